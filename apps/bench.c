@@ -0,0 +1,424 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * bench - Microbenchmarks
+ *
+ * Times the basic operations the rest of the system is built on.
+ * Each result is one line,
+ *
+ *   bench <name> <iterations> <nanoseconds per iteration>
+ *
+ * followed by "bench done" at the end, so that the QEMU harness
+ * (util/qemu-harness.py --bench) can collect them from a serial port;
+ * startup runs `bench -w -o /dev/ttyS1` when the harness asks for it.
+ * Per-syscall latency histograms are in /proc/syscalls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/shm.h>
+
+#include <math.h>
+
+#include <toaru/pex.h>
+#include <toaru/yutani.h>
+#include <toaru/graphics.h>
+
+#define READ_FILE "/tmp/bench.dat"
+#define READ_FILE_SIZE (1024 * 1024)
+
+static FILE * out_file = NULL;
+
+/* Offscreen canvas size for the graphics benchmarks */
+static int gfx_width = 640;
+static int gfx_height = 480;
+
+static uint64_t now_us(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void report(char * name, int iterations, uint64_t start, uint64_t end) {
+	unsigned long ns = iterations ? (unsigned long)((end - start) * 1000 / iterations) : 0;
+	printf("bench %s %d %lu\n", name, iterations, ns);
+	fflush(stdout);
+	if (out_file) {
+		fprintf(out_file, "bench %s %d %lu\n", name, iterations, ns);
+		fflush(out_file);
+	}
+}
+
+static void skipped(char * name, char * why) {
+	fprintf(stderr, "bench: %s: %s\n", name, why);
+}
+
+static void bench_null(void) {
+	int n = 100000;
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		getpid();
+	}
+	report("null_syscall", n, start, now_us());
+}
+
+static void bench_fork(void) {
+	int n = 200;
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		pid_t pid = fork();
+		if (!pid) _exit(0);
+		waitpid(pid, NULL, 0);
+	}
+	report("fork_exit", n, start, now_us());
+}
+
+static void bench_exec(void) {
+	int n = 50;
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		pid_t pid = fork();
+		if (!pid) {
+			execl("/bin/true", "true", (char *)NULL);
+			_exit(1);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	report("fork_exec", n, start, now_us());
+}
+
+static void bench_pipe(void) {
+	int n = 5000;
+	int to_child[2], to_parent[2];
+	if (pipe(to_child) || pipe(to_parent)) {
+		skipped("pipe_pingpong", "can't make pipes");
+		return;
+	}
+
+	pid_t pid = fork();
+	if (!pid) {
+		char c;
+		close(to_child[1]);
+		close(to_parent[0]);
+		while (read(to_child[0], &c, 1) == 1) {
+			write(to_parent[1], &c, 1);
+		}
+		_exit(0);
+	}
+	close(to_child[0]);
+	close(to_parent[1]);
+
+	char c = 'x';
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		write(to_child[1], &c, 1);
+		read(to_parent[0], &c, 1);
+	}
+	uint64_t end = now_us();
+
+	close(to_child[1]);
+	close(to_parent[0]);
+	waitpid(pid, NULL, 0);
+	report("pipe_pingpong", n, start, end);
+}
+
+static void bench_pex(void) {
+	int n = 2000;
+	char name[64];
+	sprintf(name, "bench-%d", getpid());
+
+	pid_t pid = fork();
+	if (!pid) {
+		FILE * server = pex_bind(name);
+		if (!server) _exit(1);
+		pex_packet_t * p = calloc(PACKET_SIZE, 1);
+		while (1) {
+			pex_listen(server, p);
+			if (p->size == 0) continue;
+			pex_send(server, p->source, p->size, (char *)p->data);
+		}
+	}
+
+	/* Wait for the server to show up */
+	FILE * client = NULL;
+	for (int tries = 0; !client && tries < 100; ++tries) {
+		client = pex_connect(name);
+		if (!client) usleep(10000);
+	}
+	if (!client) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		skipped("pex_roundtrip", "server didn't start");
+		return;
+	}
+
+	char buf[MAX_PACKET_SIZE];
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		pex_reply(client, 4, "ping");
+		pex_recv(client, buf);
+	}
+	uint64_t end = now_us();
+
+	fclose(client);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	report("pex_roundtrip", n, start, end);
+}
+
+static void bench_shm(void) {
+	int n = 2000;
+	char key[64];
+	sprintf(key, "bench.%d", getpid());
+
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		size_t size = 4096;
+		char * p = shm_obtain(key, &size);
+		p[0] = 1;
+		shm_release(key);
+	}
+	report("shm_obtain", n, start, now_us());
+}
+
+static void bench_read(void) {
+	int fd = open(READ_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		skipped("file_read", "can't create " READ_FILE);
+		return;
+	}
+
+	static char buf[65536];
+	memset(buf, 'b', sizeof(buf));
+	for (int i = 0; i < READ_FILE_SIZE / (int)sizeof(buf); ++i) {
+		write(fd, buf, sizeof(buf));
+	}
+
+	static const int sizes[] = { 512, 4096, 65536 };
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+		int size = sizes[s];
+		int n = 0;
+		uint64_t start = now_us();
+		/* Eight passes over the file, mostly from the page cache */
+		for (int pass = 0; pass < 8; ++pass) {
+			lseek(fd, 0, SEEK_SET);
+			while (read(fd, buf, size) == size) n++;
+		}
+		uint64_t end = now_us();
+
+		char name[32];
+		sprintf(name, "file_read_%d", size);
+		report(name, n, start, end);
+	}
+
+	close(fd);
+	unlink(READ_FILE);
+}
+
+static void bench_flip(void) {
+	int n = 100;
+	yutani_t * y = yutani_init();
+	if (!y) {
+		skipped("yutani_flip", "no compositor");
+		return;
+	}
+
+	yutani_window_t * win = yutani_window_create(y, 64, 64);
+	memset(win->buffer, 0, 64 * 64 * 4);
+
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		yutani_flip_regions(y, win, NULL, 0);
+		free(yutani_wait_for(y, YUTANI_MSG_FRAME_DONE));
+	}
+	uint64_t end = now_us();
+
+	yutani_close(y, win);
+	report("yutani_flip", n, start, end);
+}
+
+/*
+ * Graphics: the lib/graphics.c paths the compositor and clients lean
+ * on, into an offscreen canvas so no compositor is needed, and the
+ * julia and plasma demos' per-pixel kernels as fixed CPU workloads.
+ */
+static void gfx_time(char * name, int n, gfx_context_t * ctx, void (*op)(gfx_context_t *, sprite_t *), sprite_t * sprite) {
+	op(ctx, sprite); /* Warm up */
+	uint64_t start = now_us();
+	for (int i = 0; i < n; ++i) {
+		op(ctx, sprite);
+	}
+	report(name, n, start, now_us());
+}
+
+static void op_fill(gfx_context_t * ctx, sprite_t * s) { draw_fill(ctx, rgb(30,60,90)); }
+static void op_blit(gfx_context_t * ctx, sprite_t * s) { draw_sprite(ctx, s, 0, 0); }
+static void op_alpha(gfx_context_t * ctx, sprite_t * s) { draw_sprite_alpha(ctx, s, 0, 0, 0.5); }
+static void op_scale(gfx_context_t * ctx, sprite_t * s) { draw_sprite_scaled(ctx, s, 0, 0, ctx->width, ctx->height); }
+static void op_rotate(gfx_context_t * ctx, sprite_t * s) { draw_sprite_rotate(ctx, s, ctx->width / 2, ctx->height / 2, 0.3, 1.0); }
+static void op_blur(gfx_context_t * ctx, sprite_t * s) { blur_context_box(ctx, 4); }
+
+static void op_julia(gfx_context_t * ctx, sprite_t * s) {
+	for (int y = 0; y < ctx->height; ++y) {
+		for (int x = 0; x < ctx->width; ++x) {
+			double zx = x * 4.0 / ctx->width - 2.0;
+			double zy = 1.0 - y * 2.0 / ctx->height;
+			int k = 0;
+			for (; k < 100; ++k) {
+				double t = zx * zx - zy * zy - 0.74;
+				zy = 2 * zx * zy + 0.1;
+				zx = t;
+				if (zx * zx + zy * zy > 4) break;
+			}
+			GFX(ctx, x, y) = rgb(k * 2, k, 0);
+		}
+	}
+}
+
+static void op_plasma(gfx_context_t * ctx, sprite_t * s) {
+	for (int y = 0; y < ctx->height; ++y) {
+		for (int x = 0; x < ctx->width; ++x) {
+			double v = sin(sqrt((x - 128.0) * (x - 128.0) + (y - 128.0) * (y - 128.0)) / 8.0)
+				+ sin(sqrt((x - 64.0) * (x - 64.0) + (y - 64.0) * (y - 64.0)) / 8.0);
+			GFX(ctx, x, y) = rgb((int)(v * 32 + 128), 0, 128);
+		}
+	}
+}
+
+static void bench_gfx(void) {
+	sprite_t * canvas = create_sprite(gfx_width, gfx_height, ALPHA_OPAQUE);
+	gfx_context_t * ctx = init_graphics_sprite(canvas);
+
+	/* A translucent window-sized sprite, and an opaque copy */
+	sprite_t * translucent = create_sprite(gfx_width, gfx_height, ALPHA_EMBEDDED);
+	sprite_t * opaque = create_sprite(gfx_width, gfx_height, ALPHA_OPAQUE);
+	sprite_t * small = create_sprite(gfx_width / 2, gfx_height / 2, ALPHA_EMBEDDED);
+	for (int y = 0; y < gfx_height; ++y) {
+		for (int x = 0; x < gfx_width; ++x) {
+			uint32_t c = premultiply(rgba(x & 0xFF, y & 0xFF, (x ^ y) & 0xFF, (x + y) & 0xFF));
+			translucent->bitmap[y * gfx_width + x] = c;
+			opaque->bitmap[y * gfx_width + x] = c | 0xFF000000;
+			if (x < small->width && y < small->height) small->bitmap[y * small->width + x] = c;
+		}
+	}
+
+	gfx_time("gfx_fill",   200, ctx, op_fill,   NULL);
+	gfx_time("gfx_blit",   200, ctx, op_blit,   opaque);
+	gfx_time("gfx_blend",  100, ctx, op_blit,   translucent);
+	gfx_time("gfx_alpha",  100, ctx, op_alpha,  translucent);
+	gfx_time("gfx_scale",  50,  ctx, op_scale,  small);
+	gfx_time("gfx_rotate", 20,  ctx, op_rotate, translucent);
+	gfx_time("gfx_blur",   10,  ctx, op_blur,   NULL);
+	gfx_time("gfx_julia",  3,   ctx, op_julia,  NULL);
+	gfx_time("gfx_plasma", 3,   ctx, op_plasma, NULL);
+
+	sprite_free(small);
+	sprite_free(opaque);
+	sprite_free(translucent);
+	free(ctx);
+	sprite_free(canvas);
+}
+
+struct benchmark {
+	char * name;
+	void (*func)(void);
+} benchmarks[] = {
+	{"null",  bench_null},
+	{"fork",  bench_fork},
+	{"exec",  bench_exec},
+	{"pipe",  bench_pipe},
+	{"pex",   bench_pex},
+	{"shm",   bench_shm},
+	{"read",  bench_read},
+	{"flip",  bench_flip},
+	{"gfx",   bench_gfx},
+	{NULL, NULL},
+};
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"bench - run microbenchmarks\n"
+			"\n"
+			"usage: %s [-w] [-o file] [-s WxH] [benchmark...]\n"
+			"\n"
+			" -o     \033[3malso write results to a file (eg. /dev/ttyS1)\033[0m\n"
+			" -s     \033[3mcanvas size for the graphics benchmarks (default 640x480)\033[0m\n"
+			" -w     \033[3mwait in the background for the compositor to start\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			"benchmarks: null fork exec pipe pex shm read flip gfx (default: all)\n"
+			"\n", argv[0]);
+}
+
+/*
+ * Give the compositor a while to come up; flip is skipped if it doesn't.
+ */
+static void wait_for_compositor(void) {
+	for (int tries = 0; tries < 60; ++tries) {
+		if (!access("/dev/pex/compositor", F_OK)) {
+			/* Let it finish starting up */
+			sleep(2);
+			return;
+		}
+		usleep(500000);
+	}
+}
+
+int main(int argc, char * argv[]) {
+	int background = 0;
+	int c;
+	while ((c = getopt(argc, argv, "wo:s:?")) != -1) {
+		switch (c) {
+			case 'w':
+				background = 1;
+				break;
+			case 'o':
+				out_file = fopen(optarg, "w");
+				if (!out_file) {
+					fprintf(stderr, "%s: %s: can't open\n", argv[0], optarg);
+					return 1;
+				}
+				break;
+			case 's':
+				if (sscanf(optarg, "%dx%d", &gfx_width, &gfx_height) != 2 || gfx_width < 2 || gfx_height < 2) {
+					fprintf(stderr, "%s: %s: bad size\n", argv[0], optarg);
+					return 1;
+				}
+				break;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	if (background) {
+		if (fork()) return 0;
+		wait_for_compositor();
+	}
+
+	for (struct benchmark * b = benchmarks; b->name; ++b) {
+		if (optind < argc) {
+			int wanted = 0;
+			for (int i = optind; i < argc; ++i) {
+				if (!strcmp(argv[i], b->name)) wanted = 1;
+			}
+			if (!wanted) continue;
+		}
+		b->func();
+	}
+
+	printf("bench done\n");
+	if (out_file) {
+		fprintf(out_file, "bench done\n");
+		fclose(out_file);
+	}
+
+	return 0;
+}
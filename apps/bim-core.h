@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifdef __DATE__
 # define BIM_BUILD_DATE " built " __DATE__ " at " __TIME__
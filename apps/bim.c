@@ -945,15 +945,29 @@ void recalculate_syntax(line_t * line, int line_no) {
 			return;
 		}
 
-		/* Start from the line's stored in initial state */
-		struct SyntaxState * s = (void*)krk_newInstance(env->syntax->krkClass);
-		s->state.env = env;
-		s->state.line = line;
-		s->state.line_no = line_no;
-		s->state.state = line->istate;
-		s->state.i = 0;
+		/*
+		 * Start from the line's stored in initial state. Highlighters
+		 * written in C are called directly; Kuroko ones get an instance
+		 * of their state class.
+		 */
+		struct syntax_state native;
+		struct syntax_state * state = &native;
+		struct SyntaxState * s = NULL;
+		if (!env->syntax->calculate) {
+			s = (void*)krk_newInstance(env->syntax->krkClass);
+			state = &s->state;
+		}
+		state->env = env;
+		state->line = line;
+		state->line_no = line_no;
+		state->state = line->istate;
+		state->i = 0;
 
 		while (1) {
+			if (env->syntax->calculate) {
+				state->state = env->syntax->calculate(state);
+				goto _result;
+			}
 			ptrdiff_t before = vm.stackTop - vm.stack;
 			krk_push(OBJECT_VAL(s));
 			KrkValue result = krk_callSimple(OBJECT_VAL(env->syntax->krkFunc), 1, 0);
@@ -974,18 +988,19 @@ void recalculate_syntax(line_t * line, int line_no) {
 				env->syntax = NULL;
 				return;
 			}
-			s->state.state = IS_NONE(result) ? -1 : AS_INTEGER(result);
+			state->state = IS_NONE(result) ? -1 : AS_INTEGER(result);
 
-			if (s->state.state != 0) {
+_result:
+			if (state->state != 0) {
 				if (line_no == -1) return;
 				rehighlight_search(line);
 				if (!is_original) {
 					redraw_line(line_no);
 				}
-				if (line_no + 1 < env->line_count && env->lines[line_no+1]->istate != s->state.state) {
+				if (line_no + 1 < env->line_count && env->lines[line_no+1]->istate != state->state) {
 					line_no++;
 					line = env->lines[line_no];
-					line->istate = s->state.state;
+					line->istate = state->state;
 					if (env->loading) return;
 					is_original = 0;
 					goto _next;
@@ -1310,6 +1325,101 @@ line_t ** add_line(line_t ** lines, int offset) {
 	return lines;
 }
 
+/**
+ * Add `count` blank lines at `offset` in one go.
+ *
+ * The same as calling `add_line` that many times at the same offset,
+ * history included, but the array is grown and shifted only once, so
+ * pasting or filtering a large block doesn't move the rest of the
+ * buffer once per line.
+ */
+line_t ** add_lines(line_t ** lines, int offset, int count) {
+
+	if (offset > env->line_count || count < 1) return lines;
+	if (count == 1) return add_line(lines, offset);
+
+	if (!env->loading && global_config.history_enabled) {
+		for (int i = 0; i < count; ++i) {
+			history_t * e = malloc(sizeof(history_t));
+			e->type = HISTORY_ADD_LINE;
+			e->contents.add_merge_split_lines.lineno = offset;
+			HIST_APPEND(e);
+		}
+	}
+
+	if (env->line_count + count > env->line_avail) {
+		while (env->line_count + count > env->line_avail) {
+			env->line_avail *= 2;
+		}
+		lines = realloc(lines, sizeof(line_t *) * env->line_avail);
+	}
+
+	if (offset < env->line_count) {
+		memmove(&lines[offset+count], &lines[offset], sizeof(line_t *) * (env->line_count - offset));
+	}
+
+	for (int i = 0; i < count; ++i) {
+		lines[offset+i] = calloc(sizeof(line_t) + sizeof(char_t) * 32, 1);
+		lines[offset+i]->available = 32;
+		if (!env->loading) {
+			lines[offset+i]->rev_status = 2; /* Modified */
+		}
+	}
+
+	env->line_count += count;
+	env->lines = lines;
+
+	if (offset > 0 && !env->loading) {
+		recalculate_syntax(lines[offset-1],offset-1);
+	}
+	return lines;
+}
+
+/**
+ * Remove `count` lines starting at `offset` in one go.
+ *
+ * As with `remove_line`, the buffer always keeps at least one line;
+ * removing everything leaves a single empty line behind.
+ */
+line_t ** remove_lines(line_t ** lines, int offset, int count) {
+
+	if (offset + count > env->line_count) count = env->line_count - offset;
+	if (count < 1) return lines;
+
+	/* The last line standing is cleared by remove_line */
+	int clear_last = (count == env->line_count);
+	if (clear_last) count--;
+
+	if (!env->loading && global_config.history_enabled) {
+		for (int i = 0; i < count; ++i) {
+			history_t * e = malloc(sizeof(history_t));
+			e->type = HISTORY_REMOVE_LINE;
+			e->contents.remove_replace_line.lineno = offset;
+			e->contents.remove_replace_line.old_contents = malloc(sizeof(line_t) + sizeof(char_t) * lines[offset+i]->available);
+			memcpy(e->contents.remove_replace_line.old_contents, lines[offset+i], sizeof(line_t) + sizeof(char_t) * lines[offset+i]->available);
+			HIST_APPEND(e);
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		free(lines[offset+i]);
+	}
+
+	if (offset + count < env->line_count) {
+		memmove(&lines[offset], &lines[offset+count], sizeof(line_t *) * (env->line_count - offset - count));
+	}
+	for (int i = env->line_count - count; i < env->line_count; ++i) {
+		lines[i] = NULL;
+	}
+
+	env->line_count -= count;
+
+	if (clear_last) {
+		return remove_line(lines, offset);
+	}
+	return lines;
+}
+
 /**
  * (Primitive) Replace a line with data from another line.
  *
@@ -3683,6 +3793,44 @@ void run_onload(buffer_t * env) {
 	/* TODO */
 }
 
+/**
+ * Lines highlighted per idle poll by the background pass.
+ * Small enough that a keypress is never held up for long.
+ */
+#define SYNTAX_CHUNK 250
+
+static void queue_syntax_task(buffer_t * env, struct syntax_definition * syntax, int line_no);
+
+/**
+ * Redraw the lines in [from,to) that are on screen.
+ */
+static void redraw_visible_range(int from, int to) {
+	int last = env->offset + global_config.term_height - global_config.bottom_size - global_config.tabs_visible;
+	if (from < env->offset) from = env->offset;
+	if (to > last) to = last;
+	if (to > env->line_count) to = env->line_count;
+	for (int i = from; i < to; ++i) {
+		redraw_line(i);
+	}
+}
+
+/**
+ * Highlight a run of lines in order from `start`, passing each
+ * line's final state on to the next without chasing changes further.
+ */
+static void recalculate_syntax_range(int start, int end) {
+	int tmp = env->loading;
+	env->loading = 1;
+	for (int i = start; i < end && i < env->line_count; ++i) {
+		recalculate_syntax(env->lines[i], i);
+	}
+	env->loading = tmp;
+}
+
+/**
+ * Background pass over a large buffer: one chunk of lines per
+ * call, requeueing itself until it reaches the end.
+ */
 static void render_syntax_async(background_task_t * task) {
 	buffer_t * old_env = env;
 	env = task->env;
@@ -3690,13 +3838,13 @@ static void render_syntax_async(background_task_t * task) {
 	env->syntax = task->_private_p;
 	int line_no = task->_private_i;
 
-	if (env->line_count && line_no < env->line_count) {
-		int tmp = env->loading;
-		env->loading = 1;
-		recalculate_syntax(env->lines[line_no], line_no);
-		env->loading = tmp;
+	if (line_no < env->line_count) {
+		recalculate_syntax_range(line_no, line_no + SYNTAX_CHUNK);
 		if (env == old_env) {
-			redraw_line(line_no);
+			redraw_visible_range(line_no, line_no + SYNTAX_CHUNK);
+		}
+		if (line_no + SYNTAX_CHUNK < env->line_count) {
+			queue_syntax_task(env, task->_private_p, line_no + SYNTAX_CHUNK);
 		}
 	}
 
@@ -3704,6 +3852,22 @@ static void render_syntax_async(background_task_t * task) {
 	env = old_env;
 }
 
+static void queue_syntax_task(buffer_t * env, struct syntax_definition * syntax, int line_no) {
+	background_task_t * task = malloc(sizeof(background_task_t));
+	task->env  = env;
+	task->_private_i = line_no;
+	task->_private_p = syntax;
+	task->func = render_syntax_async;
+	task->next = NULL;
+	if (global_config.tail_task) {
+		global_config.tail_task->next = task;
+	}
+	global_config.tail_task = task;
+	if (!global_config.background_task) {
+		global_config.background_task = task;
+	}
+}
+
 static void schedule_complete_recalc(void) {
 	if (env->line_count < 1000) {
 		for (int i = 0; i < env->line_count; ++i) {
@@ -3712,23 +3876,24 @@ static void schedule_complete_recalc(void) {
 		return;
 	}
 
-	/* TODO see if there's already a redraw scheduled */
-	for (int i = 0; i < env->line_count; ++i) {
-		background_task_t * task = malloc(sizeof(background_task_t));
-		task->env  = env;
-		task->_private_i = i;
-		task->_private_p = env->syntax;
-		task->func = render_syntax_async;
-		task->next = NULL;
-		if (global_config.tail_task) {
-			global_config.tail_task->next = task;
-		}
-		global_config.tail_task = task;
-		if (!global_config.background_task) {
-			global_config.background_task = task;
+	/*
+	 * Get whatever is on screen highlighted now, from the states those
+	 * lines already have; the pass from the top fixes them up if that
+	 * was wrong by the time it gets there.
+	 */
+	int rows = global_config.term_height - global_config.bottom_size - global_config.tabs_visible;
+	recalculate_syntax_range(env->offset, env->offset + rows);
+
+	/* If a pass is already running for this buffer, start it over */
+	for (background_task_t * t = global_config.background_task; t; t = t->next) {
+		if (t->env == env && t->func == render_syntax_async) {
+			t->_private_i = 0;
+			t->_private_p = env->syntax;
+			return;
 		}
 	}
-	redraw_statusbar();
+
+	queue_syntax_task(env, env->syntax, 0);
 }
 
 /**
@@ -3810,18 +3975,41 @@ void open_file(char * file) {
 		return;
 	}
 
-	uint8_t buf[BLOCK_SIZE];
-
 	state = 0;
 
-	while (!feof(f) && !ferror(f)) {
-		size_t r = fread(buf, 1, BLOCK_SIZE, f);
-		add_buffer(buf, r);
-	}
+	/*
+	 * Regular files are mapped and decoded straight from the mapping,
+	 * with the line array sized for the whole file before we start,
+	 * rather than copied through stdio a block at a time.
+	 */
+	struct stat fstatbuf;
+	uint8_t * map = MAP_FAILED;
+	if (f != stdin && !fstat(fileno(f), &fstatbuf) && S_ISREG(fstatbuf.st_mode) && fstatbuf.st_size > BLOCK_SIZE) {
+		map = mmap(NULL, fstatbuf.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	}
+
+	if (map != MAP_FAILED) {
+		uint8_t * end = map + fstatbuf.st_size;
+		int newlines = 0;
+		for (uint8_t * p = map; (p = memchr(p, '\n', end - p)); ++p) newlines++;
+		if (newlines + 1 > env->line_avail) {
+			env->line_avail = newlines + 1;
+			env->lines = realloc(env->lines, sizeof(line_t *) * env->line_avail);
+		}
+		add_buffer(map, fstatbuf.st_size);
+		munmap(map, fstatbuf.st_size);
+	} else {
+		uint8_t buf[BLOCK_SIZE];
 
-	if (ferror(f)) {
-		env->loading = 0;
-		return;
+		while (!feof(f) && !ferror(f)) {
+			size_t r = fread(buf, 1, BLOCK_SIZE, f);
+			add_buffer(buf, r);
+		}
+
+		if (ferror(f)) {
+			env->loading = 0;
+			return;
+		}
 	}
 
 	if (env->line_no && env->lines[env->line_no-1] && env->lines[env->line_no-1]->actual == 0) {
@@ -4985,13 +5173,11 @@ int _prefix_command_run_script(char * cmd) {
 		/* Return to the original buffer and replace the selected lines with the output */
 		buffer_t * new = env;
 		env = old;
-		for (int i = range_top; i <= range_bot; ++i) {
-			/* Remove the existing lines */
-			env->lines = remove_line(env->lines, range_top-1);
-		}
+		/* Remove the existing lines */
+		env->lines = remove_lines(env->lines, range_top-1, range_bot - range_top + 1);
+		/* Add the new lines */
+		env->lines = add_lines(env->lines, range_top-1, new->line_count);
 		for (int i = 0; i < new->line_count; ++i) {
-			/* Add the new lines */
-			env->lines = add_line(env->lines, range_top + i - 1);
 			replace_line(env->lines, range_top + i - 1, new->lines[i]);
 			recalculate_tabs(env->lines[range_top+i-1]);
 		}
@@ -8218,15 +8404,11 @@ BIM_ACTION(delete_and_yank_lines, 0,
 	yank_lines();
 	if (env->start_line <= env->line_no) {
 		int lines_to_delete = env->line_no - env->start_line + 1;
-		for (int i = 0; i < lines_to_delete; ++i) {
-			env->lines = remove_line(env->lines, env->start_line-1);
-		}
+		env->lines = remove_lines(env->lines, env->start_line-1, lines_to_delete);
 		env->line_no = env->start_line;
 	} else {
 		int lines_to_delete = env->start_line - env->line_no + 1;
-		for (int i = 0; i < lines_to_delete; ++i) {
-			env->lines = remove_line(env->lines, env->line_no-1);
-		}
+		env->lines = remove_lines(env->lines, env->line_no-1, lines_to_delete);
 	}
 	if (env->line_no > env->line_count) {
 		env->line_no = env->line_count;
@@ -8406,9 +8588,8 @@ BIM_ACTION(delete_and_yank_chars, ACTION_IS_RW,
 		/* Copy lines */
 		yank_text(env->start_line, env->start_col, end_line, end_col);
 		/* Delete lines */
-		for (int i = env->start_line+1; i < end_line; ++i) {
-			env->lines = remove_line(env->lines, env->start_line);
-		} /* end_line is no longer valid; should be start_line+1*/
+		env->lines = remove_lines(env->lines, env->start_line, end_line - env->start_line - 1);
+		/* end_line is no longer valid; should be start_line+1*/
 		/* Delete from env->start_col forward */
 		int tmp = env->lines[env->start_line-1]->actual;
 		for (int i = env->start_col; i <= tmp; ++i) {
@@ -8980,9 +9161,7 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 			}
 			if (global_config.yank_count > 1) {
 				/* Insert full lines */
-				for (unsigned int i = 1; i < global_config.yank_count - 1; ++i) {
-					env->lines = add_line(env->lines, env->line_no);
-				}
+				env->lines = add_lines(env->lines, env->line_no, global_config.yank_count - 2);
 				for (unsigned int i = 1; i < global_config.yank_count - 1; ++i) {
 					replace_line(env->lines, env->line_no + i - 1, global_config.yanks[i]);
 				}
@@ -8993,9 +9172,7 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 			}
 		} else {
 			/* Insert full lines */
-			for (unsigned int i = 0; i < global_config.yank_count; ++i) {
-				env->lines = add_line(env->lines, env->line_no - (direction == -1 ? 1 : 0));
-			}
+			env->lines = add_lines(env->lines, env->line_no - (direction == -1 ? 1 : 0), global_config.yank_count);
 			for (unsigned int i = 0; i < global_config.yank_count; ++i) {
 				replace_line(env->lines, env->line_no - (direction == -1 ? 1 : 0) + i, global_config.yanks[i]);
 			}
@@ -22,6 +22,21 @@
 static char * _argv_0;
 static char * _file;
 
+/*
+ * Pipes on either side are spliced, and regular files are otherwise
+ * copied, by the kernel; if that doesn't work out (or stops partway),
+ * doit() carries on from wherever it left off.
+ */
+#define COPY_SIZE 0x100000
+
+static void copy_in_kernel(int fd, int regular) {
+	ssize_t r;
+	while ((r = splice(fd, NULL, STDOUT_FILENO, NULL, COPY_SIZE, 0)) > 0);
+	if (r < 0 && errno == EINVAL && regular) {
+		while (copy_file_range(fd, NULL, STDOUT_FILENO, NULL, COPY_SIZE, 0) > 0);
+	}
+}
+
 void doit(int fd) {
 	while (1) {
 		char buf[CHUNK_SIZE];
@@ -43,12 +58,14 @@ int main(int argc, char ** argv) {
 
 	if (argc == 1) {
 		_file = "stdin";
+		copy_in_kernel(0, 0);
 		doit(0);
 	}
 
 	for (int i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i],"-")) {
 			_file = "stdin";
+			copy_in_kernel(0, 0);
 			doit(0);
 			continue;
 		}
@@ -70,6 +87,8 @@ int main(int argc, char ** argv) {
 			continue;
 		}
 
+		copy_in_kernel(fd, S_ISREG(_stat.st_mode));
+
 		doit(fd);
 
 		close(fd);
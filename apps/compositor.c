@@ -27,14 +27,18 @@
 #include <getopt.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/fswait.h>
+#include <sys/signalfd.h>
 #include <sys/sysfunc.h>
 #include <sys/shm.h>
 #include <pthread.h>
 #include <dlfcn.h>
 /* auto-dep: export-dynamic */
 
+#include <kernel/video.h>
+
 #include <toaru/graphics.h>
 #include <toaru/mouse.h>
 #include <toaru/kbd.h>
@@ -198,6 +202,19 @@ uint32_t yutani_time_since(yutani_globals_t * yg, uint32_t start_time) {
 	return diff;
 }
 
+/**
+ * sin and cos of a window's rotation. Damage and input both need them
+ * for every rectangle and event, and the angle rarely changes.
+ */
+static void window_rotation(yutani_server_window_t * window, double * s, double * c) {
+	if (window->rotation != window->rotation_cached) {
+		sincos(M_PI * (window->rotation / 180.0), &window->rotation_sin, &window->rotation_cos);
+		window->rotation_cached = window->rotation;
+	}
+	*s = window->rotation_sin;
+	*c = window->rotation_cos;
+}
+
 /**
  * Translate and transform coordinate from screen-relative to window-relative.
  */
@@ -215,8 +232,9 @@ void yutani_device_to_window(yutani_server_window_t * window, int32_t x, int32_t
 	double t_x = *out_x - (window->width / 2);
 	double t_y = *out_y - (window->height / 2);
 
-	double s = sin(-M_PI * (window->rotation/ 180.0));
-	double c = cos(-M_PI * (window->rotation/ 180.0));
+	double s, c;
+	window_rotation(window, &s, &c);
+	s = -s;
 
 	double n_x = t_x * c - t_y * s;
 	double n_y = t_x * s + t_y * c;
@@ -239,8 +257,8 @@ void yutani_window_to_device(yutani_server_window_t * window, int32_t x, int32_t
 	double t_x = x - (window->width / 2);
 	double t_y = y - (window->height / 2);
 
-	double s = sin(M_PI * (window->rotation/ 180.0));
-	double c = cos(M_PI * (window->rotation/ 180.0));
+	double s, c;
+	window_rotation(window, &s, &c);
 
 	double n_x = t_x * c - t_y * s;
 	double n_y = t_x * s + t_y * c;
@@ -408,7 +426,12 @@ static yutani_server_window_t * server_window_create(yutani_globals_t * yg, int
 	win->height = height;
 	win->bufid = next_buf_id();
 	win->rotation = 0;
+	win->rotation_cached = 0;
+	win->rotation_sin = 0.0;
+	win->rotation_cos = 1.0;
 	win->newbufid = 0;
+	win->swap_count = 0;
+	win->swap_front = 0;
 	win->client_flags   = 0;
 	win->client_offsets[0] = 0;
 	win->client_offsets[1] = 0;
@@ -457,6 +480,128 @@ static void server_window_update_shape(yutani_globals_t * yg, yutani_server_wind
 	window->alpha_threshold = set;
 }
 
+/**
+ * Track whether every pixel of a window has full alpha.
+ *
+ * Called when the client flips a region. For a window already known to
+ * be opaque only that region needs checking; otherwise the whole buffer
+ * is checked, which stops at the first translucent pixel - for shadowed
+ * and translucent windows, almost immediately.
+ */
+static void window_check_opaque(yutani_server_window_t * w, int32_t x, int32_t y, int32_t width, int32_t height) {
+	if (!w->opaque) {
+		x = 0;
+		y = 0;
+		width = w->width;
+		height = w->height;
+	}
+
+	int32_t right  = min(x + width,  w->width);
+	int32_t bottom = min(y + height, w->height);
+	uint32_t * pixels = (uint32_t *)w->buffer;
+
+	for (int32_t _y = max(y, 0); _y < bottom; ++_y) {
+		for (int32_t _x = max(x, 0); _x < right; ++_x) {
+			if (_ALP(pixels[_y * w->width + _x]) != 255) {
+				w->opaque = 0;
+				return;
+			}
+		}
+	}
+	w->opaque = 1;
+}
+
+/**
+ * Drop a window's swapchain, going back to its own buffer.
+ *
+ * If `keep` is set, whatever was being shown is copied over so
+ * the window doesn't jump back to an old frame. The caller holds
+ * the redraw lock.
+ */
+static void server_window_swapchain_drop(yutani_globals_t * yg, yutani_server_window_t * win, int keep) {
+	if (!win->swap_count) return;
+
+	if (keep && win->swap_front) {
+		memcpy(win->swap_buffers[0], win->buffer, win->width * win->height * 4);
+	}
+
+	win->buffer = win->swap_buffers[0];
+
+	for (uint32_t i = 1; i < win->swap_count; ++i) {
+		char key[1024];
+		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, win->swap_bufids[i]);
+		shm_release(key);
+	}
+
+	win->swap_count = 0;
+	win->swap_front = 0;
+}
+
+/**
+ * Give a window a swapchain of `count` buffers, or none if `count` is
+ * less than two. Slot 0 is the window's existing buffer, which is what
+ * is being shown to start with. Not available mid-resize, as the
+ * swapchain would be the wrong size. Returns the number of buffers.
+ */
+static uint32_t server_window_swapchain(yutani_globals_t * yg, yutani_server_window_t * win, uint32_t count) {
+	spin_lock(&yg->redraw_lock);
+
+	server_window_swapchain_drop(yg, win, 1);
+
+	if (count < 2 || win->newbufid) {
+		spin_unlock(&yg->redraw_lock);
+		return 0;
+	}
+
+	if (count > YUTANI_SWAPCHAIN_MAX) count = YUTANI_SWAPCHAIN_MAX;
+
+	win->swap_bufids[0] = win->bufid;
+	win->swap_buffers[0] = win->buffer;
+
+	for (uint32_t i = 1; i < count; ++i) {
+		char key[1024];
+		win->swap_bufids[i] = next_buf_id();
+		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, win->swap_bufids[i]);
+
+		size_t size = (win->width * win->height * 4);
+		win->swap_buffers[i] = shm_obtain(key, &size);
+	}
+
+	win->swap_count = count;
+	win->swap_front = 0;
+
+	spin_unlock(&yg->redraw_lock);
+	return count;
+}
+
+/**
+ * Show a swapchain buffer the client has finished drawing.
+ *
+ * Compositing happens under the redraw lock, so once the pointer is
+ * swapped nothing is reading the old buffer anymore and the client
+ * can have it back right away. Returns the released buffer's ID, or
+ * 0 if the request didn't name a buffer we could switch to.
+ */
+static uint32_t server_window_swapchain_present(yutani_globals_t * yg, yutani_server_window_t * win, uint32_t bufid) {
+	uint32_t slot = 0;
+	while (slot < win->swap_count && win->swap_bufids[slot] != bufid) slot++;
+	if (slot == win->swap_count || slot == win->swap_front) return 0;
+
+	uint32_t released = win->swap_bufids[win->swap_front];
+
+	spin_lock(&yg->redraw_lock);
+	win->swap_front = slot;
+	win->buffer = win->swap_buffers[slot];
+	win->opaque = 0;
+	spin_unlock(&yg->redraw_lock);
+
+	/* The whole window is a new frame */
+	window_check_opaque(win, 0, 0, win->width, win->height);
+	mark_window(yg, win);
+
+	return released;
+}
+
 /**
  * Start resizing a window.
  *
@@ -505,8 +650,11 @@ static void server_window_resize_finish(yutani_globals_t * yg, yutani_server_win
 	win->width = width;
 	win->height = height;
 
+	server_window_swapchain_drop(yg, win, 0);
+
 	win->bufid = win->newbufid;
 	win->buffer = win->newbuffer;
+	win->opaque = 0;
 
 	win->newbuffer = NULL;
 	win->newbufid = 0;
@@ -522,6 +670,302 @@ static void server_window_resize_finish(yutani_globals_t * yg, yutani_server_win
 	mark_window(yg, win);
 }
 
+/*
+ * Damage region.
+ *
+ * A frame's damage is a short list of disjoint rectangles. A new
+ * rectangle absorbs any it overlaps or touches; if the list is full,
+ * it is folded into whichever rectangle that wastes the least area.
+ * The region is only kept for the built-in renderer, which then blits
+ * and flips just these rectangles.
+ */
+static int damage_area(yutani_damage_rect_t * r) {
+	return r->width * r->height;
+}
+
+static int damage_touches(yutani_damage_rect_t * a, yutani_damage_rect_t * b) {
+	return a->x <= b->x + (int)b->width && b->x <= a->x + (int)a->width &&
+	       a->y <= b->y + (int)b->height && b->y <= a->y + (int)a->height;
+}
+
+static void damage_union(yutani_damage_rect_t * into, yutani_damage_rect_t * r) {
+	int32_t left   = min(into->x, r->x);
+	int32_t top    = min(into->y, r->y);
+	int32_t right  = max(into->x + into->width,  r->x + r->width);
+	int32_t bottom = max(into->y + into->height, r->y + r->height);
+	into->x = left;
+	into->y = top;
+	into->width = right - left;
+	into->height = bottom - top;
+}
+
+static void damage_remove(yutani_globals_t * yg, int i) {
+	yg->damage_rects[i] = yg->damage_rects[--yg->damage_count];
+}
+
+static void damage_add(yutani_globals_t * yg, int32_t x, int32_t y, int32_t w, int32_t h) {
+	/* Clip to the screen */
+	int32_t right  = min(x + w, yg->width);
+	int32_t bottom = min(y + h, yg->height);
+	x = max(x, 0);
+	y = max(y, 0);
+	if (right <= x || bottom <= y) return;
+
+	yutani_damage_rect_t rect = { x, y, right - x, bottom - y };
+
+again:
+	/* Absorb everything it touches; having grown, it may touch more */
+	for (int i = 0; i < yg->damage_count; ) {
+		if (damage_touches(&rect, &yg->damage_rects[i])) {
+			damage_union(&rect, &yg->damage_rects[i]);
+			damage_remove(yg, i);
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+
+	if (yg->damage_count == YUTANI_DAMAGE_RECTS) {
+		int best = 0;
+		int best_cost = -1;
+		for (int i = 0; i < yg->damage_count; ++i) {
+			yutani_damage_rect_t merged = yg->damage_rects[i];
+			damage_union(&merged, &rect);
+			int cost = damage_area(&merged) - damage_area(&yg->damage_rects[i]) - damage_area(&rect);
+			if (best_cost < 0 || cost < best_cost) {
+				best = i;
+				best_cost = cost;
+			}
+		}
+		damage_union(&rect, &yg->damage_rects[best]);
+		damage_remove(yg, best);
+		goto again;
+	}
+
+	yg->damage_rects[yg->damage_count++] = rect;
+}
+
+static int damage_overlaps(yutani_damage_rect_t * a, yutani_damage_rect_t * b) {
+	return a->x < b->x + (int)b->width && b->x < a->x + (int)a->width &&
+	       a->y < b->y + (int)b->height && b->y < a->y + (int)a->height;
+}
+
+static int damage_contains(yutani_damage_rect_t * outer, yutani_damage_rect_t * inner) {
+	return outer->x <= inner->x && outer->y <= inner->y &&
+	       outer->x + outer->width  >= inner->x + inner->width &&
+	       outer->y + outer->height >= inner->y + inner->height;
+}
+
+/**
+ * Draw the part of a sprite within r that no occluder covers.
+ *
+ * Where an occluder overlaps r, the up to four strips of r around it
+ * are handled in turn against the occluders after it. What is left is
+ * drawn through a context viewing just that rectangle of the
+ * backbuffer, so no pixel outside it is touched.
+ */
+static void draw_sprite_visible(yutani_globals_t * yg, sprite_t * sprite, int32_t x, int32_t y, double opacity, yutani_damage_rect_t r, int occluder) {
+	for (; occluder < yg->occluder_count; ++occluder) {
+		yutani_damage_rect_t * o = &yg->occluders[occluder];
+		if (!damage_overlaps(&r, o)) continue;
+
+		int32_t r_right  = r.x + r.width;
+		int32_t r_bottom = r.y + r.height;
+		int32_t o_right  = o->x + o->width;
+		int32_t o_bottom = o->y + o->height;
+		int32_t top      = max(r.y, o->y);
+		int32_t bottom   = min(r_bottom, o_bottom);
+
+		if (o->y > r.y) {
+			yutani_damage_rect_t strip = { r.x, r.y, r.width, o->y - r.y };
+			draw_sprite_visible(yg, sprite, x, y, opacity, strip, occluder + 1);
+		}
+		if (o_bottom < r_bottom) {
+			yutani_damage_rect_t strip = { r.x, o_bottom, r.width, r_bottom - o_bottom };
+			draw_sprite_visible(yg, sprite, x, y, opacity, strip, occluder + 1);
+		}
+		if (o->x > r.x) {
+			yutani_damage_rect_t strip = { r.x, top, o->x - r.x, bottom - top };
+			draw_sprite_visible(yg, sprite, x, y, opacity, strip, occluder + 1);
+		}
+		if (o_right < r_right) {
+			yutani_damage_rect_t strip = { o_right, top, r_right - o_right, bottom - top };
+			draw_sprite_visible(yg, sprite, x, y, opacity, strip, occluder + 1);
+		}
+		return;
+	}
+
+	gfx_context_t * ctx = yg->backend_ctx;
+	gfx_context_t view = *ctx;
+	view.width = r.width;
+	view.height = r.height;
+	view.backbuffer = (char *)&GFX(ctx, r.x, r.y);
+	view.clips = NULL;
+
+	if (opacity < 1.0) {
+		draw_sprite_alpha(&view, sprite, x - r.x, y - r.y, opacity);
+	} else {
+		draw_sprite(&view, sprite, x - r.x, y - r.y);
+	}
+}
+
+/**
+ * Draw a sprite only where it overlaps the damage region and is not
+ * hidden behind an opaque window.
+ */
+static void draw_sprite_damaged(yutani_globals_t * yg, sprite_t * sprite, int32_t x, int32_t y, double opacity) {
+	yutani_damage_rect_t bounds = { x, y, sprite->width, sprite->height };
+	for (int i = 0; i < yg->damage_count; ++i) {
+		yutani_damage_rect_t * d = &yg->damage_rects[i];
+		if (!damage_overlaps(&bounds, d)) continue;
+
+		int32_t left = max(x, d->x);
+		int32_t top  = max(y, d->y);
+		yutani_damage_rect_t r = {
+			left, top,
+			min(x + sprite->width,  d->x + d->width)  - left,
+			min(y + sprite->height, d->y + d->height) - top,
+		};
+		draw_sprite_visible(yg, sprite, x, y, opacity, r, 0);
+	}
+}
+
+/**
+ * Copy just the damaged rectangles from the backbuffer to the screen.
+ */
+static void flip_damaged(yutani_globals_t * yg) {
+	gfx_context_t * ctx = yg->backend_ctx;
+	if (renderer_add_clip) {
+		/* The renderer clips for itself; we have no region */
+		flip(ctx);
+		return;
+	}
+	flip_regions(ctx, yg->damage_rects, yg->damage_count);
+}
+
+struct frame_callback {
+	unsigned int owner;
+	yutani_wid_t wid;
+	uint32_t serial;
+};
+
+/**
+ * Frame is on screen; tell everyone who was waiting for it.
+ */
+static void send_frame_callbacks(yutani_globals_t * yg, list_t * callbacks) {
+	while (callbacks->length) {
+		node_t * node = list_dequeue(callbacks);
+		struct frame_callback * cb = node->value;
+		yutani_msg_buildx_frame_done_alloc(response);
+		yutani_msg_buildx_frame_done(response, cb->wid, cb->serial);
+		pex_send(yg->server, cb->owner, response->size, (char *)response);
+		free(cb);
+		free(node);
+	}
+	free(callbacks);
+}
+
+/*
+ * Input latency.
+ *
+ * Key events for the focused window are tagged with an id. The client
+ * notes when one arrives and, with its next flip, sends back when it
+ * got it and when it flipped. Once the frame that flip lands in is on
+ * screen, we know how long every step took, from reading the key to
+ * showing what it did. Each step goes into a log2 histogram.
+ */
+#define LATENCY_IN_FLIGHT 64
+
+struct latency_sample {
+	uint32_t id;
+	uint64_t read;       /* Key read from the device (or its message arrived) */
+	uint64_t dispatched; /* Sent to the client */
+	uint64_t received;   /* Client got it */
+	uint64_t flipped;    /* Client flipped */
+	uint64_t marked;     /* Client's mark got back to us */
+};
+
+/* Only touched by the main thread */
+static struct latency_sample latency_in_flight[LATENCY_IN_FLIGHT];
+static uint32_t latency_next_id = 1;
+
+/* Under update_list_lock */
+static struct yutani_msg_latency_report latency_report;
+
+static uint64_t now_us(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void latency_add(int stage, uint64_t start, uint64_t end) {
+	uint32_t us = end > start ? (uint32_t)(end - start) : 0;
+	int bucket = 0;
+	while (bucket < YUTANI_LATENCY_BUCKETS - 1 && (us >> (bucket + 1))) bucket++;
+	latency_report.histogram[stage][bucket]++;
+	latency_report.last[stage] = us;
+	latency_report.sum[stage] += us;
+	if (us > latency_report.max[stage]) latency_report.max[stage] = us;
+}
+
+/**
+ * The frame these samples were waiting on is on screen.
+ */
+static void latency_record(yutani_globals_t * yg, list_t * samples) {
+	uint64_t shown = now_us();
+	spin_lock(&yg->update_list_lock);
+	while (samples->length) {
+		node_t * node = list_dequeue(samples);
+		struct latency_sample * s = node->value;
+		latency_add(YUTANI_LATENCY_INPUT,   s->read,       s->dispatched);
+		latency_add(YUTANI_LATENCY_DELIVER, s->dispatched, s->received);
+		latency_add(YUTANI_LATENCY_CLIENT,  s->received,   s->flipped);
+		latency_add(YUTANI_LATENCY_RETURN,  s->flipped,    s->marked);
+		latency_add(YUTANI_LATENCY_COMPOSE, s->marked,     shown);
+		latency_add(YUTANI_LATENCY_TOTAL,   s->read,       shown);
+		latency_report.completed++;
+		free(s);
+		free(node);
+	}
+	spin_unlock(&yg->update_list_lock);
+	free(samples);
+}
+
+/**
+ * Show the page we just drew and remember what changed on it,
+ * since the other page (our new back page) hasn't seen it yet.
+ */
+static void flip_pages(yutani_globals_t * yg) {
+	memcpy(yg->last_damage, yg->damage_rects, sizeof(yutani_damage_rect_t) * yg->damage_count);
+	yg->last_damage_count = yg->damage_count;
+	gfx_page_flip(yg->backend_ctx);
+	yg->backend_framebuffer = yg->backend_ctx->backbuffer;
+}
+
+/**
+ * Tell the display adapter what we just flipped, for
+ * adapters (VMware SVGA, VirtualBox with VBVA) that only redraw
+ * what they're told about.
+ */
+static void post_fb_update(yutani_globals_t * yg) {
+	if (yg->fb_update < 0) return;
+	struct vid_update update;
+	if (renderer_add_clip) {
+		/* No damage region to report; the whole screen was flipped */
+		update.count = 1;
+		update.rects[0] = (struct vid_rect){ 0, 0, yg->width, yg->height };
+	} else {
+		update.count = yg->damage_count;
+		for (int i = 0; i < yg->damage_count; ++i) {
+			yutani_damage_rect_t * r = &yg->damage_rects[i];
+			update.rects[i] = (struct vid_rect){ r->x, r->y, r->width, r->height };
+		}
+	}
+	if (update.count) {
+		ioctl(yg->fb_update, IO_VID_UPDATE, &update);
+	}
+}
+
 /**
  * Add a clip region from a rectangle.
  */
@@ -530,6 +974,9 @@ static void yutani_add_clip(yutani_globals_t * yg, double x, double y, double w,
 		renderer_add_clip(yg,x,y,w,h);
 	} else {
 		gfx_add_clip(yg->backend_ctx, (int)x, (int)y, (int)w, (int)h);
+		int32_t left = floor(x);
+		int32_t top  = floor(y);
+		damage_add(yg, left, top, (int32_t)ceil(x + w) - left, (int32_t)ceil(y + h) - top);
 	}
 }
 
@@ -550,11 +997,10 @@ static void mark_screen(yutani_globals_t * yg, int32_t x, int32_t y, int32_t wid
 }
 
 /**
- * Draw the cursor sprite.
+ * Pick the cursor sprite for the current state.
  */
-static void draw_cursor(yutani_globals_t * yg, int x, int y, int cursor) {
+static sprite_t * cursor_sprite(yutani_globals_t * yg, int cursor) {
 	sprite_t * sprite = &yg->mouse_sprite;
-	static sprite_t * previous = NULL;
 	if (yg->resizing_window) {
 		switch (yg->resizing_direction) {
 			case SCALE_UP:
@@ -587,6 +1033,15 @@ static void draw_cursor(yutani_globals_t * yg, int x, int y, int cursor) {
 			case YUTANI_CURSOR_TYPE_RESIZE_DOWN_UP:    sprite = &yg->mouse_sprite_resize_db; break;
 		}
 	}
+	return sprite;
+}
+
+/**
+ * Draw the cursor sprite.
+ */
+static void draw_cursor(yutani_globals_t * yg, int x, int y, int cursor) {
+	sprite_t * sprite = cursor_sprite(yg, cursor);
+	static sprite_t * previous = NULL;
 	if (sprite != previous) {
 		mark_screen(yg, x / MOUSE_SCALE - MOUSE_OFFSET_X, y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
 		previous = sprite;
@@ -642,6 +1097,40 @@ static yutani_server_window_t * top_at(yutani_globals_t * yg, uint16_t x, uint16
 	return NULL;
 }
 
+/**
+ * Keep the display adapter's own cursor in line with the mouse.
+ *
+ * With a hardware cursor, the cursor is never drawn into the
+ * framebuffer, so moving it damages nothing.
+ */
+static void update_hw_cursor(yutani_globals_t * yg, int x, int y) {
+	yutani_server_window_t * window = top_at(yg, x / MOUSE_SCALE, y / MOUSE_SCALE);
+	int visible = !window || window->show_mouse;
+	sprite_t * sprite = cursor_sprite(yg, window ? window->show_mouse : 1);
+
+	if (visible && sprite != yg->hw_cursor_sprite) {
+		struct vid_cursor * image = calloc(1, sizeof(struct vid_cursor));
+		image->width  = min(sprite->width, VID_CURSOR_MAX);
+		image->height = min(sprite->height, VID_CURSOR_MAX);
+		image->hot_x  = MOUSE_OFFSET_X;
+		image->hot_y  = MOUSE_OFFSET_Y;
+		for (uint32_t row = 0; row < image->height; ++row) {
+			memcpy(&image->pixels[row * image->width], &sprite->bitmap[row * sprite->width], image->width * sizeof(uint32_t));
+		}
+		ioctl(yg->fb_update, IO_VID_CURSOR, image);
+		free(image);
+		yg->hw_cursor_sprite = sprite;
+	}
+
+	struct vid_cursor_position position = { x / MOUSE_SCALE, y / MOUSE_SCALE, visible };
+	if (position.x != yg->hw_cursor_x || position.y != yg->hw_cursor_y || (int)position.visible != yg->hw_cursor_visible) {
+		ioctl(yg->fb_update, IO_VID_CURSOR_MOVE, &position);
+		yg->hw_cursor_x = position.x;
+		yg->hw_cursor_y = position.y;
+		yg->hw_cursor_visible = position.visible;
+	}
+}
+
 /**
  * Get the window at a coordinate and focus it.
  *
@@ -696,6 +1185,28 @@ uint32_t yutani_color_for_wid(yutani_wid_t wid) {
 	return colors[i];
 }
 
+/**
+ * Whether a window hides everything beneath its rectangle.
+ */
+static int window_is_occluder(yutani_globals_t * yg, yutani_server_window_t * w) {
+	return w->opaque && w->opacity == 255 && !w->rotation && !w->anim_mode && w != yg->resizing_window;
+}
+
+/**
+ * Whether a window is entirely covered by a single opaque window above it.
+ *
+ * Animating windows are always drawn, as finishing their animation
+ * happens during the blit.
+ */
+static int window_is_hidden(yutani_globals_t * yg, yutani_server_window_t * w) {
+	if (w->rotation || w->anim_mode || w == yg->resizing_window) return 0;
+	yutani_damage_rect_t bounds = { w->x, w->y, w->width, w->height };
+	for (int i = 0; i < yg->occluder_count; ++i) {
+		if (damage_contains(&yg->occluders[i], &bounds)) return 1;
+	}
+	return 0;
+}
+
 /**
  * Blit a window to the framebuffer.
  *
@@ -737,23 +1248,26 @@ static int yutani_blit_window(yutani_globals_t * yg, yutani_server_window_t * wi
 				case YUTANI_EFFECT_SQUEEZE_IN:
 				case YUTANI_EFFECT_FADE_IN:
 					{
-						double time_diff = ((double)frame / (float)yutani_animation_lengths[window->anim_mode]);
+						/* Sizes are worked out in integers; the blits themselves are fixed-point */
+						int length = yutani_animation_lengths[window->anim_mode];
 
 						if (window->server_flags & YUTANI_WINDOW_FLAG_DIALOG_ANIMATION) {
-							double x = time_diff;
-							int t_y = (window->height * (1.0 -x)) / 2;
+							int h = window->height * frame / length;
+							int t_y = (window->height - h) / 2;
 
-							draw_sprite_scaled(yg->backend_ctx, &_win_sprite, window->x, window->y + t_y, window->width, window->height * x);
+							draw_sprite_scaled(yg->backend_ctx, &_win_sprite, window->x, window->y + t_y, window->width, h);
 						} else {
-							double x = 0.75 + time_diff * 0.25;
-							int t_x = (window->width * (1.0 - x)) / 2;
-							int t_y = (window->height * (1.0 - x)) / 2;
+							/* Grow from 75% to full size */
+							int w = window->width * (3 * length + frame) / (4 * length);
+							int h = window->height * (3 * length + frame) / (4 * length);
+							int t_x = (window->width - w) / 2;
+							int t_y = (window->height - h) / 2;
 
-							double opacity = time_diff * (double)(window->opacity) / 255.0;
+							float opacity = (float)(frame * window->opacity) / (float)(length * 255);
 
 							if (!yutani_window_is_top(yg, window) && !yutani_window_is_bottom(yg, window) &&
 									!(window->server_flags & YUTANI_WINDOW_FLAG_ALT_ANIMATION)) {
-								draw_sprite_scaled_alpha(yg->backend_ctx, &_win_sprite, window->x + t_x, window->y + t_y, window->width * x, window->height * x, opacity);
+								draw_sprite_scaled_alpha(yg->backend_ctx, &_win_sprite, window->x + t_x, window->y + t_y, w, h, opacity);
 							} else {
 								draw_sprite_alpha(yg->backend_ctx, &_win_sprite, window->x, window->y, opacity);
 							}
@@ -774,6 +1288,8 @@ draw_window:
 			} else {
 				if (window->rotation) {
 					draw_sprite_rotate(yg->backend_ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, opacity);
+				} else if (!renderer_add_clip) {
+					draw_sprite_damaged(yg, &_win_sprite, window->x, window->y, opacity);
 				} else {
 					draw_sprite_alpha(yg->backend_ctx, &_win_sprite, window->x, window->y, opacity);
 				}
@@ -784,6 +1300,8 @@ draw_window:
 			} else {
 				if (window->rotation) {
 					draw_sprite_rotate(yg->backend_ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, 1.0);
+				} else if (!renderer_add_clip) {
+					draw_sprite_damaged(yg, &_win_sprite, window->x, window->y, 1.0);
 				} else {
 					draw_sprite(yg->backend_ctx, &_win_sprite, window->x, window->y);
 				}
@@ -800,7 +1318,8 @@ draw_finish:
  *
  * Sends rectangles describing all the non-background windows
  * to the VirtualBox Guest Additions driver for use with the
- * seamless desktop mode.
+ * seamless desktop mode. The host redoes its window shapes
+ * whenever it is sent a set, so only changed sets are sent.
  */
 static void yutani_post_vbox_rects(yutani_globals_t * yg) {
 	if (yg->vbox_rects <= 0) return;
@@ -845,8 +1364,14 @@ static void yutani_post_vbox_rects(yutani_globals_t * yg) {
 		*magic = yg->height; magic++;
 	}
 
+	/* Nothing moved, resized, opened or closed since the last set */
+	size_t size = (char *)magic - tmp;
+	if (size == yg->vbox_rects_size && !memcmp(tmp, yg->vbox_rects_last, size)) return;
+
 	/* Post rectangle data to driver */
-	write(yg->vbox_rects, tmp, sizeof(tmp));
+	if (write(yg->vbox_rects, tmp, size) < 0) return;
+	memcpy(yg->vbox_rects_last, tmp, size);
+	yg->vbox_rects_size = size;
 }
 
 /**
@@ -855,21 +1380,72 @@ static void yutani_post_vbox_rects(yutani_globals_t * yg) {
  * This is called for rendering and for screenshots.
  */
 static void yutani_blit_windows(yutani_globals_t * yg) {
-	if (yg->bottom_z) yutani_blit_window(yg, yg->bottom_z, yg->bottom_z->x, yg->bottom_z->y);
+	/* Stacking order, bottom to top */
+	size_t count = 0;
+	yutani_server_window_t ** windows = malloc(sizeof(yutani_server_window_t *) * (yg->mid_zs->length + 2));
+	if (yg->bottom_z) windows[count++] = yg->bottom_z;
 	foreach (node, yg->mid_zs) {
 		yutani_server_window_t * w = node->value;
-		if (w) yutani_blit_window(yg, w, w->x, w->y);
+		if (w) windows[count++] = w;
+	}
+	if (yg->top_z) windows[count++] = yg->top_z;
+
+	/*
+	 * Walk front to back collecting opaque windows; each window then
+	 * only needs drawing where none of those above it covers it.
+	 */
+	int * above = malloc(sizeof(int) * (count + 1));
+	yg->occluder_count = 0;
+	for (size_t i = count; i > 0; --i) {
+		yutani_server_window_t * w = windows[i-1];
+		above[i-1] = yg->occluder_count;
+		if (window_is_occluder(yg, w) && yg->occluder_count < YUTANI_MAX_OCCLUDERS) {
+			yutani_damage_rect_t * o = &yg->occluders[yg->occluder_count++];
+			o->x = w->x;
+			o->y = w->y;
+			o->width = w->width;
+			o->height = w->height;
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		yutani_server_window_t * w = windows[i];
+		yg->occluder_count = above[i];
+		if (window_is_hidden(yg, w)) continue;
+		yutani_blit_window(yg, w, w->x, w->y);
 	}
-	if (yg->top_z) yutani_blit_window(yg, yg->top_z, yg->top_z->x, yg->top_z->y);
+	yg->occluder_count = 0;
+
+	free(above);
+	free(windows);
 }
 
 /**
- * Take a screenshot
+ * Screenshots
+ *
+ * The render thread only copies the pixels; a writer thread, started
+ * with the first screenshot, turns them into a file. A few can be
+ * waiting at once, and any beyond that are dropped rather than
+ * holding up the next frame.
  */
-static void yutani_screenshot(yutani_globals_t * yg) {
-	int task = yg->screenshot_frame;
-	yg->screenshot_frame = 0;
+#define SCREENSHOT_QUEUE 4
+
+struct screenshot {
+	uint32_t * pixels;
+	int width;
+	int height;
+	int alpha;
+};
+
+static struct screenshot screenshot_queue[SCREENSHOT_QUEUE];
+static int screenshot_head = 0;
+static int screenshot_count = 0;
+static pthread_mutex_t screenshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t screenshot_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t screenshot_thread;
+static int screenshot_thread_started = 0;
 
+static void screenshot_write(struct screenshot * shot) {
 	/* raw screenshots */
 	FILE * f = fopen("/tmp/screenshot.tga", "w");
 	if (!f) {
@@ -877,6 +1453,80 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 		return;
 	}
 
+	struct {
+		uint8_t id_length;
+		uint8_t color_map_type;
+		uint8_t image_type;
+
+		uint16_t color_map_first_entry;
+		uint16_t color_map_length;
+		uint8_t color_map_entry_size;
+
+		uint16_t x_origin;
+		uint16_t y_origin;
+		uint16_t width;
+		uint16_t height;
+		uint8_t  depth;
+		uint8_t  descriptor;
+	} __attribute__((packed)) header = {
+		0, /* No image ID field */
+		0, /* No color map */
+		2, /* Uncompressed truecolor */
+		0, 0, 0, /* No color map */
+		0, 0, /* Don't care about origin */
+		shot->width, shot->height, shot->alpha ? 32 : 24,
+		shot->alpha ? 8 : 0,
+	};
+	fwrite(&header, 1, sizeof(header), f);
+
+	int bpp = shot->alpha ? 4 : 3;
+	uint8_t * row = malloc(shot->width * bpp);
+	for (int y = shot->height-1; y>=0; y--) {
+		uint32_t * in = &shot->pixels[y * shot->width];
+		uint8_t * out = row;
+		for (int x = 0; x < shot->width; ++x) {
+			*out++ = _BLU(in[x]);
+			*out++ = _GRE(in[x]);
+			*out++ = _RED(in[x]);
+			if (bpp == 4) *out++ = _ALP(in[x]);
+		}
+		fwrite(row, 1, shot->width * bpp, f);
+	}
+	free(row);
+	fclose(f);
+}
+
+static void * screenshot_writer(void * unused) {
+	sysfunc(TOARU_SYS_FUNC_THREADNAME,(char *[]){"compositor","screenshots",NULL});
+
+	while (1) {
+		pthread_mutex_lock(&screenshot_lock);
+		while (!screenshot_count) {
+			pthread_cond_wait(&screenshot_ready, &screenshot_lock);
+		}
+		struct screenshot shot = screenshot_queue[screenshot_head];
+		pthread_mutex_unlock(&screenshot_lock);
+
+		screenshot_write(&shot);
+		free(shot.pixels);
+
+		/* Only now is its slot free; until then the file is still being written */
+		pthread_mutex_lock(&screenshot_lock);
+		screenshot_head = (screenshot_head + 1) % SCREENSHOT_QUEUE;
+		screenshot_count--;
+		pthread_mutex_unlock(&screenshot_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Take a screenshot
+ */
+static void yutani_screenshot(yutani_globals_t * yg) {
+	int task = yg->screenshot_frame;
+	yg->screenshot_frame = 0;
+
 	uint32_t * buffer = NULL;
 	int width, height;
 	int alpha;
@@ -886,7 +1536,7 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 		width = yg->width;
 		height = yg->height;
 		alpha = 0;
-	} else if (task == YUTANI_SCREENSHOT_WINDOW) {
+	} else if (task == YUTANI_SCREENSHOT_WINDOW && yg->focused_window) {
 		yutani_server_window_t * window = yg->focused_window;
 		buffer = (void *)window->buffer;
 		width = window->width;
@@ -894,47 +1544,31 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 		alpha = 1;
 	}
 
-	if (buffer) {
-
-		struct {
-			uint8_t id_length;
-			uint8_t color_map_type;
-			uint8_t image_type;
-
-			uint16_t color_map_first_entry;
-			uint16_t color_map_length;
-			uint8_t color_map_entry_size;
-
-			uint16_t x_origin;
-			uint16_t y_origin;
-			uint16_t width;
-			uint16_t height;
-			uint8_t  depth;
-			uint8_t  descriptor;
-		} __attribute__((packed)) header = {
-			0, /* No image ID field */
-			0, /* No color map */
-			2, /* Uncompressed truecolor */
-			0, 0, 0, /* No color map */
-			0, 0, /* Don't care about origin */
-			width, height, alpha ? 32 : 24,
-			alpha ? 8 : 0,
-		};
-		fwrite(&header, 1, sizeof(header), f);
-
-		for (int y = height-1; y>=0; y--) {
-			for (int x = 0; x < width; ++x) {
-				uint8_t buf[4] = {
-					_BLU(buffer[y * width + x]),
-					_GRE(buffer[y * width + x]),
-					_RED(buffer[y * width + x]),
-					_ALP(buffer[y * width + x]),
-				};
-				fwrite(buf, 1, alpha ? 4 : 3, f);
-			}
-		}
+	if (!buffer) return;
+
+	pthread_mutex_lock(&screenshot_lock);
+	if (screenshot_count == SCREENSHOT_QUEUE) {
+		pthread_mutex_unlock(&screenshot_lock);
+		TRACE("Dropping screenshot; the writer is behind.");
+		return;
 	}
-	fclose(f);
+	pthread_mutex_unlock(&screenshot_lock);
+
+	/* The render thread is the only one adding, so the slot stays free */
+	size_t size = sizeof(uint32_t) * width * height;
+	struct screenshot shot = { malloc(size), width, height, alpha };
+	if (!shot.pixels) return;
+	memcpy(shot.pixels, buffer, size);
+
+	pthread_mutex_lock(&screenshot_lock);
+	screenshot_queue[(screenshot_head + screenshot_count) % SCREENSHOT_QUEUE] = shot;
+	screenshot_count++;
+	if (!screenshot_thread_started) {
+		screenshot_thread_started = 1;
+		pthread_create(&screenshot_thread, NULL, screenshot_writer, NULL);
+	}
+	pthread_cond_signal(&screenshot_ready);
+	pthread_mutex_unlock(&screenshot_lock);
 }
 
 /**
@@ -942,7 +1576,7 @@ static void yutani_screenshot(yutani_globals_t * yg) {
  *
  * This is the main redraw function.
  */
-static void redraw_windows(yutani_globals_t * yg) {
+static int redraw_windows(yutani_globals_t * yg) {
 	int has_updates = 0;
 
 	/* We keep our own temporary mouse coordinates as they may change while we're drawing. */
@@ -955,6 +1589,10 @@ static void redraw_windows(yutani_globals_t * yg) {
 
 		if (!yutani_options.nested) {
 			reinit_graphics_fullscreen(yg->backend_ctx);
+			if (yg->page_flip) {
+				yg->page_flip = !init_graphics_page_flip(yg->backend_ctx);
+				yg->last_damage_count = 0;
+			}
 		} else {
 			reinit_graphics_yutani(yg->backend_ctx, yg->host_window);
 			yutani_window_resize_done(yg->host_context, yg->host_window);
@@ -983,7 +1621,10 @@ static void redraw_windows(yutani_globals_t * yg) {
 	if (renderer_push_state) renderer_push_state(yg);
 
 	/* If the mouse has moved, that counts as two damage regions */
-	if ((yg->last_mouse_x != tmp_mouse_x) || (yg->last_mouse_y != tmp_mouse_y)) {
+	if (yg->hw_cursor) {
+		/* ...unless the adapter draws it */
+		update_hw_cursor(yg, tmp_mouse_x, tmp_mouse_y);
+	} else if ((yg->last_mouse_x != tmp_mouse_x) || (yg->last_mouse_y != tmp_mouse_y)) {
 		has_updates = 2;
 		yutani_add_clip(yg, yg->last_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->last_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
 		yutani_add_clip(yg, tmp_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, tmp_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
@@ -1000,7 +1641,20 @@ static void redraw_windows(yutani_globals_t * yg) {
 	}
 
 	/* Calculate damage regions from currently queued updates */
+	list_t * callbacks = NULL;
+	list_t * latency = NULL;
 	spin_lock(&yg->update_list_lock);
+	if (yg->frame_callbacks->length) {
+		/* These get answered once this frame is drawn */
+		callbacks = yg->frame_callbacks;
+		yg->frame_callbacks = list_create();
+		has_updates = 1;
+	}
+	if (yg->latency_marks->length) {
+		latency = yg->latency_marks;
+		yg->latency_marks = list_create();
+		has_updates = 1;
+	}
 	while (yg->update_list->length) {
 		node_t * win = list_dequeue(yg->update_list);
 		yutani_damage_rect_t * rect = (void *)win->value;
@@ -1016,6 +1670,14 @@ static void redraw_windows(yutani_globals_t * yg) {
 	/* Render */
 	if (has_updates) {
 
+		if (yg->page_flip && !renderer_blit_screen) {
+			/* Catch the back page up on what changed on the one being shown */
+			for (int i = 0; i < yg->last_damage_count; ++i) {
+				yutani_damage_rect_t * r = &yg->last_damage[i];
+				yutani_add_clip(yg, r->x, r->y, r->width, r->height);
+			}
+		}
+
 		if ((!yg->bottom_z || yg->bottom_z->anim_mode) && renderer_blit_screen) {
 			/* TODO: Need to clear with Cairo backend */
 			draw_fill(yg->backend_ctx, rgb(110,110,110));
@@ -1060,7 +1722,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 			if (renderer_blit_screen) {
 				renderer_blit_screen(yg);
 			} else {
-				flip(yg->backend_ctx);
+				flip_damaged(yg);
 			}
 			/*
 			 * We should be able to flip only the places we need to flip, but
@@ -1083,7 +1745,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 			 * can also go in the stack order of the windows.
 			 */
 			yutani_server_window_t * tmp_window = top_at(yg, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE);
-			if (!tmp_window || tmp_window->show_mouse) {
+			if (!yg->hw_cursor && (!tmp_window || tmp_window->show_mouse)) {
 				draw_cursor(yg, tmp_mouse_x, tmp_mouse_y, tmp_window ? tmp_window->show_mouse : 1);
 			}
 
@@ -1093,12 +1755,18 @@ static void redraw_windows(yutani_globals_t * yg) {
 			 */
 			if (renderer_blit_screen) {
 				renderer_blit_screen(yg);
+			} else if (yg->page_flip) {
+				flip_pages(yg);
 			} else {
-				flip(yg->backend_ctx);
+				flip_damaged(yg);
 			}
+			post_fb_update(yg);
 		}
 
-		if (!renderer_add_clip) gfx_clear_clip(yg->backend_ctx);
+		if (!renderer_add_clip) {
+			gfx_clear_clip(yg->backend_ctx);
+			yg->damage_count = 0;
+		}
 
 		spin_unlock(&yg->redraw_lock);
 
@@ -1117,6 +1785,14 @@ static void redraw_windows(yutani_globals_t * yg) {
 
 	}
 
+	if (callbacks) {
+		send_frame_callbacks(yg, callbacks);
+	}
+
+	if (latency) {
+		latency_record(yg, latency);
+	}
+
 	if (renderer_pop_state) renderer_pop_state(yg);
 
 	if (yg->screenshot_frame) {
@@ -1127,9 +1803,11 @@ static void redraw_windows(yutani_globals_t * yg) {
 		yg->reload_renderer = 0;
 		/* Otherwise we won't draw the cursor... */
 		gfx_no_clip(yg->backend_ctx);
+		yg->damage_count = 0;
 		try_load_extensions(yg);
 	}
 
+	return has_updates;
 }
 
 /**
@@ -1139,13 +1817,30 @@ void yutani_clip_init(yutani_globals_t * yg) {
 
 	yg->update_list = list_create();
 	yg->update_list_lock = 0;
+	yg->frame_callbacks = list_create();
+	yg->latency_marks = list_create();
+}
+
+/**
+ * Tell the render thread something may have changed.
+ *
+ * Only the first call after the render thread goes idle writes to
+ * the pipe; everything after that is a cheap no-op.
+ */
+static void wake_renderer(yutani_globals_t * yg) {
+	if (!__sync_lock_test_and_set(&yg->damage_pending, 1)) {
+		write(yg->damage_pipe[1], "!", 1);
+	}
 }
 
+#define FRAME_TIME 16666 /* microseconds; about 60fps */
+
 /**
  * Redraw thread.
  *
- * Calls the redraw functions in a loop, with some
- * additional yielding and sleeping.
+ * While there is damage, renders frames at about 60fps, sleeping
+ * only for what is left of each frame after rendering it. Once a
+ * frame comes up empty, sleeps until woken by wake_renderer().
  */
 static void * redraw(void * in) {
 
@@ -1153,20 +1848,28 @@ static void * redraw(void * in) {
 
 	yutani_globals_t * yg = in;
 	while (yg->server) {
+		uint32_t start = yutani_current_time(yg);
+
 		/*
 		 * Perform whatever redraw work is required.
 		 */
-		redraw_windows(yg);
+		if (redraw_windows(yg)) {
+			uint32_t spent = yutani_time_since(yg, start) * 1000;
+			if (spent < FRAME_TIME) {
+				usleep(FRAME_TIME - spent);
+			}
+			continue;
+		}
 
 		/*
-		 * Attempt to run at about 60fps...
-		 * we should actually see how long it took to render so
-		 * we can sleep *less* if it took a long time to render
-		 * this particular frame. We are definitely not
-		 * going to run at 60fps unless there's nothing to do
-		 * (and even then we've wasted cycles checking).
+		 * Nothing to draw. Wait for the byte from wake_renderer(), then
+		 * rearm it before looking for damage again; anything marked after
+		 * this point writes a fresh byte, so no wakeup is lost.
 		 */
-		usleep(16666);
+		char c;
+		read(yg->damage_pipe[0], &c, 1);
+		yg->damage_pending = 0;
+		__sync_synchronize();
 	}
 
 	return NULL;
@@ -1234,9 +1937,46 @@ static void mark_window_relative(yutani_globals_t * yg, yutani_server_window_t *
 }
 
 /**
- * (Convenience function) Mark a whole a window as damaged.
+ * Ask to tell a client when the damage it just queued has been drawn.
+ * Called after the damage is in the update list.
  */
-static void mark_window(yutani_globals_t * yg, yutani_server_window_t * window) {
+static void queue_frame_callback(yutani_globals_t * yg, unsigned int owner, yutani_wid_t wid, uint32_t serial) {
+	struct frame_callback * cb = malloc(sizeof(struct frame_callback));
+	cb->owner = owner;
+	cb->wid = wid;
+	cb->serial = serial;
+	spin_lock(&yg->update_list_lock);
+	list_insert(yg->frame_callbacks, cb);
+	spin_unlock(&yg->update_list_lock);
+	wake_renderer(yg);
+}
+
+/**
+ * A client flipped in response to a tagged key; the sample is done
+ * when the frame with that flip is. Called after the flip's damage
+ * is in the update list.
+ */
+static void queue_latency_mark(yutani_globals_t * yg, struct yutani_msg_latency_mark * lm) {
+	struct latency_sample * slot = &latency_in_flight[lm->input_id % LATENCY_IN_FLIGHT];
+	if (!lm->input_id || slot->id != lm->input_id) return; /* Too old, or not ours */
+
+	struct latency_sample * s = malloc(sizeof(struct latency_sample));
+	memcpy(s, slot, sizeof(struct latency_sample));
+	s->received = lm->received;
+	s->flipped = lm->flipped;
+	s->marked = now_us();
+	slot->id = 0;
+
+	spin_lock(&yg->update_list_lock);
+	list_insert(yg->latency_marks, s);
+	spin_unlock(&yg->update_list_lock);
+	wake_renderer(yg);
+}
+
+/**
+ * (Convenience function) Mark a whole a window as damaged.
+ */
+static void mark_window(yutani_globals_t * yg, yutani_server_window_t * window) {
 	mark_window_relative(yg, window, 0, 0, window->width, window->height);
 }
 
@@ -1287,6 +2027,8 @@ static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t
 		}
 	}
 
+	server_window_swapchain_drop(yg, w, 0);
+
 	{
 		char key[1024];
 		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, w->bufid);
@@ -1334,6 +2076,8 @@ static void notify_subscribers(yutani_globals_t * yg) {
 	yutani_msg_buildx_notify_alloc(response);
 	yutani_msg_buildx_notify(response);
 	list_t * remove = NULL;
+	unsigned int * targets = malloc(sizeof(unsigned int) * (yg->window_subscribers->length + 1));
+	unsigned int count = 0;
 	foreach(node, yg->window_subscribers) {
 		uint32_t subscriber = (uint32_t)node->value;
 		if (!hashmap_has(yg->clients_to_windows, (void *)subscriber)) {
@@ -1342,9 +2086,13 @@ static void notify_subscribers(yutani_globals_t * yg) {
 			}
 			list_insert(remove, node);
 		} else {
-			pex_send(yg->server, subscriber, response->size, (char *)response);
+			targets[count++] = subscriber;
 		}
 	}
+	if (count) {
+		pex_multicast(yg->server, count, targets, response->size, (char *)response);
+	}
+	free(targets);
 	if (remove) {
 		while (remove->length) {
 			node_t * n = list_pop(remove);
@@ -1452,7 +2200,7 @@ static void window_untile(yutani_globals_t * yg, yutani_server_window_t * window
  * These are mostly compositor shortcuts and bindings.
  * We also process key bindings for other applications.
  */
-static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event * ke) {
+static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event * ke, uint64_t read_time) {
 	yg->active_modifiers = ke->event.modifiers;
 	yutani_server_window_t * focused = get_focused(yg);
 	if (focused) {
@@ -1619,8 +2367,21 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 
 		yutani_msg_buildx_key_event_alloc(response);
 		yutani_msg_buildx_key_event(response,focused->wid, &ke->event, &ke->state);
+
+		/* Tag it, so we hear back when the client has done something about it */
+		uint32_t id = latency_next_id++;
+		if (!id) id = latency_next_id++;
+		struct latency_sample * slot = &latency_in_flight[id % LATENCY_IN_FLIGHT];
+		slot->id = id;
+		slot->read = read_time;
+		slot->dispatched = now_us();
+		((struct yutani_msg_key_event *)response->data)->input_id = id;
+
 		pex_send(yg->server, focused->owner, response->size, (char *)response);
 
+		spin_lock(&yg->update_list_lock);
+		latency_report.dispatched++;
+		spin_unlock(&yg->update_list_lock);
 	}
 }
 
@@ -1772,6 +2533,55 @@ static void mouse_start_resize(yutani_globals_t * yg, yutani_scale_direction_t d
 	}
 }
 
+#define MOUSE_COALESCE 16
+
+/**
+ * Read every whole mouse packet that's waiting, up to MOUSE_COALESCE.
+ */
+static int read_mouse_packets(int fd, mouse_device_packet_t * packets) {
+	int r = read(fd, (char *)packets, sizeof(mouse_device_packet_t) * MOUSE_COALESCE);
+	if (r <= 0) return 0;
+
+	/* Finish off a packet we only got part of */
+	while (r % sizeof(mouse_device_packet_t)) {
+		int more = read(fd, (char *)packets + r, sizeof(mouse_device_packet_t) - r % sizeof(mouse_device_packet_t));
+		if (more <= 0) break;
+		r += more;
+	}
+
+	return r / sizeof(mouse_device_packet_t);
+}
+
+/**
+ * Fold runs of motion with the same button state into one packet.
+ *
+ * A packet that changes the button state (press or release) is kept
+ * as-is, position included, and scroll clicks are never merged;
+ * only the moves between them are combined, summed for relative
+ * devices or just the last position for absolute ones.
+ */
+static int coalesce_mouse_packets(mouse_device_packet_t * packets, int count, uint32_t last_buttons, int relative) {
+	int out = 0;
+	int mergeable = 0;
+	for (int i = 0; i < count; ++i) {
+		uint32_t prev = out ? packets[out-1].buttons : last_buttons;
+		int same = packets[i].buttons == prev && !(packets[i].buttons & (MOUSE_SCROLL_UP | MOUSE_SCROLL_DOWN));
+		if (out && same && mergeable) {
+			if (relative) {
+				packets[out-1].x_difference += packets[i].x_difference;
+				packets[out-1].y_difference += packets[i].y_difference;
+			} else {
+				packets[out-1].x_difference = packets[i].x_difference;
+				packets[out-1].y_difference = packets[i].y_difference;
+			}
+		} else {
+			packets[out++] = packets[i];
+			mergeable = same;
+		}
+	}
+	return out;
+}
+
 static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_event * me)  {
 	if (me->type == YUTANI_MOUSE_EVENT_TYPE_RELATIVE) {
 		yg->mouse_x += me->event.x_difference YUTANI_INCOMING_MOUSE_SCALE;
@@ -2055,9 +2865,31 @@ static void yutani_display_resize_handle(int signum) {
 	(void)signum;
 	TRACE("Display change request, one moment.");
 	_static_yg->resize_on_next = 1;
+	wake_renderer(_static_yg);
 	signal(SIGWINEVENT, yutani_display_resize_handle);
 }
 
+/*
+ * Display changes arrive as SIGWINEVENT; where we can, we take them
+ * on a signal descriptor in the main loop instead of in a handler.
+ */
+static int resize_fd = -1;
+
+static void open_resize_fd(void) {
+	uint64_t mask = SIGNALFD_BIT(SIGWINEVENT);
+	resize_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+	if (resize_fd < 0) {
+		signal(SIGWINEVENT, yutani_display_resize_handle);
+	}
+}
+
+static void read_resize_fd(void) {
+	struct signalfd_siginfo info[4];
+	if (read(resize_fd, info, sizeof(info)) > 0) {
+		yutani_display_resize_handle(SIGWINEVENT);
+	}
+}
+
 /**
  * main
  */
@@ -2083,7 +2915,7 @@ int main(int argc, char * argv[]) {
 			return 1;
 		}
 		_static_yg = yg;
-		signal(SIGWINEVENT, yutani_display_resize_handle);
+		open_resize_fd();
 		yg->backend_ctx = init_graphics_fullscreen_double_buffer();
 	}
 
@@ -2103,9 +2935,36 @@ int main(int argc, char * argv[]) {
 	yg->width = yg->backend_ctx->width;
 	yg->height = yg->backend_ctx->height;
 
+	yg->fb_update = -1;
+	if (!yutani_options.nested) {
+		/* Only keep the device open if the adapter actually takes updates */
+		struct vid_update probe = { 0 };
+		yg->fb_update = open("/dev/fb0", O_RDONLY);
+		if (yg->fb_update >= 0 && ioctl(yg->fb_update, IO_VID_UPDATE, &probe) < 0) {
+			close(yg->fb_update);
+			yg->fb_update = -1;
+		}
+	}
+
+	yg->hw_cursor = 0;
+	if (yg->fb_update >= 0) {
+		/* Hidden until the first frame places it */
+		struct vid_cursor_position hidden = { 0, 0, 0 };
+		yg->hw_cursor = ioctl(yg->fb_update, IO_VID_CURSOR_MOVE, &hidden) == 0;
+		yg->hw_cursor_x = 0;
+		yg->hw_cursor_y = 0;
+		yg->hw_cursor_visible = 0;
+		yg->hw_cursor_sprite = NULL;
+	}
+
 	draw_fill(yg->backend_ctx, rgb(110,110,110));
 	flip(yg->backend_ctx);
 
+	if (!yutani_options.nested) {
+		/* Draw into the second page of video memory and flip to it, if the adapter can pan */
+		yg->page_flip = !init_graphics_page_flip(yg->backend_ctx);
+	}
+
 	yg->backend_framebuffer = yg->backend_ctx->backbuffer;
 
 	if (yutani_options.nested) {
@@ -2206,6 +3065,9 @@ int main(int argc, char * argv[]) {
 
 	pthread_t render_thread;
 
+	pipe(yg->damage_pipe);
+	yg->damage_pending = 0;
+
 	TRACE("Starting render thread.");
 	pthread_create(&render_thread, NULL, redraw, yg);
 
@@ -2221,12 +3083,14 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
-	int fds[4];
+	int fds[5];
+	int nfds = 2;
+	int resize_index = -1;
 	int mfd = -1;
 	int kfd = -1;
 	int amfd = -1;
 	int vmmouse = 0;
-	mouse_device_packet_t packet;
+	mouse_device_packet_t packets[MOUSE_COALESCE];
 	key_event_t event;
 	key_event_state_t state = {0};
 
@@ -2247,10 +3111,18 @@ int main(int argc, char * argv[]) {
 
 		fds[1] = mfd;
 		fds[2] = kfd;
-		fds[3] = amfd;
+		nfds = 3;
+		if (amfd != -1) fds[nfds++] = amfd;
+		if (resize_fd != -1) {
+			resize_index = nfds;
+			fds[nfds++] = resize_fd;
+		}
 	}
 
 	while (1) {
+		/* Whatever we handled last time around may have left damage */
+		wake_renderer(yg);
+
 		if (yutani_options.nested) {
 			int index = fswait(2, fds);
 
@@ -2263,7 +3135,7 @@ int main(int argc, char * argv[]) {
 								struct yutani_msg_key_event * ke = (void*)m->data;
 								yutani_msg_buildx_key_event_alloc(m_);
 								yutani_msg_buildx_key_event(m_, 0, &ke->event, &ke->state);
-								handle_key_event(yg, (struct yutani_msg_key_event *)m_->data);
+								handle_key_event(yg, (struct yutani_msg_key_event *)m_->data, now_us());
 							}
 							break;
 						case YUTANI_MSG_WINDOW_MOUSE_EVENT:
@@ -2310,37 +3182,47 @@ int main(int argc, char * argv[]) {
 				continue;
 			}
 		} else {
-			int index = fswait(amfd == -1 ? 3 : 4, fds);
+			int index = fswait(nfds, fds);
 
-			if (index == 2) {
+			if (index == resize_index) {
+				read_resize_fd();
+				continue;
+			} else if (index == 2) {
 				unsigned char buf[1];
 				int r = read(kfd, buf, 1);
 				if (r > 0) {
+					uint64_t read_time = now_us();
 					kbd_scancode(&state, buf[0], &event);
 					yutani_msg_buildx_key_event_alloc(m);
 					yutani_msg_buildx_key_event(m,0, &event, &state);
-					handle_key_event(yg, (struct yutani_msg_key_event *)m->data);
+					handle_key_event(yg, (struct yutani_msg_key_event *)m->data, read_time);
 				}
 				continue;
 			} else if (index == 1) {
-				int r = read(mfd, (char *)&packet, sizeof(mouse_device_packet_t));
-				if (r > 0) {
-					yg->last_mouse_buttons = packet.buttons;
+				int count = read_mouse_packets(mfd, packets);
+				count = coalesce_mouse_packets(packets, count, yg->last_mouse_buttons, 1);
+				for (int i = 0; i < count; ++i) {
+					yg->last_mouse_buttons = packets[i].buttons;
 					yutani_msg_buildx_mouse_event_alloc(m);
-					yutani_msg_buildx_mouse_event(m,0, &packet, YUTANI_MOUSE_EVENT_TYPE_RELATIVE);
+					yutani_msg_buildx_mouse_event(m,0, &packets[i], YUTANI_MOUSE_EVENT_TYPE_RELATIVE);
 					handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
 				}
 				continue;
 			} else if (index == 3) {
-				int r = read(amfd, (char *)&packet, sizeof(mouse_device_packet_t));
-				if (r > 0) {
+				int count = read_mouse_packets(amfd, packets);
+				uint32_t last_buttons = yg->last_mouse_buttons;
+				for (int i = 0; i < count; ++i) {
 					if (!vmmouse) {
-						packet.buttons = yg->last_mouse_buttons & 0xF;
-					} else {
-						yg->last_mouse_buttons = packet.buttons;
+						packets[i].buttons = yg->last_mouse_buttons & 0xF;
+					}
+				}
+				count = coalesce_mouse_packets(packets, count, last_buttons, 0);
+				for (int i = 0; i < count; ++i) {
+					if (vmmouse) {
+						yg->last_mouse_buttons = packets[i].buttons;
 					}
 					yutani_msg_buildx_mouse_event_alloc(m);
-					yutani_msg_buildx_mouse_event(m,0, &packet, YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
+					yutani_msg_buildx_mouse_event(m,0, &packets[i], YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
 					handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
 				}
 				continue;
@@ -2385,348 +3267,431 @@ int main(int argc, char * argv[]) {
 			continue;
 		}
 
-		switch(m->type) {
-			case YUTANI_MSG_HELLO:
-				{
-					TRACE("And hello to you, %08x!", p->source);
-					list_t * client_list = hashmap_get(yg->clients_to_windows, (void *)p->source);
-					if (!client_list) {
-						TRACE("Client is new: %x", p->source);
-						client_list = list_create();
-						hashmap_set(yg->clients_to_windows, (void *)p->source, client_list);
-					}
-					yutani_msg_buildx_welcome_alloc(response);
-					yutani_msg_buildx_welcome(response,yg->width, yg->height);
-					pex_send(server, p->source, response->size, (char *)response);
-				}
+		/* A batch is several messages back to back; handle each in turn */
+		char * batch_end = (char *)m + min(m->size, p->size);
+		if (m->type == YUTANI_MSG_BATCH) {
+			m = (yutani_msg_t *)m->data;
+		}
+
+		while ((char *)m + sizeof(yutani_msg_t) <= batch_end && m->size >= sizeof(yutani_msg_t) && (char *)m + m->size <= batch_end) {
+			if (m->magic != YUTANI_MSG__MAGIC || m->type == YUTANI_MSG_BATCH) {
+				TRACE("Bad message in batch, dropping the rest.");
 				break;
-			case YUTANI_MSG_WINDOW_NEW:
-			case YUTANI_MSG_WINDOW_NEW_FLAGS:
-				{
-					struct yutani_msg_window_new_flags * wn = (void *)m->data;
-					TRACE("Client %08x requested a new window (%dx%d).", p->source, wn->width, wn->height);
-					yutani_server_window_t * w = server_window_create(yg, wn->width, wn->height, p->source, m->type != YUTANI_MSG_WINDOW_NEW ? wn->flags : 0);
-					yutani_msg_buildx_window_init_alloc(response);
-					yutani_msg_buildx_window_init(response,w->wid, w->width, w->height, w->bufid);
-					pex_send(server, p->source, response->size, (char *)response);
-
-					if (!(w->server_flags & YUTANI_WINDOW_FLAG_NO_STEAL_FOCUS)) {
-						set_focused_window(yg, w);
+			}
+
+			switch(m->type) {
+				case YUTANI_MSG_HELLO:
+					{
+						TRACE("And hello to you, %08x!", p->source);
+						list_t * client_list = hashmap_get(yg->clients_to_windows, (void *)p->source);
+						if (!client_list) {
+							TRACE("Client is new: %x", p->source);
+							client_list = list_create();
+							hashmap_set(yg->clients_to_windows, (void *)p->source, client_list);
+						}
+						yutani_msg_buildx_welcome_alloc(response);
+						yutani_msg_buildx_welcome(response,yg->width, yg->height);
+						pex_send(server, p->source, response->size, (char *)response);
 					}
+					break;
+				case YUTANI_MSG_WINDOW_NEW:
+				case YUTANI_MSG_WINDOW_NEW_FLAGS:
+					{
+						struct yutani_msg_window_new_flags * wn = (void *)m->data;
+						TRACE("Client %08x requested a new window (%dx%d).", p->source, wn->width, wn->height);
+						yutani_server_window_t * w = server_window_create(yg, wn->width, wn->height, p->source, m->type != YUTANI_MSG_WINDOW_NEW ? wn->flags : 0);
+						yutani_msg_buildx_window_init_alloc(response);
+						yutani_msg_buildx_window_init(response,w->wid, w->width, w->height, w->bufid);
+						pex_send(server, p->source, response->size, (char *)response);
 
-					notify_subscribers(yg);
-				}
-				break;
-			case YUTANI_MSG_FLIP:
-				{
-					struct yutani_msg_flip * wf = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wf->wid);
-					if (w) {
-						mark_window(yg, w);
+						if (!(w->server_flags & YUTANI_WINDOW_FLAG_NO_STEAL_FOCUS)) {
+							set_focused_window(yg, w);
+						}
+
+						notify_subscribers(yg);
 					}
-				}
-				break;
-			case YUTANI_MSG_FLIP_REGION:
-				{
-					struct yutani_msg_flip_region * wf = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wf->wid);
-					if (w) {
-						mark_window_relative(yg, w, wf->x, wf->y, wf->width, wf->height);
+					break;
+				case YUTANI_MSG_FLIP:
+					{
+						struct yutani_msg_flip * wf = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wf->wid);
+						if (w) {
+							window_check_opaque(w, 0, 0, w->width, w->height);
+							mark_window(yg, w);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_KEY_EVENT:
-				{
-					/* XXX Verify this is from a valid device client */
-					struct yutani_msg_key_event * ke = (void *)m->data;
-					handle_key_event(yg, ke);
-				}
-				break;
-			case YUTANI_MSG_MOUSE_EVENT:
-				{
-					/* XXX Verify this is from a valid device client */
-					struct yutani_msg_mouse_event * me = (void *)m->data;
-					handle_mouse_event(yg, me);
-				}
-				break;
-			case YUTANI_MSG_WINDOW_MOVE:
-				{
-					struct yutani_msg_window_move * wm = (void *)m->data;
-					//TRACE("%08x wanted to move window %d to %d, %d", p->source, wm->wid, (int)wm->x, (int)wm->y);
-					if (wm->x > (int)yg->width + 100 || wm->x < -(int)yg->width || wm->y > (int)yg->height + 100 || wm->y < -(int)yg->height) {
-						TRACE("Refusing to move window to these coordinates.");
-						break;
+					break;
+				case YUTANI_MSG_FLIP_REGION:
+					{
+						struct yutani_msg_flip_region * wf = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wf->wid);
+						if (w) {
+							window_check_opaque(w, wf->x, wf->y, wf->width, wf->height);
+							mark_window_relative(yg, w, wf->x, wf->y, wf->width, wf->height);
+						}
 					}
-					yutani_server_window_t * win = hashmap_get(yg->wids_to_windows, (void*)wm->wid);
-					if (win) {
-						window_move(yg, win, wm->x, wm->y);
-					} else {
-						TRACE("%08x wanted to move window %d, but I can't find it?", p->source, wm->wid);
+					break;
+				case YUTANI_MSG_FLIP_REGIONS:
+					{
+						struct yutani_msg_flip_regions * wf = (void *)m->data;
+						uint32_t count = min(wf->count, (m->size - sizeof(yutani_msg_t) - sizeof(struct yutani_msg_flip_regions)) / sizeof(yutani_damage_rect_t));
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wf->wid);
+						if (w) {
+							for (uint32_t i = 0; i < count; ++i) {
+								yutani_damage_rect_t * r = &wf->rects[i];
+								window_check_opaque(w, r->x, r->y, r->width, r->height);
+								mark_window_relative(yg, w, r->x, r->y, r->width, r->height);
+							}
+						}
+						if (wf->serial) {
+							queue_frame_callback(yg, p->source, wf->wid, wf->serial);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_CLOSE:
-				{
-					struct yutani_msg_window_close * wc = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wc->wid);
-					if (w) {
-						window_mark_for_close(yg, w);
-						window_remove_from_client(yg, w);
+					break;
+				case YUTANI_MSG_KEY_EVENT:
+					{
+						/* XXX Verify this is from a valid device client */
+						struct yutani_msg_key_event * ke = (void *)m->data;
+						handle_key_event(yg, ke, now_us());
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_STACK:
-				{
-					struct yutani_msg_window_stack * ws = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)ws->wid);
-					if (w) {
-						reorder_window(yg, w, ws->z);
+					break;
+				case YUTANI_MSG_LATENCY_MARK:
+					{
+						struct yutani_msg_latency_mark * lm = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)lm->wid);
+						if (w && w->owner == p->source) {
+							queue_latency_mark(yg, lm);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_RESIZE_REQUEST:
-				{
-					struct yutani_msg_window_resize * wr = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
-					if (w) {
-						yutani_msg_buildx_window_resize_alloc(response);
-						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
+					break;
+				case YUTANI_MSG_QUERY_LATENCY:
+					{
+						struct yutani_msg_latency_report report;
+						spin_lock(&yg->update_list_lock);
+						memcpy(&report, &latency_report, sizeof(report));
+						spin_unlock(&yg->update_list_lock);
+						yutani_msg_buildx_latency_report_alloc(response);
+						yutani_msg_buildx_latency_report(response, &report);
 						pex_send(server, p->source, response->size, (char *)response);
 					}
-				}
-				break;
-			case YUTANI_MSG_RESIZE_OFFER:
-				{
-					struct yutani_msg_window_resize * wr = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
-					if (w) {
-						yutani_msg_buildx_window_resize_alloc(response);
-						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+					break;
+				case YUTANI_MSG_MOUSE_EVENT:
+					{
+						/* XXX Verify this is from a valid device client */
+						struct yutani_msg_mouse_event * me = (void *)m->data;
+						handle_mouse_event(yg, me);
 					}
-				}
-				break;
-			case YUTANI_MSG_RESIZE_ACCEPT:
-				{
-					struct yutani_msg_window_resize * wr = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
-					if (w) {
-						uint32_t newbufid = server_window_resize(yg, w, wr->width, wr->height);
-						yutani_msg_buildx_window_resize_alloc(response);
-						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_BUFID, w->wid, wr->width, wr->height, newbufid, 0);
-						pex_send(server, p->source, response->size, (char *)response);
+					break;
+				case YUTANI_MSG_WINDOW_MOVE:
+					{
+						struct yutani_msg_window_move * wm = (void *)m->data;
+						//TRACE("%08x wanted to move window %d to %d, %d", p->source, wm->wid, (int)wm->x, (int)wm->y);
+						if (wm->x > (int)yg->width + 100 || wm->x < -(int)yg->width || wm->y > (int)yg->height + 100 || wm->y < -(int)yg->height) {
+							TRACE("Refusing to move window to these coordinates.");
+							break;
+						}
+						yutani_server_window_t * win = hashmap_get(yg->wids_to_windows, (void*)wm->wid);
+						if (win) {
+							window_move(yg, win, wm->x, wm->y);
+						} else {
+							TRACE("%08x wanted to move window %d, but I can't find it?", p->source, wm->wid);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_RESIZE_DONE:
-				{
-					struct yutani_msg_window_resize * wr = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
-					if (w) {
-						server_window_resize_finish(yg, w, wr->width, wr->height);
+					break;
+				case YUTANI_MSG_WINDOW_CLOSE:
+					{
+						struct yutani_msg_window_close * wc = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wc->wid);
+						if (w) {
+							window_mark_for_close(yg, w);
+							window_remove_from_client(yg, w);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_QUERY_WINDOWS:
-				{
-					yutani_query_result(yg, p->source, yg->bottom_z);
-					foreach (node, yg->mid_zs) {
-						yutani_query_result(yg, p->source, node->value);
+					break;
+				case YUTANI_MSG_WINDOW_STACK:
+					{
+						struct yutani_msg_window_stack * ws = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)ws->wid);
+						if (w) {
+							reorder_window(yg, w, ws->z);
+						}
 					}
-					yutani_query_result(yg, p->source, yg->top_z);
-					yutani_msg_buildx_window_advertise_alloc(response, 0);
-					yutani_msg_buildx_window_advertise(response,0, 0, NULL, 0, NULL);
-					pex_send(server, p->source, response->size, (char *)response);
-				}
-				break;
-			case YUTANI_MSG_SUBSCRIBE:
-				{
-					foreach(node, yg->window_subscribers) {
-						if ((uint32_t)node->value == p->source) {
-							break;
+					break;
+				case YUTANI_MSG_RESIZE_REQUEST:
+					{
+						struct yutani_msg_window_resize * wr = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
+						if (w) {
+							yutani_msg_buildx_window_resize_alloc(response);
+							yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
+							pex_send(server, p->source, response->size, (char *)response);
 						}
 					}
-					list_insert(yg->window_subscribers, (void*)p->source);
-				}
-				break;
-			case YUTANI_MSG_UNSUBSCRIBE:
-				{
-					node_t * node = list_find(yg->window_subscribers, (void*)p->source);
-					if (node) {
-						list_delete(yg->window_subscribers, node);
+					break;
+				case YUTANI_MSG_RESIZE_OFFER:
+					{
+						struct yutani_msg_window_resize * wr = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
+						if (w) {
+							yutani_msg_buildx_window_resize_alloc(response);
+							yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
+							pex_send(server, p->source, response->size, (char *)response);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_ADVERTISE:
-				{
-					struct yutani_msg_window_advertise * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						if (w->client_strings) free(w->client_strings);
-
-						for (int i = 0; i < 5; ++i) {
-							w->client_offsets[i] = wa->offsets[i];
+					break;
+				case YUTANI_MSG_RESIZE_ACCEPT:
+					{
+						struct yutani_msg_window_resize * wr = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
+						if (w) {
+							uint32_t newbufid = server_window_resize(yg, w, wr->width, wr->height);
+							yutani_msg_buildx_window_resize_alloc(response);
+							yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_BUFID, w->wid, wr->width, wr->height, newbufid, 0);
+							pex_send(server, p->source, response->size, (char *)response);
 						}
-
-						w->client_flags   = wa->flags;
-						w->client_length  = wa->size;
-						w->client_strings = malloc(wa->size);
-						memcpy(w->client_strings, wa->strings, wa->size);
-
-						notify_subscribers(yg);
 					}
-				}
-				break;
-			case YUTANI_MSG_SESSION_END:
-				{
-					yutani_msg_buildx_session_end_alloc(response);
-					yutani_msg_buildx_session_end(response);
-					pex_broadcast(server, response->size, (char *)response);
-				}
-				break;
-			case YUTANI_MSG_WINDOW_FOCUS:
-				{
-					struct yutani_msg_window_focus * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						set_focused_window(yg, w);
+					break;
+				case YUTANI_MSG_RESIZE_DONE:
+					{
+						struct yutani_msg_window_resize * wr = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wr->wid);
+						if (w) {
+							server_window_resize_finish(yg, w, wr->width, wr->height);
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_KEY_BIND:
-				{
-					struct yutani_msg_key_bind * wa = (void *)m->data;
-					add_key_bind(yg, wa, p->source);
-				}
-				break;
-			case YUTANI_MSG_WINDOW_DRAG_START:
-				{
-					struct yutani_msg_window_drag_start * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						/* Start dragging */
-						mouse_start_drag(yg, w);
+					break;
+				case YUTANI_MSG_SWAPCHAIN:
+					{
+						struct yutani_msg_swapchain * sc = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)sc->wid);
+						if (w) {
+							uint32_t count = server_window_swapchain(yg, w, sc->count);
+							if (sc->count) {
+								/* Destroying one needs no answer */
+								yutani_msg_buildx_swapchain_alloc(response);
+								yutani_msg_buildx_swapchain(response, YUTANI_MSG_SWAPCHAIN_BUFIDS, w->wid, count, w->swap_bufids);
+								pex_send(server, p->source, response->size, (char *)response);
+							}
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_UPDATE_SHAPE:
-				{
-					struct yutani_msg_window_update_shape * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						/* Set shape parameter */
-						server_window_update_shape(yg, w, wa->set_shape);
+					break;
+				case YUTANI_MSG_SWAPCHAIN_PRESENT:
+					{
+						struct yutani_msg_window_buffer * wb = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wb->wid);
+						if (w) {
+							uint32_t released = server_window_swapchain_present(yg, w, wb->bufid);
+							if (released) {
+								yutani_msg_buildx_window_buffer_alloc(response);
+								yutani_msg_buildx_window_buffer(response, YUTANI_MSG_BUFFER_RELEASE, w->wid, released);
+								pex_send(server, p->source, response->size, (char *)response);
+							}
+						}
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_WARP_MOUSE:
-				{
-					struct yutani_msg_window_warp_mouse * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						if (yg->focused_window == w) {
-							int32_t x, y;
-							yutani_window_to_device(w, wa->x, wa->y, &x, &y);
-
-							struct yutani_msg_mouse_event me;
-							me.event.x_difference = x;
-							me.event.y_difference = y;
-							me.event.buttons = yg->last_mouse_buttons;
-							me.type = YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE;
-							me.wid = wa->wid;
-
-							handle_mouse_event(yg, &me);
+					break;
+				case YUTANI_MSG_QUERY_WINDOWS:
+					{
+						yutani_query_result(yg, p->source, yg->bottom_z);
+						foreach (node, yg->mid_zs) {
+							yutani_query_result(yg, p->source, node->value);
 						}
+						yutani_query_result(yg, p->source, yg->top_z);
+						yutani_msg_buildx_window_advertise_alloc(response, 0);
+						yutani_msg_buildx_window_advertise(response,0, 0, NULL, 0, NULL);
+						pex_send(server, p->source, response->size, (char *)response);
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_SHOW_MOUSE:
-				{
-					struct yutani_msg_window_show_mouse * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						if (wa->show_mouse == -1) {
-							w->show_mouse = w->default_mouse;
-						} else if (wa->show_mouse < 2) {
-							w->default_mouse = wa->show_mouse;
-							w->show_mouse = wa->show_mouse;
-						} else {
-							w->show_mouse = wa->show_mouse;
+					break;
+				case YUTANI_MSG_SUBSCRIBE:
+					{
+						foreach(node, yg->window_subscribers) {
+							if ((uint32_t)node->value == p->source) {
+								break;
+							}
 						}
-						if (yg->focused_window == w) {
-							mark_screen(yg, yg->mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
+						list_insert(yg->window_subscribers, (void*)p->source);
+					}
+					break;
+				case YUTANI_MSG_UNSUBSCRIBE:
+					{
+						node_t * node = list_find(yg->window_subscribers, (void*)p->source);
+						if (node) {
+							list_delete(yg->window_subscribers, node);
 						}
 					}
-				}
-				break;
-			case YUTANI_MSG_WINDOW_RESIZE_START:
-				{
-					struct yutani_msg_window_resize_start * wa = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
-					if (w) {
-						if (yg->focused_window == w && !yg->resizing_window) {
-							yg->resizing_window = w;
-							yg->resizing_button = YUTANI_MOUSE_BUTTON_LEFT; /* XXX Uh, what if we used something else */
-							mouse_start_resize(yg, wa->direction);
+					break;
+				case YUTANI_MSG_WINDOW_ADVERTISE:
+					{
+						struct yutani_msg_window_advertise * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							if (w->client_strings) free(w->client_strings);
+
+							for (int i = 0; i < 5; ++i) {
+								w->client_offsets[i] = wa->offsets[i];
+							}
+
+							w->client_flags   = wa->flags;
+							w->client_length  = wa->size;
+							w->client_strings = malloc(wa->size);
+							memcpy(w->client_strings, wa->strings, wa->size);
+
+							notify_subscribers(yg);
 						}
 					}
-				}
-				break;
-			case YUTANI_MSG_SPECIAL_REQUEST:
-				{
-					struct yutani_msg_special_request * sr = (void *)m->data;
-					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)sr->wid);
-					switch (sr->request) {
-						case YUTANI_SPECIAL_REQUEST_MAXIMIZE:
-							if (w) {
-								if (w->tiled) {
-									window_untile(yg,w);
-									window_move(yg,w,w->untiled_left,w->untiled_top);
-								} else {
-									window_tile(yg, w, 1, 1, 0, 0);
-								}
+					break;
+				case YUTANI_MSG_SESSION_END:
+					{
+						yutani_msg_buildx_session_end_alloc(response);
+						yutani_msg_buildx_session_end(response);
+						pex_broadcast(server, response->size, (char *)response);
+					}
+					break;
+				case YUTANI_MSG_WINDOW_FOCUS:
+					{
+						struct yutani_msg_window_focus * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							set_focused_window(yg, w);
+						}
+					}
+					break;
+				case YUTANI_MSG_KEY_BIND:
+					{
+						struct yutani_msg_key_bind * wa = (void *)m->data;
+						add_key_bind(yg, wa, p->source);
+					}
+					break;
+				case YUTANI_MSG_WINDOW_DRAG_START:
+					{
+						struct yutani_msg_window_drag_start * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							/* Start dragging */
+							mouse_start_drag(yg, w);
+						}
+					}
+					break;
+				case YUTANI_MSG_WINDOW_UPDATE_SHAPE:
+					{
+						struct yutani_msg_window_update_shape * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							/* Set shape parameter */
+							server_window_update_shape(yg, w, wa->set_shape);
+						}
+					}
+					break;
+				case YUTANI_MSG_WINDOW_WARP_MOUSE:
+					{
+						struct yutani_msg_window_warp_mouse * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							if (yg->focused_window == w) {
+								int32_t x, y;
+								yutani_window_to_device(w, wa->x, wa->y, &x, &y);
+
+								struct yutani_msg_mouse_event me;
+								me.event.x_difference = x;
+								me.event.y_difference = y;
+								me.event.buttons = yg->last_mouse_buttons;
+								me.type = YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE;
+								me.wid = wa->wid;
+
+								handle_mouse_event(yg, &me);
 							}
-							break;
-						case YUTANI_SPECIAL_REQUEST_PLEASE_CLOSE:
-							if (w) {
-								yutani_msg_buildx_window_close_alloc(response);
-								yutani_msg_buildx_window_close(response, w->wid);
-								pex_send(yg->server, w->owner, response->size, (char *)response);
+						}
+					}
+					break;
+				case YUTANI_MSG_WINDOW_SHOW_MOUSE:
+					{
+						struct yutani_msg_window_show_mouse * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							if (wa->show_mouse == -1) {
+								w->show_mouse = w->default_mouse;
+							} else if (wa->show_mouse < 2) {
+								w->default_mouse = wa->show_mouse;
+								w->show_mouse = wa->show_mouse;
+							} else {
+								w->show_mouse = wa->show_mouse;
 							}
-							break;
-						case YUTANI_SPECIAL_REQUEST_CLIPBOARD:
-							{
-								yutani_msg_buildx_clipboard_alloc(response, yg->clipboard_size);
-								yutani_msg_buildx_clipboard(response, yg->clipboard);
-								pex_send(server, p->source, response->size, (char *)response);
+							if (yg->focused_window == w) {
+								mark_screen(yg, yg->mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
 							}
-							break;
-						case YUTANI_SPECIAL_REQUEST_RELOAD:
-							{
-								yg->reload_renderer = 1;
+						}
+					}
+					break;
+				case YUTANI_MSG_WINDOW_RESIZE_START:
+					{
+						struct yutani_msg_window_resize_start * wa = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wa->wid);
+						if (w) {
+							if (yg->focused_window == w && !yg->resizing_window) {
+								yg->resizing_window = w;
+								yg->resizing_button = YUTANI_MOUSE_BUTTON_LEFT; /* XXX Uh, what if we used something else */
+								mouse_start_resize(yg, wa->direction);
 							}
-							break;
-						default:
-							TRACE("Unknown special request type: 0x%x", sr->request);
-							break;
+						}
 					}
+					break;
+				case YUTANI_MSG_SPECIAL_REQUEST:
+					{
+						struct yutani_msg_special_request * sr = (void *)m->data;
+						yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)sr->wid);
+						switch (sr->request) {
+							case YUTANI_SPECIAL_REQUEST_MAXIMIZE:
+								if (w) {
+									if (w->tiled) {
+										window_untile(yg,w);
+										window_move(yg,w,w->untiled_left,w->untiled_top);
+									} else {
+										window_tile(yg, w, 1, 1, 0, 0);
+									}
+								}
+								break;
+							case YUTANI_SPECIAL_REQUEST_PLEASE_CLOSE:
+								if (w) {
+									yutani_msg_buildx_window_close_alloc(response);
+									yutani_msg_buildx_window_close(response, w->wid);
+									pex_send(yg->server, w->owner, response->size, (char *)response);
+								}
+								break;
+							case YUTANI_SPECIAL_REQUEST_CLIPBOARD:
+								{
+									yutani_msg_buildx_clipboard_alloc(response, yg->clipboard_size);
+									yutani_msg_buildx_clipboard(response, yg->clipboard);
+									pex_send(server, p->source, response->size, (char *)response);
+								}
+								break;
+							case YUTANI_SPECIAL_REQUEST_RELOAD:
+								{
+									yg->reload_renderer = 1;
+								}
+								break;
+							default:
+								TRACE("Unknown special request type: 0x%x", sr->request);
+								break;
+						}
 
-				}
-				break;
-			case YUTANI_MSG_CLIPBOARD:
-				{
-					struct yutani_msg_clipboard * cb = (void *)m->data;
-					yg->clipboard_size = min(cb->size, 511);
-					memcpy(yg->clipboard, cb->content, yg->clipboard_size);
-					yg->clipboard[yg->clipboard_size] = '\0';
-					TRACE("Copied text to clipbard (size=%d)", yg->clipboard_size);
-				}
-				break;
-			default:
-				{
-					TRACE("Unknown type: 0x%8x", m->type);
-				}
-				break;
+					}
+					break;
+				case YUTANI_MSG_CLIPBOARD:
+					{
+						struct yutani_msg_clipboard * cb = (void *)m->data;
+						yg->clipboard_size = min(cb->size, 511);
+						memcpy(yg->clipboard, cb->content, yg->clipboard_size);
+						yg->clipboard[yg->clipboard_size] = '\0';
+						TRACE("Copied text to clipbard (size=%d)", yg->clipboard_size);
+					}
+					break;
+				default:
+					{
+						TRACE("Unknown type: 0x%8x", m->type);
+					}
+					break;
+			}
+
+			m = (yutani_msg_t *)((char *)m + m->size);
 		}
 		free(p);
 	}
@@ -46,6 +46,14 @@ static int copy_file(char * source, char * dest, int mode,int uid, int gid) {
 
 	//fprintf(stderr, "%d bytes to copy\n", length);
 
+	/* Have the kernel move the data, without bouncing it through us */
+	while (length > 0) {
+		ssize_t r = copy_file_range(s_fd, NULL, d_fd, NULL, length, 0);
+		if (r <= 0) break;
+		length -= r;
+	}
+
+	/* Or do it ourselves if that didn't work out */
 	char buf[CHUNK_SIZE];
 
 	while (length > 0) {
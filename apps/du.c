@@ -5,25 +5,47 @@
  *
  * du - calculate file size usage
  *
+ * Files with more than one link are remembered by inode so each
+ * is only counted once, however many names it has.
+ *
+ * With -j, the subdirectories of each directory named on the
+ * command line are handed out to a pool of worker threads. Each
+ * worker collects its output in a buffer, and the buffers are
+ * printed in directory order once they are all done, so the
+ * output is the same as without -j.
+ *
  * TODO: Should use st_blocks, but we don't set that in the kernel yet?
  *
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 
+#include <toaru/hashmap.h>
+
+#define MAX_WORKERS 16
+
 static int show_total = 0;
 static int human = 0;
 static int all = 1;
-static int is_arg = 0;
+static int workers = 1;
+
+/* Output collected by a worker until it can be printed in order */
+struct output {
+	char * buf;
+	size_t len;
+	size_t size;
+};
 
-static uint64_t count_thing(char * tmp);
+static uint64_t count_thing(char * tmp, int is_arg, struct output * out);
 
 static int print_human_readable_size(char * _out, size_t s) {
 	if (s >= 1<<20) {
@@ -37,8 +59,8 @@ static int print_human_readable_size(char * _out, size_t s) {
 	}
 }
 
-static void print_size(uint64_t size, char * name) {
-	char sizes[8];
+static void print_size(uint64_t size, char * name, struct output * out) {
+	char sizes[24];
 	if (!human) {
 		sprintf(sizes, "%-7llu", size/1024LLU);
 	} else {
@@ -47,49 +69,167 @@ static void print_size(uint64_t size, char * name) {
 	if (strlen(name) > 2 && name[0] == '/' && name[1] == '/') {
 		name = &name[1];
 	}
-	fprintf(stdout, "%7s %s\n", sizes, name);
+	if (!out) {
+		fprintf(stdout, "%7s %s\n", sizes, name);
+		return;
+	}
+	size_t need = strlen(sizes) + strlen(name) + 10;
+	if (out->len + need > out->size) {
+		out->size = (out->size + need) * 2;
+		out->buf = realloc(out->buf, out->size);
+	}
+	out->len += sprintf(out->buf + out->len, "%7s %s\n", sizes, name);
+}
+
+/* Inodes with several links we've already counted {{{ */
+
+static hashmap_t * seen_inodes = NULL;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int already_counted(struct stat * statbuf) {
+	if (statbuf->st_nlink < 2 || S_ISDIR(statbuf->st_mode)) return 0;
+	void * key = (void *)(uintptr_t)(((uint32_t)statbuf->st_dev << 16) | statbuf->st_ino);
+	int out = 1;
+	pthread_mutex_lock(&seen_lock);
+	if (!hashmap_has(seen_inodes, key)) {
+		hashmap_set(seen_inodes, key, (void *)1);
+		out = 0;
+	}
+	pthread_mutex_unlock(&seen_lock);
+	return out;
 }
 
-static uint64_t count_directory(char * source) {
+/* }}} */
+
+static char * join_path(char * dir, char * name) {
+	char * out = malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(out, "%s/%s", dir, name);
+	return out;
+}
+
+static int skip_entry(struct dirent * ent) {
+	return !strcmp(ent->d_name,".") || !strcmp(ent->d_name,"..");
+}
+
+static uint64_t count_directory(char * source, int is_arg, struct output * out) {
 	DIR * dirp = opendir(source);
 	if (dirp == NULL) {
 		//fprintf(stderr, "could not open %s\n", source);
 		return 0;
 	}
 
-	int was_arg = is_arg;
-	is_arg = 0;
-
 	uint64_t total = 0;
 
-	struct dirent * ent = readdir(dirp);
-	while (ent != NULL) {
-		if (!strcmp(ent->d_name,".") || !strcmp(ent->d_name,"..")) {
-			ent = readdir(dirp);
+	struct dirent * ent;
+	while ((ent = readdir(dirp))) {
+		if (skip_entry(ent)) continue;
+		char * tmp = join_path(source, ent->d_name);
+		total += count_thing(tmp, 0, out);
+		free(tmp);
+	}
+	closedir(dirp);
+
+	if (all || is_arg) {
+		print_size(total, source, out);
+	}
+
+	return total;
+}
+
+/* Parallel walk of the top of a tree {{{ */
+
+struct job {
+	char * path;
+	uint64_t total;
+	struct output out;
+};
+
+static struct job * jobs;
+static size_t job_count;
+static size_t next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void * worker(void * arg) {
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&job_lock);
+		size_t i = next_job++;
+		pthread_mutex_unlock(&job_lock);
+		if (i >= job_count) return NULL;
+		jobs[i].total = count_directory(jobs[i].path, 0, &jobs[i].out);
+	}
+}
+
+static uint64_t count_directory_parallel(char * source) {
+	DIR * dirp = opendir(source);
+	if (dirp == NULL) return 0;
+
+	size_t space = 0;
+	jobs = NULL;
+	job_count = 0;
+	next_job = 0;
+
+	uint64_t total = 0;
+	struct dirent * ent;
+	while ((ent = readdir(dirp))) {
+		if (skip_entry(ent)) continue;
+		char * tmp = join_path(source, ent->d_name);
+		struct stat statbuf;
+		if (lstat(tmp, &statbuf) < 0) {
+			free(tmp);
 			continue;
 		}
-		char tmp[strlen(source)+strlen(ent->d_name)+2];
-		sprintf(tmp, "%s/%s", source, ent->d_name);
-		total += count_thing(tmp);
-		ent = readdir(dirp);
+		if (!S_ISDIR(statbuf.st_mode)) {
+			if (!already_counted(&statbuf)) total += statbuf.st_size;
+			free(tmp);
+			continue;
+		}
+		if (job_count == space) {
+			space = space ? space * 2 : 32;
+			jobs = realloc(jobs, sizeof(struct job) * space);
+		}
+		memset(&jobs[job_count], 0, sizeof(struct job));
+		jobs[job_count].path = tmp;
+		job_count++;
 	}
 	closedir(dirp);
 
-	if (all || was_arg) {
-		print_size(total, source);
+	int nthreads = workers < (int)job_count ? workers : (int)job_count;
+	pthread_t threads[MAX_WORKERS];
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (size_t i = 0; i < job_count; ++i) {
+		total += jobs[i].total;
+		if (jobs[i].out.len) fwrite(jobs[i].out.buf, 1, jobs[i].out.len, stdout);
+		free(jobs[i].out.buf);
+		free(jobs[i].path);
 	}
+	free(jobs);
 
+	print_size(total, source, NULL);
 	return total;
 }
 
-static uint64_t count_thing(char * tmp) {
+/* }}} */
+
+static uint64_t count_thing(char * tmp, int is_arg, struct output * out) {
 	struct stat statbuf;
-	lstat(tmp,&statbuf);
+	if (lstat(tmp,&statbuf) < 0) {
+		if (is_arg) fprintf(stderr, "du: %s: %s\n", tmp, strerror(errno));
+		return 0;
+	}
 	if (S_ISDIR(statbuf.st_mode)) {
-		return count_directory(tmp);
+		if (is_arg && workers > 1) return count_directory_parallel(tmp);
+		return count_directory(tmp, is_arg, out);
 	} else {
+		if (already_counted(&statbuf)) return 0;
 		if (is_arg) {
-			print_size(statbuf.st_size, tmp);
+			print_size(statbuf.st_size, tmp, out);
 		}
 		return statbuf.st_size;
 	}
@@ -98,7 +238,7 @@ static uint64_t count_thing(char * tmp) {
 
 int main(int argc, char * argv[]) {
 	int opt;
-	while ((opt = getopt(argc, argv, "hsc")) != -1) {
+	while ((opt = getopt(argc, argv, "hscj:")) != -1) {
 		switch (opt) {
 			case 'h': /* human readable */
 				human = 1;
@@ -109,8 +249,13 @@ int main(int argc, char * argv[]) {
 			case 's': /* summary */
 				all = 0;
 				break;
+			case 'j': /* worker threads */
+				workers = atoi(optarg);
+				if (workers < 1) workers = 1;
+				if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+				break;
 			default:
-				fprintf(stderr, "rm: unrecognized option '%c'\n", opt);
+				fprintf(stderr, "du: unrecognized option '%c'\n", opt);
 				break;
 		}
 	}
@@ -118,15 +263,15 @@ int main(int argc, char * argv[]) {
 	int ret = 0;
 	uint64_t total = 0;
 
+	seen_inodes = hashmap_create_int(64);
+
 	for (int i = optind; i < argc; ++i) {
-		is_arg = 1;
-		total += count_thing(argv[i]);
+		total += count_thing(argv[i], 1, NULL);
 	}
 
 	if (show_total) {
-		print_size(total, "total");
+		print_size(total, "total", NULL);
 	}
 
 	return ret;
 }
-
@@ -5,11 +5,18 @@
  *
  * fetch - Retreive documents from HTTP servers.
  *
+ * Several URLs may be given. Consecutive URLs on the same server
+ * share one connection, and their requests are pipelined: they
+ * are all sent up front and the responses read back in order.
+ * Bodies (plain or chunked) are written to the output straight
+ * from the connection buffer.
  */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <signal.h>
 #include <time.h>
 #include <sys/time.h>
 #include <termios.h>
@@ -18,6 +25,8 @@
 #include <toaru/hashmap.h>
 
 #define SIZE 512
+#define BUF_SIZE 0x10000
+#define PIPELINE_DEPTH 8
 #define BOUNDARY "------ToaruOSFetchUploadBoundary"
 
 struct http_req {
@@ -36,6 +45,7 @@ struct {
 	int show_progress;
 	size_t content_length;
 	size_t size;
+	size_t last_progress;
 	struct timeval start;
 	int calculate_output;
 	int slow_upload;
@@ -67,10 +77,9 @@ void parse_url(char * d, struct http_req * r) {
 #define bar_perc "||||||||||||||||||||"
 #define bar_spac "                    "
 void print_progress(int force) {
-	static uint64_t last_size = 0;
 	if (!fetch_options.show_progress) return;
-	if (!force && (last_size + 102400 > fetch_options.size)) return;
-	last_size = fetch_options.size;
+	if (!force && (fetch_options.last_progress + 102400 > fetch_options.size)) return;
+	fetch_options.last_progress = fetch_options.size;
 	struct timeval now;
 	gettimeofday(&now, NULL);
 	fprintf(stderr,"\033[?25l\033[G%6dkB",(int)fetch_options.size/1024);
@@ -105,7 +114,7 @@ int usage(char * argv[]) {
 	fprintf(stderr,
 			"fetch - download files over HTTP\n"
 			"\n"
-			"usage: %s [-hOvmp?] [-c cookie] [-o file] [-u file] [-s speed] URL\n"
+			"usage: %s [-hOvmp?] [-c cookie] [-o file] [-u file] [-s speed] URL...\n"
 			"\n"
 			" -h     \033[3mshow headers\033[0m\n"
 			" -O     \033[3msave the file based on the filename in the URL\033[0m\n"
@@ -140,34 +149,158 @@ int collect_password(char * password) {
 	return 0;
 }
 
-void read_http_line(char * buf, FILE * f) {
-	memset(buf, 0x00, 256);
+/* Connections {{{ */
 
-	fgets(buf, 255, f);
-	char * _r = strchr(buf, '\r');
-	if (_r) {
-		*_r = '\0';
+struct connection {
+	int fd;
+	FILE * f;
+	char buf[BUF_SIZE];
+	size_t start;
+	size_t end;
+};
+
+static int connection_open(struct connection * c, char * domain) {
+	char file[SIZE + 16];
+	sprintf(file, "/dev/net/%s", domain);
+	c->f = fopen(file, "r+");
+	if (!c->f) return -1;
+	c->fd = fileno(c->f);
+	c->start = 0;
+	c->end = 0;
+	return 0;
+}
+
+static void connection_close(struct connection * c) {
+	if (c->f) fclose(c->f);
+	c->f = NULL;
+	c->fd = -1;
+}
+
+/* Read more from the server into the buffer; returns 0 once the connection is closed */
+static int connection_fill(struct connection * c) {
+	if (c->start == c->end) {
+		c->start = c->end = 0;
+	} else if (c->end == BUF_SIZE) {
+		memmove(c->buf, c->buf + c->start, c->end - c->start);
+		c->end -= c->start;
+		c->start = 0;
 	}
-	if (!_r) {
-		_r = strchr(buf, '\n'); /* that's not right, but, whatever */
-		if (_r) {
-			*_r = '\0';
+	ssize_t r = read(c->fd, c->buf + c->end, BUF_SIZE - c->end);
+	if (r <= 0) return 0;
+	c->end += r;
+	return r;
+}
+
+/*
+ * Read one header line, without its line ending, into `out`.
+ * Overlong lines are cut short. Returns -1 if the connection closed first.
+ */
+static int read_http_line(struct connection * c, char * out, size_t size) {
+	size_t scanned = c->start;
+	while (1) {
+		char * nl = memchr(c->buf + scanned, '\n', c->end - scanned);
+		if (nl) {
+			size_t len = nl - (c->buf + c->start);
+			if (len && c->buf[c->start + len - 1] == '\r') len--;
+			if (len > size - 1) len = size - 1;
+			memcpy(out, c->buf + c->start, len);
+			out[len] = '\0';
+			c->start = nl + 1 - c->buf;
+			return 0;
+		}
+		if (c->end - c->start == BUF_SIZE) {
+			/* No newline anywhere in a full buffer; not HTTP */
+			return -1;
 		}
+		scanned = c->end;
+		size_t offset = c->start;
+		if (!connection_fill(c)) return -1;
+		scanned -= offset - c->start;
+	}
+}
+
+static int write_all(int fd, const char * buf, size_t len) {
+	while (len) {
+		ssize_t r = write(fd, buf, len);
+		if (r <= 0) return -1;
+		buf += r;
+		len -= r;
 	}
+	return 0;
 }
 
+/* }}} */
+
 void bad_response(void) {
 	fprintf(stderr, "Bad response.\n");
 	exit(1);
 }
 
-int http_fetch(FILE * f) {
+/*
+ * Copy up to `length` bytes of body to the output, straight from the
+ * connection buffer. With until_close set, copy until the server
+ * closes the connection instead.
+ */
+static int copy_body(struct connection * c, int out, size_t length, int until_close) {
+	while (until_close || length) {
+		if (c->start == c->end && !connection_fill(c)) {
+			return until_close ? 0 : -1;
+		}
+		size_t n = c->end - c->start;
+		if (!until_close && n > length) n = length;
+		if (out >= 0 && write_all(out, c->buf + c->start, n) < 0) {
+			fprintf(stderr, "Failed to write output.\n");
+			exit(1);
+		}
+		c->start += n;
+		length -= until_close ? 0 : n;
+		fetch_options.size += n;
+		print_progress(0);
+		if (fetch_options.machine_readable && fetch_options.content_length) {
+			fprintf(stdout,"%d %d\n",(int)fetch_options.size, (int)fetch_options.content_length);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
+
+static int copy_chunked(struct connection * c, int out) {
+	char line[256];
+	while (1) {
+		if (read_http_line(c, line, sizeof(line)) < 0) return -1;
+		size_t length = strtoul(line, NULL, 16);
+		if (!length) break;
+		if (copy_body(c, out, length, 0) < 0) return -1;
+		/* CRLF after each chunk */
+		if (read_http_line(c, line, sizeof(line)) < 0) return -1;
+	}
+	/* Trailers, up to a blank line */
+	do {
+		if (read_http_line(c, line, sizeof(line)) < 0) return -1;
+	} while (*line);
+	return 0;
+}
+
+/*
+ * Read one response from the connection and write its body to `out`.
+ *
+ * Returns 0 on success, 1 if the server answered with something other
+ * than 200 (the body is skipped), and -1 if the connection closed
+ * before a response arrived. *keep_alive is cleared when the
+ * connection can't be used for another request.
+ */
+int http_fetch(struct connection * c, int out, int * keep_alive) {
 	hashmap_t * headers = hashmap_create(10);
+	int ret = 0;
+
+	fetch_options.size = 0;
+	fetch_options.content_length = 0;
+	fetch_options.last_progress = 0;
 
 	/* Parse response */
 	{
 		char buf[256];
-		read_http_line(buf, f);
+		if (read_http_line(c, buf, sizeof(buf)) < 0) return -1;
 
 		char * elements[3];
 
@@ -182,16 +315,22 @@ int http_fetch(FILE * f) {
 		*elements[2] = '\0';
 		elements[2]++;
 
+		if (strcmp(elements[0], "HTTP/1.1")) {
+			/* Older servers close the connection after each response */
+			*keep_alive = 0;
+		}
+
 		if (strcmp(elements[1], "200")) {
 			fprintf(stderr, "Bad response code: %s\n", elements[1]);
-			return 1;
+			ret = 1;
+			out = -1;
 		}
 	}
 
 	/* Parse headers */
 	while (1) {
-		char buf[256];
-		read_http_line(buf, f);
+		char buf[1024];
+		if (read_http_line(c, buf, sizeof(buf)) < 0) bad_response();
 
 		if (!*buf) {
 			break;
@@ -204,6 +343,11 @@ int http_fetch(FILE * f) {
 		*value = '\0';
 		value += 2;
 
+		/* Header names are case-insensitive */
+		for (char * n = name; *n; ++n) {
+			*n = tolower(*n);
+		}
+
 		hashmap_set(headers, name, strdup(value));
 	}
 
@@ -217,31 +361,140 @@ int http_fetch(FILE * f) {
 		free(hash_keys);
 	}
 
-	/* determine how many bytes we should read now */
-	if (!hashmap_has(headers, "Content-Length")) {
-		fprintf(stderr, "Don't know how much to read.\n");
-		return 1;
+	char * connection = hashmap_get(headers, "connection");
+	if (connection && !strcmp(connection, "close")) {
+		*keep_alive = 0;
 	}
 
-	int bytes_to_read = atoi(hashmap_get(headers, "Content-Length"));
-	fetch_options.content_length = bytes_to_read;
-
 	gettimeofday(&fetch_options.start, NULL);
 
-	while (bytes_to_read > 0) {
-		char buf[1024];
-		size_t r = fread(buf, 1, bytes_to_read < 1024 ? bytes_to_read : 1024, f);
-		fwrite(buf, 1, r, fetch_options.out);
-		fetch_options.size += r;
-		print_progress(0);
-		if (fetch_options.machine_readable && fetch_options.content_length) {
-			fprintf(stdout,"%d %d\n",(int)fetch_options.size, (int)fetch_options.content_length);
-		}
-		bytes_to_read -= r;
+	char * encoding = hashmap_get(headers, "transfer-encoding");
+	if (encoding && strstr(encoding, "chunked")) {
+		if (copy_chunked(c, out) < 0) bad_response();
+	} else if (hashmap_has(headers, "content-length")) {
+		fetch_options.content_length = atoi(hashmap_get(headers, "content-length"));
+		if (copy_body(c, out, fetch_options.content_length, 0) < 0) bad_response();
+	} else {
+		/* No length given; the body runs until the server hangs up */
+		copy_body(c, out, 0, 1);
+		*keep_alive = 0;
 	}
 	print_progress(1);
 
-	return 0;
+	hashmap_free(headers);
+	free(headers);
+
+	return ret;
+}
+
+static int send_request(struct connection * c, struct http_req * r, int last) {
+	char tmp[SIZE * 3 + 1024];
+	int len;
+	if (fetch_options.cookie) {
+		len = snprintf(tmp, sizeof(tmp),
+			"GET /%s HTTP/1.1\r\n"
+			"User-Agent: curl/7.35.0\r\n"
+			"Host: %s\r\n"
+			"Accept: */*\r\n"
+			"Cookie: %s\r\n"
+			"Connection: %s\r\n"
+			"\r\n", r->path, r->domain, fetch_options.cookie, last ? "close" : "keep-alive");
+	} else {
+		len = snprintf(tmp, sizeof(tmp),
+			"GET /%s HTTP/1.1\r\n"
+			"User-Agent: curl/7.35.0\r\n"
+			"Host: %s\r\n"
+			"Accept: */*\r\n"
+			"Connection: %s\r\n"
+			"\r\n", r->path, r->domain, last ? "close" : "keep-alive");
+	}
+	return write_all(c->fd, tmp, len);
+}
+
+static int open_output(struct http_req * r) {
+	if (fetch_options.calculate_output) {
+		char * x = strrchr(r->path, '/');
+		const char * name = x ? x + 1 : r->path;
+		FILE * out = fopen(name, "w+");
+		if (!out) {
+			fprintf(stderr, "Can't open %s for writing.\n", name);
+			return -1;
+		}
+		fetch_options.out = out;
+	}
+	return fileno(fetch_options.out);
+}
+
+static void close_output(void) {
+	if (fetch_options.calculate_output) {
+		fclose(fetch_options.out);
+		fetch_options.out = NULL;
+	}
+}
+
+/*
+ * Fetch a run of URLs on the same server over one connection,
+ * sending up to PIPELINE_DEPTH requests before reading the
+ * responses back in order. If the server closes the connection,
+ * the rest are sent again on a new one.
+ */
+static int fetch_group(struct http_req * reqs, int count) {
+	struct connection * c = malloc(sizeof(struct connection));
+	c->f = NULL;
+	c->fd = -1;
+
+	int status = 0;
+	int sent = 0;
+	int done = 0;
+	int retried = -1;
+
+	while (done < count) {
+		if (c->fd < 0) {
+			if (connection_open(c, reqs[done].domain) < 0) {
+				fprintf(stderr, "Nope.\n");
+				return 1;
+			}
+			sent = done;
+		}
+
+		while (sent < count && sent - done < PIPELINE_DEPTH) {
+			if (send_request(c, &reqs[sent], sent == count - 1) < 0) break;
+			sent++;
+		}
+
+		int out = open_output(&reqs[done]);
+		if (out < 0) return 1;
+
+		int keep_alive = 1;
+		int r = http_fetch(c, out, &keep_alive);
+		close_output();
+
+		if (r < 0) {
+			/* Closed before we got an answer; try once more on a fresh connection */
+			connection_close(c);
+			if (retried == done) {
+				fprintf(stderr, "Connection closed by server.\n");
+				return 1;
+			}
+			retried = done;
+			continue;
+		}
+
+		if (r) status = 1;
+		done++;
+
+		if (fetch_options.show_progress) {
+			fprintf(stderr,"\n");
+		}
+
+		if (!keep_alive) {
+			connection_close(c);
+		}
+	}
+
+	connection_close(c);
+	free(c);
+	return status;
 }
 
 int main(int argc, char * argv[]) {
@@ -286,39 +539,43 @@ int main(int argc, char * argv[]) {
 		return usage(argv);
 	}
 
-	struct http_req my_req;
-	parse_url(argv[optind], &my_req);
-
-	char file[100];
-	sprintf(file, "/dev/net/%s", my_req.domain);
+	/* Pipelined requests can land on a connection the server has
+	 * already closed; those are sent again, so don't die over it. */
+	signal(SIGPIPE, SIG_IGN);
 
-	if (fetch_options.calculate_output) {
-		char * tmp = strdup(my_req.path);
-		char * x = strrchr(tmp,'/');
-		if (x) {
-			tmp = x + 1;
-		}
-		fetch_options.output_file = tmp;
+	int count = argc - optind;
+	struct http_req * reqs = malloc(sizeof(struct http_req) * count);
+	for (int i = 0; i < count; ++i) {
+		parse_url(argv[optind + i], &reqs[i]);
 	}
 
 	fetch_options.out = stdout;
-	if (fetch_options.output_file) {
+	if (fetch_options.output_file && !fetch_options.calculate_output) {
 		fetch_options.out = fopen(fetch_options.output_file, "w+");
+		if (!fetch_options.out) {
+			fprintf(stderr, "Can't open %s for writing.\n", fetch_options.output_file);
+			return 1;
+		}
 	}
-
-	FILE * f = fopen(file,"r+");
-
-	if (!f) {
-		fprintf(stderr, "Nope.\n");
-		return 1;
-	}
+	fflush(stdout);
 
 	if (fetch_options.prompt_password) {
 		fetch_options.password = malloc(100);
 		collect_password(fetch_options.password);
 	}
 
+	int status = 0;
+
 	if (fetch_options.upload_file) {
+		/* Uploads only go to the first URL */
+		struct http_req * my_req = &reqs[0];
+		struct connection * c = malloc(sizeof(struct connection));
+		if (connection_open(c, my_req->domain) < 0) {
+			fprintf(stderr, "Nope.\n");
+			return 1;
+		}
+		FILE * f = c->f;
+
 		FILE * in_file = fopen(fetch_options.upload_file, "r");
 
 		srand(time(NULL));
@@ -355,7 +612,7 @@ int main(int argc, char * argv[]) {
 			"Accept: */*\r\n"
 			"Content-Length: %d\r\n"
 			"Content-Type: multipart/form-data; boundary=" BOUNDARY "%08x\r\n"
-			"\r\n", my_req.path, my_req.domain, (int)out_size, boundary_fuzz);
+			"\r\n", my_req->path, my_req->domain, (int)out_size, boundary_fuzz);
 
 		fprintf(f,"%s",tmp);
 		fprintf(f,
@@ -378,35 +635,34 @@ int main(int argc, char * argv[]) {
 		fprintf(f,"\r\n--" BOUNDARY "%08x--\r\n", boundary_fuzz);
 		fflush(f);
 
-	} else if (fetch_options.cookie) {
-		fprintf(f,
-			"GET /%s HTTP/1.0\r\n"
-			"User-Agent: curl/7.35.0\r\n"
-			"Host: %s\r\n"
-			"Accept: */*\r\n"
-			"Cookie: %s\r\n"
-			"\r\n", my_req.path, my_req.domain, fetch_options.cookie);
 
+		int keep_alive = 0;
+		int out = open_output(my_req);
+		if (out < 0) return 1;
+		status = http_fetch(c, out, &keep_alive) != 0;
+		close_output();
+		connection_close(c);
+
+		if (fetch_options.show_progress) {
+			fprintf(stderr,"\n");
+		}
 	} else {
-		fprintf(f,
-			"GET /%s HTTP/1.0\r\n"
-			"User-Agent: curl/7.35.0\r\n"
-			"Host: %s\r\n"
-			"Accept: */*\r\n"
-			"\r\n", my_req.path, my_req.domain);
+		/* Group consecutive URLs on the same server */
+		for (int i = 0; i < count; ) {
+			int j = i + 1;
+			while (j < count && !strcmp(reqs[j].domain, reqs[i].domain)) j++;
+			if (fetch_group(&reqs[i], j - i)) status = 1;
+			i = j;
+		}
 	}
 
-	http_fetch(f);
-
-	fflush(fetch_options.out);
-
-	if (fetch_options.show_progress) {
-		fprintf(stderr,"\n");
+	if (fetch_options.out) {
+		fflush(fetch_options.out);
 	}
 
 	if (fetch_options.machine_readable) {
 		fprintf(stdout,"done\n");
 	}
 
-	return 0;
+	return status;
 }
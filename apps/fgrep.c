@@ -3,43 +3,561 @@
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2014-2018 K. Lange
  *
- * fgrep - dump grep
+ * fgrep - search for fixed strings
  *
  * Locates strings in files and prints the lines containing them,
  * with extra color identification if stdout is a tty.
+ *
+ * All of the patterns are compiled into one Aho-Corasick automaton,
+ * expanded into a full transition table, so each input byte costs a
+ * single table lookup no matter how many patterns there are. Input
+ * is scanned in large blocks - regular files are mapped whole - and
+ * lines are only reconstructed around matches.
+ *
+ * With several files, a few worker threads search them at once.
+ * Each worker collects its output for a file and prints it when
+ * every file before it is done, so output stays in order.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
-#define LINE_SIZE 4096
+#define READ_BLOCK  0x10000
+#define MAX_WORKERS 8
 
-int main(int argc, char ** argv) {
-	if (argc < 2) {
-		fprintf(stderr, "usage: %s thing-to-grep-for\n", argv[0]);
-		return 1;
-	}
-
-	char * needle = argv[1];
-	char buf[LINE_SIZE];
-	int ret = 1;
-	int is_tty = isatty(STDOUT_FILENO);
-
-	while (fgets(buf, LINE_SIZE, stdin)) {
-		char * found = strstr(buf, needle);
-		if (found) {
-			if (is_tty) {
-				*found = '\0';
-				found += strlen(needle);
-				fprintf(stdout, "%s\033[1;31m%s\033[0m%s", buf, needle, found);
+static int * delta = NULL;  /* state * 256 + byte -> next state (pre-multiplied by 256) */
+static int * match_len = NULL; /* per state: longest pattern ending here, 0 for none */
+static int state_count = 0;
+static int state_space = 0;
+static int match_all = 0;
+
+static int opt_ignore_case = 0;
+static int opt_line_numbers = 0;
+static int opt_count = 0;
+static int opt_list = 0;
+static int opt_recursive = 0;
+static int show_names = -1;
+static int is_tty = 0;
+
+static char ** patterns = NULL;
+static int pattern_count = 0;
+
+static char ** files = NULL;
+static int file_count = 0;
+
+static int found_any = 0;
+static int had_error = 0;
+
+/* Automaton construction {{{ */
+
+static int new_state(void) {
+	if (state_count == state_space) {
+		state_space = state_space ? state_space * 2 : 64;
+		delta = realloc(delta, sizeof(int) * 256 * state_space);
+		match_len = realloc(match_len, sizeof(int) * state_space);
+	}
+	for (int i = 0; i < 256; ++i) {
+		delta[state_count * 256 + i] = -1;
+	}
+	match_len[state_count] = 0;
+	return state_count++;
+}
+
+static void add_pattern(const char * p) {
+	if (!*p) {
+		match_all = 1;
+		return;
+	}
+	int s = 0;
+	int len = 0;
+	for (; *p; p++, len++) {
+		unsigned char c = opt_ignore_case ? tolower((unsigned char)*p) : (unsigned char)*p;
+		if (delta[s * 256 + c] == -1) {
+			int n = new_state();
+			delta[s * 256 + c] = n;
+		}
+		s = delta[s * 256 + c];
+	}
+	if (match_len[s] < len) match_len[s] = len;
+}
+
+/*
+ * Fill in failure transitions breadth-first, turning the trie into
+ * a complete DFA. A state's match length also covers any shorter
+ * pattern that ends at the same place.
+ */
+static void build_automaton(void) {
+	int * fail = malloc(sizeof(int) * state_count);
+	int * queue = malloc(sizeof(int) * state_count);
+	int head = 0, tail = 0;
+
+	for (int c = 0; c < 256; ++c) {
+		int n = delta[c];
+		if (n == -1) {
+			delta[c] = 0;
+		} else {
+			fail[n] = 0;
+			queue[tail++] = n;
+		}
+	}
+
+	while (head < tail) {
+		int s = queue[head++];
+		if (match_len[fail[s]] > match_len[s]) match_len[s] = match_len[fail[s]];
+		for (int c = 0; c < 256; ++c) {
+			int n = delta[s * 256 + c];
+			if (n == -1) {
+				delta[s * 256 + c] = delta[fail[s] * 256 + c];
 			} else {
-				fprintf(stdout, "%s", buf);
+				fail[n] = delta[fail[s] * 256 + c];
+				queue[tail++] = n;
+			}
+		}
+	}
+
+	for (int s = 0; s < state_count; ++s) {
+		if (opt_ignore_case) {
+			for (int c = 'A'; c <= 'Z'; ++c) {
+				delta[s * 256 + c] = delta[s * 256 + tolower(c)];
 			}
-			ret = 0;
 		}
+		/* Matches never span lines */
+		delta[s * 256 + '\n'] = 0;
+		for (int c = 0; c < 256; ++c) {
+			delta[s * 256 + c] *= 256;
+		}
+	}
+
+	free(fail);
+	free(queue);
+}
+
+/* }}} */
+
+/* Per-file output {{{ */
+
+struct output {
+	char * data;
+	size_t len;
+	size_t size;
+};
+
+static void out_write(struct output * out, const char * data, size_t len) {
+	if (out->len + len > out->size) {
+		while (out->len + len > out->size) {
+			out->size = out->size ? out->size * 2 : 4096;
+		}
+		out->data = realloc(out->data, out->size);
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+static void out_str(struct output * out, const char * str) {
+	out_write(out, str, strlen(str));
+}
+
+static void out_prefix(struct output * out, const char * name, unsigned long line) {
+	char tmp[32];
+	if (show_names) {
+		if (is_tty) out_str(out, "\033[35m");
+		out_str(out, name);
+		if (is_tty) out_str(out, "\033[0m");
+		out_str(out, ":");
+	}
+	if (opt_line_numbers) {
+		snprintf(tmp, sizeof(tmp), is_tty ? "\033[32m%lu\033[0m:" : "%lu:", line);
+		out_str(out, tmp);
+	}
+}
+
+/*
+ * Write a matching line, coloring every match on a tty. The line is
+ * rescanned; where a match ends, the longest pattern ending there
+ * says how far back the highlight goes.
+ */
+static void out_line(struct output * out, const char * line, const char * end) {
+	if (!is_tty || match_all) {
+		out_write(out, line, end - line);
+		out_write(out, "\n", 1);
+		return;
+	}
+
+	const char * written = line;
+	const char * color_from = NULL;
+	const char * color_to = NULL;
+	int state = 0;
+	for (const char * p = line; p < end; ++p) {
+		state = delta[state + (unsigned char)*p];
+		int len = match_len[state >> 8];
+		if (!len) continue;
+		const char * start = p + 1 - len;
+		if (color_to && start <= color_to) {
+			/* Overlaps the current highlight; a longer match may also start earlier */
+			if (start < color_from) color_from = start < written ? written : start;
+			color_to = p + 1;
+			continue;
+		}
+		if (color_to) {
+			out_write(out, written, color_from - written);
+			out_str(out, "\033[1;31m");
+			out_write(out, color_from, color_to - color_from);
+			out_str(out, "\033[0m");
+			written = color_to;
+		}
+		color_from = start;
+		color_to = p + 1;
+	}
+	if (color_to) {
+		out_write(out, written, color_from - written);
+		out_str(out, "\033[1;31m");
+		out_write(out, color_from, color_to - color_from);
+		out_str(out, "\033[0m");
+		written = color_to;
+	}
+	out_write(out, written, end - written);
+	out_write(out, "\n", 1);
+}
+
+/* }}} */
+
+/* Searching {{{ */
+
+struct search {
+	const char * name;
+	struct output out;
+	unsigned long line;     /* line number of `counted` */
+	const char * counted;   /* newlines before here are in `line` */
+	unsigned long matches;
+	int done;               /* -l: stop at the first match */
+};
+
+static void count_lines(struct search * s, const char * upto) {
+	const char * p = s->counted;
+	while (p < upto && (p = memchr(p, '\n', upto - p))) {
+		s->line++;
+		p++;
+	}
+	s->counted = upto;
+}
+
+static void matched_line(struct search * s, const char * line, const char * end) {
+	s->matches++;
+	if (opt_list) {
+		out_str(&s->out, s->name);
+		out_str(&s->out, "\n");
+		s->done = 1;
+		return;
+	}
+	if (opt_count) return;
+	if (opt_line_numbers) count_lines(s, line);
+	out_prefix(&s->out, s->name, s->line);
+	out_line(&s->out, line, end);
+}
+
+/*
+ * Search a block made of whole lines (the last one may be missing
+ * its newline at the end of the input).
+ */
+static void search_block(struct search * s, const char * buf, size_t len) {
+	const char * end = buf + len;
+	const char * p = buf;
+	const char * line_start = buf;
+	s->counted = buf;
+
+	while (p < end && !s->done) {
+		const char * line_end;
+		if (match_all) {
+			line_end = memchr(p, '\n', end - p);
+		} else {
+			int state = 0;
+			while (p < end && !match_len[(state = delta[state + (unsigned char)*p]) >> 8]) p++;
+			if (p == end) break;
+			/* Back up to the start of the line holding the match */
+			const char * nl = memrchr(line_start, '\n', p - line_start);
+			line_start = nl ? nl + 1 : line_start;
+			line_end = memchr(p, '\n', end - p);
+		}
+		if (!line_end) line_end = end;
+		matched_line(s, line_start, line_end);
+		p = line_start = line_end + 1;
 	}
 
-	return ret;
+	if (opt_line_numbers) count_lines(s, end);
 }
 
+static int search_fd(struct search * s, int fd) {
+	struct stat st;
+	if (fd != STDIN_FILENO && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		char * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			search_block(s, map, st.st_size);
+			munmap(map, st.st_size);
+			return 0;
+		}
+	}
+
+	/* Not mappable: read blocks, carrying any partial last line over to the next one */
+	size_t size = READ_BLOCK;
+	size_t have = 0;
+	char * buf = malloc(size);
+	while (!s->done) {
+		if (have == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+		ssize_t r = read(fd, buf + have, size - have);
+		if (r < 0) {
+			free(buf);
+			return -1;
+		}
+		if (r == 0) {
+			if (have) search_block(s, buf, have);
+			break;
+		}
+		char * last = memrchr(buf + have, '\n', r);
+		have += r;
+		if (!last) continue;
+		size_t whole = last + 1 - buf;
+		search_block(s, buf, whole);
+		memmove(buf, buf + whole, have - whole);
+		have -= whole;
+	}
+	free(buf);
+	return 0;
+}
+
+static void search_file(struct search * s, const char * path) {
+	s->name = path;
+	s->line = 1;
+	s->matches = 0;
+	s->done = 0;
+
+	int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0 || search_fd(s, fd) < 0) {
+		fprintf(stderr, "fgrep: %s: %s\n", path, strerror(errno));
+		had_error = 1;
+	}
+	if (fd > STDIN_FILENO) close(fd);
+
+	if (opt_count) {
+		char tmp[32];
+		if (show_names) {
+			out_str(&s->out, path);
+			out_str(&s->out, ":");
+		}
+		snprintf(tmp, sizeof(tmp), "%lu\n", s->matches);
+		out_str(&s->out, tmp);
+	}
+	if (s->matches) found_any = 1;
+}
+
+/* }}} */
+
+/* Workers {{{ */
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static int next_file = 0;
+static int next_print = 0;
+
+static void * worker(void * arg) {
+	struct search s = {0};
+	while (1) {
+		pthread_mutex_lock(&work_lock);
+		int i = next_file++;
+		pthread_mutex_unlock(&work_lock);
+		if (i >= file_count) break;
+
+		s.out.len = 0;
+		search_file(&s, files[i]);
+
+		pthread_mutex_lock(&work_lock);
+		while (next_print != i) {
+			pthread_cond_wait(&work_cond, &work_lock);
+		}
+		pthread_mutex_unlock(&work_lock);
+
+		if (s.out.len) fwrite(s.out.data, 1, s.out.len, stdout);
+
+		pthread_mutex_lock(&work_lock);
+		next_print++;
+		pthread_cond_broadcast(&work_cond);
+		pthread_mutex_unlock(&work_lock);
+	}
+	free(s.out.data);
+	return NULL;
+}
+
+/* }}} */
+
+static void add_file(const char * path) {
+	files = realloc(files, sizeof(char *) * (file_count + 1));
+	files[file_count++] = strdup(path);
+}
+
+static void collect(const char * path, int is_arg) {
+	struct stat st;
+	if ((is_arg ? stat(path, &st) : lstat(path, &st)) < 0) {
+		fprintf(stderr, "fgrep: %s: %s\n", path, strerror(errno));
+		had_error = 1;
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		/* Only follow symlinks named on the command line */
+		if (!S_ISLNK(st.st_mode)) add_file(path);
+		return;
+	}
+	if (!opt_recursive) {
+		fprintf(stderr, "fgrep: %s: Is a directory\n", path);
+		return;
+	}
+
+	DIR * dirp = opendir(path);
+	if (!dirp) {
+		fprintf(stderr, "fgrep: %s: %s\n", path, strerror(errno));
+		had_error = 1;
+		return;
+	}
+	struct dirent * ent;
+	while ((ent = readdir(dirp))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+		size_t len = strlen(path);
+		char tmp[len + strlen(ent->d_name) + 2];
+		const char * sep = (len && path[len-1] == '/') ? "" : "/";
+		snprintf(tmp, sizeof(tmp), "%.*s%s%s", (int)len, path, sep, ent->d_name);
+		collect(tmp, 0);
+	}
+	closedir(dirp);
+}
+
+/* Each line of a pattern argument is a pattern of its own */
+static void add_patterns(char * arg) {
+	char * save;
+	if (!*arg) {
+		patterns = realloc(patterns, sizeof(char *) * (pattern_count + 1));
+		patterns[pattern_count++] = arg;
+		return;
+	}
+	for (char * p = strtok_r(arg, "\n", &save); p; p = strtok_r(NULL, "\n", &save)) {
+		patterns = realloc(patterns, sizeof(char *) * (pattern_count + 1));
+		patterns[pattern_count++] = p;
+	}
+}
+
+static void show_usage(char * argv[]) {
+	fprintf(stderr,
+			"fgrep - search for fixed strings\n"
+			"\n"
+			"usage: %s [-icHhlnr] [-j workers] [-e pattern]... [pattern] [file...]\n"
+			"\n"
+			" -e     \033[3madd a pattern (may be repeated)\033[0m\n"
+			" -i     \033[3mignore case\033[0m\n"
+			" -c     \033[3mprint a count of matching lines per file\033[0m\n"
+			" -H     \033[3malways print file names\033[0m\n"
+			" -h     \033[3mnever print file names\033[0m\n"
+			" -l     \033[3monly list files with matches\033[0m\n"
+			" -n     \033[3mprint line numbers\033[0m\n"
+			" -r     \033[3msearch directories recursively\033[0m\n"
+			" -j     \033[3mnumber of files to search at once\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+}
+
+int main(int argc, char ** argv) {
+	int workers = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:icHhlnrj:?")) != -1) {
+		switch (opt) {
+			case 'e':
+				add_patterns(optarg);
+				break;
+			case 'i':
+				opt_ignore_case = 1;
+				break;
+			case 'c':
+				opt_count = 1;
+				break;
+			case 'H':
+				show_names = 1;
+				break;
+			case 'h':
+				show_names = 0;
+				break;
+			case 'l':
+				opt_list = 1;
+				break;
+			case 'n':
+				opt_line_numbers = 1;
+				break;
+			case 'r':
+				opt_recursive = 1;
+				break;
+			case 'j':
+				workers = atoi(optarg);
+				break;
+			default:
+				show_usage(argv);
+				return 2;
+		}
+	}
+
+	if (!pattern_count) {
+		if (optind >= argc) {
+			show_usage(argv);
+			return 2;
+		}
+		add_patterns(argv[optind++]);
+	}
+
+	new_state();
+	for (int i = 0; i < pattern_count; ++i) {
+		add_pattern(patterns[i]);
+	}
+	build_automaton();
+
+	for (int i = optind; i < argc; ++i) {
+		collect(argv[i], 1);
+	}
+	if (optind >= argc) {
+		if (opt_recursive) {
+			collect(".", 1);
+		} else {
+			add_file("-");
+		}
+	}
+
+	if (show_names == -1) {
+		show_names = opt_recursive || argc - optind > 1;
+	}
+	is_tty = isatty(STDOUT_FILENO) && !opt_list && !opt_count;
+
+	if (!workers) workers = file_count > 1 ? 4 : 1;
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+	if (workers > file_count) workers = file_count;
+
+	if (workers <= 1) {
+		worker(NULL);
+	} else {
+		pthread_t threads[MAX_WORKERS];
+		for (int i = 0; i < workers; ++i) {
+			pthread_create(&threads[i], NULL, worker, NULL);
+		}
+		for (int i = 0; i < workers; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	if (had_error) return 2;
+	return found_any ? 0 : 1;
+}
@@ -18,6 +18,7 @@
 #include <signal.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -32,6 +33,7 @@
 #include <toaru/list.h>
 #include <toaru/sdf.h>
 #include <toaru/button.h>
+#include <toaru/jpeg.h>
 
 #define APPLICATION_TITLE "File Browser"
 #define SCROLL_AMOUNT 120
@@ -47,6 +49,8 @@ struct File {
 	uint64_t size;       /* File size */
 	int type;            /* File type: 0 = normal, 1 = directory, 2 = launcher */
 	int selected;        /* Selection status */
+	time_t mtime;        /* Modification time */
+	sprite_t * thumbnail; /* Image preview, once one has been generated */
 };
 
 static yutani_t * yctx;
@@ -220,6 +224,19 @@ static char * ellipsify(char * input, int font_size, int font, int max_width, in
 /**
  * Draw an icon view entry
  */
+/*
+ * The image decoders keep global state, and the thumbnail workers use
+ * them too, so any icon that might still need loading goes through here.
+ */
+static pthread_mutex_t thumbnail_decode_lock = 0;
+
+static sprite_t * decode_icon(sprite_t * (*get)(const char *), const char * name) {
+	pthread_mutex_lock(&thumbnail_decode_lock);
+	sprite_t * icon = get(name);
+	pthread_mutex_unlock(&thumbnail_decode_lock);
+	return icon;
+}
+
 static void draw_file(struct File * f, int offset) {
 
 	/* From the flat array offset, figure out the x/y offset. */
@@ -228,9 +245,9 @@ static void draw_file(struct File * f, int offset) {
 	int x = offset_x * FILE_WIDTH;
 	int y = offset_y * FILE_HEIGHT;
 
-	/* Load the icon sprite from the cache */
+	/* Load the icon sprite from the cache, or use the image preview */
 	if (view_mode == VIEW_MODE_ICONS) {
-		sprite_t * icon = icon_get_48(f->icon);
+		sprite_t * icon = f->thumbnail ? f->thumbnail : decode_icon(icon_get_48, f->icon);
 
 		/* If the display name is too long to fit, cut it with an ellipsis. */
 		int name_width;
@@ -267,13 +284,13 @@ static void draw_file(struct File * f, int offset) {
 
 		if (f->link[0]) {
 			/* For symlinks, draw an indicator */
-			sprite_t * arrow = icon_get_16("forward");
+			sprite_t * arrow = decode_icon(icon_get_16, "forward");
 			draw_sprite(contents, arrow, center_x_icon + 32 + x, y + 32);
 		}
 
 		free(name);
 	} else if (view_mode == VIEW_MODE_TILES) {
-		sprite_t * icon = icon_get_48(f->icon);
+		sprite_t * icon = f->thumbnail ? f->thumbnail : decode_icon(icon_get_48, f->icon);
 
 		uint32_t text_color = rgb(0,0,0);
 
@@ -315,7 +332,7 @@ static void draw_file(struct File * f, int offset) {
 		free(name);
 		free(type);
 	} else if (view_mode == VIEW_MODE_LIST) {
-		sprite_t * icon = icon_get_16(f->icon);
+		sprite_t * icon = decode_icon(icon_get_16, f->icon);
 		uint32_t text_color = rgb(0,0,0);
 
 		if (f->selected) {
@@ -331,7 +348,7 @@ static void draw_file(struct File * f, int offset) {
 		}
 
 		if (icon->width != 16 || icon->height != 16) {
-			draw_sprite_scaled(contents, icon, x + 4, y + 4, 16, 16);
+			draw_sprite(contents, get_scaled_sprite(icon, 16, 16), x + 4, y + 4);
 		} else {
 			draw_sprite(contents, icon, x + 4, y + 4);
 		}
@@ -405,6 +422,293 @@ static int has_extension(struct File * f, char * extension) {
 	return 0;
 }
 
+/**
+ * Image previews.
+ *
+ * Image files are shown with a thumbnail instead of their icon in
+ * the icon and tile views. Thumbnails are produced by a small pool
+ * of worker threads so that opening a directory of photos doesn't
+ * block the UI; as each one finishes it is handed back to the main
+ * loop through a pipe and that entry is redrawn.
+ *
+ * Finished thumbnails are also stored in ~/.thumbnails, keyed by
+ * the hash of the image's path and checked against its mtime.
+ */
+#define THUMBNAIL_SIZE 48
+#define THUMBNAIL_WORKERS 2
+#define THUMBNAIL_MAGIC 0x314D4854 /* THM1 */
+
+struct thumbnail_job {
+	char * path;      /* Absolute path to the image */
+	time_t mtime;     /* Modification time when the directory was read */
+	int generation;   /* Directory load this job belongs to */
+	int offset;       /* Index into file_pointers */
+	sprite_t * result;
+};
+
+struct thumbnail_header {
+	uint32_t magic;
+	uint32_t mtime;
+	uint16_t width;
+	uint16_t height;
+	uint32_t path_len; /* The path follows, then the pixels */
+};
+
+static pthread_mutex_t thumbnail_lock = 0;
+static list_t * thumbnail_queue = NULL;
+static list_t * thumbnail_done = NULL;
+static int thumbnail_jobs[2];     /* Main loop -> workers, one byte per job */
+static int thumbnail_results[2];  /* Workers -> main loop, one byte per result */
+static volatile int thumbnail_generation = 0;
+
+static int has_thumbnail(struct File * f) {
+	return f->type == 0 && !f->link[0] &&
+		(has_extension(f, ".png") || has_extension(f, ".jpg") ||
+		 has_extension(f, ".jpeg") || has_extension(f, ".bmp"));
+}
+
+static void thumbnail_cache_path(char * out, size_t size, const char * path) {
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	for (const char * c = path; *c; ++c) {
+		hash ^= (uint8_t)*c;
+		hash *= 16777619U;
+	}
+	char * home = getenv("HOME");
+	snprintf(out, size, "%s/.thumbnails/%08x.thm", home ? home : "/tmp", (unsigned int)hash);
+}
+
+static sprite_t * thumbnail_cache_read(struct thumbnail_job * job) {
+	char cache[1024];
+	thumbnail_cache_path(cache, sizeof(cache), job->path);
+
+	FILE * f = fopen(cache, "r");
+	if (!f) return NULL;
+
+	sprite_t * out = NULL;
+	struct thumbnail_header hdr;
+	size_t path_len = strlen(job->path);
+	char stored[path_len + 1];
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) goto _done;
+	if (hdr.magic != THUMBNAIL_MAGIC || hdr.mtime != (uint32_t)job->mtime) goto _done;
+	if (hdr.width != THUMBNAIL_SIZE || hdr.height != THUMBNAIL_SIZE) goto _done;
+
+	/* Different file with the same hash */
+	if (hdr.path_len != path_len) goto _done;
+	if (fread(stored, path_len, 1, f) != 1 || memcmp(stored, job->path, path_len)) goto _done;
+
+	out = create_sprite(hdr.width, hdr.height, ALPHA_EMBEDDED);
+	if (fread(out->bitmap, sizeof(uint32_t) * hdr.width * hdr.height, 1, f) != 1) {
+		sprite_free(out);
+		out = NULL;
+	}
+
+_done:
+	fclose(f);
+	return out;
+}
+
+static void thumbnail_cache_write(struct thumbnail_job * job, sprite_t * thumb) {
+	char cache[1024];
+	char * home = getenv("HOME");
+	snprintf(cache, sizeof(cache), "%s/.thumbnails", home ? home : "/tmp");
+	mkdir(cache, 0700);
+
+	thumbnail_cache_path(cache, sizeof(cache), job->path);
+	FILE * f = fopen(cache, "w");
+	if (!f) return;
+
+	struct thumbnail_header hdr = {
+		THUMBNAIL_MAGIC, (uint32_t)job->mtime, thumb->width, thumb->height, strlen(job->path)
+	};
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(job->path, hdr.path_len, 1, f);
+	fwrite(thumb->bitmap, sizeof(uint32_t) * thumb->width * thumb->height, 1, f);
+	fclose(f);
+}
+
+/**
+ * Decode an image and scale it to fit a thumbnail, keeping its aspect ratio.
+ */
+static sprite_t * thumbnail_generate(struct thumbnail_job * job) {
+	sprite_t * full = calloc(1, sizeof(sprite_t));
+	int status;
+
+	/* Only one image at a time; see decode_icon() */
+	pthread_mutex_lock(&thumbnail_decode_lock);
+	char * ext = strrchr(job->path, '.');
+	if (ext && (!strcmp(ext, ".jpg") || !strcmp(ext, ".jpeg"))) {
+		/* Photos are far bigger than a thumbnail; decode them at 1/8 */
+		status = load_sprite_jpg_scaled(full, job->path, 8);
+		if (!status && full->bitmap && full->width < THUMBNAIL_SIZE && full->height < THUMBNAIL_SIZE) {
+			free(full->bitmap);
+			memset(full, 0, sizeof(sprite_t));
+			status = load_sprite_jpg(full, job->path);
+		}
+	} else {
+		status = load_sprite(full, job->path);
+	}
+	pthread_mutex_unlock(&thumbnail_decode_lock);
+
+	if (status || !full->bitmap || !full->width || !full->height) {
+		if (full->bitmap) free(full->bitmap);
+		free(full);
+		return NULL;
+	}
+
+	int width = THUMBNAIL_SIZE;
+	int height = THUMBNAIL_SIZE;
+	if (full->width > full->height) {
+		height = full->height * THUMBNAIL_SIZE / full->width;
+	} else {
+		width = full->width * THUMBNAIL_SIZE / full->height;
+	}
+	if (!width) width = 1;
+	if (!height) height = 1;
+
+	sprite_t * thumb = create_sprite(THUMBNAIL_SIZE, THUMBNAIL_SIZE, ALPHA_EMBEDDED);
+	gfx_context_t * tctx = init_graphics_sprite(thumb);
+	draw_fill(tctx, rgba(0,0,0,0));
+	draw_sprite_scaled(tctx, full, (THUMBNAIL_SIZE - width) / 2, (THUMBNAIL_SIZE - height) / 2, width, height);
+	free(tctx);
+	sprite_free(full);
+
+	return thumb;
+}
+
+static void * thumbnail_worker(void * arg) {
+	char b;
+	while (read(thumbnail_jobs[0], &b, 1) > 0) {
+		pthread_mutex_lock(&thumbnail_lock);
+		node_t * node = list_dequeue(thumbnail_queue);
+		pthread_mutex_unlock(&thumbnail_lock);
+		if (!node) continue;
+
+		struct thumbnail_job * job = node->value;
+		free(node);
+
+		/* Skip work for a directory we've already left */
+		if (job->generation == thumbnail_generation) {
+			job->result = thumbnail_cache_read(job);
+			if (!job->result) {
+				job->result = thumbnail_generate(job);
+				if (job->result) thumbnail_cache_write(job, job->result);
+			}
+		}
+
+		pthread_mutex_lock(&thumbnail_lock);
+		list_insert(thumbnail_done, job);
+		pthread_mutex_unlock(&thumbnail_lock);
+		write(thumbnail_results[1], "t", 1);
+	}
+	return NULL;
+}
+
+/*
+ * Menus load their icons as they draw, without decode_icon(), so get
+ * them into the icon cache before there are any workers to race with.
+ */
+static void preload_menu_icons(struct MenuList * menu) {
+	foreach(node, menu->entries) {
+		struct MenuEntry * entry = node->value;
+		if (entry->_type == MenuEntry_Normal) {
+			struct MenuEntry_Normal * normal = (struct MenuEntry_Normal *)entry;
+			if (normal->icon) icon_get_16(normal->icon);
+		} else if (entry->_type == MenuEntry_Submenu) {
+			struct MenuEntry_Submenu * submenu = (struct MenuEntry_Submenu *)entry;
+			if (submenu->icon) icon_get_16(submenu->icon);
+			icon_get_16("menu-tick");
+		}
+	}
+}
+
+static void thumbnail_init(void) {
+	thumbnail_queue = list_create();
+	thumbnail_done = list_create();
+	pipe(thumbnail_jobs);
+	pipe(thumbnail_results);
+	for (int i = 0; i < THUMBNAIL_WORKERS; ++i) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, thumbnail_worker, NULL);
+	}
+}
+
+static void thumbnail_job_free(struct thumbnail_job * job) {
+	if (job->result) sprite_free(job->result);
+	free(job->path);
+	free(job);
+}
+
+/**
+ * Forget any thumbnails still queued for the current directory.
+ */
+static void thumbnail_cancel(void) {
+	pthread_mutex_lock(&thumbnail_lock);
+	thumbnail_generation++;
+	node_t * node;
+	while ((node = list_dequeue(thumbnail_queue))) {
+		thumbnail_job_free(node->value);
+		free(node);
+	}
+	pthread_mutex_unlock(&thumbnail_lock);
+}
+
+/**
+ * Queue thumbnails for every image in the current directory.
+ */
+static void thumbnail_request_all(void) {
+	for (int i = 0; i < file_pointers_len; ++i) {
+		struct File * f = file_pointers[i];
+		if (!has_thumbnail(f)) continue;
+
+		struct thumbnail_job * job = calloc(1, sizeof(struct thumbnail_job));
+		job->path = malloc(strlen(current_directory) + strlen(f->name) + 2);
+		sprintf(job->path, "%s/%s", current_directory, f->name);
+		job->mtime = f->mtime;
+		job->generation = thumbnail_generation;
+		job->offset = i;
+
+		pthread_mutex_lock(&thumbnail_lock);
+		list_insert(thumbnail_queue, job);
+		pthread_mutex_unlock(&thumbnail_lock);
+		write(thumbnail_jobs[1], "j", 1);
+	}
+}
+
+/**
+ * Attach finished thumbnails to their entries and redraw them.
+ * Returns whether anything changed on screen.
+ */
+static int thumbnail_collect(void) {
+	char buf[64];
+	read(thumbnail_results[0], buf, sizeof(buf));
+
+	int updated = 0;
+	while (1) {
+		pthread_mutex_lock(&thumbnail_lock);
+		node_t * node = list_dequeue(thumbnail_done);
+		pthread_mutex_unlock(&thumbnail_lock);
+		if (!node) break;
+
+		struct thumbnail_job * job = node->value;
+		free(node);
+
+		if (job->result && job->generation == thumbnail_generation && job->offset < file_pointers_len) {
+			struct File * f = file_pointers[job->offset];
+			f->thumbnail = job->result;
+			job->result = NULL;
+			if (view_mode != VIEW_MODE_LIST) {
+				clear_offset(job->offset);
+				draw_file(f, job->offset);
+				updated = 1;
+			}
+		}
+		thumbnail_job_free(job);
+	}
+	return updated;
+}
+
 /**
  * Forward/backward history; we're always in the middle of these.
  * When we navigate somewhere new, clear the forward history, but
@@ -459,19 +763,23 @@ static void load_directory(const char * path, int modifies_history) {
 		 * why this directory failed to load. XXX This uses `showdialog`
 		 * but it should use a dialog library like with the buttons.
 		 */
-		if (!fork()) {
-			char tmp[512];
-			sprintf(tmp, "Could not open directory \"%s\": %s", path, strerror(errno));
-			char * args[] = {"showdialog","File Browser","/usr/share/icons/48/folder.png",tmp,NULL};
-			execvp(args[0],args);
-			exit(0);
+		char tmp[512];
+		sprintf(tmp, "Could not open directory \"%s\": %s", path, strerror(errno));
+		char * args[] = {"/bin/showdialog","File Browser","/usr/share/icons/48/folder.png",tmp,NULL};
+		if (!vfork()) {
+			execv(args[0],args);
+			_exit(0);
 		}
 		return;
 	}
 
+	/* Drop anything still waiting on the previous directory's thumbnails */
+	thumbnail_cancel();
+
 	/* Free the previously loaded directory */
 	if (file_pointers) {
 		for (int i = 0; i < file_pointers_len; ++i) {
+			if (file_pointers[i]->thumbnail) sprite_free(file_pointers[i]->thumbnail);
 			free(file_pointers[i]);
 		}
 		free(file_pointers);
@@ -563,6 +871,8 @@ static void load_directory(const char * path, int modifies_history) {
 			lstat(tmp, &statbuf);
 
 			f->size = statbuf.st_size;
+			f->mtime = statbuf.st_mtime;
+			f->thumbnail = NULL;
 
 			/* Read link target for symlinks */
 			if (S_ISLNK(statbuf.st_mode)) {
@@ -731,6 +1041,9 @@ static void load_directory(const char * path, int modifies_history) {
 	}
 	qsort(file_pointers, file_pointers_len, sizeof(struct File *), comparator);
 
+	/* Start on previews now that entries have their final positions */
+	thumbnail_request_all();
+
 	/* Reset scroll offset when navigating */
 	scroll_offset = 0;
 }
@@ -1113,7 +1426,9 @@ static void draw_background(int width, int height) {
 		}
 	}
 
+	pthread_mutex_lock(&thumbnail_decode_lock);
 	load_sprite(wallpaper, wallpaper_path);
+	pthread_mutex_unlock(&thumbnail_decode_lock);
 
 	if (free_it) {
 		free(wallpaper_path);
@@ -1302,13 +1617,11 @@ static void _menu_action_about(struct MenuEntry * entry) {
  * Also sets the working directory to the currently-opened directory.
  */
 static void launch_application(char * app) {
-	if (!fork()) {
+	char * args[] = {"/bin/sh", "-c", app, NULL};
+	if (!vfork()) {
 		if (current_directory) chdir(current_directory);
-		char * tmp = malloc(strlen(app) + 10);
-		sprintf(tmp, "%s", app);
-		char * args[] = {"/bin/sh", "-c", tmp, NULL};
-		execvp(args[0], args);
-		exit(1);
+		execv(args[0], args);
+		_exit(1);
 	}
 }
 
@@ -1789,6 +2102,16 @@ int main(int argc, char * argv[]) {
 	history_forward = list_create();
 
 
+	/* Start the thumbnail workers */
+	list_t * menus = hashmap_values(menu_bar.set->_menus);
+	foreach(node, menus) {
+		preload_menu_icons(node->value);
+	}
+	list_free(menus);
+	free(menus);
+	preload_menu_icons(context_menu);
+	thumbnail_init();
+
 	/* Load the current working directory */
 	char tmp[1024];
 	getcwd(tmp, 1024);
@@ -1800,8 +2123,8 @@ int main(int argc, char * argv[]) {
 
 	while (application_running) {
 		waitpid(-1, NULL, WNOHANG);
-		int fds[1] = {fileno(yctx->sock)};
-		int index = fswait2(1,fds,wallpaper_old ? 10 : 200);
+		int fds[2] = {fileno(yctx->sock), thumbnail_results[0]};
+		int index = fswait2(2,fds,wallpaper_old ? 10 : 200);
 
 		if (restart) {
 			execvp(argv[0],argv);
@@ -1809,6 +2132,14 @@ int main(int argc, char * argv[]) {
 		}
 
 		if (index == 1) {
+			/* Thumbnails are ready */
+			if (thumbnail_collect() || wallpaper_old) {
+				redraw_window();
+			}
+			continue;
+		}
+
+		if (index == 2) {
 			if (wallpaper_old) {
 				redraw_window();
 			}
@@ -16,6 +16,8 @@
 #include <unistd.h>
 #include <sys/shm.h>
 
+#include <toaru/glyphcache.h>
+
 #if 0
 #include <toaru/trace.h>
 #define TRACE_APP_NAME "font-server"
@@ -64,6 +66,20 @@ static char * precache_shmfont(char * ident, char * name) {
 	return font;
 }
 
+/**
+ * Set up the shared glyph cache for a font. Clients fill it in as
+ * they render; we only need to hold on to it so it lives as long as
+ * we do rather than as long as its current users.
+ */
+static void * glyph_caches[sizeof(fonts) / sizeof(*fonts)];
+
+static void * precache_glyphs(char * server, char * ident) {
+	char tmp[100];
+	GLYPHCACHE_SHMKEY(server, tmp, 100, ident);
+	size_t shm_size = GLYPHCACHE_SIZE;
+	return shm_obtain(tmp, &shm_size);
+}
+
 /**
  * Load all of the fonts into the cache.
  */
@@ -75,6 +91,8 @@ static void load_fonts(char * server) {
 		TRACE("Loading font %s -> %s", fonts[i].path, tmp);
 		if (!precache_shmfont(tmp, fonts[i].path)) {
 			TRACE("  ... failed.");
+		} else {
+			glyph_caches[i] = precache_glyphs(server, fonts[i].identifier);
 		}
 		++i;
 	}
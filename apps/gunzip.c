@@ -17,13 +17,17 @@ static int to_stdout = 0;
 static int keep = 0;
 
 static uint8_t _get(struct inflate_context * ctx) {
-	return fgetc(ctx->input_priv);
+	return getc((FILE *)ctx->input_priv);
 }
 
 static void _write(struct inflate_context * ctx, unsigned int sym) {
 	fputc(sym, ctx->output_priv);
 }
 
+static void _write_block(struct inflate_context * ctx, const uint8_t * buf, size_t len) {
+	fwrite(buf, 1, len, ctx->output_priv);
+}
+
 static int usage(int argc, char * argv[]) {
 	fprintf(stderr,
 			"gunzip - decompress gzip-compressed payloads\n"
@@ -85,9 +89,14 @@ int main(int argc, char * argv[]) {
 	}
 	ctx.get_input = _get;
 	ctx.write_output = _write;
+	ctx.write_block = _write_block;
 	ctx.ring = NULL; /* Use the global one */
 
-	if (gzip_decompress(&ctx)) {
+	int status = gzip_decompress(&ctx);
+	if (status) {
+		if (status == 2) {
+			fprintf(stderr, "%s: %s: CRC or length mismatch\n", argv[0], to_stdout ? "stdin" : argv[optind]);
+		}
 		return 1;
 	}
 
@@ -0,0 +1,241 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * heap - Report on a program's heap
+ *
+ * Runs a command with malloc tracing on (see MALLOC_TRACE in libc's
+ * malloc) and, when it exits, sums up what was allocated by call site
+ * and by size. With -f, reads a trace left by a program that was
+ * started with MALLOC_TRACE set some other way, like the compositor.
+ *
+ * The trace only holds the last so many events (-s), so "live" means
+ * allocated in that window and not freed by the end of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <toaru/hashmap.h>
+#include <toaru/list.h>
+
+#define SIZE_CLASSES 24
+#define BAR_WIDTH 40
+
+struct site {
+	uintptr_t caller;
+	size_t allocs;
+	size_t frees;
+	size_t bytes;
+	size_t live;
+	size_t live_bytes;
+};
+
+struct allocation {
+	struct site * site;
+	size_t size;
+};
+
+static hashmap_t * sites = NULL;
+static hashmap_t * allocations = NULL;
+static size_t size_classes[SIZE_CLASSES];
+static size_t events = 0;
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"heap - report on a program's heap\n"
+			"\n"
+			"usage: %s [-n count] [-s events] command [args...]\n"
+			"       %s [-n count] -f trace\n"
+			"\n"
+			" -n     \033[3mshow this many call sites (default 20)\033[0m\n"
+			" -s     \033[3mkeep this many events in the trace (default 65536)\033[0m\n"
+			" -f     \033[3mread a trace written by MALLOC_TRACE\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0], argv[0]);
+}
+
+static struct site * site_for(uintptr_t caller) {
+	struct site * s = hashmap_get(sites, (void *)caller);
+	if (!s) {
+		s = calloc(1, sizeof(struct site));
+		s->caller = caller;
+		hashmap_set(sites, (void *)caller, s);
+	}
+	return s;
+}
+
+static void record_free(uintptr_t ptr) {
+	struct allocation * a = hashmap_remove(allocations, (void *)ptr);
+	if (!a) return;
+	a->site->frees++;
+	a->site->live--;
+	a->site->live_bytes -= a->size;
+	free(a);
+}
+
+static void record_alloc(uintptr_t ptr, size_t size, uintptr_t caller) {
+	if (!ptr) return;
+	/* Shouldn't still be live, but don't count it twice */
+	record_free(ptr);
+
+	struct site * s = site_for(caller);
+	s->allocs++;
+	s->bytes += size;
+	s->live++;
+	s->live_bytes += size;
+
+	struct allocation * a = malloc(sizeof(struct allocation));
+	a->site = s;
+	a->size = size;
+	hashmap_set(allocations, (void *)ptr, a);
+
+	int class = 0;
+	while (class < SIZE_CLASSES - 1 && (1UL << class) < size) class++;
+	size_classes[class]++;
+}
+
+static int read_trace(char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "heap: %s: no trace\n", path);
+		return 1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') {
+			printf("%s", line + 2);
+			continue;
+		}
+		char op = line[0];
+		char * p = line + 1;
+		uintptr_t ptr = strtoul(p, &p, 16);
+		size_t size = strtoul(p, &p, 10);
+		uintptr_t caller = strtoul(p, &p, 16);
+		events++;
+		switch (op) {
+			case 'm':
+			case 'c':
+			case 'v':
+				record_alloc(ptr, size, caller);
+				break;
+			case 'r': {
+				uintptr_t old = strtoul(p, &p, 16);
+				if (old && (ptr || !size)) record_free(old);
+				record_alloc(ptr, size, caller);
+				break;
+			}
+			case 'f':
+				record_free(ptr);
+				break;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int sort_sites(const void * a, const void * b) {
+	const struct site * x = *(const struct site **)a;
+	const struct site * y = *(const struct site **)b;
+	if (x->live_bytes != y->live_bytes) return x->live_bytes < y->live_bytes ? 1 : -1;
+	if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+	return 0;
+}
+
+static void report(int show) {
+	list_t * values = hashmap_values(sites);
+	struct site ** list = malloc(sizeof(struct site *) * (values->length + 1));
+	int count = 0;
+	foreach(node, values) {
+		list[count++] = node->value;
+	}
+	qsort(list, count, sizeof(struct site *), sort_sites);
+
+	printf("\n%zu events from %d call sites\n\n", events, count);
+	printf("%-10s %8s %8s %10s %8s %10s\n", "caller", "allocs", "frees", "bytes", "live", "live bytes");
+	for (int i = 0; i < count && i < show; ++i) {
+		struct site * s = list[i];
+		printf("0x%08lx %8zu %8zu %10zu %8zu %10zu\n", (unsigned long)s->caller, s->allocs, s->frees, s->bytes, s->live, s->live_bytes);
+	}
+
+	size_t most = 1;
+	int last = 0;
+	for (int i = 0; i < SIZE_CLASSES; ++i) {
+		if (size_classes[i] > most) most = size_classes[i];
+		if (size_classes[i]) last = i;
+	}
+	printf("\nallocations by size\n");
+	for (int i = 0; i <= last; ++i) {
+		char bar[BAR_WIDTH + 1];
+		size_t len = (size_classes[i] * BAR_WIDTH + most - 1) / most;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		if (i == SIZE_CLASSES - 1) {
+			printf(" >%8lu %8zu %s\n", 1UL << (i - 1), size_classes[i], bar);
+		} else {
+			printf("<=%8lu %8zu %s\n", 1UL << i, size_classes[i], bar);
+		}
+	}
+}
+
+int main(int argc, char * argv[]) {
+	int show = 20;
+	char * trace_size = "65536";
+	char * trace = NULL;
+
+	int c;
+	while ((c = getopt(argc, argv, "n:s:f:?")) != -1) {
+		switch (c) {
+			case 'n':
+				show = atoi(optarg);
+				break;
+			case 's':
+				trace_size = optarg;
+				break;
+			case 'f':
+				trace = optarg;
+				break;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	if (!trace && optind >= argc) {
+		show_usage(argc, argv);
+		return 1;
+	}
+
+	sites = hashmap_create_int(64);
+	allocations = hashmap_create_int(1024);
+
+	if (trace) {
+		if (read_trace(trace)) return 1;
+	} else {
+		char path[64];
+		sprintf(path, "/tmp/heap.%d", getpid());
+
+		pid_t pid = fork();
+		if (!pid) {
+			setenv("MALLOC_TRACE", path, 1);
+			setenv("MALLOC_TRACE_SIZE", trace_size, 1);
+			execvp(argv[optind], &argv[optind]);
+			fprintf(stderr, "heap: %s: command not found\n", argv[optind]);
+			exit(127);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+		int failed = read_trace(path);
+		unlink(path);
+		if (failed) return 1;
+	}
+
+	report(show);
+	return 0;
+}
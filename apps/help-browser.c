@@ -52,6 +52,22 @@ struct Char {
 	char state;
 };
 
+/*
+ * The parsed document, as a list of words and line breaks. Words are
+ * measured once, when the topic is loaded; laying them out again for
+ * a new width only has to walk this list.
+ */
+struct Word {
+	int newline;      /* A forced line break, rather than a word */
+	int size;         /* Font size and line height when it was written */
+	int line_height;
+	int width;
+	size_t length;
+	struct Char chars[];
+};
+
+static list_t * words = NULL;
+
 //static list_t * lines = NULL;
 static list_t * buffer = NULL;
 
@@ -74,46 +90,66 @@ static int current_size(void) {
 	return 16;
 }
 
-static int buffer_width(list_t * buffer) {
-	int out = 0;
-	foreach(node, buffer) {
-		struct Char * c = node->value;
-
-		char tmp[2] = {c->c, '\0'};
-
-		out += draw_sdf_string_width(tmp, current_size(), state_to_font(c->state));
+static int current_line_height(void) {
+	if (current_state & (1 << 2)) {
+		return HEAD_HEIGHT;
+	} else {
+		return LINE_HEIGHT;
 	}
-	return out;
 }
 
-static int draw_buffer(list_t * buffer) {
-	int x = 0;
+static void write_buffer(void) {
+	struct Word * word = malloc(sizeof(struct Word) + sizeof(struct Char) * buffer->length);
+	word->newline = 0;
+	word->size = current_size();
+	word->line_height = current_line_height();
+	word->width = 0;
+	word->length = 0;
 	while (buffer->length) {
 		node_t * node = list_dequeue(buffer);
 		struct Char * c = node->value;
-		char tmp[2] = { c->c, '\0' };
-		x += draw_sdf_string(nctx, cursor_x + x, cursor_y, tmp, current_size(), 0xFF000000, state_to_font(c->state));
+		char tmp[2] = {c->c, '\0'};
+		word->width += draw_sdf_string_width(tmp, word->size, state_to_font(c->state));
+		word->chars[word->length++] = *c;
 		free(c);
 		free(node);
 	}
-	x += 4;
-	return x;
+	list_insert(words, word);
 }
 
-static int current_line_height(void) {
-	if (current_state & (1 << 2)) {
-		return HEAD_HEIGHT;
-	} else {
-		return LINE_HEIGHT;
-	}
+static void write_newline(void) {
+	struct Word * word = calloc(1, sizeof(struct Word));
+	word->newline = 1;
+	word->line_height = current_line_height();
+	list_insert(words, word);
 }
 
-static void write_buffer(void) {
-	if (buffer_width(buffer) + cursor_x > nctx->width) {
-		cursor_x = BASE_X;
-		cursor_y += current_line_height();
+static void layout_words(void) {
+	cursor_y = BASE_Y;
+	cursor_x = BASE_X;
+	foreach(node, words) {
+		struct Word * word = node->value;
+		if (word->newline) {
+			cursor_x = BASE_X;
+			cursor_y += word->line_height;
+			continue;
+		}
+		if (word->width + cursor_x > nctx->width) {
+			cursor_x = BASE_X;
+			cursor_y += word->line_height;
+		}
+		if (cursor_y >= nctx->height) {
+			/* Out of view; nothing to draw, but keep the layout going */
+			cursor_x += word->width + 4;
+			continue;
+		}
+		int x = 0;
+		for (size_t i = 0; i < word->length; ++i) {
+			char tmp[2] = { word->chars[i].c, '\0' };
+			x += draw_sdf_string(nctx, cursor_x + x, cursor_y, tmp, word->size, 0xFF000000, state_to_font(word->chars[i].state));
+		}
+		cursor_x += x + 4;
 	}
-	cursor_x += draw_buffer(buffer);
 }
 
 static int parser_open(struct markup_state * self, void * user, struct markup_tag * tag) {
@@ -128,8 +164,7 @@ static int parser_open(struct markup_state * self, void * user, struct markup_ta
 		current_state |= (1 << 2);
 	} else if (!strcmp(tag->name, "br")) {
 		write_buffer();
-		cursor_x = BASE_X;
-		cursor_y += current_line_height();
+		write_newline();
 	}
 	markup_free_tag(tag);
 	return 0;
@@ -146,8 +181,7 @@ static int parser_close(struct markup_state * self, void * user, char * tag_name
 		free(nstate);
 	} else if (!strcmp(tag_name, "h1")) {
 		write_buffer();
-		cursor_x = BASE_X;
-		cursor_y += current_line_height();
+		write_newline();
 		node_t * nstate = list_pop(state);
 		current_state = (int)nstate->value;
 		free(nstate);
@@ -187,6 +221,37 @@ static void _menu_action_exit(struct MenuEntry * entry) {
 	application_running = 0;
 }
 
+static void free_words(void) {
+	if (!words) return;
+	foreach(node, words) {
+		free(node->value);
+	}
+	list_free(words);
+	free(words);
+	words = NULL;
+}
+
+/* Parse the current topic into words; only needed when it changes */
+static void parse_topic(void) {
+	free_words();
+	words = list_create();
+
+	struct markup_state * parser = markup_init(NULL, parser_open, parser_close, parser_data);
+	current_state = 0;
+	state = list_create();
+	buffer = list_create();
+
+	if (markup_parse_buffer(parser, current_topic, strlen(current_topic))) {
+		fprintf(stderr,"There was an error.\n");
+	}
+
+	markup_finish(parser);
+	write_buffer();
+	list_free(state);
+	free(state);
+	free(buffer);
+}
+
 static void reinitialize_contents(void) {
 	if (contents) {
 		free(contents);
@@ -208,25 +273,7 @@ static void reinitialize_contents(void) {
 	draw_fill(contents, rgb(255,255,255));
 
 	nctx = contents;
-	struct markup_state * parser = markup_init(NULL, parser_open, parser_close, parser_data);
-	cursor_y = BASE_Y;
-	cursor_x = BASE_X;
-	state = list_create();
-	buffer = list_create();
-
-	char * str = current_topic;
-	while (*str) {
-		if (markup_parse(parser, *str++)) {
-			fprintf(stderr,"There was an error.\n");
-			return;
-		}
-	}
-
-	markup_finish(parser);
-	write_buffer();
-	list_free(state);
-	free(state);
-	free(buffer);
+	layout_words();
 }
 
 static void redraw_window(void) {
@@ -297,6 +344,7 @@ static void navigate(const char * t) {
 		fclose(f);
 	}
 
+	parse_topic();
 	reinitialize_contents();
 	redraw_window();
 
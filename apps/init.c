@@ -22,11 +22,27 @@
  * Startup scripts can be any executable binary. Shell scripts are
  * generally used to allow easy editing, but you could also use
  * a binary (even a dynamically linked one) as a startup script.
- * `init` will wait for each startup script (that is, it will wait for
- * the original process it started to exit) before running the next one.
- * So if you wish to run daemons, be sure to fork them off and then
+ * `init` waits for a startup script (that is, for the original
+ * process it started to exit) before running the ones that come after
+ * it. So if you wish to run daemons, be sure to fork them off and then
  * exit so that the rest of the startup process can continue.
  *
+ * A script can instead say what it actually needs with a comment
+ * near its top, naming other scripts without their numbers or
+ * extensions:
+ *
+ *     # requires: migrate tmpfs
+ *
+ * Such a script starts as soon as the ones it names have finished,
+ * alongside anything else that is ready, and scripts that come after
+ * it don't wait for it unless they name it (or have no `requires:`
+ * line of their own). An empty `requires:` line means the script can
+ * start right away. Scripts without the line keep the old behaviour.
+ *
+ * How long each script took is written to the kernel log, and when
+ * each started and finished goes into the boot timeline in
+ * /proc/boottime.
+ *
  * When the last startup script finishes, `init` will reboot the system.
  */
 
@@ -39,6 +55,8 @@
 #include <unistd.h>
 #include <wait.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/sysfunc.h>
 
 #define INITD_PATH "/etc/startup.d"
 
@@ -49,11 +67,51 @@ void set_console(void) {
 	syscall_open("/dev/null", 1, 0);
 }
 
-/* Run a startup script and wait for it to finish */
-int start_options(char * args[]) {
+#define MAX_UNITS    64
+#define MAX_REQUIRES 8
+#define HEADER_SIZE  1024
+
+struct unit {
+	char path[256];
+	char name[64];              /* File name without its number or extension */
+	char * requires[MAX_REQUIRES];
+	int require_count;
+	int ordered;                /* No requires: line; waits for everything before it */
+	int deps[MAX_REQUIRES];     /* requires[] resolved to unit indices */
+	int dep_count;
+	int pid;                    /* 0 until started */
+	int done;
+	struct timeval started;
+};
+
+static struct unit units[MAX_UNITS];
+static int unit_count = 0;
+static struct timeval boot_start;
+static int boottime_fd = -1;
+
+static long elapsed_ms(struct timeval * since) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+}
+
+/* Write a line to the kernel log, as stdout goes nowhere */
+static void report(char * msg) {
+	char * args[] = { "init", (char *)0, (char *)1, msg };
+	sysfunc(TOARU_SYS_FUNC_DEBUGPRINT, args);
+}
+
+/* Add an event to the kernel's boot timeline */
+static void boot_event(char * kind, char * prefix, char * name) {
+	if (boottime_fd < 0) return;
+	char line[128];
+	sprintf(line, "%s %s%s\n", kind, prefix, name);
+	syscall_write(boottime_fd, line, strlen(line));
+}
 
-	/* Fork child to run script */
-	int cpid = syscall_fork();
+/* Start a program without waiting for it */
+static int spawn(char * args[]) {
+	int cpid = vfork();
 
 	/* Child process... */
 	if (!cpid) {
@@ -63,35 +121,193 @@ int start_options(char * args[]) {
 		syscall_exit(0);
 	}
 
-	/* Wait for the child process to finish */
-	int pid = 0;
+	return cpid;
+}
+
+/*
+ * Wait for a child, ignoring kernel threads (which also end up as
+ * children to init) and retrying when interrupted.
+ *
+ * @return The pid of the child that exited, or -1 when there are none.
+ */
+static int reap(void) {
+	for (;;) {
+		int pid = waitpid(-1, NULL, WNOKERN);
+		if (pid > 0) return pid;
+		if (pid == -1 && errno == EINTR) continue;
+		return -1;
+	}
+}
+
+/* Run a startup script and wait for it to finish */
+int start_options(char * args[]) {
+	int cpid = spawn(args);
+	int pid;
 	do {
-		/*
-		 * Wait, ignoring kernel threads
-		 * (which also end up as children to init)
-		 */
-		pid = waitpid(-1, NULL, WNOKERN);
-
-		if (pid == -1 && errno == ECHILD) {
-			/* There are no more children */
-			break;
+		pid = reap();
+	} while (pid != -1 && pid != cpid);
+	return cpid;
+}
+
+/*
+ * Pull the words of a `requires:` line out of the top of a script.
+ * The words are left in `header`, which must outlive the unit.
+ */
+static void read_requires(struct unit * unit, char * header) {
+	unit->ordered = 1;
+
+	int fd = syscall_open(unit->path, 0, 0);
+	if (fd < 0) return;
+	int len = syscall_read(fd, header, HEADER_SIZE - 1);
+	syscall_close(fd);
+	if (len <= 0) return;
+	header[len] = '\0';
+
+	char * line = header;
+	while (line && *line) {
+		char * next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+
+		if (line[0] == '#') {
+			char * c = line + 1;
+			while (*c == ' ' || *c == '\t') c++;
+			if (!strncmp(c, "requires:", 9)) {
+				unit->ordered = 0;
+				c += 9;
+				while (*c && unit->require_count < MAX_REQUIRES) {
+					while (*c == ' ' || *c == '\t' || *c == ',') *c++ = '\0';
+					if (!*c) break;
+					unit->requires[unit->require_count++] = c;
+					while (*c && *c != ' ' && *c != '\t' && *c != ',') c++;
+				}
+				return;
+			}
+		} else if (line[0] && line[0] != '\r') {
+			/* Only leading comments count */
+			return;
 		}
 
-		if (pid == cpid) {
-			/* The child process finished */
-			break;
+		line = next;
+	}
+}
+
+/* "03_tmpfs.sh" -> "tmpfs" */
+static void unit_name(char * out, size_t size, char * file) {
+	char * c = file;
+	while (*c >= '0' && *c <= '9') c++;
+	if (c != file && (*c == '_' || *c == '-')) c++;
+	else c = file;
+	size_t i = 0;
+	while (c[i] && c[i] != '.' && i < size - 1) {
+		out[i] = c[i];
+		i++;
+	}
+	out[i] = '\0';
+}
+
+static void resolve(struct unit * unit) {
+	for (int i = 0; i < unit->require_count; ++i) {
+		int found = -1;
+		for (int j = 0; j < unit_count; ++j) {
+			if (!strcmp(units[j].name, unit->requires[i])) {
+				found = j;
+				break;
+			}
+		}
+		if (found < 0 || &units[found] == unit) {
+			char msg[320];
+			sprintf(msg, "%s requires unknown script '%s'", unit->name, unit->requires[i]);
+			report(msg);
+			continue;
+		}
+		unit->deps[unit->dep_count++] = found;
+	}
+}
+
+static int unit_ready(int i) {
+	if (units[i].ordered) {
+		for (int j = 0; j < i; ++j) {
+			if (!units[j].done) return 0;
 		}
+		return 1;
+	}
+	for (int d = 0; d < units[i].dep_count; ++d) {
+		if (!units[units[i].deps[d]].done) return 0;
+	}
+	return 1;
+}
 
-		/* Continue while no error (or error was "interrupted") */
-	} while ((pid > 0) || (pid == -1 && errno == EINTR));
+static void start_unit(struct unit * unit) {
+	gettimeofday(&unit->started, NULL);
+	boot_event("begin", "script ", unit->name);
+	unit->pid = spawn((char *[]){unit->path, NULL});
+}
 
-	return cpid;
+static void finish_unit(struct unit * unit) {
+	unit->done = 1;
+	boot_event("end", "script ", unit->name);
+	char msg[128];
+	sprintf(msg, "%s finished in %dms (started at %dms)", unit->name,
+		(int)elapsed_ms(&unit->started),
+		(int)((unit->started.tv_sec - boot_start.tv_sec) * 1000 + (unit->started.tv_usec - boot_start.tv_usec) / 1000));
+	report(msg);
+}
+
+/*
+ * Start everything that is ready, then wait for something to finish,
+ * until every script has run.
+ */
+static void run_units(void) {
+	int finished = 0;
+	while (finished < unit_count) {
+		int running = 0;
+		for (int i = 0; i < unit_count; ++i) {
+			if (!units[i].pid && unit_ready(i)) {
+				start_unit(&units[i]);
+			}
+			if (units[i].pid && !units[i].done) running++;
+		}
+
+		if (!running) {
+			/* Nothing can start: a cycle, or a script that waits on itself. Break it in order. */
+			for (int i = 0; i < unit_count; ++i) {
+				if (!units[i].pid) {
+					char msg[128];
+					sprintf(msg, "starting %s with unfinished requirements", units[i].name);
+					report(msg);
+					start_unit(&units[i]);
+					break;
+				}
+			}
+		}
+
+		int pid = reap();
+		if (pid == -1) {
+			/* Lost track of our children; don't wait on them forever */
+			break;
+		}
+		for (int i = 0; i < unit_count; ++i) {
+			if (units[i].pid == pid && !units[i].done) {
+				finish_unit(&units[i]);
+				finished++;
+				break;
+			}
+		}
+	}
+
+	char msg[64];
+	sprintf(msg, "startup took %dms", (int)elapsed_ms(&boot_start));
+	report(msg);
+	boot_event("mark", "", "startup done");
 }
 
 int main(int argc, char * argv[]) {
 	/* Initialize stdin/out/err */
 	set_console();
 
+	gettimeofday(&boot_start, NULL);
+	boottime_fd = syscall_open("/proc/boottime", 1, 0);
+
 	/* Get directory listing for /etc/startup.d */
 	int initd_dir = syscall_open(INITD_PATH, 0, 0);
 	if (initd_dir < 0) {
@@ -121,14 +337,22 @@ int main(int argc, char * argv[]) {
 		}
 		qsort(entries, count, sizeof(struct dirent), comparator);
 
-		/* Run scripts */
-		for (int i = 0; i < count; ++i) {
-			if (entries[i].d_name[0] != '.') {
-				char path[256];
-				sprintf(path, "/etc/startup.d/%s", entries[i].d_name);
-				start_options((char *[]){path, NULL});
-			}
+		/* Read each script's requirements */
+		static char headers[MAX_UNITS][HEADER_SIZE];
+		for (int i = 0; i < count && unit_count < MAX_UNITS; ++i) {
+			if (entries[i].d_name[0] == '.') continue;
+			struct unit * unit = &units[unit_count];
+			sprintf(unit->path, INITD_PATH "/%s", entries[i].d_name);
+			unit_name(unit->name, sizeof(unit->name), entries[i].d_name);
+			read_requires(unit, headers[unit_count]);
+			unit_count++;
+		}
+		for (int i = 0; i < unit_count; ++i) {
+			resolve(&units[i]);
 		}
+
+		/* Run scripts */
+		run_units();
 	}
 
 	/* Self-explanatory */
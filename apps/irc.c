@@ -4,11 +4,20 @@
  * Copyright (C) 2018 K. Lange
  *
  * irc - Internet Relay Chat client
+ *
+ * The socket is nonblocking and waited on with the terminal in one
+ * fswait set. Everything the server has sent is parsed before the
+ * screen is touched, and all of the resulting output goes to the
+ * terminal in a single write. Messages are also kept in a ring of
+ * scrollback, which is replayed to redraw the screen (^L, or when the
+ * terminal is resized).
  */
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <termios.h>
 #include <va_list.h>
 #include <time.h>
@@ -32,9 +41,64 @@ static unsigned short port = 6667;
 static char * channel = NULL;
 
 static int sock_fd;
-static FILE * sock_r;
 static FILE * sock_w;
 
+static int term_rows = 24;
+static volatile int resized = 0;
+
+#define SCROLLBACK 1024
+static char * scrollback[SCROLLBACK];
+static int scrollback_head = 0; /* Oldest */
+static int scrollback_count = 0;
+
+/* Terminal output, sent by flush_out() */
+static char * out_buf = NULL;
+static size_t out_len = 0;
+static size_t out_size = 0;
+
+static void out_append(const char * s, size_t len) {
+	if (out_len + len > out_size) {
+		while (out_len + len > out_size) {
+			out_size = out_size ? out_size * 2 : 4096;
+		}
+		out_buf = realloc(out_buf, out_size);
+	}
+	memcpy(out_buf + out_len, s, len);
+	out_len += len;
+}
+
+static void out(const char * fmt, ...) {
+	char tmp[256];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	va_end(args);
+	if (len >= (int)sizeof(tmp)) len = sizeof(tmp) - 1;
+	out_append(tmp, len);
+}
+
+static void flush_out(void) {
+	size_t written = 0;
+	while (written < out_len) {
+		ssize_t r = write(STDOUT_FILENO, out_buf + written, out_len - written);
+		if (r <= 0) break;
+		written += r;
+	}
+	out_len = 0;
+}
+
+static void update_size(void) {
+	struct winsize w;
+	if (!ioctl(0, TIOCGWINSZ, &w) && w.ws_row) {
+		term_rows = w.ws_row;
+	}
+}
+
+static void sig_winch(int sig) {
+	resized = 1;
+	signal(SIGWINCH, sig_winch);
+}
+
 struct color_pair {
 	int fg;
 	int bg;
@@ -147,53 +211,45 @@ static void get_time(int * h, int * m, int * s) {
 }
 
 static void print_color(struct color_pair t) {
-	fprintf(stdout, "\033[");
+	out("\033[");
 	if (t.fg == -1) {
-		fprintf(stdout,"39");
+		out("39");
 	} else if (t.fg > 15) {
 		/* TODO */
 	} else if (t.fg > 7) {
-		fprintf(stdout,"9%d", t.fg - 8);
+		out("9%d", t.fg - 8);
 	} else {
-		fprintf(stdout,"3%d", t.fg);
+		out("3%d", t.fg);
 	}
-	fprintf(stdout, ";");
+	out(";");
 	if (t.bg == -1) {
-		fprintf(stdout, "49");
+		out("49");
 	} else if (t.bg > 15) {
 		/* TODO */
 	} else if (t.bg > 7) {
-		fprintf(stdout,"10%d", t.bg - 8);
+		out("10%d", t.bg - 8);
 	} else {
-		fprintf(stdout,"4%d", t.bg);
+		out("4%d", t.bg);
 	}
-	fprintf(stdout, "m");
-	fflush(stdout);
+	out("m");
 }
 
-static void WRITE(const char * fmt, ...) {
+/* Draw a formatted message above the input line */
+static void render(const char * tmp) {
 
 	int bold_on = 0;
 	int italic_on = 0;
 
-	va_list args;
-	va_start(args, fmt);
-	char * tmp;
-	vasprintf(&tmp, fmt, args);
-	va_end(args);
-
-	struct winsize w;
-	ioctl(0, TIOCGWINSZ, &w);
-	fprintf(stdout,"\033[%d;1H\033[K", w.ws_row);
+	out("\033[%d;1H\033[K", term_rows);
 
 	int line_feed_pending = 0;
-	char * c = tmp;
+	const char * c = tmp;
 
 	while (*c) {
 		if (*c == '\n') {
 			if (line_feed_pending) {
 				/* Print line feed */
-				fprintf(stdout, "\n");
+				out_append("\n", 1);
 			}
 			line_feed_pending = 1;
 			c++;
@@ -202,7 +258,7 @@ static void WRITE(const char * fmt, ...) {
 			if (line_feed_pending) {
 				line_feed_pending = 0;
 				/* Print line feed */
-				fprintf(stdout, "\n");
+				out_append("\n", 1);
 			}
 		}
 		if (*c == 0x03) {
@@ -236,10 +292,10 @@ static void WRITE(const char * fmt, ...) {
 		}
 		if (*c == 0x02) {
 			if (bold_on) {
-				fprintf(stdout,"\033[22m");
+				out("\033[22m");
 				bold_on = 0;
 			} else {
-				fprintf(stdout,"\033[1m");
+				out("\033[1m");
 				bold_on = 1;
 			}
 			c++;
@@ -247,31 +303,60 @@ static void WRITE(const char * fmt, ...) {
 		}
 		if (*c == 0x16) {
 			if (italic_on) {
-				fprintf(stdout,"\033[23m");
+				out("\033[23m");
 				italic_on = 0;
 			} else {
-				fprintf(stdout,"\033[3m");
+				out("\033[3m");
 				italic_on = 1;
 			}
 			c++;
 			continue;
 		}
 		if (*c == 0x0f) {
-			fprintf(stdout, "\033[0m");
+			out("\033[0m");
 			c++;
 			bold_on = 0;
 			italic_on = 0;
 			continue;
 		}
 
-		fprintf(stdout, "%c", *c);
-		c++;
+		/* Plain text goes out a run at a time */
+		const char * run = c;
+		while (*c && *c != '\n' && *c != 0x02 && *c != 0x03 && *c != 0x0f && *c != 0x16) c++;
+		out_append(run, c - run);
 	}
 	if (line_feed_pending) {
-		fprintf(stdout, "\033[0m\033[K\n");
+		out("\033[0m\033[K\n");
+	}
+}
+
+static void WRITE(const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	char * tmp;
+	vasprintf(&tmp, fmt, args);
+	va_end(args);
+
+	render(tmp);
+
+	/* The ring takes ownership, replacing the oldest entry once it's full */
+	if (scrollback_count == SCROLLBACK) {
+		free(scrollback[scrollback_head]);
+		scrollback[scrollback_head] = tmp;
+		scrollback_head = (scrollback_head + 1) % SCROLLBACK;
+	} else {
+		scrollback[(scrollback_head + scrollback_count) % SCROLLBACK] = tmp;
+		scrollback_count++;
+	}
+}
+
+/* Clear the screen and replay enough scrollback to fill it */
+static void redraw_screen(void) {
+	out("\033[H\033[2J");
+	int count = scrollback_count < term_rows - 1 ? scrollback_count : term_rows - 1;
+	for (int i = scrollback_count - count; i < scrollback_count; ++i) {
+		render(scrollback[(scrollback_head + i) % SCROLLBACK]);
 	}
-	fflush(stdout);
-	free(tmp);
 }
 
 static void handle(char * line) {
@@ -384,27 +469,27 @@ next:
 }
 
 static void redraw_buffer(char * buf) {
-	struct winsize w;
-	ioctl(0, TIOCGWINSZ, &w);
-	fprintf(stdout,"\033[%d;1H [%s] ", w.ws_row, channel ? channel : "(status)");
-	fprintf(stdout,"%s\033[K", buf);
-	fflush(stdout);
+	out("\033[%d;1H [%s] ", term_rows, channel ? channel : "(status)");
+	out_append(buf, strlen(buf));
+	out("\033[K");
+	flush_out();
 }
 
 void handle_input(char * buf) {
-	fflush(stdout);
 	if (strstr(buf, "/help") == buf) {
 		WRITE("[help] help text goes here\n");
 	} else if (strstr(buf, "/quit") == buf) {
 		char * m = strstr(buf, " "); if (m) m++;
 		fprintf(sock_w, "QUIT :%s\r\n", m ? m : "https://github.com/klange/toaruos");
 		fflush(sock_w);
+		flush_out();
 		fprintf(stderr,"\033[0m\n");
 		set_buffered();
 		exit(0);
 	} else if (strstr(buf,"/part") == buf) {
 		if (!channel) {
-			fprintf(stderr, "Not in a channel.\n");
+			WRITE("[system] Not in a channel.\n");
+			redraw_buffer("");
 			return;
 		}
 		char * m = strstr(buf, " "); if (m) m++;
@@ -461,16 +546,17 @@ int main(int argc, char * argv[]) {
 	{
 		char tmphost[512];
 		sprintf(tmphost, "/dev/net/%s:%d", host, port);
-		sock_fd = open(tmphost, O_RDWR);
+		sock_fd = open(tmphost, O_RDWR | O_NONBLOCK);
 		if (sock_fd < 0) {
 			fprintf(stderr, "%s: Connection failed or network not available.\n", argv[0]);
 			return 1;
 		}
-		sock_r = fdopen(sock_fd, "r");
 		sock_w = fdopen(sock_fd, "w");
 	}
 
 	set_unbuffered();
+	update_size();
+	signal(SIGWINCH, sig_winch);
 
 	fprintf(stdout, " - Toaru IRC v %s - \n", VERSION_STRING);
 	fprintf(stdout, " Copyright 2015-2018 K. Lange\n");
@@ -484,58 +570,86 @@ int main(int argc, char * argv[]) {
 	fprintf(sock_w, "NICK %s\r\nUSER %s * 0 :%s\r\n", nick, nick, nick);
 	fflush(sock_w);
 
-	int fds[] = {sock_fd, STDIN_FILENO, sock_fd};
+	int set = fswait_create();
+	fswait_ctl(set, FSWAIT_ADD, sock_fd, 0);
+	fswait_ctl(set, FSWAIT_ADD, STDIN_FILENO, 0);
 
 	char net_buf[2048];
-	memset(net_buf, 0, 2048);
 	int net_buf_p = 0;
 
 	char buf[1024] = {0};
 	int buf_p = 0;
 
 	while (1) {
-		int index = fswait2(2,fds,200);
+		int ready[2];
+		int count = fswait_wait(set, ready, 2, 200);
+
+		if (resized) {
+			resized = 0;
+			update_size();
+			redraw_screen();
+			redraw_buffer(buf);
+		}
 
-		if (index == 1) {
-			/* stdin */
-			int c = fgetc(stdin);
-			if (c < 0) {
-				continue;
-			}
-			if (c == 0x08 || c == 0x7F) {
-				/* Remove from buffer */
-				if (buf_p) {
-					buf[buf_p-1] = '\0';
-					buf_p--;
-					redraw_buffer(buf);
+		for (int i = 0; i < count; ++i) {
+			if (ready[i] == STDIN_FILENO) {
+				char keys[64];
+				ssize_t r = read(STDIN_FILENO, keys, sizeof(keys));
+				for (ssize_t k = 0; k < r; ++k) {
+					int c = (unsigned char)keys[k];
+					if (c == 0x08 || c == 0x7F) {
+						/* Remove from buffer */
+						if (buf_p) {
+							buf[buf_p-1] = '\0';
+							buf_p--;
+						}
+					} else if (c == 0x0C) {
+						/* ^L */
+						update_size();
+						redraw_screen();
+					} else if (c == '\n') {
+						/* Send buffer */
+						handle_input(buf);
+						memset(buf, 0, 1024);
+						buf_p = 0;
+					} else if (buf_p < 1023) {
+						/* Append buffer, or check special keys */
+						buf[buf_p] = c;
+						buf_p++;
+					}
 				}
-			} else if (c == '\n') {
-				/* Send buffer */
-				handle_input(buf);
-				memset(buf, 0, 1024);
-				buf_p = 0;
-			} else {
-				/* Append buffer, or check special keys */
-				buf[buf_p] = c;
-				buf_p++;
 				redraw_buffer(buf);
-			}
-		} else if (index == 0) {
-			/* network */
-			do {
-				int c = fgetc(sock_r);
-				if (c < 0) continue;
-				net_buf[net_buf_p] = c;
-				net_buf_p++;
-				if (c == '\n' || net_buf_p == 2046) {
-					handle(net_buf);
-					net_buf_p = 0;
-					memset(net_buf, 0, 2048);
-					redraw_buffer(buf);
+			} else if (ready[i] == sock_fd) {
+				/* Take everything the socket has, and handle each complete line */
+				ssize_t r;
+				while ((r = read(sock_fd, net_buf + net_buf_p, sizeof(net_buf) - 1 - net_buf_p)) > 0) {
+					net_buf_p += r;
+					char * start = net_buf;
+					char * end = net_buf + net_buf_p;
+					char * nl;
+					while ((nl = memchr(start, '\n', end - start))) {
+						char save = nl[1];
+						nl[1] = '\0';
+						handle(start);
+						nl[1] = save;
+						start = nl + 1;
+					}
+					net_buf_p = end - start;
+					if (net_buf_p == sizeof(net_buf) - 1) {
+						/* A line longer than the buffer goes out in pieces */
+						net_buf[net_buf_p] = '\0';
+						handle(net_buf);
+						net_buf_p = 0;
+					} else {
+						memmove(net_buf, start, net_buf_p);
+					}
 				}
-			} while (!_fwouldblock(sock_r));
-		} else {
-			/* timer */
+				if (r == 0) {
+					WRITE("[system] Disconnected.\n");
+					fswait_ctl(set, FSWAIT_DEL, sock_fd, 0);
+				}
+				redraw_buffer(buf);
+			}
 		}
 	}
 
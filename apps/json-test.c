@@ -71,6 +71,14 @@ int main(int argc, char * argv[]) {
 		assert(!result);
 	}
 
+	{
+		/* Escapes cut off by the end of the input */
+		assert(!json_parse("\"ab\\"));
+		assert(!json_parse("[\"x\\"));
+		assert(!json_parse("{\"k\\"));
+		assert(!json_parse("\"\\u12"));
+	}
+
 	{
 		Value * result = json_parse("{\"foo\": \"bar\", \"bix\": 123}");
 		assert(result && result->type == JSON_TYPE_OBJECT);
@@ -83,5 +91,47 @@ int main(int argc, char * argv[]) {
 		assert(fabs(((Value *)hashmap_get(hash, "bix"))->number - 123.0) < 0.00001);
 	}
 
+	{
+		struct JSON_Reader reader;
+		struct JSON_Token token;
+		char buf[32];
+		json_reader_init(&reader, "{\"skip\": [1, {\"a\": []}, \"x\"], \"na\\u00efve\": \"a\\tb\", \"n\": -2.5, \"t\": true}");
+
+		assert(json_next(&reader, &token) == JSON_TOKEN_OBJECT_BEGIN);
+		assert(json_next(&reader, &token) == JSON_TOKEN_KEY);
+		assert(json_token_is(&token, "skip"));
+		assert(json_skip(&reader) == 0);
+
+		assert(json_next(&reader, &token) == JSON_TOKEN_KEY);
+		assert(json_token_is(&token, "na\xc3\xafve"));
+		assert(!json_token_is(&token, "na"));
+		assert(json_next(&reader, &token) == JSON_TOKEN_STRING);
+		assert(json_token_string(&token, buf, sizeof(buf)) == 3);
+		assert(strcmp(buf, "a\tb") == 0);
+		assert(json_token_string(&token, buf, 2) == 3);
+		assert(strcmp(buf, "a") == 0);
+
+		assert(json_next(&reader, &token) == JSON_TOKEN_KEY);
+		assert(json_next(&reader, &token) == JSON_TOKEN_NUMBER);
+		assert(fabs(token.number - (-2.5)) < 0.00001);
+
+		assert(json_next(&reader, &token) == JSON_TOKEN_KEY);
+		assert(json_next(&reader, &token) == JSON_TOKEN_BOOL && token.boolean == 1);
+		assert(json_next(&reader, &token) == JSON_TOKEN_OBJECT_END);
+		assert(json_next(&reader, &token) == JSON_TOKEN_END);
+	}
+
+	{
+		struct JSON_Reader reader;
+		struct JSON_Token token;
+		json_reader_init(&reader, "[1, 2}");
+		assert(json_next(&reader, &token) == JSON_TOKEN_ARRAY_BEGIN);
+		assert(json_next(&reader, &token) == JSON_TOKEN_NUMBER);
+		assert(json_next(&reader, &token) == JSON_TOKEN_NUMBER);
+		assert(json_next(&reader, &token) == JSON_TOKEN_ERROR);
+		assert(reader.error);
+		assert(json_next(&reader, &token) == JSON_TOKEN_ERROR);
+	}
+
 	return 0;
 }
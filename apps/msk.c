@@ -11,12 +11,17 @@
  *
  * Packages can optionally be uncompressed, which is also
  * important for bootstrapping at the moment.
+ *
+ * Packages are installed one after another in dependency order,
+ * but their downloads run ahead: up to MAX_FETCHES fetch processes
+ * work on the next packages while the current one is extracted.
  */
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <toaru/confreader.h>
 #include <toaru/list.h>
@@ -25,6 +30,7 @@
 #define MSK_VERSION "1.0.0"
 #define VAR_PATH "/var/msk"
 #define LOCK_PATH "/var/run/msk.lock"
+#define MAX_FETCHES 3
 
 static confreader_t * msk_config = NULL;
 static confreader_t * msk_manifest = NULL;
@@ -289,24 +295,45 @@ static int process_package(list_t * pkgs, char * name) {
 	return 0;
 }
 
-static int install_package(char * pkg) {
-
-	char * type = confreader_getd(msk_manifest, pkg, "type", "");
+/**
+ * Start downloading a package from a remote store in the background.
+ *
+ * Returns the pid of the fetch process, 0 if the package is local,
+ * or -1 if the download could not be started. The package's source
+ * is pointed at the file being downloaded.
+ */
+static int start_download(char * pkg) {
 	char * msk_remote = confreader_get(msk_manifest, pkg, "remote_path");
+	if (!msk_remote || strstr(msk_remote, "http:") != msk_remote) return 0;
 
-	if (strstr(msk_remote, "http:") == msk_remote) {
-		char * source = confreader_get(msk_manifest, pkg, "source");
-		if (source) {
-			fprintf(stderr, "Download %s...\n", pkg);
-			char cmd[1024];
-			sprintf(cmd, "fetch -o /tmp/msk.file -v %s/%s", msk_remote,
-					source);
-			system(cmd);
-			hashmap_set(hashmap_get(msk_manifest->sections, pkg), "source", "/tmp/msk.file");
-		}
+	char * source = confreader_get(msk_manifest, pkg, "source");
+	if (!source) return 0;
+
+	char url[1024];
+	char path[1024];
+	snprintf(url, sizeof(url), "%s/%s", msk_remote, source);
+	snprintf(path, sizeof(path), "/tmp/msk.%s.file", pkg);
+
+	fprintf(stderr, "Download %s...\n", pkg);
+
+	int pid = fork();
+	if (pid == 0) {
+		/* Several downloads share the terminal, so no progress bars */
+		char * args[] = {"fetch", "-o", path, url, NULL};
+		execvp("fetch", args);
+		exit(1);
+	} else if (pid < 0) {
+		fprintf(stderr, "msk: failed to start download of '%s'\n", pkg);
+		return -1;
 	}
 
-	fprintf(stderr, "Install '%s'...\n", pkg);
+	hashmap_set(hashmap_get(msk_manifest->sections, pkg), "source", strdup(path));
+	return pid;
+}
+
+static int install_package(char * pkg) {
+
+	char * type = confreader_getd(msk_manifest, pkg, "type", "");
 
 	if (!strcmp(type, "file")) {
 		/* Legacy single-file package, has a source and a destination */
@@ -431,8 +458,38 @@ static int install_packages(int argc, char * argv[]) {
 		}
 	}
 
+	size_t count = ordered->length;
+	char ** pkgs = malloc(sizeof(char *) * count);
+	int * fetches = malloc(sizeof(int) * count);
+	size_t i = 0;
 	foreach(node, ordered) {
-		if (install_package(node->value)) {
+		pkgs[i++] = node->value;
+	}
+
+	size_t next_fetch = 0;
+	for (i = 0; i < count; ++i) {
+		/* Keep the next few downloads going while this package installs */
+		while (next_fetch < count && next_fetch < i + MAX_FETCHES) {
+			fetches[next_fetch] = start_download(pkgs[next_fetch]);
+			if (fetches[next_fetch] < 0) return 1;
+			next_fetch++;
+		}
+
+		if (fetches[i] > 0) {
+			int status;
+			waitpid(fetches[i], &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				fprintf(stderr, "msk: failed to download '%s'\n", pkgs[i]);
+				return 1;
+			}
+		}
+
+		fprintf(stderr, "[%d/%d] Install '%s'...\n", (int)i + 1, (int)count, pkgs[i]);
+		int status = install_package(pkgs[i]);
+		if (fetches[i] > 0) {
+			unlink(confreader_get(msk_manifest, pkgs[i], "source"));
+		}
+		if (status) {
 			return 1;
 		}
 	}
@@ -325,17 +325,51 @@ static void _menu_action_refresh(struct MenuEntry * entry) {
 	redraw_window();
 }
 
-static void install_package(struct Package * package) {
-	if (package->installed) return;
+/**
+ * Install a set of packages with one msk run, so that it can
+ * download the later ones while the earlier ones are extracted.
+ */
+static void install_packages(struct Package ** packages, int count) {
+	size_t len = sizeof("terminal msk install");
+	for (int i = 0; i < count; ++i) {
+		len += strlen(packages[i]->name) + 1;
+	}
 
-	putenv("MSK_YES=1");
-	char tmp[1024];
-	sprintf(tmp, "terminal msk install %s", package->name);
-	system(tmp);
+	char * cmd = malloc(len);
+	strcpy(cmd, "terminal msk install");
+	int any = 0;
+	for (int i = 0; i < count; ++i) {
+		if (packages[i]->installed) continue;
+		strcat(cmd, " ");
+		strcat(cmd, packages[i]->name);
+		any = 1;
+	}
 
-	load_manifest();
-	reinitialize_contents();
-	redraw_window();
+	if (any) {
+		putenv("MSK_YES=1");
+		system(cmd);
+
+		load_manifest();
+		reinitialize_contents();
+		redraw_window();
+	}
+	free(cmd);
+}
+
+static void install_package(struct Package * package) {
+	install_packages(&package, 1);
+}
+
+static void install_selected(void) {
+	struct Package ** selected = malloc(sizeof(struct Package *) * (pkg_pointers_len + 1));
+	int count = 0;
+	for (int i = 0; i < pkg_pointers_len; ++i) {
+		if (pkg_pointers[i]->selected) {
+			selected[count++] = pkg_pointers[i];
+		}
+	}
+	install_packages(selected, count);
+	free(selected);
 }
 
 static void _menu_action_about(struct MenuEntry * entry) {
@@ -519,11 +553,7 @@ int main(int argc, char * argv[]) {
 									arrow_select(-1);
 									break;
 								case '\n':
-									for (int i = 0; i <pkg_pointers_len; ++i) {
-										if (pkg_pointers[i]->selected) {
-											install_package(pkg_pointers[i]);
-										}
-									}
+									install_selected();
 									break;
 								case 'f':
 									if (ke->event.modifiers & YUTANI_KEY_MODIFIER_ALT) {
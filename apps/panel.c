@@ -201,11 +201,11 @@ static void sig_int(int sig) {
 }
 
 static void launch_application(char * app) {
-	if (!fork()) {
-		printf("Starting %s\n", app);
-		char * args[] = {"/bin/sh", "-c", app, NULL};
-		execvp(args[0], args);
-		exit(1);
+	printf("Starting %s\n", app);
+	char * args[] = {"/bin/sh", "-c", app, NULL};
+	if (!vfork()) {
+		execv(args[0], args);
+		_exit(1);
 	}
 }
 
@@ -808,7 +808,7 @@ static void redraw_alttab(void) {
 		if (icon->width == 48) {
 			draw_sprite(actx, icon, center_x_a(48), ALTTAB_OFFSET);
 		} else {
-			draw_sprite_scaled(actx, icon, center_x_a(48), ALTTAB_OFFSET, 48, 48);
+			draw_sprite(actx, get_scaled_sprite(icon, 48, 48), center_x_a(48), ALTTAB_OFFSET);
 		}
 
 		int t = draw_sdf_string_width(ad->name, 18, SDF_FONT_THIN);
@@ -978,9 +978,7 @@ static void handle_key_event(struct yutani_msg_key_event * ke) {
 
 }
 
-static void redraw(void) {
-	spin_lock(&drawlock);
-
+static void draw_clock(void) {
 	struct timeval now;
 	struct tm * timeinfo;
 	char   buffer[80];
@@ -988,9 +986,6 @@ static void redraw(void) {
 	uint32_t txt_color = TEXT_COLOR;
 	int t = 0;
 
-	/* Redraw the background */
-	memcpy(ctx->backbuffer, bg_blob, bg_size);
-
 	/* Get the current time for the clock */
 	gettimeofday(&now, NULL);
 	timeinfo = localtime((time_t *)&now.tv_sec);
@@ -1010,11 +1005,9 @@ static void redraw(void) {
 	t = draw_sdf_string_width(buffer, 12, SDF_FONT_BOLD);
 	t = (DATE_WIDTH - t) / 2;
 	draw_sdf_string(ctx, width - TIME_LEFT - DATE_WIDTH + t, 12, buffer, 12, calmenu->window ? HILIGHT_COLOR : txt_color, SDF_FONT_BOLD);
+}
 
-	/* Applications menu */
-	draw_sdf_string(ctx, 8, 3, "Applications", 20, appmenu->window ? HILIGHT_COLOR : txt_color, SDF_FONT_THIN);
-
-	/* Draw each widget */
+static void draw_widgets(void) {
 	int widget = 0;
 	/* Weather */
 	if (widgets_weather_enabled) {
@@ -1047,6 +1040,74 @@ static void redraw(void) {
 		}
 		widget++;
 	}
+}
+
+/* What the widgets last showed, to tell whether they need redrawing */
+struct widget_state {
+	int menus_open;    /* Applications and logout; outside the widget area */
+	int widgets_open;  /* Weather and network hilights */
+	uint32_t volume_level;
+	int network_status;
+	int widgets_width;
+	sprite_t * weather_icon;
+	char weather_temp[32];
+};
+
+static void widget_state_get(struct widget_state * state) {
+	memset(state, 0, sizeof(struct widget_state));
+	state->menus_open = (appmenu->window ? 1 : 0) | (logout_menu->window ? 2 : 0);
+	state->widgets_open = (weather && weather->window ? 1 : 0) | (netstat && netstat->window ? 2 : 0);
+	state->volume_level = volume_level;
+	state->network_status = network_status;
+	state->widgets_width = widgets_width;
+	state->weather_icon = weather_icon;
+	snprintf(state->weather_temp, sizeof(state->weather_temp), "%s", weather_temp_str ? weather_temp_str : "");
+}
+
+/*
+ * Redraw just one horizontal span of the panel - the clock, or the
+ * widgets - and send only that to the compositor.
+ */
+#define DAMAGE_CLOCK   1
+#define DAMAGE_WIDGETS 2
+
+static void redraw_damaged(int damage) {
+	spin_lock(&drawlock);
+
+	int left  = (damage & DAMAGE_WIDGETS) ? WIDGET_RIGHT - widgets_width : WIDGET_RIGHT;
+	int right = (damage & DAMAGE_CLOCK) ? width - 23 : WIDGET_RIGHT; /* Up to the logout button */
+	if (left < 0) left = 0;
+
+	/* Put the background back under the span */
+	for (int y = 0; y < PANEL_HEIGHT; ++y) {
+		memcpy(&GFX(ctx, left, y), &bg_blob[(y * ctx->width + left) * sizeof(uint32_t)], (right - left) * sizeof(uint32_t));
+	}
+
+	if (damage & DAMAGE_CLOCK) draw_clock();
+	if (damage & DAMAGE_WIDGETS) draw_widgets();
+
+	gfx_rect_t rect = { left, 0, right - left, PANEL_HEIGHT };
+	flip_regions(ctx, &rect, 1);
+	yutani_flip_region(yctx, panel, left, 0, right - left, PANEL_HEIGHT);
+
+	spin_unlock(&drawlock);
+}
+
+static void redraw(void) {
+	spin_lock(&drawlock);
+
+	uint32_t txt_color = TEXT_COLOR;
+
+	/* Redraw the background */
+	memcpy(ctx->backbuffer, bg_blob, bg_size);
+
+	draw_clock();
+
+	/* Applications menu */
+	draw_sdf_string(ctx, 8, 3, "Applications", 20, appmenu->window ? HILIGHT_COLOR : txt_color, SDF_FONT_THIN);
+
+	/* Draw each widget */
+	draw_widgets();
 
 	/* Now draw the window list */
 	int i = 0, j = 0;
@@ -1108,7 +1169,7 @@ static void redraw(void) {
 				if (icon->width == 48) {
 					draw_sprite(_tmp, icon, 0, 0);
 				} else {
-					draw_sprite_scaled(_tmp, icon, 0, 0, 48, 48);
+					draw_sprite(_tmp, get_scaled_sprite(icon, 48, 48), 0, 0);
 				}
 
 				free(_tmp);
@@ -1298,6 +1359,8 @@ static void resize_finish(int xwidth, int xheight) {
 
 static void bind_keys(void) {
 
+	yutani_batch_begin(yctx);
+
 	/* Cltr-Alt-T = launch terminal */
 	yutani_key_bind(yctx, 't', KEY_MOD_LEFT_CTRL | KEY_MOD_LEFT_ALT, YUTANI_BIND_STEAL);
 
@@ -1320,12 +1383,15 @@ static void bind_keys(void) {
 	/* This lets us receive all just-modifier key releases */
 	yutani_key_bind(yctx, KEY_LEFT_ALT, 0, YUTANI_BIND_PASSTHROUGH);
 
+	yutani_batch_commit(yctx);
 }
 
 static void sig_usr2(int sig) {
+	yutani_batch_begin(yctx);
 	yutani_set_stack(yctx, panel, YUTANI_ZORDER_TOP);
 	yutani_flip(yctx, panel);
 	bind_keys();
+	yutani_batch_commit(yctx);
 	signal(SIGUSR2, sig_usr2);
 }
 
@@ -1593,12 +1659,25 @@ int main (int argc, char ** argv) {
 	bind_keys();
 
 	time_t last_tick = 0;
+	struct widget_state last_widgets;
+	widget_state_get(&last_widgets);
 
 	int fds[1] = {fileno(yctx->sock)};
 
 	while (_continue) {
 
-		int index = fswait2(1,fds,clockmenu->window ? 50 : 200);
+		/*
+		 * Sleep until the clock next changes; the clock menu's second
+		 * hand sweeps, so it wants frames more often while it's open.
+		 */
+		int timeout = 50;
+		if (!clockmenu->window) {
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			timeout = 1000 - now.tv_usec / 1000 + 1;
+		}
+
+		int index = fswait2(1,fds,timeout);
 
 		if (clockmenu->window) {
 			menu_force_redraw(clockmenu);
@@ -1650,7 +1729,19 @@ int main (int argc, char ** argv) {
 				update_volume_level();
 				update_network_status();
 				update_weather_status();
-				redraw();
+
+				struct widget_state widgets;
+				widget_state_get(&widgets);
+				if (widgets.widgets_width != last_widgets.widgets_width ||
+					widgets.menus_open != last_widgets.menus_open) {
+					/* Widgets came or went (moving the window list), or a menu outside the status area opened or closed */
+					redraw();
+				} else if (memcmp(&widgets, &last_widgets, sizeof(widgets))) {
+					redraw_damaged(DAMAGE_CLOCK | DAMAGE_WIDGETS);
+				} else {
+					redraw_damaged(DAMAGE_CLOCK);
+				}
+				last_widgets = widgets;
 			}
 		}
 	}
@@ -0,0 +1,206 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * perf - Report where the kernel profiler's samples landed
+ *
+ * Reads /proc/profile and counts samples by kernel function, with
+ * time spent in user mode counted by process name. With -t, watches
+ * for a number of seconds and reports only what was sampled then.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <toaru/hashmap.h>
+#include <toaru/list.h>
+
+struct entry {
+	char * name;
+	int count;
+};
+
+static hashmap_t * counts = NULL;
+static hashmap_t * process_names = NULL;
+static int total = 0;
+
+static int filter_pid = -1;
+static int kernel_only = 0;
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"perf - report on kernel profiler samples\n"
+			"\n"
+			"usage: %s [-k] [-p pid] [-n count] [-t seconds]\n"
+			"\n"
+			" -k     \033[3monly count samples taken in the kernel\033[0m\n"
+			" -p     \033[3monly count samples from one process\033[0m\n"
+			" -n     \033[3mshow this many entries (default 20)\033[0m\n"
+			" -t     \033[3mcollect for this long instead of reading what's there\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+}
+
+static char * process_name(int pid) {
+	char * name = hashmap_get(process_names, (void *)(uintptr_t)pid);
+	if (name) return name;
+
+	char path[64];
+	sprintf(path, "/proc/%d/status", pid);
+	FILE * f = fopen(path, "r");
+	char line[256];
+	char buf[300];
+	sprintf(buf, "[user] pid %d", pid);
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strncmp(line, "Name:\t", 6)) {
+				char * n = strchr(line, '\n');
+				if (n) *n = '\0';
+				sprintf(buf, "[user] %s", line + 6);
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	name = strdup(buf);
+	hashmap_set(process_names, (void *)(uintptr_t)pid, name);
+	return name;
+}
+
+static void count_sample(int pid, char * symbol) {
+	char * key;
+	if (!strcmp(symbol, "[user]")) {
+		if (kernel_only) return;
+		key = process_name(pid);
+	} else {
+		/* Count by function, not by offset */
+		char * plus = strchr(symbol, '+');
+		if (plus) *plus = '\0';
+		key = symbol;
+	}
+
+	struct entry * e = hashmap_get(counts, key);
+	if (!e) {
+		e = malloc(sizeof(struct entry));
+		e->name = strdup(key);
+		e->count = 0;
+		hashmap_set(counts, key, e);
+	}
+	e->count++;
+	total++;
+}
+
+/*
+ * Read the profile, counting samples numbered `from` or later.
+ * Returns the number the next new sample will have.
+ */
+static unsigned long read_profile(unsigned long from, int record) {
+	FILE * f = fopen("/proc/profile", "r");
+	if (!f) {
+		fprintf(stderr, "perf: /proc/profile: no profiler\n");
+		exit(1);
+	}
+
+	unsigned long next = from;
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') {
+			/* "# N samples, M taken" */
+			char * taken = strchr(line, ',');
+			if (taken) next = strtoul(taken + 1, NULL, 10);
+			continue;
+		}
+		char * p = line;
+		unsigned long seq = strtoul(p, &p, 10);
+		int pid = strtol(p, &p, 10);
+		strtoul(p, &p, 16);
+		while (*p == ' ') p++;
+		char * n = strchr(p, '\n');
+		if (n) *n = '\0';
+
+		if (!record || seq < from) continue;
+		if (filter_pid != -1 && pid != filter_pid) continue;
+		count_sample(pid, p);
+	}
+
+	fclose(f);
+	return next;
+}
+
+static int sort_entries(const void * a, const void * b) {
+	const struct entry * x = *(const struct entry **)a;
+	const struct entry * y = *(const struct entry **)b;
+	return y->count - x->count;
+}
+
+static unsigned long now_ms(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000 + t.tv_usec / 1000;
+}
+
+int main(int argc, char * argv[]) {
+	int show = 20;
+	int seconds = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "kp:n:t:?")) != -1) {
+		switch (c) {
+			case 'k':
+				kernel_only = 1;
+				break;
+			case 'p':
+				filter_pid = atoi(optarg);
+				break;
+			case 'n':
+				show = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	counts = hashmap_create(64);
+	process_names = hashmap_create_int(16);
+
+	if (seconds > 0) {
+		/* The ring only holds a few seconds; keep up with it */
+		unsigned long next = read_profile(0, 0);
+		unsigned long end = now_ms() + seconds * 1000;
+		while (now_ms() < end) {
+			usleep(250000);
+			next = read_profile(next, 1);
+		}
+	} else {
+		read_profile(0, 1);
+	}
+
+	if (!total) {
+		printf("No samples.\n");
+		return 0;
+	}
+
+	list_t * values = hashmap_values(counts);
+	struct entry ** entries = malloc(sizeof(struct entry *) * values->length);
+	int count = 0;
+	foreach(node, values) {
+		entries[count++] = node->value;
+	}
+	qsort(entries, count, sizeof(struct entry *), sort_entries);
+
+	printf("%d samples\n\n", total);
+	for (int i = 0; i < count && i < show; ++i) {
+		int tenths = entries[i]->count * 1000 / total;
+		printf("%3d.%d%% %7d  %s\n", tenths / 10, tenths % 10, entries[i]->count, entries[i]->name);
+	}
+
+	return 0;
+}
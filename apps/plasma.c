@@ -20,7 +20,7 @@
 #include <toaru/spinlock.h>
 #include <toaru/menu.h>
 
-#define dist(a,b,c,d) sqrt((double)(((a) - (c)) * ((a) - (c)) + ((b) - (d)) * ((b) - (d))))
+#define dist2(a,b,c,d) (((a) - (c)) * ((a) - (c)) + ((b) - (d)) * ((b) - (d)))
 
 static yutani_t * yctx;
 static yutani_window_t * wina;
@@ -76,13 +76,28 @@ void * draw_thread(void * garbage) {
 		time += 1.0;
 
 		spin_lock(&draw_lock);
-		for (int x = 0; x < win_width; ++x) {
-			for (int y = 0; y < win_height; ++y) {
-				double value = sin(dist(x + time, y, 128.0, 128.0) / 8.0)
-					+ sin(dist(x, y, 64.0, 64.0) / 8.0)
-					+ sin(dist(x, y + time / 7, 192.0, 64) / 7.0)
-					+ sin(dist(x, y, 192.0, 100.0) / 8.0);
-				GFX(ctx, x + off_x, y + off_y) = palette[(int)((value + 4) * 32)];
+		/* Four pixels at a time; the last few in a row may be computed and thrown away */
+		for (int y = 0; y < win_height; ++y) {
+			for (int x = 0; x < win_width; x += 4) {
+				float d[4][4], s[4][4];
+				for (int i = 0; i < 4; ++i) {
+					float fx = x + i;
+					d[0][i] = dist2(fx + time, y, 128.0f, 128.0f);
+					d[1][i] = dist2(fx, y, 64.0f, 64.0f);
+					d[2][i] = dist2(fx, y + time / 7, 192.0f, 64.0f);
+					d[3][i] = dist2(fx, y, 192.0f, 100.0f);
+				}
+				for (int j = 0; j < 4; ++j) {
+					sqrtf4(d[j], d[j]);
+					for (int i = 0; i < 4; ++i) d[j][i] /= (j == 2 ? 7.0f : 8.0f);
+					sinf4_fast(d[j], s[j]);
+				}
+				for (int i = 0; i < 4 && x + i < win_width; ++i) {
+					int value = (s[0][i] + s[1][i] + s[2][i] + s[3][i] + 4) * 32;
+					if (value < 0) value = 0;
+					if (value > 255) value = 255;
+					GFX(ctx, x + i + off_x, y + off_y) = palette[value];
+				}
 			}
 		}
 		redraw_borders();
@@ -5,24 +5,46 @@
  *
  * play - Play back PCM samples
  *
- * This needs very specifically-formatted PCM data to function
- * properly - 16-bit, signed, stereo, little endian, and 48KHz.
+ * Plays raw little-endian PCM data, 16-bit signed stereo at 48KHz
+ * unless told otherwise; the kernel converts anything else.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
 
 #include <sys/ioctl.h>
+#include <kernel/mod/sound.h>
+
+static int usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-r rate] [-c channels] [-b bits] file\n", argv[0]);
+	return 1;
+}
 
 int main(int argc, char * argv[]) {
+	snd_dsp_format_t format = {0, 0, 0};
+	int opt;
+	while ((opt = getopt(argc, argv, "r:c:b:")) != -1) {
+		switch (opt) {
+			case 'r': format.rate = atoi(optarg); break;
+			case 'c': format.channels = atoi(optarg); break;
+			case 'b': format.bits = atoi(optarg); break;
+			default: return usage(argv);
+		}
+	}
+	if (optind >= argc) {
+		return usage(argv);
+	}
+
 	int spkr = open("/dev/dsp", O_WRONLY);
 	int song;
-	if (!strcmp(argv[1], "-")) {
+	if (!strcmp(argv[optind], "-")) {
 		song = STDIN_FILENO;
 	} else {
-		song = open(argv[1], O_RDONLY);
+		song = open(argv[optind], O_RDONLY);
 	}
 
 	if (spkr == -1) {
@@ -30,6 +52,11 @@ int main(int argc, char * argv[]) {
 		return 1;
 	}
 
+	if ((format.rate || format.channels || format.bits) && ioctl(spkr, SND_DSP_SET_FORMAT, &format) < 0) {
+		fprintf(stderr, "%s: unsupported format\n", argv[0]);
+		return 1;
+	}
+
 	if (song == -1) {
 		fprintf(stderr, "audio file not found\n");
 		return 2;
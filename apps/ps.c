@@ -29,7 +29,7 @@ static int show_username = 0;
 static int show_mem = 0;
 static int collect_commandline = 0;
 
-static int widths[] = {3,3,4,3,3,4};
+static int widths[] = {3,3,4,3,3,4,4};
 
 struct process {
 	int uid;
@@ -38,6 +38,7 @@ struct process {
 	int mem;
 	int vsz;
 	int shm;
+	int time; /* CPU time, in milliseconds */
 	char * process;
 	char * command_line;
 };
@@ -114,9 +115,25 @@ struct process * process_entry(struct dirent *dent) {
 	out->mem = mem;
 	out->shm = shm;
 	out->vsz = vsz;
+	out->time = 0;
 	out->process = strdup(name);
 	out->command_line = NULL;
 
+	if (show_mem) {
+		sprintf(tmp, "/proc/%s/stat", dent->d_name);
+		f = fopen(tmp, "r");
+		if (f) {
+			while (fgets(line, LINE_LEN, f) != NULL) {
+				char * tab = strstr(line,"\t");
+				if (!tab) continue;
+				if (strstr(line, "UserTime:") == line || strstr(line, "SystemTime:") == line) {
+					out->time += atoi(tab + 1);
+				}
+			}
+			fclose(f);
+		}
+	}
+
 	char garbage[1024];
 	int len;
 
@@ -125,6 +142,7 @@ struct process * process_entry(struct dirent *dent) {
 	if ((len = sprintf(garbage, "%d", out->vsz)) > widths[3]) widths[3] = len;
 	if ((len = sprintf(garbage, "%d", out->shm)) > widths[4]) widths[4] = len;
 	if ((len = sprintf(garbage, "%d.%01d", out->mem / 10, out->mem % 10)) > widths[5]) widths[5] = len;
+	if ((len = sprintf(garbage, "%d:%02d", out->time / 60000, (out->time / 1000) % 60)) > widths[6]) widths[6] = len;
 
 	struct passwd * p = getpwuid(out->uid);
 	if (p) {
@@ -169,6 +187,7 @@ void print_header(void) {
 		printf("%*s ", widths[5], "MEM%");
 		printf("%*s ", widths[3], "VSZ");
 		printf("%*s ", widths[4], "SHM");
+		printf("%*s ", widths[6], "TIME");
 	}
 	printf("CMD\n");
 }
@@ -188,11 +207,13 @@ void print_entry(struct process * out) {
 		printf("%*d ", widths[1], out->tid);
 	}
 	if (show_mem) {
-		char tmp[6];
+		char tmp[16];
 		sprintf(tmp, "%*d.%01d", widths[5]-2, out->mem / 10, out->mem % 10);
 		printf("%*s ", widths[5], tmp);
 		printf("%*d ", widths[3], out->vsz);
 		printf("%*d ", widths[4], out->shm);
+		sprintf(tmp, "%d:%02d", out->time / 60000, (out->time / 1000) % 60);
+		printf("%*s ", widths[6], tmp);
 	}
 	if (out->command_line) {
 		printf("%s\n", out->command_line);
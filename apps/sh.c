@@ -62,6 +62,13 @@ FILE * shell_stderr; /* specifically for `time` */
 /* This is the number of actual commands installed */
 int shell_commands_len = 0;
 
+/* Builtins by name, so finding one doesn't walk every PATH entry */
+static hashmap_t * shell_builtins = NULL;
+
+/* Command name -> full path, filled in as commands are run; see `hash` */
+static hashmap_t * command_hash = NULL;
+static char * command_hash_path = NULL; /* $PATH the hash was built from */
+
 int shell_interactive = 1;
 int last_ret = 0;
 char ** shell_argv = NULL;
@@ -127,15 +134,80 @@ void shell_install_command(char * name, shell_command_t func, char * desc) {
 	shell_descript[shell_commands_len] = desc;
 	shell_commands_len++;
 	shell_commands[shell_commands_len] = NULL;
+
+	if (func) {
+		if (!shell_builtins) {
+			shell_builtins = hashmap_create(64);
+		}
+		hashmap_set(shell_builtins, name, (void*)func);
+	}
 }
 
 shell_command_t shell_find(char * str) {
-	for (int i = 0; i < shell_commands_len; ++i) {
-		if (!strcmp(str, shell_commands[i])) {
-			return shell_pointers[i];
+	if (!shell_builtins) return NULL;
+	return (shell_command_t)hashmap_get(shell_builtins, str);
+}
+
+void command_hash_clear(void) {
+	if (!command_hash) return;
+	list_t * paths = hashmap_values(command_hash);
+	list_destroy(paths);
+	list_free(paths);
+	free(paths);
+	hashmap_free(command_hash);
+	free(command_hash);
+	command_hash = NULL;
+}
+
+/*
+ * Find the full path for an external command, searching $PATH the
+ * way execvp does only if we haven't seen the command before. The
+ * table is thrown away whenever $PATH changes. Returns NULL for
+ * builtins, paths, and anything not found.
+ */
+char * command_hash_find(char * name) {
+	if (strchr(name, '/') || shell_find(name)) return NULL;
+
+	char * path = getenv("PATH");
+	if (!path) path = "/bin";
+
+	if (command_hash && strcmp(path, command_hash_path)) {
+		command_hash_clear();
+	}
+	if (!command_hash) {
+		command_hash = hashmap_create(64);
+		free(command_hash_path);
+		command_hash_path = strdup(path);
+	}
+
+	char * found = hashmap_get(command_hash, name);
+	if (found) return found;
+
+	char * xpath = strdup(path);
+	char * p, * last;
+	for ((p = strtok_r(xpath, ":", &last)); p; p = strtok_r(NULL, ":", &last)) {
+		char * exe = malloc(strlen(p) + strlen(name) + 2);
+		sprintf(exe, "%s/%s", p, name);
+		struct stat stat_buf;
+		if (!stat(exe, &stat_buf) && S_ISREG(stat_buf.st_mode) && (stat_buf.st_mode & 0111)) {
+			hashmap_set(command_hash, name, exe);
+			found = exe;
+			break;
 		}
+		free(exe);
+	}
+	free(xpath);
+	return found;
+}
+
+/* exec a command through the hash, falling back to a fresh search if the hashed path went away */
+int exec_hashed(char ** args) {
+	char * exe = command_hash_find(*args);
+	if (exe) {
+		execv(exe, args);
+		if (errno != ENOENT) return -1;
 	}
-	return NULL;
+	return execvp(*args, args);
 }
 
 void install_commands();
@@ -753,7 +825,7 @@ static struct alternative cmd_alternatives[] = {
 };
 
 void run_cmd(char ** args) {
-	int i = execvp(*args, args);
+	int i = exec_hashed(args);
 	shell_command_t func = shell_find(*args);
 	if (func) {
 		int argc = 0;
@@ -1370,6 +1442,11 @@ _nope:
 		argv[tokenid-1] = NULL;
 	}
 
+	/* Look commands up here, before forking, so the children's searches are remembered */
+	for (int j = 0; j <= cmdi; ++j) {
+		if (arg_starts[j][0]) command_hash_find(arg_starts[j][0]);
+	}
+
 	int pgid = 0;
 	if (cmdi > 0) {
 		int last_output[2];
@@ -1653,6 +1730,29 @@ void source_eshrc(void) {
 	run_script(f);
 }
 
+/*
+ * Keep history in $HISTFILE (~/.esh_history by default), shared
+ * with any other shells using the same file. $HISTSIZE sets how
+ * many entries we keep.
+ */
+void open_history(void) {
+	char * size = getenv("HISTSIZE");
+	rline_history_max = (size && atoi(size) > 0) ? atoi(size) : 1000;
+
+	char * file = getenv("HISTFILE");
+	if (file) {
+		if (*file) rline_history_open(file);
+		return;
+	}
+
+	char * home = getenv("HOME");
+	if (!home) return;
+
+	char tmp[512];
+	sprintf(tmp, "%s/.esh_history", home);
+	rline_history_open(tmp);
+}
+
 int main(int argc, char ** argv) {
 
 	pid = getpid();
@@ -1718,6 +1818,7 @@ int main(int argc, char ** argv) {
 	signal(SIGTTIN, SIG_IGN);
 
 	source_eshrc();
+	open_history();
 	add_path();
 	sort_commands();
 
@@ -2080,7 +2181,7 @@ uint32_t shell_cmd_source(int argc, char * argv[]) {
 
 uint32_t shell_cmd_exec(int argc, char * argv[]) {
 	if (argc < 2) return 1;
-	return execvp(argv[1], &argv[1]);
+	return exec_hashed(&argv[1]);
 }
 
 uint32_t shell_cmd_not(int argc, char * argv[]) {
@@ -2239,6 +2340,12 @@ uint32_t shell_cmd_rehash(int argc, char * argv[]) {
 	}
 	/* Clear array */
 	shell_commands_len = 0;
+	if (shell_builtins) {
+		hashmap_free(shell_builtins);
+		free(shell_builtins);
+		shell_builtins = NULL;
+	}
+	command_hash_clear();
 	/* Reset capacity */
 	SHELL_COMMANDS = 64;
 	/* Free existing */
@@ -2253,6 +2360,37 @@ uint32_t shell_cmd_rehash(int argc, char * argv[]) {
 	return 0;
 }
 
+uint32_t shell_cmd_hash(int argc, char * argv[]) {
+	if (argc > 1 && !strcmp(argv[1], "-r")) {
+		command_hash_clear();
+		return 0;
+	}
+
+	if (argc > 1) {
+		int ret = 0;
+		for (int i = 1; i < argc; ++i) {
+			if (!shell_find(argv[i]) && !command_hash_find(argv[i])) {
+				fprintf(stderr, "%s: %s: not found\n", argv[0], argv[i]);
+				ret = 1;
+			}
+		}
+		return ret;
+	}
+
+	if (!command_hash || hashmap_is_empty(command_hash)) {
+		fprintf(stderr, "%s: hash table empty\n", argv[0]);
+		return 0;
+	}
+
+	list_t * keys = hashmap_keys(command_hash);
+	foreach(node, keys) {
+		printf("%s\t%s\n", (char*)node->value, (char*)hashmap_get(command_hash, node->value));
+	}
+	list_free(keys);
+	free(keys);
+	return 0;
+}
+
 uint32_t shell_cmd_time(int argc, char * argv[]) {
 	int pid, ret_code = 0;
 	struct timeval start, end;
@@ -2318,5 +2456,6 @@ void install_commands() {
 	shell_install_command("jobs",    shell_cmd_jobs, "list stopped jobs");
 	shell_install_command("bg",      shell_cmd_bg, "restart suspended job in the background");
 	shell_install_command("rehash",  shell_cmd_rehash, "reset shell command memory");
+	shell_install_command("hash",    shell_cmd_hash, "list remembered command paths, or forget them with -r");
 	shell_install_command("time",    shell_cmd_time, "time a command");
 }
@@ -5,96 +5,638 @@
  *
  * sort - Sort standard in or files.
  *
- * Currently implemented with a naive insertion sort.
+ * Lines are compared case-insensitively, ignoring anything that
+ * isn't a letter or digit. Rather than work that out on every
+ * comparison, each line's sort key (the lowercased letters and
+ * digits of the line, or of the fields picked with -k, or its
+ * numeric value with -n) is extracted once up front, and the
+ * first four key bytes are packed into an integer so most
+ * comparisons never touch the key itself. Lines are then merge
+ * sorted, which keeps equal lines in input order.
+ *
+ * Input beyond the memory budget (-S) is sorted in chunks that
+ * are written out to temporary files and merged at the end.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
 #include <ctype.h>
-#include <toaru/list.h>
+#include <fcntl.h>
+
+#define IO_BLOCK      0x10000
+#define ARENA_BLOCK   0x100000
+#define DEFAULT_LIMIT 0x1000000
+#define MAX_RUNS      16
+
+struct line {
+	char * text;
+	size_t len;
+	unsigned char * key;
+	size_t key_len;
+	uint32_t prefix;
+	double num;
+};
+
+static int reverse = 0;
+static int numeric = 0;
+static int unique = 0;
+static int key_start = 0; /* first field of the key, 1-based; 0 for the whole line */
+static int key_end = 0;   /* last field of the key; 0 for the end of the line */
+
+static char * argv_0;
+
+/* Key extraction {{{ */
+
+static int is_blank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+/* Narrow [*start, *end) down to the fields selected with -k */
+static void select_fields(const char ** start, const char ** end) {
+	if (!key_start) return;
+	const char * p = *start;
+	const char * e = *end;
+	int field = 1;
+	/* A field is a run of blanks followed by a run of non-blanks */
+	while (field < key_start && p < e) {
+		while (p < e && is_blank(*p)) p++;
+		while (p < e && !is_blank(*p)) p++;
+		field++;
+	}
+	*start = p;
+	if (key_end) {
+		for (; field <= key_end && p < e; field++) {
+			while (p < e && is_blank(*p)) p++;
+			while (p < e && !is_blank(*p)) p++;
+		}
+		*end = p;
+	}
+}
 
-int compare(const char * a, const char * b) {
+static double parse_number(const char * p, const char * e) {
+	double out = 0;
+	int neg = 0;
+	while (p < e && is_blank(*p)) p++;
+	if (p < e && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+	while (p < e && isdigit((unsigned char)*p)) out = out * 10 + (*p++ - '0');
+	if (p < e && *p == '.') {
+		double scale = 0.1;
+		for (p++; p < e && isdigit((unsigned char)*p); p++, scale /= 10) {
+			out += (*p - '0') * scale;
+		}
+	}
+	return neg ? -out : out;
+}
+
+/*
+ * Fill in the key of a line. The key bytes go to `key`, which must
+ * have room for `len` bytes.
+ */
+static void make_key(struct line * l, unsigned char * key) {
+	const char * start = l->text;
+	const char * end = l->text + l->len;
+	select_fields(&start, &end);
+
+	l->num = numeric ? parse_number(start, end) : 0;
+
+	size_t n = 0;
+	for (const char * p = start; p < end; ++p) {
+		if (isalnum((unsigned char)*p)) key[n++] = tolower((unsigned char)*p);
+	}
+	l->key = key;
+	l->key_len = n;
+
+	uint32_t prefix = 0;
+	for (size_t i = 0; i < 4; ++i) {
+		prefix = (prefix << 8) | (i < n ? key[i] : 0);
+	}
+	l->prefix = prefix;
+}
+
+static int compare(const struct line * a, const struct line * b) {
+	int out = 0;
+	if (numeric && a->num != b->num) {
+		out = a->num < b->num ? -1 : 1;
+	} else if (a->prefix != b->prefix) {
+		out = a->prefix < b->prefix ? -1 : 1;
+	} else if (a->key_len > 4 && b->key_len > 4) {
+		size_t n = (a->key_len < b->key_len ? a->key_len : b->key_len) - 4;
+		out = memcmp(a->key + 4, b->key + 4, n);
+		if (!out && a->key_len != b->key_len) out = a->key_len < b->key_len ? -1 : 1;
+	} else if (a->key_len != b->key_len) {
+		/* Key bytes are never zero, so equal prefixes mean the shorter key is a prefix of the longer */
+		out = a->key_len < b->key_len ? -1 : 1;
+	}
+	return reverse ? -out : out;
+}
+
+/* }}} */
+
+/* Buffered I/O {{{ */
+
+struct reader {
+	int fd;
+	char * buf;
+	size_t size;
+	size_t start;
+	size_t end;
+	int eof;
+};
+
+static void reader_init(struct reader * r, int fd, size_t size) {
+	r->fd = fd;
+	r->buf = malloc(size);
+	r->size = size;
+	r->start = 0;
+	r->end = 0;
+	r->eof = 0;
+}
+
+/*
+ * Return the next line (without its newline), valid until the next
+ * call, or NULL at the end of the input.
+ */
+static char * reader_line(struct reader * r, size_t * len) {
+	size_t scanned = r->start;
 	while (1) {
-		while (*a == *b || tolower(*a) == tolower(*b)) {
-			if (!*a) return 0;
-			a++;
-			b++;
+		char * nl = memchr(r->buf + scanned, '\n', r->end - scanned);
+		if (nl) {
+			char * line = r->buf + r->start;
+			*len = nl - line;
+			r->start = nl + 1 - r->buf;
+			return line;
+		}
+		if (r->eof) {
+			if (r->start == r->end) return NULL;
+			char * line = r->buf + r->start;
+			*len = r->end - r->start;
+			r->start = r->end;
+			return line;
 		}
+		/* Make room: slide the partial line down, or grow for very long lines */
+		if (r->start) {
+			memmove(r->buf, r->buf + r->start, r->end - r->start);
+			r->end -= r->start;
+			r->start = 0;
+		} else if (r->end == r->size) {
+			r->size *= 2;
+			r->buf = realloc(r->buf, r->size);
+		}
+		scanned = r->end;
+		ssize_t got = read(r->fd, r->buf + r->end, r->size - r->end);
+		if (got <= 0) {
+			if (got < 0) fprintf(stderr, "%s: read error: %s\n", argv_0, strerror(errno));
+			r->eof = 1;
+		} else {
+			r->end += got;
+		}
+	}
+}
 
-		while (*a && !isalnum(*a)) a++;
-		while (*b && !isalnum(*b)) b++;
+struct writer {
+	int fd;
+	char buf[IO_BLOCK];
+	size_t len;
+};
 
-		if (tolower(*a) == tolower(*b)) continue;
+static int writer_flush(struct writer * w) {
+	size_t done = 0;
+	while (done < w->len) {
+		ssize_t r = write(w->fd, w->buf + done, w->len - done);
+		if (r <= 0) {
+			fprintf(stderr, "%s: write error: %s\n", argv_0, strerror(errno));
+			return -1;
+		}
+		done += r;
+	}
+	w->len = 0;
+	return 0;
+}
 
-		if (tolower(*a) < tolower(*b)) return -1;
-		return 1;
+static int writer_line(struct writer * w, const char * text, size_t len) {
+	while (len + 1 > IO_BLOCK - w->len) {
+		size_t n = IO_BLOCK - w->len;
+		if (n > len) n = len;
+		memcpy(w->buf + w->len, text, n);
+		w->len += n;
+		text += n;
+		len -= n;
+		if (writer_flush(w) < 0) return -1;
 	}
+	memcpy(w->buf + w->len, text, len);
+	w->len += len;
+	w->buf[w->len++] = '\n';
+	return 0;
+}
+
+/* }}} */
+
+/* In-memory chunks {{{ */
+
+struct chunk {
+	struct line * lines;
+	size_t count;
+	size_t space;
+	char ** arenas;
+	size_t arena_count;
+	size_t arena_used;
+	size_t bytes;
+};
+
+static char * chunk_block(struct chunk * c, size_t size) {
+	c->arenas = realloc(c->arenas, sizeof(char *) * (c->arena_count + 1));
+	c->arenas[c->arena_count++] = malloc(size ? size : 1);
+	return c->arenas[c->arena_count - 1];
+}
+
+static void * chunk_alloc(struct chunk * c, size_t size) {
+	if (size > ARENA_BLOCK / 4) {
+		/* Long lines get a block of their own; the current arena stays current */
+		char * out = chunk_block(c, size);
+		c->bytes += size;
+		if (c->arena_count > 1) {
+			c->arenas[c->arena_count - 1] = c->arenas[c->arena_count - 2];
+			c->arenas[c->arena_count - 2] = out;
+		} else {
+			c->arena_used = ARENA_BLOCK;
+		}
+		return out;
+	}
+	if (!c->arena_count || c->arena_used + size > ARENA_BLOCK) {
+		chunk_block(c, ARENA_BLOCK);
+		c->arena_used = 0;
+	}
+	char * out = c->arenas[c->arena_count - 1] + c->arena_used;
+	c->arena_used += size;
+	c->bytes += size;
+	return out;
+}
+
+static void chunk_add(struct chunk * c, const char * text, size_t len) {
+	if (c->count == c->space) {
+		c->space = c->space ? c->space * 2 : 1024;
+		c->lines = realloc(c->lines, sizeof(struct line) * c->space);
+	}
+	struct line * l = &c->lines[c->count++];
+	char * copy = chunk_alloc(c, len * 2);
+	memcpy(copy, text, len);
+	l->text = copy;
+	l->len = len;
+	make_key(l, (unsigned char *)copy + len);
+	c->bytes += sizeof(struct line);
+}
+
+static void chunk_reset(struct chunk * c) {
+	for (size_t i = 0; i < c->arena_count; ++i) {
+		free(c->arenas[i]);
+	}
+	c->arena_count = 0;
+	c->arena_used = 0;
+	c->count = 0;
+	c->bytes = 0;
+}
+
+static void merge_sort(struct line ** items, struct line ** tmp, size_t count) {
+	if (count < 2) return;
+	if (count <= 8) {
+		/* Stable insertion sort for short runs */
+		for (size_t i = 1; i < count; ++i) {
+			struct line * x = items[i];
+			size_t j = i;
+			for (; j > 0 && compare(items[j-1], x) > 0; --j) {
+				items[j] = items[j-1];
+			}
+			items[j] = x;
+		}
+		return;
+	}
+	size_t half = count / 2;
+	merge_sort(items, tmp, half);
+	merge_sort(items + half, tmp, count - half);
+	/* Already in order? */
+	if (compare(items[half-1], items[half]) <= 0) return;
+
+	memcpy(tmp, items, sizeof(struct line *) * half);
+	size_t i = 0, j = half, k = 0;
+	while (i < half && j < count) {
+		items[k++] = (compare(items[j], tmp[i]) < 0) ? items[j++] : tmp[i++];
+	}
+	while (i < half) items[k++] = tmp[i++];
+}
+
+static int chunk_write(struct chunk * c, int fd) {
+	struct line ** order = malloc(sizeof(struct line *) * c->count);
+	struct line ** tmp = malloc(sizeof(struct line *) * (c->count / 2 + 1));
+	for (size_t i = 0; i < c->count; ++i) {
+		order[i] = &c->lines[i];
+	}
+	merge_sort(order, tmp, c->count);
+
+	struct writer * w = malloc(sizeof(struct writer));
+	w->fd = fd;
+	w->len = 0;
+	int ret = 0;
+	struct line * last = NULL;
+	for (size_t i = 0; i < c->count && !ret; ++i) {
+		if (unique && last && !compare(last, order[i])) continue;
+		ret = writer_line(w, order[i]->text, order[i]->len);
+		last = order[i];
+	}
+	if (!ret) ret = writer_flush(w);
+
+	free(w);
+	free(order);
+	free(tmp);
+	return ret;
+}
+
+/* }}} */
+
+/* External merge {{{ */
+
+struct run {
+	char * path;
+	int fd;
+	struct reader reader;
+	struct line head;
+	unsigned char * key;
+	size_t key_space;
+};
+
+static struct run * runs = NULL;
+static size_t run_count = 0;
+static const char * tmp_dir = NULL;
+
+static int run_open(char ** path_out) {
+	char path[strlen(tmp_dir) + 32];
+	sprintf(path, "%s/sort.XXXXXX", tmp_dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "%s: can't create temporary file in %s: %s\n", argv_0, tmp_dir, strerror(errno));
+		return -1;
+	}
+	*path_out = strdup(path);
+	return fd;
+}
+
+static void run_add(char * path, int fd) {
+	runs = realloc(runs, sizeof(struct run) * (run_count + 1));
+	runs[run_count].path = path;
+	runs[run_count].fd = fd;
+	run_count++;
+}
+
+static void runs_cleanup(void) {
+	for (size_t i = 0; i < run_count; ++i) {
+		close(runs[i].fd);
+		unlink(runs[i].path);
+		free(runs[i].path);
+	}
+	run_count = 0;
+}
+
+static int merge_runs(struct writer * w);
+
+/*
+ * Start a new run. Once there are MAX_RUNS of them, they are first
+ * merged down into one so the final merge never needs more than
+ * that many files open.
+ */
+static int run_create(void) {
+	char * path;
+	int fd;
+
+	if (run_count == MAX_RUNS) {
+		if ((fd = run_open(&path)) < 0) return -1;
+		struct writer * w = malloc(sizeof(struct writer));
+		w->fd = fd;
+		w->len = 0;
+		int ret = (merge_runs(w) < 0 || writer_flush(w) < 0) ? -1 : 0;
+		free(w);
+		runs_cleanup();
+		run_add(path, fd);
+		if (ret < 0) return -1;
+	}
+
+	if ((fd = run_open(&path)) < 0) return -1;
+	run_add(path, fd);
+	return fd;
+}
+
+static int run_next(struct run * r) {
+	size_t len;
+	char * text = reader_line(&r->reader, &len);
+	if (!text) return 0;
+	if (len > r->key_space) {
+		r->key_space = len;
+		r->key = realloc(r->key, len);
+	}
+	r->head.text = text;
+	r->head.len = len;
+	make_key(&r->head, r->key);
+	return 1;
+}
+
+/* Earlier runs win ties, which keeps the merge stable */
+static int run_before(size_t a, size_t b) {
+	int c = compare(&runs[a].head, &runs[b].head);
+	return c < 0 || (c == 0 && a < b);
+}
+
+static void heap_down(size_t * heap, size_t count, size_t i) {
+	while (1) {
+		size_t l = i * 2 + 1, r = l + 1, best = i;
+		if (l < count && run_before(heap[l], heap[best])) best = l;
+		if (r < count && run_before(heap[r], heap[best])) best = r;
+		if (best == i) return;
+		size_t t = heap[i];
+		heap[i] = heap[best];
+		heap[best] = t;
+		i = best;
+	}
+}
+
+static int merge_runs(struct writer * w) {
+	size_t * heap = malloc(sizeof(size_t) * run_count);
+	size_t count = 0;
+
+	for (size_t i = 0; i < run_count; ++i) {
+		lseek(runs[i].fd, 0, SEEK_SET);
+		reader_init(&runs[i].reader, runs[i].fd, IO_BLOCK);
+		runs[i].key = NULL;
+		runs[i].key_space = 0;
+		if (run_next(&runs[i])) heap[count++] = i;
+	}
+	for (size_t i = count / 2; i-- > 0;) {
+		heap_down(heap, count, i);
+	}
+
+	/* The last line written, kept for -u */
+	struct line last = {0};
+	size_t last_space = 0;
+	int have_last = 0;
+	int ret = 0;
+
+	while (count && !ret) {
+		struct run * r = &runs[heap[0]];
+		if (!unique || !have_last || compare(&last, &r->head)) {
+			ret = writer_line(w, r->head.text, r->head.len);
+			if (unique) {
+				if (r->head.len * 2 > last_space) {
+					last_space = r->head.len * 2;
+					last.text = realloc(last.text, last_space ? last_space : 1);
+				}
+				memcpy(last.text, r->head.text, r->head.len);
+				last.len = r->head.len;
+				make_key(&last, (unsigned char *)last.text + last.len);
+				have_last = 1;
+			}
+		}
+		if (!run_next(r)) {
+			heap[0] = heap[--count];
+		}
+		heap_down(heap, count, 0);
+	}
+
+	for (size_t i = 0; i < run_count; ++i) {
+		free(runs[i].reader.buf);
+		free(runs[i].key);
+	}
+	free(last.text);
+	free(heap);
+	return ret;
+}
+
+/* }}} */
+
+static size_t parse_size(const char * s) {
+	char * end;
+	size_t n = strtoul(s, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': return n << 10;
+		case 'm': case 'M': return n << 20;
+		case 'g': case 'G': return n << 30;
+		default: return n;
+	}
+}
+
+static void show_usage(void) {
+	fprintf(stderr,
+			"sort - sort lines of text\n"
+			"\n"
+			"usage: %s [-rnu] [-k start[,end]] [-S size] [-T dir] [file...]\n"
+			"\n"
+			" -r     \033[3mreverse the order\033[0m\n"
+			" -n     \033[3mcompare by leading numeric value\033[0m\n"
+			" -u     \033[3monly keep the first of a run of equal lines\033[0m\n"
+			" -k     \033[3msort on fields start through end\033[0m\n"
+			" -S     \033[3mmemory to use before spilling to temporary files\033[0m\n"
+			" -T     \033[3mdirectory for temporary files\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv_0);
 }
 
 int main(int argc, char * argv[]) {
-	int reverse = 0;
+	size_t limit = DEFAULT_LIMIT;
 	int opt;
 
-	list_t * lines = list_create();
-	list_t * files = list_create();
+	argv_0 = argv[0];
+	tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
 
-	while ((opt = getopt(argc, argv, "r")) != -1) {
+	while ((opt = getopt(argc, argv, "rnuk:S:T:?")) != -1) {
 		switch (opt) {
 			case 'r':
 				reverse = 1;
 				break;
+			case 'n':
+				numeric = 1;
+				break;
+			case 'u':
+				unique = 1;
+				break;
+			case 'k': {
+				char * end;
+				key_start = strtoul(optarg, &end, 10);
+				key_end = (*end == ',') ? (int)strtoul(end + 1, NULL, 10) : 0;
+				if (key_start < 1 || (key_end && key_end < key_start)) {
+					fprintf(stderr, "%s: invalid key '%s'\n", argv[0], optarg);
+					return 2;
+				}
+				break;
+			}
+			case 'S':
+				limit = parse_size(optarg);
+				break;
+			case 'T':
+				tmp_dir = optarg;
+				break;
+			default:
+				show_usage();
+				return 2;
 		}
 	}
 
-	if (optind == argc) {
-		/* No arguments */
-		list_insert(files, stdin);
-	} else {
-		while (optind < argc) {
-			FILE * f = fopen(argv[optind], "r");
-			if (!f) {
-				fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
-			} else {
-				list_insert(files, f);
+	struct chunk chunk = {0};
+	struct reader reader;
+	int ret = 0;
+	int failed = 0;
+
+	int first = optind;
+	int nfiles = (optind == argc) ? 1 : argc - optind;
+	reader_init(&reader, 0, IO_BLOCK);
+
+	for (int i = 0; i < nfiles && !failed; ++i) {
+		int fd = STDIN_FILENO;
+		if (first < argc && strcmp(argv[first + i], "-")) {
+			fd = open(argv[first + i], O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "%s: %s: %s\n", argv[0], argv[first + i], strerror(errno));
+				ret = 2;
+				continue;
 			}
-			optind++;
 		}
-	}
+		reader.fd = fd;
+		reader.start = reader.end = 0;
+		reader.eof = 0;
 
-	char line_buf[4096] = {0};
-	foreach (node, files) {
-		FILE * f = node->value;
-		while (!feof(f)) {
-			if (!fgets(line_buf, 4096, f)) {
-				break;
-			}
-			if (!strchr(line_buf,'\n')) {
-				fprintf(stderr, "%s: oversized line\n", argv[0]);
-			}
-			char * line = strdup(line_buf);
-			node_t * next = NULL;
-			foreach (lnode, lines) {
-				char * cmp = lnode->value;
-				if (reverse ? (compare(cmp, line) < 0) : (compare(line, cmp) < 0)) {
-					next = lnode;
+		char * line;
+		size_t len;
+		while ((line = reader_line(&reader, &len))) {
+			chunk_add(&chunk, line, len);
+			if (chunk.bytes >= limit) {
+				int run = run_create();
+				if (run < 0 || chunk_write(&chunk, run) < 0) {
+					failed = 1;
 					break;
 				}
-			}
-			if (next) {
-				list_insert_before(lines, next, line);
-			} else {
-				list_insert(lines, line);
+				chunk_reset(&chunk);
 			}
 		}
+		if (fd != STDIN_FILENO) close(fd);
 	}
 
-	foreach (lnode, lines) {
-		char * line = lnode->value;
-		fprintf(stdout, "%s", line);
+	if (!failed) {
+		if (!run_count) {
+			failed = chunk_write(&chunk, STDOUT_FILENO) < 0;
+		} else {
+			if (chunk.count) {
+				int run = run_create();
+				failed = run < 0 || chunk_write(&chunk, run) < 0;
+			}
+			if (!failed) {
+				struct writer * w = malloc(sizeof(struct writer));
+				w->fd = STDOUT_FILENO;
+				w->len = 0;
+				failed = merge_runs(w) < 0 || writer_flush(w) < 0;
+				free(w);
+			}
+		}
 	}
 
-	return 0;
+	runs_cleanup();
+	return failed ? 2 : ret;
 }
@@ -4,6 +4,10 @@
  * Copyright (C) 2018 K. Lange
  *
  * splash-log - Display startup messages before UI has started.
+ *
+ * With -t, draws the boot timeline from /proc/boottime instead:
+ * one row for each module, mount, and startup script, with a bar
+ * for when it started and how long it took.
  */
 #include <stdlib.h>
 #include <stdio.h>
@@ -123,6 +127,120 @@ static void check_framebuffer(void) {
 	}
 }
 
+#define BAR_COLOR  0xFF4E9A06
+#define MARK_COLOR 0xFFC4A000
+#define MAX_ROWS   128
+#define LABEL_MAX  28
+
+struct timeline_row {
+	char name[LABEL_MAX + 1];
+	unsigned int start; /* Microseconds */
+	unsigned int end;
+	int open;           /* Saw its begin, not its end yet */
+	int mark;           /* An instant rather than a span */
+};
+
+static struct timeline_row rows[MAX_ROWS];
+static int row_count = 0;
+
+static void read_timeline(void) {
+	FILE * f = fopen("/proc/boottime", "r");
+	if (!f) return;
+
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') continue;
+		char * nl = strchr(line, '\n');
+		if (nl) *nl = '\0';
+
+		/* usecs pid kind name */
+		char * us = strtok(line, " ");
+		char * pid = strtok(NULL, " ");
+		char * kind = strtok(NULL, " ");
+		char * name = strtok(NULL, "");
+		if (!us || !pid || !kind || !name) continue;
+		unsigned int when = strtoul(us, NULL, 10);
+
+		if (!strcmp(kind, "end")) {
+			for (int i = row_count - 1; i >= 0; --i) {
+				if (rows[i].open && !strncmp(rows[i].name, name, LABEL_MAX)) {
+					rows[i].end = when;
+					rows[i].open = 0;
+					break;
+				}
+			}
+			continue;
+		}
+
+		if (row_count == MAX_ROWS) continue;
+		struct timeline_row * row = &rows[row_count++];
+		strncpy(row->name, name, LABEL_MAX);
+		row->name[LABEL_MAX] = '\0';
+		row->start = when;
+		row->end = when;
+		row->open = !strcmp(kind, "begin");
+		row->mark = !row->open;
+	}
+
+	fclose(f);
+}
+
+static void fill_rect(int x, int y, int w, int h, uint32_t color) {
+	for (int j = y; j < y + h; ++j) {
+		for (int i = x; i < x + w; ++i) {
+			set_point(i, j, color);
+		}
+	}
+}
+
+static void draw_timeline(void) {
+	read_timeline();
+
+	unsigned int total = 1;
+	for (int i = 0; i < row_count; ++i) {
+		if (rows[i].end > total) total = rows[i].end;
+	}
+
+	char line[128];
+	snprintf(line, sizeof(line), "Boot timeline: %u.%03us", total / 1000000, (total / 1000) % 1000);
+	update_message(line, 0);
+
+	/* Label, duration, then the bar in whatever room is left */
+	int lines = (framebuffer_fd != -1) ? (height - 40) / char_height - 2 : 21;
+	for (int i = 0; i < row_count && i < lines; ++i) {
+		struct timeline_row * row = &rows[i];
+		unsigned int ms = (row->end - row->start) / 1000;
+		if (row->mark) {
+			snprintf(line, sizeof(line), "%-*.*s @%6ums", LABEL_MAX, LABEL_MAX, row->name, row->start / 1000);
+		} else {
+			snprintf(line, sizeof(line), "%-*.*s %7ums", LABEL_MAX, LABEL_MAX, row->name, ms);
+		}
+		update_message(line, i + 2);
+
+		int label = strlen(line) + 1;
+		if (framebuffer_fd != -1) {
+			int left  = 20 + label * char_width;
+			int room  = width - 20 - left;
+			if (room <= 0) continue;
+			int x = left + (int)((unsigned long long)row->start * room / total);
+			int w = (int)((unsigned long long)(row->end - row->start) * room / total);
+			if (w < 2) w = 2;
+			if (x + w > left + room) w = left + room - x;
+			fill_rect(x, 20 + char_height * (i + 2) + 4, w, char_height - 8, row->mark ? MARK_COLOR : BAR_COLOR);
+		} else {
+			int left = 2 + label;
+			int room = 80 - left;
+			if (room <= 0) continue;
+			int x = left + (int)((unsigned long long)row->start * room / total);
+			int w = (int)((unsigned long long)(row->end - row->start) * room / total);
+			if (w < 1) w = 1;
+			for (int j = x; j < x + w && j < 80; ++j) {
+				placech(row->mark ? '|' : '=', j, 2 + i + 2, row->mark ? 0xE : 0xA);
+			}
+		}
+	}
+}
+
 static FILE * pex_endpoint = NULL;
 static void open_socket(void) {
 	pex_endpoint = pex_bind("splash");
@@ -135,6 +253,13 @@ int main(int argc, char * argv[]) {
 		return 1;
 	}
 
+	if (argc > 1 && !strcmp(argv[1], "-t")) {
+		check_framebuffer();
+		clear_screen();
+		draw_timeline();
+		return 0;
+	}
+
 	open_socket();
 
 	if (!fork()) {
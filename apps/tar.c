@@ -8,14 +8,21 @@
  * This is a very minimal and incomplete implementation of tar.
  * It supports on ustar-formatted archives, and its arguments
  * must by the - forms. As of writing, creating archives is not
- * supported. No compression formats are supported, either.
+ * supported.
+ *
+ * gzip-compressed archives (-z) are decompressed by a second
+ * thread, which feeds a ring buffer that the main thread reads
+ * the archive from. Skipped entries are seeked over when the
+ * archive is a regular file.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -47,9 +54,174 @@ struct ustar {
 	char padding[12];
 };
 
-static struct ustar * extract_file(FILE * f) {
+/* Archive input {{{ */
+
+#define PIPE_SIZE 0x40000
+
+/* Decompressed data passed from the gzip thread to the main thread */
+struct gz_pipe {
+	FILE * in;
+	char * buf;
+	size_t head; /* bytes written by the gzip thread */
+	size_t tail; /* bytes read by the main thread */
+	int done;
+	int error;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+struct tar_input {
+	FILE * f;
+	int seekable;
+	struct gz_pipe * gz;
+};
+
+static void gz_exit(struct gz_pipe * gz, int error) {
+	pthread_mutex_lock(&gz->lock);
+	gz->error = error;
+	gz->done = 1;
+	pthread_cond_broadcast(&gz->cond);
+	pthread_mutex_unlock(&gz->lock);
+}
+
+static uint8_t gz_get(struct inflate_context * ctx) {
+	struct gz_pipe * gz = ctx->input_priv;
+	int c = getc(gz->in);
+	if (c == EOF) {
+		/* Truncated stream; inflate has no way to stop on its own */
+		gz_exit(gz, 1);
+		pthread_exit(NULL);
+	}
+	return c;
+}
+
+static void gz_write_block(struct inflate_context * ctx, const uint8_t * data, size_t len) {
+	struct gz_pipe * gz = ctx->output_priv;
+	while (len) {
+		pthread_mutex_lock(&gz->lock);
+		while (gz->head - gz->tail == PIPE_SIZE && !gz->closed) {
+			pthread_cond_wait(&gz->cond, &gz->lock);
+		}
+		if (gz->closed) {
+			pthread_mutex_unlock(&gz->lock);
+			return;
+		}
+		size_t at = gz->head % PIPE_SIZE;
+		size_t n = PIPE_SIZE - (gz->head - gz->tail);
+		pthread_mutex_unlock(&gz->lock);
+
+		/* The reader never touches free space, so copy without the lock */
+		if (n > PIPE_SIZE - at) n = PIPE_SIZE - at;
+		if (n > len) n = len;
+		memcpy(gz->buf + at, data, n);
+		data += n;
+		len -= n;
+
+		pthread_mutex_lock(&gz->lock);
+		gz->head += n;
+		pthread_cond_broadcast(&gz->cond);
+		pthread_mutex_unlock(&gz->lock);
+	}
+}
+
+static void gz_write(struct inflate_context * ctx, unsigned int sym) {
+	uint8_t c = sym;
+	gz_write_block(ctx, &c, 1);
+}
+
+static void * gz_thread(void * arg) {
+	struct gz_pipe * gz = arg;
+	struct inflate_context ctx;
+	ctx.input_priv = gz;
+	ctx.output_priv = gz;
+	ctx.get_input = gz_get;
+	ctx.write_output = gz_write;
+	ctx.write_block = gz_write_block;
+	ctx.ring = NULL;
+
+	gz_exit(gz, gzip_decompress(&ctx));
+	return NULL;
+}
+
+static struct gz_pipe * gz_start(FILE * f) {
+	struct gz_pipe * gz = calloc(1, sizeof(struct gz_pipe));
+	gz->in = f;
+	gz->buf = malloc(PIPE_SIZE);
+	pthread_mutex_init(&gz->lock, NULL);
+	pthread_cond_init(&gz->cond, NULL);
+	if (pthread_create(&gz->thread, NULL, gz_thread, gz)) {
+		free(gz->buf);
+		free(gz);
+		return NULL;
+	}
+	return gz;
+}
+
+/* Stop the gzip thread, returning nonzero if decompression failed */
+static int gz_finish(struct gz_pipe * gz) {
+	pthread_mutex_lock(&gz->lock);
+	gz->closed = 1;
+	pthread_cond_broadcast(&gz->cond);
+	pthread_mutex_unlock(&gz->lock);
+	pthread_join(gz->thread, NULL);
+	int error = gz->error;
+	free(gz->buf);
+	free(gz);
+	return error;
+}
+
+static size_t gz_read(struct gz_pipe * gz, char * out, size_t len) {
+	size_t total = 0;
+	while (total < len) {
+		pthread_mutex_lock(&gz->lock);
+		while (gz->head == gz->tail && !gz->done) {
+			pthread_cond_wait(&gz->cond, &gz->lock);
+		}
+		size_t at = gz->tail % PIPE_SIZE;
+		size_t n = gz->head - gz->tail;
+		pthread_mutex_unlock(&gz->lock);
+		if (!n) break;
+
+		if (n > PIPE_SIZE - at) n = PIPE_SIZE - at;
+		if (n > len - total) n = len - total;
+		if (out) memcpy(out + total, gz->buf + at, n);
+		total += n;
+
+		pthread_mutex_lock(&gz->lock);
+		gz->tail += n;
+		pthread_cond_broadcast(&gz->cond);
+		pthread_mutex_unlock(&gz->lock);
+	}
+	return total;
+}
+
+static size_t input_read(struct tar_input * in, void * buf, size_t len) {
+	if (in->gz) return gz_read(in->gz, buf, len);
+	return fread(buf, 1, len, in->f);
+}
+
+static void _seek_forward(struct tar_input * in, size_t amount) {
+	if (in->gz) {
+		gz_read(in->gz, NULL, amount);
+	} else if (in->seekable) {
+		fseek(in->f, amount, SEEK_CUR);
+	} else {
+		char buf[4096];
+		while (amount) {
+			size_t n = amount < sizeof(buf) ? amount : sizeof(buf);
+			if (fread(buf, 1, n, in->f) != n) break;
+			amount -= n;
+		}
+	}
+}
+
+/* }}} */
+
+static struct ustar * extract_file(struct tar_input * in) {
 	static struct ustar _ustar;
-	if (fread(&_ustar, 1, sizeof(struct ustar), f) != sizeof(struct ustar)) {
+	if (input_read(in, &_ustar, sizeof(struct ustar)) != sizeof(struct ustar)) {
 		fprintf(stderr, "failed to read file\n");
 		return NULL;
 	}
@@ -129,31 +301,28 @@ static void dump_file(struct ustar * file) {
 }
 #endif
 
-#define CHUNK_SIZE 4096
-static void write_file(struct ustar * file, FILE * f, FILE * mf, char * name) {
+#define CHUNK_SIZE 0x10000
+static char chunk[CHUNK_SIZE] __attribute__((aligned(4096)));
+
+static void write_file(struct ustar * file, struct tar_input * in, int fd, char * name) {
 	size_t length = interpret_size(file);
-	char buf[CHUNK_SIZE];
-	while (length > CHUNK_SIZE) {
-		fread( buf, 1, CHUNK_SIZE, f);
-		fwrite(buf, 1, CHUNK_SIZE, mf);
-		length -= CHUNK_SIZE;
-	}
-	if (length > 0) {
-		fread( buf, 1, length, f);
-		fwrite(buf, 1, length, mf);
+	while (length > 0) {
+		size_t n = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+		size_t r = input_read(in, chunk, n);
+		for (size_t done = 0; done < r; ) {
+			ssize_t w = write(fd, chunk + done, r - done);
+			if (w <= 0) break;
+			done += w;
+		}
+		if (r < n) break;
+		length -= n;
 	}
-	if (mf != stdout) {
-		fclose(mf);
+	if (fd != STDOUT_FILENO) {
+		close(fd);
 		chmod(name, interpret_mode(file));
 	}
 }
 
-static void _seek_forward(FILE * f, size_t amount) {
-	for (size_t i = 0; i < amount; ++i) {
-		fgetc(f);
-	}
-}
-
 static void usage(char * argv[]) {
 	fprintf(stderr,
 			"tar - extract ustar archives\n"
@@ -252,36 +421,25 @@ int main(int argc, char * argv[]) {
 			return 1;
 		}
 
+		struct tar_input in = {f, 0, NULL};
+		struct stat st;
+		if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode)) {
+			in.seekable = 1;
+		}
+
 		if (compressed) {
-			int fds[2];
-			pipe(fds);
-
-			int child = fork();
-			if (child == 0) {
-				/* Close the read end */
-				close(fds[0]);
-				/* Put f's fd into stdin */
-				dup2(fileno(f), STDIN_FILENO);
-				/* Make stdout the pipe */
-				dup2(fds[1], STDOUT_FILENO);
-				/* Execeute gzunzip */
-				char * args[] = {"gunzip","-c",NULL};
-				exit(execvp("gunzip",args));
-			} else if (child < 0) {
-				fprintf(stderr, "%s: failed to fork gunzip for compressed archive\n", argv[0]);
+			in.gz = gz_start(f);
+			if (!in.gz) {
+				fprintf(stderr, "%s: failed to start decompression thread\n", argv[0]);
 				return 1;
 			}
-
-			/* Reattach f to pipe */
-			close(fds[1]);
-			f = fdopen(fds[0], "r");
 		}
 
 		char tmpname[1024] = {0};
 		int  last_was_long = 0;
 
-		while (!feof(f)) {
-			struct ustar * file = extract_file(f);
+		while (1) {
+			struct ustar * file = extract_file(&in);
 
 			if (!file) {
 				break;
@@ -293,7 +451,7 @@ int main(int argc, char * argv[]) {
 				} else {
 					fprintf(stdout, "%.155s%.100s\n", file->prefix, file->filename);
 				}
-				_seek_forward(f, interpret_size(file));
+				_seek_forward(&in, interpret_size(file));
 			} else if (action == TAR_ACTION_EXTRACT) {
 				if (verbose) {
 					fprintf(stdout, "%.155s%.100s\n", file->prefix, file->filename);
@@ -308,13 +466,20 @@ int main(int argc, char * argv[]) {
 				}
 
 				if (file->type[0] == '0' || file->type[0] == 0) {
-					FILE * mf = to_stdout ? stdout : fopen(name,"w");
-					if (!mf) {
-						fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, strerror(errno));
-						_seek_forward(f, interpret_size(file));
+					if (only_matches && !matches_files(argc,argv,optind,name)) {
+						_seek_forward(&in, interpret_size(file));
 					} else {
-						if (!only_matches || matches_files(argc,argv,optind,name)) {
-							write_file(file,f,mf,name);
+						int mf = STDOUT_FILENO;
+						if (to_stdout) {
+							fflush(stdout);
+						} else {
+							mf = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+						}
+						if (mf < 0) {
+							fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, strerror(errno));
+							_seek_forward(&in, interpret_size(file));
+						} else {
+							write_file(file,&in,mf,name);
 						}
 					}
 				} else if (file->type[0] == '5') {
@@ -355,7 +520,7 @@ int main(int argc, char * argv[]) {
 							chmod(name, interpret_mode(file));
 						}
 					}
-					_seek_forward(f, interpret_size(file));
+					_seek_forward(&in, interpret_size(file));
 				} else if (file->type[0] == '2') {
 					if (!to_stdout && (!only_matches || matches_files(argc,argv,optind,name))) {
 						char tmp[101] = {0};
@@ -364,24 +529,31 @@ int main(int argc, char * argv[]) {
 							fprintf(stderr, "%s: %s: %s: %s: %s\n", argv[0], fname, name, tmp, strerror(errno));
 						}
 					}
-					_seek_forward(f, interpret_size(file));
+					_seek_forward(&in, interpret_size(file));
 				} else if (file->type[0] == 'L') {
 					/* This is a GNU Long Name block; store its contents as a file name */
 					size_t s = interpret_size(file);
-					fread(tmpname, 1, s, f);
-					tmpname[s] = '\0';
+					size_t keep = s < sizeof(tmpname) - 1 ? s : sizeof(tmpname) - 1;
+					keep = input_read(&in, tmpname, keep);
+					tmpname[keep] = '\0';
+					_seek_forward(&in, s - keep);
 					last_was_long = 1;
 				} else {
 					fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, type_to_string(file->type[0]));
-					_seek_forward(f, interpret_size(file));
+					_seek_forward(&in, interpret_size(file));
 				}
 			}
 
 			size_t file_size = interpret_size(file);
 			if (file_size % 512) {
-				_seek_forward(f, 512 - (file_size % 512));
+				_seek_forward(&in, 512 - (file_size % 512));
 			}
 		}
+
+		if (in.gz && gz_finish(in.gz)) {
+			fprintf(stderr, "%s: %s: failed to decompress archive\n", argv[0], fname);
+			return 1;
+		}
 	} else {
 		fprintf(stderr, "%s: unsupported action\n", argv[0]);
 		return 1;
@@ -12,6 +12,39 @@
 #include <string.h>
 #include <errno.h>
 
+#define CHUNK_SIZE 4096
+#define SPLICE_SIZE 0x10000
+
+/*
+ * With a pipe on both ends, stdin can be duplicated onto stdout and
+ * then spliced into the one file (or just spliced to stdout, if there
+ * are no files) without passing through here. Returns 0 if the kernel
+ * won't do that for these descriptors and nothing has been copied.
+ */
+static int pipe_through(int file_count, FILE ** files) {
+	if (!file_count) {
+		ssize_t r = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, SPLICE_SIZE, 0);
+		if (r < 0) return 0;
+		while (r > 0) {
+			r = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, SPLICE_SIZE, 0);
+		}
+		return 1;
+	}
+
+	int out = fileno(files[0]);
+	ssize_t r = tee(STDIN_FILENO, STDOUT_FILENO, SPLICE_SIZE, 0);
+	if (r < 0) return 0;
+	while (r > 0) {
+		while (r > 0) {
+			ssize_t s = splice(STDIN_FILENO, NULL, out, NULL, r, 0);
+			if (s <= 0) return 1;
+			r -= s;
+		}
+		r = tee(STDIN_FILENO, STDOUT_FILENO, SPLICE_SIZE, 0);
+	}
+	return 1;
+}
+
 int main(int argc, char * argv[]) {
 	int append = 0;
 	int ret_val = 0;
@@ -43,17 +76,20 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
-	while (!feof(stdin)) {
-		int c = fgetc(stdin);
-		if (c >= 0) {
-			fputc(c, stdout);
+	if (file_count <= 1 && pipe_through(file_count, files)) {
+		goto done;
+	}
 
-			for (int i = 0; i < file_count; ++i) {
-				fputc(c, files[i]);
-			}
+	char buf[CHUNK_SIZE];
+	ssize_t r;
+	while ((r = read(STDIN_FILENO, buf, CHUNK_SIZE)) > 0) {
+		write(STDOUT_FILENO, buf, r);
+		for (int i = 0; i < file_count; ++i) {
+			write(fileno(files[i]), buf, r);
 		}
 	}
 
+done:
 	for (int i = 0; i < file_count; ++i) {
 		fclose(files[i]);
 	}
@@ -528,6 +528,16 @@ term_write_char(
 	placech(val, x, y, (vga_to_ansi[fg] & 0xF) | (vga_to_ansi[bg] << 4));
 }
 
+/*
+ * Output read from the pty in one go is drawn as one batch: a scroll
+ * or clear only marks the screen for a full redraw, which happens once
+ * at the end, and so does drawing the cursor. Until then, cells are
+ * only updated in term_buffer.
+ */
+static int batching = 0;
+static int redraw_pending = 0;
+static int cursor_pending = 0;
+
 static void cell_set(uint16_t x, uint16_t y, uint32_t c, uint32_t fg, uint32_t bg, uint8_t flags) {
 	if (x >= term_width || y >= term_height) return;
 	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
@@ -539,6 +549,7 @@ static void cell_set(uint16_t x, uint16_t y, uint32_t c, uint32_t fg, uint32_t b
 
 static void cell_redraw(uint16_t x, uint16_t y) {
 	if (x >= term_width || y >= term_height) return;
+	if (redraw_pending) return;
 	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
 	if (((uint32_t *)cell)[0] == 0x00000000) {
 		term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
@@ -549,6 +560,7 @@ static void cell_redraw(uint16_t x, uint16_t y) {
 
 static void cell_redraw_inverted(uint16_t x, uint16_t y) {
 	if (x >= term_width || y >= term_height) return;
+	if (redraw_pending) return;
 	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
 	if (((uint32_t *)cell)[0] == 0x00000000) {
 		term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_BG, TERM_DEFAULT_FG, TERM_DEFAULT_FLAGS | ANSI_SPECBG);
@@ -577,12 +589,20 @@ void render_cursor() {
 static uint8_t cursor_flipped = 0;
 void draw_cursor() {
 	if (!cursor_on) return;
+	if (batching) {
+		cursor_pending = 1;
+		return;
+	}
 	mouse_ticks = get_ticks();
 	cursor_flipped = 0;
 	render_cursor();
 }
 
 void term_redraw_all() {
+	if (batching) {
+		redraw_pending = 1;
+		return;
+	}
 	/* Redraw to a temp buffer */
 	for (uint16_t y = 0; y < term_height; ++y) {
 		for (uint16_t x = 0; x < term_width; ++x) {
@@ -629,6 +649,23 @@ void term_shift_region(int top, int height, int how_much) {
 	term_redraw_all();
 }
 
+static void batch_start(void) {
+	batching = 1;
+}
+
+static void batch_end(void) {
+	batching = 0;
+	int redrew = redraw_pending;
+	if (redraw_pending) {
+		redraw_pending = 0;
+		term_redraw_all();
+	}
+	if (redrew || cursor_pending) {
+		cursor_pending = 0;
+		draw_cursor();
+	}
+}
+
 void term_scroll(int how_much) {
 	term_shift_region(0,term_height,how_much);
 }
@@ -1323,9 +1360,11 @@ int main(int argc, char ** argv) {
 			maybe_flip_cursor();
 			if (res[0]) {
 				int r = read(fd_master, buf, BUF_SIZE);
+				batch_start();
 				for (int i = 0; i < r; ++i) {
 					ansi_put(ansi_state, buf[i]);
 				}
+				batch_end();
 			}
 			if (res[1]) {
 				int r = read(kfd, buf, BUF_SIZE);
@@ -35,6 +35,7 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/fswait.h>
+#include <sys/signalfd.h>
 
 #define TRACE_APP_NAME "terminal"
 #include <toaru/trace.h>
@@ -49,6 +50,10 @@
 #include <toaru/menu.h>
 #include <toaru/sdf.h>
 
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
 /* 16- and 256-color palette */
 #include "terminal-palette.h"
 /* Bitmap font */
@@ -59,7 +64,7 @@ static void usage(char * argv[]) {
 	printf(
 			"Terminal Emulator\n"
 			"\n"
-			"usage: %s [-Fbxn] [-s SCALE] [-g WIDTHxHEIGHT] [COMMAND...]\n"
+			"usage: %s [-Fbxn] [-s SCALE] [-g WIDTHxHEIGHT] [-S LINES] [COMMAND...]\n"
 			"\n"
 			" -F --fullscreen \033[3mRun in fullscreen (background) mode.\033[0m\n"
 			" -b --bitmap     \033[3mUse the integrated bitmap font.\033[0m\n"
@@ -69,6 +74,7 @@ static void usage(char * argv[]) {
 			" -n --no-frame   \033[3mDisable decorations.\033[0m\n"
 			" -g --geometry   \033[3mSet requested terminal size WIDTHxHEIGHT\033[0m\n"
 			" -f --no-ft      \033[3mForce disable the freetype backend.\033[0m\n"
+			" -S --scrollback \033[3mNumber of lines of scrollback to keep.\033[0m\n"
 			"\n"
 			" This terminal emulator provides basic support for VT220 escapes and\n"
 			" XTerm extensions, including 256 color support and font effects.\n",
@@ -166,15 +172,222 @@ static int decor_bottom_height = 0;
 static int decor_width = 0;
 static int decor_height = 0;
 
-struct scrollback_row {
-	unsigned short width;
-	term_cell_t cells[];
+/*
+ * Scrollback is kept as a ring of encoded lines in a single arena.
+ *
+ * Each line is a header, a small table of the distinct (fg,bg,flags)
+ * styles it uses, and one 32-bit word per cell holding the codepoint
+ * in the low 24 bits and a style index in the high 8. The run of
+ * identical cells at the end of the line (usually blanks) is stored
+ * once as the fill cell. Lines that can't be packed this way (too many
+ * styles) fall back to raw cells.
+ */
+struct scrollback_style {
+	uint32_t fg;
+	uint32_t bg;
+	uint32_t flags;
+};
+
+struct scrollback_line {
+	uint16_t width;  /* Width of the terminal when the line was saved */
+	uint16_t cells;  /* Number of packed cells before the fill run */
+	uint16_t styles; /* Entries in the style table */
+	uint16_t raw;    /* Cells are stored as plain term_cell_t */
+	uint32_t fill;   /* Packed cell repeated from [cells] to [width] */
+};
+
+struct scrollback_slot {
+	uint32_t offset;
+	uint32_t length;
 };
 
-#define MAX_SCROLLBACK 10240
-static list_t * scrollback_list = NULL;
+#define SCROLLBACK_DEFAULT 10240
+#define SCROLLBACK_LINE_BYTES 256 /* Average arena budget per line */
+#define SCROLLBACK_MAX_STYLES 256
+static int scrollback_limit = SCROLLBACK_DEFAULT;
 static int scrollback_offset = 0;
 
+static uint8_t * scrollback_data = NULL;
+static size_t scrollback_size = 0;
+static size_t scrollback_head = 0; /* Next write offset in the arena */
+static struct scrollback_slot * scrollback_slots = NULL;
+static int scrollback_first = 0;
+static int scrollback_lines = 0;
+static uint32_t scrollback_serial = 0; /* Lines ever saved */
+
+static term_cell_t * scrollback_decoded = NULL;
+static int scrollback_decoded_size = 0;
+static int scrollback_decoded_width = 0;
+static uint32_t scrollback_decoded_serial = 0;
+static int scrollback_decoded_valid = 0;
+
+static uint8_t * scrollback_encode_buf = NULL;
+
+static void scrollback_init(void) {
+	if (scrollback_limit < 0) scrollback_limit = 0;
+	scrollback_size = (size_t)scrollback_limit * SCROLLBACK_LINE_BYTES;
+	if (scrollback_limit) {
+		scrollback_data  = malloc(scrollback_size);
+		scrollback_slots = malloc(sizeof(struct scrollback_slot) * scrollback_limit);
+	}
+}
+
+static int scrollback_count(void) {
+	return scrollback_lines;
+}
+
+static void scrollback_evict(void) {
+	scrollback_first = (scrollback_first + 1) % scrollback_limit;
+	scrollback_lines--;
+}
+
+/* Find room for [length] bytes in the arena, dropping the oldest lines as needed. */
+static size_t scrollback_alloc(size_t length) {
+	while (1) {
+		if (!scrollback_lines) {
+			scrollback_head = 0;
+			return 0;
+		}
+		size_t tail = scrollback_slots[scrollback_first].offset;
+		if (scrollback_head > tail) {
+			if (scrollback_size - scrollback_head >= length) return scrollback_head;
+			if (tail >= length) return 0;
+		} else if (scrollback_head < tail) {
+			if (tail - scrollback_head >= length) return scrollback_head;
+		}
+		scrollback_evict();
+	}
+}
+
+static int scrollback_style_index(struct scrollback_style * styles, int * count, term_cell_t * cell) {
+	/* Lines rarely change style, so check the most recent entry first. */
+	for (int i = *count - 1; i >= 0; --i) {
+		if (styles[i].fg == cell->fg && styles[i].bg == cell->bg && styles[i].flags == cell->flags) return i;
+	}
+	if (*count == SCROLLBACK_MAX_STYLES) return -1;
+	styles[*count].fg = cell->fg;
+	styles[*count].bg = cell->bg;
+	styles[*count].flags = cell->flags;
+	return (*count)++;
+}
+
+/* Add a line to the scrollback. */
+static void scrollback_push(term_cell_t * row, int width) {
+	if (!scrollback_limit || !scrollback_data) return;
+
+	size_t max_length = sizeof(struct scrollback_line) + sizeof(term_cell_t) * width;
+	scrollback_encode_buf = realloc(scrollback_encode_buf, max_length);
+
+	struct scrollback_line * line = (struct scrollback_line *)scrollback_encode_buf;
+	struct scrollback_style styles[SCROLLBACK_MAX_STYLES];
+	uint32_t * packed = (uint32_t *)(scrollback_encode_buf + sizeof(struct scrollback_line) + sizeof(term_cell_t) * width) - width;
+	int style_count = 0;
+	int raw = 0;
+
+	for (int x = 0; x < width; ++x) {
+		term_cell_t cell = row[x];
+		if (cell.flags & ANSI_EXT_IMG) {
+			/* Image data does not outlive the screen. */
+			cell.c = ' ';
+			cell.fg = TERM_DEFAULT_FG;
+			cell.bg = TERM_DEFAULT_BG;
+			cell.flags = TERM_DEFAULT_FLAGS;
+		}
+		int s = scrollback_style_index(styles, &style_count, &cell);
+		if (s < 0 || cell.c > 0xFFFFFF) {
+			raw = 1;
+			break;
+		}
+		packed[x] = cell.c | ((uint32_t)s << 24);
+	}
+
+	size_t length;
+	if (raw) {
+		line->width = width;
+		line->cells = width;
+		line->styles = 0;
+		line->raw = 1;
+		line->fill = 0;
+		memcpy(scrollback_encode_buf + sizeof(struct scrollback_line), row, sizeof(term_cell_t) * width);
+		length = max_length;
+	} else {
+		int cells = width;
+		while (cells > 0 && packed[cells-1] == packed[width-1]) cells--;
+		line->width = width;
+		line->cells = cells;
+		line->styles = style_count;
+		line->raw = 0;
+		line->fill = width ? packed[width-1] : 0;
+		/* The packed cells were written at the end of the buffer; styles go first. */
+		uint8_t * out = scrollback_encode_buf + sizeof(struct scrollback_line);
+		memcpy(out, styles, sizeof(struct scrollback_style) * style_count);
+		memmove(out + sizeof(struct scrollback_style) * style_count, packed, sizeof(uint32_t) * cells);
+		length = sizeof(struct scrollback_line) + sizeof(struct scrollback_style) * style_count + sizeof(uint32_t) * cells;
+	}
+
+	if (length > scrollback_size) return;
+
+	if (scrollback_lines == scrollback_limit) scrollback_evict();
+	size_t offset = scrollback_alloc(length);
+	memcpy(scrollback_data + offset, scrollback_encode_buf, length);
+	scrollback_head = offset + length;
+
+	struct scrollback_slot * slot = &scrollback_slots[(scrollback_first + scrollback_lines) % scrollback_limit];
+	slot->offset = offset;
+	slot->length = length;
+	scrollback_lines++;
+	scrollback_serial++;
+}
+
+/*
+ * Decode a scrollback line; 0 is the most recent. The returned cells are
+ * valid until the next call, and the last line decoded is cached so that
+ * per-cell callers don't repeat the work.
+ */
+static term_cell_t * scrollback_row(int i, int * width) {
+	if (i < 0 || i >= scrollback_lines) {
+		/* Lines may be dropped while the view is scrolled back. */
+		*width = 0;
+		return NULL;
+	}
+
+	uint32_t serial = scrollback_serial - 1 - i;
+	if (scrollback_decoded_valid && scrollback_decoded_serial == serial) {
+		*width = scrollback_decoded_width;
+		return scrollback_decoded;
+	}
+
+	struct scrollback_slot * slot = &scrollback_slots[(scrollback_first + scrollback_lines - 1 - i) % scrollback_limit];
+	struct scrollback_line * line = (struct scrollback_line *)(scrollback_data + slot->offset);
+	uint8_t * data = (uint8_t *)line + sizeof(struct scrollback_line);
+
+	if (line->width > scrollback_decoded_size || !scrollback_decoded) {
+		scrollback_decoded_size = line->width ? line->width : 1;
+		scrollback_decoded = realloc(scrollback_decoded, sizeof(term_cell_t) * scrollback_decoded_size);
+	}
+
+	if (line->raw) {
+		memcpy(scrollback_decoded, data, sizeof(term_cell_t) * line->width);
+	} else {
+		struct scrollback_style * styles = (struct scrollback_style *)data;
+		uint32_t * packed = (uint32_t *)(data + sizeof(struct scrollback_style) * line->styles);
+		for (int x = 0; x < line->width; ++x) {
+			uint32_t p = x < line->cells ? packed[x] : line->fill;
+			struct scrollback_style * s = &styles[p >> 24];
+			scrollback_decoded[x].c = p & 0xFFFFFF;
+			scrollback_decoded[x].fg = s->fg;
+			scrollback_decoded[x].bg = s->bg;
+			scrollback_decoded[x].flags = s->flags;
+		}
+	}
+
+	scrollback_decoded_width = line->width;
+	scrollback_decoded_serial = serial;
+	scrollback_decoded_valid = 1;
+	*width = line->width;
+	return scrollback_decoded;
+}
+
 /* Menu bar entries */
 struct menu_bar terminal_menu_bar = {0};
 struct menu_bar_entries terminal_menu_entries[] = {
@@ -201,10 +414,14 @@ static uint64_t get_ticks(void) {
 	return (uint64_t)now.tv_sec * 1000000LL + (uint64_t)now.tv_usec;
 }
 
+static uint64_t last_flip = 0;
+
 static void display_flip(void) {
 	if (l_x != INT32_MAX && l_y != INT32_MAX) {
 		flip(ctx);
-		yutani_flip_region(yctx, window, l_x, l_y, r_x - l_x, r_y - l_y);
+		yutani_damage_rect_t damage = { l_x, l_y, r_x - l_x, r_y - l_y };
+		yutani_flip_regions(yctx, window, &damage, 1);
+		last_flip = get_ticks();
 		l_x = INT32_MAX;
 		l_y = INT32_MAX;
 		r_x = -1;
@@ -212,6 +429,21 @@ static void display_flip(void) {
 	}
 }
 
+/*
+ * Flip for output from the PTY: while the compositor hasn't drawn our
+ * last frame yet, keep collecting damage instead of sending more. The
+ * timeout covers a compositor that never answers.
+ */
+#define FRAME_TIMEOUT 100000
+
+static void term_flush_deferred(void);
+
+static void display_flip_throttled(void) {
+	if (yutani_frame_pending(window) && get_ticks() - last_flip < FRAME_TIMEOUT) return;
+	term_flush_deferred();
+	display_flip();
+}
+
 /* Returns the lower of two shorts */
 static int32_t min(int32_t a, int32_t b) {
 	return (a < b) ? a : b;
@@ -420,19 +652,13 @@ static void count_selection(uint16_t x, uint16_t _y) {
 			}
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
-				if (cell && ((uint32_t *)cell)[0] != 0x00000000) {
-					char tmp[7];
-					_selection_count += to_eight(cell->c, tmp);
-				}
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row && x < width) {
+			term_cell_t * cell = &row[x];
+			if (cell && ((uint32_t *)cell)[0] != 0x00000000) {
+				char tmp[7];
+				_selection_count += to_eight(cell->c, tmp);
 			}
 		}
 	}
@@ -458,22 +684,16 @@ void write_selection(uint16_t x, uint16_t _y) {
 			}
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
-				if (cell && ((uint32_t *)cell)[0] != 0x00000000) {
-					char tmp[7];
-					int count = to_eight(cell->c, tmp);
-					for (int i = 0; i < count; ++i) {
-						selection_text[_selection_i] = tmp[i];
-						_selection_i++;
-					}
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row && x < width) {
+			term_cell_t * cell = &row[x];
+			if (cell && ((uint32_t *)cell)[0] != 0x00000000) {
+				char tmp[7];
+				int count = to_eight(cell->c, tmp);
+				for (int i = 0; i < count; ++i) {
+					selection_text[_selection_i] = tmp[i];
+					_selection_i++;
 				}
 			}
 		}
@@ -647,28 +867,127 @@ static void draw_semi_block(int c, int x, int y, uint32_t fg, uint32_t bg) {
 
 #include "apps/ununicode.h"
 
-/* Write a character to the window. */
-static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, uint32_t bg, uint8_t flags) {
-	uint32_t _fg, _bg;
-
-	/* Select foreground color from palette. */
+/* Select foreground color from palette. */
+static uint32_t term_resolve_fg(uint32_t fg) {
 	if (fg < PALETTE_COLORS) {
-		_fg = term_colors[fg];
-		_fg |= 0xFF << 24;
-	} else {
-		_fg = fg;
+		return term_colors[fg] | (0xFF << 24);
 	}
+	return fg;
+}
 
-	/* Select background color from aplette. */
+/* Select background color from palette. */
+static uint32_t term_resolve_bg(uint32_t bg, uint32_t flags) {
 	if (bg < PALETTE_COLORS) {
-		_bg = term_colors[bg];
 		if (flags & ANSI_SPECBG) {
-			_bg |= 0xFF << 24;
-		} else {
-			_bg |= TERM_DEFAULT_OPAC << 24;
+			return term_colors[bg] | (0xFF << 24);
+		}
+		return term_colors[bg] | (TERM_DEFAULT_OPAC << 24);
+	}
+	return bg;
+}
+
+/* Top-left pixel of a cell position in the window's backbuffer */
+static uint32_t * term_cell_pixels(uint16_t x, uint16_t y) {
+	if (!_no_frame) {
+		return &GFX(ctx, (x+decor_left_width),(y+decor_top_height+menu_bar_height));
+	}
+	return &GFX(ctx, x, y);
+}
+
+/* Copy a row of pixels; cells are narrow, so this beats a call to memcpy */
+static inline void term_copy_row(uint32_t * dst, const uint32_t * src, int count) {
+	int i = 0;
+#ifndef NO_SSE
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_loadu_si128((const __m128i *)&src[i]));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = src[i];
+	}
+}
+
+/*
+ * Glyph cache
+ *
+ * Drawing a cell from scratch means filling its background and then
+ * rasterizing the glyph (or walking the bitmap font) every time, which
+ * is what makes dumping a lot of text slow. Instead, the finished
+ * pixels of a cell are kept, keyed by everything that went into them,
+ * and copied back out when the same cell comes up again.
+ *
+ * The cache is direct-mapped, and its entries are sized for the cell
+ * dimensions at the time; reinit() empties it whenever fonts or cell
+ * sizes may have changed. Wide characters are not cached.
+ */
+#define GLYPH_CACHE_SIZE 1024
+
+struct glyph_entry {
+	uint32_t val;
+	uint32_t fg;
+	uint32_t bg;
+	uint8_t flags;
+	uint8_t used;
+	uint32_t * pixels;
+};
+
+static struct glyph_entry glyph_cache[GLYPH_CACHE_SIZE];
+
+static void glyph_cache_flush(void) {
+	for (int i = 0; i < GLYPH_CACHE_SIZE; ++i) {
+		free(glyph_cache[i].pixels);
+		glyph_cache[i].pixels = NULL;
+		glyph_cache[i].used = 0;
+	}
+}
+
+static struct glyph_entry * glyph_cache_slot(uint32_t val, uint32_t fg, uint32_t bg, uint8_t flags) {
+	uint32_t hash = (val * 2654435761U) ^ (fg * 31) ^ (bg * 17) ^ (flags * 7);
+	return &glyph_cache[(hash ^ (hash >> 16)) % GLYPH_CACHE_SIZE];
+}
+
+static int glyph_cache_match(struct glyph_entry * g, uint32_t val, uint32_t fg, uint32_t bg, uint8_t flags) {
+	return g->used && g->val == val && g->fg == fg && g->bg == bg && g->flags == flags;
+}
+
+/* Remember the cell that was just drawn at (x,y) */
+static void glyph_cache_store(struct glyph_entry * g, uint32_t val, uint32_t fg, uint32_t bg, uint8_t flags, uint16_t x, uint16_t y) {
+	if (!g->pixels) {
+		g->pixels = malloc(sizeof(uint32_t) * char_width * char_height);
+	}
+	g->val = val;
+	g->fg = fg;
+	g->bg = bg;
+	g->flags = flags;
+	g->used = 1;
+
+	uint32_t * src = term_cell_pixels(x, y);
+	for (int i = 0; i < char_height; ++i) {
+		term_copy_row(&g->pixels[i * char_width], &src[i * GFX_S(ctx) / 4], char_width);
+	}
+}
+
+static void glyph_cache_draw(struct glyph_entry * g, uint16_t x, uint16_t y) {
+	uint32_t * dst = term_cell_pixels(x, y);
+	for (int i = 0; i < char_height; ++i) {
+		term_copy_row(&dst[i * GFX_S(ctx) / 4], &g->pixels[i * char_width], char_width);
+	}
+}
+
+/* Write a character to the window. */
+static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, uint32_t bg, uint8_t flags) {
+	uint32_t _fg = term_resolve_fg(fg);
+	uint32_t _bg = term_resolve_bg(bg, flags);
+
+	if (_use_aa && _have_freetype && val == 0xFFFF) { return; } /* Unicode, do not redraw here */
+
+	struct glyph_entry * glyph = NULL;
+	if (!(flags & ANSI_WIDE)) {
+		glyph = glyph_cache_slot(val, _fg, _bg, flags);
+		if (glyph_cache_match(glyph, val, _fg, _bg, flags)) {
+			glyph_cache_draw(glyph, x, y);
+			goto _bounds;
 		}
-	} else {
-		_bg = bg;
 	}
 
 	/* Draw block characters */
@@ -709,7 +1028,6 @@ static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, u
 		}
 	} else if (_use_aa && _have_freetype) {
 		/* Draw using freetype extension */
-		if (val == 0xFFFF) { return; } /* Unicode, do not redraw here */
 		for (uint8_t i = 0; i < char_height; ++i) {
 			for (uint8_t j = 0; j < char_width; ++j) {
 				term_set_point(x+j,y+i,_bg);
@@ -786,7 +1104,12 @@ _extra_stuff:
 		}
 	}
 
+	if (glyph) {
+		glyph_cache_store(glyph, val, _fg, _bg, flags, x, y);
+	}
+
 	/* Calculate the bounds of the updated region of the window */
+_bounds:
 	if (!_no_frame) {
 		l_x = min(l_x, decor_left_width + x);
 		l_y = min(l_y, decor_top_height+menu_bar_height + y);
@@ -812,6 +1135,50 @@ _extra_stuff:
 	}
 }
 
+/*
+ * If a cell is just a background (a space with nothing drawn over it),
+ * get the color it would be filled with.
+ */
+static int cell_blank_color(term_cell_t * cell, uint32_t * color) {
+	if (((uint32_t *)cell)[0] == 0x00000000) {
+		*color = term_resolve_bg(TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
+		return 1;
+	}
+	if (cell->c == ' ' && !(cell->flags & (ANSI_UNDERLINE | ANSI_CROSS | ANSI_BORDER | ANSI_EXT_IMG))) {
+		*color = term_resolve_bg(cell->bg, cell->flags);
+		return 1;
+	}
+	return 0;
+}
+
+/* Add a rectangle of the cell area (in pixels) to the region to flip. */
+static void term_mark_damage(int x, int y, int width, int height) {
+	int off_x = _no_frame ? 0 : decor_left_width;
+	int off_y = _no_frame ? 0 : decor_top_height + menu_bar_height;
+	l_x = min(l_x, off_x + x);
+	l_y = min(l_y, off_y + y);
+	r_x = max(r_x, off_x + x + width);
+	r_y = max(r_y, off_y + y + height);
+}
+
+/* Fill a run of `count` blank cells on row `y` starting at column `x` in one go. */
+static void term_fill_run(uint16_t x, uint16_t y, int count, uint32_t color) {
+	if (_fullscreen) {
+		color = alpha_blend_rgba(premultiply(rgba(0,0,0,0xFF)), color);
+	}
+
+	int width = count * char_width;
+	uint32_t * dst = term_cell_pixels(x * char_width, y * char_height);
+	for (int i = 0; i < char_height; ++i) {
+		uint32_t * row = &dst[i * GFX_S(ctx) / 4];
+		for (int j = 0; j < width; ++j) {
+			row[j] = color;
+		}
+	}
+
+	term_mark_damage(x * char_width, y * char_height, width, char_height);
+}
+
 /* Set a terminal cell */
 static void cell_set(uint16_t x, uint16_t y, uint32_t c, uint32_t fg, uint32_t bg, uint32_t flags) {
 	/* Avoid setting cells out of range. */
@@ -855,6 +1222,166 @@ static void redraw_cell_image(uint16_t x, uint16_t y, term_cell_t * cell) {
 	}
 }
 
+/*
+ * Redraw columns [x, end) of a row of the terminal buffer, filling
+ * runs of blank cells that share a background as single rectangles.
+ */
+static void term_redraw_cells(int y, int x, int end_x) {
+	term_cell_t * row = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width) * sizeof(term_cell_t));
+
+	/* The right half of a wide character is drawn with its left half */
+	if (x > 0 && row[x].c == 0xFFFF) x--;
+
+	while (x < end_x) {
+		term_cell_t * cell = &row[x];
+		uint32_t color;
+
+		if (cell->flags & ANSI_EXT_IMG) {
+			redraw_cell_image(x,y,cell);
+			x++;
+		} else if (cell_blank_color(cell, &color)) {
+			int end = x + 1;
+			uint32_t next;
+			while (end < end_x && cell_blank_color(&row[end], &next) && next == color) end++;
+			term_fill_run(x, y, end - x, color);
+			x = end;
+		} else {
+			term_write_char(cell->c, x * char_width, y * char_height, cell->fg, cell->bg, cell->flags);
+			x++;
+		}
+	}
+}
+
+static void term_redraw_row(int y) {
+	term_redraw_cells(y, 0, term_width);
+}
+
+/*
+ * Deferred redraw
+ *
+ * While output from the PTY is being parsed, drawing is put off:
+ * the callbacks only update the cell grid and note which columns of
+ * which rows changed, and scrolling moves cells without touching
+ * pixels. The damage is drawn in one go by term_flush_deferred()
+ * when it's time for a frame, so a burst of output that scrolls
+ * by faster than the compositor can show it skips the frames in
+ * between instead of drawing every one of them.
+ */
+static int defer_redraw = 0;
+static int dirty_rows = 0;
+static int * dirty_from = NULL;
+static int * dirty_to = NULL;
+
+/* Forget any pending damage; called when everything is redrawn anyway. */
+static void reset_dirty_rows(void) {
+	if (dirty_rows != term_height) {
+		dirty_rows = term_height;
+		dirty_from = realloc(dirty_from, sizeof(int) * dirty_rows);
+		dirty_to = realloc(dirty_to, sizeof(int) * dirty_rows);
+	}
+	for (int i = 0; i < dirty_rows; ++i) {
+		dirty_from[i] = term_width;
+		dirty_to[i] = 0;
+	}
+}
+
+static void mark_cells_dirty(int y, int x, int end_x) {
+	if (y < 0 || y >= dirty_rows) return;
+	if (x < dirty_from[y]) dirty_from[y] = x;
+	if (end_x > dirty_to[y]) dirty_to[y] = end_x;
+}
+
+static void mark_rows_dirty(int top, int height) {
+	for (int y = top; y < top + height; ++y) {
+		mark_cells_dirty(y, 0, term_width);
+	}
+}
+
+/* Move `count` rows of rendered cells from row `src_row` to row `dest_row`. */
+static void term_move_pixel_rows(int dest_row, int src_row, int count) {
+	uintptr_t dst = (uintptr_t)ctx->backbuffer + GFX_W(ctx) * (dest_row * char_height) * GFX_B(ctx);
+	uintptr_t src = (uintptr_t)ctx->backbuffer + GFX_W(ctx) * (src_row * char_height) * GFX_B(ctx);
+	if (!_no_frame) {
+		dst += (GFX_W(ctx) * (decor_top_height + menu_bar_height) + decor_left_width) * GFX_B(ctx);
+		src += (GFX_W(ctx) * (decor_top_height + menu_bar_height) + decor_left_width) * GFX_B(ctx);
+		if (dst < src) {
+			for (int i = 0; i < count * char_height; ++i) {
+				memmove((void*)(dst + i * GFX_W(ctx) * GFX_B(ctx)), (void*)(src + i * GFX_W(ctx) * GFX_B(ctx)), term_width * char_width * GFX_B(ctx));
+			}
+		} else {
+			for (int i = count * char_height - 1; i >= 0; --i) {
+				memmove((void*)(dst + i * GFX_W(ctx) * GFX_B(ctx)), (void*)(src + i * GFX_W(ctx) * GFX_B(ctx)), term_width * char_width * GFX_B(ctx));
+			}
+		}
+	} else {
+		size_t siz = count * char_height * GFX_W(ctx) * GFX_B(ctx);
+		memmove((void*)dst, (void*)src, siz);
+	}
+}
+
+/*
+ * Rows the whole screen has scrolled by while drawing was deferred,
+ * whose pixels haven't been moved yet. Successive scrolls add up, so
+ * however many lines go by in a frame, the pixels only move once.
+ */
+static int pending_scroll = 0;
+
+static void apply_pending_scroll(void) {
+	int n = pending_scroll;
+	if (!n) return;
+	pending_scroll = 0;
+
+	/* Scrolled a whole screen or more: every row is dirty anyway */
+	if (n >= term_height || -n >= term_height) return;
+
+	if (n > 0) {
+		term_move_pixel_rows(0, n, term_height - n);
+	} else {
+		term_move_pixel_rows(-n, 0, term_height + n);
+	}
+	term_mark_damage(0, 0, term_width * char_width, term_height * char_height);
+}
+
+/* Pending damage moves along with the rows it belongs to. */
+static void shift_dirty_rows(int top, int height, int how_much) {
+	if (top < 0 || top + height > dirty_rows) return;
+	if (how_much >= height || -how_much >= height) {
+		mark_rows_dirty(top, height);
+		return;
+	}
+	if (how_much > 0) {
+		for (int y = top; y < top + height - how_much; ++y) {
+			dirty_from[y] = dirty_from[y + how_much];
+			dirty_to[y] = dirty_to[y + how_much];
+		}
+		mark_rows_dirty(top + height - how_much, how_much);
+	} else {
+		for (int y = top + height - 1; y >= top - how_much; --y) {
+			dirty_from[y] = dirty_from[y + how_much];
+			dirty_to[y] = dirty_to[y + how_much];
+		}
+		mark_rows_dirty(top, -how_much);
+	}
+}
+
+static void draw_cursor(void);
+
+/* Draw everything deferred output left behind. */
+static void term_flush_deferred(void) {
+	apply_pending_scroll();
+
+	int any = 0;
+	for (int y = 0; y < dirty_rows; ++y) {
+		if (dirty_from[y] < dirty_to[y]) {
+			term_redraw_cells(y, dirty_from[y], min(dirty_to[y], term_width));
+			dirty_from[y] = term_width;
+			dirty_to[y] = 0;
+			any = 1;
+		}
+	}
+	if (any) draw_cursor();
+}
+
 static void cell_redraw_offset(uint16_t x, uint16_t _y) {
 	int y = _y;
 	int i = y;
@@ -870,16 +1397,12 @@ static void cell_redraw_offset(uint16_t x, uint16_t _y) {
 			term_write_char(cell->c, x * char_width, i * char_height, cell->fg, cell->bg, cell->flags);
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
-				if (!cell || ((uint32_t *)cell)[0] == 0x00000000) {
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row) {
+			if (x < width) {
+				term_cell_t * cell = &row[x];
+				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				} else {
 					term_write_char(cell->c, x * char_width, i * char_height, cell->fg, cell->bg, cell->flags);
@@ -906,16 +1429,12 @@ static void cell_redraw_offset_inverted(uint16_t x, uint16_t _y) {
 			term_write_char(cell->c, x * char_width, i * char_height, cell->bg, cell->fg, cell->flags);
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
-				if (!cell || ((uint32_t *)cell)[0] == 0x00000000) {
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row) {
+			if (x < width) {
+				term_cell_t * cell = &row[x];
+				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_BG, TERM_DEFAULT_FG, TERM_DEFAULT_FLAGS);
 				} else {
 					term_write_char(cell->c, x * char_width, i * char_height, cell->bg, cell->fg, cell->flags);
@@ -933,6 +1452,11 @@ static void cell_redraw(uint16_t x, uint16_t y) {
 	/* Avoid cells out of range. */
 	if (x >= term_width || y >= term_height) return;
 
+	if (defer_redraw) {
+		mark_cells_dirty(y, x, x + 1);
+		return;
+	}
+
 	/* Calculate the cell position in the terminal buffer */
 	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
 
@@ -1010,6 +1534,7 @@ static uint8_t cursor_flipped = 0;
 /* A soft request to draw the cursor. */
 static void draw_cursor() {
 	if (!cursor_on) return;
+	if (defer_redraw) return; /* Drawn by term_flush_deferred */
 	mouse_ticks = get_ticks();
 	cursor_flipped = 0;
 	render_cursor();
@@ -1033,25 +1558,14 @@ static void maybe_flip_cursor(void) {
 	}
 }
 
-/* Draw all cells. Duplicates code from cell_redraw to avoid unecessary bounds checks. */
+/* Draw all cells. */
 static void term_redraw_all() {
+	if (defer_redraw) {
+		mark_rows_dirty(0, term_height);
+		return;
+	}
 	for (int i = 0; i < term_height; i++) {
-		for (int x = 0; x < term_width; ++x) {
-			/* Calculate the cell position in the terminal buffer */
-			term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (i * term_width + x) * sizeof(term_cell_t));
-			/* If it's an image cell, redraw the image data. */
-			if (cell->flags & ANSI_EXT_IMG) {
-				redraw_cell_image(x,i,cell);
-				continue;
-			}
-
-			/* Special case empty cells. */
-			if (((uint32_t *)cell)[0] == 0x00000000) {
-				term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
-			} else {
-				term_write_char(cell->c, x * char_width, i * char_height, cell->fg, cell->bg, cell->flags);
-			}
-		}
+		term_redraw_row(i);
 	}
 }
 
@@ -1080,24 +1594,28 @@ static void flush_unused_images(void) {
 	images_list = tmp;
 }
 
+/*
+ * Shift the rows [top, top+height) by `how_much` (positive is up).
+ *
+ * Cells move in the buffer and their rendered pixels move with them,
+ * so only the lines that scroll into view need to be drawn.
+ */
 static void term_shift_region(int top, int height, int how_much) {
 	if (how_much == 0) return;
 
-	int destination, source;
 	int count, new_top, new_bottom;
-	if (how_much > height) {
+	int dest_row = top, src_row = top;
+	if (how_much >= height || -how_much >= height) {
 		count = 0;
 		new_top = top;
 		new_bottom = top + height;
 	} else if (how_much > 0) {
-		destination = term_width * top;
-		source = term_width * (top + how_much);
+		src_row = top + how_much;
 		count = height - how_much;
 		new_top = top + height - how_much;
 		new_bottom = top + height;
-	} else if (how_much < 0) {
-		destination = term_width * (top - how_much);
-		source = term_width * top;
+	} else {
+		dest_row = top - how_much;
 		count = height + how_much;
 		new_top = top;
 		new_bottom = top - how_much;
@@ -1105,34 +1623,27 @@ static void term_shift_region(int top, int height, int how_much) {
 
 	/* Move from top+how_much to top */
 	if (count) {
-		memmove(term_buffer + destination, term_buffer + source, count * term_width * sizeof(term_cell_t));
-		/* Move displayed as well */
-		cell_redraw(csr_x, csr_y); /* Otherwise we may copy the inverted cursor */
-		uintptr_t dst = (uintptr_t)ctx->backbuffer + GFX_W(ctx) * (destination / term_width * char_height) * GFX_B(ctx);
-		uintptr_t src = (uintptr_t)ctx->backbuffer + GFX_W(ctx) * (source / term_width * char_height) * GFX_B(ctx);
-		if (!_no_frame) {
-			dst += (GFX_W(ctx) * (decor_top_height + menu_bar_height) + decor_left_width) * GFX_B(ctx);
-			src += (GFX_W(ctx) * (decor_top_height + menu_bar_height) + decor_left_width) * GFX_B(ctx);
-			if (dst < src) {
-				for (int i = 0; i < count * char_height; ++i) {
-					memmove((void*)(dst + i * GFX_W(ctx) * GFX_B(ctx)), (void*)(src + i * GFX_W(ctx) * GFX_B(ctx)), term_width * char_width * GFX_B(ctx));
-				}
-			} else {
-				for (int i = (count - 1) * char_height; i >= 0; --i) {
-					memmove((void*)(dst + i * GFX_W(ctx) * GFX_B(ctx)), (void*)(src + i * GFX_W(ctx) * GFX_B(ctx)), term_width * char_width * GFX_B(ctx));
-				}
-			}
+		memmove(term_buffer + dest_row * term_width, term_buffer + src_row * term_width, count * term_width * sizeof(term_cell_t));
+		/* Otherwise we may copy the inverted cursor */
+		cell_redraw(csr_x, csr_y);
+		if (defer_redraw && top == 0 && height == term_height) {
+			pending_scroll += how_much;
 		} else {
-			size_t siz = count * char_height * GFX_W(ctx) * GFX_B(ctx);
-			memmove((void*)dst, (void*)src, siz);
+			apply_pending_scroll();
+			term_move_pixel_rows(dest_row, src_row, count);
 		}
 	}
+	shift_dirty_rows(top, height, how_much);
 
 	/* Clear new lines at bottom */
 	for (int i = new_top; i < new_bottom; ++i) {
 		for (uint16_t x = 0; x < term_width; ++x) {
 			cell_set(x, i, ' ', current_fg, current_bg, ansi_state->flags);
-			cell_redraw(x, i);
+		}
+		if (defer_redraw) {
+			mark_cells_dirty(i, 0, term_width);
+		} else {
+			term_redraw_row(i);
 		}
 	}
 }
@@ -1146,7 +1657,9 @@ static void term_scroll(int how_much) {
 	flush_unused_images();
 
 	/* Flip the entire window. */
-	yutani_flip(yctx, window);
+	if (!defer_redraw) {
+		yutani_flip(yctx, window);
+	}
 }
 
 static void insert_delete_lines(int how_many) {
@@ -1168,22 +1681,7 @@ static int is_wide(uint32_t codepoint) {
 
 /* Save the row that is about to be scrolled offscreen into the scrollback buffer. */
 static void save_scrollback(void) {
-
-	/* If the scrollback is already full, remove the oldest element. */
-	if (scrollback_list->length == MAX_SCROLLBACK) {
-		node_t * n = list_dequeue(scrollback_list);
-		free(n->value);
-		free(n);
-	}
-
-	struct scrollback_row * row = malloc(sizeof(struct scrollback_row) + sizeof(term_cell_t) * term_width + 20);
-	row->width = term_width;
-	for (int i = 0; i < term_width; ++i) {
-		term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (i) * sizeof(term_cell_t));
-		memcpy(&row->cells[i], cell, sizeof(term_cell_t));
-	}
-
-	list_insert(scrollback_list, row);
+	scrollback_push(term_buffer, term_width);
 }
 
 /* Draw the scrollback. */
@@ -1207,57 +1705,50 @@ static void redraw_scrollback(void) {
 			}
 		}
 
-		node_t * node = scrollback_list->tail;
 		for (int i = 0; i < scrollback_offset; ++i) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
+			int row_width;
+			term_cell_t * row = scrollback_row(i, &row_width);
 
 			int y = scrollback_offset - 1 - i;
-			int width = row->width;
+			int width = row_width;
 			if (width > term_width) {
 				width = term_width;
 			} else {
-				for (int x = row->width; x < term_width; ++x) {
+				for (int x = row_width; x < term_width; ++x) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				}
 			}
 			for (int x = 0; x < width; ++x) {
-				term_cell_t * cell = &row->cells[x];
+				term_cell_t * cell = &row[x];
 				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				} else {
 					term_write_char(cell->c, x * char_width, y * char_height, cell->fg, cell->bg, cell->flags);
 				}
 			}
-
-			node = node->prev;
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (int i = 0; i < scrollback_offset - term_height; ++i) {
-			node = node->prev;
-		}
 		for (int i = scrollback_offset - term_height; i < scrollback_offset; ++i) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
+			int row_width;
+			term_cell_t * row = scrollback_row(i, &row_width);
 
 			int y = scrollback_offset - 1 - i;
-			int width = row->width;
+			int width = row_width;
 			if (width > term_width) {
 				width = term_width;
 			} else {
-				for (int x = row->width; x < term_width; ++x) {
+				for (int x = row_width; x < term_width; ++x) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				}
 			}
 			for (int x = 0; x < width; ++x) {
-				term_cell_t * cell = &row->cells[x];
+				term_cell_t * cell = &row[x];
 				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				} else {
 					term_write_char(cell->c, x * char_width, y * char_height, cell->fg, cell->bg, cell->flags);
 				}
 			}
-
-			node = node->prev;
 		}
 	}
 	display_flip();
@@ -1454,7 +1945,9 @@ static void term_switch_buffer(int buffer) {
 		SWAP(uint32_t, current_bg, _orig_bg);
 
 		term_redraw_all();
-		display_flip();
+		if (!defer_redraw) {
+			display_flip();
+		}
 	}
 
 }
@@ -1503,7 +1996,7 @@ static void handle_input_s(char * c) {
 /* Scroll the view up (scrollback) */
 static void scroll_up(int amount) {
 	int i = 0;
-	while (i < amount && scrollback_list && scrollback_offset < (int)scrollback_list->length) {
+	while (i < amount && scrollback_offset < scrollback_count()) {
 		scrollback_offset ++;
 		i++;
 	}
@@ -1513,7 +2006,7 @@ static void scroll_up(int amount) {
 /* Scroll the view down (scrollback) */
 void scroll_down(int amount) {
 	int i = 0;
-	while (i < amount && scrollback_list && scrollback_offset != 0) {
+	while (i < amount && scrollback_offset != 0) {
 		scrollback_offset -= 1;
 		i++;
 	}
@@ -1694,8 +2187,8 @@ static void key_event(int ret, key_event_t * event) {
 				break;
 			case KEY_HOME:
 				if (event->modifiers & KEY_MOD_LEFT_SHIFT) {
-					if (scrollback_list) {
-						scrollback_offset = scrollback_list->length;
+					if (scrollback_count()) {
+						scrollback_offset = scrollback_count();
 						redraw_scrollback();
 					}
 				} else {
@@ -1770,6 +2263,9 @@ static term_cell_t * copy_terminal(int old_width, int old_height, term_cell_t *
 /* Reinitialize the terminal after a resize. */
 static void reinit(void) {
 
+	/* Cached cells may be the wrong size or font now. */
+	glyph_cache_flush();
+
 	/* Figure out character sizes if fonts have changed. */
 	if (_use_aa && !_have_freetype) {
 		char_width = 9;
@@ -1832,6 +2328,10 @@ static void reinit(void) {
 	ansi_state = ansi_init(ansi_state, term_width, term_height, &term_callbacks);
 	ansi_state->mouse_on = old_mouse_state;
 
+	/* Everything gets redrawn below */
+	reset_dirty_rows();
+	pending_scroll = 0;
+
 	/* Redraw the window */
 	draw_fill(ctx, rgba(0,0,0, TERM_DEFAULT_OPAC));
 	render_decors();
@@ -2231,12 +2731,13 @@ int main(int argc, char ** argv) {
 		{"no-frame",   no_argument,       0, 'n'},
 		{"geometry",   required_argument, 0, 'g'},
 		{"no-ft",      no_argument,       0, 'f'},
+		{"scrollback", required_argument, 0, 'S'},
 		{0,0,0,0}
 	};
 
 	/* Read some arguments */
 	int index, c;
-	while ((c = getopt_long(argc, argv, "bhxnfFls:g:", long_opts, &index)) != -1) {
+	while ((c = getopt_long(argc, argv, "bhxnfFls:g:S:", long_opts, &index)) != -1) {
 		if (!c) {
 			if (long_opts[index].flag == 0) {
 				c = long_opts[index].val;
@@ -2278,6 +2779,9 @@ int main(int argc, char ** argv) {
 					}
 				}
 				break;
+			case 'S':
+				scrollback_limit = atoi(optarg);
+				break;
 			case '?':
 				break;
 			default:
@@ -2381,7 +2885,7 @@ int main(int argc, char ** argv) {
 	menu_insert(m, menu_create_normal("star","star","About Terminal", _menu_action_show_about));
 	menu_set_insert(terminal_menu_bar.set, "help", m);
 
-	scrollback_list = list_create();
+	scrollback_init();
 	images_list = list_create();
 
 	/* Initialize the graphics context */
@@ -2406,6 +2910,10 @@ int main(int argc, char ** argv) {
 	input_buffer_queue = list_create();
 	pthread_create(&input_buffer_thread, NULL, handle_input_writing, NULL);
 
+	/* Find out about the child exiting from a signal descriptor, if we can, rather than by polling */
+	uint64_t child_mask = SIGNALFD_BIT(SIGCHLD);
+	int child_fd = signalfd(-1, &child_mask, SFD_NONBLOCK);
+
 	/* Make sure we're not passing anything to stdin on the child */
 	fflush(stdin);
 
@@ -2413,6 +2921,7 @@ int main(int argc, char ** argv) {
 	child_pid = fork();
 
 	if (!child_pid) {
+		if (child_fd >= 0) close(child_fd);
 		setsid();
 		/* Prepare stdin/out/err */
 		dup2(fd_slave, 0);
@@ -2443,8 +2952,9 @@ int main(int argc, char ** argv) {
 		return 1;
 	} else {
 
-		/* Set up fswait to check Yutani and the PTY master */
-		int fds[2] = {fileno(yctx->sock), fd_master};
+		/* Set up fswait to check Yutani, the PTY master, and for SIGCHLD */
+		int fds[3] = {fileno(yctx->sock), fd_master, child_fd};
+		int nfds = child_fd >= 0 ? 3 : 2;
 
 		/* PTY read buffer */
 		unsigned char buf[4096];
@@ -2452,25 +2962,35 @@ int main(int argc, char ** argv) {
 		while (!exit_application) {
 
 			/* Wait for something to happen. */
-			int res[] = {0,0};
-			fswait3(2,fds,200,res);
+			int res[] = {0,0,0};
+			fswait3(nfds,fds,200,res);
 
 			/* Check if the child application has closed. */
-			check_for_exit();
+			if (child_fd < 0) {
+				check_for_exit();
+			} else if (res[2]) {
+				struct signalfd_siginfo info[4];
+				read(child_fd, info, sizeof(info));
+				check_for_exit();
+			}
 			maybe_flip_cursor();
 
 			if (res[1]) {
 				/* Read from PTY */
 				int r = read(fd_master, buf, 4096);
+				/* Only update the cell grid; drawing waits for the next frame */
+				defer_redraw = 1;
 				for (int i = 0; i < r; ++i) {
 					ansi_put(ansi_state, buf[i]);
 				}
-				display_flip();
+				defer_redraw = 0;
 			}
 			if (res[0]) {
 				/* Handle Yutani events. */
 				handle_incoming();
 			}
+			/* Push out anything held back while waiting on the compositor */
+			display_flip_throttled();
 		}
 	}
 
@@ -0,0 +1,262 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * top - Show which processes are using the processor
+ *
+ * Samples /proc/<pid>/stat every few seconds and shows what each
+ * process did in between: processor time, system calls, bytes
+ * read and written, and page faults. Threads are counted with
+ * their process.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+
+#include <toaru/hashmap.h>
+#include <toaru/list.h>
+
+#define LINE_LEN 4096
+
+struct usage {
+	int pid;
+	char name[100];
+	unsigned long time;     /* User and system, in milliseconds */
+	unsigned long syscalls;
+	unsigned long read_kb;
+	unsigned long write_kb;
+	unsigned long faults;
+};
+
+struct row {
+	struct usage * now;
+	unsigned long time;
+	unsigned long syscalls;
+	unsigned long read_kb;
+	unsigned long write_kb;
+	unsigned long faults;
+};
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"top - show processor usage by process\n"
+			"\n"
+			"usage: %s [-b] [-d seconds] [-n count]\n"
+			"\n"
+			" -b     \033[3mbatch mode: don't clear the screen, show every process\033[0m\n"
+			" -d     \033[3mseconds between updates (default 2)\033[0m\n"
+			" -n     \033[3mstop after this many updates\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+}
+
+static int read_status(char * pid, int * tgid, char * name) {
+	char path[256];
+	char line[LINE_LEN];
+	sprintf(path, "/proc/%s/status", pid);
+	FILE * f = fopen(path, "r");
+	if (!f) return 1;
+
+	while (fgets(line, LINE_LEN, f)) {
+		char * n = strchr(line, '\n');
+		if (n) *n = '\0';
+		char * tab = strchr(line, '\t');
+		if (!tab) continue;
+		tab++;
+		if (strstr(line, "Tgid:") == line) {
+			*tgid = atoi(tab);
+		} else if (strstr(line, "Name:") == line) {
+			strncpy(name, tab, 99);
+			name[99] = '\0';
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void read_stat(char * pid, struct usage * u) {
+	char path[256];
+	char line[LINE_LEN];
+	sprintf(path, "/proc/%s/stat", pid);
+	FILE * f = fopen(path, "r");
+	if (!f) return;
+
+	while (fgets(line, LINE_LEN, f)) {
+		char * tab = strchr(line, '\t');
+		if (!tab) continue;
+		unsigned long value = strtoul(tab + 1, NULL, 10);
+		if (strstr(line, "UserTime:") == line || strstr(line, "SystemTime:") == line) {
+			u->time += value;
+		} else if (strstr(line, "Syscalls:") == line) {
+			u->syscalls += value;
+		} else if (strstr(line, "ReadBytes:") == line) {
+			u->read_kb += value;
+		} else if (strstr(line, "WriteBytes:") == line) {
+			u->write_kb += value;
+		} else if (strstr(line, "PageFaults:") == line) {
+			u->faults += value;
+		}
+	}
+
+	fclose(f);
+}
+
+/*
+ * Collect the usage of every process, keyed by pid.
+ */
+static hashmap_t * collect(void) {
+	hashmap_t * out = hashmap_create_int(64);
+
+	DIR * dirp = opendir("/proc");
+	if (!dirp) return out;
+
+	struct dirent * ent;
+	while ((ent = readdir(dirp))) {
+		if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+
+		int tgid = 0;
+		char name[100] = {0};
+		if (read_status(ent->d_name, &tgid, name)) continue;
+		if (!tgid) tgid = atoi(ent->d_name);
+
+		struct usage * u = hashmap_get(out, (void *)(uintptr_t)tgid);
+		if (!u) {
+			u = calloc(1, sizeof(struct usage));
+			u->pid = tgid;
+			hashmap_set(out, (void *)(uintptr_t)tgid, u);
+		}
+		/* The group leader names the process */
+		if (atoi(ent->d_name) == tgid || !u->name[0]) {
+			strcpy(u->name, name);
+		}
+		read_stat(ent->d_name, u);
+	}
+	closedir(dirp);
+
+	return out;
+}
+
+static void free_usage(hashmap_t * map) {
+	list_t * values = hashmap_values(map);
+	foreach(node, values) {
+		free(node->value);
+	}
+	list_free(values);
+	free(values);
+	hashmap_free(map);
+	free(map);
+}
+
+static int sort_rows(const void * a, const void * b) {
+	const struct row * x = a;
+	const struct row * y = b;
+	if (x->time != y->time) return x->time < y->time ? 1 : -1;
+	if (x->syscalls != y->syscalls) return x->syscalls < y->syscalls ? 1 : -1;
+	return x->now->pid - y->now->pid;
+}
+
+static unsigned long now_ms(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000 + t.tv_usec / 1000;
+}
+
+int main(int argc, char * argv[]) {
+	int batch = 0;
+	int delay = 2;
+	int iterations = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "bd:n:?")) != -1) {
+		switch (c) {
+			case 'b':
+				batch = 1;
+				break;
+			case 'd':
+				delay = atoi(optarg);
+				if (delay < 1) delay = 1;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	hashmap_t * before = collect();
+	unsigned long then = now_ms();
+
+	for (int i = 0; !iterations || i < iterations; ++i) {
+		sleep(delay);
+
+		hashmap_t * after = collect();
+		unsigned long now = now_ms();
+		unsigned long elapsed = now - then;
+		if (!elapsed) elapsed = 1;
+
+		list_t * values = hashmap_values(after);
+		struct row * rows = malloc(sizeof(struct row) * (values->length + 1));
+		int count = 0;
+		unsigned long busy = 0;
+		foreach(node, values) {
+			struct usage * u = node->value;
+			struct usage * p = hashmap_get(before, (void *)(uintptr_t)u->pid);
+			struct row * r = &rows[count++];
+			r->now = u;
+			/* New processes count from zero */
+			r->time     = u->time     - (p && p->time     <= u->time     ? p->time     : 0);
+			r->syscalls = u->syscalls - (p && p->syscalls <= u->syscalls ? p->syscalls : 0);
+			r->read_kb  = u->read_kb  - (p && p->read_kb  <= u->read_kb  ? p->read_kb  : 0);
+			r->write_kb = u->write_kb - (p && p->write_kb <= u->write_kb ? p->write_kb : 0);
+			r->faults   = u->faults   - (p && p->faults   <= u->faults   ? p->faults   : 0);
+			busy += r->time;
+		}
+		list_free(values);
+		free(values);
+
+		qsort(rows, count, sizeof(struct row), sort_rows);
+
+		int max_rows = count;
+		if (!batch) {
+			struct winsize w = {0};
+			ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+			if (w.ws_row > 4 && w.ws_row - 4 < max_rows) max_rows = w.ws_row - 4;
+			printf("\033[H\033[2J");
+		}
+
+		int load = busy * 1000 / elapsed;
+		printf("%d processes, %d.%d%% of the processor in use\n\n", count, load / 10, load % 10);
+		printf("%6s %6s %8s %8s %8s %8s %6s CMD\n", "PID", "CPU%", "TIME", "SYSC/s", "RD kB/s", "WR kB/s", "FLT/s");
+		for (int j = 0; j < max_rows; ++j) {
+			struct row * r = &rows[j];
+			int cpu = r->time * 1000 / elapsed;
+			char cpu_s[16], time_s[16];
+			sprintf(cpu_s, "%d.%d", cpu / 10, cpu % 10);
+			sprintf(time_s, "%lu:%02lu", r->now->time / 60000, (r->now->time / 1000) % 60);
+			printf("%6d %6s %8s %8lu %8lu %8lu %6lu %s\n",
+				r->now->pid, cpu_s, time_s,
+				r->syscalls * 1000 / elapsed,
+				r->read_kb * 1000 / elapsed,
+				r->write_kb * 1000 / elapsed,
+				r->faults * 1000 / elapsed,
+				r->now->name);
+		}
+		if (batch) printf("\n");
+		fflush(stdout);
+
+		free(rows);
+		free_usage(before);
+		before = after;
+		then = now;
+	}
+
+	return 0;
+}
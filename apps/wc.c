@@ -6,11 +6,116 @@
  * wc - count bytes, characters, words, lines...
  */
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <errno.h>
-#include <toaru/decodeutf8.h>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
+#define RBUF_SIZE 0x10000
+
+#define CLASS_SPACE   1
+#define CLASS_NEWLINE 2
+#define CLASS_CONT    4 /* UTF-8 continuation byte; doesn't start a character */
+
+static uint8_t byte_class[256];
+static uint8_t popcount8[256];
+
+struct counts {
+	int lines;
+	int words;
+	int chars;
+	int bytes;
+	int in_space; /* Whether the last byte seen was whitespace */
+};
+
+static void build_tables(void) {
+	for (int i = 0; i < 256; ++i) {
+		if (i == ' ' || (i >= '\t' && i <= '\r')) byte_class[i] |= CLASS_SPACE;
+		if (i == '\n') byte_class[i] |= CLASS_NEWLINE;
+		if ((i & 0xC0) == 0x80) byte_class[i] |= CLASS_CONT;
+		popcount8[i] = (i & 1) + popcount8[i >> 1];
+	}
+}
+
+static inline int popcount16(unsigned int x) {
+	return popcount8[x & 0xFF] + popcount8[x >> 8];
+}
+
+static void count_scalar(struct counts * n, const uint8_t * buf, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		uint8_t c = byte_class[buf[i]];
+		if (c & CLASS_NEWLINE) n->lines++;
+		if (!(c & CLASS_CONT)) n->chars++;
+		/* A word starts wherever non-space follows space */
+		if (!(c & CLASS_SPACE) && n->in_space) n->words++;
+		n->in_space = c & CLASS_SPACE;
+	}
+	n->bytes += len;
+}
+
+#ifndef NO_SSE
+/**
+ * Sixteen bytes at a time: compare into masks of newlines, whitespace
+ * and continuation bytes, then count bits. Word starts are the bytes
+ * that aren't space but whose predecessor was.
+ */
+static void count_block(struct counts * n, const uint8_t * buf, size_t len) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i tab     = _mm_set1_epi8('\t');
+	const __m128i space   = _mm_set1_epi8(' ');
+	const __m128i four    = _mm_set1_epi8(4);
+	const __m128i topbits = _mm_set1_epi8((char)0xC0);
+	const __m128i cont    = _mm_set1_epi8((char)0x80);
+
+	unsigned int prev_space = n->in_space ? 1 : 0;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&buf[i]);
+
+		/* \t through \r, as one unsigned range check: (c - '\t') <= 4 */
+		__m128i r = _mm_sub_epi8(v, tab);
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(r, four), r), _mm_cmpeq_epi8(v, space));
+
+		unsigned int nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+		unsigned int sp = _mm_movemask_epi8(ws);
+		unsigned int cb = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, topbits), cont));
+
+		unsigned int starts = ~sp & ((sp << 1) | prev_space) & 0xFFFF;
+		prev_space = sp >> 15;
+
+		n->lines += popcount16(nl);
+		n->words += popcount16(starts);
+		n->chars += 16 - popcount16(cb);
+	}
+
+	n->bytes += i;
+	n->in_space = prev_space;
+	count_scalar(n, buf + i, len - i);
+}
+#else
+#define count_block count_scalar
+#endif
+
+static void print_counts(struct counts * n, const char * name, int show_lines, int show_words, int show_chars, int show_bytes) {
+	if (!show_words && !show_chars && !show_bytes && !show_lines) {
+		fprintf(stdout, "%d %d %d %s\n", n->lines, n->words, n->bytes, name);
+	} else {
+		if (show_lines) fprintf(stdout, "%d ", n->lines);
+		if (show_words) fprintf(stdout, "%d ", n->words);
+		if (show_chars) fprintf(stdout, "%d ", n->chars);
+		else if (show_bytes) fprintf(stdout, "%d ", n->bytes);
+		fprintf(stdout, "%s\n", name);
+	}
+}
+
+static uint8_t buf[RBUF_SIZE];
 
 int main(int argc, char * argv[]) {
 	int show_lines = 0;
@@ -38,9 +143,7 @@ int main(int argc, char * argv[]) {
 	}
 
 	int retval = 0;
-	int total_lines = 0;
-	int total_chars = 0;
-	int total_words = 0;
+	struct counts total = {0};
 	int just_stdin = 0;
 
 	if (optind == argc) {
@@ -49,83 +152,47 @@ int main(int argc, char * argv[]) {
 		just_stdin = 1;
 	}
 
+	build_tables();
+
 	for (int i = optind; i < argc; ++i) {
 		if (!*argv[i] && !just_stdin) {
 			fprintf(stderr, "%s: invalid zero-length file name\n", argv[0]);
 			retval = 1;
 			continue;
 		}
-		FILE * f = (!strcmp(argv[i], "-") || just_stdin) ? stdin : fopen(argv[i], "r");
-		if (!f) {
+		int fd = (!strcmp(argv[i], "-") || just_stdin) ? STDIN_FILENO : open(argv[i], O_RDONLY);
+		if (fd < 0) {
 			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
 			retval = 1;
 			continue;
 		}
 
-		int lines = 0;
-		int chars = 0;
-		int words = 0;
-		int ch;
-		uint32_t state, c;
-		int last_was_whitespace = 0;
-
-		while (!feof(f)) {
-			ch = getc(f);
-			if (ch < 0) break;
-
-			if (show_chars) {
-				if (!decode(&state, &c, ch)) {
-				} else if (state == UTF8_REJECT) {
-					state = 0;
-				}
-			} else {
-				c = ch;
-			}
-
-			chars++;
-			if (c == '\n') {
-				last_was_whitespace = 1;
-				lines++;
-				words++;
-			} else if (c == ' ') {
-				if (last_was_whitespace) continue;
-				last_was_whitespace = 1;
-				words++;
-			} else {
-				last_was_whitespace = 0;
-			}
-		}
-
-		if (!last_was_whitespace && chars > 0) words++;
+		struct counts n = {0};
+		n.in_space = 1;
 
-		if (!show_words && !show_chars && !show_bytes && !show_lines) {
-			fprintf(stdout, "%d %d %d %s\n", lines, words, chars, argv[i]);
-		} else {
-			if (show_lines) fprintf(stdout, "%d ", lines);
-			if (show_words) fprintf(stdout, "%d ", words);
-			if (show_bytes|show_chars) fprintf(stdout, "%d ", chars);
-			fprintf(stdout, "%s\n", argv[i]);
+		ssize_t r;
+		while ((r = read(fd, buf, RBUF_SIZE)) > 0) {
+			count_block(&n, buf, r);
+		}
+		if (r < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], just_stdin ? "stdin" : argv[i], strerror(errno));
+			retval = 1;
 		}
 
-		total_lines += lines;
-		total_words += words;
-		total_chars += chars;
+		print_counts(&n, argv[i], show_lines, show_words, show_chars, show_bytes);
 
-		if (f != stdin) fclose(f);
-		if (just_stdin) return 0;
+		total.lines += n.lines;
+		total.words += n.words;
+		total.chars += n.chars;
+		total.bytes += n.bytes;
+
+		if (fd != STDIN_FILENO) close(fd);
+		if (just_stdin) return retval;
 	}
 
 	if (optind + 1 < argc) {
-		if (!show_words && !show_chars && !show_bytes && !show_lines) {
-			fprintf(stdout, "%d %d %d %s\n", total_lines, total_words, total_chars, "total");
-		} else {
-			if (show_lines) fprintf(stdout, "%d ", total_lines);
-			if (show_words) fprintf(stdout, "%d ", total_words);
-			if (show_bytes|show_chars) fprintf(stdout, "%d ", total_chars);
-			fprintf(stdout, "%s\n", "total");
-		}
+		print_counts(&total, "total", show_lines, show_words, show_chars, show_bytes);
 	}
 
 	return retval;
 }
-
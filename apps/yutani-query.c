@@ -5,13 +5,15 @@
  *
  * yutani-query - Query display server information
  *
- * At the moment, this only supports querying the display
- * resolution. An older version of this application had
+ * Shows the display resolution, and the compositor's input
+ * latency statistics (how long keys take to reach the screen,
+ * step by step). An older version of this application had
  * support for getting the default font names, but the
  * font server is no longer part of the compositor, so
  * that functionality doesn't make sense here.
  */
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <toaru/yutani.h>
@@ -23,11 +25,14 @@ void show_usage(int argc, char * argv[]) {
 	printf(
 			"yutani-query - show misc. information about the display system\n"
 			"\n"
-			"usage: %s [-r?]\n"
+			"usage: %s [-r?] [resolution|reload|latency [watch]]\n"
 			"\n"
 			" -r     \033[3mprint display resoluton\033[0m\n"
 			" -e     \033[3mask compositor to reload extensions\033[0m\n"
 			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			" latency        \033[3mshow how long keys take to reach the screen\033[0m\n"
+			" latency watch  \033[3m... over the last second, every second\033[0m\n"
 			"\n", argv[0]);
 }
 
@@ -49,6 +54,96 @@ int reload(void) {
 	return 0;
 }
 
+static const char * stage_names[YUTANI_LATENCY_STAGES] = {
+	"input",   /* compositor, before sending it */
+	"deliver", /* to the client */
+	"client",  /* drawing it */
+	"return",  /* flip back to the compositor */
+	"compose", /* until it's on screen */
+	"total",
+};
+
+#define BAR_WIDTH 40
+
+static int query_latency(struct yutani_msg_latency_report * out) {
+	yutani_query_latency(yctx);
+	yutani_msg_t * m = yutani_wait_for(yctx, YUTANI_MSG_LATENCY_REPORT);
+	if (!m) return 1;
+	memcpy(out, m->data, sizeof(struct yutani_msg_latency_report));
+	free(m);
+	return 0;
+}
+
+/* Differences since an earlier report; last and max can't be undone, so they stay */
+static void latency_since(struct yutani_msg_latency_report * now, struct yutani_msg_latency_report * then) {
+	now->dispatched -= then->dispatched;
+	now->completed -= then->completed;
+	for (int i = 0; i < YUTANI_LATENCY_STAGES; ++i) {
+		now->sum[i] -= then->sum[i];
+		for (int j = 0; j < YUTANI_LATENCY_BUCKETS; ++j) {
+			now->histogram[i][j] -= then->histogram[i][j];
+		}
+	}
+}
+
+static void print_latency(struct yutani_msg_latency_report * r) {
+	printf("%u keys sent, %u on screen\n\n", (unsigned int)r->dispatched, (unsigned int)r->completed);
+	printf("%-8s %10s %10s %10s\n", "stage", "avg us", "max us", "last us");
+	for (int i = 0; i < YUTANI_LATENCY_STAGES; ++i) {
+		uint32_t avg = r->completed ? (uint32_t)(r->sum[i] / r->completed) : 0;
+		printf("%-8s %10u %10u %10u\n", stage_names[i], (unsigned int)avg, (unsigned int)r->max[i], (unsigned int)r->last[i]);
+	}
+
+	uint32_t * h = r->histogram[YUTANI_LATENCY_TOTAL];
+	uint32_t most = 1;
+	int first = YUTANI_LATENCY_BUCKETS;
+	int last = 0;
+	for (int i = 0; i < YUTANI_LATENCY_BUCKETS; ++i) {
+		if (h[i] > most) most = h[i];
+		if (h[i] && i < first) first = i;
+		if (h[i]) last = i;
+	}
+	if (first == YUTANI_LATENCY_BUCKETS) return;
+
+	printf("\ntotal\n");
+	for (int i = first; i <= last; ++i) {
+		char bar[BAR_WIDTH + 1];
+		size_t len = ((size_t)h[i] * BAR_WIDTH + most - 1) / most;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		if (i == YUTANI_LATENCY_BUCKETS - 1) {
+			printf(">=%8u us %8u %s\n", 1U << i, (unsigned int)h[i], bar);
+		} else {
+			printf(" <%8u us %8u %s\n", 1U << (i + 1), (unsigned int)h[i], bar);
+		}
+	}
+}
+
+int show_latency(int watch) {
+	if (!yctx) {
+		if (!quiet) printf("(not connected)\n");
+		return 1;
+	}
+
+	struct yutani_msg_latency_report report;
+	if (query_latency(&report)) return 1;
+	if (!watch) {
+		print_latency(&report);
+		return 0;
+	}
+
+	while (1) {
+		struct yutani_msg_latency_report last = report;
+		sleep(1);
+		if (query_latency(&report)) return 1;
+		struct yutani_msg_latency_report delta = report;
+		latency_since(&delta, &last);
+		printf("\033[H\033[2J");
+		print_latency(&delta);
+		fflush(stdout);
+	}
+}
+
 int main(int argc, char * argv[]) {
 	yctx = yutani_init();
 	int opt;
@@ -75,6 +170,8 @@ int main(int argc, char * argv[]) {
 			return show_resolution();
 		} else if (!strcmp(argv[optind], "reload")) {
 			return reload();
+		} else if (!strcmp(argv[optind], "latency")) {
+			return show_latency(optind + 1 < argc && !strcmp(argv[optind+1], "watch"));
 		} else {
 			fprintf(stderr, "%s: unsupported command: %s\n", argv[0], argv[optind]);
 			return 1;
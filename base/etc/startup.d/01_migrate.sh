@@ -1,4 +1,5 @@
 #!/bin/sh
+# requires: startuplog
 
 if not kcmdline -q migrate then exit 0
 
@@ -1,4 +1,5 @@
 #!/bin/sh
+# requires: migrate
 
 export-cmd HOSTNAME cat /etc/hostname
 
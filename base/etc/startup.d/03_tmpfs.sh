@@ -1,4 +1,5 @@
 #!/bin/sh
+# requires: migrate
 
 echo -n "Mounting tmpfs..." > /dev/pex/splash
 mount tmpfs tmp,777 /tmp
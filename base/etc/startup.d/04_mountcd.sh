@@ -1,4 +1,5 @@
 #!/bin/sh
+# requires: migrate
 
 if not stat -Lq /dev/cdrom0 then exit 0
 
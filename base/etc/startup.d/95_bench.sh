@@ -0,0 +1,3 @@
+#!/bin/sh
+
+if qemu-fwcfg -q opt/org.toaruos.bench then /bin/bench -w -o /dev/ttyS1
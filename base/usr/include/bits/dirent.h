@@ -13,6 +13,10 @@ typedef struct dirent {
 typedef struct DIR {
 	int fd;
 	int cur_entry;
+	/* Entries fetched ahead of the caller */
+	uint32_t cursor;
+	int count;
+	struct dirent * entries;
 } DIR;
 
 DIR * opendir (const char * dirname);
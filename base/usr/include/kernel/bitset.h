@@ -2,7 +2,7 @@
  */
 #pragma once
 
-#include <kernel/system.h>
+#include <kernel/types.h>
 
 typedef struct {
 	unsigned char *data;
@@ -16,4 +16,6 @@ void bitset_clear(bitset_t *set, size_t bit);
 int bitset_test(bitset_t *set, size_t bit);
 /* Find first unset bit */
 int bitset_ffub(bitset_t *set);
+/* ... at or after `start`; -1 if every bit from there on is set */
+int bitset_ffub_from(bitset_t *set, size_t start);
 
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <kernel/system.h>
+
+/* Kinds of boot timeline event */
+enum {
+	BOOT_MARK = 0, /* Something happened */
+	BOOT_BEGIN,    /* Something started... */
+	BOOT_END,      /* ...and finished; matched to its begin by name */
+};
+
+/*
+ * Record a moment of the boot timeline, shown in /proc/boottime.
+ * The name is formatted like debug_print() and cut short at
+ * BOOT_NAME_MAX. Events past the first BOOT_EVENTS are dropped.
+ */
+extern void boot_event(int kind, const char * fmt, ...);
+#define boot_mark(...)  boot_event(BOOT_MARK, __VA_ARGS__)
+#define boot_begin(...) boot_event(BOOT_BEGIN, __VA_ARGS__)
+#define boot_end(...)   boot_event(BOOT_END, __VA_ARGS__)
+
+extern uint32_t boottime_read(uint64_t offset, uint32_t size, uint8_t * buffer);
+extern uint32_t boottime_write(uint64_t offset, uint32_t size, uint8_t * buffer);
@@ -0,0 +1,40 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * The clock page
+ *
+ * One page, mapped read-only into every process at CLOCK_PAGE_ADDRESS,
+ * that the kernel updates from the timer interrupt. libc reads the
+ * time from it instead of making a syscall.
+ *
+ * `seq` is odd while an update is in progress; readers copy what they
+ * need and try again if `seq` was odd or changed underneath them.
+ * Between updates the TSC fills in the microseconds, once the kernel
+ * has measured its rate (`tsc_per_usec` is 0 until then).
+ */
+#pragma once
+
+#include <_cheader.h>
+
+#ifdef _KERNEL_
+#	include <kernel/types.h>
+#else
+#	include <stdint.h>
+#endif
+
+_Begin_C_Header
+
+/* The last page before the kernel's kmap window, under the heap's end */
+#define CLOCK_PAGE_ADDRESS 0x1EBFF000
+
+struct clock_page {
+	volatile uint32_t seq;
+	volatile uint32_t boot_time;    /* Wall clock at boot, in seconds */
+	volatile int32_t  drift;        /* Added to the wall clock */
+	volatile uint32_t ticks;        /* Seconds since boot */
+	volatile uint32_t subticks;     /* Milliseconds into the current second */
+	volatile uint32_t tsc_low;      /* TSC when ticks/subticks were written */
+	volatile uint32_t tsc_high;
+	volatile uint32_t tsc_per_usec;
+};
+
+_End_C_Header
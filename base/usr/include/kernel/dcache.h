@@ -0,0 +1,15 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * VFS directory entry cache
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/fs.h>
+
+extern uint32_t dcache_generation(void);
+extern int dcache_lookup(fs_node_t * dir, char * name, fs_node_t ** out);
+extern void dcache_insert(fs_node_t * dir, char * name, fs_node_t * node, uint32_t generation);
+extern void dcache_forget(fs_node_t * dir, char * name);
+extern void dcache_invalidate(fs_node_t * node);
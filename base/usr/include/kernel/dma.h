@@ -0,0 +1,31 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Physically contiguous buffers for device DMA
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/mem.h>
+
+/*
+ * Allocate `size` bytes of zeroed, uncached memory that is contiguous
+ * in physical memory and lies within `zone` (ZONE_ISA, ZONE_DMA32 or
+ * ZONE_NORMAL). Returns the kernel address and stores the physical
+ * one in `phys`, or returns NULL if there is no such run of memory.
+ * The buffer is page-aligned.
+ */
+extern void * dma_alloc(size_t size, int zone, uintptr_t * phys);
+extern void dma_free(void * buffer, size_t size);
+
+/*
+ * Pools of small fixed-size DMA blocks (descriptors, command
+ * packets), carved out of dma_alloc() pages. Blocks are aligned to
+ * `align`, a power of two, and never cross a page boundary.
+ */
+typedef struct dma_pool dma_pool_t;
+
+extern dma_pool_t * dma_pool_create(const char * name, size_t size, size_t align, int zone);
+extern void * dma_pool_alloc(dma_pool_t * pool, uintptr_t * phys);
+extern void dma_pool_free(dma_pool_t * pool, void * block);
+extern void dma_pool_destroy(dma_pool_t * pool);
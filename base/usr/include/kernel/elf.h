@@ -104,6 +104,11 @@ typedef struct {
 #define PT_LOPROC  0x70000000
 #define PT_HIPROC  0x7FFFFFFF
 
+/* p_flags values */
+#define PF_X       0x1 /* Executable */
+#define PF_W       0x2 /* Writable */
+#define PF_R       0x4 /* Readable */
+
 
 /** Section Header */
 typedef struct {
@@ -82,12 +82,30 @@ struct ext2_superblock {
 	/* Other Options */
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
-	uint8_t _unused[760];
+	uint32_t mkfs_time;
+	uint32_t jnl_blocks[17];
+	uint32_t blocks_count_hi;
+	uint32_t r_blocks_count_hi;
+	uint32_t free_blocks_count_hi;
+	uint16_t min_extra_isize;
+	uint16_t want_extra_isize;
+	uint32_t flags;
+	uint8_t _unused[668];
 
 } __attribute__ ((packed));
 
 typedef struct ext2_superblock ext2_superblock_t;
 
+/* Compatible features */
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT2_FEATURE_COMPAT_DIR_INDEX   0x0020
+
+/* Incompatible features */
+#define EXT2_FEATURE_INCOMPAT_RECOVER 0x0004 /* Journal may need replaying */
+
+/* Superblock flags */
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002 /* Directory hashes treat names as unsigned chars */
+
 /* Block group descriptor. */
 struct ext2_bgdescriptor {
 	uint32_t block_bitmap;
@@ -152,6 +170,9 @@ struct ext2_inodetable {
 
 typedef struct ext2_inodetable ext2_inodetable_t;
 
+/* Inode flags */
+#define EXT2_INDEX_FL 0x00001000 /* Directory has a hash index */
+
 /* Represents directory entry on disk. */
 struct ext2_dir {
 	uint32_t inode;
@@ -163,11 +184,125 @@ struct ext2_dir {
 
 typedef struct ext2_dir ext2_dir_t;
 
-typedef struct {
+/*
+ * Hashed directory index (HTree). Block 0 of an indexed directory
+ * holds "." and "..", with ".." covering the rest of the block so
+ * that it still reads as an ordinary directory; the index root
+ * follows them. Interior index blocks start with a single empty
+ * entry spanning the block. Leaf blocks are ordinary directory
+ * blocks holding the names whose hashes fall in their range.
+ */
+#define EXT2_HASH_LEGACY   0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA      2
+#define EXT2_HASH_UNSIGNED 3 /* Added to the above with EXT2_FLAGS_UNSIGNED_HASH */
+
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t  hash_version;
+	uint8_t  info_length;     /* 8 */
+	uint8_t  indirect_levels; /* Interior levels below the root */
+	uint8_t  unused_flags;
+} __attribute__ ((packed));
+
+typedef struct ext2_dx_root_info ext2_dx_root_info_t;
+
+/*
+ * Index entries are sorted by hash. The first entry's hash field
+ * holds the entry count and limit instead and covers the hashes
+ * below the second entry's.
+ */
+struct ext2_dx_entry {
+	uint32_t hash;  /* Lowest bit set: continues a hash from the previous block */
+	uint32_t block; /* Within the directory */
+} __attribute__ ((packed));
+
+typedef struct ext2_dx_entry ext2_dx_entry_t;
+
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__ ((packed));
+
+typedef struct ext2_dx_countlimit ext2_dx_countlimit_t;
+
+/*
+ * Journal (JBD, as used by ext3)
+ *
+ * Everything in the journal is big-endian.
+ */
+#define JBD_MAGIC 0xC03B3998
+
+#define JBD_DESCRIPTOR_BLOCK 1
+#define JBD_COMMIT_BLOCK     2
+#define JBD_SUPERBLOCK_V1    3
+#define JBD_SUPERBLOCK_V2    4
+#define JBD_REVOKE_BLOCK     5
+
+#define JBD_FLAG_ESCAPE    1 /* Block began with the magic number, which was zeroed */
+#define JBD_FLAG_SAME_UUID 2 /* No UUID follows this tag */
+#define JBD_FLAG_DELETED   4
+#define JBD_FLAG_LAST_TAG  8
+
+#define JBD_FEATURE_INCOMPAT_REVOKE 0x1
+
+struct jbd_header {
+	uint32_t magic;
+	uint32_t blocktype;
+	uint32_t sequence;
+} __attribute__ ((packed));
+
+typedef struct jbd_header jbd_header_t;
+
+struct jbd_superblock {
+	jbd_header_t header;
+
+	uint32_t blocksize;
+	uint32_t maxlen;    /* Blocks in the journal */
+	uint32_t first;     /* First block of log information */
+
+	uint32_t sequence;  /* First transaction expected in the log */
+	uint32_t start;     /* First block of the log, or 0 if there is nothing to replay */
+
+	uint32_t error;
+
+	/* Version 2 only */
+	uint32_t feature_compat;
+	uint32_t feature_incompat;
+	uint32_t feature_ro_compat;
+	uint8_t  uuid[16];
+	uint32_t nr_users;
+	uint32_t dynsuper;
+	uint32_t max_transaction;
+	uint32_t max_trans_data;
+} __attribute__ ((packed));
+
+typedef struct jbd_superblock jbd_superblock_t;
+
+/* Descriptor blocks are a header followed by one tag per logged block */
+struct jbd_block_tag {
+	uint32_t blocknr;
+	uint32_t flags;
+} __attribute__ ((packed));
+
+typedef struct jbd_block_tag jbd_block_tag_t;
+
+struct jbd_revoke_header {
+	jbd_header_t header;
+	uint32_t count;     /* Bytes used in the block, including this header */
+} __attribute__ ((packed));
+
+typedef struct jbd_revoke_header jbd_revoke_header_t;
+
+typedef struct ext2_disk_cache_entry {
 	uint32_t block_no;
-	uint32_t last_use;
 	uint8_t  dirty;
+	uint8_t  journal;   /* Logged by the running transaction; not to be written in place yet */
+	uint32_t dirtied;   /* When it became dirty (timer_ticks) */
 	uint8_t *block;
+	struct ext2_disk_cache_entry * hash_next; /* Next entry in the same hash bucket */
+	struct ext2_disk_cache_entry * lru_prev;  /* More recently used neighbor */
+	struct ext2_disk_cache_entry * lru_next;  /* Less recently used neighbor */
 } ext2_disk_cache_entry_t;
 
 typedef int (*ext2_block_io_t) (void *, uint32_t, uint8_t *);
@@ -27,6 +27,8 @@
 #define FS_PIPE        0x10
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
+#define FS_PAGECACHE   0x80 /* Reads are served through the page cache */
+#define FS_DCACHE      0x100 /* Lookups through this node are cached */
 
 #define _IFMT       0170000 /* type of file */
 #define     _IFDIR  0040000 /* directory */
@@ -57,6 +59,8 @@ typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
 typedef int (*chown_type_t) (struct fs_node *, int, int);
 typedef void (*truncate_type_t) (struct fs_node *);
+typedef int (*getdents_type_t) (struct fs_node *, uint32_t * cursor, struct dirent * entries, uint32_t count);
+typedef int (*sync_type_t) (struct fs_node *);
 
 typedef struct fs_node {
 	char name[256];         /* The filename. */
@@ -100,6 +104,12 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 
 	chown_type_t chown;
+	getdents_type_t getdents;
+	sync_type_t sync;       /* Write out anything cached for this node */
+
+	/* Sequential read detection, for readahead */
+	uint64_t ra_next;       /* Where a sequential reader would read next */
+	uint32_t ra_window;     /* Current readahead window, in pages */
 } fs_node_t;
 
 struct dirent {
@@ -142,6 +152,7 @@ uint32_t write_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buff
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 struct dirent *readdir_fs(fs_node_t *node, uint32_t index);
+int getdents_fs(fs_node_t *node, uint32_t * cursor, struct dirent * entries, uint32_t count);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
 int mkdir_fs(char *name, uint16_t permission);
 int create_file_fs(char *name, uint16_t permission);
@@ -157,6 +168,8 @@ int readlink_fs(fs_node_t * node, char * buf, size_t size);
 int selectcheck_fs(fs_node_t * node);
 int selectwait_fs(fs_node_t * node, void * process);
 void truncate_fs(fs_node_t * node);
+int sync_fs(fs_node_t * node);
+void sync_all(void);
 
 void vfs_install(void);
 void * vfs_mount(char * path, fs_node_t * local_root);
@@ -171,4 +184,9 @@ void debug_print_vfs_tree(void);
 void map_vfs_directory(char *);
 
 int make_unix_pipe(fs_node_t ** pipes);
+int unixpipe_is_reader(fs_node_t * node);
+int unixpipe_is_writer(fs_node_t * node);
+int unixpipe_splice_out(fs_node_t * node, fs_node_t * out, uint64_t * out_at, size_t len);
+int unixpipe_splice_in(fs_node_t * in, uint64_t * in_at, fs_node_t * node, size_t len);
+int unixpipe_tee(fs_node_t * node, fs_node_t * out, size_t len);
 
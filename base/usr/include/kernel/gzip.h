@@ -0,0 +1,17 @@
+#pragma once
+
+#include <kernel/system.h>
+
+/*
+ * Is this a gzip stream? Modules and ramdisks from the bootloader,
+ * and modules loaded from files, may be compressed.
+ */
+extern int gzip_check(void * data, size_t length);
+
+/*
+ * Decompress a whole gzip stream into a new buffer from kvmalloc().
+ *
+ * @return The buffer, with its size in `out_length`, or NULL if the
+ *         stream is damaged.
+ */
+extern void * gzip_inflate(void * data, size_t length, size_t * out_length);
@@ -131,9 +131,50 @@ uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header *
 
 struct tcp_socket {
 	list_t* is_connected;
-	uint32_t seq_no;
-	uint32_t ack_no;
+	uint32_t seq_no; /* highest sequence number sent so far (SND.NXT) */
+	uint32_t ack_no; /* next sequence number we expect (RCV.NXT) */
 	int status;
+
+	spin_lock_t lock;
+
+	/* Send side */
+	uint32_t snd_una;    /* oldest unacknowledged sequence number */
+	uint32_t write_seq;  /* end of the data queued by writers */
+	uint32_t snd_wnd;    /* peer's advertised window, in bytes */
+	uint32_t snd_mss;
+	uint8_t  snd_wscale;
+	uint8_t  rcv_wscale;
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	uint32_t flight;     /* bytes transmitted and not yet acknowledged */
+	uint32_t recover;    /* SND.NXT when fast recovery was entered */
+	int      in_recovery;
+	int      dup_acks;
+	list_t * send_queue; /* struct tcp_segment, in sequence order */
+	list_t * send_wait;  /* writers waiting for send_queue to drain */
+
+	/* Retransmission timer, all in milliseconds */
+	unsigned long rto;
+	unsigned long rto_expires; /* 0 when not armed */
+	unsigned long srtt;
+	unsigned long rttvar;
+	unsigned long rtt_start;   /* 0 when no sample is being timed */
+	uint32_t rtt_seq;
+
+	/* Receive side */
+	uint32_t rcv_queued;   /* payload bytes waiting for a reader */
+	uint32_t rcv_wnd_sent; /* window in our last outgoing segment */
+	list_t * out_of_order; /* tcpdata_t past ack_no, in sequence order */
+};
+
+struct tcp_segment {
+	uint32_t seq;
+	uint32_t end;   /* seq plus the sequence space this segment uses */
+	uint16_t flags;
+	uint16_t sent;
+	size_t   length;
+	uint8_t * data; /* unacknowledged part of payload */
+	uint8_t  payload[];
 };
 
 // Note: for now, not sure what to put in here, so removing from the union to get rid of compiler warnings about empty struct
@@ -184,5 +225,7 @@ struct sockaddr_in {
 typedef struct {
 	uint8_t	*payload;
 	size_t	payload_size;
+	void	*packet; /* receive buffer the payload points into */
+	uint32_t seq;
 } tcpdata_t;
 
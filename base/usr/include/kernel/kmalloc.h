@@ -0,0 +1,34 @@
+#pragma once
+
+#include <kernel/system.h>
+
+#define KMALLOC_BINS        10 /* Small bins, with cells of 4 to 2048 bytes */
+#define KMALLOC_BIG_CLASSES 12 /* Big blocks, by powers of two of their pages */
+#define KMALLOC_SKIP_LEVELS 7  /* Levels of the big-block skip list */
+
+/* The shape of the kernel heap right now, from kmalloc_heap_stats() */
+struct kmalloc_heap_stats {
+	uint32_t bin_pages[KMALLOC_BINS];   /* Pages ever given to each small bin */
+	uint32_t bin_used[KMALLOC_BINS];    /* Cells handed out */
+	uint32_t bin_cells[KMALLOC_BINS];   /* Cells in a page */
+	uint32_t big_free[KMALLOC_BIG_CLASSES];  /* Blocks waiting in the skip list */
+	uint32_t big_used[KMALLOC_BIG_CLASSES];
+	uint32_t big_free_pages;
+	uint32_t big_used_pages;
+	uint32_t skip_level[KMALLOC_SKIP_LEVELS]; /* Free blocks linked at each level */
+};
+
+extern void kmalloc_heap_stats(struct kmalloc_heap_stats * out);
+
+/*
+ * Allocation profiler, called by the allocator with its lock held.
+ * sampling is set while new allocations are being sampled; tracked
+ * counts sampled allocations that haven't been freed yet.
+ */
+extern volatile int kmalloc_profile_sampling;
+extern volatile uint32_t kmalloc_profile_tracked;
+extern void kmalloc_profile_alloc(void * ptr, uintptr_t size, unsigned int bin, uintptr_t caller);
+extern void kmalloc_profile_free(void * ptr);
+
+extern uint32_t kmalloc_profile_read(uint64_t offset, uint32_t size, uint8_t * buffer);
+extern uint32_t kmalloc_profile_write(uint64_t offset, uint32_t size, uint8_t * buffer);
@@ -0,0 +1,25 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Kernel mappings of arbitrary frames
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/mem.h>
+
+/*
+ * Map `frame` (a frame index) into the kernel's kmap window and
+ * return its address, which every directory can use. Each kmap()
+ * must be paired with a kunmap() of the address; the mapping itself
+ * is kept around afterwards, so mapping the same frame again soon
+ * is nearly free.
+ */
+extern void * kmap(uint32_t frame);
+extern void kunmap(void * address);
+
+/*
+ * Forget any idle mapping of `frame`, for when it is about to be
+ * freed and could end up mapped with other attributes.
+ */
+extern void kmap_drop(uint32_t frame);
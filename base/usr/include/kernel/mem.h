@@ -11,6 +11,27 @@ extern void set_frame(uintptr_t frame_addr);
 extern void clear_frame(uintptr_t frame_addr);
 extern uint32_t test_frame(uintptr_t frame_addr);
 extern uint32_t first_frame(void);
+extern uint32_t zero_frame;
+
+/* Physical memory zones, for devices that can't reach all of memory */
+enum {
+	ZONE_ISA = 0, /* Below 16MiB, for ISA DMA */
+	ZONE_DMA32,   /* Below 4GiB, which on i686 is all of it */
+	ZONE_NORMAL,
+};
+
+#define ZONE_ISA_FRAMES 0x1000
+
+extern uint32_t alloc_frame_run(uint32_t n, int zone);
+extern void free_frame_run(uint32_t index, uint32_t n);
+
+/* Kernel virtual addresses for kmap(), after the heap */
+#define KMAP_WINDOW_START 0x1EC00000
+#define KMAP_WINDOW_END   0x1F000000
+
+/* Kernel virtual addresses set aside for DMA buffers, after that */
+#define DMA_WINDOW_START 0x1F000000
+#define DMA_WINDOW_END   0x20000000
 
 extern uintptr_t map_to_physical(uintptr_t virtual);
 
@@ -0,0 +1,41 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Demand-filled user memory regions
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/fs.h>
+
+#define MMAP_WRITE  0x1 /* Pages are mapped writable */
+#define MMAP_SHARED 0x2 /* Changes are written back to the file */
+
+/* mmap() places mappings top-down from here, below the user stack */
+#define MMAP_TOP    (USER_STACK_BOTTOM - 0x100000)
+
+/*
+ * A region of a user address space whose pages are
+ * filled in on first touch by the page fault handler.
+ *
+ * Bytes in [data_start, data_end) come from `file`, with
+ * data_start corresponding to `offset`; everything else
+ * in [start, end) is zero-filled.
+ */
+typedef struct mmap_region {
+	uintptr_t   start;      /* Page-aligned first address */
+	uintptr_t   end;        /* Page-aligned end (exclusive) */
+	uintptr_t   data_start; /* First address backed by the file */
+	uintptr_t   data_end;   /* End of file-backed data */
+	uint64_t    offset;     /* File offset of data_start */
+	fs_node_t * file;       /* Backing file (or NULL) */
+	int         flags;
+} mmap_region_t;
+
+extern mmap_region_t * mmap_add_region(page_directory_t * dir, uintptr_t start, uintptr_t end, fs_node_t * file, uint64_t offset, uintptr_t data_start, uintptr_t data_end, int flags);
+extern int mmap_fault(uintptr_t address);
+extern void mmap_clone(page_directory_t * src, page_directory_t * dest);
+extern void mmap_release(page_directory_t * dir);
+extern int mmap_is_shared(page_directory_t * dir, uintptr_t address);
+extern uintptr_t mmap_map(uintptr_t addr, size_t len, int prot, int flags, fs_node_t * file, uint64_t offset);
+extern int mmap_unmap(page_directory_t * dir, uintptr_t addr, size_t len);
@@ -1,6 +1,9 @@
 #ifndef KERNEL_MOD_NET_H
 #define KERNEL_MOD_NET_H
 
+/* Receive buffers handed from drivers to net_handler */
+#define NET_PACKET_SIZE 2048
+
 typedef uint8_t* (*get_mac_func)(void);
 typedef struct ethernet_packet* (*get_packet_func)(void);
 typedef void (*send_packet_func)(uint8_t*, size_t);
@@ -18,12 +21,18 @@ struct netif {
 	char * driver;
 
 	uint32_t gateway;
+	uint32_t netmask; /* 0 until DHCP tells us; then on-link hosts skip the gateway */
+
+	int worker; /* pid of the tasklet receiving on this interface */
 };
 
 extern void init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_packet_func send_func, char * device);
 extern void net_handler(void * data, char * name);
 extern size_t write_dhcp_packet(uint8_t * buffer);
 
+extern void * net_packet_alloc(void);
+extern void net_packet_free(void * packet);
+
 extern struct socket* net_open(uint32_t type);
 extern int net_send(struct socket* socket, uint8_t* payload, size_t payload_size, int flags);
 extern size_t net_recv(struct socket* socket, uint8_t* buffer, size_t len);
@@ -28,6 +28,15 @@ typedef struct snd_device {
 	int (*mixer_read)(uint32_t knob_id, uint32_t *val);
 	int (*mixer_write)(uint32_t knob_id, uint32_t val);
 
+	/*
+	 * Optional. Reprogram the device to play from `*periods` buffers of
+	 * `*size` bytes, rounding both to what it supports and storing what
+	 * it chose. Zeroes just read the current setting.
+	 */
+	int (*set_periods)(uint32_t * periods, uint32_t * size);
+	/* Optional. Sample frames handed to the device and not yet played. */
+	uint32_t (*queued)(void);
+
 	uint32_t id;
 } snd_device_t;
 
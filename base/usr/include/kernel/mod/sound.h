@@ -34,3 +34,44 @@ typedef struct snd_knob_value {
 #define SND_MIXER_READ_KNOB 2
 #define SND_MIXER_WRITE_KNOB 3
 
+/* /dev/dsp IOCTLs */
+#define SND_DSP_SET_REALTIME 4 /* Drop what doesn't fit instead of blocking */
+#define SND_DSP_GET_SAMPLES  5 /* Samples played so far */
+#define SND_DSP_SET_VOLUME   6 /* uint32_t *, 16.16 fixed point; 0x10000 plays as written */
+#define SND_DSP_GET_VOLUME   7
+#define SND_DSP_SET_PERIODS  8 /* snd_dsp_periods_t *; the device's actual setting is written back */
+#define SND_DSP_GET_POSITION 9 /* snd_dsp_position_t * */
+#define SND_DSP_SET_FORMAT  10 /* snd_dsp_format_t *; the resulting format is written back */
+
+#define SND_DSP_VOLUME_UNITY 0x10000
+#define SND_DSP_VOLUME_MAX   0x40000
+
+/*
+ * The device plays from a ring of `count` periods of `size` bytes,
+ * and is refilled a period at a time, so what is written reaches the
+ * speaker after roughly (count - 1) * size bytes' worth of playback.
+ * Passing zeroes just reads the current setting. Periods are shared
+ * by every stream on the device.
+ */
+typedef struct snd_dsp_periods {
+	uint32_t count; /* IN/OUT */
+	uint32_t size;  /* IN/OUT, bytes */
+} snd_dsp_periods_t;
+
+/*
+ * What a stream writes, converted to 48KHz signed 16-bit stereo by the
+ * kernel. Rates run from 8000 to 48000; samples are 8 (unsigned), 16 or
+ * 32 bits (signed, little endian), mono or interleaved stereo. Zeroes
+ * leave a field as it was; new streams start at 48000/2/16.
+ */
+typedef struct snd_dsp_format {
+	uint32_t rate;     /* IN/OUT, Hz */
+	uint32_t channels; /* IN/OUT */
+	uint32_t bits;     /* IN/OUT */
+} snd_dsp_format_t;
+
+typedef struct snd_dsp_position {
+	uint32_t played; /* OUT: sample frames of this stream that have been played */
+	uint32_t queued; /* OUT: sample frames written but not played yet */
+} snd_dsp_position_t;
+
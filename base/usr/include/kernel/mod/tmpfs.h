@@ -1,6 +1,7 @@
 #ifndef _TMPFS_H__
 #define _TMPFS_H__
 #include <kernel/fs.h>
+#include <toaru/hashmap.h>
 
 fs_node_t * tmpfs_create(char * name);
 
@@ -32,6 +33,7 @@ struct tmpfs_dir {
 	unsigned int mtime;
 	unsigned int ctime;
 	list_t * files;
+	hashmap_t * index; /* Names to their nodes in files */
 	struct tmpfs_dir * parent;
 };
 
@@ -0,0 +1,144 @@
+#ifndef KERNEL_MOD_USB_H
+#define KERNEL_MOD_USB_H
+
+#include <kernel/system.h>
+
+/* Standard requests */
+#define USB_REQ_GET_STATUS        0x00
+#define USB_REQ_CLEAR_FEATURE     0x01
+#define USB_REQ_SET_ADDRESS       0x05
+#define USB_REQ_GET_DESCRIPTOR    0x06
+#define USB_REQ_SET_CONFIGURATION 0x09
+
+/* bmRequestType */
+#define USB_DIR_IN         0x80
+#define USB_TYPE_CLASS     0x20
+#define USB_RECIP_DEVICE   0x00
+#define USB_RECIP_INTERFACE 0x01
+#define USB_RECIP_ENDPOINT 0x02
+
+#define USB_DESC_DEVICE    1
+#define USB_DESC_CONFIG    2
+#define USB_DESC_INTERFACE 4
+#define USB_DESC_ENDPOINT  5
+
+#define USB_FEATURE_ENDPOINT_HALT 0
+
+#define USB_ENDPOINT_BULK      2
+#define USB_ENDPOINT_INTERRUPT 3
+
+struct usb_setup {
+	uint8_t  type;
+	uint8_t  request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+} __attribute__((packed));
+
+struct usb_device_desc {
+	uint8_t  length;
+	uint8_t  type;
+	uint16_t usb_version;
+	uint8_t  class;
+	uint8_t  subclass;
+	uint8_t  protocol;
+	uint8_t  max_packet0;
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t release;
+	uint8_t  manufacturer_str;
+	uint8_t  product_str;
+	uint8_t  serial_str;
+	uint8_t  num_configs;
+} __attribute__((packed));
+
+struct usb_config_desc {
+	uint8_t  length;
+	uint8_t  type;
+	uint16_t total_length;
+	uint8_t  num_interfaces;
+	uint8_t  value;
+	uint8_t  name_str;
+	uint8_t  attributes;
+	uint8_t  max_power;
+} __attribute__((packed));
+
+struct usb_interface_desc {
+	uint8_t  length;
+	uint8_t  type;
+	uint8_t  number;
+	uint8_t  alternate;
+	uint8_t  num_endpoints;
+	uint8_t  class;
+	uint8_t  subclass;
+	uint8_t  protocol;
+	uint8_t  name_str;
+} __attribute__((packed));
+
+struct usb_endpoint_desc {
+	uint8_t  length;
+	uint8_t  type;
+	uint8_t  address;    /* USB_DIR_IN for IN endpoints */
+	uint8_t  attributes; /* USB_ENDPOINT_* in the low two bits */
+	uint16_t max_packet;
+	uint8_t  interval;
+} __attribute__((packed));
+
+/* An endpoint as the host controller needs to know it */
+typedef struct usb_endpoint {
+	uint8_t address;
+	uint16_t max_packet;
+	int toggle;  /* Next DATA0/DATA1 */
+} usb_endpoint_t;
+
+typedef struct usb_device {
+	void * hc;          /* Controller it hangs off */
+	int port;           /* Root hub port */
+	uint8_t address;
+	int low_speed;
+	uint16_t max_packet0;
+
+	struct usb_device_desc desc;
+	uint8_t * config;   /* The whole configuration descriptor */
+	size_t config_length;
+
+	volatile int gone;  /* Unplugged; every transfer fails */
+	struct usb_driver * driver; /* Class driver that took the device */
+	void * driver_data;
+} usb_device_t;
+
+typedef struct usb_driver {
+	char * name;
+	/* Return 0 to take the device */
+	int (*probe)(usb_device_t * dev);
+} usb_driver_t;
+
+/*
+ * Class drivers are offered every device that has been enumerated
+ * and every one enumerated after.
+ */
+extern void usb_register_driver(usb_driver_t * driver);
+
+/*
+ * Transfers block until done. They return 0 on success, USB_STALL if
+ * the endpoint stalled, and USB_ERROR on other failures. `actual`,
+ * if not NULL, gets the number of bytes transferred, which for IN
+ * transfers may be short. `data` may be any kernel or user buffer.
+ */
+#define USB_STALL -2
+#define USB_ERROR -1
+
+extern int usb_control(usb_device_t * dev, struct usb_setup * setup, void * data, size_t * actual);
+extern int usb_bulk(usb_device_t * dev, usb_endpoint_t * ep, void * data, size_t length, size_t * actual);
+extern int usb_interrupt(usb_device_t * dev, usb_endpoint_t * ep, void * data, size_t length, size_t * actual);
+
+/* Clear a stall on an endpoint and reset its toggle */
+extern int usb_clear_halt(usb_device_t * dev, usb_endpoint_t * ep);
+
+/*
+ * Walk the configuration descriptor: returns the next descriptor of
+ * type `type` after `after` (NULL to start at the beginning), or NULL.
+ */
+extern void * usb_find_descriptor(usb_device_t * dev, void * after, uint8_t type);
+
+#endif /* KERNEL_MOD_USB_H */
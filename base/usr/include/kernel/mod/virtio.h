@@ -0,0 +1,140 @@
+#ifndef KERNEL_MOD_VIRTIO_H
+#define KERNEL_MOD_VIRTIO_H
+
+#include <kernel/system.h>
+
+/* Legacy (I/O port) virtio-pci register offsets */
+#define VIRTIO_PCI_HOST_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN      0x08
+#define VIRTIO_PCI_QUEUE_SIZE     0x0C
+#define VIRTIO_PCI_QUEUE_SELECT   0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10
+#define VIRTIO_PCI_STATUS         0x12
+#define VIRTIO_PCI_ISR            0x13
+#define VIRTIO_PCI_CONFIG         0x14 /* Device-specific configuration, without MSI-X */
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_ISR_QUEUE  0x01
+#define VIRTIO_ISR_CONFIG 0x02
+
+/* Feature bits shared by every device type */
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX     (1 << 29)
+
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2 /* Device writes into this buffer */
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTQ_USED_F_NO_NOTIFY     1
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+/* Most buffers in one request; requests of more than one go in an indirect table */
+#define VIRTQ_INDIRECT_MAX 64
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__((packed));
+
+struct virtq_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[]; /* Followed by used_event */
+} __attribute__((packed));
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct virtq_used_elem ring[]; /* Followed by avail_event */
+} __attribute__((packed));
+
+typedef struct virtio_device {
+	uint32_t pci;
+	uint16_t io_base;
+	int irq;
+	uint32_t features; /* What both we and the device agreed to */
+} virtio_device_t;
+
+typedef struct virtq {
+	virtio_device_t * dev;
+	uint16_t index;
+	uint16_t size;
+
+	volatile struct virtq_desc * desc;
+	volatile struct virtq_avail * avail;
+	volatile struct virtq_used * used;
+
+	uint16_t free_head;  /* First unused descriptor, chained through `next` */
+	uint16_t num_free;
+	uint16_t avail_idx;  /* Our copy of avail->idx */
+	uint16_t kicked_idx; /* avail->idx when the device was last notified */
+	uint16_t last_used;  /* Next used entry to take back */
+	int interrupts;      /* Whether we want to hear about finished requests */
+
+	void ** tokens;                     /* Per head descriptor */
+	struct virtq_desc ** indirect;      /* Indirect table per head descriptor, or NULL */
+} virtq_t;
+
+/* One buffer of a request, by physical address */
+typedef struct virtq_buf {
+	uintptr_t phys;
+	uint32_t len;
+} virtq_buf_t;
+
+/*
+ * Reset the device, enable bus mastering and agree on features:
+ * the device gets whichever of `wanted` it offers, plus the ring
+ * features this library supports. Returns 0 on success.
+ */
+extern int virtio_init(virtio_device_t * dev, uint32_t pci, uint32_t wanted);
+
+/* Set up queue `index`; returns NULL if the device doesn't have it. */
+extern virtq_t * virtq_create(virtio_device_t * dev, uint16_t index);
+
+/* Tell the device the driver is ready; queues must be set up before. */
+extern void virtio_driver_ok(virtio_device_t * dev);
+
+/* Read (and clear) the interrupt status; VIRTIO_ISR_* bits. */
+extern uint8_t virtio_isr(virtio_device_t * dev);
+
+extern uint8_t  virtio_config_read8(virtio_device_t * dev, uint16_t offset);
+extern uint32_t virtio_config_read32(virtio_device_t * dev, uint16_t offset);
+
+/*
+ * Queue a request of `out` buffers for the device to read followed by
+ * `in` buffers for it to write. `token` is handed back by virtq_get()
+ * once the device is done. Returns -1 if the ring is full. Requests
+ * may only be added with interrupts off; they are only seen by the
+ * device after a virtq_kick().
+ */
+extern int virtq_add(virtq_t * vq, virtq_buf_t * bufs, int out, int in, void * token);
+
+/* Notify the device of new requests, unless it said it doesn't need to be. */
+extern void virtq_kick(virtq_t * vq);
+
+/*
+ * Take back the next finished request, or return NULL if there is
+ * none. `len` is set to how much the device wrote. Call with interrupts off.
+ */
+extern void * virtq_get(virtq_t * vq, uint32_t * len);
+
+/*
+ * Ask the device to stop (or start again) interrupting for this queue.
+ * Only a hint: an interrupt may still come. Call with interrupts off,
+ * and check for finished requests after turning them back on.
+ */
+extern void virtq_set_interrupts(virtq_t * vq, int enable);
+
+#endif /* KERNEL_MOD_VIRTIO_H */
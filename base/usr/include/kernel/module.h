@@ -4,10 +4,19 @@
 
 #include <toaru/hashmap.h>
 
+/*
+ * Bump this whenever module_defs or anything else modules rely on
+ * changes in a way that needs them rebuilt; the loader refuses
+ * modules built against a different one.
+ */
+#define MODULE_ABI 1
+
 typedef struct {
     char * name;
     int (* initialize)(void);
     int (* finalize)(void);
+    int abi;
+    int deferred; /* Initialize after init has started */
 } module_defs;
 
 typedef struct {
@@ -18,6 +27,7 @@ typedef struct {
     size_t deps_length;
     char * deps;
     uintptr_t text_addr;
+    int deferred; /* Still waiting to be initialized */
 } module_data_t;
 
 void (* symbol_find(const char * name))(void);
@@ -27,17 +37,33 @@ extern void * module_load_direct(void * blob, size_t size);
 extern void * module_load(char * filename);
 extern void module_unload(char * name);
 extern void modules_install(void);
+extern void modules_start_deferred(void);
 
 #define MODULE_DEF(n,init,fini) \
         module_defs module_info_ ## n = { \
             .name       = #n, \
             .initialize = &init, \
-            .finalize   = &fini \
+            .finalize   = &fini, \
+            .abi        = MODULE_ABI \
+        }
+
+/* For drivers nothing needs during boot, like sound */
+#define MODULE_DEF_DEFERRED(n,init,fini) \
+        module_defs module_info_ ## n = { \
+            .name       = #n, \
+            .initialize = &init, \
+            .finalize   = &fini, \
+            .abi        = MODULE_ABI, \
+            .deferred   = 1 \
         }
 
 extern hashmap_t * modules_get_list(void);
 extern hashmap_t * modules_get_symbols(void);
 
+/* Closest symbol at or below an address, by binary search of a sorted index */
+extern char * modules_symbol_for(uintptr_t addr, uintptr_t * out_addr);
+extern size_t modules_symbol_longest(void);
+
 #define MODULE_DEPENDS(n) \
     static char _mod_dependency_ ## n [] __attribute__((section("moddeps"), used)) = #n
 
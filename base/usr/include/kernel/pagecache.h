@@ -0,0 +1,15 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * VFS page cache
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/fs.h>
+
+#define PAGECACHE_PAGE_SIZE 0x1000
+
+extern uint32_t pagecache_read(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer);
+extern void pagecache_update(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer);
+extern void pagecache_invalidate(fs_node_t * node);
@@ -63,6 +63,9 @@ void pci_scan_hit(pci_func_t f, uint32_t dev, void * extra);
 void pci_scan_func(pci_func_t f, int type, int bus, int slot, int func, void * extra);
 void pci_scan_slot(pci_func_t f, int type, int bus, int slot, void * extra);
 void pci_scan_bus(pci_func_t f, int type, int bus, void * extra);
+void pci_scan_hardware(pci_func_t f, int type, void * extra);
 void pci_scan(pci_func_t f, int type, void * extra);
+void pci_scan_vendor(pci_func_t f, uint16_t vendor_id, void * extra);
 void pci_remap(void);
+void pci_install(void);
 int pci_get_interrupt(uint32_t device);
@@ -5,11 +5,15 @@
 
 #include <kernel/signal.h>
 #include <kernel/task.h>
+#include <kernel/bitset.h>
 
 #include <toaru/tree.h>
 
 #define KERNEL_STACK_SIZE 0x8000
 
+/* Number of ready queues in the scheduler */
+#define SCHED_LEVELS 8
+
 typedef signed int    pid_t;
 typedef unsigned int  user_t;
 typedef unsigned int  status_t;
@@ -29,8 +33,9 @@ typedef struct thread {
 	uintptr_t  ebp; /* Base Pointer */
 	uintptr_t  eip; /* Instruction Pointer */
 
-	uint8_t    fpu_enabled;
-	uint8_t    fp_regs[512];
+	uint8_t    fpu_counter; /* Consecutive quanta that used the FPU (see fpu.c) */
+	uint8_t *  fpu_state;   /* FXSAVE/XSAVE area, once the FPU has been used */
+	void *     fpu_alloc;   /* Allocation fpu_state is aligned within */
 
 	uint8_t    padding[32]; /* I don't know */
 
@@ -50,12 +55,23 @@ typedef struct image {
 	volatile int lock[2];
 } image_t;
 
+/*
+ * An open file description: what open() returns a descriptor to.
+ * dup() and fork() share it, offset and all, rather than copying it.
+ */
+typedef struct open_file {
+	fs_node_t * node;
+	uint64_t    offset;
+	int         mode;
+	int         refs;
+} open_file_t;
+
 /* Resizable descriptor table */
 typedef struct descriptor_table {
-	fs_node_t ** entries;
-	uint64_t  *  offsets;
-	int       *  modes;
-	size_t       length;
+	open_file_t ** entries;
+	bitset_t     used;        /* Which slots are taken */
+	size_t       lowest_free; /* No free slot below this one */
+	size_t       length;      /* One past the highest slot in use (or once used) */
 	size_t       capacity;
 	size_t       refs;
 } fd_table_t;
@@ -69,6 +85,19 @@ typedef struct signal_table {
 } sig_table_t;
 
 /* Portable process struct */
+/* Resource accounting, shown in /proc/<pid>/stat */
+typedef struct {
+	unsigned long user_time;            /* Subticks spent in user mode */
+	unsigned long system_time;          /* Subticks spent in the kernel */
+	unsigned long voluntary_switches;   /* Gave up the processor: blocked, slept or yielded */
+	unsigned long involuntary_switches; /* Preempted by the timer */
+	unsigned long page_faults;
+	unsigned long syscalls;
+	uint32_t *    syscall_counts;       /* Calls by number, allocated on the first */
+	uint64_t      bytes_read;           /* Through read() */
+	uint64_t      bytes_written;        /* Through write() */
+} usage_t;
+
 typedef struct process {
 	pid_t         id;                /* Process ID (pid) */
 	char *        name;              /* Process Name */
@@ -98,6 +127,7 @@ typedef struct process {
 	list_t *      wait_queue;
 	list_t *      shm_mappings;      /* Shared memory chunk mappings */
 	list_t *      signal_queue;      /* Queued signals */
+	list_t *      signalfds;         /* Signal descriptors taking some of them instead */
 	thread_t      signal_state;
 	char *        signal_kstack;
 	node_t        sched_node;
@@ -110,11 +140,19 @@ typedef struct process {
 	node_t *      timeout_node;
 	struct timeval start;
 	uint8_t       suspended;
+	int           nice;              /* Scheduling niceness, -20 (favored) to 19 */
+	uint8_t       sched_level;       /* Ready queue this process is scheduled from */
+	uint8_t       sched_ticks;       /* Ticks used of the current time slice */
+	uint8_t       sched_preempted;   /* Being switched out by the timer, not yielding */
+	usage_t       usage;             /* Resource accounting */
+	list_t *      vfork_wait;        /* Parent sleeping until we exec or exit, if vforked */
+	list_t        zombies;           /* Finished children waiting to be reaped */
+	node_t        zombie_node;       /* In our parent's zombies, once we've finished */
 } process_t;
 
 typedef struct {
-	unsigned long end_tick;
-	unsigned long end_subtick;
+	node_t node;           /* In the timer wheel */
+	unsigned long expires; /* Wake time, in subticks since boot */
 	process_t * process;
 	int is_fswait;
 } sleeper_t;
@@ -128,15 +166,20 @@ extern void set_process_environment(process_t * proc, page_directory_t * directo
 extern void make_process_ready(process_t * proc);
 extern uint8_t process_available(void);
 extern process_t * next_ready_process(void);
+extern int process_tick(void);
+extern void process_set_nice(process_t * proc, int nice);
 extern uint32_t process_append_fd(process_t * proc, fs_node_t * node);
 extern process_t * process_from_pid(pid_t pid);
 extern void delete_process(process_t * proc);
 process_t * process_get_parent(process_t * process);
 extern uint32_t process_move_fd(process_t * proc, int src, int dest);
+extern void process_close_fd(process_t * proc, int fd);
 extern int process_is_ready(process_t * proc);
+extern void vfork_release(process_t * proc);
 
 extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
+extern int next_sleeper(unsigned long * seconds, unsigned long * subseconds);
 
 extern volatile process_t * current_process;
 extern process_t * kernel_idle_task;
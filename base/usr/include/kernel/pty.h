@@ -37,6 +37,9 @@ typedef struct pty {
 
 	void (*fill_name)(struct pty *, char *);
 
+	/* Called after the termios settings change, for line hardware that cares */
+	void (*tios_changed)(struct pty *);
+
 } pty_t;
 
 void tty_output_process_slave(pty_t * pty, uint8_t c);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <kernel/system.h>
+
+/* Seed the generator; called once, early in boot. */
+extern void random_install(void);
+
+/*
+ * Stir something unpredictable into the entropy pool. Cheap enough
+ * for interrupt handlers; nothing is credited or counted exactly.
+ */
+extern void random_add_entropy(uint32_t value);
+
+/* Timing of an interrupt, from the IRQ dispatcher */
+extern void random_add_interrupt(int irq);
+
+/* Fill `buffer` with `size` bytes from the CSPRNG. Never blocks. */
+extern void random_get_bytes(void * buffer, size_t size);
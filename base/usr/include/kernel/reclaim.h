@@ -0,0 +1,26 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Giving cached memory back when frames run out
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+
+/*
+ * Free up to `wanted` pages' worth of cached data and return how many
+ * were released. Called from inside the frame allocator, so a shrinker
+ * must not wait for a lock: if its lock is taken (possibly by the very
+ * code that is allocating), it should give up and return 0.
+ */
+typedef size_t (*reclaim_func_t)(size_t wanted);
+
+/*
+ * Expensive shrinkers, ones that have to write their pages somewhere
+ * first, are only asked after all the others.
+ */
+extern void reclaim_register(const char * name, reclaim_func_t func, int expensive);
+extern size_t reclaim(size_t wanted);
+
+extern uint32_t reclaim_runs;
+extern uint32_t reclaim_pages;
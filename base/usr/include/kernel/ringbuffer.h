@@ -19,6 +19,30 @@ size_t ring_buffer_available(ring_buffer_t * ring_buffer);
 size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer);
 size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer);
 
+/*
+ * Producer-side zero copy: ring_buffer_reserve() gives the contiguous
+ * free space at the write position (possibly less than is free in all,
+ * if it wraps), which the producer fills directly and then hands over
+ * with ring_buffer_commit(). Neither blocks. Only one producer may
+ * have space reserved at a time, and must not commit more than it got.
+ */
+size_t ring_buffer_reserve(ring_buffer_t * ring_buffer, uint8_t ** span);
+void ring_buffer_commit(ring_buffer_t * ring_buffer, size_t size);
+
+/*
+ * Consumer-side zero copy, the other way round: ring_buffer_peek()
+ * gives the contiguous unread data starting `skip` bytes past the read
+ * position, and ring_buffer_consume() releases it once it has been
+ * used. Peeking without consuming leaves the data for the next reader.
+ * Again, neither blocks, and only one consumer may be using a span.
+ */
+size_t ring_buffer_peek(ring_buffer_t * ring_buffer, size_t skip, uint8_t ** span);
+void ring_buffer_consume(ring_buffer_t * ring_buffer, size_t size);
+
+/* Sleep until there is something to read, or room to write; 0 if interrupted */
+int ring_buffer_wait_unread(ring_buffer_t * ring_buffer);
+int ring_buffer_wait_available(ring_buffer_t * ring_buffer);
+
 ring_buffer_t * ring_buffer_create(size_t size);
 void ring_buffer_destroy(ring_buffer_t * ring_buffer);
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer);
@@ -5,8 +5,6 @@
 #include <kernel/system.h>
 #include <kernel/types.h>
 
-#define SHM_PATH_SEPARATOR "."
-
 /* Types */
 struct shm_node;
 
@@ -20,7 +18,7 @@ typedef struct {
 } shm_chunk_t;
 
 typedef struct shm_node {
-	char name[256];
+	char * name;
 	shm_chunk_t * chunk;
 } shm_node_t;
 
@@ -39,4 +37,5 @@ extern int    shm_release(char * path);
 /* Other exposed functions */
 extern void shm_install(void);
 extern void shm_release_all(process_t * proc);
+extern int shm_fault(uintptr_t address);
 
@@ -0,0 +1,20 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Slab caches for fixed-size kernel objects
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+
+typedef struct slab_cache slab_cache_t;
+
+/* Called on each object when its slab is first set up */
+typedef void (*slab_ctor_t)(void * object);
+
+extern slab_cache_t * slab_create(const char * name, size_t size, slab_ctor_t ctor);
+extern void * slab_alloc(slab_cache_t * cache);
+extern void slab_free(slab_cache_t * cache, void * object);
+
+/* Used by free() so slab objects can be released like any other allocation */
+extern slab_cache_t * slab_owner(void * object);
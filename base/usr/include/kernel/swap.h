@@ -0,0 +1,27 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Paging anonymous user memory out to disk
+ */
+
+#pragma once
+
+#include <kernel/system.h>
+
+/*
+ * Start swapping to `path`, a partition or a file. A file must
+ * already be as large as it is meant to be: nothing is allocated
+ * on the filesystem while pages are going out.
+ */
+extern int swap_on(char * path);
+
+/*
+ * A page table entry with `swapped` set is not present, and its
+ * frame field is the swap slot holding its contents.
+ */
+extern int swap_fault(uintptr_t address);
+extern int swap_in(page_t * page);
+extern int swap_dup(uint32_t slot);
+extern void swap_release(uint32_t slot);
+
+extern uint32_t swap_slots;
+extern uint32_t swap_used;
@@ -48,6 +48,25 @@ typedef volatile int spin_lock_t[2];
 extern void spin_init(spin_lock_t lock);
 extern void spin_lock(spin_lock_t lock);
 extern void spin_unlock(spin_lock_t lock);
+extern int spin_trylock(spin_lock_t lock);
+extern volatile int spin_contended;
+
+typedef struct kmutex {
+	process_t * owner;
+	list_t * waiters;
+	char * name;
+	uint32_t acquired;      /* Times taken */
+	uint32_t contended;     /* Times the taker had to wait */
+	int registered;
+	struct kmutex * next;   /* In kmutex_all */
+} kmutex_t;
+
+#define KMUTEX_INIT(n) { .name = (n) }
+
+extern kmutex_t * kmutex_all;
+extern void kmutex_init(kmutex_t * mutex, char * name);
+extern void kmutex_lock(kmutex_t * mutex);
+extern void kmutex_unlock(kmutex_t * mutex);
 
 extern void return_to_userspace(void);
 
@@ -80,6 +99,19 @@ extern void set_kernel_stack(uintptr_t stack);
 extern void idt_install(void);
 extern void idt_set_gate(uint8_t num, void (*base)(void), uint16_t sel, uint8_t flags);
 
+/* ACPI */
+#define MAX_PROCESSORS 32
+#define MAX_IOAPICS    8
+extern void acpi_install(void);
+extern int processor_count;
+extern uint8_t processor_apic_ids[MAX_PROCESSORS];
+extern int ioapic_count;
+extern uintptr_t ioapic_addresses[MAX_IOAPICS];
+extern uintptr_t lapic_address;
+extern uintptr_t pci_ecam_address; /* 0 if configuration space is only reachable through ports */
+extern uint8_t pci_ecam_start_bus;
+extern uint8_t pci_ecam_end_bus;
+
 /* Registers
  *
  * Note: if the order of these changes, sys/task.S must be changed to use
@@ -117,11 +149,14 @@ extern void irq_gates(void);
 extern void irq_ack(size_t);
 
 /* Timer */
+#define SUBTICKS_PER_TICK 1000
 extern void timer_install(void);
 extern unsigned long timer_ticks;
 extern unsigned long timer_subticks;
 extern signed long timer_drift;
 extern void relative_time(unsigned long seconds, unsigned long subseconds, unsigned long * out_seconds, unsigned long * out_subseconds);
+extern void timer_idle(void);
+extern void timer_wake(void);
 
 /* Memory Management */
 extern uintptr_t placement_pointer;
@@ -144,17 +179,30 @@ extern void paging_mark_system(uint64_t addr);
 extern void switch_page_directory(page_directory_t * new);
 extern void invalidate_page_tables(void);
 extern void invalidate_tables_at(uintptr_t addr);
+extern void invalidate_tables_range(uintptr_t start, size_t size);
 extern page_t *get_page(uintptr_t address, int make, page_directory_t * dir);
 extern void page_fault(struct regs *r);
 extern void dma_frame(page_t * page, int, int, uintptr_t);
+extern void map_device_memory(uintptr_t address, size_t size, int flags);
 extern void debug_print_directory(page_directory_t *);
 
+/* map_device_memory() flags */
+#define DEVICE_MEMORY_USER 0x1 /* Userspace can reach it too, as with framebuffers */
+#define DEVICE_MEMORY_WC   0x2 /* Write-combining instead of uncached */
+
 int debug_shell_start(void);
 
 void heap_install(void);
 
 void alloc_frame(page_t *page, int is_kernel, int is_writeable);
 void free_frame(page_t *page);
+void map_zero_frame(page_t *page);
+int share_frame(page_t * src, page_t * dest);
+int frame_is_shared(page_t * page);
+int copy_on_write(uintptr_t address);
+int page_is_resident(page_t * page);
+void rss_adjust(page_directory_t * dir, uintptr_t address, int delta);
+page_t * alloc_user_frame(page_directory_t * dir, uintptr_t address, int is_writeable);
 uintptr_t memory_use(void);
 uintptr_t memory_total(void);
 
@@ -163,6 +211,7 @@ void * __attribute__ ((malloc)) malloc(uintptr_t size);
 void * __attribute__ ((malloc)) realloc(void *ptr, uintptr_t size);
 void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size);
 void * __attribute__ ((malloc)) valloc(uintptr_t size);
+void * heap_pages(uintptr_t count);
 void free(void *ptr);
 
 /* Tasks */
@@ -179,6 +228,7 @@ extern void tasking_install(void);
 extern void switch_task(uint8_t reschedule);
 extern void switch_next(void);
 extern uint32_t fork(void);
+extern uint32_t vfork(void);
 extern uint32_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg);
 extern uint32_t getpid(void);
 extern void enter_user_jmp(uintptr_t location, int argc, char ** argv, uintptr_t stack);
@@ -202,6 +252,8 @@ extern uint32_t now(void);
 extern void switch_fpu(void);
 extern void unswitch_fpu(void);
 extern void fpu_install(void);
+extern void fpu_fork(process_t * parent, process_t * child);
+extern void fpu_release(process_t * proc);
 
 /* ELF */
 extern int exec( char *, int, char **, char **, int);
@@ -209,11 +261,39 @@ extern int system( char *, int, char **, char **);
 
 /* Sytem Calls */
 extern void syscalls_install(void);
+extern uint32_t num_syscalls;
+#define SYSCALL_LATENCY_BUCKETS 32
+extern uint32_t syscall_latency[][SYSCALL_LATENCY_BUCKETS];
 
 /* wakeup queue */
 extern int wakeup_queue(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
 extern int sleep_on(list_t * queue);
+extern int wakeup_queue_count(list_t * queue, int count);
+extern process_t * wakeup_queue_first(list_t * queue);
+
+/* futexes */
+extern int futex_wait(int * address, int value);
+extern int futex_wake(int * address, int count);
+
+/* fswait sets */
+extern fs_node_t * fswait_set_create(void);
+extern int fswait_set_ctl(fs_node_t * set_node, int op, int fd, fs_node_t * node, int flags);
+extern int fswait_set_wait(fs_node_t * set_node, int * out, int max, int timeout);
+
+struct ioring;
+extern fs_node_t * ioring_create(unsigned int entries, struct ioring ** ring);
+extern int ioring_enter(fs_node_t * node, unsigned int to_submit, unsigned int min_complete);
+extern void fswait_alert(void * object);
+
+/* Signal descriptors */
+extern fs_node_t * signalfd_create(fs_node_t * existing, uint64_t mask, int flags, int * error);
+extern int signalfd_post(process_t * receiver, int signum);
+extern void signalfd_release(process_t * proc);
+
+/* Profiler */
+extern void profile_sample(struct regs * r);
+extern uint32_t profile_read(uint64_t offset, uint32_t size, uint8_t * buffer);
 
 typedef struct {
 	uint32_t  signum;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <kernel/types.h>
+#include <toaru/list.h>
 
 typedef struct page {
 	unsigned int present:1;
@@ -12,7 +13,9 @@ typedef struct page {
 	unsigned int dirty:1;
 	unsigned int pat:1;
 	unsigned int global:1;
-	unsigned int unused:3;
+	unsigned int cow:1; /* Shared after fork(), copy on write */
+	unsigned int swapped:1; /* Not present; the frame field is a swap slot */
+	unsigned int unused:1;
 	unsigned int frame:20;
 } __attribute__((packed)) page_t;
 
@@ -20,10 +23,16 @@ typedef struct page_table {
 	page_t pages[1024];
 } page_table_t;
 
+/* Stands in for the table of a directory entry that maps 4MiB itself */
+#define LARGE_PAGE_TABLE ((page_table_t *)0xFFFFFFFF)
+
 typedef struct page_directory {
 	uintptr_t physical_tables[1024];	/* Physical addresses of the tables */
 	page_table_t *tables[1024];	/* 1024 pointers to page tables... */
 	uintptr_t physical_address;	/* The physical address of physical_tables */
 	int32_t ref_count;
+	list_t * mmap_regions;	/* Demand-filled regions (see mmap.h) */
+	uint32_t rss;		/* Resident user pages below SHM_START (see page_is_resident) */
+	uint32_t rss_shm;	/* Resident shared memory pages */
 } page_directory_t;
 
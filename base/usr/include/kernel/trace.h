@@ -0,0 +1,58 @@
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/logging.h>
+
+/* Subsystems, each enabled separately through /dev/trace */
+enum {
+	TRACE_SCHED = 0,
+	TRACE_SYSCALL,
+	TRACE_MEM,
+	TRACE_VFS,
+	TRACE_PIPE,
+	TRACE_NET,
+	TRACE_SUBSYSTEMS
+};
+
+typedef struct {
+	int subsystem;
+	char * file;
+	int line;
+	char * format; /* Applied to the arguments when the record is read */
+	int string;    /* The record holds a string instead of integers */
+} trace_site_t;
+
+extern volatile uint32_t trace_mask;
+extern void trace_record(trace_site_t * site, uintptr_t a, uintptr_t b, uintptr_t c, uintptr_t d);
+extern void trace_record_string(trace_site_t * site, const char * str);
+extern void trace_install(void);
+
+#define trace_enabled(subsystem) (trace_mask & (1 << (subsystem)))
+
+/*
+ * TRACE(subsystem, format, up to four integer arguments)
+ *
+ * Costs a test and a branch while the subsystem is off. When it is
+ * on, the arguments are copied into the trace ring as they are and
+ * only formatted when someone reads /dev/trace.
+ */
+#define TRACE(subsystem, ...) _TRACE(subsystem, __VA_ARGS__, 0, 0, 0, 0, 0)
+#define _TRACE(subsystem, fmt, a, b, c, d, ...) do { \
+	if (trace_enabled(subsystem)) { \
+		static trace_site_t _trace_site = { (subsystem), MODULE_NAME, __LINE__, (fmt), 0 }; \
+		trace_record(&_trace_site, (uintptr_t)(a), (uintptr_t)(b), (uintptr_t)(c), (uintptr_t)(d)); \
+	} \
+} while (0)
+
+/*
+ * TRACE_STRING(subsystem, format, string)
+ *
+ * Copies the start of the string into the record, for a format
+ * with a single %s.
+ */
+#define TRACE_STRING(subsystem, fmt, str) do { \
+	if (trace_enabled(subsystem)) { \
+		static trace_site_t _trace_site = { (subsystem), MODULE_NAME, __LINE__, (fmt), 1 }; \
+		trace_record_string(&_trace_site, (str)); \
+	} \
+} while (0)
@@ -9,12 +9,60 @@
 #define IO_VID_STRIDE 0x5007
 #define IO_VID_DRIVER 0x5008
 #define IO_VID_REINIT 0x5009
+#define IO_VID_UPDATE 0x500A
+#define IO_VID_PAGES  0x500B
+#define IO_VID_FLIP   0x500C
+#define IO_VID_CURSOR 0x500D
+#define IO_VID_CURSOR_MOVE 0x500E
 
 struct vid_size {
 	uint32_t width;
 	uint32_t height;
 };
 
+/* Maximum number of rectangles in one IO_VID_UPDATE request */
+#define VID_UPDATE_RECTS 32
+
+struct vid_rect {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+/*
+ * Tells the display adapter which parts of the framebuffer changed.
+ * Adapters that scan out the framebuffer on their own (bochs without
+ * VirtualBox's VBVA, preset) reject this with EINVAL; a count of 0 can
+ * be used to probe for support.
+ */
+struct vid_update {
+	uint32_t count;
+	struct vid_rect rects[VID_UPDATE_RECTS];
+};
+
+/* Largest hardware cursor image */
+#define VID_CURSOR_MAX 64
+
+/*
+ * Hardware cursor image, premultiplied ARGB. The hot spot is the pixel
+ * that sits at the position given to IO_VID_CURSOR_MOVE. Adapters
+ * without a hardware cursor reject both requests with EINVAL.
+ */
+struct vid_cursor {
+	uint32_t width;
+	uint32_t height;
+	uint32_t hot_x;
+	uint32_t hot_y;
+	uint32_t pixels[VID_CURSOR_MAX * VID_CURSOR_MAX];
+};
+
+struct vid_cursor_position {
+	int32_t x;
+	int32_t y;
+	uint32_t visible;
+};
+
 #ifdef _KERNEL_
 extern void lfb_set_resolution(uint16_t x, uint16_t y);
 extern uint16_t lfb_resolution_x;
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+/*
+ * Heap usage, in the fields glibc has. Small allocations come from
+ * bins of cells of 4 to 2048 bytes; anything bigger gets a block of
+ * whole pages of its own. Sizes are of the cells and blocks, not of
+ * what was asked for.
+ */
+struct mallinfo {
+	int arena;    /* Bytes taken from the system */
+	int ordblks;  /* Free big blocks */
+	int smblks;   /* Free small cells */
+	int hblks;    /* Big blocks in use */
+	int hblkhd;   /* Bytes in big blocks in use */
+	int usmblks;  /* Most bytes ever in use at once */
+	int fsmblks;  /* Bytes in free small cells */
+	int uordblks; /* Bytes in use */
+	int fordblks; /* Bytes free */
+	int keepcost; /* Always 0; the heap is never given back */
+};
+
+/* One small bin */
+struct malloc_bin_info {
+	size_t size;   /* Of a cell */
+	size_t pages;
+	size_t cells;  /* In all of its pages */
+	size_t used;
+	size_t cached; /* Free, but held by a thread */
+};
+
+#define MALLOC_SMALL_BINS 10
+
+extern struct mallinfo mallinfo(void);
+extern int malloc_bin_info(int bin, struct malloc_bin_info * info);
+extern void malloc_stats(void);
+
+_End_C_Header
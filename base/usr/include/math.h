@@ -17,6 +17,22 @@ extern double fabs(double x);
 extern float fabsf(float x);
 extern double sin(double x);
 extern double cos(double x);
+extern void sincos(double x, double * s, double * c);
+extern float sinf(float x);
+extern float cosf(float x);
+extern void sincosf(float x, float * s, float * c);
+extern float expf(float x);
+
+/*
+ * Four at a time, on arrays of four floats (see libc/math/vector.c).
+ * The _fast versions trade accuracy (to about 4e-4) for speed.
+ */
+extern void sincosf4(const float * x, float * s, float * c);
+extern void sincosf4_fast(const float * x, float * s, float * c);
+extern void sinf4(const float * x, float * out);
+extern void sinf4_fast(const float * x, float * out);
+extern void expf4(const float * x, float * out);
+extern void sqrtf4(const float * x, float * out);
 
 double frexp(double x, int *exp);
 
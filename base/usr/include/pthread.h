@@ -2,6 +2,7 @@
 
 #include <_cheader.h>
 #include <stdint.h>
+#include <stddef.h>
 
 _Begin_C_Header
 
@@ -9,8 +10,16 @@ typedef struct {
 	uint32_t id;
 	char * stack;
 	void * ret_val;
+	size_t stack_size;
+	size_t guard_size;
 } pthread_t;
-typedef unsigned int pthread_attr_t;
+
+typedef struct {
+	size_t stack_size;
+	size_t guard_size;
+} pthread_attr_t;
+
+#define PTHREAD_STACK_MIN 0x4000
 
 extern int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg);
 extern void pthread_exit(void * value);
@@ -22,12 +31,28 @@ extern int gettid();
 extern void pthread_cleanup_push(void (*routine)(void *), void *arg);
 extern void pthread_cleanup_pop(int execute);
 
+/* 0 when unlocked, 1 when locked, 2 when locked with threads waiting */
 typedef int volatile pthread_mutex_t;
 typedef int pthread_mutexattr_t;
 
+/* Bumped on every signal; waiters sleep until it changes */
+typedef int volatile pthread_cond_t;
+typedef int pthread_condattr_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int readers;
+	int writer;
+	int writers_waiting;
+} pthread_rwlock_t;
+typedef int pthread_rwlockattr_t;
+
 extern int pthread_join(pthread_t thread, void **retval);
 
 #define PTHREAD_MUTEX_INITIALIZER 0
+#define PTHREAD_COND_INITIALIZER 0
+#define PTHREAD_RWLOCK_INITIALIZER { 0, 0, 0, 0, 0 }
 
 extern int pthread_mutex_lock(pthread_mutex_t *mutex);
 extern int pthread_mutex_trylock(pthread_mutex_t *mutex);
@@ -35,8 +60,26 @@ extern int pthread_mutex_unlock(pthread_mutex_t *mutex);
 extern int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
 
+extern int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+extern int pthread_cond_destroy(pthread_cond_t *cond);
+extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+extern int pthread_cond_signal(pthread_cond_t *cond);
+extern int pthread_cond_broadcast(pthread_cond_t *cond);
+
+extern int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
+extern int pthread_rwlock_destroy(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
+
 extern int pthread_attr_init(pthread_attr_t *attr);
 extern int pthread_attr_destroy(pthread_attr_t *attr);
+extern int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
+extern int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize);
+extern int pthread_attr_setguardsize(pthread_attr_t *attr, size_t guardsize);
+extern int pthread_attr_getguardsize(const pthread_attr_t *attr, size_t *guardsize);
 
 
 _End_C_Header
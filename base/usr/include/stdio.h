@@ -11,6 +11,28 @@ typedef struct _FILE FILE;
 
 #define BUFSIZ 8192
 
+/* Streams reading sequentially through a file grow their buffer up to this */
+#define _STDIO_MAX_BUFSIZ 65536
+
+/*
+ * Visible so getc() can take bytes straight from the read buffer;
+ * treat the fields as private.
+ */
+struct _FILE {
+	int fd;
+
+	char * read_buf;
+	int available;
+	int offset;
+	int read_from;
+	int ungetc;
+	int eof;
+	int bufsiz;
+	long last_read_start;
+	char * _name;
+	int user_buf;
+};
+
 extern FILE * stdin;
 extern FILE * stdout;
 extern FILE * stderr;
@@ -54,6 +76,14 @@ extern int getc(FILE *stream);
 extern char *fgets(char *s, int size, FILE *stream);
 extern int getchar(void);
 
+#define getc_unlocked(f) (((f)->ungetc < 0 && (f)->available > 0) ? \
+	((f)->available--, (unsigned char)(f)->read_buf[(f)->read_from++]) : fgetc(f))
+#define getchar_unlocked() getc_unlocked(stdin)
+
+/* There is no stream locking, so these are the same */
+#define getc(f) getc_unlocked(f)
+#define getchar() getc_unlocked(stdin)
+
 extern void rewind(FILE *stream);
 extern void setbuf(FILE * stream, char * buf);
 
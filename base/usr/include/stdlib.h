@@ -14,6 +14,7 @@ extern void *calloc(size_t nmemb, size_t size);
 extern void *realloc(void *ptr, size_t size);
 
 extern void qsort(void *base, size_t nmemb, size_t size, int (*compar)(const void*,const void*));
+extern int mergesort(void *base, size_t nmemb, size_t size, int (*compar)(const void*,const void*));
 
 extern int system(const char * command);
 
@@ -3,7 +3,24 @@
 #include <_cheader.h>
 
 _Begin_C_Header
+
+/* fswait_ctl operations */
+#define FSWAIT_ADD 1
+#define FSWAIT_DEL 2
+#define FSWAIT_MOD 3
+
+/* fswait_ctl flags: report once per new alert, rather than while readable */
+#define FSWAIT_EDGE 0x01
+
+#ifndef _KERNEL_
 extern int fswait(int count, int * fds);
 extern int fswait2(int count, int * fds, int timeout);
 extern int fswait3(int count, int * fds, int timeout, int * out);
+
+/* Persistent sets: returns a descriptor for the set */
+extern int fswait_create(void);
+extern int fswait_ctl(int set, int op, int fd, int flags);
+/* Fills `out` with up to `max` readable descriptors; returns how many */
+extern int fswait_wait(int set, int * out, int max, int timeout);
+#endif
 _End_C_Header
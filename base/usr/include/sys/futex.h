@@ -0,0 +1,16 @@
+#pragma once
+
+#include <_cheader.h>
+
+_Begin_C_Header
+
+/* Sleep while the word at the address still holds `val` */
+#define FUTEX_WAIT 0
+/* Wake up to `val` threads sleeping on the address */
+#define FUTEX_WAKE 1
+
+#ifndef _KERNEL_
+extern int futex(volatile int * uaddr, int op, int val);
+#endif
+
+_End_C_Header
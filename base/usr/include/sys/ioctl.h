@@ -12,4 +12,5 @@
 #define IOCTLTTYLOGIN 0x4F02
 
 #define IOCTL_PACKETFS_QUEUED 0x5050
+#define IOCTL_PACKETFS_DROPPED 0x5051
 
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+/*
+ * Submission/completion rings for asynchronous I/O.
+ *
+ * ioring_setup() maps a struct ioring, followed by its submission
+ * and completion arrays, into the caller and returns a descriptor for
+ * it. Requests are filled in at sqes[sq_tail & sq_mask] and handed
+ * over by advancing sq_tail; ioring_enter() passes them to the
+ * kernel's workers, which run them against the files in the
+ * background. Results are posted at cqes[cq_tail & cq_mask]; they
+ * are consumed by advancing cq_head. The ring's descriptor becomes
+ * readable (for fswait) when completions are waiting.
+ *
+ * Each side only ever writes its own index: the kernel moves sq_head
+ * and cq_tail, the process sq_tail and cq_head.
+ */
+
+#define IORING_OP_NOP   0
+#define IORING_OP_READ  1
+#define IORING_OP_WRITE 2
+#define IORING_OP_FSYNC 3
+
+/* Most entries a ring can be set up with */
+#define IORING_MAX_ENTRIES 256
+
+struct ioring_sqe {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t reserved;
+	int fd;
+	uint64_t off;        /* Offset to read or write at, as pread/pwrite */
+	void * buf;
+	uint32_t len;
+	uint64_t user_data;  /* Handed back in the completion */
+};
+
+struct ioring_cqe {
+	uint64_t user_data;
+	int32_t res;         /* What the call would have returned, or -errno */
+	uint32_t flags;
+};
+
+struct ioring {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	uint32_t sq_mask;
+	uint32_t cq_mask;
+	struct ioring_sqe * sqes;
+	struct ioring_cqe * cqes;
+};
+
+#ifndef _KERNEL_
+/* Rounds `entries` up to a power of two; the completion ring is twice that */
+extern int ioring_setup(unsigned int entries, struct ioring ** ring);
+/* Submits up to `to_submit` requests, then waits for `min_complete` completions */
+extern int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete);
+
+/* Next free submission entry, or NULL if the ring is full */
+static inline struct ioring_sqe * ioring_get_sqe(struct ioring * ring) {
+	if (ring->sq_tail - ring->sq_head > ring->sq_mask) return NULL;
+	return &ring->sqes[ring->sq_tail & ring->sq_mask];
+}
+
+static inline void ioring_queue_sqe(struct ioring * ring) {
+	__sync_synchronize();
+	ring->sq_tail++;
+}
+
+/* Oldest unconsumed completion, or NULL if there are none */
+static inline struct ioring_cqe * ioring_peek_cqe(struct ioring * ring) {
+	if (ring->cq_head == ring->cq_tail) return NULL;
+	__sync_synchronize();
+	return &ring->cqes[ring->cq_head & ring->cq_mask];
+}
+
+static inline void ioring_cqe_seen(struct ioring * ring) {
+	__sync_synchronize();
+	ring->cq_head++;
+}
+#endif
+
+_End_C_Header
@@ -1,3 +1,28 @@
 #pragma once
 
-/* Nothing here, we don't have an mmap implementation yet? */
+#include <_cheader.h>
+
+_Begin_C_Header
+
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_ANON      MAP_ANONYMOUS
+
+#define MAP_FAILED ((void *)-1)
+
+#ifndef _KERNEL_
+#include <sys/types.h>
+#include <stddef.h>
+
+extern void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int munmap(void * addr, size_t length);
+#endif
+
+_End_C_Header
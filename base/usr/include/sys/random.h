@@ -0,0 +1,15 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+/* Accepted for compatibility; getrandom() never blocks */
+#define GRND_NONBLOCK 0x0001
+#define GRND_RANDOM   0x0002
+
+extern ssize_t getrandom(void * buf, size_t buflen, unsigned int flags);
+
+_End_C_Header
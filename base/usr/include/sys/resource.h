@@ -0,0 +1,21 @@
+#pragma once
+
+#include <_cheader.h>
+
+_Begin_C_Header
+
+#define PRIO_PROCESS 0
+#define PRIO_PGRP    1
+#define PRIO_USER    2
+
+#define PRIO_MIN (-20)
+#define PRIO_MAX 20
+
+#ifndef _KERNEL_
+#include <sys/types.h>
+
+extern int getpriority(int which, id_t who);
+extern int setpriority(int which, id_t who, int prio);
+#endif
+
+_End_C_Header
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+/*
+ * Signal descriptors.
+ *
+ * Signals in a signal descriptor's mask no longer interrupt the
+ * process that made it; they are marked pending on the descriptor
+ * instead, which becomes readable (for fswait), and each read()
+ * returns one struct signalfd_siginfo per pending signal.
+ *
+ * The mask is 64 bits wide, rather than a sigset_t, so that it can
+ * name every signal (SIGWINEVENT included). SIGKILL, SIGSTOP and
+ * SIGCONT can't be taken this way.
+ */
+
+#define SIGNALFD_BIT(sig) (1ULL << (sig))
+
+#define SFD_NONBLOCK 0x4000 /* Reads with nothing pending fail with EAGAIN */
+
+struct signalfd_siginfo {
+	uint32_t ssi_signo;
+	int32_t  ssi_errno;
+	int32_t  ssi_code;
+	uint32_t ssi_pid;   /* Sender */
+	uint32_t ssi_uid;   /* Sender's user */
+	uint8_t  _pad[108];
+};
+
+/* Pass -1 for a new descriptor, or one of ours to change its mask */
+extern int signalfd(int fd, const uint64_t * mask, int flags);
+
+_End_C_Header
@@ -101,6 +101,9 @@ typedef unsigned char cc_t;
 #define B9600   0000015
 #define B19200  0000016
 #define B38400  0000017
+#define B57600  0010001
+#define B115200 0010002
+#define CBAUD   0010017
 
 /* control modes */
 #define CSIZE   0000060
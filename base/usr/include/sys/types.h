@@ -26,6 +26,7 @@ typedef long ssize_t;
 typedef unsigned long useconds_t;
 typedef long suseconds_t;
 typedef int pid_t;
+typedef int id_t;
 
 #define FD_SETSIZE 64 /* compatibility with newlib */
 typedef long fd_mask;
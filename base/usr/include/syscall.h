@@ -123,6 +123,11 @@ DECL_SYSCALL1(getpgid,int);
 DECL_SYSCALL0(geteuid);
 DECL_SYSCALL2(lstat, char *, void *);
 DECL_SYSCALL4(fswait3, int, int*, int, int*);
+DECL_SYSCALL1(mmap, uintptr_t *);
+DECL_SYSCALL2(munmap, void *, size_t);
+DECL_SYSCALL3(setpriority, int, int, int);
+DECL_SYSCALL2(getpriority, int, int);
+DECL_SYSCALL4(getdents, int, uint32_t *, void *, int);
 
 _End_C_Header
 
@@ -55,3 +55,23 @@
 #define SYS_SETPGID 63
 #define SYS_GETPGID 64
 #define SYS_FSWAIT3 65
+#define SYS_MMAP 66
+#define SYS_MUNMAP 67
+#define SYS_SETPRIORITY 68
+#define SYS_GETPRIORITY 69
+#define SYS_GETDENTS 70
+#define SYS_FUTEX 71
+#define SYS_FSWAIT_CREATE 72
+#define SYS_FSWAIT_CTL 73
+#define SYS_FSWAIT_WAIT 74
+#define SYS_SYNC 75
+#define SYS_FSYNC 76
+#define SYS_COPY_FILE_RANGE 77
+#define SYS_GETRANDOM 78
+#define SYS_VFORK 79
+#define SYS_SPLICE 80
+#define SYS_TEE 81
+#define SYS_IORING_SETUP 82
+#define SYS_IORING_ENTER 83
+#define SYS_SIGRETURN 84
+#define SYS_SIGNALFD 85
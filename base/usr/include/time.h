@@ -28,6 +28,7 @@ extern size_t strftime(char *s, size_t max, const char *format, const struct tm
 extern time_t time(time_t * out);
 extern double difftime(time_t a, time_t b);
 extern time_t mktime(struct tm *tm);
+extern void tzset(void);
 
 extern char * asctime(const struct tm *tm);
 extern char * ctime(const time_t * timep);
@@ -37,4 +38,16 @@ typedef int clock_t;
 extern clock_t clock(void);
 #define CLOCKS_PER_SEC 1
 
+struct timespec {
+	time_t tv_sec;
+	long   tv_nsec;
+};
+
+typedef int clockid_t;
+
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1 /* Time since boot */
+
+extern int clock_gettime(clockid_t clk_id, struct timespec * tp);
+
 _End_C_Header
@@ -0,0 +1,29 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ */
+
+#pragma once
+
+#include <_cheader.h>
+
+#ifdef _KERNEL_
+#	include <kernel/types.h>
+#else
+#	include <stdint.h>
+#	include <stddef.h>
+#endif
+
+_Begin_C_Header
+
+/**
+ * Both of these continue a running checksum, as zlib's do: start
+ * from checksum_crc32(0, NULL, 0) or checksum_adler32(1, NULL, 0)
+ * (that is, 0 and 1) and feed the data through in as many pieces
+ * as is convenient.
+ */
+uint32_t checksum_crc32(uint32_t crc, const void * buf, size_t len);
+uint32_t checksum_adler32(uint32_t adler, const void * buf, size_t len);
+
+_End_C_Header
@@ -0,0 +1,47 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Shared rasterized glyph cache
+ *
+ * The font server keeps one shm region per face, named by
+ * GLYPHCACHE_SHMKEY, and every process using the freetype extension
+ * maps it. A glyph rasterized by any client is appended to the arena
+ * and published in the table, and everyone else blits it from there.
+ *
+ * Nothing is ever removed or rewritten, so readers need no locking:
+ * a writer reserves arena space by bumping `used`, fills in the glyph,
+ * and only then claims a table slot with compare-and-swap. A new
+ * region is all zeroes, which is a valid empty cache.
+ */
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define GLYPHCACHE_SHMKEY(server_ident,buf,sz,face) snprintf(buf, sz, "sys.%s.glyphs.%s", server_ident, face)
+
+#define GLYPHCACHE_SIZE  (1024 * 1024)  /* Populated lazily by the kernel */
+#define GLYPHCACHE_SLOTS 4096           /* Power of two */
+
+/* Codepoints are at most 21 bits; the pixel size goes above them. */
+#define GLYPHCACHE_KEY(size,codepoint) ((((uint32_t)(size) & 0x7FF) << 21) | ((codepoint) & 0x1FFFFF))
+
+struct glyphcache_glyph {
+	uint32_t key;
+	int16_t left;       /* Bitmap offset from the pen */
+	int16_t top;
+	int16_t advance_x;  /* Pixels */
+	int16_t advance_y;
+	uint16_t width;
+	uint16_t rows;
+	uint8_t bitmap[];   /* width * rows coverage values */
+};
+
+struct glyphcache {
+	volatile uint32_t used;                     /* Arena bytes handed out */
+	volatile uint32_t slots[GLYPHCACHE_SLOTS];  /* Offsets of glyphs from the start of the region; 0 is empty */
+	uint8_t arena[];
+};
+
+_End_C_Header
@@ -35,6 +35,13 @@ typedef struct sprite {
 	uint8_t  alpha;
 } sprite_t;
 
+typedef struct {
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+} gfx_rect_t;
+
 typedef struct context {
 	uint16_t width;
 	uint16_t height;
@@ -50,6 +57,8 @@ typedef struct context {
 extern gfx_context_t * init_graphics_fullscreen();
 extern gfx_context_t * init_graphics_fullscreen_double_buffer();
 extern void reinit_graphics_fullscreen(gfx_context_t * ctx);
+extern int init_graphics_page_flip(gfx_context_t * ctx);
+extern void gfx_page_flip(gfx_context_t * ctx);
 
 #define ALPHA_OPAQUE   0
 #define ALPHA_MASK     1
@@ -64,6 +73,7 @@ extern uint32_t alpha_blend_rgba(uint32_t bottom, uint32_t top);
 extern uint32_t framebuffer_stride(void);
 
 extern void flip(gfx_context_t * ctx);
+extern void flip_regions(gfx_context_t * ctx, const gfx_rect_t * rects, int count);
 void clear_buffer(gfx_context_t * ctx);
 
 extern gfx_context_t * init_graphics_sprite(sprite_t * sprite);
@@ -86,6 +96,8 @@ extern void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x
 extern void draw_sprite_scaled_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height, float alpha);
 extern void draw_sprite_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha);
 extern void draw_sprite_alpha_paint(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha, uint32_t c);
+extern sprite_t * create_scaled_sprite(sprite_t * sprite, uint16_t width, uint16_t height);
+extern sprite_t * get_scaled_sprite(sprite_t * sprite, uint16_t width, uint16_t height);
 
 //extern void context_to_png(FILE * file, gfx_context_t * ctx);
 
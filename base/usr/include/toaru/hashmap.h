@@ -19,10 +19,16 @@ typedef int (*hashmap_comp_t) (void * a, void * b);
 typedef void (*hashmap_free_t) (void *);
 typedef void * (*hashmap_dupe_t) (void *);
 
+/*
+ * A slot in an open-addressed table. `distance` is one more than
+ * how far the entry sits from its home slot, so zero marks an
+ * empty slot.
+ */
 typedef struct hashmap_entry {
 	char * key;
 	void * value;
-	struct hashmap_entry * next;
+	unsigned int hash;
+	unsigned int distance;
 } hashmap_entry_t;
 
 typedef struct hashmap {
@@ -30,9 +36,15 @@ typedef struct hashmap {
 	hashmap_comp_t hash_comp;
 	hashmap_dupe_t hash_key_dup;
 	hashmap_free_t hash_key_free;
-	hashmap_free_t hash_val_free;
-	size_t         size;
-	hashmap_entry_t ** entries;
+	hashmap_free_t hash_val_free; /* Called on values by hashmap_free, if set */
+	size_t         size;          /* Slots in entries, always a power of two */
+	size_t         count;         /* Keys in both tables */
+	hashmap_entry_t * entries;
+
+	/* Previous table, moved into entries a few slots at a time after a resize */
+	size_t         old_size;
+	size_t         migrated;
+	hashmap_entry_t * old_entries;
 } hashmap_t;
 
 extern hashmap_t * hashmap_create(int size);
@@ -7,7 +7,13 @@
 #pragma once
 
 #include <_cheader.h>
-#include <stdint.h>
+
+#ifdef _KERNEL_
+#	include <kernel/types.h>
+#else
+#	include <stdint.h>
+#	include <stddef.h>
+#endif
 
 _Begin_C_Header
 
@@ -23,15 +29,24 @@ struct inflate_context {
 	uint8_t (*get_input)(struct inflate_context * ctx);
 	void (*write_output)(struct inflate_context * ctx, unsigned int sym);
 
-	/* Bit buffer, which holds at most 8 bits from the input */
-	int bit_buffer;
+	/* Optional: write a run of output at once; used instead of write_output when set */
+	void (*write_block)(struct inflate_context * ctx, const uint8_t * buf, size_t len);
+
+	/* Bit buffer, which holds the input bits not yet consumed */
+	uint32_t bit_buffer;
 	int buffer_size;
 
 	/* Output ringbuffer for backwards lookups */
 	struct huff_ring * ring;
+
+	/* Running check value of the output, kept by gzip_decompress (CRC-32) and zlib_decompress (Adler-32) */
+	int check;
+	uint32_t checksum;
+	uint32_t total_out;
 };
 
 int deflate_decompress(struct inflate_context * ctx);
 int gzip_decompress(struct inflate_context * ctx);
+int zlib_decompress(struct inflate_context * ctx);
 
 _End_C_Header
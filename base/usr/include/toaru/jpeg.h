@@ -7,4 +7,7 @@ _Begin_C_Header
 
 extern int load_sprite_jpg(sprite_t * sprite, char * filename);
 
+/* Decode at 1/denom of the image size (denom is 1, 2, 4 or 8) */
+extern int load_sprite_jpg_scaled(sprite_t * sprite, char * filename, int denom);
+
 _End_C_Header
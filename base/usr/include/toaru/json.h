@@ -50,4 +50,84 @@ extern struct JSON_Value * json_parse(const char *);
  */
 extern struct JSON_Value * json_parse_file(const char * filename);
 
+/*
+ * Pull tokenizer
+ *
+ * Walks a JSON document in place, one token at a time, without
+ * allocating anything: strings are handed back as pointers into the
+ * source, to be compared or copied out as needed. Callers that only
+ * want a few fields can skip everything else with json_skip().
+ */
+#define JSON_TOKEN_ERROR        -1
+#define JSON_TOKEN_END           0 /* End of the document */
+#define JSON_TOKEN_OBJECT_BEGIN  1
+#define JSON_TOKEN_OBJECT_END    2
+#define JSON_TOKEN_ARRAY_BEGIN   3
+#define JSON_TOKEN_ARRAY_END     4
+#define JSON_TOKEN_KEY           5 /* Object key; its value comes next */
+#define JSON_TOKEN_STRING        6
+#define JSON_TOKEN_NUMBER        7
+#define JSON_TOKEN_BOOL          8
+#define JSON_TOKEN_NULL          9
+
+#define JSON_READER_DEPTH 64
+
+struct JSON_Reader {
+	const char * string;
+	int c;
+	const char * error;
+	int depth;
+	int expect;
+	char stack[JSON_READER_DEPTH];
+};
+
+struct JSON_Token {
+	int type;
+	const char * start; /* Keys and strings: the body, still escaped, ending at its closing quote */
+	int length;         /* ... and how long it is once decoded */
+	int escaped;        /* ... and whether it has any escapes */
+	double number;
+	int boolean;
+};
+
+/**
+ * json_reader_init
+ *
+ * Start reading the document in `str`, which must outlive the reader.
+ */
+extern void json_reader_init(struct JSON_Reader * reader, const char * str);
+
+/**
+ * json_next
+ *
+ * Read the next token into `token` and return its type. After an
+ * error, reader->error says what went wrong and every later call
+ * returns JSON_TOKEN_ERROR as well.
+ */
+extern int json_next(struct JSON_Reader * reader, struct JSON_Token * token);
+
+/**
+ * json_skip
+ *
+ * Skip the next value, including everything inside it if it's an
+ * object or array. Returns 0, or -1 on error.
+ */
+extern int json_skip(struct JSON_Reader * reader);
+
+/**
+ * json_token_string
+ *
+ * Copy a key or string token out, decoded and nil-terminated, into
+ * `buf`. Returns the full decoded length; if that is `size` or more
+ * the copy was truncated.
+ */
+extern int json_token_string(struct JSON_Token * token, char * buf, int size);
+
+/**
+ * json_token_is
+ *
+ * Whether a key or string token decodes to exactly `str`.
+ */
+extern int json_token_is(struct JSON_Token * token, const char * str);
+
 _End_C_Header
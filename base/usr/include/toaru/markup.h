@@ -18,6 +18,8 @@ typedef int (*markup_callback_data)(struct markup_state * self, void * user, cha
 extern struct markup_state * markup_init(void * user, markup_callback_tag_open open, markup_callback_tag_close close, markup_callback_data data);
 extern int markup_free_tag(struct markup_tag * tag);
 extern int markup_parse(struct markup_state * state, char c);
+/* Same as feeding each character to markup_parse, but text between tags goes to the data callback in one piece */
+extern int markup_parse_buffer(struct markup_state * state, const char * buf, size_t len);
 extern int markup_finish(struct markup_state * state);
 
 _End_C_Header
@@ -19,13 +19,18 @@ typedef struct pex_header {
 	uint8_t data[];
 } pex_header_t;
 
+/* Target for pex_multicast: data is a count, that many targets, and then the packet */
+#define PEX_MULTICAST ((uintptr_t)-1)
+
 extern size_t pex_send(FILE * sock, unsigned int rcpt, size_t size, char * blob);
 extern size_t pex_broadcast(FILE * sock, size_t size, char * blob);
+extern size_t pex_multicast(FILE * sock, unsigned int count, unsigned int * rcpts, size_t size, char * blob);
 extern size_t pex_listen(FILE * sock, pex_packet_t * packet);
 
 extern size_t pex_reply(FILE * sock, size_t size, char * blob);
 extern size_t pex_recv(FILE * sock, char * blob);
 extern size_t pex_query(FILE * sock);
+extern size_t pex_dropped(FILE * sock); /* Packets lost to a full queue */
 
 extern FILE * pex_bind(char * target);
 extern FILE * pex_connect(char * target);
@@ -49,12 +49,16 @@ extern void rline_history_insert(char * str);
 extern void rline_history_append_line(char * str);
 extern char * rline_history_get(int item);
 extern char * rline_history_prev(int item);
+extern int rline_history_search(const char * needle, int from);
+extern void rline_history_open(const char * path);
 extern void rline_place_cursor(void);
 extern void rline_set_colors(rline_style_t style);
 extern int rline_terminal_width;
 
+/* Default for rline_history_max, which can be changed before the first entry is added */
 #define RLINE_HISTORY_ENTRIES 128
-extern char * rline_history[RLINE_HISTORY_ENTRIES];
+extern char ** rline_history;
+extern int rline_history_max;
 extern int rline_history_count;
 extern int rline_history_offset;
 extern int rline_scroll;
@@ -37,6 +37,13 @@ _Begin_C_Header
 #define yutani_msg_buildx_window_show_mouse_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_show_mouse)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 #define yutani_msg_buildx_window_resize_start_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_resize_start)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 #define yutani_msg_buildx_special_request_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_special_request)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_flip_regions_alloc(out, count) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_flip_regions) + sizeof(yutani_damage_rect_t) * (count)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_frame_done_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_frame_done)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_swapchain_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_swapchain)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_window_buffer_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_buffer)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_latency_mark_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_latency_mark)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_query_latency_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_latency_report_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_latency_report)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 #define yutani_msg_buildx_clipboard_alloc(out, length) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_clipboard)+length]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 
 extern void yutani_msg_buildx_hello(yutani_msg_t * msg);
@@ -69,5 +76,12 @@ extern void yutani_msg_buildx_window_show_mouse(yutani_msg_t * msg, yutani_wid_t
 extern void yutani_msg_buildx_window_resize_start(yutani_msg_t * msg, yutani_wid_t wid, yutani_scale_direction_t direction);
 extern void yutani_msg_buildx_special_request(yutani_msg_t * msg, yutani_wid_t wid, uint32_t request);
 extern void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content);
+extern void yutani_msg_buildx_flip_regions(yutani_msg_t * msg, yutani_wid_t wid, uint32_t serial, const yutani_damage_rect_t * rects, uint32_t count);
+extern void yutani_msg_buildx_frame_done(yutani_msg_t * msg, yutani_wid_t wid, uint32_t serial);
+extern void yutani_msg_buildx_swapchain(yutani_msg_t * msg, uint32_t type, yutani_wid_t wid, uint32_t count, const uint32_t * bufids);
+extern void yutani_msg_buildx_window_buffer(yutani_msg_t * msg, uint32_t type, yutani_wid_t wid, uint32_t bufid);
+extern void yutani_msg_buildx_latency_mark(yutani_msg_t * msg, yutani_wid_t wid, uint32_t input_id, uint64_t received, uint64_t flipped);
+extern void yutani_msg_buildx_query_latency(yutani_msg_t * msg);
+extern void yutani_msg_buildx_latency_report(yutani_msg_t * msg, const struct yutani_msg_latency_report * report);
 
 _End_C_Header
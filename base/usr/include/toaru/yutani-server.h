@@ -114,12 +114,23 @@ typedef struct YutaniServerWindow {
 	uint32_t newbufid;
 	uint8_t * newbuffer;
 
+	/* Swapchain: slot 0 is bufid above, while buffer is whichever slot is shown */
+	uint32_t swap_count;
+	uint32_t swap_front;
+	uint32_t swap_bufids[YUTANI_SWAPCHAIN_MAX];
+	uint8_t * swap_buffers[YUTANI_SWAPCHAIN_MAX];
+
 	/* Connection that owns this window */
 	uint32_t owner;
 
 	/* Rotation of windows XXX */
 	int16_t  rotation;
 
+	/* sin and cos of the rotation, last computed for rotation_cached degrees */
+	int16_t  rotation_cached;
+	double   rotation_sin;
+	double   rotation_cos;
+
 	/* Client advertisements */
 	uint32_t client_flags;
 	uint16_t client_offsets[5];
@@ -154,8 +165,17 @@ typedef struct YutaniServerWindow {
 
 	/* Window opacity */
 	int opacity;
+
+	/* Every pixel had full alpha as of the last flip */
+	int opaque;
 } yutani_server_window_t;
 
+/* Damage rectangles kept per frame before they are merged further */
+#define YUTANI_DAMAGE_RECTS 32
+
+/* Opaque windows considered when culling the ones below them */
+#define YUTANI_MAX_OCCLUDERS 16
+
 typedef struct YutaniGlobals {
 	/* Display resolution */
 	unsigned int width;
@@ -202,6 +222,12 @@ typedef struct YutaniGlobals {
 	list_t * update_list;
 	volatile int update_list_lock;
 
+	/* Frame-done callbacks for damage in the update list (same lock) */
+	list_t * frame_callbacks;
+
+	/* Input latency samples waiting on the same frame (same lock) */
+	list_t * latency_marks;
+
 	/* Mouse cursors */
 	sprite_t mouse_sprite;
 	sprite_t mouse_sprite_drag;
@@ -259,6 +285,10 @@ typedef struct YutaniGlobals {
 	/* Basic lock to prevent redraw thread and communication thread interference */
 	volatile int redraw_lock;
 
+	/* Wakes an idle render thread; at most one byte is ever in the pipe */
+	int damage_pipe[2];
+	volatile int damage_pending;
+
 	/* Pointer to last hovered window to allow exit events */
 	yutani_server_window_t * old_hover_window;
 
@@ -295,12 +325,37 @@ typedef struct YutaniGlobals {
 	/* VirtualBox Seamless mode support information */
 	int vbox_rects;
 	int vbox_pointer;
+	char vbox_rects_last[4096]; /* What the seamless driver was last sent */
+	size_t vbox_rects_size;
+
+	/* Framebuffer device, for adapters that want to be told about updates (-1 otherwise) */
+	int fb_update;
+
+	/* The adapter draws the cursor; what it was last given */
+	int hw_cursor;
+	sprite_t * hw_cursor_sprite;
+	int32_t hw_cursor_x;
+	int32_t hw_cursor_y;
+	int hw_cursor_visible;
 
 	/* Renderer plugin context */
 	void * renderer_ctx;
 
 	int reload_renderer;
 	uint8_t active_modifiers;
+
+	/* This frame's damage, as disjoint rectangles */
+	yutani_damage_rect_t damage_rects[YUTANI_DAMAGE_RECTS];
+	int damage_count;
+
+	/* Page flipping: the back page is missing the last flipped frame's damage */
+	int page_flip;
+	yutani_damage_rect_t last_damage[YUTANI_DAMAGE_RECTS];
+	int last_damage_count;
+
+	/* Opaque windows above the one being blitted, topmost first */
+	yutani_damage_rect_t occluders[YUTANI_MAX_OCCLUDERS];
+	int occluder_count;
 } yutani_globals_t;
 
 struct key_bind {
@@ -42,8 +42,21 @@ typedef struct yutani_context {
 
 	/* server identifier string */
 	char * server_ident;
+
+	/* messages held back between yutani_batch_begin and yutani_batch_commit */
+	int batch_depth;
+	char * batch;
+	size_t batch_size;
+	size_t batch_barrier;
+
+	/* Oldest tagged key event (see YUTANI_LATENCY_*) the next flip has yet to report */
+	uint32_t input_id;
+	uint64_t input_received;
 } yutani_t;
 
+/* Most buffers a window swapchain can have */
+#define YUTANI_SWAPCHAIN_MAX 3
+
 typedef struct yutani_window {
 	/* Server window identifier, unique to each window */
 	yutani_wid_t wid;
@@ -79,8 +92,26 @@ typedef struct yutani_window {
 
 	/* Server context that owns this window */
 	yutani_t * ctx;
+
+	/* Last frame serial sent with yutani_flip_regions, and the last one the server finished */
+	uint32_t frame_serial;
+	uint32_t frame_done;
+
+	/*
+	 * Swapchain, if one was set up with yutani_swapchain_create.
+	 * Slot 0 is the window's own buffer; `buffer` always points
+	 * at the slot the client should draw into next, and a set
+	 * bit in swap_busy means the server still holds that slot.
+	 */
+	uint32_t swap_count;
+	uint32_t swap_back;
+	uint32_t swap_busy;
+	uint32_t swap_bufids[YUTANI_SWAPCHAIN_MAX];
+	char * swap_buffers[YUTANI_SWAPCHAIN_MAX];
 } yutani_window_t;
 
+typedef gfx_rect_t yutani_damage_rect_t;
+
 typedef struct yutani_message {
 	uint32_t magic;
 	uint32_t type;
@@ -129,6 +160,7 @@ struct yutani_msg_key_event {
 	yutani_wid_t wid;
 	key_event_t event;
 	key_event_state_t state;
+	uint32_t input_id; /* Set by the server to follow the key to the screen; 0 if not */
 };
 
 struct yutani_msg_window_stack {
@@ -243,6 +275,65 @@ struct yutani_msg_clipboard {
 	char content[];
 };
 
+/* Most rectangles one FLIP_REGIONS message can carry */
+#define YUTANI_FLIP_REGIONS_MAX 32
+
+struct yutani_msg_flip_regions {
+	yutani_wid_t wid;
+	uint32_t serial;
+	uint32_t count;
+	yutani_damage_rect_t rects[];
+};
+
+struct yutani_msg_frame_done {
+	yutani_wid_t wid;
+	uint32_t serial;
+};
+
+struct yutani_msg_swapchain {
+	yutani_wid_t wid;
+	uint32_t count;
+	uint32_t bufids[YUTANI_SWAPCHAIN_MAX];
+};
+
+struct yutani_msg_window_buffer {
+	yutani_wid_t wid;
+	uint32_t bufid;
+};
+
+/*
+ * Input latency. Stages of a key's trip, each timed from the end of
+ * the one before; times are gettimeofday() microseconds.
+ */
+#define YUTANI_LATENCY_INPUT   0 /* Read from the device, until sent to the client */
+#define YUTANI_LATENCY_DELIVER 1 /* Until the client read it */
+#define YUTANI_LATENCY_CLIENT  2 /* Until the client flipped */
+#define YUTANI_LATENCY_RETURN  3 /* Until the server saw the flip */
+#define YUTANI_LATENCY_COMPOSE 4 /* Until the frame was on screen */
+#define YUTANI_LATENCY_TOTAL   5
+#define YUTANI_LATENCY_STAGES  6
+
+/* Bucket n holds times of at least 2^n microseconds (less than 2^(n+1), but for the last) */
+#define YUTANI_LATENCY_BUCKETS 20
+
+/* Sent by the client library after the first flip following a tagged key */
+struct yutani_msg_latency_mark {
+	yutani_wid_t wid;
+	uint32_t input_id;
+	uint64_t received;
+	uint64_t flipped;
+};
+
+/* Everything since the server started */
+struct yutani_msg_latency_report {
+	uint32_t dispatched;  /* Keys sent to clients tagged */
+	uint32_t completed;   /* Tagged keys whose frame reached the screen */
+	uint32_t last[YUTANI_LATENCY_STAGES];
+	uint32_t max[YUTANI_LATENCY_STAGES];
+	uint64_t sum[YUTANI_LATENCY_STAGES];
+	uint32_t histogram[YUTANI_LATENCY_STAGES][YUTANI_LATENCY_BUCKETS];
+};
+
 /* Magic value */
 #define YUTANI_MSG__MAGIC 0xABAD1DEA
 
@@ -261,12 +352,16 @@ struct yutani_msg_clipboard {
 #define YUTANI_MSG_WINDOW_MOUSE_EVENT  0x0000000C
 #define YUTANI_MSG_FLIP_REGION         0x0000000D
 #define YUTANI_MSG_WINDOW_NEW_FLAGS    0x0000000E
+#define YUTANI_MSG_FLIP_REGIONS        0x0000000F
 
 #define YUTANI_MSG_RESIZE_REQUEST      0x00000010
 #define YUTANI_MSG_RESIZE_OFFER        0x00000011
 #define YUTANI_MSG_RESIZE_ACCEPT       0x00000012
 #define YUTANI_MSG_RESIZE_BUFID        0x00000013
 #define YUTANI_MSG_RESIZE_DONE         0x00000014
+#define YUTANI_MSG_SWAPCHAIN           0x00000015
+#define YUTANI_MSG_SWAPCHAIN_PRESENT   0x00000016
+#define YUTANI_MSG_LATENCY_MARK        0x00000017
 
 /* Some session management / de stuff */
 #define YUTANI_MSG_WINDOW_ADVERTISE    0x00000020
@@ -279,6 +374,7 @@ struct yutani_msg_clipboard {
 #define YUTANI_MSG_WINDOW_WARP_MOUSE   0x00000027
 #define YUTANI_MSG_WINDOW_SHOW_MOUSE   0x00000028
 #define YUTANI_MSG_WINDOW_RESIZE_START 0x00000029
+#define YUTANI_MSG_QUERY_LATENCY       0x0000002A
 
 #define YUTANI_MSG_SESSION_END         0x00000030
 
@@ -288,6 +384,9 @@ struct yutani_msg_clipboard {
 
 #define YUTANI_MSG_CLIPBOARD           0x00000060
 
+/* Several messages back to back in one packet */
+#define YUTANI_MSG_BATCH               0x00000070
+
 #define YUTANI_MSG_GOODBYE             0x000000F0
 
 /* Special request (eg. one-off single-shot requests like "please maximize me" */
@@ -296,6 +395,10 @@ struct yutani_msg_clipboard {
 /* Server responses */
 #define YUTANI_MSG_WELCOME             0x00010001
 #define YUTANI_MSG_WINDOW_INIT         0x00010002
+#define YUTANI_MSG_FRAME_DONE          0x00010003
+#define YUTANI_MSG_SWAPCHAIN_BUFIDS    0x00010004
+#define YUTANI_MSG_BUFFER_RELEASE      0x00010005
+#define YUTANI_MSG_LATENCY_REPORT      0x00010006
 
 /*
  * YUTANI_ZORDER
@@ -485,19 +588,14 @@ struct yutani_msg_clipboard {
 #define YUTANI_RESIZE_TILE_UP    0x00000004
 #define YUTANI_RESIZE_TILE_DOWN  0x00000008
 
-typedef struct {
-	int x;
-	int y;
-	unsigned int width;
-	unsigned int height;
-} yutani_damage_rect_t;
-
 extern yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type);
 extern yutani_msg_t * yutani_poll(yutani_t * y);
 extern yutani_msg_t * yutani_poll_async(yutani_t * y);
 extern size_t yutani_query(yutani_t * y);
 
 extern int yutani_msg_send(yutani_t * y, yutani_msg_t * msg);
+extern void yutani_batch_begin(yutani_t * y);
+extern void yutani_batch_commit(yutani_t * y);
 extern yutani_t * yutani_context_create(FILE * socket);
 extern yutani_t * yutani_init(void);
 extern yutani_window_t * yutani_window_create(yutani_t * y, int width, int height);
@@ -507,15 +605,21 @@ extern void yutani_window_move(yutani_t * yctx, yutani_window_t * window, int x,
 extern void yutani_close(yutani_t * y, yutani_window_t * win);
 extern void yutani_set_stack(yutani_t *, yutani_window_t *, int);
 extern void yutani_flip_region(yutani_t *, yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height);
+extern uint32_t yutani_flip_regions(yutani_t * yctx, yutani_window_t * win, const yutani_damage_rect_t * rects, int count);
+extern int yutani_frame_pending(yutani_window_t * win);
 extern void yutani_window_resize(yutani_t * yctx, yutani_window_t * window, uint32_t width, uint32_t height);
 extern void yutani_window_resize_offer(yutani_t * yctx, yutani_window_t * window, uint32_t width, uint32_t height);
 extern void yutani_window_resize_accept(yutani_t * yctx, yutani_window_t * window, uint32_t width, uint32_t height);
 extern void yutani_window_resize_done(yutani_t * yctx, yutani_window_t * window);
+extern int yutani_swapchain_create(yutani_t * yctx, yutani_window_t * window, int count);
+extern void yutani_swapchain_destroy(yutani_t * yctx, yutani_window_t * window);
+extern char * yutani_swapchain_present(yutani_t * yctx, yutani_window_t * window);
 extern void yutani_window_advertise(yutani_t * yctx, yutani_window_t * window, char * name);
 extern void yutani_window_advertise_icon(yutani_t * yctx, yutani_window_t * window, char * name, char * icon);
 extern void yutani_subscribe_windows(yutani_t * y);
 extern void yutani_unsubscribe_windows(yutani_t * y);
 extern void yutani_query_windows(yutani_t * y);
+extern void yutani_query_latency(yutani_t * y);
 extern void yutani_session_end(yutani_t * y);
 extern void yutani_focus_window(yutani_t * y, yutani_wid_t wid);
 extern void yutani_key_bind(yutani_t * yctx, kbd_key_t key, kbd_mod_t mod, int response);
@@ -16,6 +16,12 @@ extern int close(int fd);
 
 extern pid_t fork(void);
 
+/*
+ * The child shares the parent's memory, and the parent is suspended,
+ * until the child execs or calls _exit; it may do nothing else.
+ */
+extern pid_t vfork(void) __attribute__((returns_twice));
+
 extern int execl(const char *path, const char *arg, ...);
 extern int execlp(const char *file, const char *arg, ...);
 extern int execle(const char *path, const char *arg, ...);
@@ -62,6 +68,12 @@ extern int optind, opterr, optopt;
 
 extern int unlink(const char * pathname);
 
+extern void sync(void);
+extern int fsync(int fd);
+extern ssize_t copy_file_range(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags);
+extern ssize_t splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags);
+extern ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+
 /* Unimplemented stubs */
 struct utimbuf {
     time_t actime;
@@ -93,6 +105,8 @@ extern pid_t setsid(void);
 extern int setpgid(pid_t, pid_t);
 extern pid_t getpgid(pid_t);
 
+extern int nice(int inc);
+
 extern unsigned int alarm(unsigned int seconds);
 
 extern void *sbrk(intptr_t increment);
@@ -78,13 +78,20 @@ static char * modules[] = {
 	"PACKETFS.KO", // 15
 	"SND.KO",      // 16
 	"AC97.KO",     // 17
-	"NET.KO",      // 18
-	"PCNET.KO",    // 19
-	"RTL.KO",      // 20
-	"E1000.KO",    // 21
-	"PCSPKR.KO",   // 22
-	"PORTIO.KO",   // 23
-	"TARFS.KO",    // 24
+	"HDA.KO",      // 18
+	"NET.KO",      // 19
+	"PCNET.KO",    // 20
+	"RTL.KO",      // 21
+	"E1000.KO",    // 22
+	"PCSPKR.KO",   // 23
+	"PORTIO.KO",   // 24
+	"TARFS.KO",    // 25
+	"VIRTIO.KO",   // 26
+	"VIOBLK.KO",   // 27
+	"VIONET.KO",   // 28
+	"AHCI.KO",     // 29
+	"USBUHCI.KO",  // 30
+	"USBMSD.KO",   // 31
 	0
 };
 
@@ -289,13 +296,15 @@ int kmain() {
 	if (!_sound) {
 		modules[16] = "NONE";
 		modules[17] = "NONE";
+		modules[18] = "NONE";
 	}
 
 	if (!_net) {
-		modules[18] = "NONE";
 		modules[19] = "NONE";
 		modules[20] = "NONE";
 		modules[21] = "NONE";
+		modules[22] = "NONE";
+		modules[28] = "NONE";
 	}
 
 	boot();
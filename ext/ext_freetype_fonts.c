@@ -9,6 +9,9 @@
 #include <toaru/yutani.h>
 #include <toaru/graphics.h>
 #include <toaru/decodeutf8.h>
+#include <toaru/glyphcache.h>
+
+#include <stddef.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -39,12 +42,16 @@ static int fallbacks[] = {FONT_JAPANESE, FONT_SYMBOLA, -1};
 
 #define SGFX(CTX,x,y,WIDTH) *((uint32_t *)&CTX[((WIDTH) * (y) + (x)) * 4])
 
-static void _load_font(int i, char * name) {
+static struct glyphcache * caches[FONTS_TOTAL];
+static struct glyphcache_glyph * scratch = NULL;
+static size_t scratch_size = 0;
+
+static void _load_font(int i, char * ident) {
 	uint8_t * font;
 	size_t s = 0;
 	int error;
 	char tmp[100];
-	snprintf(tmp, 100, "sys.%s%s", SERVER_NAME, name);
+	snprintf(tmp, 100, "sys.%s.fonts.%s", SERVER_NAME, ident);
 
 	font = (void*)syscall_shm_obtain(tmp, &s);
 	error = FT_New_Memory_Face(library, font, s, 0, &faces[i]);
@@ -55,6 +62,13 @@ static void _load_font(int i, char * name) {
 	if (error) {
 		fprintf(stderr, "[freetype backend] encountered error\n");
 	}
+
+	GLYPHCACHE_SHMKEY(SERVER_NAME, tmp, 100, ident);
+	s = GLYPHCACHE_SIZE;
+	caches[i] = (void*)syscall_shm_obtain(tmp, &s);
+	if (s < GLYPHCACHE_SIZE) {
+		caches[i] = NULL;
+	}
 }
 
 static void _load_font_f(int i, char * path) {
@@ -70,14 +84,14 @@ static void _load_font_f(int i, char * path) {
 }
 
 static void _load_fonts() {
-	_load_font(FONT_SANS_SERIF,             ".fonts.sans-serif");
-	_load_font(FONT_SANS_SERIF_BOLD,        ".fonts.sans-serif.bold");
-	_load_font(FONT_SANS_SERIF_ITALIC,      ".fonts.sans-serif.italic");
-	_load_font(FONT_SANS_SERIF_BOLD_ITALIC, ".fonts.sans-serif.bolditalic");
-	_load_font(FONT_MONOSPACE,              ".fonts.monospace");
-	_load_font(FONT_MONOSPACE_BOLD,         ".fonts.monospace.bold");
-	_load_font(FONT_MONOSPACE_ITALIC,       ".fonts.monospace.italic");
-	_load_font(FONT_MONOSPACE_BOLD_ITALIC,  ".fonts.monospace.bolditalic");
+	_load_font(FONT_SANS_SERIF,             "sans-serif");
+	_load_font(FONT_SANS_SERIF_BOLD,        "sans-serif.bold");
+	_load_font(FONT_SANS_SERIF_ITALIC,      "sans-serif.italic");
+	_load_font(FONT_SANS_SERIF_BOLD_ITALIC, "sans-serif.bolditalic");
+	_load_font(FONT_MONOSPACE,              "monospace");
+	_load_font(FONT_MONOSPACE_BOLD,         "monospace.bold");
+	_load_font(FONT_MONOSPACE_ITALIC,       "monospace.italic");
+	_load_font(FONT_MONOSPACE_BOLD_ITALIC,  "monospace.bolditalic");
 	_load_font_f(FONT_JAPANESE, "/usr/share/fonts/VLGothic.ttf");
 	_load_font_f(FONT_SYMBOLA, "/usr/share/fonts/Symbola.ttf");
 }
@@ -93,73 +107,132 @@ void freetype_set_font_size(int size) {
 	}
 }
 
-static void draw_char(FT_Bitmap * bitmap, int x, int y, uint32_t fg, gfx_context_t * ctx) {
-	int i, j, p, q;
-	int x_max = x + bitmap->width;
-	int y_max = y + bitmap->rows;
-	for (j = y, q = 0; j < y_max; j++, q++) {
-		if (j < 0 || j >= ctx->height) continue;
-		for ( i = x, p = 0; i < x_max; i++, p++) {
-			uint32_t a = _ALP(fg);
-			a = (a * bitmap->buffer[q * bitmap->width + p]) / 255;
-			uint32_t tmp = premultiply(rgba(_RED(fg),_GRE(fg),_BLU(fg),a));
-			if (i < 0 || i >= ctx->width) continue;
-			SGFX(ctx->backbuffer,i,j,ctx->width) = alpha_blend_rgba(SGFX(ctx->backbuffer,i,j,ctx->width),tmp);
+static int _render_glyph(FT_Face face, FT_UInt glyph_index, uint32_t o) {
+	int error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT);
+	if (error) {
+		fprintf(stderr, "Error loading glyph for '%lu'\n", o);
+		return 1;
+	}
+	slot = face->glyph;
+	if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+		error = FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL);
+		if (error) {
+			fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
+			return 1;
 		}
 	}
+	return 0;
 }
 
-void freetype_draw_char(gfx_context_t * ctx, int x, int y, uint32_t fg, uint32_t o) {
-	int pen_x = x, pen_y = y;
-	int error;
-	slot = faces[selected_face]->glyph;
-	FT_UInt glyph_index;
-
-	glyph_index = FT_Get_Char_Index( faces[selected_face], o);
+/* Rasterize a codepoint from the selected face, or the first fallback that has it */
+static FT_GlyphSlot _load_glyph(uint32_t o) {
+	FT_UInt glyph_index = FT_Get_Char_Index(faces[selected_face], o);
 	if (glyph_index) {
-		error = FT_Load_Glyph(faces[selected_face], glyph_index, FT_LOAD_DEFAULT);
-		if (error) {
-			fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-			return;
-		}
-		slot = (faces[selected_face])->glyph;
-		if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-			error = FT_Render_Glyph((faces[selected_face])->glyph, FT_RENDER_MODE_NORMAL);
-			if (error) {
-				fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-				return;
-			}
-		}
+		if (_render_glyph(faces[selected_face], glyph_index, o)) return NULL;
 	} else {
 		int i = 0;
 		while (!glyph_index && fallbacks[i] != -1) {
 			int fallback = fallbacks[i++];
-			glyph_index = FT_Get_Char_Index( faces[fallback], o);
-			error = FT_Load_Glyph(faces[fallback], glyph_index, FT_LOAD_DEFAULT);
-			if (error) {
-				fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-				return;
-			}
-			slot = (faces[fallback])->glyph;
-			if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-				error = FT_Render_Glyph((faces[fallback])->glyph, FT_RENDER_MODE_NORMAL);
-				if (error) {
-					fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-					return;
-				}
-			}
+			glyph_index = FT_Get_Char_Index(faces[fallback], o);
+			if (_render_glyph(faces[fallback], glyph_index, o)) return NULL;
+		}
+	}
+	return slot;
+}
+
+/*
+ * Find a rendered glyph in the selected face's shared cache, or render
+ * it and add it there. Glyphs that can't be shared - no cache for this
+ * face, or the cache is full - are rendered into a scratch buffer that
+ * is only good until the next call.
+ */
+static struct glyphcache_glyph * get_glyph(uint32_t o) {
+	struct glyphcache * cache = caches[selected_face];
+	uint32_t key = GLYPHCACHE_KEY(_font_size, o);
+	uint32_t h = (key * 2654435761U) & (GLYPHCACHE_SLOTS - 1);
+	int probes = 0;
+
+	if (cache) {
+		for (; probes < GLYPHCACHE_SLOTS; ++probes) {
+			uint32_t offset = cache->slots[h];
+			if (!offset) break;
+			struct glyphcache_glyph * glyph = (void*)((uint8_t*)cache + offset);
+			if (glyph->key == key) return glyph;
+			h = (h + 1) & (GLYPHCACHE_SLOTS - 1);
+		}
+	}
+
+	FT_GlyphSlot rendered = _load_glyph(o);
+	if (!rendered) return NULL;
+
+	FT_Bitmap * bitmap = &rendered->bitmap;
+	size_t size = (sizeof(struct glyphcache_glyph) + bitmap->width * bitmap->rows + 3) & ~3;
+
+	struct glyphcache_glyph * glyph = NULL;
+	uint32_t offset = 0;
+	if (cache && probes < GLYPHCACHE_SLOTS && cache->used < GLYPHCACHE_SIZE) {
+		uint32_t at = __sync_fetch_and_add(&cache->used, size);
+		offset = offsetof(struct glyphcache, arena) + at;
+		if (offset + size <= GLYPHCACHE_SIZE && offset + size > offset) {
+			glyph = (void*)((uint8_t*)cache + offset);
 		}
+	}
+	if (!glyph) {
+		if (scratch_size < size) {
+			scratch = realloc(scratch, size);
+			scratch_size = size;
+		}
+		glyph = scratch;
+	}
 
+	glyph->key = key;
+	glyph->left = rendered->bitmap_left;
+	glyph->top = rendered->bitmap_top;
+	glyph->advance_x = rendered->advance.x >> 6;
+	glyph->advance_y = rendered->advance.y >> 6;
+	glyph->width = bitmap->width;
+	glyph->rows = bitmap->rows;
+	for (unsigned int y = 0; y < bitmap->rows; ++y) {
+		memcpy(&glyph->bitmap[y * bitmap->width], &bitmap->buffer[y * bitmap->pitch], bitmap->width);
 	}
 
-	draw_char(&slot->bitmap, pen_x + slot->bitmap_left, pen_y - slot->bitmap_top, fg, ctx);
+	if (glyph == scratch) return glyph;
 
+	/* Publish it; if someone else got there first, theirs wins and ours is left unused */
+	for (; probes < GLYPHCACHE_SLOTS; ++probes) {
+		if (__sync_bool_compare_and_swap(&cache->slots[h], 0, offset)) break;
+		struct glyphcache_glyph * other = (void*)((uint8_t*)cache + cache->slots[h]);
+		if (other->key == key) return other;
+		h = (h + 1) & (GLYPHCACHE_SLOTS - 1);
+	}
+	return glyph;
+}
+
+static void draw_char(struct glyphcache_glyph * glyph, int x, int y, uint32_t fg, gfx_context_t * ctx) {
+	int i, j, p, q;
+	int x_max = x + glyph->width;
+	int y_max = y + glyph->rows;
+	for (j = y, q = 0; j < y_max; j++, q++) {
+		if (j < 0 || j >= ctx->height) continue;
+		for ( i = x, p = 0; i < x_max; i++, p++) {
+			uint32_t a = _ALP(fg);
+			a = (a * glyph->bitmap[q * glyph->width + p]) / 255;
+			uint32_t tmp = premultiply(rgba(_RED(fg),_GRE(fg),_BLU(fg),a));
+			if (i < 0 || i >= ctx->width) continue;
+			SGFX(ctx->backbuffer,i,j,ctx->width) = alpha_blend_rgba(SGFX(ctx->backbuffer,i,j,ctx->width),tmp);
+		}
+	}
+}
+
+void freetype_draw_char(gfx_context_t * ctx, int x, int y, uint32_t fg, uint32_t o) {
+	struct glyphcache_glyph * glyph = get_glyph(o);
+	if (!glyph) return;
+
+	draw_char(glyph, x + glyph->left, y - glyph->top, fg, ctx);
 }
 
 int freetype_draw_string(gfx_context_t * ctx, int x, int y, uint32_t fg, char * string) {
-	slot = faces[selected_face]->glyph;
 	int pen_x = x, pen_y = y;
-	int error;
 
 	uint8_t * s = (uint8_t *)string;
 
@@ -182,56 +255,18 @@ int freetype_draw_string(gfx_context_t * ctx, int x, int y, uint32_t fg, char *
 finished:
 		if (!o) continue;
 
-		FT_UInt glyph_index;
-
-		glyph_index = FT_Get_Char_Index( faces[selected_face], o);
-		if (glyph_index) {
-			error = FT_Load_Glyph(faces[selected_face], glyph_index, FT_LOAD_DEFAULT);
-			if (error) {
-				fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-				continue;
-			}
-			slot = (faces[selected_face])->glyph;
-			if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-				error = FT_Render_Glyph((faces[selected_face])->glyph, FT_RENDER_MODE_NORMAL);
-				if (error) {
-					fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-					continue;
-				}
-			}
-		} else {
-			int i = 0;
-			while (!glyph_index && fallbacks[i] != -1) {
-				int fallback = fallbacks[i++];
-				glyph_index = FT_Get_Char_Index( faces[fallback], o);
-				error = FT_Load_Glyph(faces[fallback], glyph_index, FT_LOAD_DEFAULT);
-				if (error) {
-					fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-					continue;
-				}
-				slot = (faces[fallback])->glyph;
-				if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-					error = FT_Render_Glyph((faces[fallback])->glyph, FT_RENDER_MODE_NORMAL);
-					if (error) {
-						fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-						continue;
-					}
-				}
-			}
-
-		}
+		struct glyphcache_glyph * glyph = get_glyph(o);
+		if (!glyph) continue;
 
-		draw_char(&slot->bitmap, pen_x + slot->bitmap_left, pen_y - slot->bitmap_top, fg, ctx);
-		pen_x += slot->advance.x >> 6;
-		pen_y += slot->advance.y >> 6;
+		draw_char(glyph, pen_x + glyph->left, pen_y - glyph->top, fg, ctx);
+		pen_x += glyph->advance_x;
+		pen_y += glyph->advance_y;
 	}
 	return pen_x - x;
 }
 
 int freetype_draw_string_width(char * string) {
-	slot = faces[selected_face]->glyph;
 	int pen_x = 0;
-	int error;
 
 	uint8_t * s = (uint8_t *)string;
 
@@ -254,30 +289,10 @@ int freetype_draw_string_width(char * string) {
 finished_width:
 		if (!o) continue;
 
-		FT_UInt glyph_index;
+		struct glyphcache_glyph * glyph = get_glyph(o);
+		if (!glyph) continue;
 
-		glyph_index = FT_Get_Char_Index( faces[selected_face], o);
-		if (glyph_index) {
-			error = FT_Load_Glyph(faces[selected_face], glyph_index, FT_LOAD_DEFAULT);
-			if (error) {
-				fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-				continue;
-			}
-			slot = (faces[selected_face])->glyph;
-		} else {
-			int i = 0;
-			while (!glyph_index && fallbacks[i] != -1) {
-				int fallback = fallbacks[i++];
-				glyph_index = FT_Get_Char_Index( faces[fallback], o);
-				error = FT_Load_Glyph(faces[fallback], glyph_index, FT_LOAD_DEFAULT);
-				if (error) {
-					fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-					continue;
-				}
-				slot = (faces[fallback])->glyph;
-			}
-		}
-		pen_x += slot->advance.x >> 6;
+		pen_x += glyph->advance_x;
 	}
 	return pen_x;
 }
@@ -0,0 +1,194 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * ACPI processor discovery
+ *
+ * Finds the RSDP, walks the RSDT to the MADT, and records the local
+ * APIC of every enabled processor along with the I/O APICs. The MCFG,
+ * if there is one, gives where PCI configuration space is mapped. This
+ * runs before paging is enabled, while the tables can be read
+ * straight out of physical memory wherever the firmware put them.
+ *
+ * Only the bootstrap processor runs anything. Bringing up the others
+ * needs the scheduler, the spin locks and the interrupt paths to stop
+ * assuming a single CPU first; this is the table side of that work.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+
+struct rsdp {
+	char     signature[8];
+	uint8_t  checksum;
+	char     oem[6];
+	uint8_t  revision;
+	uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+	char     signature[4];
+	uint32_t length;
+	uint8_t  revision;
+	uint8_t  checksum;
+	char     oem[6];
+	char     oem_table[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+struct madt {
+	struct acpi_header header;
+	uint32_t lapic_address;
+	uint32_t flags;
+	uint8_t  entries[];
+} __attribute__((packed));
+
+struct mcfg_entry {
+	uint64_t base;
+	uint16_t segment;
+	uint8_t  start_bus;
+	uint8_t  end_bus;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct mcfg {
+	struct acpi_header header;
+	uint64_t reserved;
+	struct mcfg_entry entries[];
+} __attribute__((packed));
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_LAPIC_OVERRIDE 5
+
+#define LAPIC_ENABLED        0x01
+#define LAPIC_ONLINE_CAPABLE 0x02
+
+int processor_count = 1;
+uint8_t processor_apic_ids[MAX_PROCESSORS] = { 0 };
+int ioapic_count = 0;
+uintptr_t ioapic_addresses[MAX_IOAPICS] = { 0 };
+uintptr_t lapic_address = 0;
+uintptr_t pci_ecam_address = 0;
+uint8_t pci_ecam_start_bus = 0;
+uint8_t pci_ecam_end_bus = 0;
+
+static int acpi_checksum(void * start, size_t length) {
+	uint8_t sum = 0;
+	for (uint8_t * c = start; c < (uint8_t *)start + length; ++c) {
+		sum += *c;
+	}
+	return sum == 0;
+}
+
+static struct rsdp * rsdp_scan(uintptr_t start, uintptr_t end) {
+	for (uintptr_t p = start; p + sizeof(struct rsdp) <= end; p += 16) {
+		struct rsdp * r = (struct rsdp *)p;
+		if (!memcmp(r->signature, "RSD PTR ", 8) && acpi_checksum(r, sizeof(struct rsdp))) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Read a word of the BIOS data area. The compiler sees a pointer to a
+ * small constant address as out of bounds, so it gets the address
+ * through an empty asm instead (which also keeps the read explicit).
+ */
+static uint16_t bda_read16(uintptr_t address) {
+	volatile uint16_t * p;
+	asm ("" : "=r" (p) : "0" (address));
+	return *p;
+}
+
+static struct rsdp * rsdp_find(void) {
+	/* The first KB of the EBDA, then the BIOS area below 1MB */
+	uintptr_t ebda = (uintptr_t)bda_read16(0x40E) << 4;
+	struct rsdp * r = NULL;
+	if (ebda >= 0x80000 && ebda < 0xA0000) {
+		r = rsdp_scan(ebda, ebda + 1024);
+	}
+	if (!r) {
+		r = rsdp_scan(0xE0000, 0x100000);
+	}
+	return r;
+}
+
+static void madt_parse(struct madt * madt) {
+	int count = 0;
+	lapic_address = madt->lapic_address;
+
+	uint8_t * entry = madt->entries;
+	uint8_t * end = (uint8_t *)madt + madt->header.length;
+	while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+		switch (entry[0]) {
+			case MADT_LAPIC:
+				/* acpi id, apic id, flags */
+				if ((entry[4] & (LAPIC_ENABLED | LAPIC_ONLINE_CAPABLE)) && count < MAX_PROCESSORS) {
+					processor_apic_ids[count++] = entry[3];
+				}
+				break;
+			case MADT_IOAPIC:
+				if (ioapic_count < MAX_IOAPICS) {
+					ioapic_addresses[ioapic_count++] = *(uint32_t *)(entry + 4);
+				}
+				break;
+			case MADT_LAPIC_OVERRIDE:
+				if (!*(uint32_t *)(entry + 8)) {
+					lapic_address = *(uint32_t *)(entry + 4);
+				}
+				break;
+		}
+		entry += entry[1];
+	}
+
+	if (count) processor_count = count;
+}
+
+static void mcfg_parse(struct mcfg * mcfg) {
+	size_t count = (mcfg->header.length - sizeof(struct mcfg)) / sizeof(struct mcfg_entry);
+	for (size_t i = 0; i < count; ++i) {
+		struct mcfg_entry * e = &mcfg->entries[i];
+		/* Only the first segment is scanned, and it has to be somewhere we can map */
+		if (e->segment != 0 || e->base >= 0x100000000ULL || e->start_bus > e->end_bus) continue;
+		pci_ecam_address = (uintptr_t)e->base;
+		pci_ecam_start_bus = e->start_bus;
+		pci_ecam_end_bus = e->end_bus;
+		debug_print(NOTICE, "PCI configuration space for buses %d-%d at 0x%x",
+			e->start_bus, e->end_bus, pci_ecam_address);
+		return;
+	}
+}
+
+void acpi_install(void) {
+	struct rsdp * rsdp = rsdp_find();
+	if (!rsdp) {
+		debug_print(NOTICE, "No ACPI tables; assuming one processor.");
+		return;
+	}
+
+	struct acpi_header * rsdt = (struct acpi_header *)rsdp->rsdt_address;
+	if (memcmp(rsdt->signature, "RSDT", 4) || !acpi_checksum(rsdt, rsdt->length)) {
+		debug_print(WARNING, "Bad RSDT at 0x%x", rsdp->rsdt_address);
+		return;
+	}
+
+	uint32_t * tables = (uint32_t *)(rsdt + 1);
+	size_t table_count = (rsdt->length - sizeof(struct acpi_header)) / sizeof(uint32_t);
+	for (size_t i = 0; i < table_count; ++i) {
+		struct acpi_header * table = (struct acpi_header *)tables[i];
+		if (!acpi_checksum(table, table->length)) continue;
+		if (!memcmp(table->signature, "APIC", 4)) {
+			madt_parse((struct madt *)table);
+		} else if (!memcmp(table->signature, "MCFG", 4)) {
+			mcfg_parse((struct mcfg *)table);
+		}
+	}
+
+	debug_print(NOTICE, "%d processor%s, local APIC at 0x%x, %d I/O APIC%s",
+		processor_count, processor_count == 1 ? "" : "s", lapic_address,
+		ioapic_count, ioapic_count == 1 ? "" : "s");
+}
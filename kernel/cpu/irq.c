@@ -9,6 +9,7 @@
  */
 #include <kernel/system.h>
 #include <kernel/logging.h>
+#include <kernel/random.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
 #include <kernel/args.h>
@@ -174,6 +175,7 @@ void irq_handler(struct regs *r) {
 	/* Disable interrupts when handling */
 	int_disable();
 	if (r->int_no <= 47 && r->int_no >= 32) {
+		random_add_interrupt(r->int_no - 32);
 		for (size_t i = 0; i < IRQ_CHAIN_DEPTH; i++) {
 			irq_handler_chain_t handler = irq_routines[i * IRQ_CHAIN_SIZE + (r->int_no - 32)];
 			if (!handler) break;
@@ -12,15 +12,38 @@
  * for the current process will be loaded or the FPU
  * will be reset for the new process.
  *
+ * Threads that have used the FPU on each of their last few
+ * quanta are assumed to want it again, and get their context
+ * loaded as they are switched in rather than taking the trap.
+ * The count wraps, which puts them back through the trap now
+ * and then to see if they still do.
+ *
+ * With XSAVE, the save area covers every state component
+ * enabled in XCR0 (x87, SSE and, where there is one, AVX), so
+ * its size is only known once the processor has been asked;
+ * each thread's is allocated when it first uses the FPU.
+ *
  * FPU states are per kernel thread.
  *
  */
 #include <kernel/system.h>
 #include <kernel/logging.h>
 
-#define NO_LAZY_FPU
+#define FPU_EAGER_AFTER 5 /* Consecutive quanta using the FPU before it is loaded eagerly */
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+process_t * fpu_thread = NULL; /* Whose context is in the FPU */
 
-process_t * fpu_thread = NULL;
+static size_t fpu_state_size = 512;
+static int fpu_xsave = 0;
+static int fpu_xsaveopt = 0;
+
+static void cpuid(uint32_t leaf, uint32_t sub, uint32_t * a, uint32_t * b, uint32_t * c, uint32_t * d) {
+	asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
 
 /**
  * Set the FPU control word
@@ -59,84 +82,172 @@ void disable_fpu(void) {
 	asm volatile ("mov %0, %%cr0" :: "r"(t));
 }
 
-/* Temporary aligned buffer for copying around FPU contexts */
-uint8_t saves[512] __attribute__((aligned(16)));
+static int fpu_disabled(void) {
+	size_t t;
+	asm volatile ("mov %%cr0, %0" : "=r"(t));
+	return !!(t & (1 << 3));
+}
 
 /**
  * Restore the FPU for a process
  */
 void restore_fpu(process_t * proc) {
-	memcpy(&saves,(uint8_t *)&proc->thread.fp_regs,512);
-	asm volatile ("fxrstor (%0)" :: "r"(saves));
+	if (fpu_xsave) {
+		asm volatile ("xrstor (%0)" :: "r"(proc->thread.fpu_state), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	} else {
+		asm volatile ("fxrstor (%0)" :: "r"(proc->thread.fpu_state) : "memory");
+	}
 }
 
 /**
  * Save the FPU for a process
  */
 void save_fpu(process_t * proc) {
-	asm volatile ("fxsave (%0)" :: "r"(saves));
-	memcpy((uint8_t *)&proc->thread.fp_regs,&saves,512);
+	if (fpu_xsaveopt) {
+		asm volatile ("xsaveopt (%0)" :: "r"(proc->thread.fpu_state), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	} else if (fpu_xsave) {
+		asm volatile ("xsave (%0)" :: "r"(proc->thread.fpu_state), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	} else {
+		asm volatile ("fxsave (%0)" :: "r"(proc->thread.fpu_state) : "memory");
+	}
 }
 
 /**
- * Initialize the FPU
+ * Give a thread a save area, 64-byte aligned as XSAVE wants.
  */
-void init_fpu(void) {
-	asm volatile ("fninit");
+static void alloc_fpu_state(process_t * proc) {
+	proc->thread.fpu_alloc = malloc(fpu_state_size + 63);
+	proc->thread.fpu_state = (uint8_t *)(((uintptr_t)proc->thread.fpu_alloc + 63) & ~(uintptr_t)63);
 }
 
 /**
- * Kernel trap for FPU usage when FPU is disabled
+ * Initialize the FPU for a thread that hasn't used it yet.
+ *
+ * This is done by restoring a state with the default control
+ * words and, for XSAVE, every component marked as being in its
+ * initial configuration. Restoring (rather than fninit) also
+ * resets SSE state, and keeps XSAVEOPT's idea of which area was
+ * last loaded correct.
  */
-void invalid_op(struct regs * r) {
-	/* First, turn the FPU on */
-	enable_fpu();
-	if (fpu_thread == current_process) {
-		/* If this is the thread that last used the FPU, do nothing */
-		return;
-	}
+static void init_fpu(process_t * proc) {
+	alloc_fpu_state(proc);
+	memset(proc->thread.fpu_state, 0, fpu_state_size);
+	*(uint16_t *)&proc->thread.fpu_state[0]  = 0x037F; /* FCW */
+	*(uint32_t *)&proc->thread.fpu_state[24] = 0x1F80; /* MXCSR */
+	restore_fpu(proc);
+}
+
+/**
+ * Take the FPU for the current thread if it doesn't have it already.
+ */
+static void claim_fpu(void) {
+	process_t * proc = (process_t *)current_process;
+	if (fpu_thread == proc) return;
 	if (fpu_thread) {
 		/* If there is a thread that was using the FPU, save its state */
 		save_fpu(fpu_thread);
 	}
-	fpu_thread = (process_t *)current_process;
-	if (!fpu_thread->thread.fpu_enabled) {
-		/*
-		 * If the FPU has not been used in this thread previously,
-		 * we need to initialize it.
-		 */
-		init_fpu();
-		fpu_thread->thread.fpu_enabled = 1;
-		return;
+	fpu_thread = proc;
+	if (!proc->thread.fpu_state) {
+		init_fpu(proc);
+	} else {
+		restore_fpu(proc);
 	}
-	/* Otherwise we restore the context for this thread. */
-	restore_fpu(fpu_thread);
+}
+
+/**
+ * Kernel trap for FPU usage when FPU is disabled
+ */
+void invalid_op(struct regs * r) {
+	/* First, turn the FPU on */
+	asm volatile ("clts");
+	claim_fpu();
+	current_process->thread.fpu_counter++;
 }
 
 /* Called during a context switch; disable the FPU */
 void switch_fpu(void) {
-#ifdef NO_LAZY_FPU
-	save_fpu((process_t *)current_process);
-#else
+	if (fpu_disabled()) {
+		/* Didn't touch it this time around */
+		current_process->thread.fpu_counter = 0;
+	}
 	disable_fpu();
-#endif
 }
 
+/* Called as a thread is switched in */
 void unswitch_fpu(void) {
-#ifdef NO_LAZY_FPU
-	restore_fpu((process_t *)current_process);
-#endif
+	if (fpu_thread == current_process) {
+		/* Still holding our context from last time */
+		asm volatile ("clts");
+	} else if (current_process->thread.fpu_counter > FPU_EAGER_AFTER) {
+		asm volatile ("clts");
+		claim_fpu();
+		current_process->thread.fpu_counter++;
+	}
+}
+
+/**
+ * Give a new process a copy of its parent's FPU context.
+ */
+void fpu_fork(process_t * parent, process_t * child) {
+	child->thread.fpu_counter = 0;
+	if (!parent->thread.fpu_state) return;
+	if (fpu_thread == parent) {
+		/* The registers are newer than the save area */
+		asm volatile ("clts");
+		save_fpu(parent);
+	}
+	alloc_fpu_state(child);
+	memcpy(child->thread.fpu_state, parent->thread.fpu_state, fpu_state_size);
+}
+
+/**
+ * Forget a process that is going away.
+ */
+void fpu_release(process_t * proc) {
+	if (fpu_thread == proc) {
+		fpu_thread = NULL;
+	}
+	free(proc->thread.fpu_alloc);
+	proc->thread.fpu_alloc = NULL;
+	proc->thread.fpu_state = NULL;
+}
+
+/*
+ * Turn on XSAVE, with every state component we know how to
+ * handle that the processor has, and size the save area.
+ */
+static void xsave_install(void) {
+	uint32_t a, b, c, d;
+	cpuid(1, 0, &a, &b, &c, &d);
+	if (!(c & (1 << 26))) return;
+
+	size_t t;
+	asm volatile ("mov %%cr4, %0" : "=r"(t));
+	t |= 1 << 18; /* OSXSAVE */
+	asm volatile ("mov %0, %%cr4" :: "r"(t));
+
+	uint32_t xcr0 = XCR0_X87 | XCR0_SSE;
+	if (c & (1 << 28)) {
+		xcr0 |= XCR0_AVX;
+	}
+	asm volatile ("xsetbv" :: "c"(0), "a"(xcr0), "d"(0));
+
+	/* With XCR0 set, EBX is the area size for what it enables */
+	cpuid(0xD, 0, &a, &b, &c, &d);
+	fpu_state_size = b;
+	fpu_xsave = 1;
+
+	cpuid(0xD, 1, &a, &b, &c, &d);
+	fpu_xsaveopt = a & 1;
+
+	debug_print(NOTICE, "fpu: xsave%s, %d byte contexts%s", fpu_xsaveopt ? "opt" : "", fpu_state_size, (xcr0 & XCR0_AVX) ? ", AVX enabled" : "");
 }
 
 /* Enable the FPU context handling */
 void fpu_install(void) {
-#ifdef NO_LAZY_FPU
-	enable_fpu();
-	init_fpu();
-	save_fpu((void*)current_process);
-#else
 	enable_fpu();
+	xsave_install();
 	disable_fpu();
 	isrs_install_handler(7, &invalid_op);
-#endif
 }
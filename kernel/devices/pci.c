@@ -4,18 +4,76 @@
  * Copyright (C) 2011-2018 K. Lange
  *
  * ToAruOS PCI Initialization
+ *
+ * The buses are walked once, at boot, into a table of devices;
+ * pci_scan() and friends answer from that, through chains linking
+ * devices of the same type and of the same vendor. Configuration
+ * space is accessed through the ECAM window when ACPI provides one,
+ * and through the legacy ports otherwise.
  */
 
 #include <kernel/system.h>
 #include <kernel/pci.h>
 #include <kernel/logging.h>
 
+#define PCI_HASH_SIZE 32
+#define PCI_HASH(x) (((x) ^ ((x) >> 5) ^ ((x) >> 10)) & (PCI_HASH_SIZE - 1))
+#define PCI_END 0xFFFF
+
+struct pci_device_entry {
+	uint32_t device;
+	uint16_t vendor_id;
+	uint16_t device_id;
+	uint16_t type;
+	uint16_t next_type;   /* Next entry in this type's hash chain */
+	uint16_t next_vendor; /* Next entry in this vendor's hash chain */
+};
+
+static struct pci_device_entry * pci_devices = NULL;
+static size_t pci_device_count = 0;
+static size_t pci_device_space = 0;
+static uint16_t pci_type_heads[PCI_HASH_SIZE];
+static uint16_t pci_vendor_heads[PCI_HASH_SIZE];
+static int pci_enumerated = 0;
+
+static uint8_t * pci_ecam = NULL;
+
+static volatile void * pci_ecam_field(uint32_t device, int field) {
+	int bus = pci_extract_bus(device);
+	if (!pci_ecam || bus < pci_ecam_start_bus || bus > pci_ecam_end_bus) return NULL;
+	return pci_ecam + (bus << 20) + (pci_extract_slot(device) << 15) + (pci_extract_func(device) << 12) + field;
+}
+
 void pci_write_field(uint32_t device, int field, int size, uint32_t value) {
+	volatile void * ecam = pci_ecam_field(device, field);
+	if (ecam) {
+		if (size == 4) {
+			*(volatile uint32_t *)ecam = value;
+		} else if (size == 2) {
+			*(volatile uint16_t *)ecam = value;
+		} else if (size == 1) {
+			*(volatile uint8_t *)ecam = value;
+		}
+		return;
+	}
+
 	outportl(PCI_ADDRESS_PORT, pci_get_addr(device, field));
 	outportl(PCI_VALUE_PORT, value);
 }
 
 uint32_t pci_read_field(uint32_t device, int field, int size) {
+	volatile void * ecam = pci_ecam_field(device, field);
+	if (ecam) {
+		if (size == 4) {
+			return *(volatile uint32_t *)ecam;
+		} else if (size == 2) {
+			return *(volatile uint16_t *)ecam;
+		} else if (size == 1) {
+			return *(volatile uint8_t *)ecam;
+		}
+		return 0xFFFF;
+	}
+
 	outportl(PCI_ADDRESS_PORT, pci_get_addr(device, field));
 
 	if (size == 4) {
@@ -76,7 +134,8 @@ void pci_scan_bus(pci_func_t f, int type, int bus, void * extra) {
 	}
 }
 
-void pci_scan(pci_func_t f, int type, void * extra) {
+/* Walk the hardware, calling f for each function found */
+void pci_scan_hardware(pci_func_t f, int type, void * extra) {
 
 	if ((pci_read_field(0, PCI_HEADER_TYPE, 1) & 0x80) == 0) {
 		pci_scan_bus(f,type,0,extra);
@@ -93,15 +152,72 @@ void pci_scan(pci_func_t f, int type, void * extra) {
 	}
 }
 
+static void pci_record(uint32_t device, uint16_t vendor_id, uint16_t device_id, void * extra) {
+	if (pci_device_count == pci_device_space) {
+		pci_device_space = pci_device_space ? pci_device_space * 2 : 32;
+		pci_devices = realloc(pci_devices, sizeof(struct pci_device_entry) * pci_device_space);
+	}
+	struct pci_device_entry * e = &pci_devices[pci_device_count++];
+	e->device = device;
+	e->vendor_id = vendor_id;
+	e->device_id = device_id;
+	e->type = pci_find_type(device);
+}
+
+static void pci_enumerate(void) {
+	pci_enumerated = 1;
+	pci_scan_hardware(&pci_record, -1, NULL);
+
+	/* Built back to front, so each chain is in the order the devices were found */
+	memset(pci_type_heads, 0xFF, sizeof(pci_type_heads));
+	memset(pci_vendor_heads, 0xFF, sizeof(pci_vendor_heads));
+	for (size_t i = pci_device_count; i > 0; --i) {
+		struct pci_device_entry * e = &pci_devices[i-1];
+		e->next_type = pci_type_heads[PCI_HASH(e->type)];
+		pci_type_heads[PCI_HASH(e->type)] = i-1;
+		e->next_vendor = pci_vendor_heads[PCI_HASH(e->vendor_id)];
+		pci_vendor_heads[PCI_HASH(e->vendor_id)] = i-1;
+	}
+
+	debug_print(NOTICE, "%d PCI functions", pci_device_count);
+}
+
+void pci_scan(pci_func_t f, int type, void * extra) {
+	if (!pci_enumerated) pci_enumerate();
+
+	if (type == -1) {
+		for (size_t i = 0; i < pci_device_count; ++i) {
+			f(pci_devices[i].device, pci_devices[i].vendor_id, pci_devices[i].device_id, extra);
+		}
+		return;
+	}
+
+	for (uint16_t i = pci_type_heads[PCI_HASH(type)]; i != PCI_END; i = pci_devices[i].next_type) {
+		if (pci_devices[i].type == type) {
+			f(pci_devices[i].device, pci_devices[i].vendor_id, pci_devices[i].device_id, extra);
+		}
+	}
+}
+
+void pci_scan_vendor(pci_func_t f, uint16_t vendor_id, void * extra) {
+	if (!pci_enumerated) pci_enumerate();
+
+	for (uint16_t i = pci_vendor_heads[PCI_HASH(vendor_id)]; i != PCI_END; i = pci_devices[i].next_vendor) {
+		if (pci_devices[i].vendor_id == vendor_id) {
+			f(pci_devices[i].device, pci_devices[i].vendor_id, pci_devices[i].device_id, extra);
+		}
+	}
+}
+
 static void find_isa_bridge(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
-	if (vendorid == 0x8086 && (deviceid == 0x7000 || deviceid == 0x7110)) {
+	if (deviceid == 0x7000 || deviceid == 0x7110) {
 		*((uint32_t *)extra) = device;
 	}
 }
 static uint32_t pci_isa = 0;
 static uint8_t pci_remaps[4] = {0};
 void pci_remap(void) {
-	pci_scan(&find_isa_bridge, -1, &pci_isa);
+	pci_scan_vendor(&find_isa_bridge, 0x8086, &pci_isa);
 	if (pci_isa) {
 		for (int i = 0; i < 4; ++i) {
 			pci_remaps[i] = pci_read_field(pci_isa, 0x60+i, 1);
@@ -115,6 +231,18 @@ void pci_remap(void) {
 	}
 }
 
+void pci_install(void) {
+	if (pci_ecam_address) {
+		size_t size = (pci_ecam_end_bus - pci_ecam_start_bus + 1) << 20;
+		uintptr_t base = pci_ecam_address + (pci_ecam_start_bus << 20);
+		map_device_memory(base, size, 0);
+		/* The window is addressed from bus 0, even if it starts further in */
+		pci_ecam = (uint8_t *)pci_ecam_address;
+	}
+	pci_enumerate();
+	pci_remap();
+}
+
 int pci_get_interrupt(uint32_t device) {
 
 	if (pci_isa) {
@@ -4,10 +4,26 @@
  * Copyright (C) 2011-2018 K. Lange
  *
  * Programmable Interrupt Timer
+ *
+ * Normally the PIT runs in rate generator mode at SUBTICKS_PER_TICK.
+ * When the idle task is about to halt, timer_idle() switches it to a
+ * one-shot countdown that ends at the next sleeper's wake time, so an
+ * idle system takes one interrupt per deadline (or per ~50ms, the
+ * longest the PIT can count) instead of one every millisecond.
+ * Whichever interrupt ends the halt, the clock is moved forward by
+ * the time that actually passed and the periodic rate is restored.
+ * Reprogramming the PIT throws away a partly counted subtick; those
+ * pieces are kept and added to the clock once they make a whole one.
+ *
+ * Every change to the clock is also written to the clock page, which
+ * userspace reads the time from without a syscall. The TSC rate it
+ * interpolates with is measured against the first quarter second of
+ * PIT interrupts.
  */
 #include <kernel/system.h>
 #include <kernel/logging.h>
 #include <kernel/process.h>
+#include <kernel/clockpage.h>
 
 #define PIT_A 0x40
 #define PIT_B 0x41
@@ -17,12 +33,19 @@
 #define PIT_MASK 0xFF
 #define PIT_SCALE 1193180
 #define PIT_SET 0x34
+#define PIT_ONESHOT 0x30
+#define PIT_LATCH 0x00
 
 #define TIMER_IRQ 0
 
-#define SUBTICKS_PER_TICK 1000
 #define RESYNC_TIME 1
 
+/* Subticks of PIT time to measure the TSC over; short enough that the low 32 bits can't wrap */
+#define TSC_CALIBRATE_SUBTICKS 250
+
+/* Largest count the PIT takes, in subticks */
+#define ONESHOT_MAX ((0xFFFF * SUBTICKS_PER_TICK) / PIT_SCALE)
+
 /*
  * Set the phase (in hertz) for the Programmable
  * Interrupt Timer (PIT).
@@ -47,24 +70,111 @@ signed long _timer_drift = 0;
 
 static int behind = 0;
 
+/* Subticks the current one-shot countdown covers, or 0 when periodic */
+static unsigned long oneshot_subticks = 0;
+static uint16_t oneshot_count = 0;
+
+/* PIT counts, times SUBTICKS_PER_TICK, not yet added to the clock */
+static uint32_t pit_pending = 0;
+
+static struct clock_page * clock_page = NULL;
+
+static int tsc_calibrate_started = 0;
+static uint32_t tsc_calibrate_start = 0;
+static unsigned long tsc_calibrate_subticks = 0;
+
+static uint64_t read_tsc(void) {
+	uint64_t tsc;
+	asm volatile ("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
+/* Publish the clock to userspace. Interrupts off. */
+static void clock_page_update(unsigned long subticks) {
+	if (!clock_page) return;
+	uint64_t tsc = read_tsc();
+
+	if (!clock_page->tsc_per_usec) {
+		if (!tsc_calibrate_started) {
+			tsc_calibrate_start = (uint32_t)tsc;
+			tsc_calibrate_started = 1;
+		} else {
+			tsc_calibrate_subticks += subticks;
+			if (tsc_calibrate_subticks >= TSC_CALIBRATE_SUBTICKS) {
+				clock_page->tsc_per_usec = ((uint32_t)tsc - tsc_calibrate_start) / (tsc_calibrate_subticks * 1000);
+			}
+		}
+	}
+
+	clock_page->seq++;
+	asm volatile ("" ::: "memory");
+	clock_page->drift    = timer_drift;
+	clock_page->ticks    = timer_ticks;
+	clock_page->subticks = timer_subticks;
+	clock_page->tsc_low  = (uint32_t)tsc;
+	clock_page->tsc_high = (uint32_t)(tsc >> 32);
+	asm volatile ("" ::: "memory");
+	clock_page->seq++;
+}
+
+/*
+ * Move the clock forward by some number of subticks
+ */
+static void timer_advance(unsigned long subticks) {
+	unsigned long advanced = subticks;
+	while (subticks--) {
+		if (++timer_subticks == SUBTICKS_PER_TICK || (behind && ++timer_subticks == SUBTICKS_PER_TICK)) {
+			timer_ticks++;
+			timer_subticks = 0;
+			if (timer_ticks % RESYNC_TIME == 0) {
+				uint32_t new_time = read_cmos();
+				_timer_drift = new_time - boot_time - timer_ticks;
+				if (_timer_drift > 0) behind = 1;
+				else behind = 0;
+			}
+		}
+	}
+	clock_page_update(advanced);
+}
+
+/*
+ * Turn PIT counts (and whatever was left over before) into whole
+ * subticks, keeping the rest for next time.
+ */
+static unsigned long pit_carry(uint32_t counts) {
+	uint32_t total = counts * SUBTICKS_PER_TICK + pit_pending;
+	pit_pending = total % PIT_SCALE;
+	return total / PIT_SCALE;
+}
+
 /*
  * IRQ handler for when the timer fires
  */
 int timer_handler(struct regs *r) {
-	if (++timer_subticks == SUBTICKS_PER_TICK || (behind && ++timer_subticks == SUBTICKS_PER_TICK)) {
-		timer_ticks++;
-		timer_subticks = 0;
-		if (timer_ticks % RESYNC_TIME == 0) {
-			uint32_t new_time = read_cmos();
-			_timer_drift = new_time - boot_time - timer_ticks;
-			if (_timer_drift > 0) behind = 1;
-			else behind = 0;
-		}
+	unsigned long elapsed = 1;
+	profile_sample(r);
+	if (oneshot_subticks) {
+		/* The idle countdown ran out */
+		elapsed = oneshot_subticks + pit_carry(0);
+		oneshot_subticks = 0;
+		timer_phase(SUBTICKS_PER_TICK);
 	}
+	timer_advance(elapsed);
 	irq_ack(TIMER_IRQ);
 
+	if (current_process) {
+		/* Charge the interrupted time to whoever was running */
+		if ((r->cs & 0x3) == 0x3) {
+			current_process->usage.user_time += elapsed;
+		} else {
+			current_process->usage.system_time += elapsed;
+		}
+	}
+
 	wakeup_sleepers(timer_ticks, timer_subticks);
-	switch_task(1);
+	if (process_tick()) {
+		switch_task(1);
+	}
 	return 1;
 }
 
@@ -78,12 +188,77 @@ void relative_time(unsigned long seconds, unsigned long subseconds, unsigned lon
 	}
 }
 
+/*
+ * Called by the idle task, with interrupts off, just before it halts.
+ * If nothing needs to wake up for a while, stop the periodic tick and
+ * count down to the next sleeper instead.
+ */
+void timer_idle(void) {
+	if (oneshot_subticks) return;
+
+	unsigned long seconds, subseconds;
+	unsigned long wait = ONESHOT_MAX;
+	if (next_sleeper(&seconds, &subseconds)) {
+		if (seconds < timer_ticks || (seconds == timer_ticks && subseconds <= timer_subticks)) return;
+		unsigned long until = (seconds - timer_ticks) * SUBTICKS_PER_TICK + subseconds - timer_subticks;
+		if (until < wait) wait = until;
+	}
+	if (wait < 2) return;
+
+	/* Keep what the periodic count had reached since its last tick */
+	uint16_t divisor = PIT_SCALE / SUBTICKS_PER_TICK;
+	outportb(PIT_CONTROL, PIT_LATCH);
+	uint16_t current = inportb(PIT_A);
+	current |= inportb(PIT_A) << 8;
+	if (current <= divisor) {
+		pit_pending += (uint32_t)(divisor - current) * SUBTICKS_PER_TICK;
+	}
+
+	oneshot_subticks = wait;
+	oneshot_count = (wait * PIT_SCALE) / SUBTICKS_PER_TICK;
+	outportb(PIT_CONTROL, PIT_ONESHOT);
+	outportb(PIT_A, oneshot_count & PIT_MASK);
+	outportb(PIT_A, (oneshot_count >> 8) & PIT_MASK);
+}
+
+/*
+ * Called by the idle task, with interrupts off, after the halt ends.
+ * If some other interrupt woke us before the countdown finished,
+ * account for the part of it that passed and go back to ticking.
+ */
+void timer_wake(void) {
+	if (!oneshot_subticks) return;
+
+	outportb(PIT_CONTROL, PIT_LATCH);
+	uint16_t remaining = inportb(PIT_A);
+	remaining |= inportb(PIT_A) << 8;
+
+	unsigned long elapsed;
+	if (remaining <= oneshot_count) {
+		elapsed = pit_carry(oneshot_count - remaining);
+	} else {
+		elapsed = oneshot_subticks + pit_carry(0);
+	}
+	oneshot_subticks = 0;
+	timer_phase(SUBTICKS_PER_TICK);
+	timer_advance(elapsed);
+}
+
 /*
  * Device installer for the PIT
  */
 void timer_install(void) {
 	debug_print(NOTICE,"Initializing interval timer");
 	boot_time = read_cmos();
+
+	/* The same frame, writable here and read-only at CLOCK_PAGE_ADDRESS for everyone */
+	uintptr_t physical;
+	clock_page = (struct clock_page *)kvmalloc_p(0x1000, &physical);
+	memset(clock_page, 0, 0x1000);
+	clock_page->boot_time = boot_time;
+	dma_frame(get_page(CLOCK_PAGE_ADDRESS, 1, kernel_directory), 0, 0, physical);
+	invalidate_tables_at(CLOCK_PAGE_ADDRESS);
+
 	irq_install_handler(TIMER_IRQ, timer_handler, "pit timer");
 	timer_phase(SUBTICKS_PER_TICK); /* 100Hz */
 }
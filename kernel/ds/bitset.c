@@ -4,6 +4,7 @@
  * Copyright (C) 2015-2018 K. Lange
  *               2015 Dale Weiler
  */
+#include <kernel/system.h>
 #include <kernel/bitset.h>
 
 #define CEIL(NUMBER, BASE) \
@@ -38,21 +39,32 @@ static void bitset_resize(bitset_t *set, size_t size) {
 void bitset_set(bitset_t *set, size_t bit) {
 	iom;
 	if (set->size <= index) {
-		bitset_resize(set, set->size << 1);
+		size_t size = set->size ? set->size : 1;
+		while (size <= index) size <<= 1;
+		bitset_resize(set, size);
 	}
 	set->data[index] |= mask;
 }
 
-int bitset_ffub(bitset_t *set) {
-	for (size_t i = 0; i < set->size * 8; i++) {
-		if (bitset_test(set, i)) {
+int bitset_ffub_from(bitset_t *set, size_t start) {
+	for (size_t index = start >> 3; index < set->size; index++) {
+		/* Skip full bytes whole */
+		if (set->data[index] == 0xFF) {
 			continue;
 		}
-		return (int)i;
+		for (size_t bit = (index == start >> 3) ? (start & 7) : 0; bit < 8; bit++) {
+			if (!(set->data[index] & (1 << bit))) {
+				return (int)(index * 8 + bit);
+			}
+		}
 	}
 	return -1;
 }
 
+int bitset_ffub(bitset_t *set) {
+	return bitset_ffub_from(set, 0);
+}
+
 void bitset_clear(bitset_t *set, size_t bit) {
 	iom;
 	set->data[index] &= ~mask;
@@ -35,18 +35,53 @@ size_t ring_buffer_available(ring_buffer_t * ring_buffer) {
 	}
 }
 
-static inline void ring_buffer_increment_read(ring_buffer_t * ring_buffer) {
-	ring_buffer->read_ptr++;
-	if (ring_buffer->read_ptr == ring_buffer->size) {
-		ring_buffer->read_ptr = 0;
+/* Contiguous bytes that can be read from read_ptr, before the end of the buffer */
+static inline size_t ring_buffer_read_span(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->read_ptr > ring_buffer->write_ptr) {
+		return ring_buffer->size - ring_buffer->read_ptr;
 	}
+	return ring_buffer->write_ptr - ring_buffer->read_ptr;
 }
 
-static inline void ring_buffer_increment_write(ring_buffer_t * ring_buffer) {
-	ring_buffer->write_ptr++;
-	if (ring_buffer->write_ptr == ring_buffer->size) {
-		ring_buffer->write_ptr = 0;
+/* Contiguous bytes that can be written at write_ptr */
+static inline size_t ring_buffer_write_span(ring_buffer_t * ring_buffer) {
+	size_t available = ring_buffer_available(ring_buffer);
+	size_t to_end = ring_buffer->size - ring_buffer->write_ptr;
+	return available < to_end ? available : to_end;
+}
+
+/* Take up to `size` bytes out, as at most two copies. Holding the lock. */
+static size_t ring_buffer_copy_out(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	size_t collected = 0;
+	while (collected < size) {
+		size_t span = ring_buffer_read_span(ring_buffer);
+		if (!span) break;
+		if (span > size - collected) span = size - collected;
+		memcpy(buffer + collected, ring_buffer->buffer + ring_buffer->read_ptr, span);
+		ring_buffer->read_ptr += span;
+		if (ring_buffer->read_ptr == ring_buffer->size) {
+			ring_buffer->read_ptr = 0;
+		}
+		collected += span;
+	}
+	return collected;
+}
+
+/* Put up to `size` bytes in, as at most two copies. Holding the lock. */
+static size_t ring_buffer_copy_in(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	size_t written = 0;
+	while (written < size) {
+		size_t span = ring_buffer_write_span(ring_buffer);
+		if (!span) break;
+		if (span > size - written) span = size - written;
+		memcpy(ring_buffer->buffer + ring_buffer->write_ptr, buffer + written, span);
+		ring_buffer->write_ptr += span;
+		if (ring_buffer->write_ptr == ring_buffer->size) {
+			ring_buffer->write_ptr = 0;
+		}
+		written += span;
 	}
+	return written;
 }
 
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
@@ -71,25 +106,25 @@ void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
 	list_insert(((process_t *)process)->node_waits, ring_buffer);
 }
 
+/*
+ * Readers wake writers, and writers readers (and anyone waiting in
+ * select), once for each time they move data, not per byte.
+ */
 size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
 	size_t collected = 0;
 	while (collected == 0) {
 		spin_lock(ring_buffer->lock);
-		while (ring_buffer_unread(ring_buffer) > 0 && collected < size) {
-			buffer[collected] = ring_buffer->buffer[ring_buffer->read_ptr];
-			ring_buffer_increment_read(ring_buffer);
-			collected++;
-		}
+		collected = ring_buffer_copy_out(ring_buffer, size, buffer);
 		spin_unlock(ring_buffer->lock);
-		wakeup_queue(ring_buffer->wait_queue_writers);
-		if (collected == 0) {
-			if (sleep_on(ring_buffer->wait_queue_readers) && ring_buffer->internal_stop) {
-				ring_buffer->internal_stop = 0;
-				break;
-			}
+		if (collected) {
+			wakeup_queue(ring_buffer->wait_queue_writers);
+		} else if (!size) {
+			break;
+		} else if (sleep_on(ring_buffer->wait_queue_readers) && ring_buffer->internal_stop) {
+			ring_buffer->internal_stop = 0;
+			break;
 		}
 	}
-	wakeup_queue(ring_buffer->wait_queue_writers);
 	return collected;
 }
 
@@ -97,16 +132,14 @@ size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buf
 	size_t written = 0;
 	while (written < size) {
 		spin_lock(ring_buffer->lock);
+		size_t chunk = ring_buffer_copy_in(ring_buffer, size - written, buffer + written);
+		spin_unlock(ring_buffer->lock);
 
-		while (ring_buffer_available(ring_buffer) > 0 && written < size) {
-			ring_buffer->buffer[ring_buffer->write_ptr] = buffer[written];
-			ring_buffer_increment_write(ring_buffer);
-			written++;
+		if (chunk) {
+			written += chunk;
+			wakeup_queue(ring_buffer->wait_queue_readers);
+			ring_buffer_alert_waiters(ring_buffer);
 		}
-
-		spin_unlock(ring_buffer->lock);
-		wakeup_queue(ring_buffer->wait_queue_readers);
-		ring_buffer_alert_waiters(ring_buffer);
 		if (written < size) {
 			if (ring_buffer->discard) {
 				break;
@@ -118,9 +151,73 @@ size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buf
 		}
 	}
 
+	return written;
+}
+
+size_t ring_buffer_reserve(ring_buffer_t * ring_buffer, uint8_t ** span) {
+	spin_lock(ring_buffer->lock);
+	size_t length = ring_buffer_write_span(ring_buffer);
+	*span = ring_buffer->buffer + ring_buffer->write_ptr;
+	spin_unlock(ring_buffer->lock);
+	return length;
+}
+
+void ring_buffer_commit(ring_buffer_t * ring_buffer, size_t size) {
+	if (!size) return;
+	spin_lock(ring_buffer->lock);
+	ring_buffer->write_ptr += size;
+	if (ring_buffer->write_ptr == ring_buffer->size) {
+		ring_buffer->write_ptr = 0;
+	}
+	spin_unlock(ring_buffer->lock);
 	wakeup_queue(ring_buffer->wait_queue_readers);
 	ring_buffer_alert_waiters(ring_buffer);
-	return written;
+}
+
+size_t ring_buffer_peek(ring_buffer_t * ring_buffer, size_t skip, uint8_t ** span) {
+	spin_lock(ring_buffer->lock);
+	size_t unread = ring_buffer_unread(ring_buffer);
+	size_t length = 0;
+	if (skip < unread) {
+		size_t at = ring_buffer->read_ptr + skip;
+		if (at >= ring_buffer->size) at -= ring_buffer->size;
+		size_t to_end = ring_buffer->size - at;
+		length = unread - skip < to_end ? unread - skip : to_end;
+		*span = ring_buffer->buffer + at;
+	}
+	spin_unlock(ring_buffer->lock);
+	return length;
+}
+
+void ring_buffer_consume(ring_buffer_t * ring_buffer, size_t size) {
+	if (!size) return;
+	spin_lock(ring_buffer->lock);
+	ring_buffer->read_ptr += size;
+	if (ring_buffer->read_ptr >= ring_buffer->size) {
+		ring_buffer->read_ptr -= ring_buffer->size;
+	}
+	spin_unlock(ring_buffer->lock);
+	wakeup_queue(ring_buffer->wait_queue_writers);
+}
+
+int ring_buffer_wait_unread(ring_buffer_t * ring_buffer) {
+	while (!ring_buffer_unread(ring_buffer)) {
+		if (sleep_on(ring_buffer->wait_queue_readers) && ring_buffer->internal_stop) {
+			ring_buffer->internal_stop = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int ring_buffer_wait_available(ring_buffer_t * ring_buffer) {
+	while (!ring_buffer_available(ring_buffer)) {
+		if (sleep_on(ring_buffer->wait_queue_writers) && ring_buffer->internal_stop) {
+			ring_buffer->internal_stop = 0;
+			return 0;
+		}
+	}
+	return 1;
 }
 
 ring_buffer_t * ring_buffer_create(size_t size) {
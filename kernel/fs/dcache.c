@@ -0,0 +1,226 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Directory Entry Cache
+ *
+ * Remembers what finddir_fs() found for a name in a directory, so
+ * walking the same paths again (PATH searches, the dynamic linker
+ * looking for libraries, stat()ing the same files) doesn't go back
+ * to the filesystem to scan directory blocks. Names that weren't
+ * there are cached too. Filesystems opt in by setting FS_DCACHE on
+ * their nodes.
+ *
+ * Entries are keyed by the directory's device, inode and impl, as
+ * in the page cache, and the name. Each holds a copy of the node
+ * the filesystem returned, which lookups hand back clones of.
+ *
+ * The copies carry a file's size, mode and owner, so anything that
+ * changes those through the VFS - writes, truncation, chmod, chown -
+ * drops the entries for that file, which are also chained by the
+ * file's own key. Creating, unlinking or making a directory drops
+ * the entry for that name, along with the directory's own entries,
+ * since its size and link count change too.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/logging.h>
+#include <kernel/dcache.h>
+
+#define DCACHE_BUCKETS 512
+#define DCACHE_MAX     1024
+
+typedef struct dcache_entry {
+	struct dcache_entry * hash_next; /* Same directory and name bucket */
+	struct dcache_entry * node_next; /* Same file bucket */
+	struct dcache_entry * lru_prev;  /* More recently used */
+	struct dcache_entry * lru_next;  /* Less recently used */
+	void *    device;
+	uint32_t  inode;
+	uint32_t  impl;
+	char *    name;
+	fs_node_t * node; /* NULL for a name that doesn't exist */
+} dcache_entry_t;
+
+static dcache_entry_t * dcache_hash[DCACHE_BUCKETS];
+static dcache_entry_t * dcache_nodes[DCACHE_BUCKETS];
+static dcache_entry_t * dcache_mru = NULL;
+static dcache_entry_t * dcache_lru = NULL;
+static size_t dcache_count = 0;
+static spin_lock_t dcache_lock = { 0 };
+
+/*
+ * Bumped whenever entries are dropped; a lookup that raced with
+ * an unlink or create must not insert what it found.
+ */
+static volatile uint32_t dcache_gen = 0;
+
+static unsigned int dcache_key(void * device, uint32_t inode, uint32_t impl) {
+	return (uintptr_t)device ^ (inode * 2654435761U) ^ (impl * 31);
+}
+
+static unsigned int dcache_bucket(void * device, uint32_t inode, uint32_t impl, char * name) {
+	/* FNV-1a over the name, seeded with the directory */
+	unsigned int hash = 2166136261U ^ dcache_key(device, inode, impl);
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash % DCACHE_BUCKETS;
+}
+
+static unsigned int dcache_node_bucket(fs_node_t * node) {
+	return dcache_key(node->device, node->inode, node->impl) % DCACHE_BUCKETS;
+}
+
+static int dcache_same(fs_node_t * a, void * device, uint32_t inode, uint32_t impl) {
+	return a->device == device && a->inode == inode && a->impl == impl;
+}
+
+static dcache_entry_t * dcache_find(fs_node_t * dir, char * name) {
+	dcache_entry_t * entry = dcache_hash[dcache_bucket(dir->device, dir->inode, dir->impl, name)];
+	while (entry) {
+		if (dcache_same(dir, entry->device, entry->inode, entry->impl) && !strcmp(entry->name, name)) return entry;
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+static void dcache_lru_unlink(dcache_entry_t * entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else dcache_mru = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else dcache_lru = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void dcache_touch(dcache_entry_t * entry) {
+	if (dcache_mru == entry) return;
+	dcache_lru_unlink(entry);
+	entry->lru_next = dcache_mru;
+	if (dcache_mru) dcache_mru->lru_prev = entry;
+	dcache_mru = entry;
+	if (!dcache_lru) dcache_lru = entry;
+}
+
+/* Remove and free an entry. The cache lock must be held. */
+static void dcache_drop(dcache_entry_t * entry) {
+	dcache_entry_t ** link = &dcache_hash[dcache_bucket(entry->device, entry->inode, entry->impl, entry->name)];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+
+	if (entry->node) {
+		link = &dcache_nodes[dcache_node_bucket(entry->node)];
+		while (*link != entry) {
+			link = &(*link)->node_next;
+		}
+		*link = entry->node_next;
+		free(entry->node);
+	}
+
+	dcache_lru_unlink(entry);
+	free(entry->name);
+	free(entry);
+	dcache_count--;
+}
+
+uint32_t dcache_generation(void) {
+	return dcache_gen;
+}
+
+/*
+ * Look up `name` in `dir`. Returns 0 if the cache doesn't know.
+ * Otherwise, returns 1 and sets *out to a new copy of the node,
+ * or to NULL if the name is known not to exist.
+ */
+int dcache_lookup(fs_node_t * dir, char * name, fs_node_t ** out) {
+	spin_lock(dcache_lock);
+	dcache_entry_t * entry = dcache_find(dir, name);
+	if (!entry) {
+		spin_unlock(dcache_lock);
+		return 0;
+	}
+	dcache_touch(entry);
+	if (entry->node) {
+		*out = malloc(sizeof(fs_node_t));
+		memcpy(*out, entry->node, sizeof(fs_node_t));
+	} else {
+		*out = NULL;
+	}
+	spin_unlock(dcache_lock);
+	return 1;
+}
+
+/*
+ * Remember that `name` in `dir` is `node` (or doesn't exist, if node
+ * is NULL), unless entries were dropped since `generation` was taken.
+ * The node is copied; the caller keeps its own.
+ */
+void dcache_insert(fs_node_t * dir, char * name, fs_node_t * node, uint32_t generation) {
+	spin_lock(dcache_lock);
+	if (generation != dcache_gen || dcache_find(dir, name)) {
+		spin_unlock(dcache_lock);
+		return;
+	}
+
+	while (dcache_count >= DCACHE_MAX && dcache_lru) {
+		dcache_drop(dcache_lru);
+	}
+
+	dcache_entry_t * entry = malloc(sizeof(dcache_entry_t));
+	entry->device = dir->device;
+	entry->inode  = dir->inode;
+	entry->impl   = dir->impl;
+	entry->name   = strdup(name);
+	entry->node   = NULL;
+	entry->node_next = NULL;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+
+	if (node) {
+		entry->node = malloc(sizeof(fs_node_t));
+		memcpy(entry->node, node, sizeof(fs_node_t));
+		unsigned int nb = dcache_node_bucket(node);
+		entry->node_next = dcache_nodes[nb];
+		dcache_nodes[nb] = entry;
+	}
+
+	unsigned int bucket = dcache_bucket(dir->device, dir->inode, dir->impl, name);
+	entry->hash_next = dcache_hash[bucket];
+	dcache_hash[bucket] = entry;
+	dcache_touch(entry);
+	dcache_count++;
+	spin_unlock(dcache_lock);
+}
+
+/*
+ * Forget what we know about `name` in `dir`.
+ */
+void dcache_forget(fs_node_t * dir, char * name) {
+	spin_lock(dcache_lock);
+	dcache_gen++;
+	dcache_entry_t * entry = dcache_find(dir, name);
+	if (entry) dcache_drop(entry);
+	spin_unlock(dcache_lock);
+}
+
+/*
+ * Forget every cached copy of a node, under whatever names.
+ */
+void dcache_invalidate(fs_node_t * node) {
+	spin_lock(dcache_lock);
+	dcache_gen++;
+	dcache_entry_t * entry = dcache_nodes[dcache_node_bucket(node)];
+	while (entry) {
+		dcache_entry_t * next = entry->node_next;
+		if (dcache_same(entry->node, node->device, node->inode, node->impl)) {
+			dcache_drop(entry);
+		}
+		entry = next;
+	}
+	spin_unlock(dcache_lock);
+}
@@ -0,0 +1,276 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * fswait sets
+ *
+ * A persistent set of file descriptors to wait on. fswait() has
+ * to call selectcheck and selectwait on every node each time it
+ * is called, and tear the registrations down again when it
+ * returns; a set keeps its nodes between waits, so a wait only
+ * does work for the nodes that became readable.
+ *
+ * Pipes, ring buffers (pty and unix pipes) and sockets alert their
+ * waiters once and forget them. A watch is armed by registering
+ * the current process with the node's selectwait, which also tells
+ * us which object the node will alert with. process_alert_node()
+ * hands every alert to fswait_alert(), which moves the watches on
+ * that object to their set's ready list and wakes whoever is
+ * waiting on the set. Watches are re-armed only when a wait finds
+ * them no longer readable (level-triggered), or right after they
+ * are reported (FSWAIT_EDGE).
+ *
+ * System calls run with interrupts off, so alerts from interrupt
+ * handlers can't land in the middle of any of this.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/logging.h>
+
+#include <toaru/list.h>
+#include <toaru/hashmap.h>
+
+#include <sys/fswait.h>
+
+typedef struct fswait_set {
+	hashmap_t * watches; /* fd -> fswait_watch_t */
+	list_t ready;        /* Watches that may be readable */
+	list_t * wait_queue;
+	process_t * waiter;  /* Sleeping in fswait_set_wait() */
+} fswait_set_t;
+
+typedef struct fswait_watch {
+	fswait_set_t * set;
+	fs_node_t * node;    /* Our own reference */
+	int fd;
+	int flags;
+	void * object;       /* What the node alerts with */
+	int armed;
+	node_t ready_node;   /* In set->ready */
+	node_t object_node;  /* In the object's list in watched_objects */
+} fswait_watch_t;
+
+/* Alerting object -> list of watches armed on it */
+static hashmap_t * watched_objects = NULL;
+
+static void watch_set_object(fswait_watch_t * watch, void * object) {
+	if (watch->object == object) return;
+
+	if (watch->object) {
+		list_t * watchers = hashmap_get(watched_objects, watch->object);
+		list_delete(watchers, &watch->object_node);
+		if (!watchers->length) {
+			hashmap_remove(watched_objects, watch->object);
+			free(watchers);
+		}
+	}
+
+	watch->object = object;
+
+	if (object) {
+		list_t * watchers = hashmap_get(watched_objects, object);
+		if (!watchers) {
+			watchers = list_create();
+			hashmap_set(watched_objects, object, watchers);
+		}
+		list_append(watchers, &watch->object_node);
+	}
+}
+
+/*
+ * Register for the next alert from the watched node.
+ */
+static void watch_arm(fswait_watch_t * watch) {
+	if (watch->armed || !watch->node->selectwait) return;
+
+	/* selectwait records the object it registered us on in node_waits */
+	process_t * process = (process_t *)current_process;
+	list_t * saved = process->node_waits;
+	process->node_waits = list_create();
+	selectwait_fs(watch->node, process);
+	void * object = process->node_waits->head ? process->node_waits->head->value : NULL;
+	list_free(process->node_waits);
+	free(process->node_waits);
+	process->node_waits = saved;
+
+	watch_set_object(watch, object);
+	watch->armed = (object != NULL);
+}
+
+static void watch_mark_ready(fswait_watch_t * watch) {
+	if (!watch->ready_node.owner) {
+		list_append(&watch->set->ready, &watch->ready_node);
+	}
+}
+
+static void set_wake(fswait_set_t * set) {
+	process_t * process = set->waiter;
+	if (process) {
+		set->waiter = NULL;
+		if (!process_is_ready(process)) {
+			make_process_ready(process);
+		}
+	}
+}
+
+/*
+ * Called for every alert delivered through process_alert_node().
+ */
+void fswait_alert(void * object) {
+	if (!watched_objects) return;
+	list_t * watchers = hashmap_get(watched_objects, object);
+	if (!watchers) return;
+
+	/* The object has forgotten us; every watch on it needs re-arming */
+	foreach(node, watchers) {
+		fswait_watch_t * watch = node->value;
+		watch->armed = 0;
+		watch_mark_ready(watch);
+		set_wake(watch->set);
+	}
+}
+
+static void watch_free(fswait_watch_t * watch) {
+	if (watch->ready_node.owner) {
+		list_delete(&watch->set->ready, &watch->ready_node);
+	}
+	watch_set_object(watch, NULL);
+	close_fs(watch->node);
+	free(watch);
+}
+
+static void set_close(fs_node_t * node) {
+	fswait_set_t * set = node->device;
+	list_t * keys = hashmap_keys(set->watches);
+	foreach(key, keys) {
+		watch_free(hashmap_get(set->watches, key->value));
+	}
+	list_free(keys);
+	free(keys);
+	hashmap_free(set->watches);
+	free(set->watches);
+	list_free(set->wait_queue);
+	free(set->wait_queue);
+	free(set);
+}
+
+fs_node_t * fswait_set_create(void) {
+	if (!watched_objects) {
+		watched_objects = hashmap_create_int(64);
+	}
+
+	fswait_set_t * set = malloc(sizeof(fswait_set_t));
+	memset(set, 0, sizeof(fswait_set_t));
+	set->watches = hashmap_create_int(16);
+	set->wait_queue = list_create();
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+	sprintf(fnode->name, "[fswait]");
+	fnode->mask = 0600;
+	fnode->uid = current_process->user;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->close = set_close;
+	fnode->device = set;
+	return fnode;
+}
+
+static fswait_set_t * set_from_node(fs_node_t * node) {
+	if (!node || node->close != set_close) return NULL;
+	return node->device;
+}
+
+int fswait_set_ctl(fs_node_t * set_node, int op, int fd, fs_node_t * node, int flags) {
+	fswait_set_t * set = set_from_node(set_node);
+	if (!set) return -EINVAL;
+
+	fswait_watch_t * watch = hashmap_get(set->watches, (void *)(uintptr_t)fd);
+
+	switch (op) {
+		case FSWAIT_ADD:
+			if (watch) return -EEXIST;
+			if (!node || !node->selectcheck || set_from_node(node)) return -EINVAL;
+			watch = malloc(sizeof(fswait_watch_t));
+			memset(watch, 0, sizeof(fswait_watch_t));
+			watch->set = set;
+			watch->node = clone_fs(node);
+			watch->fd = fd;
+			watch->flags = flags;
+			watch->ready_node.value = watch;
+			watch->object_node.value = watch;
+			hashmap_set(set->watches, (void *)(uintptr_t)fd, watch);
+			/* The next wait checks it and arms it if it isn't readable yet */
+			watch_mark_ready(watch);
+			return 0;
+		case FSWAIT_MOD:
+			if (!watch) return -ENOENT;
+			watch->flags = flags;
+			watch_mark_ready(watch);
+			return 0;
+		case FSWAIT_DEL:
+			if (!watch) return -ENOENT;
+			hashmap_remove(set->watches, (void *)(uintptr_t)fd);
+			watch_free(watch);
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Check the ready list: report what is readable, re-arm what isn't.
+ */
+static int set_collect(fswait_set_t * set, int * out, int max) {
+	int count = 0;
+	size_t pending = set->ready.length;
+	while (pending-- && count < max) {
+		node_t * node = list_dequeue(&set->ready);
+		fswait_watch_t * watch = node->value;
+		if (selectcheck_fs(watch->node) != 0) {
+			watch_arm(watch);
+			continue;
+		}
+		out[count++] = watch->fd;
+		if (watch->flags & FSWAIT_EDGE) {
+			watch_arm(watch);
+		} else {
+			/* Still readable until a wait finds otherwise; go to the back */
+			list_append(&set->ready, node);
+		}
+	}
+	return count;
+}
+
+int fswait_set_wait(fs_node_t * set_node, int * out, int max, int timeout) {
+	fswait_set_t * set = set_from_node(set_node);
+	if (!set || max <= 0) return -EINVAL;
+
+	unsigned long s = 0, ss = 0;
+	if (timeout > 0) {
+		relative_time(0, timeout, &s, &ss);
+	}
+
+	while (1) {
+		int count = set_collect(set, out, max);
+		if (count) return count;
+		if (timeout == 0) return 0;
+		if (timeout > 0 && (timer_ticks > s || (timer_ticks == s && timer_subticks >= ss))) return 0;
+		if (set->waiter) return -EBUSY;
+
+		set->waiter = (process_t *)current_process;
+		if (timeout > 0) {
+			sleep_until((process_t *)current_process, s, ss);
+			switch_task(0);
+		} else {
+			sleep_on(set->wait_queue);
+		}
+		set->waiter = NULL;
+
+		if (!set->ready.length && current_process->signal_queue->length) {
+			return -EINTR;
+		}
+	}
+}
@@ -0,0 +1,337 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Asynchronous I/O rings
+ *
+ * A ring is a struct ioring and its two arrays, mapped shared into
+ * the process that set it up, and a descriptor for the kernel side.
+ * ioring_enter() takes new requests off the submission ring, resolves
+ * their descriptors while it is still in the process, and queues them
+ * for a handful of worker tasklets. The workers run in the owner's
+ * address space, so they read and write the process's buffers (and
+ * the rings themselves) where they are, and can each be blocked on a
+ * different file at once.
+ *
+ * Completions are announced in batches: waiters in ioring_enter()
+ * and fswait are woken when a worker finds nothing left queued, or
+ * when enough have piled up for whoever is waiting, rather than for
+ * every request.
+ *
+ * Submission never lets more requests be outstanding than the
+ * completion ring can hold, so completions are never dropped.
+ *
+ * As with fswait sets, system calls run with interrupts off; the
+ * workers turn them off too while they touch anything shared.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/logging.h>
+#include <kernel/mmap.h>
+
+#include <toaru/list.h>
+
+#include <sys/mman.h>
+#include <sys/ioring.h>
+
+#define IORING_WORKERS 4
+
+typedef struct ioring_work {
+	fs_node_t * node;   /* Our own reference */
+	struct ioring_sqe sqe;
+} ioring_work_t;
+
+typedef struct ioring_state {
+	struct ioring * ring;  /* In the owner's address space */
+	page_directory_t * directory;
+	uint32_t entries;      /* Submission ring size; the completion ring is twice this */
+	uint32_t cq_tail;      /* Our copy of ring->cq_tail */
+	uint32_t in_flight;    /* Taken off the submission ring, not yet completed */
+	uint32_t wanted;       /* Completions a sleeper in ioring_enter() is waiting for */
+	list_t * queue;        /* ioring_work_t, waiting for a worker */
+	list_t * wait_queue_workers;
+	list_t * wait_queue_complete;
+	list_t * alert_waiters;
+	int refs;              /* The node, and each worker */
+	int dead;
+} ioring_state_t;
+
+static void state_release(ioring_state_t * state) {
+	if (--state->refs) return;
+	while (state->queue->head) {
+		node_t * node = list_dequeue(state->queue);
+		ioring_work_t * work = node->value;
+		close_fs(work->node);
+		free(work);
+		free(node);
+	}
+	list_free(state->queue);
+	free(state->queue);
+	list_free(state->wait_queue_workers);
+	free(state->wait_queue_workers);
+	list_free(state->wait_queue_complete);
+	free(state->wait_queue_complete);
+	if (state->alert_waiters) {
+		list_free(state->alert_waiters);
+		free(state->alert_waiters);
+	}
+	free(state);
+}
+
+static void alert_waiters(ioring_state_t * state) {
+	if (state->alert_waiters) {
+		while (state->alert_waiters->head) {
+			node_t * node = list_dequeue(state->alert_waiters);
+			process_t * p = node->value;
+			process_alert_node(p, state);
+			free(node);
+		}
+	}
+}
+
+static uint32_t unreaped(ioring_state_t * state) {
+	return state->cq_tail - state->ring->cq_head;
+}
+
+/* Post a completion. Interrupts are off. */
+static void complete(ioring_state_t * state, uint64_t user_data, int32_t res) {
+	struct ioring_cqe * cqe = &state->ring->cqes[state->cq_tail & (state->entries * 2 - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	cqe->flags = 0;
+	state->cq_tail++;
+	state->ring->cq_tail = state->cq_tail;
+}
+
+static void announce(ioring_state_t * state) {
+	wakeup_queue(state->wait_queue_complete);
+	alert_waiters(state);
+}
+
+static int32_t run(ioring_work_t * work) {
+	struct ioring_sqe * sqe = &work->sqe;
+	switch (sqe->opcode) {
+		case IORING_OP_READ:
+			return (int32_t)read_fs(work->node, sqe->off, sqe->len, sqe->buf);
+		case IORING_OP_WRITE:
+			return (int32_t)write_fs(work->node, sqe->off, sqe->len, sqe->buf);
+		case IORING_OP_FSYNC:
+			return sync_fs(work->node);
+		default:
+			return -EINVAL;
+	}
+}
+
+static void ioring_worker(void * data, char * name) {
+	ioring_state_t * state = data;
+
+	IRQ_OFF;
+	/* Move into the owner's address space */
+	page_directory_t * old = current_process->thread.page_directory;
+	state->directory->ref_count++;
+	set_process_environment((process_t *)current_process, state->directory);
+	current_directory = state->directory;
+	switch_page_directory(current_directory);
+	release_directory(old);
+
+	/* We got a copy of the owner's descriptors, ring included; they would keep it open */
+	for (uint32_t i = 0; i < current_process->fds->length; ++i) {
+		process_close_fd((process_t *)current_process, i);
+	}
+
+	/* And stay out of its job, so job control signals don't reach us */
+	current_process->job = current_process->id;
+	IRQ_RES;
+
+	while (1) {
+		IRQ_OFF;
+		if (state->dead) {
+			state_release(state);
+			IRQ_RES;
+			return;
+		}
+		node_t * node = list_dequeue(state->queue);
+		if (!node) {
+			/* Still with interrupts off, so a submission can't slip in before we sleep */
+			sleep_on(state->wait_queue_workers);
+			IRQ_RES;
+			continue;
+		}
+		IRQ_RES;
+
+		ioring_work_t * work = node->value;
+		free(node);
+		int32_t res = run(work);
+
+		IRQ_OFF;
+		close_fs(work->node);
+		if (!state->dead) {
+			complete(state, work->sqe.user_data, res);
+			state->in_flight--;
+			if (!state->queue->head || (state->wanted && unreaped(state) >= state->wanted)) {
+				announce(state);
+			}
+		}
+		IRQ_RES;
+		free(work);
+	}
+}
+
+static void ioring_close(fs_node_t * node) {
+	ioring_state_t * state = node->device;
+	IRQ_OFF;
+	state->dead = 1;
+	wakeup_queue(state->wait_queue_workers);
+	announce(state);
+	state_release(state);
+	IRQ_RES;
+}
+
+static int ioring_check(fs_node_t * node) {
+	ioring_state_t * state = node->device;
+	if (current_directory != state->directory) return 0;
+	return unreaped(state) ? 0 : 1;
+}
+
+static int ioring_wait(fs_node_t * node, void * process) {
+	ioring_state_t * state = node->device;
+	if (!state->alert_waiters) {
+		state->alert_waiters = list_create();
+	}
+	if (!list_find(state->alert_waiters, process)) {
+		list_insert(state->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, state);
+	return 0;
+}
+
+fs_node_t * ioring_create(unsigned int entries, struct ioring ** out) {
+	if (!entries || entries > IORING_MAX_ENTRIES) return NULL;
+	uint32_t size = 1;
+	while (size < entries) size <<= 1;
+
+	size_t length = sizeof(struct ioring) + size * sizeof(struct ioring_sqe) + size * 2 * sizeof(struct ioring_cqe);
+	uintptr_t addr = mmap_map(0, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, NULL, 0);
+	if (addr > (uintptr_t)-0x1000) return NULL;
+
+	struct ioring * ring = (struct ioring *)addr;
+	memset(ring, 0, sizeof(struct ioring));
+	ring->sq_mask = size - 1;
+	ring->cq_mask = size * 2 - 1;
+	ring->sqes = (struct ioring_sqe *)(addr + sizeof(struct ioring));
+	ring->cqes = (struct ioring_cqe *)(ring->sqes + size);
+
+	ioring_state_t * state = malloc(sizeof(ioring_state_t));
+	memset(state, 0, sizeof(ioring_state_t));
+	state->ring = ring;
+	state->directory = current_directory;
+	state->entries = size;
+	state->queue = list_create();
+	state->wait_queue_workers = list_create();
+	state->wait_queue_complete = list_create();
+	state->refs = 1 + IORING_WORKERS;
+
+	for (int i = 0; i < IORING_WORKERS; ++i) {
+		create_kernel_tasklet(ioring_worker, "[ioring]", state);
+	}
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+	sprintf(fnode->name, "[ioring]");
+	fnode->mask = 0600;
+	fnode->uid = current_process->user;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->close = ioring_close;
+	fnode->selectcheck = ioring_check;
+	fnode->selectwait = ioring_wait;
+	fnode->device = state;
+
+	*out = ring;
+	return fnode;
+}
+
+/* The node behind a request's descriptor, as a new reference, or an error */
+static fs_node_t * sqe_node(struct ioring_sqe * sqe, int * error) {
+	if (sqe->opcode == IORING_OP_READ || sqe->opcode == IORING_OP_WRITE) {
+		uintptr_t buf = (uintptr_t)sqe->buf;
+		if (buf <= current_process->image.entry || buf + sqe->len < buf) {
+			*error = -EFAULT;
+			return NULL;
+		}
+	} else if (sqe->opcode != IORING_OP_FSYNC) {
+		*error = -EINVAL;
+		return NULL;
+	}
+
+	int fd = sqe->fd;
+	if (fd < 0 || fd >= (int)current_process->fds->length || !current_process->fds->entries[fd]) {
+		*error = -EBADF;
+		return NULL;
+	}
+	int mode = current_process->fds->entries[fd]->mode;
+	if ((sqe->opcode == IORING_OP_READ && !(mode & 01)) ||
+		(sqe->opcode == IORING_OP_WRITE && !(mode & 02))) {
+		*error = -EBADF;
+		return NULL;
+	}
+	return clone_fs(current_process->fds->entries[fd]->node);
+}
+
+int ioring_enter(fs_node_t * node, unsigned int to_submit, unsigned int min_complete) {
+	if (!node || node->close != ioring_close) return -EINVAL;
+	ioring_state_t * state = node->device;
+	if (current_directory != state->directory) return -EPERM;
+
+	struct ioring * ring = state->ring;
+	unsigned int submitted = 0;
+	int posted = 0;
+
+	while (submitted < to_submit && ring->sq_head != ring->sq_tail) {
+		/* Leave room in the completion ring for everything outstanding */
+		if (state->in_flight + unreaped(state) >= state->entries * 2) break;
+
+		struct ioring_sqe * sqe = &ring->sqes[ring->sq_head & (state->entries - 1)];
+		if (sqe->opcode == IORING_OP_NOP) {
+			complete(state, sqe->user_data, 0);
+			posted = 1;
+		} else {
+			int error = 0;
+			fs_node_t * target = sqe_node(sqe, &error);
+			if (!target) {
+				complete(state, sqe->user_data, error);
+				posted = 1;
+			} else {
+				ioring_work_t * work = malloc(sizeof(ioring_work_t));
+				work->node = target;
+				memcpy(&work->sqe, sqe, sizeof(struct ioring_sqe));
+				list_insert(state->queue, work);
+				state->in_flight++;
+			}
+		}
+		ring->sq_head++;
+		submitted++;
+	}
+
+	if (state->queue->head) {
+		wakeup_queue(state->wait_queue_workers);
+	}
+	if (posted) {
+		alert_waiters(state);
+	}
+
+	/* Can't wait for more than will ever arrive */
+	if (min_complete > state->in_flight + unreaped(state)) {
+		min_complete = state->in_flight + unreaped(state);
+	}
+	while (unreaped(state) < min_complete) {
+		state->wanted = min_complete;
+		int interrupted = sleep_on(state->wait_queue_complete);
+		state->wanted = 0;
+		if (interrupted || state->dead) break;
+	}
+
+	return submitted;
+}
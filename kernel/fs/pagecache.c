@@ -0,0 +1,294 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Page Cache
+ *
+ * Caches file contents in page-sized chunks above the filesystems,
+ * so repeated reads of the same file don't go back to the disk (or
+ * CD) at all. Filesystems opt in by setting FS_PAGECACHE on their
+ * file nodes, at which point read_fs() is served from here.
+ *
+ * Pages are keyed by the node's device, inode and impl values, which
+ * between them identify a file on every filesystem we have, and the
+ * page index within the file. Misses are filled by reading a run of
+ * pages at once. Each open file tracks whether it is being read
+ * sequentially; if it is, the run continues past what was asked for
+ * by a readahead window that doubles with every sequential read, and
+ * a seek elsewhere closes the window again.
+ *
+ * Node lengths aren't kept current by every filesystem, so the cache
+ * doesn't trust them: the last page of a file remembers how much of
+ * it was there, and a read that wants more goes back to the
+ * filesystem in case the file has grown.
+ *
+ * Writes go straight through to the filesystem and then update any
+ * cached pages they touch, so the cache never holds data the disk
+ * doesn't. Truncating or unlinking a file drops its pages.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/logging.h>
+#include <kernel/pagecache.h>
+#include <kernel/reclaim.h>
+
+#define PAGECACHE_BUCKETS   1024
+#define PAGECACHE_RA_MIN    4  /* Readahead window when a file starts being read sequentially */
+#define PAGECACHE_MAX_RUN   32 /* Most pages read from the filesystem at once, and the largest window */
+
+typedef struct pagecache_entry {
+	struct pagecache_entry * hash_next;
+	struct pagecache_entry * lru_prev; /* More recently used */
+	struct pagecache_entry * lru_next; /* Less recently used */
+	void *    device;
+	uint32_t  inode;
+	uint32_t  impl;
+	uint32_t  index;
+	uint32_t  valid; /* Bytes of file data in the page; less than a page at EOF */
+	uint8_t * data;
+} pagecache_entry_t;
+
+static pagecache_entry_t * pagecache_hash[PAGECACHE_BUCKETS];
+static pagecache_entry_t * pagecache_mru = NULL;
+static pagecache_entry_t * pagecache_lru = NULL;
+static size_t pagecache_pages = 0;
+static size_t pagecache_limit = 0;
+static spin_lock_t pagecache_lock = { 0 };
+
+/*
+ * Bumped whenever cached data changes; a fill that raced with a
+ * write or invalidation must not insert what it read.
+ */
+static volatile uint32_t pagecache_generation = 0;
+
+static unsigned int pagecache_bucket(void * device, uint32_t inode, uint32_t impl, uint32_t index) {
+	return ((uintptr_t)device ^ (inode * 2654435761U) ^ (impl * 31) ^ index) % PAGECACHE_BUCKETS;
+}
+
+static int pagecache_matches(pagecache_entry_t * entry, fs_node_t * node) {
+	return entry->device == node->device && entry->inode == node->inode && entry->impl == node->impl;
+}
+
+static pagecache_entry_t * pagecache_find(fs_node_t * node, uint32_t index) {
+	pagecache_entry_t * entry = pagecache_hash[pagecache_bucket(node->device, node->inode, node->impl, index)];
+	while (entry) {
+		if (entry->index == index && pagecache_matches(entry, node)) return entry;
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+static void pagecache_lru_unlink(pagecache_entry_t * entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else pagecache_mru = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else pagecache_lru = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void pagecache_touch(pagecache_entry_t * entry) {
+	if (pagecache_mru == entry) return;
+	pagecache_lru_unlink(entry);
+	entry->lru_next = pagecache_mru;
+	if (pagecache_mru) pagecache_mru->lru_prev = entry;
+	pagecache_mru = entry;
+	if (!pagecache_lru) pagecache_lru = entry;
+}
+
+/* Remove and free an entry. The cache lock must be held. */
+static void pagecache_drop(pagecache_entry_t * entry) {
+	pagecache_entry_t ** link = &pagecache_hash[pagecache_bucket(entry->device, entry->inode, entry->impl, entry->index)];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	pagecache_lru_unlink(entry);
+	free(entry->data);
+	free(entry);
+	pagecache_pages--;
+}
+
+/*
+ * Shrinker: drop the least recently used pages. Their data is on the
+ * heap, so this makes room there rather than freeing frames, which
+ * spares the heap from growing for a while.
+ */
+static size_t pagecache_shrink(size_t wanted) {
+	size_t freed = 0;
+	if (!spin_trylock(pagecache_lock)) return 0;
+	while (pagecache_lru && freed < wanted) {
+		pagecache_drop(pagecache_lru);
+		freed++;
+	}
+	spin_unlock(pagecache_lock);
+	return freed;
+}
+
+/*
+ * Add a page with `valid` bytes of data, replacing any shorter copy,
+ * unless the cache changed since `generation` was sampled. Evicts the
+ * least recently used page if the cache is full. The cache lock must
+ * be held.
+ */
+static void pagecache_insert(fs_node_t * node, uint32_t index, uint8_t * data, uint32_t valid, uint32_t generation) {
+	if (generation != pagecache_generation) return;
+
+	pagecache_entry_t * existing = pagecache_find(node, index);
+	if (existing) {
+		if (existing->valid < valid) {
+			memcpy(existing->data, data, PAGECACHE_PAGE_SIZE);
+			existing->valid = valid;
+		}
+		pagecache_touch(existing);
+		return;
+	}
+
+	if (!pagecache_limit) {
+		/* Let the cache grow to an eighth of memory */
+		pagecache_limit = memory_total() / 4 / 8;
+		reclaim_register("page cache", pagecache_shrink, 0);
+	}
+	while (pagecache_pages >= pagecache_limit && pagecache_lru) {
+		pagecache_drop(pagecache_lru);
+	}
+
+	pagecache_entry_t * entry = malloc(sizeof(pagecache_entry_t));
+	entry->device = node->device;
+	entry->inode  = node->inode;
+	entry->impl   = node->impl;
+	entry->index  = index;
+	entry->valid  = valid;
+	entry->data   = malloc(PAGECACHE_PAGE_SIZE);
+	memcpy(entry->data, data, PAGECACHE_PAGE_SIZE);
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+
+	unsigned int bucket = pagecache_bucket(node->device, node->inode, node->impl, index);
+	entry->hash_next = pagecache_hash[bucket];
+	pagecache_hash[bucket] = entry;
+	pagecache_touch(entry);
+	pagecache_pages++;
+}
+
+/*
+ * Read from a file through the cache.
+ */
+uint32_t pagecache_read(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	/* Reads from the start, or from where the last one left off, are sequential */
+	if (offset == 0 || offset == node->ra_next) {
+		if (!node->ra_window) {
+			node->ra_window = PAGECACHE_RA_MIN;
+		} else if (node->ra_window < PAGECACHE_MAX_RUN) {
+			node->ra_window *= 2;
+		}
+	} else {
+		node->ra_window = 0;
+	}
+
+	uint32_t done = 0;
+	while (done < size) {
+		uint64_t pos   = offset + done;
+		uint32_t index = pos / PAGECACHE_PAGE_SIZE;
+		uint32_t in_page = pos % PAGECACHE_PAGE_SIZE;
+		uint32_t chunk = PAGECACHE_PAGE_SIZE - in_page;
+		if (chunk > size - done) chunk = size - done;
+
+		spin_lock(pagecache_lock);
+		pagecache_entry_t * entry = pagecache_find(node, index);
+		if (entry && entry->valid >= in_page + chunk) {
+			pagecache_touch(entry);
+			memcpy(buffer + done, entry->data + in_page, chunk);
+			spin_unlock(pagecache_lock);
+			done += chunk;
+			continue;
+		}
+
+		/* Missed; read this page and following uncached ones, through the readahead window */
+		uint32_t last = (offset + size - 1) / PAGECACHE_PAGE_SIZE + node->ra_window;
+		uint32_t count = 1;
+		while (index + count <= last && count < PAGECACHE_MAX_RUN && !pagecache_find(node, index + count)) {
+			count++;
+		}
+		uint32_t generation = pagecache_generation;
+		spin_unlock(pagecache_lock);
+
+		uint64_t start  = (uint64_t)index * PAGECACHE_PAGE_SIZE;
+		uint32_t length = count * PAGECACHE_PAGE_SIZE;
+
+		uint8_t * run = malloc(length);
+		uint32_t got = node->read(node, start, length, run);
+		if ((int32_t)got < 0) {
+			free(run);
+			return done ? done : got;
+		}
+		if (got > length) got = length;
+		memset(run + got, 0, length - got);
+
+		spin_lock(pagecache_lock);
+		for (uint32_t i = 0; i < count && got > i * PAGECACHE_PAGE_SIZE; ++i) {
+			uint32_t valid = got - i * PAGECACHE_PAGE_SIZE;
+			if (valid > PAGECACHE_PAGE_SIZE) valid = PAGECACHE_PAGE_SIZE;
+			pagecache_insert(node, index + i, run + i * PAGECACHE_PAGE_SIZE, valid, generation);
+		}
+		spin_unlock(pagecache_lock);
+
+		/* Hand back what was asked for from the run directly */
+		uint32_t available = (start + got > pos) ? (start + got - pos) : 0;
+		if (available > size - done) available = size - done;
+		memcpy(buffer + done, run + (pos - start), available);
+		done += available;
+		free(run);
+
+		if (got < length) break; /* End of file */
+	}
+
+	node->ra_next = offset + done;
+	return done;
+}
+
+/*
+ * Bring cached pages up to date after a write of `size`
+ * bytes from `buffer` at `offset`.
+ */
+void pagecache_update(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if (!size) return;
+
+	uint32_t first = offset / PAGECACHE_PAGE_SIZE;
+	uint32_t last  = (offset + size - 1) / PAGECACHE_PAGE_SIZE;
+
+	spin_lock(pagecache_lock);
+	pagecache_generation++;
+	for (uint32_t index = first; index <= last; ++index) {
+		pagecache_entry_t * entry = pagecache_find(node, index);
+		if (!entry) continue;
+
+		uint64_t page_start = (uint64_t)index * PAGECACHE_PAGE_SIZE;
+		uint64_t from = offset > page_start ? offset : page_start;
+		uint64_t to   = offset + size < page_start + PAGECACHE_PAGE_SIZE ? offset + size : page_start + PAGECACHE_PAGE_SIZE;
+		memcpy(entry->data + (from - page_start), buffer + (from - offset), to - from);
+		if (entry->valid < to - page_start) {
+			/* The file grew into this page; anything skipped over is a hole */
+			entry->valid = to - page_start;
+		}
+	}
+	spin_unlock(pagecache_lock);
+}
+
+/*
+ * Forget every cached page of a file.
+ */
+void pagecache_invalidate(fs_node_t * node) {
+	spin_lock(pagecache_lock);
+	pagecache_generation++;
+	pagecache_entry_t * entry = pagecache_mru;
+	while (entry) {
+		pagecache_entry_t * next = entry->lru_next;
+		if (pagecache_matches(entry, node)) {
+			pagecache_drop(entry);
+		}
+		entry = next;
+	}
+	spin_unlock(pagecache_lock);
+}
@@ -12,8 +12,8 @@
 #include <kernel/printf.h>
 #include <kernel/pipe.h>
 #include <kernel/logging.h>
+#include <kernel/trace.h>
 
-#define DEBUG_PIPES 0
 
 static inline size_t pipe_unread(pipe_device_t * pipe) {
 	if (pipe->read_ptr == pipe->write_ptr) {
@@ -48,18 +48,8 @@ int pipe_unsize(fs_node_t * node) {
 	return pipe_available(pipe);
 }
 
-static inline void pipe_increment_read(pipe_device_t * pipe) {
-	pipe->read_ptr++;
-	if (pipe->read_ptr == pipe->size) {
-		pipe->read_ptr = 0;
-	}
-}
-
-static inline void pipe_increment_write(pipe_device_t * pipe) {
-	pipe->write_ptr++;
-	if (pipe->write_ptr == pipe->size) {
-		pipe->write_ptr = 0;
-	}
+static inline void pipe_increment_read_by(pipe_device_t * pipe, size_t amount) {
+	pipe->read_ptr = (pipe->read_ptr + amount) % pipe->size;
 }
 
 static inline void pipe_increment_write_by(pipe_device_t * pipe, size_t amount) {
@@ -83,17 +73,7 @@ uint32_t read_pipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buf
 	/* Retreive the pipe object associated with this file node */
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
 
-#if DEBUG_PIPES
-	if (pipe->size > 300) { /* Ignore small pipes (ie, keyboard) */
-		debug_print(INFO, "[debug] Call to read from pipe 0x%x", node->device);
-		debug_print(INFO, "        Unread bytes:    %d", pipe_unread(pipe));
-		debug_print(INFO, "        Total size:      %d", pipe->size);
-		debug_print(INFO, "        Request size:    %d", size);
-		debug_print(INFO, "        Write pointer:   %d", pipe->write_ptr);
-		debug_print(INFO, "        Read  pointer:   %d", pipe->read_ptr);
-		debug_print(INFO, "        Buffer address:  0x%x", pipe->buffer);
-	}
-#endif
+	TRACE(TRACE_PIPE, "read 0x%x: %d bytes requested, %d unread", pipe, size, pipe_unread(pipe));
 
 	if (pipe->dead) {
 		debug_print(WARNING, "Pipe is dead?");
@@ -104,16 +84,23 @@ uint32_t read_pipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buf
 	size_t collected = 0;
 	while (collected == 0) {
 		spin_lock(pipe->lock_read);
-		while (pipe_unread(pipe) > 0 && collected < size) {
-			buffer[collected] = pipe->buffer[pipe->read_ptr];
-			pipe_increment_read(pipe);
-			collected++;
+		size_t count = MIN(pipe_unread(pipe), size);
+		if (count) {
+			/* The unread bytes wrap at most once: up to the end of the buffer, then from the start */
+			size_t first = MIN(count, pipe->size - pipe->read_ptr);
+			memcpy(buffer, &pipe->buffer[pipe->read_ptr], first);
+			if (count > first) {
+				memcpy(&buffer[first], pipe->buffer, count - first);
+			}
+			pipe_increment_read_by(pipe, count);
+			collected = count;
 		}
 		spin_unlock(pipe->lock_read);
-		wakeup_queue(pipe->wait_queue_writers);
 		/* Deschedule and switch */
 		if (collected == 0) {
 			sleep_on(pipe->wait_queue_readers);
+		} else {
+			wakeup_queue(pipe->wait_queue_writers);
 		}
 	}
 
@@ -126,18 +113,7 @@ uint32_t write_pipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *bu
 	/* Retreive the pipe object associated with this file node */
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
 
-#if DEBUG_PIPES
-	if (pipe->size > 300) { /* Ignore small pipes (ie, keyboard) */
-		debug_print(INFO, "[debug] Call to write to pipe 0x%x", node->device);
-		debug_print(INFO, "        Available space: %d", pipe_available(pipe));
-		debug_print(INFO, "        Total size:      %d", pipe->size);
-		debug_print(INFO, "        Request size:    %d", size);
-		debug_print(INFO, "        Write pointer:   %d", pipe->write_ptr);
-		debug_print(INFO, "        Read  pointer:   %d", pipe->read_ptr);
-		debug_print(INFO, "        Buffer address:  0x%x", pipe->buffer);
-		debug_print(INFO, " Write: %s", buffer);
-	}
-#endif
+	TRACE(TRACE_PIPE, "write 0x%x: %d bytes, %d available", pipe, size, pipe_available(pipe));
 
 	if (pipe->dead) {
 		debug_print(WARNING, "Pipe is dead?");
@@ -149,30 +125,23 @@ uint32_t write_pipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *bu
 	while (written < size) {
 		spin_lock(pipe->lock_write);
 
-#if 0
-		size_t available = 0;
-		if (pipe->read_ptr <= pipe->write_ptr) {
-			available = pipe->size - pipe->write_ptr;
-		} else {
-			available = pipe->read_ptr - pipe->write_ptr - 1;
-		}
-		if (available) {
-			available = min(available, size - written);
-			memcpy(&pipe->buffer[pipe->write_ptr], buffer, available);
-			pipe_increment_write_by(pipe, available);
-			written += available;
+		size_t count = MIN(pipe_available(pipe), size - written);
+		if (count) {
+			/* Likewise, the free space is at most two runs */
+			size_t first = MIN(count, pipe->size - pipe->write_ptr);
+			memcpy(&pipe->buffer[pipe->write_ptr], &buffer[written], first);
+			if (count > first) {
+				memcpy(pipe->buffer, &buffer[written + first], count - first);
+			}
+			pipe_increment_write_by(pipe, count);
+			written += count;
 		}
-#else
-		while (pipe_available(pipe) > 0 && written < size) {
-			pipe->buffer[pipe->write_ptr] = buffer[written];
-			pipe_increment_write(pipe);
-			written++;
-		}
-#endif
 
 		spin_unlock(pipe->lock_write);
-		wakeup_queue(pipe->wait_queue_readers);
-		pipe_alert_waiters(pipe);
+		if (count) {
+			wakeup_queue(pipe->wait_queue_readers);
+			pipe_alert_waiters(pipe);
+		}
 		if (written < size) {
 			sleep_on(pipe->wait_queue_writers);
 		}
@@ -65,7 +65,11 @@ static int ioctl_ramdisk(fs_node_t * node, int request, void * argp) {
 				return -EPERM;
 			} else {
 				/* Clear all of the memory used by this ramdisk */
-				if (node->length >= 0x1000) {
+				if (node->device) {
+					/* Inflated into the heap at boot */
+					free(node->device);
+					node->device = NULL;
+				} else if (node->length >= 0x1000) {
 					if (node->length % 0x1000) {
 						/* It would be a very bad idea to wipe the wrong page here. */
 						node->length -= node->length % 0x1000;
@@ -114,3 +118,16 @@ fs_node_t * ramdisk_mount(uintptr_t location, size_t size) {
 
 	return NULL;
 }
+
+/*
+ * Mount a ramdisk whose contents are in a buffer from the heap, such
+ * as one inflated from a compressed image, rather than in memory the
+ * bootloader put it in.
+ */
+fs_node_t * ramdisk_mount_buffer(void * buffer, size_t size) {
+	fs_node_t * ramdisk = ramdisk_mount((uintptr_t)buffer, size);
+	if (ramdisk) {
+		ramdisk->device = buffer;
+	}
+	return ramdisk;
+}
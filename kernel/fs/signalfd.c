@@ -0,0 +1,216 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Signal descriptors
+ *
+ * A signal descriptor takes the signals in its mask away from the
+ * process that made it: instead of running a handler (or the default
+ * action), send_signal() marks them pending here, and they are read
+ * back as struct signalfd_siginfo. The descriptor works with fswait,
+ * so a program waiting on several files anyway can take its signals
+ * the same way, with no handler and no trip through a signal frame.
+ *
+ * As with ordinary signals, a signal that is already pending is not
+ * queued again.
+ *
+ * Signals go to the descriptor's owner only; a copy inherited over
+ * fork() still reads the parent's. Once the owner exits, reads find
+ * nothing more.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/signal.h>
+
+#include <toaru/list.h>
+
+#include <sys/signalfd.h>
+
+/* These keep their usual meaning */
+#define SIGNALFD_UNCATCHABLE (SIGNALFD_BIT(SIGKILL) | SIGNALFD_BIT(SIGSTOP) | SIGNALFD_BIT(SIGCONT))
+
+typedef struct signalfd_state {
+	process_t * owner;
+	uint64_t mask;
+	uint64_t pending;
+	pid_t sender[NUMSIGNALS];
+	user_t sender_uid[NUMSIGNALS];
+	int nonblock;
+	list_t * wait_queue;
+	list_t * alert_waiters;
+} signalfd_state_t;
+
+static void alert_waiters(signalfd_state_t * state) {
+	if (state->alert_waiters) {
+		while (state->alert_waiters->head) {
+			node_t * node = list_dequeue(state->alert_waiters);
+			process_t * p = node->value;
+			process_alert_node(p, state);
+			free(node);
+		}
+	}
+}
+
+static uint32_t signalfd_read(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	signalfd_state_t * state = node->device;
+	if (size < sizeof(struct signalfd_siginfo)) return -EINVAL;
+
+	IRQ_OFF;
+	while (!state->pending) {
+		if (state->nonblock || !state->owner) {
+			IRQ_RES;
+			return state->owner ? -EAGAIN : 0;
+		}
+		if (sleep_on(state->wait_queue)) {
+			IRQ_RES;
+			return -EINTR;
+		}
+	}
+
+	uint32_t out = 0;
+	for (int signum = 1; signum < NUMSIGNALS && out + sizeof(struct signalfd_siginfo) <= size; ++signum) {
+		if (!(state->pending & SIGNALFD_BIT(signum))) continue;
+		struct signalfd_siginfo * info = (struct signalfd_siginfo *)(buffer + out);
+		memset(info, 0, sizeof(struct signalfd_siginfo));
+		info->ssi_signo = signum;
+		info->ssi_pid = state->sender[signum];
+		info->ssi_uid = state->sender_uid[signum];
+		state->pending &= ~SIGNALFD_BIT(signum);
+		out += sizeof(struct signalfd_siginfo);
+	}
+	IRQ_RES;
+
+	return out;
+}
+
+static int signalfd_check(fs_node_t * node) {
+	signalfd_state_t * state = node->device;
+	return (state->pending || !state->owner) ? 0 : 1;
+}
+
+static int signalfd_wait(fs_node_t * node, void * process) {
+	signalfd_state_t * state = node->device;
+	if (!state->alert_waiters) {
+		state->alert_waiters = list_create();
+	}
+	if (!list_find(state->alert_waiters, process)) {
+		list_insert(state->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, state);
+	return 0;
+}
+
+static void signalfd_close(fs_node_t * node) {
+	signalfd_state_t * state = node->device;
+	IRQ_OFF;
+	if (state->owner) {
+		node_t * n = list_find(state->owner->signalfds, state);
+		if (n) list_delete(state->owner->signalfds, n);
+		free(n);
+	}
+	wakeup_queue(state->wait_queue);
+	IRQ_RES;
+	list_free(state->wait_queue);
+	free(state->wait_queue);
+	if (state->alert_waiters) {
+		list_free(state->alert_waiters);
+		free(state->alert_waiters);
+	}
+	free(state);
+}
+
+/**
+ * Create a signal descriptor for the current process, or, given one
+ * of its own, change its mask.
+ */
+fs_node_t * signalfd_create(fs_node_t * existing, uint64_t mask, int flags, int * error) {
+	process_t * owner = process_from_pid(current_process->group);
+	mask &= (SIGNALFD_BIT(NUMSIGNALS) - 1) & ~SIGNALFD_UNCATCHABLE & ~1ULL;
+
+	if (existing) {
+		if (existing->read != signalfd_read) {
+			*error = -EINVAL;
+			return NULL;
+		}
+		signalfd_state_t * state = existing->device;
+		if (state->owner != owner) {
+			*error = -EINVAL;
+			return NULL;
+		}
+		IRQ_OFF;
+		state->mask = mask;
+		state->pending &= mask;
+		state->nonblock = !!(flags & SFD_NONBLOCK);
+		IRQ_RES;
+		return existing;
+	}
+
+	signalfd_state_t * state = malloc(sizeof(signalfd_state_t));
+	memset(state, 0, sizeof(signalfd_state_t));
+	state->owner = owner;
+	state->mask = mask;
+	state->nonblock = !!(flags & SFD_NONBLOCK);
+	state->wait_queue = list_create();
+
+	IRQ_OFF;
+	if (!owner->signalfds) owner->signalfds = list_create();
+	list_insert(owner->signalfds, state);
+	IRQ_RES;
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+	sprintf(fnode->name, "[signalfd]");
+	fnode->mask = 0600;
+	fnode->uid = current_process->user;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->read = signalfd_read;
+	fnode->close = signalfd_close;
+	fnode->selectcheck = signalfd_check;
+	fnode->selectwait = signalfd_wait;
+	fnode->device = state;
+
+	return fnode;
+}
+
+/**
+ * Called by send_signal(); returns 1 if a descriptor took the signal.
+ */
+int signalfd_post(process_t * receiver, int signum) {
+	if (!receiver->signalfds) return 0;
+	if (signum <= 0 || signum >= NUMSIGNALS) return 0;
+	int taken = 0;
+	IRQ_OFF;
+	foreach(node, receiver->signalfds) {
+		signalfd_state_t * state = node->value;
+		if (!(state->mask & SIGNALFD_BIT(signum))) continue;
+		state->pending |= SIGNALFD_BIT(signum);
+		state->sender[signum] = current_process->id;
+		state->sender_uid[signum] = current_process->user;
+		wakeup_queue(state->wait_queue);
+		alert_waiters(state);
+		taken = 1;
+	}
+	IRQ_RES;
+	return taken;
+}
+
+/**
+ * The owner is exiting; its descriptors may live on in other processes.
+ */
+void signalfd_release(process_t * proc) {
+	if (!proc->signalfds) return;
+	IRQ_OFF;
+	foreach(node, proc->signalfds) {
+		signalfd_state_t * state = node->value;
+		state->owner = NULL;
+		wakeup_queue(state->wait_queue);
+		alert_waiters(state);
+	}
+	list_free(proc->signalfds);
+	free(proc->signalfds);
+	proc->signalfds = NULL;
+	IRQ_RES;
+}
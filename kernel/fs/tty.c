@@ -77,6 +77,46 @@ void tty_output_process(pty_t * pty, uint8_t c) {
 	output_process_slave(pty, c);
 }
 
+/* Does this byte come out of the slave as it went in? */
+static int output_is_plain(pty_t * pty, uint8_t c) {
+	if (c == '\n' && (pty->tios.c_oflag & ONLCR)) return 0;
+	if (c == '\r' && (pty->tios.c_oflag & ONLRET)) return 0;
+	if (c >= 'a' && c <= 'z' && (pty->tios.c_oflag & OLCUC)) return 0;
+	return 1;
+}
+
+/*
+ * Output a whole buffer, writing runs of bytes that need no
+ * translation to the ring buffer in one go.
+ */
+static void output_process_span(pty_t * pty, uint8_t * buffer, size_t size) {
+	if (pty->write_out != pty_write_out) {
+		/* Someone else (a serial port) takes them one at a time */
+		for (size_t i = 0; i < size; ++i) {
+			output_process_slave(pty, buffer[i]);
+		}
+		return;
+	}
+
+	if (!(pty->tios.c_oflag & (ONLCR | ONLRET | OLCUC))) {
+		ring_buffer_write(pty->out, size, buffer);
+		return;
+	}
+
+	size_t start = 0;
+	for (size_t i = 0; i < size; ++i) {
+		if (output_is_plain(pty, buffer[i])) continue;
+		if (i > start) {
+			ring_buffer_write(pty->out, i - start, &buffer[start]);
+		}
+		output_process_slave(pty, buffer[i]);
+		start = i + 1;
+	}
+	if (size > start) {
+		ring_buffer_write(pty->out, size - start, &buffer[start]);
+	}
+}
+
 static int is_control(int c) {
 	return c < ' ' || c == 0x7F;
 }
@@ -244,6 +284,44 @@ void tty_input_process(pty_t * pty, uint8_t c) {
 	IN(c);
 }
 
+/*
+ * Does this byte go straight to the slave, echoed as it is if at all?
+ * Never in canonical mode, where everything goes through the line editor.
+ */
+static int input_is_plain(pty_t * pty, uint8_t c) {
+	if (pty->tios.c_lflag & ISIG) {
+		if (c == pty->tios.c_cc[VINTR] || c == pty->tios.c_cc[VQUIT] || c == pty->tios.c_cc[VSUSP]) return 0;
+	}
+	if ((c & 0x80) && (pty->tios.c_iflag & ISTRIP)) return 0;
+	if (c == '\r' && (pty->tios.c_iflag & (IGNCR | ICRNL))) return 0;
+	if (c == '\n' && (pty->tios.c_iflag & INLCR)) return 0;
+	return 1;
+}
+
+static void input_process_span(pty_t * pty, uint8_t * buffer, size_t size) {
+	if ((pty->tios.c_lflag & ICANON) || pty->next_is_verbatim || pty->write_in != pty_write_in) {
+		for (size_t i = 0; i < size; ++i) {
+			input_process(pty, buffer[i]);
+		}
+		return;
+	}
+
+	size_t start = 0;
+	for (size_t i = 0; i <= size; ++i) {
+		if (i < size && input_is_plain(pty, buffer[i])) continue;
+		if (i > start) {
+			if (pty->tios.c_lflag & ECHO) {
+				output_process_span(pty, &buffer[start], i - start);
+			}
+			ring_buffer_write(pty->in, i - start, &buffer[start]);
+		}
+		if (i < size) {
+			input_process(pty, buffer[i]);
+		}
+		start = i + 1;
+	}
+}
+
 static void tty_fill_name(pty_t * pty, char * out) {
 	((char*)out)[0] = '\0';
 	sprintf((char*)out, "/dev/pts/%d", pty->name);
@@ -311,6 +389,9 @@ int pty_ioctl(pty_t * pty, int request, void * argp) {
 				dump_input_buffer(pty);
 			}
 			memcpy(&pty->tios, argp, sizeof(struct termios));
+			if (pty->tios_changed) {
+				pty->tios_changed(pty);
+			}
 			return 0;
 		default:
 			return -EINVAL;
@@ -326,12 +407,9 @@ uint32_t  read_pty_master(fs_node_t * node, uint64_t offset, uint32_t size, uint
 uint32_t write_pty_master(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	pty_t * pty = (pty_t *)node->device;
 
-	size_t l = 0;
-	for (uint8_t * c = buffer; l < size; ++c, ++l) {
-		input_process(pty, *c);
-	}
+	input_process_span(pty, buffer, size);
 
-	return l;
+	return size;
 }
 void      open_pty_master(fs_node_t * node, unsigned int flags) {
 	return;
@@ -357,12 +435,9 @@ uint32_t  read_pty_slave(fs_node_t * node, uint64_t offset, uint32_t size, uint8
 uint32_t write_pty_slave(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	pty_t * pty = (pty_t *)node->device;
 
-	size_t l = 0;
-	for (uint8_t * c = buffer; l < size; ++c, ++l) {
-		output_process_slave(pty, *c);
-	}
+	output_process_span(pty, buffer, size);
 
-	return l;
+	return size;
 }
 void      open_pty_slave(fs_node_t * node, unsigned int flags) {
 	return;
@@ -495,8 +570,8 @@ static int readlink_dev_tty(fs_node_t * node, char * buf, size_t size) {
 	pty_t * pty = NULL;
 
 	for (unsigned int i = 0; i < ((current_process->fds->length < 3) ? current_process->fds->length : 3); ++i) {
-		if (isatty(current_process->fds->entries[i])) {
-			pty = (pty_t *)current_process->fds->entries[i]->device;
+		if (current_process->fds->entries[i] && isatty(current_process->fds->entries[i]->node)) {
+			pty = (pty_t *)current_process->fds->entries[i]->node->device;
 			break;
 		}
 	}
@@ -662,6 +737,7 @@ pty_t * pty_new(struct winsize * size) {
 
 	pty->write_in = pty_write_in;
 	pty->write_out = pty_write_out;
+	pty->tios_changed = NULL;
 
 	hashmap_set(_pty_index, (void*)pty->name, pty);
 
@@ -12,7 +12,7 @@
 
 #include <sys/ioctl.h>
 
-#define UNIX_PIPE_BUFFER 512
+#define UNIX_PIPE_BUFFER 4096
 
 struct unix_pipe {
 	fs_node_t * read_end;
@@ -28,19 +28,34 @@ static void close_complete(struct unix_pipe * self) {
 	ring_buffer_destroy(self->buffer);
 }
 
+/*
+ * Reads still stop after a newline, so line-at-a-time readers keep
+ * working, but take whole spans out of the buffer rather than a byte
+ * per call.
+ */
 static uint32_t read_unixpipe(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	struct unix_pipe * self = node->device;
 	size_t read = 0;
 
 	while (read < size) {
-		if (self->write_closed && !ring_buffer_unread(self->buffer)) {
-			return read;
+		uint8_t * span;
+		size_t length = ring_buffer_peek(self->buffer, 0, &span);
+		if (!length) {
+			if (self->write_closed) {
+				return read;
+			}
+			ring_buffer_wait_unread(self->buffer);
+			continue;
 		}
-		size_t r = ring_buffer_read(self->buffer, 1, buffer+read);
-		if (r && *((char *)(buffer + read)) == '\n') {
-			return read+r;
+		if (length > size - read) length = size - read;
+		uint8_t * newline = memchr(span, '\n', length);
+		if (newline) length = newline - span + 1;
+		memcpy(buffer + read, span, length);
+		ring_buffer_consume(self->buffer, length);
+		read += length;
+		if (newline) {
+			return read;
 		}
-		read += r;
 	}
 
 	return read;
@@ -57,13 +72,112 @@ static uint32_t write_unixpipe(fs_node_t * node, uint64_t offset, uint32_t size,
 
 			return written;
 		}
-		size_t w = ring_buffer_write(self->buffer, 1, buffer+written);
-		written += w;
+		written += ring_buffer_write(self->buffer, size - written, buffer + written);
 	}
 
 	return written;
 }
 
+int unixpipe_is_reader(fs_node_t * node) {
+	return node->read == read_unixpipe;
+}
+
+int unixpipe_is_writer(fs_node_t * node) {
+	return node->write == write_unixpipe;
+}
+
+/*
+ * splice() and tee() support. Data leaving a pipe is handed to the
+ * destination's write straight out of the pipe's buffer, and data
+ * entering one is read by the source straight into it, so the only
+ * copy is the one the other node makes anyway.
+ */
+int unixpipe_splice_out(fs_node_t * node, fs_node_t * out, uint64_t * out_at, size_t len) {
+	struct unix_pipe * self = node->device;
+	size_t moved = 0;
+
+	while (moved < len) {
+		uint8_t * span;
+		size_t length = ring_buffer_peek(self->buffer, 0, &span);
+		if (!length) {
+			/* Like read, return what we have rather than wait for more */
+			if (moved || self->write_closed) break;
+			ring_buffer_wait_unread(self->buffer);
+			continue;
+		}
+		if (length > len - moved) length = len - moved;
+		int w = write_fs(out, *out_at, length, span);
+		if (w <= 0) {
+			if (!moved && w < 0) return w;
+			break;
+		}
+		ring_buffer_consume(self->buffer, w);
+		*out_at += w;
+		moved += w;
+		if ((size_t)w < length) break;
+	}
+
+	return moved;
+}
+
+int unixpipe_splice_in(fs_node_t * in, uint64_t * in_at, fs_node_t * node, size_t len) {
+	struct unix_pipe * self = node->device;
+	size_t moved = 0;
+
+	while (moved < len) {
+		if (self->read_closed) {
+			send_signal(getpid(), SIGPIPE, 1);
+			return moved ? (int)moved : -EPIPE;
+		}
+		uint8_t * span;
+		size_t length = ring_buffer_reserve(self->buffer, &span);
+		if (!length) {
+			ring_buffer_wait_available(self->buffer);
+			continue;
+		}
+		if (length > len - moved) length = len - moved;
+		int r = read_fs(in, *in_at, length, span);
+		if (r <= 0) {
+			if (!moved && r < 0) return r;
+			break;
+		}
+		ring_buffer_commit(self->buffer, r);
+		*in_at += r;
+		moved += r;
+		if ((size_t)r < length) break;
+	}
+
+	return moved;
+}
+
+/* Copy what is waiting in one pipe into another, leaving it to be read */
+int unixpipe_tee(fs_node_t * node, fs_node_t * out, size_t len) {
+	struct unix_pipe * self = node->device;
+	struct unix_pipe * dest = out->device;
+	size_t copied = 0;
+
+	while (!ring_buffer_unread(self->buffer)) {
+		if (self->write_closed) return 0;
+		ring_buffer_wait_unread(self->buffer);
+	}
+
+	while (copied < len) {
+		if (dest->read_closed) {
+			send_signal(getpid(), SIGPIPE, 1);
+			return copied ? (int)copied : -EPIPE;
+		}
+		uint8_t * span;
+		size_t length = ring_buffer_peek(self->buffer, copied, &span);
+		if (!length) break;
+		if (length > len - copied) length = len - copied;
+		size_t w = ring_buffer_write(dest->buffer, length, span);
+		copied += w;
+		if (w < length) break;
+	}
+
+	return copied;
+}
+
 static void close_read_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
 
@@ -13,6 +13,11 @@
 #include <kernel/printf.h>
 #include <kernel/process.h>
 #include <kernel/logging.h>
+#include <kernel/pagecache.h>
+#include <kernel/dcache.h>
+#include <kernel/slab.h>
+#include <kernel/trace.h>
+#include <kernel/boottime.h>
 
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
@@ -25,6 +30,9 @@ fs_node_t * fs_root = NULL; /* Pointer to the root mount fs_node (must be some f
 
 hashmap_t * fs_types = NULL;
 
+/* Nodes cloned by kopen(); like any node, they are released with free() */
+static slab_cache_t * fs_node_cache = NULL;
+
 
 int has_permission(fs_node_t * node, int permission_bit) {
 	if (!node) return 0;
@@ -86,7 +94,7 @@ static struct dirent * readdir_mapper(fs_node_t *node, uint32_t index) {
 }
 
 static fs_node_t * vfs_mapper(void) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = slab_alloc(fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->mask = 0555;
 	fnode->flags   = FS_DIRECTORY;
@@ -136,6 +144,9 @@ uint32_t read_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffe
 	if (!node) return -ENOENT;
 
 	if (node->read) {
+		if (node->flags & FS_PAGECACHE) {
+			return pagecache_read(node, offset, size, buffer);
+		}
 		uint32_t ret = node->read(node, offset, size, buffer);
 		return ret;
 	} else {
@@ -157,6 +168,12 @@ uint32_t write_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buff
 
 	if (node->write) {
 		uint32_t ret = node->write(node, offset, size, buffer);
+		if ((node->flags & FS_PAGECACHE) && (int32_t)ret > 0) {
+			pagecache_update(node, offset, ret, buffer);
+		}
+		if ((node->flags & FS_DCACHE) && (int32_t)ret > 0) {
+			dcache_invalidate(node);
+		}
 		return ret;
 	} else {
 		return -EROFS;
@@ -173,9 +190,48 @@ void truncate_fs(fs_node_t * node) {
 
 	if (node->truncate) {
 		node->truncate(node);
+		if (node->flags & FS_PAGECACHE) {
+			pagecache_invalidate(node);
+		}
+		if (node->flags & FS_DCACHE) {
+			dcache_invalidate(node);
+		}
 	}
 }
 
+/**
+ * sync_fs: Write out anything the filesystem has cached for a node.
+ *
+ * @param node File to sync
+ * @returns 0 on success, or a negative error
+ */
+int sync_fs(fs_node_t * node) {
+	if (!node) return -EBADF;
+
+	if (node->sync) {
+		return node->sync(node);
+	}
+	return 0;
+}
+
+static void sync_tree_node(tree_node_t * node) {
+	struct vfs_entry * entry = (struct vfs_entry *)node->value;
+	if (entry->file) {
+		sync_fs(entry->file);
+	}
+	foreach(child, node->children) {
+		sync_tree_node(child->value);
+	}
+}
+
+/**
+ * sync_all: Sync every mounted filesystem.
+ */
+void sync_all(void) {
+	if (!fs_tree || !fs_tree->root) return;
+	sync_tree_node(fs_tree->root);
+}
+
 //volatile uint8_t tmp_refcount_lock = 0;
 static spin_lock_t tmp_refcount_lock = { 0 };
 
@@ -240,7 +296,11 @@ void close_fs(fs_node_t *node) {
  */
 int chmod_fs(fs_node_t *node, int mode) {
 	if (node->chmod) {
-		return node->chmod(node, mode);
+		int ret = node->chmod(node, mode);
+		if (node->flags & FS_DCACHE) {
+			dcache_invalidate(node);
+		}
+		return ret;
 	}
 	return 0;
 }
@@ -250,7 +310,11 @@ int chmod_fs(fs_node_t *node, int mode) {
  */
 int chown_fs(fs_node_t *node, int uid, int gid) {
 	if (node->chown) {
-		return node->chown(node, uid, gid);
+		int ret = node->chown(node, uid, gid);
+		if (node->flags & FS_DCACHE) {
+			dcache_invalidate(node);
+		}
+		return ret;
 	}
 	return 0;
 }
@@ -273,6 +337,42 @@ struct dirent *readdir_fs(fs_node_t *node, uint32_t index) {
 	}
 }
 
+/**
+ * getdents_fs: Read a batch of directory entries
+ *
+ * The cursor is opaque to the caller; it starts at 0 and is advanced
+ * past the entries returned, so the next call picks up where this one
+ * stopped. Filesystems that don't provide getdents use an index into
+ * readdir as the cursor.
+ *
+ * @param node    Directory to read
+ * @param cursor  Where to resume reading
+ * @param entries Where to put the entries read
+ * @param count   How many entries fit in `entries`
+ * @returns Number of entries read, 0 at the end of the directory
+ */
+int getdents_fs(fs_node_t *node, uint32_t * cursor, struct dirent * entries, uint32_t count) {
+	if (!node) return -ENOENT;
+	if (!(node->flags & FS_DIRECTORY)) return -ENOTDIR;
+
+	if (node->getdents) {
+		return node->getdents(node, cursor, entries, count);
+	}
+
+	if (!node->readdir) return -EINVAL;
+
+	uint32_t read = 0;
+	while (read < count) {
+		struct dirent * ent = node->readdir(node, *cursor);
+		if (!ent) break;
+		memcpy(&entries[read], ent, sizeof(struct dirent));
+		free(ent);
+		read++;
+		(*cursor)++;
+	}
+	return read;
+}
+
 /**
  * finddir_fs: Find the requested file in the directory and return an fs_node for it
  *
@@ -284,7 +384,16 @@ fs_node_t *finddir_fs(fs_node_t *node, char *name) {
 	if (!node) return NULL;
 
 	if ((node->flags & FS_DIRECTORY) && node->finddir) {
-		fs_node_t *ret = node->finddir(node, name);
+		fs_node_t *ret;
+		if (!(node->flags & FS_DCACHE)) {
+			return node->finddir(node, name);
+		}
+		if (dcache_lookup(node, name, &ret)) {
+			return ret;
+		}
+		uint32_t generation = dcache_generation();
+		ret = node->finddir(node, name);
+		dcache_insert(node, name, ret, generation);
 		return ret;
 	} else {
 		debug_print(WARNING, "Node passed to finddir_fs isn't a directory!");
@@ -312,6 +421,17 @@ int ioctl_fs(fs_node_t *node, int request, void * argp) {
 }
 
 
+/*
+ * A directory gained or lost `name`: forget the cached lookup, and
+ * any cached copies of the directory itself, whose size has changed.
+ */
+static void directory_changed(fs_node_t * parent, char * name) {
+	if (parent->flags & FS_DCACHE) {
+		dcache_forget(parent, name);
+		dcache_invalidate(parent);
+	}
+}
+
 /*
  * XXX: The following two function should be replaced with
  *      one function to create children of directory nodes.
@@ -359,6 +479,7 @@ int create_file_fs(char *name, uint16_t permission) {
 	int ret = 0;
 	if (parent->create) {
 		ret = parent->create(parent, f_path, permission);
+		directory_changed(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -406,13 +527,25 @@ int unlink_fs(char * name) {
 		return -EACCES;
 	}
 
+	/* Hold on to the file long enough to drop its cached pages */
+	fs_node_t * file = kopen(path, O_NOFOLLOW);
+
 	int ret = 0;
 	if (parent->unlink) {
 		ret = parent->unlink(parent, f_path);
+		if (file && !ret && (file->flags & FS_PAGECACHE)) {
+			pagecache_invalidate(file);
+		}
+		if (file && !ret && (file->flags & FS_DCACHE)) {
+			/* Other names for it have one less link now */
+			dcache_invalidate(file);
+		}
+		directory_changed(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
 
+	if (file) close_fs(file);
 	free(path);
 	close_fs(parent);
 	return ret;
@@ -474,6 +607,7 @@ int mkdir_fs(char *name, uint16_t permission) {
 	int ret = 0;
 	if (parent->mkdir) {
 		ret = parent->mkdir(parent, f_path, permission);
+		directory_changed(parent, f_path);
 	} else {
 		ret = -EROFS;
 	}
@@ -526,6 +660,7 @@ int symlink_fs(char * target, char * name) {
 	int ret = 0;
 	if (parent->symlink) {
 		ret = parent->symlink(parent, target, f_path);
+		directory_changed(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -665,6 +800,8 @@ char *canonicalize_path(char *cwd, char *input) {
 }
 
 void vfs_install(void) {
+	fs_node_cache = slab_create("fs_node_t", sizeof(fs_node_t), NULL);
+
 	/* Initialize the mountpoint tree */
 	fs_tree = tree_create();
 
@@ -694,7 +831,9 @@ int vfs_mount_type(char * type, char * arg, char * mountpoint) {
 		return -ENODEV;
 	}
 
+	boot_begin("mount %s", mountpoint);
 	fs_node_t * n = t(arg, mountpoint);
+	boot_end("mount %s", mountpoint);
 
 	if (!n) return -EINVAL;
 
@@ -878,7 +1017,7 @@ fs_node_t *get_mount_point(char * path, unsigned int path_depth, char **outpath,
 			break;
 		}
 		int found = 0;
-		debug_print(INFO, "Searching for %s", at);
+		TRACE_STRING(TRACE_VFS, "mount lookup %s", at);
 		foreach(child, node->children) {
 			tree_node_t * tchild = (tree_node_t *)child->value;
 			struct vfs_entry * ent = (struct vfs_entry *)tchild->value;
@@ -903,7 +1042,7 @@ fs_node_t *get_mount_point(char * path, unsigned int path_depth, char **outpath,
 	*outdepth = _tree_depth;
 
 	if (last) {
-		fs_node_t * last_clone = malloc(sizeof(fs_node_t));
+		fs_node_t * last_clone = slab_alloc(fs_node_cache);
 		memcpy(last_clone, last, sizeof(fs_node_t));
 		return last_clone;
 	}
@@ -926,7 +1065,7 @@ fs_node_t *kopen_recur(char *filename, uint32_t flags, uint32_t symlink_depth, c
 	/* If strlen(path) == 1, then path = "/"; return root */
 	if (path_len == 1) {
 		/* Clone the root file system node */
-		fs_node_t *root_clone = malloc(sizeof(fs_node_t));
+		fs_node_t *root_clone = slab_alloc(fs_node_cache);
 		memcpy(root_clone, fs_root, sizeof(fs_node_t));
 
 		/* Free the path */
@@ -1081,6 +1220,7 @@ fs_node_t *kopen_recur(char *filename, uint32_t flags, uint32_t symlink_depth, c
  */
 fs_node_t *kopen(char *filename, uint32_t flags) {
 	debug_print(NOTICE, "kopen(%s)", filename);
+	TRACE_STRING(TRACE_VFS, "open %s", filename);
 
 	return kopen_recur(filename, flags, 0, (char *)(current_process->wd_name));
 }
@@ -48,11 +48,28 @@
 #include <kernel/shm.h>
 #include <kernel/args.h>
 #include <kernel/module.h>
+#include <kernel/swap.h>
 #include <kernel/pci.h>
+#include <kernel/trace.h>
+#include <kernel/boottime.h>
+#include <kernel/gzip.h>
+#include <kernel/mem.h>
+#include <kernel/random.h>
 
 uintptr_t initial_esp = 0;
 
 fs_node_t * ramdisk_mount(uintptr_t, size_t);
+fs_node_t * ramdisk_mount_buffer(void *, size_t);
+
+/*
+ * Give back the frames of a bootloader module we've made a copy of.
+ * Only whole pages go; a module may share its first or last page.
+ */
+static void release_boot_module(uintptr_t start, uintptr_t end) {
+	for (uintptr_t i = (start + 0xFFF) & ~0xFFF; i + 0x1000 <= end; i += 0x1000) {
+		clear_frame(i);
+	}
+}
 
 #ifdef EARLY_BOOT_LOG
 #define EARLY_LOG_DEVICE 0x3F8
@@ -87,6 +104,7 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	mboot_ptr = mboot;
 
 	ENABLE_EARLY_BOOT_LOG(0);
+	boot_mark("kmain");
 
 	assert(mboot_mag == MULTIBOOT_EAX_MAGIC && "Didn't boot with multiboot, not sure how we got here.");
 	debug_print(NOTICE, "Processing Multiboot information.");
@@ -146,7 +164,9 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 			mmap = (mboot_memmap_t *) ((uintptr_t)mmap + mmap->size + sizeof(uintptr_t));
 		}
 	}
+	acpi_install();     /* Processor tables, read before paging is on */
 	paging_finalize();
+	boot_mark("paging");
 
 	{
 		char cmdline_[1024];
@@ -172,15 +192,19 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	vfs_install();
 	tasking_install();  /* Multi-tasking */
 	timer_install();    /* PIC driver */
+	random_install();   /* Kernel CSPRNG */
 	fpu_install();      /* FPU/SSE magic */
 	syscalls_install(); /* Install the system calls */
 	shm_install();      /* Install shared memory */
+	trace_install();    /* Tracepoints */
 	modules_install();  /* Modules! */
-	pci_remap();
+	pci_install();      /* Enumerate PCI devices */
+	boot_mark("core");
 
 	DISABLE_EARLY_BOOT_LOG();
 
 	/* Load modules from bootloader */
+	boot_begin("boot modules");
 	if (mboot_ptr->flags & MULTIBOOT_FLAG_MODS) {
 		debug_print(NOTICE, "%d modules to load", mboot_mods_count);
 		for (unsigned int i = 0; i < mboot_ptr->mods_count; ++i ) {
@@ -188,18 +212,31 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 			uint32_t module_start = mod->mod_start;
 			uint32_t module_end = mod->mod_end;
 			size_t   module_size = module_end - module_start;
+			void *   module_data = (void *)module_start;
+			int      inflated = 0;
+
+			if (gzip_check(module_data, module_size)) {
+				debug_print(NOTICE, "Inflating module: 0x%x:0x%x", module_start, module_end);
+				module_data = gzip_inflate((void *)module_start, module_size, &module_size);
+				if (!module_data) {
+					debug_print(ERROR, "Failed to inflate module %d; skipping it", i);
+					continue;
+				}
+				release_boot_module(module_start, module_end);
+				inflated = 1;
+			}
 
-			int check_result = module_quickcheck((void *)module_start);
+			int check_result = module_quickcheck(module_data);
 			if (check_result == 1) {
-				debug_print(NOTICE, "Loading a module: 0x%x:0x%x", module_start, module_end);
-				module_data_t * mod_info = (module_data_t *)module_load_direct((void *)(module_start), module_size);
+				debug_print(NOTICE, "Loading a module: 0x%x:0x%x", module_data, (uintptr_t)module_data + module_size);
+				module_data_t * mod_info = (module_data_t *)module_load_direct(module_data, module_size);
 				if (mod_info) {
 					debug_print(NOTICE, "Loaded: %s", mod_info->mod_info->name);
 				}
 			} else if (check_result == 2) {
 				/* Mod pack */
-				debug_print(NOTICE, "Loading modpack. %x", module_start);
-				struct pack_header * pack_header = (struct pack_header *)module_start;
+				debug_print(NOTICE, "Loading modpack. %x", module_data);
+				struct pack_header * pack_header = (struct pack_header *)module_data;
 				while (pack_header->region_size) {
 					void * start = (void *)((uintptr_t)pack_header + 4096);
 					int result = module_quickcheck(start);
@@ -213,12 +250,16 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 					pack_header = (struct pack_header *)((uintptr_t)start + pack_header->region_size);
 				}
 				debug_print(NOTICE, "Done with modpack.");
+			} else if (inflated) {
+				debug_print(NOTICE, "Loading ramdisk: 0x%x:0x%x", module_data, (uintptr_t)module_data + module_size);
+				ramdisk_mount_buffer(module_data, module_size);
 			} else {
 				debug_print(NOTICE, "Loading ramdisk: 0x%x:0x%x", module_start, module_end);
 				ramdisk_mount(module_start, module_size);
 			}
 		}
 	}
+	boot_end("boot modules");
 
 	/* Map /dev to a device mapper */
 	map_vfs_directory("/dev");
@@ -231,6 +272,10 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 		vfs_mount_type(root_type, args_value("root"), "/");
 	}
 
+	if (args_present("swap")) {
+		swap_on(args_value("swap"));
+	}
+
 	if (args_present("args")) {
 		char * c = args_value("args");
 		if (!c) {
@@ -260,6 +305,8 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	while (argv[argc]) {
 		argc++;
 	}
+	boot_mark("init");
+	modules_start_deferred();
 	system(argv[0], argc, argv, NULL); /* Run init */
 
 	debug_print(CRITICAL, "init failed");
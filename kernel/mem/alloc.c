@@ -103,6 +103,8 @@
 
 /* Includes {{{ */
 #include <kernel/system.h>
+#include <kernel/slab.h>
+#include <kernel/kmalloc.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -170,9 +172,23 @@ static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
 static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
+static uintptr_t klmalloc_bin_size(uintptr_t size);
 
 static spin_lock_t mem_lock =  { 0 };
 
+/*
+ * Allocation profiler hooks (kernel/misc/kmalloc_profile.c), run under
+ * mem_lock. While the profiler is off they cost a load and a branch.
+ */
+#define PROFILE_ALLOC(ret, size) do { \
+		if (kmalloc_profile_sampling && (ret)) { \
+			kmalloc_profile_alloc((ret), (size), klmalloc_bin_size(size), (uintptr_t)__builtin_return_address(0)); \
+		} } while (0)
+#define PROFILE_FREE(ptr) do { \
+		if (kmalloc_profile_tracked && (ptr)) { \
+			kmalloc_profile_free(ptr); \
+		} } while (0)
+
 void * __attribute__ ((malloc)) malloc(uintptr_t size) {
 	spin_lock(mem_lock);
 #ifdef _DEBUG_MALLOC
@@ -197,6 +213,7 @@ void * __attribute__ ((malloc)) malloc(uintptr_t size) {
 	} __attribute__((packed)) log = {'m',(uint32_t)ret,size-8,0xDEADBEEF,_eip};
 	write_fs(&_kmalloc_log, 0, sizeof(log), (uint8_t *)&log);
 #endif
+	PROFILE_ALLOC(ret, size);
 	spin_unlock(mem_lock);
 	return ret;
 }
@@ -225,6 +242,10 @@ void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 	} __attribute__((packed)) log = {'r',(uint32_t)ptr,size-8,(uint32_t)ret,_eip};
 	write_fs(&_kmalloc_log, 0, sizeof(log), (uint8_t *)&log);
 #endif
+	if (ret || !size) {
+		PROFILE_FREE(ptr);
+	}
+	PROFILE_ALLOC(ret, size);
 	spin_unlock(mem_lock);
 	return ret;
 }
@@ -242,6 +263,7 @@ void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
 	} __attribute__((packed)) log = {'c',(uint32_t)ret,size,nmemb,0};
 	write_fs(&_kmalloc_log, 0, sizeof(log), (uint8_t *)&log);
 #endif
+	PROFILE_ALLOC(ret, nmemb * size);
 	spin_unlock(mem_lock);
 	return ret;
 }
@@ -270,11 +292,32 @@ void * __attribute__ ((malloc)) valloc(uintptr_t size) {
 	} __attribute__((packed)) log = {'v',(uint32_t)ret,size-8,0xDEADBEEF,_eip};
 	write_fs(&_kmalloc_log, 0, sizeof(log), (uint8_t *)&log);
 #endif
+	PROFILE_ALLOC(ret, size);
+	spin_unlock(mem_lock);
+	return ret;
+}
+
+/*
+ * Take whole pages from the heap for an allocator that manages its
+ * own (the slab caches). They can't be given back with free().
+ */
+void * heap_pages(uintptr_t count) {
+	spin_lock(mem_lock);
+	void * ret = sbrk(count * PAGE_SIZE);
 	spin_unlock(mem_lock);
 	return ret;
 }
 
 void free(void * ptr) {
+	if ((uintptr_t)ptr > placement_pointer) {
+		/* Objects from slab caches go back to their cache */
+		slab_cache_t * cache = slab_owner(ptr);
+		if (cache) {
+			slab_free(cache, ptr);
+			return;
+		}
+	}
+
 	spin_lock(mem_lock);
 	if ((uintptr_t)ptr > placement_pointer) {
 #ifdef _DEBUG_MALLOC
@@ -313,6 +356,7 @@ void free(void * ptr) {
 		} __attribute__((packed)) log = {'f',(uint32_t)ptr,_failed ? 0xFFFFFFFF : x[1],_failed ? 0xFFFFFFFF : x[0],_eip};
 		write_fs(&_kmalloc_log, 0, sizeof(log), (uint8_t *)&log);
 #endif
+		PROFILE_FREE(ptr);
 		klfree(ptr);
 	}
 	spin_unlock(mem_lock);
@@ -393,6 +437,13 @@ static struct _klmalloc_big_bins {
 } klmalloc_big_bins;
 static klmalloc_big_bin_header * klmalloc_newest_big = NULL;		/* Newest big bin */
 
+/*
+ * Small bin usage, for kmalloc_heap_stats(). Pages are never given
+ * back, so these only count what has been handed out of them.
+ */
+static uint32_t klmalloc_bin_pages[NUM_BINS - 1];
+static uint32_t klmalloc_bin_used[NUM_BINS - 1];
+
 /* }}} Bin management */
 /* Doubly-Linked List {{{ */
 
@@ -770,8 +821,10 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			}
 			base[available << bucket_id] = NULL;
 			bin_header->size = bucket_id;
+			klmalloc_bin_pages[bucket_id]++;
 		}
 		uintptr_t ** item = klmalloc_stack_pop(bin_header);
+		klmalloc_bin_used[bucket_id]++;
 		if (klmalloc_stack_empty(bin_header)) {
 			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
 		}
@@ -1002,6 +1055,7 @@ static void klfree(void *ptr) {
 		 * Push new space back into the stack.
 		 */
 		klmalloc_stack_push(header, ptr);
+		klmalloc_bin_used[bucket_id]--;
 	}
 }
 /* }}} */
@@ -1097,6 +1151,42 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	return NULL;
 }
 /* }}} */
+/* Statistics {{{ */
+void kmalloc_heap_stats(struct kmalloc_heap_stats * out) {
+	memset(out, 0, sizeof(struct kmalloc_heap_stats));
+
+	spin_lock(mem_lock);
+	for (unsigned int i = 0; i < NUM_BINS - 1; ++i) {
+		out->bin_pages[i] = klmalloc_bin_pages[i];
+		out->bin_used[i]  = klmalloc_bin_used[i];
+		out->bin_cells[i] = (PAGE_SIZE - sizeof(klmalloc_bin_header)) >> (SMALLEST_BIN_LOG + i);
+	}
+
+	/*
+	 * Every big block is on the physical list; the ones with a
+	 * stack are free, and sitting in the skip list.
+	 */
+	for (klmalloc_big_bin_header * b = klmalloc_newest_big; b; b = b->prev) {
+		uint32_t pages = (b->size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE;
+		unsigned int class = sizeof(pages) * CHAR_BIT - 1 - __builtin_clz(pages);
+		if (class >= KMALLOC_BIG_CLASSES) class = KMALLOC_BIG_CLASSES - 1;
+		if (b->head) {
+			out->big_free[class]++;
+			out->big_free_pages += pages;
+		} else {
+			out->big_used[class]++;
+			out->big_used_pages += pages;
+		}
+	}
+
+	for (int i = 0; i <= klmalloc_big_bins.level && i < KMALLOC_SKIP_LEVELS; ++i) {
+		for (klmalloc_big_bin_header * b = klmalloc_big_bins.head.forward[i]; b; b = b->forward[i]) {
+			out->skip_level[i]++;
+		}
+	}
+	spin_unlock(mem_lock);
+}
+/* }}} */
 /* calloc() {{{ */
 static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
 	/*
@@ -0,0 +1,194 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * DMA buffers
+ *
+ * Devices see physical addresses, so a buffer bigger than a page has
+ * to be one run of physical memory. dma_alloc() takes the run from
+ * the frame allocator with alloc_frame_run(), in the zone the device can
+ * reach, and maps it uncached into a window of kernel addresses kept
+ * for the purpose past the heap. The heap's page tables are
+ * shared by every directory, as are the window's, so a buffer can be
+ * used from any process. dma_free() unmaps it and gives the frames
+ * back.
+ *
+ * Descriptors and command blocks are much smaller than a page; a
+ * pool hands them out in fixed sizes from pages it gets from
+ * dma_alloc(), and keeps those pages until it is destroyed.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
+
+#include <toaru/list.h>
+
+#define DMA_WINDOW_PAGES ((DMA_WINDOW_END - DMA_WINDOW_START) / 0x1000)
+
+static uint32_t dma_window[DMA_WINDOW_PAGES / 32]; /* Pages of the window in use */
+static spin_lock_t dma_window_lock = { 0 };
+
+#define WINDOW_TEST(i)  (dma_window[(i) / 32] & ((uint32_t)0x1 << ((i) % 32)))
+#define WINDOW_SET(i)   (dma_window[(i) / 32] |= ((uint32_t)0x1 << ((i) % 32)))
+#define WINDOW_CLEAR(i) (dma_window[(i) / 32] &= ~((uint32_t)0x1 << ((i) % 32)))
+
+/*
+ * Claim n pages of the window, returning the first page's index or -1.
+ */
+static uint32_t window_claim(uint32_t n) {
+	uint32_t run = 0;
+	spin_lock(dma_window_lock);
+	for (uint32_t i = 0; i < DMA_WINDOW_PAGES; ++i) {
+		if (WINDOW_TEST(i)) {
+			run = 0;
+			continue;
+		}
+		if (++run == n) {
+			uint32_t start = i + 1 - n;
+			for (uint32_t j = start; j <= i; ++j) {
+				WINDOW_SET(j);
+			}
+			spin_unlock(dma_window_lock);
+			return start;
+		}
+	}
+	spin_unlock(dma_window_lock);
+	return -1;
+}
+
+static void window_release(uint32_t start, uint32_t n) {
+	spin_lock(dma_window_lock);
+	for (uint32_t i = start; i < start + n; ++i) {
+		WINDOW_CLEAR(i);
+	}
+	spin_unlock(dma_window_lock);
+}
+
+void * dma_alloc(size_t size, int zone, uintptr_t * phys) {
+	uint32_t n = (size + 0xFFF) / 0x1000;
+	if (!n) return NULL;
+
+	uint32_t start = window_claim(n);
+	if (start == (uint32_t)-1) {
+		debug_print(ERROR, "DMA window is full (wanted %d pages)", n);
+		return NULL;
+	}
+
+	uint32_t frame = alloc_frame_run(n, zone);
+	if (frame == (uint32_t)-1) {
+		debug_print(ERROR, "No run of %d free frames in zone %d", n, zone);
+		window_release(start, n);
+		return NULL;
+	}
+
+	uintptr_t virt = DMA_WINDOW_START + start * 0x1000;
+	for (uint32_t i = 0; i < n; ++i) {
+		page_t * page = get_page(virt + i * 0x1000, 0, kernel_directory);
+		ASSUME(page != NULL);
+		page->frame        = frame + i;
+		page->present      = 1;
+		page->rw           = 1;
+		page->user         = 0;
+		page->global       = 1;
+		page->writethrough = 1;
+		page->cachedisable = 1;
+		invalidate_tables_at(virt + i * 0x1000);
+	}
+
+	memset((void *)virt, 0, n * 0x1000);
+	if (phys) *phys = frame * 0x1000;
+	return (void *)virt;
+}
+
+void dma_free(void * buffer, size_t size) {
+	uintptr_t virt = (uintptr_t)buffer;
+	uint32_t n = (size + 0xFFF) / 0x1000;
+	if (!buffer || !n) return;
+	assert(virt >= DMA_WINDOW_START && virt + n * 0x1000 <= DMA_WINDOW_END && "dma_free() of a buffer dma_alloc() didn't make");
+
+	uint32_t frame = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		page_t * page = get_page(virt + i * 0x1000, 0, kernel_directory);
+		if (!i) frame = page->frame;
+		page->present = 0;
+		page->global  = 0;
+		page->frame   = 0;
+		invalidate_tables_at(virt + i * 0x1000);
+	}
+
+	free_frame_run(frame, n);
+	window_release((virt - DMA_WINDOW_START) / 0x1000, n);
+}
+
+struct dma_pool {
+	const char * name;
+	size_t       size;  /* Including alignment padding */
+	int          zone;
+	void *       free;  /* Stack of free blocks, linked through their first word */
+	list_t *     pages;
+	spin_lock_t  lock;
+};
+
+dma_pool_t * dma_pool_create(const char * name, size_t size, size_t align, int zone) {
+	if (align < sizeof(void *)) align = sizeof(void *);
+	if (size < sizeof(void *)) size = sizeof(void *);
+	size = (size + align - 1) & ~(align - 1);
+	if (size > 0x1000) {
+		debug_print(ERROR, "DMA pool %s: blocks of %d bytes won't fit in a page; use dma_alloc()", name, size);
+		return NULL;
+	}
+
+	dma_pool_t * pool = malloc(sizeof(dma_pool_t));
+	memset(pool, 0, sizeof(dma_pool_t));
+	pool->name  = name;
+	pool->size  = size;
+	pool->zone  = zone;
+	pool->pages = list_create();
+	return pool;
+}
+
+void * dma_pool_alloc(dma_pool_t * pool, uintptr_t * phys) {
+	spin_lock(pool->lock);
+	if (!pool->free) {
+		uintptr_t page_phys;
+		char * page = dma_alloc(0x1000, pool->zone, &page_phys);
+		if (!page) {
+			spin_unlock(pool->lock);
+			return NULL;
+		}
+		list_insert(pool->pages, page);
+		for (size_t offset = 0; offset + pool->size <= 0x1000; offset += pool->size) {
+			*(void **)(page + offset) = pool->free;
+			pool->free = page + offset;
+		}
+	}
+	void * block = pool->free;
+	pool->free = *(void **)block;
+	spin_unlock(pool->lock);
+
+	memset(block, 0, pool->size);
+	if (phys) *phys = map_to_physical((uintptr_t)block);
+	return block;
+}
+
+void dma_pool_free(dma_pool_t * pool, void * block) {
+	if (!block) return;
+	spin_lock(pool->lock);
+	*(void **)block = pool->free;
+	pool->free = block;
+	spin_unlock(pool->lock);
+}
+
+/*
+ * Release every page the pool took, whether or not its blocks were freed.
+ */
+void dma_pool_destroy(dma_pool_t * pool) {
+	foreach(node, pool->pages) {
+		dma_free(node->value, 0x1000);
+	}
+	list_free(pool->pages);
+	free(pool->pages);
+	free(pool);
+}
@@ -0,0 +1,142 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Kernel Mappings
+ *
+ * Frames that belong to no address space (tmpfs file contents, for
+ * one) can be mapped into a window of kernel addresses next to the
+ * heap. The window's page tables are shared by every directory and
+ * its pages are global, so a mapping works from any process and
+ * survives switching between them.
+ *
+ * Mappings aren't torn down when their last user lets go; they stay
+ * in a hash of frames to slots until the slot is needed for another
+ * frame. Idle slots are reused by a clock hand that passes over the
+ * ones used since it last came by, so frames in steady use stay
+ * mapped and cost neither a page table update nor a TLB flush.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
+#include <kernel/kmap.h>
+
+#define KMAP_SLOTS   ((KMAP_WINDOW_END - KMAP_WINDOW_START) / 0x1000)
+#define KMAP_BUCKETS 256
+
+#define SLOT_ADDRESS(s) (KMAP_WINDOW_START + (s) * 0x1000)
+
+static struct kmap_slot {
+	uint32_t frame;      /* Mapped frame, or 0 */
+	uint16_t refs;       /* Outstanding kmap()s */
+	uint16_t next;       /* Next slot in the bucket, plus one */
+	uint8_t  referenced; /* Used since the clock hand last passed */
+} kmap_slots[KMAP_SLOTS];
+
+static uint16_t kmap_hash[KMAP_BUCKETS]; /* First slot of each bucket, plus one */
+static uint32_t kmap_hand = 0;
+static spin_lock_t kmap_lock = { 0 };
+
+static void kmap_unhash(uint32_t slot) {
+	uint16_t * link = &kmap_hash[kmap_slots[slot].frame % KMAP_BUCKETS];
+	while (*link != slot + 1) {
+		link = &kmap_slots[*link - 1].next;
+	}
+	*link = kmap_slots[slot].next;
+	kmap_slots[slot].next = 0;
+}
+
+/*
+ * Find an idle slot to reuse, or -1 if every slot is in use.
+ * The kmap lock must be held.
+ */
+static uint32_t kmap_victim(void) {
+	for (uint32_t i = 0; i < 2 * KMAP_SLOTS; ++i) {
+		uint32_t slot = kmap_hand;
+		kmap_hand = (kmap_hand + 1) % KMAP_SLOTS;
+		if (kmap_slots[slot].refs) continue;
+		if (kmap_slots[slot].referenced) {
+			kmap_slots[slot].referenced = 0;
+			continue;
+		}
+		return slot;
+	}
+	return -1;
+}
+
+void * kmap(uint32_t frame) {
+	for (;;) {
+		spin_lock(kmap_lock);
+
+		for (uint16_t s = kmap_hash[frame % KMAP_BUCKETS]; s; s = kmap_slots[s - 1].next) {
+			if (kmap_slots[s - 1].frame == frame) {
+				kmap_slots[s - 1].refs++;
+				kmap_slots[s - 1].referenced = 1;
+				spin_unlock(kmap_lock);
+				return (void *)SLOT_ADDRESS(s - 1);
+			}
+		}
+
+		uint32_t slot = kmap_victim();
+		if (slot == (uint32_t)-1) {
+			/* Everything is mapped by someone; wait for a kunmap() */
+			spin_unlock(kmap_lock);
+			switch_task(1);
+			continue;
+		}
+
+		if (kmap_slots[slot].frame) {
+			kmap_unhash(slot);
+		}
+
+		page_t * page = get_page(SLOT_ADDRESS(slot), 0, kernel_directory);
+		ASSUME(page != NULL);
+		page->frame   = frame;
+		page->present = 1;
+		page->rw      = 1;
+		page->user    = 0;
+		page->global  = 1;
+		invalidate_tables_at(SLOT_ADDRESS(slot));
+
+		kmap_slots[slot].frame = frame;
+		kmap_slots[slot].refs = 1;
+		kmap_slots[slot].referenced = 1;
+		kmap_slots[slot].next = kmap_hash[frame % KMAP_BUCKETS];
+		kmap_hash[frame % KMAP_BUCKETS] = slot + 1;
+
+		spin_unlock(kmap_lock);
+		return (void *)SLOT_ADDRESS(slot);
+	}
+}
+
+void kunmap(void * address) {
+	uint32_t slot = ((uintptr_t)address - KMAP_WINDOW_START) / 0x1000;
+	assert(slot < KMAP_SLOTS && "kunmap() of an address kmap() didn't return");
+	spin_lock(kmap_lock);
+	assert(kmap_slots[slot].refs && "kunmap() of an idle mapping");
+	kmap_slots[slot].refs--;
+	spin_unlock(kmap_lock);
+}
+
+void kmap_drop(uint32_t frame) {
+	spin_lock(kmap_lock);
+	for (uint16_t s = kmap_hash[frame % KMAP_BUCKETS]; s; s = kmap_slots[s - 1].next) {
+		uint32_t slot = s - 1;
+		if (kmap_slots[slot].frame != frame) continue;
+		if (kmap_slots[slot].refs) {
+			debug_print(WARNING, "kmap: frame 0x%x is being freed while still mapped", frame);
+			break;
+		}
+		kmap_unhash(slot);
+		kmap_slots[slot].frame = 0;
+
+		page_t * page = get_page(SLOT_ADDRESS(slot), 0, kernel_directory);
+		page->present = 0;
+		page->global  = 0;
+		page->frame   = 0;
+		invalidate_tables_at(SLOT_ADDRESS(slot));
+		break;
+	}
+	spin_unlock(kmap_lock);
+}
@@ -13,11 +13,17 @@
 #include <kernel/logging.h>
 #include <kernel/signal.h>
 #include <kernel/module.h>
+#include <kernel/mmap.h>
+#include <kernel/shm.h>
+#include <kernel/trace.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
+#include <kernel/clockpage.h>
 
 #include <toaru/hashmap.h>
 
 #define KERNEL_HEAP_INIT 0x00800000
-#define KERNEL_HEAP_END  0x20000000
+#define KERNEL_HEAP_END  CLOCK_PAGE_ADDRESS
 
 extern void *end;
 uintptr_t placement_pointer = (uintptr_t)&end;
@@ -27,6 +33,10 @@ uintptr_t kernel_heap_alloc_point = KERNEL_HEAP_INIT;
 //static volatile uint8_t frame_alloc_lock = 0;
 static spin_lock_t frame_alloc_lock = { 0 };
 uint32_t first_n_frames(int n);
+static void enable_global_pages(void);
+static void enable_large_pages(void);
+static void map_large_page(uint32_t table, int device, int flags);
+static int large_pages = 0;
 
 void
 kmalloc_startat(
@@ -71,6 +81,7 @@ kmalloc_real(
 					page->frame = index + i;
 					page->writethrough = 1;
 					page->cachedisable = 1;
+					invalidate_tables_at((uintptr_t)address + (i * 0x1000));
 				}
 				spin_unlock(frame_alloc_lock);
 			}
@@ -131,14 +142,62 @@ kvmalloc_p(
 
 /*
  * Frame Allocation
+ *
+ * `frames` has a bit for every frame, set while it is in use. Two
+ * summary levels above it let first_frame() skip used memory a word
+ * at a time instead of a bit at a time: frames_full has a bit set
+ * for each word of `frames` that is completely used, and frames_full2
+ * a bit for each word of frames_full that is. Bits past the end of
+ * memory are set at every level, so they never look free.
+ *
+ * Frames released through free_frame() also go on a small stack, and
+ * alloc_frame() takes from there first: the most recently freed
+ * frames are the likeliest to still be in the cache, and it saves
+ * the search entirely while a process is being torn down and another
+ * built up. The stack is only a hint; the bitmap is checked before
+ * a frame from it is used.
  */
 
 uint32_t *frames;
 uint32_t nframes;
+static uint32_t * frames_full;
+static uint32_t * frames_full2;
+static uint32_t frames_words, frames_full_words, frames_full2_words;
+static uint32_t frames_used = 0;
+
+#define FRAME_CACHE_SIZE 64
+static uint32_t frame_cache[FRAME_CACHE_SIZE];
+static int frame_cache_count = 0;
+
+/*
+ * Copy-on-write sharing counts.
+ *
+ * frame_refs[n] is the number of *additional* page table entries
+ * referencing frame n after one or more fork()s. A frame with a
+ * count of zero has a single owner - this way frames handed out
+ * by alloc_frame() need no extra bookkeeping until they are shared.
+ */
+static uint16_t * frame_refs = NULL;
+
+/*
+ * A frame of zeroes, mapped read-only and copy-on-write in place of
+ * anonymous memory nobody has written to yet. It has no reference
+ * count and is never freed; the first write to a page backed by it
+ * gets a frame of its own in copy_on_write().
+ */
+uint32_t zero_frame = 0;
 
 #define INDEX_FROM_BIT(b) (b / 0x20)
 #define OFFSET_FROM_BIT(b) (b % 0x20)
 
+static void frame_word_full(uint32_t index) {
+	frames_full[INDEX_FROM_BIT(index)] |= ((uint32_t)0x1 << OFFSET_FROM_BIT(index));
+	if (frames_full[INDEX_FROM_BIT(index)] == 0xFFFFFFFF) {
+		uint32_t index2 = INDEX_FROM_BIT(index);
+		frames_full2[INDEX_FROM_BIT(index2)] |= ((uint32_t)0x1 << OFFSET_FROM_BIT(index2));
+	}
+}
+
 void
 set_frame(
 		uintptr_t frame_addr
@@ -147,7 +206,12 @@ set_frame(
 		uint32_t frame  = frame_addr / 0x1000;
 		uint32_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
+		if (frames[index] & ((uint32_t)0x1 << offset)) return;
 		frames[index] |= ((uint32_t)0x1 << offset);
+		frames_used++;
+		if (frames[index] == 0xFFFFFFFF) {
+			frame_word_full(index);
+		}
 	}
 }
 
@@ -158,7 +222,11 @@ clear_frame(
 	uint32_t frame  = frame_addr / 0x1000;
 	uint32_t index  = INDEX_FROM_BIT(frame);
 	uint32_t offset = OFFSET_FROM_BIT(frame);
+	if (frame >= nframes || !(frames[index] & ((uint32_t)0x1 << offset))) return;
 	frames[index] &= ~((uint32_t)0x1 << offset);
+	frames_used--;
+	frames_full[INDEX_FROM_BIT(index)] &= ~((uint32_t)0x1 << OFFSET_FROM_BIT(index));
+	frames_full2[INDEX_FROM_BIT(INDEX_FROM_BIT(index))] &= ~((uint32_t)0x1 << OFFSET_FROM_BIT(INDEX_FROM_BIT(index)));
 }
 
 uint32_t test_frame(uintptr_t frame_addr) {
@@ -168,35 +236,47 @@ uint32_t test_frame(uintptr_t frame_addr) {
 	return (frames[index] & ((uint32_t)0x1 << offset));
 }
 
-uint32_t first_n_frames(int n) {
-	for (uint32_t i = 0; i < nframes * 0x1000; i += 0x1000) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (test_frame(i + 0x1000 * j)) {
-				bad = j+1;
-			}
+/*
+ * Find n free frames in a row between frames `from` and `to`, for
+ * DMA buffers. Whole words of free or used frames are taken at once.
+ */
+static uint32_t find_frames(uint32_t n, uint32_t from, uint32_t to) {
+	uint32_t run = 0;
+	uint32_t start = 0;
+	uint32_t i = from;
+	if (to > nframes) to = nframes;
+	while (i < to) {
+		uint32_t word = frames[INDEX_FROM_BIT(i)];
+		if (!OFFSET_FROM_BIT(i) && word == 0xFFFFFFFF) {
+			run = 0;
+			i += 32;
+			continue;
+		}
+		if (!OFFSET_FROM_BIT(i) && word == 0 && i + 32 <= to) {
+			if (!run) start = i;
+			run += 32;
+			i += 32;
+		} else if (word & ((uint32_t)0x1 << OFFSET_FROM_BIT(i))) {
+			run = 0;
+			i++;
+			continue;
+		} else {
+			if (!run) start = i;
+			run++;
+			i++;
 		}
-		if (!bad) {
-			return i / 0x1000;
+		if (run >= n) {
+			return start;
 		}
 	}
 	return 0xFFFFFFFF;
 }
 
-uint32_t first_frame(void) {
-	uint32_t i, j;
-
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != 0xFFFFFFFF) {
-			for (j = 0; j < 32; ++j) {
-				uint32_t testFrame = (uint32_t)0x1 << j;
-				if (!(frames[i] & testFrame)) {
-					return i * 0x20 + j;
-				}
-			}
-		}
-	}
+uint32_t first_n_frames(int n) {
+	return find_frames(n, 0, nframes);
+}
 
+static void out_of_frames(void) {
 	debug_print(CRITICAL, "System claims to be out of usable memory, which means we probably overwrote the page frames.\033[0m");
 
 	if (debug_video_crash) {
@@ -205,10 +285,85 @@ uint32_t first_frame(void) {
 	}
 
 	STOP;
+}
 
+/*
+ * First free frame at or after summary word `l1_start` (1024 frames
+ * each), or -1.
+ */
+static uint32_t first_frame_after(uint32_t l1_start) {
+	for (uint32_t i = INDEX_FROM_BIT(l1_start); i < frames_full2_words; ++i) {
+		uint32_t avail = ~frames_full2[i];
+		if (i == INDEX_FROM_BIT(l1_start)) {
+			avail &= ~(((uint32_t)0x1 << OFFSET_FROM_BIT(l1_start)) - 1);
+		}
+		if (!avail) continue;
+		uint32_t l1 = i * 0x20 + __builtin_ctz(avail);
+		uint32_t l0 = l1 * 0x20 + __builtin_ctz(~frames_full[l1]);
+		return l0 * 0x20 + __builtin_ctz(~frames[l0]);
+	}
 	return -1;
 }
 
+/*
+ * Ordinary allocations come from above the ISA DMA zone while
+ * there is memory there, so that it stays free for the devices
+ * that can't reach anything else.
+ */
+static uint32_t find_free_frame(void) {
+	uint32_t index = first_frame_after(ZONE_ISA_FRAMES / 1024);
+	if (index == (uint32_t)-1) {
+		index = first_frame_after(0);
+	}
+	return index;
+}
+
+/*
+ * Set while sbrk() is mapping new heap pages. It holds the heap lock
+ * then, and shrinkers free heap memory, so there is no reclaiming.
+ */
+static volatile int heap_growing = 0;
+
+#define RECLAIM_BATCH 64
+
+uint32_t first_frame(void) {
+	uint32_t index = find_free_frame();
+	if (index == (uint32_t)-1 && !heap_growing && reclaim(RECLAIM_BATCH)) {
+		index = find_free_frame();
+	}
+	if (index == (uint32_t)-1) {
+		out_of_frames();
+	}
+	return index;
+}
+
+/*
+ * Take a free frame, preferring a recently freed one.
+ * The frame allocation lock must be held; it is let go while the
+ * caches are asked for memory, as they free frames themselves.
+ */
+static uint32_t take_frame(void) {
+	while (frame_cache_count) {
+		uint32_t index = frame_cache[--frame_cache_count];
+		if (!test_frame(index * 0x1000)) {
+			set_frame(index * 0x1000);
+			return index;
+		}
+	}
+	uint32_t index = find_free_frame();
+	if (index == (uint32_t)-1 && !heap_growing) {
+		spin_unlock(frame_alloc_lock);
+		reclaim(RECLAIM_BATCH);
+		spin_lock(frame_alloc_lock);
+		index = find_free_frame();
+	}
+	if (index == (uint32_t)-1) {
+		out_of_frames();
+	}
+	set_frame(index * 0x1000);
+	return index;
+}
+
 void
 alloc_frame(
 		page_t *page,
@@ -216,21 +371,25 @@ alloc_frame(
 		int is_writeable
 		) {
 	ASSUME(page != NULL);
+	if (page->swapped) {
+		swap_in(page);
+	}
 	if (page->frame != 0) {
 		page->present = 1;
 		page->rw      = (is_writeable == 1) ? 1 : 0;
 		page->user    = (is_kernel == 1)    ? 0 : 1;
+		page->global  = (is_kernel == 1)    ? 1 : 0;
 		return;
 	} else {
 		spin_lock(frame_alloc_lock);
-		uint32_t index = first_frame();
+		uint32_t index = take_frame();
 		assert(index != (uint32_t)-1 && "Out of frames.");
-		set_frame(index * 0x1000);
 		page->frame   = index;
 		spin_unlock(frame_alloc_lock);
 		page->present = 1;
 		page->rw      = (is_writeable == 1) ? 1 : 0;
 		page->user    = (is_kernel == 1)    ? 0 : 1;
+		page->global  = (is_kernel == 1)    ? 1 : 0;
 	}
 }
 
@@ -246,36 +405,298 @@ dma_frame(
 	page->present = 1;
 	page->rw      = (is_writeable) ? 1 : 0;
 	page->user    = (is_kernel)    ? 0 : 1;
+	page->global  = (is_kernel)    ? 1 : 0;
 	page->frame   = address / 0x1000;
 	set_frame(address);
 }
 
+/*
+ * Allocate a run of n physically contiguous frames in a zone, returning the
+ * first frame number or -1. Zones other than ZONE_ISA are searched
+ * above the ISA zone first, as in first_frame().
+ */
+uint32_t
+alloc_frame_run(
+		uint32_t n,
+		int zone
+		) {
+	spin_lock(frame_alloc_lock);
+	uint32_t index = 0xFFFFFFFF;
+	if (zone != ZONE_ISA) {
+		index = find_frames(n, ZONE_ISA_FRAMES, nframes);
+	}
+	if (index == 0xFFFFFFFF) {
+		index = find_frames(n, 0, zone == ZONE_ISA ? ZONE_ISA_FRAMES : nframes);
+	}
+	if (index != 0xFFFFFFFF) {
+		for (uint32_t i = 0; i < n; ++i) {
+			set_frame((index + i) * 0x1000);
+		}
+	}
+	spin_unlock(frame_alloc_lock);
+	return index;
+}
+
+void
+free_frame_run(
+		uint32_t index,
+		uint32_t n
+		) {
+	spin_lock(frame_alloc_lock);
+	for (uint32_t i = 0; i < n; ++i) {
+		clear_frame((index + i) * 0x1000);
+	}
+	spin_unlock(frame_alloc_lock);
+}
+
+/*
+ * Whether the 4MiB under directory entry `table` can be given to a
+ * large page: it isn't mapped through a table yet, or the table maps
+ * nothing.
+ */
+static int large_page_fits(uint32_t table) {
+	page_table_t * t = kernel_directory->tables[table];
+	if (!t || t == LARGE_PAGE_TABLE) return 1;
+	for (int i = 0; i < 1024; ++i) {
+		if (t->pages[i].present) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Identity-map device memory (framebuffers, MMIO windows) in the
+ * kernel directory. Whole 4MiB blocks get one large page each when
+ * the processor has PSE, which spares a page table and a thousand
+ * TLB entries per block; the ends are mapped a page at a time.
+ */
+void
+map_device_memory(
+		uintptr_t address,
+		size_t size,
+		int flags
+		) {
+	uintptr_t end = address + size;
+	uintptr_t i = address & 0xFFFFF000;
+	while (i < end) {
+		uint32_t table = i / 0x400000;
+		if (large_pages && !(i & 0x3FFFFF) && i + 0x400000 <= end && large_page_fits(table)) {
+			map_large_page(table, 1, flags);
+			i += 0x400000;
+			continue;
+		}
+		if (kernel_directory->tables[table] == LARGE_PAGE_TABLE) {
+			/* Already mapped, by an earlier call covering the whole block */
+			i += 0x1000;
+			continue;
+		}
+		page_t * p = get_page(i, 1, kernel_directory);
+		dma_frame(p, !(flags & DEVICE_MEMORY_USER), 1, i);
+		p->pat          = (flags & DEVICE_MEMORY_WC) ? 1 : 0;
+		p->writethrough = 1;
+		p->cachedisable = 1;
+		invalidate_tables_at(i);
+		i += 0x1000;
+	}
+}
+
+/*
+ * Back a user page with the zero frame until it is written to.
+ */
+void
+map_zero_frame(
+		page_t * page
+		) {
+	ASSUME(page != NULL);
+	if (page->frame) {
+		/* Already has memory of its own */
+		return;
+	}
+	page->frame   = zero_frame;
+	page->present = 1;
+	page->rw      = 0;
+	page->user    = 1;
+	page->cow     = 1;
+}
+
 void
 free_frame(
 		page_t *page
 		) {
 	uint32_t frame;
-	if (!(frame = page->frame)) {
+	if (page->swapped) {
+		swap_release(page->frame);
+		page->frame = 0x0;
+		page->swapped = 0;
+		page->cow = 0;
+	} else if (!(frame = page->frame)) {
 		assert(0);
 		return;
+	} else if (frame == zero_frame) {
+		page->frame = 0x0;
+		page->cow = 0;
 	} else {
-		clear_frame(frame * 0x1000);
+		spin_lock(frame_alloc_lock);
+		if (frame < nframes && frame_refs[frame]) {
+			/* Still referenced by another directory */
+			frame_refs[frame]--;
+		} else {
+			clear_frame(frame * 0x1000);
+			if (frame_cache_count < FRAME_CACHE_SIZE) {
+				frame_cache[frame_cache_count++] = frame;
+			}
+		}
+		spin_unlock(frame_alloc_lock);
 		page->frame = 0x0;
+		page->cow = 0;
 	}
 }
 
-uintptr_t memory_use(void ) {
-	uintptr_t ret = 0;
-	uint32_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
+/*
+ * Share the frame backing `src` with `dest` for copy-on-write.
+ *
+ * Writable pages are made read-only in both tables and marked
+ * as copy-on-write; the caller must flush the TLB for `src`.
+ *
+ * @return 1 if the frame was shared, 0 if the caller must copy it.
+ */
+int
+share_frame(
+		page_t * src,
+		page_t * dest
+		) {
+	ASSUME(src != NULL);
+	ASSUME(dest != NULL);
+	if (src->swapped) {
+		if (swap_dup(src->frame)) {
+			*dest = *src;
+			return 1;
+		}
+		/* Too many references to the slot; bring it in and share the frame */
+		swap_in(src);
+	}
+	if (src->frame == zero_frame) {
+		/* Already read-only and copy-on-write, and not counted */
+		*dest = *src;
+		return 1;
+	}
+	/* Device memory and frames we don't track are always copied */
+	if (src->frame >= nframes || src->writethrough || src->cachedisable) {
+		return 0;
+	}
+	spin_lock(frame_alloc_lock);
+	if (frame_refs[src->frame] == 0xFFFF) {
+		spin_unlock(frame_alloc_lock);
+		return 0;
+	}
+	frame_refs[src->frame]++;
+	spin_unlock(frame_alloc_lock);
+	if (src->rw) {
+		src->rw  = 0;
+		src->cow = 1;
+	}
+	*dest = *src;
+	return 1;
+}
+
+/*
+ * Is any other page table entry using this page's frame?
+ */
+int frame_is_shared(page_t * page) {
+	ASSUME(page != NULL);
+	/* Dropping a swapped page frees a slot, not a frame */
+	if (page->swapped || page->frame == zero_frame) return 1;
+	if (page->frame >= nframes) return 0;
+	return frame_refs[page->frame] != 0;
+}
+
+/*
+ * Resident set accounting, which /proc reads instead of walking the
+ * page tables. A user page counts toward its directory while it has
+ * a frame of its own: swapped-out pages and the zero frame don't.
+ * Anything that changes that for a page in a directory adjusts the
+ * directory's counters to match.
+ */
+int page_is_resident(page_t * page) {
+	return page->frame && !page->swapped && page->frame != zero_frame;
+}
+
+void rss_adjust(page_directory_t * dir, uintptr_t address, int delta) {
+	if (address >= SHM_START) {
+		dir->rss_shm += delta;
+	} else {
+		dir->rss += delta;
+	}
+}
+
+/*
+ * Give the user page at `address` a frame, if it doesn't have one,
+ * and count it.
+ */
+page_t * alloc_user_frame(page_directory_t * dir, uintptr_t address, int is_writeable) {
+	page_t * page = get_page(address, 1, dir);
+	int was = page_is_resident(page);
+	alloc_frame(page, 0, is_writeable);
+	rss_adjust(dir, address, page_is_resident(page) - was);
+	return page;
+}
+
+/*
+ * Resolve a write fault on a copy-on-write page.
+ *
+ * If the frame is still shared, the faulting directory gets a
+ * private copy; if we are the last owner, the page is simply
+ * made writable again.
+ *
+ * @return 1 if the fault was handled, 0 if it was not a COW fault.
+ */
+int
+copy_on_write(
+		uintptr_t address
+		) {
+	page_t * page = get_page(address, 0, current_directory);
+	if (!page || !page->present || !page->cow) {
+		return 0;
+	}
+
+	uint32_t old = page->frame;
+
+	if (old == zero_frame) {
+		/* First write to untouched anonymous memory */
+		spin_lock(frame_alloc_lock);
+		uint32_t index = take_frame();
+		spin_unlock(frame_alloc_lock);
+		copy_page_physical(old * 0x1000, index * 0x1000);
+		page->frame = index;
+		rss_adjust(current_directory, address, 1);
+	} else {
+		spin_lock(frame_alloc_lock);
+		if (frame_refs[old]) {
+			uint32_t index = take_frame();
+			spin_unlock(frame_alloc_lock);
+
+			/* We still hold our reference to the old frame while copying */
+			copy_page_physical(old * 0x1000, index * 0x1000);
+			page->frame = index;
+
+			spin_lock(frame_alloc_lock);
+			if (frame_refs[old]) {
+				frame_refs[old]--;
+			} else {
+				/* Everyone else let go while we were copying */
+				clear_frame(old * 0x1000);
 			}
 		}
+		spin_unlock(frame_alloc_lock);
 	}
-	return ret * 4;
+
+	page->cow = 0;
+	page->rw  = 1;
+	invalidate_tables_at(address & 0xFFFFF000);
+	return 1;
+}
+
+uintptr_t memory_use(void ) {
+	return frames_used * 4;
 }
 
 uintptr_t memory_total(){
@@ -284,8 +705,34 @@ uintptr_t memory_total(){
 
 void paging_install(uint32_t memsize) {
 	nframes = memsize  / 4;
-	frames  = (uint32_t *)kmalloc(INDEX_FROM_BIT(nframes * 8));
-	memset(frames, 0, INDEX_FROM_BIT(nframes * 8));
+	frames_words       = (nframes + 31) / 32;
+	frames_full_words  = (frames_words + 31) / 32;
+	frames_full2_words = (frames_full_words + 31) / 32;
+	frames       = (uint32_t *)kmalloc(frames_words * sizeof(uint32_t));
+	frames_full  = (uint32_t *)kmalloc(frames_full_words * sizeof(uint32_t));
+	frames_full2 = (uint32_t *)kmalloc(frames_full2_words * sizeof(uint32_t));
+	memset(frames, 0, frames_words * sizeof(uint32_t));
+	memset(frames_full, 0, frames_full_words * sizeof(uint32_t));
+	memset(frames_full2, 0, frames_full2_words * sizeof(uint32_t));
+
+	/* Past the end of memory is always in use */
+	for (uint32_t i = nframes; i < frames_words * 32; ++i) {
+		frames[INDEX_FROM_BIT(i)] |= ((uint32_t)0x1 << OFFSET_FROM_BIT(i));
+	}
+	for (uint32_t i = frames_words; i < frames_full_words * 32; ++i) {
+		frame_word_full(i);
+	}
+	for (uint32_t i = frames_full_words; i < frames_full2_words * 32; ++i) {
+		frames_full2[INDEX_FROM_BIT(i)] |= ((uint32_t)0x1 << OFFSET_FROM_BIT(i));
+	}
+
+	frame_refs = (uint16_t *)kmalloc(nframes * sizeof(uint16_t));
+	memset(frame_refs, 0, nframes * sizeof(uint16_t));
+
+	/* Placement memory is identity-mapped, so this is the frame's address */
+	uintptr_t zero_phys;
+	memset((void *)kvmalloc_p(0x1000, &zero_phys), 0, 0x1000);
+	zero_frame = zero_phys / 0x1000;
 
 	uintptr_t phys;
 	kernel_directory = (page_directory_t *)kvmalloc_p(sizeof(page_directory_t),&phys);
@@ -309,6 +756,7 @@ void paging_mark_system(uint64_t addr) {
 
 void paging_finalize(void) {
 	debug_print(INFO, "Placement pointer is at 0x%x", placement_pointer);
+	enable_large_pages();
 #if 1
 	get_page(0,1,kernel_directory)->present = 0;
 	set_frame(0);
@@ -316,13 +764,22 @@ void paging_finalize(void) {
 #else
 	for (uintptr_t i = 0x0; i < 0x80000; i += 0x1000) {
 #endif
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	for (uintptr_t i = 0x80000; i < 0x100000; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	for (uintptr_t i = 0x100000; i < placement_pointer + 0x3000; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		if (large_pages && !(i & 0x3FFFFF) && i + 0x400000 <= placement_pointer && large_page_fits(i / 0x400000)) {
+			/* Boot modules can make this tens of megabytes; map whole blocks with large pages */
+			map_large_page(i / 0x400000, 0, 0);
+			for (uintptr_t j = i; j < i + 0x400000; j += 0x1000) {
+				set_frame(j);
+			}
+			i += 0x400000 - 0x1000;
+			continue;
+		}
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	debug_print(INFO, "Mapping VGA text-mode directly.");
 	for (uintptr_t j = 0xb8000; j < 0xc0000; j += 0x1000) {
@@ -341,10 +798,10 @@ void paging_finalize(void) {
 
 	/* Kernel Heap Space */
 	for (uintptr_t i = placement_pointer + 0x3000; i < tmp_heap_start; i += 0x1000) {
-		alloc_frame(get_page(i, 1, kernel_directory), 1, 0);
+		alloc_frame(get_page(i, 1, kernel_directory), 1, 1);
 	}
-	/* And preallocate the page entries for all the rest of the kernel heap as well */
-	for (uintptr_t i = tmp_heap_start; i < KERNEL_HEAP_END; i += 0x1000) {
+	/* And preallocate the page entries for all the rest of the kernel heap and the kmap and DMA windows as well */
+	for (uintptr_t i = tmp_heap_start; i < DMA_WINDOW_END; i += 0x1000) {
 		get_page(i, 1, kernel_directory);
 	}
 	for (unsigned int i = 0xE000; i <= 0xFFF0; i += 0x40) {
@@ -354,6 +811,7 @@ void paging_finalize(void) {
 	debug_print(NOTICE, "Setting directory.");
 	current_directory = clone_directory(kernel_directory);
 	switch_page_directory(kernel_directory);
+	enable_global_pages();
 }
 
 uintptr_t map_to_physical(uintptr_t virtual) {
@@ -362,7 +820,9 @@ uintptr_t map_to_physical(uintptr_t virtual) {
 	uintptr_t table = frame / 1024;
 	uintptr_t subframe = frame % 1024;
 
-	if (current_directory->tables[table]) {
+	if (current_directory->tables[table] == LARGE_PAGE_TABLE) {
+		return (current_directory->physical_tables[table] & 0xFFC00000) + (virtual & 0x3FFFFF);
+	} else if (current_directory->tables[table]) {
 		page_t * p = &current_directory->tables[table]->pages[subframe];
 		return p->frame * 0x1000 + remaining;
 	} else {
@@ -407,15 +867,113 @@ switch_page_directory(
 		page_directory_t * dir
 		) {
 	current_directory = dir;
+	/*
+	 * Enable paging and write protection; WP makes kernel writes
+	 * to read-only user pages fault so copy-on-write is honored
+	 * when syscalls fill userspace buffers.
+	 */
 	asm volatile (
 			"mov %0, %%cr3\n"
 			"mov %%cr0, %%eax\n"
-			"orl $0x80000000, %%eax\n"
+			"orl $0x80010000, %%eax\n"
 			"mov %%eax, %%cr0\n"
 			:: "r"(dir->physical_address)
 			: "%eax");
 }
 
+/*
+ * Kernel mappings are marked global, so they stay in the TLB when
+ * CR3 is reloaded on a context switch; everything that changes one
+ * has to invalidate it with invlpg.
+ */
+static int global_pages = 0;
+
+static void enable_global_pages(void) {
+	uint32_t edx;
+	asm volatile ("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+	if (!(edx & (1 << 13))) {
+		debug_print(NOTICE, "No global page support.");
+		return;
+	}
+	uint32_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= (1 << 7); /* PGE */
+	asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+	global_pages = 1;
+}
+
+/*
+ * 4MiB pages, for the parts of the kernel's identity map and of
+ * device memory that cover whole directory entries.
+ */
+static void enable_large_pages(void) {
+	uint32_t edx;
+	asm volatile ("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+	if (!(edx & (1 << 3))) {
+		debug_print(NOTICE, "No large page support.");
+		return;
+	}
+	uint32_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= (1 << 4); /* PSE */
+	asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+	large_pages = 1;
+}
+
+/*
+ * Identity-map the 4MiB under directory entry `table` with one
+ * large page. The entry is shared by every directory, so those that
+ * already exist are updated along with the kernel's; new ones copy
+ * it in clone_directory().
+ */
+static void map_large_page(uint32_t table, int device, int flags) {
+	uintptr_t entry = (table * 0x400000)
+		| 0x001                                  /* Present */
+		| 0x002                                  /* Writable */
+		| ((flags & DEVICE_MEMORY_USER) ? 0x004 : 0)
+		| 0x080                                  /* 4MiB */
+		| 0x100;                                 /* Global */
+	if (device) {
+		/* PAT entry 7 is write-combining, 3 is uncached */
+		entry |= 0x008 | 0x010 | ((flags & DEVICE_MEMORY_WC) ? 0x1000 : 0);
+	}
+
+	page_table_t * old = kernel_directory->tables[table];
+	kernel_directory->tables[table] = LARGE_PAGE_TABLE;
+	kernel_directory->physical_tables[table] = entry;
+
+	if (current_directory && current_directory->tables[table] == old) {
+		current_directory->tables[table] = LARGE_PAGE_TABLE;
+		current_directory->physical_tables[table] = entry;
+	}
+	if (process_list) {
+		foreach(node, process_list) {
+			page_directory_t * dir = ((process_t *)node->value)->thread.page_directory;
+			if (dir && dir->tables[table] == old) {
+				dir->tables[table] = LARGE_PAGE_TABLE;
+				dir->physical_tables[table] = entry;
+			}
+		}
+	}
+
+	/* The old table may still be cached as part of the walk */
+	invalidate_tables_at(table * 0x400000);
+}
+
+/*
+ * Flush everything, global pages included, by toggling PGE.
+ */
+static void invalidate_all_tables(void) {
+	if (!global_pages) {
+		invalidate_page_tables();
+		return;
+	}
+	uint32_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	asm volatile ("mov %0, %%cr4" :: "r"(cr4 & ~(1 << 7)));
+	asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+}
+
 void invalidate_page_tables(void) {
 	asm volatile (
 			"movl %%cr3, %%eax\n"
@@ -430,6 +988,30 @@ void invalidate_tables_at(uintptr_t addr) {
 			:: "r"(addr) : "%eax");
 }
 
+/*
+ * Invalidate the pages covering `size` bytes from `start` one at a
+ * time, which leaves the rest of the TLB alone. Past a few dozen pages
+ * it is cheaper to flush everything.
+ */
+#define INVALIDATE_RANGE_MAX 32
+
+void invalidate_tables_range(uintptr_t start, size_t size) {
+	uintptr_t end = start + size;
+	start &= 0xFFFFF000;
+	if ((end - start) / 0x1000 > INVALIDATE_RANGE_MAX) {
+		if (start < DMA_WINDOW_END) {
+			/* Kernel pages are global and survive a CR3 reload */
+			invalidate_all_tables();
+		} else {
+			invalidate_page_tables();
+		}
+		return;
+	}
+	for (uintptr_t addr = start; addr < end; addr += 0x1000) {
+		invalidate_tables_at(addr);
+	}
+}
+
 page_t *
 get_page(
 		uintptr_t address,
@@ -438,7 +1020,10 @@ get_page(
 		) {
 	address /= 0x1000;
 	uint32_t table_index = address / 1024;
-	if (dir->tables[table_index]) {
+	if (dir->tables[table_index] == LARGE_PAGE_TABLE) {
+		/* Mapped by a 4MiB page; there are no entries to hand out */
+		return 0;
+	} else if (dir->tables[table_index]) {
 		return &dir->tables[table_index]->pages[address % 1024];
 	} else if(make) {
 		uint32_t temp;
@@ -459,6 +1044,35 @@ page_fault(
 	uint32_t faulting_address;
 	asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
 
+	if (current_process) {
+		current_process->usage.page_faults++;
+	}
+	TRACE(TRACE_MEM, "fault at 0x%x, eip 0x%x, error %d", faulting_address, r->eip, r->err_code);
+
+	/* Not present: might be a page we swapped out, or one we haven't filled in yet */
+	if (!(r->err_code & 0x1) && faulting_address < SHM_START) {
+		if (swap_fault(faulting_address)) {
+			return;
+		}
+		if (mmap_fault(faulting_address)) {
+			return;
+		}
+	}
+
+	/* Not present in the shared memory area: might be a shm page nobody has touched */
+	if (!(r->err_code & 0x1) && faulting_address >= SHM_START) {
+		if (shm_fault(faulting_address)) {
+			return;
+		}
+	}
+
+	/* Write to a present page: might be copy-on-write */
+	if ((r->err_code & 0x3) == 0x3 && faulting_address < SHM_START) {
+		if (copy_on_write(faulting_address)) {
+			return;
+		}
+	}
+
 	if (r->eip == SIGNAL_RETURN) {
 		return_from_signal_handler();
 	} else if (r->eip == THREAD_RETURN) {
@@ -478,33 +1092,13 @@ page_fault(
 
 	if (r->eip < heap_end) {
 		/* find closest symbol */
-		char * closest  = NULL;
-		size_t distance = 0xFFFFFFFF;
-		uintptr_t  addr = 0;
+		uintptr_t addr;
+		char * closest = modules_symbol_for(r->eip, &addr);
 
 		if (modules_get_symbols()) {
-			list_t * hash_keys = hashmap_keys(modules_get_symbols());
-			foreach(_key, hash_keys) {
-				char * key = (char *)_key->value;
-				uintptr_t a = (uintptr_t)hashmap_get(modules_get_symbols(), key);
-
-				if (!a) continue;
-
-				size_t d;
-				if (a <= r->eip) {
-					d = r->eip - a;
-					if (d < distance) {
-						closest = key;
-						distance = d;
-						addr = a;
-					}
-				}
-			}
-			free(hash_keys);
-
 			debug_print(ERROR, "\033[1;31mClosest symbol to faulting address:\033[0m %s [0x%x]", closest, addr);
 
-			hash_keys = hashmap_keys(modules_get_list());
+			list_t * hash_keys = hashmap_keys(modules_get_list());
 			foreach(_key, hash_keys) {
 				char * key = (char *)_key->value;
 				module_data_t * m = (module_data_t *)hashmap_get(modules_get_list(), key);
@@ -514,6 +1108,7 @@ page_fault(
 					break;
 				}
 			}
+			list_free(hash_keys);
 			free(hash_keys);
 
 			debug_print(ERROR, "User EIP: 0x%x", current_process->syscall_registers->eip);
@@ -549,13 +1144,15 @@ void * sbrk(uintptr_t increment) {
 
 	if (heap_end + increment > kernel_heap_alloc_point) {
 		debug_print(INFO, "Hit the end of available kernel heap, going to allocate more (at 0x%x, want to be at 0x%x)", heap_end, heap_end + increment);
+		heap_growing = 1;
 		for (uintptr_t i = heap_end; i < heap_end + increment; i += 0x1000) {
 			debug_print(INFO, "Allocating frame at 0x%x...", i);
 			page_t * page = get_page(i, 0, kernel_directory);
 			assert(page && "Kernel heap allocation fault.");
-			alloc_frame(page, 1, 0);
+			alloc_frame(page, 1, 1);
 		}
-		invalidate_page_tables();
+		heap_growing = 0;
+		invalidate_tables_range(heap_end, increment);
 		debug_print(INFO, "Done.");
 	}
 
@@ -0,0 +1,547 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Demand Paging
+ *
+ * Regions of a user address space that are populated lazily:
+ * nothing is mapped until the page fault handler sees a touch
+ * within a region, at which point a frame is allocated and
+ * filled from the backing file (or zeroed).
+ *
+ * Regions hang off the page directory, so threads sharing a
+ * directory share its regions, and fork() copies them along
+ * with the rest of the address space.
+ *
+ * This also implements mmap() and munmap(). Private mappings
+ * are simply regions whose pages nobody writes back; shared
+ * mappings are populated immediately so fork() can share their
+ * frames, and dirty pages are written back to the file when
+ * they are unmapped or the address space goes away. Sharing is
+ * through the frames themselves, so two unrelated processes that
+ * map the same file do not see each other's changes until they
+ * are written back.
+ *
+ * Pages of read-only private file mappings are also kept in a
+ * small cache keyed by the file and offset they were read from,
+ * so every process mapping the same text (mostly shared libraries
+ * loaded by ld.so) ends up sharing the same frames.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/mmap.h>
+#include <kernel/reclaim.h>
+
+#include <toaru/list.h>
+#include <sys/mman.h>
+
+static spin_lock_t mmap_lock = { 0 };
+static spin_lock_t mmap_cache_lock = { 0 };
+
+#define MMAP_CACHE_BUCKETS 256
+#define MMAP_CACHE_PAGES   1024
+
+/*
+ * A cached read-only file page. The cache holds its own
+ * reference to the frame, so it outlives the mappings that
+ * filled it until it is evicted.
+ */
+typedef struct mmap_cached_page {
+	struct mmap_cached_page * next;
+	node_t *  order;   /* Position in the eviction queue */
+	unsigned int bucket;
+	void *    device;
+	uint32_t  inode;
+	uint32_t  impl;
+	uint64_t  offset;
+	uint32_t  mtime;   /* Entries for files that have changed are stale */
+	uint32_t  length;
+	page_t    page;
+} mmap_cached_page_t;
+
+static mmap_cached_page_t * mmap_cache[MMAP_CACHE_BUCKETS];
+static list_t * mmap_cache_order = NULL;
+
+/*
+ * Register a new demand-filled region with a page directory.
+ *
+ * The region takes its own reference to `file`.
+ */
+mmap_region_t * mmap_add_region(page_directory_t * dir, uintptr_t start, uintptr_t end, fs_node_t * file, uint64_t offset, uintptr_t data_start, uintptr_t data_end, int flags) {
+	mmap_region_t * region = malloc(sizeof(mmap_region_t));
+	region->start      = start & 0xFFFFF000;
+	region->end        = (end + 0xFFF) & 0xFFFFF000;
+	region->data_start = data_start;
+	region->data_end   = data_end;
+	region->offset     = offset;
+	region->file       = clone_fs(file);
+	region->flags      = flags;
+
+	spin_lock(mmap_lock);
+	if (!dir->mmap_regions) {
+		dir->mmap_regions = list_create();
+	}
+	list_insert(dir->mmap_regions, region);
+	spin_unlock(mmap_lock);
+
+	return region;
+}
+
+/*
+ * Copy the bytes of `region` that land in the page at `page_addr`.
+ * The page must already be mapped and zeroed.
+ */
+static void mmap_fill(mmap_region_t * region, uintptr_t page_addr) {
+	if (!region->file) return;
+
+	uintptr_t from = page_addr;
+	uintptr_t to   = page_addr + 0x1000;
+
+	if (from < region->data_start) from = region->data_start;
+	if (to   > region->data_end)   to   = region->data_end;
+	if (from >= to) return;
+
+	read_fs(region->file, region->offset + (from - region->data_start), to - from, (uint8_t *)from);
+}
+
+static unsigned int mmap_cache_hash(fs_node_t * file, uint64_t offset) {
+	return ((uintptr_t)file->device ^ (file->inode * 31) ^ (file->impl * 17) ^ (uint32_t)(offset >> 12)) % MMAP_CACHE_BUCKETS;
+}
+
+/*
+ * Remove an entry from the cache and drop its frame reference.
+ * The cache lock must be held.
+ */
+static void mmap_cache_drop(mmap_cached_page_t * entry) {
+	mmap_cached_page_t ** link = &mmap_cache[entry->bucket];
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+
+	list_delete(mmap_cache_order, entry->order);
+	free(entry->order);
+	free_frame(&entry->page);
+	free(entry);
+}
+
+/*
+ * Shrinker: evict the oldest entries no mapping is using any more,
+ * which gives their frames back.
+ */
+static size_t mmap_cache_shrink(size_t wanted) {
+	size_t freed = 0;
+	if (!spin_trylock(mmap_cache_lock)) return 0;
+	node_t * node = mmap_cache_order->head;
+	while (node && freed < wanted) {
+		mmap_cached_page_t * entry = node->value;
+		node = node->next;
+		if (frame_is_shared(&entry->page)) continue;
+		mmap_cache_drop(entry);
+		freed++;
+	}
+	spin_unlock(mmap_cache_lock);
+	return freed;
+}
+
+/*
+ * Can the page at `page_addr` be shared through the cache?
+ *
+ * Only private, read-only pages qualify, and only when the page
+ * holds file data from a page-aligned offset all the way to the
+ * end of the page (or the end of the file), so its contents do
+ * not depend on how the region was set up.
+ */
+static int mmap_cacheable(mmap_region_t * region, uintptr_t page_addr, uint64_t * offset) {
+	if (!region->file || !region->file->device) return 0;
+	if (region->flags & (MMAP_WRITE | MMAP_SHARED)) return 0;
+	if (page_addr < region->data_start) return 0;
+
+	uint64_t off = region->offset + (page_addr - region->data_start);
+	if (off & 0xFFF) return 0;
+	if (page_addr + 0x1000 > region->data_end &&
+		region->offset + (region->data_end - region->data_start) < region->file->length) return 0;
+
+	*offset = off;
+	return 1;
+}
+
+/*
+ * Map a cached copy of `file` at `offset` into `page`.
+ *
+ * @return 1 if the page was found and shared, 0 otherwise.
+ */
+static int mmap_cache_lookup(fs_node_t * file, uint64_t offset, page_t * page) {
+	int found = 0;
+
+	spin_lock(mmap_cache_lock);
+	mmap_cached_page_t * entry = mmap_cache[mmap_cache_hash(file, offset)];
+	while (entry) {
+		if (entry->device == file->device && entry->inode == file->inode && entry->impl == file->impl && entry->offset == offset) {
+			if (entry->mtime != file->mtime || entry->length != file->length) {
+				mmap_cache_drop(entry);
+			} else {
+				found = share_frame(&entry->page, page);
+			}
+			break;
+		}
+		entry = entry->next;
+	}
+	spin_unlock(mmap_cache_lock);
+
+	return found;
+}
+
+/*
+ * Add a freshly filled (and already read-only) page to the cache,
+ * evicting the oldest entry if the cache is full.
+ */
+static void mmap_cache_insert(fs_node_t * file, uint64_t offset, page_t * page) {
+	mmap_cached_page_t * entry = malloc(sizeof(mmap_cached_page_t));
+	if (!share_frame(page, &entry->page)) {
+		free(entry);
+		return;
+	}
+	entry->device = file->device;
+	entry->inode  = file->inode;
+	entry->impl   = file->impl;
+	entry->offset = offset;
+	entry->mtime  = file->mtime;
+	entry->length = file->length;
+
+	spin_lock(mmap_cache_lock);
+	if (!mmap_cache_order) {
+		mmap_cache_order = list_create();
+		reclaim_register("mmap cache", mmap_cache_shrink, 0);
+	}
+	if (mmap_cache_order->length >= MMAP_CACHE_PAGES) {
+		mmap_cache_drop(mmap_cache_order->head->value);
+	}
+	entry->bucket = mmap_cache_hash(file, offset);
+	entry->next = mmap_cache[entry->bucket];
+	mmap_cache[entry->bucket] = entry;
+	entry->order = list_insert(mmap_cache_order, entry);
+	spin_unlock(mmap_cache_lock);
+}
+
+/*
+ * Resolve a not-present fault against the regions of the current directory.
+ *
+ * A page may be covered by more than one region (such as when the
+ * end of text and the start of data share a page), so every region
+ * overlapping the page contributes its data.
+ *
+ * @return 1 if the fault was handled, 0 if the address is not in a region.
+ */
+int mmap_fault(uintptr_t address) {
+	page_directory_t * dir = current_directory;
+	uintptr_t page_addr = address & 0xFFFFF000;
+
+	if (!dir->mmap_regions) return 0;
+
+	int writable = -1;
+	int covering = 0;
+	mmap_region_t * only = NULL;
+
+	spin_lock(mmap_lock);
+	foreach(node, dir->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (page_addr >= region->start && page_addr < region->end) {
+			if (writable < 1) {
+				writable = (region->flags & MMAP_WRITE) ? 1 : 0;
+			}
+			covering++;
+			only = region;
+		}
+	}
+	spin_unlock(mmap_lock);
+
+	if (writable == -1) return 0;
+
+	page_t * page = get_page(page_addr, 1, dir);
+	if (page->present) {
+		/* Someone else (another thread) got here first */
+		return 1;
+	}
+
+	uint64_t offset;
+	int cacheable = (covering == 1) && mmap_cacheable(only, page_addr, &offset);
+	if (cacheable && mmap_cache_lookup(only->file, offset, page)) {
+		rss_adjust(dir, page_addr, 1);
+		invalidate_tables_at(page_addr);
+		return 1;
+	}
+
+	/* Map it writable while we fill it, we fix up the permissions later */
+	alloc_user_frame(dir, page_addr, 1);
+	invalidate_tables_at(page_addr);
+	memset((void *)page_addr, 0, 0x1000);
+
+	foreach(node, dir->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (page_addr >= region->start && page_addr < region->end) {
+			mmap_fill(region, page_addr);
+		}
+	}
+
+	if (!writable) {
+		page->rw = 0;
+		invalidate_tables_at(page_addr);
+	}
+
+	if (cacheable) {
+		mmap_cache_insert(only->file, offset, page);
+	}
+
+	return 1;
+}
+
+/*
+ * Write dirty pages of a shared region in [from, to) back to its file.
+ *
+ * Pages are accessed through their virtual addresses, so this
+ * only works on the current directory.
+ */
+static void mmap_writeback(page_directory_t * dir, mmap_region_t * region, uintptr_t from, uintptr_t to) {
+	if (!(region->flags & MMAP_SHARED) || !region->file) return;
+	if (dir != current_directory) {
+		debug_print(WARNING, "Can not write back shared mapping outside of its address space.");
+		return;
+	}
+
+	for (uintptr_t page_addr = from; page_addr < to; page_addr += 0x1000) {
+		page_t * page = get_page(page_addr, 0, dir);
+		if (!page || !page->present || !page->dirty) continue;
+
+		uintptr_t lo = page_addr;
+		uintptr_t hi = page_addr + 0x1000;
+		if (lo < region->data_start) lo = region->data_start;
+		if (hi > region->data_end)   hi = region->data_end;
+		if (lo < hi) {
+			write_fs(region->file, region->offset + (lo - region->data_start), hi - lo, (uint8_t *)lo);
+		}
+		page->dirty = 0;
+	}
+}
+
+/*
+ * Duplicate the regions of `src` into `dest`, for fork().
+ *
+ * Must be called after the page tables have been cloned: pages of
+ * shared regions were marked copy-on-write by clone_table(), and
+ * need to go back to being writable in both directories.
+ */
+void mmap_clone(page_directory_t * src, page_directory_t * dest) {
+	if (!src->mmap_regions) return;
+
+	foreach(node, src->mmap_regions) {
+		mmap_region_t * region = node->value;
+		mmap_add_region(dest, region->start, region->end, region->file, region->offset,
+			region->data_start, region->data_end, region->flags);
+
+		if (!(region->flags & MMAP_SHARED)) continue;
+
+		for (uintptr_t page_addr = region->start; page_addr < region->end; page_addr += 0x1000) {
+			page_t * a = get_page(page_addr, 0, src);
+			page_t * b = get_page(page_addr, 0, dest);
+			if (!a || !b || !a->cow) continue;
+			a->cow = b->cow = 0;
+			a->rw  = b->rw  = (region->flags & MMAP_WRITE) ? 1 : 0;
+		}
+	}
+}
+
+/*
+ * Drop all regions from a directory, releasing their files.
+ */
+void mmap_release(page_directory_t * dir) {
+	if (!dir->mmap_regions) return;
+
+	spin_lock(mmap_lock);
+	foreach(node, dir->mmap_regions) {
+		mmap_region_t * region = node->value;
+		mmap_writeback(dir, region, region->start, region->end);
+		if (region->file) {
+			close_fs(region->file);
+		}
+		free(region);
+	}
+	list_free(dir->mmap_regions);
+	free(dir->mmap_regions);
+	dir->mmap_regions = NULL;
+	spin_unlock(mmap_lock);
+}
+
+/*
+ * Is `address` in a shared mapping of `dir`? For the swapper, which
+ * can't wait for the region lock.
+ *
+ * @return 1 if it is, 0 if not, -1 if the lock was taken.
+ */
+int mmap_is_shared(page_directory_t * dir, uintptr_t address) {
+	if (!dir->mmap_regions) return 0;
+	if (!spin_trylock(mmap_lock)) return -1;
+
+	int shared = 0;
+	foreach(node, dir->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (address >= region->start && address < region->end && (region->flags & MMAP_SHARED)) {
+			shared = 1;
+			break;
+		}
+	}
+	spin_unlock(mmap_lock);
+	return shared;
+}
+
+/*
+ * Is any part of [start, end) already in use?
+ *
+ * @return The lowest address found in use, or 0 if the range is free.
+ */
+static uintptr_t mmap_in_use(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	uintptr_t lowest = 0;
+	if (dir->mmap_regions) {
+		foreach(node, dir->mmap_regions) {
+			mmap_region_t * region = node->value;
+			if (region->start < end && region->end > start) {
+				if (!lowest || region->start < lowest) lowest = region->start;
+			}
+		}
+	}
+	for (uintptr_t page_addr = start; page_addr < end; page_addr += 0x1000) {
+		page_t * page = get_page(page_addr, 0, dir);
+		if (page && page->frame) {
+			if (!lowest || page_addr < lowest) lowest = page_addr;
+			break;
+		}
+	}
+	return lowest;
+}
+
+/*
+ * Find room for `len` bytes, searching down from MMAP_TOP
+ * and staying above the process heap.
+ */
+static uintptr_t mmap_find_space(page_directory_t * dir, size_t len, uintptr_t floor) {
+	uintptr_t candidate = MMAP_TOP - len;
+	while (candidate >= floor && candidate < MMAP_TOP) {
+		uintptr_t conflict = mmap_in_use(dir, candidate, candidate + len);
+		if (!conflict) return candidate;
+		if (conflict < floor + len) break;
+		candidate = conflict - len;
+	}
+	return 0;
+}
+
+/*
+ * Map `len` bytes of `file` at `offset` (or anonymous memory, if `file`
+ * is NULL) into the current address space.
+ *
+ * @return The mapped address, or a negative error value.
+ */
+uintptr_t mmap_map(uintptr_t addr, size_t len, int prot, int flags, fs_node_t * file, uint64_t offset) {
+	page_directory_t * dir = current_directory;
+
+	if (!len || (offset & 0xFFF)) return -EINVAL;
+	if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) return -EINVAL;
+
+	len = (len + 0xFFF) & 0xFFFFF000;
+
+	process_t * proc = (process_t *)current_process;
+	if (proc->group != 0) {
+		proc = process_from_pid(proc->group);
+	}
+
+	if (flags & MAP_FIXED) {
+		/* TODO: These virtual address bounds should be in a header somewhere */
+		if ((addr & 0xFFF) || addr < 0x20000000 || addr + len > USER_STACK_BOTTOM || addr + len < addr) {
+			return -EINVAL;
+		}
+		mmap_unmap(dir, addr, len);
+	} else {
+		addr = mmap_find_space(dir, len, (proc->image.heap_actual + 0x1000) & 0xFFFFF000);
+		if (!addr) return -ENOMEM;
+	}
+
+	int region_flags = 0;
+	if (prot & PROT_WRITE)  region_flags |= MMAP_WRITE;
+	if (flags & MAP_SHARED) region_flags |= MMAP_SHARED;
+
+	uintptr_t data_end = addr;
+	if (file && offset < file->length) {
+		data_end = addr + ((file->length - offset < len) ? (file->length - offset) : len);
+	}
+
+	mmap_add_region(dir, addr, addr + len, file, offset, addr, data_end, region_flags);
+
+	if (flags & MAP_SHARED) {
+		/* Shared pages need frames now, so fork() can share them */
+		for (uintptr_t page_addr = addr; page_addr < addr + len; page_addr += 0x1000) {
+			mmap_fault(page_addr);
+		}
+	}
+
+	return addr;
+}
+
+/*
+ * Remove mappings in [addr, addr + len), writing back shared pages
+ * and releasing the frames of any pages that were filled in.
+ */
+int mmap_unmap(page_directory_t * dir, uintptr_t addr, size_t len) {
+	uintptr_t end = (addr + len + 0xFFF) & 0xFFFFF000;
+	if ((addr & 0xFFF) || !len || end < addr) return -EINVAL;
+	if (!dir->mmap_regions) return 0;
+
+	spin_lock(mmap_lock);
+	node_t * node = dir->mmap_regions->head;
+	while (node) {
+		node_t * next = node->next;
+		mmap_region_t * region = node->value;
+
+		if (region->start < end && region->end > addr) {
+			uintptr_t lo = (region->start > addr) ? region->start : addr;
+			uintptr_t hi = (region->end < end) ? region->end : end;
+
+			mmap_writeback(dir, region, lo, hi);
+
+			for (uintptr_t page_addr = lo; page_addr < hi; page_addr += 0x1000) {
+				page_t * page = get_page(page_addr, 0, dir);
+				if (page && page->frame) {
+					if (page_is_resident(page)) rss_adjust(dir, page_addr, -1);
+					free_frame(page);
+					memset(page, 0, sizeof(page_t));
+					invalidate_tables_at(page_addr);
+				}
+			}
+
+			if (lo == region->start && hi == region->end) {
+				/* Entirely unmapped */
+				list_delete(dir->mmap_regions, node);
+				free(node);
+				if (region->file) close_fs(region->file);
+				free(region);
+			} else if (lo == region->start) {
+				region->start = hi;
+			} else if (hi == region->end) {
+				region->end = lo;
+			} else {
+				/* Punched a hole in the middle; split it in two */
+				mmap_region_t * upper = malloc(sizeof(mmap_region_t));
+				memcpy(upper, region, sizeof(mmap_region_t));
+				upper->start = hi;
+				upper->file  = clone_fs(region->file);
+				region->end  = lo;
+				list_insert(dir->mmap_regions, upper);
+			}
+		}
+
+		node = next;
+	}
+	spin_unlock(mmap_lock);
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Memory Reclaim
+ *
+ * Caches register a shrinker, and when the frame allocator finds no
+ * free frames it asks each of them in turn to let go of some pages
+ * before giving up. Shrinkers are asked in the order they registered,
+ * cheap ones before expensive ones, until enough has been released.
+ *
+ * Reclaim runs at whatever point the allocation happened, with
+ * whatever locks the allocating code holds, so shrinkers only ever
+ * try their locks. The allocator doesn't reclaim while it is growing
+ * the kernel heap, as shrinkers free heap memory and the heap lock
+ * is held then.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/reclaim.h>
+
+#define MAX_SHRINKERS 16
+
+static struct {
+	const char * name;
+	reclaim_func_t func;
+	int expensive;
+} shrinkers[MAX_SHRINKERS];
+static int shrinker_count = 0;
+
+static volatile int reclaiming = 0;
+
+uint32_t reclaim_runs = 0;  /* Times the allocator ran out and asked */
+uint32_t reclaim_pages = 0; /* Pages given back, in total */
+
+void reclaim_register(const char * name, reclaim_func_t func, int expensive) {
+	if (shrinker_count == MAX_SHRINKERS) {
+		debug_print(WARNING, "Too many shrinkers; not registering %s", name);
+		return;
+	}
+	int i = shrinker_count;
+	while (!expensive && i > 0 && shrinkers[i-1].expensive) {
+		shrinkers[i] = shrinkers[i-1];
+		i--;
+	}
+	shrinkers[i].name = name;
+	shrinkers[i].func = func;
+	shrinkers[i].expensive = expensive;
+	shrinker_count++;
+}
+
+/*
+ * Ask the shrinkers for `wanted` pages; returns how many they freed.
+ */
+size_t reclaim(size_t wanted) {
+	if (reclaiming) return 0;
+	reclaiming = 1;
+	reclaim_runs++;
+
+	size_t freed = 0;
+	for (int i = 0; i < shrinker_count && freed < wanted; ++i) {
+		size_t got = shrinkers[i].func(wanted - freed);
+		if (got) {
+			debug_print(NOTICE, "Reclaimed %d pages from %s", got, shrinkers[i].name);
+		}
+		freed += got;
+	}
+
+	reclaim_pages += freed;
+	reclaiming = 0;
+	return freed;
+}
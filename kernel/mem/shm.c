@@ -5,6 +5,15 @@
  * Copyright (C) 2012 Markus Schober
  *
  * Shared Memory
+ *
+ * Chunks are populated lazily: a frame is only allocated when a
+ * page is first touched through any of its mappings, and the page
+ * fault handler maps it in (see shm_fault). Frames of freed chunks
+ * are kept in a small pool, so obtaining a chunk of the same size
+ * again - menus, tooltips, screenshots - reuses them.
+ *
+ * Names are looked up whole in a hashmap. A name stays in it for as
+ * long as its chunk exists, and goes when the last mapping does.
  */
 #include <kernel/system.h>
 #include <kernel/process.h>
@@ -12,73 +21,115 @@
 #include <kernel/shm.h>
 #include <kernel/mem.h>
 
-#include <toaru/tree.h>
+#include <toaru/hashmap.h>
 #include <toaru/list.h>
 
 
 //static volatile uint8_t bsl; // big shm lock
 static spin_lock_t bsl; // big shm lock
-tree_t * shm_tree = NULL;
+static hashmap_t * shm_names = NULL; /* full name -> shm_node_t */
+
+/* Most frames the pool of freed chunks may hold on to */
+#define SHM_POOL_FRAMES 2048
+
+typedef struct {
+	uint32_t num_frames;
+	uint32_t populated;
+	uintptr_t * frames;
+} shm_pooled_t;
+
+static list_t * shm_pool = NULL;
+static uint32_t shm_pool_frames = 0;
 
 
 void shm_install(void) {
 	debug_print(NOTICE, "Installing shared memory layer...");
-	shm_tree = tree_create();
-	tree_set_root(shm_tree, NULL);
+	shm_names = hashmap_create(64);
+	shm_pool = list_create();
 }
 
 
 /* Accessors */
 
 
-static shm_node_t * _get_node(char * shm_path, int create, tree_node_t * from) {
-
-	char *pch, *save;
-	pch = strtok_r(shm_path, SHM_PATH_SEPARATOR, &save);
+static shm_node_t * get_node (char * shm_path, int create) {
+	shm_node_t * node = hashmap_get(shm_names, shm_path);
+	if (node || !create) {
+		return node;
+	}
 
-	tree_node_t * tnode = from;
-	foreach(node, tnode->children) {
-		tree_node_t * _node = (tree_node_t *)node->value;
-		shm_node_t *  snode = (shm_node_t *)_node->value;
+	node = malloc(sizeof(shm_node_t));
+	node->name = strdup(shm_path);
+	node->chunk = NULL;
+	hashmap_set(shm_names, shm_path, node);
+	return node;
+}
 
-		if (!strcmp(snode->name, pch)) {
-			if (*save == '\0') {
-				return snode;
-			}
-			return _get_node(save, create, _node);
-		}
-	}
+static void drop_node (shm_node_t * node) {
+	hashmap_remove(shm_names, node->name);
+	free(node->name);
+	free(node);
+}
 
-	/* The next node in sequence was not found */
-	if (create) {
-		shm_node_t * nsnode = malloc(sizeof(shm_node_t));
-		memcpy(nsnode->name, pch, strlen(pch) + 1);
-		nsnode->chunk = NULL;
 
-		tree_node_t * nnode = tree_node_insert_child(shm_tree, from, nsnode);
+/* Create and Release */
 
-		if (*save == '\0') {
-			return nsnode;
+static void free_frames (uintptr_t * frames, uint32_t num_frames) {
+	for (uint32_t i = 0; i < num_frames; i++) {
+		if (frames[i]) {
+			clear_frame(frames[i] * 0x1000);
 		}
-
-		return _get_node(save, create, nnode);
-	} else {
-		return NULL;
 	}
+	free(frames);
 }
 
-static shm_node_t * get_node (char * shm_path, int create) {
-	char * _path = malloc(strlen(shm_path)+1);
-	memcpy(_path, shm_path, strlen(shm_path)+1);
+/*
+ * Keep the frames of a freed chunk around for the next chunk of
+ * the same size, evicting the oldest entries to stay in budget.
+ * Chunks that never had a page touched aren't worth keeping.
+ */
+static void pool_put (uintptr_t * frames, uint32_t num_frames) {
+	uint32_t populated = 0;
+	for (uint32_t i = 0; i < num_frames; i++) {
+		if (frames[i]) populated++;
+	}
 
-	shm_node_t * node = _get_node(_path, create, shm_tree->root);
+	if (!populated || populated > SHM_POOL_FRAMES) {
+		free_frames(frames, num_frames);
+		return;
+	}
 
-	free(_path);
-	return node;
-}
+	while (shm_pool_frames + populated > SHM_POOL_FRAMES) {
+		node_t * node = list_dequeue(shm_pool);
+		shm_pooled_t * old = node->value;
+		shm_pool_frames -= old->populated;
+		free_frames(old->frames, old->num_frames);
+		free(old);
+		free(node);
+	}
 
+	shm_pooled_t * pooled = malloc(sizeof(shm_pooled_t));
+	pooled->num_frames = num_frames;
+	pooled->populated = populated;
+	pooled->frames = frames;
+	list_insert(shm_pool, pooled);
+	shm_pool_frames += populated;
+}
 
-/* Create and Release */
+static uintptr_t * pool_take (uint32_t num_frames) {
+	foreach(node, shm_pool) {
+		shm_pooled_t * pooled = node->value;
+		if (pooled->num_frames == num_frames) {
+			uintptr_t * frames = pooled->frames;
+			shm_pool_frames -= pooled->populated;
+			list_delete(shm_pool, node);
+			free(node);
+			free(pooled);
+			return frames;
+		}
+	}
+	return NULL;
+}
 
 
 static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
@@ -96,6 +147,13 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 	chunk->ref_count = 1;
 
 	chunk->num_frames = (size / 0x1000) + ((size % 0x1000) ? 1 : 0);
+
+	/* Reuse a freed chunk of the same size if we have one. */
+	chunk->frames = pool_take(chunk->num_frames);
+	if (chunk->frames) {
+		return chunk;
+	}
+
 	chunk->frames = malloc(sizeof(uintptr_t) * chunk->num_frames);
 	if (chunk->frames == NULL) {
 		debug_print(ERROR, "Failed to allocate uintptr_t[%d]", chunk->num_frames);
@@ -103,15 +161,8 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 		return NULL;
 	}
 
-	/* Now grab some frames for this guy. */
-	for (uint32_t i = 0; i < chunk->num_frames; i++) {
-		page_t tmp = {0};
-		alloc_frame(&tmp, 0, 0);
-		chunk->frames[i] = tmp.frame;
-#if 0
-		debug_print(WARNING, "Using frame 0x%x for chunk[%d] (name=%s)", tmp.frame * 0x1000, i, parent->name);
-#endif
-	}
+	/* Frames are allocated as pages are touched; see shm_fault. */
+	memset(chunk->frames, 0, sizeof(uintptr_t) * chunk->num_frames);
 
 	return chunk;
 }
@@ -126,14 +177,11 @@ static int release_chunk (shm_chunk_t * chunk) {
 			debug_print(INFO, "Freeing chunk with name %s", chunk->parent->name);
 #endif
 
-			/* First, free the frames used by this chunk */
-			for (uint32_t i = 0; i < chunk->num_frames; i++) {
-				clear_frame(chunk->frames[i] * 0x1000);
-			}
+			/* First, give the frames used by this chunk to the pool */
+			pool_put(chunk->frames, chunk->num_frames);
 
-			/* Then, get rid of the damn thing */
-			chunk->parent->chunk = NULL;
-			free(chunk->frames);
+			/* Then, get rid of the damn thing, and its name */
+			drop_node(chunk->parent);
 			free(chunk);
 		}
 
@@ -160,6 +208,22 @@ static uintptr_t proc_sbrk(uint32_t num_pages, process_t * proc) {
 	return initial;
 }
 
+/*
+ * Map page `i` of a chunk at `vaddr`, if it has a frame yet.
+ * Pages that don't are left not-present for shm_fault.
+ */
+static void map_frame (shm_chunk_t * chunk, uint32_t i, uintptr_t vaddr, process_t * proc) {
+	if (!chunk->frames[i]) return;
+
+	page_t * page = get_page(vaddr, 1, proc->thread.page_directory);
+	assert(page && "Failed to get page for shared memory mapping");
+
+	page->frame = chunk->frames[i];
+	alloc_frame(page, 0, 1);
+	rss_adjust(proc->thread.page_directory, vaddr, 1);
+	invalidate_tables_at(vaddr);
+}
+
 static void * map_in (shm_chunk_t * chunk, process_t * proc) {
 	if (!chunk) {
 		return NULL;
@@ -182,10 +246,7 @@ static void * map_in (shm_chunk_t * chunk, process_t * proc) {
 
 				/* Map the gap */
 				for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-					page_t * page = get_page(last_address + i * 0x1000, 1, proc->thread.page_directory);
-					page->frame = chunk->frames[i];
-					alloc_frame(page, 0, 1);
-					invalidate_tables_at(last_address + i * 0x1000);
+					map_frame(chunk, i, last_address + i * 0x1000, proc);
 					mapping->vaddrs[i] = last_address + i * 0x1000;
 				}
 
@@ -205,10 +266,7 @@ static void * map_in (shm_chunk_t * chunk, process_t * proc) {
 			debug_print(INFO, "Gap is sufficient, we can insert here.");
 
 			for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-				page_t * page = get_page(last_address + i * 0x1000, 1, proc->thread.page_directory);
-				page->frame = chunk->frames[i];
-				alloc_frame(page, 0, 1);
-				invalidate_tables_at(last_address + i * 0x1000);
+				map_frame(chunk, i, last_address + i * 0x1000, proc);
 				mapping->vaddrs[i] = last_address + i * 0x1000;
 			}
 
@@ -225,12 +283,7 @@ static void * map_in (shm_chunk_t * chunk, process_t * proc) {
 		uintptr_t new_vpage = proc_sbrk(1, proc);
 		assert(new_vpage % 0x1000 == 0);
 
-		page_t * page = get_page(new_vpage, 1, proc->thread.page_directory);
-		assert(page && "Page not allocated by sys_sbrk?");
-
-		page->frame = chunk->frames[i];
-		alloc_frame(page, 0, 1);
-		invalidate_tables_at(new_vpage);
+		map_frame(chunk, i, new_vpage, proc);
 		mapping->vaddrs[i] = new_vpage;
 
 #if 0
@@ -247,6 +300,57 @@ static size_t chunk_size (shm_chunk_t * chunk) {
 	return (size_t)(chunk->num_frames * 0x1000);
 }
 
+/*
+ * Resolve a not-present fault in the shared memory area.
+ *
+ * The first process to touch a page allocates and zeroes its frame
+ * on behalf of the chunk; everyone after that just maps it in.
+ *
+ * @return 1 if the fault was handled, 0 if the address is not in a mapping.
+ */
+int shm_fault (uintptr_t address) {
+	uintptr_t page_addr = address & 0xFFFFF000;
+	process_t * proc = (process_t *)current_process;
+
+	if (proc->group != 0) {
+		proc = process_from_pid(proc->group);
+	}
+
+	spin_lock(bsl);
+
+	foreach(node, proc->shm_mappings) {
+		shm_mapping_t * m = node->value;
+		if (page_addr < m->vaddrs[0] || page_addr >= m->vaddrs[0] + m->num_vaddrs * 0x1000) continue;
+
+		uint32_t i = (page_addr - m->vaddrs[0]) / 0x1000;
+		shm_chunk_t * chunk = m->chunk;
+
+		page_t * page = get_page(page_addr, 1, proc->thread.page_directory);
+		if (page->present) {
+			/* Another thread got here first */
+			spin_unlock(bsl);
+			return 1;
+		}
+
+		int fresh = !chunk->frames[i];
+		page->frame = chunk->frames[i];
+		alloc_frame(page, 0, 1);
+		rss_adjust(proc->thread.page_directory, page_addr, 1);
+		invalidate_tables_at(page_addr);
+
+		if (fresh) {
+			chunk->frames[i] = page->frame;
+			memset((void *)page_addr, 0, 0x1000);
+		}
+
+		spin_unlock(bsl);
+		return 1;
+	}
+
+	spin_unlock(bsl);
+	return 0;
+}
+
 
 /* Kernel-Facing Functions and Syscalls */
 
@@ -270,6 +374,7 @@ void * shm_obtain (char * path, size_t * size) {
 
 		if (size == 0) {
 			// The process doesn't want a chunk...?
+			drop_node(node);
 			spin_unlock(bsl);
 			return NULL;
 		}
@@ -277,6 +382,7 @@ void * shm_obtain (char * path, size_t * size) {
 		chunk = create_chunk(node, *size);
 		if (chunk == NULL) {
 			debug_print(ERROR, "Could not allocate a shm_chunk_t");
+			drop_node(node);
 			spin_unlock(bsl);
 			return NULL;
 		}
@@ -290,7 +396,9 @@ void * shm_obtain (char * path, size_t * size) {
 	*size = chunk_size(chunk);
 
 	spin_unlock(bsl);
-	invalidate_page_tables();
+	if (vshm_start) {
+		invalidate_tables_range((uintptr_t)vshm_start, *size);
+	}
 
 	return vshm_start;
 }
@@ -330,11 +438,16 @@ int shm_release (char * path) {
 	/* Clear the mappings from the process's address space */
 	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
 		page_t * page = get_page(mapping->vaddrs[i], 0, proc->thread.page_directory);
-		assert(page && "Shared memory mapping was invalid!");
 
-		memset(page, 0, sizeof(page_t));
+		/* Pages that were never touched may not even have a table */
+		if (page) {
+			if (page->frame) rss_adjust(proc->thread.page_directory, mapping->vaddrs[i], -1);
+			memset(page, 0, sizeof(page_t));
+		}
+	}
+	if (mapping->num_vaddrs) {
+		invalidate_tables_range(mapping->vaddrs[0], mapping->num_vaddrs * 0x1000);
 	}
-	invalidate_page_tables();
 
 	/* Clean up */
 	release_chunk(chunk);
@@ -0,0 +1,183 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Slab caches
+ *
+ * A cache hands out objects of one size, carved from pages that hold
+ * nothing else, so structures the kernel makes and destroys all the
+ * time (processes, file nodes, packets) don't fragment the general
+ * heap and cost a pop from a free list to allocate.
+ *
+ * Each slab is one page, starting with a header that records its
+ * cache. The header's magic number sits where klmalloc keeps its bin
+ * magic, which is how free() recognizes a slab object and passes it
+ * back here; code that frees these objects doesn't have to know where
+ * they came from.
+ *
+ * Slabs are taken from the heap a page at a time and never given back
+ * to it. A slab that empties out goes on a pool shared by every cache,
+ * so the page can be reused for another type of object.
+ *
+ * The constructor, if any, runs on each object once, when its slab is
+ * set up. An object should be in its constructed state when freed.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/slab.h>
+
+#define SLAB_SIZE  0x1000
+#define SLAB_MAGIC 0x51AB51AB
+
+typedef struct slab {
+	struct slab *  next;
+	struct slab *  prev;
+	slab_cache_t * cache;
+	uint32_t       magic; /* Same offset as klmalloc's bin_magic */
+	void *         free;  /* Stack of free objects */
+	unsigned int   in_use;
+} slab_t;
+
+struct slab_cache {
+	const char *   name;
+	size_t         size;
+	unsigned int   per_slab;
+	slab_ctor_t    ctor;
+	slab_t *       partial; /* Slabs with objects free */
+	slab_t *       full;    /* Slabs with none */
+	spin_lock_t    lock;
+};
+
+static slab_t * slab_pool = NULL; /* Empty slabs, for any cache */
+static spin_lock_t slab_pool_lock = { 0 };
+
+static void slab_unlink(slab_t ** list, slab_t * slab) {
+	if (slab->prev) slab->prev->next = slab->next;
+	else *list = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+static void slab_push(slab_t ** list, slab_t * slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list) (*list)->prev = slab;
+	*list = slab;
+}
+
+/*
+ * Set up a fresh slab for a cache, reusing a pooled page if there is one.
+ */
+static slab_t * slab_grow(slab_cache_t * cache) {
+	spin_lock(slab_pool_lock);
+	slab_t * slab = slab_pool;
+	if (slab) {
+		slab_unlink(&slab_pool, slab);
+	}
+	spin_unlock(slab_pool_lock);
+
+	if (!slab) {
+		slab = heap_pages(1);
+	}
+
+	slab->cache  = cache;
+	slab->magic  = SLAB_MAGIC;
+	slab->in_use = 0;
+	slab->free   = NULL;
+
+	uintptr_t base = ((uintptr_t)slab + sizeof(slab_t) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+	for (unsigned int i = cache->per_slab; i > 0; --i) {
+		void ** object = (void **)(base + (i - 1) * cache->size);
+		if (cache->ctor) cache->ctor(object);
+		*object = slab->free;
+		slab->free = object;
+	}
+
+	return slab;
+}
+
+/*
+ * Make a cache for objects of `size` bytes. Objects must be small
+ * enough that a page holds at least two of them.
+ */
+slab_cache_t * slab_create(const char * name, size_t size, slab_ctor_t ctor) {
+	/* Objects hold the free list link while they're free */
+	if (size < sizeof(void *)) size = sizeof(void *);
+	size = (size + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+
+	unsigned int per_slab = (SLAB_SIZE - sizeof(slab_t) - sizeof(uintptr_t)) / size;
+	assert(per_slab >= 2 && "slab objects are too big");
+
+	slab_cache_t * cache = malloc(sizeof(slab_cache_t));
+	memset(cache, 0, sizeof(slab_cache_t));
+	cache->name     = name;
+	cache->size     = size;
+	cache->per_slab = per_slab;
+	cache->ctor     = ctor;
+
+	debug_print(INFO, "slab cache %s: %d-byte objects, %d per slab", name, size, per_slab);
+	return cache;
+}
+
+void * slab_alloc(slab_cache_t * cache) {
+	spin_lock(cache->lock);
+
+	slab_t * slab = cache->partial;
+	if (!slab) {
+		slab = slab_grow(cache);
+		slab_push(&cache->partial, slab);
+	}
+
+	void ** object = slab->free;
+	slab->free = *object;
+	slab->in_use++;
+
+	if (!slab->free) {
+		slab_unlink(&cache->partial, slab);
+		slab_push(&cache->full, slab);
+	}
+
+	spin_unlock(cache->lock);
+	return object;
+}
+
+void slab_free(slab_cache_t * cache, void * object) {
+	if (!object) return;
+
+	slab_t * slab = (slab_t *)((uintptr_t)object & ~(SLAB_SIZE - 1));
+	assert(slab->magic == SLAB_MAGIC && slab->cache == cache);
+
+	spin_lock(cache->lock);
+
+	if (!slab->free) {
+		/* It was full; now it isn't */
+		slab_unlink(&cache->full, slab);
+		slab_push(&cache->partial, slab);
+	}
+
+	void ** link = object;
+	*link = slab->free;
+	slab->free = link;
+	slab->in_use--;
+
+	if (!slab->in_use) {
+		slab_unlink(&cache->partial, slab);
+		slab->magic = 0;
+		spin_unlock(cache->lock);
+
+		spin_lock(slab_pool_lock);
+		slab_push(&slab_pool, slab);
+		spin_unlock(slab_pool_lock);
+		return;
+	}
+
+	spin_unlock(cache->lock);
+}
+
+slab_cache_t * slab_owner(void * object) {
+	if ((uintptr_t)object % SLAB_SIZE == 0) return NULL;
+	slab_t * slab = (slab_t *)((uintptr_t)object & ~(SLAB_SIZE - 1));
+	return slab->magic == SLAB_MAGIC ? slab->cache : NULL;
+}
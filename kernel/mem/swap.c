@@ -0,0 +1,331 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Swap
+ *
+ * With a swap device set up (the `swap=` boot option, naming a
+ * partition or a file), the swapper is the last shrinker asked for
+ * memory when frames run out. It walks the user address spaces like
+ * a clock hand: a page that has been touched since the hand last
+ * passed gets its accessed bit cleared and is left alone, and one
+ * that hasn't is written to a free slot on the device and its frame
+ * given back. The page table entry keeps its permission bits, loses
+ * its present bit, and records the slot in place of the frame.
+ * Touching the page again faults, and swap_in() reads it back into
+ * a new frame.
+ *
+ * Only private anonymous memory goes out: pages shared with another
+ * directory (or the zero frame), shared file mappings, shared memory
+ * and device memory all stay. fork() shares a swapped page by
+ * counting another reference to its slot; each side reads its own
+ * copy back in when it next touches it.
+ *
+ * Writing a page out can sleep, so the swapper picks its batch of
+ * pages and turns their entries into swap entries before it starts
+ * on the device, and doesn't look at the entries again afterwards;
+ * by then the process could have exited or exec()d. Anyone touching
+ * one of the pages meanwhile waits on the swap I/O lock, which is
+ * held until the batch is written.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/fs.h>
+#include <kernel/mem.h>
+#include <kernel/mmap.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
+
+#include <toaru/list.h>
+#include <sys/signal_defs.h>
+
+#define SWAP_BATCH    16   /* Most pages written out per call */
+#define SWAP_MAP_MAX  0xFF /* Most references to one slot */
+#define SWAP_SLOTS_MAX 0x100000 /* Slots are stored in the 20-bit frame field */
+
+static fs_node_t * swap_node = NULL;
+static uint8_t * swap_map = NULL; /* References to each slot; 0 is free */
+static uint8_t * swap_buffer = NULL; /* SWAP_BATCH pages to move data through */
+static uint32_t swap_hint = 1;
+static spin_lock_t swap_lock = { 0 };    /* swap_map */
+static spin_lock_t swap_io_lock = { 0 }; /* The device, swap_buffer and swap entries changing */
+
+uint32_t swap_slots = 0;
+uint32_t swap_used = 0;
+
+/*
+ * After a failed write the swapper stops, and the pages that didn't
+ * make it to the device stay here in their frames instead.
+ */
+static int swap_broken = 0;
+static struct {
+	uint32_t slot;
+	uint32_t frame;
+} swap_unwritten[SWAP_BATCH];
+static int swap_unwritten_count = 0;
+
+/* Where the clock hand is */
+static pid_t swap_hand_pid = 0;
+static uintptr_t swap_hand_addr = 0;
+
+static uint32_t swap_slot_alloc(void) {
+	uint32_t slot = 0;
+	spin_lock(swap_lock);
+	for (uint32_t i = 0; i < swap_slots - 1; ++i) {
+		uint32_t s = 1 + (swap_hint - 1 + i) % (swap_slots - 1);
+		if (!swap_map[s]) {
+			swap_map[s] = 1;
+			swap_used++;
+			swap_hint = s + 1;
+			slot = s;
+			break;
+		}
+	}
+	spin_unlock(swap_lock);
+	return slot;
+}
+
+int swap_dup(uint32_t slot) {
+	int ok = 0;
+	spin_lock(swap_lock);
+	if (swap_map[slot] < SWAP_MAP_MAX) {
+		swap_map[slot]++;
+		ok = 1;
+	}
+	spin_unlock(swap_lock);
+	return ok;
+}
+
+void swap_release(uint32_t slot) {
+	spin_lock(swap_lock);
+	assert(swap_map[slot] && "Released a free swap slot");
+	if (--swap_map[slot] == 0) {
+		swap_used--;
+		for (int i = 0; i < swap_unwritten_count; ++i) {
+			if (swap_unwritten[i].slot == slot) {
+				free_frame_run(swap_unwritten[i].frame, 1);
+				swap_unwritten[i] = swap_unwritten[--swap_unwritten_count];
+				break;
+			}
+		}
+	}
+	spin_unlock(swap_lock);
+}
+
+/*
+ * Bring a swapped-out page back into a frame of its own.
+ *
+ * @return 0 on success, -1 if the device couldn't be read, in which
+ *         case the page is mapped but its contents are lost.
+ */
+int swap_in(page_t * page) {
+	page_t fresh;
+	memset(&fresh, 0, sizeof(page_t));
+	alloc_frame(&fresh, 0, 1);
+
+	spin_lock(swap_io_lock);
+	if (!page->swapped) {
+		/* Another thread brought it in while we waited */
+		spin_unlock(swap_io_lock);
+		free_frame(&fresh);
+		return 0;
+	}
+
+	int error = 0;
+	uint32_t slot = page->frame;
+	uint32_t source = 0;
+	spin_lock(swap_lock);
+	for (int i = 0; i < swap_unwritten_count; ++i) {
+		if (swap_unwritten[i].slot == slot) {
+			source = swap_unwritten[i].frame * 0x1000;
+		}
+	}
+	spin_unlock(swap_lock);
+
+	if (!source) {
+		if (read_fs(swap_node, (uint64_t)slot * 0x1000, 0x1000, swap_buffer) != 0x1000) {
+			debug_print(ERROR, "swap: failed to read slot %d", slot);
+			memset(swap_buffer, 0, 0x1000);
+			error = -1;
+		}
+		source = map_to_physical((uintptr_t)swap_buffer);
+	}
+	copy_page_physical(source, fresh.frame * 0x1000);
+
+	page->frame    = fresh.frame;
+	page->swapped  = 0;
+	page->present  = 1;
+	page->accessed = 1;
+	spin_unlock(swap_io_lock);
+
+	swap_release(slot);
+	return error;
+}
+
+/*
+ * Page fault handler hook: is this a page of ours?
+ */
+int swap_fault(uintptr_t address) {
+	page_t * page = get_page(address, 0, current_directory);
+	if (!page || !page->swapped) return 0;
+
+	if (swap_in(page) < 0) {
+		send_signal(current_process->id, SIGBUS, 1);
+	} else {
+		rss_adjust(current_directory, address, 1);
+	}
+	invalidate_tables_at(address & 0xFFFFF000);
+	return 1;
+}
+
+/*
+ * Can this (present, user) page go out to swap? Clears the accessed
+ * bit of pages used since the last look instead.
+ *
+ * @return 1 if it can, 0 if not.
+ */
+static int swap_candidate(page_directory_t * dir, uintptr_t address, page_t * page) {
+	if (page->accessed) {
+		page->accessed = 0;
+		if (dir == current_directory) {
+			invalidate_tables_at(address);
+		}
+		return 0;
+	}
+	if (page->writethrough || page->cachedisable || page->pat) return 0;
+	if (page->frame >= memory_total() / 4) return 0;
+	if (frame_is_shared(page)) return 0;
+	/* Don't wait for the region lock; shared file pages have to stay */
+	return mmap_is_shared(dir, address) == 0;
+}
+
+/*
+ * Choose up to `wanted` pages, copy each into the swap buffer, and
+ * turn their entries into swap entries. Nothing here sleeps, so the
+ * process list and directories can't change underneath.
+ *
+ * @return The number of pages chosen; their frames and slots are
+ *         stored in `frames` and `slots`.
+ */
+static size_t swap_pick(size_t wanted, uint32_t * frames, uint32_t * slots) {
+	size_t count = 0;
+
+	/* The second time around takes the pages whose accessed bits the first cleared */
+	for (int lap = 0; lap < 2; ++lap) {
+		foreach(node, process_list) {
+			process_t * proc = node->value;
+			if (proc->id < swap_hand_pid) continue;
+			if (proc->finished || proc->is_tasklet) continue;
+			if (proc->group && proc->group != proc->id) continue; /* Threads share their leader's directory */
+			page_directory_t * dir = proc->thread.page_directory;
+			if (!dir || dir == kernel_directory) continue;
+
+			uintptr_t address = (proc->id == swap_hand_pid) ? swap_hand_addr : 0;
+			for (; address < SHM_START; address += 0x1000) {
+				uint32_t i = address / 0x400000;
+				page_table_t * table = dir->tables[i];
+				if (!table || table == LARGE_PAGE_TABLE || table == kernel_directory->tables[i]) {
+					address = (i + 1) * 0x400000 - 0x1000;
+					continue;
+				}
+				page_t * page = &table->pages[(address / 0x1000) % 1024];
+				if (!page->present || !page->user) continue;
+				if (!swap_candidate(dir, address, page)) continue;
+
+				uint32_t slot = swap_slot_alloc();
+				if (!slot) return count;
+
+				copy_page_physical(page->frame * 0x1000, map_to_physical((uintptr_t)swap_buffer + count * 0x1000));
+				frames[count] = page->frame;
+				slots[count]  = slot;
+				page->present = 0;
+				page->swapped = 1;
+				page->frame   = slot;
+				dir->rss--;
+				if (dir == current_directory) {
+					invalidate_tables_at(address);
+				}
+
+				if (++count == wanted) {
+					swap_hand_pid  = proc->id;
+					swap_hand_addr = address + 0x1000;
+					return count;
+				}
+			}
+		}
+		swap_hand_pid  = 0;
+		swap_hand_addr = 0;
+	}
+
+	return count;
+}
+
+static size_t swap_shrink(size_t wanted) {
+	if (!swap_node || swap_broken || !process_list) return 0;
+	if (!spin_trylock(swap_io_lock)) return 0;
+
+	uint32_t frames[SWAP_BATCH];
+	uint32_t slots[SWAP_BATCH];
+	size_t count = swap_pick(wanted < SWAP_BATCH ? wanted : SWAP_BATCH, frames, slots);
+
+	size_t freed = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!swap_broken && write_fs(swap_node, (uint64_t)slots[i] * 0x1000, 0x1000, swap_buffer + i * 0x1000) == 0x1000) {
+			free_frame_run(frames[i], 1);
+			freed++;
+			continue;
+		}
+		if (!swap_broken) {
+			debug_print(ERROR, "swap: failed to write slot %d; no longer swapping out", slots[i]);
+			swap_broken = 1;
+		}
+		spin_lock(swap_lock);
+		if (swap_map[slots[i]]) {
+			swap_unwritten[swap_unwritten_count].slot  = slots[i];
+			swap_unwritten[swap_unwritten_count].frame = frames[i];
+			swap_unwritten_count++;
+		} else {
+			/* Everyone holding it let go while we were writing */
+			free_frame_run(frames[i], 1);
+			freed++;
+		}
+		spin_unlock(swap_lock);
+	}
+
+	spin_unlock(swap_io_lock);
+	return freed;
+}
+
+int swap_on(char * path) {
+	if (swap_node) {
+		debug_print(WARNING, "swap: already swapping; ignoring %s", path);
+		return -EBUSY;
+	}
+
+	fs_node_t * node = kopen(path, 0);
+	if (!node) {
+		debug_print(ERROR, "swap: can't open %s", path);
+		return -ENOENT;
+	}
+
+	uint64_t slots = node->length / 0x1000;
+	if (slots > SWAP_SLOTS_MAX) slots = SWAP_SLOTS_MAX;
+	if (slots < 2) {
+		debug_print(ERROR, "swap: %s is too small", path);
+		close_fs(node);
+		return -EINVAL;
+	}
+
+	swap_map = malloc(slots);
+	memset(swap_map, 0, slots);
+	swap_map[0] = SWAP_MAP_MAX; /* Slot 0 would look like an empty entry */
+	swap_buffer = valloc(SWAP_BATCH * 0x1000);
+	swap_slots = slots;
+	swap_node = node;
+
+	reclaim_register("swap", swap_shrink, 1);
+	debug_print(NOTICE, "swap: %d kB on %s", (uint32_t)(slots - 1) * 4, path);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Boot timeline
+ *
+ * Boot milestones - kernel setup stages, each module's initialization,
+ * mounts, and (written in by init) each startup script - are recorded
+ * with a timestamp into a fixed table, listed by /proc/boottime and
+ * drawn by `splash-log -t`.
+ *
+ * Timestamps are read from the TSC, as most of the kernel's setup
+ * happens before the PIT is running, and are converted to time when
+ * the table is read by comparing how far the TSC and the PIT have
+ * moved since the first event that saw the timer running.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/boottime.h>
+
+#include <va_list.h>
+
+#define BOOT_EVENTS   512
+#define BOOT_NAME_MAX 48
+
+typedef struct {
+	uint64_t tsc;
+	uint32_t ms;   /* By the PIT; 0 until it has started */
+	pid_t pid;
+	int kind;
+	char name[BOOT_NAME_MAX];
+} boot_event_t;
+
+static boot_event_t boot_events[BOOT_EVENTS];
+static uint32_t boot_event_count = 0;
+static uint32_t boot_events_dropped = 0;
+static spin_lock_t boot_lock = { 0 };
+
+static char * boot_kinds[] = {
+	[BOOT_MARK]  = "mark",
+	[BOOT_BEGIN] = "begin",
+	[BOOT_END]   = "end",
+};
+
+static char * boot_text = NULL;
+static size_t boot_text_size = 0;
+
+static uint64_t read_tsc(void) {
+	uint64_t tsc;
+	asm volatile ("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
+static uint32_t read_ms(void) {
+	return timer_ticks * 1000 + timer_subticks;
+}
+
+static void boot_record(int kind, char * name) {
+	spin_lock(boot_lock);
+	if (boot_event_count == BOOT_EVENTS) {
+		boot_events_dropped++;
+		spin_unlock(boot_lock);
+		return;
+	}
+	boot_event_t * e = &boot_events[boot_event_count++];
+	e->tsc  = read_tsc();
+	e->ms   = read_ms();
+	e->pid  = current_process ? current_process->id : 0;
+	e->kind = kind;
+	size_t len = strlen(name);
+	if (len > BOOT_NAME_MAX - 1) len = BOOT_NAME_MAX - 1;
+	memcpy(e->name, name, len);
+	e->name[len] = '\0';
+	spin_unlock(boot_lock);
+}
+
+void boot_event(int kind, const char * fmt, ...) {
+	char name[256];
+	va_list args;
+	va_start(args, fmt);
+	vasprintf(name, fmt, args);
+	va_end(args);
+	boot_record(kind, name);
+}
+
+static void boottime_format(void) {
+	spin_lock(boot_lock);
+	uint32_t count = boot_event_count;
+	spin_unlock(boot_lock);
+
+	/*
+	 * Times are from the first event. TSC ticks per microsecond come
+	 * from the first event the PIT had seen and now.
+	 */
+	uint64_t tsc_base = count ? boot_events[0].tsc : 0;
+	uint64_t per_us = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!boot_events[i].ms) continue;
+		uint32_t ms = read_ms() - boot_events[i].ms;
+		if (ms) {
+			per_us = (read_tsc() - boot_events[i].tsc) / ((uint64_t)ms * 1000);
+		}
+		break;
+	}
+
+	free(boot_text);
+	boot_text = malloc(64 + count * (BOOT_NAME_MAX + 32));
+	size_t soffset = sprintf(boot_text, "# %d events, %d dropped; usecs pid kind name\n", count, boot_events_dropped);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		boot_event_t * e = &boot_events[i];
+		uint32_t us;
+		if (per_us) {
+			us = (e->tsc - tsc_base) / per_us;
+		} else {
+			us = (e->ms - boot_events[0].ms) * 1000;
+		}
+		soffset += sprintf(&boot_text[soffset], "%d %d %s %s\n", us, e->pid, boot_kinds[e->kind], e->name);
+	}
+
+	boot_text_size = soffset;
+}
+
+/*
+ * Read /proc/boottime. A read from the start takes a new snapshot;
+ * reads further in continue from the same one.
+ */
+uint32_t boottime_read(uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset == 0 || !boot_text) {
+		boottime_format();
+	}
+
+	if (offset > boot_text_size) return 0;
+	if (size > boot_text_size - offset) size = boot_text_size - offset;
+
+	memcpy(buffer, boot_text + offset, size);
+	return size;
+}
+
+/*
+ * Writes to /proc/boottime add events from userspace, one per line:
+ * "begin name", "end name", or "mark name" (or just "name").
+ */
+uint32_t boottime_write(uint64_t offset, uint32_t size, uint8_t * buffer) {
+	char line[BOOT_NAME_MAX + 8];
+	uint32_t i = 0;
+	while (i < size) {
+		size_t len = 0;
+		while (i < size && buffer[i] != '\n') {
+			if (len < sizeof(line) - 1) line[len++] = buffer[i];
+			i++;
+		}
+		i++;
+		line[len] = '\0';
+		if (!len) continue;
+
+		int kind = BOOT_MARK;
+		char * name = line;
+		for (int k = 0; k < (int)(sizeof(boot_kinds) / sizeof(*boot_kinds)); ++k) {
+			size_t klen = strlen(boot_kinds[k]);
+			if (startswith(line, boot_kinds[k]) && line[klen] == ' ') {
+				kind = k;
+				name = line + klen + 1;
+				break;
+			}
+		}
+		boot_record(kind, name);
+	}
+	return size;
+}
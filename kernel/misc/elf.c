@@ -12,6 +12,7 @@
 #include <kernel/elf.h>
 #include <kernel/process.h>
 #include <kernel/logging.h>
+#include <kernel/mmap.h>
 
 int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env, int interp) {
 	Elf32_Header header;
@@ -80,6 +81,16 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 	current_process->image.entry = base_addr;
 	current_process->image.size  = end_addr - base_addr;
 
+	if (current_process->vfork_wait) {
+		/* The address space is our parent's; start over in an empty one and give that back */
+		page_directory_t * directory = clone_directory(kernel_directory);
+		release_directory(current_directory);
+		set_process_environment((process_t *)current_process, directory);
+		current_directory = directory;
+		switch_page_directory(current_directory);
+		vfork_release((process_t *)current_process);
+	}
+
 	release_directory_for_exec(current_directory);
 	invalidate_page_tables();
 
@@ -91,26 +102,16 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 			/* TODO: These virtual address bounds should be in a header somewhere */
 			if (phdr.p_vaddr < 0x20000000) return -EINVAL;
 			/* TODO Upper bounds */
-			for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
-				/* This doesn't care if we already allocated this page */
-				alloc_frame(get_page(i, 1, current_directory), 0, 1);
-				invalidate_tables_at(i);
-			}
-			IRQ_RES;
-			read_fs(file, phdr.p_offset, phdr.p_filesz, (uint8_t *)phdr.p_vaddr);
-			IRQ_OFF;
-			size_t r = phdr.p_filesz;
-			while (r < phdr.p_memsz) {
-				*(char *)(phdr.p_vaddr + r) = 0;
-				r++;
-			}
+			/* Nothing is read now; pages are filled from the file on first touch */
+			mmap_add_region(current_directory, phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz,
+				file, phdr.p_offset, phdr.p_vaddr, phdr.p_vaddr + phdr.p_filesz, MMAP_WRITE);
 		}
 	}
 
 	close_fs(file);
 
 	for (uintptr_t stack_pointer = USER_STACK_BOTTOM; stack_pointer < USER_STACK_TOP; stack_pointer += 0x1000) {
-		alloc_frame(get_page(stack_pointer, 1, current_directory), 0, 1);
+		alloc_user_frame(current_directory, stack_pointer, 1);
 		invalidate_tables_at(stack_pointer);
 	}
 
@@ -129,7 +130,7 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 
 	uintptr_t heap = current_process->image.entry + current_process->image.size;
 	while (heap & 0xFFF) heap++;
-	alloc_frame(get_page(heap, 1, current_directory), 0, 1);
+	alloc_user_frame(current_directory, heap, 1);
 	invalidate_tables_at(heap);
 	char ** argv_ = (char **)heap;
 	heap += sizeof(char *) * (argc + 1);
@@ -141,7 +142,7 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 	for (int i = 0; i < argc; ++i) {
 		size_t size = strlen(argv[i]) * sizeof(char) + 1;
 		for (uintptr_t x = heap; x < heap + size + 0x1000; x += 0x1000) {
-			alloc_frame(get_page(x, 1, current_directory), 0, 1);
+			alloc_user_frame(current_directory, x, 1);
 		}
 		invalidate_tables_at(heap);
 		argv_[i] = (char *)heap;
@@ -154,7 +155,7 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 	for (int i = 0; i < envc; ++i) {
 		size_t size = strlen(env[i]) * sizeof(char) + 1;
 		for (uintptr_t x = heap; x < heap + size + 0x1000; x += 0x1000) {
-			alloc_frame(get_page(x, 1, current_directory), 0, 1);
+			alloc_user_frame(current_directory, x, 1);
 		}
 		invalidate_tables_at(heap);
 		env_[i] = (char *)heap;
@@ -167,7 +168,7 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 
 	current_process->image.heap        = heap; /* heap end */
 	current_process->image.heap_actual = heap + (0x1000 - heap % 0x1000);
-	alloc_frame(get_page(current_process->image.heap_actual, 1, current_directory), 0, 1);
+	alloc_user_frame(current_directory, current_process->image.heap_actual, 1);
 	invalidate_tables_at(current_process->image.heap_actual);
 	current_process->image.user_stack  = USER_STACK_TOP;
 
@@ -175,10 +176,7 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 
 	/* Close all fds >= 3 */
 	for (unsigned int i = 3; i < current_process->fds->length; ++i) {
-		if (current_process->fds->entries[i]) {
-			close_fs(current_process->fds->entries[i]);
-			current_process->fds->entries[i] = NULL;
-		}
+		process_close_fd((process_t *)current_process, i);
 	}
 
 	/* Go go go */
@@ -0,0 +1,91 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * In-kernel gzip
+ *
+ * The decompressor is libtoaru_inflate's, built into the kernel, so
+ * the bootloader can hand over compressed modules and ramdisks and
+ * read a fraction of the sectors from slow CD drives. Output goes
+ * straight into a buffer sized from the stream's trailer.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/gzip.h>
+
+#include "../../lib/checksum.c"
+#include "../../lib/inflate.c"
+
+struct gzip_buffer {
+	uint8_t * in;
+	size_t in_length;
+	size_t in_offset;
+	uint8_t * out;
+	size_t out_length;
+	size_t out_offset;
+	int overrun;
+};
+
+/* One ring and one set of fixed tables, shared by every caller */
+static spin_lock_t gzip_lock = { 0 };
+
+static uint8_t gzip_input(struct inflate_context * ctx) {
+	struct gzip_buffer * b = ctx->input_priv;
+	if (b->in_offset < b->in_length) {
+		return b->in[b->in_offset++];
+	}
+	/* Past the end; all ones reads as a final block of the reserved type, which ends it */
+	b->overrun = 1;
+	return 0xFF;
+}
+
+static void gzip_output(struct inflate_context * ctx, const uint8_t * buf, size_t len) {
+	struct gzip_buffer * b = ctx->output_priv;
+	if (len > b->out_length - b->out_offset) {
+		len = b->out_length - b->out_offset;
+		b->overrun = 1;
+	}
+	memcpy(b->out + b->out_offset, buf, len);
+	b->out_offset += len;
+}
+
+int gzip_check(void * data, size_t length) {
+	uint8_t * d = data;
+	return length > 18 && d[0] == 0x1F && d[1] == 0x8B && d[2] == 8;
+}
+
+void * gzip_inflate(void * data, size_t length, size_t * out_length) {
+	if (!gzip_check(data, length)) return NULL;
+
+	/* ISIZE: the uncompressed size, modulo 4GiB */
+	uint8_t * tail = (uint8_t *)data + length - 4;
+	size_t size = tail[0] | (tail[1] << 8) | (tail[2] << 16) | ((uint32_t)tail[3] << 24);
+
+	struct gzip_buffer b = {
+		.in = data,
+		.in_length = length,
+		.out = (uint8_t *)kvmalloc(size ? size : 1),
+		.out_length = size,
+	};
+
+	struct inflate_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.input_priv   = &b;
+	ctx.output_priv  = &b;
+	ctx.get_input    = gzip_input;
+	ctx.write_block  = gzip_output;
+
+	spin_lock(gzip_lock);
+	int status = gzip_decompress(&ctx);
+	spin_unlock(gzip_lock);
+
+	if (status || b.overrun || b.out_offset != size) {
+		debug_print(ERROR, "gzip: damaged stream (%d of %d bytes)", b.out_offset, size);
+		free(b.out);
+		return NULL;
+	}
+
+	*out_length = size;
+	return b.out;
+}
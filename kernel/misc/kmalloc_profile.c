@@ -0,0 +1,327 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Kernel allocation profiler
+ *
+ * While it is on, one allocation in every `rate` is sampled: it is
+ * charged to its call site - the caller's return address and the
+ * allocator bin - and remembered by address until it is freed, so
+ * each site carries a count of what it still holds. Counts and bytes
+ * are scaled by the rate in force when each sample was taken, so they
+ * estimate the whole heap rather than the samples.
+ *
+ * Both tables are fixed and open-addressed; the hooks run under the
+ * allocator's lock and can't allocate. When a table fills, samples
+ * are dropped and counted. Turning the profiler off stops sampling,
+ * but frees of what was already sampled are still seen.
+ *
+ * /proc/kmalloc lists the sites by what they hold, then charts how
+ * full each small bin's pages are and how big blocks are spread, in
+ * use and waiting in the skip list. Writing "on", "off", "rate N" or
+ * "reset" to it controls the profiler.
+ */
+#include <kernel/system.h>
+#include <kernel/printf.h>
+#include <kernel/module.h>
+#include <kernel/kmalloc.h>
+
+#define KMP_SITES   1024 /* Call sites; a power of two */
+#define KMP_TRACKED 8192 /* Sampled allocations still live; a power of two */
+#define KMP_DEFAULT_RATE 16
+
+#define KMP_CHART_WIDTH 40
+
+typedef struct {
+	uintptr_t caller; /* 0 if the slot is empty */
+	uint32_t bin;
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t live;
+	uint64_t bytes;
+	uint64_t live_bytes;
+} kmp_site_t;
+
+typedef struct {
+	uintptr_t ptr;    /* 0 if the slot is empty */
+	uint32_t size;
+	uint16_t site;
+	uint16_t weight;  /* The rate it was sampled at */
+} kmp_tracked_t;
+
+volatile int kmalloc_profile_sampling = 0;
+volatile uint32_t kmalloc_profile_tracked = 0;
+
+static spin_lock_t kmp_lock = { 0 };
+static kmp_site_t kmp_sites[KMP_SITES];
+static kmp_tracked_t kmp_live[KMP_TRACKED];
+static uint32_t kmp_site_count = 0;
+static uint32_t kmp_rate = KMP_DEFAULT_RATE;
+static uint32_t kmp_countdown = KMP_DEFAULT_RATE;
+static uint32_t kmp_samples = 0;
+static uint32_t kmp_dropped = 0;
+
+/* The most recent text of /proc/kmalloc, handed out piecewise to readers */
+static char * kmp_text = NULL;
+static size_t kmp_text_size = 0;
+
+static inline uint32_t kmp_hash(uintptr_t value) {
+	return (uint32_t)(value >> 2) * 2654435761U;
+}
+
+static kmp_site_t * kmp_site_for(uintptr_t caller, unsigned int bin) {
+	uint32_t i = kmp_hash(caller ^ bin) & (KMP_SITES - 1);
+	while (kmp_sites[i].caller) {
+		if (kmp_sites[i].caller == caller && kmp_sites[i].bin == bin) {
+			return &kmp_sites[i];
+		}
+		i = (i + 1) & (KMP_SITES - 1);
+	}
+	/* Keep a quarter empty so probes stay short */
+	if (kmp_site_count >= KMP_SITES - KMP_SITES / 4) return NULL;
+	kmp_site_count++;
+	kmp_sites[i].caller = caller;
+	kmp_sites[i].bin = bin;
+	return &kmp_sites[i];
+}
+
+static uint32_t kmp_live_find(uintptr_t ptr) {
+	uint32_t i = kmp_hash(ptr) & (KMP_TRACKED - 1);
+	while (kmp_live[i].ptr && kmp_live[i].ptr != ptr) {
+		i = (i + 1) & (KMP_TRACKED - 1);
+	}
+	return i;
+}
+
+/* Empty a slot, shifting back whatever probed past it */
+static void kmp_live_remove(uint32_t hole) {
+	uint32_t i = hole;
+	while (1) {
+		i = (i + 1) & (KMP_TRACKED - 1);
+		if (!kmp_live[i].ptr) break;
+		uint32_t home = kmp_hash(kmp_live[i].ptr) & (KMP_TRACKED - 1);
+		/* Can it move back to the hole without passing its home slot? */
+		if (((i - home) & (KMP_TRACKED - 1)) >= ((i - hole) & (KMP_TRACKED - 1))) {
+			kmp_live[hole] = kmp_live[i];
+			hole = i;
+		}
+	}
+	kmp_live[hole].ptr = 0;
+}
+
+void kmalloc_profile_alloc(void * ptr, uintptr_t size, unsigned int bin, uintptr_t caller) {
+	spin_lock(kmp_lock);
+	if (--kmp_countdown) goto _done;
+	kmp_countdown = kmp_rate;
+
+	if (kmalloc_profile_tracked >= KMP_TRACKED - KMP_TRACKED / 4) goto _drop;
+	kmp_site_t * site = kmp_site_for(caller, bin);
+	if (!site) goto _drop;
+
+	uint32_t i = kmp_live_find((uintptr_t)ptr);
+	if (kmp_live[i].ptr) {
+		/* Already tracked; leave it charged where it was */
+		goto _done;
+	}
+	kmp_live[i].ptr = (uintptr_t)ptr;
+	kmp_live[i].size = size;
+	kmp_live[i].site = site - kmp_sites;
+	kmp_live[i].weight = kmp_rate;
+	kmalloc_profile_tracked++;
+
+	site->allocs += kmp_rate;
+	site->live += kmp_rate;
+	site->bytes += (uint64_t)size * kmp_rate;
+	site->live_bytes += (uint64_t)size * kmp_rate;
+	kmp_samples++;
+	goto _done;
+
+_drop:
+	kmp_dropped++;
+_done:
+	spin_unlock(kmp_lock);
+}
+
+void kmalloc_profile_free(void * ptr) {
+	spin_lock(kmp_lock);
+	uint32_t i = kmp_live_find((uintptr_t)ptr);
+	if (kmp_live[i].ptr) {
+		kmp_site_t * site = &kmp_sites[kmp_live[i].site];
+		site->frees += kmp_live[i].weight;
+		site->live -= kmp_live[i].weight;
+		site->live_bytes -= (uint64_t)kmp_live[i].size * kmp_live[i].weight;
+		kmp_live_remove(i);
+		kmalloc_profile_tracked--;
+	}
+	spin_unlock(kmp_lock);
+}
+
+static void kmp_reset(void) {
+	spin_lock(kmp_lock);
+	memset(kmp_sites, 0, sizeof(kmp_sites));
+	memset(kmp_live, 0, sizeof(kmp_live));
+	kmp_site_count = 0;
+	kmp_samples = 0;
+	kmp_dropped = 0;
+	kmalloc_profile_tracked = 0;
+	spin_unlock(kmp_lock);
+}
+
+/* Sizes in the output are in KiB, as the formatter has no 64-bit numbers */
+static uint32_t kib(uint64_t bytes) {
+	return (uint32_t)((bytes + 1023) >> 10);
+}
+
+static size_t kmp_bar(char * out, uint32_t value, uint32_t max) {
+	uint32_t len = max ? (value * KMP_CHART_WIDTH + max - 1) / max : 0;
+	if (len > KMP_CHART_WIDTH) len = KMP_CHART_WIDTH;
+	out[0] = '|';
+	for (uint32_t i = 0; i < KMP_CHART_WIDTH; ++i) {
+		out[1 + i] = i < len ? '#' : ' ';
+	}
+	out[1 + KMP_CHART_WIDTH] = '|';
+	return KMP_CHART_WIDTH + 2;
+}
+
+static void kmp_format(void) {
+	static kmp_site_t snapshot[KMP_SITES];
+	static struct kmalloc_heap_stats stats;
+
+	spin_lock(kmp_lock);
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < KMP_SITES; ++i) {
+		if (kmp_sites[i].caller) snapshot[count++] = kmp_sites[i];
+	}
+	uint32_t rate = kmp_rate, samples = kmp_samples, dropped = kmp_dropped, tracked = kmalloc_profile_tracked;
+	int sampling = kmalloc_profile_sampling;
+	spin_unlock(kmp_lock);
+
+	kmalloc_heap_stats(&stats);
+
+	/* Biggest holders first; there are few enough sites for insertion sort */
+	for (uint32_t i = 1; i < count; ++i) {
+		kmp_site_t s = snapshot[i];
+		uint32_t j = i;
+		while (j > 0 && snapshot[j-1].live_bytes < s.live_bytes) {
+			snapshot[j] = snapshot[j-1];
+			j--;
+		}
+		snapshot[j] = s;
+	}
+
+	free(kmp_text);
+	size_t bsize = 512 + count * (96 + modules_symbol_longest())
+		+ (KMALLOC_BINS + KMALLOC_BIG_CLASSES + KMALLOC_SKIP_LEVELS + 8) * (96 + KMP_CHART_WIDTH);
+	kmp_text = malloc(bsize);
+
+	size_t soffset = sprintf(kmp_text, "# sampling %s, 1 in %d; %d samples, %d live, %d dropped\n",
+		sampling ? "on" : "off", rate, samples, tracked, dropped);
+	soffset += sprintf(&kmp_text[soffset], "# caller bin allocs frees live live_kib total_kib symbol\n");
+
+	for (uint32_t i = 0; i < count; ++i) {
+		kmp_site_t * s = &snapshot[i];
+		soffset += sprintf(&kmp_text[soffset], "0x%x %d %d %d %d %d %d ",
+			s->caller, s->bin, s->allocs, s->frees, s->live, kib(s->live_bytes), kib(s->bytes));
+		uintptr_t addr;
+		char * name = modules_symbol_for(s->caller, &addr);
+		if (name) {
+			soffset += sprintf(&kmp_text[soffset], "%s+0x%x\n", name, s->caller - addr);
+		} else {
+			soffset += sprintf(&kmp_text[soffset], "?\n");
+		}
+	}
+
+	soffset += sprintf(&kmp_text[soffset], "\n# small bins: cell pages used/cells, occupancy\n");
+	for (int i = 0; i < KMALLOC_BINS; ++i) {
+		uint32_t cells = stats.bin_pages[i] * stats.bin_cells[i];
+		soffset += sprintf(&kmp_text[soffset], "%d %d %d/%d ", 4 << i, stats.bin_pages[i], stats.bin_used[i], cells);
+		soffset += kmp_bar(&kmp_text[soffset], stats.bin_used[i], cells);
+		soffset += sprintf(&kmp_text[soffset], " %d%%\n", cells ? stats.bin_used[i] * 100 / cells : 0);
+	}
+
+	uint32_t most = 1;
+	for (int i = 0; i < KMALLOC_BIG_CLASSES; ++i) {
+		if (stats.big_used[i] > most) most = stats.big_used[i];
+		if (stats.big_free[i] > most) most = stats.big_free[i];
+	}
+	soffset += sprintf(&kmp_text[soffset], "\n# big blocks: pages used free; %d pages in use, %d free\n",
+		stats.big_used_pages, stats.big_free_pages);
+	for (int i = 0; i < KMALLOC_BIG_CLASSES; ++i) {
+		if (i == KMALLOC_BIG_CLASSES - 1) {
+			soffset += sprintf(&kmp_text[soffset], "%d+ ", 1 << i);
+		} else {
+			soffset += sprintf(&kmp_text[soffset], "%d-%d ", 1 << i, (2 << i) - 1);
+		}
+		soffset += sprintf(&kmp_text[soffset], "%d ", stats.big_used[i]);
+		soffset += kmp_bar(&kmp_text[soffset], stats.big_used[i], most);
+		soffset += sprintf(&kmp_text[soffset], " %d ", stats.big_free[i]);
+		soffset += kmp_bar(&kmp_text[soffset], stats.big_free[i], most);
+		soffset += sprintf(&kmp_text[soffset], "\n");
+	}
+
+	soffset += sprintf(&kmp_text[soffset], "\n# skip list: level free-blocks\n");
+	for (int i = 0; i < KMALLOC_SKIP_LEVELS; ++i) {
+		soffset += sprintf(&kmp_text[soffset], "%d %d ", i, stats.skip_level[i]);
+		soffset += kmp_bar(&kmp_text[soffset], stats.skip_level[i], stats.skip_level[0]);
+		soffset += sprintf(&kmp_text[soffset], "\n");
+	}
+
+	kmp_text_size = soffset;
+}
+
+/*
+ * Read /proc/kmalloc. A read from the start takes a new snapshot;
+ * reads further in continue from the same one.
+ */
+uint32_t kmalloc_profile_read(uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset == 0 || !kmp_text) {
+		kmp_format();
+	}
+
+	if (offset > kmp_text_size) return 0;
+	if (size > kmp_text_size - offset) size = kmp_text_size - offset;
+
+	memcpy(buffer, kmp_text + offset, size);
+	return size;
+}
+
+/*
+ * Writes to /proc/kmalloc control the profiler, one command per line:
+ * "on", "off", "rate N" (sample one allocation in N), or "reset".
+ */
+uint32_t kmalloc_profile_write(uint64_t offset, uint32_t size, uint8_t * buffer) {
+	char line[32];
+	uint32_t i = 0;
+	while (i < size) {
+		size_t len = 0;
+		while (i < size && buffer[i] != '\n') {
+			if (len < sizeof(line) - 1) line[len++] = buffer[i];
+			i++;
+		}
+		i++;
+		line[len] = '\0';
+		if (!len) continue;
+
+		if (!strcmp(line, "on")) {
+			spin_lock(kmp_lock);
+			kmp_countdown = kmp_rate;
+			kmalloc_profile_sampling = 1;
+			spin_unlock(kmp_lock);
+		} else if (!strcmp(line, "off")) {
+			kmalloc_profile_sampling = 0;
+		} else if (!strcmp(line, "reset")) {
+			kmp_reset();
+		} else if (startswith(line, "rate ")) {
+			int rate = atoi(line + 5);
+			if (rate < 1 || rate > 0xFFFF) return -EINVAL;
+			spin_lock(kmp_lock);
+			kmp_rate = rate;
+			kmp_countdown = rate;
+			spin_unlock(kmp_lock);
+		} else {
+			return -EINVAL;
+		}
+	}
+	return size;
+}
@@ -0,0 +1,100 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Sampling profiler
+ *
+ * Every timer tick records where it interrupted - the instruction
+ * pointer, the running process, and whether it was in user mode -
+ * into a ring of recent samples. /proc/profile lists the ring with
+ * kernel addresses resolved against the module symbol table, which
+ * also holds the kernel's own symbols; the `perf` tool aggregates it.
+ *
+ * There is one processor, so there is one ring, and samples come
+ * from the PIT. While idle the tick is stopped, so idle time is
+ * sampled once per wakeup rather than once per millisecond.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/module.h>
+
+#define PROFILE_SAMPLES 4096
+
+typedef struct {
+	uintptr_t eip;
+	pid_t pid;     /* 0 before the first process */
+	int user;
+} profile_sample_t;
+
+static profile_sample_t profile_ring[PROFILE_SAMPLES];
+static volatile uint32_t profile_total = 0; /* Samples ever taken; the next sample's sequence number */
+
+/* The most recent text of /proc/profile, handed out piecewise to readers */
+static char * profile_text = NULL;
+static size_t profile_text_size = 0;
+
+/*
+ * Called from the timer interrupt.
+ */
+void profile_sample(struct regs * r) {
+	profile_sample_t * sample = &profile_ring[profile_total % PROFILE_SAMPLES];
+	sample->eip  = r->eip;
+	sample->pid  = current_process ? current_process->id : 0;
+	sample->user = (r->cs & 0x3) == 0x3;
+	profile_total++;
+}
+
+static void profile_format(void) {
+	static profile_sample_t snapshot[PROFILE_SAMPLES];
+
+	/* Take the ring as it is now; the timer keeps writing to it */
+	IRQ_OFF;
+	uint32_t total = profile_total;
+	uint32_t count = total < PROFILE_SAMPLES ? total : PROFILE_SAMPLES;
+	uint32_t first = total - count;
+	for (uint32_t i = 0; i < count; ++i) {
+		snapshot[i] = profile_ring[(first + i) % PROFILE_SAMPLES];
+	}
+	IRQ_RES;
+
+	free(profile_text);
+	size_t bsize = 64 + count * (48 + modules_symbol_longest());
+	profile_text = malloc(bsize);
+	size_t soffset = sprintf(profile_text, "# %d samples, %d taken\n", count, total);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		profile_sample_t * s = &snapshot[i];
+		soffset += sprintf(&profile_text[soffset], "%d %d 0x%x ", first + i, s->pid, s->eip);
+		if (s->user) {
+			soffset += sprintf(&profile_text[soffset], "[user]\n");
+			continue;
+		}
+		uintptr_t addr;
+		char * name = modules_symbol_for(s->eip, &addr);
+		if (name) {
+			soffset += sprintf(&profile_text[soffset], "%s+0x%x\n", name, s->eip - addr);
+		} else {
+			soffset += sprintf(&profile_text[soffset], "?\n");
+		}
+	}
+
+	profile_text_size = soffset;
+}
+
+/*
+ * Read /proc/profile. A read from the start takes a new snapshot;
+ * reads further in continue from the same one.
+ */
+uint32_t profile_read(uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset == 0 || !profile_text) {
+		profile_format();
+	}
+
+	if (offset > profile_text_size) return 0;
+	if (size > profile_text_size - offset) size = profile_text_size - offset;
+
+	memcpy(buffer, profile_text + offset, size);
+	return size;
+}
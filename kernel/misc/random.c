@@ -0,0 +1,167 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Kernel CSPRNG
+ *
+ * Interrupt timings (TSC readings) and anything else unpredictable
+ * are stirred into a small entropy pool. Output comes from ChaCha20,
+ * keyed from the pool: a refill generates several blocks at once,
+ * immediately replaces the key with the first 32 bytes of them (so
+ * earlier output can't be recovered from the state), and hands the
+ * rest out as requested, erasing bytes as they go. Large requests are
+ * generated straight into the caller's buffer. The pool is folded
+ * into the key on refills once enough interrupts have come in.
+ *
+ * There is one generator; we only ever run on one CPU.
+ */
+#include <kernel/system.h>
+#include <kernel/random.h>
+
+#define POOL_WORDS     16
+#define RESEED_EVENTS  64   /* Interrupts between reseeds */
+#define BUFFER_BLOCKS  8
+#define BLOCK_SIZE     64
+#define BUFFER_SIZE    (BUFFER_BLOCKS * BLOCK_SIZE)
+#define KEY_SIZE       32
+
+static volatile uint32_t pool[POOL_WORDS];
+static volatile unsigned int pool_index = 0;
+static volatile unsigned int pool_events = 0;
+
+static uint32_t key[8];
+static uint64_t counter = 0;
+static uint8_t buffer[BUFFER_SIZE];
+static size_t buffer_left = 0;
+static spin_lock_t random_lock = { 0 };
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8);  \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+static void chacha20_block(uint32_t out[16]) {
+	uint32_t in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0,
+	};
+	uint32_t x[16];
+	memcpy(x, in, sizeof(x));
+
+	for (int i = 0; i < 10; ++i) {
+		QUARTER(x[0], x[4], x[8],  x[12]);
+		QUARTER(x[1], x[5], x[9],  x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8],  x[13]);
+		QUARTER(x[3], x[4], x[9],  x[14]);
+	}
+
+	for (int i = 0; i < 16; ++i) {
+		out[i] = x[i] + in[i];
+	}
+	counter++;
+}
+
+static uint32_t read_tsc(void) {
+	uint64_t tsc;
+	asm volatile ("rdtsc" : "=A" (tsc));
+	return (uint32_t)tsc;
+}
+
+void random_add_entropy(uint32_t value) {
+	unsigned int i = pool_index;
+	pool[i] = ROTL(pool[i], 7) ^ value ^ pool[(i + 7) % POOL_WORDS];
+	pool_index = (i + 1) % POOL_WORDS;
+	pool_events++;
+}
+
+void random_add_interrupt(int irq) {
+	random_add_entropy(read_tsc() ^ ((uint32_t)irq << 24));
+}
+
+/* Fold the pool into the key. Holding random_lock. */
+static void random_reseed(void) {
+	uint32_t copy[POOL_WORDS];
+	IRQ_OFF;
+	for (int i = 0; i < POOL_WORDS; ++i) {
+		copy[i] = pool[i];
+	}
+	pool_events = 0;
+	IRQ_RES;
+
+	for (int i = 0; i < 8; ++i) {
+		key[i] ^= copy[i] ^ ROTL(copy[i + 8], 13);
+	}
+	key[0] ^= read_tsc();
+	memset(copy, 0, sizeof(copy));
+}
+
+/* Generate a fresh buffer and rekey from its start. Holding random_lock. */
+static void random_refill(void) {
+	if (pool_events >= RESEED_EVENTS) {
+		random_reseed();
+	}
+	for (int i = 0; i < BUFFER_BLOCKS; ++i) {
+		chacha20_block((uint32_t *)&buffer[i * BLOCK_SIZE]);
+	}
+	memcpy(key, buffer, KEY_SIZE);
+	memset(buffer, 0, KEY_SIZE);
+	buffer_left = BUFFER_SIZE - KEY_SIZE;
+}
+
+void random_get_bytes(void * out, size_t size) {
+	uint8_t * dest = out;
+
+	spin_lock(random_lock);
+
+	/* Anything whole blocks' worth past what's buffered is generated in place */
+	if (size > buffer_left + BUFFER_SIZE) {
+		size_t direct = (size - buffer_left) & ~(BLOCK_SIZE - 1);
+		uint32_t block[16];
+		for (size_t i = 0; i < direct; i += BLOCK_SIZE) {
+			chacha20_block(block);
+			memcpy(dest + i, block, BLOCK_SIZE);
+		}
+		memset(block, 0, sizeof(block));
+		dest += direct;
+		size -= direct;
+		/* Don't leave the key that made that lying around */
+		random_refill();
+	}
+
+	while (size) {
+		if (!buffer_left) {
+			random_refill();
+		}
+		size_t take = size < buffer_left ? size : buffer_left;
+		uint8_t * from = buffer + BUFFER_SIZE - buffer_left;
+		memcpy(dest, from, take);
+		memset(from, 0, take);
+		buffer_left -= take;
+		dest += take;
+		size -= take;
+	}
+
+	spin_unlock(random_lock);
+}
+
+void random_install(void) {
+	random_add_entropy(read_tsc());
+	random_add_entropy(boot_time);
+	random_add_entropy(now());
+	for (int i = 0; i < POOL_WORDS; ++i) {
+		random_add_entropy(krand() ^ read_tsc());
+	}
+	spin_lock(random_lock);
+	random_reseed();
+	random_refill();
+	spin_unlock(random_lock);
+}
@@ -0,0 +1,236 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Kernel Tracepoints
+ *
+ * TRACE() sites copy a few words into a ring of fixed-size records
+ * and return; nothing is formatted until the records are read back
+ * from /dev/trace, so tracing a hot path costs a fraction of what a
+ * debug_print() to the serial port does. Subsystems are off until
+ * enabled with trace= on the command line or by writing their names
+ * to /dev/trace ("vfs net", "-vfs", "all", "none").
+ *
+ * Writers claim a slot with an atomic increment and mark it complete
+ * by storing its sequence number last, so they never wait on each
+ * other or on the reader, and sites can be used from interrupt
+ * handlers. The reader checks the sequence number before and after
+ * copying a record; a record that was claimed but not finished stops
+ * the read, and one that was overwritten is skipped. There is one
+ * ring, as there is one processor.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/args.h>
+#include <kernel/trace.h>
+
+#define TRACE_RECORDS 4096
+#define TRACE_STRING_MAX 32
+
+typedef struct {
+	volatile uint32_t seq; /* Slot number + 1 once complete, 0 while being written */
+	uint32_t ticks;
+	uint32_t subticks;
+	pid_t pid;
+	trace_site_t * site;
+	union {
+		uintptr_t args[4];
+		char string[TRACE_STRING_MAX];
+	} data;
+} trace_entry_t;
+
+static char * trace_names[TRACE_SUBSYSTEMS] = {
+	[TRACE_SCHED]   = "sched",
+	[TRACE_SYSCALL] = "syscall",
+	[TRACE_MEM]     = "mem",
+	[TRACE_VFS]     = "vfs",
+	[TRACE_PIPE]    = "pipe",
+	[TRACE_NET]     = "net",
+};
+
+volatile uint32_t trace_mask = 0;
+
+static trace_entry_t trace_ring[TRACE_RECORDS];
+static volatile uint32_t trace_head = 0; /* Next slot to claim */
+static uint32_t trace_tail = 0;          /* Next slot to read */
+static spin_lock_t trace_read_lock = { 0 };
+
+#define trace_barrier() asm volatile ("" ::: "memory")
+
+static trace_entry_t * trace_claim(trace_site_t * site, uint32_t * slot) {
+	*slot = __sync_fetch_and_add(&trace_head, 1);
+	trace_entry_t * entry = &trace_ring[*slot % TRACE_RECORDS];
+	entry->seq = 0;
+	trace_barrier();
+	entry->ticks = timer_ticks;
+	entry->subticks = timer_subticks;
+	entry->pid = current_process ? current_process->id : 0;
+	entry->site = site;
+	return entry;
+}
+
+static void trace_commit(trace_entry_t * entry, uint32_t slot) {
+	trace_barrier();
+	entry->seq = slot + 1;
+}
+
+void trace_record(trace_site_t * site, uintptr_t a, uintptr_t b, uintptr_t c, uintptr_t d) {
+	uint32_t slot;
+	trace_entry_t * entry = trace_claim(site, &slot);
+	entry->data.args[0] = a;
+	entry->data.args[1] = b;
+	entry->data.args[2] = c;
+	entry->data.args[3] = d;
+	trace_commit(entry, slot);
+}
+
+void trace_record_string(trace_site_t * site, const char * str) {
+	uint32_t slot;
+	trace_entry_t * entry = trace_claim(site, &slot);
+	size_t i = 0;
+	if (str) {
+		for (; i < TRACE_STRING_MAX - 1 && str[i]; ++i) {
+			entry->data.string[i] = str[i];
+		}
+	}
+	entry->data.string[i] = '\0';
+	trace_commit(entry, slot);
+}
+
+/*
+ * Format one record; returns its length.
+ */
+static size_t trace_format(char * out, trace_entry_t * entry) {
+	char message[256];
+	trace_site_t * site = entry->site;
+	if (site->string) {
+		sprintf(message, site->format, entry->data.string);
+	} else {
+		sprintf(message, site->format, entry->data.args[0], entry->data.args[1], entry->data.args[2], entry->data.args[3]);
+	}
+	return sprintf(out, "[%10d.%3d] %d %s %s:%d: %s\n", entry->ticks, entry->subticks,
+		entry->pid, trace_names[site->subsystem], site->file, site->line, message);
+}
+
+/*
+ * Reading consumes records. Each read returns whole lines, as many
+ * as fit, and does not wait for more.
+ */
+static uint32_t read_trace(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	char line[512];
+	uint32_t written = 0;
+
+	spin_lock(trace_read_lock);
+	while (trace_tail != trace_head) {
+		uint32_t head = trace_head;
+		size_t len;
+
+		if (head - trace_tail > TRACE_RECORDS) {
+			/* The writers have lapped us */
+			len = sprintf(line, "# lost %d records\n", head - TRACE_RECORDS - trace_tail);
+			if (written + len > size) break;
+			memcpy(buffer + written, line, len);
+			written += len;
+			trace_tail = head - TRACE_RECORDS;
+			continue;
+		}
+
+		trace_entry_t * slot = &trace_ring[trace_tail % TRACE_RECORDS];
+		uint32_t seq = slot->seq;
+		if (seq == 0 || (int32_t)(seq - (trace_tail + 1)) < 0) {
+			/* Claimed, but still being written */
+			break;
+		}
+
+		trace_entry_t entry;
+		memcpy(&entry, slot, sizeof(trace_entry_t));
+		trace_barrier();
+		if (seq != trace_tail + 1 || slot->seq != seq) {
+			/* Overwritten before or while we copied it */
+			trace_tail++;
+			continue;
+		}
+
+		len = trace_format(line, &entry);
+		if (written + len > size) {
+			if (written) break;
+			len = size;
+		}
+		memcpy(buffer + written, line, len);
+		written += len;
+		trace_tail++;
+	}
+	spin_unlock(trace_read_lock);
+
+	return written;
+}
+
+/*
+ * Enable or disable subsystems by name.
+ */
+static void trace_configure(char * config, size_t length) {
+	char word[32];
+	size_t i = 0;
+	while (i < length) {
+		while (i < length && (config[i] == ' ' || config[i] == ',' || config[i] == '\n' || config[i] == '\t')) i++;
+		size_t w = 0;
+		while (i < length && config[i] != ' ' && config[i] != ',' && config[i] != '\n' && config[i] != '\t') {
+			if (w < sizeof(word) - 1) word[w++] = config[i];
+			i++;
+		}
+		word[w] = '\0';
+		if (!w) continue;
+
+		char * name = word;
+		int enable = 1;
+		if (*name == '-') {
+			enable = 0;
+			name++;
+		} else if (*name == '+') {
+			name++;
+		}
+
+		if (!strcmp(name, "all")) {
+			trace_mask = enable ? (1 << TRACE_SUBSYSTEMS) - 1 : 0;
+		} else if (!strcmp(name, "none")) {
+			trace_mask = 0;
+		} else {
+			for (int s = 0; s < TRACE_SUBSYSTEMS; ++s) {
+				if (!strcmp(name, trace_names[s])) {
+					if (enable) trace_mask |= (1 << s);
+					else trace_mask &= ~(1 << s);
+				}
+			}
+		}
+	}
+}
+
+static uint32_t write_trace(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	trace_configure((char *)buffer, size);
+	return size;
+}
+
+static fs_node_t * trace_device_create(void) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, "trace");
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask = 0600;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->read  = read_trace;
+	fnode->write = write_trace;
+	return fnode;
+}
+
+void trace_install(void) {
+	if (args_present("trace")) {
+		char * config = args_value("trace");
+		trace_configure(config, strlen(config));
+	}
+	vfs_mount("/dev/trace", trace_device_create());
+}
@@ -3,8 +3,17 @@
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2015 Dale Weiler
  *
- * Spin locks with waiters
+ * Spin locks with waiters, and sleeping mutexes
  *
+ * Spin locks are for short critical sections, including ones taken
+ * from interrupt handlers. Anything that holds a lock across disk
+ * I/O or another sleep should use a kmutex instead: a contended
+ * kmutex puts the caller on a wait queue, and unlocking hands the
+ * mutex straight to the longest waiter, so nobody is woken just to
+ * find it taken again.
+ *
+ * Each kmutex counts how often it was taken and how often it was
+ * contended; they are listed in /proc/locks.
  */
 #include <kernel/system.h>
 
@@ -37,12 +46,25 @@ void spin_wait(volatile int * addr, volatile int * waiters) {
 	}
 }
 
+/* Spin lock acquisitions that had to wait, across all spin locks */
+volatile int spin_contended = 0;
+
 void spin_lock(spin_lock_t lock) {
-	while (arch_atomic_swap(lock, 1)) {
-		spin_wait(lock, lock+1);
+	if (arch_atomic_swap(lock, 1)) {
+		arch_atomic_inc(&spin_contended);
+		do {
+			spin_wait(lock, lock+1);
+		} while (arch_atomic_swap(lock, 1));
 	}
 }
 
+/*
+ * Take the lock only if nobody holds it; returns 1 if it was taken.
+ */
+int spin_trylock(spin_lock_t lock) {
+	return !arch_atomic_swap(lock, 1);
+}
+
 void spin_init(spin_lock_t lock) {
 	lock[0] = 0;
 	lock[1] = 0;
@@ -55,3 +77,38 @@ void spin_unlock(spin_lock_t lock) {
 			switch_task(1);
 	}
 }
+
+kmutex_t * kmutex_all = NULL;
+
+void kmutex_init(kmutex_t * mutex, char * name) {
+	memset(mutex, 0, sizeof(kmutex_t));
+	mutex->name = name;
+}
+
+void kmutex_lock(kmutex_t * mutex) {
+	IRQ_OFF;
+	if (!mutex->registered) {
+		mutex->registered = 1;
+		mutex->next = kmutex_all;
+		kmutex_all = mutex;
+	}
+	mutex->acquired++;
+	if (mutex->owner) {
+		mutex->contended++;
+		if (!mutex->waiters) {
+			mutex->waiters = list_create();
+		}
+		/* Unlocking will make us the owner; a signal may wake us early */
+		while (mutex->owner && mutex->owner != current_process) {
+			sleep_on(mutex->waiters);
+		}
+	}
+	mutex->owner = (process_t *)current_process;
+	IRQ_RES;
+}
+
+void kmutex_unlock(kmutex_t * mutex) {
+	IRQ_OFF;
+	mutex->owner = mutex->waiters ? wakeup_queue_first(mutex->waiters) : NULL;
+	IRQ_RES;
+}
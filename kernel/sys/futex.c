@@ -0,0 +1,105 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Futexes
+ *
+ * A futex is a wait queue attached to a word of user memory.
+ * Userspace does the uncontended work with atomic operations
+ * on the word and only asks the kernel to sleep when the word
+ * still holds the value it expected, or to wake sleepers after
+ * changing it.
+ *
+ * Queues are keyed by address space and virtual address, so
+ * only threads sharing a page directory can meet on one. They
+ * are created by the first waiter and dropped once empty.
+ *
+ * System calls run with interrupts off, so nothing can change
+ * the word or wake the queue between checking the value and
+ * going to sleep.
+ */
+
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+
+#define FUTEX_BUCKETS 64
+
+typedef struct futex {
+	page_directory_t * directory;
+	uintptr_t address;
+	list_t * waiters;
+} futex_t;
+
+static list_t * futex_buckets[FUTEX_BUCKETS] = {NULL};
+
+static list_t * futex_bucket(uintptr_t address) {
+	size_t i = (address >> 2) % FUTEX_BUCKETS;
+	if (!futex_buckets[i]) {
+		futex_buckets[i] = list_create();
+	}
+	return futex_buckets[i];
+}
+
+static node_t * futex_find(uintptr_t address) {
+	list_t * bucket = futex_bucket(address);
+	foreach(node, bucket) {
+		futex_t * f = node->value;
+		if (f->directory == current_directory && f->address == address) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Drop a futex nobody is waiting on. Waiters interrupted by a
+ * signal take themselves off the queue, so this is also how
+ * queues they leave behind get cleaned up.
+ */
+static void futex_release(uintptr_t address, node_t * node) {
+	futex_t * f = node->value;
+	if (f->waiters->length) return;
+	list_delete(futex_bucket(address), node);
+	free(node);
+	list_free(f->waiters);
+	free(f->waiters);
+	free(f);
+}
+
+int futex_wait(int * address, int value) {
+	if (*address != value) {
+		return -EAGAIN;
+	}
+
+	node_t * node = futex_find((uintptr_t)address);
+	if (!node) {
+		futex_t * f = malloc(sizeof(futex_t));
+		f->directory = current_directory;
+		f->address = (uintptr_t)address;
+		f->waiters = list_create();
+		node = list_insert(futex_bucket((uintptr_t)address), f);
+	}
+
+	int interrupted = sleep_on(((futex_t *)node->value)->waiters);
+
+	node = futex_find((uintptr_t)address);
+	if (node) {
+		futex_release((uintptr_t)address, node);
+	}
+
+	return interrupted ? -EINTR : 0;
+}
+
+int futex_wake(int * address, int count) {
+	node_t * node = futex_find((uintptr_t)address);
+	if (!node) {
+		return 0;
+	}
+
+	int woken = wakeup_queue_count(((futex_t *)node->value)->waiters, count);
+	futex_release((uintptr_t)address, node);
+
+	return woken;
+}
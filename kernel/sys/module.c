@@ -2,21 +2,55 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2014-2018 K. Lange
+ *
+ * Kernel module loader
+ *
+ * Modules are relocatable objects, linked against the kernel's symbol
+ * table and those of the modules before them. Each of a module's
+ * symbols is looked up once, and its relocations use the results.
+ *
+ * Alongside the name -> address symbol table there is an index of the
+ * same symbols sorted by address, for finding which function an
+ * address is in (fault reports, stack traces, the profiler). It is
+ * rebuilt after each module load.
+ *
+ * Modules declared with MODULE_DEF_DEFERRED (and any module that
+ * depends on one) are linked when they are loaded at boot but not
+ * initialized until modules_start_deferred(), which runs their
+ * initializers in load order from a tasklet once init has started.
  */
 #include <kernel/system.h>
+#include <kernel/process.h>
 #include <kernel/logging.h>
 #include <kernel/fs.h>
 #include <kernel/elf.h>
 #include <kernel/module.h>
+#include <kernel/boottime.h>
+#include <kernel/gzip.h>
 
 #include <toaru/hashmap.h>
 
-#define SYMBOLTABLE_HASHMAP_SIZE 10
-#define MODULE_HASHMAP_SIZE 10
+#define SYMBOLTABLE_HASHMAP_SIZE 4096
+#define MODULE_HASHMAP_SIZE 64
+#define LOCAL_HASHMAP_SIZE 64
 
 static hashmap_t * symboltable = NULL;
 static hashmap_t * modules = NULL;
 
+/* Modules waiting for modules_start_deferred() */
+static list_t * deferred_modules = NULL;
+static volatile int deferred_pending = 0;
+static int deferred_started = 0;
+
+typedef struct {
+	uintptr_t addr;
+	char * name;
+} symbol_addr_t;
+
+static symbol_addr_t * symbols_by_addr = NULL;
+static size_t symbols_by_addr_count = 0;
+static size_t symbol_longest = 0;
+
 extern char kernel_symbols_start[];
 extern char kernel_symbols_end[];
 
@@ -25,6 +59,71 @@ typedef struct {
 	char name[];
 } kernel_symbol_t;
 
+static void symbol_index_rebuild(void) {
+	symbol_addr_t * index = malloc(sizeof(symbol_addr_t) * symboltable->count);
+	size_t count = 0;
+	size_t longest = 0;
+
+	list_t * names = hashmap_keys(symboltable);
+	foreach(node, names) {
+		uintptr_t addr = (uintptr_t)hashmap_get(symboltable, node->value);
+		if (!addr) continue;
+		index[count].addr = addr;
+		index[count].name = node->value;
+		size_t len = strlen(node->value);
+		if (len > longest) longest = len;
+		count++;
+	}
+	list_free(names);
+	free(names);
+
+	/* Shell sort; there are a few thousand of these */
+	for (size_t gap = count / 2; gap > 0; gap /= 2) {
+		for (size_t i = gap; i < count; ++i) {
+			symbol_addr_t tmp = index[i];
+			size_t j = i;
+			while (j >= gap && index[j - gap].addr > tmp.addr) {
+				index[j] = index[j - gap];
+				j -= gap;
+			}
+			index[j] = tmp;
+		}
+	}
+
+	/* Swap it in whole; a fault could come in and look at it */
+	symbol_addr_t * old = symbols_by_addr;
+	IRQ_OFF;
+	symbols_by_addr = index;
+	symbols_by_addr_count = count;
+	symbol_longest = longest;
+	IRQ_RES;
+	free(old);
+}
+
+/*
+ * The name of the closest symbol at or below `addr`, with its address
+ * in `out_addr`, or NULL if there isn't one.
+ */
+char * modules_symbol_for(uintptr_t addr, uintptr_t * out_addr) {
+	*out_addr = 0;
+	if (!symbols_by_addr_count || addr < symbols_by_addr[0].addr) return NULL;
+	size_t low = 0, high = symbols_by_addr_count - 1;
+	while (low < high) {
+		size_t mid = (low + high + 1) / 2;
+		if (symbols_by_addr[mid].addr <= addr) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+	*out_addr = symbols_by_addr[low].addr;
+	return symbols_by_addr[low].name;
+}
+
+size_t modules_symbol_longest(void) {
+	return symbol_longest;
+}
+
 /* Cannot use symboltable here because symbol_find is used during initialization
  * of IRQs and ISRs.
  */
@@ -87,6 +186,7 @@ void * module_load_direct(void * blob, size_t length) {
 	Elf32_Shdr * sym_shdr = NULL;
 	char * deps = NULL;
 	size_t deps_length = 0;
+	int deps_deferred = 0;
 
 	/* TODO: Actually load the ELF somewhere! This is moronic, you're not initializing a BSS! */
 	/*       (and maybe keep the elf header somewhere) */
@@ -129,10 +229,14 @@ void * module_load_direct(void * blob, size_t length) {
 
 				unsigned int i = 0;
 				while (i < deps_length) {
-					if (strlen(&deps[i]) && !hashmap_get(modules, &deps[i])) {
+					module_data_t * dep = strlen(&deps[i]) ? hashmap_get(modules, &deps[i]) : NULL;
+					if (strlen(&deps[i]) && !dep) {
 						debug_print(ERROR, "   %s - not loaded", &deps[i]);
 						goto mod_load_error_unload;
 					}
+					if (dep && dep->deferred) {
+						deps_deferred = 1;
+					}
 					debug_print(INFO, "   %s", &deps[i]);
 					i += strlen(&deps[i]) + 1;
 				}
@@ -175,91 +279,61 @@ void * module_load_direct(void * blob, size_t length) {
 
 	int undefined = 0;
 
-	hashmap_t * local_symbols = hashmap_create(10);
+	hashmap_t * local_symbols = hashmap_create(LOCAL_HASHMAP_SIZE);
+	size_t symbol_count = sym_shdr->sh_size / sizeof(Elf32_Sym);
+	uintptr_t * resolved = calloc(symbol_count, sizeof(uintptr_t)); /* Address of each symbol, by index */
 	{
 		Elf32_Sym * table = (Elf32_Sym *)((uintptr_t)target + sym_shdr->sh_offset);
-		while ((uintptr_t)table - ((uintptr_t)target + sym_shdr->sh_offset) < sym_shdr->sh_size) {
-			if (table->st_name) {
-				if (ELF32_ST_BIND(table->st_info) == STB_GLOBAL) {
-					char * name = (char *)((uintptr_t)symstrtab + table->st_name);
-					if (table->st_shndx == 0) {
-						if (!hashmap_get(symboltable, name)) {
-							debug_print(ERROR, "Unresolved symbol in module: %s", name);
-							undefined = 1;
-						}
-					} else {
-						Elf32_Shdr * s = NULL;
-						{
-							int i = 0;
-							int set = 0;
-							for (unsigned int x = 0; x < (unsigned int)target->e_shentsize * target->e_shnum; x += target->e_shentsize) {
-								Elf32_Shdr * shdr = (Elf32_Shdr *)((uintptr_t)target + (target->e_shoff + x));
-								if (i == table->st_shndx) {
-									set = 1;
-									s = shdr;
-									break;
-								}
-								i++;
-							}
-							/*
-							 * Common symbols
-							 * If we were a proper linker, we'd look at a bunch of objects
-							 * to find out if one of them defined this, but instead we have
-							 * a strict hierarchy of symbol resolution, so we know that an
-							 * undefined common symbol at this point should be immediately
-							 * allocated and zeroed.
-							 */
-							if (!set && table->st_shndx == 65522) {
-								if (!hashmap_get(symboltable, name)) {
-									void * final = malloc(table->st_value);
-									memset(final, 0, table->st_value);
-									debug_print(NOTICE, "point %s to 0x%x", name, (uintptr_t)final);
-									hashmap_set(symboltable, name, (void *)final);
-									hashmap_set(local_symbols, name, (void *)final);
-								}
-							}
-						}
-						if (s) {
-							uintptr_t final = s->sh_addr + table->st_value;
-							hashmap_set(symboltable, name, (void *)final);
-							hashmap_set(local_symbols, name, (void *)final);
-						} else {
-							debug_print(ERROR, "Not resolving %s", name);
-						}
-					}
-				} else if (ELF32_ST_BIND(table->st_info) == STB_LOCAL) {
-					char * name = (char *)((uintptr_t)symstrtab + table->st_name);
-					Elf32_Shdr * s = NULL;
-					{
-						int i = 0;
-						int set = 0;
-						for (unsigned int x = 0; x < (unsigned int)target->e_shentsize * target->e_shnum; x += target->e_shentsize) {
-							Elf32_Shdr * shdr = (Elf32_Shdr *)((uintptr_t)target + (target->e_shoff + x));
-							if (i == table->st_shndx) {
-								set = 1;
-								s = shdr;
-								break;
-							}
-							i++;
-						}
-						if (!set && table->st_shndx == 65522) {
-							if (!hashmap_get(symboltable, name)) {
-								void * final = calloc(1, table->st_value);
-								debug_print(NOTICE, "point %s to 0x%x", name, (uintptr_t)final);
-								hashmap_set(local_symbols, name, (void *)final);
-							}
-						}
-					}
-					if (s) {
-						uintptr_t final = s->sh_addr + table->st_value;
-						hashmap_set(local_symbols, name, (void *)final);
-					}
+		for (size_t index = 0; index < symbol_count; ++index, ++table) {
+			if (!table->st_name) continue;
+			if (ELF32_ST_BIND(table->st_info) != STB_GLOBAL && ELF32_ST_BIND(table->st_info) != STB_LOCAL) continue;
+
+			int global = ELF32_ST_BIND(table->st_info) == STB_GLOBAL;
+			char * name = (char *)((uintptr_t)symstrtab + table->st_name);
+
+			if (global && table->st_shndx == 0) {
+				resolved[index] = (uintptr_t)hashmap_get(symboltable, name);
+				if (!resolved[index]) {
+					debug_print(ERROR, "Unresolved symbol in module: %s", name);
+					undefined = 1;
+				}
+				continue;
+			}
+
+			/*
+			 * Common symbols
+			 * If we were a proper linker, we'd look at a bunch of objects
+			 * to find out if one of them defined this, but instead we have
+			 * a strict hierarchy of symbol resolution, so we know that an
+			 * undefined common symbol at this point should be immediately
+			 * allocated and zeroed.
+			 */
+			if (table->st_shndx == 65522) {
+				void * final = hashmap_get(symboltable, name);
+				if (!final) {
+					final = calloc(1, table->st_value);
+					debug_print(NOTICE, "point %s to 0x%x", name, (uintptr_t)final);
+					if (global) hashmap_set(symboltable, name, final);
 				}
+				hashmap_set(local_symbols, name, final);
+				resolved[index] = (uintptr_t)final;
+				continue;
+			}
+
+			if (table->st_shndx >= target->e_shnum) {
+				if (global) debug_print(ERROR, "Not resolving %s", name);
+				continue;
 			}
-			table++;
+
+			Elf32_Shdr * s = (Elf32_Shdr *)((uintptr_t)target + target->e_shoff + table->st_shndx * target->e_shentsize);
+			uintptr_t final = s->sh_addr + table->st_value;
+			if (global) hashmap_set(symboltable, name, (void *)final);
+			hashmap_set(local_symbols, name, (void *)final);
+			resolved[index] = final;
 		}
 	}
 	if (undefined) {
+		free(resolved);
 		debug_print(ERROR, "This module is faulty! Verify it specifies all of its");
 		debug_print(ERROR, "dependencies properly with MODULE_DEPENDS.");
 		goto mod_load_error;
@@ -288,19 +362,12 @@ void * module_load_direct(void * blob, size_t length) {
 						place  = (uintptr_t)ptr;
 						symbol = s->sh_addr;
 					} else {
-						char * name = (char *)((uintptr_t)symstrtab + sym->st_name);
 						ptr = (uintptr_t *)(table->r_offset + rs->sh_addr);
 						addend = *ptr;
 						place  = (uintptr_t)ptr;
-						if (!hashmap_get(symboltable, name)) {
-							if (!hashmap_get(local_symbols, name)) {
-								debug_print(ERROR, "Wat? Missing symbol %s", name);
-								debug_print(ERROR, "Here's all the symbols:");
-							} else {
-								symbol = (uintptr_t)hashmap_get(local_symbols, name);
-							}
-						} else {
-							symbol = (uintptr_t)hashmap_get(symboltable, name);
+						symbol = ELF32_R_SYM(table->r_info) < symbol_count ? resolved[ELF32_R_SYM(table->r_info)] : 0;
+						if (!symbol) {
+							debug_print(ERROR, "Missing symbol %s", (char *)((uintptr_t)symstrtab + sym->st_name));
 						}
 					}
 					switch (ELF32_R_TYPE(table->r_info)) {
@@ -312,6 +379,7 @@ void * module_load_direct(void * blob, size_t length) {
 							break;
 						default:
 							debug_print(ERROR, "Unsupported relocation type: %d", ELF32_R_TYPE(table->r_info));
+							free(resolved);
 							goto mod_load_error;
 					}
 
@@ -321,6 +389,8 @@ void * module_load_direct(void * blob, size_t length) {
 		}
 	}
 
+	free(resolved);
+
 	debug_print(INFO, "Locating module information...");
 	module_defs * mod_info = NULL;
 	list_t * hash_keys = hashmap_keys(local_symbols);
@@ -337,15 +407,10 @@ void * module_load_direct(void * blob, size_t length) {
 		goto mod_load_error;
 	}
 
-	mod_info->initialize();
-
-	debug_print(NOTICE, "Finished loading module %s", mod_info->name);
-
-	/* We don't do this anymore
-	 * TODO: Do this in the module unload function
-	hashmap_free(local_symbols);
-	free(local_symbols);
-	*/
+	if (mod_info->abi != MODULE_ABI) {
+		debug_print(ERROR, "Module %s was built for module interface %d, not %d", mod_info->name, mod_info->abi, MODULE_ABI);
+		goto mod_load_error;
+	}
 
 	module_data_t * mod_data = malloc(sizeof(module_data_t));
 	mod_data->mod_info = mod_info;
@@ -355,8 +420,33 @@ void * module_load_direct(void * blob, size_t length) {
 	mod_data->deps     = deps;
 	mod_data->deps_length = deps_length;
 	mod_data->text_addr = text_addr;
+	mod_data->deferred = 0;
+
+	if (!deferred_started && (mod_info->deferred || deps_deferred)) {
+		debug_print(NOTICE, "Deferring initialization of module %s", mod_info->name);
+		mod_data->deferred = 1;
+		deferred_pending++;
+		list_insert(deferred_modules, mod_data);
+	} else {
+		/* Something we need may still be coming up in the background */
+		while (deps_deferred && deferred_pending) {
+			switch_task(1);
+		}
+		boot_begin("module %s", mod_info->name);
+		mod_info->initialize();
+		boot_end("module %s", mod_info->name);
+	}
+
+	debug_print(NOTICE, "Finished loading module %s", mod_info->name);
+
+	/* We don't do this anymore
+	 * TODO: Do this in the module unload function
+	hashmap_free(local_symbols);
+	free(local_symbols);
+	*/
 
 	hashmap_set(modules, mod_info->name, (void *)mod_data);
+	symbol_index_rebuild();
 
 	return mod_data;
 
@@ -386,10 +476,22 @@ void * module_load(char * filename) {
 
 	debug_print(NOTICE, "Attempting to load kernel module: %s", filename);
 
-	void * blob = (void *)kvmalloc(file->length);
-	read_fs(file, 0, file->length, (uint8_t *)blob);
+	size_t length = file->length;
+	void * blob = (void *)kvmalloc(length);
+	read_fs(file, 0, length, (uint8_t *)blob);
+
+	if (gzip_check(blob, length)) {
+		void * inflated = gzip_inflate(blob, length, &length);
+		free(blob);
+		if (!inflated) {
+			debug_print(ERROR, "Failed to inflate module: %s", filename);
+			close_fs(file);
+			return NULL;
+		}
+		blob = inflated;
+	}
 
-	void * result = module_load_direct(blob, file->length);
+	void * result = module_load_direct(blob, length);
 
 	if (result == (void *)-1) {
 		debug_print(ERROR, "Error loading module.");
@@ -427,8 +529,35 @@ void modules_install(void) {
 	hashmap_set(symboltable, "kernel_symbols_start", &kernel_symbols_start);
 	hashmap_set(symboltable, "kernel_symbols_end",   &kernel_symbols_end);
 
+	symbol_index_rebuild();
+
 	/* Initialize the module name -> object hashmap */
 	modules = hashmap_create(MODULE_HASHMAP_SIZE);
+	deferred_modules = list_create();
+}
+
+static void deferred_init(void * data, char * name) {
+	foreach(node, deferred_modules) {
+		module_data_t * mod_data = node->value;
+		boot_begin("module %s", mod_data->mod_info->name);
+		mod_data->mod_info->initialize();
+		boot_end("module %s", mod_data->mod_info->name);
+		mod_data->deferred = 0;
+		deferred_pending--;
+	}
+	list_free(deferred_modules);
+	free(deferred_modules);
+	deferred_modules = NULL;
+}
+
+/*
+ * Initialize the deferred modules in the background. Modules loaded
+ * after this are initialized as they are loaded.
+ */
+void modules_start_deferred(void) {
+	deferred_started = 1;
+	if (!deferred_modules->length) return;
+	create_kernel_tasklet(deferred_init, "[modules]", NULL);
 }
 
 /* Accessors. */
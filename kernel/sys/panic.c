@@ -30,33 +30,7 @@ void halt_and_catch_fire(char * error_message, const char * file, int line, stru
 }
 
 char * probable_function_name(uintptr_t ip, uintptr_t * out_addr) {
-	char * closest  = NULL;
-	size_t distance = 0xFFFFFFFF;
-	uintptr_t  addr = 0;
-
-	if (modules_get_symbols()) {
-		list_t * hash_keys = hashmap_keys(modules_get_symbols());
-		foreach(_key, hash_keys) {
-			char * key = (char *)_key->value;
-			uintptr_t a = (uintptr_t)hashmap_get(modules_get_symbols(), key);
-
-			if (!a) continue;
-
-			size_t d = 0xFFFFFFFF;
-			if (a <= ip) {
-				d = ip - a;
-			}
-			if (d < distance) {
-				closest = key;
-				distance = d;
-				addr = a;
-			}
-		}
-		free(hash_keys);
-
-	}
-	*out_addr = addr;
-	return closest;
+	return modules_symbol_for(ip, out_addr);
 }
 
 void assert_failed(const char *file, uint32_t line, const char *desc) {
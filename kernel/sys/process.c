@@ -16,6 +16,7 @@
 #include <kernel/logging.h>
 #include <kernel/shm.h>
 #include <kernel/printf.h>
+#include <kernel/slab.h>
 
 #include <sys/wait.h>
 
@@ -24,8 +25,7 @@
 
 tree_t * process_tree;  /* Parent->Children tree */
 list_t * process_list;  /* Flat storage */
-list_t * process_queue; /* Ready queue */
-list_t * sleep_queue;
+list_t * process_queue[SCHED_LEVELS]; /* Ready queues, highest priority first */
 volatile process_t * current_process = NULL;
 process_t * kernel_idle_task = NULL;
 
@@ -36,9 +36,42 @@ static spin_lock_t sleep_lock = { 0 };
 
 static bitset_t pid_set;
 
+/* Slab caches for the objects made and destroyed with every process and sleep */
+static slab_cache_t * process_cache;
+static slab_cache_t * fd_table_cache;
+static slab_cache_t * open_file_cache;
+static slab_cache_t * sleeper_cache;
+
 /* Default process name string */
 char * default_name = "[unnamed]";
 
+/* Ticks between promoting every waiting process up a level */
+#define SCHED_AGE_TICKS 100
+
+static unsigned int sched_age_counter = 0;
+
+/*
+ * Sleepers live in a hierarchical timer wheel, keyed by their wake
+ * time in subticks since boot. The first level has a slot for each
+ * of the next 256 subticks; each later level covers 64 times the
+ * span of the one before it in 64 slots, and its slots are cascaded
+ * down a level as the clock reaches them. Adding and cancelling a
+ * sleeper are O(1), and each subtick only touches its own slot.
+ */
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_BITS      6
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4
+
+static list_t wheel_root[WHEEL_ROOT_SIZE];
+static list_t wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long wheel_now = 0; /* Next subtick to expire */
+static size_t wheel_count = 0;
+
+/* sleep_node.owner of a process in sleep_until() */
+static list_t timed_sleep;
+
 int is_valid_process(process_t * process) {
 	foreach(lnode, process_list) {
 		if (lnode->value == process) {
@@ -55,14 +88,110 @@ int is_valid_process(process_t * process) {
  */
 #define MAX_PID 32768
 
+/*
+ * PID -> process, as a two-level radix table. Leaves cover 256 PIDs
+ * and are allocated the first time one of their PIDs is used. Kept
+ * in step with the process tree, under tree_lock.
+ */
+#define PID_LEAF_BITS 8
+#define PID_LEAF_SIZE (1 << PID_LEAF_BITS)
+
+static process_t ** pid_table[MAX_PID / PID_LEAF_SIZE + 1];
+
+static void pid_table_set(pid_t pid, process_t * proc) {
+	process_t ** leaf = pid_table[pid >> PID_LEAF_BITS];
+	if (!leaf) {
+		if (!proc) return;
+		leaf = malloc(sizeof(process_t *) * PID_LEAF_SIZE);
+		memset(leaf, 0, sizeof(process_t *) * PID_LEAF_SIZE);
+		pid_table[pid >> PID_LEAF_BITS] = leaf;
+	}
+	leaf[pid & (PID_LEAF_SIZE - 1)] = proc;
+}
+
+/*
+ * Descriptor tables are an array of open files, with a bitmap of the
+ * slots in use so that the lowest free one can be found a byte at a
+ * time, starting from a slot below which everything is known taken.
+ */
+static fd_table_t * fd_table_create(size_t capacity) {
+	fd_table_t * fds = slab_alloc(fd_table_cache);
+	fds->refs        = 1;
+	fds->length      = 0;
+	fds->lowest_free = 0;
+	fds->capacity    = capacity;
+	fds->entries     = malloc(sizeof(open_file_t *) * capacity);
+	memset(fds->entries, 0, sizeof(open_file_t *) * capacity);
+	bitset_init(&fds->used, (capacity + 7) / 8);
+	return fds;
+}
+
+/* A copy for a new process, sharing the open files */
+static fd_table_t * fd_table_clone(fd_table_t * src) {
+	fd_table_t * fds = slab_alloc(fd_table_cache);
+	fds->refs        = 1;
+	fds->length      = src->length;
+	fds->lowest_free = src->lowest_free;
+	fds->capacity    = src->capacity;
+	fds->entries     = malloc(sizeof(open_file_t *) * fds->capacity);
+	assert(fds->entries && "Failed to allocate file descriptor table for new process.");
+	memcpy(fds->entries, src->entries, sizeof(open_file_t *) * fds->capacity);
+	fds->used.size   = src->used.size;
+	fds->used.data   = malloc(src->used.size);
+	memcpy(fds->used.data, src->used.data, src->used.size);
+	for (size_t i = 0; i < fds->length; ++i) {
+		if (fds->entries[i]) {
+			fds->entries[i]->refs++;
+		}
+	}
+	return fds;
+}
+
+static int fd_table_free_slot(fd_table_t * fds) {
+	int fd = bitset_ffub_from(&fds->used, fds->lowest_free);
+	return fd < 0 ? (int)(fds->used.size * 8) : fd;
+}
+
+static void fd_table_install(fd_table_t * fds, int fd, open_file_t * file) {
+	if ((size_t)fd >= fds->capacity) {
+		size_t capacity = fds->capacity;
+		while (capacity <= (size_t)fd) capacity *= 2;
+		fds->entries = realloc(fds->entries, sizeof(open_file_t *) * capacity);
+		memset(fds->entries + fds->capacity, 0, sizeof(open_file_t *) * (capacity - fds->capacity));
+		fds->capacity = capacity;
+	}
+	fds->entries[fd] = file;
+	bitset_set(&fds->used, fd);
+	if ((size_t)fd >= fds->length) {
+		fds->length = fd + 1;
+	}
+	if ((size_t)fd == fds->lowest_free) {
+		fds->lowest_free = fd + 1;
+	}
+}
+
+static void open_file_release(open_file_t * file) {
+	if (--file->refs) return;
+	if (file->node) {
+		close_fs(file->node);
+	}
+	slab_free(open_file_cache, file);
+}
+
 /*
  * Initialize the process tree and ready queue.
  */
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create();
-	process_queue = list_create();
-	sleep_queue = list_create();
+	for (int i = 0; i < SCHED_LEVELS; ++i) {
+		process_queue[i] = list_create();
+	}
+
+	process_cache  = slab_create("process_t", sizeof(process_t), NULL);
+	fd_table_cache = slab_create("fd_table_t", sizeof(fd_table_t), NULL);
+	open_file_cache = slab_create("open_file_t", sizeof(open_file_t), NULL);
+	sleeper_cache  = slab_create("sleeper_t", sizeof(sleeper_t), NULL);
 
 	/* Start off with enough bits for 64 processes */
 	bitset_init(&pid_set, MAX_PID / 8);
@@ -114,6 +243,48 @@ void debug_print_process_tree(void) {
 	debug_print_process_tree_node(process_tree->root, 0);
 }
 
+/*
+ * Scheduling
+ *
+ * Ready processes sit in one of SCHED_LEVELS queues, and we always
+ * run from the highest priority queue that has anything in it.
+ * Where a process starts out, and how far it can sink, is set by
+ * its niceness. A process that uses up its time slice drops a level
+ * (and gets a longer slice); one that blocks and is woken back up
+ * returns to just above its starting level, so interactive tasks
+ * that spend most of their time waiting for input stay ahead of
+ * anything grinding away in the background. Processes left waiting
+ * in the queues are periodically promoted so nothing starves.
+ */
+
+/* The level a process of a given niceness starts from */
+static int sched_base_level(process_t * proc) {
+	return (proc->nice + 20) * SCHED_LEVELS / 40;
+}
+
+/* The lowest level a process can be demoted to */
+static int sched_floor_level(process_t * proc) {
+	int floor = sched_base_level(proc) + 2;
+	return floor < SCHED_LEVELS ? floor : SCHED_LEVELS - 1;
+}
+
+/* Time slice, in timer ticks, for a level */
+static int sched_quantum(int level) {
+	return (level + 1) * 5;
+}
+
+/*
+ * Set the niceness of a process and move it back to
+ * the starting level for its new priority.
+ */
+void process_set_nice(process_t * proc, int nice) {
+	if (nice < -20) nice = -20;
+	if (nice > 19)  nice = 19;
+	proc->nice = nice;
+	proc->sched_level = sched_base_level(proc);
+	proc->sched_ticks = 0;
+}
+
 /*
  * Retreive the next ready process.
  * XXX: POPs from the ready queue!
@@ -124,19 +295,92 @@ process_t * next_ready_process(void) {
 	if (!process_available()) {
 		return kernel_idle_task;
 	}
-	if (process_queue->head->owner != process_queue) {
-		debug_print(ERROR, "Erroneous process located in process queue: node 0x%x has owner 0x%x, but process_queue is 0x%x", process_queue->head, process_queue->head->owner, process_queue);
+	list_t * queue = NULL;
+	for (int i = 0; i < SCHED_LEVELS; ++i) {
+		if (process_queue[i]->head) {
+			queue = process_queue[i];
+			break;
+		}
+	}
+	if (queue->head->owner != queue) {
+		debug_print(ERROR, "Erroneous process located in process queue: node 0x%x has owner 0x%x, but process_queue is 0x%x", queue->head, queue->head->owner, queue);
 
-		process_t * proc = process_queue->head->value;
+		process_t * proc = queue->head->value;
 
 		debug_print(ERROR, "PID associated with this node is %d", proc->id);
 	}
-	node_t * np = list_dequeue(process_queue);
+	node_t * np = list_dequeue(queue);
 	assert(np && "Ready queue is empty.");
 	process_t * next = np->value;
 	return next;
 }
 
+static unsigned long to_subticks(unsigned long seconds, unsigned long subseconds) {
+	return seconds * SUBTICKS_PER_TICK + subseconds;
+}
+
+/*
+ * Put a sleeper in the slot for its wake time. The sleep lock must be held.
+ */
+static void timer_add(sleeper_t * sleeper) {
+	unsigned long expires = sleeper->expires;
+	unsigned long delta = expires - wheel_now;
+	list_t * slot;
+
+	if ((long)delta < 0) {
+		/* Already due; expire with the current subtick */
+		slot = &wheel_root[wheel_now & (WHEEL_ROOT_SIZE - 1)];
+	} else if (delta < WHEEL_ROOT_SIZE) {
+		slot = &wheel_root[expires & (WHEEL_ROOT_SIZE - 1)];
+	} else {
+		int level = 0;
+		while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_ROOT_BITS + WHEEL_BITS * (level + 1)))) {
+			level++;
+		}
+		slot = &wheel[level][(expires >> (WHEEL_ROOT_BITS + WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+	}
+
+	sleeper->node.value = sleeper;
+	list_append(slot, &sleeper->node);
+}
+
+/*
+ * Remove and free a sleeper that hasn't expired. The sleep lock must be held.
+ */
+static void timer_cancel(node_t * node) {
+	if (node->owner) {
+		list_delete(node->owner, node);
+		wheel_count--;
+	}
+	slab_free(sleeper_cache, node->value);
+}
+
+/*
+ * Move everything in a slot of an outer level down to where it belongs now.
+ *
+ * @returns The index of the slot, so the caller knows whether it wrapped.
+ */
+static int timer_cascade(int level) {
+	int index = (wheel_now >> (WHEEL_ROOT_BITS + WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	list_t * slot = &wheel[level][index];
+	node_t * node;
+	while ((node = list_dequeue(slot))) {
+		timer_add(node->value);
+	}
+	return index;
+}
+
+static sleeper_t * new_sleeper(process_t * process, unsigned long seconds, unsigned long subseconds, int is_fswait) {
+	sleeper_t * sleeper = slab_alloc(sleeper_cache);
+	memset(sleeper, 0, sizeof(sleeper_t));
+	sleeper->process   = process;
+	sleeper->expires   = to_subticks(seconds, subseconds);
+	sleeper->is_fswait = is_fswait;
+	timer_add(sleeper);
+	wheel_count++;
+	return sleeper;
+}
+
 /*
  * Reinsert a process into the ready queue.
  *
@@ -144,18 +388,17 @@ process_t * next_ready_process(void) {
  */
 void make_process_ready(process_t * proc) {
 	if (proc->sleep_node.owner != NULL) {
-		if (proc->sleep_node.owner == sleep_queue) {
-			/* XXX can't wake from timed sleep */
+		if (proc->sleep_node.owner == &timed_sleep) {
+			/* Woken early: take it out of the timer wheel */
+			IRQ_OFF;
+			spin_lock(sleep_lock);
 			if (proc->timed_sleep_node) {
-				IRQ_OFF;
-				spin_lock(sleep_lock);
-				list_delete(sleep_queue, proc->timed_sleep_node);
-				spin_unlock(sleep_lock);
-				IRQ_RES;
-				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
+				timer_cancel(proc->timed_sleep_node);
+				proc->timed_sleep_node = NULL;
 			}
-			/* Else: I have no idea what happened. */
+			spin_unlock(sleep_lock);
+			IRQ_RES;
+			proc->sleep_node.owner = NULL;
 		} else {
 			proc->sleep_interrupted = 1;
 			spin_lock(wait_lock_tmp);
@@ -165,14 +408,91 @@ void make_process_ready(process_t * proc) {
 	}
 	if (proc->sched_node.owner) {
 		debug_print(WARNING, "Can't make process ready without removing from owner list: %d", proc->id);
-		debug_print(WARNING, "  (This is a bug) Current owner list is 0x%x (ready queue is 0x%x)", proc->sched_node.owner, process_queue);
+		debug_print(WARNING, "  (This is a bug) Current owner list is 0x%x (ready queue is 0x%x)", proc->sched_node.owner, process_queue[proc->sched_level]);
 		return;
 	}
+
+	int level;
+	if (proc != current_process) {
+		/* Being woken up (or just created): boost it back up */
+		int base = sched_base_level(proc);
+		proc->sched_level = base > 0 ? base - 1 : 0;
+		proc->sched_ticks = 0;
+		level = proc->sched_level;
+	} else if (proc->sched_preempted) {
+		/* Preempted by the timer, stays at its level */
+		proc->sched_preempted = 0;
+		level = proc->sched_level;
+	} else {
+		/*
+		 * Yielding, probably waiting for a lock or some other
+		 * process; go behind everyone else so we don't just
+		 * get picked again before whatever we are waiting on.
+		 */
+		level = SCHED_LEVELS - 1;
+	}
+
 	spin_lock(process_queue_lock);
-	list_append(process_queue, &proc->sched_node);
+	list_append(process_queue[level], &proc->sched_node);
 	spin_unlock(process_queue_lock);
 }
 
+/*
+ * Promote every waiting process one level.
+ */
+static void sched_age(void) {
+	spin_lock(process_queue_lock);
+	for (int i = 1; i < SCHED_LEVELS; ++i) {
+		node_t * node;
+		while ((node = list_dequeue(process_queue[i]))) {
+			process_t * proc = node->value;
+			if (proc->sched_level > i - 1) {
+				proc->sched_level = i - 1;
+			}
+			list_append(process_queue[i-1], node);
+		}
+	}
+	spin_unlock(process_queue_lock);
+}
+
+/*
+ * Account a timer tick to the current process.
+ *
+ * Called from the timer interrupt before switching tasks.
+ *
+ * @return 1 if the current process should be switched out,
+ *         0 if it should keep running.
+ */
+int process_tick(void) {
+	if (++sched_age_counter >= SCHED_AGE_TICKS) {
+		sched_age_counter = 0;
+		sched_age();
+	}
+
+	process_t * proc = (process_t *)current_process;
+	if (!proc || proc == kernel_idle_task || !proc->running) {
+		return 1;
+	}
+
+	proc->sched_preempted = 1;
+
+	if (++proc->sched_ticks >= sched_quantum(proc->sched_level)) {
+		/* Used up its time slice */
+		if (proc->sched_level < sched_floor_level(proc)) {
+			proc->sched_level++;
+		}
+		proc->sched_ticks = 0;
+		return 1;
+	}
+
+	/* Something more important is waiting */
+	for (int i = 0; i < proc->sched_level; ++i) {
+		if (process_queue[i]->head) return 1;
+	}
+
+	proc->sched_preempted = 0;
+	return 0;
+}
 
 extern void tree_remove_reparent_root(tree_t * tree, tree_node_t * node);
 
@@ -201,23 +521,45 @@ void delete_process(process_t * proc) {
 	int has_children = entry->children->length;
 	tree_remove_reparent_root(process_tree, entry);
 	list_delete(process_list, list_find(process_list, proc));
+	pid_table_set(proc->id, NULL);
+	if (proc->zombie_node.owner) {
+		list_delete(proc->zombie_node.owner, &proc->zombie_node);
+	}
+	/* Our unreaped children are init's to reap now */
+	process_t * init = process_tree->root->value;
+	node_t * zombie;
+	while ((zombie = list_dequeue(&proc->zombies))) {
+		list_append(&init->zombies, zombie);
+	}
 	spin_unlock(tree_lock);
 
 	if (has_children) {
-		process_t * init = process_tree->root->value;
 		wakeup_queue(init->wait_queue);
 	}
 
 	bitset_clear(&pid_set, proc->id);
 
+	free(proc->usage.syscall_counts);
+	fpu_release(proc);
+
 	/* Uh... */
-	free(proc);
+	slab_free(process_cache, proc);
 }
 
 static void _kidle(void) {
 	while (1) {
+		IRQ_OFF;
+		if (process_available()) {
+			/* Woken by something other than the timer */
+			switch_task(1);
+			continue;
+		}
+		timer_idle();
+		/* sti only takes effect after the next instruction, so nothing can sneak in before the hlt */
+		asm volatile ("sti\nhlt");
+		IRQ_OFF;
+		timer_wake();
 		IRQ_ON;
-		PAUSE;
 	}
 }
 
@@ -225,7 +567,7 @@ static void _kidle(void) {
  * Spawn the idle "process".
  */
 process_t * spawn_kidle(void) {
-	process_t * idle = malloc(sizeof(process_t));
+	process_t * idle = slab_alloc(process_cache);
 	memset(idle, 0x00, sizeof(process_t));
 	idle->id = -1;
 	idle->name = strdup("[kidle]");
@@ -258,13 +600,14 @@ process_t * spawn_init(void) {
 	assert((!process_tree->root) && "Tried to regenerate init!");
 
 	/* Allocate space for a new process */
-	process_t * init = malloc(sizeof(process_t));
+	process_t * init = slab_alloc(process_cache);
 	/* Set it as the root process */
 	tree_set_root(process_tree, (void *)init);
 	/* Set its tree entry pointer so we can keep track
 	 * of the process' entry in the process tree. */
 	init->tree_entry = process_tree->root;
 	init->id      = 1;       /* Init is PID 1 */
+	pid_table_set(init->id, init);
 	init->group   = 0; /* thread group id (real PID) */
 	init->job     = 1; /* process group id (jobs) */
 	init->session = 1; /* session leader id */
@@ -274,13 +617,7 @@ process_t * spawn_init(void) {
 	init->real_user = 0;
 	init->mask    = 022;     /* umask */
 	init->status  = 0;       /* Run status */
-	init->fds = malloc(sizeof(fd_table_t));
-	init->fds->refs = 1;
-	init->fds->length   = 0;  /* Initialize the file descriptors */
-	init->fds->capacity = 4;
-	init->fds->entries  = malloc(sizeof(fs_node_t *) * init->fds->capacity);
-	init->fds->modes    = malloc(sizeof(int) * init->fds->capacity);
-	init->fds->offsets  = malloc(sizeof(uint64_t) * init->fds->capacity);
+	init->fds = fd_table_create(4); /* Initialize the file descriptors */
 
 	/* Set the working directory */
 	init->wd_node = clone_fs(fs_root);
@@ -300,12 +637,18 @@ process_t * spawn_init(void) {
 	/* Process is not finished */
 	init->finished = 0;
 	init->suspended = 0;
+	process_set_nice(init, 0);
 	init->started = 1;
 	init->running = 1;
 	init->wait_queue = list_create();
 	init->shm_mappings = list_create();
 	init->signal_queue = list_create();
 	init->signal_kstack = NULL; /* None yet initialized */
+	init->signalfds = NULL;
+
+	memset(&init->zombies, 0, sizeof(list_t));
+	memset(&init->zombie_node, 0, sizeof(node_t));
+	init->zombie_node.value = init;
 
 	init->sched_node.prev = NULL;
 	init->sched_node.next = NULL;
@@ -317,6 +660,8 @@ process_t * spawn_init(void) {
 
 	init->timed_sleep_node = NULL;
 
+	memset(&init->usage, 0, sizeof(usage_t));
+
 	init->is_tasklet = 0;
 
 	set_process_environment(init, current_directory);
@@ -380,7 +725,7 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 
 	/* Allocate a new process */
 	debug_print(INFO,"   process_t {");
-	process_t * proc = malloc(sizeof(process_t));
+	process_t * proc = slab_alloc(process_cache);
 	memset(proc, 0, sizeof(process_t));
 	debug_print(INFO,"   }");
 	proc->id = get_next_pid(); /* Set its PID */
@@ -402,8 +747,7 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	proc->thread.esp = 0;
 	proc->thread.ebp = 0;
 	proc->thread.eip = 0;
-	proc->thread.fpu_enabled = 0;
-	memcpy((void*)proc->thread.fp_regs, (void*)parent->thread.fp_regs, 512);
+	fpu_fork((process_t *)parent, proc);
 
 	/* Set the process image information from the parent */
 	proc->image.entry       = parent->image.entry;
@@ -425,22 +769,7 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 		proc->fds = parent->fds;
 		proc->fds->refs++;
 	} else {
-		proc->fds = malloc(sizeof(fd_table_t));
-		proc->fds->refs     = 1;
-		proc->fds->length   = parent->fds->length;
-		proc->fds->capacity = parent->fds->capacity;
-		debug_print(INFO,"    fds / files {");
-		proc->fds->entries  = malloc(sizeof(fs_node_t *) * proc->fds->capacity);
-		proc->fds->modes    = malloc(sizeof(int) * proc->fds->capacity);
-		proc->fds->offsets  = malloc(sizeof(uint64_t) * proc->fds->capacity);
-		assert(proc->fds->entries && "Failed to allocate file descriptor table for new process.");
-		debug_print(INFO,"    ---");
-		for (uint32_t i = 0; i < parent->fds->length; ++i) {
-			proc->fds->entries[i] = clone_fs(parent->fds->entries[i]);
-			proc->fds->modes[i]   = parent->fds->modes[i];
-			proc->fds->offsets[i] = parent->fds->offsets[i];
-		}
-		debug_print(INFO,"    }");
+		proc->fds = fd_table_clone(parent->fds);
 	}
 
 	/* As well as the working directory */
@@ -458,6 +787,7 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	proc->shm_mappings = list_create();
 	proc->signal_queue = list_create();
 	proc->signal_kstack = NULL; /* None yet initialized */
+	proc->signalfds = NULL;
 
 	proc->sched_node.prev = NULL;
 	proc->sched_node.next = NULL;
@@ -469,8 +799,12 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 
 	proc->timed_sleep_node = NULL;
 
+	proc->zombie_node.value = proc;
+
 	proc->is_tasklet = 0;
 
+	process_set_nice(proc, parent->nice);
+
 	gettimeofday(&proc->start, NULL);
 
 	/* Insert the process into the process tree as a child
@@ -481,6 +815,7 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	spin_lock(tree_lock);
 	tree_node_insert_child_node(process_tree, parent->tree_entry, entry);
 	list_insert(process_list, (void *)proc);
+	pid_table_set(proc->id, proc);
 	spin_unlock(tree_lock);
 
 	/* Return the new process */
@@ -495,15 +830,16 @@ uint8_t process_compare(void * proc_v, void * pid_v) {
 }
 
 process_t * process_from_pid(pid_t pid) {
-	if (pid < 0) return NULL;
+	if (pid < 0 || pid > MAX_PID) return NULL;
 
+	process_t * proc = NULL;
 	spin_lock(tree_lock);
-	tree_node_t * entry = tree_find(process_tree,&pid,process_compare);
-	spin_unlock(tree_lock);
-	if (entry) {
-		return (process_t *)entry->value;
+	process_t ** leaf = pid_table[pid >> PID_LEAF_BITS];
+	if (leaf) {
+		proc = leaf[pid & (PID_LEAF_SIZE - 1)];
 	}
-	return NULL;
+	spin_unlock(tree_lock);
+	return proc;
 }
 
 process_t * process_get_parent(process_t * process) {
@@ -575,68 +911,75 @@ void set_process_environment(process_t * proc, page_directory_t * directory) {
  * @return 1 if there are processes available, 0 otherwise
  */
 uint8_t process_available(void) {
-	return (process_queue->head != NULL);
+	for (int i = 0; i < SCHED_LEVELS; ++i) {
+		if (process_queue[i]->head) return 1;
+	}
+	return 0;
 }
 
 /*
- * Append a file descriptor to a process.
+ * Append a file descriptor to a process, in the lowest free slot.
  *
  * @param proc Process to append to
  * @param node The VFS node
  * @return The actual fd, for use in userspace
  */
 uint32_t process_append_fd(process_t * proc, fs_node_t * node) {
-	/* Fill gaps */
-	for (unsigned int i = 0; i < proc->fds->length; ++i) {
-		if (!proc->fds->entries[i]) {
-			proc->fds->entries[i] = node;
-			/* modes, offsets must be set by caller */
-			proc->fds->modes[i] = 0;
-			proc->fds->offsets[i] = 0;
-			return i;
-		}
-	}
-	/* No gaps, expand */
-	if (proc->fds->length == proc->fds->capacity) {
-		proc->fds->capacity *= 2;
-		proc->fds->entries = realloc(proc->fds->entries, sizeof(fs_node_t *) * proc->fds->capacity);
-		proc->fds->modes   = realloc(proc->fds->modes,   sizeof(int) * proc->fds->capacity);
-		proc->fds->offsets = realloc(proc->fds->offsets, sizeof(uint64_t) * proc->fds->capacity);
-	}
-	proc->fds->entries[proc->fds->length] = node;
-	/* modes, offsets must be set by caller */
-	proc->fds->modes[proc->fds->length] = 0;
-	proc->fds->offsets[proc->fds->length] = 0;
-	proc->fds->length++;
-	return proc->fds->length-1;
+	open_file_t * file = slab_alloc(open_file_cache);
+	file->node   = node;
+	file->offset = 0;
+	file->mode   = 0; /* must be set by caller */
+	file->refs   = 1;
+
+	int fd = fd_table_free_slot(proc->fds);
+	fd_table_install(proc->fds, fd, file);
+	return fd;
 }
 
 /*
- * dup2() -> Move the file pointed to by `s(ou)rc(e)` into
- *           the slot pointed to be `dest(ination)`.
+ * dup2() -> Point the slot `dest(ination)` at the same open file
+ *           as `s(ou)rc(e)`, closing whatever was there.
  *
  * @param proc  Process to do this for
  * @param src   Source file descriptor
- * @param dest  Destination file descriptor
+ * @param dest  Destination file descriptor (-1 for the lowest free one)
  * @return The destination file descriptor, -1 on failure
  */
 uint32_t process_move_fd(process_t * proc, int src, int dest) {
-	if ((size_t)src >= proc->fds->length || (dest != -1 && (size_t)dest >= proc->fds->length)) {
+	fd_table_t * fds = proc->fds;
+	if (src < 0 || (size_t)src >= fds->length || !fds->entries[src] ||
+		dest < -1 || (dest != -1 && (size_t)dest >= fds->length)) {
 		return -1;
 	}
 	if (dest == -1) {
-		dest = process_append_fd(proc, NULL);
+		dest = fd_table_free_slot(fds);
 	}
-	if (proc->fds->entries[dest] != proc->fds->entries[src]) {
-		close_fs(proc->fds->entries[dest]);
-		proc->fds->entries[dest] = proc->fds->entries[src];
-		proc->fds->modes[dest] = proc->fds->modes[src];
-		proc->fds->offsets[dest] = proc->fds->offsets[src];
-		open_fs(proc->fds->entries[dest], 0);
+	if (fds->entries[dest] != fds->entries[src]) {
+		open_file_t * file = fds->entries[src];
+		file->refs++;
+		process_close_fd(proc, dest);
+		fd_table_install(fds, dest, file);
 	}
 	return dest;
 }
 
+/*
+ * close() -> Empty a slot, closing the file if nothing else has it open.
+ */
+void process_close_fd(process_t * proc, int fd) {
+	fd_table_t * fds = proc->fds;
+	if (fd < 0 || (size_t)fd >= fds->length || !fds->entries[fd]) {
+		return;
+	}
+	open_file_t * file = fds->entries[fd];
+	fds->entries[fd] = NULL;
+	bitset_clear(&fds->used, fd);
+	if ((size_t)fd < fds->lowest_free) {
+		fds->lowest_free = fd;
+	}
+	open_file_release(file);
+}
+
 int wakeup_queue(list_t * queue) {
 	int awoken_processes = 0;
 	while (queue->length > 0) {
@@ -651,6 +994,44 @@ int wakeup_queue(list_t * queue) {
 	return awoken_processes;
 }
 
+/*
+ * Wake up to `count` processes from the front of a queue,
+ * skipping any that have already finished.
+ */
+int wakeup_queue_count(list_t * queue, int count) {
+	int awoken_processes = 0;
+	while (queue->length > 0 && awoken_processes < count) {
+		spin_lock(wait_lock_tmp);
+		node_t * node = list_pop(queue);
+		spin_unlock(wait_lock_tmp);
+		if (!((process_t *)node->value)->finished) {
+			make_process_ready(node->value);
+			awoken_processes++;
+		}
+	}
+	return awoken_processes;
+}
+
+/*
+ * Wake the process that has been waiting longest on a queue,
+ * skipping any that have already finished.
+ *
+ * @returns The process woken, or NULL if there was none.
+ */
+process_t * wakeup_queue_first(list_t * queue) {
+	while (queue->length > 0) {
+		spin_lock(wait_lock_tmp);
+		node_t * node = list_dequeue(queue);
+		spin_unlock(wait_lock_tmp);
+		process_t * process = node->value;
+		if (!process->finished) {
+			make_process_ready(process);
+			return process;
+		}
+	}
+	return NULL;
+}
+
 int wakeup_queue_interrupted(list_t * queue) {
 	int awoken_processes = 0;
 	while (queue->length > 0) {
@@ -687,60 +1068,76 @@ int process_is_ready(process_t * proc) {
 }
 
 
+/*
+ * Expire everything in the wheel up to the given time.
+ */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
+	unsigned long now = to_subticks(seconds, subseconds);
 	IRQ_OFF;
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node(proc->process,proc);
+	while ((long)(now - wheel_now) >= 0) {
+		int index = wheel_now & (WHEEL_ROOT_SIZE - 1);
+		if (!index) {
+			for (int level = 0; level < WHEEL_LEVELS && !timer_cascade(level); ++level);
+		}
+		node_t * node;
+		while ((node = list_dequeue(&wheel_root[index]))) {
+			sleeper_t * sleeper = node->value;
+			process_t * process = sleeper->process;
+			wheel_count--;
+			if (sleeper->is_fswait) {
+				/* Timed out; it's already out of the wheel */
+				process->timeout_node = NULL;
+				process_alert_node(process, sleeper);
 			} else {
-				process_t * process = proc->process;
 				process->sleep_node.owner = NULL;
 				process->timed_sleep_node = NULL;
 				if (!process_is_ready(process)) {
 					make_process_ready(process);
 				}
 			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
-			}
+			slab_free(sleeper_cache, sleeper);
 		}
+		wheel_now++;
 	}
 	spin_unlock(sleep_lock);
 	IRQ_RES;
 }
 
+/*
+ * Get a time by which the first sleeper is due, if there are any.
+ *
+ * Exact when it's in the first level of the wheel; otherwise this is
+ * when the next cascade happens, which is as long as it's safe to wait.
+ */
+int next_sleeper(unsigned long * seconds, unsigned long * subseconds) {
+	int ret = 0;
+	spin_lock(sleep_lock);
+	if (wheel_count) {
+		/* Stops at the next cascade, including one that is due now */
+		unsigned long when = wheel_now;
+		while ((when & (WHEEL_ROOT_SIZE - 1)) && !wheel_root[when & (WHEEL_ROOT_SIZE - 1)].head) {
+			when++;
+		}
+		*seconds    = when / SUBTICKS_PER_TICK;
+		*subseconds = when % SUBTICKS_PER_TICK;
+		ret = 1;
+	}
+	spin_unlock(sleep_lock);
+	return ret;
+}
+
 void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds) {
 	if (current_process->sleep_node.owner) {
 		/* Can't sleep, sleeping already */
 		return;
 	}
-	process->sleep_node.owner = sleep_queue;
+	process->sleep_node.owner = &timed_sleep;
 
 	IRQ_OFF;
 	spin_lock(sleep_lock);
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	sleeper_t * sleeper = new_sleeper(process, seconds, subseconds, 0);
+	process->timed_sleep_node = &sleeper->node;
 	spin_unlock(sleep_lock);
 	IRQ_RES;
 }
@@ -753,6 +1150,7 @@ void cleanup_process(process_t * proc, int retval) {
 	free(proc->wait_queue);
 	list_free(proc->signal_queue);
 	free(proc->signal_queue);
+	signalfd_release(proc);
 	free(proc->wd_name);
 
 
@@ -778,18 +1176,25 @@ void cleanup_process(process_t * proc, int retval) {
 		debug_print(INFO, "Going to clear out the file descriptors %d", proc->id);
 		for (uint32_t i = 0; i < proc->fds->length; ++i) {
 			if (proc->fds->entries[i]) {
-				close_fs(proc->fds->entries[i]);
+				open_file_release(proc->fds->entries[i]);
 				proc->fds->entries[i] = NULL;
 			}
 		}
 		debug_print(INFO, "... and their storage %d", proc->id);
 		free(proc->fds->entries);
-		free(proc->fds->offsets);
-		free(proc->fds->modes);
-		free(proc->fds);
+		bitset_free(&proc->fds->used);
+		slab_free(fd_table_cache, proc->fds);
 		debug_print(INFO, "... and the kernel stack (hope this ain't us) %d", proc->id);
 		free((void *)(proc->image.stack - KERNEL_STACK_SIZE));
 	}
+
+	/* Now our parent can find us without looking through all of its children */
+	spin_lock(tree_lock);
+	tree_node_t * parent = proc->tree_entry->parent;
+	if (parent) {
+		list_append(&((process_t *)parent->value)->zombies, &proc->zombie_node);
+	}
+	spin_unlock(tree_lock);
 }
 
 void reap_process(process_t * proc) {
@@ -823,6 +1228,47 @@ static int wait_candidate(process_t * parent, int pid, int options, process_t *
 	return 0;
 }
 
+/*
+ * Does `parent` have any child at all that `pid` and `options` could
+ * match? Only asked when there's nothing to collect.
+ */
+static int has_wait_candidate(process_t * parent, int pid, int options) {
+	if (pid > 0) {
+		process_t * child = process_from_pid(pid);
+		return child && child->tree_entry && child->tree_entry->parent == parent->tree_entry &&
+			wait_candidate(parent, pid, options, child);
+	}
+
+	if (pid == -1 && !(options & WNOKERN)) {
+		return parent->tree_entry->children->length > 0;
+	}
+
+	foreach(node, parent->tree_entry->children) {
+		if (!node->value) continue;
+		if (wait_candidate(parent, pid, options, ((tree_node_t *)node->value)->value)) return 1;
+	}
+	return 0;
+}
+
+/* A stopped child to report to WSTOPPED; these aren't kept anywhere but the tree. */
+static process_t * find_stopped_child(process_t * parent, int pid, int options) {
+	if (pid > 0) {
+		process_t * child = process_from_pid(pid);
+		if (child && child->tree_entry && child->tree_entry->parent == parent->tree_entry &&
+			!child->finished && child->suspended) return child;
+		return NULL;
+	}
+
+	foreach(node, parent->tree_entry->children) {
+		if (!node->value) continue;
+		process_t * child = ((tree_node_t *)node->value)->value;
+		if (!child->finished && child->suspended && wait_candidate(parent, pid, options, child)) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
 int waitpid(int pid, int * status, int options) {
 	process_t * proc = (process_t *)current_process;
 	if (proc->group) {
@@ -833,32 +1279,19 @@ int waitpid(int pid, int * status, int options) {
 
 	do {
 		process_t * candidate = NULL;
-		int has_children = 0;
 
 		/* First, find out if there is anyone to reap */
-		foreach(node, proc->tree_entry->children) {
-			if (!node->value) {
-				continue;
-			}
-			process_t * child = ((tree_node_t *)node->value)->value;
-
-			if (wait_candidate(proc, pid, options, child)) {
-				has_children = 1;
-				if (child->finished) {
-					candidate = child;
-					break;
-				}
-				if ((options & WSTOPPED) && child->suspended) {
-					candidate = child;
-					break;
-				}
+		spin_lock(tree_lock);
+		foreach(node, &proc->zombies) {
+			if (wait_candidate(proc, pid, options, node->value)) {
+				candidate = node->value;
+				break;
 			}
 		}
+		spin_unlock(tree_lock);
 
-		if (!has_children) {
-			/* No valid children matching this description */
-			debug_print(INFO, "No children matching description.");
-			return -ECHILD;
+		if (!candidate && (options & WSTOPPED)) {
+			candidate = find_stopped_child(proc, pid, options);
 		}
 
 		if (candidate) {
@@ -871,16 +1304,22 @@ int waitpid(int pid, int * status, int options) {
 				reap_process(candidate);
 			}
 			return pid;
-		} else {
-			if (options & WNOHANG) {
-				return 0;
-			}
-			debug_print(INFO, "Sleeping until queue is done.");
-			/* Wait */
-			if (sleep_on(proc->wait_queue) != 0) {
-				debug_print(INFO, "wait() was interrupted");
-				return -EINTR;
-			}
+		}
+
+		if (!has_wait_candidate(proc, pid, options)) {
+			/* No valid children matching this description */
+			debug_print(INFO, "No children matching description.");
+			return -ECHILD;
+		}
+
+		if (options & WNOHANG) {
+			return 0;
+		}
+		debug_print(INFO, "Sleeping until queue is done.");
+		/* Wait */
+		if (sleep_on(proc->wait_queue) != 0) {
+			debug_print(INFO, "wait() was interrupted");
+			return -EINTR;
 		}
 	} while (1);
 }
@@ -928,21 +1367,9 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 		IRQ_OFF;
 		spin_lock(sleep_lock);
-		node_t * before = NULL;
-		foreach(node, sleep_queue) {
-			sleeper_t * candidate = ((sleeper_t *)node->value);
-			if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-				break;
-			}
-			before = node;
-		}
-		sleeper_t * proc = malloc(sizeof(sleeper_t));
-		proc->process     = process;
-		proc->end_tick    = s;
-		proc->end_subtick = ss;
-		proc->is_fswait = 1;
-		list_insert(((process_t *)process)->node_waits, proc);
-		process->timeout_node = list_insert_after(sleep_queue, before, proc);
+		sleeper_t * sleeper = new_sleeper(process, s, ss, 1);
+		list_insert(((process_t *)process)->node_waits, sleeper);
+		process->timeout_node = &sleeper->node;
 		spin_unlock(sleep_lock);
 		IRQ_RES;
 	} else {
@@ -961,21 +1388,24 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	list_free(process->node_waits);
 	free(process->node_waits);
 	process->node_waits = NULL;
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
+	IRQ_OFF;
+	if (process->timeout_node) {
+		/* Woken by a file before the timeout (an expired one is already cleared) */
+		spin_lock(sleep_lock);
+		timer_cancel(process->timeout_node);
+		process->timeout_node = NULL;
+		spin_unlock(sleep_lock);
 	}
-	process->timeout_node = NULL;
+	IRQ_RES;
 	make_process_ready(process);
 	return 0;
 }
 
 int process_alert_node(process_t * process, void * value) {
 
+	/* fswait sets only care which object alerted, not who it alerted */
+	fswait_alert(value);
+
 	if (!is_valid_process(process)) {
 		debug_print(WARNING, "Invalid process in alert from fswait.");
 		return 0;
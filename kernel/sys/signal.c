@@ -10,16 +10,38 @@
 #include <kernel/signal.h>
 #include <kernel/logging.h>
 
+#include <syscall_nums.h>
+
+/*
+ * Handlers return to a few bytes we leave on their stack, which make
+ * the sigreturn system call:
+ *     mov $SYS_SIGRETURN, %eax
+ *     int $0x7F
+ * That used to be a jump to SIGNAL_RETURN, and a page fault to catch
+ * it, which is still understood for anything that ends up there.
+ */
+static uint8_t sigreturn_code[8] = {
+	0xB8, SYS_SIGRETURN, 0x00, 0x00, 0x00,
+	0xCD, 0x7F,
+	0x90,
+};
+
 void enter_signal_handler(uintptr_t location, int signum, uintptr_t stack) {
 	IRQ_OFF;
 	uintptr_t ebp = current_process->syscall_registers->ebp;
 	uintptr_t esp = current_process->syscall_registers->useresp;
+
+	/* Below whatever the interrupted code had on its stack */
+	stack = (stack - 128 - sizeof(sigreturn_code)) & ~0xF;
+	memcpy((void *)stack, sigreturn_code, sizeof(sigreturn_code));
+	uintptr_t ret = stack;
+
 	asm volatile(
 			"mov %2, %%esp\n"
 			"pushl %4\n"
 			"pushl %3\n"
 			"pushl %1\n"           /*          argument count   */
-			"pushl $" STRSTR(SIGNAL_RETURN) "\n"
+			"pushl %5\n"           /* Return to sigreturn_code  */
 			"mov $0x23, %%ax\n"    /* Segment selector */
 			"mov %%ax, %%ds\n"
 			"mov %%ax, %%es\n"
@@ -35,7 +57,7 @@ void enter_signal_handler(uintptr_t location, int signum, uintptr_t stack) {
 			"pushl $0x1B\n"
 			"pushl %0\n"           /* Push the entry point */
 			"iret\n"
-			: : "m"(location), "m"(signum), "r"(stack), "m"(ebp), "m"(esp) : "%ax", "%esp", "%eax");
+			: : "m"(location), "m"(signum), "r"(stack), "m"(ebp), "m"(esp), "m"(ret) : "%ax", "%esp", "%eax");
 
 	debug_print(CRITICAL, "Failed to jump to signal handler!");
 }
@@ -226,6 +248,11 @@ int send_signal(pid_t process, uint32_t signal, int force_root) {
 		return -EINVAL;
 	}
 
+	if (signalfd_post(receiver, signal)) {
+		/* Taken as an event by a signal descriptor instead */
+		return 0;
+	}
+
 	if (!receiver->signals.functions[signal] && !isdeadly[signal]) {
 		/* If we're blocking a signal and it's not going to kill us, don't deliver it */
 		return 0;
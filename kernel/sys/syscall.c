@@ -17,8 +17,15 @@
 #include <kernel/printf.h>
 #include <kernel/module.h>
 #include <kernel/args.h>
+#include <kernel/mmap.h>
+#include <kernel/trace.h>
+#include <kernel/random.h>
 
 #include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/futex.h>
+#include <sys/fswait.h>
 #include <syscall_nums.h>
 
 static char   hostname[256];
@@ -26,14 +33,16 @@ static size_t hostname_len = 0;
 
 #define FD_INRANGE(FD) \
 	((FD) < (int)current_process->fds->length && (FD) >= 0)
-#define FD_ENTRY(FD) \
+#define FD_FILE(FD) \
 	(current_process->fds->entries[(FD)])
+#define FD_ENTRY(FD) \
+	(FD_FILE(FD)->node)
 #define FD_CHECK(FD) \
-	(FD_INRANGE(FD) && FD_ENTRY(FD))
+	(FD_INRANGE(FD) && FD_FILE(FD))
 #define FD_OFFSET(FD) \
-	(current_process->fds->offsets[(FD)])
+	(FD_FILE(FD)->offset)
 #define FD_MODE(FD) \
-	(current_process->fds->modes[(FD)])
+	(FD_FILE(FD)->mode)
 
 #define PTR_INRANGE(PTR) \
 	((uintptr_t)(PTR) > current_process->image.entry)
@@ -73,6 +82,7 @@ static int sys_read(int fd, char * ptr, int len) {
 		}
 		uint32_t out = read_fs(node, FD_OFFSET(fd), len, (uint8_t *)ptr);
 		FD_OFFSET(fd) += out;
+		if ((int)out > 0) current_process->usage.bytes_read += out;
 		return (int)out;
 	}
 	return -EBADF;
@@ -101,6 +111,23 @@ static int sys_readdir(int fd, int index, struct dirent * entry) {
 	return -EBADF;
 }
 
+/*
+ * Read up to `count` entries from a directory at once,
+ * resuming from (and updating) the caller's cursor.
+ */
+static int sys_getdents(int fd, uint32_t * cursor, struct dirent * entries, int count) {
+	if (FD_CHECK(fd)) {
+		PTR_VALIDATE(cursor);
+		PTR_VALIDATE(entries);
+		if (!cursor || !entries || count < 0) return -EINVAL;
+		uint32_t pos = *cursor;
+		int ret = getdents_fs(FD_ENTRY(fd), &pos, entries, count);
+		*cursor = pos;
+		return ret;
+	}
+	return -EBADF;
+}
+
 static int sys_write(int fd, char * ptr, int len) {
 	if (FD_CHECK(fd)) {
 		PTR_VALIDATE(ptr);
@@ -111,11 +138,124 @@ static int sys_write(int fd, char * ptr, int len) {
 		}
 		uint32_t out = write_fs(node, FD_OFFSET(fd), len, (uint8_t *)ptr);
 		FD_OFFSET(fd) += out;
+		if ((int)out > 0) current_process->usage.bytes_written += out;
 		return out;
 	}
 	return -EBADF;
 }
 
+#define COPY_CHUNK 0x10000
+
+/*
+ * Copy data from one file to another without it passing through
+ * userspace. Offsets passed by pointer are used, and updated, in
+ * place of the descriptors' own.
+ */
+static int sys_copy_file_range(int fd_in, long * off_in, int fd_out, long * off_out, size_t len) {
+	if (!FD_CHECK(fd_in) || !FD_CHECK(fd_out)) {
+		return -EBADF;
+	}
+	PTR_VALIDATE(off_in);
+	PTR_VALIDATE(off_out);
+	if (!(FD_MODE(fd_in) & 01) || !(FD_MODE(fd_out) & 02)) {
+		return -EBADF;
+	}
+	fs_node_t * in  = FD_ENTRY(fd_in);
+	fs_node_t * out = FD_ENTRY(fd_out);
+	if (in == out) {
+		return -EINVAL;
+	}
+
+	uint64_t in_at  = off_in  ? (uint64_t)*off_in  : FD_OFFSET(fd_in);
+	uint64_t out_at = off_out ? (uint64_t)*off_out : FD_OFFSET(fd_out);
+
+	size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+	uint8_t * buf = malloc(chunk ? chunk : 1);
+	size_t copied = 0;
+	while (copied < len) {
+		size_t want = len - copied < chunk ? len - copied : chunk;
+		uint32_t r = read_fs(in, in_at, want, buf);
+		if ((int)r <= 0) break;
+		uint32_t w = write_fs(out, out_at, r, buf);
+		if ((int)w <= 0) break;
+		in_at  += w;
+		out_at += w;
+		copied += w;
+		if (w < r || r < want) break;
+	}
+	free(buf);
+
+	if (off_in) *off_in = in_at;   else FD_OFFSET(fd_in)  = in_at;
+	if (off_out) *off_out = out_at; else FD_OFFSET(fd_out) = out_at;
+	current_process->usage.bytes_read += copied;
+	current_process->usage.bytes_written += copied;
+	return copied;
+}
+
+/*
+ * Move data between a pipe and another file (or another pipe) without
+ * it passing through userspace, straight out of or into the pipe's own
+ * buffer. Either the input must be the read end of a pipe or the output
+ * the write end of one; the pipe side can't take an offset.
+ */
+static int sys_splice(int fd_in, long * off_in, int fd_out, long * off_out, size_t len) {
+	if (!FD_CHECK(fd_in) || !FD_CHECK(fd_out)) {
+		return -EBADF;
+	}
+	PTR_VALIDATE(off_in);
+	PTR_VALIDATE(off_out);
+	if (!(FD_MODE(fd_in) & 01) || !(FD_MODE(fd_out) & 02)) {
+		return -EBADF;
+	}
+	fs_node_t * in  = FD_ENTRY(fd_in);
+	fs_node_t * out = FD_ENTRY(fd_out);
+	if (in->device == out->device) {
+		return -EINVAL;
+	}
+
+	int moved;
+	if (unixpipe_is_reader(in)) {
+		if (off_in) return -ESPIPE;
+		uint64_t out_at = off_out ? (uint64_t)*off_out : FD_OFFSET(fd_out);
+		moved = unixpipe_splice_out(in, out, &out_at, len);
+		if (off_out) *off_out = out_at; else FD_OFFSET(fd_out) = out_at;
+	} else if (unixpipe_is_writer(out)) {
+		if (off_out) return -ESPIPE;
+		uint64_t in_at = off_in ? (uint64_t)*off_in : FD_OFFSET(fd_in);
+		moved = unixpipe_splice_in(in, &in_at, out, len);
+		if (off_in) *off_in = in_at; else FD_OFFSET(fd_in) = in_at;
+	} else {
+		return -EINVAL;
+	}
+
+	if (moved > 0) {
+		current_process->usage.bytes_read += moved;
+		current_process->usage.bytes_written += moved;
+	}
+	return moved;
+}
+
+/* Duplicate what is waiting in one pipe into another, without consuming it */
+static int sys_tee(int fd_in, int fd_out, size_t len) {
+	if (!FD_CHECK(fd_in) || !FD_CHECK(fd_out)) {
+		return -EBADF;
+	}
+	if (!(FD_MODE(fd_in) & 01) || !(FD_MODE(fd_out) & 02)) {
+		return -EBADF;
+	}
+	fs_node_t * in  = FD_ENTRY(fd_in);
+	fs_node_t * out = FD_ENTRY(fd_out);
+	if (!unixpipe_is_reader(in) || !unixpipe_is_writer(out) || in->device == out->device) {
+		return -EINVAL;
+	}
+
+	int copied = unixpipe_tee(in, out, len);
+	if (copied > 0) {
+		current_process->usage.bytes_written += copied;
+	}
+	return copied;
+}
+
 static int sys_waitpid(int pid, int * status, int options) {
 	if (status && !PTR_INRANGE(status)) {
 		return -EINVAL;
@@ -192,6 +332,7 @@ static int sys_open(const char * file, int flags, int mode) {
 		close_fs(node);
 		return -EISDIR;
 	}
+	node->open_flags = flags;
 	int fd = process_append_fd((process_t *)current_process, node);
 	FD_MODE(fd) = access_bits;
 	if (flags & O_APPEND) {
@@ -214,13 +355,39 @@ static int sys_access(const char * file, int flags) {
 
 static int sys_close(int fd) {
 	if (FD_CHECK(fd)) {
-		close_fs(FD_ENTRY(fd));
-		FD_ENTRY(fd) = NULL;
+		process_close_fd((process_t *)current_process, fd);
 		return 0;
 	}
 	return -EBADF;
 }
 
+#define GETRANDOM_MAX 0x2000000
+
+/*
+ * Random bytes straight from the kernel CSPRNG, without having to
+ * open /dev/urandom. It never blocks, so the flags, which only say
+ * when to, are accepted and ignored.
+ */
+static int sys_getrandom(void * buf, size_t len, unsigned int flags) {
+	if (!buf) return -EFAULT;
+	PTR_VALIDATE(buf);
+	if (len > GETRANDOM_MAX) len = GETRANDOM_MAX;
+	random_get_bytes(buf, len);
+	return len;
+}
+
+static int sys_sync(void) {
+	sync_all();
+	return 0;
+}
+
+static int sys_fsync(int fd) {
+	if (FD_CHECK(fd)) {
+		return sync_fs(FD_ENTRY(fd));
+	}
+	return -EBADF;
+}
+
 static int sys_sbrk(int size) {
 	process_t * proc = (process_t *)current_process;
 	if (proc->group != 0) {
@@ -234,7 +401,8 @@ static int sys_sbrk(int size) {
 	while (proc->image.heap > proc->image.heap_actual) {
 		proc->image.heap_actual += 0x1000;
 		assert(proc->image.heap_actual % 0x1000 == 0);
-		alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
+		/* Frames are allocated when the pages are first written */
+		map_zero_frame(get_page(proc->image.heap_actual, 1, current_directory));
 		invalidate_tables_at(proc->image.heap_actual);
 	}
 	spin_unlock(proc->image.lock);
@@ -599,13 +767,13 @@ static int sys_sysfunc(int fn, char ** args) {
 	if (current_process->user == USER_ROOT_UID) {
 		switch (fn) {
 			case 3:
-				debug_print(ERROR, "sync is currently unimplemented");
-				//ext2_disk_sync();
+				sync_all();
 				return 0;
 			case 4:
 				/* Request kernel output to file descriptor in arg0*/
 				debug_print(NOTICE, "Setting output to file object in process %d's fd=%d!", getpid(), (int)args);
-				debug_file = current_process->fds->entries[(int)args];
+				if (!FD_CHECK((int)args)) return -EBADF;
+				debug_file = FD_ENTRY((int)args);
 				return 0;
 			case 5:
 				{
@@ -615,12 +783,19 @@ static int sys_sysfunc(int fn, char ** args) {
 						PTR_VALIDATE(arg);
 					debug_print(NOTICE, "Replacing process %d's file descriptors with pointers to %s", getpid(), (char *)args);
 					fs_node_t * repdev = kopen((char *)args, 0);
-					while (current_process->fds->length < 3) {
-						process_append_fd((process_t *)current_process, repdev);
+					if (!repdev) return -ENOENT;
+					process_t * proc = (process_t *)current_process;
+					int fd = process_append_fd(proc, repdev);
+					FD_MODE(fd) = 03;
+					while (proc->fds->length < 3) {
+						process_move_fd(proc, fd, -1);
+					}
+					for (int i = 0; i < 3; ++i) {
+						process_move_fd(proc, fd, i);
+					}
+					if (fd > 2) {
+						process_close_fd(proc, fd);
 					}
-					FD_ENTRY(0) = repdev;
-					FD_ENTRY(1) = repdev;
-					FD_ENTRY(2) = repdev;
 				}
 				return 0;
 			case 6:
@@ -693,11 +868,11 @@ static int sys_sysfunc(int fn, char ** args) {
 				proc->image.heap = (uintptr_t)address;
 				proc->image.heap_actual = proc->image.heap & 0xFFFFF000;
 				assert(proc->image.heap_actual % 0x1000 == 0);
-				alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
+				alloc_user_frame(current_directory, proc->image.heap_actual, 1);
 				invalidate_tables_at(proc->image.heap_actual);
 				while (proc->image.heap > proc->image.heap_actual) {
 					proc->image.heap_actual += 0x1000;
-					alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
+					alloc_user_frame(current_directory, proc->image.heap_actual, 1);
 					invalidate_tables_at(proc->image.heap_actual);
 				}
 				spin_unlock(proc->image.lock);
@@ -725,7 +900,7 @@ static int sys_sysfunc(int fn, char ** args) {
 
 				spin_lock(proc->image.lock);
 				for (size_t x = 0; x < size; x += 0x1000) {
-					alloc_frame(get_page(address + x, 1, current_directory), 0, 1);
+					alloc_user_frame(current_directory, address + x, 1);
 					invalidate_tables_at(address + x);
 				}
 				spin_unlock(proc->image.lock);
@@ -825,6 +1000,10 @@ static int sys_fork(void) {
 	return (int)fork();
 }
 
+static int sys_vfork(void) {
+	return (int)vfork();
+}
+
 static int sys_clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 	if (!new_stack || !PTR_INRANGE(new_stack)) return -EINVAL;
 	if (!thread_func || !PTR_INRANGE(thread_func)) return -EINVAL;
@@ -1011,6 +1190,71 @@ static int sys_fswait_multi(int c, int fds[], int timeout, int out[]) {
 	return result;
 }
 
+static int sys_fswait_create(void) {
+	fs_node_t * node = fswait_set_create();
+	open_fs(node, 0);
+	int fd = process_append_fd((process_t *)current_process, node);
+	FD_MODE(fd) = 01;
+	return fd;
+}
+
+static int sys_fswait_ctl(int set, int op, int fd, int flags) {
+	if (!FD_CHECK(set)) return -EBADF;
+	fs_node_t * node = NULL;
+	if (op == FSWAIT_ADD) {
+		if (!FD_CHECK(fd)) return -EBADF;
+		node = FD_ENTRY(fd);
+	}
+	return fswait_set_ctl(FD_ENTRY(set), op, fd, node, flags);
+}
+
+static int sys_fswait_wait(int set, int * out, int max, int timeout) {
+	PTR_VALIDATE(out);
+	if (!out) return -EFAULT;
+	if (!FD_CHECK(set)) return -EBADF;
+	return fswait_set_wait(FD_ENTRY(set), out, max, timeout);
+}
+
+static int sys_ioring_setup(unsigned int entries, struct ioring ** ring) {
+	PTR_VALIDATE(ring);
+	if (!ring) return -EFAULT;
+	fs_node_t * node = ioring_create(entries, ring);
+	if (!node) return -EINVAL;
+	open_fs(node, 0);
+	int fd = process_append_fd((process_t *)current_process, node);
+	FD_MODE(fd) = 01;
+	return fd;
+}
+
+static int sys_ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	return ioring_enter(FD_ENTRY(fd), to_submit, min_complete);
+}
+
+static int sys_sigreturn(void) {
+	if (!current_process->signal_kstack) return -EINVAL; /* Not in a handler */
+	return_from_signal_handler();
+	return 0;
+}
+
+static int sys_signalfd(int fd, uint64_t * mask, int flags) {
+	PTR_VALIDATE(mask);
+	if (!mask) return -EFAULT;
+	fs_node_t * existing = NULL;
+	if (fd != -1) {
+		if (!FD_CHECK(fd)) return -EBADF;
+		existing = FD_ENTRY(fd);
+	}
+	int error = 0;
+	fs_node_t * node = signalfd_create(existing, *mask, flags, &error);
+	if (!node) return error;
+	if (existing) return fd;
+	open_fs(node, 0);
+	fd = process_append_fd((process_t *)current_process, node);
+	FD_MODE(fd) = 01;
+	return fd;
+}
+
 static int sys_setsid(void) {
 	if (current_process->job == current_process->group) {
 		return -EPERM;
@@ -1078,6 +1322,109 @@ static int sys_getpgid(pid_t pid) {
 	return proc->job;
 }
 
+/*
+ * mmap() takes six arguments, which is more than fit in
+ * registers, so they are passed in as an array:
+ * addr, length, prot, flags, fd, offset
+ */
+static int sys_mmap(uintptr_t * args) {
+	PTR_VALIDATE(args);
+	uintptr_t addr  = args[0];
+	size_t    len   = args[1];
+	int       prot  = args[2];
+	int       flags = args[3];
+	int       fd    = args[4];
+	uint64_t  off   = args[5];
+
+	fs_node_t * node = NULL;
+	if (!(flags & MAP_ANONYMOUS)) {
+		if (!FD_CHECK(fd)) return -EBADF;
+		if (!(FD_MODE(fd) & 01)) return -EACCES;
+		if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !(FD_MODE(fd) & 02)) return -EACCES;
+		node = FD_ENTRY(fd);
+	}
+
+	return (int)mmap_map(addr, len, prot, flags, node, off);
+}
+
+static int sys_munmap(void * addr, size_t len) {
+	/* TODO: These virtual address bounds should be in a header somewhere */
+	if ((uintptr_t)addr < 0x20000000 || (uintptr_t)addr + len > USER_STACK_BOTTOM) return -EINVAL;
+	return mmap_unmap(current_directory, (uintptr_t)addr, len);
+}
+
+static int sys_futex(int * addr, int op, int val) {
+	if (!addr || ((uintptr_t)addr & 3)) return -EINVAL;
+	PTR_VALIDATE(addr);
+	switch (op) {
+		case FUTEX_WAIT:
+			return futex_wait(addr, val);
+		case FUTEX_WAKE:
+			return futex_wake(addr, val);
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Does `proc` fall under a setpriority()/getpriority() target?
+ * A `who` of 0 means the calling process, process group or user.
+ */
+static int priority_target(process_t * proc, int which, int who) {
+	switch (which) {
+		case PRIO_PROCESS:
+			if (!who) who = current_process->group ? current_process->group : current_process->id;
+			/* Threads belong to the process they were created by */
+			return proc->id == who || proc->group == who;
+		case PRIO_PGRP:
+			if (!who) who = current_process->job;
+			return proc->job == who;
+		case PRIO_USER:
+			if (!who) who = current_process->user;
+			return proc->user == (user_t)who;
+	}
+	return 0;
+}
+
+static int sys_setpriority(int which, int who, int prio) {
+	if (which != PRIO_PROCESS && which != PRIO_PGRP && which != PRIO_USER) return -EINVAL;
+
+	if (prio < PRIO_MIN) prio = PRIO_MIN;
+	if (prio >= PRIO_MAX) prio = PRIO_MAX - 1;
+
+	int found = 0;
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (proc->is_tasklet || !priority_target(proc, which, who)) continue;
+		found = 1;
+		if (current_process->user != USER_ROOT_UID) {
+			if (proc->user != current_process->user) return -EPERM;
+			/* Only root can make things more important */
+			if (prio < proc->nice) return -EACCES;
+		}
+		process_set_nice(proc, prio);
+	}
+
+	return found ? 0 : -ESRCH;
+}
+
+/*
+ * Returns 20 - nice, so that the result is always positive
+ * and can't be confused with an error; libc undoes this.
+ */
+static int sys_getpriority(int which, int who) {
+	if (which != PRIO_PROCESS && which != PRIO_PGRP && which != PRIO_USER) return -EINVAL;
+
+	int best = PRIO_MAX;
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (proc->is_tasklet || !priority_target(proc, which, who)) continue;
+		if (proc->nice < best) best = proc->nice;
+	}
+
+	return best == PRIO_MAX ? -ESRCH : 20 - best;
+}
+
 /*
  * System Call Internals
  */
@@ -1138,10 +1485,33 @@ static int (*syscalls[])() = {
 	[SYS_SETSID]       = sys_setsid,
 	[SYS_SETPGID]      = sys_setpgid,
 	[SYS_GETPGID]      = sys_getpgid,
+	[SYS_MMAP]         = sys_mmap,
+	[SYS_MUNMAP]       = sys_munmap,
+	[SYS_SETPRIORITY]  = sys_setpriority,
+	[SYS_GETPRIORITY]  = sys_getpriority,
+	[SYS_GETDENTS]     = sys_getdents,
+	[SYS_FUTEX]        = sys_futex,
+	[SYS_FSWAIT_CREATE] = sys_fswait_create,
+	[SYS_FSWAIT_CTL]   = sys_fswait_ctl,
+	[SYS_FSWAIT_WAIT]  = sys_fswait_wait,
+	[SYS_SYNC]         = sys_sync,
+	[SYS_FSYNC]        = sys_fsync,
+	[SYS_COPY_FILE_RANGE] = sys_copy_file_range,
+	[SYS_GETRANDOM]    = sys_getrandom,
+	[SYS_VFORK]        = sys_vfork,
+	[SYS_SPLICE]       = sys_splice,
+	[SYS_TEE]          = sys_tee,
+	[SYS_IORING_SETUP] = sys_ioring_setup,
+	[SYS_IORING_ENTER] = sys_ioring_enter,
+	[SYS_SIGRETURN]    = sys_sigreturn,
+	[SYS_SIGNALFD]     = sys_signalfd,
 };
 
 uint32_t num_syscalls = sizeof(syscalls) / sizeof(*syscalls);
 
+/* Calls by number, bucketed by log2 of the cycles they took */
+uint32_t syscall_latency[sizeof(syscalls) / sizeof(*syscalls)][SYSCALL_LATENCY_BUCKETS];
+
 typedef uint32_t (*scall_func)(unsigned int, ...);
 
 pid_t trace_pid = 0;
@@ -1159,13 +1529,31 @@ void syscall_handler(struct regs * r) {
 	/* Update the syscall registers for this process */
 	current_process->syscall_registers = r;
 
+	usage_t * usage = (usage_t *)&current_process->usage;
+	if (!usage->syscall_counts) {
+		usage->syscall_counts = calloc(num_syscalls, sizeof(uint32_t));
+	}
+	usage->syscall_counts[r->eax]++;
+	usage->syscalls++;
+
+	TRACE(TRACE_SYSCALL, "syscall %d (0x%x, 0x%x, 0x%x)", r->eax, r->ebx, r->ecx, r->edx);
+
 	if (trace_pid && current_process->id == trace_pid) {
 		debug_print(WARNING, "[syscall trace] %d (0x%x) 0x%x 0x%x 0x%x 0x%x 0x%x", r->eax, location, r->ebx, r->ecx, r->edx, r->esi, r->edi);
 	}
 
 	/* Call the syscall function */
+	uint32_t num = r->eax;
+	uint64_t start, end;
+	asm volatile ("rdtsc" : "=A" (start));
 	scall_func func = (scall_func)location;
 	uint32_t ret = func(r->ebx, r->ecx, r->edx, r->esi, r->edi);
+	asm volatile ("rdtsc" : "=A" (end));
+
+	/* Includes any time spent sleeping */
+	uint64_t cycles = end - start;
+	int bucket = cycles > 0xFFFFFFFF ? SYSCALL_LATENCY_BUCKETS - 1 : 31 - __builtin_clz((uint32_t)cycles | 1);
+	syscall_latency[num][bucket]++;
 
 	if ((current_process->syscall_registers == r) ||
 			(location != (uintptr_t)&fork && location != (uintptr_t)&clone)) {
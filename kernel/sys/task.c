@@ -12,6 +12,8 @@
 #include <kernel/logging.h>
 #include <kernel/shm.h>
 #include <kernel/mem.h>
+#include <kernel/mmap.h>
+#include <kernel/trace.h>
 
 #define TASK_MAGIC 0xDEADBEEF
 
@@ -23,6 +25,17 @@ uint32_t next_pid = 0;
 page_directory_t *kernel_directory;
 page_directory_t *current_directory;
 
+/*
+ * Count the resident pages in a user table
+ */
+static uint32_t table_resident(page_table_t * table) {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < 1024; ++i) {
+		if (page_is_resident(&table->pages[i])) count++;
+	}
+	return count;
+}
+
 /*
  * Clone a page directory and its contents.
  * (If you do not intend to clone the contents, do it yourself!)
@@ -46,7 +59,13 @@ clone_directory(
 	uint32_t i;
 	for (i = 0; i < 1024; ++i) {
 		/* Copy each table */
-		if (!src->tables[i] || (uintptr_t)src->tables[i] == (uintptr_t)0xFFFFFFFF) {
+		if (src->tables[i] == LARGE_PAGE_TABLE) {
+			/* A 4MiB kernel mapping; the entry is the whole thing */
+			dir->tables[i] = src->tables[i];
+			dir->physical_tables[i] = src->physical_tables[i];
+			continue;
+		}
+		if (!src->tables[i]) {
 			continue;
 		}
 		if (kernel_directory->tables[i] == src->tables[i]) {
@@ -55,13 +74,18 @@ clone_directory(
 			dir->physical_tables[i] = src->physical_tables[i];
 		} else {
 			if (i * 0x1000 * 1024 < SHM_START) {
-				/* User tables must be cloned */
+				/* User tables must be cloned; sharing can bring swapped pages back into the source */
 				uintptr_t phys;
+				uint32_t before = table_resident(src->tables[i]);
 				dir->tables[i] = clone_table(src->tables[i], &phys);
 				dir->physical_tables[i] = phys | 0x07;
+				src->rss += table_resident(src->tables[i]) - before;
+				dir->rss += table_resident(dir->tables[i]);
 			}
 		}
 	}
+	/* Pages we haven't touched yet stay lazy in the copy */
+	mmap_clone(src, dir);
 	return dir;
 }
 
@@ -73,6 +97,8 @@ void release_directory(page_directory_t * dir) {
 
 	if (dir->ref_count < 1) {
 		uint32_t i;
+		/* Shared mappings write back through the tables, so do this first */
+		mmap_release(dir);
 		for (i = 0; i < 1024; ++i) {
 			if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) {
 				continue;
@@ -95,6 +121,7 @@ void release_directory(page_directory_t * dir) {
 void release_directory_for_exec(page_directory_t * dir) {
 	uint32_t i;
 	/* This better be the only owner of this directory... */
+	mmap_release(dir);
 	for (i = 0; i < 1024; ++i) {
 		if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
@@ -103,6 +130,7 @@ void release_directory_for_exec(page_directory_t * dir) {
 			if (i * 0x1000 * 1024 < USER_STACK_BOTTOM) {
 				for (uint32_t j = 0; j < 1024; ++j) {
 					if (dir->tables[i]->pages[j].frame) {
+						if (page_is_resident(&dir->tables[i]->pages[j])) dir->rss--;
 						free_frame(&(dir->tables[i]->pages[j]));
 					}
 				}
@@ -119,6 +147,9 @@ extern char * default_name;
 /*
  * Clone a page table
  *
+ * Frames are shared with the source table copy-on-write where
+ * possible; only device memory is copied eagerly.
+ *
  * @param src      Pointer to a page table to clone.
  * @param physAddr [out] Pointer to the physical address of the new page table
  * @return         A pointer to a new page table.
@@ -137,6 +168,10 @@ clone_table(
 		if (!src->pages[i].frame) {
 			continue;
 		}
+		/* Share it with the parent until someone writes to it */
+		if (share_frame(&src->pages[i], &table->pages[i])) {
+			continue;
+		}
 		/* Allocate a new frame */
 		alloc_frame(&table->pages[i], 0, 0);
 		/* Set the correct access bit */
@@ -197,6 +232,8 @@ uint32_t fork(void) {
 	/* Clone the current process' page directory */
 	page_directory_t * directory = clone_directory(current_directory);
 	assert(directory && "Could not allocate a new page directory!");
+	/* Our writable pages are now copy-on-write */
+	invalidate_page_tables();
 	/* Spawn a new process from this one */
 	debug_print(INFO,"\033[1;32mALLOC {\033[0m");
 	process_t * new_proc = spawn_process(current_process, 0);
@@ -232,6 +269,94 @@ uint32_t fork(void) {
 	return new_proc->id;
 }
 
+/*
+ * vfork.
+ *
+ * Like fork, but the child borrows our address space rather than
+ * getting a copy of it, so nothing is cloned. The child runs on our
+ * user stack, so we don't return to userspace until it has exec'd
+ * or exited; see vfork_release().
+ *
+ * @return To the parent: PID of the child; to the child: 0
+ */
+uint32_t vfork(void) {
+	IRQ_OFF;
+
+	uintptr_t esp, ebp;
+
+	current_process->syscall_registers->eax = 0;
+
+	process_t * parent = (process_t *)current_process;
+	assert(parent && "vforked from nothing??");
+	page_directory_t * directory = current_directory;
+	process_t * new_proc = spawn_process(current_process, 0);
+	assert(new_proc && "Could not allocate a new process!");
+	set_process_environment(new_proc, directory);
+	directory->ref_count++;
+
+	/* The heap is ours too, so start from where it really ends */
+	process_t * heap_owner = parent->group ? process_from_pid(parent->group) : parent;
+	new_proc->image.heap        = heap_owner->image.heap;
+	new_proc->image.heap_actual = heap_owner->image.heap_actual;
+
+	list_t * wait = list_create();
+	new_proc->vfork_wait = wait;
+
+	struct regs r;
+	memcpy(&r, current_process->syscall_registers, sizeof(struct regs));
+	new_proc->syscall_registers = &r;
+
+	esp = new_proc->image.stack;
+	ebp = esp;
+
+	new_proc->syscall_registers->eax = 0;
+
+	PUSH(esp, struct regs, r);
+
+	new_proc->thread.esp = esp;
+	new_proc->thread.ebp = ebp;
+
+	new_proc->is_tasklet = parent->is_tasklet;
+
+	new_proc->thread.eip = (uintptr_t)&return_to_userspace;
+
+	make_process_ready(new_proc);
+
+	/* Signals don't get us out of this; the child is using our stack */
+	while (new_proc->vfork_wait) {
+		sleep_on(wait);
+		IRQ_OFF;
+	}
+	list_free(wait);
+	free(wait);
+
+	IRQ_RES;
+
+	return new_proc->id;
+}
+
+/*
+ * A vforked child is done with its parent's address space,
+ * because it is about to exec or exit; let the parent go.
+ */
+void vfork_release(process_t * proc) {
+	list_t * wait = proc->vfork_wait;
+	if (!wait) return;
+
+	/* Whatever it sbrk'd came out of the parent's heap */
+	process_t * parent = process_get_parent(proc);
+	if (parent) {
+		process_t * heap_owner = parent->group ? process_from_pid(parent->group) : parent;
+		if (heap_owner) {
+			heap_owner->image.heap        = proc->image.heap;
+			heap_owner->image.heap_actual = proc->image.heap_actual;
+		}
+	}
+
+	proc->vfork_wait = NULL;
+	wakeup_queue(wait);
+}
+
 int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp) {
 	IRQ_OFF;
 
@@ -407,6 +532,12 @@ void switch_task(uint8_t reschedule) {
 	current_process->thread.ebp = ebp;
 	current_process->running = 0;
 
+	if (reschedule && current_process->sched_preempted) {
+		current_process->usage.involuntary_switches++;
+	} else {
+		current_process->usage.voluntary_switches++;
+	}
+
 	/* Save floating point state */
 	switch_fpu();
 
@@ -428,6 +559,7 @@ void switch_next(void) {
 	uintptr_t esp, ebp, eip;
 	/* Get the next available process */
 	current_process = next_ready_process();
+	TRACE(TRACE_SCHED, "switch to %d", current_process->id);
 	/* Retreive the ESP/EBP/EIP */
 	eip = current_process->thread.eip;
 	esp = current_process->thread.esp;
@@ -512,6 +644,7 @@ void task_exit(int retval) {
 		return;
 	}
 	cleanup_process((process_t *)current_process, retval);
+	vfork_release((process_t *)current_process);
 
 	process_t * parent = process_get_parent((process_t *)current_process);
 
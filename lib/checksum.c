@@ -0,0 +1,232 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * libtoaru_checksum: CRC-32 (as used by gzip, PNG and zip) and Adler-32.
+ *
+ * The CRC is computed eight bytes at a time from eight tables ("slicing
+ * by 8"), generated the first time they're needed. In userspace, CPUs
+ * with carry-less multiply fold 64 bytes per iteration instead, which
+ * is several times faster again; the kernel doesn't save SSE state for
+ * itself, so it always uses the tables.
+ */
+#ifdef _KERNEL_
+# include <kernel/types.h>
+#else
+# include <stdint.h>
+# include <stddef.h>
+# include <cpuid.h>
+# include <emmintrin.h>
+# include <smmintrin.h>
+# include <wmmintrin.h>
+#endif
+
+#include <toaru/checksum.h>
+
+#define CRC32_POLY 0xEDB88320
+
+static uint32_t crc32_tables[8][256];
+static int crc32_ready = 0;
+
+static void crc32_init(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+		}
+		crc32_tables[0][i] = c;
+	}
+	/* tables[k][i] is the CRC of byte i followed by k zero bytes */
+	for (int i = 0; i < 256; ++i) {
+		uint32_t c = crc32_tables[0][i];
+		for (int k = 1; k < 8; ++k) {
+			c = crc32_tables[0][c & 0xFF] ^ (c >> 8);
+			crc32_tables[k][i] = c;
+		}
+	}
+}
+
+/* Takes and returns the CRC in its working (inverted) form */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t * p, size_t len) {
+	while (len && ((uintptr_t)p & 3)) {
+		crc = crc32_tables[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	const uint32_t * w = (const uint32_t *)p;
+	while (len >= 8) {
+		uint32_t one = *w++ ^ crc;
+		uint32_t two = *w++;
+		crc = crc32_tables[7][one & 0xFF] ^
+		      crc32_tables[6][(one >> 8) & 0xFF] ^
+		      crc32_tables[5][(one >> 16) & 0xFF] ^
+		      crc32_tables[4][one >> 24] ^
+		      crc32_tables[3][two & 0xFF] ^
+		      crc32_tables[2][(two >> 8) & 0xFF] ^
+		      crc32_tables[1][(two >> 16) & 0xFF] ^
+		      crc32_tables[0][two >> 24];
+		len -= 8;
+	}
+
+	p = (const uint8_t *)w;
+	while (len--) {
+		crc = crc32_tables[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifndef _KERNEL_
+/**
+ * Folding with PCLMULQDQ, after Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The constants are
+ * powers of x modulo the (bit-reflected) polynomial, for folding across
+ * 512, 128 and 64 bits, followed by a Barrett reduction. Needs at least
+ * 64 bytes and consumes a multiple of 16; works on the inverted CRC.
+ */
+__attribute__((__force_align_arg_pointer__, target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t * buf, size_t len) {
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* Four lanes, each folded forward 512 bits into the next block */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the lanes together, then any remaining 16-byte blocks */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static int crc32_has_pclmul = 0;
+#endif
+
+uint32_t checksum_crc32(uint32_t crc, const void * buf, size_t len) {
+	if (!buf) return 0;
+
+	if (!crc32_ready) {
+		crc32_init();
+#ifndef _KERNEL_
+		unsigned int eax, ebx, ecx, edx;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) {
+			crc32_has_pclmul = 1;
+		}
+#endif
+		crc32_ready = 1;
+	}
+
+	const uint8_t * p = buf;
+	crc = ~crc;
+
+#ifndef _KERNEL_
+	if (crc32_has_pclmul && len >= 64) {
+		size_t chunk = len & ~(size_t)15;
+		crc = crc32_pclmul(crc, p, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+#endif
+
+	return ~crc32_slice8(crc, p, len);
+}
+
+/* Largest n such that 255n(n+1)/2 + (n+1)(65520) fits in 32 bits */
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+uint32_t checksum_adler32(uint32_t adler, const void * buf, size_t len) {
+	if (!buf) return 1;
+
+	const uint8_t * p = buf;
+	uint32_t a = adler & 0xFFFF;
+	uint32_t b = adler >> 16;
+
+	/* Reduce only once per NMAX bytes, rather than on every one */
+	while (len) {
+		size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+		len -= n;
+		while (n >= 8) {
+			a += p[0]; b += a;
+			a += p[1]; b += a;
+			a += p[2]; b += a;
+			a += p[3]; b += a;
+			a += p[4]; b += a;
+			a += p[5]; b += a;
+			a += p[6]; b += a;
+			a += p[7]; b += a;
+			p += 8;
+			n -= 8;
+		}
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= ADLER_BASE;
+		b %= ADLER_BASE;
+	}
+
+	return (b << 16) | a;
+}
@@ -56,13 +56,17 @@ int confreader_write(confreader_t * config, const char * file) {
 			write_section(f, data);
 		}
 	}
+	list_free(sections);
+	free(sections);
 
+	fclose(f);
 	return 0;
 }
 
 confreader_t * confreader_create_empty(void) {
 	confreader_t * out = malloc(sizeof(confreader_t));
 	out->sections = hashmap_create(10);
+	out->sections->hash_val_free = free_hashmap;
 	return out;
 }
 
@@ -72,78 +76,61 @@ confreader_t * confreader_load(const char * file) {
 
 	if (!f) return NULL;
 
+	/* Take the whole file in at once and pick it apart in place */
+	size_t size = 0;
+	size_t avail = 1024;
+	char * buf = malloc(avail);
+	size_t r;
+	while ((r = fread(buf + size, 1, avail - size - 1, f)) > 0) {
+		size += r;
+		if (size + 1 == avail) {
+			avail *= 2;
+			buf = realloc(buf, avail);
+		}
+	}
+	buf[size] = '\0';
+
+	fclose(f);
+
 	confreader_t * out = confreader_create_empty();
 
 	hashmap_t * current_section = hashmap_create(10);
-	current_section->hash_val_free = free_hashmap;
+	current_section->hash_val_free = free;
 
 	hashmap_set(out->sections, "", current_section);
 
-	if (!f) {
-		/* File does not exist, no configuration values, but continue normally. */
-		return out;
-	}
-
-	char tmp[1024];
-	char tmp2[1024];
-
-	while (!feof(f)) {
-		char c = fgetc(f);
-		tmp[0] = '\0';
-		tmp2[0] = '\0';
-		if (c == ';') {
-			TRACE("Comment");
-			while (!feof(f) && fgetc(f) != '\n');
-			TRACE("Done");
-		} else if (c == '\n' || c == EOF) {
-			TRACE("blank line or EOF: %d", c);
-			continue;
-		} else if (c == '[') {
-			TRACE("section");
-			char * foo = tmp;
-			int i;
-			while ((i = fgetc(f)) >= 0) {
-				if (i == ']') break;
-				*foo = i;
-				foo++;
-				*foo = '\0';
-			}
-			while (!feof(f) && fgetc(f) != '\n');
+	char * line = buf;
+	char * end = buf + size;
+	while (line < end) {
+		char * eol = memchr(line, '\n', end - line);
+		if (!eol) eol = end;
+		*eol = '\0';
+
+		if (*line == ';' || *line == '\0') {
+			TRACE("Comment or blank line");
+		} else if (*line == '[') {
+			char * close = strchr(line + 1, ']');
+			if (close) *close = '\0';
 			current_section = hashmap_create(10);
-			TRACE("adding section %s", tmp);
-			hashmap_set(out->sections, tmp, current_section);
-			TRACE("section is over");
+			current_section->hash_val_free = free;
+			TRACE("adding section %s", line + 1);
+			hashmap_t * old = hashmap_set(out->sections, line + 1, current_section);
+			if (old) free_hashmap(old);
 		} else {
-			TRACE("value");
-			char * foo = tmp;
-			*foo = c;
-			foo++;
-			int i;
-			while ((i = fgetc(f)) >= 0) {
-				if (i == '=') break;
-				*foo = i;
-				foo++;
-				*foo = '\0';
-			}
-			if (i != '=') {
+			char * equals = strchr(line, '=');
+			if (equals) {
+				*equals = '\0';
+				TRACE("setting value %s to %s", line, equals + 1);
+				free(hashmap_set(current_section, line, strdup(equals + 1)));
+			} else {
 				TRACE("no equals sign");
-				while (!feof(f) && fgetc(f) != '\n');
-				continue;
 			}
-			TRACE("=");
-			foo = tmp2;
-			while ((i = fgetc(f)) >= 0) {
-				if (i == '\n') break;
-				*foo = i;
-				foo++;
-				*foo = '\0';
-			}
-			TRACE("setting value %s to %s", tmp, tmp2);
-			hashmap_set(current_section, tmp, strdup(tmp2));
 		}
+
+		line = eol + 1;
 	}
 
-	fclose(f);
+	free(buf);
 
 	TRACE("done reading");
 
@@ -63,12 +63,72 @@ static int get_bounds_fancy(yutani_window_t * window, struct decor_bounds * boun
 	return 0;
 }
 
-static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * ctx, char * title, int decors_active) {
+/*
+ * What we drew for the last few (size, flags, focus, title) combinations,
+ * so redrawing decorations that haven't changed - a focus change flipping
+ * back and forth, or a client redrawing its whole window - is a copy.
+ */
+#define CACHE_ENTRIES 4
+
+struct decor_cache {
+	int width;
+	int height;
+	uint32_t flags;
+	int active;
+	char * title;
+	uint32_t * pixels; /* Top rows, bottom rows, then the sides of each row between */
+	size_t size;
+};
+
+static struct decor_cache cache[CACHE_ENTRIES];
+static int cache_next = 0;
+
+/* Copy the decorated border of ctx into the cache entry, or back out of it */
+static void cache_copy(struct decor_cache * entry, gfx_context_t * ctx, struct decor_bounds * bounds, int save) {
+	uint32_t * p = entry->pixels;
+	int width = entry->width;
+	int height = entry->height;
+
+#define SPAN(x,y,n) do { \
+	uint32_t * row = &GFX(ctx,x,y); \
+	if (save) memcpy(p, row, (n) * sizeof(uint32_t)); \
+	else memcpy(row, p, (n) * sizeof(uint32_t)); \
+	p += (n); \
+} while (0)
+
+	for (int j = 0; j < bounds->top_height; ++j) {
+		SPAN(0, j, width);
+	}
+	for (int j = height - bounds->bottom_height; j < height; ++j) {
+		SPAN(0, j, width);
+	}
+	for (int j = bounds->top_height; j < height - bounds->bottom_height; ++j) {
+		SPAN(0, j, bounds->left_width);
+		SPAN(width - bounds->right_width, j, bounds->right_width);
+	}
+#undef SPAN
+}
+
+static struct decor_cache * cache_find(yutani_window_t * window, char * title, int decors_active) {
+	for (int i = 0; i < CACHE_ENTRIES; ++i) {
+		struct decor_cache * entry = &cache[i];
+		if (entry->pixels &&
+			entry->width == (int)window->width &&
+			entry->height == (int)window->height &&
+			entry->flags == window->decorator_flags &&
+			entry->active == decors_active &&
+			!strcmp(entry->title, title)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void render_decorations_uncached(yutani_window_t * window, gfx_context_t * ctx, char * title, int decors_active, struct decor_bounds * _bounds) {
 	int width = window->width;
 	int height = window->height;
 
-	struct decor_bounds bounds;
-	get_bounds_fancy(window, &bounds);
+	struct decor_bounds bounds = *_bounds;
 
 	for (int j = 0; j < (int)bounds.top_height; ++j) {
 		for (int i = 0; i < width; ++i) {
@@ -183,6 +243,44 @@ static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * c
 	}
 }
 
+static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * ctx, char * title, int decors_active) {
+	struct decor_bounds bounds;
+	get_bounds_fancy(window, &bounds);
+
+	int width = window->width;
+	int height = window->height;
+	if (height < bounds.height || ctx->width < width || ctx->height < height) {
+		render_decorations_uncached(window, ctx, title, decors_active, &bounds);
+		return;
+	}
+
+	struct decor_cache * entry = cache_find(window, title, decors_active);
+	if (entry) {
+		cache_copy(entry, ctx, &bounds, 0);
+		return;
+	}
+
+	render_decorations_uncached(window, ctx, title, decors_active, &bounds);
+
+	entry = &cache[cache_next];
+	cache_next = (cache_next + 1) % CACHE_ENTRIES;
+
+	size_t size = (bounds.top_height + bounds.bottom_height) * width +
+		(height - bounds.height) * (bounds.left_width + bounds.right_width);
+	if (entry->size < size) {
+		free(entry->pixels);
+		entry->pixels = malloc(size * sizeof(uint32_t));
+		entry->size = size;
+	}
+	free(entry->title);
+	entry->title = strdup(title);
+	entry->width = width;
+	entry->height = height;
+	entry->flags = window->decorator_flags;
+	entry->active = decors_active;
+	cache_copy(entry, ctx, &bounds, 1);
+}
+
 static int check_button_press_fancy(yutani_window_t * window, int x, int y) {
 	if (x >= (int)window->width - 28 + BUTTON_OFFSET && x <= (int)window->width - 18 + BUTTON_OFFSET &&
 		y >= 16 && y <= 26) {
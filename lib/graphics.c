@@ -18,6 +18,8 @@
 #ifndef NO_SSE
 #include <xmmintrin.h>
 #include <emmintrin.h>
+#include <tmmintrin.h>
+#include <cpuid.h>
 #endif
 
 #include <kernel/video.h>
@@ -75,6 +77,53 @@ void gfx_no_clip(gfx_context_t * ctx) {
 }
 
 /* Pointer to graphics memory */
+/*
+ * Copy a row to video memory. The framebuffer is write-combined and
+ * we never read it back, so bypass the cache with streaming stores.
+ */
+#ifndef NO_SSE
+static void _flip_row(uint32_t * dst, const uint32_t * src, size_t count) {
+	while (count && ((uintptr_t)dst & 15)) {
+		*dst++ = *src++;
+		count--;
+	}
+	for (; count >= 4; count -= 4, dst += 4, src += 4) {
+		_mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+	}
+	while (count--) {
+		*dst++ = *src++;
+	}
+}
+#else
+static void _flip_row(uint32_t * dst, const uint32_t * src, size_t count) {
+	memcpy(dst, src, count * sizeof(uint32_t));
+}
+#endif
+
+/**
+ * Copy just the given rectangles from the backbuffer to the screen.
+ * Rectangles are clipped to the context.
+ */
+#ifndef NO_SSE
+__attribute__((__force_align_arg_pointer__))
+#endif
+void flip_regions(gfx_context_t * ctx, const gfx_rect_t * rects, int count) {
+	for (int i = 0; i < count; ++i) {
+		int32_t left   = max(rects[i].x, 0);
+		int32_t top    = max(rects[i].y, 0);
+		int32_t right  = min(rects[i].x + (int32_t)rects[i].width,  (int32_t)ctx->width);
+		int32_t bottom = min(rects[i].y + (int32_t)rects[i].height, (int32_t)ctx->height);
+		if (left >= right) continue;
+		for (int32_t y = top; y < bottom; ++y) {
+			_flip_row(&GFXR(ctx, left, y), &GFX(ctx, left, y), right - left);
+		}
+	}
+#ifndef NO_SSE
+	/* Make sure the streamed data is out before anyone looks at the screen */
+	_mm_sfence();
+#endif
+}
+
 void flip(gfx_context_t * ctx) {
 	if (ctx->clips) {
 		for (size_t i = 0; i < ctx->height; ++i) {
@@ -83,7 +132,8 @@ void flip(gfx_context_t * ctx) {
 			}
 		}
 	} else {
-		memcpy(ctx->buffer, ctx->backbuffer, ctx->size);
+		gfx_rect_t all = { 0, 0, ctx->width, ctx->height };
+		flip_regions(ctx, &all, 1);
 	}
 }
 
@@ -155,8 +205,45 @@ gfx_context_t * init_graphics_subregion(gfx_context_t * base, int x, int y, int
 	return out;
 }
 
+/* Page currently on screen when page flipping, or -1 */
+static int framebuffer_page = -1;
+
+int init_graphics_page_flip(gfx_context_t * out) {
+	size_t pages = 1;
+	ioctl(framebuffer_fd, IO_VID_PAGES, &pages);
+	if (pages < 2) return -1;
+
+	uint32_t page = 0;
+	if (ioctl(framebuffer_fd, IO_VID_FLIP, &page) < 0) return -1;
+
+	if (out->backbuffer != out->buffer) {
+		free(out->backbuffer);
+	}
+	/* Start both pages out the same so callers only have to redraw what changes */
+	out->backbuffer = out->buffer + out->size;
+	memcpy(out->backbuffer, out->buffer, out->size);
+	framebuffer_page = 0;
+	return 0;
+}
+
+void gfx_page_flip(gfx_context_t * out) {
+	uint32_t page = !framebuffer_page;
+	ioctl(framebuffer_fd, IO_VID_FLIP, &page);
+	framebuffer_page = page;
+
+	char * tmp = out->buffer;
+	out->buffer = out->backbuffer;
+	out->backbuffer = tmp;
+}
+
 void reinit_graphics_fullscreen(gfx_context_t * out) {
 
+	if (framebuffer_page >= 0) {
+		/* Modesetting put us back on the first page; go back to a normal backbuffer */
+		framebuffer_page = -1;
+		out->backbuffer = NULL;
+	}
+
 	ioctl(framebuffer_fd, IO_VID_WIDTH,  &out->width);
 	ioctl(framebuffer_fd, IO_VID_HEIGHT, &out->height);
 	ioctl(framebuffer_fd, IO_VID_DEPTH,  &out->depth);
@@ -217,7 +304,10 @@ sprite_t * create_sprite(size_t width, size_t height, int alpha) {
 	return out;
 }
 
+static void _scale_cache_forget(sprite_t * sprite);
+
 void sprite_free(sprite_t * sprite) {
+	_scale_cache_forget(sprite);
 	if (sprite->masks) {
 		free(sprite->masks);
 	}
@@ -282,6 +372,122 @@ uint32_t premultiply(uint32_t color) {
 	return rgba(r,g,b,a);
 }
 
+#ifndef NO_SSE
+/*
+ * Box blur with each pixel held as four 32-bit channel sums in one
+ * register. Both passes keep running sums and touch memory row by row:
+ * the vertical pass keeps a sum per column and slides every column
+ * down together, rather than walking the columns one at a time.
+ */
+
+/* A pixel widened to one 32-bit lane per channel */
+static inline __m128i _blur_widen(uint32_t px) {
+	__m128i p = _mm_cvtsi32_si128(px);
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(p, _mm_setzero_si128()), _mm_setzero_si128());
+}
+
+/* Channel sums over a window of hits pixels (inv = 1 / hits), truncated back into a pixel */
+static inline uint32_t _blur_average(__m128i sum, float inv) {
+	/* (sum + 0.5) / hits keeps the truncation exact where sum / hits is a whole number */
+	__m128 f = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(0.5f)), _mm_set1_ps(inv));
+	__m128i q = _mm_cvttps_epi32(f);
+	q = _mm_packs_epi32(q, q);
+	return _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+}
+
+/* 1 / (pixels within half_radius of each position, inside [0, n)) */
+static float * _blur_weights(int n, int half_radius) {
+	float * inv = malloc(sizeof(float) * n);
+	for (int i = 0; i < n; ++i) {
+		inv[i] = 1.0f / (min(i + half_radius, n - 1) - max(i - half_radius, 0) + 1);
+	}
+	return inv;
+}
+
+__attribute__((__force_align_arg_pointer__))
+static void _box_blur_horizontal(gfx_context_t * _src, int radius) {
+	int w = _src->width;
+	int h = _src->height;
+	int half_radius = radius / 2;
+	uint32_t * out_color = malloc(sizeof(uint32_t) * w);
+	float * inv = _blur_weights(w, half_radius);
+
+	for (int y = 0; y < h; y++) {
+		if (!_is_in_clip(_src, y)) continue;
+		uint32_t * row = &GFX(_src, 0, y);
+
+		__m128i sum = _mm_setzero_si128();
+		for (int x = 0; x < half_radius && x < w; x++) {
+			sum = _mm_add_epi32(sum, _blur_widen(row[x]));
+		}
+
+		for (int x = 0; x < w; x++) {
+			if (x + half_radius < w) {
+				sum = _mm_add_epi32(sum, _blur_widen(row[x + half_radius]));
+			}
+			if (x - half_radius - 1 >= 0) {
+				sum = _mm_sub_epi32(sum, _blur_widen(row[x - half_radius - 1]));
+			}
+			out_color[x] = _blur_average(sum, inv[x]);
+		}
+
+		memcpy(row, out_color, sizeof(uint32_t) * w);
+	}
+
+	free(inv);
+	free(out_color);
+}
+
+__attribute__((__force_align_arg_pointer__))
+static void _box_blur_vertical(gfx_context_t * _src, int radius) {
+	int w = _src->width;
+	int h = _src->height;
+	int half_radius = radius / 2;
+	int32_t * sums = calloc(sizeof(int32_t) * 4, w);
+	float * inv = _blur_weights(h, half_radius);
+
+	/*
+	 * Rows are blurred in place, but each is still needed as input until
+	 * the window has slid past it, so keep the last half_radius + 1
+	 * originals aside.
+	 */
+	int saved_rows = half_radius + 1;
+	uint32_t * saved = malloc(sizeof(uint32_t) * w * saved_rows);
+
+	for (int y = 0; y < half_radius && y < h; y++) {
+		uint32_t * row = &GFX(_src, 0, y);
+		for (int x = 0; x < w; x++) {
+			__m128i s = _mm_loadu_si128((void *)&sums[x * 4]);
+			_mm_storeu_si128((void *)&sums[x * 4], _mm_add_epi32(s, _blur_widen(row[x])));
+		}
+	}
+
+	for (int y = 0; y < h; y++) {
+		uint32_t * row = &GFX(_src, 0, y);
+		uint32_t * incoming = (y + half_radius < h) ? &GFX(_src, 0, y + half_radius) : NULL;
+		uint32_t * slot = &saved[(y % saved_rows) * w];
+		uint32_t * outgoing = (y - half_radius - 1 >= 0) ? slot : NULL;
+		int write = _is_in_clip(_src, y);
+
+		for (int x = 0; x < w; x++) {
+			__m128i s = _mm_loadu_si128((void *)&sums[x * 4]);
+			if (incoming) s = _mm_add_epi32(s, _blur_widen(incoming[x]));
+			if (outgoing) s = _mm_sub_epi32(s, _blur_widen(outgoing[x]));
+			_mm_storeu_si128((void *)&sums[x * 4], s);
+
+			/* The outgoing row's slot now holds this row's original */
+			slot[x] = row[x];
+			if (write) {
+				row[x] = _blur_average(s, inv[y]);
+			}
+		}
+	}
+
+	free(saved);
+	free(inv);
+	free(sums);
+}
+#else
 static int clamp(int a, int l, int h) {
 	return a < l ? l : (a > h ? h : a);
 }
@@ -391,6 +597,8 @@ static void _box_blur_vertical(gfx_context_t * _src, int radius) {
 	free(out_color);
 }
 
+#endif
+
 void blur_context_box(gfx_context_t * _src, int radius) {
 	_box_blur_horizontal(_src,radius);
 	_box_blur_vertical(_src,radius);
@@ -568,136 +776,237 @@ _cleanup_sprite:
 	return 0;
 }
 
+/*
+ * Row kernels.
+ *
+ * Each blends count pixels of one row; callers clip first, so the
+ * kernels never check bounds. All blending is premultiplied "over".
+ * With SSE2 they do four pixels at a time once the destination is
+ * aligned; the plain blend also has an SSSE3 variant, picked at load
+ * time when the CPU has it. (The kernel only saves XMM state, so
+ * there is no AVX variant.)
+ */
 #ifndef NO_SSE
 static __m128i mask00ff;
 static __m128i mask0080;
 static __m128i mask0101;
+static __m128i alpha_lo;
+static __m128i alpha_hi;
 
-__attribute__((constructor)) static void _masks(void) {
-	mask00ff = _mm_set1_epi16(0x00FF);
-	mask0080 = _mm_set1_epi16(0x0080);
-	mask0101 = _mm_set1_epi16(0x0101);
+/* x / 255 for each 16-bit lane, rounded */
+static inline __m128i _div255(__m128i x) {
+	return _mm_mulhi_epu16(_mm_adds_epu16(x, mask0080), mask0101);
 }
-#endif
 
-__attribute__((__force_align_arg_pointer__))
-void draw_sprite(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y) {
+/* Blend four source pixels over four destination pixels, given the source alpha spread across each pixel's lanes */
+static inline __m128i _blend4(__m128i d, __m128i s, __m128i a_l, __m128i a_h) {
+	__m128i d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+	__m128i d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
 
-	int32_t _left   = max(x, 0);
-	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	if (sprite->alpha == ALPHA_MASK) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y), SMASKS(sprite, _x, _y));
-			}
-		}
-	} else if (sprite->alpha == ALPHA_EMBEDDED) {
-		/* Alpha embedded is the most important step. */
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-#ifdef NO_SSE
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
-#else
-			uint16_t _x = 0;
-
-			/* Ensure alignment */
-			for (; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				if (!((uintptr_t)&GFX(ctx, x + _x, y + _y) & 15))
-					break;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
-			for (; _x < sprite->width - 3; _x += 4) {
-				if (x + _x < _left || y + _y < _top || y + _y > _bottom) {
-					continue;
-				}
-				if (x + _x + 3 > _right)
-					break;
+	// apply negated source alpha to destination
+	d_l = _div255(_mm_mullo_epi16(d_l, _mm_xor_si128(a_l, mask00ff)));
+	d_h = _div255(_mm_mullo_epi16(d_h, _mm_xor_si128(a_h, mask00ff)));
+
+	// combine source and destination
+	return _mm_adds_epu8(s, _mm_packus_epi16(d_l, d_h));
+}
+
+static inline __m128i _blend4_sse2(__m128i d, __m128i s) {
+	__m128i s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+	__m128i s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+
+	// extract source alpha RGBA → AAAA
+	__m128i a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	__m128i a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_h, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+
+	return _blend4(d, s, a_l, a_h);
+}
 
-				__m128i d = _mm_load_si128((void *)&GFX(ctx, x + _x, y + _y));
-				__m128i s = _mm_loadu_si128((void *)&SPRITE(sprite, _x, _y));
+__attribute__((__force_align_arg_pointer__))
+static void blend_row_sse2(uint32_t * dst, const uint32_t * src, int count) {
+	int i = 0;
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+	for (; i + 4 <= count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+		_mm_store_si128((void *)&dst[i], _blend4_sse2(d, s));
+	}
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+}
 
-				__m128i d_l, d_h;
-				__m128i s_l, s_h;
+/* SSSE3 can spread the alpha bytes straight from the packed source */
+__attribute__((__force_align_arg_pointer__, target("ssse3")))
+static void blend_row_ssse3(uint32_t * dst, const uint32_t * src, int count) {
+	int i = 0;
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+	for (; i + 4 <= count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+		__m128i a_l = _mm_shuffle_epi8(s, alpha_lo);
+		__m128i a_h = _mm_shuffle_epi8(s, alpha_hi);
+		_mm_store_si128((void *)&dst[i], _blend4(d, s, a_l, a_h));
+	}
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+}
 
-				// unpack destination
-				d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
-				d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
+static void (*blend_row)(uint32_t * dst, const uint32_t * src, int count) = blend_row_sse2;
 
-				// unpack source
-				s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
-				s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+/* Blend a source row scaled by an overall opacity of k/255 */
+__attribute__((__force_align_arg_pointer__))
+static void blend_row_alpha(uint32_t * dst, const uint32_t * src, int count, uint8_t k) {
+	__m128i kk = _mm_set1_epi16(k);
+	int i = 0;
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		__m128i s = _mm_cvtsi32_si128(src[i]);
+		s = _mm_packus_epi16(_div255(_mm_mullo_epi16(_mm_unpacklo_epi8(s, _mm_setzero_si128()), kk)), _mm_setzero_si128());
+		dst[i] = alpha_blend_rgba(dst[i], _mm_cvtsi128_si32(s));
+	}
+	for (; i + 4 <= count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+		__m128i s_l = _div255(_mm_mullo_epi16(_mm_unpacklo_epi8(s, _mm_setzero_si128()), kk));
+		__m128i s_h = _div255(_mm_mullo_epi16(_mm_unpackhi_epi8(s, _mm_setzero_si128()), kk));
+		_mm_store_si128((void *)&dst[i], _blend4_sse2(d, _mm_packus_epi16(s_l, s_h)));
+	}
+	for (; i < count; ++i) {
+		__m128i s = _mm_cvtsi32_si128(src[i]);
+		s = _mm_packus_epi16(_div255(_mm_mullo_epi16(_mm_unpacklo_epi8(s, _mm_setzero_si128()), kk)), _mm_setzero_si128());
+		dst[i] = alpha_blend_rgba(dst[i], _mm_cvtsi128_si32(s));
+	}
+}
 
-				__m128i a_l, a_h;
-				__m128i t_l, t_h;
+/* Blend one color over a whole row */
+__attribute__((__force_align_arg_pointer__))
+static void blend_row_color(uint32_t * dst, uint32_t color, int count) {
+	__m128i s = _mm_set1_epi32(color);
+	__m128i s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	int i = 0;
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], color);
+	}
+	for (; i + 4 <= count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		_mm_store_si128((void *)&dst[i], _blend4(d, s, a, a));
+	}
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], color);
+	}
+}
 
-				// extract source alpha RGBA → AAAA
-				a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
-				a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_h, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+/* Interpolate towards src by the red channel of masks; alpha adds, saturating */
+__attribute__((__force_align_arg_pointer__))
+static void blend_row_mask(uint32_t * dst, const uint32_t * src, const uint32_t * masks, int count) {
+	__m128i alpha_bytes = _mm_set1_epi32(0xFF000000);
+	int i = 0;
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend(dst[i], src[i], masks[i]);
+	}
+	for (; i + 4 <= count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+		__m128i m = _mm_loadu_si128((void *)&masks[i]);
+
+		__m128i m_l = _mm_unpacklo_epi8(m, _mm_setzero_si128());
+		__m128i m_h = _mm_unpackhi_epi8(m, _mm_setzero_si128());
+		__m128i a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(m_l, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,2,2,2));
+		__m128i a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(m_h, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,2,2,2));
+
+		__m128i d_l = _mm_mullo_epi16(_mm_unpacklo_epi8(d, _mm_setzero_si128()), _mm_xor_si128(a_l, mask00ff));
+		__m128i d_h = _mm_mullo_epi16(_mm_unpackhi_epi8(d, _mm_setzero_si128()), _mm_xor_si128(a_h, mask00ff));
+		__m128i s_l = _mm_mullo_epi16(_mm_unpacklo_epi8(s, _mm_setzero_si128()), a_l);
+		__m128i s_h = _mm_mullo_epi16(_mm_unpackhi_epi8(s, _mm_setzero_si128()), a_h);
+		__m128i c = _mm_packus_epi16(_div255(_mm_add_epi16(d_l, s_l)), _div255(_mm_add_epi16(d_h, s_h)));
+
+		/* Mask's red byte moved up to the alpha byte, added to the old alpha */
+		__m128i alp = _mm_adds_epu8(d, _mm_and_si128(_mm_slli_epi32(m, 8), alpha_bytes));
+		_mm_store_si128((void *)&dst[i], _mm_or_si128(_mm_andnot_si128(alpha_bytes, c), _mm_and_si128(alpha_bytes, alp)));
+	}
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend(dst[i], src[i], masks[i]);
+	}
+}
 
-				// negate source alpha
-				t_l = _mm_xor_si128(a_l, mask00ff);
-				t_h = _mm_xor_si128(a_h, mask00ff);
+__attribute__((constructor)) static void _masks(void) {
+	mask00ff = _mm_set1_epi16(0x00FF);
+	mask0080 = _mm_set1_epi16(0x0080);
+	mask0101 = _mm_set1_epi16(0x0101);
+	alpha_lo = _mm_setr_epi8(3,-1,3,-1,3,-1,3,-1, 7,-1,7,-1,7,-1,7,-1);
+	alpha_hi = _mm_setr_epi8(11,-1,11,-1,11,-1,11,-1, 15,-1,15,-1,15,-1,15,-1);
 
-				// apply source alpha to destination
-				d_l = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_l,t_l),mask0080),mask0101);
-				d_h = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_h,t_h),mask0080),mask0101);
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3)) {
+		blend_row = blend_row_ssse3;
+	}
+}
+#else
+static void blend_row(uint32_t * dst, const uint32_t * src, int count) {
+	for (int i = 0; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+}
 
-				// combine source and destination
-				d_l = _mm_adds_epu8(s_l,d_l);
-				d_h = _mm_adds_epu8(s_h,d_h);
+static void blend_row_alpha(uint32_t * dst, const uint32_t * src, int count, uint8_t k) {
+	for (int i = 0; i < count; ++i) {
+		uint32_t f_color = premultiply((src[i] & 0xFFFFFF) | ((uint32_t)k << 24));
+		f_color = (f_color & 0xFFFFFF) | ((uint32_t)(k * _ALP(src[i]) / 255) << 24);
+		dst[i] = alpha_blend_rgba(dst[i], f_color);
+	}
+}
 
-				// pack low + high and write back to memory
-				_mm_storeu_si128((void*)&GFX(ctx, x + _x, y + _y), _mm_packus_epi16(d_l,d_h));
-			}
-			for (; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
+static void blend_row_color(uint32_t * dst, uint32_t color, int count) {
+	for (int i = 0; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], color);
+	}
+}
+
+static void blend_row_mask(uint32_t * dst, const uint32_t * src, const uint32_t * masks, int count) {
+	for (int i = 0; i < count; ++i) {
+		dst[i] = alpha_blend(dst[i], src[i], masks[i]);
+	}
+}
 #endif
-		}
-	} else if (sprite->alpha == ALPHA_INDEXED) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				if (SPRITE(sprite, _x, _y) != sprite->blank) {
-					GFX(ctx, x + _x, y + _y) = SPRITE(sprite, _x, _y) | 0xFF000000;
+
+__attribute__((__force_align_arg_pointer__))
+void draw_sprite(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y) {
+	/* Visible part of the sprite, in sprite coordinates */
+	int32_t _left   = max(-x, 0);
+	int32_t _top    = max(-y, 0);
+	int32_t _right  = min(sprite->width,  ctx->width - x);
+	int32_t _bottom = min(sprite->height, ctx->height - y);
+	int32_t count   = _right - _left;
+	if (count <= 0) return;
+
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		if (!_is_in_clip(ctx, y + _y)) continue;
+		uint32_t * dst = &GFX(ctx, x + _left, y + _y);
+		uint32_t * src = &SPRITE(sprite, _left, _y);
+		if (sprite->alpha == ALPHA_MASK) {
+			blend_row_mask(dst, src, &SMASKS(sprite, _left, _y), count);
+		} else if (sprite->alpha == ALPHA_EMBEDDED) {
+			/* Alpha embedded is the most important step. */
+			blend_row(dst, src, count);
+		} else if (sprite->alpha == ALPHA_INDEXED) {
+			for (int32_t i = 0; i < count; ++i) {
+				if (src[i] != sprite->blank) {
+					dst[i] = src[i] | 0xFF000000;
 				}
 			}
-		}
-	} else if (sprite->alpha == ALPHA_FORCE_SLOW_EMBEDDED) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-#if 1
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-#else
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(rgba(255,255,0,255), SPRITE(sprite, _x, _y));
-#endif
+		} else if (sprite->alpha == ALPHA_FORCE_SLOW_EMBEDDED) {
+			for (int32_t i = 0; i < count; ++i) {
+				dst[i] = alpha_blend_rgba(dst[i], src[i]);
 			}
-		}
-	} else {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = SPRITE(sprite, _x, _y) | 0xFF000000;
+		} else {
+			for (int32_t i = 0; i < count; ++i) {
+				dst[i] = src[i] | 0xFF000000;
 			}
 		}
 	}
@@ -792,16 +1101,132 @@ uint32_t getBilinearFilteredPixelColor(sprite_t * tex, double u, double v) {
 	return rgb(r_RED,r_GRE,r_BLU) & (0xFFFFFF + ((uint32_t)r_ALP << 24));
 }
 
-void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height) {
-	int32_t _left   = max(x, 0);
-	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
+/*
+ * Fixed-point bilinear resampling, for sprites with embedded or no
+ * alpha. A table gives each visible destination column its source
+ * position in 24.8 fixed point; each destination row blends two
+ * source rows together (four pixels per SSE op, and only across the
+ * columns actually sampled), then picks and blends pairs of pixels
+ * out of that with two channels per multiply.
+ */
+
+/* (a * (256 - f) + b * f) / 256, per channel */
+static inline uint32_t _lerp_pixel(uint32_t a, uint32_t b, uint32_t f) {
+	uint32_t rb = (((a & 0x00FF00FF) * (256 - f) + (b & 0x00FF00FF) * f) >> 8) & 0x00FF00FF;
+	uint32_t ag = ((((a >> 8) & 0x00FF00FF) * (256 - f) + ((b >> 8) & 0x00FF00FF) * f)) & 0xFF00FF00;
+	return rb | ag;
+}
+
+#ifndef NO_SSE
+__attribute__((__force_align_arg_pointer__))
+static void _lerp_rows(uint32_t * out, const uint32_t * a, const uint32_t * b, int count, uint32_t f) {
+	__m128i w0 = _mm_set1_epi16(256 - f);
+	__m128i w1 = _mm_set1_epi16(f);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i pa = _mm_loadu_si128((void *)&a[i]);
+		__m128i pb = _mm_loadu_si128((void *)&b[i]);
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, _mm_setzero_si128()), w0),
+		                           _mm_mullo_epi16(_mm_unpacklo_epi8(pb, _mm_setzero_si128()), w1));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, _mm_setzero_si128()), w0),
+		                           _mm_mullo_epi16(_mm_unpackhi_epi8(pb, _mm_setzero_si128()), w1));
+		_mm_storeu_si128((void *)&out[i], _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+	for (; i < count; ++i) {
+		out[i] = _lerp_pixel(a[i], b[i], f);
+	}
+}
+#else
+static void _lerp_rows(uint32_t * out, const uint32_t * a, const uint32_t * b, int count, uint32_t f) {
+	for (int i = 0; i < count; ++i) {
+		out[i] = _lerp_pixel(a[i], b[i], f);
+	}
+}
+#endif
+
+/* Source positions, 24.8 fixed point, for destination positions [start, start + count) */
+static uint32_t * _scale_table(int src, int dst, int start, int count) {
+	uint32_t * table = malloc(sizeof(uint32_t) * count);
+	for (int i = 0; i < count; ++i) {
+		table[i] = (uint32_t)(((uint64_t)(start + i) * src << 8) / dst);
+	}
+	return table;
+}
+
+/* Resample one destination row (at source row ypos, 24.8) into out */
+static void _scale_row(sprite_t * sprite, uint32_t * out, uint32_t * xtab, int count, uint32_t ypos, uint32_t * tmp) {
+	int y0 = min(ypos >> 8, sprite->height - 1);
+	int y1 = min(y0 + 1, sprite->height - 1);
+	uint32_t fy = ypos & 0xFF;
+
+	const uint32_t * row = &SPRITE(sprite, 0, y0);
+	if (fy && y1 != y0) {
+		int first = xtab[0] >> 8;
+		int last  = min((xtab[count - 1] >> 8) + 1, sprite->width - 1);
+		_lerp_rows(&tmp[first], &SPRITE(sprite, first, y0), &SPRITE(sprite, first, y1), last - first + 1, fy);
+		row = tmp;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		int x0 = min(xtab[i] >> 8, sprite->width - 1);
+		int x1 = min(x0 + 1, sprite->width - 1);
+		out[i] = _lerp_pixel(row[x0], row[x1], xtab[i] & 0xFF);
+	}
+}
+
+/* Scale and draw, with an overall opacity of k / 255 */
+static void _draw_sprite_scaled_fast(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height, uint8_t k) {
+	int32_t _left   = max(-x, 0);
+	int32_t _top    = max(-y, 0);
+	int32_t _right  = min(width,  ctx->width - x);
+	int32_t _bottom = min(height, ctx->height - y);
+	int32_t count   = _right - _left;
+	if (count <= 0 || _bottom <= _top || !sprite->width || !sprite->height) return;
+
+	uint32_t * xtab = _scale_table(sprite->width, width, _left, count);
+	uint32_t * tmp  = malloc(sizeof(uint32_t) * sprite->width);
+	uint32_t * out  = malloc(sizeof(uint32_t) * count);
+
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
 		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
+		_scale_row(sprite, out, xtab, count, (uint32_t)(((uint64_t)_y * sprite->height << 8) / height), tmp);
+
+		uint32_t * dst = &GFX(ctx, x + _left, y + _y);
+		if (sprite->alpha == ALPHA_OPAQUE) {
+			for (int32_t i = 0; i < count; ++i) {
+				out[i] |= 0xFF000000;
+			}
+			if (k == 255) {
+				memcpy(dst, out, sizeof(uint32_t) * count);
 				continue;
+			}
+		}
+		if (k == 255) {
+			blend_row(dst, out, count);
+		} else {
+			blend_row_alpha(dst, out, count, k);
+		}
+	}
+
+	free(out);
+	free(tmp);
+	free(xtab);
+}
+
+void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height) {
+	if (sprite->alpha == ALPHA_EMBEDDED || sprite->alpha == ALPHA_OPAQUE) {
+		_draw_sprite_scaled_fast(ctx, sprite, x, y, width, height, 255);
+		return;
+	}
+
+	/* Masked and indexed sprites go through the general filter */
+	int32_t _left   = max(-x, 0);
+	int32_t _top    = max(-y, 0);
+	int32_t _right  = min(width,  ctx->width - x);
+	int32_t _bottom = min(height, ctx->height - y);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		if (!_is_in_clip(ctx, y + _y)) continue;
+		for (int32_t _x = _left; _x < _right; ++_x) {
 			if (sprite->alpha > 0) {
 				uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
 				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), n_color);
@@ -812,21 +1237,19 @@ void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 	}
 }
 
+__attribute__((__force_align_arg_pointer__))
 void draw_sprite_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha) {
-	int32_t _left   = max(x, 0);
-	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < sprite->height; ++_y) {
+	int32_t _left   = max(-x, 0);
+	int32_t _top    = max(-y, 0);
+	int32_t _right  = min(sprite->width,  ctx->width - x);
+	int32_t _bottom = min(sprite->height, ctx->height - y);
+	int32_t count   = _right - _left;
+	if (count <= 0) return;
+
+	uint8_t k = 255 * alpha;
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
 		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = SPRITE(sprite, _x, _y);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
-		}
+		blend_row_alpha(&GFX(ctx, x + _left, y + _y), &SPRITE(sprite, _left, _y), count, k);
 	}
 }
 
@@ -848,15 +1271,19 @@ void draw_sprite_alpha_paint(gfx_context_t * ctx, sprite_t * sprite, int32_t x,
 }
 
 void draw_sprite_scaled_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height, float alpha) {
-	int32_t _left   = max(x, 0);
-	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
+	if (sprite->alpha == ALPHA_EMBEDDED || sprite->alpha == ALPHA_OPAQUE) {
+		_draw_sprite_scaled_fast(ctx, sprite, x, y, width, height, 255 * alpha);
+		return;
+	}
+
+	/* Masked and indexed sprites go through the general filter */
+	int32_t _left   = max(-x, 0);
+	int32_t _top    = max(-y, 0);
+	int32_t _right  = min(width,  ctx->width - x);
+	int32_t _bottom = min(height, ctx->height - y);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
 		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
+		for (int32_t _x = _left; _x < _right; ++_x) {
 			uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
 			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
 			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
@@ -866,6 +1293,74 @@ void draw_sprite_scaled_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x,
 }
 
 
+sprite_t * create_scaled_sprite(sprite_t * sprite, uint16_t width, uint16_t height) {
+	sprite_t * out = create_sprite(width, height, ALPHA_EMBEDDED);
+	memset(out->bitmap, 0, sizeof(uint32_t) * width * height);
+	gfx_context_t * ctx = init_graphics_sprite(out);
+	draw_sprite_scaled(ctx, sprite, 0, 0, width, height);
+	free(ctx);
+	return out;
+}
+
+/*
+ * Scaled copies of sprites that keep getting drawn at the same size
+ * (icons, mostly), keyed by source sprite and size. An entry goes
+ * away when its source is passed to sprite_free; when the cache is
+ * full the least recently used entry is replaced. Only for sprites
+ * whose pixels don't change.
+ */
+#define SCALE_CACHE_SIZE 64
+
+static struct scale_cache_entry {
+	sprite_t * source;
+	uint32_t * bitmap;
+	uint16_t width;
+	uint16_t height;
+	sprite_t * scaled;
+	unsigned long used;
+} scale_cache[SCALE_CACHE_SIZE];
+static unsigned long scale_cache_clock = 0;
+
+static void _scale_cache_forget(sprite_t * sprite) {
+	for (int i = 0; i < SCALE_CACHE_SIZE; ++i) {
+		if (scale_cache[i].scaled && scale_cache[i].source == sprite) {
+			sprite_t * scaled = scale_cache[i].scaled;
+			scale_cache[i].scaled = NULL;
+			sprite_free(scaled);
+		}
+	}
+}
+
+sprite_t * get_scaled_sprite(sprite_t * sprite, uint16_t width, uint16_t height) {
+	if (sprite->width == width && sprite->height == height) return sprite;
+
+	struct scale_cache_entry * victim = &scale_cache[0];
+	for (int i = 0; i < SCALE_CACHE_SIZE; ++i) {
+		struct scale_cache_entry * e = &scale_cache[i];
+		if (e->scaled && e->source == sprite && e->bitmap == sprite->bitmap && e->width == width && e->height == height) {
+			e->used = ++scale_cache_clock;
+			return e->scaled;
+		}
+		if (victim->scaled && (!e->scaled || e->used < victim->used)) {
+			victim = e;
+		}
+	}
+
+	if (victim->scaled) {
+		sprite_t * old = victim->scaled;
+		victim->scaled = NULL;
+		sprite_free(old);
+	}
+
+	victim->source = sprite;
+	victim->bitmap = sprite->bitmap;
+	victim->width  = width;
+	victim->height = height;
+	victim->scaled = create_scaled_sprite(sprite, width, height);
+	victim->used   = ++scale_cache_clock;
+	return victim->scaled;
+}
+
 uint32_t interp_colors(uint32_t bottom, uint32_t top, uint8_t interp) {
 	uint8_t red = (_RED(bottom) * (255 - interp) + _RED(top) * interp) / 255;
 	uint8_t gre = (_GRE(bottom) * (255 - interp) + _GRE(top) * interp) / 255;
@@ -874,32 +1369,29 @@ uint32_t interp_colors(uint32_t bottom, uint32_t top, uint8_t interp) {
 	return rgba(red,gre,blu, alp);
 }
 
+__attribute__((__force_align_arg_pointer__))
 void draw_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, uint32_t color) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), color);
-		}
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	if (_right <= _left) return;
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		if (!_is_in_clip(ctx, _y)) continue;
+		blend_row_color(&GFX(ctx, _left, _y), color, _right - _left);
 	}
 }
 
 void draw_rectangle_solid(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, uint32_t color) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			GFX(ctx, x + _x, y + _y) = color;
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		if (!_is_in_clip(ctx, _y)) continue;
+		uint32_t * dst = &GFX(ctx, 0, _y);
+		for (int32_t _x = _left; _x < _right; ++_x) {
+			dst[_x] = color;
 		}
 	}
 }
@@ -1040,28 +1532,63 @@ float gfx_line_distance(struct gfx_point * p, struct gfx_point * v, struct gfx_p
 	return gfx_point_distance(p, &v_t);
 }
 
+static inline void _line_aa_pixel(gfx_context_t * ctx, int x, int y, float d, uint32_t color, float thickness) {
+	if (d < thickness + 0.5) {
+		if (d < thickness - 0.5) {
+			GFX(ctx,x,y) = color;
+		} else {
+			uint32_t f_color = rgb(255 * (1.0 - (d - thickness + 0.5)), 0, 0);
+			GFX(ctx,x,y) = alpha_blend(GFX(ctx,x,y), color, f_color);
+		}
+	}
+}
+
 /**
- * This is slow, but it works...
- *
- * Maybe acceptable for baked UI elements?
+ * Only the pixels within reach of the line's bounding box are looked
+ * at; their distances from the segment (see gfx_line_distance) are
+ * computed four at a time.
  */
 void draw_line_aa(gfx_context_t * ctx, int x_1, int x_2, int y_1, int y_2, uint32_t color, float thickness) {
 	struct gfx_point v = {(float)x_1, (float)y_1};
 	struct gfx_point w = {(float)x_2, (float)y_2};
 
-	for (int y = 0; y < ctx->height; ++y) {
-		for (int x = 0; x < ctx->width; ++x) {
-			struct gfx_point p = {x,y};
-			float d = gfx_line_distance(&p,&v,&w);
-			if (d < thickness + 0.5) {
-				if (d < thickness - 0.5) {
-					GFX(ctx,x,y) = color;
-				} else {
-					uint32_t f_color = rgb(255 * (1.0 - (d - thickness + 0.5)), 0, 0);
-					GFX(ctx,x,y) = alpha_blend(GFX(ctx,x,y), color, f_color);
-				}
+	int reach = (int)(thickness + 1.5);
+	int left   = max(min(x_1, x_2) - reach, 0);
+	int right  = min(max(x_1, x_2) + reach + 1, ctx->width);
+	int top    = max(min(y_1, y_2) - reach, 0);
+	int bottom = min(max(y_1, y_2) + reach + 1, ctx->height);
+
+#ifndef NO_SSE
+	float wx = w.x - v.x;
+	float wy = w.y - v.y;
+	float lengthlength = wx * wx + wy * wy;
+	__m128 inv = _mm_set1_ps(lengthlength == 0.0 ? 0.0 : 1.0 / lengthlength);
+	__m128 vwx = _mm_set1_ps(wx);
+	__m128 vwy = _mm_set1_ps(wy);
+	__m128 steps = _mm_set_ps(3.0, 2.0, 1.0, 0.0);
+#endif
+
+	for (int y = top; y < bottom; ++y) {
+		int x = left;
+#ifndef NO_SSE
+		__m128 py = _mm_set1_ps(y - v.y);
+		for (; x + 3 < right; x += 4) {
+			__m128 px = _mm_add_ps(_mm_set1_ps(x - v.x), steps);
+			__m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(px, vwx), _mm_mul_ps(py, vwy)), inv);
+			t = _mm_max_ps(_mm_min_ps(t, _mm_set1_ps(1.0)), _mm_setzero_ps());
+			__m128 dx = _mm_sub_ps(px, _mm_mul_ps(t, vwx));
+			__m128 dy = _mm_sub_ps(py, _mm_mul_ps(t, vwy));
+			float d[4];
+			_mm_storeu_ps(d, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))));
+			for (int i = 0; i < 4; ++i) {
+				_line_aa_pixel(ctx, x + i, y, d[i], color, thickness);
 			}
 		}
+#endif
+		for (; x < right; ++x) {
+			struct gfx_point p = {x,y};
+			_line_aa_pixel(ctx, x, y, gfx_line_distance(&p,&v,&w), color, thickness);
+		}
 	}
 }
 
@@ -1074,6 +1601,51 @@ static void calc_rotation(double x, double y, double px, double py, double s, do
 	*v = (x * s + y * c) + py;
 }
 
+/*
+ * Rotation for sprites with embedded or no alpha. The source position
+ * moves in a straight line along each destination row, so it's stepped
+ * in 16.16 fixed point rather than rotated per pixel, sampled with the
+ * same integer filter as scaling, and the row is blended in one go.
+ */
+static void _draw_sprite_rotate_fast(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, double s, double c,
+		int32_t _left, int32_t _top, int32_t _right, int32_t _bottom, uint8_t k) {
+	int32_t count = _right - _left;
+	if (count <= 0 || _bottom <= _top) return;
+
+	uint32_t * out = malloc(sizeof(uint32_t) * count);
+	int32_t du = c * 65536.0;
+	int32_t dv = s * 65536.0;
+	uint32_t opaque = sprite->alpha == ALPHA_OPAQUE ? 0xFF000000 : 0;
+
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		if (!_is_in_clip(ctx, y + _y)) continue;
+		int32_t u = (_left * c - _y * s + sprite->width / 2.0) * 65536.0;
+		int32_t v = (_left * s + _y * c + sprite->height / 2.0) * 65536.0;
+		for (int32_t i = 0; i < count; ++i, u += du, v += dv) {
+			int32_t sx = u >> 16;
+			int32_t sy = v >> 16;
+			if (sx <= 0 || sy <= 0 || sx >= sprite->width || sy >= sprite->height) {
+				out[i] = 0;
+			} else if (sx == sprite->width - 1 || sy == sprite->height - 1) {
+				out[i] = SPRITE(sprite, sx, sy) | opaque;
+			} else {
+				uint32_t fx = (u >> 8) & 0xFF;
+				uint32_t top = _lerp_pixel(SPRITE(sprite, sx, sy), SPRITE(sprite, sx + 1, sy), fx);
+				uint32_t bot = _lerp_pixel(SPRITE(sprite, sx, sy + 1), SPRITE(sprite, sx + 1, sy + 1), fx);
+				out[i] = _lerp_pixel(top, bot, (v >> 8) & 0xFF) | opaque;
+			}
+		}
+		uint32_t * dst = &GFX(ctx, x + _left, y + _y);
+		if (k == 255) {
+			blend_row(dst, out, count);
+		} else {
+			blend_row_alpha(dst, out, count, k);
+		}
+	}
+
+	free(out);
+}
+
 void draw_sprite_rotate(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float rotation, float alpha) {
 
 	double originx = (double)sprite->width / 2.0;
@@ -1085,15 +1657,15 @@ void draw_sprite_rotate(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 	double ur_x, ur_y;
 	double lr_x, lr_y;
 
-	double _s = sin(rotation);
-	double _c = cos(rotation);
+	double _s, _c;
+	sincos(rotation, &_s, &_c);
 	calc_rotation(-sprite->width/2, -sprite->height/2, 0, 0, _s, _c, &ul_x, &ul_y);
 	calc_rotation(-sprite->width/2, sprite->height/2,  0, 0, _s, _c, &ll_x, &ll_y);
 	calc_rotation(sprite->width/2, -sprite->height/2,  0, 0, _s, _c, &ur_x, &ur_y);
 	calc_rotation(sprite->width/2, sprite->height/2,   0, 0, _s, _c, &lr_x, &lr_y);
 
-	_s = sin(-rotation);
-	_c = cos(-rotation);
+	/* And the other way, to map back into the sprite */
+	_s = -_s;
 
 	/* Calculate bounds */
 	int32_t _left   = min(min(ul_x, ll_x), min(ur_x, lr_x));
@@ -1101,6 +1673,12 @@ void draw_sprite_rotate(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 	int32_t _right  = max(max(ul_x, ll_x), max(ur_x, lr_x));
 	int32_t _bottom = max(max(ul_y, ll_y), max(ur_y, lr_y));
 
+	if (sprite->alpha == ALPHA_EMBEDDED || sprite->alpha == ALPHA_OPAQUE) {
+		_draw_sprite_rotate_fast(ctx, sprite, x, y, _s, _c,
+			max(_left, -x), max(_top, -y), min(_right, ctx->width - x), min(_bottom, ctx->height - y), 255 * alpha);
+		return;
+	}
+
 	for (int32_t _y = _top; _y < _bottom; ++_y) {
 		if (_y + y < 0) continue;
 		if (_y + y  >= ctx->height) break;
@@ -2,19 +2,39 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2013-2018 K. Lange
+ *
+ * Open-addressed hash table with Robin Hood probing.
+ *
+ * Entries live directly in a power-of-two array of slots. An
+ * insertion that has probed further from its home than the
+ * entry it meets takes that slot and carries on inserting the
+ * displaced entry, which keeps probe lengths short and lets a
+ * lookup stop as soon as it passes where its key would be.
+ * Removal shifts the rest of the run back a slot instead of
+ * leaving tombstones.
+ *
+ * The table doubles once it is three quarters full. Rather than
+ * rehashing everything at once, the old table is kept around and
+ * every set or remove moves a few of its slots across; lookups
+ * check both until it is empty. Slots already moved are marked
+ * dead but keep their probe distance so lookups in the old table
+ * still find entries further along the same run.
  */
 
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
 
+#define HASHMAP_MIN_SIZE     8
+#define HASHMAP_MIGRATE_STEP 8
+#define HASHMAP_DEAD         0x80000000
+
 unsigned int hashmap_string_hash(void * _key) {
-	unsigned int hash = 0;
-	char * key = (char *)_key;
-	int c;
-	/* This is the so-called "sdbm" hash. It comes from a piece of
-	 * public domain code from a clone of ndbm. */
-	while ((c = *key++)) {
-		hash = c + (hash << 6) + (hash << 16) - hash;
+	unsigned int hash = 2166136261u;
+	unsigned char * key = (unsigned char *)_key;
+	/* FNV-1a */
+	while (*key) {
+		hash ^= *key++;
+		hash *= 16777619u;
 	}
 	return hash;
 }
@@ -44,148 +64,215 @@ static void hashmap_int_free(void * ptr) {
 	return;
 }
 
+/*
+ * Slots are picked from the low bits of the hash, so spread
+ * whatever the hash function gave us (pointers and small integers
+ * in particular) across all of them.
+ */
+static unsigned int hashmap_mix(unsigned int hash) {
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static hashmap_entry_t * hashmap_table(size_t size) {
+	hashmap_entry_t * table = malloc(sizeof(hashmap_entry_t) * size);
+	memset(table, 0x00, sizeof(hashmap_entry_t) * size);
+	return table;
+}
 
-hashmap_t * hashmap_create(int size) {
+static hashmap_t * hashmap_create_common(int size) {
 	hashmap_t * map = malloc(sizeof(hashmap_t));
 
+	map->size = HASHMAP_MIN_SIZE;
+	while (map->size < (size_t)size) map->size <<= 1;
+	map->count = 0;
+	map->entries = hashmap_table(map->size);
+
+	map->old_size = 0;
+	map->migrated = 0;
+	map->old_entries = NULL;
+
+	return map;
+}
+
+hashmap_t * hashmap_create(int size) {
+	hashmap_t * map = hashmap_create_common(size);
+
 	map->hash_func     = &hashmap_string_hash;
 	map->hash_comp     = &hashmap_string_comp;
 	map->hash_key_dup  = &hashmap_string_dupe;
 	map->hash_key_free = &free;
-	map->hash_val_free = &free;
-
-	map->size = size;
-	map->entries = malloc(sizeof(hashmap_entry_t *) * size);
-	memset(map->entries, 0x00, sizeof(hashmap_entry_t *) * size);
+	map->hash_val_free = NULL;
 
 	return map;
 }
 
 hashmap_t * hashmap_create_int(int size) {
-	hashmap_t * map = malloc(sizeof(hashmap_t));
+	hashmap_t * map = hashmap_create_common(size);
 
 	map->hash_func     = &hashmap_int_hash;
 	map->hash_comp     = &hashmap_int_comp;
 	map->hash_key_dup  = &hashmap_int_dupe;
 	map->hash_key_free = &hashmap_int_free;
-	map->hash_val_free = &free;
-
-	map->size = size;
-	map->entries = malloc(sizeof(hashmap_entry_t *) * size);
-	memset(map->entries, 0x00, sizeof(hashmap_entry_t *) * size);
+	map->hash_val_free = NULL;
 
 	return map;
 }
 
+/*
+ * Place an entry in the current table, which must have a free slot.
+ */
+static void hashmap_place(hashmap_t * map, char * key, void * value, unsigned int hash) {
+	size_t mask = map->size - 1;
+	hashmap_entry_t e = { key, value, hash, 1 };
+	size_t i = hash & mask;
+
+	while (map->entries[i].distance) {
+		if (map->entries[i].distance < e.distance) {
+			hashmap_entry_t t = map->entries[i];
+			map->entries[i] = e;
+			e = t;
+		}
+		i = (i + 1) & mask;
+		e.distance++;
+	}
+
+	map->entries[i] = e;
+}
+
+static hashmap_entry_t * hashmap_find(hashmap_t * map, hashmap_entry_t * table, size_t size, void * key, unsigned int hash) {
+	size_t mask = size - 1;
+	size_t i = hash & mask;
+
+	for (unsigned int distance = 1; distance <= size; ++distance) {
+		hashmap_entry_t * e = &table[i];
+		if ((e->distance & ~HASHMAP_DEAD) < distance) return NULL;
+		if (!(e->distance & HASHMAP_DEAD) && e->hash == hash && map->hash_comp(e->key, key)) return e;
+		i = (i + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static hashmap_entry_t * hashmap_lookup(hashmap_t * map, void * key) {
+	unsigned int hash = hashmap_mix(map->hash_func(key));
+	hashmap_entry_t * e = hashmap_find(map, map->entries, map->size, key, hash);
+	if (!e && map->old_entries) {
+		e = hashmap_find(map, map->old_entries, map->old_size, key, hash);
+	}
+	return e;
+}
+
+static void hashmap_migrate(hashmap_t * map, size_t slots) {
+	while (map->old_entries && slots--) {
+		hashmap_entry_t * e = &map->old_entries[map->migrated++];
+		if (e->distance && !(e->distance & HASHMAP_DEAD)) {
+			hashmap_place(map, e->key, e->value, e->hash);
+			e->distance |= HASHMAP_DEAD;
+		}
+		if (map->migrated == map->old_size) {
+			free(map->old_entries);
+			map->old_entries = NULL;
+			map->old_size = 0;
+			map->migrated = 0;
+		}
+	}
+}
+
+static void hashmap_grow(hashmap_t * map) {
+	/* A resize still underway has to finish before the next one starts */
+	hashmap_migrate(map, map->old_size);
+
+	map->old_entries = map->entries;
+	map->old_size = map->size;
+	map->migrated = 0;
+
+	map->size <<= 1;
+	map->entries = hashmap_table(map->size);
+}
+
 void * hashmap_set(hashmap_t * map, void * key, void * value) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
-		e->key   = map->hash_key_dup(key);
-		e->value = value;
-		e->next = NULL;
-		map->entries[hash] = e;
-		return NULL;
-	} else {
-		hashmap_entry_t * p = NULL;
-		do {
-			if (map->hash_comp(x->key, key)) {
-				void * out = x->value;
-				x->value = value;
-				return out;
-			} else {
-				p = x;
-				x = x->next;
-			}
-		} while (x);
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
-		e->key   = map->hash_key_dup(key);
-		e->value = value;
-		e->next = NULL;
-
-		p->next = e;
-		return NULL;
+	hashmap_migrate(map, HASHMAP_MIGRATE_STEP);
+
+	hashmap_entry_t * x = hashmap_lookup(map, key);
+	if (x) {
+		void * out = x->value;
+		x->value = value;
+		return out;
 	}
+
+	if ((map->count + 1) * 4 > map->size * 3) {
+		hashmap_grow(map);
+	}
+
+	hashmap_place(map, map->hash_key_dup(key), value, hashmap_mix(map->hash_func(key)));
+	map->count++;
+	return NULL;
 }
 
 void * hashmap_get(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return NULL;
-	} else {
-		do {
-			if (map->hash_comp(x->key, key)) {
-				return x->value;
-			}
-			x = x->next;
-		} while (x);
-		return NULL;
-	}
+	hashmap_entry_t * x = hashmap_lookup(map, key);
+	return x ? x->value : NULL;
 }
 
 void * hashmap_remove(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return NULL;
-	} else {
-		if (map->hash_comp(x->key, key)) {
-			void * out = x->value;
-			map->entries[hash] = x->next;
-			map->hash_key_free(x->key);
-			map->hash_val_free(x);
-			return out;
-		} else {
-			hashmap_entry_t * p = x;
-			x = x->next;
-			do {
-				if (map->hash_comp(x->key, key)) {
-					void * out = x->value;
-					p->next = x->next;
-					map->hash_key_free(x->key);
-					map->hash_val_free(x);
-					return out;
-				}
-				p = x;
-				x = x->next;
-			} while (x);
-		}
-		return NULL;
+	hashmap_migrate(map, HASHMAP_MIGRATE_STEP);
+
+	unsigned int hash = hashmap_mix(map->hash_func(key));
+	void * out;
+
+	hashmap_entry_t * x = map->old_entries ? hashmap_find(map, map->old_entries, map->old_size, key, hash) : NULL;
+	if (x) {
+		/* The old table is only ever drained, so leaving a dead slot is fine */
+		out = x->value;
+		map->hash_key_free(x->key);
+		x->distance |= HASHMAP_DEAD;
+		map->count--;
+		return out;
+	}
+
+	x = hashmap_find(map, map->entries, map->size, key, hash);
+	if (!x) return NULL;
+
+	out = x->value;
+	map->hash_key_free(x->key);
+	map->count--;
+
+	/* Shift the rest of the run back into the hole */
+	size_t mask = map->size - 1;
+	size_t i = x - map->entries;
+	size_t j = (i + 1) & mask;
+	while (map->entries[j].distance > 1) {
+		map->entries[i] = map->entries[j];
+		map->entries[i].distance--;
+		i = j;
+		j = (j + 1) & mask;
 	}
+	memset(&map->entries[i], 0x00, sizeof(hashmap_entry_t));
+
+	return out;
 }
 
 int hashmap_has(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return 0;
-	} else {
-		do {
-			if (map->hash_comp(x->key, key)) {
-				return 1;
-			}
-			x = x->next;
-		} while (x);
-		return 0;
-	}
+	return hashmap_lookup(map, key) != NULL;
+}
 
+static int hashmap_live(hashmap_entry_t * e) {
+	return e->distance && !(e->distance & HASHMAP_DEAD);
 }
 
 list_t * hashmap_keys(hashmap_t * map) {
 	list_t * l = list_create();
 
+	for (unsigned int i = 0; i < map->old_size; ++i) {
+		if (hashmap_live(&map->old_entries[i])) list_insert(l, map->old_entries[i].key);
+	}
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i];
-		while (x) {
-			list_insert(l, x->key);
-			x = x->next;
-		}
+		if (hashmap_live(&map->entries[i])) list_insert(l, map->entries[i].key);
 	}
 
 	return l;
@@ -194,33 +281,33 @@ list_t * hashmap_keys(hashmap_t * map) {
 list_t * hashmap_values(hashmap_t * map) {
 	list_t * l = list_create();
 
+	for (unsigned int i = 0; i < map->old_size; ++i) {
+		if (hashmap_live(&map->old_entries[i])) list_insert(l, map->old_entries[i].value);
+	}
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i];
-		while (x) {
-			list_insert(l, x->value);
-			x = x->next;
-		}
+		if (hashmap_live(&map->entries[i])) list_insert(l, map->entries[i].value);
 	}
 
 	return l;
 }
 
 void hashmap_free(hashmap_t * map) {
+	for (unsigned int i = 0; i < map->old_size; ++i) {
+		hashmap_entry_t * e = &map->old_entries[i];
+		if (!hashmap_live(e)) continue;
+		map->hash_key_free(e->key);
+		if (map->hash_val_free) map->hash_val_free(e->value);
+	}
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i], * p;
-		while (x) {
-			p = x;
-			x = x->next;
-			map->hash_key_free(p->key);
-			map->hash_val_free(p);
-		}
+		hashmap_entry_t * e = &map->entries[i];
+		if (!hashmap_live(e)) continue;
+		map->hash_key_free(e->key);
+		if (map->hash_val_free) map->hash_val_free(e->value);
 	}
+	if (map->old_entries) free(map->old_entries);
 	free(map->entries);
 }
 
 int hashmap_is_empty(hashmap_t * map) {
-	for (unsigned int i = 0; i < map->size; ++i) {
-		if (map->entries[i]) return 0;
-	}
-	return 1;
+	return map->count == 0;
 }
@@ -6,12 +6,22 @@
  * icon_cache - caches icons
  *
  * Used be a few different applications.
- * Probably needs scaling?
+ *
+ * Icons that ship with the system are looked up in an atlas
+ * built by util/make-icon-atlas.py, which holds every icon
+ * already decoded and scaled to 16x16 and 48x48. The atlas is
+ * mapped read-only, so its pages are shared by every process
+ * using this library and sprites point straight into it.
+ * Anything not in the atlas is found by searching the icon
+ * directories, as before.
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <toaru/graphics.h>
 #include <toaru/hashmap.h>
@@ -43,25 +53,123 @@ static char * prefixes[] = {
 	NULL
 };
 
+#define ICON_ATLAS_PATH    "/usr/share/icons/atlas.bin"
+#define ICON_ATLAS_MAGIC   0x54414349 /* ICAT */
+#define ICON_ATLAS_VERSION 1
+
+struct icon_atlas_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+/* Sorted by name, then size */
+struct icon_atlas_entry {
+	uint32_t name;   /* Offset of a NUL-terminated name */
+	uint16_t size;   /* 16 or 48 */
+	uint16_t width;
+	uint16_t height;
+	uint16_t pad;
+	uint32_t alpha;
+	uint32_t pixels; /* Offset of width * height premultiplied pixels */
+};
+
+static uint8_t * icon_atlas;
+static size_t icon_atlas_size;
+static struct icon_atlas_entry * icon_atlas_entries;
+static uint32_t icon_atlas_count;
+
+static void atlas_open(void) {
+	int fd = open(ICON_ATLAS_PATH, O_RDONLY);
+	if (fd < 0) return;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct icon_atlas_header)) {
+		close(fd);
+		return;
+	}
+
+	void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+
+	struct icon_atlas_header * header = map;
+	if (header->magic != ICON_ATLAS_MAGIC || header->version != ICON_ATLAS_VERSION ||
+		header->count > (st.st_size - sizeof(struct icon_atlas_header)) / sizeof(struct icon_atlas_entry)) {
+		munmap(map, st.st_size);
+		return;
+	}
+
+	icon_atlas = map;
+	icon_atlas_size = st.st_size;
+	icon_atlas_entries = (struct icon_atlas_entry *)(header + 1);
+	icon_atlas_count = header->count;
+}
+
+static const char * atlas_name(struct icon_atlas_entry * entry) {
+	if (entry->name >= icon_atlas_size || !memchr(icon_atlas + entry->name, 0, icon_atlas_size - entry->name)) return "";
+	return (const char *)icon_atlas + entry->name;
+}
+
+/*
+ * Find `name` at `size` in the atlas and wrap it in a sprite
+ * whose bitmap points into the mapping.
+ */
+static sprite_t * atlas_get(const char * name, int size) {
+	uint32_t lo = 0, hi = icon_atlas_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		struct icon_atlas_entry * entry = &icon_atlas_entries[mid];
+		int cmp = strcmp(name, atlas_name(entry));
+		if (!cmp) cmp = size - entry->size;
+		if (cmp < 0) {
+			hi = mid;
+		} else if (cmp > 0) {
+			lo = mid + 1;
+		} else {
+			size_t bytes = (size_t)entry->width * entry->height * sizeof(uint32_t);
+			if (entry->pixels & 3 || entry->pixels > icon_atlas_size || bytes > icon_atlas_size - entry->pixels) return NULL;
+			sprite_t * icon = malloc(sizeof(sprite_t));
+			icon->width  = entry->width;
+			icon->height = entry->height;
+			icon->bitmap = (uint32_t *)(icon_atlas + entry->pixels);
+			icon->masks  = NULL;
+			icon->blank  = 0;
+			icon->alpha  = entry->alpha;
+			return icon;
+		}
+	}
+	return NULL;
+}
+
 __attribute__((constructor))
 static void _init_caches(void) {
+	atlas_open();
+
 	icon_cache_16 = hashmap_create(10);
 	{ /* Generic fallback icon */
-		sprite_t * app_icon = malloc(sizeof(sprite_t));
-		load_sprite(app_icon, "/usr/share/icons/16/applications-generic.png");
+		sprite_t * app_icon = atlas_get("applications-generic", 16);
+		if (!app_icon) {
+			app_icon = malloc(sizeof(sprite_t));
+			load_sprite(app_icon, "/usr/share/icons/16/applications-generic.png");
+		}
 		hashmap_set(icon_cache_16, "generic", app_icon);
 	}
 
 	icon_cache_48 = hashmap_create(10);
 	{ /* Generic fallback icon */
-		sprite_t * app_icon = malloc(sizeof(sprite_t));
-		load_sprite(app_icon, "/usr/share/icons/48/applications-generic.png");
+		sprite_t * app_icon = atlas_get("applications-generic", 48);
+		if (!app_icon) {
+			app_icon = malloc(sizeof(sprite_t));
+			load_sprite(app_icon, "/usr/share/icons/48/applications-generic.png");
+		}
 		hashmap_set(icon_cache_48, "generic", app_icon);
 	}
 }
 
 
-static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char ** icon_directories) {
+static sprite_t * icon_get_int(const char * name, int size, hashmap_t * icon_cache, char ** icon_directories) {
 
 	if (!strcmp(name,"")) {
 		/* If a window doesn't have an icon set, return the generic icon */
@@ -72,6 +180,13 @@ static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char *
 	sprite_t * icon = hashmap_get(icon_cache, (void*)name);
 
 	if (!icon) {
+		/* Icons shipped with the system are already in the atlas */
+		icon = atlas_get(name, size);
+		if (icon) {
+			hashmap_set(icon_cache, (void*)name, icon);
+			return icon;
+		}
+
 		/* We don't have an icon cached for this identifier, try search */
 		int i = 0;
 		char path[100];
@@ -102,9 +217,9 @@ static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char *
 }
 
 sprite_t * icon_get_16(const char * name) {
-	return icon_get_int(name, icon_cache_16, icon_directories_16);
+	return icon_get_int(name, 16, icon_cache_16, icon_directories_16);
 }
 
 sprite_t * icon_get_48(const char * name) {
-	return icon_get_int(name, icon_cache_48, icon_directories_48);
+	return icon_get_int(name, 48, icon_cache_48, icon_directories_48);
 }
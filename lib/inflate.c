@@ -5,19 +5,42 @@
  *
  * libtoaru_inflate: Methods for decompressing DEFLATE and gzip payloads.
  */
-#include <stdint.h>
-#include <stddef.h>
+#ifdef _KERNEL_
+# include <kernel/types.h>
+#else
+# include <stdint.h>
+# include <stddef.h>
+#endif
 
 #ifndef _BOOT_LOADER
 #include <toaru/inflate.h>
+#include <toaru/checksum.h>
 #endif
 
+#define CHECK_NONE    0
+#define CHECK_CRC32   1
+#define CHECK_ADLER32 2
+
+/**
+ * Lookup tables resolve the first HUFF_FAST_BITS bits of a code
+ * in one step; longer codes go through a secondary table hung
+ * off their prefix. Entries are one of:
+ *   0                              invalid code
+ *   (length << 9) | symbol         a complete code of that length
+ *   0x8000 | (bits << 12) | index  secondary table of 2^bits entries
+ */
+#define HUFF_FAST_BITS 9
+#define HUFF_FAST_MASK ((1 << HUFF_FAST_BITS) - 1)
+#define HUFF_TABLE_SIZE 2560
+#define HUFF_LINK 0x8000
+
 /**
  * Decoded Huffman table
  */
 struct huff {
 	uint16_t counts[16];   /* Number of symbols of each length */
 	uint16_t symbols[288]; /* Ordered symbols */
+	uint16_t table[HUFF_TABLE_SIZE]; /* Lookup table, see above */
 };
 
 /**
@@ -25,6 +48,7 @@ struct huff {
  */
 struct huff_ring {
 	size_t pointer;
+	size_t flushed; /* Data before this has been passed to the output */
 	uint8_t data[32768];
 };
 
@@ -44,42 +68,108 @@ static uint16_t read_16le(struct inflate_context * ctx) {
 	return (a << 0) | (b << 8);
 }
 
+/**
+ * Pull one more byte into the bit buffer.
+ *
+ * Bytes are only pulled when the bits are actually needed, so we
+ * never read past the end of the compressed stream: our callers
+ * read trailers (gzip CRC, zlib Adler) straight from the input.
+ */
+static inline void pull_byte(struct inflate_context * ctx) {
+	ctx->bit_buffer |= (uint32_t)ctx->get_input(ctx) << ctx->buffer_size;
+	ctx->buffer_size += 8;
+}
+
+/**
+ * Read multible bits, in bit order, from the source.
+ */
+static inline uint32_t read_bits(struct inflate_context * ctx, unsigned int count) {
+	while (ctx->buffer_size < (int)count) pull_byte(ctx);
+	uint32_t out = ctx->bit_buffer & ((1UL << count) - 1);
+	ctx->bit_buffer >>= count;
+	ctx->buffer_size -= count;
+	return out;
+}
+
 /**
  * Read a single bit from the source.
- * Fills the byte buffer with one byte when it runs out.
  */
 static uint8_t read_bit(struct inflate_context * ctx) {
+	return read_bits(ctx, 1);
+}
 
-	/* When we run out of bits... */
-	if (ctx->buffer_size == 0) {
-		/* Refill from the next input byte */
-		ctx->bit_buffer = ctx->get_input(ctx);
-		/* And restore bit buffer size to 8 bits */
-		ctx->buffer_size = 8;
+/**
+ * Reverse the low [length] bits of a code; Huffman codes are
+ * packed starting from their most significant bit.
+ */
+static unsigned int reverse_bits(unsigned int code, unsigned int length) {
+	unsigned int out = 0;
+	for (unsigned int i = 0; i < length; ++i) {
+		out = (out << 1) | (code & 1);
+		code >>= 1;
 	}
-
-	/* Get the next available bit */
-	int out = ctx->bit_buffer & 1;
-
-	/* Shift the bit buffer forward */
-	ctx->bit_buffer >>= 1;
-
-	/* There is now one less bit available */
-	ctx->buffer_size--;
-
 	return out;
 }
 
 /**
- * Read multible bits, in bit order, from the source.
+ * Build the lookup table from the canonical symbol ordering.
  */
-static uint32_t read_bits(struct inflate_context * ctx, unsigned int count) {
-	uint32_t out = 0;
-	for (unsigned int bit = 0; bit < count; bit++) {
-		/* Read one bit at a time, from least to most significant */
-		out |= (read_bit(ctx) << bit);
+static void build_table(struct huff * out) {
+	uint16_t next_code[16];
+	uint8_t sub_bits[1 << HUFF_FAST_BITS] = {0};
+	unsigned int code = 0;
+
+	for (unsigned int i = 0; i < HUFF_TABLE_SIZE; ++i) out->table[i] = 0;
+
+	/* First code of each length */
+	for (unsigned int i = 1; i < 16; ++i) {
+		code = (code + out->counts[i-1]) << 1;
+		next_code[i] = code;
+	}
+
+	/* Size the secondary tables: each needs enough bits for the longest code under its prefix */
+	unsigned int sym = 0;
+	for (unsigned int len = 1; len < 16; ++len) {
+		code = next_code[len];
+		for (unsigned int i = 0; i < out->counts[len]; ++i, ++sym, ++code) {
+			if (len <= HUFF_FAST_BITS || code >= (1U << len)) continue;
+			unsigned int prefix = reverse_bits(code, len) & HUFF_FAST_MASK;
+			sub_bits[prefix] = len - HUFF_FAST_BITS;
+		}
+	}
+
+	unsigned int next = 1 << HUFF_FAST_BITS;
+	for (unsigned int i = 0; i < (1 << HUFF_FAST_BITS); ++i) {
+		if (!sub_bits[i]) continue;
+		if (next + (1U << sub_bits[i]) > HUFF_TABLE_SIZE) break;
+		out->table[i] = HUFF_LINK | (sub_bits[i] << 12) | next;
+		next += 1 << sub_bits[i];
+	}
+
+	/* Fill in every entry that starts with each code */
+	sym = 0;
+	for (unsigned int len = 1; len < 16; ++len) {
+		code = next_code[len];
+		for (unsigned int i = 0; i < out->counts[len]; ++i, ++sym, ++code) {
+			/* Over-subscribed lengths; leave the rest invalid */
+			if (code >= (1U << len)) continue;
+			uint16_t entry = (len << 9) | out->symbols[sym];
+			unsigned int rev = reverse_bits(code, len);
+			if (len <= HUFF_FAST_BITS) {
+				for (unsigned int j = rev; j < (1 << HUFF_FAST_BITS); j += 1 << len) {
+					out->table[j] = entry;
+				}
+			} else {
+				uint16_t link = out->table[rev & HUFF_FAST_MASK];
+				if (!(link & HUFF_LINK)) continue;
+				unsigned int bits = (link >> 12) & 7;
+				uint16_t * sub = &out->table[link & 0xFFF];
+				for (unsigned int j = rev >> HUFF_FAST_BITS; j < (1U << bits); j += 1 << (len - HUFF_FAST_BITS)) {
+					sub[j] = entry;
+				}
+			}
+		}
 	}
-	return out;
 }
 
 /**
@@ -109,6 +199,8 @@ static void build_huffman(uint8_t * lengths, size_t size, struct huff * out) {
 	for (unsigned int i = 0; i < size; ++i) {
 		if (lengths[i]) out->symbols[offsets[lengths[i]]++] = i;
 	}
+
+	build_table(out);
 }
 
 /**
@@ -147,37 +239,89 @@ static void build_fixed(void) {
 
 /**
  * Decode a symbol from the source using a Huffman table.
+ *
+ * Bits beyond what is in the buffer read as zero, and the table
+ * repeats each code across every value of the bits after it, so
+ * a lookup is good as soon as its code length fits in the buffer.
  */
 static int decode(struct inflate_context * ctx, struct huff * huff) {
-	int count = 0, cur = 0;
-	for (int i = 1; cur >= 0; i++) {
-		cur = (cur << 1) | read_bit(ctx); /* Shift */
-		count += huff->counts[i];
-		cur -= huff->counts[i];
+	while (1) {
+		uint16_t entry = huff->table[ctx->bit_buffer & HUFF_FAST_MASK];
+		if (entry & HUFF_LINK) {
+			unsigned int bits = (entry >> 12) & 7;
+			entry = huff->table[(entry & 0xFFF) + ((ctx->bit_buffer >> HUFF_FAST_BITS) & ((1 << bits) - 1))];
+		}
+		int length = entry >> 9;
+		if (entry && length <= ctx->buffer_size) {
+			ctx->bit_buffer >>= length;
+			ctx->buffer_size -= length;
+			return entry & 0x1FF;
+		}
+		/* No code is longer than 15 bits */
+		if (ctx->buffer_size >= 15) return -1;
+		pull_byte(ctx);
+	}
+}
+
+/**
+ * Pass everything in the ringbuffer since the last flush to the output.
+ */
+static void flush(struct inflate_context * ctx) {
+	struct huff_ring * ring = ctx->ring;
+	if (ring->pointer == ring->flushed) return;
+	size_t len = ring->pointer - ring->flushed;
+	if (ctx->check == CHECK_CRC32) {
+		ctx->checksum = checksum_crc32(ctx->checksum, &ring->data[ring->flushed], len);
+	} else if (ctx->check == CHECK_ADLER32) {
+		ctx->checksum = checksum_adler32(ctx->checksum, &ring->data[ring->flushed], len);
 	}
-	return huff->symbols[count + cur];
+	ctx->total_out += len;
+	if (ctx->write_block) {
+		ctx->write_block(ctx, &ring->data[ring->flushed], len);
+	} else {
+		for (size_t i = ring->flushed; i < ring->pointer; ++i) {
+			ctx->write_output(ctx, ring->data[i]);
+		}
+	}
+	ring->flushed = ring->pointer;
 }
 
 /**
  * Emit one byte to the output, maintaining the ringbuffer.
  * The ringbuffer ensures we can always look back 32K bytes
- * while keeping output streaming.
+ * while keeping output streaming; output is passed on whenever
+ * it wraps and when the stream ends.
  */
-static void emit(struct inflate_context * ctx, unsigned char byte) {
-	if (ctx->ring->pointer == 32768) {
-		ctx->ring->pointer = 0;
+static inline void emit(struct inflate_context * ctx, unsigned char byte) {
+	struct huff_ring * ring = ctx->ring;
+	ring->data[ring->pointer++] = byte;
+	if (ring->pointer == 32768) {
+		flush(ctx);
+		ring->pointer = 0;
+		ring->flushed = 0;
 	}
-
-	ctx->ring->data[ctx->ring->pointer] = byte;
-	ctx->write_output(ctx, byte);
-	ctx->ring->pointer++;
 }
 
 /**
- * Look backwards in the output ring buffer.
+ * Copy [length] bytes from [offset] bytes back in the ringbuffer.
  */
-static uint8_t peek(struct inflate_context * ctx, int offset) {
-	return ctx->ring->data[(ctx->ring->pointer - offset) % 32768];
+static void copy(struct inflate_context * ctx, unsigned int length, unsigned int offset) {
+	struct huff_ring * ring = ctx->ring;
+	size_t from = (ring->pointer - offset) & 32767;
+
+	/* Neither side wraps; a forward byte copy handles overlap */
+	if (from + length <= 32768 && ring->pointer + length < 32768) {
+		uint8_t * dest = &ring->data[ring->pointer];
+		uint8_t * src  = &ring->data[from];
+		for (unsigned int i = 0; i < length; ++i) dest[i] = src[i];
+		ring->pointer += length;
+		return;
+	}
+
+	for (unsigned int i = 0; i < length; ++i) {
+		emit(ctx, ring->data[from]);
+		from = (from + 1) & 32767;
+	}
 }
 
 /**
@@ -240,6 +384,10 @@ static int inflate(struct inflate_context * ctx, struct huff * huff_len, struct
 			break;
 		}
 
+		if (symbol < 0 || symbol > 285) {
+			return 1;
+		}
+
 		if (symbol < 256) {
 			emit(ctx, symbol);
 		} else if (symbol == 256) {
@@ -251,12 +399,10 @@ static int inflate(struct inflate_context * ctx, struct huff * huff_len, struct
 			symbol -= 257;
 			length = read_bits(ctx, lext[symbol]) + lens[symbol];
 			distance = decode(ctx, huff_dist);
+			if (distance < 0 || distance > 29) return 1;
 			offset = read_bits(ctx, dext[distance]) + dists[distance];
 
-			for (int i = 0; i < length; ++i) {
-				uint8_t b = peek(ctx, offset);
-				emit(ctx, b);
-			}
+			copy(ctx, length, offset);
 		}
 	}
 
@@ -299,7 +445,9 @@ static void decode_huffman(struct inflate_context * ctx) {
 	while (count < literals + distances) {
 		int symbol = decode(ctx, &codes);
 
-		if (symbol < 16) {
+		if (symbol < 0) {
+			break;
+		} else if (symbol < 16) {
 			/* 0 - 15: Represent code lengths of 0-15 */
 			lengths[count++] = symbol;
 		} else if (symbol < 19) {
@@ -363,14 +511,18 @@ static int uncompressed(struct inflate_context * ctx) {
 	return 0;
 }
 
-static struct huff_ring data = {0, {0}};
+static struct huff_ring data = {0, 0, {0}};
 
 /**
- * Decompress DEFLATE-compressed data.
+ * Decompress DEFLATE-compressed data, keeping a check value of
+ * the output if asked; the wrappers below verify it.
  */
-int deflate_decompress(struct inflate_context * ctx) {
+static int deflate_checked(struct inflate_context * ctx, int check) {
 	ctx->bit_buffer = 0;
 	ctx->buffer_size = 0;
+	ctx->check = check;
+	ctx->checksum = (check == CHECK_ADLER32) ? 1 : 0;
+	ctx->total_out = 0;
 
 	build_fixed();
 
@@ -378,6 +530,8 @@ int deflate_decompress(struct inflate_context * ctx) {
 		ctx->ring = &data;
 	}
 
+	ctx->ring->flushed = ctx->ring->pointer;
+
 	/* read compressed data */
 	while (1) {
 		/* Read bit */
@@ -396,6 +550,7 @@ int deflate_decompress(struct inflate_context * ctx) {
 				decode_huffman(ctx);
 				break;
 			case 0x03:
+				flush(ctx);
 				return 1;
 		}
 
@@ -404,9 +559,18 @@ int deflate_decompress(struct inflate_context * ctx) {
 		}
 	}
 
+	flush(ctx);
+
 	return 0;
 }
 
+/**
+ * Decompress DEFLATE-compressed data.
+ */
+int deflate_decompress(struct inflate_context * ctx) {
+	return deflate_checked(ctx, CHECK_NONE);
+}
+
 #define GZIP_FLAG_TEXT (1 << 0)
 #define GZIP_FLAG_HCRC (1 << 1)
 #define GZIP_FLAG_EXTR (1 << 2)
@@ -468,14 +632,39 @@ int gzip_decompress(struct inflate_context * ctx) {
 	}
 	(void)crc16;
 
-	int status = deflate_decompress(ctx);
+	int status = deflate_checked(ctx, CHECK_CRC32);
+	if (status) return status;
 
 	/* Read CRC and decompressed size from end of input */
-	unsigned int crc32 = read_32le(ctx);
+	unsigned int crc = read_32le(ctx);
 	unsigned int dsize = read_32le(ctx);
 
-	(void)crc32;
-	(void)dsize;
+	if (crc != ctx->checksum || dsize != ctx->total_out) return 2;
+
+	return 0;
+}
 
-	return status;
+/**
+ * Decompress a zlib (RFC 1950) stream: a two-byte header,
+ * DEFLATE data, and a big-endian Adler-32 of the output.
+ */
+int zlib_decompress(struct inflate_context * ctx) {
+	unsigned int cmf = ctx->get_input(ctx);
+	unsigned int flg = ctx->get_input(ctx);
+
+	if ((cmf & 0xF) != 8) return 1;
+	if (((cmf << 8) | flg) % 31) return 1;
+	if (flg & (1 << 5)) return 1; /* Preset dictionaries are not supported */
+
+	int status = deflate_checked(ctx, CHECK_ADLER32);
+	if (status) return status;
+
+	unsigned int adler = 0;
+	for (int i = 0; i < 4; ++i) {
+		adler = (adler << 8) | ctx->get_input(ctx);
+	}
+
+	if (adler != ctx->checksum) return 2;
+
+	return 0;
 }
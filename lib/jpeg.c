@@ -34,12 +34,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 
 #include <toaru/graphics.h>
 
 #ifndef NO_SSE
-#include <xmmintrin.h>
 #include <emmintrin.h>
 #endif
 
@@ -74,6 +72,12 @@ static int zigzag[] = {
 
 static uint8_t quant_mapping[3] = {0};
 static uint8_t quant[8][64];
+static int32_t quant_scaled[8][64]; /* Natural order, with the IDCT's scale factors folded in */
+
+/* Output is 1/scale of the image size in each direction */
+static int scale = 1;
+static int image_width;
+static int image_height;
 
 static int clamp(int col) {
 	if (col > 255) return 255;
@@ -81,23 +85,31 @@ static int clamp(int col) {
 	return col;
 }
 
-/* YCbCr to RGB conversion */
-static void color_conversion(
-		float Y, float Cb, float Cr,
-		int *R, int *G, int *B
-	) {
-	float r = (Cr*(2.0-2.0*0.299) + Y);
-	float b = (Cb*(2.0-2.0*0.114) + Y);
-	float g = (Y - 0.144 * b - 0.229 * r) / 0.587;
-
-	*R = clamp(r + 128);
-	*G = clamp(g + 128);
-	*B = clamp(b + 128);
-}
+/*
+ * Scale factors for the AAN IDCT, in natural order:
+ * cos(k*pi/16) * sqrt(2) for row and column, times 2^14
+ */
+static const uint16_t aanscales[64] = {
+	16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+	22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+	21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+	19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+	16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+	12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+	 8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+	 4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247,
+};
 
-static int xy_to_lin(int x, int y) {
-	return x + y * 8;
-}
+#define IDCT_CONST_BITS 8
+#define IDCT_PASS1_BITS 2
+
+#define FIX_1_082392200 277
+#define FIX_1_414213562 362
+#define FIX_1_847759065 473
+#define FIX_2_613125930 669
+
+#define DESCALE(x,n) (((x) + (1 << ((n)-1))) >> (n))
+#define MULTIPLY(v,c) DESCALE((v) * (c), IDCT_CONST_BITS)
 
 struct huffman_table {
 	uint8_t lengths[16];
@@ -106,9 +118,8 @@ struct huffman_table {
 
 struct stream {
 	FILE * file;
-	uint8_t byte;
-	int have;
-	int pos;
+	uint32_t bits; /* Upcoming bits, most significant first */
+	int count;     /* Number of valid bits in the above */
 };
 
 static void define_quant_table(FILE * f, int len) {
@@ -117,7 +128,12 @@ static void define_quant_table(FILE * f, int len) {
 	while (len > 0) {
 		uint8_t hdr;
 		fread(&hdr, 1, 1, f);
-		fread(&quant[(hdr) & 0xF], 64, 1, f);
+		int id = hdr & 0xF;
+		fread(&quant[id], 64, 1, f);
+		for (int i = 0; i < 64; ++i) {
+			int k = zigzag[i];
+			quant_scaled[id][k] = DESCALE((int32_t)quant[id][i] * aanscales[k], 14 - IDCT_PASS1_BITS);
+		}
 		len -= 65;
 	}
 	TRACE("Done");
@@ -142,8 +158,10 @@ static void baseline_dct(FILE * f, int len) {
 	len -= sizeof(struct dct);
 
 	TRACE("Image dimensions are %d×%d", dct.width, dct.height);
-	sprite->width  = dct.width;
-	sprite->height = dct.height;
+	image_width  = dct.width;
+	image_height = dct.height;
+	sprite->width  = (dct.width  + scale - 1) / scale;
+	sprite->height = (dct.height + scale - 1) / scale;
 	sprite->bitmap = malloc(sizeof(uint32_t) * sprite->width * sprite->height);
 	sprite->masks = NULL;
 	sprite->alpha = 0;
@@ -206,77 +224,194 @@ static void define_huffman_table(FILE * f, int len) {
 	}
 }
 
-struct idct {
-	float base[64];
-};
-
-/**
- * norm_coeff[0] = 0.35355339059
- * norm_coeff[1] = 0.5
+/*
+ * Fixed-point AAN inverse DCT (after the IJG jidctfst.c).
+ * Coefficients are dequantized with quant_scaled[], so they arrive
+ * carrying the AAN scale factors and IDCT_PASS1_BITS of fraction.
+ * Produces level-shifted, clamped samples.
  */
-static float cosines[8][8] = {
-	{ 0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059 },
-	{ 0.490392640202,0.415734806151,0.27778511651,0.0975451610081,-0.0975451610081,-0.27778511651,-0.415734806151,-0.490392640202 },
-	{ 0.461939766256,0.191341716183,-0.191341716183,-0.461939766256,-0.461939766256,-0.191341716183,0.191341716183,0.461939766256 },
-	{ 0.415734806151,-0.0975451610081,-0.490392640202,-0.27778511651,0.27778511651,0.490392640202,0.0975451610081,-0.415734806151 },
-	{ 0.353553390593,-0.353553390593,-0.353553390593,0.353553390593,0.353553390593,-0.353553390593,-0.353553390593,0.353553390593 },
-	{ 0.27778511651,-0.490392640202,0.0975451610081,0.415734806151,-0.415734806151,-0.0975451610081,0.490392640202,-0.27778511651 },
-	{ 0.191341716183,-0.461939766256,0.461939766256,-0.191341716183,-0.191341716183,0.461939766256,-0.461939766256,0.191341716183 },
-	{ 0.0975451610081,-0.27778511651,0.415734806151,-0.490392640202,0.490392640202,-0.415734806151,0.27778511651,-0.0975451610081 },
-};
+static void idct_block(const int32_t * in, uint8_t * out) {
+	int32_t ws[64];
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z5, z10, z11, z12, z13;
+
+	/* Pass 1: columns */
+	for (int c = 0; c < 8; ++c) {
+		const int32_t * i = &in[c];
+		int32_t * w = &ws[c];
+
+		if (!(i[8] | i[16] | i[24] | i[32] | i[40] | i[48] | i[56])) {
+			/* Only the DC term; very common */
+			for (int k = 0; k < 8; ++k) w[8*k] = i[0];
+			continue;
+		}
 
-static float premul[8][8][8][8]= {{{{0}}}};
+		/* Even part */
+		tmp10 = i[0] + i[32];
+		tmp11 = i[0] - i[32];
+		tmp13 = i[16] + i[48];
+		tmp12 = MULTIPLY(i[16] - i[48], FIX_1_414213562) - tmp13;
+
+		tmp0 = tmp10 + tmp13;
+		tmp3 = tmp10 - tmp13;
+		tmp1 = tmp11 + tmp12;
+		tmp2 = tmp11 - tmp12;
+
+		/* Odd part */
+		z13 = i[40] + i[24];
+		z10 = i[40] - i[24];
+		z11 = i[8] + i[56];
+		z12 = i[8] - i[56];
+
+		tmp7 = z11 + z13;
+		tmp11 = MULTIPLY(z11 - z13, FIX_1_414213562);
+
+		z5 = MULTIPLY(z10 + z12, FIX_1_847759065);
+		tmp10 = MULTIPLY(z12, FIX_1_082392200) - z5;
+		tmp12 = MULTIPLY(z10, -FIX_2_613125930) + z5;
+
+		tmp6 = tmp12 - tmp7;
+		tmp5 = tmp11 - tmp6;
+		tmp4 = tmp10 + tmp5;
+
+		w[8*0] = tmp0 + tmp7;
+		w[8*7] = tmp0 - tmp7;
+		w[8*1] = tmp1 + tmp6;
+		w[8*6] = tmp1 - tmp6;
+		w[8*2] = tmp2 + tmp5;
+		w[8*5] = tmp2 - tmp5;
+		w[8*4] = tmp3 + tmp4;
+		w[8*3] = tmp3 - tmp4;
+	}
 
-static void add_idc(struct idct * self, int n, int m, int coeff) {
-#ifdef NO_SSE
-	for (int y = 0; y < 8; ++y) {
-		for (int x = 0; x < 8; ++x) {
-			self->base[xy_to_lin(x, y)] += premul[n][m][y][x] * coeff;
-		}
+	/* Pass 2: rows, removing the fraction bits and the factor of 8 */
+	for (int r = 0; r < 8; ++r) {
+		const int32_t * w = &ws[r*8];
+		uint8_t * o = &out[r*8];
+
+		/* Even part */
+		tmp10 = w[0] + w[4];
+		tmp11 = w[0] - w[4];
+		tmp13 = w[2] + w[6];
+		tmp12 = MULTIPLY(w[2] - w[6], FIX_1_414213562) - tmp13;
+
+		tmp0 = tmp10 + tmp13;
+		tmp3 = tmp10 - tmp13;
+		tmp1 = tmp11 + tmp12;
+		tmp2 = tmp11 - tmp12;
+
+		/* Odd part */
+		z13 = w[5] + w[3];
+		z10 = w[5] - w[3];
+		z11 = w[1] + w[7];
+		z12 = w[1] - w[7];
+
+		tmp7 = z11 + z13;
+		tmp11 = MULTIPLY(z11 - z13, FIX_1_414213562);
+
+		z5 = MULTIPLY(z10 + z12, FIX_1_847759065);
+		tmp10 = MULTIPLY(z12, FIX_1_082392200) - z5;
+		tmp12 = MULTIPLY(z10, -FIX_2_613125930) + z5;
+
+		tmp6 = tmp12 - tmp7;
+		tmp5 = tmp11 - tmp6;
+		tmp4 = tmp10 + tmp5;
+
+		o[0] = clamp(DESCALE(tmp0 + tmp7, IDCT_PASS1_BITS + 3) + 128);
+		o[7] = clamp(DESCALE(tmp0 - tmp7, IDCT_PASS1_BITS + 3) + 128);
+		o[1] = clamp(DESCALE(tmp1 + tmp6, IDCT_PASS1_BITS + 3) + 128);
+		o[6] = clamp(DESCALE(tmp1 - tmp6, IDCT_PASS1_BITS + 3) + 128);
+		o[2] = clamp(DESCALE(tmp2 + tmp5, IDCT_PASS1_BITS + 3) + 128);
+		o[5] = clamp(DESCALE(tmp2 - tmp5, IDCT_PASS1_BITS + 3) + 128);
+		o[4] = clamp(DESCALE(tmp3 + tmp4, IDCT_PASS1_BITS + 3) + 128);
+		o[3] = clamp(DESCALE(tmp3 - tmp4, IDCT_PASS1_BITS + 3) + 128);
 	}
-#else
-	__m128 c = _mm_set_ps(coeff,coeff,coeff,coeff);
-	for (int y = 0; y < 8; ++y) {
-		__m128 a, b;
-		/* base[y][x] = base[y][x] + premul[n][m][y][x] * coeff */
-
-		/* x = 0..3 */
-		a = _mm_load_ps(&premul[n][m][y][0]);
-		a = _mm_mul_ps(a,c);
-		b = _mm_load_ps(&self->base[xy_to_lin(0,y)]);
-		a = _mm_add_ps(a,b);
-		_mm_store_ps(&self->base[xy_to_lin(0,y)], a);
-
-		/* x = 4..7 */
-		a = _mm_load_ps(&premul[n][m][y][4]);
-		a = _mm_mul_ps(a,c);
-		b = _mm_load_ps(&self->base[xy_to_lin(4,y)]);
-		a = _mm_add_ps(a,b);
-		_mm_store_ps(&self->base[xy_to_lin(4,y)], a);
+}
+
+/*
+ * Produce a block's samples at the output scale. At 1/8 that is
+ * just the DC term; smaller reductions box-filter the full block.
+ */
+static void reduce_block(const int32_t * coef, uint8_t * out) {
+	if (scale == 8) {
+		out[0] = clamp(DESCALE(coef[0], IDCT_PASS1_BITS + 3) + 128);
+		return;
+	}
+
+	idct_block(coef, out);
+	if (scale == 1) return;
+
+	/* In place: each output lands before any input still to be read */
+	int size = 8 / scale;
+	int area = scale * scale;
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			int sum = 0;
+			for (int yy = 0; yy < scale; ++yy) {
+				for (int xx = 0; xx < scale; ++xx) {
+					sum += out[(y * scale + yy) * 8 + x * scale + xx];
+				}
+			}
+			out[y * size + x] = (sum + area / 2) / area;
+		}
 	}
-#endif
 }
 
-static void add_zigzag(struct idct * self, int zi, int coeff) {
-	int i = zigzag[zi];
-	int n = i & 0x7;
-	int m = i >> 3;
-	add_idc(self, n, m, coeff);
+/*
+ * YCbCr to RGB conversion (JFIF), in fixed point:
+ *   R = Y + 1.402 Cr
+ *   G = Y - 0.344136 Cb - 0.714136 Cr
+ *   B = Y + 1.772 Cb
+ * Chroma is scaled up by 4 so the 2^14 constants come out of
+ * a 16-bit high multiply; the SSE and scalar paths agree exactly.
+ */
+#define YCC_CR_R 22970
+#define YCC_CB_G  5638
+#define YCC_CR_G 11700
+#define YCC_CB_B 29032
+
+static void color_convert(const uint8_t * Y, const uint8_t * Cb, const uint8_t * Cr, uint32_t * out, int count) {
+#ifndef NO_SSE
+	if (count == 8) {
+		__m128i zero = _mm_setzero_si128();
+		__m128i offset = _mm_set1_epi16(128);
+		__m128i y  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)Y), zero);
+		__m128i cb = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)Cb), zero), offset), 2);
+		__m128i cr = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)Cr), zero), offset), 2);
+
+		__m128i r = _mm_add_epi16(y, _mm_mulhi_epi16(cr, _mm_set1_epi16(YCC_CR_R)));
+		__m128i g = _mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhi_epi16(cb, _mm_set1_epi16(YCC_CB_G))), _mm_mulhi_epi16(cr, _mm_set1_epi16(YCC_CR_G)));
+		__m128i b = _mm_add_epi16(y, _mm_mulhi_epi16(cb, _mm_set1_epi16(YCC_CB_B)));
+
+		/* Saturate to bytes and interleave as B G R A */
+		__m128i r8 = _mm_packus_epi16(r, r);
+		__m128i g8 = _mm_packus_epi16(g, g);
+		__m128i b8 = _mm_packus_epi16(b, b);
+		__m128i bg = _mm_unpacklo_epi8(b8, g8);
+		__m128i ra = _mm_unpacklo_epi8(r8, _mm_set1_epi8(-1));
+		_mm_storeu_si128((__m128i *)&out[0], _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)&out[4], _mm_unpackhi_epi16(bg, ra));
+		return;
+	}
+#endif
+	for (int i = 0; i < count; ++i) {
+		int cb = (Cb[i] - 128) * 4;
+		int cr = (Cr[i] - 128) * 4;
+		int r = clamp(Y[i] + ((cr * YCC_CR_R) >> 16));
+		int g = clamp(Y[i] - ((cb * YCC_CB_G) >> 16) - ((cr * YCC_CR_G) >> 16));
+		int b = clamp(Y[i] + ((cb * YCC_CB_B) >> 16));
+		out[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+	}
 }
 
-/* Read a bit from the stream */
-static int get_bit(struct stream * st) {
-	while ((st->pos >> 3) >= st->have) {
-		/* We have finished using the current byte and need to read another one */
+/* Top up the bit buffer with whole bytes from the stream */
+static void fill_bits(struct stream * st) {
+	while (st->count <= 24) {
 		int t = fgetc(st->file);
-		if (t < 0) {
-			/* EOF */
-			st->byte = 0;
-		} else {
-			st->byte = t;
-		}
+		uint8_t byte = (t < 0) ? 0 : t; /* EOF */
 
-		if (st->byte == 0xFF) {
+		if (byte == 0xFF) {
 			/*
 			 * If we see 0xFF, it's followed by a 0x00
 			 * that should be skipped.
@@ -287,29 +422,31 @@ static int get_bit(struct stream * st) {
 				 * If it's *not*, we reached the end of the file - but
 				 * this shouldn't happen.
 				 */
-				st->byte = 0;
+				byte = 0;
 			}
 		}
 
-		/* We've seen a new byte */
-		st->have++;
+		st->bits |= (uint32_t)byte << (24 - st->count);
+		st->count += 8;
 	}
+}
 
-	/* Extract appropriate bit from this byte */
-	uint8_t b = st->byte;
-	int s = 7 - (st->pos & 0x7);
-
-	/* We move forward one position in the bit stream */
-	st->pos += 1;
-	return (b >> s) & 1;
+/* Read a bit from the stream */
+static int get_bit(struct stream * st) {
+	if (!st->count) fill_bits(st);
+	int out = st->bits >> 31;
+	st->bits <<= 1;
+	st->count--;
+	return out;
 }
 
 /* Advance forward and get the n'th next bit */
 static int get_bitn(struct stream * st, int l) {
-	int val = 0;
-	for (int i = 0; i < l; ++i) {
-		val = val * 2 + get_bit(st);
-	}
+	if (l <= 0) return 0;
+	if (st->count < l) fill_bits(st);
+	int val = st->bits >> (32 - l);
+	st->bits <<= l;
+	st->count -= l;
 	return val;
 }
 
@@ -340,6 +477,7 @@ static int get_code(struct huffman_table * table, struct stream * st) {
 
 /* Decode Huffman codes to values */
 static int decode(int code, int bits) {
+	if (code <= 0) return 0;
 	int l = 1L << (code - 1);
 	if (bits >= l) {
 		return bits;
@@ -348,51 +486,42 @@ static int decode(int code, int bits) {
 	}
 }
 
-/* Build IDCT matrix */
-static struct idct * build_matrix(struct idct * i, struct stream * st, int idx, uint8_t * quant, int oldcoeff, int * outcoeff) {
-	memset(i, 0, sizeof(struct idct));
+/* Decode one block's coefficients into natural order, dequantized */
+static void decode_block(struct stream * st, int idx, int32_t * qt, int * dc, int32_t * coef) {
+	memset(coef, 0, sizeof(int32_t) * 64);
 
 	int code = get_code(&huffman_tables[idx], st);
 	int bits = get_bitn(st, code);
-	int dccoeff = decode(code, bits) + oldcoeff;
-
-	add_zigzag(i, 0, dccoeff * quant[0]);
-	int l = 1;
+	*dc += decode(code, bits);
+	coef[0] = *dc * qt[0];
 
-	while (l < 64) {
+	for (int l = 1; l < 64; ++l) {
 		code = get_code(&huffman_tables[16+idx], st);
-		if (code == 0) break;
+		if (code <= 0) break;
 		if (code > 15) {
+			/* Run of zeros before this coefficient */
 			l += (code >> 4);
 			code = code & 0xF;
 		}
+		if (l > 63) break;
 		bits = get_bitn(st, code);
-		int coeff = decode(code, bits);
-		add_zigzag(i, l, coeff * quant[l]);
-		l += 1;
-	}
-
-	*outcoeff = dccoeff;
-	return i;
-}
-
-/* Set pixel in sprite buffer with bounds checking */
-static void set_pixel(int x, int y, uint32_t color) {
-	if ((x < sprite->width) && (y < sprite->height)) {
-		SPRITE(sprite,x,y) = color;
+		coef[zigzag[l]] = decode(code, bits) * qt[zigzag[l]];
 	}
 }
 
-/* Concvert YCbCr values to RGB pixels */
-static void draw_matrix(int x, int y, struct idct * L, struct idct * cb, struct idct * cr) {
-	for (int yy = 0; yy < 8; ++yy) {
-		for (int xx = 0; xx < 8; ++xx) {
-			int o = xy_to_lin(xx,yy);
-			int r, g, b;
-			color_conversion(L->base[o], cb->base[o], cr->base[o], &r, &g, &b);
-			uint32_t c = 0xFF000000 | (r << 16) | (g << 8) | b;
-			set_pixel((x * 8 + xx), (y * 8 + yy), c);
-		}
+/* Convert a block's YCbCr samples to RGB pixels, clipped to the sprite */
+static void draw_block(int x, int y, uint8_t * L, uint8_t * cb, uint8_t * cr) {
+	int size = 8 / scale;
+	int px = x * size;
+	int count = sprite->width - px;
+	if (count > size) count = size;
+
+	for (int yy = 0; yy < size; ++yy) {
+		int py = y * size + yy;
+		if (py >= sprite->height) break;
+		uint32_t row[8];
+		color_convert(&L[yy * size], &cb[yy * size], &cr[yy * size], row, size);
+		memcpy(&SPRITE(sprite, px, py), row, sizeof(uint32_t) * count);
 	}
 }
 
@@ -411,51 +540,41 @@ static void start_of_scan(FILE * f, int len) {
 	int old_lum = 0;
 	int old_crd = 0;
 	int old_cbd = 0;
-	for (int y = 0; y < sprite->height / 8 + !!(sprite->height & 0x7); ++y) {
+	for (int y = 0; y < (image_height + 7) / 8; ++y) {
 		TRACE("Star row %d", y );
-		for (int x = 0; x < sprite->width / 8 + !!(sprite->width & 0x7); ++x) {
-			if (y >= 134) {
-				TRACE("Start col %d", x);
-			}
-
-			/* Build matrices */
-			struct idct matL, matCr, matCb;
-			build_matrix(&matL,  st, 0, quant[quant_mapping[0]], old_lum, &old_lum);
-			build_matrix(&matCb, st, 1, quant[quant_mapping[1]], old_cbd, &old_cbd);
-			build_matrix(&matCr, st, 1, quant[quant_mapping[2]], old_crd, &old_crd);
-
-			if (y >= 134) {
-				TRACE("Draw col %d", x);
-			}
-			draw_matrix(x, y, &matL, &matCb, &matCr);
+		for (int x = 0; x < (image_width + 7) / 8; ++x) {
+			int32_t coef[64];
+			uint8_t L[64], Cb[64], Cr[64];
+
+			decode_block(st, 0, quant_scaled[quant_mapping[0]], &old_lum, coef);
+			reduce_block(coef, L);
+			decode_block(st, 1, quant_scaled[quant_mapping[1]], &old_cbd, coef);
+			reduce_block(coef, Cb);
+			decode_block(st, 1, quant_scaled[quant_mapping[2]], &old_crd, coef);
+			reduce_block(coef, Cr);
+
+			draw_block(x, y, L, Cb, Cr);
 		}
 	}
 
 	TRACE("Done.");
 }
 
-int load_sprite_jpg(sprite_t * tsprite, char * filename) {
+int load_sprite_jpg_scaled(sprite_t * tsprite, char * filename, int denom) {
+	if (denom != 1 && denom != 2 && denom != 4 && denom != 8) {
+		return 1;
+	}
+
 	FILE * f = fopen(filename, "r");
 	if (!f) {
 		return 1;
 	}
 
 	sprite = tsprite;
+	scale = denom;
 
 	memset(huffman_tables, 0, sizeof(huffman_tables));
 
-	if (premul[0][0][0][0] == 0.0) {
-		for (int n = 0; n < 8; ++n) {
-			for (int m = 0; m < 8; ++m) {
-				for (int y = 0; y < 8; ++y) {
-					for (int x = 0; x < 8; ++x) {
-						premul[n][m][y][x] = cosines[n][x] * cosines[m][y];
-					}
-				}
-			}
-		}
-	}
-
 	while (1) {
 
 		/* Read a header */
@@ -505,3 +624,7 @@ int load_sprite_jpg(sprite_t * tsprite, char * filename) {
 
 	return 0;
 }
+
+int load_sprite_jpg(sprite_t * tsprite, char * filename) {
+	return load_sprite_jpg_scaled(tsprite, filename, 1);
+}
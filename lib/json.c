@@ -55,92 +55,116 @@ static void whitespace(struct JSON_Context * ctx) {
 	}
 }
 
-static Value * string(struct JSON_Context * ctx) {
-	if (peek(ctx) != '"') return NULL;
-	advance(ctx);
+/*
+ * Decode one character (or escape sequence) of a string body at s[*i],
+ * writing up to three bytes of UTF-8 to `out` and advancing *i past it.
+ * Returns the number of bytes written, or -1 on a bad escape.
+ */
+static int decode_next(const char * s, int * i, char * out) {
+	int ch = s[*i];
+	if (ch != '\\') {
+		out[0] = ch;
+		(*i)++;
+		return 1;
+	}
+	(*i)++;
+	ch = s[*i];
+	/* Don't step past the end of a truncated string */
+	if (ch == '\0') return -1;
+	(*i)++;
+	switch (ch) {
+		case '"':  out[0] = '"';  return 1;
+		case '\\': out[0] = '\\'; return 1;
+		case '/':  out[0] = '/';  return 1;
+		case 'b':  out[0] = '\b'; return 1;
+		case 'f':  out[0] = '\f'; return 1;
+		case 'n':  out[0] = '\n'; return 1;
+		case 'r':  out[0] = '\r'; return 1;
+		case 't':  out[0] = '\t'; return 1;
+		case 'u':  break;
+		default:   return -1;
+	}
 
-	int size = 4;
-	char * tmp = malloc(4);
-	tmp[0] = 0;
-	int used = 0;
+	/* Parse hex */
+	uint32_t val = 0;
+	for (int j = 0; j < 4; ++j) {
+		ch = s[*i];
+		if (!isxdigit(ch)) return -1;
+		val = (val << 4) | (isdigit(ch) ? ch - '0' : (tolower(ch) - 'a' + 10));
+		(*i)++;
+	}
 
-#define add(c) do { \
-	if (used + 1 == size) { \
-		size *= 2; \
-		tmp = realloc(tmp, size); \
-	} \
-	tmp[used] = c; \
-	tmp[used+1] = 0; \
-	used++; \
-} while (0)
+	if (val < 0x0080) {
+		out[0] = val;
+		return 1;
+	} else if (val < 0x0800) {
+		out[0] = 0xC0 | (val >> 6);
+		out[1] = 0x80 | (val & 0x3F);
+		return 2;
+	} else {
+		out[0] = 0xE0 | (val >> 12);
+		out[1] = 0x80 | ((val >> 6) & 0x3F);
+		out[2] = 0x80 | (val & 0x3F);
+		return 3;
+	}
+}
 
-	while (1) {
-		int ch = peek(ctx);
-		if (ch == 0) goto string_error;
-		if (ch == '"') {
-			break;
-		} else if (ch == '\\') {
-			advance(ctx);
-			ch = peek(ctx);
-			if (ch == '"') add('"');
-			else if (ch == '\\') add('\\');
-			else if (ch == '/') add('/');
-			else if (ch == 'b') add('\b');
-			else if (ch == 'f') add('\f');
-			else if (ch == 'n') add('\n');
-			else if (ch == 'r') add('\r');
-			else if (ch == 't') add('\t');
-			else if (ch == 'u') {
-				/* Parse hex */
-				advance(ctx);
-				char hex_digits[5];
-				if (!isxdigit(peek(ctx))) goto string_error;
-				hex_digits[0] = peek(ctx); advance(ctx);
-				if (!isxdigit(peek(ctx))) goto string_error;
-				hex_digits[1] = peek(ctx); advance(ctx);
-				if (!isxdigit(peek(ctx))) goto string_error;
-				hex_digits[2] = peek(ctx); advance(ctx);
-				if (!isxdigit(peek(ctx))) goto string_error;
-				hex_digits[3] = peek(ctx); /* will be advanced later */
-				hex_digits[4] = 0;
-
-				uint32_t val = strtoul(hex_digits, NULL, 16);
-				if (val < 0x0080) {
-					add(val);
-				} else if (val < 0x0800) {
-					add(0xC0 | (val >> 6));
-					add(0x80 | (val & 0x3F));
-				} else {
-					add(0xE0 | (val >> 12));
-					add(0x80 | ((val >> 6) & 0x3F));
-					add(0x80 | (val & 0x3F));
-				}
-			} else {
-				goto string_error;
-			}
-			advance(ctx);
-		} else {
-			add(ch);
-			advance(ctx);
+/*
+ * Step over a string, checking its escapes. On success the context
+ * is past the closing quote, *start is the index of the first byte of
+ * the body and the decoded length is returned; -1 otherwise.
+ */
+static int scan_string(struct JSON_Context * ctx, int * start, int * escaped) {
+	if (peek(ctx) != '"') return -1;
+	advance(ctx);
+	*start = ctx->c;
+	if (escaped) *escaped = 0;
+
+	int size = 0;
+	char tmp[4];
+	while (peek(ctx) != '"') {
+		if (peek(ctx) == 0) {
+			ctx->error = "Unexpected EOF?";
+			return -1;
+		}
+		if (peek(ctx) == '\\' && escaped) *escaped = 1;
+		int n = decode_next(ctx->string, &ctx->c, tmp);
+		if (n < 0) {
+			ctx->error = "Invalid escape in string";
+			return -1;
 		}
+		size += n;
 	}
+	advance(ctx);
+	return size;
+}
 
-	if (peek(ctx) != '"') {
-		ctx->error = "Unexpected EOF?";
-		goto string_error;
+/* Decode a string body that has already been scanned */
+static void decode_string(const char * s, int start, char * out) {
+	int i = start;
+	while (s[i] != '"') {
+		out += decode_next(s, &i, out);
 	}
-	advance(ctx);
+	*out = '\0';
+}
+
+static char * string_raw(struct JSON_Context * ctx) {
+	int start;
+	int size = scan_string(ctx, &start, NULL);
+	if (size < 0) return NULL;
+	char * out = malloc(size + 1);
+	decode_string(ctx->string, start, out);
+	return out;
+}
+
+static Value * string(struct JSON_Context * ctx) {
+	char * str = string_raw(ctx);
+	if (!str) return NULL;
 
 	Value * out = malloc(sizeof(Value));
 	out->type = JSON_TYPE_STRING;
-	out->string = strdup(tmp);
-	free(tmp);
-
+	out->string = str;
 	return out;
-
-string_error:
-	free(tmp);
-	return NULL;
 }
 
 static Value * object(struct JSON_Context * ctx) {
@@ -162,9 +186,9 @@ static Value * object(struct JSON_Context * ctx) {
 
 	while (1) {
 		whitespace(ctx);
-		Value * s = string(ctx);
+		char * key = string_raw(ctx);
 
-		if (!s) {
+		if (!key) {
 			ctx->error = "Expected string";
 			break;
 		}
@@ -173,14 +197,20 @@ static Value * object(struct JSON_Context * ctx) {
 
 		if (peek(ctx) != ':') {
 			ctx->error = "Expected :";
+			free(key);
 			break;
 		}
 		advance(ctx);
 
 		Value * v = value(ctx);
 
-		hashmap_set(output, s->string, v);
-		json_free(s);
+		if (!v) {
+			free(key);
+			break;
+		}
+
+		hashmap_set(output, key, v);
+		free(key);
 
 		if (peek(ctx) == '}') {
 			advance(ctx);
@@ -205,27 +235,20 @@ _object_done:
 	return out;
 }
 
+/* Match a bare word; returns 0 if it was there */
+static int literal(struct JSON_Context * ctx, const char * word) {
+	for (; *word; word++) {
+		if (peek(ctx) != *word) return -1;
+		advance(ctx);
+	}
+	return 0;
+}
+
 static Value * boolean(struct JSON_Context * ctx) {
 	int value = -1;
-	if (peek(ctx) == 't') {
-		advance(ctx);
-		if (peek(ctx) != 'r') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
-		if (peek(ctx) != 'u') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
-		if (peek(ctx) != 'e') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
+	if (peek(ctx) == 't' && !literal(ctx, "true")) {
 		value = 1;
-	} else if (peek(ctx) == 'f') {
-		advance(ctx);
-		if (peek(ctx) != 'a') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
-		if (peek(ctx) != 'l') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
-		if (peek(ctx) != 's') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
-		if (peek(ctx) != 'e') { ctx->error = "Invalid literal while parsing bool"; return NULL; }
-		advance(ctx);
+	} else if (peek(ctx) == 'f' && !literal(ctx, "false")) {
 		value = 0;
 	} else { ctx->error = "Invalid literal while parsing bool"; return NULL; }
 
@@ -236,21 +259,14 @@ static Value * boolean(struct JSON_Context * ctx) {
 }
 
 static Value * null(struct JSON_Context * ctx) {
-	if (peek(ctx) != 'n') { ctx->error = "Invalid literal while parsing null"; return NULL; }
-	advance(ctx);
-	if (peek(ctx) != 'u') { ctx->error = "Invalid literal while parsing null"; return NULL; }
-	advance(ctx);
-	if (peek(ctx) != 'l') { ctx->error = "Invalid literal while parsing null"; return NULL; }
-	advance(ctx);
-	if (peek(ctx) != 'l') { ctx->error = "Invalid literal while parsing null"; return NULL; }
-	advance(ctx);
+	if (literal(ctx, "null")) { ctx->error = "Invalid literal while parsing null"; return NULL; }
 
 	Value * out = malloc(sizeof(Value));
 	out->type = JSON_TYPE_NULL;
 	return out;
 }
 
-static Value * number(struct JSON_Context * ctx) {
+static int parse_number(struct JSON_Context * ctx, double * out) {
 
 	double value = 0;
 	int sign = 1;
@@ -273,7 +289,7 @@ static Value * number(struct JSON_Context * ctx) {
 		}
 	} else {
 		ctx->error = "Expected digit";
-		return NULL;
+		return -1;
 	}
 
 	if (peek(ctx) == '.') {
@@ -284,7 +300,7 @@ static Value * number(struct JSON_Context * ctx) {
 		/* read at least one digit */
 		if (!isdigit(peek(ctx))) {
 			ctx->error = "Expected digit";
-			return NULL;
+			return -1;
 		}
 		while (isdigit(peek(ctx))) {
 			value += multiplier * (peek(ctx) - '0');
@@ -306,7 +322,7 @@ static Value * number(struct JSON_Context * ctx) {
 		/* read digits */
 		if (!isdigit(peek(ctx))) {
 			ctx->error = "Expected digit";
-			return NULL;
+			return -1;
 		}
 		double exp = peek(ctx) - '0';
 		advance(ctx);
@@ -319,10 +335,17 @@ static Value * number(struct JSON_Context * ctx) {
 		value = value * pow(10.0,exp * exp_sign);
 	}
 
+	*out = value * sign;
+	return 0;
+}
+
+static Value * number(struct JSON_Context * ctx) {
+	double value;
+	if (parse_number(ctx, &value)) return NULL;
+
 	Value * out = malloc(sizeof(Value));
 	out->type = JSON_TYPE_NUMBER;
-	out->number = value * sign;
-
+	out->number = value;
 	return out;
 }
 
@@ -430,3 +453,187 @@ Value * json_parse_file(const char * filename) {
 	free(tmp);
 	return out;
 }
+
+/* What the reader wants to see next */
+enum {
+	EXPECT_VALUE,
+	EXPECT_VALUE_OR_END, /* Just after [ */
+	EXPECT_KEY,
+	EXPECT_KEY_OR_END,   /* Just after { */
+	EXPECT_COMMA_OR_END,
+	EXPECT_DONE,
+};
+
+void json_reader_init(struct JSON_Reader * reader, const char * str) {
+	reader->string = str;
+	reader->c = 0;
+	reader->error = NULL;
+	reader->depth = 0;
+	reader->expect = EXPECT_VALUE;
+}
+
+static int reader_error(struct JSON_Reader * reader, struct JSON_Context * ctx, const char * error) {
+	reader->c = ctx->c;
+	reader->error = ctx->error ? ctx->error : error;
+	return JSON_TOKEN_ERROR;
+}
+
+/* A value or container just finished */
+static void reader_after_value(struct JSON_Reader * reader) {
+	reader->expect = reader->depth ? EXPECT_COMMA_OR_END : EXPECT_DONE;
+}
+
+static int reader_close(struct JSON_Reader * reader, struct JSON_Context * ctx, int ch) {
+	if (!reader->depth || reader->stack[reader->depth-1] != (ch == '}' ? '{' : '[')) {
+		return reader_error(reader, ctx, "Mismatched close");
+	}
+	advance(ctx);
+	reader->depth--;
+	reader_after_value(reader);
+	reader->c = ctx->c;
+	return ch == '}' ? JSON_TOKEN_OBJECT_END : JSON_TOKEN_ARRAY_END;
+}
+
+static int reader_open(struct JSON_Reader * reader, struct JSON_Context * ctx, int ch) {
+	if (reader->depth == JSON_READER_DEPTH) {
+		return reader_error(reader, ctx, "Nested too deeply");
+	}
+	advance(ctx);
+	reader->stack[reader->depth++] = ch;
+	reader->expect = (ch == '{') ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+	reader->c = ctx->c;
+	return ch == '{' ? JSON_TOKEN_OBJECT_BEGIN : JSON_TOKEN_ARRAY_BEGIN;
+}
+
+static int reader_string(struct JSON_Context * ctx, struct JSON_Token * token) {
+	int start;
+	int length = scan_string(ctx, &start, &token->escaped);
+	if (length < 0) return -1;
+	token->start = ctx->string + start;
+	token->length = length;
+	return 0;
+}
+
+int json_next(struct JSON_Reader * reader, struct JSON_Token * token) {
+	if (reader->error) return JSON_TOKEN_ERROR;
+
+	struct JSON_Context _ctx = { reader->string, reader->c, NULL };
+	struct JSON_Context * ctx = &_ctx;
+	whitespace(ctx);
+	int ch = peek(ctx);
+
+	token->type = JSON_TOKEN_ERROR;
+
+	switch (reader->expect) {
+		case EXPECT_DONE:
+			if (ch) return reader_error(reader, ctx, "Trailing data after document");
+			reader->c = ctx->c;
+			return (token->type = JSON_TOKEN_END);
+
+		case EXPECT_COMMA_OR_END:
+			if (ch == '}' || ch == ']') return (token->type = reader_close(reader, ctx, ch));
+			if (ch != ',') return reader_error(reader, ctx, "Expected , or close");
+			advance(ctx);
+			whitespace(ctx);
+			ch = peek(ctx);
+			reader->expect = (reader->stack[reader->depth-1] == '{') ? EXPECT_KEY : EXPECT_VALUE;
+			break;
+
+		case EXPECT_KEY_OR_END:
+			if (ch == '}') return (token->type = reader_close(reader, ctx, ch));
+			reader->expect = EXPECT_KEY;
+			break;
+
+		case EXPECT_VALUE_OR_END:
+			if (ch == ']') return (token->type = reader_close(reader, ctx, ch));
+			reader->expect = EXPECT_VALUE;
+			break;
+	}
+
+	if (reader->expect == EXPECT_KEY) {
+		if (reader_string(ctx, token)) return reader_error(reader, ctx, "Expected string");
+		whitespace(ctx);
+		if (peek(ctx) != ':') return reader_error(reader, ctx, "Expected :");
+		advance(ctx);
+		reader->expect = EXPECT_VALUE;
+		reader->c = ctx->c;
+		return (token->type = JSON_TOKEN_KEY);
+	}
+
+	/* EXPECT_VALUE */
+	if (ch == '{' || ch == '[') {
+		return (token->type = reader_open(reader, ctx, ch));
+	} else if (ch == '"') {
+		if (reader_string(ctx, token)) return reader_error(reader, ctx, "Bad string");
+		token->type = JSON_TOKEN_STRING;
+	} else if (ch == '-' || isdigit(ch)) {
+		if (parse_number(ctx, &token->number)) return reader_error(reader, ctx, "Bad number");
+		token->type = JSON_TOKEN_NUMBER;
+	} else if (ch == 't' || ch == 'f') {
+		if (literal(ctx, ch == 't' ? "true" : "false")) return reader_error(reader, ctx, "Invalid literal while parsing bool");
+		token->boolean = (ch == 't');
+		token->type = JSON_TOKEN_BOOL;
+	} else if (ch == 'n') {
+		if (literal(ctx, "null")) return reader_error(reader, ctx, "Invalid literal while parsing null");
+		token->type = JSON_TOKEN_NULL;
+	} else {
+		return reader_error(reader, ctx, "Unexpected value");
+	}
+
+	reader_after_value(reader);
+	reader->c = ctx->c;
+	return token->type;
+}
+
+int json_skip(struct JSON_Reader * reader) {
+	struct JSON_Token token;
+	int depth = reader->depth;
+	do {
+		int type = json_next(reader, &token);
+		if (type == JSON_TOKEN_ERROR || type == JSON_TOKEN_END) return -1;
+		if (type == JSON_TOKEN_OBJECT_END || type == JSON_TOKEN_ARRAY_END) {
+			/* Closing the container we were asked to skip a value in */
+			if (reader->depth < depth) return -1;
+		}
+	} while (reader->depth > depth);
+	return 0;
+}
+
+int json_token_string(struct JSON_Token * token, char * buf, int size) {
+	if (!token->escaped && token->length < size) {
+		memcpy(buf, token->start, token->length);
+		buf[token->length] = '\0';
+		return token->length;
+	}
+
+	int i = 0;
+	int used = 0;
+	char tmp[4];
+	while (token->start[i] != '"') {
+		int n = decode_next(token->start, &i, tmp);
+		if (used + n < size) {
+			memcpy(buf + used, tmp, n);
+			used += n;
+		} else {
+			break;
+		}
+	}
+	if (size > 0) buf[used] = '\0';
+	return token->length;
+}
+
+int json_token_is(struct JSON_Token * token, const char * str) {
+	if (!token->escaped) {
+		return (int)strlen(str) == token->length && !memcmp(str, token->start, token->length);
+	}
+
+	int i = 0;
+	char tmp[4];
+	while (token->start[i] != '"') {
+		int n = decode_next(token->start, &i, tmp);
+		for (int j = 0; j < n; ++j, ++str) {
+			if (*str != tmp[j]) return 0;
+		}
+	}
+	return *str == '\0';
+}
@@ -49,6 +49,12 @@ struct YutaniSprite {
 	sprite_t sprite;
 };
 
+static KrkClass * Pixels;
+struct Pixels {
+	KrkInstance inst;
+	struct GraphicsContext * context; /* Also in fields, to keep it alive */
+};
+
 static KrkClass * Decorator;
 /* no additional fields */
 
@@ -518,6 +524,247 @@ static KrkValue _gfx_draw_sprite(int argc, KrkValue argv[], int hasKw) {
 	return NONE_VAL();
 }
 
+/*
+ * Batch drawing: each of these takes a list (or tuple) of things to
+ * draw and does them all in one call, so a frame of UI doesn't have
+ * to cross into C for every line and box.
+ */
+static KrkValueArray * as_sequence(KrkValue value) {
+	if (IS_TUPLE(value)) return &AS_TUPLE(value)->values;
+	if (krk_isInstanceOf(value, vm.baseClasses.listClass)) return AS_LIST(value);
+	return NULL;
+}
+
+/* An (x,y) pair, as either a tuple or a list */
+static int as_point(KrkValue value, int32_t * x, int32_t * y) {
+	KrkValueArray * pair = as_sequence(value);
+	if (!pair || pair->count != 2 || !IS_INTEGER(pair->values[0]) || !IS_INTEGER(pair->values[1])) return 0;
+	*x = AS_INTEGER(pair->values[0]);
+	*y = AS_INTEGER(pair->values[1]);
+	return 1;
+}
+
+/* A pixel is an int (0xAARRGGBB) or a color */
+static int as_pixel(KrkValue value, uint32_t * out) {
+	if (IS_INTEGER(value)) {
+		*out = (uint32_t)AS_INTEGER(value);
+		return 1;
+	}
+	if (krk_isInstanceOf(value, YutaniColor)) {
+		*out = ((struct YutaniColor*)AS_INSTANCE(value))->color;
+		return 1;
+	}
+	return 0;
+}
+
+static KrkValue _gfx_polyline(int argc, KrkValue argv[], int hasKw) {
+	CHECK_GFX();
+
+	KrkValueArray * points = argc > 1 ? as_sequence(argv[1]) : NULL;
+	if (!points || argc < 3 || !krk_isInstanceOf(argv[2], YutaniColor))
+		return krk_runtimeError(vm.exceptions.typeError, "polyline() expects a list of points and a color");
+	uint32_t color = ((struct YutaniColor*)AS_INSTANCE(argv[2]))->color;
+
+	KrkValue thickness = NONE_VAL(), closed = BOOLEAN_VAL(0);
+	if (hasKw) {
+		krk_tableGet(AS_DICT(argv[argc]), OBJECT_VAL(S("thickness")), &thickness);
+		krk_tableGet(AS_DICT(argv[argc]), OBJECT_VAL(S("closed")), &closed);
+	}
+	if (!IS_NONE(thickness) && !IS_INTEGER(thickness) && !IS_FLOATING(thickness))
+		return krk_runtimeError(vm.exceptions.typeError, "thickness must be int or float, not '%s'", krk_typeName(thickness));
+	if (!IS_BOOLEAN(closed))
+		return krk_runtimeError(vm.exceptions.typeError, "closed must be bool");
+
+	/* Check them all first, so a bad point doesn't leave half a line */
+	for (size_t i = 0; i < points->count; ++i) {
+		int32_t x, y;
+		if (!as_point(points->values[i], &x, &y))
+			return krk_runtimeError(vm.exceptions.typeError, "point %d is not a pair of ints", (int)i);
+	}
+
+	size_t segments = points->count < 2 ? 0 : points->count - (AS_BOOLEAN(closed) && points->count > 2 ? 0 : 1);
+	for (size_t i = 0; i < segments; ++i) {
+		int32_t x0, y0, x1, y1;
+		as_point(points->values[i], &x0, &y0);
+		as_point(points->values[(i + 1) % points->count], &x1, &y1);
+		if (IS_INTEGER(thickness)) {
+			draw_line_thick(self->ctx, x0, x1, y0, y1, color, AS_INTEGER(thickness));
+		} else if (IS_FLOATING(thickness)) {
+			draw_line_aa(self->ctx, x0, x1, y0, y1, color, AS_FLOATING(thickness));
+		} else {
+			draw_line(self->ctx, x0, x1, y0, y1, color);
+		}
+	}
+
+	return NONE_VAL();
+}
+
+static KrkValue _gfx_rects(int argc, KrkValue argv[], int hasKw) {
+	CHECK_GFX();
+
+	KrkValueArray * rects = argc > 1 ? as_sequence(argv[1]) : NULL;
+	if (!rects || argc < 3 || !krk_isInstanceOf(argv[2], YutaniColor))
+		return krk_runtimeError(vm.exceptions.typeError, "rects() expects a list of (x,y,width,height) and a color");
+	uint32_t color = ((struct YutaniColor*)AS_INSTANCE(argv[2]))->color;
+
+	KrkValue solid = BOOLEAN_VAL(0);
+	if (hasKw) {
+		krk_tableGet(AS_DICT(argv[argc]), OBJECT_VAL(S("solid")), &solid);
+	}
+	if (!IS_BOOLEAN(solid))
+		return krk_runtimeError(vm.exceptions.typeError, "solid must be bool");
+
+	for (size_t i = 0; i < rects->count; ++i) {
+		KrkValueArray * r = as_sequence(rects->values[i]);
+		if (!r || r->count != 4 || !IS_INTEGER(r->values[0]) || !IS_INTEGER(r->values[1]) ||
+			!IS_INTEGER(r->values[2]) || !IS_INTEGER(r->values[3]))
+			return krk_runtimeError(vm.exceptions.typeError, "rect %d is not four ints", (int)i);
+	}
+
+	for (size_t i = 0; i < rects->count; ++i) {
+		KrkValueArray * r = as_sequence(rects->values[i]);
+		int32_t x = AS_INTEGER(r->values[0]);
+		int32_t y = AS_INTEGER(r->values[1]);
+		uint16_t width = AS_INTEGER(r->values[2]);
+		uint16_t height = AS_INTEGER(r->values[3]);
+		if (AS_BOOLEAN(solid)) {
+			draw_rectangle_solid(self->ctx, x, y, width, height, color);
+		} else {
+			draw_rectangle(self->ctx, x, y, width, height, color);
+		}
+	}
+
+	return NONE_VAL();
+}
+
+/*
+ * Direct access to the pixels of a context (and so of a sprite's
+ * bitmap, or a window's buffer). Nothing is copied: a Pixels object
+ * reads and writes the context's backbuffer where it is, every time,
+ * so it stays right after the window is resized.
+ */
+#define CHECK_PIXELS() \
+	if (argc < 1 || !krk_isInstanceOf(argv[0], Pixels)) \
+		return krk_runtimeError(vm.exceptions.typeError, "expected Pixels"); \
+	gfx_context_t * ctx = ((struct Pixels*)AS_INSTANCE(argv[0]))->context->ctx
+
+static KrkValue _gfx_pixels(int argc, KrkValue argv[]) {
+	CHECK_GFX();
+	KrkInstance * out = krk_newInstance(Pixels);
+	krk_push(OBJECT_VAL(out));
+	((struct Pixels*)out)->context = self;
+	krk_attachNamedValue(&out->fields, "context", argv[0]);
+	return krk_pop();
+}
+
+/* Offset in the backbuffer of pixel i, counting across rows */
+static int pixel_index(gfx_context_t * ctx, KrkValue index, uint32_t ** out) {
+	if (!IS_INTEGER(index)) return 0;
+	krk_integer_type i = AS_INTEGER(index);
+	krk_integer_type count = (krk_integer_type)ctx->width * ctx->height;
+	if (i < 0) i += count;
+	if (i < 0 || i >= count) return 0;
+	*out = &GFX(ctx, i % ctx->width, i / ctx->width);
+	return 1;
+}
+
+static KrkValue _pixels_getitem(int argc, KrkValue argv[]) {
+	CHECK_PIXELS();
+	uint32_t * pixel;
+	if (argc < 2 || !pixel_index(ctx, argv[1], &pixel))
+		return krk_runtimeError(vm.exceptions.indexError, "pixel index out of range");
+	return INTEGER_VAL(*pixel);
+}
+
+static KrkValue _pixels_setitem(int argc, KrkValue argv[]) {
+	CHECK_PIXELS();
+	uint32_t * pixel;
+	uint32_t value;
+	if (argc < 3 || !pixel_index(ctx, argv[1], &pixel))
+		return krk_runtimeError(vm.exceptions.indexError, "pixel index out of range");
+	if (!as_pixel(argv[2], &value))
+		return krk_runtimeError(vm.exceptions.typeError, "expected int or color, not '%s'", krk_typeName(argv[2]));
+	*pixel = value;
+	return argv[2];
+}
+
+static KrkValue _pixels_len(int argc, KrkValue argv[]) {
+	CHECK_PIXELS();
+	return INTEGER_VAL(ctx->width * ctx->height);
+}
+
+/* The part of a width x height block at (x,y) that is inside the context */
+static int clip_block(gfx_context_t * ctx, int32_t x, int32_t y, int32_t width, int32_t height,
+		int32_t * left, int32_t * top, int32_t * right, int32_t * bottom) {
+	*left = x < 0 ? 0 : x;
+	*top = y < 0 ? 0 : y;
+	*right = x + width > (int32_t)ctx->width ? (int32_t)ctx->width : x + width;
+	*bottom = y + height > (int32_t)ctx->height ? (int32_t)ctx->height : y + height;
+	return *left < *right && *top < *bottom;
+}
+
+static KrkValue _pixels_read(int argc, KrkValue argv[]) {
+	CHECK_PIXELS();
+	if (argc < 5 || !IS_INTEGER(argv[1]) || !IS_INTEGER(argv[2]) || !IS_INTEGER(argv[3]) || !IS_INTEGER(argv[4]))
+		return krk_runtimeError(vm.exceptions.typeError, "read() expects x, y, width, height");
+	int32_t x = AS_INTEGER(argv[1]);
+	int32_t y = AS_INTEGER(argv[2]);
+	int32_t width = AS_INTEGER(argv[3]);
+	int32_t height = AS_INTEGER(argv[4]);
+
+	KrkValue list = krk_list_of(0, NULL);
+	krk_push(list);
+	int32_t left, top, right, bottom;
+	if (width > 0 && height > 0) {
+		/* Outside the context reads as transparent */
+		int inside = clip_block(ctx, x, y, width, height, &left, &top, &right, &bottom);
+		for (int32_t _y = y; _y < y + height; ++_y) {
+			for (int32_t _x = x; _x < x + width; ++_x) {
+				uint32_t value = (inside && _x >= left && _x < right && _y >= top && _y < bottom) ? GFX(ctx, _x, _y) : 0;
+				krk_writeValueArray(AS_LIST(list), INTEGER_VAL(value));
+			}
+		}
+	}
+	return krk_pop();
+}
+
+static KrkValue _pixels_write(int argc, KrkValue argv[]) {
+	CHECK_PIXELS();
+	KrkValueArray * values = argc > 4 ? as_sequence(argv[4]) : NULL;
+	if (!values || !IS_INTEGER(argv[1]) || !IS_INTEGER(argv[2]) || !IS_INTEGER(argv[3]) || AS_INTEGER(argv[3]) <= 0)
+		return krk_runtimeError(vm.exceptions.typeError, "write() expects x, y, width, and a list of pixels");
+	int32_t x = AS_INTEGER(argv[1]);
+	int32_t y = AS_INTEGER(argv[2]);
+	int32_t width = AS_INTEGER(argv[3]);
+	int32_t height = (values->count + width - 1) / width;
+
+	for (size_t i = 0; i < values->count; ++i) {
+		uint32_t value;
+		if (!as_pixel(values->values[i], &value))
+			return krk_runtimeError(vm.exceptions.typeError, "pixel %d is not an int or color", (int)i);
+	}
+
+	int32_t left, top, right, bottom;
+	if (!clip_block(ctx, x, y, width, height, &left, &top, &right, &bottom)) return NONE_VAL();
+	for (int32_t _y = top; _y < bottom; ++_y) {
+		for (int32_t _x = left; _x < right; ++_x) {
+			size_t i = (size_t)(_y - y) * width + (_x - x);
+			if (i >= values->count) break;
+			as_pixel(values->values[i], &GFX(ctx, _x, _y));
+		}
+	}
+	return NONE_VAL();
+}
+
+#define PIXELS_PROPERTY(name) \
+static KrkValue _pixels_ ## name (int argc, KrkValue argv[]) { \
+	CHECK_PIXELS(); \
+	return INTEGER_VAL(ctx-> name); \
+}
+
+PIXELS_PROPERTY(width);
+PIXELS_PROPERTY(height);
+
 static void _sprite_sweep(KrkInstance * self) {
 	struct YutaniSprite * sprite = (struct YutaniSprite*)self;
 
@@ -932,6 +1179,39 @@ static KrkValue _font_draw_string(int argc, KrkValue argv[]) {
 	return INTEGER_VAL(draw_sdf_string_stroke(ctx,x,y,str,self->fontSize,self->fontColor,self->fontType,self->fontGamma,self->fontStroke));
 }
 
+/*
+ * Several strings in one call; each run is (str, x, y) or (str, x, y, color).
+ * Returns the widths drawn, in order.
+ */
+static KrkValue _font_draw_strings(int argc, KrkValue argv[]) {
+	CHECK_FONT();
+	if (argc < 2 || !krk_isInstanceOf(argv[1], GraphicsContext))
+		return krk_runtimeError(vm.exceptions.typeError, "expected GraphicsContext");
+	KrkValueArray * runs = argc > 2 ? as_sequence(argv[2]) : NULL;
+	if (!runs)
+		return krk_runtimeError(vm.exceptions.typeError, "expected list of (str, x, y[, color])");
+
+	for (size_t i = 0; i < runs->count; ++i) {
+		KrkValueArray * run = as_sequence(runs->values[i]);
+		if (!run || run->count < 3 || run->count > 4 || !IS_STRING(run->values[0]) ||
+			!IS_INTEGER(run->values[1]) || !IS_INTEGER(run->values[2]) ||
+			(run->count == 4 && !krk_isInstanceOf(run->values[3], YutaniColor)))
+			return krk_runtimeError(vm.exceptions.typeError, "run %d is not (str, x, y[, color])", (int)i);
+	}
+
+	gfx_context_t * ctx = ((struct GraphicsContext*)AS_INSTANCE(argv[1]))->ctx;
+	KrkValue widths = krk_list_of(0, NULL);
+	krk_push(widths);
+	for (size_t i = 0; i < runs->count; ++i) {
+		KrkValueArray * run = as_sequence(runs->values[i]);
+		uint32_t color = run->count == 4 ? ((struct YutaniColor*)AS_INSTANCE(run->values[3]))->color : self->fontColor;
+		int width = draw_sdf_string_stroke(ctx, AS_INTEGER(run->values[1]), AS_INTEGER(run->values[2]),
+			AS_CSTRING(run->values[0]), self->fontSize, color, self->fontType, self->fontGamma, self->fontStroke);
+		krk_writeValueArray(AS_LIST(widths), INTEGER_VAL(width));
+	}
+	return krk_pop();
+}
+
 static KrkValue _font_width(int argc, KrkValue argv[]) {
 	CHECK_FONT();
 	if (argc < 2 || !IS_STRING(argv[1]))
@@ -1282,8 +1562,39 @@ KrkValue krk_module_onload__yutani(void) {
 		"  color:    color to paint the sprite as, can not be used with rotation or scale;\n"
 		"            used to paint a given color with this sprite as a 'brush'. Useful for\n"
 		"            colored icons, such as those found in the panel.";
+	krk_defineNative(&GraphicsContext->methods, ".polyline", _gfx_polyline)->doc =
+		"GraphicsContext.polyline(points,color,thickness=None,closed=False)\n"
+		"  Draw lines through a list of (x,y) points, as line() would draw each.\n"
+		"  If closed is True, also joins the last point to the first.";
+	krk_defineNative(&GraphicsContext->methods, ".rects", _gfx_rects)->doc =
+		"GraphicsContext.rects(rects,color,solid=False)\n"
+		"  Draw each (x,y,width,height) in a list as rect() would.";
+	krk_defineNative(&GraphicsContext->methods, ":pixels", _gfx_pixels);
 	krk_finalizeClass(GraphicsContext);
 
+	/**
+	 * class Pixels():
+	 *     context = GraphicsContext
+	 */
+	Pixels = krk_createClass(module, "Pixels", NULL);
+	Pixels->allocSize = sizeof(struct Pixels);
+	Pixels->docstring = S("GraphicsContext.pixels\n"
+		"  The pixels of a context, as 0xAARRGGBB ints, indexed across rows from the\n"
+		"  top left. Reads and writes go straight to the context's buffer.");
+	krk_defineNative(&Pixels->methods, ".__getitem__", _pixels_getitem);
+	krk_defineNative(&Pixels->methods, ".__setitem__", _pixels_setitem);
+	krk_defineNative(&Pixels->methods, ".__len__", _pixels_len);
+	krk_defineNative(&Pixels->methods, ".read", _pixels_read)->doc =
+		"Pixels.read(x,y,width,height)\n"
+		"  Return a block of pixels as a list, a row at a time.";
+	krk_defineNative(&Pixels->methods, ".write", _pixels_write)->doc =
+		"Pixels.write(x,y,width,pixels)\n"
+		"  Copy a list of pixels (ints or colors) into a block width pixels wide,\n"
+		"  a row at a time. Anything outside the context is skipped.";
+	krk_defineNative(&Pixels->methods, ":width", _pixels_width);
+	krk_defineNative(&Pixels->methods, ":height", _pixels_height);
+	krk_finalizeClass(Pixels);
+
 	/**
 	 * class Window(GraphicsContext):
 	 *     ctx = gfx_context_t *
@@ -1343,6 +1654,10 @@ KrkValue krk_module_onload__yutani(void) {
 	krk_defineNative(&YutaniFont->methods, ".draw_string", _font_draw_string)->doc =
 		"Font.draw_string(gfxContext, string, x, y)\n"
 		"  Draw text to a graphics context with this font.";
+	krk_defineNative(&YutaniFont->methods, ".draw_strings", _font_draw_strings)->doc =
+		"Font.draw_strings(gfxContext, runs)\n"
+		"  Draw a list of (string, x, y) or (string, x, y, color) with this font.\n"
+		"  Returns a list of the widths drawn.";
 	krk_defineNative(&YutaniFont->methods, ".width", _font_width)->doc =
 		"Font.width(string)\n"
 		"  Calculate the rendered width of the given string when drawn with this font.";
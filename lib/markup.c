@@ -6,6 +6,7 @@
  * Markup parser.
  */
 #include <stdio.h>
+#include <string.h>
 #include <toaru/markup.h>
 
 struct markup_state {
@@ -20,14 +21,20 @@ struct markup_state {
 	size_t len;
 	char data[64];
 	char * attr;
+
+	/* Text runs from markup_parse_buffer, which need their own terminator */
+	char * run;
+	size_t run_size;
 };
 
 struct markup_state * markup_init(void * user, markup_callback_tag_open open, markup_callback_tag_close close, markup_callback_data data) {
-	struct markup_state * out = malloc(sizeof(out));
+	struct markup_state * out = malloc(sizeof(*out));
 
 	out->state = 0;
 	out->user = user;
 	out->len = 0;
+	out->run = NULL;
+	out->run_size = 0;
 
 	out->callback_tag_open  = open;
 	out->callback_tag_close = close;
@@ -36,6 +43,13 @@ struct markup_state * markup_init(void * user, markup_callback_tag_open open, ma
 	return out;
 }
 
+/* Overlong names and values are cut short rather than overflowing */
+static void _append(struct markup_state * state, char c) {
+	if (state->len < sizeof(state->data) - 1) {
+		state->data[state->len++] = c;
+	}
+}
+
 static void _dump_buffer(struct markup_state * state) {
 	if (state->len) {
 		state->data[state->len] = '\0';
@@ -117,8 +131,7 @@ int markup_parse(struct markup_state * state, char c) {
 					state->state = 1;
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, c);
 					return 0;
 			}
 			break;
@@ -139,8 +152,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_name(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, c);
 					return 0;
 			}
 			break;
@@ -157,8 +169,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_attr(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, c);
 					return 0;
 			}
 			return 0;
@@ -168,8 +179,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_close(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, c);
 					return 0;
 			}
 			break;
@@ -183,8 +193,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_tag(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, c);
 					return 0;
 			}
 			break;
@@ -195,12 +204,45 @@ int markup_parse(struct markup_state * state, char c) {
 	return 0;
 }
 
+int markup_parse_buffer(struct markup_state * state, const char * buf, size_t len) {
+	const char * end = buf + len;
+	while (buf < end) {
+		if (state->state != 0) {
+			/* Tags are short; take them a character at a time */
+			if (markup_parse(state, *buf++)) return 1;
+			continue;
+		}
+
+		/* Everything up to the next tag is one run of text */
+		const char * lt = memchr(buf, '<', end - buf);
+		size_t run = (lt ? lt : end) - buf;
+		if (run) {
+			_dump_buffer(state);
+			if (state->run_size < run + 1) {
+				state->run_size = run + 1;
+				state->run = realloc(state->run, state->run_size);
+			}
+			memcpy(state->run, buf, run);
+			state->run[run] = '\0';
+			state->callback_data(state, state->user, state->run);
+			buf += run;
+		}
+		if (lt) {
+			_dump_buffer(state);
+			state->state = 1;
+			buf++;
+		}
+	}
+	return 0;
+}
+
 int markup_finish(struct markup_state * state) {
 	if (state->state != 0) {
 		fprintf(stderr, "unexpected end of data\n");
 		return 1;
 	} else {
 		_dump_buffer(state);
+		free(state->run);
 		free(state);
 		return 0;
 	}
@@ -108,7 +108,7 @@ void _menu_draw_MenuEntry_Normal(gfx_context_t * ctx, struct MenuEntry * self, i
 		if (icon->width == MENU_ICON_SIZE) {
 			draw_sprite(ctx, icon, 4, offset + 2);
 		} else {
-			draw_sprite_scaled(ctx, icon, 4, offset + 2, MENU_ICON_SIZE, MENU_ICON_SIZE);
+			draw_sprite(ctx, get_scaled_sprite(icon, MENU_ICON_SIZE, MENU_ICON_SIZE), 4, offset + 2);
 		}
 	}
 
@@ -484,6 +484,9 @@ struct MenuSet * menu_set_from_description(const char * path, void (*callback)(s
 		}
 	}
 
+	if (f != stdin) {
+		fclose(f);
+	}
 	return _out;
 
 failure:
@@ -554,6 +557,8 @@ void menu_show_at(struct MenuList * menu, yutani_window_t * parent, int x, int y
 	int final_x;
 	int final_y;
 
+	/* Send the first flip and the move together */
+	yutani_batch_begin(parent->ctx);
 	menu_show(menu, parent->ctx);
 
 	final_x = x + parent->x;
@@ -563,6 +568,7 @@ void menu_show_at(struct MenuList * menu, yutani_window_t * parent, int x, int y
 	if (final_y + menu->window->height > parent->ctx->display_height) final_y -= menu->window->height;
 
 	yutani_window_move(parent->ctx, menu->window, final_x, final_y);
+	yutani_batch_commit(parent->ctx);
 }
 
 int menu_has_eventual_child(struct MenuList * root, struct MenuList * child) {
@@ -21,18 +21,36 @@
 
 size_t pex_send(FILE * sock, unsigned int rcpt, size_t size, char * blob) {
 	assert(size <= MAX_PACKET_SIZE);
-	pex_header_t * broadcast = malloc(sizeof(pex_header_t) + size);
+	char tmp[sizeof(pex_header_t) + MAX_PACKET_SIZE];
+	pex_header_t * broadcast = (pex_header_t *)tmp;
 	broadcast->target = rcpt;
 	memcpy(broadcast->data, blob, size);
-	size_t out = write(fileno(sock), broadcast, sizeof(pex_header_t) + size);
-	free(broadcast);
-	return out;
+	return write(fileno(sock), broadcast, sizeof(pex_header_t) + size);
 }
 
 size_t pex_broadcast(FILE * sock, size_t size, char * blob) {
 	return pex_send(sock, 0, size, blob);
 }
 
+/*
+ * One packet to several clients: the kernel copies it once and every
+ * recipient's queue shares it.
+ */
+size_t pex_multicast(FILE * sock, unsigned int count, unsigned int * rcpts, size_t size, char * blob) {
+	assert(size <= MAX_PACKET_SIZE);
+	size_t prefix = sizeof(pex_header_t) + sizeof(uint32_t) + count * sizeof(uintptr_t);
+	char * tmp = alloca(prefix + size);
+	pex_header_t * multicast = (pex_header_t *)tmp;
+	multicast->target = PEX_MULTICAST;
+	*(uint32_t *)multicast->data = count;
+	uintptr_t * targets = (uintptr_t *)(multicast->data + sizeof(uint32_t));
+	for (unsigned int i = 0; i < count; ++i) {
+		targets[i] = rcpts[i];
+	}
+	memcpy(tmp + prefix, blob, size);
+	return write(fileno(sock), tmp, prefix + size);
+}
+
 size_t pex_listen(FILE * sock, pex_packet_t * packet) {
 	return read(fileno(sock), packet, PACKET_SIZE);
 }
@@ -71,3 +89,7 @@ FILE * pex_bind(char * target) {
 size_t pex_query(FILE * sock) {
 	return ioctl(fileno(sock), IOCTL_PACKETFS_QUEUED, NULL);
 }
+
+size_t pex_dropped(FILE * sock) {
+	return ioctl(fileno(sock), IOCTL_PACKETFS_DROPPED, NULL);
+}
@@ -7,6 +7,11 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
 
 #include <toaru/graphics.h>
 #include <toaru/inflate.h>
@@ -15,10 +20,10 @@
  * Read 32-bit big-endian value from file.
  */
 unsigned int read_32(FILE * f) {
-	unsigned char a = fgetc(f);
-	unsigned char b = fgetc(f);
-	unsigned char c = fgetc(f);
-	unsigned char d = fgetc(f);
+	unsigned char a = getc(f);
+	unsigned char b = getc(f);
+	unsigned char c = getc(f);
+	unsigned char d = getc(f);
 	return (a << 24) | (b << 16) | (c << 8) | d;
 }
 
@@ -26,8 +31,8 @@ unsigned int read_32(FILE * f) {
  * Read 16-bit big-endian value from file.
  */
 unsigned int read_16(FILE * f) {
-	unsigned char a = fgetc(f);
-	unsigned char b = fgetc(f);
+	unsigned char a = getc(f);
+	unsigned char b = getc(f);
 	return (a << 8) | b;
 }
 
@@ -50,12 +55,18 @@ static char*  reorder_type(unsigned int type) {
 struct png_ctx {
 	FILE * f;          /* File being decoded. */
 	sprite_t * sprite; /* Sprite being generated. */
-	int y;             /* Cursor pointers for writing out bitmap data */
-	int x;
-	char buffer[4];   /* A buffer to hold a pixel's worth of data until it can
-	                     be written out to the image with the right filter. */
-	int  buf_off;     /* How much data is in the above buffer */
+	int y;             /* Scanline being decoded */
+	int row_off;       /* Bytes of the scanline received so far, or -1 before its filter type */
+	int bpp;           /* Bytes per pixel */
+	size_t stride;     /* Bytes per scanline, excluding the filter type */
+	uint8_t * current; /* Scanline being received */
+	uint8_t * prior;   /* Previous scanline, unfiltered; zeros for the first */
 	int seen_ihdr;    /* Whether the IHDR was seen; for error handling */
+	int inflated;     /* Whether the image data has been decompressed */
+
+	uint8_t in_buf[4096]; /* Buffered IDAT contents */
+	size_t in_off;
+	size_t in_len;
 
 	unsigned int width;   /* Image width (dup from sprite) */
 	unsigned int height;  /* Image height (dup from sprite) */
@@ -83,11 +94,14 @@ struct png_ctx {
 
 /**
  * Read a byte from the IDAT chunk.
- * Tracks when an IDAT has been read to completion and
- * can load the next IDAT (or bail of this was the last one)
+ * IDAT contents are read in blocks; tracks when an IDAT has been
+ * read to completion and can load the next IDAT (or bail of this
+ * was the last one)
  */
 static uint8_t _get(struct inflate_context * ctx) {
 	struct png_ctx * c = (ctx->input_priv);
+	if (c->in_off < c->in_len) return c->in_buf[c->in_off++];
+
 	if (c->size == 0) {
 
 		/* Read the CRC32 from the end of this IDAT */
@@ -108,14 +122,20 @@ static uint8_t _get(struct inflate_context * ctx) {
 		}
 	}
 
-	/* Read one byte from the input */
-	c->size--;
-	int i = fgetc(c->f);
+	/* Refill from the rest of this chunk */
+	size_t want = c->size < sizeof(c->in_buf) ? c->size : sizeof(c->in_buf);
+	size_t got = fread(c->in_buf, 1, want, c->f);
+	c->size -= want;
+	c->in_off = 0;
+	c->in_len = got;
 
 	/* If this was EOF, we should handle that error case... probably... */
-	if (i < 0) fprintf(stderr, "This is probably not good.\n");
+	if (!got) {
+		fprintf(stderr, "This is probably not good.\n");
+		return 0;
+	}
 
-	return i;
+	return c->in_buf[c->in_off++];
 }
 
 /**
@@ -133,233 +153,221 @@ static int paeth(int a, int b, int c) {
 	return c;
 }
 
-static void write_pixel(struct png_ctx * c, uint32_t color) {
-	SPRITE((c->sprite), (c->x), (c->y)) = color;
-
-	/* Reset the short buffer */
-	c->buf_off = 0;
+#ifndef NO_SSE
+/* Load / store one pixel of [bpp] (3 or 4) bytes */
+static inline __m128i load_pixel(const uint8_t * p, int bpp) {
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+	if (bpp == 4) v |= (uint32_t)p[3] << 24;
+	return _mm_cvtsi32_si128(v);
+}
 
-	/* Advance to next pixel */
-	c->x++;
-	if (c->x == (int)c->width) {
-		/* Advance to next line; next read is scanline filter type */
-		c->x = -1;
-		c->y++;
-	}
+static inline void store_pixel(uint8_t * p, __m128i x, int bpp) {
+	uint32_t v = _mm_cvtsi128_si32(x);
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	if (bpp == 4) p[3] = v >> 24;
 }
 
-static void process_pixel_type_6(struct png_ctx * c) {
-	/*
-	 * Obtain pixel data from short buffer;
-	 * For color type 6, this is always in R G B A order in the
-	 * bytestream, so we don't have to worry about subpixel ordering
-	 * or weird color masks.
-	 */
-	unsigned int r = c->buffer[0];
-	unsigned int g = c->buffer[1];
-	unsigned int b = c->buffer[2];
-	unsigned int a = c->buffer[3];
-
-	/* Apply filters */
-	if (c->sf == PNG_FILTER_SUB) {
-		/* Add raw value to the pixel on the left */
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			r += _RED(left);
-			g += _GRE(left);
-			b += _BLU(left);
-			a += _ALP(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		/* Add raw value to the pixel above */
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			r += _RED(up);
-			g += _GRE(up);
-			b += _BLU(up);
-			a += _ALP(up);
-		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		/* Add raw value to the average of the pixel above and left */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-
-		r += ((int)_RED(left) + (int)_RED(up)) / 2;
-		g += ((int)_GRE(left) + (int)_GRE(up)) / 2;
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-		a += ((int)_ALP(left) + (int)_ALP(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		/* Use the Paeth predictor */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-
-		r = ((int)r + paeth((int)_RED(left),(int)_RED(up),(int)_RED(upleft))) % 256;
-		g = ((int)g + paeth((int)_GRE(left),(int)_GRE(up),(int)_GRE(upleft))) % 256;
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
-		a = ((int)a + paeth((int)_ALP(left),(int)_ALP(up),(int)_ALP(upleft))) % 256;
-	}
+static inline __m128i abs_epi16(__m128i x) {
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
 
-	/* Write new pixel to the image */
-	write_pixel(c, rgba(r,g,b,a));
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
 }
 
-static void process_pixel_type_2(struct png_ctx * c) {
-	/*
-	 * Obtain pixel data from short buffer;
-	 * For color type 6, this is always in R G B A order in the
-	 * bytestream, so we don't have to worry about subpixel ordering
-	 * or weird color masks.
-	 */
-	unsigned int r = c->buffer[0];
-	unsigned int g = c->buffer[1];
-	unsigned int b = c->buffer[2];
-
-	/* Apply filters */
-	if (c->sf == PNG_FILTER_SUB) {
-		/* Add raw value to the pixel on the left */
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			r += _RED(left);
-			g += _GRE(left);
-			b += _BLU(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		/* Add raw value to the pixel above */
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			r += _RED(up);
-			g += _GRE(up);
-			b += _BLU(up);
+/*
+ * Sub, Avg and Paeth depend on the pixel to the left, so for 3- and
+ * 4-byte pixels these work one pixel at a time with the channels
+ * side by side in one register.
+ */
+static void unfilter_sse(int sf, uint8_t * row, const uint8_t * prior, size_t len, int bpp) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero; /* left */
+	__m128i c = zero; /* upper left */
+
+	for (size_t i = 0; i < len; i += bpp) {
+		__m128i x = load_pixel(&row[i], bpp);
+		if (sf == PNG_FILTER_SUB) {
+			a = _mm_add_epi8(x, a);
+		} else if (sf == PNG_FILTER_AVG) {
+			__m128i b = load_pixel(&prior[i], bpp);
+			/* avg_epu8 rounds up; PNG wants floor */
+			__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+			a = _mm_add_epi8(x, avg);
+		} else {
+			__m128i b = _mm_unpacklo_epi8(load_pixel(&prior[i], bpp), zero);
+			__m128i a16 = _mm_unpacklo_epi8(a, zero);
+			/* pa = |b - c|, pb = |a - c|, pc = |a + b - 2c| */
+			__m128i pa = _mm_sub_epi16(b, c);
+			__m128i pb = _mm_sub_epi16(a16, c);
+			__m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+			pa = abs_epi16(pa);
+			pb = abs_epi16(pb);
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			__m128i nearest = select_si128(_mm_cmpeq_epi16(smallest, pa), a16,
+				select_si128(_mm_cmpeq_epi16(smallest, pb), b, c));
+			a = _mm_add_epi8(x, _mm_packus_epi16(nearest, zero));
+			c = b;
 		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		/* Add raw value to the average of the pixel above and left */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-
-		r += ((int)_RED(left) + (int)_RED(up)) / 2;
-		g += ((int)_GRE(left) + (int)_GRE(up)) / 2;
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		/* Use the Paeth predictor */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-
-		r = ((int)r + paeth((int)_RED(left),(int)_RED(up),(int)_RED(upleft))) % 256;
-		g = ((int)g + paeth((int)_GRE(left),(int)_GRE(up),(int)_GRE(upleft))) % 256;
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
+		store_pixel(&row[i], a, bpp);
 	}
-
-	/* Write new pixel to the image */
-	write_pixel(c, rgb(r,g,b));
 }
+#endif
 
-static void process_pixel_type_4(struct png_ctx * c) {
-	/*
-	 * Obtain pixel data from short buffer;
-	 * For color type 6, this is always in R G B A order in the
-	 * bytestream, so we don't have to worry about subpixel ordering
-	 * or weird color masks.
-	 */
-	unsigned int b = c->buffer[0];
-	unsigned int a = c->buffer[1];
-
-	/* Apply filters */
-	if (c->sf == PNG_FILTER_SUB) {
-		/* Add raw value to the pixel on the left */
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			b += _BLU(left);
-			a += _ALP(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		/* Add raw value to the pixel above */
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			b += _BLU(up);
-			a += _ALP(up);
-		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		/* Add raw value to the average of the pixel above and left */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-		a += ((int)_ALP(left) + (int)_ALP(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		/* Use the Paeth predictor */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
-		a = ((int)a + paeth((int)_ALP(left),(int)_ALP(up),(int)_ALP(upleft))) % 256;
+/**
+ * Undo the scanline filter on [row], given the previous
+ * (already unfiltered) row in [prior]; [prior] is all zeros
+ * for the first row of the image.
+ */
+static void unfilter_row(int sf, uint8_t * row, const uint8_t * prior, size_t len, int bpp) {
+	size_t i = 0;
+	switch (sf) {
+		case PNG_FILTER_SUB:
+#ifndef NO_SSE
+			if (bpp >= 3) { unfilter_sse(sf, row, prior, len, bpp); break; }
+#endif
+			for (i = bpp; i < len; ++i) row[i] += row[i - bpp];
+			break;
+		case PNG_FILTER_UP:
+#ifndef NO_SSE
+			for (; i + 16 <= len; i += 16) {
+				__m128i x = _mm_loadu_si128((const __m128i *)&row[i]);
+				__m128i b = _mm_loadu_si128((const __m128i *)&prior[i]);
+				_mm_storeu_si128((__m128i *)&row[i], _mm_add_epi8(x, b));
+			}
+#endif
+			for (; i < len; ++i) row[i] += prior[i];
+			break;
+		case PNG_FILTER_AVG:
+#ifndef NO_SSE
+			if (bpp >= 3) { unfilter_sse(sf, row, prior, len, bpp); break; }
+#endif
+			for (; i < (size_t)bpp; ++i) row[i] += prior[i] / 2;
+			for (; i < len; ++i) row[i] += ((int)row[i - bpp] + (int)prior[i]) / 2;
+			break;
+		case PNG_FILTER_PAETH:
+#ifndef NO_SSE
+			if (bpp >= 3) { unfilter_sse(sf, row, prior, len, bpp); break; }
+#endif
+			for (; i < (size_t)bpp; ++i) row[i] += paeth(0, prior[i], 0);
+			for (; i < len; ++i) row[i] += paeth(row[i - bpp], prior[i], prior[i - bpp]);
+			break;
+		default:
+			break;
 	}
+}
 
-	/* Write new pixel to the image */
-	write_pixel(c, rgba(b,b,b,a));
+/**
+ * Data in PNGs is unpremultiplied, but our sprites expect
+ * premultiplied alpha.
+ */
+static inline uint32_t premultiplied(unsigned int r, unsigned int g, unsigned int b, unsigned int a) {
+	return (a << 24) | ((r * a / 255) << 16) | ((g * a / 255) << 8) | (b * a / 255);
 }
 
-static void process_pixel_type_0(struct png_ctx * c) {
-	unsigned int b = c->buffer[0];
-	if (c->sf == PNG_FILTER_SUB) {
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			b += _BLU(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			b += _BLU(up);
-		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
+/**
+ * Convert an unfiltered scanline into sprite pixels.
+ */
+static void convert_row(struct png_ctx * c, const uint8_t * row) {
+	uint32_t * out = &c->sprite->bitmap[c->width * c->y];
+	unsigned int x = 0;
+
+	switch (c->color_type) {
+		case 0: /* Greyscale */
+			for (; x < c->width; ++x) {
+				out[x] = 0xFF000000 | (row[x] * 0x010101);
+			}
+			break;
+		case 2: /* RGB */
+			for (; x < c->width; ++x, row += 3) {
+				out[x] = 0xFF000000 | (row[0] << 16) | (row[1] << 8) | row[2];
+			}
+			break;
+		case 4: /* Greyscale with alpha */
+			for (; x < c->width; ++x, row += 2) {
+				out[x] = ((uint32_t)row[1] << 24) | ((row[0] * row[1] / 255) * 0x010101);
+			}
+			break;
+		case 6: /* RGBA */
+#ifndef NO_SSE
+			{
+				__m128i zero = _mm_setzero_si128();
+				__m128i keep_rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+				__m128i alpha_one = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+				__m128i one = _mm_set1_epi16(1);
+				for (; x + 4 <= c->width; x += 4, row += 16) {
+					__m128i px = _mm_loadu_si128((const __m128i *)row);
+					__m128i half[2] = { _mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero) };
+					for (int h = 0; h < 2; ++h) {
+						/* Scale R, G, B by alpha and A by 255 */
+						__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(half[h], _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+						__m128i t = _mm_mullo_epi16(half[h], _mm_or_si128(_mm_and_si128(alpha, keep_rgb), alpha_one));
+						/* Exact t / 255 for t <= 255 * 255 */
+						t = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, one), _mm_srli_epi16(t, 8)), 8);
+						/* R G B A -> B G R A */
+						half[h] = _mm_shufflehi_epi16(_mm_shufflelo_epi16(t, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+					}
+					_mm_storeu_si128((__m128i *)&out[x], _mm_packus_epi16(half[0], half[1]));
+				}
+			}
+#endif
+			for (; x < c->width; ++x, row += 4) {
+				out[x] = premultiplied(row[0], row[1], row[2], row[3]);
+			}
+			break;
 	}
-
-	/* Write new pixel to the image */
-	write_pixel(c, rgb(b,b,b));
 }
 
-
 /**
  * Handle decompressed output from the inflater
  *
- * Writes pixel data to the image, and applies relevant filters.
+ * Collects a scanline at a time, then unfilters it against the
+ * previous one and converts it into the sprite.
  */
-static void _write(struct inflate_context * ctx, unsigned int sym) {
-	struct png_ctx * c = (ctx->input_priv);
+static void _write_block(struct inflate_context * ctx, const uint8_t * buf, size_t len) {
+	struct png_ctx * c = (ctx->output_priv);
+
+	while (len) {
+		/* Ignore anything past the end of the image */
+		if (c->y >= (int)c->height) return;
+
+		if (c->row_off == -1) {
+			/* Beginning of a scanline: this is the scanline filter type */
+			c->sf = *buf++;
+			len--;
+			c->row_off = 0;
+			continue;
+		}
+
+		size_t n = c->stride - c->row_off;
+		if (n > len) n = len;
+		memcpy(&c->current[c->row_off], buf, n);
+		c->row_off += n;
+		buf += n;
+		len -= n;
 
-	/* Put this byte into the short buffer */
-	c->buffer[c->buf_off] = sym;
-	c->buf_off++;
-
-	/* If this is the beginning of a scanline... */
-	if (c->x == -1 && c->buf_off == 1) {
-		/* Then this is the scanline filter type */
-		c->sf = sym;
-
-		/* Reset the buffer, advance to the beginning of the actual scanline */
-		c->x = 0;
-		c->buf_off = 0;
-	} else if (c->buf_off == 1 && c->color_type == 0) {
-		process_pixel_type_0(c);
-	} else if (c->buf_off == 2 && c->color_type == 4) {
-		process_pixel_type_4(c);
-	} else if (c->buf_off == 3 && c->color_type == 2) {
-		process_pixel_type_2(c);
-	} else if (c->buf_off == 4 && c->color_type == 6) {
-		process_pixel_type_6(c);
+		if (c->row_off == (int)c->stride) {
+			unfilter_row(c->sf, c->current, c->prior, c->stride, c->bpp);
+			convert_row(c, c->current);
+
+			/* This row is the next one's prior */
+			uint8_t * tmp = c->prior;
+			c->prior = c->current;
+			c->current = tmp;
+
+			c->row_off = -1;
+			c->y++;
+		}
 	}
 }
 
+static void _write(struct inflate_context * ctx, unsigned int sym) {
+	uint8_t b = sym;
+	_write_block(ctx, &b, 1);
+}
+
 static int color_type_has_alpha(int c) {
 	switch (c) {
 		case 4:
@@ -390,11 +398,13 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 	/* Set up context for future calls to inflate */
 	struct png_ctx c;
 	c.sprite = sprite;
-	c.x = -1;
+	c.row_off = -1;
 	c.y = 0;
 	c.f = f;
-	c.buf_off = 0;
+	c.current = NULL;
+	c.prior = NULL;
 	c.seen_ihdr = 0;
+	c.inflated = 0;
 
 	while (1) {
 		/* read chunks */
@@ -436,6 +446,12 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 					sprite->alpha = color_type_has_alpha(c.color_type);
 					sprite->blank = 0;
 
+					/* Scanline buffers; the one before the first row is all zeros */
+					static const int channels[] = {1, 0, 3, 0, 2, 0, 4};
+					c.bpp = channels[c.color_type];
+					c.stride = c.width * c.bpp;
+					c.prior = calloc(2, c.stride);
+					c.current = c.prior + c.stride;
 
 					/* Skip */
 					for (unsigned int i = 13; i < size; ++i) fgetc(f);
@@ -443,6 +459,12 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 				break;
 
 			case PNG_IDAT:
+				if (!c.seen_ihdr) return 1;
+				if (c.inflated) {
+					/* Trailing IDATs only carry the rest of the checksum */
+					for (unsigned int i = 0; i < size; ++i) fgetc(f);
+					break;
+				}
 				{
 					/* First two bytes of IDAT data are ZLIB header */
 					unsigned int cflags = fgetc(f);
@@ -462,16 +484,20 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 					ctx.output_priv = &c;
 					ctx.get_input = _get;
 					ctx.write_output = _write;
+					ctx.write_block = _write_block;
 					ctx.ring = NULL; /* use builtin */
 
 					c.size = size - 2; /* 2 for the bytes we already read */
+					c.in_off = 0;
+					c.in_len = 0;
 
 					deflate_decompress(&ctx);
+					c.inflated = 1;
 
 					/* The IDATs contain a ZLIB stream, so they end with an
-					 * adler32 checksum. Skip that. */
-					unsigned int adler = read_32(f);
-					(void)adler;
+					 * adler32 checksum. Skip that, and anything else left
+					 * in this chunk; what we buffered is simply dropped. */
+					for (unsigned int i = 0; i < c.size; ++i) fgetc(f);
 				}
 				break;
 			case PNG_IEND:
@@ -490,15 +516,8 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 		(void)crc32;
 	}
 
-	/*
-	 * Data in PNGs is unpremultiplied, but our sprites expect
-	 * premultiplied alpha, so convert the image data
-	 */
-	for (int y = 0; y < sprite->height; ++y) {
-		for (int x = 0; x < sprite->width; ++x) {
-			SPRITE(sprite,x,y) = premultiply(SPRITE(sprite,x,y));
-		}
-	}
+	free(c.prior < c.current ? c.prior : c.current);
+	fclose(f);
 
 	return 0;
 
@@ -40,36 +40,95 @@ static __attribute__((used)) int _isxdigit(int c) { if (c > 128) return 0; retur
 #define isdigit(c) _isdigit(c)
 #define isxdigit(c) _isxdigit(c)
 
-char * rline_history[RLINE_HISTORY_ENTRIES];
+/**
+ * History is a ring of the last rline_history_max entries, allocated
+ * on first use. Every entry ever added gets a serial number, so the
+ * entry k back from the newest is serial history_total - k.
+ */
+char ** rline_history = NULL;
+int rline_history_max    = RLINE_HISTORY_ENTRIES;
 int rline_history_count  = 0;
 int rline_history_offset = 0;
 int rline_scroll = 0;
 char * rline_exit_string = "exit\n";
 int rline_terminal_width = 0;
 
-void rline_history_insert(char * str) {
-	if (str[strlen(str)-1] == '\n') {
-		str[strlen(str)-1] = '\0';
+static uint32_t history_total = 0;
+
+/**
+ * Substring search index: for each trigram (hashed, so a bucket can
+ * hold a few), the serials of the entries that contain it, oldest
+ * first. Anything that matches a search has to be in the bucket of
+ * every trigram of the search string, so a search only has to look
+ * at the entries in the smallest one. Serials that have fallen out
+ * of the ring are dropped when a bucket needs to grow.
+ */
+#define HISTORY_INDEX_BUCKETS 4096
+
+struct history_bucket {
+	uint32_t * serials;
+	uint32_t count;
+	uint32_t size;
+};
+
+static struct history_bucket * history_index = NULL;
+
+static unsigned int trigram_hash(const char * c) {
+	uint32_t t = ((uint32_t)(unsigned char)c[0] << 16) | ((uint32_t)(unsigned char)c[1] << 8) | (unsigned char)c[2];
+	return (t * 2654435761u) >> 20; /* 12 bits */
+}
+
+static void history_index_add(const char * str, uint32_t serial) {
+	if (!history_index) history_index = calloc(HISTORY_INDEX_BUCKETS, sizeof(struct history_bucket));
+	uint32_t oldest = history_total - rline_history_count;
+	size_t len = strlen(str);
+	for (size_t i = 0; i + 2 < len; ++i) {
+		struct history_bucket * b = &history_index[trigram_hash(str + i)];
+		/* Serials only go up, so if we already have this one it's at the end */
+		if (b->count && b->serials[b->count-1] == serial) continue;
+		if (b->count == b->size) {
+			uint32_t gone = 0;
+			while (gone < b->count && b->serials[gone] < oldest) gone++;
+			if (gone) {
+				memmove(b->serials, &b->serials[gone], (b->count - gone) * sizeof(uint32_t));
+				b->count -= gone;
+			} else {
+				b->size = b->size ? b->size * 2 : 4;
+				b->serials = realloc(b->serials, b->size * sizeof(uint32_t));
+			}
+		}
+		b->serials[b->count++] = serial;
 	}
+}
+
+/* Add an entry (which we now own); returns 0 if it repeated the last one and was dropped */
+static int history_add(char * str) {
 	if (rline_history_count) {
 		if (!strcmp(str, rline_history_prev(1))) {
 			free(str);
-			return;
+			return 0;
 		}
 	}
-	if (rline_history_count == RLINE_HISTORY_ENTRIES) {
+	if (!rline_history) {
+		if (rline_history_max < 1) rline_history_max = 1;
+		rline_history = calloc(rline_history_max, sizeof(char *));
+	}
+	if (rline_history_count == rline_history_max) {
 		free(rline_history[rline_history_offset]);
 		rline_history[rline_history_offset] = str;
-		rline_history_offset = (rline_history_offset + 1) % RLINE_HISTORY_ENTRIES;
+		rline_history_offset = (rline_history_offset + 1) % rline_history_max;
 	} else {
 		rline_history[rline_history_count] = str;
 		rline_history_count++;
 	}
+	history_total++;
+	history_index_add(str, history_total - 1);
+	return 1;
 }
 
-void rline_history_append_line(char * str) {
+static void history_extend(char * str) {
 	if (rline_history_count) {
-		char ** s = &rline_history[(rline_history_count - 1 + rline_history_offset) % RLINE_HISTORY_ENTRIES];
+		char ** s = &rline_history[(rline_history_count - 1 + rline_history_offset) % rline_history_max];
 		char * c = malloc(strlen(*s) + strlen(str) + 2);
 		sprintf(c, "%s\n%s", *s, str);
 		if (c[strlen(c)-1] == '\n') {
@@ -77,19 +136,195 @@ void rline_history_append_line(char * str) {
 		}
 		free(*s);
 		*s = c;
+		history_index_add(c, history_total - 1);
 	} else {
 		/* wat */
 	}
 }
 
+/**
+ * History file.
+ *
+ * One entry per line, appended as each is entered, so any number of
+ * sessions can share a file. Backslashes and newlines in an entry are
+ * written as \\ and \n; a line starting with \+ continues the entry
+ * before it (see rline_history_append_line).
+ *
+ * Before adding an entry, we read whatever other sessions have
+ * appended since we last looked, so it lands after theirs.
+ */
+static char * history_file = NULL;
+static long history_file_end = 0; /* How much of it we've read (or written) */
+
+static void history_write(FILE * f, const char * str, int continued) {
+	if (continued) fputs("\\+", f);
+	for (const char * c = str; *c; ++c) {
+		if (*c == '\\') fputs("\\\\", f);
+		else if (*c == '\n') fputs("\\n", f);
+		else fputc(*c, f);
+	}
+	fputc('\n', f);
+}
+
+/* Returns how much of data was whole lines, and so was used */
+static size_t history_parse(char * data, size_t len) {
+	size_t used = 0;
+	while (used < len) {
+		char * line = &data[used];
+		char * nl = memchr(line, '\n', len - used);
+		if (!nl) break;
+		used = nl - data + 1;
+
+		int continued = (line[0] == '\\' && line[1] == '+');
+		if (continued) line += 2;
+		char * str = malloc(nl - line + 1);
+		char * o = str;
+		for (char * c = line; c < nl; ++c) {
+			if (*c == '\\' && c + 1 < nl) {
+				c++;
+				*o++ = (*c == 'n') ? '\n' : *c;
+			} else {
+				*o++ = *c;
+			}
+		}
+		*o = '\0';
+
+		if (continued) {
+			history_extend(str);
+			free(str);
+		} else {
+			history_add(str);
+		}
+	}
+	return used;
+}
+
+static void history_merge(void) {
+	if (!history_file) return;
+	FILE * f = fopen(history_file, "r");
+	if (!f) return;
+	fseek(f, 0, SEEK_END);
+	long end = ftell(f);
+	if (end < history_file_end) {
+		/* Someone rewrote it; start over from their copy */
+		history_file_end = 0;
+	}
+	if (end > history_file_end) {
+		size_t len = end - history_file_end;
+		char * data = malloc(len);
+		fseek(f, history_file_end, SEEK_SET);
+		len = fread(data, 1, len, f);
+		history_file_end += history_parse(data, len);
+		free(data);
+	}
+	fclose(f);
+}
+
+/* Rewrite the file with just what we're keeping */
+static void history_compact(void) {
+	char * tmp = malloc(strlen(history_file) + 5);
+	sprintf(tmp, "%s.tmp", history_file);
+	FILE * f = fopen(tmp, "w");
+	if (f) {
+		for (int i = 0; i < rline_history_count; ++i) {
+			history_write(f, rline_history_get(i), 0);
+		}
+		history_file_end = ftell(f);
+		fclose(f);
+		rename(tmp, history_file);
+	}
+	free(tmp);
+}
+
+/**
+ * Load history from a file (with one read), and keep adding to it.
+ * The file doesn't have to exist yet.
+ */
+void rline_history_open(const char * path) {
+	free(history_file);
+	history_file = strdup(path);
+	history_file_end = 0;
+
+	uint32_t before = history_total;
+	history_merge();
+
+	/* Once it has much more than we keep, trim it */
+	if (history_total - before > (uint32_t)rline_history_max * 2) {
+		history_compact();
+	}
+}
+
+void rline_history_insert(char * str) {
+	if (str[strlen(str)-1] == '\n') {
+		str[strlen(str)-1] = '\0';
+	}
+	history_merge();
+	if (!history_add(str) || !history_file) return;
+	FILE * f = fopen(history_file, "a");
+	if (!f) return;
+	history_write(f, str, 0);
+	fflush(f);
+	history_file_end = ftell(f);
+	fclose(f);
+}
+
+void rline_history_append_line(char * str) {
+	if (!rline_history_count) return;
+	history_extend(str);
+	if (!history_file) return;
+	FILE * f = fopen(history_file, "a");
+	if (!f) return;
+	char * line = strdup(str);
+	if (*line && line[strlen(line)-1] == '\n') line[strlen(line)-1] = '\0';
+	history_write(f, line, 1);
+	free(line);
+	fflush(f);
+	history_file_end = ftell(f);
+	fclose(f);
+}
+
 char * rline_history_get(int item) {
-	return rline_history[(item + rline_history_offset) % RLINE_HISTORY_ENTRIES];
+	return rline_history[(item + rline_history_offset) % rline_history_max];
 }
 
 char * rline_history_prev(int item) {
 	return rline_history_get(rline_history_count - item);
 }
 
+/**
+ * Find the newest entry, at least from back (1 being the newest),
+ * that contains needle. Returns how far back it is, or 0.
+ */
+int rline_history_search(const char * needle, int from) {
+	if (from < 1) from = 1;
+	if (from > rline_history_count) return 0;
+	size_t len = strlen(needle);
+
+	if (len < 3 || !history_index) {
+		for (int k = from; k <= rline_history_count; ++k) {
+			if (strstr(rline_history_prev(k), needle)) return k;
+		}
+		return 0;
+	}
+
+	struct history_bucket * best = NULL;
+	for (size_t i = 0; i + 2 < len; ++i) {
+		struct history_bucket * b = &history_index[trigram_hash(needle + i)];
+		if (!best || b->count < best->count) best = b;
+	}
+
+	uint32_t newest = history_total - from;
+	uint32_t oldest = history_total - rline_history_count;
+	for (uint32_t i = best->count; i > 0; --i) {
+		uint32_t serial = best->serials[i-1];
+		if (serial > newest) continue;
+		if (serial < oldest) break;
+		int k = history_total - serial;
+		if (strstr(rline_history_prev(k), needle)) return k;
+	}
+	return 0;
+}
+
 #define UTF8_ACCEPT 0
 #define UTF8_REJECT 1
 
@@ -1698,6 +1933,87 @@ static void history_next(void) {
 	rline_place_cursor();
 }
 
+/**
+ * Replace the line with a string.
+ */
+static void set_line(const char * str) {
+	the_line->actual = 0;
+	column = 0;
+	loading = 1;
+	uint32_t istate = 0, c = 0;
+	for (const unsigned char * b = (const unsigned char *)str; *b; ++b) {
+		if (!decode(&istate, &c, *b)) {
+			insert_char(c);
+		}
+	}
+	loading = 0;
+	column = the_line->actual;
+	offset = 0;
+	recalculate_tabs(the_line);
+	recalculate_syntax(the_line);
+}
+
+/**
+ * ^R: search back through history as you type; ^R again finds the
+ * next older match. Returns the key that ended the search, for the
+ * caller to handle, with the match in the line; or 0 if the search
+ * was cancelled (^G, ^C) and the line was put back.
+ */
+static int reverse_search(void) {
+	char input[512] = {0};
+	int collected = 0;
+	int found = 0; /* How far back the match is, as for rline_history_prev */
+
+	/* Keep what we had, in case we are cancelled */
+	char * saved = malloc(the_line->actual * 7 + 1);
+	unsigned int off = 0;
+	for (int j = 0; j < the_line->actual; j++) {
+		off += to_eight(the_line->text[j].codepoint, &saved[off]);
+	}
+	saved[off] = '\0';
+
+	int c;
+	while (1) {
+		printf("\033[0m\r(reverse-i-search)`%s': %s\033[K", input, found ? rline_history_prev(found) : "");
+		fflush(stdout);
+
+		c = getch(0);
+		if (c == 18) { /* ^R */
+			if (collected) {
+				int next = rline_history_search(input, found + 1);
+				if (next) found = next;
+			}
+		} else if (c == DELETE_KEY || c == BACKSPACE_KEY) {
+			if (collected) {
+				input[--collected] = '\0';
+				found = collected ? rline_history_search(input, 1) : 0;
+			}
+		} else if (c == 7 || c == 3 || c == -1) { /* ^G, ^C */
+			set_line(saved);
+			free(saved);
+			return 0;
+		} else if (c >= ' ' || c == '\t') {
+			if (collected < (int)sizeof(input) - 1) {
+				input[collected++] = c;
+				/* A longer string can only match the same entry or older ones */
+				int next = rline_history_search(input, found ? found : 1);
+				if (next) {
+					found = next;
+				} else {
+					input[--collected] = '\0';
+				}
+			}
+		} else {
+			break;
+		}
+	}
+
+	set_line(found ? rline_history_prev(found) : saved);
+	if (found) rline_scroll = found;
+	free(saved);
+	return c;
+}
+
 /**
  * Handle escape sequences (arrow keys, etc.)
  */
@@ -2005,6 +2321,21 @@ static int read_line(void) {
 					case 23: /* ^W */
 						delete_word();
 						break;
+					case 18: /* ^R - Search history */
+						switch (reverse_search()) {
+							case '\033':
+								this_buf[0] = '\033';
+								timeout = 1;
+								break;
+							case 13:
+							case ENTER_KEY:
+								loading = 1;
+								column = the_line->actual;
+								render_line();
+								insert_char('\n');
+								return 1;
+						}
+						break;
 					case 12: /* ^L - Repaint the whole screen */
 						printf("\033[2J\033[H");
 						render_line();
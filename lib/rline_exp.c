@@ -1675,13 +1675,10 @@ try_rev_search_again:
 		if (collected && changed) {
 			match = "";
 			match_index = 0;
-			for (int i = start_at; i < rline_history_count; i++) {
-				char * c = rline_history_prev(i+1);
-				if (strstr(c, input)) {
-					match = c;
-					match_index = i;
-					break;
-				}
+			int found = rline_history_search(input, start_at + 1);
+			if (found) {
+				match = rline_history_prev(found);
+				match_index = found - 1;
 			}
 			if (!strcmp(match,"")) {
 				if (start_at) {
@@ -12,6 +12,7 @@
 
 #include <toaru/graphics.h>
 #include <toaru/hashmap.h>
+#include <toaru/list.h>
 #include <toaru/sdf.h>
 #include <toaru/spinlock.h>
 #include <toaru/decodeutf8.h>
@@ -31,9 +32,10 @@ static sprite_t _font_data_mono_oblique;
 static sprite_t _font_data_mono_bold_oblique;
 
 static hashmap_t * _font_cache;
+static hashmap_t * _glyph_cache;
+static list_t * _glyph_lru;
 
 static volatile int _sdf_lock = 0;
-static double gamma = 1.7;
 
 struct CharData{
 	char code;
@@ -69,6 +71,8 @@ __attribute__((constructor))
 static void _init_sdf(void) {
 	/* Load the font. */
 	_font_cache = hashmap_create_int(10);
+	_glyph_cache = hashmap_create_int(64);
+	_glyph_lru = list_create();
 	{
 		char tmp[100];
 		char * display = getenv("DISPLAY");
@@ -138,91 +142,240 @@ static sprite_t * _select_font(int font) {
 	}
 }
 
-static int _select_width(int _ch, int font) {
-	int ch = (_ch >= 0 && _ch <= 128) ? _ch : (int)ununicode(_ch);
+enum width_class {
+	WIDTH_THIN,
+	WIDTH_BOLD,
+	WIDTH_MONO,
+};
+
+static int _width_class(int font) {
 	switch (font) {
 		case SDF_FONT_BOLD:
 		case SDF_FONT_BOLD_OBLIQUE:
-			return _char_data[ch].width_bold;
+			return WIDTH_BOLD;
 		case SDF_FONT_MONO:
 		case SDF_FONT_MONO_BOLD:
 		case SDF_FONT_MONO_OBLIQUE:
 		case SDF_FONT_MONO_BOLD_OBLIQUE:
-			return _char_data[ch].width_mono;
+			return WIDTH_MONO;
 		case SDF_FONT_OBLIQUE:
 		case SDF_FONT_THIN:
+		default:
+			return WIDTH_THIN;
+	}
+}
+
+static int _class_width(int ch, int cls) {
+	switch (cls) {
+		case WIDTH_BOLD:
+			return _char_data[ch].width_bold;
+		case WIDTH_MONO:
+			return _char_data[ch].width_mono;
 		default:
 			return _char_data[ch].width_thin;
 	}
 }
 
-static int draw_sdf_character(gfx_context_t * ctx, int32_t x, int32_t y, int _ch, int size, uint32_t color, sprite_t * tmp, int font, sprite_t * _font_data, double buffer) {
-	int ch = (_ch >= 0 && _ch <= 128) ? _ch : (int)ununicode(_ch);
+static int _glyph_index(int _ch) {
+	return (_ch >= 0 && _ch <= 128) ? _ch : (int)ununicode(_ch);
+}
+
+/*
+ * Scaled advance widths, one table per width class and size,
+ * shared by everything that draws or measures at that size.
+ */
+#define ADVANCE_SIZES 256
+static int * _advances[3][ADVANCE_SIZES];
+
+static int * _advance_table(int font, int size) {
+	if (size < 0 || size >= ADVANCE_SIZES) return NULL;
+	int cls = _width_class(font);
+	if (!_advances[cls][size]) {
+		double scale = (double)size / 50.0;
+		int * table = malloc(sizeof(int) * 256);
+		for (int i = 0; i < 256; ++i) {
+			table[i] = _class_width(i, cls) * scale;
+		}
+		spin_lock(&_sdf_lock);
+		if (!_advances[cls][size]) {
+			_advances[cls][size] = table;
+			table = NULL;
+		}
+		spin_unlock(&_sdf_lock);
+		free(table);
+	}
+	return _advances[cls][size];
+}
+
+static int _advance(int * table, int ch, int size, int font) {
+	if (table) return table[ch];
+	return _class_width(ch, _width_class(font)) * ((double)size / 50.0);
+}
+
+/*
+ * Rasterized glyphs: coverage computed from the distance field once per
+ * (font, size, gamma, stroke) and kept in an LRU cache, so drawing a
+ * cached glyph is just a blend per pixel.
+ */
+#define GLYPH_CACHE_SIZE 1024
+#define GLYPH_STYLES 16
+
+struct sdf_glyph {
+	node_t lru;
+	uint32_t key;
+	int width;
+	int height;
+	uint8_t coverage[];
+};
+
+/* Distinct (gamma, stroke) pairs seen so far; their index goes in the cache key */
+static struct {
+	double gamma;
+	double stroke;
+} _glyph_styles[GLYPH_STYLES];
+static int _glyph_style_count = 0;
+
+static int _glyph_style(double _gamma, double stroke) {
+	for (int i = 0; i < _glyph_style_count; ++i) {
+		if (_glyph_styles[i].gamma == _gamma && _glyph_styles[i].stroke == stroke) return i;
+	}
+	if (_glyph_style_count == GLYPH_STYLES) return -1;
+	_glyph_styles[_glyph_style_count].gamma = _gamma;
+	_glyph_styles[_glyph_style_count].stroke = stroke;
+	return _glyph_style_count++;
+}
+
+/* The whole font sheet scaled to this size; glyphs are cut from it */
+static sprite_t * _scaled_font(int font, int size) {
+	sprite_t * _font_data = _select_font(font);
+	double scale = (double)size / 50.0;
+	int scale_height = scale * _font_data->height;
+
+	sprite_t * tmp;
+	if (!hashmap_has(_font_cache, (void *)(scale_height | (font << 16)))) {
+		tmp = create_sprite(scale * _font_data->width, scale * _font_data->height, ALPHA_OPAQUE);
+		gfx_context_t * t = init_graphics_sprite(tmp);
+		draw_sprite_scaled(t, _font_data, 0, 0, tmp->width, tmp->height);
+		free(t);
+		hashmap_set(_font_cache, (void *)(scale_height | (font << 16)), tmp);
+	} else {
+		tmp = hashmap_get(_font_cache, (void *)(scale_height | (font << 16)));
+	}
+	return tmp;
+}
+
+static struct sdf_glyph * _rasterize_glyph(int ch, int size, int font, double _gamma, double buffer) {
+	sprite_t * _font_data = _select_font(font);
+	sprite_t * tmp = _scaled_font(font, size);
 
 	double scale = (double)size / 50.0;
-	int width = _select_width(ch, font) * scale;
 	int fx = ((BASE_WIDTH * ch) % _font_data->width) * scale;
 	int fy = (((BASE_WIDTH * ch) / _font_data->width) * BASE_HEIGHT) * scale;
-
 	int height = BASE_HEIGHT * ((double)size / 50.0);
 
+	struct sdf_glyph * glyph = malloc(sizeof(struct sdf_glyph) + size * height);
+	memset(&glyph->lru, 0, sizeof(node_t));
+	glyph->lru.value = glyph;
+	glyph->width = size;
+	glyph->height = height;
 
-	/* ignore size */
+	double edge0 = buffer - _gamma * 1.4142 / (double)size;
+	double edge1 = buffer + _gamma * 1.4142 / (double)size;
 	for (int j = 0; j < height; ++j) {
-		if (y + j < 0) continue;
-		if (y + j >= ctx->height) continue;
-		if (fy+j >= tmp->height) continue;
+		uint8_t * row = &glyph->coverage[j * size];
 		for (int i = 0; i < size; ++i) {
 			/* TODO needs to do bilinear filter */
-			if (fx+i >= tmp->width) continue;
-			if (x + i < 0) continue;
-			if (x + i >= ctx->width) continue;
+			if (fy + j >= tmp->height || fx + i >= tmp->width) {
+				row[i] = 0;
+				continue;
+			}
 			uint32_t c = SPRITE((tmp), fx+i, fy+j);
 			double dist = (double)_RED(c) / 255.0;
-			double edge0 = buffer - gamma * 1.4142 / (double)size;
-			double edge1 = buffer + gamma * 1.4142 / (double)size;
 			double a = (dist - edge0) / (edge1 - edge0);
 			if (a < 0.0) a = 0.0;
 			if (a > 1.0) a = 1.0;
 			a = a * a * (3 - 2 * a);
-			uint32_t f_color = premultiply((color & 0xFFFFFF) | ((uint32_t)(255 * a) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(a * _ALP(color)) << 24);
-			GFX(ctx,x+i,y+j) = alpha_blend_rgba(GFX(ctx,x+i,y+j), f_color);
+			row[i] = 255 * a;
 		}
 	}
 
-	return width;
+	return glyph;
+}
+
+/* Must be called with _sdf_lock held; uncached glyphs have key 0 and belong to the caller */
+static struct sdf_glyph * _get_glyph(int ch, int size, int font, int style, double _gamma, double buffer) {
+	if (style < 0 || size <= 0 || size >= 256) {
+		struct sdf_glyph * glyph = _rasterize_glyph(ch, size, font, _gamma, buffer);
+		glyph->key = 0;
+		return glyph;
+	}
+
+	uint32_t key = (ch & 0xFF) | (size << 8) | (font << 16) | (style << 19) | (1 << 23);
+	struct sdf_glyph * glyph = hashmap_get(_glyph_cache, (void *)(uintptr_t)key);
+	if (glyph) {
+		/* Most recently used goes to the back */
+		list_delete(_glyph_lru, &glyph->lru);
+		list_append(_glyph_lru, &glyph->lru);
+		return glyph;
+	}
+
+	if (_glyph_lru->length >= GLYPH_CACHE_SIZE) {
+		struct sdf_glyph * old = list_dequeue(_glyph_lru)->value;
+		hashmap_remove(_glyph_cache, (void *)(uintptr_t)old->key);
+		free(old);
+	}
 
+	glyph = _rasterize_glyph(ch, size, font, _gamma, buffer);
+	glyph->key = key;
+	hashmap_set(_glyph_cache, (void *)(uintptr_t)key, glyph);
+	list_append(_glyph_lru, &glyph->lru);
+	return glyph;
 }
 
-int draw_sdf_string_stroke(gfx_context_t * ctx, int32_t x, int32_t y, const char * str, int size, uint32_t color, int font, double _gamma, double stroke) {
+static void _draw_glyph(gfx_context_t * ctx, int32_t x, int32_t y, struct sdf_glyph * glyph, const uint32_t * colors) {
+	int32_t _left   = x < 0 ? -x : 0;
+	int32_t _top    = y < 0 ? -y : 0;
+	int32_t _right  = glyph->width;
+	int32_t _bottom = glyph->height;
+	if (_right > ctx->width - x) _right = ctx->width - x;
+	if (_bottom > ctx->height - y) _bottom = ctx->height - y;
+
+	for (int32_t j = _top; j < _bottom; ++j) {
+		const uint8_t * row = &glyph->coverage[j * glyph->width];
+		uint32_t * dst = &GFX(ctx, x, y + j);
+		for (int32_t i = _left; i < _right; ++i) {
+			if (row[i]) {
+				dst[i] = alpha_blend_rgba(dst[i], colors[row[i]]);
+			}
+		}
+	}
+}
 
-	sprite_t * _font_data = _select_font(font);
+int draw_sdf_string_stroke(gfx_context_t * ctx, int32_t x, int32_t y, const char * str, int size, uint32_t color, int font, double _gamma, double stroke) {
 
 	if (!loaded) return 0;
 
-	double scale = (double)size / 50.0;
-	int scale_height = scale * _font_data->height;
-
-	sprite_t * tmp;
-	spin_lock(&_sdf_lock);
-	if (!hashmap_has(_font_cache, (void *)(scale_height | (font << 16)))) {
-		tmp = create_sprite(scale * _font_data->width, scale * _font_data->height, ALPHA_OPAQUE);
-		gfx_context_t * t = init_graphics_sprite(tmp);
-		draw_sprite_scaled(t, _font_data, 0, 0, tmp->width, tmp->height);
-		free(t);
-		hashmap_set(_font_cache, (void *)(scale_height | (font << 16)), tmp);
-	} else {
-		tmp = hashmap_get(_font_cache, (void *)(scale_height | (font << 16)));
+	/* Premultiplied color for each coverage value */
+	uint32_t colors[256];
+	for (int i = 0; i < 256; ++i) {
+		uint32_t f_color = premultiply((color & 0xFFFFFF) | ((uint32_t)i << 24));
+		colors[i] = (f_color & 0xFFFFFF) | ((uint32_t)(i * _ALP(color) / 255) << 24);
 	}
 
+	int * advances = _advance_table(font, size);
+
 	uint32_t state = 0;
 	uint32_t c = 0;
 	int32_t out_width = 0;
-	gamma = _gamma;
+	spin_lock(&_sdf_lock);
+	int style = _glyph_style(_gamma, stroke);
 	while (*str) {
 		if (!decode(&state, &c, (unsigned char)*str)) {
-			int w = draw_sdf_character(ctx,x,y,c,size,color,tmp,font,_font_data, stroke);
+			int ch = _glyph_index(c);
+			struct sdf_glyph * glyph = _get_glyph(ch, size, font, style, _gamma, stroke);
+			_draw_glyph(ctx, x, y, glyph, colors);
+			if (!glyph->key) free(glyph);
+			int w = _advance(advances, ch, size, font);
 			out_width += w;
 			x += w;
 		}
@@ -234,20 +387,15 @@ int draw_sdf_string_stroke(gfx_context_t * ctx, int32_t x, int32_t y, const char
 }
 
 int draw_sdf_string_gamma(gfx_context_t * ctx, int32_t x, int32_t y, const char * str, int size, uint32_t color, int font, double _gamma) {
-	return draw_sdf_string_stroke(ctx,x,y,str,size,color,font,gamma,0.75);
+	return draw_sdf_string_stroke(ctx,x,y,str,size,color,font,_gamma,0.75);
 }
 
 int draw_sdf_string(gfx_context_t * ctx, int32_t x, int32_t y, const char * str, int size, uint32_t color, int font) {
 	return draw_sdf_string_stroke(ctx,x,y,str,size,color,font,1.7, 0.75);
 }
 
-static int char_width(int ch, int font) {
-	return _select_width(ch, font);
-}
-
-
 int draw_sdf_string_width(const char * str, int size, int font) {
-	double scale = (double)size / 50.0;
+	int * table = _advance_table(font, size);
 
 	uint32_t state = 0;
 	uint32_t c = 0;
@@ -255,8 +403,8 @@ int draw_sdf_string_width(const char * str, int size, int font) {
 	int32_t out_width = 0;
 	while (*str) {
 		if (!decode(&state, &c, (unsigned char)*str)) {
-			int w = char_width(c,font) * scale;
-			out_width += w;
+			int ch = _glyph_index(c);
+			out_width += _advance(table, ch, size, font);
 		} else if (state == UTF8_REJECT) {
 			state = 0;
 		}
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/shm.h>
+#include <sys/time.h>
 
 #include <toaru/pex.h>
 #include <toaru/graphics.h>
@@ -23,6 +24,49 @@
 /* We need the flags but don't want the library dep (maybe the flags should be here?) */
 #include <toaru/./decorations.h>
 
+static int _batch_flush(yutani_t * y);
+
+/**
+ * _receive
+ *
+ * Read one packet from the server. A batch is split up: its first
+ * message is returned and the rest are queued behind anything
+ * already waiting.
+ */
+static yutani_msg_t * _receive(yutani_t * y) {
+	char tmp[MAX_PACKET_SIZE];
+	size_t size = pex_recv(y->sock, tmp);
+	yutani_msg_t * m = (yutani_msg_t *)tmp;
+
+	if (size < sizeof(yutani_msg_t) || m->type != YUTANI_MSG_BATCH) {
+		yutani_msg_t * out = malloc(size);
+		memcpy(out, tmp, size);
+		return out;
+	}
+
+	yutani_msg_t * first = NULL;
+	size_t offset = sizeof(yutani_msg_t);
+	while (offset + sizeof(yutani_msg_t) <= size) {
+		yutani_msg_t * sub = (yutani_msg_t *)&tmp[offset];
+		if (sub->size < sizeof(yutani_msg_t) || offset + sub->size > size) break;
+		yutani_msg_t * out = malloc(sub->size);
+		memcpy(out, sub, sub->size);
+		if (!first) {
+			first = out;
+		} else {
+			list_insert(y->queued, out);
+		}
+		offset += sub->size;
+	}
+
+	if (!first) {
+		/* Empty batch; hand it back as-is so the caller sees something */
+		first = malloc(size);
+		memcpy(first, tmp, size);
+	}
+	return first;
+}
+
 /**
  * yutani_wait_for
  *
@@ -30,20 +74,25 @@
  * of messages for processing later.
  */
 yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type) {
+	/* Whatever we're waiting on may be a reply to something still held back */
+	_batch_flush(y);
 	do {
-		yutani_msg_t * out;
-		size_t size;
-		{
-			char tmp[MAX_PACKET_SIZE];
-			size = pex_recv(y->sock, tmp);
-			out = malloc(size);
-			memcpy(out, tmp, size);
-		}
+		node_t * mark = y->queued->tail;
+		yutani_msg_t * out = _receive(y);
 
 		if (out->type == type) {
 			return out;
-		} else {
-			list_insert(y->queued, out);
+		}
+
+		/* Keep it ahead of anything else that came in the same batch */
+		node_t * node = list_insert_after(y->queued, mark, out);
+		for (node_t * n = node->next; n; n = n->next) {
+			yutani_msg_t * m = n->value;
+			if (m->type == type) {
+				list_delete(y->queued, n);
+				free(n);
+				return m;
+			}
 		}
 	} while (1); /* XXX: (!y->abort) */
 }
@@ -59,6 +108,24 @@ size_t yutani_query(yutani_t * y) {
 	return pex_query(y->sock);
 }
 
+/*
+ * Releases name buffers by ID rather than slot, so one that was
+ * meant for a swapchain since torn down by a resize never matches.
+ */
+static void _swapchain_release(yutani_window_t * win, uint32_t bufid) {
+	for (uint32_t i = 0; i < win->swap_count; ++i) {
+		if (win->swap_bufids[i] == bufid) {
+			win->swap_busy &= ~(1 << i);
+		}
+	}
+}
+
+static uint64_t _now_us(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
 /**
  * _handle_internal
  *
@@ -68,9 +135,23 @@ size_t yutani_query(yutani_t * y) {
  *
  * WELCOME: Update the display_width and display_height for the connection.
  * WINDOW_MOVE: Update the window location.
+ * FRAME_DONE: Note which frame of the window the server has finished.
+ * BUFFER_RELEASE: Mark a swapchain buffer as free to draw into again.
+ * KEY_EVENT: If the server tagged it, note when it arrived; the next
+ *            flip reports that back (see _latency_mark).
  */
 static void _handle_internal(yutani_t * y, yutani_msg_t * out) {
 	switch (out->type) {
+		case YUTANI_MSG_KEY_EVENT:
+			{
+				struct yutani_msg_key_event * ke = (void *)out->data;
+				/* Keep the oldest; the next frame answers for all of them */
+				if (ke->input_id && !y->input_id) {
+					y->input_id = ke->input_id;
+					y->input_received = _now_us();
+				}
+			}
+			break;
 		case YUTANI_MSG_WELCOME:
 			{
 				struct yutani_msg_welcome * mw = (void *)out->data;
@@ -88,6 +169,24 @@ static void _handle_internal(yutani_t * y, yutani_msg_t * out) {
 				}
 			}
 			break;
+		case YUTANI_MSG_FRAME_DONE:
+			{
+				struct yutani_msg_frame_done * fd = (void *)out->data;
+				yutani_window_t * win = hashmap_get(y->windows, (void *)fd->wid);
+				if (win) {
+					win->frame_done = fd->serial;
+				}
+			}
+			break;
+		case YUTANI_MSG_BUFFER_RELEASE:
+			{
+				struct yutani_msg_window_buffer * wb = (void *)out->data;
+				yutani_window_t * win = hashmap_get(y->windows, (void *)wb->wid);
+				if (win) {
+					_swapchain_release(win, wb->bufid);
+				}
+			}
+			break;
 		case YUTANI_MSG_RESIZE_OFFER:
 			{
 				struct yutani_msg_window_resize * wr = (void *)out->data;
@@ -102,6 +201,48 @@ static void _handle_internal(yutani_t * y, yutani_msg_t * out) {
 	}
 }
 
+/* Plain moves and drags; clicks, enters and leaves always get through */
+static int _is_motion(yutani_msg_t * m) {
+	if (m->type != YUTANI_MSG_WINDOW_MOUSE_EVENT) return 0;
+	struct yutani_msg_window_mouse_event * me = (void *)m->data;
+	return me->command == YUTANI_MOUSE_EVENT_MOVE || me->command == YUTANI_MOUSE_EVENT_DRAG;
+}
+
+/**
+ * _coalesce_motion
+ *
+ * If a mouse motion event is directly followed by another for the same
+ * window with the same buttons, modifiers and command, skip ahead to the
+ * newer one (keeping the older event's starting position). Messages
+ * already sitting in the socket are pulled in to look at, but nothing
+ * blocks.
+ */
+static yutani_msg_t * _coalesce_motion(yutani_t * y, yutani_msg_t * out) {
+	while (_is_motion(out)) {
+		if (!y->queued->length) {
+			if (pex_query(y->sock) <= 0) break;
+			/* Anything else from the same batch is already queued; this goes first */
+			list_insert_after(y->queued, NULL, _receive(y));
+		}
+
+		yutani_msg_t * next = y->queued->head->value;
+		if (!_is_motion(next)) break;
+
+		struct yutani_msg_window_mouse_event * a = (void *)out->data;
+		struct yutani_msg_window_mouse_event * b = (void *)next->data;
+		if (a->wid != b->wid || a->buttons != b->buttons || a->command != b->command || a->modifiers != b->modifiers) break;
+
+		b->old_x = a->old_x;
+		b->old_y = a->old_y;
+
+		node_t * node = list_dequeue(y->queued);
+		free(node);
+		free(out);
+		out = next;
+	}
+	return out;
+}
+
 /**
  * yutani_poll
  *
@@ -115,17 +256,11 @@ yutani_msg_t * yutani_poll(yutani_t * y) {
 		node_t * node = list_dequeue(y->queued);
 		out = (yutani_msg_t *)node->value;
 		free(node);
-		_handle_internal(y, out);
-		return out;
+	} else {
+		out = _receive(y);
 	}
 
-	size_t size;
-	{
-		char tmp[MAX_PACKET_SIZE];
-		size = pex_recv(y->sock, tmp);
-		out = malloc(size);
-		memcpy(out, tmp, size);
-	}
+	out = _coalesce_motion(y, out);
 
 	_handle_internal(y, out);
 
@@ -237,6 +372,7 @@ void yutani_msg_buildx_key_event(yutani_msg_t * msg, yutani_wid_t wid, key_event
 	mw->wid = wid;
 	memcpy(&mw->event, event, sizeof(key_event_t));
 	memcpy(&mw->state, state, sizeof(key_event_state_t));
+	mw->input_id = 0;
 }
 
 
@@ -500,8 +636,189 @@ void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content) {
 	memcpy(cl->content, content, strlen(content));
 }
 
+void yutani_msg_buildx_flip_regions(yutani_msg_t * msg, yutani_wid_t wid, uint32_t serial, const yutani_damage_rect_t * rects, uint32_t count) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_FLIP_REGIONS;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_flip_regions) + sizeof(yutani_damage_rect_t) * count;
+
+	struct yutani_msg_flip_regions * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->serial = serial;
+	mw->count = count;
+	memcpy(mw->rects, rects, sizeof(yutani_damage_rect_t) * count);
+}
+
+void yutani_msg_buildx_frame_done(yutani_msg_t * msg, yutani_wid_t wid, uint32_t serial) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_FRAME_DONE;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_frame_done);
+
+	struct yutani_msg_frame_done * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->serial = serial;
+}
+
+void yutani_msg_buildx_swapchain(yutani_msg_t * msg, uint32_t type, yutani_wid_t wid, uint32_t count, const uint32_t * bufids) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = type;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_swapchain);
+
+	struct yutani_msg_swapchain * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->count = count;
+	for (int i = 0; i < YUTANI_SWAPCHAIN_MAX; ++i) {
+		mw->bufids[i] = (bufids && i < (int)count) ? bufids[i] : 0;
+	}
+}
+
+void yutani_msg_buildx_window_buffer(yutani_msg_t * msg, uint32_t type, yutani_wid_t wid, uint32_t bufid) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = type;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_buffer);
+
+	struct yutani_msg_window_buffer * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->bufid = bufid;
+}
+
+void yutani_msg_buildx_latency_mark(yutani_msg_t * msg, yutani_wid_t wid, uint32_t input_id, uint64_t received, uint64_t flipped) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_LATENCY_MARK;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_latency_mark);
+
+	struct yutani_msg_latency_mark * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->input_id = input_id;
+	mw->received = received;
+	mw->flipped = flipped;
+}
+
+void yutani_msg_buildx_query_latency(yutani_msg_t * msg) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_QUERY_LATENCY;
+	msg->size  = sizeof(struct yutani_message);
+}
+
+void yutani_msg_buildx_latency_report(yutani_msg_t * msg, const struct yutani_msg_latency_report * report) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_LATENCY_REPORT;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_latency_report);
+
+	memcpy(msg->data, report, sizeof(struct yutani_msg_latency_report));
+}
+
+/* Room for messages in a batch, after its own header */
+#define BATCH_SPACE (MAX_PACKET_SIZE - sizeof(yutani_msg_t))
+
+static int _batch_flush(yutani_t * y) {
+	if (!y->batch_size) return 0;
+
+	int out;
+	yutani_msg_t * first = (yutani_msg_t *)&y->batch[sizeof(yutani_msg_t)];
+	if (first->size == y->batch_size) {
+		/* Just one message, no need to wrap it */
+		out = pex_reply(y->sock, first->size, (char *)first);
+	} else {
+		yutani_msg_t * batch = (yutani_msg_t *)y->batch;
+		batch->magic = YUTANI_MSG__MAGIC;
+		batch->type  = YUTANI_MSG_BATCH;
+		batch->size  = sizeof(yutani_msg_t) + y->batch_size;
+		out = pex_reply(y->sock, batch->size, (char *)batch);
+	}
+
+	y->batch_size = 0;
+	y->batch_barrier = 0;
+	return out;
+}
+
+/*
+ * A flip region that directly follows other flips of the same window
+ * (with nothing else in between) gets folded into the earlier one.
+ */
+static int _batch_coalesce(yutani_t * y, yutani_msg_t * msg) {
+	if (msg->type != YUTANI_MSG_FLIP_REGION) return 0;
+	struct yutani_msg_flip_region * fr = (void *)msg->data;
+
+	size_t offset = y->batch_barrier;
+	while (offset < y->batch_size) {
+		yutani_msg_t * m = (yutani_msg_t *)&y->batch[sizeof(yutani_msg_t) + offset];
+		if (m->type == YUTANI_MSG_FLIP) {
+			struct yutani_msg_flip * f = (void *)m->data;
+			/* Whole window is already being redrawn */
+			if (f->wid == fr->wid) return 1;
+		} else if (m->type == YUTANI_MSG_FLIP_REGION) {
+			struct yutani_msg_flip_region * o = (void *)m->data;
+			if (o->wid == fr->wid) {
+				int32_t left   = o->x < fr->x ? o->x : fr->x;
+				int32_t top    = o->y < fr->y ? o->y : fr->y;
+				int32_t right  = o->x + o->width  > fr->x + fr->width  ? o->x + o->width  : fr->x + fr->width;
+				int32_t bottom = o->y + o->height > fr->y + fr->height ? o->y + o->height : fr->y + fr->height;
+				o->x = left;
+				o->y = top;
+				o->width  = right - left;
+				o->height = bottom - top;
+				return 1;
+			}
+		}
+		offset += m->size;
+	}
+	return 0;
+}
+
 int yutani_msg_send(yutani_t * y, yutani_msg_t * msg) {
-	return pex_reply(y->sock, msg->size, (char *)msg);
+	if (!y->batch_depth) {
+		return pex_reply(y->sock, msg->size, (char *)msg);
+	}
+
+	if (_batch_coalesce(y, msg)) {
+		return msg->size;
+	}
+
+	if (y->batch_size + msg->size > BATCH_SPACE) {
+		_batch_flush(y);
+		if (msg->size > BATCH_SPACE) {
+			return pex_reply(y->sock, msg->size, (char *)msg);
+		}
+	}
+
+	if (msg->type != YUTANI_MSG_FLIP && msg->type != YUTANI_MSG_FLIP_REGION) {
+		/* Flips can't be folded across anything else */
+		y->batch_barrier = y->batch_size + msg->size;
+	}
+
+	memcpy(&y->batch[sizeof(yutani_msg_t) + y->batch_size], msg, msg->size);
+	y->batch_size += msg->size;
+	return msg->size;
+}
+
+/**
+ * yutani_batch_begin
+ *
+ * Hold back messages sent on this connection until the matching
+ * yutani_batch_commit, then send them together in as few packets
+ * as will fit. Batches nest; only the outermost commit sends.
+ */
+void yutani_batch_begin(yutani_t * y) {
+	if (!y->batch) {
+		y->batch = malloc(MAX_PACKET_SIZE);
+	}
+	y->batch_depth++;
+}
+
+/**
+ * yutani_batch_commit
+ *
+ * Send everything queued since yutani_batch_begin.
+ */
+void yutani_batch_commit(yutani_t * y) {
+	if (!y->batch_depth) return;
+	if (--y->batch_depth) return;
+	_batch_flush(y);
 }
 
 yutani_t * yutani_context_create(FILE * socket) {
@@ -512,6 +829,12 @@ yutani_t * yutani_context_create(FILE * socket) {
 	out->display_height = 0;
 	out->windows = hashmap_create_int(10);
 	out->queued = list_create();
+	out->batch_depth = 0;
+	out->batch = NULL;
+	out->batch_size = 0;
+	out->batch_barrier = 0;
+	out->input_id = 0;
+	out->input_received = 0;
 	return out;
 }
 
@@ -573,6 +896,11 @@ yutani_window_t * yutani_window_create_flags(yutani_t * y, int width, int height
 	win->y = 0;
 	win->user_data = NULL;
 	win->ctx = y;
+	win->frame_serial = 0;
+	win->frame_done = 0;
+	win->swap_count = 0;
+	win->swap_back = 0;
+	win->swap_busy = 0;
 	free(mm);
 
 	hashmap_set(y->windows, (void*)win->wid, win);
@@ -600,10 +928,25 @@ yutani_window_t * yutani_window_create(yutani_t * y, int width, int height) {
  *
  * Ask the server to redraw the window.
  */
+/*
+ * After the first flip since a tagged key event arrived, tell the
+ * server when the key was read and when the flip was sent. This goes
+ * after the flip, so the server has its damage by the time it looks.
+ */
+static void _latency_mark(yutani_t * y, yutani_window_t * win, uint64_t flipped) {
+	if (!y->input_id) return;
+	yutani_msg_buildx_latency_mark_alloc(m);
+	yutani_msg_buildx_latency_mark(m, win->wid, y->input_id, y->input_received, flipped);
+	y->input_id = 0;
+	yutani_msg_send(y, m);
+}
+
 void yutani_flip(yutani_t * y, yutani_window_t * win) {
+	uint64_t flipped = y->input_id ? _now_us() : 0;
 	yutani_msg_buildx_flip_alloc(m);
 	yutani_msg_buildx_flip(m, win->wid);
 	yutani_msg_send(y, m);
+	_latency_mark(y, win, flipped);
 }
 
 /**
@@ -612,9 +955,74 @@ void yutani_flip(yutani_t * y, yutani_window_t * win) {
  * Ask the server to redraw a region relative the window.
  */
 void yutani_flip_region(yutani_t * yctx, yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height) {
+	uint64_t flipped = yctx->input_id ? _now_us() : 0;
 	yutani_msg_buildx_flip_region_alloc(m);
 	yutani_msg_buildx_flip_region(m, win->wid, x, y, width, height);
 	yutani_msg_send(yctx, m);
+	_latency_mark(yctx, win, flipped);
+}
+
+/**
+ * yutani_flip_regions
+ *
+ * Ask the server to redraw a list of regions (relative to the window)
+ * as one frame. Returns the frame's serial; the server sends a
+ * FRAME_DONE with it once the frame has been composited, and until
+ * then yutani_frame_pending() is true. An empty list flips the
+ * whole window.
+ */
+uint32_t yutani_flip_regions(yutani_t * yctx, yutani_window_t * win, const yutani_damage_rect_t * rects, int count) {
+	yutani_damage_rect_t whole = { 0, 0, win->width, win->height };
+	if (count <= 0) {
+		rects = &whole;
+		count = 1;
+	}
+
+	uint64_t flipped = yctx->input_id ? _now_us() : 0;
+	uint32_t serial = ++win->frame_serial;
+	if (!serial) serial = ++win->frame_serial; /* 0 means "no callback" */
+
+	/* Only the last piece of a long list asks for a callback */
+	while (count > YUTANI_FLIP_REGIONS_MAX) {
+		yutani_msg_buildx_flip_regions_alloc(m, YUTANI_FLIP_REGIONS_MAX);
+		yutani_msg_buildx_flip_regions(m, win->wid, 0, rects, YUTANI_FLIP_REGIONS_MAX);
+		yutani_msg_send(yctx, m);
+		rects += YUTANI_FLIP_REGIONS_MAX;
+		count -= YUTANI_FLIP_REGIONS_MAX;
+	}
+
+	yutani_msg_buildx_flip_regions_alloc(m, count);
+	yutani_msg_buildx_flip_regions(m, win->wid, serial, rects, count);
+	yutani_msg_send(yctx, m);
+	_latency_mark(yctx, win, flipped);
+	return serial;
+}
+
+/**
+ * yutani_frame_pending
+ *
+ * Whether the last frame sent with yutani_flip_regions
+ * is still waiting to be composited.
+ */
+int yutani_frame_pending(yutani_window_t * win) {
+	return win->frame_serial != win->frame_done;
+}
+
+/*
+ * Unmap a window's extra swapchain buffers and point it back at its
+ * own. The server is told separately, if it needs to be.
+ */
+static void _swapchain_unmap(yutani_t * yctx, yutani_window_t * window) {
+	if (!window->swap_count) return;
+	for (uint32_t i = 1; i < window->swap_count; ++i) {
+		char key[1024];
+		YUTANI_SHMKEY_EXP(yctx->server_ident, key, 1024, window->swap_bufids[i]);
+		shm_release(key);
+	}
+	window->buffer = window->swap_buffers[0];
+	window->swap_count = 0;
+	window->swap_back = 0;
+	window->swap_busy = 0;
 }
 
 /**
@@ -629,6 +1037,7 @@ void yutani_close(yutani_t * y, yutani_window_t * win) {
 	yutani_msg_send(y, m);
 
 	/* Now destroy our end of the window */
+	_swapchain_unmap(y, win);
 	{
 		char key[1024];
 		YUTANI_SHMKEY_EXP(y->server_ident, key, 1024, win->bufid);
@@ -705,6 +1114,9 @@ void yutani_window_resize_accept(yutani_t * yctx, yutani_window_t * window, uint
 		return;
 	}
 
+	/* The server drops the swapchain when the resize finishes */
+	_swapchain_unmap(yctx, window);
+
 	/* Update the window */
 	window->width = wr->width;
 	window->height = wr->height;
@@ -742,6 +1154,145 @@ void yutani_window_resize_done(yutani_t * yctx, yutani_window_t * window) {
 	yutani_msg_send(yctx, m);
 }
 
+/**
+ * yutani_swapchain_create
+ *
+ * Ask the server for a set of 2 or 3 buffers for a window, so the
+ * client can draw into one while the server composites another.
+ * The window's buffer becomes the first one to draw into; once a
+ * frame is drawn, yutani_swapchain_present hands it to the server
+ * and moves on to the next free buffer. Buffers are not preserved
+ * between frames, so each frame should be drawn in full.
+ *
+ * Resizing drops the swapchain; create it again after
+ * yutani_window_resize_done. Returns the number of buffers,
+ * or -1 if the server refused.
+ */
+int yutani_swapchain_create(yutani_t * yctx, yutani_window_t * window, int count) {
+	if (count < 2) return -1;
+	if (count > YUTANI_SWAPCHAIN_MAX) count = YUTANI_SWAPCHAIN_MAX;
+
+	/* The server drops any existing chain first, so we do too */
+	_swapchain_unmap(yctx, window);
+
+	yutani_msg_buildx_swapchain_alloc(m);
+	yutani_msg_buildx_swapchain(m, YUTANI_MSG_SWAPCHAIN, window->wid, count, NULL);
+	yutani_msg_send(yctx, m);
+
+	yutani_msg_t * mm = yutani_wait_for(yctx, YUTANI_MSG_SWAPCHAIN_BUFIDS);
+	struct yutani_msg_swapchain * sc = (void *)mm->data;
+
+	if (sc->wid != window->wid || sc->count < 2 || sc->count > YUTANI_SWAPCHAIN_MAX || sc->bufids[0] != window->bufid) {
+		free(mm);
+		return -1;
+	}
+
+	window->swap_count = sc->count;
+	window->swap_bufids[0] = window->bufid;
+	window->swap_buffers[0] = window->buffer;
+	for (uint32_t i = 1; i < sc->count; ++i) {
+		char key[1024];
+		YUTANI_SHMKEY_EXP(yctx->server_ident, key, 1024, sc->bufids[i]);
+
+		size_t size = (window->width * window->height * 4);
+		window->swap_bufids[i] = sc->bufids[i];
+		window->swap_buffers[i] = shm_obtain(key, &size);
+	}
+	free(mm);
+
+	/* The server starts out showing the window's own buffer */
+	window->swap_busy = 1;
+	window->swap_back = 1;
+	window->buffer = window->swap_buffers[1];
+	return window->swap_count;
+}
+
+/**
+ * yutani_swapchain_destroy
+ *
+ * Go back to a single buffer. The server keeps showing the
+ * last frame that was presented.
+ */
+void yutani_swapchain_destroy(yutani_t * yctx, yutani_window_t * window) {
+	if (!window->swap_count) return;
+
+	yutani_msg_buildx_swapchain_alloc(m);
+	yutani_msg_buildx_swapchain(m, YUTANI_MSG_SWAPCHAIN, window->wid, 0, NULL);
+	yutani_msg_send(yctx, m);
+
+	_swapchain_unmap(yctx, window);
+}
+
+/*
+ * Apply any releases for this window that were queued while
+ * waiting on something else, so they aren't applied twice.
+ */
+static void _swapchain_take_queued(yutani_t * yctx, yutani_window_t * window) {
+	node_t * n = yctx->queued->head;
+	while (n) {
+		node_t * next = n->next;
+		yutani_msg_t * m = n->value;
+		if (m->type == YUTANI_MSG_BUFFER_RELEASE) {
+			struct yutani_msg_window_buffer * wb = (void *)m->data;
+			if (wb->wid == window->wid) {
+				_swapchain_release(window, wb->bufid);
+				list_delete(yctx->queued, n);
+				free(n);
+				free(m);
+			}
+		}
+		n = next;
+	}
+}
+
+/**
+ * yutani_swapchain_present
+ *
+ * Hand the buffer that was just drawn to the server to be shown
+ * and move the window on to the next free one, which is returned
+ * (any graphics context should follow it with
+ * reinit_graphics_yutani). Only waits if every buffer is still
+ * held by the server; with three, that means it has yet to get
+ * to the frame before last.
+ */
+char * yutani_swapchain_present(yutani_t * yctx, yutani_window_t * window) {
+	if (!window->swap_count) {
+		yutani_flip(yctx, window);
+		return window->buffer;
+	}
+
+	uint64_t flipped = yctx->input_id ? _now_us() : 0;
+	yutani_msg_buildx_window_buffer_alloc(m);
+	yutani_msg_buildx_window_buffer(m, YUTANI_MSG_SWAPCHAIN_PRESENT, window->wid, window->swap_bufids[window->swap_back]);
+	yutani_msg_send(yctx, m);
+	_latency_mark(yctx, window, flipped);
+	window->swap_busy |= (1 << window->swap_back);
+
+	uint32_t all = (1 << window->swap_count) - 1;
+	if (window->swap_busy == all) {
+		_swapchain_take_queued(yctx, window);
+	}
+	while (window->swap_busy == all) {
+		yutani_msg_t * mm = yutani_wait_for(yctx, YUTANI_MSG_BUFFER_RELEASE);
+		struct yutani_msg_window_buffer * wb = (void *)mm->data;
+		yutani_window_t * win = hashmap_get(yctx->windows, (void *)wb->wid);
+		if (win) {
+			_swapchain_release(win, wb->bufid);
+		}
+		free(mm);
+	}
+
+	/* Take the free buffer that comes next after this one */
+	uint32_t i = window->swap_back;
+	do {
+		i = (i + 1) % window->swap_count;
+	} while (window->swap_busy & (1 << i));
+
+	window->swap_back = i;
+	window->buffer = window->swap_buffers[i];
+	return window->buffer;
+}
+
 /**
  * yutani_window_advertise
  *
@@ -847,6 +1398,18 @@ void yutani_query_windows(yutani_t * y) {
 	yutani_msg_send(y, m);
 }
 
+/**
+ * yutani_query_latency
+ *
+ * Ask the server for its input latency statistics,
+ * which come back as a LATENCY_REPORT.
+ */
+void yutani_query_latency(yutani_t * y) {
+	yutani_msg_buildx_query_latency_alloc(m);
+	yutani_msg_buildx_query_latency(m);
+	yutani_msg_send(y, m);
+}
+
 /**
  * yutani_session_end
  *
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -7,6 +8,9 @@
 #include <bits/dirent.h>
 
 DEFN_SYSCALL3(readdir, SYS_READDIR, int, int, void *);
+DEFN_SYSCALL4(getdents, SYS_GETDENTS, int, uint32_t *, void *, int);
+
+#define DIR_BATCH 16 /* Entries to fetch per system call */
 
 DIR * opendir (const char * dirname) {
 	int fd = open(dirname, O_RDONLY);
@@ -18,32 +22,41 @@ DIR * opendir (const char * dirname) {
 	DIR * dir = (DIR *)malloc(sizeof(DIR));
 	dir->fd = fd;
 	dir->cur_entry = -1;
+	dir->cursor = 0;
+	dir->count = 0;
+	dir->entries = malloc(sizeof(struct dirent) * DIR_BATCH);
 	return dir;
 }
 
 int closedir (DIR * dir) {
 	if (dir && (dir->fd != -1)) {
-		return close(dir->fd);
+		int ret = close(dir->fd);
+		free(dir->entries);
+		free(dir);
+		return ret;
 	} else {
 		return -EBADF;
 	}
 }
 
 struct dirent * readdir (DIR * dirp) {
-	static struct dirent ent;
-
-	int ret = syscall_readdir(dirp->fd, ++dirp->cur_entry, &ent);
-	if (ret < 0) {
-		errno = -ret;
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
-	}
-
-	if (ret == 0) {
-		/* end of directory */
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
+	dirp->cur_entry++;
+
+	if (dirp->cur_entry >= dirp->count) {
+		/* Out of fetched entries; get the next batch */
+		int ret = syscall_getdents(dirp->fd, &dirp->cursor, dirp->entries, DIR_BATCH);
+		if (ret < 0) {
+			errno = -ret;
+			dirp->count = 0;
+			return NULL;
+		}
+		dirp->count = ret;
+		dirp->cur_entry = 0;
+		if (ret == 0) {
+			/* end of directory */
+			return NULL;
+		}
 	}
 
-	return &ent;
+	return &dirp->entries[dirp->cur_entry];
 }
@@ -2,6 +2,7 @@
 #include <syscall_nums.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <errno.h>
 
 DEFN_SYSCALL3(ioctl, SYS_IOCTL, int, int, void *);
 
@@ -10,20 +11,25 @@ int ioctl(int fd, int request, void * argp) {
 }
 
 /* termios */
+/* There is one speed for both directions, kept in c_cflag */
 speed_t cfgetispeed(const struct termios * tio) {
-	return 0;
+	return tio->c_cflag & CBAUD;
 }
 speed_t cfgetospeed(const struct termios * tio) {
-	return 0;
+	return tio->c_cflag & CBAUD;
 }
 
 int cfsetispeed(struct termios * tio, speed_t speed) {
-	/* hahahaha, yeah right */
+	if (speed & ~CBAUD) {
+		errno = EINVAL;
+		return -1;
+	}
+	tio->c_cflag = (tio->c_cflag & ~CBAUD) | speed;
 	return 0;
 }
 
 int cfsetospeed(struct termios * tio, speed_t speed) {
-	return 0;
+	return cfsetispeed(tio, speed);
 }
 
 int tcdrain(int i) {
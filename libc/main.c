@@ -22,6 +22,7 @@ extern char ** __get_argv(void) {
 }
 
 extern void __stdio_init_buffers(void);
+extern void __malloc_init(void);
 
 void _exit(int val){
 	_fini();
@@ -88,6 +89,7 @@ static void _libc_init(void) {
 		environ = new_environ;
 	}
 	if (getenv("__LIBC_DEBUG")) __libc_debug = 1;
+	__malloc_init();
 	_argv_0 = __get_argv()[0];
 }
 
@@ -10,8 +10,46 @@ extern char * _argv_0;
 #define MATH (void)0
 #endif
 
+/*
+ * exp as in fdlibm: x = k*ln2 + r with |r| <= ln2/2, a rational
+ * approximation of e^r, and k put straight into the exponent.
+ */
+static double scale_by_two(double y, int k) {
+	union { double d; uint64_t u; } scale;
+	if (k > 1023) {
+		y *= 8.98846567431157953865e+307; /* 2^1023 */
+		k -= 1023;
+	} else if (k < -1022) {
+		y *= 2.22507385850720138309e-308; /* 2^-1022 */
+		k += 1022;
+	}
+	scale.u = (uint64_t)(k + 1023) << 52;
+	return y * scale.d;
+}
+
 double exp(double x) {
-	return pow(2.71828182846, x);
+	MATH;
+	if (x != x) return x + x;
+	if (x > 7.09782712893383973096e+02) return HUGE_VAL;
+	if (x < -7.45133219101941108420e+02) return 0.0;
+
+	static const double ln2_hi = 6.93147180369123816490e-01;
+	static const double ln2_lo = 1.90821492927058770002e-10;
+	static const double invln2 = 1.44269504088896338700e+00;
+
+	int k = (int)(x * invln2 + (x < 0.0 ? -0.5 : 0.5));
+	double hi = x - k * ln2_hi;
+	double lo = k * ln2_lo;
+	double r = hi - lo;
+	double t = r * r;
+	double c = r - t * (1.66666666666666019037e-01 + t * (-2.77777777770155933842e-03 + t * (6.61375632143793436117e-05 +
+		t * (-1.65339022054652515390e-06 + t * 4.13813679705723846039e-08))));
+	double y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+	return scale_by_two(y, k);
+}
+
+float expf(float x) {
+	return exp(x);
 }
 
 double ceil(double x) {
@@ -98,391 +136,91 @@ float sqrtf(float x) {
 	return sqrt(x);
 }
 
-static double bad_sine_table[] = {
-	0,
-		0.01745240644,
-		0.03489949671,
-		0.05233595625,
-		0.06975647375,
-		0.08715574276,
-		0.1045284633,
-		0.1218693434,
-		0.139173101,
-		0.1564344651,
-		0.1736481777,
-		0.1908089954,
-		0.2079116908,
-		0.2249510544,
-		0.2419218956,
-		0.2588190451,
-		0.2756373559,
-		0.2923717048,
-		0.3090169944,
-		0.3255681545,
-		0.3420201434,
-		0.3583679496,
-		0.3746065935,
-		0.3907311285,
-		0.4067366431,
-		0.4226182618,
-		0.4383711468,
-		0.4539904998,
-		0.4694715628,
-		0.4848096203,
-		0.5000000001,
-		0.515038075,
-		0.5299192643,
-		0.5446390351,
-		0.5591929035,
-		0.5735764364,
-		0.5877852524,
-		0.6018150232,
-		0.6156614754,
-		0.6293203911,
-		0.6427876098,
-		0.6560590291,
-		0.6691306064,
-		0.6819983601,
-		0.6946583705,
-		0.7071067813,
-		0.7193398004,
-		0.7313537017,
-		0.7431448256,
-		0.7547095803,
-		0.7660444432,
-		0.7771459615,
-		0.7880107537,
-		0.7986355101,
-		0.8090169944,
-		0.8191520444,
-		0.8290375726,
-		0.838670568,
-		0.8480480962,
-		0.8571673008,
-		0.8660254039,
-		0.8746197072,
-		0.8829475929,
-		0.8910065243,
-		0.8987940464,
-		0.9063077871,
-		0.9135454577,
-		0.9205048535,
-		0.9271838546,
-		0.9335804266,
-		0.9396926208,
-		0.9455185757,
-		0.9510565163,
-		0.956304756,
-		0.961261696,
-		0.9659258263,
-		0.9702957263,
-		0.9743700648,
-		0.9781476008,
-		0.9816271835,
-		0.984807753,
-		0.9876883406,
-		0.9902680688,
-		0.9925461517,
-		0.9945218954,
-		0.9961946981,
-		0.9975640503,
-		0.9986295348,
-		0.999390827,
-		0.9998476952,
-		1,
-		0.9998476952,
-		0.999390827,
-		0.9986295347,
-		0.9975640502,
-		0.9961946981,
-		0.9945218953,
-		0.9925461516,
-		0.9902680687,
-		0.9876883406,
-		0.984807753,
-		0.9816271834,
-		0.9781476007,
-		0.9743700647,
-		0.9702957262,
-		0.9659258262,
-		0.9612616959,
-		0.9563047559,
-		0.9510565162,
-		0.9455185755,
-		0.9396926207,
-		0.9335804264,
-		0.9271838545,
-		0.9205048534,
-		0.9135454575,
-		0.9063077869,
-		0.8987940462,
-		0.8910065241,
-		0.8829475927,
-		0.874619707,
-		0.8660254036,
-		0.8571673006,
-		0.848048096,
-		0.8386705678,
-		0.8290375724,
-		0.8191520441,
-		0.8090169942,
-		0.7986355099,
-		0.7880107534,
-		0.7771459613,
-		0.7660444429,
-		0.75470958,
-		0.7431448253,
-		0.7313537014,
-		0.7193398001,
-		0.707106781,
-		0.6946583702,
-		0.6819983598,
-		0.6691306061,
-		0.6560590288,
-		0.6427876094,
-		0.6293203908,
-		0.6156614751,
-		0.6018150229,
-		0.587785252,
-		0.5735764361,
-		0.5591929032,
-		0.5446390347,
-		0.5299192639,
-		0.5150380746,
-		0.4999999997,
-		0.4848096199,
-		0.4694715625,
-		0.4539904994,
-		0.4383711465,
-		0.4226182614,
-		0.4067366428,
-		0.3907311282,
-		0.3746065931,
-		0.3583679492,
-		0.342020143,
-		0.3255681541,
-		0.309016994,
-		0.2923717044,
-		0.2756373555,
-		0.2588190447,
-		0.2419218952,
-		0.224951054,
-		0.2079116904,
-		0.190808995,
-		0.1736481773,
-		0.1564344647,
-		0.1391731006,
-		0.121869343,
-		0.1045284629,
-		0.08715574235,
-		0.06975647334,
-		0.05233595584,
-		0.0348994963,
-		0.01745240603,
-		-0.000000000410206857,
-		-0.01745240685,
-		-0.03489949712,
-		-0.05233595666,
-		-0.06975647416,
-		-0.08715574317,
-		-0.1045284637,
-		-0.1218693438,
-		-0.1391731014,
-		-0.1564344655,
-		-0.1736481781,
-		-0.1908089958,
-		-0.2079116912,
-		-0.2249510548,
-		-0.241921896,
-		-0.2588190455,
-		-0.2756373562,
-		-0.2923717052,
-		-0.3090169948,
-		-0.3255681549,
-		-0.3420201438,
-		-0.35836795,
-		-0.3746065938,
-		-0.3907311289,
-		-0.4067366435,
-		-0.4226182622,
-		-0.4383711472,
-		-0.4539905002,
-		-0.4694715632,
-		-0.4848096207,
-		-0.5000000004,
-		-0.5150380753,
-		-0.5299192646,
-		-0.5446390354,
-		-0.5591929039,
-		-0.5735764368,
-		-0.5877852527,
-		-0.6018150235,
-		-0.6156614757,
-		-0.6293203914,
-		-0.6427876101,
-		-0.6560590294,
-		-0.6691306067,
-		-0.6819983604,
-		-0.6946583708,
-		-0.7071067815,
-		-0.7193398007,
-		-0.731353702,
-		-0.7431448258,
-		-0.7547095806,
-		-0.7660444435,
-		-0.7771459618,
-		-0.7880107539,
-		-0.7986355104,
-		-0.8090169947,
-		-0.8191520446,
-		-0.8290375729,
-		-0.8386705682,
-		-0.8480480964,
-		-0.857167301,
-		-0.8660254041,
-		-0.8746197074,
-		-0.8829475931,
-		-0.8910065244,
-		-0.8987940465,
-		-0.9063077873,
-		-0.9135454579,
-		-0.9205048537,
-		-0.9271838548,
-		-0.9335804267,
-		-0.939692621,
-		-0.9455185758,
-		-0.9510565165,
-		-0.9563047561,
-		-0.9612616961,
-		-0.9659258264,
-		-0.9702957264,
-		-0.9743700649,
-		-0.9781476009,
-		-0.9816271836,
-		-0.9848077531,
-		-0.9876883407,
-		-0.9902680688,
-		-0.9925461517,
-		-0.9945218954,
-		-0.9961946981,
-		-0.9975640503,
-		-0.9986295348,
-		-0.999390827,
-		-0.9998476952,
-		-1,
-		-0.9998476951,
-		-0.999390827,
-		-0.9986295347,
-		-0.9975640502,
-		-0.996194698,
-		-0.9945218953,
-		-0.9925461516,
-		-0.9902680687,
-		-0.9876883405,
-		-0.9848077529,
-		-0.9816271833,
-		-0.9781476006,
-		-0.9743700646,
-		-0.9702957261,
-		-0.9659258261,
-		-0.9612616958,
-		-0.9563047558,
-		-0.9510565161,
-		-0.9455185754,
-		-0.9396926206,
-		-0.9335804263,
-		-0.9271838543,
-		-0.9205048532,
-		-0.9135454574,
-		-0.9063077868,
-		-0.898794046,
-		-0.8910065239,
-		-0.8829475925,
-		-0.8746197068,
-		-0.8660254034,
-		-0.8571673003,
-		-0.8480480958,
-		-0.8386705676,
-		-0.8290375722,
-		-0.8191520439,
-		-0.809016994,
-		-0.7986355096,
-		-0.7880107532,
-		-0.777145961,
-		-0.7660444427,
-		-0.7547095798,
-		-0.743144825,
-		-0.7313537011,
-		-0.7193397998,
-		-0.7071067807,
-		-0.6946583699,
-		-0.6819983595,
-		-0.6691306058,
-		-0.6560590284,
-		-0.6427876091,
-		-0.6293203905,
-		-0.6156614747,
-		-0.6018150226,
-		-0.5877852517,
-		-0.5735764357,
-		-0.5591929029,
-		-0.5446390344,
-		-0.5299192636,
-		-0.5150380743,
-		-0.4999999993,
-		-0.4848096196,
-		-0.4694715621,
-		-0.4539904991,
-		-0.4383711461,
-		-0.422618261,
-		-0.4067366424,
-		-0.3907311278,
-		-0.3746065927,
-		-0.3583679488,
-		-0.3420201426,
-		-0.3255681537,
-		-0.3090169936,
-		-0.292371704,
-		-0.2756373551,
-		-0.2588190443,
-		-0.2419218948,
-		-0.2249510536,
-		-0.20791169,
-		-0.1908089946,
-		-0.1736481769,
-		-0.1564344643,
-		-0.1391731002,
-		-0.1218693426,
-		-0.1045284625,
-		-0.08715574194,
-		-0.06975647293,
-		-0.05233595543,
-		-0.03489949589,
-		-0.01745240562,
-		0.0
-};
+/*
+ * sin and cos reduce their argument by multiples of pi/2 (Cody-Waite,
+ * with pi/2 split in three so the products are exact for any argument
+ * of reasonable size) and evaluate the fdlibm polynomials on what is
+ * left, in [-pi/4,pi/4]. Larger arguments are brought down with fmod
+ * first, which is where they lose precision.
+ */
+static const double invpio2 = 6.36619772367581382433e-01;
+static const double pio2_1  = 1.57079632673412561417e+00; /* first 33 bits of pi/2 */
+static const double pio2_2  = 6.07710050630396597660e-11; /* next 33 */
+static const double pio2_2t = 2.02226624879595063154e-21; /* the rest */
 
-double sin(double x) {
+static double kernel_sin(double x) {
+	double z = x * x;
+	double r = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06 +
+		z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+	return x + x * z * (-1.66666666666666324348e-01 + z * r);
+}
+
+static double kernel_cos(double x) {
+	double z = x * x;
+	double r = 4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 +
+		z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11))));
+	return 1.0 - (0.5 * z - z * z * r);
+}
+
+static int reduce_pio2(double x, double * y) {
+	if (fabs(x) > 1.0e5) {
+		x = fmod(x, 6.28318530717958647692);
+	}
+	int n = (int)(x * invpio2 + (x < 0.0 ? -0.5 : 0.5));
+	*y = ((x - n * pio2_1) - n * pio2_2) - n * pio2_2t;
+	return n;
+}
+
+void sincos(double x, double * s, double * c) {
 	MATH;
-	if (x < 0.0) {
-		x += 3.141592654 * 2.0 * 100.0;
+	if (x != x || x - x != 0.0) {
+		/* NaN or infinite */
+		*s = *c = x - x;
+		return;
 	}
-	int i = x * 360.0 / (3.141592654 * 2.0);
-	double z = x * 360.0 / (3.141592654 * 2.0);
-	z -= i;
+	if (fabs(x) < 7.45058059692382812500e-09) {
+		/* Below 2^-27 the polynomials round to these anyway; this also keeps -0 */
+		*s = x;
+		*c = 1.0;
+		return;
+	}
+	double y;
+	int n = reduce_pio2(x, &y);
+	double ks = kernel_sin(y);
+	double kc = kernel_cos(y);
+	switch (n & 3) {
+		case 0: *s =  ks; *c =  kc; break;
+		case 1: *s =  kc; *c = -ks; break;
+		case 2: *s = -ks; *c = -kc; break;
+		default: *s = -kc; *c =  ks; break;
+	}
+}
 
-	i = i % 360;
+double sin(double x) {
+	double s, c;
+	sincos(x, &s, &c);
+	return s;
+}
 
-	//fprintf(stderr, "z = %f\n", z);
+double cos(double x) {
+	double s, c;
+	sincos(x, &s, &c);
+	return c;
+}
 
-	double a = bad_sine_table[i];
-	double b = bad_sine_table[(i+1)%360];
+void sincosf(float x, float * s, float * c) {
+	double _s, _c;
+	sincos(x, &_s, &_c);
+	*s = _s;
+	*c = _c;
+}
 
-	return a * (1.0-z) + b * (z);
+float sinf(float x) {
+	return sin(x);
 }
 
-double cos(double x) {
-	return sin(x + 3.141592654 / 2.0);
+float cosf(float x) {
+	return cos(x);
 }
 
 double tan(double x) {
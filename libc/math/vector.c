@@ -0,0 +1,150 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Four-wide float versions of the common math functions, for
+ * per-pixel and per-sample loops. Arguments and results are arrays
+ * of four floats, with no alignment requirement.
+ *
+ * sincosf4 and expf4 follow the Cephes single-precision routines and
+ * are good to a couple of ulps for arguments up to a few thousand.
+ * The _fast variants reduce with a single constant and use shorter
+ * polynomials; they are off by up to about 4e-4, which is plenty for
+ * anything that ends up as an 8-bit color.
+ */
+#include <math.h>
+#include <stdint.h>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+
+#define PS(x) _mm_set1_ps(x)
+#define SIGN_MASK _mm_castsi128_ps(_mm_set1_epi32(0x80000000))
+
+static inline void sincos_ps(__m128 x, __m128 * s, __m128 * c, int fast) {
+	__m128 sign_sin = _mm_and_ps(x, SIGN_MASK);
+	x = _mm_andnot_ps(SIGN_MASK, x);
+
+	/* Octant, rounded to even so what's left is within pi/4 of zero */
+	__m128i j = _mm_cvttps_epi32(_mm_mul_ps(x, PS(1.27323954473516f)));
+	j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+	__m128 y = _mm_cvtepi32_ps(j);
+
+	__m128 swap_sin = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29));
+	__m128 sign_cos = _mm_castsi128_ps(_mm_slli_epi32(_mm_andnot_si128(_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4)), 29));
+	__m128 poly_mask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_setzero_si128()));
+	sign_sin = _mm_xor_ps(sign_sin, swap_sin);
+
+	__m128 ys, yc;
+	if (fast) {
+		x = _mm_sub_ps(x, _mm_mul_ps(y, PS(0.785398163397448f)));
+		__m128 z = _mm_mul_ps(x, x);
+		/* Taylor to x^5 and x^4 */
+		ys = _mm_add_ps(PS(-1.6666667e-1f), _mm_mul_ps(z, PS(8.3333333e-3f)));
+		ys = _mm_add_ps(x, _mm_mul_ps(_mm_mul_ps(ys, z), x));
+		yc = _mm_add_ps(PS(-0.5f), _mm_mul_ps(z, PS(4.1666667e-2f)));
+		yc = _mm_add_ps(PS(1.0f), _mm_mul_ps(yc, z));
+	} else {
+		x = _mm_sub_ps(x, _mm_mul_ps(y, PS(0.78515625f)));
+		x = _mm_sub_ps(x, _mm_mul_ps(y, PS(2.4187564849853515625e-4f)));
+		x = _mm_sub_ps(x, _mm_mul_ps(y, PS(3.77489497744594108e-8f)));
+		__m128 z = _mm_mul_ps(x, x);
+		ys = _mm_add_ps(_mm_mul_ps(PS(-1.9515295891e-4f), z), PS(8.3321608736e-3f));
+		ys = _mm_add_ps(_mm_mul_ps(ys, z), PS(-1.6666654611e-1f));
+		ys = _mm_add_ps(x, _mm_mul_ps(_mm_mul_ps(ys, z), x));
+		yc = _mm_add_ps(_mm_mul_ps(PS(2.443315711809948e-5f), z), PS(-1.388731625493765e-3f));
+		yc = _mm_add_ps(_mm_mul_ps(yc, z), PS(4.166664568298827e-2f));
+		yc = _mm_mul_ps(_mm_mul_ps(yc, z), z);
+		yc = _mm_add_ps(_mm_sub_ps(yc, _mm_mul_ps(z, PS(0.5f))), PS(1.0f));
+	}
+
+	/* Odd octant pairs swap which polynomial is which */
+	__m128 rs = _mm_or_ps(_mm_and_ps(poly_mask, ys), _mm_andnot_ps(poly_mask, yc));
+	__m128 rc = _mm_or_ps(_mm_and_ps(poly_mask, yc), _mm_andnot_ps(poly_mask, ys));
+	*s = _mm_xor_ps(rs, sign_sin);
+	*c = _mm_xor_ps(rc, sign_cos);
+}
+
+void sincosf4(const float * x, float * s, float * c) {
+	__m128 vs, vc;
+	sincos_ps(_mm_loadu_ps(x), &vs, &vc, 0);
+	_mm_storeu_ps(s, vs);
+	_mm_storeu_ps(c, vc);
+}
+
+void sincosf4_fast(const float * x, float * s, float * c) {
+	__m128 vs, vc;
+	sincos_ps(_mm_loadu_ps(x), &vs, &vc, 1);
+	_mm_storeu_ps(s, vs);
+	_mm_storeu_ps(c, vc);
+}
+
+void sinf4(const float * x, float * out) {
+	__m128 vs, vc;
+	sincos_ps(_mm_loadu_ps(x), &vs, &vc, 0);
+	_mm_storeu_ps(out, vs);
+}
+
+void sinf4_fast(const float * x, float * out) {
+	__m128 vs, vc;
+	sincos_ps(_mm_loadu_ps(x), &vs, &vc, 1);
+	_mm_storeu_ps(out, vs);
+}
+
+void expf4(const float * in, float * out) {
+	__m128 x = _mm_loadu_ps(in);
+	x = _mm_min_ps(x, PS(88.3762626647949f));
+	x = _mm_max_ps(x, PS(-87.3365447505531f));
+
+	/* n = floor(x / ln2 + 0.5), and x - n*ln2 in two parts */
+	__m128 fx = _mm_add_ps(_mm_mul_ps(x, PS(1.44269504088896341f)), PS(0.5f));
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	fx = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, fx), PS(1.0f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, PS(0.693359375f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, PS(-2.12194440e-4f)));
+
+	__m128 z = _mm_mul_ps(x, x);
+	__m128 y = PS(1.9875691500e-4f);
+	y = _mm_add_ps(_mm_mul_ps(y, x), PS(1.3981999507e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), PS(8.3334519073e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), PS(4.1665795894e-2f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), PS(1.6666665459e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), PS(5.0000001201e-1f));
+	y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, z), x), PS(1.0f));
+
+	__m128i n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(127)), 23);
+	_mm_storeu_ps(out, _mm_mul_ps(y, _mm_castsi128_ps(n)));
+}
+
+void sqrtf4(const float * x, float * out) {
+	_mm_storeu_ps(out, _mm_sqrt_ps(_mm_loadu_ps(x)));
+}
+
+#else
+
+void sincosf4(const float * x, float * s, float * c) {
+	for (int i = 0; i < 4; ++i) sincosf(x[i], &s[i], &c[i]);
+}
+
+void sincosf4_fast(const float * x, float * s, float * c) {
+	sincosf4(x, s, c);
+}
+
+void sinf4(const float * x, float * out) {
+	for (int i = 0; i < 4; ++i) out[i] = sinf(x[i]);
+}
+
+void sinf4_fast(const float * x, float * out) {
+	sinf4(x, out);
+}
+
+void expf4(const float * x, float * out) {
+	for (int i = 0; i < 4; ++i) out[i] = expf(x[i]);
+}
+
+void sqrtf4(const float * x, float * out) {
+	for (int i = 0; i < 4; ++i) out[i] = sqrtf(x[i]);
+}
+
+#endif
@@ -11,11 +11,20 @@
 #include <errno.h>
 
 #include <sys/wait.h>
+#include <sys/futex.h>
+#include <sys/mman.h>
 
 DEFN_SYSCALL3(clone, SYS_CLONE, uintptr_t, uintptr_t, void *);
 DEFN_SYSCALL0(gettid, SYS_GETTID);
 
 #define PTHREAD_STACK_SIZE 0x100000
+#define PTHREAD_GUARD_SIZE 0x1000
+#define PTHREAD_STACK_POOL 8
+
+#define PAGE_ROUND(x) (((x) + 0xFFF) & ~0xFFF)
+
+extern void __malloc_thread_register(void * stack, uintptr_t size);
+extern void __malloc_thread_release(void * stack);
 
 int clone(uintptr_t a,uintptr_t b,void* c) {
 	__sets_errno(syscall_clone(a,b,c));
@@ -24,11 +33,84 @@ int gettid() {
 	return syscall_gettid(); /* never fails */
 }
 
+/*
+ * Thread stacks are mapped rather than taken from the heap, with a
+ * read-only guard region below them so running off the end faults
+ * instead of scribbling on whatever sits beneath. Pages are only
+ * filled in as the stack grows into them.
+ *
+ * Stacks of joined threads go back into a small pool and are handed
+ * out again to new threads asking for the same sizes.
+ */
+struct stack_slot {
+	char * base;
+	size_t stack_size;
+	size_t guard_size;
+};
+
+static struct stack_slot stack_pool[PTHREAD_STACK_POOL];
+static pthread_mutex_t stack_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char * stack_obtain(size_t stack_size, size_t guard_size) {
+	pthread_mutex_lock(&stack_pool_lock);
+	for (int i = 0; i < PTHREAD_STACK_POOL; ++i) {
+		if (stack_pool[i].base && stack_pool[i].stack_size == stack_size && stack_pool[i].guard_size == guard_size) {
+			char * base = stack_pool[i].base;
+			stack_pool[i].base = NULL;
+			pthread_mutex_unlock(&stack_pool_lock);
+			return base;
+		}
+	}
+	pthread_mutex_unlock(&stack_pool_lock);
+
+	char * base = mmap(NULL, guard_size + stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	if (guard_size && mmap(base, guard_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		munmap(base, guard_size + stack_size);
+		return NULL;
+	}
+	return base;
+}
+
+static void stack_return(char * base, size_t stack_size, size_t guard_size) {
+	pthread_mutex_lock(&stack_pool_lock);
+	for (int i = 0; i < PTHREAD_STACK_POOL; ++i) {
+		if (!stack_pool[i].base) {
+			stack_pool[i].base = base;
+			stack_pool[i].stack_size = stack_size;
+			stack_pool[i].guard_size = guard_size;
+			pthread_mutex_unlock(&stack_pool_lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&stack_pool_lock);
+	munmap(base, guard_size + stack_size);
+}
+
 int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg) {
-	char * stack = malloc(PTHREAD_STACK_SIZE);
-	uintptr_t stack_top = (uintptr_t)stack + PTHREAD_STACK_SIZE;
+	size_t stack_size = attr ? attr->stack_size : PTHREAD_STACK_SIZE;
+	size_t guard_size = attr ? attr->guard_size : PTHREAD_GUARD_SIZE;
+
+	char * base = stack_obtain(stack_size, guard_size);
+	if (!base) {
+		return EAGAIN;
+	}
+
+	char * stack = base + guard_size;
+	uintptr_t stack_top = (uintptr_t)stack + stack_size;
 	thread->stack = stack;
+	thread->stack_size = stack_size;
+	thread->guard_size = guard_size;
+	__malloc_thread_register(stack, stack_size);
 	thread->id = clone(stack_top, (uintptr_t)start_routine, arg);
+	if ((int)thread->id < 0) {
+		int err = errno;
+		__malloc_thread_release(stack);
+		stack_return(base, stack_size, guard_size);
+		return err;
+	}
 	return 0;
 }
 
@@ -37,12 +119,7 @@ int pthread_kill(pthread_t thread, int sig) {
 }
 
 void pthread_exit(void * value) {
-	/* Perform nice cleanup */
-#if 0
-	/* XXX: LOCK */
-	free(stack);
-	/* XXX: Return value!? */
-#endif
+	/* The stack is still in use here; pthread_join() returns it to the pool */
 	uintptr_t magic_exit_target = 0xFFFFB00F;
 	void (*magic_exit_func)(void) = (void *)magic_exit_target;
 	magic_exit_func();
@@ -56,22 +133,38 @@ void pthread_cleanup_pop(int execute) {
 	/* do nothing */
 }
 
+/*
+ * Mutexes are a single word: 0 unlocked, 1 locked, 2 locked and
+ * possibly contended. Only a lock that finds the word already
+ * held, or an unlock that finds it contended, makes a syscall.
+ */
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	while (__sync_lock_test_and_set(mutex, 0x01)) {
-		syscall_yield();
+	int c = __sync_val_compare_and_swap(mutex, 0, 1);
+	if (c == 0) {
+		return 0;
+	}
+	if (c != 2) {
+		c = __sync_lock_test_and_set(mutex, 2);
+	}
+	while (c != 0) {
+		futex(mutex, FUTEX_WAIT, 2);
+		c = __sync_lock_test_and_set(mutex, 2);
 	}
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	if (__sync_lock_test_and_set(mutex, 0x01)) {
+	if (__sync_val_compare_and_swap(mutex, 0, 1)) {
 		return EBUSY;
 	}
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	__sync_lock_release(mutex);
+	if (__sync_fetch_and_sub(mutex, 1) != 1) {
+		*mutex = 0;
+		futex(mutex, FUTEX_WAKE, 1);
+	}
 	return 0;
 }
 
@@ -84,8 +177,120 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex) {
 	return 0;
 }
 
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+	*cond = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) {
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	/* A signal between the unlock and the sleep changes the sequence, so the wait returns at once */
+	int seq = *cond;
+	pthread_mutex_unlock(mutex);
+	futex(cond, FUTEX_WAIT, seq);
+	/* Relock as contended, since other waiters may have been woken alongside us */
+	while (__sync_lock_test_and_set(mutex, 2)) {
+		futex(mutex, FUTEX_WAIT, 2);
+	}
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+	__sync_fetch_and_add(cond, 1);
+	futex(cond, FUTEX_WAKE, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+	__sync_fetch_and_add(cond, 1);
+	futex(cond, FUTEX_WAKE, INT32_MAX);
+	return 0;
+}
+
+/*
+ * Read-write locks are a mutex-protected count of readers plus a
+ * writer flag. Waiting writers hold off new readers so a steady
+ * stream of readers can't starve them.
+ */
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr) {
+	rwlock->lock = 0;
+	rwlock->cond = 0;
+	rwlock->readers = 0;
+	rwlock->writer = 0;
+	rwlock->writers_waiting = 0;
+	return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
+	return 0;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+	pthread_mutex_lock(&rwlock->lock);
+	while (rwlock->writer || rwlock->writers_waiting) {
+		pthread_cond_wait(&rwlock->cond, &rwlock->lock);
+	}
+	rwlock->readers++;
+	pthread_mutex_unlock(&rwlock->lock);
+	return 0;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
+	int out = 0;
+	pthread_mutex_lock(&rwlock->lock);
+	if (rwlock->writer || rwlock->writers_waiting) {
+		out = EBUSY;
+	} else {
+		rwlock->readers++;
+	}
+	pthread_mutex_unlock(&rwlock->lock);
+	return out;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+	pthread_mutex_lock(&rwlock->lock);
+	rwlock->writers_waiting++;
+	while (rwlock->writer || rwlock->readers) {
+		pthread_cond_wait(&rwlock->cond, &rwlock->lock);
+	}
+	rwlock->writers_waiting--;
+	rwlock->writer = 1;
+	pthread_mutex_unlock(&rwlock->lock);
+	return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
+	int out = 0;
+	pthread_mutex_lock(&rwlock->lock);
+	if (rwlock->writer || rwlock->readers) {
+		out = EBUSY;
+	} else {
+		rwlock->writer = 1;
+	}
+	pthread_mutex_unlock(&rwlock->lock);
+	return out;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
+	pthread_mutex_lock(&rwlock->lock);
+	if (rwlock->writer) {
+		rwlock->writer = 0;
+	} else {
+		rwlock->readers--;
+	}
+	if (!rwlock->readers) {
+		pthread_cond_broadcast(&rwlock->cond);
+	}
+	pthread_mutex_unlock(&rwlock->lock);
+	return 0;
+}
+
 int pthread_attr_init(pthread_attr_t *attr) {
-	*attr = 0;
+	attr->stack_size = PTHREAD_STACK_SIZE;
+	attr->guard_size = PTHREAD_GUARD_SIZE;
 	return 0;
 }
 
@@ -93,9 +298,36 @@ int pthread_attr_destroy(pthread_attr_t *attr) {
 	return 0;
 }
 
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize) {
+	if (stacksize < PTHREAD_STACK_MIN) {
+		return EINVAL;
+	}
+	attr->stack_size = PAGE_ROUND(stacksize);
+	return 0;
+}
+
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize) {
+	*stacksize = attr->stack_size;
+	return 0;
+}
+
+int pthread_attr_setguardsize(pthread_attr_t *attr, size_t guardsize) {
+	attr->guard_size = PAGE_ROUND(guardsize);
+	return 0;
+}
+
+int pthread_attr_getguardsize(const pthread_attr_t *attr, size_t *guardsize) {
+	*guardsize = attr->guard_size;
+	return 0;
+}
+
 int pthread_join(pthread_t thread, void **retval) {
 	int status;
 	int result = waitpid(thread.id, &status, 0);
+	if (result >= 0) {
+		__malloc_thread_release(thread.stack);
+		stack_return(thread.stack - thread.guard_size, thread.stack_size, thread.guard_size);
+	}
 	if (retval) {
 		*retval = (void*)status;
 	}
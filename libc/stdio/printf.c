@@ -1,114 +1,165 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <va_list.h>
 
-static void print_dec(unsigned int value, unsigned int width, char * buf, int * ptr, int fill_zero, int align_right, int precision) {
-	unsigned int n_width = 1;
-	unsigned int i = 9;
-	if (precision == -1) precision = 1;
-
-	if (value == 0) {
-		n_width = 0;
-	} else if (value < 10UL) {
-		n_width = 1;
-	} else if (value < 100UL) {
-		n_width = 2;
-	} else if (value < 1000UL) {
-		n_width = 3;
-	} else if (value < 10000UL) {
-		n_width = 4;
-	} else if (value < 100000UL) {
-		n_width = 5;
-	} else if (value < 1000000UL) {
-		n_width = 6;
-	} else if (value < 10000000UL) {
-		n_width = 7;
-	} else if (value < 100000000UL) {
-		n_width = 8;
-	} else if (value < 1000000000UL) {
-		n_width = 9;
-	} else {
-		n_width = 10;
-	}
+/*
+ * Output goes through a `struct out`: a window of space to write into
+ * and, for destinations that can take more than fits, a callback to
+ * make more room. Literal runs of the format and converted numbers are
+ * appended in bulk; `count` keeps the full length even when a bounded
+ * destination has dropped the tail.
+ */
+struct out {
+	char * start;
+	char * b;
+	char * end;
+	size_t count;
+	int (*full)(struct out * o); /* 0 to drop what doesn't fit */
+	void * extra;
+};
 
-	if (n_width < (unsigned int)precision) n_width = precision;
+#define OUT_ROOM(o) ((size_t)((uintptr_t)(o)->end - (uintptr_t)(o)->b))
 
-	int printed = 0;
-	if (align_right) {
-		while (n_width + printed < width) {
-			buf[*ptr] = fill_zero ? '0' : ' ';
-			*ptr += 1;
-			printed += 1;
+static void out_write(struct out * o, const char * s, size_t n) {
+	o->count += n;
+	while (n) {
+		size_t room = OUT_ROOM(o);
+		if (!room) {
+			if (!o->full || !o->full(o)) return;
+			room = OUT_ROOM(o);
 		}
+		if (room > n) room = n;
+		memcpy(o->b, s, room);
+		o->b += room;
+		s += room;
+		n -= room;
+	}
+}
 
-		i = n_width;
-		while (i > 0) {
-			unsigned int n = value / 10;
-			int r = value % 10;
-			buf[*ptr + i - 1] = r + '0';
-			i--;
-			value = n;
+static void out_fill(struct out * o, char c, size_t n) {
+	o->count += n;
+	while (n) {
+		size_t room = OUT_ROOM(o);
+		if (!room) {
+			if (!o->full || !o->full(o)) return;
+			room = OUT_ROOM(o);
 		}
-		*ptr += n_width;
-	} else {
-		i = n_width;
-		while (i > 0) {
-			unsigned int n = value / 10;
-			int r = value % 10;
-			buf[*ptr + i - 1] = r + '0';
-			i--;
-			value = n;
-			printed++;
+		if (room > n) room = n;
+		memset(o->b, c, room);
+		o->b += room;
+		n -= room;
+	}
+}
+
+static inline void out_putc(struct out * o, char c) {
+	o->count++;
+	if (o->b == o->end && (!o->full || !o->full(o))) return;
+	*o->b++ = c;
+}
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+ * Decimal digits of value, two at a time, backwards from end. 64-bit
+ * values are split into 32-bit chunks of eight digits first, so there
+ * is one long division per eight digits rather than one per digit.
+ * Zero has no digits; precision provides it.
+ */
+static char * format_dec(unsigned long long value, char * end) {
+	char * p = end;
+	while (value > UINT32_MAX) {
+		unsigned long long q = value / 100000000;
+		uint32_t low = value - q * 100000000;
+		for (int i = 0; i < 4; ++i) {
+			p -= 2;
+			memcpy(p, &digit_pairs[(low % 100) * 2], 2);
+			low /= 100;
 		}
-		*ptr += n_width;
-		while (printed < (int)width) {
-			buf[*ptr] = fill_zero ? '0' : ' ';
-			*ptr += 1;
-			printed += 1;
+		value = q;
+	}
+	uint32_t v = value;
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[v * 2], 2);
+	} else if (v) {
+		*--p = '0' + v;
+	}
+	return p;
+}
+
+static void print_dec(struct out * o, unsigned long long value, unsigned int width, int fill_zero, int align_right, int precision, char sign) {
+	char digits[20];
+	char * end = digits + sizeof(digits);
+	char * p = format_dec(value, end);
+	size_t n_width = end - p;
+	if (precision == -1) precision = 1;
+
+	size_t zeros = (size_t)precision > n_width ? precision - n_width : 0;
+	size_t len = n_width + zeros + (sign ? 1 : 0);
+	size_t pad = width > len ? width - len : 0;
+
+	if (align_right) {
+		if (fill_zero) {
+			zeros += pad;
+		} else {
+			out_fill(o, ' ', pad);
 		}
+		pad = 0;
 	}
+	if (sign) out_putc(o, sign);
+	out_fill(o, '0', zeros);
+	out_write(o, p, n_width);
+	out_fill(o, fill_zero ? '0' : ' ', pad);
 }
 
 /*
  * Hexadecimal to string
  */
-static void print_hex(unsigned int value, unsigned int width, char * buf, int * ptr) {
+static void print_hex(struct out * o, unsigned int value, unsigned int width) {
 	int i = width;
 
 	if (i == 0) i = 8;
 
-	unsigned int n_width = 1;
-	unsigned int j = 0x0F;
-	while (value > j && j < UINT32_MAX) {
-		n_width += 1;
-		j *= 0x10;
-		j += 0x0F;
+	int n_width = 1;
+	while (n_width < 8 && (value >> (n_width * 4))) {
+		n_width++;
 	}
 
-	while (i > (int)n_width) {
-		buf[*ptr] = '0';
-		*ptr += 1;
-		i--;
+	if (i > n_width) {
+		out_fill(o, '0', i - n_width);
 	}
 
-	i = (int)n_width;
-	while (i-- > 0) {
-		buf[*ptr] = "0123456789abcdef"[(value>>(i*4))&0xF];
-		*ptr += + 1;
+	char digits[8];
+	for (int j = 0; j < n_width; ++j) {
+		digits[j] = "0123456789abcdef"[(value >> ((n_width - 1 - j) * 4)) & 0xF];
 	}
+	out_write(o, digits, n_width);
 }
 
-/*
- * vasprintf()
- */
-int xvasprintf(char * buf, const char * fmt, va_list args) {
-	int i = 0;
+static size_t format(struct out * o, const char * fmt, va_list args) {
 	char * s;
-	char * b = buf;
-	int precision = -1;
 	for (const char *f = fmt; *f; f++) {
 		if (*f != '%') {
-			*b++ = *f;
+			const char * span = f;
+			while (f[1] && f[1] != '%') f++;
+			out_write(o, span, f - span + 1);
 			continue;
 		}
 		++f;
@@ -118,6 +169,7 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 		int big = 0;
 		int alt = 0;
 		int always_sign = 0;
+		int precision = -1;
 		while (1) {
 			if (*f == '-') {
 				align = 0;
@@ -126,7 +178,12 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 				alt = 1;
 				++f;
 			} else if (*f == '*') {
-				arg_width = (char)va_arg(args, int);
+				int w = va_arg(args, int);
+				if (w < 0) {
+					align = 0;
+					w = -w;
+				}
+				arg_width = w;
 				++f;
 			} else if (*f == '0') {
 				fill_zero = 1;
@@ -179,9 +236,8 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 						if (ws == NULL) {
 							ws = L"(null)";
 						}
-						size_t count = 0;
 						while (*ws) {
-							*b++ = *ws++;
+							out_putc(o, *ws++);
 							count++;
 							if (arg_width && count == arg_width) break;
 						}
@@ -190,29 +246,19 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 						if (s == NULL) {
 							s = "(null)";
 						}
-						if (precision >= 0) {
-							while (*s && precision > 0) {
-								*b++ = *s++;
-								count++;
-								precision--;
-								if (arg_width && count == arg_width) break;
-							}
-						} else {
-							while (*s) {
-								*b++ = *s++;
-								count++;
-								if (arg_width && count == arg_width) break;
-							}
-						}
+						/* Precision limits the string, and (oddly) so does the width */
+						size_t limit = precision >= 0 ? (size_t)precision : SIZE_MAX;
+						if (arg_width && arg_width < limit) limit = arg_width;
+						while (count < limit && s[count]) count++;
+						out_write(o, s, count);
 					}
-					while (count < arg_width) {
-						*b++ = ' ';
-						count++;
+					if (count < arg_width) {
+						out_fill(o, ' ', arg_width - count);
 					}
 				}
 				break;
 			case 'c': /* Single character */
-				*b++ = (char)va_arg(args, int);
+				out_putc(o, (char)va_arg(args, int));
 				break;
 			case 'p':
 				if (!arg_width) {
@@ -221,20 +267,17 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 				}
 			case 'x': /* Hexadecimal number */
 				if (alt) {
-					*b++ = '0';
-					*b++ = 'x';
+					out_write(o, "0x", 2);
 				}
-				i = b - buf;
 				if (big == 2) {
 					unsigned long long val = (unsigned long long)va_arg(args, unsigned long long);
 					if (val > 0xFFFFFFFF) {
-						print_hex(val >> 32, arg_width > 8 ? (arg_width - 8) : 0, buf, &i);
+						print_hex(o, val >> 32, arg_width > 8 ? (arg_width - 8) : 0);
 					}
-					print_hex(val & 0xFFFFFFFF, arg_width > 8 ? 8 : arg_width, buf, &i);
+					print_hex(o, val & 0xFFFFFFFF, arg_width > 8 ? 8 : arg_width);
 				} else {
-					print_hex((unsigned long)va_arg(args, unsigned long), arg_width, buf, &i);
+					print_hex(o, (unsigned long)va_arg(args, unsigned long), arg_width);
 				}
-				b = buf + i;
 				break;
 			case 'i':
 			case 'd': /* Decimal number */
@@ -245,19 +288,18 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 					} else {
 						val = (long)va_arg(args, long);
 					}
+					char sign = 0;
+					unsigned long long mag = val;
 					if (val < 0) {
-						*b++ = '-';
-						val = -val;
+						sign = '-';
+						mag = -mag;
 					} else if (always_sign) {
-						*b++ = '+';
+						sign = '+';
 					}
-					i = b - buf;
-					print_dec(val, arg_width, buf, &i, fill_zero, align, precision);
-					b = buf + i;
+					print_dec(o, mag, arg_width, fill_zero, align, precision, sign);
 				}
 				break;
 			case 'u': /* Unsigned ecimal number */
-				i = b - buf;
 				{
 					unsigned long long val;
 					if (big == 2) {
@@ -265,48 +307,74 @@ int xvasprintf(char * buf, const char * fmt, va_list args) {
 					} else {
 						val = (unsigned long)va_arg(args, unsigned long);
 					}
-					print_dec(val, arg_width, buf, &i, fill_zero, align, precision);
+					print_dec(o, val, arg_width, fill_zero, align, precision, 0);
 				}
-				b = buf + i;
 				break;
 			case 'g': /* supposed to also support e */
 			case 'f':
 				{
 					double val = (double)va_arg(args, double);
+					char sign = 0;
 					if (val < 0) {
-						*b++ = '-';
+						sign = '-';
 						val = -val;
 					}
-					i = b - buf;
-					print_dec((long)val, arg_width, buf, &i, fill_zero, align, 1);
-					b = buf + i;
-					*b++ = '.';
-					i = b - buf;
+					print_dec(o, (unsigned long long)val, arg_width, fill_zero, align, 1, sign);
+					out_putc(o, '.');
 					for (int j = 0; j < ((precision > -1 && precision < 8) ? precision : 8); ++j) {
 						if ((int)(val * 100000.0) % 100000 == 0 && j != 0) break;
 						val *= 10.0;
-						print_dec((int)(val) % 10, 0, buf, &i, 0, 0, 1);
+						out_putc(o, '0' + (int)(val) % 10);
 					}
-					b = buf + i;
 				}
 				break;
 			case '%': /* Escape */
-				*b++ = '%';
+				out_putc(o, '%');
 				break;
 			default: /* Nothing at all, just dump it */
-				*b++ = *f;
+				out_putc(o, *f);
 				break;
 		}
 	}
-	/* Ensure the buffer ends in a null */
-	*b = '\0';
-	return b - buf;
+	return o->count;
+}
+
+/* Straight into a buffer the caller promises is big enough */
+int xvasprintf(char * buf, const char * fmt, va_list args) {
+	struct out o = {buf, buf, (char *)UINTPTR_MAX, 0, NULL, NULL};
+	format(&o, fmt, args);
+	*o.b = '\0';
+	return o.count;
+}
+
+static int grow_string(struct out * o) {
+	size_t used = o->b - o->start;
+	size_t size = (o->end - o->start + 1) * 2;
+	char * n = realloc(o->start, size);
+	if (!n) return 0;
+	o->start = n;
+	o->b = n + used;
+	o->end = n + size - 1; /* Room for the terminator */
+	return 1;
 }
 
 int vasprintf(char ** buf, const char * fmt, va_list args) {
-	char * b = malloc(1024);
-	*buf = b;
-	return xvasprintf(b, fmt, args);
+	char * b = malloc(128);
+	if (!b) {
+		*buf = NULL;
+		return -1;
+	}
+	struct out o = {b, b, b + 127, 0, grow_string, NULL};
+	format(&o, fmt, args);
+	if ((size_t)(o.b - o.start) != o.count) {
+		/* Growing failed partway */
+		free(o.start);
+		*buf = NULL;
+		return -1;
+	}
+	*o.b = '\0';
+	*buf = o.start;
+	return o.count;
 }
 
 int vsprintf(char * buf, const char *fmt, va_list args) {
@@ -314,17 +382,27 @@ int vsprintf(char * buf, const char *fmt, va_list args) {
 }
 
 int vsnprintf(char * buf, size_t size, const char *fmt, va_list args) {
-	/* XXX */
-	return xvasprintf(buf, fmt, args);
+	struct out o = {buf, buf, size ? buf + size - 1 : buf, 0, NULL, NULL};
+	format(&o, fmt, args);
+	if (size) *o.b = '\0';
+	return o.count;
 }
 
-int vfprintf(FILE * device, const char *fmt, va_list args) {
-	char * buffer;
-	vasprintf(&buffer, fmt, args);
+/* Files get a small buffer on the stack, handed to fwrite as it fills */
+#define FILE_CHUNK 512
 
-	int out = fwrite(buffer, 1, strlen(buffer), device);
-	free(buffer);
-	return out;
+static int flush_file(struct out * o) {
+	fwrite(o->start, 1, o->b - o->start, (FILE *)o->extra);
+	o->b = o->start;
+	return 1;
+}
+
+int vfprintf(FILE * device, const char *fmt, va_list args) {
+	char buffer[FILE_CHUNK];
+	struct out o = {buffer, buffer, buffer + FILE_CHUNK, 0, flush_file, device};
+	format(&o, fmt, args);
+	flush_file(&o);
+	return o.count;
 }
 
 int vprintf(const char *fmt, va_list args) {
@@ -334,23 +412,16 @@ int vprintf(const char *fmt, va_list args) {
 int fprintf(FILE * device, const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	char * buffer;
-	vasprintf(&buffer, fmt, args);
+	int out = vfprintf(device, fmt, args);
 	va_end(args);
-
-	int out = fwrite(buffer, 1, strlen(buffer), device);
-	free(buffer);
 	return out;
 }
 
 int printf(const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	char * buffer;
-	vasprintf(&buffer, fmt, args);
+	int out = vfprintf(stdout, fmt, args);
 	va_end(args);
-	int out = fwrite(buffer, 1, strlen(buffer), stdout);
-	free(buffer);
 	return out;
 }
 
@@ -363,13 +434,9 @@ int sprintf(char * buf, const char *fmt, ...) {
 }
 
 int snprintf(char * buf, size_t size, const char * fmt, ...) {
-	/* XXX This is bad. */
-	(void)size;
 	va_list args;
 	va_start(args, fmt);
-	int out = xvasprintf(buf, fmt, args);
+	int out = vsnprintf(buf, size, fmt, args);
 	va_end(args);
 	return out;
 }
-
-
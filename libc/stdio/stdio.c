@@ -8,20 +8,6 @@
 
 #include <_xlog.h>
 
-struct _FILE {
-	int fd;
-
-	char * read_buf;
-	int available;
-	int offset;
-	int read_from;
-	int ungetc;
-	int eof;
-	int bufsiz;
-	long last_read_start;
-	char * _name;
-};
-
 FILE _stdin = {
 	.fd = 0,
 	.read_buf = NULL,
@@ -90,66 +76,91 @@ int setvbuf(FILE * stream, char * buf, int mode, size_t size) {
 		return -1; /* Unsupported */
 	}
 	if (buf) {
-		if (stream->read_buf) {
+		if (stream->read_buf && !stream->user_buf) {
 			free(stream->read_buf);
 		}
 		stream->read_buf = buf;
 		stream->bufsiz = size;
+		stream->user_buf = 1;
 	}
 	return 0;
 }
 
+/*
+ * Refill an empty read buffer from the start. A stream that keeps
+ * filling its buffer completely is reading through a file, so its
+ * buffer is doubled (up to _STDIO_MAX_BUFSIZ) to cut down on reads.
+ */
+static ssize_t refill(FILE * f) {
+	if (!f->user_buf && f->read_buf && f->offset == f->bufsiz && f->bufsiz < _STDIO_MAX_BUFSIZ) {
+		char * larger = realloc(f->read_buf, f->bufsiz * 2);
+		if (larger) {
+			f->read_buf = larger;
+			f->bufsiz *= 2;
+		}
+	}
+	if (!f->read_buf) {
+		f->read_buf = malloc(f->bufsiz);
+	}
+
+	f->last_read_start = syscall_lseek(f->fd, 0, SEEK_CUR);
+	ssize_t r = read(f->fd, f->read_buf, f->bufsiz);
+	f->read_from = 0;
+	if (r < 0) {
+		f->offset = 0;
+		f->available = 0;
+		return r;
+	}
+	f->offset = r;
+	f->available = r;
+	if (r == 0) {
+		f->eof = 1;
+	}
+	return r;
+}
+
 static size_t read_bytes(FILE * f, char * out, size_t len) {
 	size_t r_out = 0;
 
-	//fprintf(stderr, "%s: Read %d bytes from %s\n", _argv_0, len, stream_id(f));
-	//fprintf(stderr, "%s: off[%d] avail[%d] read[%d]\n", _argv_0, f->offset, f->available, f->read_from);
+	if (len > 0 && f->ungetc >= 0) {
+		*out++ = f->ungetc;
+		len--;
+		r_out++;
+		f->ungetc = -1;
+	}
 
 	while (len > 0) {
-		if (f->ungetc >= 0) {
-			*out = f->ungetc;
-			len--;
-			out++;
-			r_out++;
-			f->ungetc = -1;
+		if (f->available > 0) {
+			size_t n = (size_t)f->available < len ? (size_t)f->available : len;
+			memcpy(out, &f->read_buf[f->read_from], n);
+			f->read_from += n;
+			f->available -= n;
+			out += n;
+			len -= n;
+			r_out += n;
 			continue;
 		}
 
-		if (f->available == 0) {
-			if (f->offset == f->bufsiz) {
-				f->offset = 0;
-			}
-			f->last_read_start = syscall_lseek(f->fd, 0, SEEK_CUR);
-			ssize_t r = read(fileno(f), &f->read_buf[f->offset], f->bufsiz - f->offset);
-			if (r < 0) {
-				//fprintf(stderr, "error condition\n");
+		if (len >= (size_t)f->bufsiz) {
+			/* Nothing is buffered, so large reads go straight to the caller */
+			f->offset = 0;
+			f->read_from = 0;
+			ssize_t r = read(f->fd, out, len);
+			if (r <= 0) {
+				if (r == 0) f->eof = 1;
 				return r_out;
-			} else {
-				f->read_from = f->offset;
-				f->available = r;
-				f->offset += f->available;
 			}
+			out += r;
+			len -= r;
+			r_out += r;
+			continue;
 		}
 
-		if (f->available == 0) {
-			/* EOF condition */
-			//fprintf(stderr, "%s: no bytes available, returning read value of %d\n", _argv_0, r_out);
-			f->eof = 1;
+		if (refill(f) <= 0) {
 			return r_out;
 		}
-
-		//fprintf(stderr, "%s: reading until %d reaches %d or %d reaches 0\n", _argv_0, f->read_from, f->offset, len);
-		while (f->read_from < f->offset && len > 0 && f->available > 0) {
-			*out = f->read_buf[f->read_from];
-			len--;
-			f->read_from++;
-			f->available--;
-			out++;
-			r_out += 1;
-		}
 	}
 
-	//fprintf(stderr, "%s: read completed, returning read value of %d\n", _argv_0, r_out);
 	return r_out;
 }
 
@@ -220,6 +231,9 @@ FILE * freopen(const char *path, const char *mode, FILE * stream) {
 		parse_mode(mode, &flags, &mask);
 		int fd = syscall_open(path, flags, mask);
 		stream->fd = fd;
+		stream->read_buf = NULL;
+		stream->bufsiz = BUFSIZ;
+		stream->user_buf = 0;
 		stream->available = 0;
 		stream->read_from = 0;
 		stream->offset = 0;
@@ -267,7 +281,9 @@ int _fwouldblock(FILE * stream) {
 int fclose(FILE * stream) {
 	int out = syscall_close(stream->fd);
 	free(stream->_name);
-	free(stream->read_buf);
+	if (!stream->user_buf) {
+		free(stream->read_buf);
+	}
 	if (stream == &_stdin || stream == &_stdout || stream == &_stderr) {
 		return out;
 	} else {
@@ -285,7 +301,7 @@ static char * _whence_str(int whence) {
 
 int fseek(FILE * stream, long offset, int whence) {
 	if (_argv_0 && strcmp(_argv_0, "ld.so")) {
-		if (stream->read_from && whence == SEEK_CUR) {
+		if (stream->offset && whence == SEEK_CUR) {
 			if (__libc_debug) {
 				fprintf(stderr, "%s: fseek(%s, %ld, %s)\n", _argv_0, stream->_name, offset, _whence_str(whence));
 				fprintf(stderr, "\033[33;3mWARNING\033[0m: seeking when offset is currently %d\n", stream->read_from);
@@ -313,14 +329,10 @@ long ftell(FILE * stream) {
 	if (_argv_0 && strcmp(_argv_0, "ld.so") && __libc_debug) {
 		fprintf(stderr, "%s: ftell(%s)\n", _argv_0, stream->_name);
 	}
-	if (stream->read_from || stream->last_read_start) {
+	if (stream->offset) {
+		/* The kernel is ahead of us by whatever is still buffered */
 		return stream->last_read_start + stream->read_from;
 	}
-	stream->offset = 0;
-	stream->read_from = 0;
-	stream->available = 0;
-	stream->ungetc = -1;
-	stream->eof = 0;
 	long resp = syscall_lseek(stream->fd, 0, SEEK_CUR);
 	if (resp < 0) {
 		errno = -resp;
@@ -342,18 +354,8 @@ int fsetpos(FILE *stream, const fpos_t *pos) {
 }
 
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE * stream) {
-	char * tracking = (char*)ptr;
-	for (size_t i = 0; i < nmemb; ++i) {
-		int r = read_bytes(stream, tracking, size);
-		if (r < 0) {
-			return -1;
-		}
-		tracking += r;
-		if (r < (int)size) {
-			return i;
-		}
-	}
-	return nmemb;
+	if (!size || !nmemb) return 0;
+	return read_bytes(stream, ptr, size * nmemb) / size;
 }
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE * stream) {
@@ -393,48 +395,60 @@ int fputc(int c, FILE *stream) {
 int putc(int c, FILE *stream) __attribute__((weak, alias("fputc")));
 
 int fgetc(FILE * stream) {
+	if (stream->ungetc < 0 && stream->available > 0) {
+		stream->available--;
+		return (unsigned char)stream->read_buf[stream->read_from++];
+	}
 	char buf[1];
-	int r;
-	r = fread(buf, 1, 1, stream);
-	if (r < 0) {
-		stream->eof = 1;
-		return EOF;
-	} else if (r == 0) {
+	if (read_bytes(stream, buf, 1) == 0) {
 		stream->eof = 1;
 		return EOF;
 	}
 	return (unsigned char)buf[0];
 }
 
-int getc(FILE * stream) __attribute__((weak, alias("fgetc")));
+/* Parenthesized so the getc() and getchar() macros don't apply */
+int (getc)(FILE * stream) __attribute__((weak, alias("fgetc")));
 
-int getchar(void) {
+int (getchar)(void) {
 	return fgetc(stdin);
 }
 
 char *fgets(char *s, int size, FILE *stream) {
-	int c;
 	char * out = s;
-	while ((c = fgetc(stream)) > 0) {
+	if (size <= 0) return NULL;
+	size--;
+
+	if (size > 0 && stream->ungetc >= 0) {
+		char c = stream->ungetc;
+		stream->ungetc = -1;
 		*s++ = c;
 		size--;
-		if (size == 0) {
-			return out;
-		}
-		*s = '\0';
-		if (c == '\n') {
-			return out;
-		}
+		if (c == '\n') size = 0;
 	}
-	if (c == EOF) {
-		stream->eof = 1;
-		if (out == s) {
-			return NULL;
-		} else {
-			return out;
+
+	/* Copy whole runs out of the buffer, up to and including a newline */
+	while (size > 0) {
+		if (stream->available <= 0 && refill(stream) <= 0) {
+			break;
 		}
+		size_t n = stream->available < size ? stream->available : size;
+		char * start = &stream->read_buf[stream->read_from];
+		char * nl = memchr(start, '\n', n);
+		if (nl) n = nl - start + 1;
+		memcpy(s, start, n);
+		s += n;
+		size -= n;
+		stream->read_from += n;
+		stream->available -= n;
+		if (nl) break;
 	}
-	return NULL;
+
+	*s = '\0';
+	if (s == out) {
+		return NULL;
+	}
+	return out;
 }
 
 int putchar(int c) {
@@ -96,7 +96,6 @@
  * """""""""""""""""
  *
  * TODO: Try to be more consistent on comment widths...
- * FIXME: Make thread safe! Not necessary for competition, but would be nice.
  * FIXME: Splitting/coalescing is broken. Fix this ASAP!
  *
 **/
@@ -107,6 +106,11 @@
 #include <stdint.h>
 #include <limits.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -159,50 +163,14 @@ static void _malloc_assert(const char * file, int line, const char * func, const
 	exit(1);
 }
 
+/* Contended threads sleep on the lock word rather than spinning */
 static void spin_lock(int volatile * lock, const char * caller) {
-	while(__sync_lock_test_and_set(lock, 0x01)) {
-		syscall_yield();
-	}
+	pthread_mutex_lock(lock);
 	_lock_holder = caller;
 }
 
 static void spin_unlock(int volatile * lock) {
-	__sync_lock_release(lock);
-}
-
-
-void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klmalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klrealloc(ptr, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klcalloc(nmemb, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klvalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void free(void * ptr) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	klfree(ptr);
-	spin_unlock(&mem_lock);
+	pthread_mutex_unlock(lock);
 }
 
 
@@ -280,6 +248,23 @@ static struct _klmalloc_big_bins {
 } klmalloc_big_bins;
 static klmalloc_big_bin_header * klmalloc_newest_big = NULL;		/* Newest big bin */
 
+/*
+ * Usage, for mallinfo(). Cells held in thread caches have left the
+ * shared bins, so they are in use as far as these are concerned.
+ */
+static uintptr_t klmalloc_bin_pages[NUM_BINS - 1];					/* Pages given to each small bin */
+static uintptr_t klmalloc_bin_used[NUM_BINS - 1];					/* Cells handed out of them */
+static uintptr_t klmalloc_arena = 0;								/* Bytes taken with sbrk */
+static uintptr_t klmalloc_in_use = 0;
+static uintptr_t klmalloc_peak = 0;
+
+static inline void __attribute__ ((always_inline)) klmalloc_account(uintptr_t size) {
+	klmalloc_in_use += size;
+	if (klmalloc_in_use > klmalloc_peak) {
+		klmalloc_peak = klmalloc_in_use;
+	}
+}
+
 /* }}} Bin management */
 /* Doubly-Linked List {{{ */
 
@@ -597,6 +582,398 @@ static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_
 
 /* }}} Stack */
 
+/* Thread caches {{{ */
+
+/*
+ * Each thread keeps a small stash of free cells for every small bin,
+ * so most small allocations and frees don't need the lock at all.
+ * A stash is refilled from, and drained back into, the shared bins
+ * a batch at a time, which is when the lock is taken.
+ *
+ * There is no thread-local storage, so a thread is recognized by its
+ * stack: the main thread's is where the kernel always puts it, and
+ * pthread_create registers the ones it allocates. A thread running
+ * on a stack we don't know about just takes the locked path.
+ */
+#define THREAD_CACHES     16U							/* Threads that can have a cache at once. */
+#define THREAD_CACHE_FILL 16U							/* Cells moved between a cache and the shared bins at a time. */
+#define THREAD_CACHE_MAX  (THREAD_CACHE_FILL * 2)		/* Cells a cache may hold per bin before it drains some. */
+
+#define MAIN_STACK_BOTTOM 0xAFF00000					/* The kernel's USER_STACK_BOTTOM */
+#define MAIN_STACK_TOP    0xB0000000					/* The kernel's USER_STACK_TOP */
+
+typedef struct _klmalloc_thread_cache {
+	uintptr_t volatile stack_bottom;
+	uintptr_t volatile stack_top;						/* 0 if this cache is unused */
+	void * cells[BIG_BIN];								/* Stack of free cells for each small bin. */
+	unsigned int count[BIG_BIN];
+} klmalloc_thread_cache;
+
+static klmalloc_thread_cache klmalloc_thread_caches[THREAD_CACHES] = {
+	{ MAIN_STACK_BOTTOM, MAIN_STACK_TOP, { NULL }, { 0 } },
+};
+
+/*
+ * Find the cache for the calling thread, if it has one.
+ */
+static klmalloc_thread_cache * klmalloc_thread_cache_get(void) {
+	uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+	for (unsigned int i = 0; i < THREAD_CACHES; ++i) {
+		klmalloc_thread_cache * cache = &klmalloc_thread_caches[i];
+		if (sp >= cache->stack_bottom && sp < cache->stack_top) {
+			return cache;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get a cell from a small bin, refilling the cache if it has run dry.
+ */
+static void * klmalloc_thread_cache_pop(klmalloc_thread_cache * cache, unsigned int bucket_id) {
+	if (!cache->cells[bucket_id]) {
+		spin_lock(&mem_lock, __FUNCTION__);
+		for (unsigned int i = 0; i < THREAD_CACHE_FILL; ++i) {
+			void ** cell = klmalloc(1UL << (SMALLEST_BIN_LOG + bucket_id));
+			*cell = cache->cells[bucket_id];
+			cache->cells[bucket_id] = cell;
+		}
+		spin_unlock(&mem_lock);
+		cache->count[bucket_id] = THREAD_CACHE_FILL;
+	}
+
+	void ** cell = cache->cells[bucket_id];
+	cache->cells[bucket_id] = *cell;
+	cache->count[bucket_id]--;
+	return cell;
+}
+
+/*
+ * Put `count` cells from a cache back in the shared bins.
+ * The lock must be held.
+ */
+static void klmalloc_thread_cache_drain(klmalloc_thread_cache * cache, unsigned int bucket_id, unsigned int count) {
+	while (count-- && cache->cells[bucket_id]) {
+		void ** cell = cache->cells[bucket_id];
+		cache->cells[bucket_id] = *cell;
+		cache->count[bucket_id]--;
+		klfree(cell);
+	}
+}
+
+/*
+ * Return a cell to the cache, draining a batch if it has grown too big.
+ */
+static void klmalloc_thread_cache_push(klmalloc_thread_cache * cache, unsigned int bucket_id, void * ptr) {
+	void ** cell = ptr;
+	*cell = cache->cells[bucket_id];
+	cache->cells[bucket_id] = cell;
+	cache->count[bucket_id]++;
+
+	if (cache->count[bucket_id] > THREAD_CACHE_MAX) {
+		spin_lock(&mem_lock, __FUNCTION__);
+		klmalloc_thread_cache_drain(cache, bucket_id, THREAD_CACHE_FILL);
+		spin_unlock(&mem_lock);
+	}
+}
+
+/*
+ * Which small bin does this allocation belong to?
+ * Returns BIG_BIN for anything else, which free() leaves to klfree.
+ */
+static unsigned int klmalloc_thread_cache_bin(void * ptr) {
+	if (!ptr || (uintptr_t)ptr % PAGE_SIZE == 0) return BIG_BIN;
+	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC || header->size >= BIG_BIN) return BIG_BIN;
+	return header->size;
+}
+
+/*
+ * Give a thread running on [stack, stack + size) its own cache.
+ * Called by pthread_create before the thread starts.
+ */
+void __malloc_thread_register(void * stack, uintptr_t size) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	for (unsigned int i = 1; i < THREAD_CACHES; ++i) {
+		klmalloc_thread_cache * cache = &klmalloc_thread_caches[i];
+		if (!cache->stack_top) {
+			memset(cache->cells, 0, sizeof(cache->cells));
+			memset(cache->count, 0, sizeof(cache->count));
+			cache->stack_bottom = (uintptr_t)stack;
+			cache->stack_top    = (uintptr_t)stack + size;
+			break;
+		}
+	}
+	spin_unlock(&mem_lock);
+}
+
+/*
+ * Return the cells held by a thread that has exited and free up its cache.
+ */
+void __malloc_thread_release(void * stack) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	for (unsigned int i = 1; i < THREAD_CACHES; ++i) {
+		klmalloc_thread_cache * cache = &klmalloc_thread_caches[i];
+		if (cache->stack_top && cache->stack_bottom == (uintptr_t)stack) {
+			cache->stack_top = 0;
+			for (unsigned int bucket_id = 0; bucket_id < BIG_BIN; ++bucket_id) {
+				klmalloc_thread_cache_drain(cache, bucket_id, cache->count[bucket_id]);
+			}
+			break;
+		}
+	}
+	spin_unlock(&mem_lock);
+}
+
+/* }}} Thread caches */
+/* Statistics {{{ */
+
+/*
+ * Fill in one small bin. The lock must be held. Other threads' caches
+ * are read as they are, so cached counts are only a snapshot.
+ */
+static void klmalloc_bin_info(unsigned int bucket_id, struct malloc_bin_info * info) {
+	info->size   = 1UL << (SMALLEST_BIN_LOG + bucket_id);
+	info->pages  = klmalloc_bin_pages[bucket_id];
+	info->cells  = info->pages * ((PAGE_SIZE - sizeof(klmalloc_bin_header)) >> (SMALLEST_BIN_LOG + bucket_id));
+	info->cached = 0;
+	for (unsigned int i = 0; i < THREAD_CACHES; ++i) {
+		if (klmalloc_thread_caches[i].stack_top) {
+			info->cached += klmalloc_thread_caches[i].count[bucket_id];
+		}
+	}
+	info->used = klmalloc_bin_used[bucket_id] - info->cached;
+}
+
+int malloc_bin_info(int bin, struct malloc_bin_info * info) {
+	if (bin < 0 || bin >= (int)BIG_BIN) return -1;
+	spin_lock(&mem_lock, __FUNCTION__);
+	klmalloc_bin_info(bin, info);
+	spin_unlock(&mem_lock);
+	return 0;
+}
+
+struct mallinfo mallinfo(void) {
+	struct mallinfo out;
+	memset(&out, 0, sizeof(struct mallinfo));
+
+	spin_lock(&mem_lock, __FUNCTION__);
+	for (unsigned int i = 0; i < BIG_BIN; ++i) {
+		struct malloc_bin_info info;
+		klmalloc_bin_info(i, &info);
+		out.smblks   += info.cells - info.used;
+		out.fsmblks  += (info.cells - info.used) * info.size;
+		out.uordblks += info.used * info.size;
+	}
+
+	/* Every big block is on the physical list; the free ones have a stack */
+	for (klmalloc_big_bin_header * b = klmalloc_newest_big; b; b = b->prev) {
+		if (b->head) {
+			out.ordblks++;
+			out.fordblks += b->size;
+		} else {
+			out.hblks++;
+			out.hblkhd += b->size;
+		}
+	}
+	out.uordblks += out.hblkhd;
+	out.fordblks += out.fsmblks;
+	out.arena = klmalloc_arena;
+	out.usmblks = klmalloc_peak;
+	spin_unlock(&mem_lock);
+
+	return out;
+}
+
+void malloc_stats(void) {
+	struct mallinfo info = mallinfo();
+	fprintf(stderr, "arena:  %d bytes\n", info.arena);
+	fprintf(stderr, "in use: %d bytes (peak %d), %d in %d big blocks\n", info.uordblks, info.usmblks, info.hblkhd, info.hblks);
+	fprintf(stderr, "free:   %d bytes, %d in %d big blocks\n", info.fordblks, info.fordblks - info.fsmblks, info.ordblks);
+	fprintf(stderr, "%6s %6s %8s %8s %8s\n", "cell", "pages", "used", "cached", "free");
+	for (int i = 0; i < (int)BIG_BIN; ++i) {
+		struct malloc_bin_info bin;
+		malloc_bin_info(i, &bin);
+		if (!bin.pages) continue;
+		fprintf(stderr, "%6zu %6zu %8zu %8zu %8zu\n", bin.size, bin.pages, bin.used, bin.cached, bin.cells - bin.used - bin.cached);
+	}
+}
+
+/* }}} Statistics */
+/* Tracing {{{ */
+
+/*
+ * With MALLOC_TRACE in the environment, every allocation and free goes
+ * into a ring of the last MALLOC_TRACE_SIZE (default 4096) events, with
+ * its size and the caller's return address. The ring is written out at
+ * exit to the file MALLOC_TRACE names, or to stderr for "-". Separately,
+ * MALLOC_STATS prints malloc_stats() at exit. `heap` sets these up.
+ */
+#define TRACE_DEFAULT_SIZE 4096
+#define TRACE_MAX_SIZE     (1 << 20)
+
+typedef struct _klmalloc_trace_event {
+	char op;             /* m, c, v, r or f */
+	uintptr_t ptr;
+	uintptr_t old;       /* realloc's original pointer */
+	uintptr_t size;
+	uintptr_t caller;
+} klmalloc_trace_event;
+
+static klmalloc_trace_event * volatile klmalloc_trace_ring = NULL;
+static uint32_t klmalloc_trace_mask = 0;
+static uint32_t volatile klmalloc_trace_next = 0;
+static char klmalloc_trace_path[256];
+
+#define TRACE(op, ptr, old, size) do { \
+		if (__builtin_expect(klmalloc_trace_ring != NULL, 0)) { \
+			klmalloc_trace((op), (ptr), (old), (size), __builtin_return_address(0)); \
+		} } while (0)
+
+static void klmalloc_trace(char op, void * ptr, void * old, uintptr_t size, void * caller) {
+	uint32_t i = __sync_fetch_and_add(&klmalloc_trace_next, 1) & klmalloc_trace_mask;
+	klmalloc_trace_event * e = &klmalloc_trace_ring[i];
+	e->op     = op;
+	e->ptr    = (uintptr_t)ptr;
+	e->old    = (uintptr_t)old;
+	e->size   = size;
+	e->caller = (uintptr_t)caller;
+}
+
+static void klmalloc_trace_dump(void) {
+	klmalloc_trace_event * ring = klmalloc_trace_ring;
+	/* Stop first, so the stdio below doesn't trace itself */
+	klmalloc_trace_ring = NULL;
+
+	FILE * f = strcmp(klmalloc_trace_path, "-") ? fopen(klmalloc_trace_path, "w") : stderr;
+	if (!f) return;
+
+	uint32_t total = klmalloc_trace_next;
+	uint32_t count = total > klmalloc_trace_mask ? klmalloc_trace_mask + 1 : total;
+	struct mallinfo info = mallinfo();
+	fprintf(f, "# pid %d, %u events, last %u kept\n", getpid(), (unsigned int)total, (unsigned int)count);
+	fprintf(f, "# arena %d in-use %d peak %d free %d\n", info.arena, info.uordblks, info.usmblks, info.fordblks);
+	for (uint32_t i = total - count; i != total; ++i) {
+		klmalloc_trace_event * e = &ring[i & klmalloc_trace_mask];
+		if (e->op == 'r') {
+			fprintf(f, "%c %p %zu %p %p\n", e->op, (void *)e->ptr, e->size, (void *)e->caller, (void *)e->old);
+		} else {
+			fprintf(f, "%c %p %zu %p\n", e->op, (void *)e->ptr, e->size, (void *)e->caller);
+		}
+	}
+
+	if (f != stderr) fclose(f);
+}
+
+/*
+ * Called from libc's startup, once the environment is there.
+ */
+void __malloc_init(void) {
+	char * path = getenv("MALLOC_TRACE");
+	if (path && *path && strlen(path) < sizeof(klmalloc_trace_path)) {
+		uint32_t size = TRACE_DEFAULT_SIZE;
+		char * s = getenv("MALLOC_TRACE_SIZE");
+		if (s && atoi(s) > 0) size = atoi(s);
+		if (size > TRACE_MAX_SIZE) size = TRACE_MAX_SIZE;
+		uint32_t ring_size = 16;
+		while (ring_size < size) ring_size <<= 1;
+
+		/* Straight from sbrk, in whole pages, so the heap stays page-aligned */
+		uintptr_t bytes = (ring_size * sizeof(klmalloc_trace_event) + PAGE_MASK) & ~(uintptr_t)PAGE_MASK;
+		spin_lock(&mem_lock, __FUNCTION__);
+		void * ring = (void *)sbrk(bytes);
+		spin_unlock(&mem_lock);
+
+		strcpy(klmalloc_trace_path, path);
+		klmalloc_trace_mask = ring_size - 1;
+		klmalloc_trace_ring = ring;
+		atexit(klmalloc_trace_dump);
+	}
+	if (getenv("MALLOC_STATS")) {
+		atexit(malloc_stats);
+	}
+}
+
+/* }}} Tracing */
+
+void * __attribute__ ((malloc)) malloc(uintptr_t size) {
+	if (size) {
+		unsigned int bucket_id = klmalloc_bin_size(size);
+		if (bucket_id < BIG_BIN) {
+			klmalloc_thread_cache * cache = klmalloc_thread_cache_get();
+			if (cache) {
+				void * ret = klmalloc_thread_cache_pop(cache, bucket_id);
+				TRACE('m', ret, NULL, size);
+				return ret;
+			}
+		}
+	}
+
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klmalloc(size);
+	spin_unlock(&mem_lock);
+	TRACE('m', ret, NULL, size);
+	return ret;
+}
+
+void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klrealloc(ptr, size);
+	spin_unlock(&mem_lock);
+	TRACE('r', ret, ptr, size);
+	return ret;
+}
+
+void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
+	uintptr_t total = nmemb * size;
+	if (total) {
+		unsigned int bucket_id = klmalloc_bin_size(total);
+		if (bucket_id < BIG_BIN) {
+			klmalloc_thread_cache * cache = klmalloc_thread_cache_get();
+			if (cache) {
+				void * ret = klmalloc_thread_cache_pop(cache, bucket_id);
+				memset(ret, 0x00, total);
+				TRACE('c', ret, NULL, total);
+				return ret;
+			}
+		}
+	}
+
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klcalloc(nmemb, size);
+	spin_unlock(&mem_lock);
+	TRACE('c', ret, NULL, total);
+	return ret;
+}
+
+void * __attribute__ ((malloc)) valloc(uintptr_t size) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klvalloc(size);
+	spin_unlock(&mem_lock);
+	TRACE('v', ret, NULL, size);
+	return ret;
+}
+
+void free(void * ptr) {
+	if (ptr) {
+		TRACE('f', ptr, NULL, 0);
+	}
+
+	unsigned int bucket_id = klmalloc_thread_cache_bin(ptr);
+	if (bucket_id < BIG_BIN) {
+		klmalloc_thread_cache * cache = klmalloc_thread_cache_get();
+		if (cache) {
+			klmalloc_thread_cache_push(cache, bucket_id, ptr);
+			return;
+		}
+	}
+
+	spin_lock(&mem_lock, __FUNCTION__);
+	klfree(ptr);
+	spin_unlock(&mem_lock);
+}
+
+
 /* malloc() {{{ */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 	/*
@@ -623,6 +1000,8 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 * Grow the heap for the new bin.
 			 */
 			bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
+			klmalloc_arena += PAGE_SIZE;
+			klmalloc_bin_pages[bucket_id]++;
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 
@@ -662,6 +1041,8 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		if (klmalloc_stack_empty(bin_header)) {
 			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
 		}
+		klmalloc_bin_used[bucket_id]++;
+		klmalloc_account(1UL << (SMALLEST_BIN_LOG + bucket_id));
 		return item;
 	} else {
 		/*
@@ -721,6 +1102,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 				klfree((void *)((uintptr_t)header_new + sizeof(klmalloc_big_bin_header)));
 			}
 #endif
+			klmalloc_account(bin_header->size);
 			return item;
 		} else {
 			/*
@@ -728,6 +1110,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 */
 			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
 			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
+			klmalloc_arena += PAGE_SIZE * pages;
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 			/*
@@ -748,6 +1131,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 * Return the head of the block.
 			 */
 			bin_header->head = NULL;
+			klmalloc_account(bin_header->size);
 			return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
 		}
 	}
@@ -796,6 +1180,7 @@ static void klfree(void *ptr) {
 		assert(bheader);
 		assert(bheader->head == NULL);
 		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+		klmalloc_in_use -= bheader->size;
 		/*
 		 * Coalesce forward blocks into us.
 		 */
@@ -889,6 +1274,8 @@ static void klfree(void *ptr) {
 		 * Push new space back into the stack.
 		 */
 		klmalloc_stack_push(header, ptr);
+		klmalloc_bin_used[bucket_id]--;
+		klmalloc_in_use -= 1UL << (SMALLEST_BIN_LOG + bucket_id);
 	}
 }
 /* }}} */
@@ -921,7 +1308,7 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 */
 	if (__builtin_expect(size == 0, 0))
 	{
-		free(ptr);
+		klfree(ptr);
 		return NULL;
 	}
 
@@ -0,0 +1,69 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * mergesort - a stable counterpart to qsort, as in the BSDs.
+ *
+ * Top-down merge sort through a scratch buffer the size of the input,
+ * with short runs done by insertion sort. Returns -1 and sets errno
+ * if the scratch buffer can't be allocated.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define MERGE_THRESHOLD 8
+
+typedef int (*compar_t)(const void *, const void *);
+
+extern void __sort_insertion(char * base, size_t nmemb, size_t size, compar_t compar);
+
+static void merge_sort(char * base, char * tmp, size_t nmemb, size_t size, compar_t compar) {
+	if (nmemb <= MERGE_THRESHOLD) {
+		__sort_insertion(base, nmemb, size, compar);
+		return;
+	}
+
+	size_t half = nmemb / 2;
+	char * mid = base + half * size;
+	char * end = base + nmemb * size;
+	merge_sort(base, tmp, half, size, compar);
+	merge_sort(mid, tmp, nmemb - half, size, compar);
+
+	/* Already in order across the halves */
+	if (compar(mid - size, mid) <= 0) return;
+
+	/* Ties take from the left, which is what keeps it stable */
+	char * l = base;
+	char * r = mid;
+	char * out = tmp;
+	while (l < mid && r < end) {
+		if (compar(r, l) < 0) {
+			memcpy(out, r, size);
+			r += size;
+		} else {
+			memcpy(out, l, size);
+			l += size;
+		}
+		out += size;
+	}
+	/* Whatever is left of the right half is already in place */
+	memcpy(out, l, mid - l);
+	out += mid - l;
+	memcpy(base, tmp, out - tmp);
+}
+
+int mergesort(void * base, size_t nmemb, size_t size, int (*compar)(const void *, const void *)) {
+	if (nmemb < 2 || !size) return 0;
+
+	char * tmp = malloc(nmemb * size);
+	if (!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	merge_sort(base, tmp, nmemb, size, compar);
+	free(tmp);
+	return 0;
+}
@@ -4,16 +4,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/random.h>
+
+static const char _mktemp_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
 
 char * mktemp(char * template) {
 	if (strstr(template + strlen(template)-6, "XXXXXX") != template + strlen(template) - 6) {
 		errno = EINVAL;
 		return NULL;
 	}
-	static int _i = 0;
-	char tmp[7] = {0};
-	sprintf(tmp,"%04d%02d", getpid(), _i++);
-	memcpy(template + strlen(template) - 6, tmp, 6);
+	unsigned char bytes[6];
+	getrandom(bytes, 6, 0);
+	char * out = template + strlen(template) - 6;
+	for (int i = 0; i < 6; ++i) {
+		out[i] = _mktemp_chars[bytes[i] % (sizeof(_mktemp_chars) - 1)];
+	}
 	return template;
 }
 
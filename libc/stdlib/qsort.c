@@ -1,25 +1,130 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * qsort, as an introsort: median-of-three quicksort, switching to
+ * heapsort if the partitions go badly enough to threaten quadratic
+ * time, with small partitions finished off by insertion sort.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 
-extern char * _argv_0;
-extern int __libc_debug;
+#define INSERTION_THRESHOLD 16
 
-void qsort(void * base, size_t nmemb, size_t size, int (*compar)(const void *, const void *)) {
-	if (!nmemb) return;
-	if (!size) return;
-	for (size_t i = 0; i < nmemb-1; ++i) {
-		for (size_t j = 0; j < nmemb-1; ++j) {
-			void * left = (char *)base + size * j;
-			void * right = (char *)base + size * (j + 1);
-			if (compar(left,right) > 0) {
-				char tmp[size];
-				memcpy(tmp, right, size);
-				memcpy(right, left, size);
-				memcpy(left, tmp, size);
-			}
+typedef int (*compar_t)(const void *, const void *);
+
+void __sort_swap(char * a, char * b, size_t size) {
+	if (size == sizeof(uint32_t) && !(((uintptr_t)a | (uintptr_t)b) & (sizeof(uint32_t) - 1))) {
+		uint32_t t = *(uint32_t *)a;
+		*(uint32_t *)a = *(uint32_t *)b;
+		*(uint32_t *)b = t;
+		return;
+	}
+	if (!((size | (uintptr_t)a | (uintptr_t)b) & (sizeof(uint32_t) - 1))) {
+		uint32_t * x = (uint32_t *)a;
+		uint32_t * y = (uint32_t *)b;
+		for (size_t i = 0; i < size / sizeof(uint32_t); ++i) {
+			uint32_t t = x[i];
+			x[i] = y[i];
+			y[i] = t;
+		}
+		return;
+	}
+	while (size--) {
+		char t = *a;
+		*a++ = *b;
+		*b++ = t;
+	}
+}
+
+/* Stable; also used by mergesort for its short runs */
+void __sort_insertion(char * base, size_t nmemb, size_t size, compar_t compar) {
+	for (size_t i = 1; i < nmemb; ++i) {
+		for (char * p = base + i * size; p > base && compar(p - size, p) > 0; p -= size) {
+			__sort_swap(p - size, p, size);
 		}
 	}
 }
+
+static void sift_down(char * base, size_t root, size_t nmemb, size_t size, compar_t compar) {
+	while (root * 2 + 1 < nmemb) {
+		size_t child = root * 2 + 1;
+		if (child + 1 < nmemb && compar(base + child * size, base + (child + 1) * size) < 0) {
+			child++;
+		}
+		if (compar(base + root * size, base + child * size) >= 0) return;
+		__sort_swap(base + root * size, base + child * size, size);
+		root = child;
+	}
+}
+
+static void heap_sort(char * base, size_t nmemb, size_t size, compar_t compar) {
+	for (size_t i = nmemb / 2; i > 0; --i) {
+		sift_down(base, i - 1, nmemb, size, compar);
+	}
+	for (size_t end = nmemb - 1; end > 0; --end) {
+		__sort_swap(base, base + end * size, size);
+		sift_down(base, 0, end, size, compar);
+	}
+}
+
+static void intro_sort(char * base, size_t nmemb, size_t size, compar_t compar, int depth) {
+	while (nmemb > INSERTION_THRESHOLD) {
+		if (depth-- == 0) {
+			heap_sort(base, nmemb, size, compar);
+			return;
+		}
+
+		/* Order the first, middle and last elements, and take the middle one as the pivot */
+		char * a = base;
+		char * m = base + (nmemb / 2) * size;
+		char * c = base + (nmemb - 1) * size;
+		if (compar(m, a) < 0) __sort_swap(m, a, size);
+		if (compar(c, m) < 0) {
+			__sort_swap(c, m, size);
+			if (compar(m, a) < 0) __sort_swap(m, a, size);
+		}
+		__sort_swap(base, m, size);
+
+		/* Partition around base[0]; equal elements stop both scans, which keeps duplicates balanced */
+		size_t lo = 1;
+		size_t hi = nmemb - 1;
+		while (1) {
+			while (lo <= hi && compar(base + lo * size, base) < 0) lo++;
+			while (lo <= hi && compar(base + hi * size, base) > 0) hi--;
+			if (lo >= hi) break;
+			__sort_swap(base + lo * size, base + hi * size, size);
+			lo++;
+			hi--;
+		}
+		__sort_swap(base, base + hi * size, size);
+
+		/* Recurse into the smaller side and loop on the larger, so the stack stays logarithmic */
+		size_t left = hi;
+		size_t right = nmemb - hi - 1;
+		if (left < right) {
+			intro_sort(base, left, size, compar, depth);
+			base += (hi + 1) * size;
+			nmemb = right;
+		} else {
+			intro_sort(base + (hi + 1) * size, right, size, compar, depth);
+			nmemb = left;
+		}
+	}
+	__sort_insertion(base, nmemb, size, compar);
+}
+
+void qsort(void * base, size_t nmemb, size_t size, int (*compar)(const void *, const void *)) {
+	if (nmemb < 2) return;
+	if (!size) return;
+
+	int depth = 0;
+	for (size_t n = nmemb; n > 1; n >>= 1) depth += 2;
+
+	intro_sort(base, nmemb, size, compar, depth);
+}
@@ -1,9 +1,122 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * memcpy, picked by size:
+ *
+ *  - up to 16 bytes: a few overlapping scalar moves, no loop
+ *  - larger, with SSE2: 16-byte vector moves on an aligned
+ *    destination, with unaligned head and tail vectors
+ *  - a megabyte or more: the same with non-temporal stores, so
+ *    big framebuffer copies don't flush everything else out of
+ *    the cache
+ *
+ * Without SSE2 (as reported by CPUID) larger copies use rep movs.
+ */
 #include <stddef.h>
+#include <stdint.h>
 
-void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
-	asm volatile("cld; rep movsb"
-	            : "=c"((int){0})
-	            : "D"(dest), "S"(src), "c"(n)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <cpuid.h>
+#endif
+
+#define MEMCPY_STREAM_THRESHOLD 0x100000
+
+/* Keep GCC from turning the copy loops back into calls to ourselves */
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_u;
+
+static inline void copy_small(char * d, const char * s, size_t n) {
+	if (n >= 8) {
+		uint32_t a = *(u32_u *)s, b = *(u32_u *)(s + 4);
+		uint32_t c = *(u32_u *)(s + n - 8), e = *(u32_u *)(s + n - 4);
+		*(u32_u *)d = a;
+		*(u32_u *)(d + 4) = b;
+		*(u32_u *)(d + n - 8) = c;
+		*(u32_u *)(d + n - 4) = e;
+	} else if (n >= 4) {
+		uint32_t a = *(u32_u *)s, b = *(u32_u *)(s + n - 4);
+		*(u32_u *)d = a;
+		*(u32_u *)(d + n - 4) = b;
+	} else if (n) {
+		d[0] = s[0];
+		d[n-1] = s[n-1];
+		if (n > 2) d[1] = s[1];
+	}
+}
+
+static void copy_rep(char * d, const char * s, size_t n) {
+	asm volatile("cld; rep movsl; mov %3, %%ecx; rep movsb"
+	            : "+D"(d), "+S"(s), "=&c"((int){0})
+	            : "r"(n & 3), "2"(n >> 2)
 	            : "flags", "memory");
+}
+
+#ifdef __SSE2__
+static int memcpy_vectors = 0;
+
+__attribute__((constructor)) static void _memcpy_init(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+		memcpy_vectors = 1;
+	}
+}
+
+/* n > 16 */
+NO_LIBCALLS static void copy_sse2(char * d, const char * s, size_t n, int stream) {
+	__m128i head = _mm_loadu_si128((const __m128i *)s);
+	__m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+	char * end = d + n - 16;
+
+	size_t skew = 16 - ((uintptr_t)d & 15);
+	_mm_storeu_si128((__m128i *)d, head);
+	d += skew;
+	s += skew;
+	n -= skew;
+
+	if (stream) {
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)s);
+			__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_stream_si128((__m128i *)d, a);
+			_mm_stream_si128((__m128i *)(d + 16), b);
+			_mm_stream_si128((__m128i *)(d + 32), c);
+			_mm_stream_si128((__m128i *)(d + 48), e);
+		}
+		_mm_sfence();
+	} else {
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)s);
+			__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_store_si128((__m128i *)d, a);
+			_mm_store_si128((__m128i *)(d + 16), b);
+			_mm_store_si128((__m128i *)(d + 32), c);
+			_mm_store_si128((__m128i *)(d + 48), e);
+		}
+	}
+	for (; n >= 16; n -= 16, d += 16, s += 16) {
+		_mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	}
+
+	_mm_storeu_si128((__m128i *)end, tail);
+}
+#endif
+
+NO_LIBCALLS void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
+	if (n <= 16) {
+		copy_small(dest, src, n);
+		return dest;
+	}
+#ifdef __SSE2__
+	if (memcpy_vectors) {
+		copy_sse2(dest, src, n, n >= MEMCPY_STREAM_THRESHOLD);
+		return dest;
+	}
+#endif
+	copy_rep(dest, src, n);
 	return dest;
 }
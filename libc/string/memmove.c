@@ -2,7 +2,14 @@
 #include <stdint.h>
 #include <string.h>
 
-void * memmove(void * dest, const void * src, size_t n) {
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Keep GCC from turning the copy loops back into calls to ourselves */
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+NO_LIBCALLS void * memmove(void * dest, const void * src, size_t n) {
 	char * d = dest;
 	const char * s = src;
 
@@ -15,6 +22,12 @@ void * memmove(void * dest, const void * src, size_t n) {
 	}
 
 	if (d<s) {
+#ifdef __SSE2__
+		/* Every chunk is loaded before it is stored, so overlap is safe in this direction */
+		for (; n >= 16; n -= 16, d += 16, s += 16) {
+			_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+		}
+#endif
 		if ((uintptr_t)s % sizeof(size_t) == (uintptr_t)d % sizeof(size_t)) {
 			while ((uintptr_t)d % sizeof(size_t)) {
 				if (!n--) {
@@ -30,6 +43,11 @@ void * memmove(void * dest, const void * src, size_t n) {
 			*d++ = *s++;
 		}
 	} else {
+#ifdef __SSE2__
+		for (; n >= 16; n -= 16) {
+			_mm_storeu_si128((__m128i *)(d + n - 16), _mm_loadu_si128((const __m128i *)(s + n - 16)));
+		}
+#endif
 		if ((uintptr_t)s % sizeof(size_t) == (uintptr_t)d % sizeof(size_t)) {
 			while ((uintptr_t)(d+n) % sizeof(size_t)) {
 				if (!n--) {
@@ -1,10 +1,94 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * memset, split by size the same way as memcpy.
+ */
 #include <stddef.h>
+#include <stdint.h>
 
-void * memset(void * dest, int c, size_t n) {
-	asm volatile("cld; rep stosb"
-	             : "=c"((int){0})
-	             : "D"(dest), "a"(c), "c"(n)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <cpuid.h>
+#endif
+
+#define MEMSET_STREAM_THRESHOLD 0x100000
+
+/* Keep GCC from turning the copy loops back into calls to ourselves */
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_u;
+
+static inline void set_small(char * d, unsigned char c, size_t n) {
+	uint32_t v = c * 0x01010101u;
+	if (n >= 8) {
+		*(u32_u *)d = v;
+		*(u32_u *)(d + 4) = v;
+		*(u32_u *)(d + n - 8) = v;
+		*(u32_u *)(d + n - 4) = v;
+	} else if (n >= 4) {
+		*(u32_u *)d = v;
+		*(u32_u *)(d + n - 4) = v;
+	} else if (n) {
+		d[0] = c;
+		d[n-1] = c;
+		if (n > 2) d[1] = c;
+	}
+}
+
+static void set_rep(char * d, unsigned char c, size_t n) {
+	asm volatile("cld; rep stosl; mov %3, %%ecx; rep stosb"
+	             : "+D"(d), "=&c"((int){0})
+	             : "a"(c * 0x01010101u), "r"(n & 3), "1"(n >> 2)
 	             : "flags", "memory");
-	return dest;
 }
 
+#ifdef __SSE2__
+static int memset_vectors = 0;
+
+__attribute__((constructor)) static void _memset_init(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+		memset_vectors = 1;
+	}
+}
+
+/* n > 16 */
+NO_LIBCALLS static void set_sse2(char * d, unsigned char c, size_t n, int stream) {
+	__m128i v = _mm_set1_epi8(c);
+	char * end = d + n - 16;
+
+	size_t skew = 16 - ((uintptr_t)d & 15);
+	_mm_storeu_si128((__m128i *)d, v);
+	d += skew;
+	n -= skew;
+
+	if (stream) {
+		for (; n >= 64; n -= 64, d += 64) {
+			_mm_stream_si128((__m128i *)d, v);
+			_mm_stream_si128((__m128i *)(d + 16), v);
+			_mm_stream_si128((__m128i *)(d + 32), v);
+			_mm_stream_si128((__m128i *)(d + 48), v);
+		}
+		_mm_sfence();
+	}
+	for (; n >= 16; n -= 16, d += 16) {
+		_mm_store_si128((__m128i *)d, v);
+	}
+
+	_mm_storeu_si128((__m128i *)end, v);
+}
+#endif
+
+NO_LIBCALLS void * memset(void * dest, int c, size_t n) {
+	if (n <= 16) {
+		set_small(dest, c, n);
+		return dest;
+	}
+#ifdef __SSE2__
+	if (memset_vectors) {
+		set_sse2(dest, c, n, n >= MEMSET_STREAM_THRESHOLD);
+		return dest;
+	}
+#endif
+	set_rep(dest, c, n);
+	return dest;
+}
@@ -5,6 +5,10 @@
 #include <limits.h>
 #include <ctype.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 
@@ -16,6 +20,17 @@
 #define BITOP(A, B, OP) \
  ((A)[(size_t)(B)/(8*sizeof *(A))] OP (size_t)1<<((size_t)(B)%(8*sizeof *(A))))
 
+#ifdef __SSE2__
+/*
+ * The SSE2 scanners below only ever do aligned 16-byte loads. An
+ * aligned block never straddles a page, so reading the bytes of it
+ * that lie before the start or past the end of the string can't
+ * fault; those bytes are masked out of the result.
+ */
+#define BLOCK(p) ((const __m128i *)((uintptr_t)(p) & ~(uintptr_t)15))
+#define MATCHES(x, v) ((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8((x), (v))))
+#endif
+
 int memcmp(const void * vl, const void * vr, size_t n) {
 	const unsigned char *l = vl;
 	const unsigned char *r = vr;
@@ -24,6 +39,32 @@ int memcmp(const void * vl, const void * vr, size_t n) {
 }
 
 void * memchr(const void * src, int c, size_t n) {
+#ifdef __SSE2__
+	if (!n) return 0;
+
+	const unsigned char * s = src;
+	const __m128i * p = BLOCK(s);
+	__m128i v = _mm_set1_epi8(c);
+	size_t skip = (uintptr_t)s & 15;
+
+	unsigned int mask = MATCHES(_mm_load_si128(p), v) >> skip;
+	if (mask) {
+		size_t i = __builtin_ctz(mask);
+		return i < n ? (void *)(s + i) : 0;
+	}
+	if (16 - skip >= n) return 0;
+	n -= 16 - skip;
+
+	for (p++; ; p++) {
+		mask = MATCHES(_mm_load_si128(p), v);
+		if (mask) {
+			size_t i = __builtin_ctz(mask);
+			return i < n ? (void *)((const unsigned char *)p + i) : 0;
+		}
+		if (n <= 16) return 0;
+		n -= 16;
+	}
+#else
 	const unsigned char * s = src;
 	c = (unsigned char)c;
 	for (; ((uintptr_t)s & (ALIGN - 1)) && n && *s != c; s++, n--);
@@ -34,6 +75,7 @@ void * memchr(const void * src, int c, size_t n) {
 		for (s = (const void *)w; n && *s != c; s++, n--);
 	}
 	return n ? (void *)s : 0;
+#endif
 }
 
 void * memrchr(const void * m, int c, size_t n) {
@@ -57,6 +99,16 @@ int strcoll(const char * s1, const char * s2) {
 }
 
 size_t strlen(const char * s) {
+#ifdef __SSE2__
+	const __m128i * p = BLOCK(s);
+	__m128i zero = _mm_setzero_si128();
+
+	unsigned int mask = MATCHES(_mm_load_si128(p), zero) >> ((uintptr_t)s & 15);
+	if (mask) return __builtin_ctz(mask);
+
+	for (p++; !(mask = MATCHES(_mm_load_si128(p), zero)); p++);
+	return (const char *)p + __builtin_ctz(mask) - s;
+#else
 	const char * a = s;
 	const size_t * w;
 	for (; (uintptr_t)s % ALIGN; s++) {
@@ -67,6 +119,7 @@ size_t strlen(const char * s) {
 	for (w = (const void *)s; !HASZERO(*w); w++);
 	for (s = (const void *)w; *s; s++);
 	return s-a;
+#endif
 }
 
 char * strdup(const char * s) {
@@ -121,14 +174,29 @@ size_t strspn(const char * s, const char * c) {
 }
 
 char * strchrnul(const char * s, int c) {
-	size_t * w;
-	size_t k;
-
 	c = (unsigned char)c;
 	if (!c) {
 		return (char *)s + strlen(s);
 	}
 
+#ifdef __SSE2__
+	const __m128i * p = BLOCK(s);
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_set1_epi8(c);
+
+	__m128i x = _mm_load_si128(p);
+	unsigned int mask = (MATCHES(x, zero) | MATCHES(x, v)) >> ((uintptr_t)s & 15);
+	if (mask) return (char *)s + __builtin_ctz(mask);
+
+	for (p++; ; p++) {
+		x = _mm_load_si128(p);
+		mask = MATCHES(x, zero) | MATCHES(x, v);
+		if (mask) return (char *)p + __builtin_ctz(mask);
+	}
+#else
+	size_t * w;
+	size_t k;
+
 	for (; (uintptr_t)s % ALIGN; s++) {
 		if (!*s || *(unsigned char *)s == c) {
 			return (char *)s;
@@ -139,6 +207,7 @@ char * strchrnul(const char * s, int c) {
 	for (w = (void *)s; !HASZERO(*w) && !HASZERO(*w^k); w++);
 	for (s = (void *)w; *s && *(unsigned char *)s != c; s++);
 	return (char *)s;
+#endif
 }
 
 char * strchr(const char * s, int c) {
@@ -166,25 +235,18 @@ char * strpbrk(const char * s, const char * b) {
 	return *s ? (char *)s : 0;
 }
 
-static char *strstr_2b(const unsigned char * h, const unsigned char * n) {
-	uint16_t nw = n[0] << 8 | n[1];
-	uint16_t hw = h[0] << 8 | h[1];
-	for (h++; *h && hw != nw; hw = hw << 8 | *++h);
-	return *h ? (char *)h-1 : 0;
-}
-
-static char *strstr_3b(const unsigned char * h, const unsigned char * n) {
-	uint32_t nw = n[0] << 24 | n[1] << 16 | n[2] << 8;
-	uint32_t hw = h[0] << 24 | h[1] << 16 | h[2] << 8;
-	for (h += 2; *h && hw != nw; hw = (hw|*++h) << 8);
-	return *h ? (char *)h-2 : 0;
-}
-
-static char *strstr_4b(const unsigned char * h, const unsigned char * n) {
-	uint32_t nw = n[0] << 24 | n[1] << 16 | n[2] << 8 | n[3];
-	uint32_t hw = h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3];
-	for (h += 3; *h && hw != nw; hw = hw << 8 | *++h);
-	return *h ? (char *)h-3 : 0;
+/*
+ * Needles of up to four bytes: jump between occurrences of the first
+ * byte with strchr() and compare the rest in place.
+ */
+static char *strstr_short(const char * h, const char * n) {
+	for (; h; h = strchr(h + 1, *n)) {
+		size_t i;
+		for (i = 1; n[i] && h[i] == n[i]; i++);
+		if (!n[i]) return (char *)h;
+		if (!h[i]) return 0;
+	}
+	return 0;
 }
 
 static char *strstr_twoway(const unsigned char * h, const unsigned char * n) {
@@ -329,12 +391,7 @@ char *strstr(const char * h, const char * n) {
 		return (char *)h;
 	}
 
-	if (!h[1]) return 0;
-	if (!n[2]) return strstr_2b((void *)h, (void *)n);
-	if (!h[2]) return 0;
-	if (!n[3]) return strstr_3b((void *)h, (void *)n);
-	if (!h[3]) return 0;
-	if (!n[4]) return strstr_4b((void *)h, (void *)n);
+	if (!n[2] || !n[3] || !n[4]) return strstr_short(h, n);
 
 	/* Two-way on large needles */
 	return strstr_twoway((void *)h, (void *)n);
@@ -6,6 +6,9 @@
 DEFN_SYSCALL2(fswait, SYS_FSWAIT, int, int *);
 DEFN_SYSCALL3(fswait2, SYS_FSWAIT2, int, int *,int);
 DEFN_SYSCALL4(fswait3, SYS_FSWAIT3, int, int *, int, int *);
+DEFN_SYSCALL0(fswait_create, SYS_FSWAIT_CREATE);
+DEFN_SYSCALL4(fswait_ctl, SYS_FSWAIT_CTL, int, int, int, int);
+DEFN_SYSCALL4(fswait_wait, SYS_FSWAIT_WAIT, int, int *, int, int);
 
 int fswait(int count, int * fds) {
 	__sets_errno(syscall_fswait(count, fds));
@@ -18,3 +21,15 @@ int fswait2(int count, int * fds, int timeout) {
 int fswait3(int count, int * fds, int timeout, int * out) {
 	__sets_errno(syscall_fswait3(count, fds, timeout, out));
 }
+
+int fswait_create(void) {
+	__sets_errno(syscall_fswait_create());
+}
+
+int fswait_ctl(int set, int op, int fd, int flags) {
+	__sets_errno(syscall_fswait_ctl(set, op, fd, flags));
+}
+
+int fswait_wait(int set, int * out, int max, int timeout) {
+	__sets_errno(syscall_fswait_wait(set, out, max, timeout));
+}
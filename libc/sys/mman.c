@@ -0,0 +1,22 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(mmap, SYS_MMAP, uintptr_t *);
+DEFN_SYSCALL2(munmap, SYS_MUNMAP, void *, size_t);
+
+void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	uintptr_t args[6] = {(uintptr_t)addr, length, prot, flags, fd, offset};
+	/* Mapped addresses can have the high bit set, so only small negatives are errors */
+	int ret = syscall_mmap(args);
+	if (ret < 0 && ret > -4096) {
+		errno = -ret;
+		return MAP_FAILED;
+	}
+	return (void *)ret;
+}
+
+int munmap(void * addr, size_t length) {
+	__sets_errno(syscall_munmap(addr, length));
+}
@@ -0,0 +1,21 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(setpriority, SYS_SETPRIORITY, int, int, int);
+DEFN_SYSCALL2(getpriority, SYS_GETPRIORITY, int, int);
+
+int setpriority(int which, id_t who, int prio) {
+	__sets_errno(syscall_setpriority(which, who, prio));
+}
+
+int getpriority(int which, id_t who) {
+	/* The kernel returns 20 - nice, to keep the result positive */
+	int ret = syscall_getpriority(which, who);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 20 - ret;
+}
@@ -0,0 +1,10 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/signalfd.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(signalfd, SYS_SIGNALFD, int, const uint64_t *, int);
+
+int signalfd(int fd, const uint64_t * mask, int flags) {
+	__sets_errno(syscall_signalfd(fd, mask, flags));
+}
@@ -1,10 +1,63 @@
+/*
+ * gettimeofday, clock_gettime
+ *
+ * Both read the kernel's clock page (see <kernel/clockpage.h>), so
+ * neither makes a syscall.
+ */
 #include <sys/time.h>
-#include <syscall.h>
-#include <syscall_nums.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <kernel/clockpage.h>
 
-DEFN_SYSCALL2(gettimeofday, SYS_GETTIMEOFDAY, void *, void *);
+static void read_clock(int realtime, time_t * out_sec, long * out_usec) {
+	struct clock_page * page = (struct clock_page *)CLOCK_PAGE_ADDRESS;
+	uint32_t seq, ticks, subticks, tsc_low, tsc_high, rate;
+	int32_t offset;
+
+	do {
+		seq = page->seq;
+		asm volatile ("" ::: "memory");
+		ticks    = page->ticks;
+		subticks = page->subticks;
+		tsc_low  = page->tsc_low;
+		tsc_high = page->tsc_high;
+		rate     = page->tsc_per_usec;
+		offset   = realtime ? (int32_t)page->boot_time + page->drift : 0;
+		asm volatile ("" ::: "memory");
+	} while ((seq & 1) || seq != page->seq);
+
+	long usec = subticks * 1000;
+	if (rate) {
+		/* Time since the last timer interrupt, short of the next millisecond */
+		uint64_t now;
+		asm volatile ("rdtsc" : "=A" (now));
+		uint64_t delta = now - (((uint64_t)tsc_high << 32) | tsc_low);
+		usec += (delta >= (uint64_t)rate * 1000) ? 999 : (uint32_t)delta / rate;
+	}
+
+	*out_sec  = ticks + offset;
+	*out_usec = usec;
+}
 
 int gettimeofday(struct timeval *p, void *z){
-	return syscall_gettimeofday(p,z);
+	time_t sec;
+	long usec;
+	read_clock(1, &sec, &usec);
+	p->tv_sec  = sec;
+	p->tv_usec = usec;
+	return 0;
 }
 
+int clock_gettime(clockid_t clk_id, struct timespec * tp) {
+	if (clk_id != CLOCK_REALTIME && clk_id != CLOCK_MONOTONIC) {
+		errno = EINVAL;
+		return -1;
+	}
+	time_t sec;
+	long usec;
+	read_clock(clk_id == CLOCK_REALTIME, &sec, &usec);
+	tp->tv_sec  = sec;
+	tp->tv_nsec = usec * 1000;
+	return 0;
+}
@@ -1,158 +1,167 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Civil time conversions
+ *
+ * Dates are worked out in closed form from a count of days since
+ * the epoch, using the proleptic Gregorian calendar shifted to start
+ * in March (so the leap day falls at the end of the year) and split
+ * into 400-year eras.
+ *
+ * Most callers ask about timestamps on the same day over and over
+ * (ls on a directory, the panel's clock), so the last day's date is
+ * kept and only the time of day is recomputed when it matches.
+ *
+ * The local time zone comes from TZ, as a POSIX-style fixed offset:
+ * a name, then hours (and optionally :minutes) west of UTC, as in
+ * "EST5" or "JST-9". Daylight saving rules are not supported; anything
+ * after the offset is ignored.
+ */
 #include <time.h>
 #include <sys/time.h>
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define SEC_DAY 86400
 
-#define fprintf(...)
-
 static struct tm _timevalue;
 
-static int year_is_leap(int year) {
-	return ((year % 4 == 0) && ((year % 100 != 0) || (year % 400 == 0)));
+/* Seconds to add to UTC to get local time */
+static long _tz_offset = 0;
+static char _tz_last[32] = "";
+
+/* The last day converted */
+static struct {
+	long day;
+	int valid;
+	int year;
+	int mon;
+	int mday;
+	int yday;
+	int wday;
+} _day_cache;
+
+/* Division rounding towards negative infinity */
+static long floor_div(long a, long b) {
+	return (a >= 0 ? a : a - b + 1) / b;
 }
 
-// 0 was a Thursday
-
-static int day_of_week(long seconds) {
-	long day = seconds / SEC_DAY;
-	day += 4;
-	return day % 7;
+static long days_from_civil(long y, int m, int d) {
+	y -= m <= 2;
+	long era = floor_div(y, 400);
+	long yoe = y - era * 400;
+	long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
 }
 
-static long days_in_month(int month, int year) {
-	switch(month) {
-		case 12:
-			return 31;
-		case 11:
-			return 30;
-		case 10:
-			return 31;
-		case 9:
-			return 30;
-		case 8:
-			return 31;
-		case 7:
-			return 31;
-		case 6:
-			return 30;
-		case 5:
-			return 31;
-		case 4:
-			return 30;
-		case 3:
-			return 31;
-		case 2:
-			return year_is_leap(year) ? 29 : 28;
-		case 1:
-			return 31;
+static void civil_from_days(long z, struct tm * tm) {
+	if (_day_cache.valid && _day_cache.day == z) {
+		tm->tm_year = _day_cache.year;
+		tm->tm_mon  = _day_cache.mon;
+		tm->tm_mday = _day_cache.mday;
+		tm->tm_yday = _day_cache.yday;
+		tm->tm_wday = _day_cache.wday;
+		/* A thread may have replaced it while we copied */
+		if (_day_cache.valid && _day_cache.day == z) return;
 	}
-	return 0;
-}
 
-static long secs_of_month(int months, int year) {
-	long days = 0;
-	for (int i = 1; i < months; ++i) {
-		days += days_in_month(months, year);
-	}
-	return days * SEC_DAY;
+	long days = z + 719468;
+	long era = floor_div(days, 146097);
+	long doe = days - era * 146097;
+	long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	long mp = (5 * doy + 2) / 153;
+	int mday = doy - (153 * mp + 2) / 5 + 1;
+	int mon = mp < 10 ? mp + 3 : mp - 9;
+	long year = yoe + era * 400 + (mon <= 2);
+
+	tm->tm_year = year - 1900;
+	tm->tm_mon  = mon - 1;
+	tm->tm_mday = mday;
+	tm->tm_yday = z - days_from_civil(year, 1, 1);
+	/* 0 was a Thursday */
+	tm->tm_wday = z - floor_div(z + 4, 7) * 7 + 4;
+
+	_day_cache.valid = 0;
+	_day_cache.day  = z;
+	_day_cache.year = tm->tm_year;
+	_day_cache.mon  = tm->tm_mon;
+	_day_cache.mday = tm->tm_mday;
+	_day_cache.yday = tm->tm_yday;
+	_day_cache.wday = tm->tm_wday;
+	_day_cache.valid = 1;
 }
 
-struct tm *localtime_r(const time_t *timep, struct tm * _timevalue) {
-
-	fprintf(stderr, "Hello world? %p %d\n", _timevalue, *timep);
-
-	long seconds = 0; // this needs to be bigger, but whatever
-
-	long year_sec = 0;
-
-	for (int year = 1970; year < 2100; ++year) {
-		fprintf(stderr, "Checking year %d\n", year);
-		long added = year_is_leap(year) ? 366 : 365;
-		fprintf(stderr, "adding %d...\n", added);
-		long secs = added * 86400;
-
-		if (seconds + secs > *timep) {
-			_timevalue->tm_year = year - 1900;
-			year_sec = seconds;
-			fprintf(stderr, "The year is %d, year_sec=%d\n", year, year_sec);
-			for (int month = 1; month <= 12; ++month) {
-				fprintf(stderr, "Checking %d\n", month);
-				secs = days_in_month(month, year) * SEC_DAY;
-				fprintf(stderr, "%d vs %d\n", seconds + secs, *timep);
-				if (seconds + secs > *timep) {
-					fprintf(stderr, "The month is %d.\n", month);
-					_timevalue->tm_mon = month - 1;
-					for (int day = 1; day <= days_in_month(month, year); ++day) {
-						secs = 60 * 60 * 24;
-						fprintf(stderr, "Checking day %d, %d vs . %d\n", day, seconds + secs, *timep);
-						if (seconds + secs > *timep) {
-							fprintf(stderr, "The day is %d.\n", day);
-							_timevalue->tm_mday = day;
-							for (int hour = 1; hour <= 24; ++hour) {
-								secs = 60 * 60;
-								if (seconds + secs > *timep) {
-									long remaining = *timep - seconds;
-									_timevalue->tm_hour = hour - 1;
-									_timevalue->tm_min = remaining / 60;
-									_timevalue->tm_sec = remaining % 60; // can be 60 on a leap second, ignore that
-									_timevalue->tm_wday = day_of_week(*timep); // oh shit
-									_timevalue->tm_yday = (*timep - year_sec) / SEC_DAY;
-									_timevalue->tm_isdst = 0; // never because UTC
-									return _timevalue;
-								} else {
-									seconds += secs;
-								}
-							}
-							fprintf(stderr, "Failed but this is definitely the right day, returning NULL (seconds = %dbut need %d)\n", seconds, *timep);
-							return NULL;
-						} else {
-							seconds += secs;
-						}
-					}
-					fprintf(stderr, "Failed but this is definitely the right month, returning NULL\n");
-					return NULL;
-				} else {
-					seconds += secs;
-				}
-			}
-			fprintf(stderr, "Failed but this is definitely the right year, returning NULL\n");
-			return NULL;
-		} else {
-			seconds += secs;
-		}
-	}
+static struct tm * seconds_to_tm(long seconds, struct tm * tm) {
+	long day = floor_div(seconds, SEC_DAY);
+	long remaining = seconds - day * SEC_DAY;
 
-	fprintf(stderr, "Uh, no?\n");
-	return (void *)0; /// uh what
+	civil_from_days(day, tm);
+	tm->tm_hour = remaining / 3600;
+	tm->tm_min  = (remaining / 60) % 60;
+	tm->tm_sec  = remaining % 60;
+	tm->tm_isdst = 0;
+	return tm;
 }
 
-static unsigned int secs_of_years(int years) {
-	unsigned int days = 0;
-	while (years > 1969) {
-		days += 365;
-		if (year_is_leap(years)) {
-			days++;
-		}
-		years--;
+void tzset(void) {
+	char * tz = getenv("TZ");
+	if (!tz) tz = "";
+	if (!strncmp(tz, _tz_last, sizeof(_tz_last) - 1)) return;
+	strncpy(_tz_last, tz, sizeof(_tz_last) - 1);
+
+	/* Skip the name, either plain letters or <quoted> */
+	if (*tz == '<') {
+		while (*tz && *tz != '>') tz++;
+		if (*tz) tz++;
+	} else {
+		while ((*tz >= 'A' && *tz <= 'Z') || (*tz >= 'a' && *tz <= 'z')) tz++;
 	}
-	return days * 86400;
-}
 
+	int sign = 1;
+	if (*tz == '+') {
+		tz++;
+	} else if (*tz == '-') {
+		sign = -1;
+		tz++;
+	}
 
-time_t mktime(struct tm *tm) {
-	return
-	  secs_of_years(tm->tm_year + 1900) +
-	  secs_of_month(tm->tm_mon, tm->tm_year + 1900) +
-	  (tm->tm_mday - 1) * 86400 +
-	  (tm->tm_hour) * 3600 +
-	  (tm->tm_min) * 60 +
-	  (tm->tm_sec);
+	long hours = strtol(tz, &tz, 10);
+	long minutes = 0;
+	if (*tz == ':') minutes = strtol(tz + 1, &tz, 10);
 
+	/* POSIX offsets count west of UTC */
+	_tz_offset = -sign * (hours * 3600 + minutes * 60);
 }
 
 struct tm * gmtime_r(const time_t * timep, struct tm * tm) {
-	return localtime_r(timep, tm);
+	return seconds_to_tm(*timep, tm);
+}
+
+struct tm * localtime_r(const time_t * timep, struct tm * tm) {
+	tzset();
+	return seconds_to_tm(*timep + _tz_offset, tm);
+}
+
+time_t mktime(struct tm * tm) {
+	tzset();
+
+	/* Out-of-range months carry into the year; everything else just adds up */
+	long year = tm->tm_year + 1900 + floor_div(tm->tm_mon, 12);
+	int mon = tm->tm_mon - floor_div(tm->tm_mon, 12) * 12;
+
+	long seconds = days_from_civil(year, mon + 1, 1) * SEC_DAY +
+		(long)(tm->tm_mday - 1) * SEC_DAY +
+		(long)tm->tm_hour * 3600 +
+		(long)tm->tm_min * 60 +
+		tm->tm_sec;
+
+	/* And normalize what we were given, as callers expect */
+	seconds_to_tm(seconds, tm);
+	return seconds - _tz_offset;
 }
 
 struct tm * localtime(const time_t *timep) {
@@ -160,6 +169,5 @@ struct tm * localtime(const time_t *timep) {
 }
 
 struct tm *gmtime(const time_t *timep) {
-	return localtime(timep);
+	return gmtime_r(timep, &_timevalue);
 }
-
@@ -0,0 +1,14 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+int nice(int inc) {
+	errno = 0;
+	int prio = getpriority(PRIO_PROCESS, 0);
+	if (prio == -1 && errno) return -1;
+	if (setpriority(PRIO_PROCESS, 0, prio + inc) < 0) {
+		if (errno == EACCES) errno = EPERM;
+		return -1;
+	}
+	return getpriority(PRIO_PROCESS, 0);
+}
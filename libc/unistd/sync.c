@@ -0,0 +1,15 @@
+#include <unistd.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL0(sync, SYS_SYNC);
+DEFN_SYSCALL1(fsync, SYS_FSYNC, int);
+
+void sync(void) {
+	syscall_sync();
+}
+
+int fsync(int fd) {
+	__sets_errno(syscall_fsync(fd));
+}
@@ -0,0 +1,14 @@
+#include <unistd.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(tee, SYS_TEE, int, int, size_t);
+
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+	if (flags) {
+		errno = EINVAL;
+		return -1;
+	}
+	__sets_errno(syscall_tee(fd_in, fd_out, len));
+}
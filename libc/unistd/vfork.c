@@ -0,0 +1,25 @@
+#include <unistd.h>
+#include <syscall_nums.h>
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+/*
+ * The child runs on our stack until it execs or exits, and anything it
+ * calls overwrites whatever is below the stack pointer - including the
+ * return address an ordinary wrapper would return through once the
+ * parent is let go. So the return address is kept in %ecx across the
+ * system call instead; the kernel hands each process back its own
+ * registers. vfork can't fail short of a kernel panic, so there is no
+ * errno to set.
+ */
+__asm__ (
+	".global vfork\n"
+	".type vfork, @function\n"
+	"vfork:\n"
+	"	popl %ecx\n"
+	"	movl $" STR(SYS_VFORK) ", %eax\n"
+	"	int $0x7F\n"
+	"	pushl %ecx\n"
+	"	ret\n"
+);
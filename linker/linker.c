@@ -10,11 +10,13 @@
  *
  * As of writing, this is a simplistic and not-fully-compliant
  * implementation of ELF dynamic linking. It suffers from a number
- * of issues, including not actually sharing libraries (there
- * isn't a sufficient mechanism in the kernel at the moment for
- * doing that - we need something with copy-on-write, preferably
- * an mmap-file mechanism), as well as not handling symbol
- * resolution correctly.
+ * of issues, including not handling symbol resolution correctly.
+ *
+ * Objects are mapped from their files with mmap() where their
+ * layout allows it: read-only segments are then shared with every
+ * other process using the same object through the kernel's cache
+ * of mapped file pages, and only pages we actually write (data,
+ * GOT, relocations) become private copies.
  *
  * However, it's sufficient for our purposes, and works well enough
  * to load Python C modules.
@@ -25,8 +27,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/sysfunc.h>
 
 #include <kernel/elf.h>
@@ -72,7 +76,8 @@ static int __trace_ld = 0;
 typedef int (*entry_point_t)(int, char *[], char**);
 
 /* Global linking state */
-static hashmap_t * dumb_symbol_table;
+/* Objects whose symbols are visible, in the order they were relocated */
+static list_t * symbol_scope;
 static hashmap_t * glob_dat;
 static hashmap_t * objects_map;
 
@@ -81,6 +86,16 @@ static char * last_error = NULL;
 
 static int _target_is_suid = 0;
 
+/* Set by LD_BIND_NOW to resolve every PLT slot before startup */
+static int _bind_now = 0;
+
+/* Symbols provided by the linker itself, found before anything loaded */
+typedef struct {
+	char * name;
+	void * symbol;
+} ld_exports_t;
+extern ld_exports_t ld_builtin_exports[];
+
 typedef struct elf_object {
 	FILE * file;
 
@@ -95,6 +110,10 @@ typedef struct elf_object {
 
 	Elf32_Dyn * dynamic;
 	Elf32_Word * dyn_hash;
+	Elf32_Word * dyn_gnu_hash;
+
+	uintptr_t * plt_got;
+	Elf32_Rel * jmprel;
 
 	void (*init)(void);
 	void (**init_array)(void);
@@ -105,9 +124,55 @@ typedef struct elf_object {
 	list_t * dependencies;
 
 	int loaded;
+	int mapped;   /* Segments were mapped from the file */
+	size_t file_size;
+
+	struct prelink_entry * prelink;
 
 } elf_t;
 
+/*
+ * Prelink cache, built by util/prelink.py.
+ *
+ * Each library in /lib is given a fixed base address and has its
+ * relocations applied ahead of time against the other libraries at
+ * theirs. The relocated contents of its writable segments are kept
+ * in the cache, so loading it at that base is a matter of mapping
+ * those pages in place of the file's and fixing up the handful of
+ * relocations that could not be resolved offline.
+ *
+ * Libraries are checked against their entry by size and a checksum
+ * of the data that was relocated and the symbols others resolved
+ * against; anything that does not match is relocated as usual.
+ */
+#define PRELINK_CACHE   "/lib/ld.so.cache"
+#define PRELINK_MAGIC   0x4350444C /* LDPC */
+#define PRELINK_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+} prelink_header_t;
+
+typedef struct prelink_entry {
+	uint32_t name;      /* Offset of the library's name */
+	uint32_t size;      /* Size of the library file */
+	uint32_t checksum;  /* Of writable segment contents and the symbol table */
+	uint32_t sym_count;
+	uint32_t base;      /* Address the library was prelinked at */
+	uint32_t deps;      /* Offset of [count, entry indices] it was resolved against */
+	uint32_t segments;  /* Offset of [count, {vaddr, offset, length}] relocated pages */
+	uint32_t relocs;    /* Offset of [count, Elf32_Rel] still to apply at load */
+	uint32_t copies;    /* Offset of [count, Elf32_Rel] GLOB_DATs an executable may copy */
+} prelink_entry_t;
+
+static uint8_t * prelink_cache = NULL;
+static size_t prelink_cache_size = 0;
+static int prelink_fd = -1;
+static elf_t ** prelink_objects = NULL; /* Verified objects, by entry index */
+
 static elf_t * _main_obj = NULL;
 
 /* Locate library for LD_LIBRARY PATH */
@@ -201,6 +266,9 @@ static elf_t * open_object(const char * path) {
 
 	object->file = f;
 
+	struct stat st;
+	if (!fstat(fileno(f), &st)) object->file_size = st.st_size;
+
 	/* Read the header */
 	size_t r = fread(&object->header, sizeof(Elf32_Header), 1, object->file);
 
@@ -268,6 +336,90 @@ static size_t object_calculate_size(elf_t * object) {
 	return end_addr - base_addr;
 }
 
+/*
+ * Can this object's segments be mapped straight from its file?
+ *
+ * Each loaded segment needs to sit at the same offset within a page
+ * in memory as it does in the file, segments must not share pages,
+ * and nothing may need to be written into read-only segments - which
+ * rules out zero-filled space in them and text relocations.
+ */
+static int object_can_map(elf_t * object) {
+	uintptr_t last_end = 0;
+
+	for (size_t headers = 0; headers < object->header.e_phnum; headers++) {
+		Elf32_Phdr phdr;
+
+		fseek(object->file, object->header.e_phoff + object->header.e_phentsize * headers, SEEK_SET);
+		fread(&phdr, object->header.e_phentsize, 1, object->file);
+
+		switch (phdr.p_type) {
+			case PT_LOAD:
+				if ((phdr.p_vaddr & 0xFFF) != (phdr.p_offset & 0xFFF)) return 0;
+				if ((phdr.p_vaddr & 0xFFFFF000) < last_end) return 0;
+				if (!(phdr.p_flags & PF_W) && phdr.p_memsz > phdr.p_filesz) return 0;
+				last_end = (phdr.p_vaddr + phdr.p_memsz + 0xFFF) & 0xFFFFF000;
+				break;
+			case PT_DYNAMIC:
+				{
+					/* We haven't loaded anything yet, so read the dynamic table from the file */
+					Elf32_Dyn dyn;
+					fseek(object->file, phdr.p_offset, SEEK_SET);
+					for (size_t i = 0; i < phdr.p_filesz / sizeof(Elf32_Dyn); ++i) {
+						fread(&dyn, sizeof(Elf32_Dyn), 1, object->file);
+						if (dyn.d_tag == 0) break;
+						if (dyn.d_tag == 22) return 0; /* DT_TEXTREL */
+						if (dyn.d_tag == 30 && (dyn.d_un.d_val & 0x4)) return 0; /* DT_FLAGS & DF_TEXTREL */
+					}
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Map one loadable segment from the object's file.
+ *
+ * File pages are mapped private, so writable segments get copies
+ * of only the pages that are written; anything past the end of the
+ * file data is anonymous zeroed memory.
+ */
+static int object_map_segment(elf_t * object, uintptr_t base, Elf32_Phdr * phdr) {
+	int prot = PROT_READ;
+	if (phdr->p_flags & PF_W) prot |= PROT_WRITE;
+	if (phdr->p_flags & PF_X) prot |= PROT_EXEC;
+
+	uintptr_t start    = (base + phdr->p_vaddr) & 0xFFFFF000;
+	uintptr_t file_end = base + phdr->p_vaddr + phdr->p_filesz;
+	uintptr_t mem_end  = base + phdr->p_vaddr + phdr->p_memsz;
+	uintptr_t map_end  = (file_end + 0xFFF) & 0xFFFFF000;
+
+	if (phdr->p_filesz) {
+		if (mmap((void *)start, map_end - start, prot, MAP_PRIVATE | MAP_FIXED,
+				fileno(object->file), phdr->p_offset & 0xFFFFF000) == MAP_FAILED) {
+			return 1;
+		}
+		/* The rest of the last file page is whatever follows in the file */
+		if (mem_end > file_end) {
+			memset((void *)file_end, 0, ((mem_end < map_end) ? mem_end : map_end) - file_end);
+		}
+	} else {
+		map_end = start;
+	}
+
+	if (mem_end > map_end) {
+		if (mmap((void *)map_end, mem_end - map_end, prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 /* Load an object into memory */
 static uintptr_t object_load(elf_t * object, uintptr_t base) {
 
@@ -275,6 +427,9 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 
 	object->base = base;
 
+	int can_map = object_can_map(object);
+	object->mapped = can_map;
+
 	size_t headers = 0;
 	while (headers < object->header.e_phnum) {
 		Elf32_Phdr phdr;
@@ -286,19 +441,23 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 		switch (phdr.p_type) {
 			case PT_LOAD:
 				{
-					/* Request memory to load this PHDR into */
-					char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
-					sysfunc(TOARU_SYS_FUNC_MMAP, args);
-
-					/* Copy the code into memory */
-					fseek(object->file, phdr.p_offset, SEEK_SET);
-					fread((void *)(base + phdr.p_vaddr), phdr.p_filesz, 1, object->file);
-
-					/* Zero the remaining area */
-					size_t r = phdr.p_filesz;
-					while (r < phdr.p_memsz) {
-						*(char *)(phdr.p_vaddr + base + r) = 0;
-						r++;
+					if (can_map && !object_map_segment(object, base, &phdr)) {
+						TRACE_LD("Mapped segment at 0x%x", (unsigned int)(base + phdr.p_vaddr));
+					} else {
+						/* Request memory to load this PHDR into */
+						char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
+						sysfunc(TOARU_SYS_FUNC_MMAP, args);
+
+						/* Copy the code into memory */
+						fseek(object->file, phdr.p_offset, SEEK_SET);
+						fread((void *)(base + phdr.p_vaddr), phdr.p_filesz, 1, object->file);
+
+						/* Zero the remaining area */
+						size_t r = phdr.p_filesz;
+						while (r < phdr.p_memsz) {
+							*(char *)(phdr.p_vaddr + base + r) = 0;
+							r++;
+						}
 					}
 
 					/* If this expands our end address, be sure to update it */
@@ -334,10 +493,19 @@ static int object_postload(elf_t * object) {
 		table = object->dynamic;
 		while (table->d_tag) {
 			switch (table->d_tag) {
-				case 4:
+				case 4: /* DT_HASH */
 					object->dyn_hash = (Elf32_Word *)(object->base + table->d_un.d_ptr);
 					object->dyn_symbol_table_size = object->dyn_hash[1];
 					break;
+				case 0x6ffffef5: /* DT_GNU_HASH */
+					object->dyn_gnu_hash = (Elf32_Word *)(object->base + table->d_un.d_ptr);
+					break;
+				case 3: /* DT_PLTGOT */
+					object->plt_got = (uintptr_t *)(object->base + table->d_un.d_ptr);
+					break;
+				case 23: /* DT_JMPREL - PLT relocations */
+					object->jmprel = (Elf32_Rel *)(object->base + table->d_un.d_ptr);
+					break;
 				case 5: /* Dynamic String Table */
 					object->dyn_string_table = (char *)(object->base + table->d_un.d_ptr);
 					break;
@@ -394,28 +562,228 @@ static int need_symbol_for_type(unsigned char type) {
 	}
 }
 
-/* Apply ELF relocations */
-static int object_relocate(elf_t * object) {
+/* Symbol hash from the System V ABI, used by DT_HASH */
+static uint32_t elf_hash(const char * name) {
+	uint32_t h = 0;
+	while (*name) {
+		h = (h << 4) + (unsigned char)*name++;
+		uint32_t g = h & 0xF0000000;
+		if (g) h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
 
-	/* If there is a dynamic symbol table, load symbols */
-	if (object->dyn_symbol_table) {
-		Elf32_Sym * table = object->dyn_symbol_table;
-		size_t i = 0;
-		while (i < object->dyn_symbol_table_size) {
-			char * symname = (char *)((uintptr_t)object->dyn_string_table + table->st_name);
-
-			/* If we haven't added this symbol to our symbol table, do so now. */
-			if (!hashmap_has(dumb_symbol_table, symname)) {
-				if (table->st_shndx) {
-					hashmap_set(dumb_symbol_table, symname, (void*)(table->st_value + object->base));
-				}
-			}
+/* Symbol hash used by DT_GNU_HASH */
+static uint32_t gnu_hash(const char * name) {
+	uint32_t h = 5381;
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h;
+}
 
-			table++;
+/*
+ * Find a symbol defined by `object` through its own hash table,
+ * preferring the GNU table, whose bloom filter rejects most misses
+ * without touching the symbol table at all.
+ */
+static Elf32_Sym * object_lookup(elf_t * object, const char * name, uint32_t h_elf, uint32_t h_gnu) {
+	if (!object->dyn_symbol_table) return NULL;
+
+	if (object->dyn_gnu_hash) {
+		Elf32_Word nbuckets  = object->dyn_gnu_hash[0];
+		Elf32_Word symoffset = object->dyn_gnu_hash[1];
+		Elf32_Word bloom_size  = object->dyn_gnu_hash[2];
+		Elf32_Word bloom_shift = object->dyn_gnu_hash[3];
+		Elf32_Word * bloom   = &object->dyn_gnu_hash[4];
+		Elf32_Word * buckets = &bloom[bloom_size];
+		Elf32_Word * chain   = &buckets[nbuckets];
+
+		if (!nbuckets || !bloom_size) return NULL;
+
+		Elf32_Word word = bloom[(h_gnu / 32) % bloom_size];
+		Elf32_Word mask = (1U << (h_gnu % 32)) | (1U << ((h_gnu >> bloom_shift) % 32));
+		if ((word & mask) != mask) return NULL;
+
+		Elf32_Word i = buckets[h_gnu % nbuckets];
+		if (i < symoffset) return NULL;
+
+		while (1) {
+			Elf32_Word h = chain[i - symoffset];
+			Elf32_Sym * sym = &object->dyn_symbol_table[i];
+			if ((h | 1) == (h_gnu | 1) && sym->st_shndx &&
+				!strcmp(name, object->dyn_string_table + sym->st_name)) {
+				return sym;
+			}
+			if (h & 1) return NULL;
 			i++;
 		}
 	}
 
+	if (object->dyn_hash) {
+		Elf32_Word nbucket = object->dyn_hash[0];
+		Elf32_Word * bucket = &object->dyn_hash[2];
+		Elf32_Word * chain  = &bucket[nbucket];
+
+		if (!nbucket) return NULL;
+
+		for (Elf32_Word i = bucket[h_elf % nbucket]; i; i = chain[i]) {
+			Elf32_Sym * sym = &object->dyn_symbol_table[i];
+			if (sym->st_shndx && !strcmp(name, object->dyn_string_table + sym->st_name)) {
+				return sym;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolve a symbol against our builtins and then every object
+ * that has begun relocation, in the order they did so; the first
+ * definition wins.
+ */
+static int resolve_symbol(const char * name, uintptr_t * out) {
+	for (ld_exports_t * ex = ld_builtin_exports; ex->name; ex++) {
+		if (!strcmp(name, ex->name)) {
+			*out = (uintptr_t)ex->symbol;
+			return 1;
+		}
+	}
+
+	uint32_t h_elf = elf_hash(name);
+	uint32_t h_gnu = gnu_hash(name);
+
+	foreach(node, symbol_scope) {
+		elf_t * object = node->value;
+		Elf32_Sym * sym = object_lookup(object, name, h_elf, h_gnu);
+		if (sym) {
+			*out = sym->st_value + object->base;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Lazy PLT binding.
+ *
+ * The first call through a PLT entry lands in PLT0, which pushes
+ * GOT[1] (the object) and jumps to GOT[2] (the trampoline below)
+ * with the entry's offset into DT_JMPREL already on the stack.
+ * We look up the symbol, patch the GOT slot so later calls go
+ * straight there, and jump to it as if it had been called directly.
+ */
+uintptr_t _ld_lazy_bind(elf_t * object, uint32_t offset) {
+	Elf32_Rel * rel = (Elf32_Rel *)((uintptr_t)object->jmprel + offset);
+	Elf32_Sym * sym = &object->dyn_symbol_table[ELF32_R_SYM(rel->r_info)];
+	char * symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
+
+	uintptr_t x;
+	if (!resolve_symbol(symname, &x)) {
+		fprintf(stderr, "ld.so: unresolved symbol '%s'\n", symname);
+		exit(127);
+	}
+
+	TRACE_LD("Bound %s to 0x%x", symname, x);
+	*(uintptr_t *)(rel->r_offset + object->base) = x;
+	return x;
+}
+
+extern void _ld_lazy_trampoline(void);
+__asm__ (
+	".text\n"
+	".type _ld_lazy_trampoline, @function\n"
+	"_ld_lazy_trampoline:\n"
+	"	pushl %eax\n"
+	"	pushl %ecx\n"
+	"	pushl %edx\n"
+	"	pushl 16(%esp)\n"      /* PLT relocation offset */
+	"	pushl 16(%esp)\n"      /* object */
+	"	call _ld_lazy_bind\n"
+	"	addl $8, %esp\n"
+	"	movl %eax, 16(%esp)\n" /* Return into the target in place of the offset */
+	"	popl %edx\n"
+	"	popl %ecx\n"
+	"	popl %eax\n"
+	"	addl $4, %esp\n"
+	"	ret\n"
+);
+
+static int object_binds_lazily(elf_t * object) {
+	return !_bind_now && object->plt_got && object->jmprel;
+}
+
+/* Apply a single relocation */
+static void object_apply_rel(elf_t * object, Elf32_Rel * rel, int lazy) {
+	unsigned int  symbol = ELF32_R_SYM(rel->r_info);
+	unsigned char type = ELF32_R_TYPE(rel->r_info);
+	Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
+
+	/* If we need symbol for this, get it. */
+	char * symname = NULL;
+	uintptr_t x = sym->st_value + object->base;
+	if ((need_symbol_for_type(type) || (type == 5)) && !(lazy && type == 7)) {
+		symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
+		if (!symname || !resolve_symbol(symname, &x)) {
+			/* This isn't fatal, but do log a message if debugging is enabled. */
+			TRACE_LD("Symbol not found: %s", symname);
+			x = 0x0;
+		}
+	}
+
+	/* Relocations, symbol lookups, etc. */
+	switch (type) {
+		case 6: /* GLOB_DAT */
+			if (symname && hashmap_has(glob_dat, symname)) {
+				x = (uintptr_t)hashmap_get(glob_dat, symname);
+			}
+			memcpy((void *)(rel->r_offset + object->base), &x, sizeof(uintptr_t));
+			break;
+		case 7: /* JUMP_SLOT */
+			if (lazy) {
+				/* Point the slot back at its PLT entry, which will call the resolver */
+				x = object->base;
+				x += *((ssize_t *)(rel->r_offset + object->base));
+			}
+			memcpy((void *)(rel->r_offset + object->base), &x, sizeof(uintptr_t));
+			break;
+		case 1: /* 32 */
+			x += *((ssize_t *)(rel->r_offset + object->base));
+			memcpy((void *)(rel->r_offset + object->base), &x, sizeof(uintptr_t));
+			break;
+		case 2: /* PC32 */
+			x += *((ssize_t *)(rel->r_offset + object->base));
+			x -= (rel->r_offset + object->base);
+			memcpy((void *)(rel->r_offset + object->base), &x, sizeof(uintptr_t));
+			break;
+		case 8: /* RELATIVE */
+			x = object->base;
+			x += *((ssize_t *)(rel->r_offset + object->base));
+			memcpy((void *)(rel->r_offset + object->base), &x, sizeof(uintptr_t));
+			break;
+		case 5: /* COPY */
+			memcpy((void *)(rel->r_offset + object->base), (void *)x, sym->st_size);
+			break;
+		default:
+			TRACE_LD("Unknown relocation type: %d", type);
+	}
+}
+
+/* Apply ELF relocations */
+static int object_relocate(elf_t * object) {
+
+	/* Our symbols are visible from here on, including to our own relocations */
+	list_insert(symbol_scope, object);
+
+	int lazy = object_binds_lazily(object);
+	if (lazy) {
+		object->plt_got[1] = (uintptr_t)object;
+		object->plt_got[2] = (uintptr_t)&_ld_lazy_trampoline;
+	}
+
 	/* Find relocation table */
 	for (uintptr_t x = 0; x < object->header.e_shentsize * object->header.e_shnum; x += object->header.e_shentsize) {
 		Elf32_Shdr shdr;
@@ -427,54 +795,7 @@ static int object_relocate(elf_t * object) {
 		if (shdr.sh_type == 9) {
 			Elf32_Rel * table = (Elf32_Rel *)(shdr.sh_addr + object->base);
 			while ((uintptr_t)table - ((uintptr_t)shdr.sh_addr + object->base) < shdr.sh_size) {
-				unsigned int  symbol = ELF32_R_SYM(table->r_info);
-				unsigned char type = ELF32_R_TYPE(table->r_info);
-				Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
-
-				/* If we need symbol for this, get it. */
-				char * symname = NULL;
-				uintptr_t x = sym->st_value + object->base;
-				if (need_symbol_for_type(type) || (type == 5)) {
-					symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
-					if (symname && hashmap_has(dumb_symbol_table, symname)) {
-						x = (uintptr_t)hashmap_get(dumb_symbol_table, symname);
-					} else {
-						/* This isn't fatal, but do log a message if debugging is enabled. */
-						TRACE_LD("Symbol not found: %s", symname);
-						x = 0x0;
-					}
-				}
-
-				/* Relocations, symbol lookups, etc. */
-				switch (type) {
-					case 6: /* GLOB_DAT */
-						if (symname && hashmap_has(glob_dat, symname)) {
-							x = (uintptr_t)hashmap_get(glob_dat, symname);
-						}
-					case 7: /* JUMP_SLOT */
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 1: /* 32 */
-						x += *((ssize_t *)(table->r_offset + object->base));
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 2: /* PC32 */
-						x += *((ssize_t *)(table->r_offset + object->base));
-						x -= (table->r_offset + object->base);
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 8: /* RELATIVE */
-						x = object->base;
-						x += *((ssize_t *)(table->r_offset + object->base));
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 5: /* COPY */
-						memcpy((void *)(table->r_offset + object->base), (void *)x, sym->st_size);
-						break;
-					default:
-						TRACE_LD("Unknown relocation type: %d", type);
-				}
-
+				object_apply_rel(object, table, lazy);
 				table++;
 			}
 		}
@@ -508,6 +829,177 @@ static void object_find_copy_relocations(elf_t * object) {
 	}
 }
 
+/* Map the prelink cache, if there is a usable one */
+static void prelink_open(void) {
+	int fd = open(PRELINK_CACHE, O_RDONLY);
+	if (fd < 0) return;
+
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(prelink_header_t)) {
+		close(fd);
+		return;
+	}
+
+	void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	prelink_header_t * header = map;
+	if (header->magic != PRELINK_MAGIC || header->version != PRELINK_VERSION ||
+		header->count > (st.st_size - sizeof(prelink_header_t)) / sizeof(prelink_entry_t)) {
+		munmap(map, st.st_size);
+		close(fd);
+		return;
+	}
+
+	prelink_cache = map;
+	prelink_cache_size = st.st_size;
+	prelink_fd = fd;
+	prelink_objects = malloc(sizeof(elf_t *) * header->count);
+	memset(prelink_objects, 0, sizeof(elf_t *) * header->count);
+}
+
+/* We're done loading; the mappings we made keep their own references to the cache */
+static void prelink_close(void) {
+	if (!prelink_cache) return;
+	munmap(prelink_cache, prelink_cache_size);
+	close(prelink_fd);
+	prelink_cache = NULL;
+	prelink_fd = -1;
+}
+
+/* A counted list of `words`-sized items in the cache */
+static uint32_t * prelink_list(uint32_t offset, size_t words) {
+	if ((offset & 3) || offset > prelink_cache_size - sizeof(uint32_t)) return NULL;
+	uint32_t * list = (uint32_t *)(prelink_cache + offset);
+	if (list[0] > (prelink_cache_size - offset - sizeof(uint32_t)) / (words * sizeof(uint32_t))) return NULL;
+	return list;
+}
+
+static prelink_entry_t * prelink_find(const char * name, uint32_t * index) {
+	if (!prelink_cache) return NULL;
+
+	prelink_header_t * header = (prelink_header_t *)prelink_cache;
+	prelink_entry_t * entries = (prelink_entry_t *)(header + 1);
+	for (uint32_t i = 0; i < header->count; ++i) {
+		uint32_t offset = entries[i].name;
+		if (offset >= prelink_cache_size || !memchr(prelink_cache + offset, 0, prelink_cache_size - offset)) continue;
+		if (!strcmp(name, (char *)prelink_cache + offset)) {
+			*index = i;
+			return &entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* FNV-1a, which is what util/prelink.py uses too */
+static uint32_t prelink_checksum(uint32_t hash, const uint8_t * data, size_t len) {
+	while (len--) {
+		hash ^= *data++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Is the loaded object the same one the cache entry was built from? */
+static int prelink_verify(elf_t * object, prelink_entry_t * entry) {
+	if (!object->mapped || object->file_size != entry->size || !object->dyn_symbol_table) return 0;
+
+	uint32_t hash = 2166136261u;
+	uintptr_t load_end = 0;
+	for (size_t headers = 0; headers < object->header.e_phnum; headers++) {
+		Elf32_Phdr phdr;
+		fseek(object->file, object->header.e_phoff + object->header.e_phentsize * headers, SEEK_SET);
+		fread(&phdr, object->header.e_phentsize, 1, object->file);
+		if (phdr.p_type != PT_LOAD) continue;
+		if (phdr.p_flags & PF_W) {
+			hash = prelink_checksum(hash, (uint8_t *)(object->base + phdr.p_vaddr), phdr.p_filesz);
+		}
+		if (load_end < object->base + phdr.p_vaddr + phdr.p_memsz) {
+			load_end = object->base + phdr.p_vaddr + phdr.p_memsz;
+		}
+	}
+
+	size_t symbols = entry->sym_count * sizeof(Elf32_Sym);
+	if ((uintptr_t)object->dyn_symbol_table + symbols > load_end) return 0;
+	hash = prelink_checksum(hash, (uint8_t *)object->dyn_symbol_table, symbols);
+
+	return hash == entry->checksum;
+}
+
+/* Map the writable segments from the file again, throwing away prelinked pages */
+static void object_remap(elf_t * object) {
+	for (size_t headers = 0; headers < object->header.e_phnum; headers++) {
+		Elf32_Phdr phdr;
+		fseek(object->file, object->header.e_phoff + object->header.e_phentsize * headers, SEEK_SET);
+		fread(&phdr, object->header.e_phentsize, 1, object->file);
+		if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_W)) {
+			object_map_segment(object, object->base, &phdr);
+		}
+	}
+}
+
+/* Replace the object's writable pages with their prelinked copies */
+static int prelink_map(elf_t * object, prelink_entry_t * entry) {
+	uint32_t * segments = prelink_list(entry->segments, 3);
+	if (!segments) return 1;
+
+	for (uint32_t i = 0; i < segments[0]; ++i) {
+		uint32_t vaddr  = segments[1 + i * 3];
+		uint32_t offset = segments[2 + i * 3];
+		uint32_t length = segments[3 + i * 3];
+		if ((vaddr & 0xFFF) || (offset & 0xFFF) || offset > prelink_cache_size || length > prelink_cache_size - offset) return 1;
+		if (mmap((void *)(object->base + vaddr), length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+				prelink_fd, offset) == MAP_FAILED) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Were all the libraries this one was resolved against loaded where the cache expects? */
+static int prelink_deps_ready(elf_t * object) {
+	prelink_header_t * header = (prelink_header_t *)prelink_cache;
+	uint32_t * deps = prelink_list(object->prelink->deps, 1);
+	if (!deps) return 0;
+
+	for (uint32_t i = 0; i < deps[0]; ++i) {
+		if (deps[1 + i] >= header->count || !prelink_objects[deps[1 + i]]) return 0;
+	}
+
+	return 1;
+}
+
+/* The prelinked counterpart to object_relocate */
+static int prelink_finish(elf_t * object) {
+	uint32_t * relocs = prelink_list(object->prelink->relocs, 2);
+	uint32_t * copies = prelink_list(object->prelink->copies, 2);
+	if (!relocs || !copies) return 1;
+
+	list_insert(symbol_scope, object);
+
+	for (uint32_t i = 0; i < relocs[0]; ++i) {
+		object_apply_rel(object, (Elf32_Rel *)&relocs[1 + i * 2], 0);
+	}
+
+	/* Data an executable has copied, which we have to point at its copy instead */
+	for (uint32_t i = 0; i < copies[0] && glob_dat->count; ++i) {
+		Elf32_Rel * rel = (Elf32_Rel *)&copies[1 + i * 2];
+		Elf32_Sym * sym = &object->dyn_symbol_table[ELF32_R_SYM(rel->r_info)];
+		char * symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
+		if (hashmap_has(glob_dat, symname)) {
+			uintptr_t x = (uintptr_t)hashmap_get(glob_dat, symname);
+			memcpy((void *)(rel->r_offset + object->base), &x, sizeof(uintptr_t));
+		}
+	}
+
+	return 0;
+}
+
 /* Find a symbol in a specific object. */
 static void * object_find_symbol(elf_t * object, const char * symbol_name) {
 
@@ -516,14 +1008,9 @@ static void * object_find_symbol(elf_t * object, const char * symbol_name) {
 		return NULL;
 	}
 
-	Elf32_Sym * table = object->dyn_symbol_table;
-	size_t i = 0;
-	while (i < object->dyn_symbol_table_size) {
-		if (!strcmp(symbol_name, (char *)((uintptr_t)object->dyn_string_table + table->st_name))) {
-			return (void *)(table->st_value + object->base);
-		}
-		table++;
-		i++;
+	Elf32_Sym * sym = object_lookup(object, symbol_name, elf_hash(symbol_name), gnu_hash(symbol_name));
+	if (sym) {
+		return (void *)(sym->st_value + object->base);
 	}
 
 	last_error = "symbol not found in library";
@@ -548,11 +1035,14 @@ static void * do_actual_load(const char * filename, elf_t * lib, int flags) {
 	}
 
 	/*
-	 * Allocate space to load the library
-	 * This is where we should really be loading things into COW
-	 * but we don't have the functionality available.
+	 * Reserve space to load the library; object_load() maps
+	 * the segments over this reservation.
 	 */
-	uintptr_t load_addr = (uintptr_t)malloc(lib_size);
+	uintptr_t load_addr = (uintptr_t)mmap(NULL, lib_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (load_addr == (uintptr_t)MAP_FAILED) {
+		last_error = "could not reserve space for library";
+		return NULL;
+	}
 	object_load(lib, load_addr);
 
 	/* Perform cleanup steps */
@@ -567,7 +1057,7 @@ static void * do_actual_load(const char * filename, elf_t * lib, int flags) {
 		if (!_lib) {
 			/* Missing dependencies are fatal to this process, but
 			 * not to the entire application. */
-			free((void *)load_addr);
+			munmap((void *)load_addr, lib_size);
 			last_error = "Failed to load a dependency.";
 			lib->loaded = 0;
 			TRACE_LD("Failed to load object: %s", item->value);
@@ -636,11 +1126,28 @@ static elf_t * preload(hashmap_t * libs, list_t * load_libs, char * lib_name) {
 		end_addr++;
 	}
 
-	/* Load PHDRs */
-	end_addr = object_load(lib, end_addr);
+	uint32_t index;
+	prelink_entry_t * entry = prelink_find(lib_name, &index);
+	if (entry && entry->base >= end_addr) {
+		/* Load at the prelinked base, and use the relocated pages if this is still the same library */
+		object_load(lib, entry->base);
+		object_postload(lib);
+		if (prelink_verify(lib, entry)) {
+			if (!prelink_map(lib, entry)) {
+				TRACE_LD("Using prelinked %s at 0x%x", lib_name, entry->base);
+				lib->prelink = entry;
+				prelink_objects[index] = lib;
+			} else {
+				object_remap(lib);
+			}
+		}
+	} else {
+		/* Load PHDRs */
+		end_addr = object_load(lib, end_addr);
 
-	/* Extract information */
-	object_postload(lib);
+		/* Extract information */
+		object_postload(lib);
+	}
 
 	/* Mark loaded */
 	lib->loaded = 1;
@@ -705,10 +1212,6 @@ static char * argv_value(void) {
 }
 
 /* Exported methods (dlfcn) */
-typedef struct {
-	char * name;
-	void * symbol;
-} ld_exports_t;
 ld_exports_t ld_builtin_exports[] = {
 	{"dlopen", dlopen_ld},
 	{"dlsym", object_find_symbol},
@@ -747,18 +1250,17 @@ int main(int argc, char * argv[]) {
 		__trace_ld = 1;
 	}
 
-	/* Initialize hashmaps for symbols, GLOB_DATs, and objects */
-	dumb_symbol_table = hashmap_create(10);
+	/* Resolve PLT entries up front instead of on first call */
+	char * bind_now_env = getenv("LD_BIND_NOW");
+	if (bind_now_env && *bind_now_env) {
+		_bind_now = 1;
+	}
+
+	/* Initialize the symbol scope and hashmaps for GLOB_DATs and objects */
+	symbol_scope = list_create();
 	glob_dat = hashmap_create(10);
 	objects_map = hashmap_create(10);
 
-	/* Setup symbols for built-in exports */
-	ld_exports_t * ex = ld_builtin_exports;
-	while (ex->name) {
-		hashmap_set(dumb_symbol_table, ex->name, ex->symbol);
-		ex++;
-	}
-
 	/* Technically there's a potential time-of-use probably if we check like this but
 	 * this is a toy linker for a toy OS so the fact that we even need to check suid
 	 * bits at all is outrageous
@@ -773,6 +1275,11 @@ int main(int argc, char * argv[]) {
 		_target_is_suid = 1;
 	}
 
+	/* The cache only describes the default library path */
+	if (_target_is_suid || !getenv("LD_LIBRARY_PATH")) {
+		prelink_open();
+	}
+
 	/* Open the requested main object */
 	elf_t * main_obj = open_object(file);
 	_main_obj = main_obj;
@@ -821,7 +1328,15 @@ nope:
 		elf_t * lib = item->value;
 
 		/* Complete relocation */
-		object_relocate(lib);
+		if (lib->prelink && prelink_deps_ready(lib) && !prelink_finish(lib)) {
+			TRACE_LD("Prelinked %s", lib->prelink->name + (char *)prelink_cache);
+		} else {
+			if (lib->prelink) {
+				object_remap(lib);
+				lib->prelink = NULL;
+			}
+			object_relocate(lib);
+		}
 
 		/* Close the underlying file */
 		fclose(lib->file);
@@ -837,6 +1352,8 @@ nope:
 		free(item);
 	}
 
+	prelink_close();
+
 	/* Relocate the main object */
 	TRACE_LD("Relocating main object");
 	object_relocate(main_obj);
@@ -889,8 +1406,9 @@ nope:
 	}
 
 	/* Set heap functions for later usage */
-	if (hashmap_has(dumb_symbol_table, "malloc")) _malloc = hashmap_get(dumb_symbol_table, "malloc");
-	if (hashmap_has(dumb_symbol_table, "free")) _free = hashmap_get(dumb_symbol_table, "free");
+	uintptr_t heap_func;
+	if (resolve_symbol("malloc", &heap_func)) _malloc = (void *)heap_func;
+	if (resolve_symbol("free", &heap_func)) _free = (void *)heap_func;
 	_malloc_minimum = 0x40000000;
 
 	/* Jump to the entry for the main object */
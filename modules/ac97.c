@@ -9,6 +9,7 @@
  * See <http://www.intel.com/design/chipsets/manuals/29802801.pdf>.
  */
 
+#include <kernel/dma.h>
 #include <kernel/logging.h>
 #include <kernel/mem.h>
 #include <kernel/module.h>
@@ -35,7 +36,7 @@
 /* Bus mastering misc */
 /* Buffer descriptor list constants */
 #define AC97_BDL_LEN              32                    /* Buffer descriptor list length */
-#define AC97_BDL_BUFFER_LEN       0x1000                /* Length of buffer in BDL */
+#define AC97_BDL_BUFFER_LEN       0x1000                /* Length of buffer in BDL, in samples */
 #define AC97_CL_GET_LENGTH(cl)    ((cl) & 0xFFFF)       /* Decode length from cl */
 #define AC97_CL_SET_LENGTH(cl, v) ((cl) = (v) & 0xFFFF) /* Encode length to cl */
 #define AC97_CL_BUP               ((uint32_t)1 << 30)             /* Buffer underrun policy in cl */
@@ -67,6 +68,12 @@
 #define AC97_PLAYBACK_SPEED 48000
 #define AC97_PLAYBACK_FORMAT SND_FORMAT_L16SLE
 
+/* Period limits and defaults, in bytes */
+#define AC97_PERIOD_MIN      0x100
+#define AC97_PERIOD_MAX      (AC97_BDL_BUFFER_LEN * 2)
+#define AC97_PERIOD_DEFAULT  AC97_PERIOD_MAX
+#define AC97_PERIODS_DEFAULT 3
+
 /* An entry in a buffer dscriptor list */
 typedef struct {
 	uint32_t pointer;  /* Pointer to buffer */
@@ -84,6 +91,8 @@ typedef struct {
 	uint16_t * bufs[AC97_BDL_LEN];  /* Virtual addresses for buffers in BDL */
 	uint32_t bdl_p;
 	uint32_t mask;
+	uint32_t periods;               /* How many buffers are kept queued */
+	uint32_t period_size;           /* Bytes played from each buffer */
 } ac97_device_t;
 
 static ac97_device_t _device;
@@ -103,6 +112,8 @@ static snd_knob_t _knobs[] = {
 
 static int ac97_mixer_read(uint32_t knob_id, uint32_t *val);
 static int ac97_mixer_write(uint32_t knob_id, uint32_t val);
+static int ac97_set_periods(uint32_t * periods, uint32_t * size);
+static uint32_t ac97_queued(void);
 
 static snd_device_t _snd = {
 	.name            = AC97_SND_NAME,
@@ -115,6 +126,9 @@ static snd_device_t _snd = {
 
 	.mixer_read  = ac97_mixer_read,
 	.mixer_write = ac97_mixer_write,
+
+	.set_periods = ac97_set_periods,
+	.queued      = ac97_queued,
 };
 
 /* 
@@ -132,34 +146,100 @@ static void find_ac97(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 
 }
 
-#define DIVISION 0x1000
+/*
+ * Queue buffers after the last valid one until `periods` of them,
+ * counting the one playing, are waiting to be played.
+ */
+static void ac97_top_up(void) {
+	uint8_t civ = inportb(_device.nabmbar + AC97_PO_CIV) % AC97_BDL_LEN;
+	while ((uint32_t)((_device.lvi - civ + AC97_BDL_LEN) % AC97_BDL_LEN) < _device.periods - 1) {
+		_device.lvi = (_device.lvi + 1) % AC97_BDL_LEN;
+		snd_request_buf(&_snd, _device.period_size, (uint8_t *)_device.bufs[_device.lvi]);
+	}
+	outportb(_device.nabmbar + AC97_PO_LVI, _device.lvi);
+}
+
 static int irq_handler(struct regs * regs) {
 	uint16_t sr = inports(_device.nabmbar + AC97_PO_SR);
 	if (!sr) return 0;
 
-	if (sr & AC97_X_SR_BCIS) {
-		size_t f = (_device.lvi + 2) % AC97_BDL_LEN;
-		for (size_t i = 0; i < AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]); i += DIVISION) {
-			snd_request_buf(&_snd, DIVISION, (uint8_t *)_device.bufs[f] + i);
-			//switch_task(1);
-		}
-		_device.lvi = (_device.lvi + 1) % AC97_BDL_LEN;
-		outportb(_device.nabmbar + AC97_PO_LVI, _device.lvi);
-	} else if (sr & AC97_X_SR_LVBCI) {
-		debug_print(NOTICE, "ac97 irq is lvbci");
+	if (sr & (AC97_X_SR_BCIS | AC97_X_SR_LVBCI)) {
+		/* Completing the last valid buffer means we fell behind; queueing more restarts it */
+		ac97_top_up();
 	} else if (sr & AC97_X_SR_FIFOE) {
 		debug_print(NOTICE, "ac97 irq is fifoe");
 	} else {
 		/* don't handle it */
 		return 0;
 	}
-	debug_print(NOTICE, "ac97 status register: 0x%4x", sr);
 	outports(_device.nabmbar + AC97_PO_SR, sr & 0x1E);
 
 	irq_ack(_device.irq);
 	return 1;
 }
 
+/*
+ * (Re)start playback from the start of the buffer descriptor list
+ * with the current period settings.
+ */
+static void ac97_start(void) {
+	/* Stop the DMA engine and reset the PCM out registers */
+	outportb(_device.nabmbar + AC97_PO_CR, 0);
+	for (int i = 0; i < 1000 && !(inports(_device.nabmbar + AC97_PO_SR) & AC97_X_SR_DCH); ++i);
+	outportb(_device.nabmbar + AC97_PO_CR, AC97_X_CR_RR);
+	for (int i = 0; i < 1000 && (inportb(_device.nabmbar + AC97_PO_CR) & AC97_X_CR_RR); ++i);
+
+	for (int i = 0; i < AC97_BDL_LEN; i++) {
+		AC97_CL_SET_LENGTH(_device.bdl[i].cl, _device.period_size / sizeof(*_device.bufs[0]));
+		/* Set all buffers to interrupt */
+		_device.bdl[i].cl |= AC97_CL_IOC;
+	}
+
+	/* Tell the ac97 where our BDL is */
+	outportl(_device.nabmbar + AC97_PO_BDBAR, _device.bdl_p);
+
+	/* Queue the first periods, starting with the one at index 0 */
+	_device.lvi = AC97_BDL_LEN - 1;
+	ac97_top_up();
+
+	/* Enable all matter of interrupts and start things playing */
+	outportb(_device.nabmbar + AC97_PO_CR, AC97_X_CR_FEIE | AC97_X_CR_IOCE | AC97_X_CR_LVBIE | AC97_X_CR_RPBM);
+}
+
+static int ac97_set_periods(uint32_t * periods, uint32_t * size) {
+	if (!*periods && !*size) {
+		*periods = _device.periods;
+		*size = _device.period_size;
+		return 0;
+	}
+
+	uint32_t new_size = *size ? *size : _device.period_size;
+	new_size = MAX(AC97_PERIOD_MIN, MIN(new_size, AC97_PERIOD_MAX)) & ~0x3;
+	uint32_t new_periods = *periods ? *periods : _device.periods;
+	new_periods = MAX(2, MIN(new_periods, AC97_BDL_LEN - 1));
+
+	IRQ_OFF;
+	_device.period_size = new_size;
+	_device.periods = new_periods;
+	ac97_start();
+	IRQ_RES;
+
+	*size = new_size;
+	*periods = new_periods;
+	debug_print(NOTICE, "ac97: playing %d periods of %d bytes", new_periods, new_size);
+	return 0;
+}
+
+static uint32_t ac97_queued(void) {
+	IRQ_OFF;
+	uint8_t civ = inportb(_device.nabmbar + AC97_PO_CIV) % AC97_BDL_LEN;
+	uint32_t waiting = (_device.lvi - civ + AC97_BDL_LEN) % AC97_BDL_LEN;
+	/* PICB counts the samples left in the buffer that is playing */
+	uint32_t samples = inports(_device.nabmbar + AC97_PO_PICB) + waiting * (_device.period_size / sizeof(*_device.bufs[0]));
+	IRQ_RES;
+	return samples / 2; /* Two channels */
+}
+
 /* Currently we just assume right and left are the same */
 static int ac97_mixer_read(uint32_t knob_id, uint32_t *val) {
 	uint16_t tmp;
@@ -242,9 +322,6 @@ static int init(void) {
 	_device.nabmbar = pci_read_field(_device.pci_device, AC97_NABMBAR, 2) & ((uint32_t) -1) << 1;
 	_device.nambar = pci_read_field(_device.pci_device, PCI_BAR0, 4) & ((uint32_t) -1) << 1;
 	_device.irq = pci_get_interrupt(_device.pci_device);
-	irq_install_handler(_device.irq, irq_handler, "ac97");
-	/* Enable all matter of interrupts */
-	outportb(_device.nabmbar + AC97_PO_CR, AC97_X_CR_FEIE | AC97_X_CR_IOCE);
 
 	/* Enable bus mastering and disable memory mapped space */
 	pci_write_field(_device.pci_device, PCI_COMMAND, 2, 0x5);
@@ -252,22 +329,16 @@ static int init(void) {
 	outports(_device.nambar + AC97_PCM_OUT_VOLUME, 0x0000);
 
 	/* Allocate our BDL and our buffers */
-	_device.bdl = (void *)kmalloc_p(AC97_BDL_LEN * sizeof(*_device.bdl), &_device.bdl_p);
-	memset(_device.bdl, 0, AC97_BDL_LEN * sizeof(*_device.bdl));
+	uintptr_t phys;
+	_device.bdl = dma_alloc(AC97_BDL_LEN * sizeof(*_device.bdl), ZONE_DMA32, &phys);
+	_device.bdl_p = phys;
 	for (int i = 0; i < AC97_BDL_LEN; i++) {
-		_device.bufs[i] = (uint16_t *)kmalloc_p(AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]),
-												&_device.bdl[i].pointer);
-		memset(_device.bufs[i], 0, AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]));
-		AC97_CL_SET_LENGTH(_device.bdl[i].cl, AC97_BDL_BUFFER_LEN);
-		/* Set all buffers to interrupt */
-		_device.bdl[i].cl |= AC97_CL_IOC;
-
+		/* Each buffer is two pages, which have to be contiguous for the device */
+		_device.bufs[i] = dma_alloc(AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]), ZONE_DMA32, &phys);
+		_device.bdl[i].pointer = phys;
 	}
-	/* Tell the ac97 where our BDL is */
-	outportl(_device.nabmbar + AC97_PO_BDBAR, _device.bdl_p);
-	/* Set the LVI to be the last index */
-	_device.lvi = 2;
-	outportb(_device.nabmbar + AC97_PO_LVI, _device.lvi);
+	_device.periods = AC97_PERIODS_DEFAULT;
+	_device.period_size = AC97_PERIOD_DEFAULT;
 
 	/* detect whether device supports MSB */
 	outports(_device.nambar + AC97_MASTER_VOLUME, 0x2020);
@@ -285,8 +356,10 @@ static int init(void) {
 
 	snd_register(&_snd);
 
-	/* Start things playing */
-	outportb(_device.nabmbar + AC97_PO_CR, inportb(_device.nabmbar + AC97_PO_CR) | AC97_X_CR_RPBM);
+	IRQ_OFF;
+	irq_install_handler(_device.irq, irq_handler, "ac97");
+	ac97_start();
+	IRQ_RES;
 
 	debug_print(NOTICE, "AC97 initialized successfully");
 
@@ -296,12 +369,12 @@ static int init(void) {
 static int fini(void) {
 	snd_unregister(&_snd);
 
-	free(_device.bdl);
 	for (int i = 0; i < AC97_BDL_LEN; i++) {
-		free(_device.bufs[i]);
+		dma_free(_device.bufs[i], AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]));
 	}
+	dma_free(_device.bdl, AC97_BDL_LEN * sizeof(*_device.bdl));
 	return 0;
 }
 
-MODULE_DEF(ac97, init, fini);
+MODULE_DEF_DEFERRED(ac97, init, fini);
 MODULE_DEPENDS(snd);
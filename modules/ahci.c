@@ -0,0 +1,676 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * AHCI SATA Disk Driver
+ *
+ * Provides raw block access to disks on AHCI controllers as /dev/sda,
+ * /dev/sdb... Each port has a list of 32 command slots; a transfer
+ * takes a free slot, describes its buffer with a PRDT entry per page,
+ * and sets the slot's bit in the issue register. Disks that support
+ * native command queuing get READ/WRITE FPDMA QUEUED, which lets the
+ * drive reorder up to 32 outstanding commands; others get the plain
+ * DMA commands, which the controller runs one after another.
+ *
+ * Completions arrive by interrupt. The controller's MSI support isn't
+ * used, as without a local APIC there's nowhere to deliver one; the
+ * legacy PCI interrupt line is used instead.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/fs.h>
+#include <kernel/printf.h>
+#include <kernel/pci.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
+#include <kernel/ata.h>
+
+#include <toaru/list.h>
+
+#define AHCI_SECTOR_SIZE   512
+#define AHCI_MAX_PORTS     32
+#define AHCI_SLOTS         32
+#define AHCI_PRDT_ENTRIES  56  /* Makes each command table 1KiB */
+#define AHCI_MAX_SECTORS   256 /* Per command; 33 pages at most */
+#define AHCI_RETRIES       4
+#define AHCI_TIMEOUT       1000000
+
+/* HBA registers */
+#define AHCI_CAP  0x00
+#define AHCI_GHC  0x04
+#define AHCI_IS   0x08
+#define AHCI_PI   0x0C
+
+#define AHCI_CAP_NCQ   (1 << 30)
+#define AHCI_CAP_SSS   (1 << 27)
+#define AHCI_GHC_AE    (1U << 31)
+#define AHCI_GHC_IE    (1 << 1)
+
+/* Port registers */
+#define AHCI_PORT(p)  (0x100 + (p) * 0x80)
+#define PORT_CLB   0x00
+#define PORT_CLBU  0x04
+#define PORT_FB    0x08
+#define PORT_FBU   0x0C
+#define PORT_IS    0x10
+#define PORT_IE    0x14
+#define PORT_CMD   0x18
+#define PORT_TFD   0x20
+#define PORT_SIG   0x24
+#define PORT_SSTS  0x28
+#define PORT_SERR  0x30
+#define PORT_SACT  0x34
+#define PORT_CI    0x38
+
+#define PORT_CMD_ST   (1 << 0)
+#define PORT_CMD_SUD  (1 << 1)
+#define PORT_CMD_POD  (1 << 2)
+#define PORT_CMD_FRE  (1 << 4)
+#define PORT_CMD_FR   (1 << 14)
+#define PORT_CMD_CR   (1 << 15)
+
+#define PORT_IS_DHRS  (1 << 0)  /* Device to host register FIS */
+#define PORT_IS_PSS   (1 << 1)  /* PIO setup FIS */
+#define PORT_IS_DSS   (1 << 2)  /* DMA setup FIS */
+#define PORT_IS_SDBS  (1 << 3)  /* Set device bits FIS; NCQ completions */
+#define PORT_IS_ERROR 0x7D800010 /* Any of the fatal and non-fatal error bits */
+
+#define PORT_TFD_BSY  0x80
+#define PORT_TFD_DRQ  0x08
+#define PORT_TFD_ERR  0x01
+
+#define SATA_SIG_ATA  0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA    0x60
+#define ATA_CMD_WRITE_FPDMA   0x61
+
+struct ahci_command_header {
+	uint16_t flags;  /* FIS length in dwords, write bit, ... */
+	uint16_t prdtl;  /* PRDT entries */
+	volatile uint32_t prdbc; /* Bytes transferred */
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+#define CMD_HEADER_WRITE (1 << 6)
+#define CMD_HEADER_CLEAR (1 << 10) /* Clear busy on R_OK */
+
+struct ahci_prdt_entry {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc; /* Byte count - 1; bit 31 interrupts on completion */
+} __attribute__((packed));
+
+struct ahci_command_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prdt_entry prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed));
+
+typedef struct {
+	volatile int done;
+	volatile int error;
+} ahci_request_t;
+
+struct ahci_port {
+	int index;
+	uintptr_t base; /* Port registers */
+
+	struct ahci_command_header * command_list;
+	uintptr_t command_list_phys;
+	struct ahci_command_table * tables;
+	uintptr_t tables_phys;
+
+	int ncq;
+	uint32_t slots_mask;  /* Slots we may use */
+	uint32_t busy;        /* Slots with a command outstanding */
+	ahci_request_t * requests[AHCI_SLOTS];
+	list_t * waiters;     /* For finished commands and free slots */
+
+	uint64_t sectors;
+	ata_identify_t identity;
+};
+
+static uintptr_t ahci_base = 0;
+static uint32_t ahci_pci = 0;
+static int ahci_irq = 0;
+static uint32_t ahci_cap = 0;
+static struct ahci_port * ahci_ports[AHCI_MAX_PORTS];
+static char ahci_drive_char = 'a';
+
+static uint32_t mmio_read32(uintptr_t addr) {
+	return *((volatile uint32_t*)(addr));
+}
+static void mmio_write32(uintptr_t addr, uint32_t val) {
+	(*((volatile uint32_t*)(addr))) = val;
+}
+
+static uint32_t port_read(struct ahci_port * port, int reg) {
+	return mmio_read32(port->base + reg);
+}
+static void port_write(struct ahci_port * port, int reg, uint32_t val) {
+	mmio_write32(port->base + reg, val);
+}
+
+static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (pci_find_type(device) == PCI_TYPE_SATA && pci_read_field(device, PCI_PROG_IF, 1) == 0x01) {
+		*((uint32_t *)extra) = device;
+	}
+}
+
+static int ahci_wait_clear(struct ahci_port * port, int reg, uint32_t bits) {
+	for (int i = 0; i < AHCI_TIMEOUT; ++i) {
+		if (!(port_read(port, reg) & bits)) return 0;
+	}
+	return 1;
+}
+
+static void ahci_port_stop(struct ahci_port * port) {
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_ST);
+	ahci_wait_clear(port, PORT_CMD, PORT_CMD_CR);
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_FRE);
+	ahci_wait_clear(port, PORT_CMD, PORT_CMD_FR);
+}
+
+static void ahci_port_start(struct ahci_port * port) {
+	ahci_wait_clear(port, PORT_TFD, PORT_TFD_BSY | PORT_TFD_DRQ);
+	port_write(port, PORT_SERR, 0xFFFFFFFF);
+	port_write(port, PORT_IS, 0xFFFFFFFF);
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_FRE);
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_ST);
+}
+
+/*
+ * Fill slot `slot`'s command header and table for a transfer of
+ * `sectors` sectors at `lba` to or from `buf` (kernel memory).
+ */
+static void ahci_build(struct ahci_port * port, int slot, uint8_t command, uint64_t lba, unsigned int sectors, uint8_t * buf, size_t size, int write) {
+	struct ahci_command_header * header = &port->command_list[slot];
+	struct ahci_command_table * table = &port->tables[slot];
+
+	int entry = 0;
+	uintptr_t addr = (uintptr_t)buf;
+	uintptr_t end = addr + size;
+	while (addr < end) {
+		uintptr_t chunk = 0x1000 - (addr & 0xFFF);
+		if (chunk > end - addr) chunk = end - addr;
+		assert(entry < AHCI_PRDT_ENTRIES);
+		table->prdt[entry].dba  = map_to_physical(addr);
+		table->prdt[entry].dbau = 0;
+		table->prdt[entry].reserved = 0;
+		table->prdt[entry].dbc  = chunk - 1;
+		entry++;
+		addr += chunk;
+	}
+
+	uint8_t * fis = table->cfis;
+	memset(fis, 0, 20);
+	fis[0] = FIS_TYPE_REG_H2D;
+	fis[1] = 0x80; /* This is a command */
+	fis[2] = command;
+	fis[4] = lba & 0xFF;
+	fis[5] = (lba >> 8) & 0xFF;
+	fis[6] = (lba >> 16) & 0xFF;
+	fis[7] = 0x40; /* LBA */
+	fis[8] = (lba >> 24) & 0xFF;
+	fis[9] = (lba >> 32) & 0xFF;
+	fis[10] = (lba >> 40) & 0xFF;
+	if (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA) {
+		/* Queued commands take the count in the features field and the tag in the count */
+		fis[3]  = sectors & 0xFF;
+		fis[11] = (sectors >> 8) & 0xFF;
+		fis[12] = slot << 3;
+	} else {
+		fis[12] = sectors & 0xFF;
+		fis[13] = (sectors >> 8) & 0xFF;
+	}
+
+	header->flags = 5 /* dwords of FIS */ | (write ? CMD_HEADER_WRITE : 0) | CMD_HEADER_CLEAR;
+	header->prdtl = entry;
+	header->prdbc = 0;
+	header->ctba  = port->tables_phys + slot * sizeof(struct ahci_command_table);
+	header->ctbau = 0;
+}
+
+/*
+ * Something went wrong: fail everything outstanding and restart the
+ * port, which is the simplest way to recover NCQ state.
+ * Called from the interrupt handler.
+ */
+static void ahci_port_error(struct ahci_port * port, uint32_t status) {
+	debug_print(WARNING, "ahci: port %d error, IS=0x%x TFD=0x%x SERR=0x%x", port->index,
+		status, port_read(port, PORT_TFD), port_read(port, PORT_SERR));
+
+	ahci_port_stop(port);
+	for (int slot = 0; slot < AHCI_SLOTS; ++slot) {
+		if (port->busy & (1U << slot)) {
+			port->requests[slot]->error = 1;
+			port->requests[slot]->done = 1;
+			port->requests[slot] = NULL;
+		}
+	}
+	port->busy = 0;
+	ahci_port_start(port);
+}
+
+static int ahci_irq_handler(struct regs *r) {
+	uint32_t pending = mmio_read32(ahci_base + AHCI_IS);
+	if (!pending) {
+		return 0;
+	}
+
+	for (int p = 0; p < AHCI_MAX_PORTS; ++p) {
+		if (!(pending & (1U << p))) continue;
+		struct ahci_port * port = ahci_ports[p];
+		if (!port) {
+			continue;
+		}
+
+		uint32_t status = port_read(port, PORT_IS);
+		port_write(port, PORT_IS, status);
+
+		if (status & PORT_IS_ERROR) {
+			ahci_port_error(port, status);
+		} else {
+			/* Queued commands are done once the drive clears their SActive bit */
+			uint32_t outstanding = port->ncq ? port_read(port, PORT_SACT) : port_read(port, PORT_CI);
+			uint32_t finished = port->busy & ~outstanding;
+			for (int slot = 0; finished; ++slot) {
+				if (!(finished & (1U << slot))) continue;
+				finished &= ~(1U << slot);
+				port->requests[slot]->done = 1;
+				port->requests[slot] = NULL;
+				port->busy &= ~(1U << slot);
+			}
+		}
+		wakeup_queue(port->waiters);
+	}
+
+	mmio_write32(ahci_base + AHCI_IS, pending);
+	irq_ack(ahci_irq);
+	return 1;
+}
+
+/*
+ * Issue one command and sleep until it finishes.
+ *
+ * @returns 0 on success, 1 on error
+ */
+static int ahci_command(struct ahci_port * port, uint64_t lba, unsigned int sectors, uint8_t * buf, int write) {
+	ahci_request_t request = { .done = 0, .error = 0 };
+	uint8_t command = port->ncq ?
+		(write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA) :
+		(write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+
+	IRQ_OFF;
+	while ((port->busy & port->slots_mask) == port->slots_mask) {
+		sleep_on(port->waiters);
+	}
+	int slot = 0;
+	while (port->busy & (1U << slot)) slot++;
+	port->busy |= (1U << slot);
+	port->requests[slot] = &request;
+
+	ahci_build(port, slot, command, lba, sectors, buf, sectors * AHCI_SECTOR_SIZE, write);
+	if (port->ncq) {
+		port_write(port, PORT_SACT, 1U << slot);
+	}
+	port_write(port, PORT_CI, 1U << slot);
+
+	while (!request.done) {
+		sleep_on(port->waiters);
+	}
+	IRQ_RES;
+
+	return request.error;
+}
+
+/*
+ * Transfer `sectors` sectors between the device and `buf`.
+ *
+ * Buffers in user memory (or not word-aligned, which the controller
+ * requires) go through a bounce buffer; kernel buffers are used directly.
+ */
+static int ahci_transfer(struct ahci_port * port, uint64_t lba, unsigned int sectors, uint8_t * buf, int write) {
+	if (lba + sectors > port->sectors) return 1;
+
+	size_t size = sectors * AHCI_SECTOR_SIZE;
+	uint8_t * data = buf;
+
+	/* TODO: These virtual address bounds should be in a header somewhere */
+	if ((uintptr_t)buf + size > 0x20000000 || ((uintptr_t)buf & 0x3)) {
+		data = malloc(size);
+		if (write) {
+			memcpy(data, buf, size);
+		}
+	}
+
+	int error;
+	int tries = 0;
+	do {
+		error = ahci_command(port, lba, sectors, data, write);
+	} while (error && ++tries < AHCI_RETRIES);
+
+	if (error) {
+		debug_print(WARNING, "Error during AHCI %s of %d sectors at lba %d", write ? "write" : "read", sectors, (uint32_t)lba);
+	}
+
+	if (data != buf) {
+		if (!write) {
+			memcpy(buf, data, size);
+		}
+		free(data);
+	}
+
+	return error;
+}
+
+static uint32_t read_ahci(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct ahci_port * port = (struct ahci_port *)node->device;
+	uint64_t max_offset = port->sectors * AHCI_SECTOR_SIZE;
+
+	if (offset > max_offset) {
+		return 0;
+	}
+
+	if (offset + size > max_offset) {
+		size = max_offset - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset / AHCI_SECTOR_SIZE;
+	uint64_t end_block = (offset + size - 1) / AHCI_SECTOR_SIZE;
+	unsigned int x_offset = 0;
+
+	if (offset % AHCI_SECTOR_SIZE || size < AHCI_SECTOR_SIZE) {
+		unsigned int prefix_size = (AHCI_SECTOR_SIZE - (offset % AHCI_SECTOR_SIZE));
+		if (prefix_size > size) prefix_size = size;
+		char * tmp = malloc(AHCI_SECTOR_SIZE);
+		ahci_transfer(port, start_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % AHCI_SECTOR_SIZE)), prefix_size);
+
+		free(tmp);
+
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % AHCI_SECTOR_SIZE && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % AHCI_SECTOR_SIZE;
+		char * tmp = malloc(AHCI_SECTOR_SIZE);
+		ahci_transfer(port, end_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
+
+		free(tmp);
+
+		end_block--;
+	}
+
+	while (start_block <= end_block) {
+		unsigned int count = end_block - start_block + 1;
+		if (count > AHCI_MAX_SECTORS) count = AHCI_MAX_SECTORS;
+		ahci_transfer(port, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset), 0);
+		x_offset += count * AHCI_SECTOR_SIZE;
+		start_block += count;
+	}
+
+	return size;
+}
+
+static uint32_t write_ahci(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct ahci_port * port = (struct ahci_port *)node->device;
+	uint64_t max_offset = port->sectors * AHCI_SECTOR_SIZE;
+
+	if (offset > max_offset) {
+		return 0;
+	}
+
+	if (offset + size > max_offset) {
+		size = max_offset - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset / AHCI_SECTOR_SIZE;
+	uint64_t end_block = (offset + size - 1) / AHCI_SECTOR_SIZE;
+	unsigned int x_offset = 0;
+
+	if (offset % AHCI_SECTOR_SIZE || size < AHCI_SECTOR_SIZE) {
+		unsigned int prefix_size = (AHCI_SECTOR_SIZE - (offset % AHCI_SECTOR_SIZE));
+		if (prefix_size > size) prefix_size = size;
+		char * tmp = malloc(AHCI_SECTOR_SIZE);
+		ahci_transfer(port, start_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % AHCI_SECTOR_SIZE)), buffer, prefix_size);
+		ahci_transfer(port, start_block, 1, (uint8_t *)tmp, 1);
+
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % AHCI_SECTOR_SIZE && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % AHCI_SECTOR_SIZE;
+		char * tmp = malloc(AHCI_SECTOR_SIZE);
+		ahci_transfer(port, end_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
+		ahci_transfer(port, end_block, 1, (uint8_t *)tmp, 1);
+
+		free(tmp);
+		end_block--;
+	}
+
+	while (start_block <= end_block) {
+		unsigned int count = end_block - start_block + 1;
+		if (count > AHCI_MAX_SECTORS) count = AHCI_MAX_SECTORS;
+		ahci_transfer(port, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset), 1);
+		x_offset += count * AHCI_SECTOR_SIZE;
+		start_block += count;
+	}
+
+	return size;
+}
+
+static void open_ahci(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_ahci(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * ahci_device_create(struct ahci_port * port) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	sprintf(fnode->name, "ahcidev%d", ahci_drive_char - 'a');
+	fnode->device  = port;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = port->sectors * AHCI_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_ahci;
+	fnode->write   = write_ahci;
+	fnode->open    = open_ahci;
+	fnode->close   = close_ahci;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = NULL;
+	return fnode;
+}
+
+/*
+ * IDENTIFY DEVICE, before interrupts are on for the port; polled.
+ */
+static int ahci_identify(struct ahci_port * port) {
+	uintptr_t phys;
+	uint16_t * buf = dma_alloc(0x1000, ZONE_DMA32, &phys);
+	if (!buf) return 1;
+
+	struct ahci_command_header * header = &port->command_list[0];
+	struct ahci_command_table * table = &port->tables[0];
+	memset(table->cfis, 0, 20);
+	table->cfis[0] = FIS_TYPE_REG_H2D;
+	table->cfis[1] = 0x80;
+	table->cfis[2] = ATA_CMD_IDENTIFY;
+	table->prdt[0].dba  = phys;
+	table->prdt[0].dbau = 0;
+	table->prdt[0].dbc  = sizeof(ata_identify_t) - 1;
+	header->flags = 5;
+	header->prdtl = 1;
+	header->prdbc = 0;
+	header->ctba  = port->tables_phys;
+	header->ctbau = 0;
+
+	port_write(port, PORT_CI, 1);
+	int error = ahci_wait_clear(port, PORT_CI, 1) || (port_read(port, PORT_TFD) & PORT_TFD_ERR);
+	port_write(port, PORT_IS, 0xFFFFFFFF);
+
+	if (!error) {
+		memcpy(&port->identity, buf, sizeof(ata_identify_t));
+		uint8_t * ptr = (uint8_t *)&port->identity.model;
+		for (int i = 0; i < 39; i+=2) {
+			uint8_t tmp = ptr[i+1];
+			ptr[i+1] = ptr[i];
+			ptr[i] = tmp;
+		}
+		port->identity.model[39] = 0;
+
+		port->sectors = port->identity.sectors_48;
+		if (!port->sectors) port->sectors = port->identity.sectors_28;
+
+		/* Word 76 bit 8 is NCQ support; word 75 the queue depth, less one */
+		port->ncq = (ahci_cap & AHCI_CAP_NCQ) && (buf[76] & (1 << 8));
+		if (port->ncq) {
+			int depth = (buf[75] & 0x1F) + 1;
+			port->slots_mask &= (depth == 32) ? 0xFFFFFFFF : ((1U << depth) - 1);
+		}
+	}
+
+	dma_free(buf, 0x1000);
+	return error;
+}
+
+static void ahci_port_init(int p) {
+	struct ahci_port * port = malloc(sizeof(struct ahci_port));
+	memset(port, 0, sizeof(struct ahci_port));
+	port->index = p;
+	port->base = ahci_base + AHCI_PORT(p);
+
+	uint32_t ssts = port_read(port, PORT_SSTS);
+	if ((ssts & 0xF) != 3 || ((ssts >> 8) & 0xF) != 1) {
+		/* Nothing attached, or it's asleep */
+		free(port);
+		return;
+	}
+
+	if (port_read(port, PORT_SIG) != SATA_SIG_ATA) {
+		debug_print(NOTICE, "ahci: port %d has a non-disk device (0x%x)", p, port_read(port, PORT_SIG));
+		free(port);
+		return;
+	}
+
+	ahci_port_stop(port);
+
+	/* Command list (1KiB) and received FIS area (256 bytes) share a page */
+	uint8_t * page = dma_alloc(0x1000, ZONE_DMA32, &port->command_list_phys);
+	port->command_list = (void *)page;
+	port->tables = dma_alloc(sizeof(struct ahci_command_table) * AHCI_SLOTS, ZONE_DMA32, &port->tables_phys);
+	if (!page || !port->tables) {
+		debug_print(ERROR, "ahci: no memory for port %d", p);
+		free(port);
+		return;
+	}
+
+	port_write(port, PORT_CLB,  port->command_list_phys);
+	port_write(port, PORT_CLBU, 0);
+	port_write(port, PORT_FB,   port->command_list_phys + 0x400);
+	port_write(port, PORT_FBU,  0);
+
+	if (ahci_cap & AHCI_CAP_SSS) {
+		port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_SUD | PORT_CMD_POD);
+	}
+
+	ahci_port_start(port);
+
+	int slots = ((ahci_cap >> 8) & 0x1F) + 1;
+	port->slots_mask = (slots == 32) ? 0xFFFFFFFF : ((1U << slots) - 1);
+
+	if (ahci_identify(port)) {
+		debug_print(WARNING, "ahci: IDENTIFY failed on port %d", p);
+		ahci_port_stop(port);
+		return;
+	}
+
+	port->waiters = list_create();
+	ahci_ports[p] = port;
+	port_write(port, PORT_IE, PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_DSS | PORT_IS_SDBS | PORT_IS_ERROR);
+
+	char devname[64];
+	sprintf((char *)&devname, "/dev/sd%c", ahci_drive_char);
+	vfs_mount(devname, ahci_device_create(port));
+	ahci_drive_char++;
+
+	int depth = 0;
+	for (uint32_t m = port->slots_mask; m; m >>= 1) depth++;
+	debug_print(NOTICE, "%s: %s, %d sectors, %s with %d slots", devname, port->identity.model,
+		(uint32_t)port->sectors, port->ncq ? "NCQ" : "no NCQ", depth);
+}
+
+static int ahci_initialize(void) {
+	pci_scan(&find_ahci, -1, &ahci_pci);
+
+	if (!ahci_pci) {
+		debug_print(NOTICE, "No AHCI controller found.");
+		return 0;
+	}
+
+	uint16_t command_reg = pci_read_field(ahci_pci, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1); /* Bus master, memory space */
+	pci_write_field(ahci_pci, PCI_COMMAND, 2, command_reg);
+
+	ahci_base = pci_read_field(ahci_pci, PCI_BAR5, 4) & 0xFFFFF000;
+	for (uintptr_t x = 0; x < 0x2000; x += 0x1000) {
+		uintptr_t addr = ahci_base + x;
+		dma_frame(get_page(addr, 1, kernel_directory), 1, 1, addr);
+	}
+
+	mmio_write32(ahci_base + AHCI_GHC, mmio_read32(ahci_base + AHCI_GHC) | AHCI_GHC_AE);
+	ahci_cap = mmio_read32(ahci_base + AHCI_CAP);
+	uint32_t implemented = mmio_read32(ahci_base + AHCI_PI);
+
+	debug_print(NOTICE, "ahci: controller 0x%x at 0x%x, CAP=0x%x, ports=0x%x", ahci_pci, ahci_base, ahci_cap, implemented);
+
+	for (int p = 0; p < AHCI_MAX_PORTS; ++p) {
+		if (implemented & (1U << p)) {
+			ahci_port_init(p);
+		}
+	}
+
+	ahci_irq = pci_get_interrupt(ahci_pci);
+	irq_install_handler(ahci_irq, ahci_irq_handler, "ahci");
+	mmio_write32(ahci_base + AHCI_IS, 0xFFFFFFFF);
+	mmio_write32(ahci_base + AHCI_GHC, mmio_read32(ahci_base + AHCI_GHC) | AHCI_GHC_IE);
+
+	return 0;
+}
+
+static int ahci_finalize(void) {
+	return 0;
+}
+
+MODULE_DEF(ahci, ahci_initialize, ahci_finalize);
@@ -14,6 +14,8 @@
 #include <kernel/fs.h>
 #include <kernel/printf.h>
 #include <kernel/pci.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
 
 /* TODO: Move this to mod/ata.h */
 #include <kernel/ata.h>
@@ -50,10 +52,6 @@ struct ata_device {
 	int slave;
 	int is_atapi;
 	ata_identify_t identity;
-	prdt_t * dma_prdt;
-	uintptr_t dma_prdt_phys;
-	uint8_t * dma_start;
-	uintptr_t dma_start_phys;
 	uint32_t bar4;
 	uint32_t atapi_lba;
 	uint32_t atapi_sector_size;
@@ -65,14 +63,62 @@ static struct ata_device ata_secondary_master = {.io_base = 0x170, .control = 0x
 static struct ata_device ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1};
 
 //static volatile uint8_t ata_lock = 0;
-static spin_lock_t ata_lock = { 0 };
+static kmutex_t ata_lock = KMUTEX_INIT("ata");
 
 /* TODO support other sector sizes */
 #define ATA_SECTOR_SIZE 512
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector_retry(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+/*
+ * Largest single DMA transfer. The PRDT has room for at least
+ * one entry per page of this, plus one for each request merged
+ * into the transfer starting partway through a page.
+ */
+#define ATA_DMA_MAX_SECTORS 256
+#define ATA_PRDT_ENTRIES    (0x1000 / sizeof(prdt_t))
+#define ATA_RETRIES         4
+
+/* Most CD sectors asked for in one packet command, and most bytes per data block */
+#define ATAPI_MAX_SECTORS   32
+#define ATAPI_BYTE_LIMIT    0xF800
+
+/*
+ * Bus mastering state. Only one transfer is ever in flight
+ * (under ata_lock), so all devices share the PRDT.
+ */
+static prdt_t * ata_dma_prdt;
+static uintptr_t ata_dma_prdt_phys;
+static struct ata_device * volatile ata_dma_device = NULL;
+static volatile int ata_dma_done = 0;
+static volatile uint8_t ata_dma_status = 0;
+static list_t * ata_dma_waiter;
+
+/*
+ * A queued transfer between a device and a kernel buffer.
+ */
+typedef struct ata_request {
+	struct ata_device * dev;
+	uint64_t lba;
+	unsigned int sectors;
+	uint8_t * buffer;
+	int write;
+	volatile int done;
+	int error;
+} ata_request_t;
+
+/* Pending requests, sorted by device and LBA */
+static list_t * ata_queue;
+static list_t * ata_queue_waiter;
+static spin_lock_t ata_queue_lock = { 0 };
+static int ata_dispatching = 0;
+
+/* Where the elevator is; it sweeps upwards from here */
+static struct ata_device * ata_head_dev = NULL;
+static uint64_t ata_head_lba = 0;
+
+static int ata_device_read_sectors(struct ata_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buf);
+static int ata_device_write_sectors(struct ata_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buf);
+static void ata_device_read_sectors_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf, unsigned int sectors);
+#define ata_device_read_sector_atapi(a,b,c) ata_device_read_sectors_atapi(a,b,c,1)
 static uint32_t read_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
 static uint32_t write_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
 static void     open_ata(fs_node_t *node, unsigned int flags);
@@ -124,7 +170,7 @@ static uint32_t read_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 		unsigned int prefix_size = (ATA_SECTOR_SIZE - (offset % ATA_SECTOR_SIZE));
 		if (prefix_size > size) prefix_size = size;
 		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, start_block, 1, (uint8_t *)tmp);
 
 		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_SECTOR_SIZE)), prefix_size);
 
@@ -137,7 +183,7 @@ static uint32_t read_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 	if ((offset + size)  % ATA_SECTOR_SIZE && start_block <= end_block) {
 		unsigned int postfix_size = (offset + size) % ATA_SECTOR_SIZE;
 		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, end_block, 1, (uint8_t *)tmp);
 
 		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
 
@@ -147,9 +193,11 @@ static uint32_t read_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 	}
 
 	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_SECTOR_SIZE;
-		start_block++;
+		unsigned int count = end_block - start_block + 1;
+		if (count > ATA_DMA_MAX_SECTORS) count = ATA_DMA_MAX_SECTORS;
+		ata_device_read_sectors(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset));
+		x_offset += count * ATA_SECTOR_SIZE;
+		start_block += count;
 	}
 
 	return size;
@@ -200,9 +248,11 @@ static uint32_t read_atapi(fs_node_t *node, uint64_t offset, uint32_t size, uint
 	}
 
 	while (start_block <= end_block) {
-		ata_device_read_sector_atapi(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += dev->atapi_sector_size;
-		start_block++;
+		unsigned int count = end_block - start_block + 1;
+		if (count > ATAPI_MAX_SECTORS) count = ATAPI_MAX_SECTORS;
+		ata_device_read_sectors_atapi(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset), count);
+		x_offset += dev->atapi_sector_size * count;
+		start_block += count;
 	}
 
 	return size;
@@ -236,12 +286,12 @@ static uint32_t write_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8
 		unsigned int prefix_size = (ATA_SECTOR_SIZE - (offset % ATA_SECTOR_SIZE));
 
 		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, start_block, 1, (uint8_t *)tmp);
 
 		debug_print(NOTICE, "Writing first block");
 
 		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_SECTOR_SIZE)), buffer, prefix_size);
-		ata_device_write_sector_retry(dev, start_block, (uint8_t *)tmp);
+		ata_device_write_sectors(dev, start_block, 1, (uint8_t *)tmp);
 
 		free(tmp);
 		x_offset += prefix_size;
@@ -252,22 +302,24 @@ static uint32_t write_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8
 		unsigned int postfix_size = (offset + size) % ATA_SECTOR_SIZE;
 
 		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, end_block, 1, (uint8_t *)tmp);
 
 		debug_print(NOTICE, "Writing last block");
 
 		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
 
-		ata_device_write_sector_retry(dev, end_block, (uint8_t *)tmp);
+		ata_device_write_sectors(dev, end_block, 1, (uint8_t *)tmp);
 
 		free(tmp);
 		end_block--;
 	}
 
 	while (start_block <= end_block) {
-		ata_device_write_sector_retry(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_SECTOR_SIZE;
-		start_block++;
+		unsigned int count = end_block - start_block + 1;
+		if (count > ATA_DMA_MAX_SECTORS) count = ATA_DMA_MAX_SECTORS;
+		ata_device_write_sectors(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset));
+		x_offset += count * ATA_SECTOR_SIZE;
+		start_block += count;
 	}
 
 	return size;
@@ -365,8 +417,25 @@ static void ata_soft_reset(struct ata_device * dev) {
 	outportb(dev->control, 0x00);
 }
 
+/*
+ * Wake the dispatcher if the DMA transfer in flight
+ * on the channel at `io_base` has finished.
+ */
+static void ata_dma_interrupt(int io_base) {
+	struct ata_device * dev = ata_dma_device;
+	if (dev && dev->io_base == io_base) {
+		uint8_t status = inportb(dev->bar4 + 0x02);
+		if (status & 0x04) {
+			ata_dma_status = status;
+			ata_dma_done = 1;
+			wakeup_queue(ata_dma_waiter);
+		}
+	}
+}
+
 static int ata_irq_handler(struct regs *r) {
 	inportb(ata_primary_master.io_base + ATA_REG_STATUS);
+	ata_dma_interrupt(ata_primary_master.io_base);
 	if (atapi_in_progress) {
 		wakeup_queue(atapi_waiter);
 	}
@@ -376,6 +445,7 @@ static int ata_irq_handler(struct regs *r) {
 
 static int ata_irq_handler_s(struct regs *r) {
 	inportb(ata_secondary_master.io_base + ATA_REG_STATUS);
+	ata_dma_interrupt(ata_secondary_master.io_base);
 	if (atapi_in_progress) {
 		wakeup_queue(atapi_waiter);
 	}
@@ -421,16 +491,6 @@ static void ata_device_init(struct ata_device * dev) {
 	debug_print(NOTICE, "Sectors (24): %d", dev->identity.sectors_28);
 
 	debug_print(NOTICE, "Setting up DMA...");
-	dev->dma_prdt  = (void *)kvmalloc_p(sizeof(prdt_t) * 1, &dev->dma_prdt_phys);
-	dev->dma_start = (void *)kvmalloc_p(4096, &dev->dma_start_phys);
-
-	debug_print(NOTICE, "Putting prdt    at 0x%x (0x%x phys)", dev->dma_prdt, dev->dma_prdt_phys);
-	debug_print(NOTICE, "Putting prdt[0] at 0x%x (0x%x phys)", dev->dma_start, dev->dma_start_phys);
-
-	dev->dma_prdt[0].offset = dev->dma_start_phys;
-	dev->dma_prdt[0].bytes = 512;
-	dev->dma_prdt[0].last = 0x8000;
-
 	debug_print(NOTICE, "ATA PCI device ID: 0x%x", ata_pci);
 
 	uint16_t command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
@@ -450,6 +510,10 @@ static void ata_device_init(struct ata_device * dev) {
 
 	if (dev->bar4 & 0x00000001) {
 		dev->bar4 = dev->bar4 & 0xFFFFFFFC;
+		/* The secondary channel's bus master registers follow the primary's */
+		if (dev->io_base == ata_secondary_master.io_base) {
+			dev->bar4 += 0x08;
+		}
 	} else {
 		debug_print(WARNING, "? ATA bus master registers are /usually/ I/O ports.\n");
 		return; /* No DMA because we're not sure what to do here */
@@ -620,24 +684,41 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
+/*
+ * Fill the PRDT for a batch of requests that are being
+ * transferred together, one entry per page of each buffer.
+ */
+static void ata_dma_prepare(ata_request_t ** batch, size_t count) {
+	size_t entry = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uintptr_t addr = (uintptr_t)batch[i]->buffer;
+		uintptr_t end  = addr + batch[i]->sectors * ATA_SECTOR_SIZE;
+		while (addr < end) {
+			uintptr_t chunk = 0x1000 - (addr & 0xFFF);
+			if (chunk > end - addr) chunk = end - addr;
+			assert(entry < ATA_PRDT_ENTRIES);
+			ata_dma_prdt[entry].offset = map_to_physical(addr);
+			ata_dma_prdt[entry].bytes  = chunk;
+			ata_dma_prdt[entry].last   = 0;
+			entry++;
+			addr += chunk;
+		}
+	}
+	ata_dma_prdt[entry-1].last = 0x8000;
+}
+
+/*
+ * Run one DMA transfer of `sectors` sectors at `lba`, with the
+ * PRDT already filled in, sleeping until the controller interrupts.
+ *
+ * Must be called with ata_lock held.
+ *
+ * @returns 0 on success, 1 on error
+ */
+static int ata_dma_transfer(struct ata_device * dev, uint64_t lba, unsigned int sectors, int write) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
-
-	if (dev->is_atapi) return;
-
-#if 0
-	debug_print(ERROR, "Request to read sector %8x%8x",
-			(uint32_t)(lba >> 32),
-			(uint32_t)(lba & 0xFFFFFFFF));
-#endif
-
-	spin_lock(ata_lock);
-
-#if 0
-	int errors = 0;
-try_again:
-#endif
+	uint8_t direction = write ? 0x00 : 0x08;
 
 	ata_wait(dev, 0);
 
@@ -645,101 +726,175 @@ try_again:
 	outportb(dev->bar4, 0x00);
 
 	/* Set the PRDT */
-	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
+	outportl(dev->bar4 + 0x04, ata_dma_prdt_phys);
 
 	/* Enable error, irq status */
 	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
 
-	/* set read */
-	outportb(dev->bar4, 0x08);
+	/* Set the direction */
+	outportb(dev->bar4, direction);
 
-	IRQ_ON;
 	while (1) {
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
 		if (!(status & ATA_SR_BSY)) break;
 	}
 
-	outportb(bus + ATA_REG_CONTROL, 0x00);
+	/* Make sure the device will interrupt us */
+	outportb(dev->control, 0x00);
 	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
 	ata_io_wait(dev);
 	outportb(bus + ATA_REG_FEATURES, 0x00);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
+	outportb(bus + ATA_REG_SECCOUNT0, (sectors >> 8) & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 1);
+	outportb(bus + ATA_REG_SECCOUNT0, sectors & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
 
-	//outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
-#if 1
 	while (1) {
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
 		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
 	}
-#endif
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_DMA_EXT);
 
+	/*
+	 * Interrupts stay off until we are on the wait queue,
+	 * so the completion can't slip in before we sleep.
+	 */
+	IRQ_OFF;
+	ata_dma_done   = 0;
+	ata_dma_device = dev;
+
+	outportb(bus + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
 	ata_io_wait(dev);
 
-	outportb(dev->bar4, 0x08 | 0x01);
+	outportb(dev->bar4, direction | 0x01);
 
-	while (1) {
-		int status = inportb(dev->bar4 + 0x02);
-		int dstatus = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
+	while (!ata_dma_done) {
+		sleep_on(ata_dma_waiter);
+	}
+	ata_dma_device = NULL;
+	IRQ_RES;
+
+	/* Stop, and inform device we are done. */
+	outportb(dev->bar4, direction);
+	uint8_t status = inportb(bus + ATA_REG_STATUS);
+	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+
+	if ((ata_dma_status & 0x02) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+		return 1;
+	}
+
+	if (write) {
+		outportb(bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH_EXT);
+		ata_wait(dev, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Does request `a` sort before `b` in the queue?
+ */
+static int ata_request_before(ata_request_t * a, struct ata_device * dev, uint64_t lba) {
+	if (a->dev != dev) return (uintptr_t)a->dev < (uintptr_t)dev;
+	return a->lba < lba;
+}
+
+/*
+ * Pick the next request for the elevator: the first one at or
+ * past the current head position, wrapping around to the start
+ * of the queue when we reach the end.
+ *
+ * Must be called with ata_queue_lock held.
+ */
+static node_t * ata_elevator_next(void) {
+	foreach(node, ata_queue) {
+		if (!ata_request_before(node->value, ata_head_dev, ata_head_lba)) {
+			return node;
 		}
 	}
-	IRQ_OFF;
+	return ata_queue->head;
+}
 
-#if 0
-	if (ata_wait(dev, 1)) {
-		debug_print(WARNING, "Error during ATA read of lba block %d", lba);
-		errors++;
-		if (errors > 4) {
-			debug_print(WARNING, "-- Too many errors trying to read this block. Bailing.");
-			spin_unlock(ata_lock);
+/*
+ * Serve queued requests until the queue is empty, merging
+ * runs of adjacent requests into single transfers.
+ */
+static void ata_dispatch(void) {
+	ata_request_t * batch[ATA_DMA_MAX_SECTORS];
+
+	while (1) {
+		spin_lock(ata_queue_lock);
+		node_t * node = ata_elevator_next();
+		if (!node) {
+			ata_dispatching = 0;
+			spin_unlock(ata_queue_lock);
 			return;
 		}
-		goto try_again;
-	}
-#endif
 
-	/* Copy from DMA buffer to output buffer. */
-	memcpy(buf, dev->dma_start, 512);
+		ata_request_t * first = node->value;
+		size_t count = 0;
+		unsigned int sectors = 0;
+
+		while (node) {
+			ata_request_t * request = node->value;
+			if (count) {
+				if (request->dev != first->dev || request->write != first->write) break;
+				if (request->lba != first->lba + sectors) break;
+				if (sectors + request->sectors > ATA_DMA_MAX_SECTORS) break;
+			}
+			node_t * next = node->next;
+			list_delete(ata_queue, node);
+			free(node);
+			batch[count++] = request;
+			sectors += request->sectors;
+			node = next;
+		}
 
-	/* Inform device we are done. */
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+		ata_head_dev = first->dev;
+		ata_head_lba = first->lba + sectors;
+		spin_unlock(ata_queue_lock);
 
-#if 0
-	int size = 256;
-	inportsm(bus,buf,size);
-	ata_wait(dev, 0);
-	outportb(bus + ATA_REG_CONTROL, 0x02);
-#endif
-	spin_unlock(ata_lock);
+		kmutex_lock(&ata_lock);
+		ata_dma_prepare(batch, count);
+		int error = ata_dma_transfer(first->dev, first->lba, sectors, first->write);
+		kmutex_unlock(&ata_lock);
+
+		for (size_t i = 0; i < count; ++i) {
+			batch[i]->error = error;
+			batch[i]->done  = 1;
+		}
+		wakeup_queue(ata_queue_waiter);
+	}
 }
 
-static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
+/*
+ * Read a run of sectors with one READ (12) command. The drive hands
+ * the data over in blocks of up to the byte count limit we give it,
+ * each announced by an interrupt; we sleep for the first and poll
+ * for the rest, as the next one can come in before we'd be back on
+ * the wait queue.
+ */
+static void ata_device_read_sectors_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf, unsigned int sectors) {
 
 	if (!dev->is_atapi) return;
 
 	uint16_t bus = dev->io_base;
-	spin_lock(ata_lock);
+	uint32_t limit = dev->atapi_sector_size * sectors;
+	if (limit > ATAPI_BYTE_LIMIT) limit = ATAPI_BYTE_LIMIT - ATAPI_BYTE_LIMIT % dev->atapi_sector_size;
+
+	kmutex_lock(&ata_lock);
 
 	outportb(dev->io_base + ATA_REG_HDDEVSEL, 0xA0 | dev->slave << 4);
 	ata_io_wait(dev);
 
 	outportb(bus + ATA_REG_FEATURES, 0x00);
-	outportb(bus + ATA_REG_LBA1, dev->atapi_sector_size & 0xFF);
-	outportb(bus + ATA_REG_LBA2, dev->atapi_sector_size >> 8);
+	outportb(bus + ATA_REG_LBA1, limit & 0xFF);
+	outportb(bus + ATA_REG_LBA2, limit >> 8);
 	outportb(bus + ATA_REG_COMMAND, ATA_CMD_PACKET);
 
 	/* poll */
@@ -759,10 +914,10 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 	command.command_bytes[3] = (lba >> 0x10) & 0xFF;
 	command.command_bytes[4] = (lba >> 0x08) & 0xFF;
 	command.command_bytes[5] = (lba >> 0x00) & 0xFF;
-	command.command_bytes[6] = 0;
-	command.command_bytes[7] = 0;
-	command.command_bytes[8] = 0; /* bit 0 = PMI (0, last sector) */
-	command.command_bytes[9] = 1; /* control */
+	command.command_bytes[6] = (sectors >> 0x18) & 0xFF;
+	command.command_bytes[7] = (sectors >> 0x10) & 0xFF;
+	command.command_bytes[8] = (sectors >> 0x08) & 0xFF;
+	command.command_bytes[9] = (sectors >> 0x00) & 0xFF;
 	command.command_bytes[10] = 0;
 	command.command_bytes[11] = 0;
 
@@ -775,17 +930,21 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 
 	atapi_in_progress = 0;
 
-	while (1) {
+	uint32_t remaining = dev->atapi_sector_size * sectors;
+	while (remaining) {
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
 		if ((status & ATA_SR_ERR)) goto atapi_error_on_read_setup;
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ)) break;
-	}
-
-	uint16_t size_to_read = inportb(bus + ATA_REG_LBA2) << 8;
-	size_to_read = size_to_read | inportb(bus + ATA_REG_LBA1);
+		if (status & ATA_SR_BSY) continue;
+		if (!(status & ATA_SR_DRQ)) break;
 
+		uint16_t size_to_read = inportb(bus + ATA_REG_LBA2) << 8;
+		size_to_read = size_to_read | inportb(bus + ATA_REG_LBA1);
+		if (size_to_read > remaining) size_to_read = remaining;
 
-	inportsm(bus,buf,size_to_read/2);
+		inportsm(bus,buf,size_to_read/2);
+		buf += size_to_read;
+		remaining -= size_to_read;
+	}
 
 	while (1) {
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
@@ -794,71 +953,107 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 	}
 
 atapi_error_on_read_setup:
-	spin_unlock(ata_lock);
+	kmutex_unlock(&ata_lock);
 
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	uint16_t bus = dev->io_base;
-	uint8_t slave = dev->slave;
+/*
+ * Queue a transfer and wait for it to finish. If nobody is
+ * serving the queue yet, we do it ourselves.
+ *
+ * `buffer` must be kernel memory, as it may be accessed
+ * from another process.
+ *
+ * @returns 0 on success, 1 on error
+ */
+static int ata_queue_request(struct ata_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buffer, int write) {
+	ata_request_t request = {
+		.dev = dev,
+		.lba = lba,
+		.sectors = sectors,
+		.buffer = buffer,
+		.write = write,
+		.done = 0,
+		.error = 0,
+	};
+
+	spin_lock(ata_queue_lock);
+	node_t * before = NULL;
+	foreach(node, ata_queue) {
+		if (!ata_request_before(node->value, dev, lba)) {
+			before = node;
+			break;
+		}
+	}
+	if (before) {
+		list_insert_before(ata_queue, before, &request);
+	} else {
+		list_insert(ata_queue, &request);
+	}
+	int dispatch = !ata_dispatching;
+	ata_dispatching = 1;
+	spin_unlock(ata_queue_lock);
 
-#if 0
-	debug_print(ERROR, "Request to write sector %8x%8x",
-			(uint32_t)(lba >> 32),
-			(uint32_t)(lba & 0xFFFFFFFF));
-	debug_print(ERROR, "Some data from buf: [%2x %2x %2x %2x]", buf[0], buf[1], buf[2], buf[3]);
-#endif
+	if (dispatch) {
+		ata_dispatch();
+	}
 
-	spin_lock(ata_lock);
+	IRQ_OFF;
+	while (!request.done) {
+		sleep_on(ata_queue_waiter);
+	}
+	IRQ_RES;
 
-	outportb(bus + ATA_REG_CONTROL, 0x02);
+	return request.error;
+}
 
-	ata_wait(dev, 0);
-	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
-	ata_wait(dev, 0);
+/*
+ * Transfer `sectors` sectors between the device and `buf`.
+ *
+ * Buffers in user memory (or that the controller can't address)
+ * go through a bounce buffer; kernel buffers are used directly.
+ */
+static int ata_device_transfer(struct ata_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buf, int write) {
+	if (dev->is_atapi) return 1;
+	if (lba + sectors > ata_max_offset(dev) / ATA_SECTOR_SIZE) return 1;
+
+	size_t size = sectors * ATA_SECTOR_SIZE;
+	uint8_t * data = buf;
+
+	/* TODO: These virtual address bounds should be in a header somewhere */
+	if ((uintptr_t)buf + size > 0x20000000 || ((uintptr_t)buf & 0x3)) {
+		data = malloc(size);
+		if (write) {
+			memcpy(data, buf, size);
+		}
+	}
 
-	outportb(bus + ATA_REG_FEATURES, 0x00);
+	int error;
+	int tries = 0;
+	do {
+		error = ata_queue_request(dev, lba, sectors, data, write);
+	} while (error && ++tries < ATA_RETRIES);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
-	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
-	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
-	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
+	if (error) {
+		debug_print(WARNING, "Error during ATA %s of %d sectors at lba %d", write ? "write" : "read", sectors, (uint32_t)lba);
+	}
 
-	outportb(bus + ATA_REG_SECCOUNT0, 1);
-	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
-	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
-	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
+	if (data != buf) {
+		if (!write) {
+			memcpy(buf, data, size);
+		}
+		free(data);
+	}
 
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO_EXT);
-	ata_wait(dev, 0);
-	int size = ATA_SECTOR_SIZE / 2;
-	outportsm(bus,buf,size);
-	outportb(bus + 0x07, ATA_CMD_CACHE_FLUSH);
-	ata_wait(dev, 0);
-	spin_unlock(ata_lock);
+	return error;
 }
 
-static int buffer_compare(uint32_t * ptr1, uint32_t * ptr2, size_t size) {
-	assert(!(size % 4));
-	size_t i = 0;
-	while (i < size) {
-		if (*ptr1 != *ptr2) return 1;
-		ptr1++;
-		ptr2++;
-		i += sizeof(uint32_t);
-	}
-	return 0;
+static int ata_device_read_sectors(struct ata_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buf) {
+	return ata_device_transfer(dev, lba, sectors, buf, 0);
 }
 
-static void ata_device_write_sector_retry(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	uint64_t sectors = dev->identity.sectors_48;
-	if (lba >= sectors) return;
-	uint8_t * read_buf = malloc(ATA_SECTOR_SIZE);
-	do {
-		ata_device_write_sector(dev, lba, buf);
-		ata_device_read_sector(dev, lba, read_buf);
-	} while (buffer_compare((uint32_t *)buf, (uint32_t *)read_buf, ATA_SECTOR_SIZE));
-	free(read_buf);
+static int ata_device_write_sectors(struct ata_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buf) {
+	return ata_device_transfer(dev, lba, sectors, buf, 1);
 }
 
 static int ata_initialize(void) {
@@ -871,6 +1066,10 @@ static int ata_initialize(void) {
 	irq_install_handler(15, ata_irq_handler_s, "ide slave");
 
 	atapi_waiter = list_create();
+	ata_dma_waiter = list_create();
+	ata_queue = list_create();
+	ata_queue_waiter = list_create();
+	ata_dma_prdt = dma_alloc(sizeof(prdt_t) * ATA_PRDT_ENTRIES, ZONE_DMA32, &ata_dma_prdt_phys);
 
 	ata_device_detect(&ata_primary_master);
 	ata_device_detect(&ata_primary_slave);
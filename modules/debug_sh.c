@@ -661,7 +661,7 @@ struct tty_o {
 static void debug_shell_actual(void * data, char * name) {
 
 	current_process->image.entry = 0;
-	fs_node_t * tty = (fs_node_t *)current_process->fds->entries[1];
+	fs_node_t * tty = current_process->fds->entries[1]->node;
 
 	/* Our prompt will include the version number of the current kernel */
 	char version_number[1024];
@@ -685,7 +685,7 @@ static void debug_shell_actual(void * data, char * name) {
 		}
 
 		/* Read a line */
-		if (debug_shell_readline(current_process->fds->entries[0], command, 511) < 0) {
+		if (debug_shell_readline(current_process->fds->entries[0]->node, command, 511) < 0) {
 			kexit(0);
 		}
 
@@ -718,7 +718,7 @@ static void debug_shell_run(void * data, char * name) {
 	fs_node_t * tty = kopen("/dev/ttyS0", 0);
 
 	int fd = process_append_fd((process_t *)current_process, tty);
-	current_process->fds->modes[fd] = 03; /* rw */
+	current_process->fds->entries[fd]->mode = 03; /* rw */
 	process_move_fd((process_t *)current_process, fd, 0);
 	process_move_fd((process_t *)current_process, fd, 1);
 	process_move_fd((process_t *)current_process, fd, 2);
@@ -120,6 +120,30 @@ static int dospart_initialize(void) {
 			break;
 		}
 	}
+	/* Virtio disks */
+	for (char l = 'a'; l < 'z'; ++l) {
+		char name[64];
+		sprintf(name, "/dev/vd%c", l);
+		if (read_partition_map(name)) {
+			break;
+		}
+	}
+	/* AHCI disks */
+	for (char l = 'a'; l < 'z'; ++l) {
+		char name[64];
+		sprintf(name, "/dev/sd%c", l);
+		if (read_partition_map(name)) {
+			break;
+		}
+	}
+	/* USB disks */
+	for (char l = 'a'; l < 'z'; ++l) {
+		char name[64];
+		sprintf(name, "/dev/ud%c", l);
+		if (read_partition_map(name)) {
+			break;
+		}
+	}
 	return 0;
 }
 
@@ -8,6 +8,7 @@
 #include <kernel/printf.h>
 #include <kernel/pci.h>
 #include <kernel/mem.h>
+#include <kernel/dma.h>
 #include <kernel/pipe.h>
 #include <kernel/ipv4.h>
 #include <kernel/mod/net.h>
@@ -21,12 +22,14 @@ static int e1000_irq = 0;
 static uintptr_t mem_base = 0;
 static int has_eeprom = 0;
 static uint8_t mac[6];
-static int rx_index = 0;
-static int tx_index = 0;
+static int rx_index = 0;   /* next descriptor the card will fill */
+static int rx_pending = 0; /* descriptors processed but not yet returned */
+static int rx_discard = 0; /* inside a frame that spans descriptors */
+static int tx_index = 0;   /* next descriptor we will fill */
 
-static list_t * net_queue = NULL;
-static spin_lock_t net_queue_lock = { 0 };
+static spin_lock_t tx_lock = { 0 };
 static list_t * rx_wait;
+static list_t * tx_wait;
 
 static uint32_t mmio_read32(uintptr_t addr) {
 	return *((volatile uint32_t*)(addr));
@@ -43,8 +46,14 @@ static uint32_t read_command(uint16_t addr) {
 	return mmio_read32(mem_base + addr);
 }
 
-#define E1000_NUM_RX_DESC 32
-#define E1000_NUM_TX_DESC 8
+#define E1000_NUM_RX_DESC 64
+#define E1000_NUM_TX_DESC 32
+
+/* Hand processed RX descriptors back at least this often */
+#define E1000_RX_BATCH 16
+
+/* Interrupt throttling, in 256ns units: about 8000 interrupts a second */
+#define E1000_ITR_INTERVAL 488
 
 struct rx_desc {
 	volatile uint64_t addr;
@@ -72,26 +81,6 @@ static struct tx_desc * tx;
 static uintptr_t rx_phys;
 static uintptr_t tx_phys;
 
-static void enqueue_packet(void * buffer) {
-	spin_lock(net_queue_lock);
-	list_insert(net_queue, buffer);
-	spin_unlock(net_queue_lock);
-}
-
-static struct ethernet_packet * dequeue_packet(void) {
-	while (!net_queue->length) {
-		sleep_on(rx_wait);
-	}
-
-	spin_lock(net_queue_lock);
-	node_t * n = list_dequeue(net_queue);
-	void* value = n->value;
-	free(n);
-	spin_unlock(net_queue_lock);
-
-	return value;
-}
-
 static uint8_t* get_mac() {
 	return mac;
 }
@@ -115,8 +104,23 @@ static uint8_t* get_mac() {
 #define E1000_REG_TXDESCHEAD 0x3810
 #define E1000_REG_TXDESCTAIL 0x3818
 
+#define E1000_REG_ICR        0x00C0
+#define E1000_REG_ITR        0x00C4
+#define E1000_REG_IMS        0x00D0
+#define E1000_REG_IMC        0x00D8
+
 #define E1000_REG_RXADDR     0x5400
 
+#define ICR_TXDW                        (1 << 0)    /* Transmit Descriptor Written Back */
+#define ICR_LSC                         (1 << 2)    /* Link Status Change */
+#define ICR_RXDMT0                      (1 << 4)    /* Receive Descriptor Minimum Threshold */
+#define ICR_RXO                         (1 << 6)    /* Receiver Overrun */
+#define ICR_RXT0                        (1 << 7)    /* Receiver Timer Interrupt */
+
+#define RSTA_DD                         (1 << 0)    /* Descriptor Done */
+#define RSTA_EOP                        (1 << 1)    /* End of Packet */
+#define TSTA_DD                         (1 << 0)    /* Descriptor Done */
+
 #define RCTL_EN                         (1 << 1)    /* Receiver Enable */
 #define RCTL_SBP                        (1 << 2)    /* Store Bad Packets */
 #define RCTL_UPE                        (1 << 3)    /* Unicast Promiscuous Enabled */
@@ -224,7 +228,7 @@ static void read_mac(void) {
 
 static int irq_handler(struct regs *r) {
 
-	uint32_t status = read_command(0xc0);
+	uint32_t status = read_command(E1000_REG_ICR);
 
 	if (!status) {
 		return 0;
@@ -232,42 +236,87 @@ static int irq_handler(struct regs *r) {
 
 	irq_ack(e1000_irq);
 
-	if (status & 0x04) {
-		/* Start link */
+	/*
+	 * Descriptors are processed by whoever is waiting on them; all
+	 * that happens here is the wakeup, so one interrupt covers
+	 * however many frames the card finished since the last one.
+	 */
+	if (status & ICR_LSC) {
 		debug_print(E1000_LOG_LEVEL, "start link");
-	} else if (status & 0x10) {
-		/* ?? */
-	} else if (status & ((1 << 6) | (1 << 7))) {
-		/* receive packet */
-		do {
-			rx_index = read_command(E1000_REG_RXDESCTAIL);
-			if (rx_index == (int)read_command(E1000_REG_RXDESCHEAD)) return 1;
-			rx_index = (rx_index + 1) % E1000_NUM_RX_DESC;
-			if (rx[rx_index].status & 0x01) {
-				uint8_t * pbuf = (uint8_t *)rx_virt[rx_index];
-				uint16_t  plen = rx[rx_index].length;
-
-				void * packet = malloc(plen);
-				memcpy(packet, pbuf, plen);
-
-				rx[rx_index].status = 0;
-
-				enqueue_packet(packet);
-
-				write_command(E1000_REG_RXDESCTAIL, rx_index);
-			} else {
-				break;
-			}
-		} while (1);
+	}
+
+	if (status & (ICR_RXT0 | ICR_RXDMT0 | ICR_RXO)) {
 		wakeup_queue(rx_wait);
 	}
 
+	if (status & ICR_TXDW) {
+		wakeup_queue(tx_wait);
+	}
+
 	return 1;
 }
 
+/*
+ * Take the next received frame off the ring. Each RX descriptor points
+ * at a network packet buffer; a filled one is handed up as it is and
+ * replaced with a fresh buffer, so frames aren't copied. The tail is
+ * written back to the card in batches.
+ */
+static struct ethernet_packet * dequeue_packet(void) {
+	while (1) {
+		IRQ_OFF;
+		while (!(rx[rx_index].status & RSTA_DD)) {
+			sleep_on(rx_wait);
+		}
+		IRQ_RES;
+
+		struct rx_desc * desc = &rx[rx_index];
+		void * packet = NULL;
+
+		if (rx_discard || !(desc->status & RSTA_EOP) || desc->errors || desc->length > NET_PACKET_SIZE) {
+			/* Bad or oversized; leave the buffer in the ring */
+			rx_discard = !(desc->status & RSTA_EOP);
+		} else {
+			packet = rx_virt[rx_index];
+			rx_virt[rx_index] = net_packet_alloc();
+			desc->addr = map_to_physical((uintptr_t)rx_virt[rx_index]);
+		}
+		desc->status = 0;
+
+		int done = rx_index;
+		rx_index = (rx_index + 1) % E1000_NUM_RX_DESC;
+
+		if (++rx_pending >= E1000_RX_BATCH || !(rx[rx_index].status & RSTA_DD)) {
+			write_command(E1000_REG_RXDESCTAIL, done);
+			rx_pending = 0;
+		}
+
+		if (packet) {
+			return packet;
+		}
+	}
+}
+
 static void send_packet(uint8_t* payload, size_t payload_size) {
-	tx_index = read_command(E1000_REG_TXDESCTAIL);
-	debug_print(E1000_LOG_LEVEL,"sending packet 0x%x, %d desc[%d]", payload, payload_size, tx_index);
+	if (payload_size > NET_PACKET_SIZE) {
+		debug_print(ERROR, "Packet too big; max is %d, got %d", NET_PACKET_SIZE, payload_size);
+		return;
+	}
+
+	spin_lock(tx_lock);
+
+	/* The card sets DD once it's done with a descriptor */
+	while (!(tx[tx_index].status & TSTA_DD)) {
+		spin_unlock(tx_lock);
+		IRQ_OFF;
+		if (!(tx[tx_index].status & TSTA_DD)) {
+			sleep_on(tx_wait);
+		}
+		IRQ_RES;
+		spin_lock(tx_lock);
+	}
+
+	debug_print(INFO,"sending packet 0x%x, %d desc[%d]", payload, payload_size, tx_index);
 
 	memcpy(tx_virt[tx_index], payload, payload_size);
 	tx[tx_index].length = payload_size;
@@ -276,6 +325,8 @@ static void send_packet(uint8_t* payload, size_t payload_size) {
 
 	tx_index = (tx_index + 1) % E1000_NUM_TX_DESC;
 	write_command(E1000_REG_TXDESCTAIL, tx_index);
+
+	spin_unlock(tx_lock);
 }
 
 static void init_rx(void) {
@@ -289,9 +340,14 @@ static void init_rx(void) {
 	write_command(E1000_REG_RXDESCTAIL, E1000_NUM_RX_DESC - 1);
 
 	rx_index = 0;
+	rx_pending = 0;
+	rx_discard = 0;
 
+	/* 2048-byte buffers, to match NET_PACKET_SIZE */
 	write_command(E1000_REG_RCTRL,
 		RCTL_EN  |
+		RCTL_BAM |
+		RCTL_SECRC |
 		(read_command(E1000_REG_RCTRL) & (~((1 << 17) | (1 << 16)))));
 
 }
@@ -389,8 +445,8 @@ static void e1000_init(void * data, char * name) {
 	sleep_until((process_t *)current_process, s, ss);
 	switch_task(0);
 
-	net_queue = list_create();
 	rx_wait = list_create();
+	tx_wait = list_create();
 
 	e1000_irq = pci_get_interrupt(e1000_device_pci);
 
@@ -418,10 +474,13 @@ static void e1000_init(void * data, char * name) {
 	init_rx();
 	init_tx();
 
+	/* Coalesce interrupts */
+	write_command(E1000_REG_ITR, E1000_ITR_INTERVAL);
+
 	/* Twiddle interrupts */
-	write_command(0x00D0, 0xFF);
-	write_command(0x00D8, 0xFF);
-	write_command(0x00D0,(1 << 2) | (1 << 6) | (1 << 7) | (1 << 1) | (1 << 0));
+	write_command(E1000_REG_IMS, 0xFF);
+	write_command(E1000_REG_IMC, 0xFF);
+	write_command(E1000_REG_IMS, ICR_LSC | ICR_RXO | ICR_RXT0 | ICR_RXDMT0 | ICR_TXDW);
 
 	relative_time(0, 10, &s, &ss);
 	sleep_until((process_t *)current_process, s, ss);
@@ -449,20 +508,23 @@ static int init(void) {
 		dma_frame(get_page(addr, 1, kernel_directory), 1, 1, addr);
 	}
 
-	rx = (void*)kvmalloc_p(sizeof(struct rx_desc) * E1000_NUM_RX_DESC + 16, &rx_phys);
+	rx = dma_alloc(sizeof(struct rx_desc) * E1000_NUM_RX_DESC, ZONE_DMA32, &rx_phys);
 
+	/* Packet buffers are 2048 bytes and never cross a page, so they can take DMA */
 	for (int i = 0; i < E1000_NUM_RX_DESC; ++i) {
-		rx_virt[i] = (void*)kvmalloc_p(8192 + 16, (uint32_t *)&rx[i].addr);
-		debug_print(E1000_LOG_LEVEL, "rx[%d] 0x%x → 0x%x", i, rx_virt[i], (uint32_t)rx[i].addr);
+		rx_virt[i] = net_packet_alloc();
+		rx[i].addr = map_to_physical((uintptr_t)rx_virt[i]);
+		debug_print(INFO, "rx[%d] 0x%x → 0x%x", i, rx_virt[i], (uint32_t)rx[i].addr);
 		rx[i].status = 0;
 	}
 
-	tx = (void*)kvmalloc_p(sizeof(struct tx_desc) * E1000_NUM_TX_DESC + 16, &tx_phys);
+	tx = dma_alloc(sizeof(struct tx_desc) * E1000_NUM_TX_DESC, ZONE_DMA32, &tx_phys);
 
 	for (int i = 0; i < E1000_NUM_TX_DESC; ++i) {
-		tx_virt[i] = (void*)kvmalloc_p(8192+16, (uint32_t *)&tx[i].addr);
-		debug_print(E1000_LOG_LEVEL, "tx[%d] 0x%x → 0x%x", i, tx_virt[i], (uint32_t)tx[i].addr);
-		tx[i].status = 0;
+		tx_virt[i] = net_packet_alloc();
+		tx[i].addr = map_to_physical((uintptr_t)tx_virt[i]);
+		debug_print(INFO, "tx[%d] 0x%x → 0x%x", i, tx_virt[i], (uint32_t)tx[i].addr);
+		tx[i].status = TSTA_DD; /* free for us to fill */
 		tx[i].cmd = (1 << 0);
 	}
 
@@ -4,6 +4,7 @@
  * Copyright (C) 2014-2018 K. Lange
  */
 #include <kernel/system.h>
+#include <kernel/process.h>
 #include <kernel/types.h>
 #include <kernel/fs.h>
 #include <kernel/ext2.h>
@@ -13,6 +14,8 @@
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
 
+#include <toaru/hashmap.h>
+
 #define EXT2_BGD_BLOCK 2
 
 #define E_SUCCESS   0
@@ -23,6 +26,22 @@
 #undef _symlink
 #define _symlink(inode) ((char *)(inode)->block)
 
+#define EXT2_FLUSH_INTERVAL 1  /* Seconds between looks for old dirty blocks */
+#define EXT2_DIRTY_EXPIRE   5  /* Seconds a block can stay dirty before it is written */
+#define EXT2_FLUSH_RUN      32 /* Most blocks written in one request */
+
+#define EXT2_PREALLOC_BLOCKS  32 /* Extra blocks reserved for a file that is growing */
+#define EXT2_PREALLOC_WINDOWS 8  /* Growing files that can have blocks reserved at once */
+
+/*
+ * Blocks reserved for an inode, allocated on disk but not yet in the file
+ */
+typedef struct {
+	uint32_t inode; /* 0 if the window is unused */
+	uint32_t start; /* Next reserved block */
+	uint32_t count; /* Blocks left */
+} ext2_prealloc_t;
+
 /*
  * EXT2 filesystem object
  */
@@ -40,15 +59,33 @@ typedef struct {
 
 	ext2_disk_cache_entry_t * disk_cache;          /* Dynamically allocated array of cache entries */
 	unsigned int              cache_entries;       /* Size of ->disk_cache */
-	unsigned int              cache_time;          /* "timer" that increments with each cache read/write */
+	ext2_disk_cache_entry_t **cache_hash;          /* Hash buckets of cached entries, by block number */
+	unsigned int              cache_hash_size;     /* Number of buckets (a power of two) */
+	ext2_disk_cache_entry_t * cache_mru;           /* Most recently used entry */
+	ext2_disk_cache_entry_t * cache_lru;           /* Least recently used entry, next to be evicted */
 
-	spin_lock_t               lock;                /* Synchronization lock point */
+	kmutex_t                  lock;                /* Synchronization lock point */
 
 	uint8_t                   bgd_block_span;
 	uint8_t                   bgd_offset;
 	unsigned int              inode_size;
 
 	uint8_t *                 cache_data;
+	ext2_disk_cache_entry_t **flush_list;          /* Dirty entries being written out, sorted */
+	uint8_t *                 flush_buffer;        /* EXT2_FLUSH_RUN blocks, to write runs through */
+
+	ext2_prealloc_t           prealloc[EXT2_PREALLOC_WINDOWS];
+	unsigned int              prealloc_next;       /* Window to take over next, when none are free */
+
+	uint32_t *                jnl_map;             /* Where each journal block is, or NULL when not journaling */
+	uint8_t *                 jnl_super;           /* Journal superblock, a whole block */
+	uint32_t                  jnl_limit;           /* Blocks a transaction can log before it should commit */
+	uint32_t                  jnl_count;           /* Blocks logged by the running transaction */
+	unsigned long             jnl_started;         /* When it logged its first block */
+	int                       jnl_handles;         /* Operations in progress */
+	int                       jnl_sync_wanted;     /* Commit once they finish */
+	spin_lock_t               jnl_lock;            /* jnl_handles */
+	int                       sb_dirty;            /* Superblock changed since the last commit */
 
 	int flags;
 } ext2_fs_t;
@@ -81,25 +118,158 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name);
 static unsigned int allocate_block(ext2_fs_t * this);
 
 /**
- * ext2->get_cache_time Increment and return the current cache time
+ * ext2->cache_flush_dirty Flush dirty cache entry to the disk.
  *
- * @returns Current cache time
+ * @param entry Cache entry to dump
+ * @returns Error code or E_SUCCESS
  */
-static unsigned int get_cache_time(ext2_fs_t * this) {
-	return this->cache_time++;
+static void cache_clean(ext2_fs_t * this, ext2_disk_cache_entry_t * entry) {
+	entry->dirty = 0;
+	if (entry->journal) {
+		entry->journal = 0;
+		this->jnl_count--;
+	}
+}
+
+static int cache_flush_dirty(ext2_fs_t * this, ext2_disk_cache_entry_t * entry) {
+	write_fs(this->block_device, (entry->block_no) * this->block_size, this->block_size, (uint8_t *)(entry->block));
+	cache_clean(this, entry);
+
+	return E_SUCCESS;
 }
 
 /**
- * ext2->cache_flush_dirty Flush dirty cache entry to the disk.
+ * ext2->cache_flush Write out dirty cache entries, in block order.
  *
- * @param ent_no Cache entry to dump
- * @returns Error code or E_SUCCESS
+ * Entries for consecutive blocks are gathered up and written with
+ * one request. The filesystem lock must be held.
+ *
+ * @param older_than Only write entries dirtied at or before this time
+ * @param journaled  Write the entries logged by the running transaction
+ *                   (checkpointing it), rather than everything else
+ * @returns Number of blocks written
  */
-static int cache_flush_dirty(ext2_fs_t * this, unsigned int ent_no) {
-	write_fs(this->block_device, (DC[ent_no].block_no) * this->block_size, this->block_size, (uint8_t *)(DC[ent_no].block));
-	DC[ent_no].dirty = 0;
+static unsigned int cache_flush(ext2_fs_t * this, unsigned long older_than, int journaled) {
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < this->cache_entries; ++i) {
+		if (DC[i].dirty && DC[i].dirtied <= older_than && DC[i].journal == journaled) {
+			this->flush_list[count++] = &DC[i];
+		}
+	}
+	if (!count) return 0;
 
-	return E_SUCCESS;
+	/* Shell sort by block number; the list can be the whole cache */
+	for (unsigned int gap = count / 2; gap > 0; gap /= 2) {
+		for (unsigned int i = gap; i < count; ++i) {
+			ext2_disk_cache_entry_t * entry = this->flush_list[i];
+			unsigned int j = i;
+			while (j >= gap && this->flush_list[j - gap]->block_no > entry->block_no) {
+				this->flush_list[j] = this->flush_list[j - gap];
+				j -= gap;
+			}
+			this->flush_list[j] = entry;
+		}
+	}
+
+	unsigned int i = 0;
+	while (i < count) {
+		unsigned int run = 1;
+		while (i + run < count && run < EXT2_FLUSH_RUN &&
+			this->flush_list[i + run]->block_no == this->flush_list[i]->block_no + run) {
+			run++;
+		}
+
+		if (run == 1) {
+			cache_flush_dirty(this, this->flush_list[i]);
+		} else {
+			for (unsigned int j = 0; j < run; ++j) {
+				memcpy(this->flush_buffer + j * this->block_size, this->flush_list[i + j]->block, this->block_size);
+				cache_clean(this, this->flush_list[i + j]);
+			}
+			write_fs(this->block_device, this->flush_list[i]->block_no * this->block_size, run * this->block_size, this->flush_buffer);
+		}
+		i += run;
+	}
+
+	return count;
+}
+
+/**
+ * ext2->cache_find Look up a block in the cache.
+ *
+ * @param block_no Block to find
+ * @returns The cache entry holding the block, or NULL
+ */
+static ext2_disk_cache_entry_t * cache_find(ext2_fs_t * this, unsigned int block_no) {
+	ext2_disk_cache_entry_t * entry = this->cache_hash[block_no & (this->cache_hash_size - 1)];
+	while (entry && entry->block_no != block_no) {
+		entry = entry->hash_next;
+	}
+	return entry;
+}
+
+/**
+ * ext2->cache_touch Mark a cache entry as the most recently used.
+ */
+static void cache_touch(ext2_fs_t * this, ext2_disk_cache_entry_t * entry) {
+	if (this->cache_mru == entry) return;
+
+	/* Unlink from where it is now */
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	if (this->cache_lru == entry) this->cache_lru = entry->lru_prev;
+
+	/* And put it at the front */
+	entry->lru_prev = NULL;
+	entry->lru_next = this->cache_mru;
+	if (this->cache_mru) this->cache_mru->lru_prev = entry;
+	this->cache_mru = entry;
+	if (!this->cache_lru) this->cache_lru = entry;
+}
+
+/**
+ * ext2->cache_replace Take the least recently used entry and
+ * reassign it to a new block.
+ *
+ * The old contents are flushed if they were dirty. The entry is
+ * marked as most recently used, but its data is left as is.
+ *
+ * @param block_no Block the entry will hold
+ * @returns The reassigned entry
+ */
+static ext2_disk_cache_entry_t * cache_replace(ext2_fs_t * this, unsigned int block_no) {
+	/* Blocks in the running transaction can't be written in place yet */
+	ext2_disk_cache_entry_t * entry = this->cache_lru;
+	while (entry && entry->journal) {
+		entry = entry->lru_prev;
+	}
+	if (!entry) {
+		debug_print(WARNING, "Every cache entry is in the running transaction; writing one out early.");
+		entry = this->cache_lru;
+	}
+
+	/* We'll start by flushing the block if it was dirty. */
+	if (entry->dirty) {
+		cache_flush_dirty(this, entry);
+	}
+
+	/* Remove it from the bucket for its old block, if it had one */
+	if (entry->block_no) {
+		ext2_disk_cache_entry_t ** link = &this->cache_hash[entry->block_no & (this->cache_hash_size - 1)];
+		while (*link != entry) {
+			link = &(*link)->hash_next;
+		}
+		*link = entry->hash_next;
+	}
+
+	/* And add it to the bucket for the new one */
+	unsigned int bucket = block_no & (this->cache_hash_size - 1);
+	entry->block_no  = block_no;
+	entry->hash_next = this->cache_hash[bucket];
+	this->cache_hash[bucket] = entry;
+
+	cache_touch(this, entry);
+	return entry;
 }
 
 /**
@@ -109,8 +279,18 @@ static int cache_flush_dirty(ext2_fs_t * this, unsigned int ent_no) {
  * regardless of what the filesystem block size is. This doesn't work well with our setup,
  * so we need to special-case it.
  */
-static int rewrite_superblock(ext2_fs_t * this) {
+static void write_superblock(ext2_fs_t * this) {
 	write_fs(this->block_device, 1024, sizeof(ext2_superblock_t), (uint8_t *)SB);
+	this->sb_dirty = 0;
+}
+
+static int rewrite_superblock(ext2_fs_t * this) {
+	if (this->jnl_map) {
+		/* Written when the running transaction commits */
+		this->sb_dirty = 1;
+		return E_SUCCESS;
+	}
+	write_superblock(this);
 	return E_SUCCESS;
 }
 
@@ -130,78 +310,116 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 	}
 
 	/* This operation requires the filesystem lock to be obtained */
-	spin_lock(this->lock);
+	kmutex_lock(&this->lock);
 
 	/* We can make reads without a cache in place. */
 	if (!DC) {
 		/* In such cases, we read directly from the block device */
 		read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf);
 		/* We are done, release the lock */
-		spin_unlock(this->lock);
+		kmutex_unlock(&this->lock);
 		/* And return SUCCESS */
 		return E_SUCCESS;
 	}
 
-	/*
-	 * Search the cache for this entry
-	 * We'll look for the oldest entry, too.
-	 */
-	int oldest = -1;
-	unsigned int oldest_age = UINT32_MAX;
-	for (unsigned int i = 0; i < this->cache_entries; ++i) {
-		if (DC[i].block_no == block_no) {
-			/* We found it! Update usage times */
-			DC[i].last_use = get_cache_time(this);
-			/* Read the block */
-			memcpy(buf, DC[i].block, this->block_size);
-			/* Release the lock */
-			spin_unlock(this->lock);
-			/* Success! */
-			return E_SUCCESS;
-		}
-		if (DC[i].last_use < oldest_age) {
-			/* We found an older block, remember this. */
-			oldest = i;
-			oldest_age = DC[i].last_use;
-		}
+	/* Search the cache for this entry */
+	ext2_disk_cache_entry_t * entry = cache_find(this, block_no);
+	if (entry) {
+		/* We found it! Update usage times */
+		cache_touch(this, entry);
+		/* Read the block */
+		memcpy(buf, entry->block, this->block_size);
+		/* Release the lock */
+		kmutex_unlock(&this->lock);
+		/* Success! */
+		return E_SUCCESS;
 	}
 
 	/*
 	 * At this point, we did not find this block in the cache.
 	 * We are going to replace the oldest entry with this new one.
 	 */
-
-	/* We'll start by flushing the block if it was dirty. */
-	if (DC[oldest].dirty) {
-		cache_flush_dirty(this, oldest);
-	}
+	entry = cache_replace(this, block_no);
 
 	/* Then we'll read the new one */
-	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)DC[oldest].block);
+	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)entry->block);
 
 	/* And copy the results to the output buffer */
-	memcpy(buf, DC[oldest].block, this->block_size);
-
-	/* And update the cache entry to point to the new block */
-	DC[oldest].block_no = block_no;
-	DC[oldest].last_use = get_cache_time(this);
-	DC[oldest].dirty = 0;
+	memcpy(buf, entry->block, this->block_size);
+	entry->dirty = 0;
 
 	/* Release the lock */
-	spin_unlock(this->lock);
+	kmutex_unlock(&this->lock);
 
 	/* And return success */
 	return E_SUCCESS;
 }
 
+/**
+ * ext2->read_blocks Read a run of consecutive blocks.
+ *
+ * Blocks that aren't already cached are read from the block device
+ * in as few requests as possible, rather than one at a time, and
+ * then added to the cache.
+ *
+ * @param block_no First block to read
+ * @param count    Number of blocks
+ * @param buf      Where to put the data read (count blocks long)
+ * @returns Error code or E_SUCCESS
+ */
+static int read_blocks(ext2_fs_t * this, unsigned int block_no, unsigned int count, uint8_t * buf) {
+	if (!block_no) {
+		return E_BADBLOCK;
+	}
+
+	kmutex_lock(&this->lock);
+
+	if (!DC) {
+		read_fs(this->block_device, block_no * this->block_size, count * this->block_size, buf);
+		kmutex_unlock(&this->lock);
+		return E_SUCCESS;
+	}
+
+	unsigned int i = 0;
+	while (i < count) {
+		ext2_disk_cache_entry_t * entry = cache_find(this, block_no + i);
+		if (entry) {
+			cache_touch(this, entry);
+			memcpy(buf + i * this->block_size, entry->block, this->block_size);
+			i++;
+			continue;
+		}
+
+		/* Gather up the uncached blocks that follow and read them together */
+		unsigned int run = 1;
+		while (i + run < count && !cache_find(this, block_no + i + run)) {
+			run++;
+		}
+		read_fs(this->block_device, (block_no + i) * this->block_size, run * this->block_size, buf + i * this->block_size);
+
+		/* Don't let one big read push everything else out of the cache */
+		unsigned int keep = run < this->cache_entries / 4 ? run : this->cache_entries / 4;
+		for (unsigned int j = run - keep; j < run; ++j) {
+			entry = cache_replace(this, block_no + i + j);
+			memcpy(entry->block, buf + (i + j) * this->block_size, this->block_size);
+			entry->dirty = 0;
+		}
+		i += run;
+	}
+
+	kmutex_unlock(&this->lock);
+	return E_SUCCESS;
+}
+
 /**
  * ext2->write_block Write a block to the block device.
  *
  * @param block_no Block to write
  * @param buf      Data in the block
+ * @param meta     The block is metadata, and goes through the journal
  * @returns Error code or E_SUCCESSS
  */
-static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
+static int write_block_common(ext2_fs_t * this, unsigned int block_no, uint8_t *buf, int meta) {
 	if (!block_no) {
 		debug_print(ERROR, "Attempted to write to block #0. Enable tracing and retry this operation.");
 		debug_print(ERROR, "Your file system is most likely corrupted now.");
@@ -209,71 +427,296 @@ static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
 	}
 
 	/* This operation requires the filesystem lock */
-	spin_lock(this->lock);
+	kmutex_lock(&this->lock);
 
 	if (!DC) {
 		write_fs(this->block_device, block_no * this->block_size, this->block_size, buf);
-		spin_unlock(this->lock);
+		kmutex_unlock(&this->lock);
 		return E_SUCCESS;
 	}
 
-	/* Find the entry in the cache */
-	int oldest = -1;
-	unsigned int oldest_age = UINT32_MAX;
-	for (unsigned int i = 0; i < this->cache_entries; ++i) {
-		if (DC[i].block_no == block_no) {
-			/* We found it. Update the cache entry */
-			DC[i].last_use = get_cache_time(this);
-			DC[i].dirty = 1;
-			memcpy(DC[i].block, buf, this->block_size);
-			spin_unlock(this->lock);
-			return E_SUCCESS;
-		}
-		if (DC[i].last_use < oldest_age) {
-			/* Keep track of the oldest entry */
-			oldest = i;
-			oldest_age = DC[i].last_use;
-		}
-	}
-
-	/* We did not find this element in the cache, so make room. */
-	if (DC[oldest].dirty) {
-		/* Flush the oldest entry */
-		cache_flush_dirty(this, oldest);
+	/* Find the entry in the cache, or make room for it */
+	ext2_disk_cache_entry_t * entry = cache_find(this, block_no);
+	if (entry) {
+		cache_touch(this, entry);
+	} else {
+		entry = cache_replace(this, block_no);
 	}
 
 	/* Update the entry */
-	memcpy(DC[oldest].block, buf, this->block_size);
-	DC[oldest].block_no = block_no;
-	DC[oldest].last_use = get_cache_time(this);
-	DC[oldest].dirty = 1;
+	memcpy(entry->block, buf, this->block_size);
+	if (!entry->dirty) {
+		entry->dirty = 1;
+		entry->dirtied = timer_ticks;
+	}
+	if (meta && this->jnl_map && !entry->journal) {
+		entry->journal = 1;
+		if (!this->jnl_count++) {
+			this->jnl_started = timer_ticks;
+		}
+	}
 
 	/* Release the lock */
-	spin_unlock(this->lock);
+	kmutex_unlock(&this->lock);
 
 	/* We're done. */
 	return E_SUCCESS;
 }
 
-static unsigned int ext2_sync(ext2_fs_t * this) {
-	if (!this->disk_cache) return 0;
+static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
+	return write_block_common(this, block_no, buf, 0);
+}
 
-	/* This operation requires the filesystem lock */
-	spin_lock(this->lock);
+static int write_meta_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
+	return write_block_common(this, block_no, buf, 1);
+}
 
-	/* Flush each cache entry. */
+/*
+ * Journaling
+ *
+ * On a filesystem with an ext3 journal, metadata (inodes, bitmaps,
+ * group descriptors, indirect blocks and directories) isn't written
+ * in place as it changes. Blocks written with write_meta_block() join
+ * the running transaction and stay in the cache. When the transaction
+ * is a few seconds old, gets large, or a sync asks for it, it commits:
+ *
+ *  1. File data is written out first (ext3's "ordered" mode), so
+ *     committed metadata never points at blocks with stale contents.
+ *  2. The journal superblock is pointed at the start of the log.
+ *  3. Descriptor blocks and copies of the logged blocks are written to
+ *     the journal, followed by a commit block.
+ *  4. The logged blocks are written in place, and the journal is
+ *     marked empty again.
+ *
+ * A crash before the commit block is on disk loses the transaction; a
+ * crash after it is repaired by replaying the journal, at our next
+ * mount or by e2fsck. Transactions are written in place as soon as
+ * they commit, so the log always starts at the journal's first block.
+ *
+ * Operations that change metadata are bracketed by journal_start()
+ * and journal_stop(), and a transaction only commits when none are in
+ * progress, so an operation is never split between two transactions.
+ *
+ * The superblock isn't logged. Its free counts are written when a
+ * transaction commits, and e2fsck recalculates them after a crash.
+ */
+
+static inline uint32_t jbd32(uint32_t x) {
+	return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+#define JSB ((jbd_superblock_t *)this->jnl_super)
+
+/* A descriptor block and its copies are written together through the flush buffer */
+#define JBD_TAGS_PER_RUN (EXT2_FLUSH_RUN - 1)
+
+/*
+ * Write `count` blocks to the journal from journal block `first` on,
+ * in as few requests as its layout on the disk allows.
+ */
+static void journal_write(ext2_fs_t * this, uint32_t first, uint32_t count, uint8_t * buf) {
+	while (count) {
+		uint32_t run = 1;
+		while (run < count && this->jnl_map[first + run] == this->jnl_map[first] + run) {
+			run++;
+		}
+		write_fs(this->block_device, (uint64_t)this->jnl_map[first] * this->block_size, run * this->block_size, buf);
+		first += run;
+		count -= run;
+		buf   += run * this->block_size;
+	}
+}
+
+static void journal_header(ext2_fs_t * this, uint8_t * block, uint32_t type, uint32_t sequence) {
+	memset(block, 0, this->block_size);
+	jbd_header_t * header = (jbd_header_t *)block;
+	header->magic     = jbd32(JBD_MAGIC);
+	header->blocktype = jbd32(type);
+	header->sequence  = jbd32(sequence);
+}
+
+/*
+ * Commit the running transaction. The filesystem lock must be held,
+ * and no operations may be in progress.
+ */
+static void journal_commit_locked(ext2_fs_t * this) {
+	if (!this->jnl_count) {
+		if (this->sb_dirty) write_superblock(this);
+		return;
+	}
+
+	uint32_t sequence = jbd32(JSB->sequence);
+	uint32_t first    = jbd32(JSB->first);
+
+	/* Data first */
+	cache_flush(this, (unsigned long)-1, 0);
+
+	unsigned int count = 0;
 	for (unsigned int i = 0; i < this->cache_entries; ++i) {
-		if (DC[i].dirty) {
-			cache_flush_dirty(this, i);
+		if (DC[i].journal) {
+			this->flush_list[count++] = &DC[i];
+		}
+	}
+
+	unsigned int needed = count + (count + JBD_TAGS_PER_RUN - 1) / JBD_TAGS_PER_RUN + 1;
+	if (needed > jbd32(JSB->maxlen) - first) {
+		/* Only if a single operation logged more than the journal holds */
+		debug_print(ERROR, "Transaction %d needs %d journal blocks; writing it in place unjournaled.", sequence, needed);
+		if (this->sb_dirty) write_superblock(this);
+		cache_flush(this, (unsigned long)-1, 1);
+		return;
+	}
+
+	JSB->start = jbd32(first);
+	journal_write(this, 0, 1, this->jnl_super);
+
+	uint32_t at = first;
+	for (unsigned int i = 0; i < count; i += JBD_TAGS_PER_RUN) {
+		unsigned int n = count - i < JBD_TAGS_PER_RUN ? count - i : JBD_TAGS_PER_RUN;
+		journal_header(this, this->flush_buffer, JBD_DESCRIPTOR_BLOCK, sequence);
+
+		uint8_t * tag_at = this->flush_buffer + sizeof(jbd_header_t);
+		for (unsigned int j = 0; j < n; ++j) {
+			ext2_disk_cache_entry_t * entry = this->flush_list[i + j];
+			uint8_t * copy = this->flush_buffer + (j + 1) * this->block_size;
+			memcpy(copy, entry->block, this->block_size);
+
+			uint32_t flags = j ? JBD_FLAG_SAME_UUID : 0;
+			if (*(uint32_t *)copy == jbd32(JBD_MAGIC)) {
+				/* Replay would take it for a journal block */
+				*(uint32_t *)copy = 0;
+				flags |= JBD_FLAG_ESCAPE;
+			}
+			if (j == n - 1) {
+				flags |= JBD_FLAG_LAST_TAG;
+			}
+
+			jbd_block_tag_t * tag = (jbd_block_tag_t *)tag_at;
+			tag->blocknr = jbd32(entry->block_no);
+			tag->flags   = jbd32(flags);
+			tag_at += sizeof(jbd_block_tag_t);
+			if (!j) {
+				memcpy(tag_at, SB->uuid, 16);
+				tag_at += 16;
+			}
 		}
+
+		journal_write(this, at, n + 1, this->flush_buffer);
+		at += n + 1;
 	}
 
+	journal_header(this, this->flush_buffer, JBD_COMMIT_BLOCK, sequence);
+	journal_write(this, at, 1, this->flush_buffer);
+
+	/* Committed; now it can go in place */
+	if (this->sb_dirty) write_superblock(this);
+	cache_flush(this, (unsigned long)-1, 1);
+
+	JSB->start    = 0;
+	JSB->sequence = jbd32(sequence + 1);
+	journal_write(this, 0, 1, this->jnl_super);
+
+	debug_print(INFO, "committed transaction %d (%d blocks)", sequence, count);
+}
+
+/*
+ * Commit now if nothing is in progress, or when the last operation
+ * in progress finishes.
+ */
+static void journal_commit(ext2_fs_t * this) {
+	kmutex_lock(&this->lock);
+	spin_lock(this->jnl_lock);
+	int busy = this->jnl_handles;
+	if (busy) {
+		this->jnl_sync_wanted = 1;
+	}
+	spin_unlock(this->jnl_lock);
+	if (!busy) {
+		journal_commit_locked(this);
+	}
+	kmutex_unlock(&this->lock);
+}
+
+static void journal_start(ext2_fs_t * this) {
+	if (!this->jnl_map) return;
+	spin_lock(this->jnl_lock);
+	this->jnl_handles++;
+	spin_unlock(this->jnl_lock);
+}
+
+static void journal_stop(ext2_fs_t * this) {
+	if (!this->jnl_map) return;
+	spin_lock(this->jnl_lock);
+	int left = --this->jnl_handles;
+	int commit = !left && (this->jnl_sync_wanted || this->jnl_count >= this->jnl_limit);
+	if (commit) {
+		this->jnl_sync_wanted = 0;
+	}
+	spin_unlock(this->jnl_lock);
+	if (commit) {
+		journal_commit(this);
+	}
+}
+
+static unsigned int ext2_sync(ext2_fs_t * this) {
+	if (!this->disk_cache) return 0;
+
+	/* Metadata gets to the disk by committing it */
+	if (this->jnl_map) {
+		journal_commit(this);
+	}
+
+	/* This operation requires the filesystem lock */
+	kmutex_lock(&this->lock);
+
+	/* Flush every other dirty cache entry. */
+	cache_flush(this, (unsigned long)-1, 0);
+
 	/* Release the lock */
-	spin_unlock(this->lock);
+	kmutex_unlock(&this->lock);
 
 	return 0;
 }
 
+/*
+ * Background flusher: writes out blocks that have been dirty for
+ * longer than EXT2_DIRTY_EXPIRE, so a write is on the disk a few
+ * seconds after it was made even if nothing evicts it.
+ */
+static void ext2_flusher(void * data, char * name) {
+	ext2_fs_t * this = data;
+	while (1) {
+		unsigned long s, ss;
+		relative_time(EXT2_FLUSH_INTERVAL, 0, &s, &ss);
+		sleep_until((process_t *)current_process, s, ss);
+		switch_task(0);
+
+		if (this->jnl_map && this->jnl_count && timer_ticks - this->jnl_started >= EXT2_DIRTY_EXPIRE) {
+			journal_commit(this);
+		}
+
+		if (timer_ticks < EXT2_DIRTY_EXPIRE) continue;
+
+		kmutex_lock(&this->lock);
+		unsigned int written = cache_flush(this, timer_ticks - EXT2_DIRTY_EXPIRE, 0);
+		kmutex_unlock(&this->lock);
+
+		if (written) {
+			debug_print(INFO, "flushed %d blocks", written);
+		}
+	}
+}
+
+/*
+ * fsync() and sync() on any node of the filesystem write out the
+ * whole cache: entries don't know which inode they belong to.
+ */
+static int sync_ext2(fs_node_t * node) {
+	ext2_fs_t * this = node->device;
+	ext2_sync(this);
+	return 0;
+}
+
 /**
  * ext2->set_block_number Set the "real" block number for a given "inode" block number.
  *
@@ -306,7 +749,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
 
 		((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS] = rblock;
-		write_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
+		write_meta_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
 
 		free(tmp);
 		return E_SUCCESS;
@@ -330,14 +773,14 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 			unsigned int block_no = allocate_block(this);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[c] = block_no;
-			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
+			write_meta_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
 		}
 
 		uint32_t nblock = ((uint32_t *)tmp)[c];
 		read_block(this, nblock, (uint8_t *)tmp);
 
 		((uint32_t  *)tmp)[d] = rblock;
-		write_block(this, nblock, (uint8_t *)tmp);
+		write_meta_block(this, nblock, (uint8_t *)tmp);
 
 		free(tmp);
 		return E_SUCCESS;
@@ -364,7 +807,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 			unsigned int block_no = allocate_block(this);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[d] = block_no;
-			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
+			write_meta_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
 		}
 
 		uint32_t nblock = ((uint32_t *)tmp)[d];
@@ -374,14 +817,14 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 			unsigned int block_no = allocate_block(this);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[f] = block_no;
-			write_block(this, nblock, (uint8_t *)tmp);
+			write_meta_block(this, nblock, (uint8_t *)tmp);
 		}
 
 		nblock = ((uint32_t *)tmp)[f];
 		read_block(this, nblock, (uint8_t *)tmp);
 
-		((uint32_t *)tmp)[g] = nblock;
-		write_block(this, nblock, (uint8_t *)tmp);
+		((uint32_t *)tmp)[g] = rblock;
+		write_meta_block(this, nblock, (uint8_t *)tmp);
 
 		free(tmp);
 		return E_SUCCESS;
@@ -478,131 +921,632 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, uint32_t inde
 	/* Read the current table block */
 	read_block(this, inode_table_block + block_offset, (uint8_t *)inodet);
 	memcpy((uint8_t *)((uint32_t)inodet + offset_in_block * this->inode_size), inode, this->inode_size);
-	write_block(this, inode_table_block + block_offset, (uint8_t *)inodet);
+	write_meta_block(this, inode_table_block + block_offset, (uint8_t *)inodet);
 	free(inodet);
 
 	return E_SUCCESS;
 }
 
-static unsigned int allocate_block(ext2_fs_t * this) {
-	unsigned int block_no     = 0;
-	unsigned int block_offset = 0;
-	unsigned int group        = 0;
+/*
+ * Block allocation
+ *
+ * Blocks are handed out in runs: allocate_blocks() finds up to `count`
+ * free blocks in a row, as close to a goal block as it can, and marks
+ * them all with one update of the bitmap, the group descriptors and
+ * the superblock.
+ *
+ * A file that is growing also gets a preallocation window. When it
+ * needs blocks, a longer run than it asked for is taken, starting
+ * right after its last block, and the rest is kept for its next
+ * writes; a file written a little at a time, or alongside others, is
+ * still laid out contiguously. Windows are handed back to the bitmap
+ * when the file is closed, or when the window is needed for another
+ * file.
+ */
+
+static unsigned int blocks_in_group(ext2_fs_t * this, unsigned int group) {
+	unsigned int first = SB->first_data_block + group * SB->blocks_per_group;
+	if (SB->blocks_count - first < SB->blocks_per_group) {
+		return SB->blocks_count - first;
+	}
+	return SB->blocks_per_group;
+}
+
+static void write_block_groups(ext2_fs_t * this) {
+	for (int i = 0; i < this->bgd_block_span; ++i) {
+		write_meta_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
+	}
+}
+
+/**
+ * ext2->allocate_blocks Allocate a run of contiguous blocks.
+ *
+ * @param goal  Block to start looking from, or 0
+ * @param count Most blocks wanted
+ * @param got   Set to how many were allocated
+ * @returns First block of the run, or 0 if the disk is full.
+ */
+static unsigned int allocate_blocks(ext2_fs_t * this, unsigned int goal, unsigned int count, unsigned int * got) {
+	unsigned int goal_group  = 0;
+	unsigned int goal_offset = 0;
+	if (goal >= SB->first_data_block && goal < SB->blocks_count) {
+		goal_group  = (goal - SB->first_data_block) / SB->blocks_per_group;
+		goal_offset = (goal - SB->first_data_block) % SB->blocks_per_group;
+	}
+
 	uint8_t * bg_buffer = malloc(this->block_size);
 
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_blocks_count > 0) {
-			read_block(this, BGD[i].block_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(block_offset)) {
-				++block_offset;
+	for (unsigned int g = 0; g < BGDS; ++g) {
+		unsigned int group = (goal_group + g) % BGDS;
+		if (!BGD[group].free_blocks_count) continue;
+
+		unsigned int size = blocks_in_group(this, group);
+		unsigned int from = (group == goal_group && goal_offset < size) ? goal_offset : 0;
+		read_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+
+		/* First free block at or after the goal, else the first in the group */
+		unsigned int block_offset = from;
+		for (unsigned int n = 0; n < size; ++n, ++block_offset) {
+			if (block_offset == size) block_offset = 0;
+			if (!(block_offset % 8) && BLOCKBYTE(block_offset) == 0xFF && block_offset + 8 <= size) {
+				n += 7;
+				block_offset += 7;
+				continue;
 			}
-			block_no = block_offset + SB->blocks_per_group * i;
-			group = i;
-			break;
+			if (!BLOCKBIT(block_offset)) break;
+		}
+		if (block_offset >= size || BLOCKBIT(block_offset)) {
+			/* The descriptor's count was wrong */
+			continue;
 		}
-	}
 
-	if (!block_no) {
-		debug_print(CRITICAL, "No available blocks, disk is out of space!");
+		unsigned int run = 0;
+		while (run < count && block_offset + run < size && !BLOCKBIT(block_offset + run)) {
+			BLOCKBYTE(block_offset + run) |= SETBIT(block_offset + run);
+			run++;
+		}
+		write_meta_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+
+		BGD[group].free_blocks_count -= run;
+		write_block_groups(this);
+
+		SB->free_blocks_count -= run;
+		rewrite_superblock(this);
+
 		free(bg_buffer);
-		return 0;
+
+		unsigned int block_no = SB->first_data_block + group * SB->blocks_per_group + block_offset;
+		debug_print(INFO, "allocated %d blocks at #%d (group %d)", run, block_no, group);
+		*got = run;
+		return block_no;
 	}
 
-	debug_print(WARNING, "allocating block #%d (group %d)", block_no, group);
+	debug_print(CRITICAL, "No available blocks, disk is out of space!");
+	free(bg_buffer);
+	*got = 0;
+	return 0;
+}
 
-	BLOCKBYTE(block_offset) |= SETBIT(block_offset);
-	write_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+/**
+ * ext2->release_blocks Give back a run of blocks from allocate_blocks().
+ */
+static void release_blocks(ext2_fs_t * this, unsigned int block_no, unsigned int count) {
+	if (!count) return;
 
-	BGD[group].free_blocks_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
+	unsigned int group        = (block_no - SB->first_data_block) / SB->blocks_per_group;
+	unsigned int block_offset = (block_no - SB->first_data_block) % SB->blocks_per_group;
+	uint8_t * bg_buffer = malloc(this->block_size);
+
+	read_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+	for (unsigned int i = 0; i < count; ++i) {
+		BLOCKBYTE(block_offset + i) &= ~SETBIT(block_offset + i);
 	}
+	write_meta_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
 
-	SB->free_blocks_count--;
-	rewrite_superblock(this);
+	BGD[group].free_blocks_count += count;
+	write_block_groups(this);
 
-	memset(bg_buffer, 0x00, this->block_size);
-	write_block(this, block_no, bg_buffer);
+	SB->free_blocks_count += count;
+	rewrite_superblock(this);
 
 	free(bg_buffer);
+}
+
+/**
+ * ext2->allocate_block Allocate a single, zeroed, block.
+ */
+static unsigned int allocate_block(ext2_fs_t * this) {
+	unsigned int got;
+	unsigned int block_no = allocate_blocks(this, 0, 1, &got);
+	if (!block_no) return 0;
+
+	uint8_t * buf = malloc(this->block_size);
+	memset(buf, 0x00, this->block_size);
+	write_meta_block(this, block_no, buf);
+	free(buf);
 
 	return block_no;
+}
 
+/**
+ * ext2->prealloc_release Return an inode's unused reserved blocks.
+ */
+static void prealloc_release(ext2_fs_t * this, uint32_t inode_no) {
+	for (int i = 0; i < EXT2_PREALLOC_WINDOWS; ++i) {
+		ext2_prealloc_t * window = &this->prealloc[i];
+		if (window->inode != inode_no) continue;
+		release_blocks(this, window->start, window->count);
+		window->inode = 0;
+		window->count = 0;
+	}
 }
 
+/**
+ * ext2->take_blocks Get blocks for an inode, from its window if it has one.
+ *
+ * @param goal   Block the inode would like next
+ * @param wanted Most blocks wanted
+ * @param got    Set to how many were taken
+ * @returns First block of the run, or 0 if the disk is full.
+ */
+static unsigned int take_blocks(ext2_fs_t * this, uint32_t inode_no, unsigned int goal, unsigned int wanted, unsigned int * got) {
+	ext2_prealloc_t * window = NULL;
+	for (int i = 0; i < EXT2_PREALLOC_WINDOWS; ++i) {
+		if (this->prealloc[i].inode == inode_no) {
+			window = &this->prealloc[i];
+			break;
+		}
+	}
+
+	if (window && window->count) {
+		unsigned int block_no = window->start;
+		*got = wanted < window->count ? wanted : window->count;
+		window->start += *got;
+		window->count -= *got;
+		return block_no;
+	}
+
+	if (!window) {
+		for (int i = 0; i < EXT2_PREALLOC_WINDOWS; ++i) {
+			if (!this->prealloc[i].inode) {
+				window = &this->prealloc[i];
+				break;
+			}
+		}
+		if (!window) {
+			window = &this->prealloc[this->prealloc_next];
+			this->prealloc_next = (this->prealloc_next + 1) % EXT2_PREALLOC_WINDOWS;
+			prealloc_release(this, window->inode);
+		}
+	}
+
+	unsigned int run;
+	unsigned int block_no = allocate_blocks(this, goal, wanted + EXT2_PREALLOC_BLOCKS, &run);
+	if (!block_no) {
+		window->inode = 0;
+		*got = 0;
+		return 0;
+	}
+
+	*got = wanted < run ? wanted : run;
+	window->inode = inode_no;
+	window->start = block_no + *got;
+	window->count = run - *got;
+	return block_no;
+}
 
 /**
- * ext2->allocate_inode_block Allocate a block in an inode.
+ * ext2->allocate_inode_blocks Grow an inode to `count` blocks.
+ *
+ * New blocks are zeroed if `zero` is set; otherwise the caller is
+ * about to write all of them.
  *
  * @param inode Inode to operate on
  * @param inode_no Number of the inode (this is not part of the struct)
- * @param block Block within inode to allocate
+ * @param count Blocks the inode should have
  * @returns Error code or E_SUCCESS
  */
-static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
-	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
-	unsigned int block_no = allocate_block(this);
+static int allocate_inode_blocks(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int count, int zero) {
+	unsigned int sectors_per_block = this->block_size / 512;
+	unsigned int have = inode->blocks / sectors_per_block;
+	if (have >= count) return E_SUCCESS;
+
+	debug_print(INFO, "Growing inode #%d from %d to %d blocks", inode_no, have, count);
+
+	uint8_t * empty = NULL;
+	if (zero) {
+		empty = malloc(this->block_size);
+		memset(empty, 0x00, this->block_size);
+	}
+
+	int status = E_SUCCESS;
+	while (have < count) {
+		/* Carry on from the end of the file, or from the start of its inode's group */
+		unsigned int goal = have ? get_block_number(this, inode, have - 1) + 1 :
+			SB->first_data_block + ((inode_no - 1) / this->inodes_per_group) * SB->blocks_per_group;
+
+		unsigned int got;
+		unsigned int block_no = take_blocks(this, inode_no, goal, count - have, &got);
+		if (!block_no) {
+			status = E_NOSPACE;
+			break;
+		}
+
+		for (unsigned int i = 0; i < got; ++i) {
+			if (empty) {
+				write_block(this, block_no + i, empty);
+			}
+			if (set_block_number(this, inode, inode_no, have, block_no + i) != E_SUCCESS) {
+				release_blocks(this, block_no + i, got - i);
+				status = E_NOSPACE;
+				break;
+			}
+			have++;
+			inode->blocks = have * sectors_per_block;
+		}
+		if (status != E_SUCCESS) break;
+	}
+
+	write_inode(this, inode, inode_no);
+	if (empty) free(empty);
+	return status;
+}
+
+/**
+ * ext2->inode_read_block
+ *
+ * @param inode
+ * @param no
+ * @param block
+ * @parma buf
+ * @returns Real block number for reference.
+ */
+static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
+
+	if (block >= inode->blocks / (this->block_size / 512)) {
+		memset(buf, 0x00, this->block_size);
+		debug_print(WARNING, "Tried to read an invalid block. Asked for %d (0-indexed), but inode only has %d!", block, inode->blocks / (this->block_size / 512));
+		return 0;
+	}
+
+	unsigned int real_block = get_block_number(this, inode, block);
+	read_block(this, real_block, buf);
+
+	return real_block;
+}
+
+/**
+ * ext2->inode_write_block
+ */
+static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
+	if (block >= inode->blocks / (this->block_size / 512)) {
+		debug_print(INFO, "Writing beyond the allocated blocks of inode %d (block %d)", inode_no, block);
+		/* Anything skipped over reads as zeroes; the block itself is about to be written */
+		if (allocate_inode_blocks(this, inode, inode_no, block, 1) != E_SUCCESS ||
+			allocate_inode_blocks(this, inode, inode_no, block + 1, 0) != E_SUCCESS) {
+			return 0;
+		}
+	}
+
+	unsigned int real_block = get_block_number(this, inode, block);
+	debug_print(INFO, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+
+	/* Directory and symlink contents are metadata, as far as the journal is concerned */
+	if ((inode->mode & 0xF000) == EXT2_S_IFREG) {
+		write_block(this, real_block, buf);
+	} else {
+		write_meta_block(this, real_block, buf);
+	}
+	return real_block;
+}
+
+/*
+ * Directory entries are padded to four bytes.
+ */
+#define DIR_REC_LEN(name_len) ((sizeof(ext2_dir_t) + (name_len) + 3) & ~3)
+
+/*
+ * Directory indexes
+ *
+ * Directories made by mke2fs and e2fsck -D (and by other systems'
+ * drivers) can carry a hash index. Lookups in them hash the name as
+ * the filesystem says to, binary search the index down to the leaf
+ * block that covers the hash, and only look through that block.
+ *
+ * New names in an indexed directory go into their leaf when there is
+ * room. There's no splitting of full leaves; when a leaf fills up the
+ * directory stops being indexed (clearing the flag is how a driver
+ * that can't maintain an index is meant to leave it; e2fsck -D will
+ * build it again) and carries on as an ordinary directory.
+ */
+
+#define DX_TEA_DELTA 0x9E3779B9
+
+static void dx_tea_transform(uint32_t buf[4], uint32_t const in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	for (int n = 0; n < 16; ++n) {
+		sum += DX_TEA_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define DX_ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = DX_ROL(a, s))
+#define DX_K1 0
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+static void dx_half_md4_transform(uint32_t buf[4], uint32_t const in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1,  3);
+	DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1,  7);
+	DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1,  3);
+	DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1,  7);
+	DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/* Names are hashed as signed chars unless the filesystem says otherwise */
+static int dx_char(const char * name, int i, int is_unsigned) {
+	return is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+}
+
+static uint32_t dx_legacy_hash(const char * name, int len, int is_unsigned) {
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (int i = 0; i < len; ++i) {
+		hash = hash1 + (hash0 ^ (dx_char(name, i, is_unsigned) * 7152373));
+		if (hash & 0x80000000) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/*
+ * Pack up to num * 4 bytes of a name into words for the transforms,
+ * padding with the length.
+ */
+static void dx_str2hashbuf(const char * msg, int len, uint32_t * buf, int num, int is_unsigned) {
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4) len = num * 4;
+	for (int i = 0; i < len; ++i) {
+		val = dx_char(msg, i, is_unsigned) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) *buf++ = val;
+	while (--num >= 0) *buf++ = pad;
+}
+
+static uint32_t dx_hash(ext2_fs_t * this, int version, const char * name, int len) {
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8];
+	uint32_t hash = 0;
+	int is_unsigned = version >= EXT2_HASH_UNSIGNED;
+
+	for (int i = 0; i < 4; ++i) {
+		if (SB->hash_seed[i]) {
+			memcpy(buf, SB->hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (version % EXT2_HASH_UNSIGNED) {
+		case EXT2_HASH_LEGACY:
+			hash = dx_legacy_hash(name, len, is_unsigned);
+			break;
+		case EXT2_HASH_HALF_MD4:
+			for (; len > 0; len -= 32, name += 32) {
+				dx_str2hashbuf(name, len, in, 8, is_unsigned);
+				dx_half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case EXT2_HASH_TEA:
+			for (; len > 0; len -= 16, name += 16) {
+				dx_str2hashbuf(name, len, in, 4, is_unsigned);
+				dx_tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1;
+	if (hash == (0x7fffffffU << 1)) hash = (0x7fffffffU - 1) << 1;
+	return hash;
+}
+
+/*
+ * Where a name belongs in an indexed directory.
+ */
+typedef struct {
+	uint32_t          hash;
+	uint8_t *         node; /* The bottom index block, which at and end point into */
+	ext2_dx_entry_t * at;   /* Entry covering the hash */
+	ext2_dx_entry_t * end;  /* End of that block's entries */
+} dx_frame_t;
+
+/*
+ * Walk a directory's index down to the entry covering `name`.
+ *
+ * @returns 0 with `frame` filled in (free its node), or -1 if the
+ *          directory has no index we can use.
+ */
+static int dx_probe(ext2_fs_t * this, ext2_inodetable_t * inode, char * name, dx_frame_t * frame) {
+	if (!(inode->flags & EXT2_INDEX_FL) || !(SB->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		return -1;
+	}
+
+	uint32_t blocks = inode->size / this->block_size;
+	uint8_t * node = malloc(this->block_size);
+	inode_read_block(this, inode, 0, node);
+
+	ext2_dx_root_info_t * info = (ext2_dx_root_info_t *)(node + 24);
+	if (info->reserved_zero || info->indirect_levels > 1 || info->hash_version > EXT2_HASH_TEA + EXT2_HASH_UNSIGNED) {
+		goto _bad_index;
+	}
+
+	int version = info->hash_version;
+	if (version < EXT2_HASH_UNSIGNED && (SB->flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+		version += EXT2_HASH_UNSIGNED;
+	}
+	frame->hash = dx_hash(this, version, name, strlen(name));
+
+	int levels = info->indirect_levels;
+	ext2_dx_entry_t * entries = (ext2_dx_entry_t *)((uintptr_t)info + info->info_length);
+	for (int level = 0; ; ++level) {
+		ext2_dx_countlimit_t * countlimit = (ext2_dx_countlimit_t *)entries;
+		if (!countlimit->count || countlimit->count > countlimit->limit ||
+			(uintptr_t)(entries + countlimit->limit) > (uintptr_t)node + this->block_size) {
+			goto _bad_index;
+		}
 
-	if (!block_no) return E_NOSPACE;
+		ext2_dx_entry_t * p = entries + 1;
+		ext2_dx_entry_t * q = entries + countlimit->count - 1;
+		while (p <= q) {
+			ext2_dx_entry_t * m = p + (q - p) / 2;
+			if (m->hash > frame->hash) {
+				q = m - 1;
+			} else {
+				p = m + 1;
+			}
+		}
+		frame->at  = p - 1;
+		frame->end = entries + countlimit->count;
 
-	set_block_number(this, inode, inode_no, block, block_no);
+		if (frame->at->block >= blocks) {
+			goto _bad_index;
+		}
+		if (level == levels) break;
 
-	unsigned int t = (block + 1) * (this->block_size / 512);
-	if (inode->blocks < t) {
-		debug_print(NOTICE, "Setting inode->blocks to %d = (%d fs blocks)", t, t / (this->block_size / 512));
-		inode->blocks = t;
+		inode_read_block(this, inode, frame->at->block, node);
+		entries = (ext2_dx_entry_t *)(node + 8);
 	}
-	write_inode(this, inode, inode_no);
 
-	return E_SUCCESS;
+	frame->node = node;
+	return 0;
+
+_bad_index:
+	debug_print(WARNING, "Directory index looks wrong; searching the directory instead.");
+	free(node);
+	return -1;
 }
 
-/**
- * ext2->inode_read_block
- *
- * @param inode
- * @param no
- * @param block
- * @parma buf
- * @returns Real block number for reference.
+/*
+ * Find `name` among the entries of one directory block.
  */
-static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
-
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		memset(buf, 0x00, this->block_size);
-		debug_print(WARNING, "Tried to read an invalid block. Asked for %d (0-indexed), but inode only has %d!", block, inode->blocks / (this->block_size / 512));
-		return 0;
+static ext2_dir_t * dir_block_find(ext2_fs_t * this, uint8_t * block, char * name) {
+	size_t len = strlen(name);
+	uint32_t offset = 0;
+	while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)((uintptr_t)block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t) || offset + d_ent->rec_len > this->block_size) break;
+		if (d_ent->inode && d_ent->name_len == len && !memcmp(d_ent->name, name, len)) {
+			return d_ent;
+		}
+		offset += d_ent->rec_len;
 	}
-
-	unsigned int real_block = get_block_number(this, inode, block);
-	read_block(this, real_block, buf);
-
-	return real_block;
+	return NULL;
 }
 
-/**
- * ext2->inode_write_block
+/*
+ * Look a name up in a directory, through its index if it has one.
+ *
+ * @param block    Buffer for one block, which holds the entry's block after
+ * @param block_nr Set to the entry block's number within the directory
+ * @returns The entry, within `block`, or NULL.
  */
-static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		debug_print(WARNING, "Attempting to write beyond the existing allocated blocks for this inode.");
-		debug_print(WARNING, "Inode %d, Block %d", inode_no, block);
+static ext2_dir_t * dir_lookup(ext2_fs_t * this, ext2_inodetable_t * inode, char * name, uint8_t * block, uint32_t * block_nr) {
+	ext2_dir_t * found = NULL;
+
+	dx_frame_t frame;
+	if (dx_probe(this, inode, name, &frame) == 0) {
+		for (;;) {
+			*block_nr = frame.at->block;
+			inode_read_block(this, inode, *block_nr, block);
+			found = dir_block_find(this, block, name);
+			if (found) break;
+			/* Names with the same hash can carry on into the next leaf */
+			frame.at++;
+			if (frame.at == frame.end || !(frame.at->hash & 1) || (frame.at->hash & ~1) != frame.hash) break;
+		}
+		free(frame.node);
+		return found;
 	}
 
-	debug_print(WARNING, "clearing and allocating up to required blocks (block=%d, %d)", block, inode->blocks);
-	char * empty = NULL;
-	while (block >= inode->blocks / (this->block_size / 512)) {
-		allocate_inode_block(this, inode, inode_no, inode->blocks / (this->block_size / 512));
-		refresh_inode(this, inode, inode_no);
+	uint32_t blocks = inode->size / this->block_size;
+	for (*block_nr = 0; *block_nr < blocks; ++*block_nr) {
+		inode_read_block(this, inode, *block_nr, block);
+		found = dir_block_find(this, block, name);
+		if (found) break;
 	}
-	if (empty) free(empty);
-	debug_print(WARNING, "... done");
-
-	unsigned int real_block = get_block_number(this, inode, block);
-	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+	return found;
+}
 
-	write_block(this, real_block, buf);
-	return real_block;
+/*
+ * Make room for an entry of `rec_len` bytes in a directory block,
+ * in an unused entry or in the slack after a used one.
+ *
+ * @returns The new entry, with only rec_len set, or NULL.
+ */
+static ext2_dir_t * dir_block_make_room(ext2_fs_t * this, uint8_t * block, unsigned int rec_len) {
+	uint32_t offset = 0;
+	while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)((uintptr_t)block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t) || offset + d_ent->rec_len > this->block_size) break;
+		if (!d_ent->inode && d_ent->rec_len >= rec_len) {
+			return d_ent;
+		}
+		unsigned int used = DIR_REC_LEN(d_ent->name_len);
+		if (d_ent->inode && d_ent->rec_len >= used + rec_len) {
+			ext2_dir_t * out = (ext2_dir_t *)((uintptr_t)d_ent + used);
+			out->rec_len = d_ent->rec_len - used;
+			d_ent->rec_len = used;
+			return out;
+		}
+		offset += d_ent->rec_len;
+	}
+	return NULL;
 }
 
 /**
@@ -616,118 +1560,61 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	ext2_inodetable_t * pinode = read_inode(this,parent->inode);
 	if (((pinode->mode & EXT2_S_IFDIR) == 0) || (name == NULL)) {
 		debug_print(WARNING, "Attempted to allocate an inode in a parent that was not a directory.");
+		free(pinode);
 		return E_BADPARENT;
 	}
 
-	debug_print(WARNING, "Creating a directory entry for %s pointing to inode %d.", name, inode);
-
-	/* okay, how big is it... */
-
-	debug_print(WARNING, "We need to append %d bytes to the direcotry.", sizeof(ext2_dir_t) + strlen(name));
-
-	unsigned int rec_len = sizeof(ext2_dir_t) + strlen(name);
-	rec_len += (rec_len % 4) ? (4 - (rec_len % 4)) : 0;
-
-	debug_print(WARNING, "Our directory entry looks like this:");
-	debug_print(WARNING, "  inode     = %d", inode);
-	debug_print(WARNING, "  rec_len   = %d", rec_len);
-	debug_print(WARNING, "  name_len  = %d", strlen(name));
-	debug_print(WARNING, "  file_type = %d", 0);
-	debug_print(WARNING, "  name      = %s", name);
-
-	debug_print(WARNING, "The inode size is marked as: %d", pinode->size);
-	debug_print(WARNING, "Block size is %d", this->block_size);
+	debug_print(INFO, "Creating a directory entry for %s pointing to inode %d.", name, inode);
 
+	unsigned int rec_len = DIR_REC_LEN(strlen(name));
 	uint8_t * block = malloc(this->block_size);
-	uint8_t block_nr = 0;
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-	int modify_or_replace = 0;
-	ext2_dir_t *previous;
-
-	inode_read_block(this, pinode, block_nr, block);
-	while (total_offset < pinode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, pinode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		unsigned int sreclen = d_ent->name_len + sizeof(ext2_dir_t);
-		sreclen += (sreclen % 4) ? (4 - (sreclen % 4)) : 0;
-
-		{
-			char f[d_ent->name_len+1];
-			memcpy(f, d_ent->name, d_ent->name_len);
-			f[d_ent->name_len] = 0;
-			debug_print(WARNING, " * file: %s", f);
-		}
-		debug_print(WARNING, "   rec_len: %d", d_ent->rec_len);
-		debug_print(WARNING, "   type: %d", d_ent->file_type);
-		debug_print(WARNING, "   namel: %d", d_ent->name_len);
-		debug_print(WARNING, "   inode: %d", d_ent->inode);
-
-		if (d_ent->rec_len != sreclen && total_offset + d_ent->rec_len == pinode->size) {
-			debug_print(WARNING, "  - should be %d, but instead points to end of block", sreclen);
-			debug_print(WARNING, "  - we've hit the end, should change this pointer");
-
-			dir_offset += sreclen;
-			total_offset += sreclen;
-
-			modify_or_replace = 1; /* Modify */
-			previous = d_ent;
-
-			break;
-		}
-
-		if (d_ent->inode == 0) {
-			modify_or_replace = 2; /* Replace */
+	uint32_t block_nr = 0;
+	ext2_dir_t * d_ent = NULL;
+
+	dx_frame_t frame;
+	if (dx_probe(this, pinode, name, &frame) == 0) {
+		block_nr = frame.at->block;
+		free(frame.node);
+		inode_read_block(this, pinode, block_nr, block);
+		d_ent = dir_block_make_room(this, block, rec_len);
+		if (!d_ent) {
+			debug_print(WARNING, "Directory index leaf %d is full; dropping the index.", block_nr);
+			pinode->flags &= ~EXT2_INDEX_FL;
+			write_inode(this, pinode, parent->inode);
 		}
-
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
-	}
-
-	if (!modify_or_replace) {
-		debug_print(WARNING, "That's odd, this shouldn't have happened, we made it all the way here without hitting our two end conditions?");
 	}
 
-	if (modify_or_replace == 1) {
-		debug_print(WARNING, "The last node in the list is a real node, we need to modify it.");
-
-		if (dir_offset + rec_len >= this->block_size) {
-			debug_print(WARNING, "Need to allocate more space, bail!");
-			free(block);
-			return E_NOSPACE;
-		} else {
-			unsigned int sreclen = previous->name_len + sizeof(ext2_dir_t);
-			sreclen += (sreclen % 4) ? (4 - (sreclen % 4)) : 0;
-			previous->rec_len = sreclen;
-			debug_print(WARNING, "Set previous node rec_len to %d", sreclen);
+	if (!d_ent) {
+		uint32_t blocks = pinode->size / this->block_size;
+		for (block_nr = 0; block_nr < blocks; ++block_nr) {
+			inode_read_block(this, pinode, block_nr, block);
+			d_ent = dir_block_make_room(this, block, rec_len);
+			if (d_ent) break;
 		}
-
-	} else if (modify_or_replace == 2) {
-		debug_print(WARNING, "The last node in the list is a fake node, we'll replace it.");
 	}
 
-	debug_print(WARNING, " total_offset = 0x%x", total_offset);
-	debug_print(WARNING, "   dir_offset = 0x%x", dir_offset);
-	ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
+	if (!d_ent) {
+		/* Every block is full; add another one */
+		block_nr = pinode->size / this->block_size;
+		debug_print(INFO, "Growing directory to %d blocks.", block_nr + 1);
+		memset(block, 0, this->block_size);
+		d_ent = (ext2_dir_t *)block;
+		d_ent->rec_len = this->block_size;
+		pinode->size += this->block_size;
+	}
 
 	d_ent->inode     = inode;
-	d_ent->rec_len   = this->block_size - dir_offset;
 	d_ent->name_len  = strlen(name);
 	d_ent->file_type = 0; /* This is unused */
 	memcpy(d_ent->name, name, strlen(name));
 
 	inode_write_block(this, pinode, parent->inode, block_nr, block);
+	write_inode(this, pinode, parent->inode);
 
 	free(block);
 	free(pinode);
 
-
-	return E_NOSPACE;
+	return E_SUCCESS;
 }
 
 static unsigned int allocate_inode(ext2_fs_t * this) {
@@ -755,13 +1642,11 @@ static unsigned int allocate_inode(ext2_fs_t * this) {
 
 	BLOCKBYTE(node_offset) |= SETBIT(node_offset);
 
-	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
+	write_meta_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
 	free(bg_buffer);
 
 	BGD[group].free_inodes_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
-	}
+	write_block_groups(this);
 
 	SB->free_inodes_count--;
 	rewrite_superblock(this);
@@ -782,6 +1667,8 @@ static int mkdir_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 		return -EEXIST;
 	}
 
+	journal_start(this);
+
 	/* Allocate an inode for it */
 	unsigned int inode_no = allocate_inode(this);
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
@@ -855,11 +1742,10 @@ static int mkdir_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 	/* Update directory count in block group descriptor */
 	uint32_t group = inode_no / this->inodes_per_group;
 	BGD[group].used_dirs_count++;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
-	}
+	write_block_groups(this);
 
 	ext2_sync(this);
+	journal_stop(this);
 
 	return 0;
 }
@@ -877,6 +1763,8 @@ static int create_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 		return -EEXIST;
 	}
 
+	journal_start(this);
+
 	/* Allocate an inode for it */
 	unsigned int inode_no = allocate_inode(this);
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
@@ -922,12 +1810,14 @@ static int create_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 	free(inode);
 
 	ext2_sync(this);
+	journal_stop(this);
 
 	return 0;
 }
 
 static int chmod_ext2(fs_node_t * node, int mode) {
 	ext2_fs_t * this = node->device;
+	journal_start(this);
 
 	ext2_inodetable_t * inode = read_inode(this,node->inode);
 
@@ -936,6 +1826,7 @@ static int chmod_ext2(fs_node_t * node, int mode) {
 	write_inode(this, inode, node->inode);
 
 	ext2_sync(this);
+	journal_stop(this);
 
 	return 0;
 }
@@ -945,7 +1836,7 @@ static int chmod_ext2(fs_node_t * node, int mode) {
  */
 static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t no, uint32_t index) {
 	uint8_t *block = malloc(this->block_size);
-	uint8_t block_nr = 0;
+	uint32_t block_nr = 0;
 	inode_read_block(this, inode, block_nr, block);
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
@@ -989,56 +1880,22 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 	ext2_inodetable_t *inode = read_inode(this,node->inode);
 	assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
-	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
-
-			continue;
-		}
-
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = malloc(d_ent->rec_len);
-			memcpy(direntry, d_ent, d_ent->rec_len);
-			break;
-		}
-		free(dname);
-
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
-	}
+	uint32_t block_nr;
+	ext2_dir_t *d_ent = dir_lookup(this, inode, name, block, &block_nr);
 	free(inode);
-	if (!direntry) {
+	if (!d_ent) {
 		free(block);
 		return NULL;
 	}
 	fs_node_t *outnode = malloc(sizeof(fs_node_t));
 	memset(outnode, 0, sizeof(fs_node_t));
 
-	inode = read_inode(this, direntry->inode);
+	inode = read_inode(this, d_ent->inode);
 
-	if (!node_from_file(this, inode, direntry, outnode)) {
+	if (!node_from_file(this, inode, d_ent, outnode)) {
 		debug_print(CRITICAL, "Oh dear. Couldn't allocate the outnode?");
 	}
 
-	free(direntry);
 	free(inode);
 	free(block);
 	return outnode;
@@ -1047,56 +1904,28 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 static int unlink_ext2(fs_node_t * node, char * name) {
 	/* XXX this is a very bad implementation */
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
+	journal_start(this);
 
 	ext2_inodetable_t *inode = read_inode(this,node->inode);
 	assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
-	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
-
-			continue;
-		}
-
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = d_ent;
-			break;
-		}
-		free(dname);
-
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
-	}
-	free(inode);
+	uint32_t block_nr;
+	ext2_dir_t *direntry = dir_lookup(this, inode, name, block, &block_nr);
 	if (!direntry) {
+		free(inode);
 		free(block);
+		journal_stop(this);
 		return -ENOENT;
 	}
 
 	direntry->inode = 0;
 
 	inode_write_block(this, inode, node->inode, block_nr, block);
+	free(inode);
 	free(block);
 
 	ext2_sync(this);
+	journal_stop(this);
 
 	return 0;
 }
@@ -1136,38 +1965,50 @@ static uint32_t read_ext2(fs_node_t *node, uint64_t offset, uint32_t size, uint8
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
 	uint32_t end;
-	if (inode->size == 0) return 0;
+	if (offset >= inode->size || !size) {
+		free(inode);
+		return 0;
+	}
 	if (offset + size > inode->size) {
 		end = inode->size;
 	} else {
 		end = offset + size;
 	}
 	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
+	uint32_t end_block    = (end - 1) / this->block_size;
 	uint32_t size_to_read = end - offset;
+	uint32_t allocated    = inode->blocks / (this->block_size / 512);
 
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
-			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
-			}
+	uint8_t * buf = malloc((end_block - start_block + 1) * this->block_size);
+
+	/*
+	 * Read the blocks in runs that are consecutive on disk, so a large
+	 * read of an unfragmented file goes to the device in one request.
+	 */
+	uint32_t block_offset = start_block;
+	unsigned int real_block = block_offset < allocated ? get_block_number(this, inode, block_offset) : 0;
+	while (block_offset <= end_block) {
+		uint8_t * out = buf + (block_offset - start_block) * this->block_size;
+		unsigned int next_real = 0;
+		uint32_t run = 1;
+		while (block_offset + run <= end_block) {
+			next_real = block_offset + run < allocated ? get_block_number(this, inode, block_offset + run) : 0;
+			if (!real_block || next_real != real_block + run) break;
+			next_real = 0;
+			run++;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
+		if (real_block) {
+			read_blocks(this, real_block, run, out);
+		} else {
+			/* Sparse, or past the blocks the inode has */
+			memset(out, 0x00, this->block_size);
 		}
+		block_offset += run;
+		real_block = next_real;
 	}
+
+	memcpy(buffer, buf + (offset % this->block_size), size_to_read);
+
 	free(inode);
 	free(buf);
 	return size_to_read;
@@ -1184,9 +2025,26 @@ static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode,
 	uint32_t end_block    = end / this->block_size;
 	uint32_t end_size     = end - end_block * this->block_size;
 	uint32_t size_to_read = end - offset;
+
+	/*
+	 * Allocate everything this write needs up front, so it comes from
+	 * one run where possible. Blocks in a hole before the write are
+	 * zeroed; the ones being written start out as zeroes in `buf`.
+	 */
+	uint32_t allocated = inode->blocks / (this->block_size / 512);
+	if (allocate_inode_blocks(this, inode, inode_number, start_block, 1) != E_SUCCESS ||
+		allocate_inode_blocks(this, inode, inode_number, end_size ? end_block + 1 : end_block, 0) != E_SUCCESS) {
+		return 0;
+	}
+	if (allocated < start_block) allocated = start_block;
+
 	uint8_t * buf = malloc(this->block_size);
 	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
+		if (start_block < allocated) {
+			inode_read_block(this, inode, start_block, buf);
+		} else {
+			memset(buf, 0x00, this->block_size);
+		}
 		memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, size_to_read);
 		inode_write_block(this, inode, inode_number, start_block, buf);
 	} else {
@@ -1194,23 +2052,25 @@ static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode,
 		uint32_t blocks_read = 0;
 		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
 			if (block_offset == start_block) {
-				int b = inode_read_block(this, inode, block_offset, buf);
+				if (block_offset < allocated) {
+					inode_read_block(this, inode, block_offset, buf);
+				} else {
+					memset(buf, 0x00, this->block_size);
+				}
 				memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
 				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
-				}
 			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
+				/* Completely overwritten; no need to read it first */
 				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
 				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
-				}
 			}
 		}
 		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
+			if (end_block < allocated) {
+				inode_read_block(this, inode, end_block, buf);
+			} else {
+				memset(buf, 0x00, this->block_size);
+			}
 			memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), end_size);
 			inode_write_block(this, inode, inode_number, end_block, buf);
 		}
@@ -1223,7 +2083,9 @@ static uint32_t write_ext2(fs_node_t *node, uint64_t offset, uint32_t size, uint
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
 
+	journal_start(this);
 	uint32_t rv = write_inode_buffer(this, inode, node->inode, offset, size, buffer);
+	journal_stop(this);
 	free(inode);
 	return rv;
 }
@@ -1232,7 +2094,10 @@ static void truncate_ext2(fs_node_t * node) {
 	ext2_fs_t * this = node->device;
 	ext2_inodetable_t * inode = read_inode(this,node->inode);
 	inode->size = 0;
+	journal_start(this);
 	write_inode(this, inode, node->inode);
+	journal_stop(this);
+	free(inode);
 }
 
 static void open_ext2(fs_node_t *node, unsigned int flags) {
@@ -1240,7 +2105,10 @@ static void open_ext2(fs_node_t *node, unsigned int flags) {
 }
 
 static void close_ext2(fs_node_t *node) {
-	/* Nothing to do here */
+	ext2_fs_t * this = node->device;
+	journal_start(this);
+	prealloc_release(this, node->inode);
+	journal_stop(this);
 }
 
 
@@ -1267,6 +2135,54 @@ static struct dirent * readdir_ext2(fs_node_t *node, uint32_t index) {
 	return dirent;
 }
 
+/**
+ * getdents_ext2
+ *
+ * The cursor is a byte offset into the directory, so each batch
+ * starts where the last one stopped rather than from the top.
+ */
+static int getdents_ext2(fs_node_t *node, uint32_t * cursor, struct dirent * entries, uint32_t count) {
+
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+
+	ext2_inodetable_t *inode = read_inode(this, node->inode);
+	assert(inode->mode & EXT2_S_IFDIR);
+	uint8_t * block = malloc(this->block_size);
+	uint32_t block_nr = (uint32_t)-1;
+	uint32_t read = 0;
+
+	while (read < count && *cursor < inode->size) {
+		if (*cursor / this->block_size != block_nr) {
+			block_nr = *cursor / this->block_size;
+			inode_read_block(this, inode, block_nr, block);
+		}
+
+		uint32_t dir_offset = *cursor % this->block_size;
+		ext2_dir_t * d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
+
+		/* Don't trust a cursor that doesn't land on an entry */
+		if (dir_offset + sizeof(ext2_dir_t) > this->block_size ||
+			d_ent->rec_len < sizeof(ext2_dir_t) ||
+			dir_offset + d_ent->rec_len > this->block_size ||
+			d_ent->name_len > d_ent->rec_len - sizeof(ext2_dir_t)) {
+			break;
+		}
+
+		if (d_ent->inode) {
+			entries[read].ino = d_ent->inode;
+			memcpy(&entries[read].name, &d_ent->name, d_ent->name_len);
+			entries[read].name[d_ent->name_len] = '\0';
+			read++;
+		}
+
+		*cursor += d_ent->rec_len;
+	}
+
+	free(block);
+	free(inode);
+	return read;
+}
+
 static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	if (!name) return -EINVAL;
 
@@ -1280,6 +2196,8 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 		return -EEXIST; /* this should probably have a return value... */
 	}
 
+	journal_start(this);
+
 	/* Allocate an inode for it */
 	unsigned int inode_no = allocate_inode(this);
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
@@ -1337,6 +2255,7 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	free(inode);
 
 	ext2_sync(this);
+	journal_stop(this);
 
 	return 0;
 }
@@ -1379,9 +2298,9 @@ static uint32_t node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_
 	fnode->mask = inode->mode & 0xFFF;
 	fnode->nlink = inode->links_count;
 	/* File Flags */
-	fnode->flags = 0;
+	fnode->flags = FS_DCACHE;
 	if ((inode->mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
-		fnode->flags   |= FS_FILE;
+		fnode->flags   |= FS_FILE | FS_PAGECACHE;
 		fnode->read     = read_ext2;
 		fnode->write    = write_ext2;
 		fnode->create   = NULL;
@@ -1397,6 +2316,7 @@ static uint32_t node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_
 		fnode->create   = create_ext2;
 		fnode->mkdir    = mkdir_ext2;
 		fnode->readdir  = readdir_ext2;
+		fnode->getdents = getdents_ext2;
 		fnode->finddir  = finddir_ext2;
 		fnode->unlink   = unlink_ext2;
 		fnode->write    = NULL;
@@ -1431,6 +2351,7 @@ static uint32_t node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_
 	fnode->chmod   = chmod_ext2;
 	fnode->open    = open_ext2;
 	fnode->close   = close_ext2;
+	fnode->sync    = sync_ext2;
 	fnode->ioctl   = NULL;
 	return 1;
 }
@@ -1451,7 +2372,7 @@ static uint32_t ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t
 	fnode->mask = inode->mode & 0xFFF;
 	fnode->nlink = inode->links_count;
 	/* File Flags */
-	fnode->flags = 0;
+	fnode->flags = FS_DCACHE;
 	if ((inode->mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
 		debug_print(CRITICAL, "Root appears to be a regular file.");
 		debug_print(CRITICAL, "This is probably very, very wrong.");
@@ -1494,7 +2415,9 @@ static uint32_t ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t
 	fnode->chmod   = chmod_ext2;
 	fnode->open    = open_ext2;
 	fnode->close   = close_ext2;
+	fnode->sync    = sync_ext2;
 	fnode->readdir = readdir_ext2;
+	fnode->getdents = getdents_ext2;
 	fnode->finddir = finddir_ext2;
 	fnode->ioctl   = NULL;
 	fnode->create  = create_ext2;
@@ -1503,12 +2426,201 @@ static uint32_t ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t
 	return 1;
 }
 
+/*
+ * Forget everything in the cache, after the disk was changed behind its back.
+ */
+static void cache_reset(ext2_fs_t * this) {
+	memset(this->cache_hash, 0, sizeof(ext2_disk_cache_entry_t *) * this->cache_hash_size);
+	for (unsigned int i = 0; i < this->cache_entries; ++i) {
+		DC[i].block_no  = 0;
+		DC[i].dirty     = 0;
+		DC[i].journal   = 0;
+		DC[i].hash_next = NULL;
+	}
+}
+
+static void journal_read(ext2_fs_t * this, uint32_t block, uint8_t * buf) {
+	read_fs(this->block_device, (uint64_t)this->jnl_map[block] * this->block_size, this->block_size, buf);
+}
+
+/*
+ * Replay the transactions a crash left committed in the journal.
+ *
+ * This is the usual three passes over the log: find where the last
+ * committed transaction ends, collect the revoked blocks, then write
+ * out every logged block that wasn't revoked by a later transaction.
+ * Writes go straight to the disk.
+ *
+ * @returns Number of blocks replayed
+ */
+static unsigned int journal_recover(ext2_fs_t * this) {
+	uint32_t first  = jbd32(JSB->first);
+	uint32_t maxlen = jbd32(JSB->maxlen);
+	uint32_t end_sequence = jbd32(JSB->sequence);
+	unsigned int replayed = 0;
+
+	uint8_t * block = malloc(this->block_size);
+	uint8_t * copy  = malloc(this->block_size);
+	hashmap_t * revoked = hashmap_create_int(16); /* Block -> last transaction that revoked it */
+
+	for (int pass = 0; pass < 3; ++pass) {
+		uint32_t at = jbd32(JSB->start);
+		uint32_t sequence = jbd32(JSB->sequence);
+		int done = 0;
+
+#define JOURNAL_NEXT(b) ((b) + 1 == maxlen ? first : (b) + 1)
+		for (uint32_t walked = 0; !done && walked < maxlen; ) {
+			if (pass && sequence == end_sequence) break;
+
+			journal_read(this, at, block);
+			jbd_header_t * header = (jbd_header_t *)block;
+			if (jbd32(header->magic) != JBD_MAGIC || jbd32(header->sequence) != sequence) break;
+			at = JOURNAL_NEXT(at);
+			walked++;
+
+			switch (jbd32(header->blocktype)) {
+				case JBD_DESCRIPTOR_BLOCK: {
+					uint8_t * tag_at = block + sizeof(jbd_header_t);
+					while (tag_at + sizeof(jbd_block_tag_t) <= block + this->block_size) {
+						jbd_block_tag_t * tag = (jbd_block_tag_t *)tag_at;
+						uint32_t flags  = jbd32(tag->flags);
+						uint32_t target = jbd32(tag->blocknr);
+						void * key = (void *)(uintptr_t)target;
+
+						if (pass == 2 && !(hashmap_has(revoked, key) && (uint32_t)(uintptr_t)hashmap_get(revoked, key) >= sequence)) {
+							journal_read(this, at, copy);
+							if (flags & JBD_FLAG_ESCAPE) {
+								*(uint32_t *)copy = jbd32(JBD_MAGIC);
+							}
+							write_fs(this->block_device, (uint64_t)target * this->block_size, this->block_size, copy);
+							replayed++;
+						}
+
+						at = JOURNAL_NEXT(at);
+						walked++;
+						tag_at += sizeof(jbd_block_tag_t);
+						if (!(flags & JBD_FLAG_SAME_UUID)) tag_at += 16;
+						if (flags & JBD_FLAG_LAST_TAG) break;
+					}
+					break;
+				}
+				case JBD_COMMIT_BLOCK:
+					sequence++;
+					if (pass == 0) end_sequence = sequence;
+					break;
+				case JBD_REVOKE_BLOCK:
+					if (pass == 1) {
+						uint32_t used = jbd32(((jbd_revoke_header_t *)block)->count);
+						if (used > this->block_size) used = this->block_size;
+						for (uint32_t offset = sizeof(jbd_revoke_header_t); offset + 4 <= used; offset += 4) {
+							void * key = (void *)(uintptr_t)jbd32(*(uint32_t *)(block + offset));
+							if (!hashmap_has(revoked, key) || (uint32_t)(uintptr_t)hashmap_get(revoked, key) < sequence) {
+								hashmap_set(revoked, key, (void *)(uintptr_t)sequence);
+							}
+						}
+					}
+					break;
+				default:
+					done = 1;
+					break;
+			}
+		}
+#undef JOURNAL_NEXT
+	}
+
+	hashmap_free(revoked);
+	free(revoked);
+	free(copy);
+	free(block);
+
+	JSB->start    = 0;
+	JSB->sequence = jbd32(end_sequence);
+	journal_write(this, 0, 1, this->jnl_super);
+
+	return replayed;
+}
+
+/*
+ * Find the journal, replay it if the last mount didn't finish with
+ * it, and start journaling if it is a kind we can write.
+ */
+static void journal_load(ext2_fs_t * this) {
+	if (!(SB->feature_compat & EXT2_FEATURE_COMPAT_HAS_JOURNAL) || !SB->journal_inum) return;
+
+	ext2_inodetable_t * inode = read_inode(this, SB->journal_inum);
+	this->jnl_super = malloc(this->block_size);
+	read_fs(this->block_device, (uint64_t)get_block_number(this, inode, 0) * this->block_size, this->block_size, this->jnl_super);
+
+	uint32_t type = jbd32(JSB->header.blocktype);
+	uint32_t maxlen = jbd32(JSB->maxlen);
+	uint32_t first  = jbd32(JSB->first);
+	if (jbd32(JSB->header.magic) != JBD_MAGIC || (type != JBD_SUPERBLOCK_V1 && type != JBD_SUPERBLOCK_V2)) {
+		debug_print(ERROR, "Journal inode %d doesn't hold a journal; not journaling.", SB->journal_inum);
+		goto _no_journal;
+	}
+	if (type == JBD_SUPERBLOCK_V2 && (jbd32(JSB->feature_incompat) & ~JBD_FEATURE_INCOMPAT_REVOKE)) {
+		debug_print(ERROR, "Journal uses features we don't know (0x%x); not journaling.", jbd32(JSB->feature_incompat));
+		goto _no_journal;
+	}
+	if (jbd32(JSB->blocksize) != this->block_size || !first || first >= maxlen ||
+		maxlen > inode->blocks / (this->block_size / 512)) {
+		debug_print(ERROR, "Journal superblock looks wrong; not journaling.");
+		goto _no_journal;
+	}
+
+	this->jnl_map = malloc(sizeof(uint32_t) * maxlen);
+	for (uint32_t i = 0; i < maxlen; ++i) {
+		this->jnl_map[i] = get_block_number(this, inode, i);
+	}
+	free(inode);
+	inode = NULL;
+
+	if (JSB->start) {
+		debug_print(NOTICE, "Replaying the journal...");
+		unsigned int replayed = journal_recover(this);
+		debug_print(NOTICE, "Replayed %d blocks.", replayed);
+
+		/* What we've read so far could be out of date */
+		if (DC) cache_reset(this);
+		read_fs(this->block_device, 1024, sizeof(ext2_superblock_t), (uint8_t *)SB);
+		for (int i = 0; i < this->bgd_block_span; ++i) {
+			read_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
+		}
+	}
+
+	if (!DC) {
+		debug_print(WARNING, "Journaling needs the cache; writing metadata in place (nocache).");
+		goto _no_journal;
+	}
+
+	/* Leave room for the descriptor blocks; half of the cache at most */
+	this->jnl_limit = (maxlen - first - 1) * JBD_TAGS_PER_RUN / (JBD_TAGS_PER_RUN + 1) / 2;
+	if (this->jnl_limit > this->cache_entries / 2) {
+		this->jnl_limit = this->cache_entries / 2;
+	}
+
+	/* Anyone mounting us after a crash has to replay first */
+	SB->feature_incompat |= EXT2_FEATURE_INCOMPAT_RECOVER;
+	write_superblock(this);
+
+	debug_print(NOTICE, "Journaling with %d journal blocks, committing every %d blocks", maxlen, this->jnl_limit);
+	return;
+
+_no_journal:
+	if (inode) free(inode);
+	if (this->jnl_map) free(this->jnl_map);
+	free(this->jnl_super);
+	this->jnl_map = NULL;
+	this->jnl_super = NULL;
+}
+
 static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 
 	debug_print(NOTICE, "Mounting ext2 file system...");
 	ext2_fs_t * this = malloc(sizeof(ext2_fs_t));
 
 	memset(this, 0x00, sizeof(ext2_fs_t));
+	kmutex_init(&this->lock, "ext2");
 
 	this->flags = flags;
 
@@ -1547,16 +2659,32 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 		DC = malloc(sizeof(ext2_disk_cache_entry_t) * this->cache_entries);
 		this->cache_data = malloc(this->block_size * this->cache_entries);
 		memset(this->cache_data, 0, this->block_size * this->cache_entries);
+		this->cache_hash_size = 1;
+		while (this->cache_hash_size < this->cache_entries) {
+			this->cache_hash_size <<= 1;
+		}
+		this->cache_hash = malloc(sizeof(ext2_disk_cache_entry_t *) * this->cache_hash_size);
+		memset(this->cache_hash, 0, sizeof(ext2_disk_cache_entry_t *) * this->cache_hash_size);
+		this->cache_mru = NULL;
+		this->cache_lru = NULL;
 		for (uint32_t i = 0; i < this->cache_entries; ++i) {
 			DC[i].block_no = 0;
 			DC[i].dirty = 0;
-			DC[i].last_use = 0;
 			DC[i].block = this->cache_data + i * this->block_size;
+			DC[i].hash_next = NULL;
+			DC[i].lru_prev = NULL;
+			DC[i].lru_next = NULL;
+			/* Unused entries start out in the LRU list, but in no bucket */
+			cache_touch(this, &DC[i]);
 			if (i % 128 == 0) {
 				debug_print(INFO, "Allocated cache block #%d", i+1);
 			}
 		}
 		debug_print(INFO, "Allocated cache.");
+
+		this->flush_list = malloc(sizeof(ext2_disk_cache_entry_t *) * this->cache_entries);
+		this->flush_buffer = malloc(this->block_size * EXT2_FLUSH_RUN);
+		create_kernel_tasklet(ext2_flusher, "[ext2-flush]", this);
 	} else {
 		DC = NULL;
 		debug_print(NOTICE, "ext2 cache is disabled (nocache)");
@@ -1607,6 +2735,8 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	free(bg_buffer);
 #endif
 
+	journal_load(this);
+
 	ext2_inodetable_t *root_inode = read_inode(this, 2);
 	RN = (fs_node_t *)malloc(sizeof(fs_node_t));
 	if (!ext2_root(this, root_inode, RN)) {
@@ -1,28 +1,472 @@
-/*
- * Experimental Intel High-Definition Audio "driver"
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Intel High Definition Audio
+ *
+ * Plays 48KHz 16-bit stereo through the first output stream of the
+ * controller. Codec commands go through the CORB and their responses
+ * come back in the RIRB, both polled; only the stream interrupts.
+ *
+ * At start we look for an audio function group on each codec, pick an
+ * output pin (line out, then speaker, then headphones) and follow its
+ * connections down to a converter, unmuting everything on the way.
+ *
+ * The stream is a ring of periods, each of which interrupts when it
+ * has been played, and is then refilled from snd.
+ *
+ * See the High Definition Audio Specification, Revision 1.0a.
  */
 
+#include <kernel/dma.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
 #include <kernel/pci.h>
+#include <kernel/process.h>
+#include <kernel/system.h>
 #include <kernel/mod/shell.h>
+#include <kernel/mod/snd.h>
+
+/* Controller registers */
+#define HDA_GCAP      0x00
+#define HDA_GCTL      0x08
+#define HDA_STATESTS  0x0E
+#define HDA_INTCTL    0x20
+#define HDA_INTSTS    0x24
+#define HDA_CORBLBASE 0x40
+#define HDA_CORBUBASE 0x44
+#define HDA_CORBWP    0x48
+#define HDA_CORBRP    0x4A
+#define HDA_CORBCTL   0x4C
+#define HDA_CORBSIZE  0x4E
+#define HDA_RIRBLBASE 0x50
+#define HDA_RIRBUBASE 0x54
+#define HDA_RIRBWP    0x58
+#define HDA_RINTCNT   0x5A
+#define HDA_RIRBCTL   0x5C
+#define HDA_RIRBSTS   0x5D
+#define HDA_RIRBSIZE  0x5E
+
+#define HDA_GCTL_CRST     (1 << 0)
+#define HDA_INTCTL_GIE    ((uint32_t)1 << 31)
+#define HDA_CORBRP_RST    (1 << 15)
+#define HDA_RIRBWP_RST    (1 << 15)
+#define HDA_CORBCTL_RUN   (1 << 1)
+#define HDA_RIRBCTL_RUN   (1 << 1)
+
+/* Stream descriptor registers, from the start of the descriptor */
+#define HDA_SD_BASE(n) (0x80 + (n) * 0x20)
+#define HDA_SD_CTL     0x00 /* 3 bytes; stream number in bits 20-23 */
+#define HDA_SD_STS     0x03
+#define HDA_SD_LPIB    0x04
+#define HDA_SD_CBL     0x08
+#define HDA_SD_LVI     0x0C
+#define HDA_SD_FMT     0x12
+#define HDA_SD_BDPL    0x18
+#define HDA_SD_BDPU    0x1C
+
+#define HDA_SD_CTL_SRST (1 << 0)
+#define HDA_SD_CTL_RUN  (1 << 1)
+#define HDA_SD_CTL_IOCE (1 << 2)
+#define HDA_SD_STS_BCIS (1 << 2)
+#define HDA_SD_STS_MASK 0x1C
+
+#define HDA_STREAM_TAG 1
+
+/* Codec verbs */
+#define VERB_GET_PARAMETER      0xF00
+#define VERB_GET_CONN_LIST      0xF02
+#define VERB_GET_CONFIG_DEFAULT 0xF1C
+#define VERB_SET_CONN_SELECT    0x701
+#define VERB_SET_POWER_STATE    0x705
+#define VERB_SET_STREAM_CHANNEL 0x706
+#define VERB_SET_PIN_CONTROL    0x707
+#define VERB_SET_EAPD           0x70C
+#define VERB_SET_FORMAT         0x2  /* 16-bit payload */
+#define VERB_SET_AMP_GAIN_MUTE  0x3  /* 16-bit payload */
+
+#define PARAM_NODE_COUNT     0x04
+#define PARAM_FUNCTION_TYPE  0x05
+#define PARAM_WIDGET_CAPS    0x09
+#define PARAM_PIN_CAPS       0x0C
+#define PARAM_CONN_LIST_LEN  0x0E
+#define PARAM_OUT_AMP_CAPS   0x12
+
+#define WIDGET_OUTPUT   0x0
+#define WIDGET_MIXER    0x2
+#define WIDGET_SELECTOR 0x3
+#define WIDGET_PIN      0x4
+#define WIDGET_TYPE(caps) (((caps) >> 20) & 0xF)
+
+#define PIN_CAPS_OUTPUT  (1 << 4)
+#define PIN_CAPS_EAPD    (1 << 16)
+#define PIN_CONTROL_OUT  0x40
+#define PIN_CONTROL_HP   0x80
+
+#define AMP_SET_OUTPUT   0xB000 /* Output amp, both channels */
+#define AMP_SET_INPUT    0x7000 /* Input amp, both channels */
+
+/* 48KHz, 16 bits, 2 channels */
+#define HDA_FORMAT 0x0011
+
+#define HDA_SND_NAME "Intel HD Audio"
+#define HDA_PLAYBACK_SPEED 48000
+#define HDA_PLAYBACK_FORMAT SND_FORMAT_L16SLE
+
+#define HDA_BUFFER_SIZE      0x10000 /* Room for every period */
+#define HDA_PERIODS_MAX      32
+#define HDA_PERIOD_MIN       0x80
+#define HDA_PERIOD_MAX       0x2000
+#define HDA_PERIOD_DEFAULT   0x1000
+#define HDA_PERIODS_DEFAULT  4
+
+#define CORB_ENTRIES 256
+#define RIRB_ENTRIES 256
+
+typedef struct {
+	uint64_t address;
+	uint32_t length;
+	uint32_t ioc;
+} __attribute__((packed)) hda_bdl_entry_t;
 
 struct hda_device {
 	uint32_t pci_device;
+	uintptr_t mmio;
+	size_t irq;
+
+	uint32_t * corb;
+	uint64_t * rirb;
+	uint16_t rirb_read;
+
+	int codec;        /* Codec address driving the output, or -1 */
+	int dac;          /* Output converter node */
+	int pin;          /* Output pin node */
+	int stream;       /* Stream descriptor index of the first output stream */
+
+	hda_bdl_entry_t * bdl;
+	uint8_t * buffer;
+	uint32_t periods;
+	uint32_t period_size;
+	uint32_t next_fill; /* The period to refill once it has been played */
 };
 
 static struct hda_device _device;
 
+static int hda_set_periods(uint32_t * periods, uint32_t * size);
+static uint32_t hda_queued(void);
+
+static snd_device_t _snd = {
+	.name            = HDA_SND_NAME,
+	.device          = &_device,
+	.playback_speed  = HDA_PLAYBACK_SPEED,
+	.playback_format = HDA_PLAYBACK_FORMAT,
+
+	.knobs     = NULL,
+	.num_knobs = 0,
+
+	.set_periods = hda_set_periods,
+	.queued      = hda_queued,
+};
+
+static uint32_t hda_read32(uint32_t reg) { return *(volatile uint32_t *)(_device.mmio + reg); }
+static uint16_t hda_read16(uint32_t reg) { return *(volatile uint16_t *)(_device.mmio + reg); }
+static uint8_t  hda_read8(uint32_t reg)  { return *(volatile uint8_t  *)(_device.mmio + reg); }
+static void hda_write32(uint32_t reg, uint32_t val) { *(volatile uint32_t *)(_device.mmio + reg) = val; }
+static void hda_write16(uint32_t reg, uint16_t val) { *(volatile uint16_t *)(_device.mmio + reg) = val; }
+static void hda_write8(uint32_t reg, uint8_t val)   { *(volatile uint8_t  *)(_device.mmio + reg) = val; }
+
+static void hda_sleep(unsigned long ms) {
+	unsigned long s, ss;
+	relative_time(0, ms, &s, &ss);
+	sleep_until((process_t *)current_process, s, ss);
+	switch_task(0);
+}
+
 static void find_hda(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 
 	struct hda_device * hda = extra;
 
-	if ((vendorid == 0x8086) && (deviceid == 0x2668)) {
+	/* Multimedia controller, audio device */
+	if (!hda->pci_device && pci_find_type(device) == 0x0403) {
 		hda->pci_device = device;
 	}
 
 }
 
+/*
+ * Send a verb to a codec and wait for its response.
+ *
+ * @return The response, or -1 if there wasn't one.
+ */
+static uint32_t hda_command(int codec, int node, uint32_t verb, uint32_t payload) {
+	uint32_t command = ((uint32_t)codec << 28) | ((uint32_t)node << 20);
+	if (verb <= 0xF) {
+		command |= (verb << 16) | (payload & 0xFFFF);
+	} else {
+		command |= (verb << 8) | (payload & 0xFF);
+	}
+
+	uint16_t wp = (hda_read16(HDA_CORBWP) + 1) % CORB_ENTRIES;
+	_device.corb[wp] = command;
+	hda_write16(HDA_CORBWP, wp);
+
+	for (int i = 0; i < 10000; ++i) {
+		uint16_t rp = hda_read16(HDA_RIRBWP) % RIRB_ENTRIES;
+		if (rp != _device.rirb_read) {
+			_device.rirb_read = (_device.rirb_read + 1) % RIRB_ENTRIES;
+			hda_write8(HDA_RIRBSTS, hda_read8(HDA_RIRBSTS));
+			return (uint32_t)_device.rirb[_device.rirb_read];
+		}
+	}
+	debug_print(WARNING, "hda: codec %d node %d did not answer verb 0x%x", codec, node, verb);
+	return (uint32_t)-1;
+}
+
+static uint32_t hda_param(int codec, int node, int param) {
+	return hda_command(codec, node, VERB_GET_PARAMETER, param);
+}
+
+static int hda_reset(void) {
+	hda_write32(HDA_GCTL, hda_read32(HDA_GCTL) & ~HDA_GCTL_CRST);
+	for (int i = 0; i < 100 && (hda_read32(HDA_GCTL) & HDA_GCTL_CRST); ++i) hda_sleep(1);
+	hda_write32(HDA_GCTL, hda_read32(HDA_GCTL) | HDA_GCTL_CRST);
+	for (int i = 0; i < 100 && !(hda_read32(HDA_GCTL) & HDA_GCTL_CRST); ++i) hda_sleep(1);
+	if (!(hda_read32(HDA_GCTL) & HDA_GCTL_CRST)) {
+		return 1;
+	}
+	/* Codecs get 521us after reset to ask for an address */
+	hda_sleep(1);
+	return 0;
+}
+
+static void hda_setup_rings(void) {
+	uintptr_t phys;
+
+	hda_write8(HDA_CORBCTL, 0);
+	hda_write8(HDA_RIRBCTL, 0);
+
+	_device.corb = dma_alloc(CORB_ENTRIES * sizeof(uint32_t), ZONE_DMA32, &phys);
+	hda_write32(HDA_CORBLBASE, phys);
+	hda_write32(HDA_CORBUBASE, 0);
+	hda_write8(HDA_CORBSIZE, 0x2); /* 256 entries */
+	hda_write16(HDA_CORBRP, HDA_CORBRP_RST);
+	for (int i = 0; i < 100 && !(hda_read16(HDA_CORBRP) & HDA_CORBRP_RST); ++i);
+	hda_write16(HDA_CORBRP, 0);
+	hda_write16(HDA_CORBWP, 0);
+
+	_device.rirb = dma_alloc(RIRB_ENTRIES * sizeof(uint64_t), ZONE_DMA32, &phys);
+	hda_write32(HDA_RIRBLBASE, phys);
+	hda_write32(HDA_RIRBUBASE, 0);
+	hda_write8(HDA_RIRBSIZE, 0x2); /* 256 entries */
+	hda_write16(HDA_RIRBWP, HDA_RIRBWP_RST);
+	hda_write16(HDA_RINTCNT, 1);
+	_device.rirb_read = 0;
+
+	hda_write8(HDA_CORBCTL, HDA_CORBCTL_RUN);
+	hda_write8(HDA_RIRBCTL, HDA_RIRBCTL_RUN);
+}
+
+static void hda_unmute(int codec, int node) {
+	uint32_t caps = hda_param(codec, node, PARAM_OUT_AMP_CAPS);
+	uint32_t gain = (caps >> 8) & 0x7F; /* Number of steps; the top one is the loudest */
+	hda_command(codec, node, VERB_SET_AMP_GAIN_MUTE, AMP_SET_OUTPUT | gain);
+	hda_command(codec, node, VERB_SET_AMP_GAIN_MUTE, AMP_SET_INPUT | gain);
+}
+
+/*
+ * Follow connections from `node` to an output converter, selecting each
+ * hop and unmuting it.
+ *
+ * @return The converter's node, or 0 if there was none within reach.
+ */
+static int hda_find_dac(int codec, int node, int depth) {
+	uint32_t caps = hda_param(codec, node, PARAM_WIDGET_CAPS);
+	int type = WIDGET_TYPE(caps);
+
+	if (type == WIDGET_OUTPUT) {
+		return node;
+	}
+	if (depth == 0 || (type != WIDGET_PIN && type != WIDGET_MIXER && type != WIDGET_SELECTOR)) {
+		return 0;
+	}
+
+	uint32_t length = hda_param(codec, node, PARAM_CONN_LIST_LEN);
+	if (length & 0x80) return 0; /* Long form entries; nothing we drive uses them */
+	length &= 0x7F;
+
+	for (uint32_t i = 0; i < length; i += 4) {
+		uint32_t entries = hda_command(codec, node, VERB_GET_CONN_LIST, i);
+		for (uint32_t j = 0; j < 4 && i + j < length; ++j) {
+			int next = (entries >> (j * 8)) & 0xFF;
+			int dac = hda_find_dac(codec, next, depth - 1);
+			if (dac) {
+				if (type != WIDGET_MIXER) {
+					hda_command(codec, node, VERB_SET_CONN_SELECT, i + j);
+				}
+				hda_unmute(codec, node);
+				return dac;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pick the best output pin of an audio function group and a path from
+ * a converter to it.
+ */
+static int hda_probe_group(int codec, int group) {
+	uint32_t nodes = hda_param(codec, group, PARAM_NODE_COUNT);
+	int start = (nodes >> 16) & 0xFF;
+	int count = nodes & 0xFF;
+
+	hda_command(codec, group, VERB_SET_POWER_STATE, 0);
+
+	/* Line out, speaker, headphones */
+	for (int want = 0; want < 3; ++want) {
+		for (int node = start; node < start + count; ++node) {
+			uint32_t caps = hda_param(codec, node, PARAM_WIDGET_CAPS);
+			if (WIDGET_TYPE(caps) != WIDGET_PIN) continue;
+			uint32_t pin_caps = hda_param(codec, node, PARAM_PIN_CAPS);
+			if (!(pin_caps & PIN_CAPS_OUTPUT)) continue;
+			uint32_t config = hda_command(codec, node, VERB_GET_CONFIG_DEFAULT, 0);
+			if ((config >> 30) == 1) continue; /* Not connected to anything */
+			if ((int)((config >> 20) & 0xF) != want) continue;
+
+			int dac = hda_find_dac(codec, node, 3);
+			if (!dac) continue;
+
+			hda_command(codec, dac, VERB_SET_POWER_STATE, 0);
+			hda_command(codec, node, VERB_SET_POWER_STATE, 0);
+			hda_command(codec, node, VERB_SET_PIN_CONTROL, PIN_CONTROL_OUT | (want == 2 ? PIN_CONTROL_HP : 0));
+			if (pin_caps & PIN_CAPS_EAPD) {
+				hda_command(codec, node, VERB_SET_EAPD, 0x2);
+			}
+			hda_unmute(codec, dac);
+
+			_device.codec = codec;
+			_device.dac = dac;
+			_device.pin = node;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int hda_probe_codecs(void) {
+	uint16_t present = hda_read16(HDA_STATESTS);
+	for (int codec = 0; codec < 15; ++codec) {
+		if (!(present & (1 << codec))) continue;
+		uint32_t groups = hda_param(codec, 0, PARAM_NODE_COUNT);
+		int start = (groups >> 16) & 0xFF;
+		int count = groups & 0xFF;
+		for (int group = start; group < start + count; ++group) {
+			if ((hda_param(codec, group, PARAM_FUNCTION_TYPE) & 0xFF) != 0x1) continue; /* Audio */
+			if (hda_probe_group(codec, group)) return 1;
+		}
+	}
+	return 0;
+}
+
+static void hda_fill(uint32_t period) {
+	snd_request_buf(&_snd, _device.period_size, _device.buffer + period * _device.period_size);
+}
+
+static int irq_handler(struct regs * regs) {
+	uint32_t intsts = hda_read32(HDA_INTSTS);
+	if (!(intsts & (1 << _device.stream))) return 0;
+
+	uint32_t sd = HDA_SD_BASE(_device.stream);
+	uint8_t sts = hda_read8(sd + HDA_SD_STS);
+	hda_write8(sd + HDA_SD_STS, sts & HDA_SD_STS_MASK);
+
+	if (sts & HDA_SD_STS_BCIS) {
+		/* Refill everything behind the period that is playing now */
+		uint32_t playing = (hda_read32(sd + HDA_SD_LPIB) / _device.period_size) % _device.periods;
+		while (_device.next_fill != playing) {
+			hda_fill(_device.next_fill);
+			_device.next_fill = (_device.next_fill + 1) % _device.periods;
+		}
+	}
+
+	irq_ack(_device.irq);
+	return 1;
+}
+
+/*
+ * (Re)start the output stream with the current period settings.
+ * Interrupts must be off.
+ */
+static void hda_start(void) {
+	uint32_t sd = HDA_SD_BASE(_device.stream);
+
+	hda_write8(sd + HDA_SD_CTL, hda_read8(sd + HDA_SD_CTL) & ~(HDA_SD_CTL_RUN | HDA_SD_CTL_IOCE));
+	for (int i = 0; i < 10000 && (hda_read8(sd + HDA_SD_CTL) & HDA_SD_CTL_RUN); ++i);
+	hda_write8(sd + HDA_SD_CTL, HDA_SD_CTL_SRST);
+	for (int i = 0; i < 10000 && !(hda_read8(sd + HDA_SD_CTL) & HDA_SD_CTL_SRST); ++i);
+	hda_write8(sd + HDA_SD_CTL, 0);
+	for (int i = 0; i < 10000 && (hda_read8(sd + HDA_SD_CTL) & HDA_SD_CTL_SRST); ++i);
+
+	uintptr_t buffer_phys = map_to_physical((uintptr_t)_device.buffer);
+	for (uint32_t i = 0; i < _device.periods; ++i) {
+		_device.bdl[i].address = buffer_phys + i * _device.period_size;
+		_device.bdl[i].length  = _device.period_size;
+		_device.bdl[i].ioc     = 1;
+		hda_fill(i);
+	}
+	_device.next_fill = 0;
+
+	hda_write32(sd + HDA_SD_BDPL, map_to_physical((uintptr_t)_device.bdl));
+	hda_write32(sd + HDA_SD_BDPU, 0);
+	hda_write32(sd + HDA_SD_CBL, _device.periods * _device.period_size);
+	hda_write16(sd + HDA_SD_LVI, _device.periods - 1);
+	hda_write16(sd + HDA_SD_FMT, HDA_FORMAT);
+	hda_write8(sd + HDA_SD_CTL + 2, HDA_STREAM_TAG << 4);
+	hda_write8(sd + HDA_SD_STS, HDA_SD_STS_MASK);
+
+	hda_write8(sd + HDA_SD_CTL, HDA_SD_CTL_IOCE | HDA_SD_CTL_RUN);
+}
+
+static int hda_set_periods(uint32_t * periods, uint32_t * size) {
+	if (!*periods && !*size) {
+		*periods = _device.periods;
+		*size = _device.period_size;
+		return 0;
+	}
+
+	uint32_t new_size = *size ? *size : _device.period_size;
+	new_size = MAX(HDA_PERIOD_MIN, MIN(new_size, HDA_PERIOD_MAX)) & ~0x7F; /* Buffers are 128-byte aligned */
+	uint32_t new_periods = *periods ? *periods : _device.periods;
+	new_periods = MAX(2, MIN(new_periods, HDA_PERIODS_MAX));
+	while (new_periods * new_size > HDA_BUFFER_SIZE) {
+		new_periods--;
+	}
+
+	IRQ_OFF;
+	_device.period_size = new_size;
+	_device.periods = new_periods;
+	hda_start();
+	IRQ_RES;
+
+	*size = new_size;
+	*periods = new_periods;
+	debug_print(NOTICE, "hda: playing %d periods of %d bytes", new_periods, new_size);
+	return 0;
+}
+
+static uint32_t hda_queued(void) {
+	IRQ_OFF;
+	uint32_t total = _device.periods * _device.period_size;
+	uint32_t position = hda_read32(HDA_SD_BASE(_device.stream) + HDA_SD_LPIB) % total;
+	/* Everything from the position to the next period we would refill has been filled */
+	uint32_t played = (position + total - _device.next_fill * _device.period_size) % total;
+	IRQ_RES;
+	return (total - played) / 4;
+}
+
 DEFINE_SHELL_FUNCTION(hda_test, "[debug] Intel HDA experiments") {
 
 	if (!_device.pci_device) {
@@ -30,16 +474,72 @@ DEFINE_SHELL_FUNCTION(hda_test, "[debug] Intel HDA experiments") {
 		return 1;
 	}
 	fprintf(tty, "HDA audio device is at 0x%x.\n", _device.pci_device);
+	if (_device.codec < 0) {
+		fprintf(tty, "No usable output was found.\n");
+		return 1;
+	}
+	fprintf(tty, "Codec %d: converter %d -> pin %d, stream %d\n",
+		_device.codec, _device.dac, _device.pin, _device.stream);
+	fprintf(tty, "%d periods of %d bytes, %d frames queued\n",
+		_device.periods, _device.period_size, hda_queued());
 
 	return 0;
 }
 
 static int init(void) {
 	BIND_SHELL_FUNCTION(hda_test);
+	_device.codec = -1;
 	pci_scan(&find_hda, -1, &_device);
 	if (!_device.pci_device) {
 		return 1;
 	}
+
+	_device.mmio = pci_read_field(_device.pci_device, PCI_BAR0, 4) & 0xFFFFFFF0;
+	for (size_t x = 0; x < 0x4000; x += 0x1000) {
+		uintptr_t addr = (_device.mmio & 0xFFFFF000) + x;
+		dma_frame(get_page(addr, 1, kernel_directory), 1, 1, addr);
+	}
+	_device.irq = pci_get_interrupt(_device.pci_device);
+
+	/* Enable memory space and bus mastering */
+	pci_write_field(_device.pci_device, PCI_COMMAND, 2, pci_read_field(_device.pci_device, PCI_COMMAND, 2) | 0x6);
+
+	if (hda_reset()) {
+		debug_print(ERROR, "hda: controller did not come out of reset");
+		return 1;
+	}
+	hda_setup_rings();
+
+	if (!hda_probe_codecs()) {
+		debug_print(WARNING, "hda: no codec with an output we can drive");
+		return 1;
+	}
+
+	uint16_t gcap = hda_read16(HDA_GCAP);
+	if (!((gcap >> 12) & 0xF)) {
+		debug_print(WARNING, "hda: controller has no output streams");
+		return 1;
+	}
+	_device.stream = (gcap >> 8) & 0xF; /* Output streams come after the input streams */
+
+	hda_command(_device.codec, _device.dac, VERB_SET_FORMAT, HDA_FORMAT);
+	hda_command(_device.codec, _device.dac, VERB_SET_STREAM_CHANNEL, HDA_STREAM_TAG << 4);
+
+	uintptr_t phys;
+	_device.bdl = dma_alloc(HDA_PERIODS_MAX * sizeof(hda_bdl_entry_t), ZONE_DMA32, &phys);
+	_device.buffer = dma_alloc(HDA_BUFFER_SIZE, ZONE_DMA32, &phys);
+	_device.periods = HDA_PERIODS_DEFAULT;
+	_device.period_size = HDA_PERIOD_DEFAULT;
+
+	snd_register(&_snd);
+
+	IRQ_OFF;
+	irq_install_handler(_device.irq, irq_handler, "hda");
+	hda_write32(HDA_INTCTL, HDA_INTCTL_GIE | (1 << _device.stream));
+	hda_start();
+	IRQ_RES;
+
+	debug_print(NOTICE, "hda: codec %d, converter %d, pin %d", _device.codec, _device.dac, _device.pin);
 	return 0;
 }
 
@@ -47,5 +547,6 @@ static int fini(void) {
 	return 0;
 }
 
-MODULE_DEF(hda, init, fini);
+MODULE_DEF_DEFERRED(hda, init, fini);
 MODULE_DEPENDS(debugshell);
+MODULE_DEPENDS(snd);
@@ -31,6 +31,8 @@ typedef struct {
 	uint32_t block_size;
 	hashmap_t * cache;
 	list_t * lru;
+	hashmap_t * dirs; /* Directory extent -> iso_dir_t */
+	spin_lock_t dirs_lock;
 } iso_9660_fs_t;
 
 typedef struct {
@@ -135,10 +137,31 @@ typedef struct {
 	char application_use[];
 } __attribute__((packed)) iso_9660_volume_descriptor_t;
 
-static void file_from_dir_entry(iso_9660_fs_t * this, size_t sector, iso_9660_directory_entry_t * dir, size_t offset, fs_node_t * fs);
+typedef struct iso_record iso_record_t;
+static void file_from_record(iso_9660_fs_t * this, iso_record_t * record, fs_node_t * fs);
 
-#define CACHE_SIZE 64
+#define CACHE_SIZE 256
+#define READAHEAD  16 /* Sectors read into the cache on a miss, in one request */
 
+static void cache_insert(iso_9660_fs_t * this, uint32_t sector_id, char * data) {
+	void * sector_id_v = (void *)sector_id;
+	if (hashmap_has(this->cache, sector_id_v)) return;
+	if (this->lru->length > CACHE_SIZE) {
+		node_t * l = list_dequeue(this->lru);
+		free(hashmap_get(this->cache, l->value));
+		hashmap_remove(this->cache, l->value);
+		free(l);
+	}
+	char * buf = malloc(this->block_size);
+	memcpy(buf, data, this->block_size);
+	hashmap_set(this->cache, sector_id_v, buf);
+	list_insert(this->lru, sector_id_v);
+}
+
+/*
+ * Directories and volume descriptors are read a sector at a time but
+ * sit in runs on the disc, so a miss reads the sectors after it too.
+ */
 static void read_sector(iso_9660_fs_t * this, uint32_t sector_id, char * buffer) {
 	if (this->cache) {
 		void * sector_id_v = (void *)sector_id;
@@ -150,17 +173,20 @@ static void read_sector(iso_9660_fs_t * this, uint32_t sector_id, char * buffer)
 			list_append(this->lru, me);
 
 		} else {
-			if (this->lru->length > CACHE_SIZE) {
-				node_t * l = list_dequeue(this->lru);
-				free(hashmap_get(this->cache, l->value));
-				hashmap_remove(this->cache, l->value);
-				free(l);
+			uint32_t count = READAHEAD;
+			uint32_t sectors = this->block_device->length / this->block_size;
+			if (sector_id >= sectors) {
+				count = 1;
+			} else if (sector_id + count > sectors) {
+				count = sectors - sector_id;
 			}
-			read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
-			char * buf = malloc(this->block_size);
-			memcpy(buf, buffer, this->block_size);
-			hashmap_set(this->cache, sector_id_v, buf);
-			list_insert(this->lru, sector_id_v);
+			char * run = malloc(count * this->block_size);
+			read_fs(this->block_device, (uint64_t)sector_id * this->block_size, count * this->block_size, (uint8_t *)run);
+			memcpy(buffer, run, this->block_size);
+			for (uint32_t i = 0; i < count; ++i) {
+				cache_insert(this, sector_id + i, run + i * this->block_size);
+			}
+			free(run);
 		}
 	} else {
 		read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
@@ -184,6 +210,157 @@ static void close_iso(fs_node_t *node) {
 	/* Nothing to do here */
 }
 
+/*
+ * Parsed directories. ISO 9660 is read-only, so a directory's records
+ * are read and parsed once, when it is first looked in, and kept for
+ * as long as the filesystem is mounted.
+ */
+struct iso_record {
+	char * name;     /* Rock Ridge name if there is one, else the cleaned-up ISO name */
+	uint32_t extent;
+	uint32_t length;
+	uint8_t flags;
+};
+
+typedef struct {
+	size_t count;
+	iso_record_t * records; /* In directory order, without "." and ".." */
+	hashmap_t * by_name;
+} iso_dir_t;
+
+/*
+ * The name of a record: its Rock Ridge NM entries if it has any,
+ * otherwise the ISO name, lowercased and without its version.
+ */
+static char * record_name(iso_9660_directory_entry_t * dir) {
+	uint8_t * record = (uint8_t *)dir;
+	size_t su = sizeof(iso_9660_directory_entry_t) + dir->name_len + !(dir->name_len & 1);
+	char rr_name[256];
+	size_t rr_len = 0;
+	while (su + 4 <= dir->length) {
+		uint8_t len = record[su + 2];
+		if (len < 4 || su + len > dir->length) break;
+		if (record[su] == 'N' && record[su + 1] == 'M' && len > 5 && !(record[su + 4] & 0x06)) {
+			/* Flags 2 and 4 name "." and ".."; 1 means it continues in the next NM */
+			for (size_t i = su + 5; i < su + len && rr_len < sizeof(rr_name) - 1; ++i) {
+				rr_name[rr_len++] = record[i];
+			}
+		}
+		su += len;
+	}
+	if (rr_len) {
+		rr_name[rr_len] = '\0';
+		return strdup(rr_name);
+	}
+
+	char * file_name = malloc(dir->name_len + 1);
+	memcpy(file_name, dir->name, dir->name_len);
+	file_name[dir->name_len] = 0;
+	inplace_lower(file_name);
+	char * dot = strchr(file_name, '.');
+	if (!dot) {
+		/* It's a directory. */
+	} else {
+		char * ext = dot + 1;
+		char * semi = strchr(ext, ';');
+		if (semi) {
+			*semi = 0;
+		}
+		if (strlen(ext) == 0) {
+			*dot = 0;
+		} else {
+			char * derp = ext;
+			while (*derp == '.') derp++;
+			if (derp != ext) {
+				memmove(ext, derp, strlen(derp)+1);
+			}
+		}
+	}
+	return file_name;
+}
+
+static void record_from_entry(iso_9660_directory_entry_t * dir, iso_record_t * record) {
+	record->name   = record_name(dir);
+	record->extent = dir->extent_start_LSB;
+	record->length = dir->extent_length_LSB;
+	record->flags  = dir->flags;
+}
+
+static iso_dir_t * dir_parse(iso_9660_fs_t * this, uint32_t extent, uint32_t length) {
+	size_t sectors = (length + this->block_size - 1) / this->block_size;
+	uint8_t * data = malloc(sectors * this->block_size);
+	for (size_t i = 0; i < sectors; ++i) {
+		read_sector(this, extent + i, (char *)data + i * this->block_size);
+	}
+
+	iso_dir_t * out = malloc(sizeof(iso_dir_t));
+	out->count = 0;
+	out->by_name = hashmap_create(16);
+
+	/* Records don't cross sectors; a zero length means the rest of this sector is padding */
+	size_t space = 16;
+	out->records = malloc(sizeof(iso_record_t) * space);
+	size_t offset = 0;
+	while (offset + sizeof(iso_9660_directory_entry_t) <= length) {
+		iso_9660_directory_entry_t * dir = (iso_9660_directory_entry_t *)(data + offset);
+		if (dir->length == 0) {
+			offset = (offset / this->block_size + 1) * this->block_size;
+			continue;
+		}
+		if (offset + dir->length > length) break;
+		offset += dir->length;
+
+		if (dir->flags & FLAG_HIDDEN) continue;
+		if (dir->name_len == 1 && (dir->name[0] == 0 || dir->name[0] == 1)) continue; /* . and .. */
+
+		if (out->count == space) {
+			space *= 2;
+			out->records = realloc(out->records, sizeof(iso_record_t) * space);
+		}
+		iso_record_t * record = &out->records[out->count++];
+		record_from_entry(dir, record);
+		if (!hashmap_has(out->by_name, record->name)) {
+			hashmap_set(out->by_name, record->name, (void *)out->count);
+		}
+	}
+
+	free(data);
+	return out;
+}
+
+static void dir_free(iso_dir_t * dir) {
+	for (size_t i = 0; i < dir->count; ++i) {
+		free(dir->records[i].name);
+	}
+	free(dir->records);
+	hashmap_free(dir->by_name);
+	free(dir->by_name);
+	free(dir);
+}
+
+static iso_dir_t * dir_get(fs_node_t * node) {
+	iso_9660_fs_t * this = node->device;
+	void * key = (void *)node->inode;
+
+	spin_lock(this->dirs_lock);
+	iso_dir_t * dir = hashmap_get(this->dirs, key);
+	spin_unlock(this->dirs_lock);
+	if (dir) return dir;
+
+	/* Reading sleeps, so someone else may parse it too; the first one in is kept */
+	iso_dir_t * parsed = dir_parse(this, node->inode, node->length);
+	spin_lock(this->dirs_lock);
+	dir = hashmap_get(this->dirs, key);
+	if (!dir) {
+		hashmap_set(this->dirs, key, parsed);
+		dir = parsed;
+		parsed = NULL;
+	}
+	spin_unlock(this->dirs_lock);
+	if (parsed) dir_free(parsed);
+	return dir;
+}
+
 static struct dirent * readdir_iso(fs_node_t *node, uint32_t index) {
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
@@ -201,194 +378,67 @@ static struct dirent * readdir_iso(fs_node_t *node, uint32_t index) {
 		return out;
 	}
 
-	iso_9660_fs_t * this = node->device;
-	char * buffer = malloc(this->block_size);
-	read_sector(this, node->inode, buffer);
-	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(buffer + node->impl);
-
-	debug_print(INFO, "[iso] Reading directory for readdir; sector = %d, offset = %d", node->inode, node->impl);
-
-	uint8_t * root_data = malloc(root_entry->extent_length_LSB);
-	uint8_t * offset = root_data;
-	size_t sector_offset = 0;
-	size_t length_to_read = root_entry->extent_length_LSB;
-	while (length_to_read) {
-		read_sector(this, root_entry->extent_start_LSB + sector_offset, (char*)offset);
-		if (length_to_read >= this->block_size) {
-			offset += this->block_size;
-			sector_offset += 1;
-			length_to_read -= this->block_size;
-		} else {
-			break;
-		}
-	}
-
-	debug_print(INFO, "[iso] Done, want index = %d", index);
+	iso_dir_t * dir = dir_get(node);
+	if (index - 2 >= dir->count) return NULL;
 
-	/* Examine directory */
-	offset = root_data;
-
-	unsigned int i = 0;
-	struct dirent *dirent = malloc(sizeof(struct dirent));
-	fs_node_t * out = malloc(sizeof(fs_node_t));
+	iso_record_t * record = &dir->records[index - 2];
+	struct dirent * dirent = malloc(sizeof(struct dirent));
 	memset(dirent, 0, sizeof(struct dirent));
-	while (1) {
-		iso_9660_directory_entry_t * dir = (iso_9660_directory_entry_t *)offset;
-		if (dir->length == 0) {
-			debug_print(INFO, "dir->length = %d", dir->length);
-			if ((size_t)(offset - root_data) < root_entry->extent_length_LSB) {
-				offset += 1; // this->block_size - ((uintptr_t)offset % this->block_size);
-				goto try_again;
-			}
-			break;
-		}
-		if (!(dir->flags & FLAG_HIDDEN)) {
-			debug_print(INFO, "[iso] Found file %d", i);
-			if (i == index) {
-				file_from_dir_entry(this, (root_entry->extent_start_LSB)+(offset - root_data)/this->block_size, dir, (offset - root_data) % this->block_size, out);
-				memcpy(&dirent->name, out->name, strlen(out->name)+1);
-				dirent->ino = out->inode;
-				goto cleanup;
-			}
-			i += 1;
-		}
-		offset += dir->length;
-try_again:
-		if ((size_t)(offset - root_data) > root_entry->extent_length_LSB) break;
-	}
-
-	debug_print(INFO, "offset = %x; root_data = %x; extent = %x", offset, root_data, root_entry->extent_length_LSB);
-
-	free(dirent);
-	dirent = NULL;
-
-cleanup:
-	free(root_data);
-	free(buffer);
-	free(out);
+	memcpy(&dirent->name, record->name, strlen(record->name)+1);
+	dirent->ino = record->extent;
 	return dirent;
 }
 
 static uint32_t read_iso(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
 	iso_9660_fs_t * this = node->device;
-	char * tmp = malloc(this->block_size);
-	read_sector(this, node->inode, tmp);
-	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(tmp + node->impl);
+
+	if (offset >= node->length) return 0;
 
 	uint32_t end;
 	/* We can do this in a single underlying read to the filesystem */
-	if (offset + size > root_entry->extent_length_LSB) {
-		end = root_entry->extent_length_LSB;
+	if (offset + size > node->length) {
+		end = node->length;
 	} else {
 		end = offset + size;
 	}
 	uint32_t size_to_read = end - offset;
 
-	read_fs(this->block_device, root_entry->extent_start_LSB * this->block_size + offset, size_to_read, (uint8_t *)buffer);
+	read_fs(this->block_device, (uint64_t)node->inode * this->block_size + offset, size_to_read, (uint8_t *)buffer);
 
-	free(tmp);
 	return size_to_read;
 }
 
 static fs_node_t * finddir_iso(fs_node_t *node, char *name) {
 	iso_9660_fs_t * this = node->device;
-	char * buffer = malloc(this->block_size);
-	read_sector(this, node->inode, buffer);
-	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(buffer + node->impl);
-
-	uint8_t * root_data = malloc(root_entry->extent_length_LSB);
-	uint8_t * offset = root_data;
-	size_t sector_offset = 0;
-	size_t length_to_read = root_entry->extent_length_LSB;
-	while (length_to_read) {
-		read_sector(this, root_entry->extent_start_LSB + sector_offset, (char*)offset);
-		if (length_to_read >= this->block_size) {
-			offset += this->block_size;
-			sector_offset += 1;
-			length_to_read -= this->block_size;
-		} else {
-			break;
-		}
-	}
+	iso_dir_t * dir = dir_get(node);
 
-	/* Examine directory */
-	offset = root_data;
+	uintptr_t index = (uintptr_t)hashmap_get(dir->by_name, name);
+	if (!index) return NULL;
 
 	fs_node_t * out = malloc(sizeof(fs_node_t));
-	while (1) {
-		iso_9660_directory_entry_t * dir = (iso_9660_directory_entry_t *)offset;
-		if (dir->length == 0) {
-			if ((size_t)(offset - root_data) < root_entry->extent_length_LSB) {
-				offset += 1; // this->block_size - ((uintptr_t)offset % this->block_size);
-				goto try_next_finddir;
-			}
-			break;
-		}
-		if (!(dir->flags & FLAG_HIDDEN)) {
-			memset(out, 0, sizeof(fs_node_t));
-			file_from_dir_entry(this, (root_entry->extent_start_LSB)+(offset - root_data)/this->block_size, dir, (offset - root_data) % this->block_size, out);
-
-			if (!strcmp(out->name, name)) {
-				goto cleanup; /* found it */
-			}
-
-		}
-		offset += dir->length;
-try_next_finddir:
-		if ((size_t)(offset - root_data) > root_entry->extent_length_LSB) break;
-	}
-
-	free(out);
-	out = NULL;
-
-cleanup:
-	free(root_data);
-	free(buffer);
+	memset(out, 0, sizeof(fs_node_t));
+	file_from_record(this, &dir->records[index - 1], out);
 	return out;
 }
 
-static void file_from_dir_entry(iso_9660_fs_t * this, size_t sector, iso_9660_directory_entry_t * dir, size_t offset, fs_node_t * fs) {
+static void file_from_record(iso_9660_fs_t * this, iso_record_t * record, fs_node_t * fs) {
 	fs->device = this;
-	fs->inode  = sector; /* Sector the file is in */
-	fs->impl   = offset; /* Offset */
+	fs->inode  = record->extent; /* Where its data is */
+	fs->impl   = 0;
 
-	char * file_name = malloc(dir->name_len + 1);
-	memcpy(file_name, dir->name, dir->name_len);
-	file_name[dir->name_len] = 0;
-	inplace_lower(file_name);
-	char * dot = strchr(file_name, '.');
-	if (!dot) {
-		/* It's a directory. */
-	} else {
-		char * ext = dot + 1;
-		char * semi = strchr(ext, ';');
-		if (semi) {
-			*semi = 0;
-		}
-		if (strlen(ext) == 0) {
-			*dot = 0;
-		} else {
-			char * derp = ext;
-			while (*derp == '.') derp++;
-			if (derp != ext) {
-				memmove(ext, derp, strlen(derp)+1);
-			}
-		}
-	}
-	memcpy(fs->name, file_name, strlen(file_name)+1);
-	free(file_name);
+	memcpy(fs->name, record->name, strlen(record->name)+1);
 
 	fs->uid = 0;
 	fs->gid = 0;
-	fs->length = dir->extent_length_LSB;
+	fs->length = record->length;
 	fs->mask = 0555;
 	fs->nlink = 0; /* Unsupported */
-	if (dir->flags & FLAG_DIRECTORY) {
-		fs->flags = FS_DIRECTORY;
+	if (record->flags & FLAG_DIRECTORY) {
+		fs->flags = FS_DIRECTORY | FS_DCACHE;
 		fs->readdir = readdir_iso;
 		fs->finddir = finddir_iso;
 	} else {
-		fs->flags = FS_FILE;
+		fs->flags = FS_FILE | FS_PAGECACHE | FS_DCACHE;
 		fs->read = read_iso;
 	}
 	/* Other things not supported */
@@ -429,7 +479,9 @@ static fs_node_t * iso_fs_mount(char * device, char * mount_path) {
 	}
 
 	iso_9660_fs_t * this = malloc(sizeof(iso_9660_fs_t));
+	memset(this, 0, sizeof(iso_9660_fs_t));
 	this->block_device = dev;
+	this->dirs = hashmap_create_int(64);
 	this->block_size = ISO_SECTOR_SIZE;
 	if (cache) {
 		this->cache = hashmap_create_int(10);
@@ -438,8 +490,6 @@ static fs_node_t * iso_fs_mount(char * device, char * mount_path) {
 		this->cache = NULL;
 	}
 
-	/* Probably want to put a block cache on this like EXT2 driver does; or do that in the ATAPI layer... */
-
 	debug_print(WARNING, "ISO 9660 file system driver mounting %s to %s", device, mount_path);
 
 	/* Read the volume descriptors */
@@ -489,9 +539,13 @@ static fs_node_t * iso_fs_mount(char * device, char * mount_path) {
 	debug_print(WARNING, " Interleave gap:   %d", root_entry->interleave_gap);
 	debug_print(WARNING, " Volume Seq:       %d", root_entry->volume_seq_LSB);
 
+	iso_record_t record;
+	record_from_entry(root_entry, &record);
 	fs_node_t * fs = malloc(sizeof(fs_node_t));
 	memset(fs, 0, sizeof(fs_node_t));
-	file_from_dir_entry(this, i, root_entry, 156, fs);
+	file_from_record(this, &record, fs);
+	free(record.name);
+	free(tmp);
 
 	free(arg);
 	return fs;
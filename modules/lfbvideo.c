@@ -6,7 +6,8 @@
  * Generic linear framebuffer driver.
  *
  * Supports several cases:
- *  - Bochs/QEMU/VirtualBox "Bochs VBE" with modesetting.
+ *  - Bochs/QEMU/VirtualBox "Bochs VBE" with modesetting, and VBVA
+ *    update reporting on VirtualBox.
  *  - VMware SVGA with modesetting.
  *  - Linear framebuffers set by the bootloader with no modesetting.
  */
@@ -46,6 +47,20 @@ static pid_t display_change_recipient = 0;
 /* Driver-specific modesetting function */
 static void (*lfb_resolution_impl)(uint16_t,uint16_t) = NULL;
 
+/* Driver-specific damage reporting, for adapters that need to be told what changed */
+static void (*lfb_update_impl)(struct vid_rect *, uint32_t) = NULL;
+
+/*
+ * Driver-specific panning, for adapters with a virtual framebuffer
+ * taller than the screen; page N starts at scanline N * height.
+ */
+static void (*lfb_flip_impl)(uint32_t) = NULL;
+static uint32_t lfb_pages = 1;
+
+/* Driver-specific hardware cursor */
+static void (*lfb_cursor_impl)(struct vid_cursor *) = NULL;
+static void (*lfb_cursor_move_impl)(struct vid_cursor_position *) = NULL;
+
 /* Called by ioctl on /dev/fb0 */
 void lfb_set_resolution(uint16_t x, uint16_t y) {
 	if (lfb_resolution_impl) {
@@ -108,6 +123,48 @@ static int ioctl_vid(fs_node_t * node, int request, void * argp) {
 			}
 			validate(argp);
 			return lfb_init(argp);
+		case IO_VID_UPDATE:
+			/* Push changed regions to the display adapter */
+			validate(argp);
+			if (!lfb_update_impl) {
+				return -EINVAL;
+			} else {
+				struct vid_update * update = argp;
+				uint32_t count = update->count;
+				if (count > VID_UPDATE_RECTS) count = VID_UPDATE_RECTS;
+				lfb_update_impl(update->rects, count);
+			}
+			return 0;
+		case IO_VID_PAGES:
+			/* Get number of screen-sized pages we can flip between */
+			validate(argp);
+			*((size_t *)argp) = lfb_flip_impl ? lfb_pages : 1;
+			return 0;
+		case IO_VID_FLIP:
+			/* Show a different page */
+			validate(argp);
+			if (!lfb_flip_impl || *((uint32_t *)argp) >= lfb_pages) {
+				return -EINVAL;
+			}
+			lfb_flip_impl(*((uint32_t *)argp));
+			return 0;
+		case IO_VID_CURSOR:
+			/* Set the hardware cursor image */
+			validate(argp);
+			if (!lfb_cursor_impl || ((struct vid_cursor *)argp)->width > VID_CURSOR_MAX ||
+					((struct vid_cursor *)argp)->height > VID_CURSOR_MAX) {
+				return -EINVAL;
+			}
+			lfb_cursor_impl(argp);
+			return 0;
+		case IO_VID_CURSOR_MOVE:
+			/* Move, show or hide the hardware cursor */
+			validate(argp);
+			if (!lfb_cursor_move_impl) {
+				return -EINVAL;
+			}
+			lfb_cursor_move_impl(argp);
+			return 0;
 		default:
 			return -EINVAL;
 	}
@@ -274,6 +331,17 @@ static void finalize_graphics(const char * driver) {
 }
 
 /* Bochs support {{{ */
+
+/* Video memory past this is kept for the adapter's own use (VBVA) */
+static uint32_t bochs_vram_top = 0;
+
+/* Keep flippable pages clear of the reserved memory */
+static void bochs_clamp_pages(void) {
+	if (!bochs_vram_top || !lfb_resolution_y) return;
+	uint32_t fits = bochs_vram_top / (lfb_resolution_s * lfb_resolution_y);
+	if (lfb_pages > fits) lfb_pages = fits ? fits : 1;
+}
+
 static void bochs_scan_pci(uint32_t device, uint16_t v, uint16_t d, void * extra) {
 	if ((v == 0x1234 && d == 0x1111) ||
 	    (v == 0x80EE && d == 0xBEEF) ||
@@ -300,6 +368,9 @@ static void bochs_set_resolution(uint16_t x, uint16_t y) {
 	/* Set Virtual Height to stuff */
 	outports(0x1CE, 0x07);
 	outports(0x1CF, PREFERRED_VY);
+	/* Start at the top */
+	outports(0x1CE, 0x09);
+	outports(0x1CF, 0);
 	/* Turn it back on */
 	outports(0x1CE, 0x04);
 	outports(0x1CF, 0x41);
@@ -311,12 +382,270 @@ static void bochs_set_resolution(uint16_t x, uint16_t y) {
 		x = new_x;
 	}
 
+	/* The virtual height gets clamped to what fits in video memory */
+	outports(0x1CE, 0x07);
+	uint16_t virtual_y = inports(0x1CF);
+
 	lfb_resolution_x = x;
 	lfb_resolution_s = x * 4;
 	lfb_resolution_y = y;
 	lfb_resolution_b = 32;
+	lfb_pages = y ? virtual_y / y : 1;
+	bochs_clamp_pages();
+}
+
+static void bochs_flip(uint32_t page) {
+	outports(0x1CE, 0x09);
+	outports(0x1CF, page * lfb_resolution_y);
+}
+
+/*
+ * VirtualBox VBVA
+ *
+ * Without it, VirtualBox rescans the whole framebuffer on a timer to
+ * find what changed. With it enabled, the host only redraws what we
+ * report: each update is a record in a ring buffer in video memory
+ * that the host drains on its own. The buffer and the command area
+ * used to set it up (HGSMI) sit at the top of video memory.
+ *
+ * VBVA is only turned on by the first update, so the console and
+ * panic screens, which report nothing, keep being scanned out.
+ */
+#define VBE_DISPI_ID_HGSMI 0xBE01
+#define VBOX_HGSMI_GUEST_PORT 0x3D0
+
+#define HGSMI_CH_VBVA 2
+#define VBVA_ENABLE 7
+#define VBVA_FLUSH  8
+
+#define VBVA_F_ENABLE  0x1
+#define VBVA_F_DISABLE 0x2
+#define VBVA_F_MODE_ENABLED 0x1
+#define VBVA_F_RECORD_PARTIAL 0x80000000
+
+#define VBVA_MAX_RECORDS 64
+#define VBVA_ADAPTER_INFORMATION_SIZE 0x10000
+#define VBVA_BUFFER_SIZE 0x10000
+
+#define VERR_NOT_SUPPORTED (-37)
+
+struct hgsmi_header {
+	uint32_t data_size;
+	uint8_t  flags;
+	uint8_t  channel;
+	uint16_t channel_info;
+	uint8_t  reserved[8];
+} __attribute__((packed));
+
+struct hgsmi_tail {
+	uint32_t reserved;
+	uint32_t checksum;
+} __attribute__((packed));
+
+struct vbva_enable {
+	uint32_t flags;
+	uint32_t offset;
+	int32_t  result;
+} __attribute__((packed));
+
+struct vbva_cmd_hdr {
+	int16_t  x;
+	int16_t  y;
+	uint16_t w;
+	uint16_t h;
+} __attribute__((packed));
+
+struct vbva_buffer {
+	uint32_t host_events;
+	uint32_t supported_orders;
+	uint32_t data_offset;
+	uint32_t free_offset;
+	uint32_t records[VBVA_MAX_RECORDS];
+	uint32_t record_first_index;
+	uint32_t record_free_index;
+	uint32_t partial_write_tresh;
+	uint32_t data_len;
+	uint8_t  data[];
+} __attribute__((packed));
+
+static uint32_t vbva_offset = 0;        /* Of the ring buffer in video memory */
+static uint32_t vbva_hgsmi_offset = 0;  /* Of the command area */
+static volatile struct vbva_buffer * vbva = NULL;
+static int vbva_enabled = 0;
+static int vbva_failed = 0;
+static spin_lock_t vbva_lock = { 0 };
+
+static uint32_t hgsmi_hash(uint32_t hash, const uint8_t * data, size_t size) {
+	while (size--) {
+		hash += *data++;
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+	return hash;
+}
+
+/*
+ * Hand a command to the host. Commands are carried out before the
+ * port write returns, and whatever the host wrote back is copied
+ * into `data`.
+ */
+static void hgsmi_submit(uint16_t command, void * data, uint32_t size) {
+	struct hgsmi_header header = {
+		.data_size = size,
+		.channel = HGSMI_CH_VBVA,
+		.channel_info = command,
+	};
+	struct hgsmi_tail tail = { 0 };
+	uint32_t checksum = hgsmi_hash(0, (uint8_t *)&vbva_hgsmi_offset, sizeof(uint32_t));
+	checksum = hgsmi_hash(checksum, (uint8_t *)&header, sizeof(header));
+	checksum = hgsmi_hash(checksum, (uint8_t *)&tail, sizeof(tail.reserved));
+	checksum += (checksum << 3);
+	checksum ^= (checksum >> 11);
+	checksum += (checksum << 15);
+	tail.checksum = checksum;
+
+	uint8_t * area = lfb_vid_memory + vbva_hgsmi_offset;
+	memcpy(area, &header, sizeof(header));
+	memcpy(area + sizeof(header), data, size);
+	memcpy(area + sizeof(header) + size, &tail, sizeof(tail));
+	/* Port writes wait for the write-combined stores above to land */
+	outportl(VBOX_HGSMI_GUEST_PORT, vbva_hgsmi_offset);
+	memcpy(data, area + sizeof(header), size);
+}
+
+static void vbva_enable(void) {
+	vbva->host_events = 0;
+	vbva->supported_orders = 0;
+	vbva->data_offset = 0;
+	vbva->free_offset = 0;
+	for (int i = 0; i < VBVA_MAX_RECORDS; ++i) {
+		vbva->records[i] = 0;
+	}
+	vbva->record_first_index = 0;
+	vbva->record_free_index = 0;
+	vbva->partial_write_tresh = 256;
+	vbva->data_len = VBVA_BUFFER_SIZE - sizeof(struct vbva_buffer);
+
+	struct vbva_enable enable = {
+		.flags = VBVA_F_ENABLE,
+		.offset = vbva_offset,
+		.result = VERR_NOT_SUPPORTED,
+	};
+	hgsmi_submit(VBVA_ENABLE, &enable, sizeof(enable));
+
+	if (enable.result < 0 || !(vbva->host_events & VBVA_F_MODE_ENABLED)) {
+		debug_print(WARNING, "VirtualBox did not enable VBVA (%d); keeping full refreshes", enable.result);
+		vbva_failed = 1;
+		return;
+	}
+	vbva_enabled = 1;
+}
+
+static void vbva_disable(void) {
+	struct vbva_enable disable = {
+		.flags = VBVA_F_DISABLE,
+		.result = VERR_NOT_SUPPORTED,
+	};
+	hgsmi_submit(VBVA_ENABLE, &disable, sizeof(disable));
+	vbva_enabled = 0;
+}
+
+/* Ask the host to drain the ring now */
+static void vbva_flush(void) {
+	uint32_t reserved = 0;
+	hgsmi_submit(VBVA_FLUSH, &reserved, sizeof(reserved));
+}
+
+static uint32_t vbva_available(void) {
+	int32_t diff = vbva->data_offset - vbva->free_offset;
+	return diff > 0 ? (uint32_t)diff : vbva->data_len + diff;
+}
+
+static int vbva_record(struct vbva_cmd_hdr * cmd) {
+	uint32_t next = (vbva->record_free_index + 1) % VBVA_MAX_RECORDS;
+	if (next == vbva->record_first_index || vbva_available() <= sizeof(*cmd)) {
+		vbva_flush();
+		if (next == vbva->record_first_index || vbva_available() <= sizeof(*cmd)) {
+			return 0;
+		}
+	}
+
+	/* The host skips a record until it is no longer partial */
+	uint32_t record = vbva->record_free_index;
+	vbva->records[record] = VBVA_F_RECORD_PARTIAL;
+	vbva->record_free_index = next;
+
+	uint32_t offset = vbva->free_offset;
+	for (size_t i = 0; i < sizeof(*cmd); ++i) {
+		vbva->data[(offset + i) % vbva->data_len] = ((uint8_t *)cmd)[i];
+	}
+	vbva->free_offset = (offset + sizeof(*cmd)) % vbva->data_len;
+	vbva->records[record] = sizeof(*cmd);
+	return 1;
+}
+
+static void vbva_update(struct vid_rect * rects, uint32_t count) {
+	if (!count) return;
+	spin_lock(vbva_lock);
+	if (!vbva_enabled && !vbva_failed) {
+		vbva_enable();
+	}
+	if (vbva_enabled && !(vbva->host_events & VBVA_F_MODE_ENABLED)) {
+		/* The host turned it off and is scanning out on its own again */
+		vbva_enabled = 0;
+	}
+	for (uint32_t i = 0; vbva_enabled && i < count; ++i) {
+		uint32_t x = rects[i].x;
+		uint32_t y = rects[i].y;
+		if (x >= lfb_resolution_x || y >= lfb_resolution_y) continue;
+		uint32_t w = rects[i].width;
+		uint32_t h = rects[i].height;
+		if (w > lfb_resolution_x - x) w = lfb_resolution_x - x;
+		if (h > lfb_resolution_y - y) h = lfb_resolution_y - y;
+		if (!w || !h) continue;
+		struct vbva_cmd_hdr cmd = { .x = x, .y = y, .w = w, .h = h };
+		if (!vbva_record(&cmd)) break;
+	}
+	spin_unlock(vbva_lock);
+}
+
+static void vbva_set_resolution(uint16_t x, uint16_t y) {
+	spin_lock(vbva_lock);
+	/* Back to full scanout until the next update turns it on again */
+	if (vbva_enabled) {
+		vbva_disable();
+	}
+	spin_unlock(vbva_lock);
+	bochs_set_resolution(x, y);
+}
+
+static void vbva_flip(uint32_t page) {
+	bochs_flip(page);
+	/* The host only redraws what it's told; it has to hear about the whole page */
+	struct vid_rect rect = { 0, 0, lfb_resolution_x, lfb_resolution_y };
+	vbva_update(&rect, 1);
 }
 
+static void vbva_install(uint32_t vid_memsize) {
+	outports(0x1CE, 0x00);
+	outports(0x1CF, VBE_DISPI_ID_HGSMI);
+	if (inports(0x1CF) != VBE_DISPI_ID_HGSMI) return;
+	if (vid_memsize < VBVA_ADAPTER_INFORMATION_SIZE + VBVA_BUFFER_SIZE) return;
+
+	vbva_hgsmi_offset = vid_memsize - VBVA_ADAPTER_INFORMATION_SIZE;
+	vbva_offset = vbva_hgsmi_offset - VBVA_BUFFER_SIZE;
+	vbva = (volatile struct vbva_buffer *)(lfb_vid_memory + vbva_offset);
+	vbva_enabled = 0;
+	vbva_failed = 0;
+	bochs_vram_top = vbva_offset;
+
+	lfb_resolution_impl = &vbva_set_resolution;
+	lfb_update_impl = &vbva_update;
+	lfb_flip_impl = &vbva_flip;
+	debug_print(NOTICE, "VirtualBox HGSMI present; VBVA ring at 0x%x", vbva_offset);
+}
+
+
 static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y) {
 	uint32_t vid_memsize;
 	debug_print(NOTICE, "Setting up BOCHS/QEMU graphics controller...");
@@ -334,6 +663,7 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 	pci_scan(bochs_scan_pci, -1, &lfb_vid_memory);
 
 	lfb_resolution_impl = &bochs_set_resolution;
+	lfb_flip_impl = &bochs_flip;
 
 	if (!lfb_vid_memory) {
 		debug_print(ERROR, "Failed to locate video memory.");
@@ -341,14 +671,7 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 	}
 
 	/* Enable the higher memory */
-	uintptr_t fb_offset = (uintptr_t)lfb_vid_memory;
-	for (uintptr_t i = fb_offset; i <= fb_offset + 0xFF0000; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	map_device_memory((uintptr_t)lfb_vid_memory, 0xFF1000, DEVICE_MEMORY_USER | DEVICE_MEMORY_WC);
 
 	outports(0x1CE, 0x0a);
 	i = inports(0x1CF);
@@ -358,9 +681,10 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 		vid_memsize = inportl(0x1CF);
 	}
 	debug_print(WARNING, "Video memory size is 0x%x", vid_memsize);
-	for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + vid_memsize; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-	}
+	map_device_memory((uintptr_t)lfb_vid_memory, vid_memsize, DEVICE_MEMORY_USER | DEVICE_MEMORY_WC);
+
+	vbva_install(vid_memsize);
+	bochs_clamp_pages();
 
 	finalize_graphics("bochs");
 }
@@ -380,13 +704,7 @@ static void graphics_install_preset(uint16_t w, uint16_t h) {
 
 	debug_print(WARNING, "Mode was set by bootloader: %dx%d bpp should be 32, framebuffer is at 0x%x", w, h, (uintptr_t)lfb_vid_memory);
 
-	for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + w * h * 4; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	map_device_memory((uintptr_t)lfb_vid_memory, w * h * 4, DEVICE_MEMORY_USER | DEVICE_MEMORY_WC);
 	finalize_graphics("preset");
 }
 
@@ -402,9 +720,7 @@ static void graphics_install_kludge(uint16_t w, uint16_t h) {
 
 	for (uintptr_t fb_offset = 0xE0000000; fb_offset < 0xFF000000; fb_offset += 0x01000000) {
 		/* Enable the higher memory */
-		for (uintptr_t i = fb_offset; i <= fb_offset + 0xFF0000; i += 0x1000) {
-			dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-		}
+		map_device_memory(fb_offset, 0xFF1000, DEVICE_MEMORY_USER);
 
 		/* Go find it */
 		for (uintptr_t x = fb_offset; x < fb_offset + 0xFF0000; x += 0x1000) {
@@ -421,13 +737,7 @@ mem_found:
 	lfb_resolution_s = w * 4;
 	lfb_resolution_b = 32;
 
-	for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + w * h * 4; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	map_device_memory((uintptr_t)lfb_vid_memory, w * h * 4, DEVICE_MEMORY_USER | DEVICE_MEMORY_WC);
 	finalize_graphics("kludge");
 }
 
@@ -443,9 +753,45 @@ mem_found:
 #define SVGA_REG_BITS_PER_PIXEL 7
 #define SVGA_REG_BYTES_PER_LINE 12
 #define SVGA_REG_FB_START 13
+#define SVGA_REG_VRAM_SIZE 15
+#define SVGA_REG_MEM_START 18
+#define SVGA_REG_MEM_SIZE 19
+#define SVGA_REG_CONFIG_DONE 20
+#define SVGA_REG_CAPABILITIES 17
+#define SVGA_REG_SYNC 21
+#define SVGA_REG_BUSY 22
+#define SVGA_REG_CURSOR_ID 24
+#define SVGA_REG_CURSOR_X 25
+#define SVGA_REG_CURSOR_Y 26
+#define SVGA_REG_CURSOR_ON 27
+
+#define SVGA_CAP_CURSOR_BYPASS_2 0x00000080
+#define SVGA_CAP_ALPHA_CURSOR    0x00000200
+
+#define SVGA_FIFO_MIN 0
+#define SVGA_FIFO_MAX 1
+#define SVGA_FIFO_NEXT_CMD 2
+#define SVGA_FIFO_STOP 3
+#define SVGA_FIFO_HEADER 4
+
+#define SVGA_CMD_UPDATE 1
+#define SVGA_CMD_DEFINE_ALPHA_CURSOR 22
+
+#define SVGA_CURSOR_ID 0
 
 static uint32_t vmware_io = 0;
 
+/*
+ * Command FIFO. Once CONFIG_DONE is set, the host stops scanning out
+ * the whole framebuffer on its own and only redraws what we tell it
+ * about with UPDATE commands, so this is only enabled once someone
+ * (the compositor) starts sending updates.
+ */
+static volatile uint32_t * vmware_fifo = NULL;
+static uint32_t vmware_fifo_size = 0;
+static int vmware_fifo_ready = 0;
+static spin_lock_t vmware_fifo_lock = { 0 };
+
 static void vmware_scan_pci(uint32_t device, uint16_t v, uint16_t d, void * extra) {
 	if ((v == 0x15ad && d == 0x0405)) {
 		uintptr_t t = pci_read_field(device, PCI_BAR0, 4);
@@ -465,8 +811,100 @@ static uint32_t vmware_read(int reg) {
 	return inportl(SVGA_IO_MUL * SVGA_VALUE_PORT + SVGA_IO_BASE);
 }
 
+static void vmware_fifo_init(void) {
+	if (!vmware_fifo) {
+		uint32_t fifo_addr = vmware_read(SVGA_REG_MEM_START);
+		vmware_fifo_size = vmware_read(SVGA_REG_MEM_SIZE);
+		debug_print(WARNING, "vmware fifo: 0x%x (0x%x bytes)", fifo_addr, vmware_fifo_size);
+
+		map_device_memory(fifo_addr, vmware_fifo_size, DEVICE_MEMORY_USER);
+		vmware_fifo = (volatile uint32_t *)fifo_addr;
+	}
+
+	vmware_fifo[SVGA_FIFO_MIN] = SVGA_FIFO_HEADER * sizeof(uint32_t);
+	vmware_fifo[SVGA_FIFO_MAX] = vmware_fifo_size;
+	vmware_fifo[SVGA_FIFO_NEXT_CMD] = SVGA_FIFO_HEADER * sizeof(uint32_t);
+	vmware_fifo[SVGA_FIFO_STOP] = SVGA_FIFO_HEADER * sizeof(uint32_t);
+	vmware_write(SVGA_REG_CONFIG_DONE, 1);
+	vmware_fifo_ready = 1;
+}
+
+/* Wait for the host to drain the FIFO */
+static void vmware_fifo_sync(void) {
+	vmware_write(SVGA_REG_SYNC, 1);
+	while (vmware_read(SVGA_REG_BUSY));
+}
+
+static void vmware_fifo_write(uint32_t value) {
+	uint32_t next = vmware_fifo[SVGA_FIFO_NEXT_CMD];
+	uint32_t after = next + sizeof(uint32_t);
+	if (after == vmware_fifo[SVGA_FIFO_MAX]) {
+		after = vmware_fifo[SVGA_FIFO_MIN];
+	}
+	if (after == vmware_fifo[SVGA_FIFO_STOP]) {
+		/* Full */
+		vmware_fifo_sync();
+	}
+	vmware_fifo[next / sizeof(uint32_t)] = value;
+	vmware_fifo[SVGA_FIFO_NEXT_CMD] = after;
+}
+
+static void vmware_update(struct vid_rect * rects, uint32_t count) {
+	if (!count) return;
+	spin_lock(vmware_fifo_lock);
+	if (!vmware_fifo_ready) {
+		vmware_fifo_init();
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t x = rects[i].x;
+		uint32_t y = rects[i].y;
+		if (x >= lfb_resolution_x || y >= lfb_resolution_y) continue;
+		uint32_t w = rects[i].width;
+		uint32_t h = rects[i].height;
+		if (w > lfb_resolution_x - x) w = lfb_resolution_x - x;
+		if (h > lfb_resolution_y - y) h = lfb_resolution_y - y;
+		if (!w || !h) continue;
+		vmware_fifo_write(SVGA_CMD_UPDATE);
+		vmware_fifo_write(x);
+		vmware_fifo_write(y);
+		vmware_fifo_write(w);
+		vmware_fifo_write(h);
+	}
+	spin_unlock(vmware_fifo_lock);
+}
+
+static void vmware_cursor(struct vid_cursor * cursor) {
+	spin_lock(vmware_fifo_lock);
+	if (!vmware_fifo_ready) {
+		vmware_fifo_init();
+	}
+	vmware_fifo_write(SVGA_CMD_DEFINE_ALPHA_CURSOR);
+	vmware_fifo_write(SVGA_CURSOR_ID);
+	vmware_fifo_write(cursor->hot_x);
+	vmware_fifo_write(cursor->hot_y);
+	vmware_fifo_write(cursor->width);
+	vmware_fifo_write(cursor->height);
+	for (uint32_t i = 0; i < cursor->width * cursor->height; ++i) {
+		vmware_fifo_write(cursor->pixels[i]);
+	}
+	spin_unlock(vmware_fifo_lock);
+}
+
+static void vmware_cursor_move(struct vid_cursor_position * position) {
+	vmware_write(SVGA_REG_CURSOR_ID, SVGA_CURSOR_ID);
+	vmware_write(SVGA_REG_CURSOR_X, position->x);
+	vmware_write(SVGA_REG_CURSOR_Y, position->y);
+	vmware_write(SVGA_REG_CURSOR_ON, position->visible ? 1 : 0);
+}
+
 static void vmware_set_resolution(uint16_t w, uint16_t h) {
+	spin_lock(vmware_fifo_lock);
+	/* Go back to full scanout until the next update re-arms the FIFO */
+	vmware_fifo_ready = 0;
+	spin_unlock(vmware_fifo_lock);
+
 	vmware_write(SVGA_REG_ENABLE, 0);
+	vmware_write(SVGA_REG_CONFIG_DONE, 0);
 	vmware_write(SVGA_REG_ID, 0);
 	vmware_write(SVGA_REG_WIDTH, w);
 	vmware_write(SVGA_REG_HEIGHT, h);
@@ -493,24 +931,24 @@ static void graphics_install_vmware(uint16_t w, uint16_t h) {
 
 	vmware_set_resolution(w,h);
 	lfb_resolution_impl = &vmware_set_resolution;
+	lfb_update_impl = &vmware_update;
+
+	uint32_t caps = vmware_read(SVGA_REG_CAPABILITIES);
+	if ((caps & SVGA_CAP_ALPHA_CURSOR) && (caps & SVGA_CAP_CURSOR_BYPASS_2)) {
+		lfb_cursor_impl = &vmware_cursor;
+		lfb_cursor_move_impl = &vmware_cursor_move;
+	}
 
 	uint32_t fb_addr = vmware_read(SVGA_REG_FB_START);
 	debug_print(WARNING, "vmware fb address: 0x%x", fb_addr);
 
-	uint32_t fb_size = vmware_read(15);
+	uint32_t fb_size = vmware_read(SVGA_REG_VRAM_SIZE);
 
 	debug_print(WARNING, "vmware fb size: 0x%x", fb_size);
 
 	lfb_vid_memory = (uint8_t *)fb_addr;
 
-	uintptr_t fb_offset = (uintptr_t)lfb_vid_memory;
-	for (uintptr_t i = fb_offset; i <= fb_offset + fb_size; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	map_device_memory((uintptr_t)lfb_vid_memory, fb_size, DEVICE_MEMORY_USER | DEVICE_MEMORY_WC);
 
 	finalize_graphics("vmware");
 }
@@ -550,6 +988,15 @@ static int lfb_init(char * c) {
 	}
 
 	int ret_val = 0;
+	if (vbva_enabled) {
+		vbva_disable();
+	}
+	bochs_vram_top = 0;
+	lfb_update_impl = NULL;
+	lfb_flip_impl = NULL;
+	lfb_pages = 1;
+	lfb_cursor_impl = NULL;
+	lfb_cursor_move_impl = NULL;
 	if (!strcmp(argv[0], "auto")) {
 		/* Attempt autodetection */
 		debug_print(NOTICE, "Automatically detecting display driver...");
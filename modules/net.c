@@ -8,29 +8,125 @@
 #include <kernel/ipv4.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
+#include <kernel/slab.h>
 #include <kernel/mod/net.h>
 #include <kernel/mod/procfs.h>
+#include <kernel/trace.h>
 
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
 
+/*
+ * Resolver cache: name → struct dns_entry. Answers are kept for their
+ * TTL; names that don't resolve are remembered for a while as well, so
+ * retries don't each cost a round trip.
+ */
+struct dns_entry {
+	uint32_t addr;
+	unsigned long expires; /* uptime in seconds; 0 never expires */
+	int missing;           /* the name has no address */
+};
+
+#define DNS_NEGATIVE_TTL 60
+#define DNS_MAX_TTL      (24 * 60 * 60)
+
 static hashmap_t * dns_cache;
+static spin_lock_t dns_lock = { 0 };
 static list_t * dns_waiters = NULL;
 static uint32_t _dns_server;
 
-static hashmap_t *_tcp_sockets = NULL;
-static hashmap_t *_udp_sockets = NULL;
+/*
+ * Bound sockets, keyed by protocol, local port and remote address.
+ * Sockets not tied to a peer are entered with a zero remote address.
+ */
+struct socket_key {
+	uint32_t remote_ip;
+	uint16_t remote_port;
+	uint16_t local_port;
+	uint32_t proto;
+};
+
+#define SOCKET_BUCKETS 256
+
+static hashmap_t * _sockets = NULL;
+static spin_lock_t _sockets_lock = { 0 };
 
 static void parse_dns_response(fs_node_t * tty, void * last_packet);
 static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * queries);
 size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip);
-static size_t write_arp_request(uint8_t * buffer, uint32_t ip);
-
-static uint8_t _gateway[6] = {255,255,255,255,255,255};
+static size_t write_arp_request(struct netif * netif, uint8_t * buffer, uint32_t ip);
 
+/* The first interface registered; everything is sent through it */
 static struct netif _netif = {0};
 
-static int tasklet_pid = 0;
+/* All interfaces, each with its own receive worker */
+static list_t * net_interfaces = NULL;
+static spin_lock_t net_interfaces_lock = { 0 };
+
+/* Handlers for IPv4 payloads, by protocol number */
+typedef int (*ipv4_handler_t)(struct netif * netif, struct ethernet_packet * eth, struct ipv4_packet * ipv4);
+static ipv4_handler_t ipv4_protocols[256];
+
+/* Every received TCP segment gets a tcpdata_t, so they come from a slab */
+static slab_cache_t * tcpdata_cache = NULL;
+static slab_cache_t * socket_cache = NULL;
+
+/* Connected TCP sockets, for the retransmission timer */
+static list_t * tcp_timer_sockets = NULL;
+static spin_lock_t tcp_timer_lock = { 0 };
+
+#define TCP_MSS          1460  /* what fits in one Ethernet frame */
+#define TCP_DEFAULT_MSS  536   /* assumed if the peer doesn't say */
+#define TCP_RECV_BUFFER  (128 * 1024)
+#define TCP_RCV_WSCALE   2     /* so TCP_RECV_BUFFER fits in the window field */
+#define TCP_SEND_BUFFER  (64 * 1024)
+
+/* Timer values, in milliseconds */
+#define TCP_TIMER_TICK   50
+#define TCP_RTO_INITIAL  1000
+#define TCP_RTO_MIN      200
+#define TCP_RTO_MAX      60000
+
+/* Sequence number comparisons, modulo 2^32 */
+#define SEQ_LT(a,b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((a) - (b)) >= 0)
+
+/*
+ * Receive buffers. Drivers copy each frame into one of these and the
+ * TCP path queues the frame itself rather than copying its payload,
+ * so a segment is copied exactly once more: into the reader's buffer.
+ * Two buffers fit in a page and never straddle one.
+ */
+static void * packet_pool = NULL;
+static spin_lock_t packet_pool_lock = { 0 };
+
+void * net_packet_alloc(void) {
+	spin_lock(packet_pool_lock);
+	void ** packet = packet_pool;
+	if (packet) {
+		packet_pool = *packet;
+	}
+	spin_unlock(packet_pool_lock);
+
+	if (!packet) {
+		uintptr_t page = (uintptr_t)heap_pages(1);
+		for (uintptr_t i = NET_PACKET_SIZE; i < 0x1000; i += NET_PACKET_SIZE) {
+			net_packet_free((void *)(page + i));
+		}
+		packet = (void **)page;
+	}
+
+	return packet;
+}
+
+void net_packet_free(void * packet) {
+	spin_lock(packet_pool_lock);
+	*(void **)packet = packet_pool;
+	packet_pool = packet;
+	spin_unlock(packet_pool_lock);
+}
 
 uint32_t get_primary_dns(void);
 
@@ -87,24 +183,156 @@ static struct procfs_entry netif_entry = {
 	netif_func,
 };
 
+static uint32_t dns_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	spin_lock(dns_lock);
+	list_t * names = hashmap_keys(dns_cache);
+	char * buf = malloc(names->length * 300 + 1);
+	size_t _bsize = 0;
+	buf[0] = '\0';
+
+	foreach(item, names) {
+		char * name = item->value;
+		struct dns_entry * entry = hashmap_get(dns_cache, name);
+		if (entry->expires && entry->expires <= timer_ticks) continue;
+
+		char ip[16];
+		if (entry->missing) {
+			strcpy(ip, "-");
+		} else {
+			ip_ntoa(entry->addr, ip);
+		}
+
+		if (entry->expires) {
+			sprintf(buf + _bsize, "%s\t%s\t%d\n", name, ip, entry->expires - timer_ticks);
+		} else {
+			sprintf(buf + _bsize, "%s\t%s\tstatic\n", name, ip);
+		}
+		_bsize += strlen(buf + _bsize);
+	}
+	spin_unlock(dns_lock);
+	list_free(names);
+	free(names);
+
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+static struct procfs_entry dns_entry = {
+	0, /* filled by install */
+	"dns",
+	dns_func,
+};
+
 void init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_packet_func send_func, char * device) {
-	_netif.get_mac = mac_func;
-	_netif.get_packet = get_func;
-	_netif.send_packet = send_func;
-	_netif.driver = device;
-	memcpy(_netif.hwaddr, _netif.get_mac(), sizeof(_netif.hwaddr));
+	struct netif * netif = &_netif;
+	if (_netif.get_packet) {
+		netif = malloc(sizeof(struct netif));
+		memset(netif, 0, sizeof(struct netif));
+	}
+
+	netif->get_mac = mac_func;
+	netif->get_packet = get_func;
+	netif->send_packet = send_func;
+	netif->driver = device;
+	memcpy(netif->hwaddr, netif->get_mac(), sizeof(netif->hwaddr));
 
 	if (!netif_entry.id) {
 		int (*procfs_install)(struct procfs_entry *) = (int (*)(struct procfs_entry *))(uintptr_t)hashmap_get(modules_get_symbols(),"procfs_install");
 		if (procfs_install) {
 			procfs_install(&netif_entry);
+			procfs_install(&dns_entry);
+		}
+	}
+
+	spin_lock(net_interfaces_lock);
+	list_insert(net_interfaces, netif);
+	spin_unlock(net_interfaces_lock);
+
+	netif->worker = create_kernel_tasklet(net_handler, "[net]", netif);
+	debug_print(NOTICE, "Network worker tasklet for %s started with pid %d", device, netif->worker);
+}
+
+/*
+ * Whether we are running in one of the interface receive workers,
+ * which mustn't block waiting on the network.
+ */
+static int net_is_worker(void) {
+	foreach(node, net_interfaces) {
+		if (((struct netif *)node->value)->worker == (int)current_process->id) {
+			return 1;
 		}
 	}
+	return 0;
+}
 
-	if (!tasklet_pid) {
-		tasklet_pid = create_kernel_tasklet(net_handler, "[net]", NULL);
-		debug_print(NOTICE, "Network worker tasklet started with pid %d", tasklet_pid);
+static unsigned int socket_key_hash(void * key) {
+	struct socket_key * k = key;
+	unsigned int hash = k->remote_ip * 2654435761U;
+	hash ^= ((k->remote_port << 16) | k->local_port) * 40503U;
+	hash ^= k->proto;
+	return hash ^ (hash >> 16);
+}
+
+static int socket_key_comp(void * a, void * b) {
+	struct socket_key * x = a;
+	struct socket_key * y = b;
+	return x->remote_ip == y->remote_ip && x->remote_port == y->remote_port &&
+		x->local_port == y->local_port && x->proto == y->proto;
+}
+
+static void * socket_key_dupe(void * key) {
+	struct socket_key * out = malloc(sizeof(struct socket_key));
+	memcpy(out, key, sizeof(struct socket_key));
+	return out;
+}
+
+static hashmap_t * socket_table_create(void) {
+	hashmap_t * map = hashmap_create(SOCKET_BUCKETS);
+	map->hash_func    = socket_key_hash;
+	map->hash_comp    = socket_key_comp;
+	map->hash_key_dup = socket_key_dupe;
+	return map;
+}
+
+/*
+ * Find the socket for an incoming packet: a connected socket for the
+ * exact peer first, then one accepting from anyone on the port.
+ */
+static struct socket * net_socket_lookup(int proto, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port) {
+	struct socket_key key = { remote_ip, remote_port, local_port, proto };
+
+	spin_lock(_sockets_lock);
+	struct socket * socket = hashmap_get(_sockets, &key);
+	if (!socket) {
+		key.remote_ip = 0;
+		key.remote_port = 0;
+		socket = hashmap_get(_sockets, &key);
 	}
+	spin_unlock(_sockets_lock);
+	return socket;
+}
+
+static void net_socket_bind(int proto, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port, struct socket * socket) {
+	struct socket_key key = { remote_ip, remote_port, local_port, proto };
+
+	spin_lock(_sockets_lock);
+	hashmap_set(_sockets, &key, socket);
+	spin_unlock(_sockets_lock);
+}
+
+static void net_socket_unbind(int proto, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port) {
+	struct socket_key key = { remote_ip, remote_port, local_port, proto };
+
+	spin_lock(_sockets_lock);
+	hashmap_remove(_sockets, &key);
+	spin_unlock(_sockets_lock);
 }
 
 struct netif * get_default_network_interface(void) {
@@ -425,6 +653,9 @@ static int socket_wait(fs_node_t * node, void * process) {
 }
 
 static uint32_t socket_read(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if ((node->open_flags & O_NONBLOCK) && socket_check(node) && ((struct socket *)node->device)->status != 1) {
+		return -EAGAIN;
+	}
 	/* Sleep until we have something to receive */
 #if 0
 	fgets((char *)buffer, size, node->device);
@@ -466,14 +697,51 @@ fs_node_t * socket_ipv4_tcp_create(uint32_t dest, uint16_t target_port, uint16_t
 
 }
 
+/*
+ * Cache an answer. ttl is in seconds; 0 means the entry never expires.
+ */
+static void dns_cache_add(char * name, uint32_t addr, uint32_t ttl, int missing) {
+	struct dns_entry * entry = malloc(sizeof(struct dns_entry));
+	entry->addr = addr;
+	entry->expires = ttl ? timer_ticks + MIN(ttl, DNS_MAX_TTL) : 0;
+	entry->missing = missing;
+
+	spin_lock(dns_lock);
+	free(hashmap_set(dns_cache, name, entry));
+	spin_unlock(dns_lock);
+}
+
+/*
+ * Look a name up in the cache, dropping it if it has expired.
+ */
+static int dns_cache_get(char * name, struct dns_entry * out) {
+	spin_lock(dns_lock);
+	struct dns_entry * entry = hashmap_get(dns_cache, name);
+	if (entry && entry->expires && entry->expires <= timer_ticks) {
+		free(hashmap_remove(dns_cache, name));
+		entry = NULL;
+	}
+	if (entry) {
+		*out = *entry;
+	}
+	spin_unlock(dns_lock);
+	return entry != NULL;
+}
+
 static int gethost(char * name, uint32_t * ip) {
+	struct dns_entry entry;
+
 	if (is_ip(name)) {
 		debug_print(WARNING, "   IP: %x", ip_aton(name));
 		*ip = ip_aton(name);
 		return 0;
 	} else {
-		if (hashmap_has(dns_cache, name)) {
-			*ip = ip_aton(hashmap_get(dns_cache, name));
+		if (dns_cache_get(name, &entry)) {
+			if (entry.missing) {
+				debug_print(WARNING, "   In Cache: %s does not resolve", name);
+				return 1;
+			}
+			*ip = entry.addr;
 			debug_print(WARNING, "   In Cache: %s → %x", name, ip);
 			return 0;
 		} else {
@@ -507,32 +775,37 @@ static int gethost(char * name, uint32_t * ip) {
 			free(tmp);
 
 			/* wait for response */
-			if (current_process->id != tasklet_pid) {
+			if (!net_is_worker()) {
 				sleep_on(dns_waiters);
 			}
-			if (hashmap_has(dns_cache, name)) {
-				*ip = ip_aton(hashmap_get(dns_cache, name));
+			if (dns_cache_get(name, &entry)) {
+				if (entry.missing) {
+					debug_print(WARNING, "   %s does not resolve", name);
+					return 1;
+				}
+				*ip = entry.addr;
 				debug_print(WARNING, "   Now in cache: %s → %x", name, ip);
 				return 0;
 			} else {
-				if (current_process->id == tasklet_pid) {
+				if (net_is_worker()) {
 					debug_print(WARNING, "Query hasn't returned yet, but we're in the network thread, so we need to yield.");
 					return 2;
 				}
-				gethost(name,ip);
-				return 1;
+				/* Woken by the answer to some other query */
+				return gethost(name,ip);
 			}
 		}
 	}
 }
 
-static int net_send_tcp(struct socket *socket, uint16_t flags, uint8_t * payload, uint32_t payload_size);
+static void tcp_queue(struct socket * socket, uint16_t flags, uint8_t * payload, size_t length);
 
 static void socket_close(fs_node_t * node) {
 	debug_print(WARNING, "Closing socket");
 	struct socket * sock = node->device;
 	if (sock->status == 1) return; /* already closed */
-	net_send_tcp(sock, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
+	/* Goes out after anything still queued */
+	tcp_queue(sock, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
 	sock->status = 2;
 }
 
@@ -663,20 +936,147 @@ static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * q
 	return offset;
 }
 
+/*
+ * Neighbour cache: IPv4 address to hardware address, for the default
+ * interface. An entry is trusted for ARP_REACHABLE seconds; after that
+ * it stays in use while a fresh request goes out, so a busy connection
+ * never stalls on re-resolution. Frames for an address nobody has
+ * answered for yet wait on its entry and go out with the reply.
+ */
+struct arp_entry {
+	uint32_t ip;
+	uint8_t hwaddr[6];
+	int resolved;
+	unsigned long expires;      /* seconds of uptime */
+	unsigned long next_request; /* don't ask again before this */
+	list_t * pending;           /* struct sized_blob, complete frames */
+};
+
+#define ARP_REACHABLE   300
+#define ARP_MAX_PENDING 16
+
+static hashmap_t * arp_cache = NULL;
+static spin_lock_t arp_lock = { 0 };
+
+static struct arp_entry * arp_entry_get(uint32_t ip) {
+	struct arp_entry * entry = hashmap_get(arp_cache, (void *)ip);
+	if (!entry) {
+		entry = malloc(sizeof(struct arp_entry));
+		memset(entry, 0, sizeof(struct arp_entry));
+		entry->ip = ip;
+		entry->pending = list_create();
+		hashmap_set(arp_cache, (void *)ip, entry);
+	}
+	return entry;
+}
+
+static void arp_send_request(struct netif * netif, uint32_t ip) {
+	void * tmp = malloc(1024);
+	size_t packet_size = write_arp_request(netif, tmp, ip);
+	netif->send_packet(tmp, packet_size);
+	free(tmp);
+}
+
+/*
+ * Fill in the destination of a frame bound for ip. Returns 1 if the
+ * caller should send it now, 0 if the cache has taken it to send once
+ * the address resolves.
+ */
+static int arp_resolve(struct netif * netif, uint32_t ip, struct sized_blob * frame) {
+	struct ethernet_packet * eth = (struct ethernet_packet *)frame->blob;
+
+	if (!ip) {
+		/* No gateway yet; all we can do is broadcast */
+		memset(eth->destination, 0xFF, sizeof(eth->destination));
+		return 1;
+	}
+
+	int ready = 0;
+	int ask;
+
+	spin_lock(arp_lock);
+	struct arp_entry * entry = arp_entry_get(ip);
+	if (entry->resolved) {
+		memcpy(eth->destination, entry->hwaddr, sizeof(eth->destination));
+		ready = 1;
+		ask = entry->expires <= timer_ticks;
+	} else {
+		if (entry->pending->length >= ARP_MAX_PENDING) {
+			node_t * oldest = list_dequeue(entry->pending);
+			free(oldest->value);
+			free(oldest);
+		}
+		list_insert(entry->pending, frame);
+		ask = 1;
+	}
+	if (ask && entry->next_request <= timer_ticks) {
+		entry->next_request = timer_ticks + 1;
+	} else {
+		ask = 0;
+	}
+	spin_unlock(arp_lock);
+
+	if (ask) {
+		arp_send_request(netif, ip);
+	}
+
+	return ready;
+}
+
+/* Record ip as living at hwaddr and send whatever was waiting for it */
+static void arp_learn(struct netif * netif, uint32_t ip, uint8_t * hwaddr) {
+	spin_lock(arp_lock);
+	struct arp_entry * entry = arp_entry_get(ip);
+	memcpy(entry->hwaddr, hwaddr, sizeof(entry->hwaddr));
+	entry->resolved = 1;
+	entry->expires = timer_ticks + ARP_REACHABLE;
+	entry->next_request = 0;
+	list_t * waiting = entry->pending;
+	entry->pending = list_create();
+	spin_unlock(arp_lock);
+
+	node_t * node;
+	while ((node = list_dequeue(waiting))) {
+		struct sized_blob * frame = node->value;
+		struct ethernet_packet * eth = (struct ethernet_packet *)frame->blob;
+		memcpy(eth->destination, hwaddr, sizeof(eth->destination));
+		netif->send_packet(frame->blob, frame->size);
+		free(frame);
+		free(node);
+	}
+	list_free(waiting);
+	free(waiting);
+}
+
+/* Hosts on our own subnet are reached directly, everything else via the gateway */
+static uint32_t net_next_hop(struct netif * netif, uint32_t ip) {
+	if (netif->netmask && (ip & netif->netmask) == (netif->source & netif->netmask)) {
+		return ip;
+	}
+	return netif->gateway;
+}
+
 static int net_send_ether(struct socket *socket, struct netif* netif, uint16_t ether_type, void* payload, uint32_t payload_size) {
-	struct ethernet_packet *eth = malloc(sizeof(struct ethernet_packet) + payload_size);
+	size_t size = sizeof(struct ethernet_packet) + payload_size;
+	struct sized_blob * frame = malloc(sizeof(struct sized_blob) + size);
+	frame->size = size;
+
+	struct ethernet_packet *eth = (struct ethernet_packet *)frame->blob;
 	memcpy(eth->source, netif->hwaddr, sizeof(eth->source));
-	//memset(eth->destination, 0xFF, sizeof(eth->destination));
-	memcpy(eth->destination, _gateway, sizeof(_gateway));
 	eth->type = htons(ether_type);
 
 	if (payload_size) {
 		memcpy(eth->payload, payload, payload_size);
 	}
 
-	netif->send_packet((uint8_t*)eth, sizeof(struct ethernet_packet) + payload_size);
+	if (!arp_resolve(netif, net_next_hop(netif, socket->ip), frame)) {
+		/* Queued until the neighbour answers */
+		return 1;
+	}
+
+	netif->send_packet((uint8_t*)eth, size);
 
-	free(eth);
+	free(frame);
 
 	return 1; // yolo
 }
@@ -714,7 +1114,8 @@ static int net_send_ip(struct socket *socket, int proto, void* payload, uint32_t
 		// debug_print(WARNING, "net_send_ip: Payload size: %d\n", payload_size);
 		struct tcp_header* tcp_hdr = (struct tcp_header*)payload;
 		// debug_print(WARNING, "net_send_ip: Header len htons: %d\n", TCP_HEADER_LENGTH_FLIPPED(tcp_hdr));
-		size_t orig_payload_size = payload_size - TCP_HEADER_LENGTH_FLIPPED(tcp_hdr);
+		/* Options, if any, are summed along with the data that follows them */
+		size_t orig_payload_size = payload_size - sizeof(struct tcp_header);
 
 		uint16_t chk = calculate_tcp_checksum(&check_hd, tcp_hdr, tcp_hdr->payload, orig_payload_size);
 		tcp_hdr->checksum = htons(chk);
@@ -731,35 +1132,341 @@ static int net_send_ip(struct socket *socket, int proto, void* payload, uint32_t
 	return out;
 }
 
-static int net_send_tcp(struct socket *socket, uint16_t flags, uint8_t * payload, uint32_t payload_size) {
-	struct tcp_header *tcp = malloc(sizeof(struct tcp_header) + payload_size);
+static unsigned long tcp_now(void) {
+	return timer_ticks * 1000 + timer_subticks;
+}
+
+/*
+ * How much more we can take, counting both data waiting for a reader
+ * and out-of-order segments.
+ */
+static uint32_t tcp_receive_window(struct socket * socket) {
+	uint32_t queued = socket->proto_sock.tcp_socket.rcv_queued;
+	return queued < TCP_RECV_BUFFER ? TCP_RECV_BUFFER - queued : 0;
+}
+
+/*
+ * Build and send one segment. SYNs carry our MSS and window scale.
+ */
+static int tcp_transmit(struct socket *socket, uint16_t flags, uint32_t seq, uint8_t * payload, uint32_t payload_size) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+	size_t options = (flags & TCP_FLAGS_SYN) ? 8 : 0;
+	struct tcp_header *tcp = malloc(sizeof(struct tcp_header) + options + payload_size);
+
+	/* The window in a SYN is never scaled */
+	uint32_t window = tcp_receive_window(socket);
+	uint8_t shift = (flags & TCP_FLAGS_SYN) ? 0 : tcp_sock->rcv_wscale;
+	window = MIN(window >> shift, 0xFFFF);
+	tcp_sock->rcv_wnd_sent = window << shift;
 
 	tcp->source_port = htons(socket->port_recv);
 	tcp->destination_port = htons(socket->port_dest);
-	tcp->seq_number = htonl(socket->proto_sock.tcp_socket.seq_no);
-	tcp->ack_number = flags & (TCP_FLAGS_ACK) ? htonl(socket->proto_sock.tcp_socket.ack_no) : 0;
-	tcp->flags = htons(0x5000 ^ (flags & 0xFF));
-	tcp->window_size = htons(1548-54);
+	tcp->seq_number = htonl(seq);
+	tcp->ack_number = flags & (TCP_FLAGS_ACK) ? htonl(tcp_sock->ack_no) : 0;
+	tcp->flags = htons(((5 + options / 4) << 12) ^ (flags & 0xFF));
+	tcp->window_size = htons(window);
 	tcp->checksum = 0; // Fill in later
 	tcp->urgent = 0;
 
-	if ((flags & 0xff) == TCP_FLAGS_SYN) {
-		// If only SYN set, expected ACK will be 1 despite no payload
-		socket->proto_sock.tcp_socket.seq_no += 1;
+	if (options) {
+		uint8_t * opt = tcp->payload;
+		opt[0] = 2; /* maximum segment size */
+		opt[1] = 4;
+		opt[2] = TCP_MSS >> 8;
+		opt[3] = TCP_MSS & 0xFF;
+		opt[4] = 1; /* no-op, for alignment */
+		opt[5] = 3; /* window scale */
+		opt[6] = 3;
+		opt[7] = TCP_RCV_WSCALE;
+	}
+
+	if (payload_size) {
+		memcpy(tcp->payload + options, payload, payload_size);
+	}
+
+	return net_send_ip(socket, IPV4_PROT_TCP, tcp, sizeof(struct tcp_header) + options + payload_size);
+}
+
+/*
+ * Segments that take no sequence space (plain ACKs, window updates)
+ * and aren't retransmitted.
+ */
+static int net_send_tcp(struct socket *socket, uint16_t flags, uint8_t * payload, uint32_t payload_size) {
+	return tcp_transmit(socket, flags, socket->proto_sock.tcp_socket.seq_no, payload, payload_size);
+}
+
+static void tcp_arm_timer(struct tcp_socket * tcp_sock) {
+	tcp_sock->rto_expires = tcp_now() + tcp_sock->rto;
+}
+
+/*
+ * Send whatever queued segments the congestion and receive windows
+ * allow. One segment may always be outstanding, which also serves as
+ * the probe when the peer's window is closed. Called with the socket's
+ * lock held.
+ */
+static void tcp_output(struct socket * socket) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+	uint32_t window = MIN(tcp_sock->cwnd, tcp_sock->snd_wnd);
+
+	foreach(node, tcp_sock->send_queue) {
+		struct tcp_segment * seg = node->value;
+		if (seg->sent) continue;
+		if (tcp_sock->flight && tcp_sock->flight + (seg->end - seg->seq) > window) break;
+
+		tcp_transmit(socket, seg->flags, seg->seq, seg->data, seg->length);
+		seg->sent = 1;
+		tcp_sock->flight += seg->end - seg->seq;
+
+		if (SEQ_GT(seg->end, tcp_sock->seq_no)) {
+			/* Only time segments sent once (Karn's algorithm) */
+			if (!tcp_sock->rtt_start) {
+				tcp_sock->rtt_start = tcp_now();
+				tcp_sock->rtt_seq = seg->end;
+			}
+			tcp_sock->seq_no = seg->end;
+		}
+
+		if (!tcp_sock->rto_expires) {
+			tcp_arm_timer(tcp_sock);
+		}
+	}
+}
+
+/*
+ * Resend the oldest unacknowledged segment.
+ */
+static void tcp_retransmit(struct socket * socket) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+	if (!tcp_sock->send_queue->head) return;
+
+	struct tcp_segment * seg = tcp_sock->send_queue->head->value;
+	if (!seg->sent) {
+		seg->sent = 1;
+		tcp_sock->flight += seg->end - seg->seq;
+	}
+	tcp_transmit(socket, seg->flags, seg->seq, seg->data, seg->length);
+	tcp_sock->rtt_start = 0;
+	tcp_arm_timer(tcp_sock);
+}
+
+/*
+ * Queue a segment for sending. Data, SYN and FIN all take sequence
+ * space, so they stay queued until the peer acknowledges them.
+ */
+static void tcp_queue(struct socket * socket, uint16_t flags, uint8_t * payload, size_t length) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+	struct tcp_segment * seg = malloc(sizeof(struct tcp_segment) + length);
+
+	seg->flags  = flags;
+	seg->sent   = 0;
+	seg->length = length;
+	seg->data   = seg->payload;
+	if (length) {
+		memcpy(seg->payload, payload, length);
+	}
+
+	spin_lock(tcp_sock->lock);
+	seg->seq = tcp_sock->write_seq;
+	seg->end = seg->seq + length + ((flags & TCP_FLAGS_SYN) ? 1 : 0) + ((flags & TCP_FLAGS_FIN) ? 1 : 0);
+	tcp_sock->write_seq = seg->end;
+	list_insert(tcp_sock->send_queue, seg);
+	tcp_output(socket);
+	spin_unlock(tcp_sock->lock);
+}
+
+static void tcp_drop_queue(struct tcp_socket * tcp_sock) {
+	while (tcp_sock->send_queue->head) {
+		node_t * node = list_dequeue(tcp_sock->send_queue);
+		free(node->value);
+		free(node);
+	}
+	tcp_sock->flight = 0;
+	tcp_sock->rto_expires = 0;
+}
+
+/*
+ * Fold a round-trip measurement into the retransmission timeout
+ * (RFC 6298).
+ */
+static void tcp_rtt_sample(struct tcp_socket * tcp_sock, unsigned long rtt) {
+	if (!tcp_sock->srtt) {
+		tcp_sock->srtt = MAX(rtt, 1);
+		tcp_sock->rttvar = rtt / 2;
 	} else {
-		socket->proto_sock.tcp_socket.seq_no += payload_size;
+		unsigned long delta = rtt > tcp_sock->srtt ? rtt - tcp_sock->srtt : tcp_sock->srtt - rtt;
+		tcp_sock->rttvar = (3 * tcp_sock->rttvar + delta) / 4;
+		tcp_sock->srtt = MAX((7 * tcp_sock->srtt + rtt) / 8, 1);
 	}
+	tcp_sock->rto = tcp_sock->srtt + MAX(4 * tcp_sock->rttvar, TCP_TIMER_TICK);
+	tcp_sock->rto = MAX(tcp_sock->rto, TCP_RTO_MIN);
+	tcp_sock->rto = MIN(tcp_sock->rto, TCP_RTO_MAX);
+}
 
-	if (payload) {
-		memcpy(tcp->payload, payload, payload_size);
+/*
+ * Process the acknowledgement and window in an incoming segment:
+ * cumulative ACKs retire queued segments and open the congestion
+ * window (slow start, then congestion avoidance); three duplicate
+ * ACKs trigger fast retransmit and NewReno fast recovery. Called with
+ * the socket's lock held.
+ */
+static void tcp_ack(struct socket * socket, struct tcp_header * tcp, size_t data_length) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+	uint32_t ack = ntohl(tcp->ack_number);
+
+	if (SEQ_GT(ack, tcp_sock->seq_no)) {
+		debug_print(WARNING, "tcp_ack: Peer acknowledged data we haven't sent");
+		return;
 	}
 
-	return net_send_ip(socket, IPV4_PROT_TCP, tcp, sizeof(struct tcp_header) + payload_size);
+	uint32_t window = (uint32_t)ntohs(tcp->window_size) << tcp_sock->snd_wscale;
+	int window_changed = (window != tcp_sock->snd_wnd);
+	tcp_sock->snd_wnd = window;
+
+	if (SEQ_GT(ack, tcp_sock->snd_una)) {
+		uint32_t acked = ack - tcp_sock->snd_una;
+		tcp_sock->snd_una = ack;
+		tcp_sock->dup_acks = 0;
+
+		while (tcp_sock->send_queue->head) {
+			node_t * node = tcp_sock->send_queue->head;
+			struct tcp_segment * seg = node->value;
+			if (SEQ_LEQ(seg->end, ack)) {
+				if (seg->sent) tcp_sock->flight -= seg->end - seg->seq;
+				list_delete(tcp_sock->send_queue, node);
+				free(node);
+				free(seg);
+			} else {
+				if (SEQ_GT(ack, seg->seq)) {
+					/* Peer took part of this one */
+					uint32_t n = ack - seg->seq;
+					if (seg->sent) tcp_sock->flight -= n;
+					seg->seq     = ack;
+					seg->data   += n;
+					seg->length -= n;
+				}
+				break;
+			}
+		}
+
+		if (tcp_sock->rtt_start && SEQ_GEQ(ack, tcp_sock->rtt_seq)) {
+			tcp_rtt_sample(tcp_sock, tcp_now() - tcp_sock->rtt_start);
+			tcp_sock->rtt_start = 0;
+		}
+
+		if (tcp_sock->in_recovery) {
+			if (SEQ_GEQ(ack, tcp_sock->recover)) {
+				/* Everything outstanding at the loss is in; deflate */
+				tcp_sock->in_recovery = 0;
+				tcp_sock->cwnd = tcp_sock->ssthresh;
+			} else {
+				/* Partial ACK: the next segment was lost as well */
+				tcp_retransmit(socket);
+				tcp_sock->cwnd = (tcp_sock->cwnd > acked ? tcp_sock->cwnd - acked : 0) + tcp_sock->snd_mss;
+			}
+		} else if (tcp_sock->cwnd < tcp_sock->ssthresh) {
+			tcp_sock->cwnd += MIN(acked, tcp_sock->snd_mss);
+		} else {
+			tcp_sock->cwnd += MAX(tcp_sock->snd_mss * tcp_sock->snd_mss / tcp_sock->cwnd, 1);
+		}
+
+		if (tcp_sock->send_queue->head) {
+			tcp_arm_timer(tcp_sock);
+		} else {
+			tcp_sock->rto_expires = 0;
+		}
+
+		wakeup_queue(tcp_sock->send_wait);
+	} else if (ack == tcp_sock->snd_una && !data_length && !window_changed && tcp_sock->flight) {
+		tcp_sock->dup_acks++;
+		if (tcp_sock->in_recovery) {
+			/* Each duplicate means another segment has left the network */
+			tcp_sock->cwnd += tcp_sock->snd_mss;
+		} else if (tcp_sock->dup_acks == 3) {
+			tcp_sock->ssthresh = MAX(tcp_sock->flight / 2, 2 * tcp_sock->snd_mss);
+			tcp_sock->cwnd = tcp_sock->ssthresh + 3 * tcp_sock->snd_mss;
+			tcp_sock->recover = tcp_sock->seq_no;
+			tcp_sock->in_recovery = 1;
+			tcp_retransmit(socket);
+		}
+	}
+
+	tcp_output(socket);
+}
+
+/*
+ * The retransmission timer went off: collapse to one segment, go back
+ * to slow start, and resend everything outstanding as the window
+ * reopens. Called with the socket's lock held.
+ */
+static void tcp_timeout(struct socket * socket) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+
+	tcp_sock->ssthresh    = MAX(tcp_sock->flight / 2, 2 * tcp_sock->snd_mss);
+	tcp_sock->cwnd        = tcp_sock->snd_mss;
+	tcp_sock->in_recovery = 0;
+	tcp_sock->dup_acks    = 0;
+	tcp_sock->rtt_start   = 0;
+	tcp_sock->recover     = tcp_sock->seq_no;
+	tcp_sock->rto         = MIN(tcp_sock->rto * 2, TCP_RTO_MAX);
+
+	foreach(node, tcp_sock->send_queue) {
+		((struct tcp_segment *)node->value)->sent = 0;
+	}
+	tcp_sock->flight = 0;
+	tcp_sock->rto_expires = 0;
+
+	tcp_output(socket);
+}
+
+static void tcp_timer(void * data, char * name) {
+	while (1) {
+		unsigned long s, ss;
+		relative_time(0, TCP_TIMER_TICK, &s, &ss);
+		sleep_until((process_t *)current_process, s, ss);
+		switch_task(0);
+
+		unsigned long now = tcp_now();
+
+		spin_lock(tcp_timer_lock);
+		node_t * node = tcp_timer_sockets->head;
+		while (node) {
+			node_t * next = node->next;
+			struct socket * socket = node->value;
+			struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+
+			spin_lock(tcp_sock->lock);
+			if (socket->status == 1) {
+				/* Closed; nobody is left to deliver to */
+				tcp_drop_queue(tcp_sock);
+				spin_unlock(tcp_sock->lock);
+				list_delete(tcp_timer_sockets, node);
+				free(node);
+				net_socket_unbind(IPV4_PROT_TCP, socket->port_recv, socket->ip, socket->port_dest);
+				wakeup_queue(tcp_sock->send_wait);
+				node = next;
+				continue;
+			}
+			if (tcp_sock->rto_expires && (long)(now - tcp_sock->rto_expires) >= 0) {
+				tcp_timeout(socket);
+			}
+			int room = tcp_sock->write_seq - tcp_sock->snd_una < TCP_SEND_BUFFER;
+			spin_unlock(tcp_sock->lock);
+
+			/* Catches a writer that went to sleep just after an ACK woke the queue */
+			if (room) {
+				wakeup_queue(tcp_sock->send_wait);
+			}
+
+			node = next;
+		}
+		spin_unlock(tcp_timer_lock);
+	}
 }
 
 struct socket* net_open(uint32_t type) {
 	// This is a socket() call
-	struct socket *sock = malloc(sizeof(struct socket));
+	struct socket *sock = slab_alloc(socket_cache);
 	memset(sock, 0, sizeof(struct socket));
 	sock->sock_type = type;
 
@@ -775,14 +1482,31 @@ int net_close(struct socket* socket) {
 }
 
 int net_send(struct socket* socket, uint8_t* payload, size_t payload_size, int flags) {
-	return net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_PSH, payload, payload_size);
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+
+	while (payload_size) {
+		if (socket->status == 1) {
+			return 0;
+		}
+		if (tcp_sock->write_seq - tcp_sock->snd_una >= TCP_SEND_BUFFER) {
+			sleep_on(tcp_sock->send_wait);
+			continue;
+		}
+
+		size_t size = MIN(payload_size, tcp_sock->snd_mss);
+		tcp_queue(socket, TCP_FLAGS_ACK | (size == payload_size ? TCP_FLAGS_PSH : 0), payload, size);
+		payload += size;
+		payload_size -= size;
+	}
+
+	return 1;
 }
 
 size_t net_recv(struct socket* socket, uint8_t* buffer, size_t len) {
 	tcpdata_t *tcpdata = NULL;
 	node_t *node = NULL;
 
-	debug_print(INFO, "0x%x [socket]", socket);
+	TRACE(TRACE_NET, "recv socket 0x%x: %d bytes requested", socket, len);
 
 	size_t offset = 0;
 	size_t size_to_read = 0;
@@ -831,8 +1555,21 @@ size_t net_recv(struct socket* socket, uint8_t* buffer, size_t len) {
 	} else {
 		socket->bytes_available = 0;
 		socket->current_packet = NULL;
-		free(tcpdata->payload);
-		free(tcpdata);
+
+		spin_lock(socket->packet_queue_lock);
+		socket->proto_sock.tcp_socket.rcv_queued -= tcpdata->payload_size;
+		spin_unlock(socket->packet_queue_lock);
+
+		if (tcpdata->packet) {
+			net_packet_free(tcpdata->packet);
+		}
+		slab_free(tcpdata_cache, tcpdata);
+
+		/* Tell the peer once a mostly-closed window has opened up again */
+		if (socket->proto_sock.tcp_socket.rcv_wnd_sent < TCP_RECV_BUFFER / 4 &&
+			tcp_receive_window(socket) >= TCP_RECV_BUFFER / 2) {
+			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
+		}
 	}
 
 
@@ -842,110 +1579,228 @@ size_t net_recv(struct socket* socket, uint8_t* buffer, size_t len) {
 	return size_to_read;
 }
 
-static void net_handle_tcp(struct tcp_header * tcp, size_t length) {
+static void tcp_parse_options(struct tcp_socket * tcp_sock, struct tcp_header * tcp) {
+	uint8_t * opt = tcp->payload;
+	uint8_t * end = (uint8_t *)tcp + TCP_HEADER_LENGTH_FLIPPED(tcp);
+
+	while (opt < end) {
+		if (opt[0] == 0) break; /* end of options */
+		if (opt[0] == 1) { /* no-op */
+			opt++;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) break;
+
+		if (opt[0] == 2 && opt[1] == 4) {
+			uint32_t mss = (opt[2] << 8) | opt[3];
+			if (mss) {
+				tcp_sock->snd_mss = MIN(mss, TCP_MSS);
+			}
+		} else if (opt[0] == 3 && opt[1] == 3) {
+			/* Scaling only applies if both sides ask for it; we always do */
+			tcp_sock->snd_wscale = MIN(opt[2], 14);
+			tcp_sock->rcv_wscale = TCP_RCV_WSCALE;
+		}
+
+		opt += opt[1];
+	}
+}
+
+static void tcp_free_data(tcpdata_t * tcpdata) {
+	net_packet_free(tcpdata->packet);
+	slab_free(tcpdata_cache, tcpdata);
+}
+
+/*
+ * Place a received segment. In-order data goes on the packet queue,
+ * followed by whatever out-of-order segments it now joins up with;
+ * data further ahead is held until the gap fills. Called with the
+ * socket's packet queue lock held. Returns 1 if the frame was kept.
+ */
+static int tcp_receive(struct socket * socket, struct ethernet_packet * eth, uint8_t * payload, uint32_t seq, size_t length) {
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+
+	if (SEQ_LEQ(seq + length, tcp_sock->ack_no)) {
+		/* Nothing we don't already have */
+		return 0;
+	}
+
+	if (SEQ_GT(seq + length - tcp_sock->ack_no, TCP_RECV_BUFFER)) {
+		debug_print(WARNING, "tcp_receive: Segment beyond our window, dropping");
+		return 0;
+	}
+
+	tcpdata_t *tcpdata = slab_alloc(tcpdata_cache);
+	tcpdata->payload = payload;
+	tcpdata->payload_size = length;
+	tcpdata->packet = eth;
+	tcpdata->seq = seq;
+	tcp_sock->rcv_queued += length;
+
+	if (SEQ_GT(seq, tcp_sock->ack_no)) {
+		/* Out of order: keep the list sorted and free of repeats */
+		foreach(node, tcp_sock->out_of_order) {
+			tcpdata_t * other = node->value;
+			if (other->seq == seq) {
+				tcp_sock->rcv_queued -= length;
+				slab_free(tcpdata_cache, tcpdata);
+				return 0;
+			}
+			if (SEQ_GT(other->seq, seq)) {
+				list_insert_before(tcp_sock->out_of_order, node, tcpdata);
+				return 1;
+			}
+		}
+		list_insert(tcp_sock->out_of_order, tcpdata);
+		return 1;
+	}
 
+	while (tcpdata) {
+		if (SEQ_LT(tcpdata->seq, tcp_sock->ack_no)) {
+			/* Overlaps data we already have; trim the front */
+			uint32_t n = tcp_sock->ack_no - tcpdata->seq;
+			tcpdata->payload      += n;
+			tcpdata->payload_size -= n;
+			tcpdata->seq          += n;
+			tcp_sock->rcv_queued  -= n;
+		}
+		tcp_sock->ack_no = tcpdata->seq + tcpdata->payload_size;
+		list_insert(socket->packet_queue, tcpdata);
+
+		tcpdata = NULL;
+		while (tcp_sock->out_of_order->head) {
+			tcpdata_t * next = tcp_sock->out_of_order->head->value;
+			if (SEQ_GT(next->seq, tcp_sock->ack_no)) break;
+			free(list_dequeue(tcp_sock->out_of_order));
+			if (SEQ_LEQ(next->seq + next->payload_size, tcp_sock->ack_no)) {
+				tcp_sock->rcv_queued -= next->payload_size;
+				tcp_free_data(next);
+				continue;
+			}
+			tcpdata = next;
+			break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Returns 1 if the frame holding the segment was queued on the socket,
+ * in which case net_recv() releases it once the payload is consumed.
+ */
+static int net_handle_tcp(struct netif * netif, struct ethernet_packet * eth, struct ipv4_packet * ipv4) {
+
+	struct tcp_header * tcp = (struct tcp_header *)ipv4->payload;
+	size_t length = ntohs(ipv4->length) - sizeof(struct ipv4_packet);
 	size_t data_length = length - TCP_HEADER_LENGTH_FLIPPED(tcp);
 
 	/* Find socket */
-	if (hashmap_has(_tcp_sockets, (void *)ntohs(tcp->destination_port))) {
-		struct socket *socket = hashmap_get(_tcp_sockets, (void *)ntohs(tcp->destination_port));
+	struct socket *socket = net_socket_lookup(IPV4_PROT_TCP, ntohs(tcp->destination_port),
+			ntohl(ipv4->source), ntohs(tcp->source_port));
+	if (socket) {
+		struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+		uint16_t flags = htons(tcp->flags);
 
 		if (socket->status == 2) {
 			debug_print(WARNING, "Received packet while connection is in 'closing' statuus");
 		}
 
 		if (socket->status == 1) {
-			if ((htons(tcp->flags) & TCP_FLAGS_FIN)) {
+			if ((flags & TCP_FLAGS_FIN)) {
 				debug_print(WARNING, "TCP close sequence continues");
-				return;
+				return 0;
 			}
-			if ((htons(tcp->flags) & TCP_FLAGS_ACK)) {
+			if ((flags & TCP_FLAGS_ACK)) {
 				debug_print(WARNING, "TCP close sequence continues");
-				return;
+				return 0;
 			}
 			debug_print(ERROR, "Socket is closed? Should send FIN. socket=0x%x flags=0x%x", socket, tcp->flags);
 			net_send_tcp(socket, TCP_FLAGS_FIN | TCP_FLAGS_ACK, NULL, 0);
-			return;
-		}
-
-		if (socket->proto_sock.tcp_socket.seq_no != ntohl(tcp->ack_number)) {
-			// Drop packet
-			debug_print(WARNING, "Dropping packet. Expected ack: %d | Got ack: %d",
-					socket->proto_sock.tcp_socket.seq_no, ntohl(tcp->ack_number));
-			return;
+			return 0;
 		}
 
-		if ((htons(tcp->flags) & TCP_FLAGS_SYN) && (htons(tcp->flags) & TCP_FLAGS_ACK)) {
-			socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length + 1;
-			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
-			wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
-		} else if (htons(tcp->flags) & TCP_FLAGS_RES) {
+		if (flags & TCP_FLAGS_RES) {
 			/* Reset doesn't necessarily mean close. */
 			debug_print(WARNING, "net_handle_tcp: Received RST - socket closing");
 			net_close(socket);
-			return;
-		} else {
-			// Store a copy of the layer 5 data for a userspace recv() call
-			tcpdata_t *tcpdata = malloc(sizeof(tcpdata_t));
-			tcpdata->payload_size = length - TCP_HEADER_LENGTH_FLIPPED(tcp);
-
-			if (tcpdata->payload_size == 0) {
-				if (htons(tcp->flags) & TCP_FLAGS_FIN) {
-					/* We should make sure we finish sending before closing. */
-					debug_print(WARNING, "net_handle_tcp: Received FIN - socket closing with SYNACK");
-					socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length + 1;
-					net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
-					wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
-					net_close(socket);
+			return 0;
+		}
+
+		if ((flags & TCP_FLAGS_SYN) && (flags & TCP_FLAGS_ACK)) {
+			spin_lock(tcp_sock->lock);
+			if (!tcp_sock->status) {
+				if (ntohl(tcp->ack_number) != tcp_sock->snd_una + 1) {
+					spin_unlock(tcp_sock->lock);
+					debug_print(WARNING, "net_handle_tcp: SYN-ACK for a different SYN, dropping");
+					return 0;
 				}
-				free(tcpdata);
-				return;
+				/* The window in a SYN-ACK is unscaled, so take it before the options */
+				tcp_ack(socket, tcp, 0);
+				tcp_parse_options(tcp_sock, tcp);
+				tcp_sock->cwnd = MIN(4 * tcp_sock->snd_mss, MAX(2 * tcp_sock->snd_mss, 4380));
+				tcp_sock->ack_no = ntohl(tcp->seq_number) + 1;
+				tcp_sock->status = 1;
 			}
+			spin_unlock(tcp_sock->lock);
+			/* Also answers a repeated SYN-ACK whose ACK got lost */
+			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
+			wakeup_queue(tcp_sock->is_connected);
+			return 0;
+		}
 
-			// debug_print(WARNING, "net_handle_tcp: payload length: %d\n",  length);
-			// debug_print(WARNING, "net_handle_tcp: flipped tcp flags hdr len: %d\n",  TCP_HEADER_LENGTH_FLIPPED(tcp));
-			// debug_print(WARNING, "net_handle_tcp: tcpdata->payload_size: %d\n", tcpdata->payload_size);
+		if (!tcp_sock->status || !(flags & TCP_FLAGS_ACK)) {
+			return 0;
+		}
 
-			if (tcpdata->payload_size > 0) {
-				tcpdata->payload = malloc(tcpdata->payload_size);
-				memcpy(tcpdata->payload, tcp->payload, tcpdata->payload_size);
-			} else {
-				tcpdata->payload = NULL;
-			}
+		spin_lock(tcp_sock->lock);
+		tcp_ack(socket, tcp, data_length);
+		spin_unlock(tcp_sock->lock);
 
-			socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length;
+		uint32_t seq = ntohl(tcp->seq_number);
+		int kept = 0;
 
-			if ((htons(tcp->flags) & TCP_FLAGS_SYN) && (htons(tcp->flags) & TCP_FLAGS_ACK) && data_length == 0) {
-				socket->proto_sock.tcp_socket.ack_no += 1;
+		if (data_length) {
+			uint8_t * payload = (uint8_t *)tcp + TCP_HEADER_LENGTH_FLIPPED(tcp);
+			if ((uintptr_t)payload + data_length > (uintptr_t)eth + NET_PACKET_SIZE) {
+				debug_print(WARNING, "net_handle_tcp: Segment runs past the end of its frame, dropping");
+				return 0;
 			}
 
-			socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + tcpdata->payload_size;
-
 			spin_lock(socket->packet_queue_lock);
-			list_insert(socket->packet_queue, tcpdata);
+			size_t queued = socket->packet_queue->length;
+			kept = tcp_receive(socket, eth, payload, seq, data_length);
+			int delivered = socket->packet_queue->length != queued;
 			spin_unlock(socket->packet_queue_lock);
 
-			// Send acknowledgement of receiving data
+			// Send acknowledgement of receiving data; a repeat of the last one if this was out of order
 			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
 
-			wakeup_queue(socket->packet_wait);
-			socket_alert_waiters(socket);
-
-			if (htons(tcp->flags) & TCP_FLAGS_FIN) {
-				/* We should make sure we finish sending before closing. */
-				debug_print(WARNING, "net_handle_tcp: Received FIN - socket closing with SYNACK");
-				socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length + 1;
-				net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
-				wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
-				net_close(socket);
+			if (delivered) {
+				wakeup_queue(socket->packet_wait);
+				socket_alert_waiters(socket);
 			}
 		}
+
+		if ((flags & TCP_FLAGS_FIN) && seq + data_length == tcp_sock->ack_no) {
+			/* We should make sure we finish sending before closing. */
+			debug_print(WARNING, "net_handle_tcp: Received FIN - socket closing with SYNACK");
+			tcp_sock->ack_no = seq + data_length + 1;
+			net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
+			wakeup_queue(tcp_sock->is_connected);
+			net_close(socket);
+		}
+
+		return kept;
 	} else {
 		debug_print(WARNING, "net_handle_tcp: Received packet not associated with a socket!");
 	}
+	return 0;
 }
 
-static void net_handle_udp(struct udp_packet * udp, size_t length) {
+static int net_handle_udp(struct netif * netif, struct ethernet_packet * eth, struct ipv4_packet * ipv4) {
+
+	struct udp_packet * udp = (struct udp_packet *)ipv4->payload;
 
 	// size_t data_length = length - sizeof(struct tcp_header);
 	debug_print(WARNING, "UDP response!");
@@ -954,51 +1809,40 @@ static void net_handle_udp(struct udp_packet * udp, size_t length) {
 	if (ntohs(udp->source_port) == 53) {
 		debug_print(WARNING, "UDP response to DNS query!");
 		parse_dns_response(debug_file, udp);
-		return;
+		return 0;
 	}
 
 	if (ntohs(udp->source_port) == 67) {
 		debug_print(WARNING, "UDP response to DHCP!");
 
-		{
-			void * tmp = malloc(1024);
-			size_t packet_size = write_arp_request(tmp, _netif.gateway);
-			_netif.send_packet(tmp, packet_size);
-			free(tmp);
-		}
+		/* Learn the gateway now rather than on the first send */
+		arp_send_request(netif, netif->gateway);
 
-		return;
+		return 0;
 	}
 
 	/* Find socket */
-	if (hashmap_has(_udp_sockets, (void *)ntohs(udp->source_port))) {
+	if (net_socket_lookup(IPV4_PROT_UDP, ntohs(udp->destination_port),
+			ntohl(ipv4->source), ntohs(udp->source_port))) {
 		/* Do the thing */
 
 	} else {
 		/* ??? */
 	}
 
+	return 0;
 }
 
-static void net_handle_ipv4(struct ipv4_packet * ipv4) {
+/*
+ * Returns 1 if the protocol kept the frame.
+ */
+static int net_handle_ipv4(struct netif * netif, struct ethernet_packet * eth) {
+	struct ipv4_packet * ipv4 = (struct ipv4_packet *)eth->payload;
 	debug_print(INFO, "net_handle_ipv4: ENTER");
-	switch (ipv4->protocol) {
-		case IPV4_PROT_TCP:
-			net_handle_tcp((struct tcp_header *)ipv4->payload, ntohs(ipv4->length) - sizeof(struct ipv4_packet));
-			break;
-		case IPV4_PROT_UDP:
-			net_handle_udp((struct udp_packet *)ipv4->payload, ntohs(ipv4->length) - sizeof(struct ipv4_packet));
-			break;
-		default:
-			/* XXX */
-			break;
+	if (ipv4_protocols[ipv4->protocol]) {
+		return ipv4_protocols[ipv4->protocol](netif, eth, ipv4);
 	}
-}
-
-static struct ethernet_packet* net_receive(void) {
-	struct ethernet_packet *eth = _netif.get_packet();
-
-	return eth;
+	return 0;
 }
 
 int net_connect(struct socket* socket, uint32_t dest_ip, uint16_t dest_port) {
@@ -1009,10 +1853,25 @@ int net_connect(struct socket* socket, uint32_t dest_ip, uint16_t dest_port) {
 
 	memset(socket->mac, 0, sizeof(socket->mac)); // idk
 	socket->port_recv = next_ephemeral_port();
-	socket->proto_sock.tcp_socket.is_connected = list_create();
-	socket->proto_sock.tcp_socket.seq_no = 0;
-	socket->proto_sock.tcp_socket.ack_no = 0;
-	socket->proto_sock.tcp_socket.status = 0;
+	struct tcp_socket * tcp_sock = &socket->proto_sock.tcp_socket;
+	uint32_t iss = krand();
+
+	tcp_sock->is_connected = list_create();
+	tcp_sock->seq_no    = iss;
+	tcp_sock->snd_una   = iss;
+	tcp_sock->write_seq = iss;
+	tcp_sock->recover   = iss;
+	tcp_sock->ack_no    = 0;
+	tcp_sock->status    = 0;
+
+	tcp_sock->snd_mss  = TCP_DEFAULT_MSS;
+	tcp_sock->cwnd     = TCP_DEFAULT_MSS;
+	tcp_sock->ssthresh = 0xFFFFFFFF;
+	tcp_sock->rto      = TCP_RTO_INITIAL;
+
+	tcp_sock->send_queue   = list_create();
+	tcp_sock->send_wait    = list_create();
+	tcp_sock->out_of_order = list_create();
 
 	socket->packet_queue = list_create();
 	socket->packet_wait = list_create();
@@ -1023,13 +1882,19 @@ int net_connect(struct socket* socket, uint32_t dest_ip, uint16_t dest_port) {
 
 	debug_print(WARNING, "net_connect: using ephemeral port: %d", (void*)socket->port_recv);
 
-	hashmap_set(_tcp_sockets, (void*)socket->port_recv, socket);
+	net_socket_bind(IPV4_PROT_TCP, socket->port_recv, socket->ip, socket->port_dest, socket);
 
-	net_send_tcp(socket, TCP_FLAGS_SYN, NULL, 0);
-	// debug_print(WARNING, "net_connect:sent tcp SYN: %d", ret);
+	spin_lock(tcp_timer_lock);
+	list_insert(tcp_timer_sockets, socket);
+	spin_unlock(tcp_timer_lock);
+
+	/* Queued like data, so the timer resends it if it's lost */
+	tcp_queue(socket, TCP_FLAGS_SYN, NULL, 0);
 
 	// Race condition here - if net_handle_tcp runs and connects before this sleep
-	sleep_on(socket->proto_sock.tcp_socket.is_connected);
+	if (!tcp_sock->status) {
+		sleep_on(tcp_sock->is_connected);
+	}
 
 	return 1;
 }
@@ -1054,7 +1919,7 @@ static void placeholder_dhcp(void) {
 
 		if (eth_type != 0x0800) {
 			debug_print(WARNING, "ARP packet while waiting for DHCP...");
-			free(eth);
+			net_packet_free(eth);
 			continue;
 		}
 
@@ -1076,7 +1941,7 @@ static void placeholder_dhcp(void) {
 		if (ipv4->protocol != IPV4_PROT_UDP) {
 			debug_print(WARNING, "Protocol: %d", ipv4->protocol);
 			debug_print(WARNING, "Bad packet...");
-			free(eth);
+			net_packet_free(eth);
 			continue;
 		}
 
@@ -1091,7 +1956,7 @@ static void placeholder_dhcp(void) {
 		if (dst_port != 68) {
 			debug_print(WARNING, "Destination port: %d", dst_port);
 			debug_print(WARNING, "Bad packet...");
-			free(eth);
+			net_packet_free(eth);
 			continue;
 		}
 
@@ -1123,6 +1988,8 @@ static void placeholder_dhcp(void) {
 				ip_ntoa(dnsaddr, ip);
 				debug_print(NOTICE, "Found one: %s", ip);
 				_dns_server = dnsaddr;
+			} else if (type == 1) {
+				_netif.netmask = ntohl(*(uint32_t *)data);
 			} else if (type == 3) {
 				_netif.gateway = ntohl(*(uint32_t *)data);
 			}
@@ -1137,7 +2004,7 @@ static void placeholder_dhcp(void) {
 		_netif.send_packet(tmp, packet_size);
 		free(tmp);
 
-		free(eth);
+		net_packet_free(eth);
 
 		break;
 	}
@@ -1161,13 +2028,13 @@ struct arp {
 	uint8_t padding[18];
 } __attribute__((packed));
 
-static size_t write_arp_response(uint8_t * buffer, struct arp * source) {
+static size_t write_arp_response(struct netif * netif, uint8_t * buffer, struct arp * source) {
 	size_t offset = 0;
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0806),
 	};
@@ -1184,13 +2051,13 @@ static size_t write_arp_response(uint8_t * buffer, struct arp * source) {
 	arp_out.plen = 4;
 	arp_out.oper = ntohs(2);
 
-	arp_out.sender_ha[0] = _netif.hwaddr[0];
-	arp_out.sender_ha[1] = _netif.hwaddr[1];
-	arp_out.sender_ha[2] = _netif.hwaddr[2];
-	arp_out.sender_ha[3] = _netif.hwaddr[3];
-	arp_out.sender_ha[4] = _netif.hwaddr[4];
-	arp_out.sender_ha[5] = _netif.hwaddr[5];
-	arp_out.sender_ip = ntohl(_netif.source);
+	arp_out.sender_ha[0] = netif->hwaddr[0];
+	arp_out.sender_ha[1] = netif->hwaddr[1];
+	arp_out.sender_ha[2] = netif->hwaddr[2];
+	arp_out.sender_ha[3] = netif->hwaddr[3];
+	arp_out.sender_ha[4] = netif->hwaddr[4];
+	arp_out.sender_ha[5] = netif->hwaddr[5];
+	arp_out.sender_ip = ntohl(netif->source);
 
 	arp_out.target_ha[0] = source->sender_ha[0];
 	arp_out.target_ha[1] = source->sender_ha[1];
@@ -1207,15 +2074,15 @@ static size_t write_arp_response(uint8_t * buffer, struct arp * source) {
 	return offset;
 }
 
-static size_t write_arp_request(uint8_t * buffer, uint32_t ip) {
+static size_t write_arp_request(struct netif * netif, uint8_t * buffer, uint32_t ip) {
 	size_t offset = 0;
 
 	debug_print(WARNING, "Request ARP from gateway address %x", ip);
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0806),
 	};
@@ -1234,13 +2101,13 @@ static size_t write_arp_request(uint8_t * buffer, uint32_t ip) {
 	arp_out.plen = 4;
 	arp_out.oper = ntohs(1);
 
-	arp_out.sender_ha[0] = _netif.hwaddr[0];
-	arp_out.sender_ha[1] = _netif.hwaddr[1];
-	arp_out.sender_ha[2] = _netif.hwaddr[2];
-	arp_out.sender_ha[3] = _netif.hwaddr[3];
-	arp_out.sender_ha[4] = _netif.hwaddr[4];
-	arp_out.sender_ha[5] = _netif.hwaddr[5];
-	arp_out.sender_ip = ntohl(_netif.source);
+	arp_out.sender_ha[0] = netif->hwaddr[0];
+	arp_out.sender_ha[1] = netif->hwaddr[1];
+	arp_out.sender_ha[2] = netif->hwaddr[2];
+	arp_out.sender_ha[3] = netif->hwaddr[3];
+	arp_out.sender_ha[4] = netif->hwaddr[4];
+	arp_out.sender_ha[5] = netif->hwaddr[5];
+	arp_out.sender_ip = ntohl(netif->source);
 
 	arp_out.target_ha[0] = 0;
 	arp_out.target_ha[1] = 0;
@@ -1258,7 +2125,7 @@ static size_t write_arp_request(uint8_t * buffer, uint32_t ip) {
 }
 
 
-static void net_handle_arp(struct ethernet_packet * eth) {
+static void net_handle_arp(struct netif * netif, struct ethernet_packet * eth) {
 	debug_print(WARNING, "ARP packet...");
 
 	struct arp * arp = (struct arp *)&eth->payload;
@@ -1287,28 +2154,29 @@ static void net_handle_arp(struct ethernet_packet * eth) {
 
 	if (ntohs(arp->oper) == 1) {
 
-		if (ntohl(arp->target_ip) == _netif.source) {
+		if (ntohl(arp->target_ip) == netif->source) {
 			debug_print(WARNING, "That's us!");
 
+			/* Whoever asks for us is about to talk to us */
+			if (netif == &_netif) {
+				arp_learn(netif, ntohl(arp->sender_ip), arp->sender_ha);
+			}
+
 			{
 				void * tmp = malloc(1024);
-				size_t packet_size = write_arp_response(tmp, arp);
-				_netif.send_packet(tmp, packet_size);
+				size_t packet_size = write_arp_response(netif, tmp, arp);
+				netif->send_packet(tmp, packet_size);
 				free(tmp);
 			}
 
 		}
 
 	} else {
-		if (ntohl(arp->target_ip) == _netif.source) {
+		if (ntohl(arp->target_ip) == netif->source) {
 			debug_print(WARNING, "It's a response to our query!");
-			if (ntohl(arp->sender_ip) == _netif.gateway) {
-				_gateway[0] = arp->sender_ha[0];
-				_gateway[1] = arp->sender_ha[1];
-				_gateway[2] = arp->sender_ha[2];
-				_gateway[3] = arp->sender_ha[3];
-				_gateway[4] = arp->sender_ha[4];
-				_gateway[5] = arp->sender_ha[5];
+			/* Only the default interface sends, so only its neighbours matter */
+			if (netif == &_netif) {
+				arp_learn(netif, ntohl(arp->sender_ip), arp->sender_ha);
 			}
 		} else {
 			debug_print(WARNING, "Response to someone else...\n");
@@ -1317,34 +2185,40 @@ static void net_handle_arp(struct ethernet_packet * eth) {
 
 }
 
+/*
+ * Receive worker, one per interface. The default interface's worker
+ * also brings the network up.
+ */
 void net_handler(void * data, char * name) {
-	/* Network Packet Handler*/
-	_netif.extra = NULL;
-
-	_dns_server = ip_aton("10.0.2.3");
+	struct netif * netif = data;
 
-	placeholder_dhcp();
+	if (netif == &_netif) {
+		_netif.extra = NULL;
 
-	dns_waiters = list_create();
+		_dns_server = ip_aton("10.0.2.3");
 
-	_tcp_sockets = hashmap_create_int(0xFF);
-	_udp_sockets = hashmap_create_int(0xFF);
+		placeholder_dhcp();
+	}
 
 	while (1) {
-		struct ethernet_packet * eth = net_receive();
+		struct ethernet_packet * eth = netif->get_packet();
 
 		if (!eth) continue;
 
+		int kept = 0;
+
 		switch (ntohs(eth->type)) {
 			case ETHERNET_TYPE_IPV4:
-				net_handle_ipv4((struct ipv4_packet *)eth->payload);
+				kept = net_handle_ipv4(netif, eth);
 				break;
 			case ETHERNET_TYPE_ARP:
-				net_handle_arp(eth);
+				net_handle_arp(netif, eth);
 				break;
 		}
 
-		free(eth);
+		if (!kept) {
+			net_packet_free(eth);
+		}
 	}
 }
 
@@ -1573,6 +2447,16 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 	int offset = sizeof(struct dns_packet);
 	int queries = 0;
 	uint8_t * bytes = (uint8_t *)dns;
+
+	/* NXDOMAIN, or no answers at all: remember that the name doesn't resolve */
+	int rcode = ntohs(dns->flags) & 0xF;
+	if (dns_questions && (rcode == 3 || (rcode == 0 && dns_answers == 0))) {
+		char qname[1024];
+		dns_name_to_normal_name(dns, offset, qname);
+		debug_print(NOTICE, "Domain [%s] does not resolve", qname);
+		dns_cache_add(qname, 0, DNS_NEGATIVE_TTL, 1);
+	}
+
 	while (queries < dns_questions) {
 		offset = print_dns_name(tty, dns, offset);
 		uint16_t * d = (uint16_t *)&bytes[offset];
@@ -1592,6 +2476,7 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 		fprintf(tty, " - Type: %4x %4x; ", ntohs(d[0]), ntohs(d[1]));
 		offset += 4;
 		uint32_t * t = (uint32_t *)&bytes[offset];
+		uint32_t ttl = MAX(ntohl(t[0]), 1);
 		fprintf(tty, "TTL: %d; ", ntohl(t[0]));
 		offset += 4;
 		uint16_t * l = (uint16_t *)&bytes[offset];
@@ -1604,9 +2489,7 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 			ip_ntoa(ntohl(i[0]), ip);
 			fprintf(tty, " Address: %s\n", ip);
 			debug_print(NOTICE, "Domain [%s] maps to [%s]", buf, ip);
-			if (!hashmap_has(dns_cache, buf)) {
-				hashmap_set(dns_cache, buf, strdup(ip));
-			}
+			dns_cache_add(buf, ntohl(i[0]), ttl, 0);
 		} else {
 			if (ntohs(d[0]) == 5) {
 				fprintf(tty, "CNAME: ");
@@ -1620,12 +2503,10 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 				if (gethost(buffer,&addr) == 2) {
 					debug_print(WARNING,"Can't provide a response yet, but going to query again in a moment.");
 				} else {
-					if (!hashmap_has(dns_cache, buf)) {
-						char ip[16];
-						ip_ntoa(addr, ip);
-						hashmap_set(dns_cache, buf, strdup(ip));
-						fprintf(tty, "resolves to %s\n", ip);
-					}
+					char ip[16];
+					ip_ntoa(addr, ip);
+					dns_cache_add(buf, addr, ttl, 0);
+					fprintf(tty, "resolves to %s\n", ip);
 				}
 			} else {
 				fprintf(tty, "dunno\n");
@@ -1653,17 +2534,32 @@ static fs_node_t * netfs_create(void) {
 }
 
 static int init(void) {
-	dns_cache = hashmap_create(10);
-
-	hashmap_set(dns_cache, "dakko.us", strdup("104.131.140.26"));
-	hashmap_set(dns_cache, "toaruos.org", strdup("104.131.140.26"));
-	hashmap_set(dns_cache, "www.toaruos.org", strdup("104.131.140.26"));
-	hashmap_set(dns_cache, "www.yelp.com", strdup("104.16.57.23"));
-	hashmap_set(dns_cache, "s3-media2.fl.yelpcdn.com", strdup("199.27.79.175"));
-	hashmap_set(dns_cache, "forum.osdev.org", strdup("173.255.206.39"));
-	hashmap_set(dns_cache, "wolfgun.puckipedia.com", strdup("104.47.147.203"));
-	hashmap_set(dns_cache, "irc.freenode.net", strdup("91.217.189.42"));
-	hashmap_set(dns_cache, "i.imgur.com", strdup("23.235.47.193"));
+	tcpdata_cache = slab_create("tcpdata_t", sizeof(tcpdata_t), NULL);
+	socket_cache  = slab_create("socket", sizeof(struct socket), NULL);
+
+	net_interfaces = list_create();
+	dns_waiters = list_create();
+
+	_sockets = socket_table_create();
+
+	ipv4_protocols[IPV4_PROT_TCP] = net_handle_tcp;
+	ipv4_protocols[IPV4_PROT_UDP] = net_handle_udp;
+
+	tcp_timer_sockets = list_create();
+	create_kernel_tasklet(tcp_timer, "[tcp]", NULL);
+
+	arp_cache = hashmap_create_int(16);
+	dns_cache = hashmap_create(64);
+
+	dns_cache_add("dakko.us", ip_aton("104.131.140.26"), 0, 0);
+	dns_cache_add("toaruos.org", ip_aton("104.131.140.26"), 0, 0);
+	dns_cache_add("www.toaruos.org", ip_aton("104.131.140.26"), 0, 0);
+	dns_cache_add("www.yelp.com", ip_aton("104.16.57.23"), 0, 0);
+	dns_cache_add("s3-media2.fl.yelpcdn.com", ip_aton("199.27.79.175"), 0, 0);
+	dns_cache_add("forum.osdev.org", ip_aton("173.255.206.39"), 0, 0);
+	dns_cache_add("wolfgun.puckipedia.com", ip_aton("104.47.147.203"), 0, 0);
+	dns_cache_add("irc.freenode.net", ip_aton("91.217.189.42"), 0, 0);
+	dns_cache_add("i.imgur.com", ip_aton("23.235.47.193"), 0, 0);
 
 	/* /dev/net/{domain|ip}/{protocol}/{port} */
 	vfs_mount("/dev/net", netfs_create());
@@ -2,17 +2,29 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2014-2018 K. Lange
+ *
+ * Packets from clients go to the server through a pipe. Packets from
+ * the server are copied once into a shared, reference-counted buffer,
+ * and each recipient's queue takes a reference, so a broadcast costs
+ * one copy in and one copy out per reader. A queue that is full drops
+ * what is sent to it and counts the loss, as the client pipe did.
  */
 #include <kernel/system.h>
 #include <kernel/fs.h>
 #include <kernel/pipe.h>
 #include <kernel/module.h>
 #include <kernel/logging.h>
+#include <kernel/slab.h>
 
 #include <sys/ioctl.h>
 
 #define MAX_PACKET_SIZE 1024
 
+#define CLIENT_QUEUE_SLOTS 64
+#define CLIENT_QUEUE_BYTES 4096 /* Packets and their headers, as the client pipe held */
+
+#define PEX_MULTICAST ((pex_client_t *)-1)
+
 typedef struct packet_manager {
 	/* uh, nothing, lol */
 	list_t * exchanges;
@@ -25,11 +37,25 @@ typedef struct packet_exchange {
 	spin_lock_t lock;
 	fs_node_t * server_pipe;
 	list_t * clients;
+	uint32_t dropped;
 } pex_ex_t;
 
+typedef struct packet_buffer {
+	volatile int refs;
+	size_t size;
+	uint8_t data[MAX_PACKET_SIZE];
+} pex_buffer_t;
+
 typedef struct packet_client {
 	pex_ex_t * parent;
-	fs_node_t * pipe;
+	spin_lock_t lock;
+	pex_buffer_t * queue[CLIENT_QUEUE_SLOTS];
+	unsigned int head;   /* Next to read */
+	unsigned int count;
+	size_t queued;       /* Bytes, counting packet headers */
+	list_t * readers;
+	list_t * alert_waiters;
+	uint32_t dropped;
 } pex_client_t;
 
 
@@ -44,20 +70,42 @@ typedef struct server_write_header {
 	uint8_t data[];
 } header_t;
 
-static void receive_packet(fs_node_t * socket, packet_t ** out) {
-	packet_t tmp;
-	read_fs(socket, 0, sizeof(struct packet), (uint8_t *)&tmp);
-	*out = malloc(tmp.size + sizeof(struct packet));
-	memcpy(*out, &tmp, sizeof(struct packet));
+/* Throw away the payload of a packet the reader didn't have room for */
+static void discard_packet(fs_node_t * socket, size_t size) {
+	uint8_t tmp[64];
+	while (size) {
+		size_t chunk = size < sizeof(tmp) ? size : sizeof(tmp);
+		read_fs(socket, 0, chunk, tmp);
+		size -= chunk;
+	}
+}
+
+/*
+ * Read a packet header into *head and its payload straight into data,
+ * which has room for max bytes. Payloads that don't fit are dropped.
+ */
+static int receive_packet(fs_node_t * socket, packet_t * head, uint8_t * data, size_t max) {
+	read_fs(socket, 0, sizeof(struct packet), (uint8_t *)head);
+
+	if (head->size > max) {
+		discard_packet(socket, head->size);
+		return -1;
+	}
 
-	if (tmp.size) {
-		read_fs(socket, 0, tmp.size, (uint8_t *)(*out)->data);
+	if (head->size) {
+		read_fs(socket, 0, head->size, data);
 	}
+	return 0;
 }
 
+/*
+ * Packets are assembled on the stack and go into the pipe with a single
+ * write, so concurrent writers can't interleave.
+ */
 static void send_to_server(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
 	size_t p_size = size + sizeof(struct packet);
-	packet_t * packet = malloc(p_size);
+	uint8_t tmp[sizeof(struct packet) + MAX_PACKET_SIZE];
+	packet_t * packet = (packet_t *)tmp;
 
 	packet->source = c;
 	packet->size = size;
@@ -67,34 +115,64 @@ static void send_to_server(pex_ex_t * p, pex_client_t * c, size_t size, void * d
 	}
 
 	write_fs(p->server_pipe, 0, p_size, (uint8_t *)packet);
+}
 
-	free(packet);
+static slab_cache_t * buffer_cache = NULL;
+
+static pex_buffer_t * make_buffer(size_t size, void * data) {
+	pex_buffer_t * b = slab_alloc(buffer_cache);
+	b->refs = 1;
+	b->size = size;
+	memcpy(b->data, data, size);
+	return b;
 }
 
-static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
-	size_t p_size = size + sizeof(struct packet);
+static void release_buffer(pex_buffer_t * b) {
+	if (__sync_sub_and_fetch(&b->refs, 1) == 0) {
+		slab_free(buffer_cache, b);
+	}
+}
 
-	/* Verify there is space on the client */
-	if (pipe_unsize(c->pipe) < (int)p_size) {
-		return -1;
+static void alert_client_waiters(pex_client_t * c) {
+	if (c->alert_waiters) {
+		while (c->alert_waiters->head) {
+			node_t * node = list_dequeue(c->alert_waiters);
+			process_alert_node(node->value, c);
+			free(node);
+		}
 	}
+}
 
-	packet_t * packet = malloc(p_size);
+/* Put a reference to b on the client's queue, or count it as dropped */
+static int send_to_client(pex_ex_t * p, pex_client_t * c, pex_buffer_t * b) {
+	size_t p_size = b->size + sizeof(struct packet);
 
-	memcpy(packet->data, data, size);
-	packet->source = NULL;
-	packet->size = size;
+	spin_lock(c->lock);
+	if (c->count == CLIENT_QUEUE_SLOTS || c->queued + p_size > CLIENT_QUEUE_BYTES) {
+		c->dropped++;
+		p->dropped++;
+		spin_unlock(c->lock);
+		debug_print(INFO, "[pex] Dropped packet of size %d for client 0x%x (%d dropped)", b->size, c, c->dropped);
+		return -1;
+	}
+	__sync_add_and_fetch(&b->refs, 1);
+	c->queue[(c->head + c->count) % CLIENT_QUEUE_SLOTS] = b;
+	c->count++;
+	c->queued += p_size;
+	spin_unlock(c->lock);
 
-	write_fs(c->pipe, 0, p_size, (uint8_t *)packet);
+	wakeup_queue(c->readers);
+	alert_client_waiters(c);
 
-	free(packet);
-	return size;
+	return b->size;
 }
 
 static pex_client_t * create_client(pex_ex_t * p) {
 	pex_client_t * out = malloc(sizeof(pex_client_t));
+	memset(out, 0, sizeof(pex_client_t));
 	out->parent = p;
-	out->pipe = make_pipe(4096);
+	spin_init(out->lock);
+	out->readers = list_create();
 	return out;
 }
 
@@ -102,21 +180,20 @@ static uint32_t read_server(fs_node_t * node, uint64_t offset, uint32_t size, ui
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	debug_print(INFO, "[pex] server read(...)");
 
-	packet_t * packet;
-
-	receive_packet(p->server_pipe, &packet);
+	if (size < sizeof(packet_t)) {
+		return -1;
+	}
 
-	debug_print(INFO, "Server recevied packet of size %d, was waiting for at most %d", packet->size, size);
+	packet_t * packet = (packet_t *)buffer;
 
-	if (packet->size + sizeof(packet_t) > size) {
+	if (receive_packet(p->server_pipe, packet, packet->data, size - sizeof(packet_t)) < 0) {
+		debug_print(WARNING, "[pex] Server is not reading enough bytes to hold packet of size %d", packet->size);
 		return -1;
 	}
 
-	memcpy(buffer, packet, packet->size + sizeof(packet_t));
-	uint32_t out = packet->size + sizeof(packet_t);
+	debug_print(INFO, "Server recevied packet of size %d, was waiting for at most %d", packet->size, size);
 
-	free(packet);
-	return out;
+	return packet->size + sizeof(packet_t);
 }
 
 static uint32_t write_server(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
@@ -125,18 +202,45 @@ static uint32_t write_server(fs_node_t * node, uint64_t offset, uint32_t size, u
 
 	header_t * head = (header_t *)buffer;
 
+	if (size < sizeof(header_t)) {
+		return -1;
+	}
+
+	if (head->target == PEX_MULTICAST) {
+		/* A count, that many targets, and the packet for all of them */
+		if (size < sizeof(header_t) + sizeof(uint32_t)) return -1;
+		uint32_t count = *(uint32_t *)head->data;
+		pex_client_t ** targets = (pex_client_t **)(head->data + sizeof(uint32_t));
+		size_t prefix = sizeof(header_t) + sizeof(uint32_t) + count * sizeof(pex_client_t *);
+		if (count > size / sizeof(pex_client_t *) || prefix > size || size - prefix > MAX_PACKET_SIZE) {
+			return -1;
+		}
+		pex_buffer_t * b = make_buffer(size - prefix, buffer + prefix);
+		for (uint32_t i = 0; i < count; ++i) {
+			if (!targets[i] || targets[i]->parent != p) {
+				debug_print(WARNING, "[pex] Invalid multicast target from server? (pid=%d)", current_process->id);
+				continue;
+			}
+			send_to_client(p, targets[i], b);
+		}
+		release_buffer(b);
+		return size;
+	}
+
 	if (size - sizeof(header_t) > MAX_PACKET_SIZE) {
 		return -1;
 	}
 
 	if (head->target == NULL) {
 		/* Brodcast packet */
+		pex_buffer_t * b = make_buffer(size - sizeof(header_t), head->data);
 		spin_lock(p->lock);
 		foreach(f, p->clients) {
 			debug_print(INFO, "Sending to client 0x%x", f->value);
-			send_to_client(p, (pex_client_t *)f->value, size - sizeof(header_t), head->data);
+			send_to_client(p, (pex_client_t *)f->value, b);
 		}
 		spin_unlock(p->lock);
+		release_buffer(b);
 		debug_print(INFO, "Done broadcasting to clients.");
 		return size;
 	} else if (head->target->parent != p) {
@@ -144,7 +248,10 @@ static uint32_t write_server(fs_node_t * node, uint64_t offset, uint32_t size, u
 		return -1;
 	}
 
-	return send_to_client(p, head->target, size - sizeof(header_t), head->data);
+	pex_buffer_t * b = make_buffer(size - sizeof(header_t), head->data);
+	int out = send_to_client(p, head->target, b);
+	release_buffer(b);
+	return out;
 }
 
 static int ioctl_server(fs_node_t * node, int request, void * argp) {
@@ -153,6 +260,8 @@ static int ioctl_server(fs_node_t * node, int request, void * argp) {
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
 			return pipe_size(p->server_pipe);
+		case IOCTL_PACKETFS_DROPPED:
+			return p->dropped;
 		default:
 			return -1;
 	}
@@ -167,21 +276,31 @@ static uint32_t read_client(fs_node_t * node, uint64_t offset, uint32_t size, ui
 
 	debug_print(INFO, "[pex] client read(...)");
 
-	packet_t * packet;
-
-	receive_packet(c->pipe, &packet);
+	pex_buffer_t * b = NULL;
+	while (1) {
+		spin_lock(c->lock);
+		if (c->count) {
+			b = c->queue[c->head];
+			c->head = (c->head + 1) % CLIENT_QUEUE_SLOTS;
+			c->count--;
+			c->queued -= b->size + sizeof(struct packet);
+		}
+		spin_unlock(c->lock);
+		if (b) break;
+		sleep_on(c->readers);
+	}
 
-	if (packet->size > size) {
-		debug_print(WARNING, "[pex] Client is not reading enough bytes to hold packet of size %d", packet->size);
+	size_t out = b->size;
+	if (out > size) {
+		debug_print(WARNING, "[pex] Client is not reading enough bytes to hold packet of size %d", out);
+		release_buffer(b);
 		return -1;
 	}
+	memcpy(buffer, b->data, out);
+	release_buffer(b);
 
-	memcpy(buffer, &packet->data, packet->size);
-	uint32_t out = packet->size;
-
-	debug_print(INFO, "[pex] Client received packet of size %d", packet->size);
+	debug_print(INFO, "[pex] Client received packet of size %d", out);
 
-	free(packet);
 	return out;
 }
 
@@ -210,7 +329,9 @@ static int ioctl_client(fs_node_t * node, int request, void * argp) {
 
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
-			return pipe_size(c->pipe);
+			return c->queued;
+		case IOCTL_PACKETFS_DROPPED:
+			return c->dropped;
 		default:
 			return -1;
 	}
@@ -236,6 +357,18 @@ static void close_client(fs_node_t * node) {
 
 	send_to_server(p, c, 0, tmp);
 
+	while (c->count) {
+		release_buffer(c->queue[c->head]);
+		c->head = (c->head + 1) % CLIENT_QUEUE_SLOTS;
+		c->count--;
+	}
+	list_free(c->readers);
+	free(c->readers);
+	if (c->alert_waiters) {
+		list_free(c->alert_waiters);
+		free(c->alert_waiters);
+	}
+
 	free(c);
 }
 
@@ -250,11 +383,21 @@ static int check_server(fs_node_t * node) {
 
 static int wait_client(fs_node_t * node, void * process) {
 	pex_client_t * c = (pex_client_t *)node->inode;
-	return selectwait_fs(c->pipe, process);
+
+	if (!c->alert_waiters) {
+		c->alert_waiters = list_create();
+	}
+
+	if (!list_find(c->alert_waiters, process)) {
+		list_insert(c->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, c);
+
+	return 0;
 }
 static int check_client(fs_node_t * node) {
 	pex_client_t * c = (pex_client_t *)node->inode;
-	return selectcheck_fs(c->pipe);
+	return c->count ? 0 : 1;
 }
 
 static void open_pex(fs_node_t * node, unsigned int flags) {
@@ -475,6 +618,7 @@ static fs_node_t * packetfs_manager(void) {
 }
 
 static int init(void) {
+	buffer_cache = slab_create("pex packets", sizeof(pex_buffer_t), NULL);
 	fs_node_t * packet_mgr = packetfs_manager();
 	vfs_mount("/dev/pex", packet_mgr);
 	return 0;
@@ -184,12 +184,13 @@ static int pcnet_irq_handler(struct regs *r) {
 
 		void * pbuf = (void *)(pcnet_rx_start + pcnet_rx_buffer_id * PCNET_BUFFER_SIZE);
 
-		void * packet = malloc(plen);
-		memcpy(packet, pbuf, plen);
+		if (plen <= NET_PACKET_SIZE) {
+			void * packet = net_packet_alloc();
+			memcpy(packet, pbuf, plen);
+			enqueue_packet(packet);
+		}
 		pcnet_rx_de_start[pcnet_rx_buffer_id * PCNET_DE_SIZE + 7] = 0x80;
 
-		enqueue_packet(packet);
-
 		pcnet_rx_buffer_id = next_rx_index(pcnet_rx_buffer_id);
 	}
 	wakeup_queue(rx_wait);
@@ -77,4 +77,4 @@ static int fini(void) {
 	return 0;
 }
 
-MODULE_DEF(pcspkr, init, fini);
+MODULE_DEF_DEFERRED(pcspkr, init, fini);
@@ -8,28 +8,86 @@
 #include <kernel/fs.h>
 #include <kernel/version.h>
 #include <kernel/process.h>
+#include <kernel/mem.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
 #include <kernel/printf.h>
 #include <kernel/module.h>
 #include <kernel/multiboot.h>
 #include <kernel/pci.h>
+#include <kernel/boottime.h>
+#include <kernel/kmalloc.h>
 #include <kernel/mod/procfs.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
 
+/*
+ * Files are formatted in full on the first read, and again whenever
+ * they're read from the start, into a snapshot that belongs to the
+ * open file; reads in between are served from it. A reader taking
+ * small chunks sees one consistent copy, and doesn't pay for the
+ * formatting on every call.
+ *
+ * The formatters keep their read() signature and are simply asked
+ * for everything from offset 0, with a bigger buffer if they fill it.
+ */
+#define PROCFS_SNAPSHOT_MIN 4096
+#define PROCFS_SNAPSHOT_MAX (1024 * 1024)
+
+struct procfs_file {
+	fs_node_t node;     /* Must be first: close_fs() frees the node */
+	read_type_t func;   /* Formats the contents */
+	char * data;
+	size_t length;
+};
+
+static void procfs_snapshot(struct procfs_file * file) {
+	size_t capacity = PROCFS_SNAPSHOT_MIN;
+	free(file->data);
+	while (1) {
+		file->data = malloc(capacity);
+		file->length = file->func(&file->node, 0, capacity, (uint8_t *)file->data);
+		if (file->length < capacity || capacity >= PROCFS_SNAPSHOT_MAX) break;
+		free(file->data);
+		capacity *= 2;
+	}
+}
+
+static uint32_t procfs_read(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct procfs_file * file = (struct procfs_file *)node;
+	if (offset == 0 || !file->data) {
+		procfs_snapshot(file);
+	}
+
+	if (offset > file->length) return 0;
+	if (size > file->length - offset) size = file->length - offset;
+
+	memcpy(buffer, file->data + offset, size);
+	return size;
+}
+
+static void procfs_close(fs_node_t * node) {
+	struct procfs_file * file = (struct procfs_file *)node;
+	free(file->data);
+	file->data = NULL;
+}
+
 static fs_node_t * procfs_generic_create(char * name, read_type_t read_func) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
+	struct procfs_file * file = malloc(sizeof(struct procfs_file));
+	memset(file, 0x00, sizeof(struct procfs_file));
+	file->func = read_func;
+	fs_node_t * fnode = &file->node;
 	fnode->inode = 0;
 	strcpy(fnode->name, name);
 	fnode->uid = 0;
 	fnode->gid = 0;
 	fnode->mask    = 0444;
 	fnode->flags   = FS_FILE;
-	fnode->read    = read_func;
+	fnode->read    = procfs_read;
 	fnode->write   = NULL;
 	fnode->open    = NULL;
-	fnode->close   = NULL;
+	fnode->close   = procfs_close;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ctime   = now();
@@ -38,6 +96,45 @@ static fs_node_t * procfs_generic_create(char * name, read_type_t read_func) {
 	return fnode;
 }
 
+/*
+ * Output for the longer tables, which grows as records are added
+ * rather than being sized up front.
+ */
+#define PROCFS_LINE_MAX 1024
+
+struct procfs_out {
+	char * data;
+	size_t length;
+	size_t capacity;
+};
+
+static void procfs_printf(struct procfs_out * out, const char * fmt, ...) {
+	if (out->capacity - out->length < PROCFS_LINE_MAX) {
+		size_t capacity = out->capacity ? out->capacity * 2 : PROCFS_SNAPSHOT_MIN;
+		char * data = malloc(capacity);
+		if (out->length) memcpy(data, out->data, out->length);
+		free(out->data);
+		out->data = data;
+		out->capacity = capacity;
+	}
+	va_list args;
+	va_start(args, fmt);
+	out->length += vasprintf(out->data + out->length, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Copy [offset, offset + size) of a finished table out, and free it.
+ */
+static uint32_t procfs_out_read(struct procfs_out * out, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if (offset > out->length) size = 0;
+	else if (size > out->length - offset) size = out->length - offset;
+
+	if (size) memcpy(buffer, out->data + offset, size);
+	free(out->data);
+	return size;
+}
+
 static uint32_t proc_cmdline_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[1024];
 	process_t * proc = process_from_pid(node->inode);
@@ -81,53 +178,6 @@ static uint32_t proc_cmdline_func(fs_node_t *node, uint64_t offset, uint32_t siz
 	return size;
 }
 
-static size_t calculate_memory_usage(page_directory_t * src) {
-	size_t pages = 0;
-	for (uint32_t i = 0; i < 1024; ++i) {
-		if (!src->tables[i] || (uintptr_t)src->tables[i] == (uintptr_t)0xFFFFFFFF) {
-			continue;
-		}
-		if (kernel_directory->tables[i] == src->tables[i]) {
-			continue;
-		}
-		/* For each table */
-		if (i * 0x1000 * 1024 < SHM_START) {
-			/* Ignore shared memory for now */
-			for (int j = 0; j < 1024; ++j) {
-				/* For each frame in the table... */
-				if (!src->tables[i]->pages[j].frame) {
-					continue;
-				}
-				pages++;
-			}
-		}
-	}
-	return pages;
-}
-
-static size_t calculate_shm_resident(page_directory_t * src) {
-	size_t pages = 0;
-	for (uint32_t i = 0; i < 1024; ++i) {
-		if (!src->tables[i] || (uintptr_t)src->tables[i] == (uintptr_t)0xFFFFFFFF) {
-			continue;
-		}
-		if (kernel_directory->tables[i] == src->tables[i]) {
-			continue;
-		}
-		if (i * 0x1000 * 1024 < SHM_START) {
-			continue;
-		}
-		for (int j = 0; j < 1024; ++j) {
-			/* For each frame in the table... */
-			if (!src->tables[i]->pages[j].frame) {
-				continue;
-			}
-			pages++;
-		}
-	}
-	return pages;
-}
-
 static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[2048];
 	process_t * proc = process_from_pid(node->inode);
@@ -153,8 +203,8 @@ static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size
 	}
 
 	/* Calculate process memory usage */
-	int mem_usage = calculate_memory_usage(proc->thread.page_directory) * 4;
-	int shm_usage = calculate_shm_resident(proc->thread.page_directory) * 4;
+	int mem_usage = proc->thread.page_directory->rss * 4;
+	int shm_usage = proc->thread.page_directory->rss_shm * 4;
 	int mem_permille = 1000 * (mem_usage + shm_usage) / memory_total();
 
 	sprintf(buf,
@@ -207,9 +257,60 @@ static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size
 	return size;
 }
 
+static uint32_t proc_stat_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	process_t * proc = process_from_pid(node->inode);
+
+	if (!proc) {
+		return 0;
+	}
+
+	usage_t * usage = &proc->usage;
+	char * buf = malloc(512 + num_syscalls * 32);
+	unsigned int soffset = sprintf(buf,
+			"UserTime:\t%d\n" /* subticks */
+			"SystemTime:\t%d\n"
+			"VoluntarySwitches:\t%d\n"
+			"InvoluntarySwitches:\t%d\n"
+			"PageFaults:\t%d\n"
+			"ReadBytes:\t %d kB\n"
+			"WriteBytes:\t %d kB\n"
+			"Syscalls:\t%d\n"
+			,
+			usage->user_time,
+			usage->system_time,
+			usage->voluntary_switches,
+			usage->involuntary_switches,
+			usage->page_faults,
+			(uint32_t)(usage->bytes_read / 1024),
+			(uint32_t)(usage->bytes_written / 1024),
+			usage->syscalls
+			);
+
+	/* Then each system call this process has made, by number */
+	if (usage->syscall_counts) {
+		for (uint32_t i = 0; i < num_syscalls; ++i) {
+			if (usage->syscall_counts[i]) {
+				soffset += sprintf(&buf[soffset], "Syscall%d:\t%d\n", i, usage->syscall_counts[i]);
+			}
+		}
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
 static struct procfs_entry procdir_entries[] = {
 	{1, "cmdline", proc_cmdline_func},
 	{2, "status",  proc_status_func},
+	{3, "stat",    proc_stat_func},
 };
 
 static struct dirent * readdir_procfs_procdir(fs_node_t *node, uint32_t index) {
@@ -306,7 +407,9 @@ static uint32_t cpuinfo_func(fs_node_t *node, uint64_t offset, uint32_t size, ui
 		"Manufacturer: %s\n"
 		"Family: %d\n"
 		"Model: %d\n"
-		, _manu, _family, _model);
+		"Processors: %d\n"
+		"Processors in use: 1\n"
+		, _manu, _family, _model, processor_count);
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -331,7 +434,12 @@ static uint32_t meminfo_func(fs_node_t *node, uint64_t offset, uint32_t size, ui
 		"MemTotal: %d kB\n"
 		"MemFree: %d kB\n"
 		"KHeapUse: %d kB\n"
-		, total, free, kheap);
+		"Reclaims: %d\n"
+		"Reclaimed: %d kB\n"
+		"SwapTotal: %d kB\n"
+		"SwapFree: %d kB\n"
+		, total, free, kheap, reclaim_runs, reclaim_pages * 4,
+		swap_slots ? (swap_slots - 1) * 4 : 0, swap_slots ? (swap_slots - 1 - swap_used) * 4 : 0);
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -458,50 +566,29 @@ static uint32_t compiler_func(fs_node_t *node, uint64_t offset, uint32_t size, u
 
 extern tree_t * fs_tree; /* kernel/fs/vfs.c */
 
-static void mount_recurse(char * buf, tree_node_t * node, size_t height) {
+static void mount_recurse(struct procfs_out * out, tree_node_t * node, size_t height) {
 	/* End recursion on a blank entry */
 	if (!node) return;
-	char * tmp = malloc(512);
-	memset(tmp, 0, 512);
-	char * c = tmp;
 	/* Indent output */
 	for (uint32_t i = 0; i < height; ++i) {
-		c += sprintf(c, "  ");
+		procfs_printf(out, "  ");
 	}
-	/* Get the current process */
 	struct vfs_entry * fnode = (struct vfs_entry *)node->value;
-	/* Print the process name */
 	if (fnode->file) {
-		c += sprintf(c, "%s → %s 0x%x (%s, %s)", fnode->name, fnode->device, fnode->file, fnode->fs_type, fnode->file->name);
+		procfs_printf(out, "%s → %s 0x%x (%s, %s)\n", fnode->name, fnode->device, fnode->file, fnode->fs_type, fnode->file->name);
 	} else {
-		c += sprintf(c, "%s → (empty)", fnode->name);
+		procfs_printf(out, "%s → (empty)\n", fnode->name);
 	}
-	/* Linefeed */
-	sprintf(buf+strlen(buf),"%s\n",tmp);
-	free(tmp);
 	foreach(child, node->children) {
 		/* Recursively print the children */
-		mount_recurse(buf+strlen(buf),child->value, height + 1);
+		mount_recurse(out, child->value, height + 1);
 	}
 }
 
 static uint32_t mounts_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	char * buf = malloc(4096);
-
-	buf[0] = '\0';
-
-	mount_recurse(buf, fs_tree->root, 0);
-
-	size_t _bsize = strlen(buf);
-	if (offset > _bsize) {
-		free(buf);
-		return 0;
-	}
-	if (size > _bsize - offset) size = _bsize - offset;
-
-	memcpy(buffer, buf + offset, size);
-	free(buf);
-	return size;
+	struct procfs_out out = {0};
+	mount_recurse(&out, fs_tree->root, 0);
+	return procfs_out_read(&out, offset, size, buffer);
 }
 
 static uint32_t modules_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
@@ -630,19 +717,95 @@ static uint32_t irq_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 	return size;
 }
 
+static uint32_t locks_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	size_t bsize = 128;
+	for (kmutex_t * m = kmutex_all; m; m = m->next) {
+		bsize += 64;
+	}
+	char * buf = malloc(bsize);
+	unsigned int soffset = 0;
+
+	for (kmutex_t * m = kmutex_all; m && soffset + 64 < bsize; m = m->next) {
+		soffset += sprintf(&buf[soffset], "%s: %d acquired, %d contended\n", m->name ? m->name : "?", m->acquired, m->contended);
+	}
+	soffset += sprintf(&buf[soffset], "spin locks: %d contended\n", spin_contended);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+/*
+ * One line per system call that has been made: its number, how many
+ * calls, then "b:n" for n calls that took 2^b to 2^(b+1) cycles.
+ */
+static uint32_t syscalls_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	char * buf = malloc(64 + num_syscalls * (16 + SYSCALL_LATENCY_BUCKETS * 16));
+	unsigned int soffset = 0;
+
+	for (uint32_t i = 0; i < num_syscalls; ++i) {
+		uint32_t calls = 0;
+		for (int b = 0; b < SYSCALL_LATENCY_BUCKETS; ++b) {
+			calls += syscall_latency[i][b];
+		}
+		if (!calls) continue;
+		soffset += sprintf(&buf[soffset], "%d %d", i, calls);
+		for (int b = 0; b < SYSCALL_LATENCY_BUCKETS; ++b) {
+			if (syscall_latency[i][b]) {
+				soffset += sprintf(&buf[soffset], " %d:%d", b, syscall_latency[i][b]);
+			}
+		}
+		soffset += sprintf(&buf[soffset], "\n");
+	}
+	buf[soffset] = '\0';
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+static uint32_t profile_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	return profile_read(offset, size, buffer);
+}
+
+static uint32_t boottime_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	return boottime_read(offset, size, buffer);
+}
+
+static uint32_t boottime_write_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	return boottime_write(offset, size, buffer);
+}
+
+static uint32_t kmalloc_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	return kmalloc_profile_read(offset, size, buffer);
+}
+
+static uint32_t kmalloc_write_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	return kmalloc_profile_write(offset, size, buffer);
+}
+
 /**
  * Basically the same as the kdebug `pci` command.
  */
-struct _pci_buf {
-	size_t   offset;
-	char *buffer;
-};
-
 static void scan_hit_list(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 
-	struct _pci_buf * b = extra;
+	struct procfs_out * out = extra;
 
-	b->offset += sprintf(b->buffer + b->offset, "%2x:%2x.%d (%4x, %4x:%4x)\n",
+	procfs_printf(out, "%2x:%2x.%d (%4x, %4x:%4x)\n",
 			(int)pci_extract_bus(device),
 			(int)pci_extract_slot(device),
 			(int)pci_extract_func(device),
@@ -650,43 +813,23 @@ static void scan_hit_list(uint32_t device, uint16_t vendorid, uint16_t deviceid,
 			vendorid,
 			deviceid);
 
-	b->offset += sprintf(b->buffer + b->offset, " BAR0: 0x%8x", pci_read_field(device, PCI_BAR0, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR1: 0x%8x", pci_read_field(device, PCI_BAR1, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR2: 0x%8x", pci_read_field(device, PCI_BAR2, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR3: 0x%8x", pci_read_field(device, PCI_BAR3, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR4: 0x%8x", pci_read_field(device, PCI_BAR4, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR5: 0x%8x\n", pci_read_field(device, PCI_BAR5, 4));
-
-	b->offset += sprintf(b->buffer + b->offset, " IRQ Line: %d", pci_read_field(device, 0x3C, 1));
-	b->offset += sprintf(b->buffer + b->offset, " IRQ Pin: %d", pci_read_field(device, 0x3D, 1));
-	b->offset += sprintf(b->buffer + b->offset, " Interrupt: %d", pci_get_interrupt(device));
-	b->offset += sprintf(b->buffer + b->offset, " Status: 0x%4x\n", pci_read_field(device, PCI_STATUS, 2));
-}
-
-static void scan_count(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
-	size_t * count = extra;
-	(*count)++;
+	procfs_printf(out, " BAR0: 0x%8x", pci_read_field(device, PCI_BAR0, 4));
+	procfs_printf(out, " BAR1: 0x%8x", pci_read_field(device, PCI_BAR1, 4));
+	procfs_printf(out, " BAR2: 0x%8x", pci_read_field(device, PCI_BAR2, 4));
+	procfs_printf(out, " BAR3: 0x%8x", pci_read_field(device, PCI_BAR3, 4));
+	procfs_printf(out, " BAR4: 0x%8x", pci_read_field(device, PCI_BAR4, 4));
+	procfs_printf(out, " BAR5: 0x%8x\n", pci_read_field(device, PCI_BAR5, 4));
+
+	procfs_printf(out, " IRQ Line: %d", pci_read_field(device, 0x3C, 1));
+	procfs_printf(out, " IRQ Pin: %d", pci_read_field(device, 0x3D, 1));
+	procfs_printf(out, " Interrupt: %d", pci_get_interrupt(device));
+	procfs_printf(out, " Status: 0x%4x\n", pci_read_field(device, PCI_STATUS, 2));
 }
 
 static uint32_t pci_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	size_t count = 0;
-	pci_scan(&scan_count, -1, &count);
-
-	struct _pci_buf b = {0,NULL};
-	b.buffer = malloc(count * 1024);
-
-	pci_scan(&scan_hit_list, -1, &b);
-
-	size_t _bsize = b.offset;
-	if (offset > _bsize) {
-		free(b.buffer);
-		return 0;
-	}
-	if (size > _bsize - offset) size = _bsize - offset;
-
-	memcpy(buffer, b.buffer + offset, size);
-	free(b.buffer);
-	return size;
+	struct procfs_out out = {0};
+	pci_scan(&scan_hit_list, -1, &out);
+	return procfs_out_read(&out, offset, size, buffer);
 }
 
 static struct procfs_entry std_entries[] = {
@@ -703,6 +846,11 @@ static struct procfs_entry std_entries[] = {
 	{-11,"irq",      irq_func},
 	{-12,"pat",      pat_func},
 	{-13,"pci",      pci_func},
+	{-14,"locks",    locks_func},
+	{-15,"profile",  profile_func},
+	{-16,"syscalls", syscalls_func},
+	{-17,"boottime", boottime_func},
+	{-18,"kmalloc",  kmalloc_func},
 };
 
 static list_t * extended_entries = NULL;
@@ -861,6 +1009,16 @@ static fs_node_t * finddir_procfs_root(fs_node_t * node, char * name) {
 	for (unsigned int i = 0; i < PROCFS_STANDARD_ENTRIES; ++i) {
 		if (!strcmp(name, std_entries[i].name)) {
 			fs_node_t * out = procfs_generic_create(std_entries[i].name, std_entries[i].func);
+			if (std_entries[i].func == boottime_func) {
+				/* Boot milestones from userspace */
+				out->write = boottime_write_func;
+				out->mask  = 0644;
+			}
+			if (std_entries[i].func == kmalloc_func) {
+				/* Profiler controls */
+				out->write = kmalloc_write_func;
+				out->mask  = 0644;
+			}
 			return out;
 		}
 	}
@@ -5,10 +5,15 @@
  *
  * Mouse driver
  *
+ * Packets wait in a small queue for /dev/mouse to be read. Motion
+ * that arrives while a packet is still waiting is added to it, as
+ * long as the buttons stay the same, so a reader that falls behind
+ * gets one packet per button change rather than one per interrupt,
+ * and is only woken when the queue goes from empty to not.
  */
 #include <kernel/system.h>
 #include <kernel/logging.h>
-#include <kernel/pipe.h>
+#include <kernel/process.h>
 #include <kernel/module.h>
 #include <kernel/mouse.h>
 #include <kernel/args.h>
@@ -16,8 +21,7 @@
 static uint8_t mouse_cycle = 0;
 static uint8_t mouse_byte[4];
 
-#define PACKETS_IN_PIPE 1024
-#define DISCARD_POINT 32
+#define PACKET_QUEUE 64
 
 #define MOUSE_IRQ 12
 
@@ -35,7 +39,28 @@ static uint8_t mouse_byte[4];
 
 static int8_t mouse_mode = MOUSE_DEFAULT;
 
-static fs_node_t * mouse_pipe;
+static mouse_device_packet_t queue[PACKET_QUEUE];
+static uint8_t queue_mergeable[PACKET_QUEUE]; /* Same buttons as the packet before it */
+static size_t queue_head = 0;
+static size_t queue_count = 0;
+static uint32_t queue_buttons = 0; /* Buttons of the newest packet */
+static list_t * mouse_readers;
+static list_t * mouse_alert_waiters;
+
+static uint32_t read_mouse(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer);
+static int ioctl_mouse(fs_node_t * node, int request, void * argp);
+static int check_mouse(fs_node_t * node);
+static int wait_mouse(fs_node_t * node, void * process);
+
+static fs_node_t mouse_node = {
+	.name        = "mouse",
+	.mask        = 0666,
+	.flags       = FS_CHARDEVICE,
+	.read        = read_mouse,
+	.ioctl       = ioctl_mouse,
+	.selectcheck = check_mouse,
+	.selectwait  = wait_mouse,
+};
 
 void (*ps2_mouse_alternate)(void) = NULL;
 
@@ -67,6 +92,87 @@ static void mouse_write(uint8_t write) {
 	outportb(MOUSE_PORT, write);
 }
 
+/*
+ * Queue a packet, or fold it into the newest one if that is still
+ * waiting and neither changes the buttons or scrolls. Called from the
+ * interrupt handler.
+ */
+static void queue_packet(mouse_device_packet_t * packet) {
+	int scroll = packet->buttons & (MOUSE_SCROLL_UP | MOUSE_SCROLL_DOWN);
+	int same = packet->buttons == queue_buttons && !scroll;
+	queue_buttons = packet->buttons;
+
+	if (queue_count && same) {
+		size_t tail = (queue_head + queue_count - 1) % PACKET_QUEUE;
+		if (queue_mergeable[tail]) {
+			queue[tail].x_difference += packet->x_difference;
+			queue[tail].y_difference += packet->y_difference;
+			return;
+		}
+	}
+
+	if (queue_count == PACKET_QUEUE) {
+		/* Nobody is reading; lose the oldest */
+		queue_head = (queue_head + 1) % PACKET_QUEUE;
+		queue_count--;
+	}
+
+	size_t tail = (queue_head + queue_count) % PACKET_QUEUE;
+	queue[tail] = *packet;
+	queue_mergeable[tail] = same;
+	queue_count++;
+
+	if (queue_count == 1) {
+		wakeup_queue(mouse_readers);
+		while (mouse_alert_waiters->head) {
+			node_t * node = list_dequeue(mouse_alert_waiters);
+			process_alert_node(node->value, &mouse_node);
+			free(node);
+		}
+	}
+}
+
+/*
+ * Hand over every whole packet that fits, waiting for one if there are none.
+ */
+static uint32_t read_mouse(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	size_t wanted = size / sizeof(mouse_device_packet_t);
+	if (!wanted) return 0;
+
+	for (;;) {
+		IRQ_OFF;
+		if (queue_count) break;
+		IRQ_RES;
+		if (sleep_on(mouse_readers)) {
+			return -EINTR;
+		}
+	}
+
+	size_t count = MIN(wanted, queue_count);
+	for (size_t i = 0; i < count; ++i) {
+		memcpy(buffer + i * sizeof(mouse_device_packet_t), &queue[queue_head], sizeof(mouse_device_packet_t));
+		queue_head = (queue_head + 1) % PACKET_QUEUE;
+	}
+	queue_count -= count;
+	IRQ_RES;
+
+	return count * sizeof(mouse_device_packet_t);
+}
+
+static int check_mouse(fs_node_t * node) {
+	return queue_count ? 0 : 1;
+}
+
+static int wait_mouse(fs_node_t * node, void * process) {
+	IRQ_OFF;
+	if (!list_find(mouse_alert_waiters, process)) {
+		list_insert(mouse_alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, &mouse_node);
+	IRQ_RES;
+	return 0;
+}
+
 static uint8_t mouse_read(void) {
 	mouse_wait(0);
 	char t = inportb(MOUSE_PORT);
@@ -144,11 +250,7 @@ finish_packet:
 			}
 		}
 
-		mouse_device_packet_t bitbucket;
-		while (pipe_size(mouse_pipe) > (int)(DISCARD_POINT * sizeof(packet))) {
-			read_fs(mouse_pipe, 0, sizeof(packet), (uint8_t *)&bitbucket);
-		}
-		write_fs(mouse_pipe, 0, sizeof(packet), (uint8_t *)&packet);
+		queue_packet(&packet);
 read_next:
 		break;
 	}
@@ -173,7 +275,8 @@ static int mouse_install(void) {
 		inportb(0x60);
 	}
 
-	mouse_pipe = make_pipe(sizeof(mouse_device_packet_t) * PACKETS_IN_PIPE);
+	mouse_readers = list_create();
+	mouse_alert_waiters = list_create();
 	mouse_wait(1);
 	outportb(MOUSE_STATUS, 0xA8);
 	mouse_read();
@@ -235,10 +338,7 @@ static int mouse_install(void) {
 		inportb(0x60);
 	}
 
-	mouse_pipe->flags = FS_CHARDEVICE;
-	mouse_pipe->ioctl = ioctl_mouse;
-
-	vfs_mount("/dev/mouse", mouse_pipe);
+	vfs_mount("/dev/mouse", &mouse_node);
 	return 0;
 }
 
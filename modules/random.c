@@ -5,23 +5,27 @@
  *
  * Provides access to the kernel RNG
  *
+ * Both /dev/random and /dev/urandom read from the kernel CSPRNG, which
+ * never blocks. Writes are stirred into its entropy pool.
  */
 
 #include <kernel/system.h>
 #include <kernel/logging.h>
 #include <kernel/fs.h>
 #include <kernel/module.h>
+#include <kernel/random.h>
 
 static uint32_t read_random(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	uint32_t s = 0;
-	while (s < size) {
-		buffer[s] = krand() % 0xFF;
-		s++;
-	}
+	random_get_bytes(buffer, size);
 	return size;
 }
 
 static uint32_t write_random(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	for (uint32_t i = 0; i < size; i += 4) {
+		uint32_t value = 0;
+		memcpy(&value, &buffer[i], size - i < 4 ? size - i : 4);
+		random_add_entropy(value);
+	}
 	return size;
 }
 
@@ -40,7 +44,7 @@ static fs_node_t * random_device_create(void) {
 	strcpy(fnode->name, "random");
 	fnode->uid = 0;
 	fnode->gid = 0;
-	fnode->mask = 0444;
+	fnode->mask = 0666;
 	fnode->length  = 1024;
 	fnode->flags   = FS_CHARDEVICE;
 	fnode->read    = read_random;
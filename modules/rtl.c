@@ -137,10 +137,12 @@ static int rtl_irq_handler(struct regs *r) {
 
 			if (rx_status & (0x0020 | 0x0010 | 0x0004 | 0x0002)) {
 				debug_print(WARNING, "rx error :(");
+			} else if (rx_size > NET_PACKET_SIZE) {
+				debug_print(WARNING, "rx frame too large (%d bytes)", rx_size);
 			} else {
 				uint8_t * buf_8 = (uint8_t *)&(buf_start[1]);
 
-				last_packet = malloc(rx_size);
+				last_packet = net_packet_alloc();
 
 				uintptr_t packet_end = (uintptr_t)buf_8 + rx_size;
 				if (packet_end > (uintptr_t)rtl_rx_buffer + 0x2000) {
@@ -268,7 +270,7 @@ static void rtl_netd(void * data, char * name) {
 		}
 
 		ack_no = ntohl(tcp->seq_number) + 1;
-		free(eth);
+		net_packet_free(eth);
 	}
 
 	{
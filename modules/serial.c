@@ -24,87 +24,239 @@
 #define SERIAL_IRQ_AC 4
 #define SERIAL_IRQ_BD 3
 
-static pty_t * _serial_port_pty_a = NULL;
-static pty_t * _serial_port_pty_b = NULL;
-static pty_t * _serial_port_pty_c = NULL;
-static pty_t * _serial_port_pty_d = NULL;
-
-static pty_t ** pty_for_port(int port) {
-	switch (port) {
-		case SERIAL_PORT_A: return &_serial_port_pty_a;
-		case SERIAL_PORT_B: return &_serial_port_pty_b;
-		case SERIAL_PORT_C: return &_serial_port_pty_c;
-		case SERIAL_PORT_D: return &_serial_port_pty_d;
+#define SERIAL_CLOCK   115200 /* Divisor 1 */
+#define SERIAL_FIFO    16     /* Bytes the transmitter takes at once when THR is empty */
+#define SERIAL_TX_SIZE 4096
+
+/* Register offsets from the port base */
+#define UART_DATA 0
+#define UART_IER  1
+#define UART_IIR  2 /* Read */
+#define UART_FCR  2 /* Write */
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+#define UART_MSR  6
+
+#define IER_RX   0x01
+#define IER_THRE 0x02
+
+#define LSR_DATA 0x01
+#define LSR_THRE 0x20
+#define LSR_TEMT 0x40
+
+/*
+ * Output goes into a ring, and the THRE interrupt pulls it out a
+ * FIFO's worth at a time; the THRE interrupt is only enabled while
+ * there is something waiting. Everything that touches the ring runs
+ * with interrupts off.
+ */
+struct serial_port {
+	int base;
+	int irq;
+	pty_t * pty;
+
+	uint16_t divisor;
+	uint8_t lcr;
+	uint8_t fcr;
+
+	int tx_armed;
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	uint8_t tx[SERIAL_TX_SIZE];
+};
+
+static struct serial_port serial_ports[] = {
+	{ .base = SERIAL_PORT_A, .irq = SERIAL_IRQ_AC },
+	{ .base = SERIAL_PORT_B, .irq = SERIAL_IRQ_BD },
+	{ .base = SERIAL_PORT_C, .irq = SERIAL_IRQ_AC },
+	{ .base = SERIAL_PORT_D, .irq = SERIAL_IRQ_BD },
+};
+
+#define SERIAL_PORTS (sizeof(serial_ports) / sizeof(*serial_ports))
+
+static struct serial_port * port_for_pty(pty_t * pty) {
+	for (unsigned int i = 0; i < SERIAL_PORTS; ++i) {
+		if (serial_ports[i].pty == pty) return &serial_ports[i];
 	}
 	__builtin_unreachable();
 }
 
-static int serial_rcvd(int device) {
-	return inportb(device + 5) & 1;
+static int tx_empty(struct serial_port * p) {
+	return p->tx_head == p->tx_tail;
 }
 
-static char serial_recv(int device) {
-	while (serial_rcvd(device) == 0) ;
-	return inportb(device);
+static int tx_full(struct serial_port * p) {
+	return (p->tx_head + 1) % SERIAL_TX_SIZE == p->tx_tail;
 }
 
-static int serial_transmit_empty(int device) {
-	return inportb(device + 5) & 0x20;
+/* Top up the transmitter if it's idle, and arm THRE if more is waiting. IRQs off. */
+static void tx_fill(struct serial_port * p) {
+	if (inportb(p->base + UART_LSR) & LSR_THRE) {
+		for (int i = 0; i < SERIAL_FIFO && !tx_empty(p); ++i) {
+			outportb(p->base + UART_DATA, p->tx[p->tx_tail]);
+			p->tx_tail = (p->tx_tail + 1) % SERIAL_TX_SIZE;
+		}
+	}
+	int want = !tx_empty(p);
+	if (want != p->tx_armed) {
+		p->tx_armed = want;
+		outportb(p->base + UART_IER, want ? (IER_RX | IER_THRE) : IER_RX);
+	}
 }
 
-static void serial_send(int device, char out) {
-	while (serial_transmit_empty(device) == 0);
-	outportb(device, out);
+/* Wait out everything queued, down to the last stop bit. IRQs off. */
+static void tx_drain(struct serial_port * p) {
+	while (!tx_empty(p) || !(inportb(p->base + UART_LSR) & LSR_TEMT)) {
+		tx_fill(p);
+	}
 }
 
-static int serial_handler_ac(struct regs *r) {
-	char serial;
-	int  port = 0;
-	if (inportb(SERIAL_PORT_A+1) & 0x01) {
-		port = SERIAL_PORT_A;
-	} else {
-		port = SERIAL_PORT_C;
+static void serial_handler(int irq) {
+	uint8_t rx[SERIAL_PORTS][64];
+	int rx_len[SERIAL_PORTS] = {0};
+
+	for (unsigned int i = 0; i < SERIAL_PORTS; ++i) {
+		struct serial_port * p = &serial_ports[i];
+		if (p->irq != irq || !p->pty) continue;
+		uint8_t iir;
+		while (!((iir = inportb(p->base + UART_IIR)) & 0x01)) {
+			switch (iir & 0x0E) {
+				case 0x06: /* Line status */
+					inportb(p->base + UART_LSR);
+					break;
+				case 0x04: /* Received data */
+				case 0x0C: /* Character timeout */
+					while (inportb(p->base + UART_LSR) & LSR_DATA) {
+						uint8_t c = inportb(p->base + UART_DATA);
+						if (rx_len[i] < (int)sizeof(rx[i])) rx[i][rx_len[i]++] = c;
+					}
+					break;
+				case 0x02: /* Transmitter empty */
+					tx_fill(p);
+					break;
+				default: /* Modem status */
+					inportb(p->base + UART_MSR);
+					break;
+			}
+		}
 	}
-	serial = serial_recv(port);
-	irq_ack(SERIAL_IRQ_AC);
-	tty_input_process(*pty_for_port(port), serial);
+
+	irq_ack(irq);
+
+	for (unsigned int i = 0; i < SERIAL_PORTS; ++i) {
+		for (int j = 0; j < rx_len[i]; ++j) {
+			tty_input_process(serial_ports[i].pty, rx[i][j]);
+		}
+	}
+}
+
+static int serial_handler_ac(struct regs *r) {
+	serial_handler(SERIAL_IRQ_AC);
 	return 1;
 }
 
 static int serial_handler_bd(struct regs *r) {
-	char serial;
-	int  port = 0;
-	debug_print(NOTICE, "Received something on secondary port");
-	if (inportb(SERIAL_PORT_B+1) & 0x01) {
-		port = SERIAL_PORT_B;
-	} else {
-		port = SERIAL_PORT_D;
-	}
-	serial = serial_recv(port);
-	irq_ack(SERIAL_IRQ_BD);
-	tty_input_process(*pty_for_port(port), serial);
+	serial_handler(SERIAL_IRQ_BD);
 	return 1;
 }
 
-static void serial_enable(int port) {
-	outportb(port + 1, 0x00); /* Disable interrupts */
-	outportb(port + 3, 0x80); /* Enable divisor mode */
-	outportb(port + 0, 0x01); /* Div Low:  01 Set the port to 115200 bps */
-	outportb(port + 1, 0x00); /* Div High: 00 */
-	outportb(port + 3, 0x03); /* Disable divisor mode, set parity */
-	outportb(port + 2, 0xC7); /* Enable FIFO and clear */
-	outportb(port + 4, 0x0B); /* Enable interrupts */
-	outportb(port + 1, 0x01); /* Enable interrupts */
+static void serial_program(struct serial_port * p) {
+	outportb(p->base + UART_IER, 0x00); /* Disable interrupts */
+	outportb(p->base + UART_LCR, 0x80); /* Enable divisor mode */
+	outportb(p->base + 0, p->divisor & 0xFF);
+	outportb(p->base + 1, p->divisor >> 8);
+	outportb(p->base + UART_LCR, p->lcr); /* Disable divisor mode, set word format */
+	outportb(p->base + UART_FCR, p->fcr | 0x07); /* Enable FIFO and clear */
+	outportb(p->base + UART_MCR, 0x0B); /* Enable interrupts */
+	outportb(p->base + UART_IER, p->tx_armed ? (IER_RX | IER_THRE) : IER_RX);
+}
+
+static void serial_enable(struct serial_port * p) {
+	p->divisor = 1;   /* 115200 bps */
+	p->lcr = 0x03;    /* 8N1 */
+	p->fcr = 0xC0;    /* Receive interrupt at 14 bytes */
+	p->tx_armed = 0;
+	serial_program(p);
 }
 
 static int have_installed_ac = 0;
 static int have_installed_bd = 0;
 
 static void serial_write_out(pty_t * pty, uint8_t c) {
-	if (pty == _serial_port_pty_a) serial_send(SERIAL_PORT_A, c);
-	if (pty == _serial_port_pty_b) serial_send(SERIAL_PORT_B, c);
-	if (pty == _serial_port_pty_c) serial_send(SERIAL_PORT_C, c);
-	if (pty == _serial_port_pty_d) serial_send(SERIAL_PORT_D, c);
+	struct serial_port * p = port_for_pty(pty);
+	IRQ_OFF;
+	/* Only if we're writing faster than the line: wait for room */
+	while (tx_full(p)) {
+		tx_fill(p);
+	}
+	p->tx[p->tx_head] = c;
+	p->tx_head = (p->tx_head + 1) % SERIAL_TX_SIZE;
+	if (!p->tx_armed) {
+		tx_fill(p);
+	}
+	IRQ_RES;
+}
+
+static unsigned int serial_baud(tcflag_t cflag) {
+	switch (cflag & CBAUD) {
+		case B50:     return 50;
+		case B75:     return 75;
+		case B110:    return 110;
+		case B134:    return 134;
+		case B150:    return 150;
+		case B200:    return 200;
+		case B300:    return 300;
+		case B600:    return 600;
+		case B1200:   return 1200;
+		case B1800:   return 1800;
+		case B2400:   return 2400;
+		case B4800:   return 4800;
+		case B9600:   return 9600;
+		case B19200:  return 19200;
+		case B38400:  return 38400;
+		case B57600:  return 57600;
+		case B115200: return 115200;
+		default:      return 0;
+	}
+}
+
+/*
+ * Line settings from termios: speed, character size, stop bits and parity
+ * from c_cflag. In non-canonical mode the receive FIFO trigger follows
+ * VMIN, picking the largest level (1, 4, 8 or 14) that doesn't exceed it;
+ * the character timeout interrupt picks up anything short of the trigger.
+ */
+static void serial_tios_changed(pty_t * pty) {
+	struct serial_port * p = port_for_pty(pty);
+	struct termios * tios = &pty->tios;
+
+	unsigned int baud = serial_baud(tios->c_cflag);
+	uint16_t divisor = baud ? SERIAL_CLOCK / baud : p->divisor;
+
+	uint8_t lcr = (tios->c_cflag & CSIZE) >> 4;
+	if (tios->c_cflag & CSTOPB) lcr |= 0x04;
+	if (tios->c_cflag & PARENB) lcr |= (tios->c_cflag & PARODD) ? 0x08 : 0x18;
+
+	uint8_t fcr = 0xC0;
+	if (!(tios->c_lflag & ICANON)) {
+		cc_t vmin = tios->c_cc[VMIN];
+		fcr = vmin >= 14 ? 0xC0 : vmin >= 8 ? 0x80 : vmin >= 4 ? 0x40 : 0x00;
+	}
+
+	IRQ_OFF;
+	if (divisor != p->divisor || lcr != p->lcr) {
+		/* Don't change the line under bytes that are still going out */
+		tx_drain(p);
+		p->divisor = divisor;
+		p->lcr = lcr;
+		p->fcr = fcr;
+		serial_program(p);
+	} else if (fcr != p->fcr) {
+		p->fcr = fcr;
+		outportb(p->base + UART_FCR, fcr | 0x01);
+	}
+	IRQ_RES;
 }
 
 #define DEV_PATH "/dev/"
@@ -114,21 +266,30 @@ static void serial_write_out(pty_t * pty, uint8_t c) {
 #define TTY_D "ttyS3"
 
 static void serial_fill_name(pty_t * pty, char * name) {
-	if (pty == _serial_port_pty_a) sprintf(name, DEV_PATH TTY_A);
-	if (pty == _serial_port_pty_b) sprintf(name, DEV_PATH TTY_B);
-	if (pty == _serial_port_pty_c) sprintf(name, DEV_PATH TTY_C);
-	if (pty == _serial_port_pty_d) sprintf(name, DEV_PATH TTY_D);
+	switch (port_for_pty(pty)->base) {
+		case SERIAL_PORT_A: sprintf(name, DEV_PATH TTY_A); break;
+		case SERIAL_PORT_B: sprintf(name, DEV_PATH TTY_B); break;
+		case SERIAL_PORT_C: sprintf(name, DEV_PATH TTY_C); break;
+		case SERIAL_PORT_D: sprintf(name, DEV_PATH TTY_D); break;
+	}
 }
 
 static fs_node_t * serial_device_create(int port) {
+	struct serial_port * p = NULL;
+	for (unsigned int i = 0; i < SERIAL_PORTS; ++i) {
+		if (serial_ports[i].base == port) p = &serial_ports[i];
+	}
+
 	pty_t * pty = pty_new(NULL);
-	*pty_for_port(port) = pty;
 	pty->write_out = serial_write_out;
 	pty->fill_name = serial_fill_name;
+	pty->tios_changed = serial_tios_changed;
+	pty->tios.c_cflag |= B115200;
 
-	serial_enable(port);
+	serial_enable(p);
+	p->pty = pty;
 
-	if (port == SERIAL_PORT_A || port == SERIAL_PORT_C) {
+	if (p->irq == SERIAL_IRQ_AC) {
 		if (!have_installed_ac) {
 			irq_install_handler(SERIAL_IRQ_AC, serial_handler_ac, "serial ac");
 			have_installed_ac = 1;
@@ -24,6 +24,19 @@
 
 #define SND_BUF_SIZE 0x4000
 
+/* What the mixer and devices take: 48KHz, signed 16-bit, stereo */
+#define SND_RATE     48000
+#define SND_CHANNELS 2
+#define SND_BITS     16
+
+#define SND_RATE_MIN 8000
+#define SND_RATE_MAX 48000
+
+/* Resampling filter */
+#define RESAMPLE_TAPS   8
+#define RESAMPLE_PHASES 32
+#define RESAMPLE_MAX_OUT (SND_RATE / SND_RATE_MIN + 1) /* Most frames out per frame in */
+
 static uint32_t snd_dsp_write(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer);
 static int snd_dsp_ioctl(fs_node_t * node, int request, void * argp);
 static void snd_dsp_open(fs_node_t * node, unsigned int flags);
@@ -63,6 +76,63 @@ struct dsp_node {
 	size_t samples;
 	size_t written;
 	int realtime;
+	uint32_t volume; /* 16.16 fixed point */
+
+	/* What the client writes */
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t bits;
+
+	/* Conversion state, for anything but the mixer's own format */
+	uint8_t partial[8];                /* Bytes of a frame split across writes */
+	size_t partial_length;
+	int16_t history[RESAMPLE_TAPS][2]; /* The last input frames, oldest first */
+	uint32_t step;                     /* Input frames per output frame, 16.16 */
+	uint32_t position;                 /* Past history[TAPS/2-1], 16.16 */
+};
+
+/*
+ * Interpolation filter for the resampler: a Blackman-windowed sinc
+ * cut off at 0.9 of the input's Nyquist frequency, RESAMPLE_TAPS taps
+ * for each of RESAMPLE_PHASES positions between two input frames,
+ * Q15, each row normalized to unity gain.
+ *
+ * Streams are only ever converted up to 48KHz, so one table serves
+ * every rate.
+ */
+static const int16_t resample_filter[RESAMPLE_PHASES][RESAMPLE_TAPS] = {
+	{    187,  -1042,   2493,  29491,   2493,  -1042,    187,      0 },
+	{    160,   -865,   1723,  29445,   3315,  -1226,    215,      0 },
+	{    135,   -697,   1006,  29309,   4187,  -1416,    244,     -1 },
+	{    112,   -538,    344,  29081,   5105,  -1610,    274,     -1 },
+	{     91,   -390,   -263,  28766,   6067,  -1806,    304,     -2 },
+	{     72,   -252,   -813,  28363,   7069,  -2003,    335,     -4 },
+	{     55,   -126,  -1307,  27877,   8106,  -2197,    365,     -5 },
+	{     39,    -12,  -1746,  27311,   9176,  -2388,    394,     -7 },
+	{     26,     90,  -2130,  26667,  10272,  -2571,    422,     -9 },
+	{     15,    181,  -2460,  25950,  11389,  -2744,    447,    -11 },
+	{      5,    260,  -2739,  25166,  12523,  -2905,    470,    -13 },
+	{     -2,    327,  -2967,  24318,  13667,  -3051,    489,    -15 },
+	{     -9,    383,  -3147,  23413,  14816,  -3178,    505,    -17 },
+	{    -13,    429,  -3281,  22456,  15964,  -3283,    515,    -18 },
+	{    -17,    464,  -3372,  21452,  17103,  -3363,    519,    -20 },
+	{    -19,    490,  -3423,  20409,  18228,  -3415,    517,    -20 },
+	{    -20,    508,  -3436,  19332,  19332,  -3436,    508,    -20 },
+	{    -20,    517,  -3415,  18228,  20409,  -3423,    490,    -19 },
+	{    -20,    519,  -3363,  17103,  21452,  -3372,    464,    -17 },
+	{    -18,    515,  -3283,  15964,  22456,  -3281,    429,    -13 },
+	{    -17,    505,  -3178,  14816,  23413,  -3147,    383,     -9 },
+	{    -15,    489,  -3051,  13667,  24318,  -2967,    327,     -2 },
+	{    -13,    470,  -2905,  12523,  25166,  -2739,    260,      5 },
+	{    -11,    447,  -2744,  11389,  25950,  -2460,    181,     15 },
+	{     -9,    422,  -2571,  10272,  26667,  -2130,     90,     26 },
+	{     -7,    394,  -2388,   9176,  27311,  -1746,    -12,     39 },
+	{     -5,    365,  -2197,   8106,  27877,  -1307,   -126,     55 },
+	{     -4,    335,  -2003,   7069,  28363,   -813,   -252,     72 },
+	{     -2,    304,  -1806,   6067,  28766,   -263,   -390,     91 },
+	{     -1,    274,  -1610,   5105,  29081,    344,   -538,    112 },
+	{     -1,    244,  -1416,   4187,  29309,   1006,   -697,    135 },
+	{      0,    215,  -1226,   3315,  29445,   1723,   -865,    160 },
 };
 
 int snd_register(snd_device_t * device) {
@@ -102,11 +172,127 @@ snd_unregister_cleanup:
 	return rv;
 }
 
+static inline int16_t clamp_sample(int32_t sample) {
+	if (sample > INT16_MAX) return INT16_MAX;
+	if (sample < INT16_MIN) return INT16_MIN;
+	return sample;
+}
+
+static int snd_dsp_native(struct dsp_node * dsp) {
+	return dsp->rate == SND_RATE && dsp->channels == SND_CHANNELS && dsp->bits == SND_BITS;
+}
+
+static int snd_dsp_set_format(struct dsp_node * dsp, snd_dsp_format_t * format) {
+	uint32_t rate     = format->rate     ? format->rate     : dsp->rate;
+	uint32_t channels = format->channels ? format->channels : dsp->channels;
+	uint32_t bits     = format->bits     ? format->bits     : dsp->bits;
+
+	if (rate < SND_RATE_MIN || rate > SND_RATE_MAX) return -EINVAL;
+	if (channels != 1 && channels != 2) return -EINVAL;
+	if (bits != 8 && bits != 16 && bits != 32) return -EINVAL;
+
+	dsp->rate = rate;
+	dsp->channels = channels;
+	dsp->bits = bits;
+
+	dsp->partial_length = 0;
+	memset(dsp->history, 0, sizeof(dsp->history));
+	dsp->step = (uint32_t)(((uint64_t)rate << 16) / SND_RATE);
+	dsp->position = 0;
+
+	format->rate = rate;
+	format->channels = channels;
+	format->bits = bits;
+	return 0;
+}
+
+/* Decode one frame in the client's format to 16-bit stereo */
+static void snd_decode_frame(struct dsp_node * dsp, uint8_t * in, int16_t out[2]) {
+	for (uint32_t c = 0; c < dsp->channels; ++c) {
+		switch (dsp->bits) {
+			case 8:  out[c] = ((int16_t)in[c] - 0x80) << 8; break; /* Unsigned */
+			case 16: out[c] = ((int16_t *)in)[c]; break;
+			case 32: out[c] = ((int32_t *)in)[c] >> 16; break;
+		}
+	}
+	if (dsp->channels == 1) {
+		out[1] = out[0];
+	}
+}
+
+/*
+ * Take one input frame into the filter and produce however many output
+ * frames fall before the next one.
+ *
+ * @return The number of frames written to `out`.
+ */
+static size_t snd_resample_frame(struct dsp_node * dsp, int16_t frame[2], int16_t * out) {
+	memmove(dsp->history[0], dsp->history[1], sizeof(dsp->history) - sizeof(dsp->history[0]));
+	dsp->history[RESAMPLE_TAPS-1][0] = frame[0];
+	dsp->history[RESAMPLE_TAPS-1][1] = frame[1];
+
+	size_t count = 0;
+	while (dsp->position < 0x10000) {
+		const int16_t * taps = resample_filter[dsp->position >> (16 - 5)];
+		int32_t left = 0, right = 0;
+		for (int k = 0; k < RESAMPLE_TAPS; ++k) {
+			left  += (int32_t)dsp->history[k][0] * taps[k];
+			right += (int32_t)dsp->history[k][1] * taps[k];
+		}
+		out[count * 2]     = clamp_sample(left >> 15);
+		out[count * 2 + 1] = clamp_sample(right >> 15);
+		count++;
+		dsp->position += dsp->step;
+	}
+	dsp->position -= 0x10000;
+	return count;
+}
+
+static void snd_dsp_queue(struct dsp_node * dsp, int16_t * samples, size_t frames) {
+	size_t bytes = frames * SND_CHANNELS * sizeof(int16_t);
+	if (dsp->realtime) {
+		bytes = MIN(bytes, ring_buffer_available(dsp->rb) & ~0x3);
+	}
+	dsp->written += ring_buffer_write(dsp->rb, bytes, (uint8_t *)samples) / 4;
+}
+
+/*
+ * Convert what the client wrote to the mixer's format on its way into
+ * the ring buffer. Realtime streams drop what doesn't fit.
+ */
+static uint32_t snd_dsp_write_converted(struct dsp_node * dsp, uint32_t size, uint8_t * buffer) {
+	int16_t out[256 * SND_CHANNELS];
+	size_t out_frames = 0;
+	size_t frame_size = dsp->channels * dsp->bits / 8;
+
+	for (uint32_t i = 0; i < size; ++i) {
+		dsp->partial[dsp->partial_length++] = buffer[i];
+		if (dsp->partial_length < frame_size) continue;
+		dsp->partial_length = 0;
+
+		int16_t frame[2] = {0, 0};
+		snd_decode_frame(dsp, dsp->partial, frame);
+		out_frames += snd_resample_frame(dsp, frame, &out[out_frames * SND_CHANNELS]);
+
+		if (out_frames + RESAMPLE_MAX_OUT > N_ELEMENTS(out) / SND_CHANNELS) {
+			snd_dsp_queue(dsp, out, out_frames);
+			out_frames = 0;
+		}
+	}
+	snd_dsp_queue(dsp, out, out_frames);
+
+	return size;
+}
+
 static uint32_t snd_dsp_write(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	if (!_devices.length) return -1; /* No sink available. */
 
 	struct dsp_node * dsp = node->device;
 
+	if (!snd_dsp_native(dsp)) {
+		return snd_dsp_write_converted(dsp, size, buffer);
+	}
+
 	size_t s = ring_buffer_available(dsp->rb);
 	size_t out;
 	if (size > s && dsp->realtime) {
@@ -119,13 +305,48 @@ static uint32_t snd_dsp_write(fs_node_t * node, uint64_t offset, uint32_t size,
 	return out;
 }
 
+static snd_device_t * snd_main_device();
+
 static int snd_dsp_ioctl(fs_node_t * node, int request, void * argp) {
 	/* Potentially use this to set sample rates in the future */
 	struct dsp_node * dsp = node->device;
-	if (request == 4) {
-		dsp->realtime = 1;
-	} else if (request == 5) {
-		return dsp->samples;
+	snd_device_t * device;
+	switch (request) {
+		case SND_DSP_SET_REALTIME:
+			dsp->realtime = 1;
+			return 0;
+		case SND_DSP_GET_SAMPLES:
+			return dsp->samples;
+		case SND_DSP_SET_VOLUME:
+			validate(argp);
+			dsp->volume = MIN(*(uint32_t *)argp, SND_DSP_VOLUME_MAX);
+			return 0;
+		case SND_DSP_GET_VOLUME:
+			validate(argp);
+			*(uint32_t *)argp = dsp->volume;
+			return 0;
+		case SND_DSP_SET_PERIODS: {
+			validate(argp);
+			snd_dsp_periods_t * periods = argp;
+			device = snd_main_device();
+			if (!device) return -ENODEV;
+			if (!device->set_periods) return -EINVAL;
+			return device->set_periods(&periods->count, &periods->size);
+		}
+		case SND_DSP_GET_POSITION: {
+			validate(argp);
+			snd_dsp_position_t * position = argp;
+			device = snd_main_device();
+			uint32_t in_device = (device && device->queued) ? device->queued() : 0;
+			/* Everything mixed from this stream went in after what the device holds, at worst */
+			in_device = MIN(in_device, dsp->samples);
+			position->played = dsp->samples - in_device;
+			position->queued = in_device + ring_buffer_unread(dsp->rb) / 4;
+			return 0;
+		}
+		case SND_DSP_SET_FORMAT:
+			validate(argp);
+			return snd_dsp_set_format(dsp, argp);
 	}
 	return -1;
 }
@@ -142,6 +363,11 @@ static void snd_dsp_open(fs_node_t * node, unsigned int flags) {
 	dsp->samples = 0;
 	dsp->written = 0;
 	dsp->realtime = 0;
+	dsp->volume = SND_DSP_VOLUME_UNITY;
+	dsp->rate = SND_RATE;
+	dsp->channels = SND_CHANNELS;
+	dsp->bits = SND_BITS;
+	dsp->partial_length = 0;
 	node->device = dsp;
 	spin_lock(_buffers_lock);
 	list_insert(&_buffers, node->device);
@@ -233,39 +459,78 @@ static void snd_mixer_close(fs_node_t * node) {
 	return;
 }
 
-int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer) {
-	static int16_t tmp_buf[0x100];
+/*
+ * Mix `count` samples at `in` into `out` with the stream's volume.
+ * The first stream is copied rather than added, which saves clearing
+ * the buffer beforehand.
+ */
+static void mix_samples(int16_t * out, int16_t * in, size_t count, uint32_t volume, int first) {
+	if (volume == SND_DSP_VOLUME_UNITY) {
+		if (first) {
+			memcpy(out, in, count * sizeof(int16_t));
+			return;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = clamp_sample((int32_t)out[i] + in[i]);
+		}
+		return;
+	}
 
-	memset(buffer, 0, size);
+	for (size_t i = 0; i < count; ++i) {
+		int32_t sample = ((int32_t)in[i] * (int32_t)volume) >> 16;
+		out[i] = clamp_sample((first ? 0 : (int32_t)out[i]) + sample);
+	}
+}
+
+/*
+ * Mix up to `size` bytes of a stream straight out of its ring buffer,
+ * in at most two runs (before and after it wraps).
+ *
+ * @return The number of bytes mixed.
+ */
+static size_t mix_stream(struct dsp_node * dsp, uint8_t * buffer, size_t size, int first) {
+	ring_buffer_t * rb = dsp->rb;
+
+	spin_lock(rb->lock);
+	/* ~0x3 is to ensure we don't read partial samples or just a single channel */
+	size_t bytes = MIN(ring_buffer_unread(rb) & ~0x3, size);
+	size_t done = 0;
+	while (done < bytes) {
+		size_t run = MIN(bytes - done, rb->size - rb->read_ptr);
+		mix_samples((int16_t *)(buffer + done), (int16_t *)(rb->buffer + rb->read_ptr),
+			run / sizeof(int16_t), dsp->volume, first);
+		rb->read_ptr = (rb->read_ptr + run) % rb->size;
+		done += run;
+	}
+	spin_unlock(rb->lock);
+
+	if (bytes) {
+		wakeup_queue(rb->wait_queue_writers);
+	}
+	dsp->samples += bytes / 4; /* 16 bits, 2 channels */
+	return bytes;
+}
+
+int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer) {
+	/* Bytes at the start of the buffer that hold mixed samples so far */
+	size_t filled = 0;
 
 	spin_lock(_buffers_lock);
 	foreach(buf_node, &_buffers) {
 		struct dsp_node * dsp = buf_node->value;
-		ring_buffer_t * buf = dsp->rb;
-		/* ~0x3 is to ensure we don't read partial samples or just a single channel */
-		size_t bytes_left = MIN(ring_buffer_unread(buf) & ~0x3, size);
-		int16_t * adding_ptr = (int16_t *) buffer;
-		while (bytes_left) {
-			size_t this_read_size = MIN(bytes_left, sizeof(tmp_buf));
-			ring_buffer_read(buf, this_read_size, (uint8_t *)tmp_buf);
-			dsp->samples += this_read_size / 4; /* 16 bits, 2 channels */
-			/*
-			 * Reduce the sample by a half so that multiple sources won't immediately
-			 * cause awful clipping. This is kind of a hack since it would probably be
-			 * better to just use some kind of compressor.
-			 */
-			for (size_t i = 0; i < N_ELEMENTS(tmp_buf); i++) {
-				tmp_buf[i] /= 2;
-			}
-			for (size_t i = 0; i < this_read_size / sizeof(*adding_ptr); i++) {
-				adding_ptr[i] += tmp_buf[i];
-			}
-			adding_ptr += this_read_size / sizeof(*adding_ptr);
-			bytes_left -= this_read_size;
+		if (!filled) {
+			filled = mix_stream(dsp, buffer, size, 1);
+			continue;
+		}
+		/* Samples past what earlier streams had are copied, not added */
+		size_t mixed = mix_stream(dsp, buffer, filled, 0);
+		if (mixed == filled) {
+			filled += mix_stream(dsp, buffer + filled, size - filled, 1);
 		}
 	}
 	spin_unlock(_buffers_lock);
 
+	memset(buffer + filled, 0, size - filled);
 	return size;
 }
 
@@ -318,7 +583,7 @@ static int fini(void) {
 	return 0;
 }
 
-MODULE_DEF(snd, init, fini);
+MODULE_DEF_DEFERRED(snd, init, fini);
 #if 0
 MODULE_DEPENDS(debugshell);
 #endif
@@ -19,9 +19,26 @@
 
 #define TARFS_LOG_LEVEL WARNING
 
+/*
+ * The archive is indexed once, when it is mounted: every header gets
+ * an entry, found by its path or by its offset (which is the inode
+ * number of its nodes), and directories list their entries.
+ */
+struct tarfs_entry {
+	char * path;                    /* Full path in the archive, without a trailing slash */
+	char * name;                    /* Last component, within path */
+	unsigned int offset;            /* Where its header is */
+	struct tarfs_entry ** children; /* For directories, what is directly inside */
+	unsigned int child_count;
+	unsigned int child_space;
+};
+
 struct tarfs {
 	fs_node_t * device;
 	unsigned int length;
+	struct tarfs_entry root;
+	hashmap_t * paths;   /* Path -> entry */
+	hashmap_t * offsets; /* Header offset -> entry */
 };
 
 struct ustar {
@@ -105,7 +122,7 @@ static unsigned int round_to_512(unsigned int i) {
 }
 
 static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out);
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset);
+static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, struct tarfs_entry * entry);
 
 #ifndef strncat
 static char * strncat(char *dest, const char *src, size_t n) {
@@ -125,219 +142,72 @@ static char * strncat(char *dest, const char *src, size_t n) {
 }
 #endif
 
-static int count_slashes(char * string) {
-	int i = 0;
-	char * s = strstr(string, "/");
-	while (s) {
-		if (*(s+1) == '\0') return i;
-		i++;
-		s = strstr(s+1,"/");
-	}
-	return i;
-}
-
-static struct dirent * readdir_tar_root(fs_node_t *node, uint32_t index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
+static struct dirent * readdir_entry(struct tarfs_entry * dir, uint32_t index) {
+	struct dirent * out;
+	if (index == 0 || index == 1) {
+		out = malloc(sizeof(struct dirent));
 		memset(out, 0x00, sizeof(struct dirent));
 		out->ino = 0;
-		strcpy(out->name, ".");
-		return out;
-	}
-
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, "..");
+		strcpy(out->name, index ? ".." : ".");
 		return out;
 	}
 
 	index -= 2;
+	if (!dir || index >= dir->child_count) return NULL;
 
-	struct tarfs * self = node->device;
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (!count_slashes(filename_workspace)) {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0'; /* remove trailing slash */
-			if (strlen(filename_workspace)) {
-				if (index == 0) {
-					struct dirent * out = malloc(sizeof(struct dirent));
-					memset(out, 0x00, sizeof(struct dirent));
-					out->ino = offset;
-					strcpy(out->name, filename_workspace);
-					free(file);
-					return out;
-				} else {
-					index--;
-				}
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-
-	}
+	out = malloc(sizeof(struct dirent));
+	memset(out, 0x00, sizeof(struct dirent));
+	out->ino = dir->children[index]->offset;
+	strcpy(out->name, dir->children[index]->name);
+	return out;
+}
 
-	free(file);
-	return NULL;
+static struct dirent * readdir_tar_root(fs_node_t *node, uint32_t index) {
+	struct tarfs * self = node->device;
+	return readdir_entry(&self->root, index);
 }
 
 static uint32_t read_tarfs(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
 	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-	size_t file_size = interpret_size(file);
+	size_t file_size = node->length;
 
 	if (offset > file_size) return 0;
 	if (offset + size > file_size) {
 		size = file_size - offset;
 	}
 
-	free(file);
-
 	return read_fs(self->device, offset + node->inode + 512, size, buffer);
 }
 
 static struct dirent * readdir_tarfs(fs_node_t *node, uint32_t index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, ".");
-		return out;
-	}
-
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, "..");
-		return out;
-	}
-
-	index -= 2;
-
 	struct tarfs * self = node->device;
+	return readdir_entry(hashmap_get(self->offsets, (void *)(uintptr_t)node->inode), index);
+}
 
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = node->inode;
-
-	/* Read myself */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	int status = ustar_from_offset(self, node->inode, file);
-	char my_filename[256];
-
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	while (offset < self->length) {
-		ustar_from_offset(self, offset, file);
+static fs_node_t * finddir_entry(struct tarfs * self, struct tarfs_entry * dir, char * name) {
+	if (!dir) return NULL;
 
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	char path[strlen(dir->path) + strlen(name) + 2];
+	if (dir == &self->root) {
+		strcpy(path, name);
+	} else {
+		sprintf(path, "%s/%s", dir->path, name);
+	}
 
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (startswith(filename_workspace, my_filename)) {
-			if (!count_slashes(filename_workspace + strlen(my_filename))) {
-				if (strlen(filename_workspace + strlen(my_filename))) {
-					if (index == 0) {
-						char * slash = strstr(filename_workspace+strlen(my_filename),"/");
-						if (slash) *slash = '\0'; /* remove trailing slash */
-						struct dirent * out = malloc(sizeof(struct dirent));
-						memset(out, 0x00, sizeof(struct dirent));
-						out->ino = offset;
-						strcpy(out->name, filename_workspace+strlen(my_filename));
-						free(file);
-						return out;
-					} else {
-						index--;
-					}
-				}
-			}
-		}
+	struct tarfs_entry * entry = hashmap_get(self->paths, path);
+	if (!entry) return NULL;
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+	struct ustar * file = malloc(sizeof(struct ustar));
+	if (!ustar_from_offset(self, entry->offset, file)) {
+		free(file);
+		return NULL;
 	}
-
-	free(file);
-	return NULL;
+	return file_from_ustar(self, file, entry);
 }
 
 static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
-
-	/* find my own filename */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-
-	char my_filename[256];
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	/* Append name */
-	strncat(my_filename, name, strlen(name));
-	if (strlen(my_filename) > 255) {
-		debug_print(CRITICAL, "what");
-	}
-
-	unsigned int offset = node->inode;
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (filename_workspace[strlen(filename_workspace)-1] == '/') {
-			filename_workspace[strlen(filename_workspace)-1] = '\0';
-		}
-		if (!strcmp(filename_workspace, my_filename)) {
-			return file_from_ustar(self, file, offset);
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
-
-	free(file);
-	return NULL;
+	return finddir_entry(self, hashmap_get(self->offsets, (void *)(uintptr_t)node->inode), name);
 }
 
 static int readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
@@ -360,14 +230,13 @@ static int readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
 
 }
 
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
+static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, struct tarfs_entry * entry) {
 	fs_node_t * fs = malloc(sizeof(fs_node_t));
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
-	fs->inode  = offset;
+	fs->inode  = entry->offset;
 	fs->impl   = 0;
-	char filename_workspace[256];
-	memcpy(fs->name, filename_workspace, strlen(filename_workspace)+1);
+	memcpy(fs->name, entry->name, strlen(entry->name) + 1);
 
 	fs->uid = interpret_uid(file);
 	fs->gid = interpret_gid(file);
@@ -376,7 +245,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 	fs->nlink = 0; /* Unsupported */
 	fs->flags = FS_FILE;
 	if (file->type[0] == '5') {
-		fs->flags = FS_DIRECTORY;
+		fs->flags = FS_DIRECTORY | FS_DCACHE;
 		fs->readdir = readdir_tarfs;
 		fs->finddir = finddir_tarfs;
 	} else if (file->type[0] == '1') {
@@ -386,7 +255,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
-		fs->flags = FS_FILE;
+		fs->flags = FS_FILE | FS_PAGECACHE;
 		fs->read = read_tarfs;
 	}
 	free(file);
@@ -401,38 +270,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 
 static fs_node_t * finddir_tar_root(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
-
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (count_slashes(filename_workspace)) {
-			/* skip */
-		} else {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0';
-			if (!strcmp(filename_workspace, name)) {
-				return file_from_ustar(self, file, offset);
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
-	free(file);
-	return NULL;
+	return finddir_entry(self, &self->root, name);
 }
 
 static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
@@ -447,6 +285,77 @@ static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct us
 	return 1;
 }
 
+static void tarfs_add_child(struct tarfs_entry * dir, struct tarfs_entry * child) {
+	if (dir->child_count == dir->child_space) {
+		dir->child_space = dir->child_space ? dir->child_space * 2 : 8;
+		dir->children = realloc(dir->children, sizeof(struct tarfs_entry *) * dir->child_space);
+	}
+	dir->children[dir->child_count++] = child;
+}
+
+/*
+ * Read every header once and build the index. Where a path appears
+ * more than once, the first copy is the one that is used.
+ */
+static void tarfs_index(struct tarfs * self) {
+	self->paths   = hashmap_create(64);
+	self->offsets = hashmap_create_int(64);
+	memset(&self->root, 0, sizeof(struct tarfs_entry));
+	self->root.path = "";
+	self->root.name = "";
+
+	list_t * entries = list_create();
+	struct ustar * file = malloc(sizeof(struct ustar));
+	unsigned int offset = 0;
+	while (offset < self->length && ustar_from_offset(self, offset, file)) {
+		char path[256];
+		memset(path, 0, 256);
+		strncat(path, file->prefix, 155);
+		strncat(path, file->filename, 100);
+
+		size_t len = strlen(path);
+		while (len && path[len-1] == '/') {
+			path[--len] = '\0';
+		}
+
+		if (len && !hashmap_has(self->paths, path)) {
+			struct tarfs_entry * entry = malloc(sizeof(struct tarfs_entry));
+			memset(entry, 0, sizeof(struct tarfs_entry));
+			entry->path   = strdup(path);
+			entry->offset = offset;
+			char * slash = strrchr(entry->path, '/');
+			entry->name = slash ? slash + 1 : entry->path;
+
+			hashmap_set(self->paths, entry->path, entry);
+			hashmap_set(self->offsets, (void *)(uintptr_t)offset, entry);
+			list_insert(entries, entry);
+		}
+
+		offset += 512;
+		offset += round_to_512(interpret_size(file));
+	}
+	free(file);
+
+	/* Directories can come after what's in them, so link everything up afterwards */
+	foreach(node, entries) {
+		struct tarfs_entry * entry = node->value;
+		struct tarfs_entry * parent = &self->root;
+		if (entry->name != entry->path) {
+			entry->name[-1] = '\0';
+			parent = hashmap_get(self->paths, entry->path);
+			entry->name[-1] = '/';
+		}
+		if (parent) {
+			tarfs_add_child(parent, entry);
+		} else {
+			debug_print(TARFS_LOG_LEVEL, "%s has no directory entry in the archive", entry->path);
+		}
+	}
+	debug_print(INFO, "indexed %d entries", entries->length);
+	list_free(entries);
+	free(entries);
+}
+
 static fs_node_t * tar_mount(char * device, char * mount_path) {
 	char * arg = strdup(device);
 	char * argv[10];
@@ -469,6 +378,7 @@ static fs_node_t * tar_mount(char * device, char * mount_path) {
 
 	self->device = dev;
 	self->length = dev->length;
+	tarfs_index(self);
 
 	fs_node_t * root = malloc(sizeof(fs_node_t));
 	memset(root, 0, sizeof(fs_node_t));
@@ -9,6 +9,7 @@
 #include <kernel/version.h>
 #include <kernel/process.h>
 #include <kernel/mem.h>
+#include <kernel/kmap.h>
 #include <kernel/module.h>
 #include <kernel/mod/tmpfs.h>
 #include <kernel/tokenize.h>
@@ -20,10 +21,7 @@
 #define TMPFS_TYPE_DIR  2
 #define TMPFS_TYPE_LINK 3
 
-static char * buf_space = NULL;
-
 static spin_lock_t tmpfs_lock = { 0 };
-static spin_lock_t tmpfs_page_lock = { 0 };
 
 struct tmpfs_dir * tmpfs_root = NULL;
 
@@ -54,18 +52,23 @@ static struct tmpfs_file * tmpfs_file_new(char * name) {
 	return t;
 }
 
+/*
+ * Add a file, link or directory to a directory. The tmpfs lock must
+ * be held.
+ */
+static void tmpfs_dir_insert(struct tmpfs_dir * d, char * name, void * entry) {
+	hashmap_set(d->index, name, list_insert(d->files, entry));
+}
+
 static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
 	debug_print(NOTICE, "Creating TMPFS file (symlink) %s in %s", name, d->name);
 
 	spin_lock(tmpfs_lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			debug_print(WARNING, "... already exists.");
-			return -EEXIST; /* Already exists */
-		}
+	if (hashmap_has(d->index, name)) {
+		spin_unlock(tmpfs_lock);
+		debug_print(WARNING, "... already exists.");
+		return -EEXIST; /* Already exists */
 	}
 	spin_unlock(tmpfs_lock);
 
@@ -80,7 +83,7 @@ static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 	t->gid = current_process->user;
 
 	spin_lock(tmpfs_lock);
-	list_insert(d->files, t);
+	tmpfs_dir_insert(d, t->name, t);
 	spin_unlock(tmpfs_lock);
 
 	return 0;
@@ -118,18 +121,24 @@ static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent)
 	d->mtime = d->atime;
 	d->ctime = d->atime;
 	d->files = list_create();
+	d->index = hashmap_create(16);
 
 	spin_unlock(tmpfs_lock);
 	return d;
 }
 
+static void tmpfs_block_free(uintptr_t frame) {
+	kmap_drop(frame);
+	free_frame_run(frame, 1);
+}
+
 static void tmpfs_file_free(struct tmpfs_file * t) {
 	if (t->type == TMPFS_TYPE_LINK) {
 		debug_print(ERROR, "uh, what");
 		free(t->target);
 	}
 	for (size_t i = 0; i < t->block_count; ++i) {
-		clear_frame((uintptr_t)t->blocks[i] * 0x1000);
+		tmpfs_block_free((uintptr_t)t->blocks[i]);
 	}
 }
 
@@ -139,40 +148,40 @@ static void tmpfs_file_blocks_embiggen(struct tmpfs_file * t) {
 	t->blocks = realloc(t->blocks, sizeof(char *) * t->pointers);
 }
 
+/*
+ * Map a block of a file, allocating (zeroed) blocks up to it if
+ * `create` is set. The block stays mapped until it is kunmap()ed.
+ */
 static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int create) {
 	debug_print(INFO, "Reading block %d from file %s", blockid, t->name);
 
-	spin_lock(tmpfs_page_lock);
-
+	spin_lock(tmpfs_lock);
 	if (create) {
-		spin_lock(tmpfs_lock);
 		while (blockid >= t->pointers) {
 			tmpfs_file_blocks_embiggen(t);
 		}
 		while (blockid >= t->block_count) {
 			debug_print(INFO, "Allocating block %d for file %s", blockid, t->name);
-			uintptr_t index = first_frame();
-			set_frame(index * 0x1000);
-			t->blocks[t->block_count] = (char*)index;
+			page_t page = { 0 };
+			alloc_frame(&page, 1, 1);
+			char * block = kmap(page.frame);
+			memset(block, 0, BLOCKSIZE);
+			kunmap(block);
+			t->blocks[t->block_count] = (char *)(uintptr_t)page.frame;
 			t->block_count += 1;
 		}
-		spin_unlock(tmpfs_lock);
 	} else {
 		if (blockid >= t->block_count) {
+			spin_unlock(tmpfs_lock);
 			debug_print(ERROR, "This will probably end badly.");
 			return NULL;
 		}
 	}
-	debug_print(INFO, "Using block %d->0x%x (of %d) on file %s", blockid, t->blocks[blockid], t->block_count, t->name);
-
-	page_t * page = get_page((uintptr_t)buf_space,0,current_directory);
-	page->rw = 1;
-	page->user = 0;
-	page->frame = (uintptr_t)t->blocks[blockid];
-	page->present = 1;
-	invalidate_tables_at((uintptr_t)buf_space);
+	uintptr_t frame = (uintptr_t)t->blocks[blockid];
+	spin_unlock(tmpfs_lock);
 
-	return (char *)buf_space;
+	debug_print(INFO, "Using block %d->0x%x (of %d) on file %s", blockid, frame, t->block_count, t->name);
+	return kmap(frame);
 }
 
 
@@ -196,7 +205,7 @@ static uint32_t read_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uint
 	if (start_block == end_block) {
 		void *buf = tmpfs_file_getset_block(t, start_block, 0);
 		memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), size_to_read);
-		spin_unlock(tmpfs_page_lock);
+		kunmap(buf);
 		return size_to_read;
 	} else {
 		uint32_t block_offset;
@@ -205,17 +214,17 @@ static uint32_t read_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uint
 			if (block_offset == start_block) {
 				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
 				memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), BLOCKSIZE - (offset % BLOCKSIZE));
-				spin_unlock(tmpfs_page_lock);
+				kunmap(buf);
 			} else {
 				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
 				memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, BLOCKSIZE);
-				spin_unlock(tmpfs_page_lock);
+				kunmap(buf);
 			}
 		}
 		if (end_size) {
 			void *buf = tmpfs_file_getset_block(t, end_block, 0);
 			memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, end_size);
-			spin_unlock(tmpfs_page_lock);
+			kunmap(buf);
 		}
 	}
 	return size_to_read;
@@ -239,7 +248,7 @@ static uint32_t write_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uin
 	if (start_block == end_block) {
 		void *buf = tmpfs_file_getset_block(t, start_block, 1);
 		memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, size_to_read);
-		spin_unlock(tmpfs_page_lock);
+		kunmap(buf);
 		return size_to_read;
 	} else {
 		uint32_t block_offset;
@@ -248,17 +257,17 @@ static uint32_t write_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uin
 			if (block_offset == start_block) {
 				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
 				memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, BLOCKSIZE - (offset % BLOCKSIZE));
-				spin_unlock(tmpfs_page_lock);
+				kunmap(buf);
 			} else {
 				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
 				memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), BLOCKSIZE);
-				spin_unlock(tmpfs_page_lock);
+				kunmap(buf);
 			}
 		}
 		if (end_size) {
 			void *buf = tmpfs_file_getset_block(t, end_block, 1);
 			memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), end_size);
-			spin_unlock(tmpfs_page_lock);
+			kunmap(buf);
 		}
 	}
 	return size_to_read;
@@ -288,7 +297,7 @@ static void truncate_tmpfs(fs_node_t * node) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
 	debug_print(INFO, "Truncating file %s", t->name);
 	for (size_t i = 0; i < t->block_count; ++i) {
-		clear_frame((uintptr_t)t->blocks[i] * 0x1000);
+		tmpfs_block_free((uintptr_t)t->blocks[i]);
 		t->blocks[i] = 0;
 	}
 	t->block_count = 0;
@@ -384,57 +393,72 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint32_t index) {
 	return NULL;
 }
 
-static fs_node_t * finddir_tmpfs(fs_node_t * node, char * name) {
-	if (!name) return NULL;
-
+static int getdents_tmpfs(fs_node_t *node, uint32_t * cursor, struct dirent * entries, uint32_t count) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
+	uint32_t read = 0;
 
-	spin_lock(tmpfs_lock);
+	while (read < count && *cursor < 2) {
+		memset(&entries[read], 0x00, sizeof(struct dirent));
+		strcpy(entries[read].name, *cursor ? ".." : ".");
+		read++;
+		(*cursor)++;
+	}
 
+	/* Skip to the cursor once, then walk the rest of the batch in order */
+	uint32_t i = 2;
 	foreach(f, d->files) {
+		if (read == count) break;
+		if (i++ < *cursor) continue;
 		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			switch (t->type) {
-				case TMPFS_TYPE_FILE:
-					return tmpfs_from_file(t);
-				case TMPFS_TYPE_LINK:
-					return tmpfs_from_link(t);
-				case TMPFS_TYPE_DIR:
-					return tmpfs_from_dir((struct tmpfs_dir *)t);
-			}
-			return NULL;
-		}
+		memset(&entries[read], 0x00, sizeof(struct dirent));
+		entries[read].ino = (uint32_t)t;
+		strcpy(entries[read].name, t->name);
+		read++;
+		(*cursor)++;
 	}
 
+	return read;
+}
+
+static fs_node_t * finddir_tmpfs(fs_node_t * node, char * name) {
+	if (!name) return NULL;
+
+	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
+
+	spin_lock(tmpfs_lock);
+	node_t * f = hashmap_get(d->index, name);
 	spin_unlock(tmpfs_lock);
 
+	if (!f) return NULL;
+
+	struct tmpfs_file * t = (struct tmpfs_file *)f->value;
+	switch (t->type) {
+		case TMPFS_TYPE_FILE:
+			return tmpfs_from_file(t);
+		case TMPFS_TYPE_LINK:
+			return tmpfs_from_link(t);
+		case TMPFS_TYPE_DIR:
+			return tmpfs_from_dir((struct tmpfs_dir *)t);
+	}
 	return NULL;
 }
 
 static int unlink_tmpfs(fs_node_t * node, char * name) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-	int i = -1, j = 0;
 	spin_lock(tmpfs_lock);
 
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			tmpfs_file_free(t);
-			free(t);
-			i = j;
-			break;
-		}
-		j++;
-	}
-
-	if (i >= 0) {
-		list_remove(d->files, i);
-	} else {
+	node_t * f = hashmap_remove(d->index, name);
+	if (!f) {
 		spin_unlock(tmpfs_lock);
 		return -ENOENT;
 	}
 
+	struct tmpfs_file * t = (struct tmpfs_file *)f->value;
+	list_delete(d->files, f);
+	free(f);
+	tmpfs_file_free(t);
+	free(t);
+
 	spin_unlock(tmpfs_lock);
 	return 0;
 }
@@ -446,13 +470,10 @@ static int create_tmpfs(fs_node_t *parent, char *name, uint16_t permission) {
 	debug_print(NOTICE, "Creating TMPFS file %s in %s", name, d->name);
 
 	spin_lock(tmpfs_lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			debug_print(WARNING, "... already exists.");
-			return -EEXIST; /* Already exists */
-		}
+	if (hashmap_has(d->index, name)) {
+		spin_unlock(tmpfs_lock);
+		debug_print(WARNING, "... already exists.");
+		return -EEXIST; /* Already exists */
 	}
 	spin_unlock(tmpfs_lock);
 
@@ -463,7 +484,7 @@ static int create_tmpfs(fs_node_t *parent, char *name, uint16_t permission) {
 	t->gid = current_process->user;
 
 	spin_lock(tmpfs_lock);
-	list_insert(d->files, t);
+	tmpfs_dir_insert(d, t->name, t);
 	spin_unlock(tmpfs_lock);
 
 	return 0;
@@ -477,13 +498,10 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, uint16_t permission) {
 	debug_print(NOTICE, "Creating TMPFS directory %s (in %s)", name, d->name);
 
 	spin_lock(tmpfs_lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			debug_print(WARNING, "... already exists.");
-			return -EEXIST; /* Already exists */
-		}
+	if (hashmap_has(d->index, name)) {
+		spin_unlock(tmpfs_lock);
+		debug_print(WARNING, "... already exists.");
+		return -EEXIST; /* Already exists */
 	}
 	spin_unlock(tmpfs_lock);
 
@@ -494,7 +512,7 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, uint16_t permission) {
 	out->gid  = current_process->user;
 
 	spin_lock(tmpfs_lock);
-	list_insert(d->files, out);
+	tmpfs_dir_insert(d, out->name, out);
 	spin_unlock(tmpfs_lock);
 
 	return 0;
@@ -518,6 +536,7 @@ static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
 	fnode->open    = NULL;
 	fnode->close   = NULL;
 	fnode->readdir = readdir_tmpfs;
+	fnode->getdents = getdents_tmpfs;
 	fnode->finddir = finddir_tmpfs;
 	fnode->create  = create_tmpfs;
 	fnode->unlink  = unlink_tmpfs;
@@ -564,8 +583,6 @@ fs_node_t * tmpfs_mount(char * device, char * mount_path) {
 
 static int tmpfs_initialize(void) {
 
-	buf_space = (void*)kvmalloc(BLOCKSIZE);
-
 	vfs_register("tmpfs", tmpfs_mount);
 
 	return 0;
@@ -0,0 +1,439 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * USB mass storage driver
+ *
+ * Provides raw block access to USB sticks and card readers as
+ * /dev/uda, /dev/udb... These speak SCSI over the bulk-only
+ * transport: a command block wrapper on the bulk OUT endpoint, the
+ * data, if any, and a command status wrapper back on bulk IN. Only
+ * the first logical unit of a device is used.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/fs.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/mod/usb.h>
+
+#define USB_CLASS_MASS_STORAGE 0x08
+#define USB_SUBCLASS_SCSI      0x06
+#define USB_PROTOCOL_BBB       0x50
+
+#define USBMSD_RESET 0xFF /* Bulk-only mass storage reset */
+
+#define USBMSD_MAX_BYTES 0x10000 /* Per command */
+#define USBMSD_RETRIES   3
+
+#define CBW_SIGNATURE 0x43425355
+#define CSW_SIGNATURE 0x53425355
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE   0x03
+#define SCSI_INQUIRY         0x12
+#define SCSI_READ_CAPACITY   0x25
+#define SCSI_READ_10         0x28
+#define SCSI_WRITE_10        0x2A
+
+struct usbmsd_cbw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t length;
+	uint8_t  flags; /* USB_DIR_IN for reads */
+	uint8_t  lun;
+	uint8_t  cb_length;
+	uint8_t  cb[16];
+} __attribute__((packed));
+
+struct usbmsd_csw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t residue;
+	uint8_t  status;
+} __attribute__((packed));
+
+struct usbmsd_device {
+	usb_device_t * usb;
+	uint8_t interface;
+	usb_endpoint_t in;
+	usb_endpoint_t out;
+	uint32_t tag;
+
+	uint64_t blocks;
+	uint32_t block_size;
+	int block_shift;
+
+	spin_lock_t lock;
+	char vendor[9];
+	char product[17];
+};
+
+static char usbmsd_drive_char = 'a';
+
+static uint32_t be32(uint8_t * p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void usbmsd_sleep(unsigned long ms) {
+	unsigned long s, ss;
+	relative_time(0, ms, &s, &ss);
+	sleep_until((process_t *)current_process, s, ss);
+	switch_task(0);
+}
+
+/* Get back in step after a phase error or a stalled command */
+static void usbmsd_reset_recovery(struct usbmsd_device * dev) {
+	struct usb_setup setup = {
+		USB_TYPE_CLASS | USB_RECIP_INTERFACE, USBMSD_RESET, 0, dev->interface, 0
+	};
+	usb_control(dev->usb, &setup, NULL, NULL);
+	usb_clear_halt(dev->usb, &dev->in);
+	usb_clear_halt(dev->usb, &dev->out);
+}
+
+/*
+ * Run one SCSI command. `in` says which way `length` bytes of `data` go.
+ *
+ * @returns 0 on success, 1 if the device says the command failed, and
+ *          -1 if the transport did
+ */
+static int usbmsd_command(struct usbmsd_device * dev, uint8_t * cb, int cb_length, void * data, size_t length, int in) {
+	struct usbmsd_cbw cbw;
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.signature = CBW_SIGNATURE;
+	cbw.tag       = ++dev->tag;
+	cbw.length    = length;
+	cbw.flags     = in ? USB_DIR_IN : 0;
+	cbw.cb_length = cb_length;
+	memcpy(cbw.cb, cb, cb_length);
+
+	size_t actual;
+	if (usb_bulk(dev->usb, &dev->out, &cbw, sizeof(cbw), &actual) || actual != sizeof(cbw)) {
+		usbmsd_reset_recovery(dev);
+		return -1;
+	}
+
+	if (length) {
+		usb_endpoint_t * ep = in ? &dev->in : &dev->out;
+		int result = usb_bulk(dev->usb, ep, data, length, &actual);
+		if (result == USB_STALL) {
+			/* The status still follows */
+			usb_clear_halt(dev->usb, ep);
+		} else if (result) {
+			usbmsd_reset_recovery(dev);
+			return -1;
+		}
+	}
+
+	struct usbmsd_csw csw;
+	int result = usb_bulk(dev->usb, &dev->in, &csw, sizeof(csw), &actual);
+	if (result == USB_STALL) {
+		usb_clear_halt(dev->usb, &dev->in);
+		result = usb_bulk(dev->usb, &dev->in, &csw, sizeof(csw), &actual);
+	}
+
+	if (result || actual != sizeof(csw) || csw.signature != CSW_SIGNATURE || csw.tag != cbw.tag || csw.status > 1) {
+		usbmsd_reset_recovery(dev);
+		return -1;
+	}
+
+	if (!csw.status && csw.residue) {
+		/* The device took or gave less than we asked for */
+		return 1;
+	}
+
+	return csw.status;
+}
+
+static void usbmsd_request_sense(struct usbmsd_device * dev) {
+	uint8_t cb[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0 };
+	uint8_t sense[18];
+	if (!usbmsd_command(dev, cb, 6, sense, 18, 1)) {
+		debug_print(INFO, "usbmsd: sense key 0x%x, asc 0x%x", sense[2] & 0xF, sense[12]);
+	}
+}
+
+/*
+ * Read or write `blocks` blocks at `lba` to or from `buf`.
+ */
+static int usbmsd_transfer(struct usbmsd_device * dev, uint64_t lba, unsigned int blocks, uint8_t * buf, int write) {
+	if (lba + blocks > dev->blocks) return 1;
+
+	uint8_t cb[10] = {
+		write ? SCSI_WRITE_10 : SCSI_READ_10, 0,
+		(lba >> 24) & 0xFF, (lba >> 16) & 0xFF, (lba >> 8) & 0xFF, lba & 0xFF,
+		0, (blocks >> 8) & 0xFF, blocks & 0xFF, 0
+	};
+
+	int error;
+	int tries = 0;
+	spin_lock(dev->lock);
+	do {
+		error = usbmsd_command(dev, cb, 10, buf, blocks << dev->block_shift, !write);
+		if (error > 0) {
+			usbmsd_request_sense(dev);
+		}
+	} while (error && !dev->usb->gone && ++tries < USBMSD_RETRIES);
+	spin_unlock(dev->lock);
+
+	if (error) {
+		debug_print(WARNING, "Error during USB %s of %d blocks at lba %d", write ? "write" : "read", blocks, (uint32_t)lba);
+	}
+
+	return error;
+}
+
+static uint32_t read_usbmsd(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct usbmsd_device * dev = (struct usbmsd_device *)node->device;
+	uint32_t block_size = dev->block_size;
+	uint64_t max_offset = dev->blocks << dev->block_shift;
+
+	if (dev->usb->gone || offset > max_offset) {
+		return 0;
+	}
+
+	if (offset + size > max_offset) {
+		size = max_offset - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset >> dev->block_shift;
+	uint64_t end_block = (offset + size - 1) >> dev->block_shift;
+	unsigned int x_offset = 0;
+
+	if (offset % block_size || size < block_size) {
+		unsigned int prefix_size = (block_size - (offset % block_size));
+		if (prefix_size > size) prefix_size = size;
+		char * tmp = malloc(block_size);
+		usbmsd_transfer(dev, start_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % block_size)), prefix_size);
+
+		free(tmp);
+
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % block_size && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % block_size;
+		char * tmp = malloc(block_size);
+		usbmsd_transfer(dev, end_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
+
+		free(tmp);
+
+		end_block--;
+	}
+
+	while (start_block <= end_block) {
+		unsigned int count = end_block - start_block + 1;
+		if (count > USBMSD_MAX_BYTES / block_size) count = USBMSD_MAX_BYTES / block_size;
+		usbmsd_transfer(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset), 0);
+		x_offset += count * block_size;
+		start_block += count;
+	}
+
+	return size;
+}
+
+static uint32_t write_usbmsd(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct usbmsd_device * dev = (struct usbmsd_device *)node->device;
+	uint32_t block_size = dev->block_size;
+	uint64_t max_offset = dev->blocks << dev->block_shift;
+
+	if (dev->usb->gone || offset > max_offset) {
+		return 0;
+	}
+
+	if (offset + size > max_offset) {
+		size = max_offset - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset >> dev->block_shift;
+	uint64_t end_block = (offset + size - 1) >> dev->block_shift;
+	unsigned int x_offset = 0;
+
+	if (offset % block_size || size < block_size) {
+		unsigned int prefix_size = (block_size - (offset % block_size));
+		if (prefix_size > size) prefix_size = size;
+		char * tmp = malloc(block_size);
+		usbmsd_transfer(dev, start_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % block_size)), buffer, prefix_size);
+		usbmsd_transfer(dev, start_block, 1, (uint8_t *)tmp, 1);
+
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % block_size && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % block_size;
+		char * tmp = malloc(block_size);
+		usbmsd_transfer(dev, end_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
+		usbmsd_transfer(dev, end_block, 1, (uint8_t *)tmp, 1);
+
+		free(tmp);
+		end_block--;
+	}
+
+	while (start_block <= end_block) {
+		unsigned int count = end_block - start_block + 1;
+		if (count > USBMSD_MAX_BYTES / block_size) count = USBMSD_MAX_BYTES / block_size;
+		usbmsd_transfer(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset), 1);
+		x_offset += count * block_size;
+		start_block += count;
+	}
+
+	return size;
+}
+
+static void open_usbmsd(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_usbmsd(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * usbmsd_device_create(struct usbmsd_device * dev) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	sprintf(fnode->name, "usbmsd%d", usbmsd_drive_char - 'a');
+	fnode->device  = dev;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = dev->blocks << dev->block_shift;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_usbmsd;
+	fnode->write   = write_usbmsd;
+	fnode->open    = open_usbmsd;
+	fnode->close   = close_usbmsd;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = NULL;
+	return fnode;
+}
+
+/* Ask what it is and how big it is, waiting for media to spin up or settle */
+static int usbmsd_device_init(struct usbmsd_device * dev) {
+	uint8_t inquiry[36];
+	uint8_t inquiry_cb[6] = { SCSI_INQUIRY, 0, 0, 0, 36, 0 };
+	if (usbmsd_command(dev, inquiry_cb, 6, inquiry, 36, 1)) return 1;
+	memcpy(dev->vendor, &inquiry[8], 8);
+	memcpy(dev->product, &inquiry[16], 16);
+
+	uint8_t ready_cb[6] = { SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+	int ready = 0;
+	for (int i = 0; i < 30 && !ready; ++i) {
+		int result = usbmsd_command(dev, ready_cb, 6, NULL, 0, 0);
+		if (result < 0) return 1;
+		if (!result) {
+			ready = 1;
+		} else {
+			usbmsd_request_sense(dev);
+			usbmsd_sleep(100);
+		}
+	}
+	if (!ready) {
+		debug_print(WARNING, "usbmsd: no media");
+		return 1;
+	}
+
+	uint8_t capacity[8];
+	uint8_t capacity_cb[10] = { SCSI_READ_CAPACITY, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (usbmsd_command(dev, capacity_cb, 10, capacity, 8, 1)) return 1;
+	dev->blocks = (uint64_t)be32(&capacity[0]) + 1;
+	dev->block_size = be32(&capacity[4]);
+
+	dev->block_shift = 0;
+	while ((1U << dev->block_shift) < dev->block_size) dev->block_shift++;
+	if (dev->block_size < 512 || dev->block_size > USBMSD_MAX_BYTES || (1U << dev->block_shift) != dev->block_size) {
+		debug_print(WARNING, "usbmsd: unusable block size %d", dev->block_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int usbmsd_probe(usb_device_t * usb) {
+	struct usb_interface_desc * interface = NULL;
+	while ((interface = usb_find_descriptor(usb, interface, USB_DESC_INTERFACE))) {
+		if (interface->class == USB_CLASS_MASS_STORAGE &&
+			interface->subclass == USB_SUBCLASS_SCSI &&
+			interface->protocol == USB_PROTOCOL_BBB) {
+			break;
+		}
+	}
+	if (!interface) return 1;
+
+	struct usbmsd_device * dev = malloc(sizeof(struct usbmsd_device));
+	memset(dev, 0, sizeof(struct usbmsd_device));
+	dev->usb = usb;
+	dev->interface = interface->number;
+
+	/* The endpoints follow their interface */
+	struct usb_endpoint_desc * ep = (void *)interface;
+	for (int i = 0; i < interface->num_endpoints; ++i) {
+		ep = usb_find_descriptor(usb, ep, USB_DESC_ENDPOINT);
+		if (!ep) break;
+		if ((ep->attributes & 0x3) != USB_ENDPOINT_BULK) continue;
+		usb_endpoint_t * target = (ep->address & USB_DIR_IN) ? &dev->in : &dev->out;
+		target->address = ep->address;
+		target->max_packet = ep->max_packet;
+		target->toggle = 0;
+	}
+
+	if (!dev->in.max_packet || !dev->out.max_packet) {
+		debug_print(WARNING, "usbmsd: device %d has no bulk endpoints", usb->address);
+		free(dev);
+		return 1;
+	}
+
+	if (usbmsd_device_init(dev)) {
+		debug_print(WARNING, "usbmsd: device %d did not come up", usb->address);
+		free(dev);
+		return 1;
+	}
+
+	usb->driver_data = dev;
+
+	char devname[64];
+	sprintf((char *)&devname, "/dev/ud%c", usbmsd_drive_char);
+	vfs_mount(devname, usbmsd_device_create(dev));
+	usbmsd_drive_char++;
+
+	debug_print(NOTICE, "%s: %s %s, %d blocks of %d bytes", devname, dev->vendor, dev->product,
+		(uint32_t)dev->blocks, dev->block_size);
+
+	return 0;
+}
+
+static usb_driver_t usbmsd_driver = {
+	.name  = "usbmsd",
+	.probe = usbmsd_probe,
+};
+
+static int usbmsd_initialize(void) {
+	usb_register_driver(&usbmsd_driver);
+	return 0;
+}
+
+static int usbmsd_finalize(void) {
+	return 0;
+}
+
+MODULE_DEF(usbmsd, usbmsd_initialize, usbmsd_finalize);
+MODULE_DEPENDS(usbuhci);
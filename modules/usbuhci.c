@@ -2,43 +2,616 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2014-2018 K. Lange
+ *
+ * UHCI USB host controller driver
+ *
+ * Every entry of the frame list points at the same chain of three
+ * skeleton queue heads: interrupt, then control, then bulk, so all of
+ * them are serviced every frame. A transfer is built as one chain of
+ * transfer descriptors in memory owned by its queue, hung off that
+ * queue's head, and only interrupts us once, when its last descriptor
+ * (or a short or failed one) finishes. Transfers on a queue run one
+ * at a time; data goes through the queue's own DMA buffer.
+ *
+ * Devices on the root hub ports are enumerated, and the ports checked
+ * for new ones every second. External hubs aren't supported.
  */
 #include <kernel/module.h>
 #include <kernel/pci.h>
 #include <kernel/printf.h>
 #include <kernel/logging.h>
+#include <kernel/process.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
 #include <kernel/mod/shell.h>
+#include <kernel/mod/usb.h>
 
-static uint32_t hub_device = 0;
+#include <toaru/list.h>
+
+#define UHCI_MAX_CONTROLLERS 4
+#define UHCI_PORTS           2
+#define UHCI_MAX_TDS         256
+#define UHCI_BUFFER_SIZE     0x4000
+
+/* I/O registers */
+#define UHCI_USBCMD    0x00
+#define UHCI_USBSTS    0x02
+#define UHCI_USBINTR   0x04
+#define UHCI_FRNUM     0x06
+#define UHCI_FRBASEADD 0x08
+#define UHCI_SOFMOD    0x0C
+#define UHCI_PORTSC(n) (0x10 + (n) * 2)
+
+#define USBCMD_RS      (1 << 0)
+#define USBCMD_HCRESET (1 << 1)
+#define USBCMD_GRESET  (1 << 2)
+#define USBCMD_CF      (1 << 6)
+#define USBCMD_MAXP    (1 << 7)
+
+#define USBSTS_USBINT  (1 << 0)
+#define USBSTS_ERROR   (1 << 1)
+
+#define USBINTR_TIMEOUT (1 << 0)
+#define USBINTR_RESUME  (1 << 1)
+#define USBINTR_IOC     (1 << 2)
+#define USBINTR_SHORT   (1 << 3)
+
+#define PORTSC_CCS   (1 << 0)
+#define PORTSC_CSC   (1 << 1)
+#define PORTSC_PE    (1 << 2)
+#define PORTSC_PEC   (1 << 3)
+#define PORTSC_LSDA  (1 << 8)
+#define PORTSC_PR    (1 << 9)
+#define PORTSC_W1C   (PORTSC_CSC | PORTSC_PEC)
+
+/* PCI legacy support register: keyboard emulation off, PIRQ routing on */
+#define UHCI_LEGSUP       0xC0
+#define LEGSUP_CLEAR      0x8F00
+#define LEGSUP_PIRQ       0x2000
+
+#define LINK_TERMINATE (1 << 0)
+#define LINK_QH        (1 << 1)
+#define LINK_DEPTH     (1 << 2)
+
+#define TD_ACTIVE   (1 << 23)
+#define TD_STALLED  (1 << 22)
+#define TD_ERRORS   (0x76 << 16) /* Stalled, buffer, babble, CRC/timeout, bitstuff */
+#define TD_IOC      (1 << 24)
+#define TD_LS       (1 << 26)
+#define TD_CERR     (3 << 27)
+#define TD_SPD      (1 << 29)
+
+#define PID_SETUP 0x2D
+#define PID_IN    0x69
+#define PID_OUT   0xE1
+
+#define UHCI_RUNNING 1
+
+#define barrier() asm volatile ("" ::: "memory")
+
+struct uhci_td {
+	uint32_t link;
+	volatile uint32_t status;
+	uint32_t token;
+	uint32_t buffer;
+	uint32_t reserved[4]; /* Ours; keeps them 32-byte aligned */
+} __attribute__((packed));
+
+struct uhci_qh {
+	uint32_t head;
+	volatile uint32_t element;
+	uint32_t reserved[2];
+} __attribute__((packed));
+
+enum {
+	QUEUE_INTERRUPT,
+	QUEUE_CONTROL,
+	QUEUE_BULK,
+	QUEUE_COUNT
+};
+
+struct uhci_queue {
+	struct uhci_qh * qh;
+	uintptr_t qh_phys;
+	struct uhci_td * tds;
+	uintptr_t tds_phys;
+	uint8_t * buffer;
+	uintptr_t buffer_phys;
+	int busy;
+	list_t * waiters; /* For the queue, and for the transfer on it */
+};
+
+struct uhci {
+	uint32_t pci;
+	uint16_t io;
+	int irq;
+	uint32_t * frame_list;
+	uintptr_t frame_list_phys;
+	struct uhci_queue queues[QUEUE_COUNT];
+	usb_device_t * ports[UHCI_PORTS];
+	uint8_t next_address;
+};
+
+static struct uhci * controllers[UHCI_MAX_CONTROLLERS];
+static int controller_count = 0;
+
+static list_t * usb_devices = NULL;
+static list_t * usb_drivers = NULL;
+static spin_lock_t usb_probe_lock = { 0 };
+
+static void uhci_sleep(unsigned long ms) {
+	unsigned long s, ss;
+	relative_time(0, ms, &s, &ss);
+	sleep_until((process_t *)current_process, s, ss);
+	switch_task(0);
+}
 
 static void find_usb_device(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 	if (pci_find_type(device) == 0xc03) {
 		int prog_if = (int)pci_read_field(device, PCI_PROG_IF, 1);
-		if (prog_if == 0) {
-			*((uint32_t *)extra)= device;
+		if (prog_if == 0 && controller_count < UHCI_MAX_CONTROLLERS) {
+			struct uhci * hc = malloc(sizeof(struct uhci));
+			memset(hc, 0, sizeof(struct uhci));
+			hc->pci = device;
+			controllers[controller_count++] = hc;
 		}
 	}
 }
 
-DEFINE_SHELL_FUNCTION(usb, "Enumerate USB devices (UHCI)") {
+static int uhci_irq_handler(struct regs *r) {
+	int handled = 0;
+	for (int i = 0; i < controller_count; ++i) {
+		struct uhci * hc = controllers[i];
+		if (hc->irq != (int)r->int_no - 32) continue;
+		uint16_t status = inports(hc->io + UHCI_USBSTS);
+		if (!(status & (USBSTS_USBINT | USBSTS_ERROR))) continue;
+		outports(hc->io + UHCI_USBSTS, status);
+		for (int q = 0; q < QUEUE_COUNT; ++q) {
+			wakeup_queue(hc->queues[q].waiters);
+		}
+		handled = 1;
+	}
+	if (handled) {
+		irq_ack(r->int_no - 32);
+	}
+	return handled;
+}
+
+static void uhci_queue_acquire(struct uhci_queue * q) {
+	IRQ_OFF;
+	while (q->busy) {
+		sleep_on(q->waiters);
+	}
+	q->busy = 1;
+	IRQ_RES;
+}
+
+static void uhci_queue_release(struct uhci_queue * q) {
+	IRQ_OFF;
+	q->busy = 0;
+	wakeup_queue(q->waiters);
+	IRQ_RES;
+}
+
+static void uhci_td_fill(struct uhci_queue * q, int i, usb_device_t * dev, uint8_t pid, uint8_t endpoint, int toggle, uintptr_t buffer, size_t len, int spd) {
+	struct uhci_td * td = &q->tds[i];
+	td->link   = (q->tds_phys + (i + 1) * sizeof(struct uhci_td)) | LINK_DEPTH;
+	td->status = TD_ACTIVE | TD_CERR | (dev->low_speed ? TD_LS : 0) | (spd ? TD_SPD : 0);
+	td->token  = pid | (dev->address << 8) | ((endpoint & 0xF) << 15) | ((toggle & 1) << 19) | (((len - 1) & 0x7FF) << 21);
+	td->buffer = buffer;
+}
+
+static size_t uhci_td_actual(struct uhci_td * td) {
+	return ((td->status & 0x7FF) + 1) & 0x7FF;
+}
+
+static size_t uhci_td_max(struct uhci_td * td) {
+	return ((td->token >> 21) + 1) & 0x7FF;
+}
+
+/* Where the chain has got to: UHCI_RUNNING, 0 once done, or an error */
+static int uhci_check(struct uhci_queue * q, int count) {
+	for (int i = 0; i < count; ++i) {
+		struct uhci_td * td = &q->tds[i];
+		uint32_t status = td->status;
+		if (status & TD_ACTIVE) return UHCI_RUNNING;
+		if (status & TD_STALLED) return USB_STALL;
+		if (status & TD_ERRORS) return USB_ERROR;
+		if ((td->token & 0xFF) == PID_IN && uhci_td_actual(td) < uhci_td_max(td)) {
+			/* Short packet; the controller stops the queue here */
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Run the `count` descriptors built in the queue's table and wait for
+ * them. The queue must be held. `good` gets how many of them finished
+ * without error.
+ */
+static int uhci_execute(struct uhci_queue * q, int count, int * good) {
+	q->tds[count-1].link = LINK_TERMINATE;
+	q->tds[count-1].status |= TD_IOC;
+	barrier();
+
+	int result;
+	IRQ_OFF;
+	q->qh->element = q->tds_phys;
+	while ((result = uhci_check(q, count)) == UHCI_RUNNING) {
+		sleep_on(q->waiters);
+	}
+	q->qh->element = LINK_TERMINATE;
+	IRQ_RES;
+
+	int i = 0;
+	while (i < count && !(q->tds[i].status & (TD_ACTIVE | TD_ERRORS))) i++;
+	*good = i;
+	return result;
+}
+
+int usb_control(usb_device_t * dev, struct usb_setup * setup, void * data, size_t * actual) {
+	struct uhci * hc = dev->hc;
+	struct uhci_queue * q = &hc->queues[QUEUE_CONTROL];
+	size_t length = setup->length;
+	int in = setup->type & USB_DIR_IN;
+	size_t mps = dev->max_packet0;
+
+	if (actual) *actual = 0;
+	if (dev->gone) return USB_ERROR;
+	if (length > UHCI_BUFFER_SIZE - sizeof(struct usb_setup) || (length + mps - 1) / mps > UHCI_MAX_TDS - 2) {
+		return USB_ERROR;
+	}
+
+	uhci_queue_acquire(q);
+
+	memcpy(q->buffer, setup, sizeof(struct usb_setup));
+	uint8_t * payload = q->buffer + sizeof(struct usb_setup);
+	uintptr_t payload_phys = q->buffer_phys + sizeof(struct usb_setup);
+	if (!in && length) {
+		memcpy(payload, data, length);
+	}
+
+	int count = 0;
+	uhci_td_fill(q, count++, dev, PID_SETUP, 0, 0, q->buffer_phys, sizeof(struct usb_setup), 0);
+	int toggle = 1;
+	for (size_t offset = 0; offset < length; offset += mps) {
+		size_t len = (length - offset < mps) ? length - offset : mps;
+		uhci_td_fill(q, count++, dev, in ? PID_IN : PID_OUT, 0, toggle, payload_phys + offset, len, 0);
+		toggle ^= 1;
+	}
+	/* Status stage goes the other way, always DATA1 */
+	uhci_td_fill(q, count++, dev, (in && length) ? PID_OUT : PID_IN, 0, 1, 0, 0, 0);
+
+	int good;
+	int result = uhci_execute(q, count, &good);
+
+	size_t got = 0;
+	for (int i = 1; i < good && i < count - 1; ++i) {
+		got += uhci_td_actual(&q->tds[i]);
+	}
+	if (in && got) {
+		memcpy(data, payload, got);
+	}
+
+	uhci_queue_release(q);
+
+	if (actual) *actual = got;
+	return result;
+}
+
+static int uhci_data_transfer(usb_device_t * dev, int queue, usb_endpoint_t * ep, void * data, size_t length, size_t * actual) {
+	struct uhci * hc = dev->hc;
+	struct uhci_queue * q = &hc->queues[queue];
+	int in = ep->address & USB_DIR_IN;
+	size_t mps = ep->max_packet;
+	size_t max_chunk = UHCI_MAX_TDS * mps;
+	if (max_chunk > UHCI_BUFFER_SIZE) max_chunk = UHCI_BUFFER_SIZE;
+
+	if (actual) *actual = 0;
+	if (dev->gone || !mps) return USB_ERROR;
+
+	uhci_queue_acquire(q);
+
+	size_t done = 0;
+	int result = 0;
+	do {
+		size_t chunk = (length - done < max_chunk) ? length - done : max_chunk;
+		if (!in && chunk) {
+			memcpy(q->buffer, (uint8_t *)data + done, chunk);
+		}
+
+		int count = 0;
+		size_t offset = 0;
+		do {
+			size_t len = (chunk - offset < mps) ? chunk - offset : mps;
+			uhci_td_fill(q, count, dev, in ? PID_IN : PID_OUT, ep->address, ep->toggle ^ (count & 1), q->buffer_phys + offset, len, in);
+			count++;
+			offset += len;
+		} while (offset < chunk);
+
+		int good;
+		result = uhci_execute(q, count, &good);
+		ep->toggle ^= (good & 1);
+
+		size_t got = 0;
+		for (int i = 0; i < good; ++i) {
+			got += uhci_td_actual(&q->tds[i]);
+		}
+		if (in && got) {
+			memcpy((uint8_t *)data + done, q->buffer, got);
+		}
+		done += got;
 
-	pci_scan(&find_usb_device, -1, &hub_device);
+		if (result || got < chunk) break;
+	} while (done < length);
 
-	if (!hub_device) {
+	uhci_queue_release(q);
+
+	if (actual) *actual = done;
+	return result;
+}
+
+int usb_bulk(usb_device_t * dev, usb_endpoint_t * ep, void * data, size_t length, size_t * actual) {
+	return uhci_data_transfer(dev, QUEUE_BULK, ep, data, length, actual);
+}
+
+/* Waits for as long as the device has nothing to say */
+int usb_interrupt(usb_device_t * dev, usb_endpoint_t * ep, void * data, size_t length, size_t * actual) {
+	return uhci_data_transfer(dev, QUEUE_INTERRUPT, ep, data, length, actual);
+}
+
+int usb_clear_halt(usb_device_t * dev, usb_endpoint_t * ep) {
+	struct usb_setup setup = {
+		USB_RECIP_ENDPOINT, USB_REQ_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, ep->address, 0
+	};
+	ep->toggle = 0;
+	return usb_control(dev, &setup, NULL, NULL);
+}
+
+void * usb_find_descriptor(usb_device_t * dev, void * after, uint8_t type) {
+	uint8_t * end = dev->config + dev->config_length;
+	uint8_t * p = after ? (uint8_t *)after + ((uint8_t *)after)[0] : dev->config;
+	while (p + 2 <= end && p[0]) {
+		if (p[1] == type && p + p[0] <= end) return p;
+		p += p[0];
+	}
+	return NULL;
+}
+
+static void usb_offer(usb_device_t * dev, usb_driver_t * driver) {
+	if (!dev->driver && !dev->gone && !driver->probe(dev)) {
+		dev->driver = driver;
+		debug_print(NOTICE, "usb: device %d taken by %s", dev->address, driver->name);
+	}
+}
+
+void usb_register_driver(usb_driver_t * driver) {
+	spin_lock(usb_probe_lock);
+	list_insert(usb_drivers, driver);
+	foreach(node, usb_devices) {
+		usb_offer(node->value, driver);
+	}
+	spin_unlock(usb_probe_lock);
+}
+
+static int uhci_port_reset(struct uhci * hc, int port) {
+	uint16_t reg = hc->io + UHCI_PORTSC(port);
+
+	outports(reg, (inports(reg) & ~PORTSC_W1C) | PORTSC_PR);
+	uhci_sleep(50);
+	outports(reg, inports(reg) & ~(PORTSC_W1C | PORTSC_PR));
+	uhci_sleep(1);
+
+	for (int i = 0; i < 10; ++i) {
+		uint16_t status = inports(reg);
+		if (!(status & PORTSC_CCS)) return 1;
+		if (status & PORTSC_W1C) {
+			outports(reg, status);
+			continue;
+		}
+		if (status & PORTSC_PE) return 0;
+		outports(reg, status | PORTSC_PE);
+		uhci_sleep(10);
+	}
+	return 1;
+}
+
+static int usb_get_descriptor(usb_device_t * dev, uint8_t type, void * buf, size_t length) {
+	struct usb_setup setup = {
+		USB_DIR_IN | USB_RECIP_DEVICE, USB_REQ_GET_DESCRIPTOR, type << 8, 0, length
+	};
+	size_t got;
+	if (usb_control(dev, &setup, buf, &got) || got < length) return 1;
+	return 0;
+}
+
+static void uhci_port_attach(struct uhci * hc, int port) {
+	if (uhci_port_reset(hc, port)) return;
+	if (hc->next_address > 127) {
+		debug_print(WARNING, "uhci: out of addresses");
+		return;
+	}
+
+	usb_device_t * dev = malloc(sizeof(usb_device_t));
+	memset(dev, 0, sizeof(usb_device_t));
+	dev->hc = hc;
+	dev->port = port;
+	dev->low_speed = !!(inports(hc->io + UHCI_PORTSC(port)) & PORTSC_LSDA);
+	dev->max_packet0 = 8;
+
+	/* Just enough to learn the size of endpoint 0's packets */
+	if (usb_get_descriptor(dev, USB_DESC_DEVICE, &dev->desc, 8)) goto fail;
+	if (dev->desc.max_packet0) dev->max_packet0 = dev->desc.max_packet0;
+
+	struct usb_setup set_address = { USB_RECIP_DEVICE, USB_REQ_SET_ADDRESS, hc->next_address, 0, 0 };
+	if (usb_control(dev, &set_address, NULL, NULL)) goto fail;
+	dev->address = hc->next_address++;
+	uhci_sleep(2);
+
+	if (usb_get_descriptor(dev, USB_DESC_DEVICE, &dev->desc, sizeof(struct usb_device_desc))) goto fail;
+
+	struct usb_config_desc config;
+	if (usb_get_descriptor(dev, USB_DESC_CONFIG, &config, sizeof(struct usb_config_desc))) goto fail;
+	dev->config_length = config.total_length;
+	if (dev->config_length < sizeof(struct usb_config_desc) || dev->config_length > 1024) goto fail;
+	dev->config = malloc(dev->config_length);
+	if (usb_get_descriptor(dev, USB_DESC_CONFIG, dev->config, dev->config_length)) goto fail;
+
+	struct usb_setup set_config = { USB_RECIP_DEVICE, USB_REQ_SET_CONFIGURATION, config.value, 0, 0 };
+	if (usb_control(dev, &set_config, NULL, NULL)) goto fail;
+
+	debug_print(NOTICE, "usb: device %d on port %d: %x:%x class %d%s", dev->address, port,
+		dev->desc.vendor, dev->desc.product, dev->desc.class, dev->low_speed ? " (low speed)" : "");
+
+	hc->ports[port] = dev;
+
+	spin_lock(usb_probe_lock);
+	list_insert(usb_devices, dev);
+	foreach(node, usb_drivers) {
+		usb_offer(dev, node->value);
+	}
+	spin_unlock(usb_probe_lock);
+	return;
+
+fail:
+	debug_print(WARNING, "uhci: failed to enumerate device on port %d", port);
+	if (dev->config) free(dev->config);
+	free(dev);
+}
+
+/* The root hub doesn't interrupt on connection changes, so we look */
+static void uhci_hub_thread(void * data, char * name) {
+	int first = 1;
+	while (1) {
+		for (int i = 0; i < controller_count; ++i) {
+			struct uhci * hc = controllers[i];
+			for (int port = 0; port < UHCI_PORTS; ++port) {
+				uint16_t status = inports(hc->io + UHCI_PORTSC(port));
+				/* The first time round, take whatever was plugged in before us too */
+				if (!(status & PORTSC_CSC) && !(first && (status & PORTSC_CCS))) continue;
+				outports(hc->io + UHCI_PORTSC(port), status);
+
+				if (hc->ports[port]) {
+					debug_print(NOTICE, "usb: device %d removed", hc->ports[port]->address);
+					hc->ports[port]->gone = 1;
+					hc->ports[port] = NULL;
+				}
+				if (status & PORTSC_CCS) {
+					uhci_port_attach(hc, port);
+				}
+			}
+		}
+		first = 0;
+		uhci_sleep(1000);
+	}
+}
+
+static int uhci_queue_init(struct uhci_queue * q, struct uhci_qh * qh, uintptr_t qh_phys) {
+	q->qh = qh;
+	q->qh_phys = qh_phys;
+	q->qh->element = LINK_TERMINATE;
+	q->tds = dma_alloc(sizeof(struct uhci_td) * UHCI_MAX_TDS, ZONE_DMA32, &q->tds_phys);
+	q->buffer = dma_alloc(UHCI_BUFFER_SIZE, ZONE_DMA32, &q->buffer_phys);
+	q->waiters = list_create();
+	return !q->tds || !q->buffer;
+}
+
+static int uhci_init(struct uhci * hc) {
+	hc->io = pci_read_field(hc->pci, PCI_BAR4, 4) & 0xFFFC;
+	if (!hc->io) return 1;
+
+	uint16_t command_reg = pci_read_field(hc->pci, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 0); /* Bus master, I/O space */
+	pci_write_field(hc->pci, PCI_COMMAND, 2, command_reg);
+	pci_write_field(hc->pci, UHCI_LEGSUP, 2, LEGSUP_CLEAR);
+
+	outports(hc->io + UHCI_USBINTR, 0);
+	outports(hc->io + UHCI_USBCMD, USBCMD_GRESET);
+	uhci_sleep(10);
+	outports(hc->io + UHCI_USBCMD, 0);
+	outports(hc->io + UHCI_USBCMD, USBCMD_HCRESET);
+	for (int i = 0; i < 100 && (inports(hc->io + UHCI_USBCMD) & USBCMD_HCRESET); ++i) {
+		uhci_sleep(1);
+	}
+
+	hc->frame_list = dma_alloc(0x1000, ZONE_DMA32, &hc->frame_list_phys);
+	uintptr_t qh_phys;
+	struct uhci_qh * qh = dma_alloc(0x1000, ZONE_DMA32, &qh_phys);
+	if (!hc->frame_list || !qh) return 1;
+
+	for (int i = 0; i < QUEUE_COUNT; ++i) {
+		if (uhci_queue_init(&hc->queues[i], &qh[i], qh_phys + i * sizeof(struct uhci_qh))) return 1;
+		qh[i].head = (i + 1 < QUEUE_COUNT) ? ((qh_phys + (i + 1) * sizeof(struct uhci_qh)) | LINK_QH) : LINK_TERMINATE;
+	}
+	for (int i = 0; i < 1024; ++i) {
+		hc->frame_list[i] = hc->queues[QUEUE_INTERRUPT].qh_phys | LINK_QH;
+	}
+
+	hc->next_address = 1;
+	hc->irq = pci_get_interrupt(hc->pci);
+	irq_install_handler(hc->irq, uhci_irq_handler, "uhci");
+
+	outportl(hc->io + UHCI_FRBASEADD, hc->frame_list_phys);
+	outports(hc->io + UHCI_FRNUM, 0);
+	outportb(hc->io + UHCI_SOFMOD, 0x40);
+	outports(hc->io + UHCI_USBSTS, 0xFFFF);
+	outports(hc->io + UHCI_USBINTR, USBINTR_TIMEOUT | USBINTR_RESUME | USBINTR_IOC | USBINTR_SHORT);
+	outports(hc->io + UHCI_USBCMD, USBCMD_RS | USBCMD_CF | USBCMD_MAXP);
+	pci_write_field(hc->pci, UHCI_LEGSUP, 2, LEGSUP_PIRQ);
+
+	debug_print(NOTICE, "uhci: controller %x at io 0x%x, irq %d", hc->pci, hc->io, hc->irq);
+	return 0;
+}
+
+DEFINE_SHELL_FUNCTION(usb, "Enumerate USB devices (UHCI)") {
+
+	if (!controller_count) {
 		fprintf(tty, "Failed to locate a UHCI controller.\n");
 		return 1;
 	}
 
-	fprintf(tty, "Located UHCI controller: %2x:%2x.%d\n",
-			(int)pci_extract_bus (hub_device),
-			(int)pci_extract_slot(hub_device),
-			(int)pci_extract_func(hub_device));
+	for (int i = 0; i < controller_count; ++i) {
+		struct uhci * hc = controllers[i];
+		fprintf(tty, "Located UHCI controller: %2x:%2x.%d\n",
+				(int)pci_extract_bus (hc->pci),
+				(int)pci_extract_slot(hc->pci),
+				(int)pci_extract_func(hc->pci));
+		for (int port = 0; port < UHCI_PORTS; ++port) {
+			usb_device_t * dev = hc->ports[port];
+			if (!dev) continue;
+			fprintf(tty, "  port %d: device %d, %4x:%4x class %d, %s\n",
+					port, dev->address, dev->desc.vendor, dev->desc.product, dev->desc.class,
+					dev->driver ? dev->driver->name : "no driver");
+		}
+	}
 
 	return 0;
 }
 
 static int install(void) {
 	BIND_SHELL_FUNCTION(usb);
+
+	usb_devices = list_create();
+	usb_drivers = list_create();
+
+	pci_scan(&find_usb_device, -1, NULL);
+
+	int working = 0;
+	for (int i = 0; i < controller_count; ++i) {
+		if (uhci_init(controllers[i])) {
+			debug_print(WARNING, "uhci: failed to set up controller %x", controllers[i]->pci);
+			controllers[i] = controllers[--controller_count];
+			--i;
+			continue;
+		}
+		working++;
+	}
+
+	if (working) {
+		create_kernel_tasklet(uhci_hub_thread, "[uhci]", NULL);
+	}
+
 	return 0;
 }
 
@@ -46,5 +619,5 @@ static int uninstall(void) {
 	return 0;
 }
 
-MODULE_DEF(usbuhci, install, uninstall);
+MODULE_DEF_DEFERRED(usbuhci, install, uninstall);
 MODULE_DEPENDS(debugshell);
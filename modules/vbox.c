@@ -238,13 +238,14 @@ uint32_t write_rectpipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t
 	(void)node;
 	(void)offset;
 
-	/* TODO should check size */
-
 	/* This is kinda special and always assumes everything was written at once. */
+	if (size < sizeof(uint32_t)) return -1;
 	uint32_t count = ((uint32_t *)buffer)[0];
-	vbox_visibleregion->count = count;
 
 	if (count > 254) count = 254; /* enforce maximum */
+	if (count > (size - sizeof(uint32_t)) / sizeof(struct vbox_rtrect)) {
+		count = (size - sizeof(uint32_t)) / sizeof(struct vbox_rtrect);
+	}
 
 #if 0
 	fprintf(&vb, "Writing %d rectangles\n", count);
@@ -252,21 +253,10 @@ uint32_t write_rectpipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t
 
 	buffer += sizeof(uint32_t);
 
-	for (unsigned int i = 0; i < count; ++i) {
-		memcpy(&vbox_visibleregion->rect[i], buffer, sizeof(struct vbox_rtrect));
-#if 0
-		fprintf(&vb, "Rectangle %d is [%d,%d,%d,%d]\n",
-				i,
-				vbox_visibleregion->rect[i].xLeft,
-				vbox_visibleregion->rect[i].yTop,
-				vbox_visibleregion->rect[i].xRight,
-				vbox_visibleregion->rect[i].yBottom);
-#endif
-
-		buffer += sizeof(struct vbox_rtrect);
-	}
+	vbox_visibleregion->count = count;
+	memcpy(vbox_visibleregion->rect, buffer, sizeof(struct vbox_rtrect) * count);
 
-	vbox_visibleregion->header.size = sizeof(struct vbox_header) + sizeof(uint32_t) + sizeof(int32_t) * count * 4;
+	vbox_visibleregion->header.size = sizeof(struct vbox_header) + sizeof(uint32_t) + sizeof(struct vbox_rtrect) * count;
 	outportl(vbox_port, vbox_phys_visibleregion);
 
 	return size;
@@ -0,0 +1,426 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Virtio block device driver
+ *
+ * Provides raw block access to virtio disks as /dev/vda, /dev/vdb...
+ * Every transfer is one request on the device's queue: a header, the
+ * caller's buffer one page at a time, and a status byte, described
+ * by a single indirect descriptor. Requests from different processes
+ * are in flight together, and the device finishes them in whatever
+ * order it likes.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/fs.h>
+#include <kernel/printf.h>
+#include <kernel/pci.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
+#include <kernel/mod/virtio.h>
+
+#include <toaru/list.h>
+
+#define VIOBLK_SECTOR_SIZE   512
+#define VIOBLK_MAX_DEVICES   8
+#define VIOBLK_MAX_SECTORS   256 /* Per request */
+#define VIOBLK_MAX_SEGMENTS  (VIRTQ_INDIRECT_MAX - 2)
+
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLK_F_RO      (1 << 5)
+
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+#define VIRTIO_BLK_CONFIG_SEG_MAX  12
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+
+#define VIRTIO_BLK_S_OK  0
+
+struct vioblk_header {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__((packed));
+
+/* What the device reads and writes besides the data; one DMA pool block */
+struct vioblk_command {
+	struct vioblk_header header;
+	volatile uint8_t status;
+};
+
+typedef struct {
+	struct vioblk_command * command;
+	uintptr_t command_phys;
+	volatile int done;
+} vioblk_request_t;
+
+struct vioblk_device {
+	virtio_device_t virtio;
+	virtq_t * queue;
+	uint64_t sectors;
+	uint32_t max_segments;
+	int read_only;
+	list_t * waiters; /* For finished requests and for room in the queue */
+};
+
+static struct vioblk_device * vioblk_devices[VIOBLK_MAX_DEVICES];
+static int vioblk_count = 0;
+static dma_pool_t * vioblk_command_pool = NULL;
+
+static void find_vioblk(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (vendorid == 0x1af4 && deviceid == 0x1001 && vioblk_count < VIOBLK_MAX_DEVICES) {
+		struct vioblk_device * dev = malloc(sizeof(struct vioblk_device));
+		memset(dev, 0, sizeof(struct vioblk_device));
+		dev->virtio.pci = device;
+		vioblk_devices[vioblk_count++] = dev;
+	}
+}
+
+static int vioblk_irq_handler(struct regs *r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+	for (int i = 0; i < vioblk_count; ++i) {
+		struct vioblk_device * dev = vioblk_devices[i];
+		if (!dev->queue || dev->virtio.irq != irq) continue;
+		if (!(virtio_isr(&dev->virtio) & VIRTIO_ISR_QUEUE)) continue;
+		handled = 1;
+
+		vioblk_request_t * request;
+		while ((request = virtq_get(dev->queue, NULL))) {
+			request->done = 1;
+		}
+		wakeup_queue(dev->waiters);
+	}
+
+	if (handled) {
+		irq_ack(irq);
+	}
+	return handled;
+}
+
+/*
+ * Run one request of `sectors` sectors (at most VIOBLK_MAX_SECTORS)
+ * whose data buffers are already in `bufs[1..segments]`.
+ *
+ * @returns 0 on success, 1 on error
+ */
+static int vioblk_request(struct vioblk_device * dev, uint64_t lba, virtq_buf_t * bufs, int segments, int write) {
+	vioblk_request_t request = { .done = 0 };
+
+	IRQ_OFF;
+	request.command = dma_pool_alloc(vioblk_command_pool, &request.command_phys);
+	IRQ_RES;
+	if (!request.command) return 1;
+
+	request.command->header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	request.command->header.reserved = 0;
+	request.command->header.sector = lba;
+	request.command->status = 0xFF;
+
+	bufs[0].phys = request.command_phys;
+	bufs[0].len  = sizeof(struct vioblk_header);
+	bufs[segments + 1].phys = request.command_phys + sizeof(struct vioblk_header);
+	bufs[segments + 1].len  = 1;
+
+	IRQ_OFF;
+	/* Data the device reads comes before the buffers it writes */
+	while (virtq_add(dev->queue, bufs, write ? segments + 1 : 1, write ? 1 : segments + 1, &request) < 0) {
+		sleep_on(dev->waiters);
+	}
+	virtq_kick(dev->queue);
+	while (!request.done) {
+		sleep_on(dev->waiters);
+	}
+	IRQ_RES;
+
+	int error = request.command->status != VIRTIO_BLK_S_OK;
+
+	IRQ_OFF;
+	dma_pool_free(vioblk_command_pool, request.command);
+	IRQ_RES;
+
+	return error;
+}
+
+/*
+ * Transfer `sectors` sectors between the device and `buf`, in as
+ * few requests as the device's segment limit allows.
+ *
+ * Buffers in user memory go through a bounce buffer; kernel buffers
+ * are used directly.
+ */
+static int vioblk_transfer(struct vioblk_device * dev, uint64_t lba, unsigned int sectors, uint8_t * buf, int write) {
+	if (lba + sectors > dev->sectors) return 1;
+	if (write && dev->read_only) return 1;
+
+	size_t size = sectors * VIOBLK_SECTOR_SIZE;
+	uint8_t * data = buf;
+
+	/* TODO: These virtual address bounds should be in a header somewhere */
+	if ((uintptr_t)buf + size > 0x20000000) {
+		data = malloc(size);
+		if (write) {
+			memcpy(data, buf, size);
+		}
+	}
+
+	virtq_buf_t bufs[VIOBLK_MAX_SEGMENTS + 2];
+	uintptr_t addr = (uintptr_t)data;
+	uintptr_t end  = addr + size;
+	int error = 0;
+
+	while (addr < end && !error) {
+		/* One page at a time, up to what one request can carry */
+		uintptr_t limit = end;
+		if (limit - addr > VIOBLK_MAX_SECTORS * VIOBLK_SECTOR_SIZE) {
+			limit = addr + VIOBLK_MAX_SECTORS * VIOBLK_SECTOR_SIZE;
+		}
+		uint32_t segments = 0;
+		uintptr_t p = addr;
+		while (p < limit && segments < dev->max_segments) {
+			uintptr_t chunk = 0x1000 - (p & 0xFFF);
+			if (chunk > limit - p) chunk = limit - p;
+			bufs[segments + 1].phys = map_to_physical(p);
+			bufs[segments + 1].len  = chunk;
+			segments++;
+			p += chunk;
+		}
+
+		/* Out of segments mid-sector; leave the rest of the sector for the next request */
+		uint32_t excess = (p - addr) % VIOBLK_SECTOR_SIZE;
+		while (excess) {
+			uint32_t cut = bufs[segments].len < excess ? bufs[segments].len : excess;
+			bufs[segments].len -= cut;
+			excess -= cut;
+			p -= cut;
+			if (!bufs[segments].len) segments--;
+		}
+
+		error = vioblk_request(dev, lba, bufs, segments, write);
+		lba += (p - addr) / VIOBLK_SECTOR_SIZE;
+		addr = p;
+	}
+
+	if (error) {
+		debug_print(WARNING, "Error during virtio %s of %d sectors at lba %d", write ? "write" : "read", sectors, (uint32_t)lba);
+	}
+
+	if (data != buf) {
+		if (!write) {
+			memcpy(buf, data, size);
+		}
+		free(data);
+	}
+
+	return error;
+}
+
+static uint32_t read_vioblk(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct vioblk_device * dev = (struct vioblk_device *)node->device;
+	uint64_t max_offset = dev->sectors * VIOBLK_SECTOR_SIZE;
+
+	if (offset > max_offset) {
+		return 0;
+	}
+
+	if (offset + size > max_offset) {
+		size = max_offset - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset / VIOBLK_SECTOR_SIZE;
+	uint64_t end_block = (offset + size - 1) / VIOBLK_SECTOR_SIZE;
+	unsigned int x_offset = 0;
+
+	if (offset % VIOBLK_SECTOR_SIZE || size < VIOBLK_SECTOR_SIZE) {
+		unsigned int prefix_size = (VIOBLK_SECTOR_SIZE - (offset % VIOBLK_SECTOR_SIZE));
+		if (prefix_size > size) prefix_size = size;
+		char * tmp = malloc(VIOBLK_SECTOR_SIZE);
+		vioblk_transfer(dev, start_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % VIOBLK_SECTOR_SIZE)), prefix_size);
+
+		free(tmp);
+
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % VIOBLK_SECTOR_SIZE && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % VIOBLK_SECTOR_SIZE;
+		char * tmp = malloc(VIOBLK_SECTOR_SIZE);
+		vioblk_transfer(dev, end_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
+
+		free(tmp);
+
+		end_block--;
+	}
+
+	while (start_block <= end_block) {
+		unsigned int count = end_block - start_block + 1;
+		if (count > VIOBLK_MAX_SECTORS) count = VIOBLK_MAX_SECTORS;
+		vioblk_transfer(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset), 0);
+		x_offset += count * VIOBLK_SECTOR_SIZE;
+		start_block += count;
+	}
+
+	return size;
+}
+
+static uint32_t write_vioblk(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct vioblk_device * dev = (struct vioblk_device *)node->device;
+	uint64_t max_offset = dev->sectors * VIOBLK_SECTOR_SIZE;
+
+	if (dev->read_only || offset > max_offset) {
+		return 0;
+	}
+
+	if (offset + size > max_offset) {
+		size = max_offset - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset / VIOBLK_SECTOR_SIZE;
+	uint64_t end_block = (offset + size - 1) / VIOBLK_SECTOR_SIZE;
+	unsigned int x_offset = 0;
+
+	if (offset % VIOBLK_SECTOR_SIZE || size < VIOBLK_SECTOR_SIZE) {
+		unsigned int prefix_size = (VIOBLK_SECTOR_SIZE - (offset % VIOBLK_SECTOR_SIZE));
+		if (prefix_size > size) prefix_size = size;
+		char * tmp = malloc(VIOBLK_SECTOR_SIZE);
+		vioblk_transfer(dev, start_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % VIOBLK_SECTOR_SIZE)), buffer, prefix_size);
+		vioblk_transfer(dev, start_block, 1, (uint8_t *)tmp, 1);
+
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % VIOBLK_SECTOR_SIZE && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % VIOBLK_SECTOR_SIZE;
+		char * tmp = malloc(VIOBLK_SECTOR_SIZE);
+		vioblk_transfer(dev, end_block, 1, (uint8_t *)tmp, 0);
+
+		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
+		vioblk_transfer(dev, end_block, 1, (uint8_t *)tmp, 1);
+
+		free(tmp);
+		end_block--;
+	}
+
+	while (start_block <= end_block) {
+		unsigned int count = end_block - start_block + 1;
+		if (count > VIOBLK_MAX_SECTORS) count = VIOBLK_MAX_SECTORS;
+		vioblk_transfer(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset), 1);
+		x_offset += count * VIOBLK_SECTOR_SIZE;
+		start_block += count;
+	}
+
+	return size;
+}
+
+static void open_vioblk(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_vioblk(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * vioblk_device_create(struct vioblk_device * device, int index) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	sprintf(fnode->name, "vioblk%d", index);
+	fnode->device  = device;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = device->read_only ? 0440 : 0660;
+	fnode->length  = device->sectors * VIOBLK_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_vioblk;
+	fnode->write   = device->read_only ? NULL : write_vioblk;
+	fnode->open    = open_vioblk;
+	fnode->close   = close_vioblk;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = NULL;
+	return fnode;
+}
+
+static int vioblk_device_init(struct vioblk_device * dev) {
+	if (virtio_init(&dev->virtio, dev->virtio.pci, VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO)) {
+		return 1;
+	}
+
+	dev->sectors = virtio_config_read32(&dev->virtio, VIRTIO_BLK_CONFIG_CAPACITY) |
+		((uint64_t)virtio_config_read32(&dev->virtio, VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32);
+	dev->read_only = !!(dev->virtio.features & VIRTIO_BLK_F_RO);
+
+	dev->max_segments = VIOBLK_MAX_SEGMENTS;
+	if (dev->virtio.features & VIRTIO_BLK_F_SEG_MAX) {
+		uint32_t seg_max = virtio_config_read32(&dev->virtio, VIRTIO_BLK_CONFIG_SEG_MAX);
+		if (seg_max && seg_max < dev->max_segments) dev->max_segments = seg_max;
+	}
+
+	dev->waiters = list_create();
+	dev->queue = virtq_create(&dev->virtio, 0);
+	if (!dev->queue) {
+		debug_print(ERROR, "virtio-blk: device has no request queue");
+		return 1;
+	}
+
+	/* Without indirect tables, a request's descriptors all come from the ring */
+	if (!(dev->virtio.features & VIRTIO_RING_F_INDIRECT_DESC) && dev->max_segments > (uint32_t)dev->queue->size - 2) {
+		dev->max_segments = dev->queue->size - 2;
+	}
+
+	irq_install_handler(dev->virtio.irq, vioblk_irq_handler, "virtio-blk");
+	virtio_driver_ok(&dev->virtio);
+	return 0;
+}
+
+static int vioblk_initialize(void) {
+	pci_scan(&find_vioblk, -1, NULL);
+
+	if (!vioblk_count) {
+		debug_print(NOTICE, "No virtio block devices found.");
+		return 0;
+	}
+
+	vioblk_command_pool = dma_pool_create("vioblk", sizeof(struct vioblk_command), 16, ZONE_DMA32);
+
+	char drive = 'a';
+	for (int i = 0; i < vioblk_count; ++i) {
+		struct vioblk_device * dev = vioblk_devices[i];
+		if (vioblk_device_init(dev)) {
+			continue;
+		}
+
+		char devname[64];
+		sprintf((char *)&devname, "/dev/vd%c", drive);
+		vfs_mount(devname, vioblk_device_create(dev, drive - 'a'));
+		debug_print(NOTICE, "%s: %d sectors%s, %d segments per request", devname,
+			(uint32_t)dev->sectors, dev->read_only ? " (read-only)" : "", dev->max_segments);
+		drive++;
+	}
+
+	return 0;
+}
+
+static int vioblk_finalize(void) {
+	return 0;
+}
+
+MODULE_DEF(vioblk, vioblk_initialize, vioblk_finalize);
+MODULE_DEPENDS(virtio);
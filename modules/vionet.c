@@ -0,0 +1,236 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Virtio network device driver
+ *
+ * Received frames land straight in network packet buffers, which are
+ * handed up as they are and replaced with fresh ones. Sent frames are
+ * copied into one of a fixed set of transmit buffers; the device
+ * doesn't interrupt when it is done with them unless we run out.
+ */
+#include <kernel/module.h>
+#include <kernel/logging.h>
+#include <kernel/printf.h>
+#include <kernel/pci.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
+#include <kernel/ipv4.h>
+#include <kernel/mod/net.h>
+#include <kernel/mod/virtio.h>
+
+#include <toaru/list.h>
+
+#define VIONET_LOG_LEVEL NOTICE
+
+#define VIONET_RX_BUFFERS 64
+#define VIONET_TX_BUFFERS 32
+
+#define VIONET_RX_QUEUE 0
+#define VIONET_TX_QUEUE 1
+
+#define VIRTIO_NET_F_MAC (1 << 5)
+
+#define VIRTIO_NET_CONFIG_MAC 0
+
+/* Without VIRTIO_NET_F_MRG_RXBUF, every frame is preceded by one of these */
+struct virtio_net_hdr {
+	uint8_t  flags;
+	uint8_t  gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+} __attribute__((packed));
+
+static uint32_t vionet_device_pci = 0x00000000;
+static virtio_device_t vionet;
+static virtq_t * rx_queue;
+static virtq_t * tx_queue;
+static uint8_t mac[6];
+
+static struct virtio_net_hdr * rx_headers;
+static uintptr_t rx_headers_phys;
+static void * rx_packets[VIONET_RX_BUFFERS];
+
+static struct virtio_net_hdr * tx_headers;
+static uintptr_t tx_headers_phys;
+static void * tx_buffers[VIONET_TX_BUFFERS];
+static int tx_free[VIONET_TX_BUFFERS]; /* Stack of idle transmit buffers */
+static int tx_free_count = 0;
+
+static list_t * rx_wait;
+static list_t * tx_wait;
+
+static uint8_t* get_mac() {
+	return mac;
+}
+
+static void find_vionet(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (vendorid == 0x1af4 && deviceid == 0x1000) {
+		*((uint32_t *)extra) = device;
+	}
+}
+
+static int irq_handler(struct regs *r) {
+	if (!(virtio_isr(&vionet) & VIRTIO_ISR_QUEUE)) {
+		return 0;
+	}
+
+	irq_ack(vionet.irq);
+
+	/* Whoever is waiting takes the finished buffers back */
+	wakeup_queue(rx_wait);
+	wakeup_queue(tx_wait);
+
+	return 1;
+}
+
+/* Hand receive buffer `slot` (back) to the device. Interrupts must be off. */
+static void rx_post(int slot) {
+	virtq_buf_t bufs[2] = {
+		{ rx_headers_phys + slot * sizeof(struct virtio_net_hdr), sizeof(struct virtio_net_hdr) },
+		{ map_to_physical((uintptr_t)rx_packets[slot]), NET_PACKET_SIZE },
+	};
+	virtq_add(rx_queue, bufs, 0, 2, (void *)(uintptr_t)(slot + 1));
+}
+
+static struct ethernet_packet * dequeue_packet(void) {
+	while (1) {
+		uint32_t len;
+		void * token;
+
+		IRQ_OFF;
+		while (!(token = virtq_get(rx_queue, &len))) {
+			sleep_on(rx_wait);
+		}
+
+		int slot = (uintptr_t)token - 1;
+		void * packet = NULL;
+		if (len > sizeof(struct virtio_net_hdr)) {
+			packet = rx_packets[slot];
+			rx_packets[slot] = net_packet_alloc();
+		}
+		rx_post(slot);
+		virtq_kick(rx_queue);
+		IRQ_RES;
+
+		if (packet) {
+			return packet;
+		}
+	}
+}
+
+/* Take back transmit buffers the device is done with. Interrupts must be off. */
+static void tx_reap(void) {
+	void * token;
+	while ((token = virtq_get(tx_queue, NULL))) {
+		tx_free[tx_free_count++] = (uintptr_t)token - 1;
+	}
+}
+
+static void send_packet(uint8_t* payload, size_t payload_size) {
+	if (payload_size > NET_PACKET_SIZE) {
+		debug_print(ERROR, "Packet too big; max is %d, got %d", NET_PACKET_SIZE, payload_size);
+		return;
+	}
+
+	IRQ_OFF;
+	tx_reap();
+	if (!tx_free_count) {
+		/* All in flight; we need to hear when one comes back */
+		virtq_set_interrupts(tx_queue, 1);
+		tx_reap();
+		while (!tx_free_count) {
+			sleep_on(tx_wait);
+			tx_reap();
+		}
+		virtq_set_interrupts(tx_queue, 0);
+	}
+
+	int slot = tx_free[--tx_free_count];
+	memcpy(tx_buffers[slot], payload, payload_size);
+
+	virtq_buf_t bufs[2] = {
+		{ tx_headers_phys + slot * sizeof(struct virtio_net_hdr), sizeof(struct virtio_net_hdr) },
+		{ map_to_physical((uintptr_t)tx_buffers[slot]), payload_size },
+	};
+	virtq_add(tx_queue, bufs, 2, 0, (void *)(uintptr_t)(slot + 1));
+	virtq_kick(tx_queue);
+	IRQ_RES;
+}
+
+static int init(void) {
+	pci_scan(&find_vionet, -1, &vionet_device_pci);
+
+	if (!vionet_device_pci) {
+		debug_print(VIONET_LOG_LEVEL, "No virtio network device found.");
+		return 1;
+	}
+
+	if (virtio_init(&vionet, vionet_device_pci, VIRTIO_NET_F_MAC)) {
+		return 1;
+	}
+
+	if (vionet.features & VIRTIO_NET_F_MAC) {
+		for (int i = 0; i < 6; ++i) {
+			mac[i] = virtio_config_read8(&vionet, VIRTIO_NET_CONFIG_MAC + i);
+		}
+	} else {
+		/* Locally administered address of our own */
+		uint8_t fallback[6] = { 0x02, 0x00, 0x00, 0x12, 0x34, 0x56 };
+		memcpy(mac, fallback, 6);
+	}
+
+	rx_queue = virtq_create(&vionet, VIONET_RX_QUEUE);
+	tx_queue = virtq_create(&vionet, VIONET_TX_QUEUE);
+	if (!rx_queue || !tx_queue) {
+		debug_print(ERROR, "virtio-net: device is missing its queues");
+		return 1;
+	}
+
+	rx_wait = list_create();
+	tx_wait = list_create();
+
+	rx_headers = dma_alloc(sizeof(struct virtio_net_hdr) * VIONET_RX_BUFFERS, ZONE_DMA32, &rx_headers_phys);
+	tx_headers = dma_alloc(sizeof(struct virtio_net_hdr) * VIONET_TX_BUFFERS, ZONE_DMA32, &tx_headers_phys);
+
+	/* Each buffer takes two descriptors of a ring that may be smaller than we'd like */
+	int rx_count = VIONET_RX_BUFFERS < rx_queue->size / 2 ? VIONET_RX_BUFFERS : rx_queue->size / 2;
+	int tx_count = VIONET_TX_BUFFERS < tx_queue->size / 2 ? VIONET_TX_BUFFERS : tx_queue->size / 2;
+
+	/* Packet buffers are 2048 bytes and never cross a page, so they can take DMA */
+	IRQ_OFF;
+	for (int i = 0; i < rx_count; ++i) {
+		rx_packets[i] = net_packet_alloc();
+		rx_post(i);
+	}
+	IRQ_RES;
+
+	for (int i = 0; i < tx_count; ++i) {
+		tx_buffers[i] = net_packet_alloc();
+		tx_free[tx_free_count++] = i;
+	}
+	virtq_set_interrupts(tx_queue, 0);
+
+	irq_install_handler(vionet.irq, irq_handler, "virtio-net");
+	virtio_driver_ok(&vionet);
+
+	IRQ_OFF;
+	virtq_kick(rx_queue);
+	IRQ_RES;
+
+	debug_print(VIONET_LOG_LEVEL, "virtio-net mac %2x:%2x:%2x:%2x:%2x:%2x, irq=%d, %d rx buffers", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], vionet.irq, rx_count);
+
+	init_netif_funcs(get_mac, dequeue_packet, send_packet, "Virtio Network");
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(vionet, init, fini);
+MODULE_DEPENDS(net);
+MODULE_DEPENDS(virtio);
@@ -0,0 +1,268 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Virtio PCI transport and virtqueues.
+ *
+ * Shared by the virtio block and network drivers. Devices are driven
+ * through the legacy I/O port interface, which every hypervisor that
+ * offers virtio still provides and which needs no MMIO mappings.
+ *
+ * Requests of more than two buffers are described by an indirect
+ * table, so they take up a single descriptor of the ring. With
+ * VIRTIO_RING_F_EVENT_IDX both sides tell each other which ring entry
+ * they next want to hear about: we only notify the device when it
+ * asks for it, and it only interrupts us for entries past the last
+ * one we took back.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/pci.h>
+#include <kernel/mem.h>
+#include <kernel/dma.h>
+#include <kernel/mod/virtio.h>
+
+#define VIRTIO_RING_ALIGN 0x1000
+
+/* The device sees ring updates in order; the compiler has to be told */
+#define barrier() asm volatile ("" ::: "memory")
+
+/*
+ * A store followed by a load of something the device writes needs a
+ * real fence: the CPU may otherwise satisfy the load before the store
+ * is visible to a host running on another processor.
+ */
+#define mb() asm volatile ("lock; addl $0,(%%esp)" ::: "memory", "cc")
+
+static dma_pool_t * indirect_pool = NULL;
+
+#define USED_EVENT(vq)  (*(volatile uint16_t *)&(vq)->avail->ring[(vq)->size])
+#define AVAIL_EVENT(vq) (*(volatile uint16_t *)((volatile uint8_t *)(vq)->used + 4 + 8 * (vq)->size))
+
+int virtio_init(virtio_device_t * dev, uint32_t pci, uint32_t wanted) {
+	dev->pci = pci;
+	dev->io_base = pci_read_field(pci, PCI_BAR0, 4) & 0xFFFC;
+	dev->irq = pci_get_interrupt(pci);
+
+	if (!dev->io_base) {
+		debug_print(WARNING, "virtio: device has no I/O BAR");
+		return 1;
+	}
+
+	uint16_t command_reg = pci_read_field(pci, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 0); /* Bus master, I/O space */
+	pci_write_field(pci, PCI_COMMAND, 2, command_reg);
+
+	/* Reset, then announce ourselves */
+	outportb(dev->io_base + VIRTIO_PCI_STATUS, 0);
+	outportb(dev->io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outportb(dev->io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	uint32_t offered = inportl(dev->io_base + VIRTIO_PCI_HOST_FEATURES);
+	dev->features = offered & (wanted | VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX);
+	outportl(dev->io_base + VIRTIO_PCI_GUEST_FEATURES, dev->features);
+
+	debug_print(NOTICE, "virtio: device 0x%x offers 0x%x, using 0x%x", pci, offered, dev->features);
+
+	if ((dev->features & VIRTIO_RING_F_INDIRECT_DESC) && !indirect_pool) {
+		indirect_pool = dma_pool_create("virtio-indirect", sizeof(struct virtq_desc) * VIRTQ_INDIRECT_MAX, sizeof(struct virtq_desc), ZONE_DMA32);
+	}
+
+	return 0;
+}
+
+virtq_t * virtq_create(virtio_device_t * dev, uint16_t index) {
+	outports(dev->io_base + VIRTIO_PCI_QUEUE_SELECT, index);
+	uint16_t size = inports(dev->io_base + VIRTIO_PCI_QUEUE_SIZE);
+	if (!size) return NULL;
+
+	/* Legacy layout: descriptors and available ring, then the used ring on the next page */
+	size_t avail_end = sizeof(struct virtq_desc) * size + sizeof(uint16_t) * (3 + size);
+	size_t used_offset = (avail_end + VIRTIO_RING_ALIGN - 1) & ~(VIRTIO_RING_ALIGN - 1);
+	size_t total = used_offset + sizeof(uint16_t) * 3 + sizeof(struct virtq_used_elem) * size;
+
+	uintptr_t phys;
+	uint8_t * ring = dma_alloc(total, ZONE_DMA32, &phys);
+	if (!ring) {
+		debug_print(ERROR, "virtio: no memory for a %d-entry queue", size);
+		return NULL;
+	}
+
+	virtq_t * vq = malloc(sizeof(virtq_t));
+	memset(vq, 0, sizeof(virtq_t));
+	vq->dev   = dev;
+	vq->index = index;
+	vq->size  = size;
+	vq->desc  = (void *)ring;
+	vq->avail = (void *)(ring + sizeof(struct virtq_desc) * size);
+	vq->used  = (void *)(ring + used_offset);
+
+	vq->tokens = malloc(sizeof(void *) * size);
+	memset(vq->tokens, 0, sizeof(void *) * size);
+	vq->indirect = malloc(sizeof(struct virtq_desc *) * size);
+	memset(vq->indirect, 0, sizeof(struct virtq_desc *) * size);
+
+	for (uint16_t i = 0; i < size; ++i) {
+		vq->desc[i].next = i + 1;
+	}
+	vq->free_head = 0;
+	vq->num_free = size;
+	vq->interrupts = 1;
+
+	outportl(dev->io_base + VIRTIO_PCI_QUEUE_PFN, phys / VIRTIO_RING_ALIGN);
+	return vq;
+}
+
+void virtio_driver_ok(virtio_device_t * dev) {
+	outportb(dev->io_base + VIRTIO_PCI_STATUS,
+		VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+uint8_t virtio_isr(virtio_device_t * dev) {
+	return inportb(dev->io_base + VIRTIO_PCI_ISR);
+}
+
+uint8_t virtio_config_read8(virtio_device_t * dev, uint16_t offset) {
+	return inportb(dev->io_base + VIRTIO_PCI_CONFIG + offset);
+}
+
+uint32_t virtio_config_read32(virtio_device_t * dev, uint16_t offset) {
+	return inportl(dev->io_base + VIRTIO_PCI_CONFIG + offset);
+}
+
+static void virtq_fill(volatile struct virtq_desc * desc, virtq_buf_t * buf, int write, uint16_t next, int last) {
+	desc->addr  = buf->phys;
+	desc->len   = buf->len;
+	desc->flags = (write ? VIRTQ_DESC_F_WRITE : 0) | (last ? 0 : VIRTQ_DESC_F_NEXT);
+	desc->next  = next;
+}
+
+int virtq_add(virtq_t * vq, virtq_buf_t * bufs, int out, int in, void * token) {
+	int count = out + in;
+	int use_indirect = (vq->dev->features & VIRTIO_RING_F_INDIRECT_DESC) && count > 2;
+
+	if (use_indirect && count > VIRTQ_INDIRECT_MAX) return -1;
+	if (vq->num_free < (use_indirect ? 1 : count)) return -1;
+
+	uint16_t head = vq->free_head;
+
+	if (use_indirect) {
+		/* Tables stay with their head descriptor once allocated */
+		if (!vq->indirect[head]) {
+			uintptr_t phys;
+			vq->indirect[head] = indirect_pool ? dma_pool_alloc(indirect_pool, &phys) : NULL;
+			if (!vq->indirect[head]) {
+				use_indirect = 0;
+				if (vq->num_free < count) return -1;
+			}
+		}
+	}
+
+	if (use_indirect) {
+		struct virtq_desc * table = vq->indirect[head];
+		for (int i = 0; i < count; ++i) {
+			virtq_fill(&table[i], &bufs[i], i >= out, i + 1, i == count - 1);
+		}
+		vq->free_head = vq->desc[head].next;
+		vq->num_free--;
+		vq->desc[head].addr  = map_to_physical((uintptr_t)table);
+		vq->desc[head].len   = sizeof(struct virtq_desc) * count;
+		vq->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+	} else {
+		uint16_t d = head;
+		for (int i = 0; i < count; ++i) {
+			uint16_t next = vq->desc[d].next;
+			/* The free chain's link is kept through the last descriptor */
+			virtq_fill(&vq->desc[d], &bufs[i], i >= out, next, i == count - 1);
+			if (i == count - 1) {
+				vq->free_head = next;
+			}
+			d = next;
+		}
+		vq->num_free -= count;
+	}
+
+	vq->tokens[head] = token;
+	vq->avail->ring[vq->avail_idx % vq->size] = head;
+	vq->avail_idx++;
+	return 0;
+}
+
+void virtq_kick(virtq_t * vq) {
+	barrier();
+	uint16_t old = vq->kicked_idx;
+	uint16_t new = vq->avail_idx;
+	vq->avail->idx = new;
+	vq->kicked_idx = new;
+	mb();
+
+	int notify;
+	if (vq->dev->features & VIRTIO_RING_F_EVENT_IDX) {
+		/* Did we just pass the entry the device asked to hear about? */
+		notify = (uint16_t)(new - AVAIL_EVENT(vq) - 1) < (uint16_t)(new - old);
+	} else {
+		notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	}
+
+	if (notify) {
+		outports(vq->dev->io_base + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+	}
+}
+
+void * virtq_get(virtq_t * vq, uint32_t * len) {
+	if (vq->last_used == vq->used->idx) return NULL;
+	barrier();
+
+	volatile struct virtq_used_elem * elem = &vq->used->ring[vq->last_used % vq->size];
+	uint16_t head = elem->id;
+	if (len) *len = elem->len;
+	vq->last_used++;
+
+	/* Interrupt us again once the device finishes the entry after this one */
+	if (vq->interrupts && (vq->dev->features & VIRTIO_RING_F_EVENT_IDX)) {
+		USED_EVENT(vq) = vq->last_used;
+		/* Before the caller looks at used->idx again */
+		mb();
+	}
+
+	/* Put the descriptors back on the free chain */
+	uint16_t tail = head;
+	uint16_t freed = 1;
+	if (!(vq->desc[head].flags & VIRTQ_DESC_F_INDIRECT)) {
+		while (vq->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+			tail = vq->desc[tail].next;
+			freed++;
+		}
+	}
+	vq->desc[tail].next = vq->free_head;
+	vq->free_head = head;
+	vq->num_free += freed;
+
+	void * token = vq->tokens[head];
+	vq->tokens[head] = NULL;
+	return token;
+}
+
+void virtq_set_interrupts(virtq_t * vq, int enable) {
+	vq->interrupts = enable;
+	if (vq->dev->features & VIRTIO_RING_F_EVENT_IDX) {
+		/* An entry the device has already passed is never crossed again */
+		USED_EVENT(vq) = enable ? vq->last_used : (uint16_t)(vq->last_used - 1);
+	} else {
+		vq->avail->flags = enable ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT;
+	}
+	/* Callers re-check used->idx after this, so it must be seen first */
+	mb();
+}
+
+static int init(void) {
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(virtio, init, fini);
@@ -19,7 +19,8 @@ class Classifier(object):
         '<toaru/pex.h>':         (None, '-ltoaru_pex',         []),
         '<toaru/auth.h>':        (None, '-ltoaru_auth',        []),
         '<toaru/graphics.h>':    (None, '-ltoaru_graphics',    []),
-        '<toaru/inflate.h>':     (None, '-ltoaru_inflate',     []),
+        '<toaru/checksum.h>':    (None, '-ltoaru_checksum',    []),
+        '<toaru/inflate.h>':     (None, '-ltoaru_inflate',     ['<toaru/checksum.h>']),
         '<toaru/drawstring.h>':  (None, '-ltoaru_drawstring',  ['<toaru/graphics.h>']),
         '<toaru/jpeg.h>':        (None, '-ltoaru_jpeg',        ['<toaru/graphics.h>']),
         '<toaru/png.h>':         (None, '-ltoaru_png',         ['<toaru/graphics.h>','<toaru/inflate.h>']),
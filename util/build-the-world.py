@@ -491,6 +491,7 @@ class ISO9660(object):
             o = t.write(self.mods_data.data, o)
             for mod_file in [
                 'cdrom/mod/ac97.ko',
+                'cdrom/mod/ahci.ko',
                 'cdrom/mod/ata.ko',
                 'cdrom/mod/ataold.ko',
                 'cdrom/mod/debug_sh.ko',
@@ -513,11 +514,15 @@ class ISO9660(object):
                 'cdrom/mod/serial.ko',
                 'cdrom/mod/snd.ko',
                 'cdrom/mod/tmpfs.ko',
+                'cdrom/mod/usbmsd.ko',
                 'cdrom/mod/usbuhci.ko',
                 'cdrom/mod/vbox.ko',
                 'cdrom/mod/vgadbg.ko',
                 'cdrom/mod/vgalog.ko',
                 'cdrom/mod/vidset.ko',
+                'cdrom/mod/vioblk.ko',
+                'cdrom/mod/vionet.ko',
+                'cdrom/mod/virtio.ko',
                 'cdrom/mod/vmware.ko',
                 'cdrom/mod/xtest.ko',
                 'cdrom/mod/zero.ko',
@@ -44,7 +44,7 @@ def file_filter(tarinfo):
 
     return tarinfo
 
-with tarfile.open('fatbase/ramdisk.img','w') as ramdisk:
+with tarfile.open('fatbase/ramdisk.img','w:gz',compresslevel=9) as ramdisk:
     ramdisk.add('base',arcname='/',filter=file_filter)
 
     ramdisk.add('.',arcname='/src',filter=file_filter,recursive=False) # Add a src directory
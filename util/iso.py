@@ -420,6 +420,7 @@ class ISO9660(object):
             o = t.write(self.mods_data.data, o)
             for mod_file in [
                 'fatbase/mod/ac97.ko',
+                'fatbase/mod/ahci.ko',
                 'fatbase/mod/ata.ko',
                 'fatbase/mod/ataold.ko',
                 'fatbase/mod/debug_sh.ko',
@@ -442,11 +443,15 @@ class ISO9660(object):
                 'fatbase/mod/serial.ko',
                 'fatbase/mod/snd.ko',
                 'fatbase/mod/tmpfs.ko',
+                'fatbase/mod/usbmsd.ko',
                 'fatbase/mod/usbuhci.ko',
                 'fatbase/mod/vbox.ko',
                 'fatbase/mod/vgadbg.ko',
                 'fatbase/mod/vgalog.ko',
                 'fatbase/mod/vidset.ko',
+                'fatbase/mod/vioblk.ko',
+                'fatbase/mod/vionet.ko',
+                'fatbase/mod/virtio.ko',
                 'fatbase/mod/vmware.ko',
                 'fatbase/mod/xtest.ko',
                 'fatbase/mod/zero.ko',
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+Builds the icon atlas used by libtoaru_icon_cache.
+
+Every icon the 16 and 48 pixel lookups would find in the base
+icon directories is resolved here, at build time, using the same
+search order as lib/icon_cache.c, scaled to exactly 16x16 or
+48x48, and stored as premultiplied ARGB so applications can map
+the atlas and point sprites straight at it.
+
+Layout (all little-endian):
+
+    header:  magic 'ICAT', version, entry count, reserved
+    entries: name offset, size class, width, height, (pad), alpha mode,
+             pixel offset
+             sorted by (name, size class)
+    names:   NUL-terminated strings
+    pixels:  width * height uint32_t per entry, 4-byte aligned
+"""
+
+import os
+import struct
+import sys
+import zlib
+
+ICONS = 'base/usr/share/icons'
+OUTPUT = os.path.join(ICONS, 'atlas.bin')
+
+MAGIC = 0x54414349  # 'ICAT'
+VERSION = 1
+
+ALPHA_EMBEDDED = 2
+
+search_16 = ['16', '24', '48', '', 'external']
+search_48 = ['48', '24', '16', '', 'external']
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa = abs(p - a)
+    pb = abs(p - b)
+    pc = abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    if pb <= pc:
+        return b
+    return c
+
+def load_png(path):
+    """Decode an 8-bit, non-interlaced PNG to a list of premultiplied ARGB pixels."""
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:8] != b'\x89PNG\r\n\x1a\n':
+        return None
+    offset = 8
+    idat = b''
+    width = height = depth = color_type = interlace = None
+    while offset < len(data):
+        length, kind = struct.unpack('>I4s', data[offset:offset+8])
+        body = data[offset+8:offset+8+length]
+        if kind == b'IHDR':
+            width, height, depth, color_type, _, _, interlace = struct.unpack('>IIBBBBB', body)
+        elif kind == b'IDAT':
+            idat += body
+        elif kind == b'IEND':
+            break
+        offset += 12 + length
+
+    channels = {0: 1, 2: 3, 4: 2, 6: 4}.get(color_type)
+    if depth != 8 or interlace or not channels:
+        return None
+
+    raw = zlib.decompress(idat)
+    stride = width * channels
+    prev = bytearray(stride)
+    pixels = []
+    for y in range(height):
+        row_start = y * (stride + 1)
+        kind = raw[row_start]
+        row = bytearray(raw[row_start+1:row_start+1+stride])
+        for i in range(stride):
+            a = row[i-channels] if i >= channels else 0
+            b = prev[i]
+            c = prev[i-channels] if i >= channels else 0
+            if kind == 1:
+                row[i] = (row[i] + a) & 0xFF
+            elif kind == 2:
+                row[i] = (row[i] + b) & 0xFF
+            elif kind == 3:
+                row[i] = (row[i] + ((a + b) >> 1)) & 0xFF
+            elif kind == 4:
+                row[i] = (row[i] + paeth(a, b, c)) & 0xFF
+        for x in range(width):
+            px = row[x*channels:(x+1)*channels]
+            if channels == 1:
+                r = g = b = px[0]; a = 255
+            elif channels == 2:
+                r = g = b = px[0]; a = px[1]
+            elif channels == 3:
+                r, g, b = px; a = 255
+            else:
+                r, g, b, a = px
+            pixels.append((r * a // 255, g * a // 255, b * a // 255, a))
+        prev = row
+    return width, height, pixels
+
+def scale(width, height, pixels, size):
+    """Box filter when shrinking, bilinear when growing; works on premultiplied pixels."""
+    if width == size and height == size:
+        return pixels
+    out = []
+    for ty in range(size):
+        for tx in range(size):
+            if width > size and height > size:
+                x0 = tx * width // size
+                x1 = max(x0 + 1, (tx + 1) * width // size)
+                y0 = ty * height // size
+                y1 = max(y0 + 1, (ty + 1) * height // size)
+                acc = [0, 0, 0, 0]
+                for y in range(y0, y1):
+                    for x in range(x0, x1):
+                        p = pixels[y * width + x]
+                        for i in range(4):
+                            acc[i] += p[i]
+                n = (x1 - x0) * (y1 - y0)
+                out.append(tuple((v + n // 2) // n for v in acc))
+            else:
+                fx = max(0.0, (tx + 0.5) * width / size - 0.5)
+                fy = max(0.0, (ty + 0.5) * height / size - 0.5)
+                x0 = min(int(fx), width - 1)
+                y0 = min(int(fy), height - 1)
+                x1 = min(x0 + 1, width - 1)
+                y1 = min(y0 + 1, height - 1)
+                dx = fx - x0
+                dy = fy - y0
+                p00 = pixels[y0 * width + x0]
+                p10 = pixels[y0 * width + x1]
+                p01 = pixels[y1 * width + x0]
+                p11 = pixels[y1 * width + x1]
+                out.append(tuple(int(round(
+                    p00[i] * (1 - dx) * (1 - dy) + p10[i] * dx * (1 - dy) +
+                    p01[i] * (1 - dx) * dy + p11[i] * dx * dy)) for i in range(4)))
+    return out
+
+def resolve(name, directories):
+    for d in directories:
+        path = os.path.join(ICONS, d, name + '.png')
+        if os.path.exists(path):
+            return path
+    return None
+
+def main():
+    names = set()
+    for d in set(search_16 + search_48):
+        directory = os.path.join(ICONS, d)
+        if not os.path.isdir(directory):
+            continue
+        for f in os.listdir(directory):
+            if f.endswith('.png'):
+                names.add(f[:-4])
+
+    entries = []
+    decoded = {}
+    for name in sorted(names):
+        for size, directories in ((16, search_16), (48, search_48)):
+            path = resolve(name, directories)
+            if path not in decoded:
+                decoded[path] = load_png(path)
+            if not decoded[path]:
+                print("make-icon-atlas: skipping unsupported image", path, file=sys.stderr)
+                continue
+            width, height, pixels = decoded[path]
+            entries.append((name, size, scale(width, height, pixels, size)))
+
+    header_size = 16
+    entry_size = 20
+    name_table = b''
+    name_offsets = {}
+    for name, _, _ in entries:
+        if name not in name_offsets:
+            name_offsets[name] = header_size + entry_size * len(entries) + len(name_table)
+            name_table += name.encode('utf-8') + b'\0'
+
+    pixel_base = header_size + entry_size * len(entries) + len(name_table)
+    pixel_base = (pixel_base + 3) & ~3
+
+    index = b''
+    blob = b''
+    for name, size, pixels in entries:
+        index += struct.pack('<IHHHHII', name_offsets[name], size, size, size, 0, ALPHA_EMBEDDED, pixel_base + len(blob))
+        blob += b''.join(struct.pack('<I', (a << 24) | (r << 16) | (g << 8) | b) for r, g, b, a in pixels)
+
+    out = struct.pack('<IIII', MAGIC, VERSION, len(entries), 0) + index + name_table
+    out += b'\0' * (pixel_base - len(out))
+    out += blob
+
+    with open(OUTPUT, 'wb') as f:
+        f.write(out)
+
+if __name__ == '__main__':
+    main()
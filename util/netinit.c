@@ -31,6 +31,8 @@
 #include <kernel/video.h>
 #include "../lib/list.c"
 #include "../lib/hashmap.c"
+#include "../lib/checksum.c"
+#include "../lib/inflate.c"
 #include "terminal-font.h"
 
 extern int mount(char* src,char* tgt,char* typ,unsigned long,void*);
@@ -44,13 +46,6 @@ struct http_req {
 	int ssl;
 };
 
-struct {
-	int show_headers;
-	const char * output_file;
-	const char * cookie;
-	FILE * out;
-} fetch_options = {0};
-
 #define TRACE(msg,...) do { \
 	char tmp[512]; \
 	sprintf(tmp, msg, ##__VA_ARGS__); \
@@ -334,17 +329,30 @@ static void * watchdog_func(void * garbage) {
 #define bar_perc "||||||||||||||||||||"
 #define bar_spac "                    "
 static void draw_progress(size_t content_length, size_t size) {
+	static struct timeval last;
+	static size_t last_size = 0;
+	static double rate = 0.0;
+
 	struct timeval now;
 	gettimeofday(&now, NULL);
 
+	/* Smooth the rate over the last few updates, rather than averaging since the start */
+	if (last.tv_sec) {
+		double dt = (double)(now.tv_sec - last.tv_sec) + (double)(now.tv_usec - last.tv_usec)/1000000.0;
+		if (dt > 0.0) {
+			double current = (double)(size - last_size) / dt;
+			rate = (rate > 0.0) ? (rate * 0.7 + current * 0.3) : current;
+		}
+	}
+	last = now;
+	last_size = size;
+
 	TRACE("\033[G%6dkB",(int)size/1024);
 	if (content_length) {
 		int percent = (size * BAR_WIDTH) / (content_length);
 		TRACE(" / %6dkB [%.*s%.*s]", (int)content_length/1024, percent,bar_perc,BAR_WIDTH-percent,bar_spac);
 	}
-	double timediff = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_usec - start.tv_usec)/1000000.0;
-	if (timediff > 0.0) {
-		double rate = (double)(size) / timediff;
+	if (rate > 0.0) {
 		double s = rate/(1024.0) * 8.0;
 		if (s > 1024.0) {
 			TRACE(" %.2f mbps", s/1024.0);
@@ -353,63 +361,222 @@ static void draw_progress(size_t content_length, size_t size) {
 		}
 
 		if (content_length) {
-			if (rate > 0.0) {
-				double remaining = (double)(content_length - size) / rate;
-
-				TRACE(" (%.2f sec remaining)", remaining);
-			}
+			double remaining = (double)(content_length - size) / rate;
+			TRACE(" (%.2f sec remaining)", remaining);
 		}
 	}
 	TRACE("\033[K");
 }
 
-static unsigned int crctab[256] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-	0xf3b97148, 0x84be41de,	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,	0x14015c4f, 0x63066cd9,
-	0xfa0f3d63, 0x8d080df5,	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,	0x35b5a8fa, 0x42b2986c,
-	0xdbbbc9d6, 0xacbcf940,	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,	0x76dc4190, 0x01db7106,
-	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+/* This is taken from the kernel/sys/version.c */
+/*
+ * Send a GET for the image, for just [first, last] if `ranged`,
+ * and read the status line and headers of the response.
+ *
+ * @return The status code, or -1 if the response made no sense.
+ */
+static int http_request(FILE * f, struct http_req * req, int ranged, size_t first, size_t last, hashmap_t * headers) {
+	if (ranged) {
+		fprintf(f,
+			"GET /%s HTTP/1.0\r\n"
+			"User-Agent: curl/7.35.0\r\n"
+			"Host: %s\r\n"
+			"Accept: */*\r\n"
+			"Range: bytes=%u-%u\r\n"
+			"\r\n", req->path, req->domain, (unsigned int)first, (unsigned int)last);
+	} else {
+		fprintf(f,
+			"GET /%s HTTP/1.0\r\n"
+			"User-Agent: curl/7.35.0\r\n"
+			"Host: %s\r\n"
+			"Accept: */*\r\n"
+			"\r\n", req->path, req->domain);
+	}
+	fflush(f);
+
+	char buf[BUF_SIZE];
+	read_http_line(buf, f);
+	if (!ranged) TRACE("[%s]\n", buf);
+
+	char * code = strchr(buf, ' ');
+	if (!code) return -1;
+	code++;
+	if (!strchr(code, ' ')) return -1;
+	int status = atoi(code);
+
+	while (1) {
+		read_http_line(buf, f);
+		if (!*buf) break;
+
+		char * name = buf;
+		char * value = strstr(buf, ": ");
+		if (!value) return -1;
+		*value = '\0';
+		value += 2;
+
+		hashmap_set(headers, name, strdup(value));
+	}
+
+	return status;
+}
+
+/*
+ * The image is fetched in up to DOWNLOAD_PARTS ranges at once, each
+ * over its own connection, when the server takes Range requests.
+ * Parts go straight into the image file at their offsets; a gzipped
+ * image is collected in memory instead and inflated into the file by
+ * another thread as soon as each next byte has arrived, so the
+ * decompression is done by the time the download is.
+ */
+#define DOWNLOAD_PARTS    4
+#define DOWNLOAD_PART_MIN (256 * 1024) /* Smaller images aren't worth splitting */
+#define RBUF_SIZE 10240
+
+struct part {
+	size_t start;            /* Offset in the image */
+	size_t length;
+	volatile size_t received;
+	FILE * conn;             /* For the first part, the response we already have */
+	int failed;
+	volatile int active;     /* Its thread is still going */
+	pthread_t thread;
 };
 
-/* This is taken from the kernel/sys/version.c */
+static struct {
+	struct http_req * req;
+	char * host;             /* /dev/net/ path of the server */
+	size_t length;
+	size_t part_size;
+	int nparts;
+	struct part parts[DOWNLOAD_PARTS];
+
+	uint8_t * data;          /* Compressed image, if inflating */
+	size_t in_offset;        /* How far the inflater has read */
+	size_t in_ready;         /* Everything before this has arrived */
+	int inflate_status;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} download;
+
+static size_t download_received(void) {
+	size_t total = 0;
+	for (int i = 0; i < download.nparts; ++i) {
+		total += download.parts[i].received;
+	}
+	return total;
+}
+
+static void fetch_part(struct part * part) {
+	FILE * f = part->conn;
+	part->conn = NULL;
+
+	if (!f) {
+		f = fopen(download.host, "r+");
+		if (!f) {
+			part->failed = 1;
+			return;
+		}
+		hashmap_t * headers = hashmap_create(10);
+		size_t first = part->start + part->received;
+		int status = http_request(f, download.req, 1, first, part->start + part->length - 1, headers);
+		char * length = hashmap_get(headers, "Content-Length");
+		int ok = (status == 206 && length && (size_t)atoi(length) == part->length - part->received);
+		hashmap_free(headers);
+		free(headers);
+		if (!ok) {
+			fclose(f);
+			part->failed = 1;
+			return;
+		}
+	}
+
+	int fd = -1;
+	if (!download.data) {
+		fd = open(img, O_WRONLY);
+		lseek(fd, part->start + part->received, SEEK_SET);
+	}
+
+	char * buf = malloc(RBUF_SIZE);
+	while (part->received < part->length) {
+		size_t want = part->length - part->received;
+		if (want > RBUF_SIZE) want = RBUF_SIZE;
+
+		char * into = download.data ? (char *)download.data + part->start + part->received : buf;
+		size_t r = fread(into, 1, want, f);
+		if (!r) {
+			part->failed = 1;
+			break;
+		}
+		if (fd >= 0) {
+			write(fd, buf, r);
+		}
+
+		pthread_mutex_lock(&download.lock);
+		part->received += r;
+		pthread_cond_broadcast(&download.cond);
+		pthread_mutex_unlock(&download.lock);
+	}
+	free(buf);
+
+	if (fd >= 0) close(fd);
+	fclose(f);
+
+	if (part->failed) {
+		/* Wake the inflater, which may be waiting on us */
+		pthread_mutex_lock(&download.lock);
+		pthread_cond_broadcast(&download.cond);
+		pthread_mutex_unlock(&download.lock);
+	}
+}
+
+static void * part_thread(void * arg) {
+	struct part * part = arg;
+	fetch_part(part);
+	part->active = 0;
+	return NULL;
+}
+
+static uint8_t inflate_input(struct inflate_context * ctx) {
+	if (download.in_offset >= download.in_ready) {
+		if (download.in_offset >= download.length) {
+			/* Past the end; reads as a final block of the reserved type */
+			return 0xFF;
+		}
+		pthread_mutex_lock(&download.lock);
+		while (1) {
+			struct part * part = &download.parts[download.in_offset / download.part_size];
+			download.in_ready = part->start + part->received;
+			if (download.in_offset < download.in_ready) break;
+			pthread_cond_wait(&download.cond, &download.lock);
+		}
+		pthread_mutex_unlock(&download.lock);
+	}
+	return download.data[download.in_offset++];
+}
+
+static void inflate_output(struct inflate_context * ctx, unsigned int sym) {
+	fputc(sym, ctx->output_priv);
+}
+
+static void inflate_write_block(struct inflate_context * ctx, const uint8_t * buf, size_t len) {
+	fwrite(buf, 1, len, ctx->output_priv);
+}
+
+static void * inflate_thread(void * garbage) {
+	(void)garbage;
+	struct inflate_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.output_priv = fopen(img, "w");
+	ctx.get_input = inflate_input;
+	ctx.write_output = inflate_output;
+	ctx.write_block = inflate_write_block;
+
+	download.inflate_status = gzip_decompress(&ctx);
+	fclose(ctx.output_priv);
+	return NULL;
+}
+
 #if (defined(__GNUC__) || defined(__GNUG__)) && !(defined(__clang__) || defined(__INTEL_COMPILER))
 # define COMPILER_VERSION "gcc " __VERSION__
 #elif (defined(__clang__))
@@ -524,7 +691,8 @@ int main(int argc, char * argv[]) {
 
 	TRACE("Fetching from %s... ", my_req.domain);
 
-	fetch_options.out = fopen(img,"w+");
+	/* Create the image file for the parts to write into */
+	close(open(img, O_WRONLY | O_CREAT | O_TRUNC, 0644));
 
 	pthread_t watchdog;
 
@@ -535,69 +703,22 @@ int main(int argc, char * argv[]) {
 		network_error(0);
 	}
 
-#if 0
-	char * vbuf = malloc(10240);
-	setvbuf(f,vbuf,_IOLBF,10240);
-#endif
-
 	watchdog_success = 1;
 
 	TRACE("Connection established.\n");
 
-	fprintf(f,
-		"GET /%s HTTP/1.0\r\n"
-		"User-Agent: curl/7.35.0\r\n"
-		"Host: %s\r\n"
-		"Accept: */*\r\n"
-		"\r\n", my_req.path, my_req.domain);
-
 	gettimeofday(&start, NULL);
 
 	hashmap_t * headers = hashmap_create(10);
 
 	/* Parse response */
-	{
-		char buf[BUF_SIZE];
-		read_http_line(buf, f);
-		TRACE("[%s]\n", buf);
-
-		char * elements[3];
-
-		elements[0] = buf;
-		elements[1] = strchr(elements[0], ' ');
-		if (!elements[1]) bad_response();
-		*elements[1] = '\0';
-		elements[1]++;
-
-		elements[2] = strchr(elements[1], ' ');
-		if (!elements[2]) bad_response();
-		*elements[2] = '\0';
-		elements[2]++;
-
-		if (strcmp(elements[1], "200")) {
-			TRACE("Bad response code: %s\n", elements[1]);
-			return 1;
-		}
-	}
-
-	while (1) {
-		char buf[BUF_SIZE];
-		read_http_line(buf, f);
-
-		if (!*buf) {
-			TRACE("(done with headers)\n");
-			break;
-		}
-
-		/* Split */
-		char * name = buf;
-		char * value = strstr(buf, ": ");
-		if (!value) bad_response();
-		*value = '\0';
-		value += 2;
-
-		hashmap_set(headers, name, strdup(value));
+	int status = http_request(f, &my_req, 0, 0, 0, headers);
+	if (status < 0) bad_response();
+	if (status != 200) {
+		TRACE("Bad response code: %d\n", status);
+		return 1;
 	}
+	TRACE("(done with headers)\n");
 
 #if 1
 	TRACE("Dumping headers.\n");
@@ -616,35 +737,96 @@ int main(int argc, char * argv[]) {
 		return 1;
 	}
 
-	int bytes_to_read = atoi(hashmap_get(headers, "Content-Length"));
-	size_t bytes_total = (size_t)bytes_to_read;
-	size_t bytes_read = 0;
+	download.req = &my_req;
+	download.host = file;
+	download.length = (size_t)atoi(hashmap_get(headers, "Content-Length"));
+
+	/* The request we already sent becomes the first part; the others ask for their own ranges */
+	char * ranges = hashmap_get(headers, "Accept-Ranges");
+	download.nparts = 1;
+	if (ranges && strstr(ranges, "bytes")) {
+		download.nparts = download.length / DOWNLOAD_PART_MIN;
+		if (download.nparts > DOWNLOAD_PARTS) download.nparts = DOWNLOAD_PARTS;
+		if (download.nparts < 1) download.nparts = 1;
+	}
+	download.part_size = (download.length + download.nparts - 1) / download.nparts;
+	if (!download.part_size) download.part_size = 1;
 
-#define RBUF_SIZE 10240
-	char * buf = malloc(RBUF_SIZE);
-	uint32_t crc32 = 0xffffffff;
-	while (bytes_to_read > 0) {
-		size_t r = fread(buf, 1, bytes_to_read < RBUF_SIZE ? bytes_to_read : RBUF_SIZE, f);
-		fwrite(buf, 1, r, fetch_options.out);
-		for (size_t i = 0; i < r; ++i) {
-			int ind = (crc32 ^ buf[i]) & 0xFF;
-			crc32 = (crc32 >> 8) ^ (crctab[ind]);
+	for (int i = 0; i < download.nparts; ++i) {
+		struct part * part = &download.parts[i];
+		part->start  = i * download.part_size;
+		part->length = (i == download.nparts - 1) ? download.length - part->start : download.part_size;
+	}
+	download.parts[0].conn = f;
+
+	int compressed = strlen(my_req.path) > 3 && !strcmp(my_req.path + strlen(my_req.path) - 3, ".gz");
+	pthread_t inflater;
+	if (compressed) {
+		download.data = malloc(download.length ? download.length : 1);
+		pthread_create(&inflater, NULL, inflate_thread, NULL);
+	}
+
+	if (download.nparts > 1) {
+		TRACE("Downloading in %d parts.\n", download.nparts);
+	}
+
+	for (int i = 0; i < download.nparts; ++i) {
+		download.parts[i].active = 1;
+		pthread_create(&download.parts[i].thread, NULL, part_thread, &download.parts[i]);
+	}
+
+	while (download_received() < download.length) {
+		draw_progress(download.length, download_received());
+		usleep(100000);
+
+		int active = 0;
+		for (int i = 0; i < download.nparts; ++i) {
+			if (download.parts[i].active) active = 1;
+		}
+		if (active) continue;
+
+		/* Everything has stopped short; parts that failed are tried again, one at a time */
+		for (int i = 0; i < download.nparts; ++i) {
+			struct part * part = &download.parts[i];
+			if (!part->failed) continue;
+			part->failed = 0;
+			fetch_part(part);
+			if (part->failed) {
+				TRACE("\nDownload failed.\n");
+				return 1;
+			}
 		}
-		bytes_to_read -= r;
-		bytes_read += r;
-		draw_progress(bytes_total, bytes_read);
 	}
-	crc32 ^= 0xffffffff;
-	free(buf);
+	draw_progress(download.length, download_received());
 
-	TRACE("\nDone: 0x%x\n", (unsigned int)crc32);
+	for (int i = 0; i < download.nparts; ++i) {
+		pthread_join(download.parts[i].thread, NULL);
+	}
 
-	fflush(fetch_options.out);
-	fclose(fetch_options.out);
+	if (compressed) {
+		pthread_join(inflater, NULL);
+		free(download.data);
+		if (download.inflate_status) {
+			TRACE("\nDecompression failed (%d).\n", download.inflate_status);
+			return 1;
+		}
+		TRACE("\nDone, decompressed and verified.\n");
+	} else {
+		uint32_t crc32 = 0;
+		int fd = open(img, O_RDONLY);
+		char * buf = malloc(RBUF_SIZE);
+		ssize_t r;
+		while ((r = read(fd, buf, RBUF_SIZE)) > 0) {
+			crc32 = checksum_crc32(crc32, buf, r);
+		}
+		free(buf);
+		close(fd);
+		TRACE("\nDone: 0x%x\n", (unsigned int)crc32);
+	}
 
 #if 0
 	FILE * xtmp = fopen(img, "r");
-	crc32 = 0xffffffff;
+	uint32_t crc32 = 0;
 	int tab = 0;
 	size_t bytesread = 0;
 	while (!feof(xtmp)) {
@@ -661,12 +843,10 @@ int main(int argc, char * argv[]) {
 				tab = 0;
 				TRACE("\n");
 			}
-			int ind = (crc32 ^ buf[i]) & 0xFF;
-			crc32 = (crc32 >> 8) ^ (crctab[ind]);
 		}
+		crc32 = checksum_crc32(crc32, buf, r);
 		bytesread += r;
 	}
-	crc32 ^= 0xffffffff;
 	TRACE("\nDisk crc32: 0x%x (%d)\n", (unsigned int)crc32, bytesread);
 #endif
 
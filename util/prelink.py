@@ -0,0 +1,345 @@
+#!/usr/bin/env python3
+"""
+Builds the ld.so prelink cache (/lib/ld.so.cache).
+
+Every shared library in base/lib is given its own fixed base near
+the top of the address space, and its relocations are resolved
+against the other libraries at their bases, the way ld.so would at
+run time. The relocated contents of each library's writable segments
+are stored in the cache, page-aligned so ld.so can map them in place
+of the pages from the library file.
+
+Relocations that can't be settled ahead of time - symbols ld.so
+provides itself, symbols with no definition or more than one among
+the library's dependencies, copy relocations - are kept in the
+cache for ld.so to apply as usual.
+
+Layout (all little-endian uint32):
+
+    header:  magic 'LDPC', version, entry count, reserved
+    entries: name, file size, checksum, symbol count, base,
+             deps, segments, relocs, copies (offsets of counted lists)
+    names, lists, then page-aligned segment images
+"""
+
+import os
+import struct
+import sys
+
+LIBS = 'base/lib'
+OUTPUT = os.path.join(LIBS, 'ld.so.cache')
+
+MAGIC = 0x4350444C  # 'LDPC'
+VERSION = 1
+
+# Libraries are placed top-down from here; mmap() starts well above it
+PRELINK_TOP = 0xA0000000
+PAGE = 0x1000
+
+# Symbols ld.so resolves to its own functions
+LD_BUILTINS = {'dlopen', 'dlsym', 'dlclose', 'dlerror', '__get_argv'}
+
+PT_LOAD = 1
+PT_DYNAMIC = 2
+PF_W = 2
+SHT_REL = 9
+
+R_386_32 = 1
+R_386_PC32 = 2
+R_386_GLOB_DAT = 6
+R_386_JMP_SLOT = 7
+R_386_RELATIVE = 8
+
+def page_down(x):
+    return x & ~(PAGE - 1)
+
+def page_up(x):
+    return (x + PAGE - 1) & ~(PAGE - 1)
+
+def fnv1a(h, data):
+    for b in data:
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+class Library(object):
+
+    def __init__(self, path):
+        self.path = path
+        self.name = os.path.basename(path)
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        self.ok = self.parse()
+
+    def u32(self, offset):
+        return struct.unpack_from('<I', self.data, offset)[0]
+
+    def file_offset(self, vaddr):
+        for p in self.loads:
+            if p['vaddr'] <= vaddr < p['vaddr'] + p['filesz']:
+                return vaddr - p['vaddr'] + p['offset']
+        return None
+
+    def cstring(self, offset):
+        end = self.data.index(b'\0', offset)
+        return self.data[offset:end].decode('utf-8')
+
+    def parse(self):
+        d = self.data
+        if d[:4] != b'\x7fELF' or d[4] != 1:
+            return False
+        (e_type, _, _, _, e_phoff, e_shoff, _, _, e_phentsize, e_phnum,
+         e_shentsize, e_shnum, _) = struct.unpack_from('<HHIIIIIHHHHHH', d, 16)
+        if e_type != 3:  # ET_DYN
+            return False
+
+        self.loads = []
+        dynamic = None
+        for i in range(e_phnum):
+            p_type, p_offset, p_vaddr, _, p_filesz, p_memsz, p_flags, _ = \
+                struct.unpack_from('<IIIIIIII', d, e_phoff + i * e_phentsize)
+            if p_type == PT_LOAD:
+                self.loads.append({'offset': p_offset, 'vaddr': p_vaddr, 'filesz': p_filesz,
+                                   'memsz': p_memsz, 'flags': p_flags})
+            elif p_type == PT_DYNAMIC:
+                dynamic = (p_offset, p_filesz)
+        if not self.loads or not dynamic:
+            return False
+
+        # Same conditions as object_can_map() in ld.so
+        last_end = 0
+        for p in self.loads:
+            if (p['vaddr'] & 0xFFF) != (p['offset'] & 0xFFF):
+                return False
+            if page_down(p['vaddr']) < last_end:
+                return False
+            if not (p['flags'] & PF_W) and p['memsz'] > p['filesz']:
+                return False
+            last_end = page_up(p['vaddr'] + p['memsz'])
+        self.size = last_end
+
+        tags = []
+        for i in range(dynamic[1] // 8):
+            tag, val = struct.unpack_from('<iI', d, dynamic[0] + i * 8)
+            if tag == 0:
+                break
+            tags.append((tag, val))
+        tag_map = dict(tags)
+        if 22 in tag_map or (tag_map.get(30, 0) & 0x4):  # DT_TEXTREL
+            return False
+        if 5 not in tag_map or 6 not in tag_map:
+            return False
+
+        self.strtab = self.file_offset(tag_map[5])
+        self.symtab = self.file_offset(tag_map[6])
+        self.needed = [self.cstring(self.strtab + val) for tag, val in tags if tag == 1]
+
+        # Symbols reachable through the hash tables, as ld.so looks them up
+        if 0x6ffffef5 in tag_map:
+            h = self.file_offset(tag_map[0x6ffffef5])
+            nbuckets, symoffset, bloom_size, _ = struct.unpack_from('<IIII', d, h)
+            buckets = h + 16 + bloom_size * 4
+            chain = buckets + nbuckets * 4
+            last = 0
+            for b in range(nbuckets):
+                last = max(last, self.u32(buckets + b * 4))
+            if last >= symoffset:
+                while not (self.u32(chain + (last - symoffset) * 4) & 1):
+                    last += 1
+                self.sym_count = last + 1
+            else:
+                self.sym_count = symoffset
+            first_hashed = symoffset
+        elif 4 in tag_map:
+            self.sym_count = self.u32(self.file_offset(tag_map[4]) + 4)
+            first_hashed = 1
+        else:
+            return False
+
+        self.symbols = []
+        self.defined = {}
+        for i in range(self.sym_count):
+            st_name, st_value, st_size, st_info, st_other, st_shndx = \
+                struct.unpack_from('<IIIBBH', d, self.symtab + i * 16)
+            name = self.cstring(self.strtab + st_name)
+            self.symbols.append((name, st_value))
+            if i >= first_hashed and st_shndx:
+                self.defined[name] = st_value
+
+        self.rels = []
+        for i in range(e_shnum):
+            _, sh_type, _, _, sh_offset, sh_size, _, _, _, _ = \
+                struct.unpack_from('<IIIIIIIIII', d, e_shoff + i * e_shentsize)
+            if sh_type == SHT_REL:
+                for j in range(sh_size // 8):
+                    self.rels.append(struct.unpack_from('<II', d, sh_offset + j * 8))
+
+        return True
+
+    def checksum(self):
+        h = 2166136261
+        for p in self.loads:
+            if p['flags'] & PF_W:
+                h = fnv1a(h, self.data[p['offset']:p['offset'] + p['filesz']])
+        h = fnv1a(h, self.data[self.symtab:self.symtab + self.sym_count * 16])
+        return h
+
+    def images(self):
+        """Writable segments as they look in memory once mapped, before relocation."""
+        out = []
+        for p in self.loads:
+            if not (p['flags'] & PF_W) or not p['filesz']:
+                continue
+            start = page_down(p['vaddr'])
+            file_end = p['vaddr'] + p['filesz']
+            map_end = page_up(file_end)
+            offset = page_down(p['offset'])
+            image = bytearray(self.data[offset:offset + map_end - start])
+            image += b'\0' * (map_end - start - len(image))
+            zero_end = min(p['vaddr'] + p['memsz'], map_end)
+            if zero_end > file_end:
+                image[file_end - start:zero_end - start] = b'\0' * (zero_end - file_end)
+            out.append([start, image])
+        return out
+
+def closure(lib, libs):
+    seen = []
+    todo = [lib.name]
+    while todo:
+        name = todo.pop(0)
+        if name in seen:
+            continue
+        if name not in libs:
+            return None
+        seen.append(name)
+        todo.extend(libs[name].needed)
+    return seen
+
+def prelink(lib, libs, bases, definers):
+    deps = closure(lib, libs)
+    if deps is None:
+        return None
+
+    base = bases[lib.name]
+    images = lib.images()
+    relocs = []
+    copies = []
+
+    def target(offset):
+        for start, image in images:
+            if start <= offset and offset + 4 <= start + len(image):
+                return image, offset - start
+        return None, None
+
+    for r_offset, r_info in lib.rels:
+        kind = r_info & 0xFF
+        symbol = r_info >> 8
+        image, at = target(r_offset)
+        if image is None:
+            relocs.append((r_offset, r_info))
+            continue
+        addend = struct.unpack_from('<i', image, at)[0]
+
+        if kind == R_386_RELATIVE:
+            value = base + addend
+        elif kind in (R_386_32, R_386_PC32, R_386_GLOB_DAT, R_386_JMP_SLOT):
+            name = lib.symbols[symbol][0] if symbol < len(lib.symbols) else ''
+            owners = definers.get(name, [])
+            if not symbol or name in LD_BUILTINS or len(owners) != 1 or owners[0] not in deps:
+                relocs.append((r_offset, r_info))
+                continue
+            value = bases[owners[0]] + libs[owners[0]].defined[name]
+            if kind == R_386_32:
+                value += addend
+            elif kind == R_386_PC32:
+                value += addend - (base + r_offset)
+            elif kind == R_386_GLOB_DAT:
+                copies.append((r_offset, r_info))
+        else:
+            relocs.append((r_offset, r_info))
+            continue
+
+        struct.pack_into('<I', image, at, value & 0xFFFFFFFF)
+
+    return deps, images, relocs, copies
+
+def main():
+    libs = {}
+    for f in sorted(os.listdir(LIBS)):
+        path = os.path.join(LIBS, f)
+        if not f.endswith('.so') or os.path.islink(path) or not os.path.isfile(path):
+            continue
+        lib = Library(path)
+        if lib.ok:
+            libs[lib.name] = lib
+
+    bases = {}
+    top = PRELINK_TOP
+    for name in sorted(libs):
+        top -= page_up(libs[name].size) + PAGE
+        bases[name] = top
+
+    definers = {}
+    for name in sorted(libs):
+        for symbol in libs[name].defined:
+            definers.setdefault(symbol, []).append(name)
+
+    results = []
+    for name in sorted(libs):
+        result = prelink(libs[name], libs, bases, definers)
+        if result is None:
+            print("prelink: skipping", name, "(missing dependencies)", file=sys.stderr)
+            continue
+        results.append((name, result))
+
+    index = {name: i for i, (name, _) in enumerate(results)}
+
+    header_size = 16
+    entry_size = 36
+    blob = bytearray()
+    base_offset = header_size + entry_size * len(results)
+
+    def add(data):
+        while len(blob) % 4:
+            blob.append(0)
+        offset = base_offset + len(blob)
+        blob.extend(data)
+        return offset
+
+    def counted(items, fmt):
+        return add(struct.pack('<I', len(items)) + b''.join(struct.pack(fmt, *item) for item in items))
+
+    entries = []
+    pending_images = []
+    for name, (deps, images, relocs, copies) in results:
+        lib = libs[name]
+        name_offset = add(name.encode('utf-8') + b'\0')
+        deps_offset = counted([(index[d],) for d in deps if d in index], '<I')
+        relocs_offset = counted(relocs, '<II')
+        copies_offset = counted(copies, '<II')
+        segments_offset = add(b'\0' * (4 + 12 * len(images)))
+        pending_images.append((segments_offset, images))
+        entries.append([name_offset, len(lib.data), lib.checksum(), lib.sym_count, bases[name],
+                        deps_offset, segments_offset, relocs_offset, copies_offset])
+
+    # Segment images go last, each on its own pages
+    for segments_offset, images in pending_images:
+        table = struct.pack('<I', len(images))
+        for start, image in images:
+            while (base_offset + len(blob)) % PAGE:
+                blob.append(0)
+            offset = base_offset + len(blob)
+            blob.extend(image)
+            table += struct.pack('<III', start, offset, len(image))
+        blob[segments_offset - base_offset:segments_offset - base_offset + len(table)] = table
+
+    out = struct.pack('<IIII', MAGIC, VERSION, len(entries), 0)
+    for e in entries:
+        out += struct.pack('<9I', *e)
+    out += bytes(blob)
+
+    with open(OUTPUT, 'wb') as f:
+        f.write(out)
+
+if __name__ == '__main__':
+    main()
@@ -1,6 +1,10 @@
 #!/usr/bin/env python3
 """
 Harness for running QEMU and communicating window sizes through serial.
+
+With --bench, also has the guest run /bin/bench at startup and collects
+its results (lines of "bench <name> <iterations> <ns per iteration>")
+into bench-results.txt, exiting once it reports "bench done".
 """
 
 import subprocess
@@ -15,6 +19,9 @@ import Xlib
 
 qemu_bin = 'qemu-system-i386'
 
+bench = '--bench' in sys.argv[1:]
+bench_results = 'bench-results.txt'
+
 qemu = subprocess.Popen([
     qemu_bin,
     '-enable-kvm',
@@ -35,7 +42,7 @@ qemu = subprocess.Popen([
     '-fw_cfg','name=opt/org.toaruos.displayharness,string=1',
     # Boot directly to graphical mode
     '-fw_cfg','name=opt/org.toaruos.bootmode,string=normal'
-])
+] + (['-fw_cfg','name=opt/org.toaruos.bench,string=1'] if bench else []))
 
 # Give QEMU some time to start up and create a window.
 time.sleep(1)
@@ -79,13 +86,34 @@ def send_key(key, state, up=False):
     qemu_win.send_event(ke)
     display.flush()
 
+def bench_line(line):
+    """Record one line of benchmark output."""
+    print(line)
+    if line == 'bench done':
+        print("Benchmark results are in %s" % bench_results)
+        qemu.terminate()
+        asyncio.get_event_loop().call_soon(sys.exit, 0)
+        return
+    with open(bench_results, 'a') as f:
+        f.write(line + '\n')
+
 class Client(asyncio.Protocol):
 
     def connection_made(self, transport):
+        self.pending = ''
         asyncio.ensure_future(heartbeat(transport))
 
     def data_received(self, data):
-        if 'X' in data.decode('utf-8'):
+        data = data.decode('utf-8')
+        if bench:
+            self.pending += data
+            lines = self.pending.split('\n')
+            self.pending = lines.pop()
+            for line in lines:
+                if line.startswith('bench '):
+                    bench_line(line.strip())
+        # Benchmark output never has an X in it
+        if 'X' in data:
             # Send Ctrl-Alt-u
             send_key('Control_L',0x00)
             send_key('Alt_L',0x04)
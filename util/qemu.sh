@@ -27,6 +27,12 @@ fatbase/mod/e1000.ko,\
 fatbase/mod/pcspkr.ko,\
 fatbase/mod/portio.ko,\
 fatbase/mod/tarfs.ko,\
+fatbase/mod/virtio.ko,\
+fatbase/mod/vioblk.ko,\
+fatbase/mod/vionet.ko,\
+fatbase/mod/ahci.ko,\
+fatbase/mod/usbuhci.ko,\
+fatbase/mod/usbmsd.ko,\
 fatbase/ramdisk.img \
 -append "root=/dev/ram0 root_type=tar logtoserial=2 vid=qemu" \
 -enable-kvm \